@@ -0,0 +1,687 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2012 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the per packet work done by tcpreplay and
+ * tcpreplay-edit.  Everything runs against synthetic packets, and
+ * packets are "sent" with the null injector unless --intf1 is given,
+ * so the suite runs anywhere without privileges.
+ *
+ * Results are printed as one JSON object per line so they can be
+ * collected and compared between builds.
+ */
+
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "tcpreplay_bench_opts.h"
+#include "sleep.h"
+#include "tcpedit/tcpedit.h"
+#include "tcpedit/tcpedit_api.h"
+#include "common/ring.h"
+#include <errno.h>
+#include <pcap.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef DEBUG
+int debug = 0;
+#endif
+
+/* distinct packets cycled through by every benchmark */
+#define BENCH_POOL 4096
+/* distinct 5-tuples among them */
+#define BENCH_FLOWS 1024
+/* sendpacket_batch() size, what the send threads use */
+#define BENCH_BATCH 32
+#define BENCH_SLEEP_MAX 1000
+#define BENCH_SLEEP_NS 10000
+#define BENCH_MIN_SIZE (TCPR_ETH_H + TCPR_IPV4_H + TCPR_UDP_H)
+#define BENCH_MAX_SIZE 9000
+/* descriptors in the ring benchmarks' rings */
+#define BENCH_RING_SIZE 4096
+/* producer threads of the ring/mpsc benchmarks */
+#define BENCH_RING_PRODUCERS 2
+
+typedef struct bench_s {
+    COUNTER iterations;
+    const char *filter;
+    int size;
+    struct pcap_pkthdr hdr[BENCH_POOL];
+    u_char *data[BENCH_POOL];
+    u_char *scratch;
+} bench_t;
+
+/* keeps the compiler from optimizing away a loop whose result is unused */
+static volatile u_int64_t bench_sink;
+
+static bool
+bench_wanted(const bench_t *b, const char *name)
+{
+    return b->filter == NULL || strncmp(name, b->filter, strlen(b->filter)) == 0;
+}
+
+static void
+bench_report(const char *name, int size, COUNTER packets, u_int64_t elapsed_ns)
+{
+    double ns = packets ? (double)elapsed_ns / (double)packets : 0.0;
+
+    printf("{\"bench\":\"%s\",\"size\":%d,\"packets\":" COUNTER_SPEC ",\"ns_per_pkt\":%.1f,\"pps\":%.1f}\n",
+           name,
+           size,
+           packets,
+           ns,
+           ns > 0.0 ? 1000000000.0 / ns : 0.0);
+    fflush(stdout);
+}
+
+/**
+ * \brief build BENCH_POOL UDP/IPv4 packets of the current size
+ *
+ * Packets are spread over BENCH_FLOWS flows so the flow table and the
+ * CPU caches see something closer to real traffic than one flow.
+ */
+static void
+bench_packets(bench_t *b)
+{
+    int i;
+
+    for (i = 0; i < BENCH_POOL; i++) {
+        eth_hdr_t *eth;
+        ipv4_hdr_t *ip;
+        udp_hdr_t *udp;
+        int flow = i % BENCH_FLOWS;
+
+        safe_free(b->data[i]);
+        b->data[i] = safe_malloc(b->size);
+
+        eth = (eth_hdr_t *)b->data[i];
+        memcpy(eth->ether_dhost, "\x00\x11\x22\x33\x44\x55", ETHER_ADDR_LEN);
+        memcpy(eth->ether_shost, "\x00\x66\x77\x88\x99\xaa", ETHER_ADDR_LEN);
+        eth->ether_type = htons(ETHERTYPE_IP);
+
+        ip = (ipv4_hdr_t *)(b->data[i] + TCPR_ETH_H);
+        ip->ip_v = 4;
+        ip->ip_hl = TCPR_IPV4_H >> 2;
+        ip->ip_len = htons(b->size - TCPR_ETH_H);
+        ip->ip_id = htons(i);
+        ip->ip_ttl = 64;
+        ip->ip_p = IPPROTO_UDP;
+        ip->ip_src.s_addr = htonl(0x0a000001 + (flow >> 4));
+        ip->ip_dst.s_addr = htonl(0x0a800001);
+
+        udp = (udp_hdr_t *)(b->data[i] + TCPR_ETH_H + TCPR_IPV4_H);
+        udp->uh_sport = htons(1024 + (flow & 0xf));
+        udp->uh_dport = htons(7);
+        udp->uh_ulen = htons(b->size - TCPR_ETH_H - TCPR_IPV4_H);
+
+        b->hdr[i].ts.tv_sec = i / 1000;
+        b->hdr[i].ts.tv_usec = (i % 1000) * 1000;
+        b->hdr[i].caplen = b->hdr[i].len = b->size;
+    }
+}
+
+/**
+ * \brief reading packets from a pcap file, the non-cached path
+ */
+static void
+bench_read_file(bench_t *b)
+{
+    char path[] = "/tmp/tcpreplay-bench.XXXXXX";
+    char ebuf[PCAP_ERRBUF_SIZE];
+    struct pcap_pkthdr *pkthdr;
+    const u_char *pktdata;
+    pcap_dumper_t *dumper;
+    pcap_t *pcap;
+    u_int64_t start, sum = 0;
+    COUNTER n = 0;
+    int fd, i;
+
+    if (!bench_wanted(b, "read/file"))
+        return;
+
+    if ((fd = mkstemp(path)) < 0)
+        errx(-1, "Unable to create %s: %s", path, strerror(errno));
+    close(fd);
+
+    pcap = pcap_open_dead(DLT_EN10MB, MAX_SNAPLEN);
+    if ((dumper = pcap_dump_open(pcap, path)) == NULL)
+        errx(-1, "Unable to write %s: %s", path, pcap_geterr(pcap));
+    for (i = 0; i < BENCH_POOL; i++)
+        pcap_dump((u_char *)dumper, &b->hdr[i], b->data[i]);
+    pcap_dump_close(dumper);
+    pcap_close(pcap);
+
+    /* reopening the file at the end is part of the cost */
+    start = tcpr_clock_ns();
+    while (n < b->iterations) {
+        if ((pcap = pcap_open_offline(path, ebuf)) == NULL)
+            errx(-1, "Unable to read %s: %s", path, ebuf);
+        while (n < b->iterations && pcap_next_ex(pcap, &pkthdr, &pktdata) == 1) {
+            sum += pktdata[pkthdr->caplen - 1];
+            n++;
+        }
+        pcap_close(pcap);
+    }
+    bench_report("read/file", b->size, n, tcpr_clock_ns() - start);
+
+#ifdef HAVE_MMAP
+    if (bench_wanted(b, "read/mmap")) {
+        struct pcap_pkthdr hdr;
+        mmap_pcap_t *mp;
+        u_char *data;
+
+        n = 0;
+        start = tcpr_clock_ns();
+        while (n < b->iterations) {
+            if ((mp = mmap_pcap_open(path, ebuf)) == NULL)
+                errx(-1, "Unable to map %s: %s", path, ebuf);
+            while (n < b->iterations && (data = mmap_pcap_next(mp, &hdr)) != NULL) {
+                sum += data[hdr.caplen - 1];
+                n++;
+            }
+            mmap_pcap_close(mp);
+        }
+        bench_report("read/mmap", b->size, n, tcpr_clock_ns() - start);
+    }
+#endif
+
+    unlink(path);
+    bench_sink = sum;
+}
+
+/**
+ * \brief walking packets already loaded into memory, as --preload-pcap
+ * does on every loop after the first
+ */
+static void
+bench_read_cached(bench_t *b)
+{
+    u_int64_t start, sum = 0;
+    COUNTER n;
+
+    if (!bench_wanted(b, "read/cached"))
+        return;
+
+    start = tcpr_clock_ns();
+    for (n = 0; n < b->iterations; n++) {
+        const struct pcap_pkthdr *pkthdr = &b->hdr[n % BENCH_POOL];
+
+        sum += b->data[n % BENCH_POOL][pkthdr->caplen - 1];
+    }
+    bench_report("read/cached", b->size, n, tcpr_clock_ns() - start);
+    bench_sink = sum;
+}
+
+typedef enum bench_edit_e {
+    BENCH_EDIT_OPTIONS,
+    BENCH_EDIT_FIXCSUM,
+    BENCH_EDIT_TTL,
+    BENCH_EDIT_TOS,
+    BENCH_EDIT_SRCIPMAP,
+    BENCH_EDIT_PORTMAP,
+    BENCH_EDIT_MTU_TRUNC,
+} bench_edit_t;
+
+static const char *bench_edit_names[] = {
+    "tcpedit/options",
+    "tcpedit/fixcsum",
+    "tcpedit/ttl",
+    "tcpedit/tos",
+    "tcpedit/srcipmap",
+    "tcpedit/portmap",
+    "tcpedit/mtu-trunc",
+};
+
+/**
+ * \brief set up tcpedit as tcpreplay-edit would, plus one extra edit
+ */
+static tcpedit_t *
+bench_edit_init(bench_edit_t edit)
+{
+    char srcipmap[] = "10.0.0.0/8:172.16.0.0/12";
+    char portmap[] = "7:9";
+    tcpedit_t *tcpedit;
+    int rcode = TCPEDIT_OK;
+
+    if (tcpedit_init(&tcpedit, DLT_EN10MB) < 0)
+        errx(-1, "Error initializing tcpedit: %s", tcpedit_geterr(tcpedit));
+
+    if (tcpedit_post_args(tcpedit) < 0)
+        errx(-1, "Unable to parse args: %s", tcpedit_geterr(tcpedit));
+
+    switch (edit) {
+    case BENCH_EDIT_OPTIONS:
+        break;
+    case BENCH_EDIT_FIXCSUM:
+        rcode = tcpedit_set_fixcsum(tcpedit, true);
+        break;
+    case BENCH_EDIT_TTL:
+        if ((rcode = tcpedit_set_ttl_mode(tcpedit, TCPEDIT_TTL_MODE_SUB)) == TCPEDIT_OK)
+            rcode = tcpedit_set_ttl_value(tcpedit, 1);
+        break;
+    case BENCH_EDIT_TOS:
+        rcode = tcpedit_set_tos(tcpedit, IPTOS_LOWDELAY);
+        break;
+    case BENCH_EDIT_SRCIPMAP:
+        rcode = tcpedit_set_srcip_map(tcpedit, srcipmap);
+        break;
+    case BENCH_EDIT_PORTMAP:
+        rcode = tcpedit_set_port_map(tcpedit, portmap);
+        break;
+    case BENCH_EDIT_MTU_TRUNC:
+        if ((rcode = tcpedit_set_mtu(tcpedit, 576)) == TCPEDIT_OK)
+            rcode = tcpedit_set_mtu_truncate(tcpedit, true);
+        break;
+    }
+
+    if (rcode != TCPEDIT_OK || tcpedit_validate(tcpedit) < 0)
+        errx(-1, "Unable to edit packets given options: %s", tcpedit_geterr(tcpedit));
+
+    return tcpedit;
+}
+
+/**
+ * \brief tcpedit_packet() with each set of edits
+ *
+ * tcpedit edits in place, so every packet is first copied to a scratch
+ * buffer, which is what tcpreplay-edit does with cached packets.
+ */
+static void
+bench_tcpedit(bench_t *b)
+{
+    bench_edit_t edit;
+
+    for (edit = BENCH_EDIT_OPTIONS; edit <= BENCH_EDIT_MTU_TRUNC; edit++) {
+        tcpedit_t *tcpedit;
+        struct pcap_pkthdr hdr, *pkthdr;
+        u_int64_t start;
+        u_char *pktdata;
+        COUNTER n;
+
+        if (!bench_wanted(b, bench_edit_names[edit]))
+            continue;
+
+        tcpedit = bench_edit_init(edit);
+        start = tcpr_clock_ns();
+        for (n = 0; n < b->iterations; n++) {
+            hdr = b->hdr[n % BENCH_POOL];
+            memcpy(b->scratch, b->data[n % BENCH_POOL], hdr.caplen);
+            pkthdr = &hdr;
+            pktdata = b->scratch;
+            if (tcpedit_packet(tcpedit, &pkthdr, &pktdata, TCPR_DIR_C2S) < 0)
+                errx(-1, "Error editing packet: %s", tcpedit_geterr(tcpedit));
+        }
+        bench_report(bench_edit_names[edit], b->size, n, tcpr_clock_ns() - start);
+        tcpedit_close(&tcpedit);
+    }
+}
+
+/**
+ * \brief flow_decode() as used for the flow statistics
+ */
+static void
+bench_flow_decode(bench_t *b)
+{
+    flow_hash_table_t *fht;
+    u_int64_t start, sum = 0;
+    uint32_t flow_id;
+    COUNTER n;
+
+    if (!bench_wanted(b, "flow_decode"))
+        return;
+
+    fht = flow_hash_table_init(DEFAULT_FLOW_HASH_BUCKET_SIZE);
+    start = tcpr_clock_ns();
+    for (n = 0; n < b->iterations; n++) {
+        sum += flow_decode(fht, &b->hdr[n % BENCH_POOL], b->data[n % BENCH_POOL], DLT_EN10MB, 0, &flow_id);
+    }
+    bench_report("flow_decode", b->size, n, tcpr_clock_ns() - start);
+    flow_hash_table_release(fht);
+    bench_sink = sum;
+}
+
+/**
+ * \brief get_l2len_protocol() on Ethernet frames with increasingly deep
+ * tag stacks in front of the IPv4 header
+ */
+static void
+bench_l2_parse(bench_t *b)
+{
+    static const struct {
+        const char *name;
+        int vlans;
+        int labels;
+    } layouts[] = {
+            {"l2_parse/eth", 0, 0},
+            {"l2_parse/vlan", 1, 0},
+            {"l2_parse/qinq", 2, 0},
+            {"l2_parse/qinq_mpls", 2, 3},
+    };
+    u_char frame[TCPR_ETH_H + 2 * 4 + 3 * 4 + TCPR_IPV4_H];
+    size_t i;
+
+    for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); i++) {
+        uint32_t l2len, l2offset, vlan_offset;
+        u_int64_t start, sum = 0;
+        uint16_t protocol;
+        uint16_t type;
+        COUNTER n;
+        int off, j;
+
+        if (!bench_wanted(b, layouts[i].name))
+            continue;
+
+        memset(frame, 0, sizeof(frame));
+        off = 12;
+        for (j = 0; j < layouts[i].vlans; j++) {
+            type = htons(j == 0 && layouts[i].vlans > 1 ? ETHERTYPE_Q_IN_Q : ETHERTYPE_VLAN);
+            memcpy(frame + off, &type, 2);
+            off += 4;
+        }
+        type = htons(layouts[i].labels ? ETHERTYPE_MPLS : ETHERTYPE_IP);
+        memcpy(frame + off, &type, 2);
+        off += 2;
+        for (j = 0; j < layouts[i].labels; j++) {
+            uint32_t entry = htonl((uint32_t)(100 + j) << MPLS_LS_LABEL_SHIFT |
+                                   (j == layouts[i].labels - 1 ? MPLS_LS_S_MASK : 0));
+            memcpy(frame + off, &entry, 4);
+            off += 4;
+        }
+        frame[off] = 0x45;
+
+        start = tcpr_clock_ns();
+        for (n = 0; n < b->iterations; n++) {
+            vlan_offset = 0;
+            if (get_l2len_protocol(frame, sizeof(frame), DLT_EN10MB, &protocol, &l2len, &l2offset, &vlan_offset) == 0)
+                sum += l2len + protocol;
+        }
+        bench_report(layouts[i].name, 0, n, tcpr_clock_ns() - start);
+        bench_sink = sum;
+    }
+}
+
+/**
+ * \brief check_cache() on a tcpprep cache with a random mix of
+ * primary, secondary and skipped packets
+ */
+static void
+bench_check_cache(bench_t *b)
+{
+    char cachedata[BENCH_POOL / CACHE_PACKETS_PER_BYTE];
+    u_int64_t start, sum = 0;
+    COUNTER n;
+    size_t i;
+
+    if (!bench_wanted(b, "check_cache"))
+        return;
+
+    srandom(1);
+    for (i = 0; i < sizeof(cachedata); i++)
+        cachedata[i] = (char)random();
+
+    start = tcpr_clock_ns();
+    for (n = 0; n < b->iterations; n++)
+        sum += check_cache(cachedata, n % BENCH_POOL + 1);
+    bench_report("check_cache", 0, n, tcpr_clock_ns() - start);
+    bench_sink = sum;
+}
+
+#ifdef HAVE_PTHREAD
+typedef struct bench_ring_s {
+    tcpr_ring_t *ring;
+    COUNTER count; /* descriptors each producer queues */
+} bench_ring_t;
+
+static void *
+bench_ring_producer(void *arg)
+{
+    bench_ring_t *br = arg;
+    sendpacket_pkt_t pkts[BENCH_BATCH];
+    COUNTER n;
+    int i;
+
+    memset(pkts, 0, sizeof(pkts));
+    for (n = 0; n < br->count; n += BENCH_BATCH) {
+        u_int32_t cnt = br->count - n < BENCH_BATCH ? (u_int32_t)(br->count - n) : BENCH_BATCH;
+
+        for (i = 0; i < (int)cnt; i++)
+            pkts[i].len = (size_t)(n + i);
+        tcpr_ring_enqueue_wait(br->ring, pkts, cnt, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief packet descriptors through a tcpr_ring_t from producer threads
+ * to this one, in BENCH_BATCH batches, for each wait strategy
+ *
+ * ns_per_pkt is what handing one descriptor to another thread costs.
+ */
+static void
+bench_ring(bench_t *b)
+{
+    static const int producer_cnt[] = {1, BENCH_RING_PRODUCERS};
+    tcpr_ring_wait_t wait;
+    size_t k;
+
+    for (k = 0; k < sizeof(producer_cnt) / sizeof(producer_cnt[0]); k++) {
+        int producers = producer_cnt[k];
+
+        for (wait = TCPR_RING_SPIN; wait <= TCPR_RING_FUTEX; wait++) {
+            pthread_t thread[BENCH_RING_PRODUCERS];
+            sendpacket_pkt_t pkts[BENCH_BATCH];
+            bench_ring_t br;
+            char name[64];
+            u_int64_t start, sum = 0;
+            COUNTER n = 0;
+            u_int32_t cnt, i;
+            int p;
+
+            snprintf(name, sizeof(name), "ring/%s/%s", producers > 1 ? "mpsc" : "spsc", tcpr_ring_wait_name(wait));
+            if (!bench_wanted(b, name))
+                continue;
+
+            br.ring = tcpr_ring_new(BENCH_RING_SIZE, sizeof(sendpacket_pkt_t), producers > 1 ? TCPR_RING_MP : 0, wait);
+            br.count = b->iterations / producers;
+
+            start = tcpr_clock_ns();
+            for (p = 0; p < producers; p++) {
+                if (pthread_create(&thread[p], NULL, bench_ring_producer, &br) != 0)
+                    errx(-1, "Unable to start the %s producer", name);
+            }
+            while (n < br.count * producers && (cnt = tcpr_ring_dequeue_wait(br.ring, pkts, BENCH_BATCH)) > 0) {
+                for (i = 0; i < cnt; i++)
+                    sum += pkts[i].len;
+                n += cnt;
+            }
+            for (p = 0; p < producers; p++)
+                pthread_join(thread[p], NULL);
+            bench_report(name, 0, n, tcpr_clock_ns() - start);
+
+            bench_sink = sum;
+            tcpr_ring_free(br.ring);
+        }
+    }
+}
+#endif /* HAVE_PTHREAD */
+
+typedef void (*bench_sleep_fn)(sendpacket_t *, struct timespec *, u_int64_t *, bool);
+
+static void
+bench_sleep_one(bench_t *b, sendpacket_t *sp, const char *name, bench_sleep_fn fn)
+{
+    struct timespec nap;
+    u_int64_t start, now;
+    COUNTER n, count = min(b->iterations, BENCH_SLEEP_MAX);
+
+    if (!bench_wanted(b, name))
+        return;
+
+    NANOSEC_TO_TIMESPEC(BENCH_SLEEP_NS, &nap);
+    start = now = tcpr_clock_ns();
+    for (n = 0; n < count; n++)
+        fn(sp, &nap, &now, false);
+    bench_report(name, 0, n, tcpr_clock_ns() - start);
+}
+
+/* the sleep functions differ in constness, so wrap the lot */
+static void
+bench_nanosleep(sendpacket_t *sp, struct timespec *nap, u_int64_t *now_ns, bool flush)
+{
+    nanosleep_sleep(sp, nap, now_ns, flush);
+}
+
+static void
+bench_gettimeofday(sendpacket_t *sp, struct timespec *nap, u_int64_t *now_ns, bool flush)
+{
+    gettimeofday_sleep(sp, nap, now_ns, flush);
+}
+
+#ifdef HAVE_SELECT
+static void
+bench_select(sendpacket_t *sp, struct timespec *nap, u_int64_t *now_ns, bool flush)
+{
+    select_sleep(sp, nap, now_ns, flush);
+}
+#endif
+
+/**
+ * \brief each sleep method asked for BENCH_SLEEP_NS at a time
+ *
+ * ns_per_pkt is what one sleep really took, so the overshoot is
+ * ns_per_pkt - BENCH_SLEEP_NS.
+ */
+static void
+bench_sleep(bench_t *b, sendpacket_t *sp)
+{
+    bench_sleep_one(b, sp, "sleep/nanosleep", bench_nanosleep);
+    bench_sleep_one(b, sp, "sleep/gettimeofday", bench_gettimeofday);
+#ifdef HAVE_SELECT
+    bench_sleep_one(b, sp, "sleep/select", bench_select);
+#endif
+}
+
+/**
+ * \brief sendpacket() and sendpacket_batch() on the given injector
+ */
+static void
+bench_send(bench_t *b, sendpacket_t *sp)
+{
+    sendpacket_pkt_t pkts[BENCH_BATCH];
+    char name[64];
+    u_int64_t start;
+    COUNTER n;
+    int i;
+
+    snprintf(name, sizeof(name), "send/%s", sendpacket_get_method(sp));
+    if (bench_wanted(b, name)) {
+        start = tcpr_clock_ns();
+        for (n = 0; n < b->iterations; n++) {
+            struct pcap_pkthdr *pkthdr = &b->hdr[n % BENCH_POOL];
+
+            sendpacket(sp, b->data[n % BENCH_POOL], pkthdr->caplen, pkthdr);
+        }
+        bench_report(name, b->size, n, tcpr_clock_ns() - start);
+    }
+
+    snprintf(name, sizeof(name), "send/%s/batch", sendpacket_get_method(sp));
+    if (bench_wanted(b, name)) {
+        start = tcpr_clock_ns();
+        for (n = 0; n < b->iterations; n += BENCH_BATCH) {
+            for (i = 0; i < BENCH_BATCH; i++) {
+                int p = (int)((n + i) % BENCH_POOL);
+
+                pkts[i].data = b->data[p];
+                pkts[i].len = b->hdr[p].caplen;
+                pkts[i].pkthdr = &b->hdr[p];
+            }
+            sendpacket_batch(sp, pkts, BENCH_BATCH);
+        }
+        bench_report(name, b->size, n, tcpr_clock_ns() - start);
+    }
+}
+
+int
+main(int argc, char *argv[])
+{
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    sendpacket_t *null_sp, *intf_sp = NULL;
+    char *sizes, *size, *saveptr = NULL;
+    bench_t *b;
+    int i;
+
+    optionProcess(&tcpreplay_benchOptions, argc, argv);
+
+    b = safe_malloc(sizeof(*b));
+    b->iterations = OPT_VALUE_ITERATIONS;
+    if (HAVE_OPT(BENCH))
+        b->filter = OPT_ARG(BENCH);
+    b->scratch = safe_malloc(MAXPACKET);
+
+    if ((null_sp = sendpacket_open("null", ebuf, TCPR_DIR_C2S, SP_TYPE_NULL, NULL)) == NULL)
+        errx(-1, "Unable to open null injector: %s", ebuf);
+
+    if (HAVE_OPT(INTF1)) {
+        if ((intf_sp = sendpacket_open(OPT_ARG(INTF1), ebuf, TCPR_DIR_C2S, SP_TYPE_NONE, NULL)) == NULL)
+            errx(-1, "Can't open %s: %s", OPT_ARG(INTF1), ebuf);
+    }
+
+    /* benchmarks which don't care about the packet size */
+    bench_check_cache(b);
+#ifdef HAVE_PTHREAD
+    bench_ring(b);
+#endif
+    bench_l2_parse(b);
+    bench_sleep(b, null_sp);
+
+    sizes = safe_strdup(OPT_ARG(SIZE));
+    for (size = strtok_r(sizes, ",", &saveptr); size; size = strtok_r(NULL, ",", &saveptr)) {
+        b->size = atoi(size);
+        if (b->size < BENCH_MIN_SIZE || b->size > BENCH_MAX_SIZE)
+            errx(-1, "Invalid --size: %s", size);
+
+        bench_packets(b);
+        bench_read_file(b);
+        bench_read_cached(b);
+        bench_tcpedit(b);
+        bench_flow_decode(b);
+        bench_send(b, null_sp);
+        if (intf_sp)
+            bench_send(b, intf_sp);
+    }
+
+    if (intf_sp)
+        sendpacket_close(intf_sp);
+    sendpacket_close(null_sp);
+    for (i = 0; i < BENCH_POOL; i++)
+        safe_free(b->data[i]);
+    safe_free(b->scratch);
+    safe_free(sizes);
+    safe_free(b);
+
+    return 0;
+}
@@ -0,0 +1,479 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2012 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writes pcap files of synthetic traffic to benchmark with, so inputs of
+ * any size can be made on demand rather than shared.  All of it comes
+ * from tcpr_random(), which only does integer arithmetic, so the same
+ * options and seed give the same file everywhere.
+ *
+ * The attributes of a flow are drawn from a seed of its own each time
+ * one of its packets is built, so nothing is kept per flow and millions
+ * of flows cost no memory.
+ */
+
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "tcpreplay_gen_opts.h"
+#include "common/csum.h"
+#include <errno.h>
+#include <pcap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef DEBUG
+int debug = 0;
+#endif
+
+#define GEN_MIN_SIZE 60
+#define GEN_MAX_SIZE 9216
+#define GEN_SIZES_MAX 64
+#define GEN_DEFAULT_PACKETS 1000000
+#define GEN_VLAN_H 4
+#define GEN_MPLS_H 4
+
+typedef enum {
+    GEN_TIMING_CONSTANT,
+    GEN_TIMING_POISSON,
+    GEN_TIMING_BURST
+} gen_timing_t;
+
+typedef struct {
+    int min;
+    int max;
+    uint32_t weight;
+} gen_size_t;
+
+typedef struct {
+    bool ipv6;
+    bool tcp;
+    uint16_t vlan; /* 0 for none */
+    uint32_t label; /* 0 for none */
+    uint32_t src;
+    uint32_t dst;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t seq;
+} gen_flow_t;
+
+typedef struct {
+    uint32_t seed;      /* picks the flow, size and timing of each packet */
+    uint32_t flow_seed; /* flows are drawn from this and their number */
+    uint32_t flows;
+    COUNTER packets;
+    u_int64_t bytes_max;
+
+    gen_size_t sizes[GEN_SIZES_MAX];
+    int size_cnt;
+    uint32_t weight_total;
+
+    int ipv6_pct;
+    int tcp_pct;
+    int vlan_pct;
+    int mpls_pct;
+
+    gen_timing_t timing;
+    u_int64_t pps;
+    int burst;
+    u_int64_t start_ns;
+    u_int64_t ts_ns; /* of the last packet, with --timing=poisson */
+
+    u_char frame[GEN_MAX_SIZE];
+    u_char payload[GEN_MAX_SIZE];
+} gen_t;
+
+static const uint16_t gen_udp_ports[] = {53, 123, 443, 514, 2152, 4789, 5060};
+static const uint16_t gen_tcp_ports[] = {22, 25, 80, 443, 993, 3306, 8080};
+
+/**
+ * \brief "min", "imix", "jumbo" or a list of size[-max][:weight]
+ */
+static void
+gen_parse_sizes(gen_t *g, const char *spec)
+{
+    char *list, *entry, *saveptr = NULL;
+
+    if (strcmp(spec, "min") == 0)
+        spec = "60";
+    else if (strcmp(spec, "imix") == 0)
+        spec = "60:7,590:4,1514:1";
+    else if (strcmp(spec, "jumbo") == 0)
+        spec = "9014";
+
+    list = safe_strdup(spec);
+    for (entry = strtok_r(list, ",", &saveptr); entry; entry = strtok_r(NULL, ",", &saveptr)) {
+        gen_size_t *s;
+        char *end;
+        long weight = 1;
+
+        if (g->size_cnt == GEN_SIZES_MAX)
+            errx(-1, "--sizes has more than %d entries", GEN_SIZES_MAX);
+        s = &g->sizes[g->size_cnt++];
+
+        s->min = s->max = (int)strtol(entry, &end, 10);
+        if (*end == '-')
+            s->max = (int)strtol(end + 1, &end, 10);
+        if (*end == ':')
+            weight = strtol(end + 1, &end, 10);
+
+        if (*end != '\0' || s->min < GEN_MIN_SIZE || s->max > GEN_MAX_SIZE || s->min > s->max || weight < 1 ||
+            weight > 1000000)
+            errx(-1, "Invalid --sizes entry: %s", entry);
+
+        s->weight = (uint32_t)weight;
+        g->weight_total += s->weight;
+    }
+    safe_free(list);
+
+    if (g->size_cnt == 0)
+        errx(-1, "Invalid --sizes: %s", spec);
+}
+
+static uint32_t
+gen_range(uint32_t *seed, uint32_t n)
+{
+    return (uint32_t)(((u_int64_t)tcpr_random(seed) * n) >> 31);
+}
+
+/**
+ * \brief the attributes of flow idx, the same every time
+ */
+static void
+gen_flow(const gen_t *g, uint32_t idx, gen_flow_t *f)
+{
+    uint32_t seed = g->flow_seed ^ (idx * 2654435761u);
+    const uint16_t *ports;
+
+    memset(f, 0, sizeof(*f));
+    f->ipv6 = gen_range(&seed, 100) < (uint32_t)g->ipv6_pct;
+    f->tcp = gen_range(&seed, 100) < (uint32_t)g->tcp_pct;
+    if (gen_range(&seed, 100) < (uint32_t)g->vlan_pct)
+        f->vlan = 1 + gen_range(&seed, 4094);
+    if (gen_range(&seed, 100) < (uint32_t)g->mpls_pct)
+        f->label = 16 + gen_range(&seed, (1 << 20) - 16);
+
+    /* the source address alone tells the flows apart */
+    f->src = idx;
+    f->dst = tcpr_random(&seed);
+    f->sport = 1024 + gen_range(&seed, 65536 - 1024);
+    ports = f->tcp ? gen_tcp_ports : gen_udp_ports;
+    f->dport = ports[gen_range(&seed, sizeof(gen_udp_ports) / sizeof(gen_udp_ports[0]))];
+    f->seq = tcpr_random(&seed);
+}
+
+static int
+gen_size(gen_t *g)
+{
+    uint32_t w = gen_range(&g->seed, g->weight_total);
+    int i;
+
+    for (i = 0; i < g->size_cnt - 1 && w >= g->sizes[i].weight; i++)
+        w -= g->sizes[i].weight;
+
+    return g->sizes[i].min + (int)gen_range(&g->seed, g->sizes[i].max - g->sizes[i].min + 1);
+}
+
+/**
+ * \brief ln(x) for 0 < x <= 1, so the tool needn't link libm
+ */
+static double
+gen_log(double x)
+{
+    double y, y2, term, sum = 0.0;
+    int k = 0, i;
+
+    while (x < 0.5) {
+        x *= 2.0;
+        k--;
+    }
+
+    /* ln(x) = 2 atanh((x - 1) / (x + 1)), |y| <= 1/3 here */
+    y = (x - 1.0) / (x + 1.0);
+    y2 = y * y;
+    term = y;
+    for (i = 1; i < 30; i += 2) {
+        sum += term / i;
+        term *= y2;
+    }
+
+    return 2.0 * sum + k * 0.69314718055994530942;
+}
+
+/**
+ * \brief when packet n would go out at exactly pps, kept exact rather
+ * than summing rounded gaps
+ */
+static u_int64_t
+gen_even_ns(const gen_t *g, COUNTER n)
+{
+    return g->start_ns + (n / g->pps) * 1000000000 + (n % g->pps) * 1000000000 / g->pps;
+}
+
+/**
+ * \brief the timestamp of packet n, called for each n in turn
+ */
+static void
+gen_timestamp(gen_t *g, COUNTER n, struct timeval *ts)
+{
+    u_int64_t ns;
+
+    switch (g->timing) {
+    case GEN_TIMING_POISSON:
+        /* (0, 1], so the log is finite */
+        if (n > 0)
+            g->ts_ns += (u_int64_t)(-gen_log(((double)tcpr_random(&g->seed) + 1.0) / 2147483648.0) * 1000000000.0 /
+                                    (double)g->pps);
+        ns = g->ts_ns;
+        break;
+    case GEN_TIMING_BURST:
+        ns = gen_even_ns(g, n - n % g->burst);
+        break;
+    case GEN_TIMING_CONSTANT:
+    default:
+        ns = gen_even_ns(g, n);
+        break;
+    }
+
+    ts->tv_sec = (time_t)(ns / 1000000000);
+    ts->tv_usec = (suseconds_t)(ns % 1000000000 / 1000);
+}
+
+/**
+ * \brief checksum of l4len bytes at l4, the payload being copied in behind the header
+ */
+static uint16_t
+gen_l4_csum(const gen_t *g, const u_char *pseudo, int pseudo_len, u_char *l4, int l4hdr, int l4len)
+{
+    uint32_t sum;
+
+    sum = tcpr_csum_partial(pseudo, pseudo_len, 0);
+    sum = tcpr_csum_partial(l4, l4hdr, sum);
+    sum = tcpr_csum_partial_copy(l4 + l4hdr, g->payload, l4len - l4hdr, sum);
+
+    return (uint16_t)(~sum & 0xffff);
+}
+
+/**
+ * \brief build packet n in g->frame, returning its length
+ */
+static int
+gen_packet(gen_t *g, COUNTER n)
+{
+    u_char pseudo[TCPR_IPV6_H];
+    gen_flow_t f;
+    uint16_t type, l3len, l4len;
+    int off, l4hdr, len, pseudo_len;
+    u_char *l4;
+    uint32_t word;
+
+    gen_flow(g, gen_range(&g->seed, g->flows), &f);
+
+    l4hdr = f.tcp ? TCPR_TCP_H : TCPR_UDP_H;
+    off = TCPR_ETH_H + (f.vlan ? GEN_VLAN_H : 0) + (f.label ? GEN_MPLS_H : 0);
+    len = gen_size(g);
+    if (len < off + (f.ipv6 ? TCPR_IPV6_H : TCPR_IPV4_H) + l4hdr)
+        len = off + (f.ipv6 ? TCPR_IPV6_H : TCPR_IPV4_H) + l4hdr;
+
+    /* locally administered MACs which carry the flow */
+    memset(g->frame, 0, off);
+    g->frame[0] = 0x02;
+    word = htonl(f.dst);
+    memcpy(g->frame + 2, &word, 4);
+    g->frame[6] = 0x02;
+    g->frame[7] = 0x01;
+    word = htonl(f.src);
+    memcpy(g->frame + 8, &word, 4);
+
+    off = 12;
+    if (f.vlan) {
+        type = htons(ETHERTYPE_VLAN);
+        memcpy(g->frame + off, &type, 2);
+        type = htons(f.vlan);
+        memcpy(g->frame + off + 2, &type, 2);
+        off += GEN_VLAN_H;
+    }
+    type = htons(f.label ? ETHERTYPE_MPLS : f.ipv6 ? ETHERTYPE_IP6 : ETHERTYPE_IP);
+    memcpy(g->frame + off, &type, 2);
+    off += 2;
+    if (f.label) {
+        word = htonl(f.label << MPLS_LS_LABEL_SHIFT | MPLS_LS_S_MASK | 64);
+        memcpy(g->frame + off, &word, 4);
+        off += GEN_MPLS_H;
+    }
+
+    l3len = (uint16_t)(len - off);
+    if (f.ipv6) {
+        ipv6_hdr_t *ip6 = (ipv6_hdr_t *)(g->frame + off);
+
+        memset(ip6, 0, TCPR_IPV6_H);
+        ip6->ip_flags[0] = 0x60;
+        ip6->ip_len = htons(l3len - TCPR_IPV6_H);
+        ip6->ip_nh = f.tcp ? IPPROTO_TCP : IPPROTO_UDP;
+        ip6->ip_hl = 64;
+        /* fd00::/8, unique local */
+        ip6->ip_src.__u6_addr.__u6_addr8[0] = 0xfd;
+        ip6->ip_src.__u6_addr.__u6_addr32[3] = htonl(f.src);
+        ip6->ip_dst.__u6_addr.__u6_addr8[0] = 0xfd;
+        ip6->ip_dst.__u6_addr.__u6_addr8[1] = 0x01;
+        ip6->ip_dst.__u6_addr.__u6_addr32[3] = htonl(f.dst);
+
+        l4 = g->frame + off + TCPR_IPV6_H;
+        l4len = l3len - TCPR_IPV6_H;
+
+        memcpy(pseudo, &ip6->ip_src, 32);
+        word = htonl(l4len);
+        memcpy(pseudo + 32, &word, 4);
+        word = htonl(ip6->ip_nh);
+        memcpy(pseudo + 36, &word, 4);
+        pseudo_len = 40;
+    } else {
+        ipv4_hdr_t *ip = (ipv4_hdr_t *)(g->frame + off);
+
+        memset(ip, 0, TCPR_IPV4_H);
+        ip->ip_v = 4;
+        ip->ip_hl = TCPR_IPV4_H >> 2;
+        ip->ip_len = htons(l3len);
+        ip->ip_id = htons((uint16_t)n);
+        ip->ip_ttl = 64;
+        ip->ip_p = f.tcp ? IPPROTO_TCP : IPPROTO_UDP;
+        /* 10.0.0.0/8 to 172.16.0.0/12 */
+        ip->ip_src.s_addr = htonl(0x0a000000 | (f.src & 0xffffff));
+        ip->ip_dst.s_addr = htonl(0xac100000 | (f.dst & 0xfffff));
+        ip->ip_sum = (uint16_t)(~tcpr_csum_partial(ip, TCPR_IPV4_H, 0) & 0xffff);
+
+        l4 = g->frame + off + TCPR_IPV4_H;
+        l4len = l3len - TCPR_IPV4_H;
+
+        memcpy(pseudo, &ip->ip_src, 8);
+        pseudo[8] = 0;
+        pseudo[9] = ip->ip_p;
+        type = htons(l4len);
+        memcpy(pseudo + 10, &type, 2);
+        pseudo_len = 12;
+    }
+
+    memset(l4, 0, l4hdr);
+    if (f.tcp) {
+        tcp_hdr_t *tcp = (tcp_hdr_t *)l4;
+
+        tcp->th_sport = htons(f.sport);
+        tcp->th_dport = htons(f.dport);
+        tcp->th_seq = htonl(f.seq + (uint32_t)n);
+        tcp->th_ack = htonl(~f.seq);
+        tcp->th_off = TCPR_TCP_H >> 2;
+        tcp->th_flags = TH_ACK | TH_PUSH;
+        tcp->th_win = htons(65535);
+        tcp->th_sum = gen_l4_csum(g, pseudo, pseudo_len, l4, l4hdr, l4len);
+    } else {
+        udp_hdr_t *udp = (udp_hdr_t *)l4;
+
+        udp->uh_sport = htons(f.sport);
+        udp->uh_dport = htons(f.dport);
+        udp->uh_ulen = htons(l4len);
+        udp->uh_sum = gen_l4_csum(g, pseudo, pseudo_len, l4, l4hdr, l4len);
+        if (udp->uh_sum == 0)
+            udp->uh_sum = 0xffff;
+    }
+
+    return len;
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct pcap_pkthdr pkthdr;
+    pcap_dumper_t *dumper;
+    u_int64_t bytes = 0;
+    pcap_t *pcap;
+    COUNTER n;
+    gen_t *g;
+    int i;
+
+    optionProcess(&tcpreplay_genOptions, argc, argv);
+
+#ifdef DEBUG
+    if (HAVE_OPT(DBUG))
+        debug = OPT_VALUE_DBUG;
+#endif
+
+    g = safe_malloc(sizeof(*g));
+    g->seed = (uint32_t)OPT_VALUE_SEED;
+    g->flow_seed = tcpr_random(&g->seed);
+    g->flows = (uint32_t)OPT_VALUE_FLOWS;
+    g->ipv6_pct = OPT_VALUE_IPV6;
+    g->tcp_pct = OPT_VALUE_TCP;
+    g->vlan_pct = OPT_VALUE_VLAN;
+    g->mpls_pct = OPT_VALUE_MPLS;
+    g->pps = (u_int64_t)OPT_VALUE_PPS;
+    g->burst = OPT_VALUE_BURST;
+    g->start_ns = g->ts_ns = (u_int64_t)OPT_VALUE_START * 1000000000;
+    gen_parse_sizes(g, OPT_ARG(SIZES));
+
+    if (HAVE_OPT(PACKETS))
+        g->packets = OPT_VALUE_PACKETS;
+    if (HAVE_OPT(MEGABYTES))
+        g->bytes_max = (u_int64_t)OPT_VALUE_MEGABYTES << 20;
+    if (g->packets == 0 && g->bytes_max == 0)
+        g->packets = GEN_DEFAULT_PACKETS;
+
+    if (strcmp(OPT_ARG(TIMING), "constant") == 0)
+        g->timing = GEN_TIMING_CONSTANT;
+    else if (strcmp(OPT_ARG(TIMING), "poisson") == 0)
+        g->timing = GEN_TIMING_POISSON;
+    else if (strcmp(OPT_ARG(TIMING), "burst") == 0)
+        g->timing = GEN_TIMING_BURST;
+    else
+        errx(-1, "Invalid --timing: %s", OPT_ARG(TIMING));
+
+    for (i = 0; i < GEN_MAX_SIZE; i++)
+        g->payload[i] = (u_char)(tcpr_random(&g->seed) >> 23);
+
+    pcap = pcap_open_dead(DLT_EN10MB, GEN_MAX_SIZE);
+    if ((dumper = pcap_dump_open(pcap, OPT_ARG(WRITE))) == NULL)
+        errx(-1, "Unable to write %s: %s", OPT_ARG(WRITE), pcap_geterr(pcap));
+
+    for (n = 0; g->packets == 0 || n < g->packets; n++) {
+        int len = gen_packet(g, n);
+
+        if (g->bytes_max > 0 && bytes + len > g->bytes_max)
+            break;
+
+        gen_timestamp(g, n, &pkthdr.ts);
+        pkthdr.caplen = pkthdr.len = len;
+        pcap_dump((u_char *)dumper, &pkthdr, g->frame);
+        bytes += len;
+    }
+
+    if (pcap_dump_flush(dumper) != 0)
+        errx(-1, "Unable to write %s: %s", OPT_ARG(WRITE), strerror(errno));
+    pcap_dump_close(dumper);
+    pcap_close(pcap);
+
+    notice("Wrote " COUNTER_SPEC " packets (%llu bytes) of %u flows to %s",
+           n,
+           (unsigned long long)bytes,
+           g->flows,
+           OPT_ARG(WRITE));
+
+    safe_free(g);
+    return 0;
+}
@@ -0,0 +1,546 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2012 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * End to end timing benchmark: runs tcpreplay on a reference capture for
+ * every timer and speed asked for while capturing what comes out the far
+ * side of the link, and works out how close the gaps between packets came
+ * to what tcpreplay was aiming for.
+ *
+ * Packets are known by rxmatch_sig(), like --rx-interface does, and
+ * matched in file order: a packet is looked for among the next
+ * TIMING_LOOKAHEAD of the file, so lost packets are skipped over and
+ * whatever else is seen on the link is ignored.  Gaps are taken between
+ * consecutive packets received, any lost between them included in what
+ * was expected.
+ *
+ * Results are printed as one JSON object per line, like tcpreplay-bench.
+ */
+
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "tcpreplay_timing_opts.h"
+#include "common/histogram.h"
+#include "common/rxmatch.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pcap.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifdef DEBUG
+int debug = 0;
+#endif
+
+/* enough for the headers rxmatch_sig() hashes */
+#define TIMING_SNAPLEN 256
+#define TIMING_BUFSIZE (64 * 1024 * 1024)
+#define TIMING_POLL_MS 10
+/* packets of the file a received one is looked for in */
+#define TIMING_LOOKAHEAD 256
+#define TIMING_SPEEDS_MAX 32
+#define TIMING_ARGS_MAX 64
+
+#ifdef ENABLE_RXMATCH
+typedef enum {
+    TIMING_MULTIPLIER,
+    TIMING_PPS,
+    TIMING_MBPS,
+    TIMING_TOPSPEED
+} timing_speed_type_t;
+
+typedef struct {
+    const char *name;
+    timing_speed_type_t type;
+    double value;
+} timing_speed_t;
+
+/* a reference capture */
+typedef struct {
+    const char *path;
+    COUNTER cnt;
+    COUNTER ip;        /* packets with a signature, the ones which can be matched */
+    u_int64_t *ts_ns;  /* of each packet */
+    u_int64_t *bytes;  /* before each packet */
+    u_int32_t *sig;
+} timing_ref_t;
+
+/* one run of tcpreplay */
+typedef struct {
+    const timing_ref_t *ref;
+    const timing_speed_t *speed;
+    int dlt;
+    bool nsec;
+    COUNTER next;     /* first packet of the file not received or skipped */
+    COUNTER received;
+    COUNTER other;    /* not from the file */
+    COUNTER last;     /* packet of the file received last */
+    u_int64_t first_ns;
+    u_int64_t last_ns;
+    COUNTER first;
+    u_int64_t bytes;
+    int64_t bias_ns;  /* sum of the gap errors */
+    tcpr_hist_t err_ns;
+    tcpr_hist_t err_bp; /* in hundredths of a percent of the gap */
+} timing_run_t;
+
+static void
+timing_load(timing_ref_t *ref, const char *path)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    struct pcap_pkthdr pkthdr;
+    const u_char *data;
+    COUNTER size = 0;
+    u_int64_t bytes = 0;
+    pcap_t *pcap;
+    int dlt;
+
+    if ((pcap = tcpr_pcap_open_offline(path, ebuf)) == NULL)
+        errx(-1, "Unable to open %s: %s", path, ebuf);
+
+    memset(ref, 0, sizeof(*ref));
+    ref->path = path;
+    dlt = pcap_datalink(pcap);
+
+    while ((data = pcap_next(pcap, &pkthdr)) != NULL) {
+        if (ref->cnt == size) {
+            size = size ? size * 2 : 4096;
+            ref->ts_ns = safe_realloc(ref->ts_ns, size * sizeof(u_int64_t));
+            ref->bytes = safe_realloc(ref->bytes, size * sizeof(u_int64_t));
+            ref->sig = safe_realloc(ref->sig, size * sizeof(u_int32_t));
+        }
+
+        ref->ts_ns[ref->cnt] = (u_int64_t)pkthdr.ts.tv_sec * 1000000000 + (u_int64_t)pkthdr.ts.tv_usec * 1000;
+        ref->bytes[ref->cnt] = bytes;
+        if ((ref->sig[ref->cnt] = rxmatch_sig(data, pkthdr.caplen, dlt)) != 0)
+            ref->ip++;
+        bytes += pkthdr.len;
+        ref->cnt++;
+    }
+
+    pcap_close(pcap);
+
+    if (ref->ip < 2)
+        errx(-1, "%s needs at least two IP packets to time", path);
+}
+
+static void
+timing_unload(timing_ref_t *ref)
+{
+    safe_free(ref->ts_ns);
+    safe_free(ref->bytes);
+    safe_free(ref->sig);
+}
+
+static int
+timing_parse_speeds(timing_speed_t *speeds, char *list)
+{
+    char *speed, *end, *saveptr = NULL;
+    int cnt = 0;
+
+    for (speed = strtok_r(list, ",", &saveptr); speed; speed = strtok_r(NULL, ",", &saveptr)) {
+        timing_speed_t *s = &speeds[cnt];
+        const char *value = NULL;
+
+        if (cnt == TIMING_SPEEDS_MAX)
+            errx(-1, "At most %d --speeds", TIMING_SPEEDS_MAX);
+
+        s->name = speed;
+        if (strcmp(speed, "topspeed") == 0) {
+            s->type = TIMING_TOPSPEED;
+        } else if (speed[0] == 'x') {
+            s->type = TIMING_MULTIPLIER;
+            value = speed + 1;
+        } else if (strncmp(speed, "pps:", 4) == 0) {
+            s->type = TIMING_PPS;
+            value = speed + 4;
+        } else if (strncmp(speed, "mbps:", 5) == 0) {
+            s->type = TIMING_MBPS;
+            value = speed + 5;
+        } else {
+            errx(-1, "Invalid --speeds: %s", speed);
+        }
+
+        if (value != NULL) {
+            s->value = strtod(value, &end);
+            if (end == value || *end != '\0' || s->value <= 0.0)
+                errx(-1, "Invalid --speeds: %s", speed);
+        }
+        cnt++;
+    }
+
+    if (cnt == 0)
+        errx(-1, "%s", "No --speeds to run");
+    return cnt;
+}
+
+/**
+ * \brief ns tcpreplay aims to leave between packets a and b of the file
+ */
+static u_int64_t
+timing_expected(const timing_run_t *run, COUNTER a, COUNTER b)
+{
+    const timing_ref_t *ref = run->ref;
+
+    switch (run->speed->type) {
+    case TIMING_MULTIPLIER:
+        if (ref->ts_ns[b] <= ref->ts_ns[a])
+            return 0;
+        return (u_int64_t)((double)(ref->ts_ns[b] - ref->ts_ns[a]) / run->speed->value);
+    case TIMING_PPS:
+        return (u_int64_t)((double)(b - a) * 1000000000.0 / run->speed->value);
+    case TIMING_MBPS:
+        return (u_int64_t)((double)(ref->bytes[b] - ref->bytes[a]) * 8000.0 / run->speed->value);
+    default:
+        return 0;
+    }
+}
+
+static void
+timing_drop(_U_ u_char *arg, _U_ const struct pcap_pkthdr *pkthdr, _U_ const u_char *data)
+{
+}
+
+static void
+timing_got(u_char *arg, const struct pcap_pkthdr *pkthdr, const u_char *data)
+{
+    timing_run_t *run = (timing_run_t *)arg;
+    const timing_ref_t *ref = run->ref;
+    u_int64_t ts_ns;
+    u_int32_t sig;
+    COUNTER i, end;
+
+    if ((sig = rxmatch_sig(data, pkthdr->caplen, run->dlt)) == 0) {
+        run->other++;
+        return;
+    }
+
+    end = run->next + TIMING_LOOKAHEAD < ref->cnt ? run->next + TIMING_LOOKAHEAD : ref->cnt;
+    for (i = run->next; i < end && ref->sig[i] != sig; i++)
+        ;
+
+    if (i == end) {
+        run->other++;
+        return;
+    }
+
+    ts_ns = (u_int64_t)pkthdr->ts.tv_sec * 1000000000 + (u_int64_t)pkthdr->ts.tv_usec * (run->nsec ? 1 : 1000);
+    if (run->received == 0) {
+        run->first = i;
+        run->first_ns = ts_ns;
+    } else if (run->speed->type != TIMING_TOPSPEED) {
+        u_int64_t expected = timing_expected(run, run->last, i);
+        u_int64_t gap = ts_ns > run->last_ns ? ts_ns - run->last_ns : 0;
+        u_int64_t err = gap > expected ? gap - expected : expected - gap;
+
+        run->bias_ns += (int64_t)gap - (int64_t)expected;
+        tcpr_hist_add(&run->err_ns, err);
+        if (expected > 0)
+            tcpr_hist_add(&run->err_bp, err * 10000 / expected);
+    }
+
+    run->next = i + 1;
+    run->last = i;
+    run->last_ns = ts_ns;
+    run->bytes += pkthdr->len;
+    run->received++;
+}
+
+static pcap_t *
+timing_open_capture(const char *device)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    pcap_t *pcap;
+
+#ifdef HAVE_PCAP_SET_TSTAMP_PRECISION
+    if ((pcap = pcap_create(device, ebuf)) == NULL)
+        errx(-1, "Unable to capture on %s: %s", device, ebuf);
+    pcap_set_snaplen(pcap, TIMING_SNAPLEN);
+    pcap_set_promisc(pcap, 1);
+    pcap_set_timeout(pcap, TIMING_POLL_MS);
+    pcap_set_buffer_size(pcap, TIMING_BUFSIZE);
+    pcap_set_tstamp_precision(pcap, PCAP_TSTAMP_PRECISION_NANO);
+    if (pcap_activate(pcap) < 0)
+        errx(-1, "Unable to capture on %s: %s", device, pcap_geterr(pcap));
+#else
+    if ((pcap = pcap_open_live(device, TIMING_SNAPLEN, 1, TIMING_POLL_MS, ebuf)) == NULL)
+        errx(-1, "Unable to capture on %s: %s", device, ebuf);
+#endif
+
+#ifdef HAVE_PCAP_SETNONBLOCK
+    if (pcap_setnonblock(pcap, 1, ebuf) < 0)
+        errx(-1, "Unable to capture on %s: %s", device, ebuf);
+#endif
+
+    return pcap;
+}
+
+/**
+ * \brief hand what has been captured to run, waiting up to TIMING_POLL_MS
+ * for something to come in
+ */
+static void
+timing_capture(pcap_t *pcap, timing_run_t *run)
+{
+#ifdef HAVE_PCAP_GET_SELECTABLE_FD
+    struct pollfd pfd;
+
+    pfd.fd = pcap_get_selectable_fd(pcap);
+    pfd.events = POLLIN;
+    if (pfd.fd >= 0 && poll(&pfd, 1, TIMING_POLL_MS) <= 0)
+        return;
+#endif
+
+    if (pcap_dispatch(pcap, -1, timing_got, (u_char *)run) < 0)
+        errx(-1, "Error capturing: %s", pcap_geterr(pcap));
+}
+
+static pid_t
+timing_spawn(const timing_ref_t *ref, const char *timer, const timing_speed_t *speed, char *extra)
+{
+    char timer_arg[64], speed_arg[64];
+    char *argv[TIMING_ARGS_MAX];
+    char *arg, *saveptr = NULL;
+    int argc = 0, fd;
+    pid_t pid;
+
+    argv[argc++] = OPT_ARG(TCPREPLAY);
+    argv[argc++] = "-q";
+    argv[argc++] = "-i";
+    argv[argc++] = OPT_ARG(INTF1);
+    snprintf(timer_arg, sizeof(timer_arg), "--timer=%s", timer);
+    argv[argc++] = timer_arg;
+
+    switch (speed->type) {
+    case TIMING_MULTIPLIER:
+        snprintf(speed_arg, sizeof(speed_arg), "--multiplier=%g", speed->value);
+        break;
+    case TIMING_PPS:
+        snprintf(speed_arg, sizeof(speed_arg), "--pps=%g", speed->value);
+        break;
+    case TIMING_MBPS:
+        snprintf(speed_arg, sizeof(speed_arg), "--mbps=%g", speed->value);
+        break;
+    default:
+        snprintf(speed_arg, sizeof(speed_arg), "%s", "--topspeed");
+    }
+    argv[argc++] = speed_arg;
+
+    for (arg = extra ? strtok_r(extra, " ", &saveptr) : NULL; arg; arg = strtok_r(NULL, " ", &saveptr)) {
+        if (argc == TIMING_ARGS_MAX - 2)
+            errx(-1, "At most %d --tcpreplay-args", TIMING_ARGS_MAX - 8);
+        argv[argc++] = arg;
+    }
+
+    argv[argc++] = (char *)ref->path;
+    argv[argc] = NULL;
+
+    if ((pid = fork()) < 0)
+        errx(-1, "Unable to fork: %s", strerror(errno));
+
+    if (pid == 0) {
+        /* the statistics would get in the way of the results on stdout */
+        if ((fd = open("/dev/null", O_WRONLY)) >= 0)
+            dup2(fd, STDOUT_FILENO);
+        execvp(argv[0], argv);
+        fprintf(stderr, "Unable to run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+
+    return pid;
+}
+
+static void
+timing_report(const timing_run_t *run, const char *timer, double wall_s, const struct rusage *ru, COUNTER dropped)
+{
+    const timing_ref_t *ref = run->ref;
+    double cpu_s, dur_s;
+
+    cpu_s = (double)ru->ru_utime.tv_sec + (double)ru->ru_utime.tv_usec / 1000000.0 + (double)ru->ru_stime.tv_sec +
+            (double)ru->ru_stime.tv_usec / 1000000.0;
+    dur_s = run->received > 1 ? (double)(run->last_ns - run->first_ns) / 1000000000.0 : 0.0;
+
+    printf("{\"file\":\"%s\",\"timer\":\"%s\",\"speed\":\"%s\",\"sent\":" COUNTER_SPEC ",\"received\":" COUNTER_SPEC
+           ",\"lost\":" COUNTER_SPEC ",\"other\":" COUNTER_SPEC ",\"dropped\":" COUNTER_SPEC
+           ",\"pps\":%.1f,\"mbps\":%.3f,\"cpu_pct\":%.1f",
+           ref->path,
+           timer,
+           run->speed->name,
+           ref->ip,
+           run->received,
+           ref->ip - run->received,
+           run->other,
+           dropped,
+           dur_s > 0.0 ? (double)(run->received - 1) / dur_s : 0.0,
+           dur_s > 0.0 ? (double)run->bytes * 8.0 / dur_s / 1000000.0 : 0.0,
+           wall_s > 0.0 ? cpu_s * 100.0 / wall_s : 0.0);
+
+    if (run->speed->type != TIMING_TOPSPEED && run->err_ns.count > 0) {
+        u_int64_t expected = timing_expected(run, run->first, run->last);
+
+        printf(",\"pace_pct\":%.2f,\"bias_us\":%.3f",
+               expected > 0 ? dur_s * 100000000000.0 / (double)expected : 0.0,
+               (double)run->bias_ns / (double)run->err_ns.count / 1000.0);
+        printf(",\"gap_err_us\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"p999\":%.3f,\"max\":%.3f}",
+               (double)tcpr_hist_percentile(&run->err_ns, 50.0) / 1000.0,
+               (double)tcpr_hist_percentile(&run->err_ns, 90.0) / 1000.0,
+               (double)tcpr_hist_percentile(&run->err_ns, 99.0) / 1000.0,
+               (double)tcpr_hist_percentile(&run->err_ns, 99.9) / 1000.0,
+               (double)run->err_ns.max / 1000.0);
+        printf(",\"gap_err_pct\":{\"p50\":%.2f,\"p90\":%.2f,\"p99\":%.2f}",
+               (double)tcpr_hist_percentile(&run->err_bp, 50.0) / 100.0,
+               (double)tcpr_hist_percentile(&run->err_bp, 90.0) / 100.0,
+               (double)tcpr_hist_percentile(&run->err_bp, 99.0) / 100.0);
+    }
+
+    printf("}\n");
+    fflush(stdout);
+}
+
+/**
+ * \brief send ref once with the given timer and speed, and report on it
+ */
+static void
+timing_run(pcap_t *pcap, const timing_ref_t *ref, const char *timer, const timing_speed_t *speed)
+{
+    struct pcap_stat before, after;
+    timing_run_t *run;
+    struct rusage ru;
+    u_int64_t start_ns, end_ns;
+    char *extra = NULL;
+    int status = 0;
+    pid_t pid;
+
+    run = safe_malloc(sizeof(*run));
+    run->ref = ref;
+    run->speed = speed;
+    run->dlt = pcap_datalink(pcap);
+#ifdef HAVE_PCAP_SET_TSTAMP_PRECISION
+    run->nsec = pcap_get_tstamp_precision(pcap) == PCAP_TSTAMP_PRECISION_NANO;
+#endif
+
+    /* whatever came in since the last run isn't ours */
+    while (pcap_dispatch(pcap, -1, timing_drop, NULL) > 0)
+        ;
+
+    memset(&before, 0, sizeof(before));
+    pcap_stats(pcap, &before);
+
+    if (HAVE_OPT(TCPREPLAY_ARGS))
+        extra = safe_strdup(OPT_ARG(TCPREPLAY_ARGS));
+
+    start_ns = tcpr_clock_ns();
+    pid = timing_spawn(ref, timer, speed, extra);
+    for (;;) {
+        pid_t done = wait4(pid, &status, WNOHANG, &ru);
+
+        if (done == pid)
+            break;
+        if (done < 0 && errno != EINTR)
+            errx(-1, "Unable to wait for tcpreplay: %s", strerror(errno));
+        timing_capture(pcap, run);
+    }
+    end_ns = tcpr_clock_ns();
+
+    /* the last packets may still be on their way */
+    while (tcpr_clock_ns() - end_ns < (u_int64_t)OPT_VALUE_SETTLE * 1000000)
+        timing_capture(pcap, run);
+
+    memset(&after, 0, sizeof(after));
+    pcap_stats(pcap, &after);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("{\"file\":\"%s\",\"timer\":\"%s\",\"speed\":\"%s\",\"error\":\"tcpreplay %s %d\"}\n",
+               ref->path,
+               timer,
+               speed->name,
+               WIFEXITED(status) ? "exited with" : "killed by signal",
+               WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+        fflush(stdout);
+    } else {
+        timing_report(run, timer, (double)(end_ns - start_ns) / 1000000000.0, &ru, after.ps_drop - before.ps_drop);
+    }
+
+    safe_free(extra);
+    safe_free(run);
+}
+
+int
+main(int argc, char *argv[])
+{
+    timing_speed_t speeds[TIMING_SPEEDS_MAX];
+    char *timers, *timer, *speed_list, *saveptr = NULL;
+    timing_ref_t ref;
+    pcap_t *pcap;
+    int optct, speed_cnt, i, j;
+
+    optct = optionProcess(&tcpreplay_timingOptions, argc, argv);
+    argc -= optct;
+    argv += optct;
+
+#ifdef DEBUG
+    if (HAVE_OPT(DBUG))
+        debug = OPT_VALUE_DBUG;
+#endif
+
+    if (argc < 1)
+        errx(-1, "%s", "Give at least one pcap file to replay");
+
+    speed_list = safe_strdup(OPT_ARG(SPEEDS));
+    speed_cnt = timing_parse_speeds(speeds, speed_list);
+
+    pcap = timing_open_capture(HAVE_OPT(CAPTURE) ? OPT_ARG(CAPTURE) : OPT_ARG(INTF1));
+
+    for (i = 0; i < argc; i++) {
+        timing_load(&ref, argv[i]);
+
+        timers = safe_strdup(OPT_ARG(TIMERS));
+        for (timer = strtok_r(timers, ",", &saveptr); timer; timer = strtok_r(NULL, ",", &saveptr)) {
+            for (j = 0; j < speed_cnt; j++)
+                timing_run(pcap, &ref, timer, &speeds[j]);
+        }
+
+        safe_free(timers);
+        timing_unload(&ref);
+    }
+
+    pcap_close(pcap);
+    safe_free(speed_list);
+
+    return 0;
+}
+
+#else
+
+int
+main(_U_ int argc, _U_ char *argv[])
+{
+    errx(-1, "%s", "tcpreplay-timing needs POSIX threads");
+}
+
+#endif /* ENABLE_RXMATCH */
@@ -0,0 +1,46 @@
+#!/usr/bin/perl -w
+
+# Prints a tcpreplay --trace-ring file, one line per record, e.g.:
+#
+#   ./scripts/trace_ring_dump.pl /tmp/trace.bin
+#
+# The file is in the byte order of the host which wrote it; see
+# src/common/trace_ring.h for the layout.
+
+use strict;
+
+my $file = shift or die("usage: $0 <trace file>\n");
+open(my $fh, '<', $file) or die("Unable to open $file: $!\n");
+binmode($fh);
+
+sub readn {
+    my ($len) = @_;
+    my $buf;
+    my $got = read($fh, $buf, $len);
+
+    die("Unable to read $file: $!\n") unless defined($got);
+    return undef if $got == 0;
+    die("$file is truncated\n") if $got != $len;
+    return $buf;
+}
+
+my $hdr = readn(16) or die("$file is empty\n");
+my ($magic, $version, $rec_size) = unpack('a8 L L', $hdr);
+die("$file is not a tcpreplay trace\n") if $magic ne 'TCPRTRC1';
+die("$file is trace version $version, only 1 is known\n") if $version != 1;
+
+while (defined(my $ring = readn(56))) {
+    my ($device, $thread, undef, $recorded, $count) = unpack('Z32 L L Q Q', $ring);
+
+    printf("# %s thread %u: %u of %u records\n", $device, $thread, $count, $recorded);
+    print("# packet deadline_ns actual_ns late_ns skip_length skip_packets len\n");
+    for (my $i = 0; $i < $count; $i++) {
+        my $rec = readn($rec_size) or die("$file is truncated\n");
+        my ($packet, $deadline, $actual, $skip_length, $skip_packets, $len) = unpack('Q6', $rec);
+        my $late = $deadline ? $actual - $deadline : 0;
+
+        print("$packet $deadline $actual $late $skip_length $skip_packets $len\n");
+    }
+}
+
+close($fh);
@@ -0,0 +1,184 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Statistics per source file, per loop and per interface for
+ * --stats-breakdown.  tcpr_replay_index() and tcpreplay_replay() mark the
+ * start and end of each file and loop, and each part adds what the
+ * totals grew by in between.
+ */
+
+#include "breakdown.h"
+#include "config.h"
+#include "common.h"
+#include "send_threads.h"
+#include <string.h>
+
+tcpr_breakdowns_t *
+breakdown_new(void)
+{
+    return safe_malloc(sizeof(tcpr_breakdowns_t));
+}
+
+void
+breakdown_free(tcpr_breakdowns_t *bd)
+{
+    safe_free(bd);
+}
+
+static void
+breakdown_add_sp(tcpr_breakdown_t *t, const sendpacket_t *sp)
+{
+    t->retries += sp->retry_eagain + sp->retry_enobufs;
+    t->sleep_ns += sp->sleep_ns;
+    t->backpressure_ns += sp->backpressure_ns;
+}
+
+/**
+ * \brief the totals of the replay so far, elapsed_ns being the time now
+ */
+static void
+breakdown_totals(tcpreplay_t *ctx, tcpr_breakdown_t *t)
+{
+    int i;
+
+    memset(t, 0, sizeof(*t));
+    t->pkts = ctx->stats.pkts_sent;
+    t->bytes = ctx->stats.bytes_sent;
+    t->failed = ctx->stats.failed;
+    t->elapsed_ns = tcpr_clock_ns();
+
+    breakdown_add_sp(t, ctx->intf1);
+    if (ctx->intf2 != NULL)
+        breakdown_add_sp(t, ctx->intf2);
+    for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+        breakdown_add_sp(t, ctx->pair_intf[i]);
+#ifdef ENABLE_SEND_THREADS
+    /* the workers keep their own until send_threads_fold() */
+    for (i = 1; ctx->threads != NULL && i < ctx->threads->cnt; i++) {
+        if (ctx->threads->workers[i].sp != NULL)
+            breakdown_add_sp(t, ctx->threads->workers[i].sp);
+    }
+#endif
+}
+
+/**
+ * \brief add to b what the totals grew by since mark
+ */
+static void
+breakdown_add(tcpreplay_t *ctx, tcpr_breakdown_t *b, const tcpr_breakdown_t *mark)
+{
+    tcpr_breakdown_t now;
+
+    breakdown_totals(ctx, &now);
+    b->passes++;
+    b->pkts += now.pkts - mark->pkts;
+    b->bytes += now.bytes - mark->bytes;
+    b->failed += now.failed - mark->failed;
+    b->retries += now.retries - mark->retries;
+    b->sleep_ns += now.sleep_ns - mark->sleep_ns;
+    b->backpressure_ns += now.backpressure_ns - mark->backpressure_ns;
+    b->elapsed_ns += now.elapsed_ns - mark->elapsed_ns;
+}
+
+void
+breakdown_source_start(tcpreplay_t *ctx)
+{
+    assert(ctx->breakdown);
+    breakdown_totals(ctx, &ctx->breakdown->source_mark);
+}
+
+void
+breakdown_source_end(tcpreplay_t *ctx, int idx)
+{
+    assert(ctx->breakdown);
+    assert(idx >= 0 && idx < MAX_FILES);
+    breakdown_add(ctx, &ctx->breakdown->sources[idx], &ctx->breakdown->source_mark);
+}
+
+void
+breakdown_loop_start(tcpreplay_t *ctx)
+{
+    assert(ctx->breakdown);
+    breakdown_totals(ctx, &ctx->breakdown->loop_mark);
+}
+
+/**
+ * \brief the loop is done, the oldest kept makes room for it if need be
+ */
+void
+breakdown_loop_end(tcpreplay_t *ctx)
+{
+    tcpr_breakdowns_t *bd = ctx->breakdown;
+    tcpr_breakdown_t *b;
+
+    assert(bd);
+
+    b = &bd->loops[bd->loop_cnt % BREAKDOWN_LOOPS];
+    memset(b, 0, sizeof(*b));
+    breakdown_add(ctx, b, &bd->loop_mark);
+    __atomic_store_n(&bd->loop_cnt, bd->loop_cnt + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief the counters of an interface over the whole run
+ */
+void
+breakdown_interface(const tcpreplay_t *ctx, const sendpacket_t *sp, tcpr_breakdown_t *b)
+{
+    memset(b, 0, sizeof(*b));
+    b->passes = 1;
+    b->pkts = sp->sent;
+    b->bytes = sp->bytes_sent;
+    b->failed = sp->failed;
+    breakdown_add_sp(b, sp);
+    if (ctx->stats.end_time_ns > ctx->stats.start_time_ns)
+        b->elapsed_ns = ctx->stats.end_time_ns - ctx->stats.start_time_ns;
+}
+
+/**
+ * \brief one line on what a part sent, its rate and where its time went
+ *
+ * The time sending is what's left of the elapsed time after sleeping and
+ * waiting for room in a full queue.
+ */
+void
+breakdown_summary(const tcpr_breakdown_t *b, char *buf, size_t len)
+{
+    double secs = (double)b->elapsed_ns / 1000000000.0;
+    double idle_ns = (double)(b->sleep_ns + b->backpressure_ns);
+    double send_pct = 0.0;
+
+    if (b->elapsed_ns > 0 && idle_ns < (double)b->elapsed_ns)
+        send_pct = 100.0 * ((double)b->elapsed_ns - idle_ns) / (double)b->elapsed_ns;
+
+    snprintf(buf,
+             len,
+             COUNTER_SPEC " packets (" COUNTER_SPEC " bytes) in %.6f sec, %.2f Mbps, %.2f pps, " COUNTER_SPEC
+             " failed, " COUNTER_SPEC " retried, sleeping %.6f sec, waiting %.6f sec, sending %.1f%%",
+             b->pkts,
+             b->bytes,
+             secs,
+             secs > 0 ? (double)b->bytes * 8 / secs / 1000000.0 : 0.0,
+             secs > 0 ? (double)b->pkts / secs : 0.0,
+             b->failed,
+             b->retries,
+             (double)b->sleep_ns / 1000000000.0,
+             (double)b->backpressure_ns / 1000000000.0,
+             send_pct);
+}
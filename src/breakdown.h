@@ -0,0 +1,59 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+/* loops kept for the report and the exporter, the last ones once there are more */
+#define BREAKDOWN_LOOPS 1024
+
+/*
+ * --stats-breakdown: what one part of the replay, a source file, a loop
+ * or an interface, sent and how long it took.  Only taken at the start
+ * and end of each part, from ctx->stats and the counters of the
+ * sendpacket_t, so the send loop doesn't change.  Aligned so the exporter
+ * reading one never shares a cache line with the replay filling the next.
+ */
+struct tcpr_breakdown_s {
+    COUNTER passes; /* times the part was sent */
+    COUNTER pkts;
+    COUNTER bytes;
+    COUNTER failed;
+    COUNTER retries; /* after EAGAIN or ENOBUFS */
+    u_int64_t sleep_ns;
+    u_int64_t backpressure_ns;
+    u_int64_t elapsed_ns;
+} __attribute__((aligned(64)));
+
+struct tcpr_breakdowns_s {
+    tcpr_breakdown_t sources[MAX_FILES]; /* with --dualfile, the pair is under the first */
+    tcpr_breakdown_t loops[BREAKDOWN_LOOPS]; /* loop n is at (n - 1) % BREAKDOWN_LOOPS */
+    COUNTER loop_cnt;                        /* loops done */
+    tcpr_breakdown_t source_mark;            /* the totals when the source started */
+    tcpr_breakdown_t loop_mark;
+};
+
+tcpr_breakdowns_t *breakdown_new(void);
+void breakdown_free(tcpr_breakdowns_t *bd);
+void breakdown_source_start(tcpreplay_t *ctx);
+void breakdown_source_end(tcpreplay_t *ctx, int idx);
+void breakdown_loop_start(tcpreplay_t *ctx);
+void breakdown_loop_end(tcpreplay_t *ctx);
+void breakdown_interface(const tcpreplay_t *ctx, const sendpacket_t *sp, tcpr_breakdown_t *b);
+void breakdown_summary(const tcpr_breakdown_t *b, char *buf, size_t len);
@@ -23,6 +23,9 @@
 #include "common.h"
 #include "tcpbridge.h"
 #include <errno.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,36 +38,161 @@ static void live_callback(u_char *, const struct pcap_pkthdr *, const u_char *);
 
 static void signal_catcher(int signo);
 
+#ifdef HAVE_PTHREAD
+#ifdef ENABLE_VERBOSE
+/* the tcpdump decoder can only be fed by one thread */
+#define BRIDGE_THREADS(options) (!(options)->verbose)
+#else
+#define BRIDGE_THREADS(options) 1
+#endif
+#endif
+
+/* which interface each source MAC lives on, see bridge.h */
+static uint64_t macsrc_table[MACSRC_HASH_SIZE];
+
 /**
- * First, prep our RB Tree which tracks where each (source)
- * MAC really lives so we don't create really nasty network
- * storms.
+ * Look up which interface the given source MAC lives on, learning that it
+ * lives on source if we haven't seen it before.  If the table is too full
+ * to learn it, the packet is treated as coming from a new MAC.
  */
-static struct macsrc_t *new_node(void);
+static u_char
+macsrc_learn(const u_char *mac, u_char source)
+{
+    uint64_t key = 0, entry, slot;
+    uint32_t hash, i;
+    int j;
+
+    for (j = 0; j < ETHER_ADDR_LEN; j++)
+        key = (key << 8) | mac[j];
+
+    entry = (key << 8) | (uint64_t)(source + 1);
+    hash = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> (64 - MACSRC_HASH_BITS));
+
+    for (i = 0; i < MACSRC_MAX_PROBE; i++) {
+        uint64_t *p = &macsrc_table[(hash + i) & (MACSRC_HASH_SIZE - 1)];
+
+        slot = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+        if (slot == 0) {
+            slot = __sync_val_compare_and_swap(p, 0, entry);
+            if (slot == 0) {
+                dbg(1, "Unable to find MAC in the table");
+                return source;
+            }
+            /* the other thread just claimed it, maybe for this MAC */
+        }
+
+        if ((slot >> 8) == key)
+            return (u_char)((slot & 0xff) - 1);
+    }
 
-RB_HEAD(macsrc_tree, macsrc_t) macsrc_root;
+    dbg(1, "MAC table is full, not learning this MAC");
+    return source;
+}
 
-static int
-rbmacsrc_comp(struct macsrc_t *a, struct macsrc_t *b)
+/**
+ * Forward packets in batches out of the interface out if neither tcpedit
+ * nor the CIDR filter have anything to do with them.  If the interface
+ * can't be opened for sendpacket_batch() we stay on the normal path.
+ */
+static void
+bridge_passthru_open(struct live_data_t *livedata, tcpedit_t *tcpedit, u_char out)
 {
-    return (memcmp(a->key, b->key, ETHER_ADDR_LEN));
+    tcpbridge_opt_t *options = livedata->options;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    const char *intf = out == PCAP_INT1 ? options->intf1 : options->intf2;
+
+    if (options->xX.cidr != NULL || !tcpedit_is_passthru(tcpedit))
+        return;
+
+    livedata->sp[out] =
+            sendpacket_try_open(intf, ebuf, out == PCAP_INT1 ? TCPR_DIR_C2S : TCPR_DIR_S2C, SP_TYPE_NONE, NULL);
+    if (livedata->sp[out] == NULL) {
+        warnx("Unable to open %s for batches, sending one packet at a time: %s", intf, ebuf);
+        return;
+    }
+
+    if (livedata->batch_buf == NULL)
+        livedata->batch_buf = safe_malloc(BRIDGE_BATCH_BYTES);
+    livedata->passthru = true;
+    dbgx(1, "Forwarding packets out of %s untouched in batches", intf);
 }
 
-RB_PROTOTYPE(macsrc_tree, macsrc_t, node, rbmacsrc_comp)
-RB_GENERATE(macsrc_tree, macsrc_t, node, rbmacsrc_comp)
+/**
+ * send the packets batched by live_callback()
+ */
+static void
+bridge_flush(struct live_data_t *livedata)
+{
+    sendpacket_t *sp = livedata->sp[livedata->batch_out];
+    COUNTER bytes = sp->bytes_sent;
+    int sent;
+
+    if (livedata->batch_cnt == 0)
+        return;
+
+    sent = sendpacket_batch(sp, livedata->batch, livedata->batch_cnt);
+    if (sent == 0)
+        errx(-1, "Unable to send packets out %s: %s", sp->device, sendpacket_geterr(sp));
+
+    /* the bridge threads share the stats */
+    __sync_add_and_fetch(&stats.bytes_sent, sp->bytes_sent - bytes);
+    __sync_add_and_fetch(&stats.pkts_sent, sent);
+    if (sent < livedata->batch_cnt)
+        __sync_add_and_fetch(&stats.failed, livedata->batch_cnt - sent);
+
+    dbgx(1, "Sent %d of %d batched packets", sent, livedata->batch_cnt);
+    livedata->batch_cnt = 0;
+    livedata->batch_used = 0;
+}
+
+static void
+bridge_passthru_close(struct live_data_t *livedata)
+{
+    int i;
+
+    for (i = PCAP_INT1; i <= PCAP_INT2; i++) {
+        if (livedata->sp[i] != NULL)
+            sendpacket_close(livedata->sp[i]);
+        livedata->sp[i] = NULL;
+    }
+
+    safe_free(livedata->batch_buf);
+    livedata->batch_buf = NULL;
+    livedata->passthru = false;
+}
 
 /**
- * create a new node... Malloc's memory
+ * receive on one interface and send everything out the other until
+ * ctrl-C or we've sent enough packets
  */
-struct macsrc_t *
-new_node(void)
+static void
+bridge_poll_loop(struct live_data_t *livedata)
 {
-    struct macsrc_t *node;
+    tcpbridge_opt_t *options = livedata->options;
+    struct pollfd poll_fd;
+    int pollresult, timeout;
 
-    node = (struct macsrc_t *)safe_malloc(sizeof(struct macsrc_t));
+    timeout = options->poll_timeout;
+    if (timeout < 0 || timeout > BRIDGE_THREAD_POLL_MS)
+        timeout = BRIDGE_THREAD_POLL_MS;
 
-    memset(node, '\0', sizeof(struct macsrc_t));
-    return (node);
+    while ((options->limit_send == 0) || (options->limit_send > stats.pkts_sent)) {
+        if (didsig)
+            break;
+
+        poll_fd.fd = pcap_fileno(livedata->pcap);
+        poll_fd.events = POLLIN;
+        poll_fd.revents = 0;
+
+        pollresult = poll(&poll_fd, 1, timeout);
+        if (pollresult > 0) {
+            pcap_dispatch(livedata->pcap, -1, (pcap_handler)live_callback, (u_char *)livedata);
+            if (livedata->passthru)
+                bridge_flush(livedata);
+        } else if (pollresult < 0 && errno != EINTR) {
+            warnx("poll() error: %s", strerror(errno));
+        }
+    }
 }
 
 /**
@@ -80,19 +208,31 @@ do_bridge_unidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
     assert(options);
     assert(tcpedit);
 
+    memset(&livedata, 0, sizeof(livedata));
     livedata.tcpedit = tcpedit;
     livedata.source = PCAP_INT1;
     livedata.pcap = options->pcap1;
     livedata.options = options;
 
-    if ((retcode = pcap_loop(options->pcap1, (int)options->limit_send, live_callback, (u_char *)&livedata)) < 0) {
+    /* batches have to be flushed once libpcap has nothing more for us */
+    bridge_passthru_open(&livedata, tcpedit, PCAP_INT2);
+    if (livedata.passthru) {
+        bridge_poll_loop(&livedata);
+    } else if ((retcode = pcap_loop(options->pcap1, (int)options->limit_send, live_callback, (u_char *)&livedata)) <
+               0) {
         warnx("Error in %d pcap_loop(): %s", retcode, pcap_geterr(options->pcap1));
     }
+
+    bridge_passthru_close(&livedata);
+    safe_free(livedata.pktdata);
 }
 
 /**
  * main loop for bridging in both directions.  Since we dealing with two handles
  * we need to poll() on them which isn't the most efficient
+ *
+ * It's also the loop of the delay line, in either direction or both, as
+ * it has to keep sending the packets due while it waits for new ones.
  */
 static void
 do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
@@ -104,8 +244,20 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
     assert(options);
     assert(tcpedit);
 
+    memset(&livedata, 0, sizeof(livedata));
     livedata.tcpedit = tcpedit;
     livedata.options = options;
+    if (options->delay_ns > 0) {
+        livedata.delay = delayline_new(options);
+    } else {
+        bridge_passthru_open(&livedata, tcpedit, PCAP_INT1);
+        if (livedata.passthru)
+            bridge_passthru_open(&livedata, tcpedit, PCAP_INT2);
+    }
+
+    /* both or neither, a batch only goes one way */
+    if (livedata.passthru && (livedata.sp[PCAP_INT1] == NULL || livedata.sp[PCAP_INT2] == NULL))
+        bridge_passthru_close(&livedata);
 
     /*
      * loop until ctrl-C or we've sent enough packets
@@ -128,7 +280,15 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
         polls[PCAP_INT2].fd = pcap_fileno(options->pcap2);
 
         timeout = options->poll_timeout;
-        pollcount = 2;
+        pollcount = options->unidir ? 1 : 2;
+
+        /* send what came due, and wake up for the next that does */
+        if (livedata.delay != NULL) {
+            u_int64_t now = tcpr_clock_ns();
+
+            delayline_run(livedata.delay, now);
+            timeout = delayline_timeout(livedata.delay, now, timeout);
+        }
 
         /* poll for a packet on the two interfaces */
         pollresult = poll(polls, pollcount, timeout);
@@ -143,6 +303,8 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
                 livedata.source = PCAP_INT1;
                 livedata.pcap = options->pcap1;
                 pcap_dispatch(options->pcap1, -1, (pcap_handler)live_callback, (u_char *)&livedata);
+                if (livedata.passthru)
+                    bridge_flush(&livedata);
             }
 
             /* check the other interface?? */
@@ -151,6 +313,8 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
                 livedata.source = PCAP_INT2;
                 livedata.pcap = options->pcap2;
                 pcap_dispatch(options->pcap2, -1, (pcap_handler)live_callback, (u_char *)&livedata);
+                if (livedata.passthru)
+                    bridge_flush(&livedata);
             }
 
         } else if (pollresult == 0) {
@@ -164,8 +328,75 @@ do_bridge_bidirectional(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
         /* go back to the top of the loop */
     }
 
+    if (livedata.delay != NULL) {
+        if (livedata.delay->dropped > 0 || livedata.delay->pending > 0)
+            notice("Delay line dropped " COUNTER_SPEC " packets when full and %u left at the end",
+                   livedata.delay->dropped,
+                   livedata.delay->pending);
+        delayline_free(livedata.delay);
+    }
+
+    bridge_passthru_close(&livedata);
+    safe_free(livedata.pktdata);
 } /* do_bridge_bidirectional() */
 
+#ifdef HAVE_PTHREAD
+/**
+ * bridge thread: one direction, see bridge_poll_loop()
+ */
+static void *
+bridge_thread(void *arg)
+{
+    bridge_poll_loop((struct live_data_t *)arg);
+    return NULL;
+}
+
+/**
+ * main loop for bridging in both directions with one thread per direction.
+ * Each thread has its own tcpedit context; only the MAC table and the stats
+ * are shared between them.
+ */
+static void
+do_bridge_threads(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
+{
+    struct live_data_t livedata[2];
+    tcpedit_t *tcpedit2 = NULL;
+    int i, err;
+
+    assert(options);
+    assert(tcpedit);
+
+    if (tcpedit_init(&tcpedit2, pcap_datalink(options->pcap1)) < 0)
+        errx(-1, "Error initializing tcpedit for %s: %s", options->intf2, tcpedit_geterr(tcpedit2));
+
+    if (tcpedit_post_args(tcpedit2) < 0)
+        errx(-1, "Unable to parse args for %s: %s", options->intf2, tcpedit_geterr(tcpedit2));
+
+    if (tcpedit_validate(tcpedit2) < 0)
+        errx(-1, "Unable to edit packets for %s: %s", options->intf2, tcpedit_geterr(tcpedit2));
+
+    memset(livedata, 0, sizeof(livedata));
+    for (i = PCAP_INT1; i <= PCAP_INT2; i++) {
+        livedata[i].options = options;
+        livedata[i].source = (u_char)i;
+        livedata[i].pcap = i == PCAP_INT1 ? options->pcap1 : options->pcap2;
+        livedata[i].tcpedit = i == PCAP_INT1 ? tcpedit : tcpedit2;
+        bridge_passthru_open(&livedata[i], livedata[i].tcpedit, i == PCAP_INT1 ? PCAP_INT2 : PCAP_INT1);
+
+        if ((err = pthread_create(&livedata[i].thread, NULL, bridge_thread, &livedata[i])) != 0)
+            errx(-1, "Unable to create bridge thread: %s", strerror(err));
+    }
+
+    for (i = PCAP_INT1; i <= PCAP_INT2; i++) {
+        pthread_join(livedata[i].thread, NULL);
+        bridge_passthru_close(&livedata[i]);
+        safe_free(livedata[i].pktdata);
+    }
+
+    tcpedit_close(&tcpedit2);
+} /* do_bridge_threads() */
+#endif
+
 /**
  * Main entry point to bridging.  Does some initial setup and then calls the
  * correct loop (unidirectional or bidirectional)
@@ -204,14 +435,19 @@ do_bridge(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
     didsig = 0;
     (void)signal(SIGINT, signal_catcher);
 
-    if (options->unidir == 1) {
+    if (options->delay_ns > 0) {
+        do_bridge_bidirectional(options, tcpedit);
+    } else if (options->unidir == 1) {
         do_bridge_unidirectional(options, tcpedit);
+#ifdef HAVE_PTHREAD
+    } else if (BRIDGE_THREADS(options)) {
+        do_bridge_threads(options, tcpedit);
+#endif
     } else {
         do_bridge_bidirectional(options, tcpedit);
     }
 
-    if (gettimeofday(&stats.end_time, NULL) < 0)
-        errx(-1, "gettimeofday() failed: %s", strerror(errno));
+    stats.end_time_ns = tcpr_clock_ns();
     packet_stats(&stats);
 }
 
@@ -219,6 +455,12 @@ do_bridge(tcpbridge_opt_t *options, tcpedit_t *tcpedit)
  * This is the callback we use with pcap_dispatch to process
  * each packet received by libpcap on the two interfaces.
  * Need to return > 0 to denote success
+ *
+ * Packets are looked at and, unless tcpedit may grow them, edited in place
+ * in libpcap's buffer (the RX ring frame on Linux).  Others are copied
+ * into the per-direction buffer only once we know they will be sent.
+ * With nothing to edit or filter, they only go through the MAC checks
+ * and are batched, see BRIDGE_BATCH_CNT.
  */
 static void
 live_callback(u_char *usr_data, const struct pcap_pkthdr *const_pkthdr, const u_char *nextpkt)
@@ -229,29 +471,17 @@ live_callback(u_char *usr_data, const struct pcap_pkthdr *const_pkthdr, const u_
     ipv4_hdr_t *ip_hdr = NULL;
     ipv6_hdr_t *ip6_hdr = NULL;
     pcap_t *send = NULL;
-    static u_char *pktdata = NULL; /* full packet buffer */
+    u_char *pktdata;
+    const u_char *srcmac;
     int cache_mode;
-    static unsigned long packetnum = 0;
-    struct macsrc_t *node, finder; /* rb tree nodes */
-#ifdef DEBUG
-    u_char dstmac[ETHER_ADDR_LEN];
-#endif
+    u_char source;
+    bool copied;
     u_int16_t l2proto;
 
-    packetnum++;
-    dbgx(2, "packet %lu caplen %d", packetnum, pkthdr->caplen);
-
-    /* only malloc the first time */
-    if (pktdata == NULL) {
-        /* create packet buffers */
-        pktdata = (u_char *)safe_malloc(MAXPACKET);
-    } else {
-        /* zero out the old packet info */
-        memset(pktdata, '\0', MAXPACKET);
-    }
+    livedata->packetnum++;
+    dbgx(2, "packet " COUNTER_SPEC " caplen %d", livedata->packetnum, pkthdr->caplen);
 
-    /* copy the packet to our buffer */
-    memcpy(pktdata, nextpkt, pkthdr->caplen);
+    pktdata = (u_char *)nextpkt;
 
 #ifdef ENABLE_VERBOSE
     /* decode packet? */
@@ -259,36 +489,23 @@ live_callback(u_char *usr_data, const struct pcap_pkthdr *const_pkthdr, const u_
         tcpdump_print(livedata->options->tcpdump, pkthdr, nextpkt);
 #endif
 
-    /* lookup our source MAC in the tree */
-    memcpy(&finder.key, &pktdata[ETHER_ADDR_LEN], ETHER_ADDR_LEN);
-#ifdef DEBUG
-    memcpy(&dstmac, pktdata, ETHER_ADDR_LEN);
-    dbgx(1, "SRC MAC: " MAC_FORMAT "\tDST MAC: " MAC_FORMAT, MAC_STR(finder.key), MAC_STR(dstmac));
-#endif
+    /* lookup our source MAC in the table */
+    srcmac = &pktdata[ETHER_ADDR_LEN];
+    dbgx(1, "SRC MAC: " MAC_FORMAT "\tDST MAC: " MAC_FORMAT, MAC_STR(srcmac), MAC_STR(pktdata));
 
     /* first, is this a packet sent locally?  If so, ignore it */
-    if ((memcmp(livedata->options->intf1_mac, &finder.key, ETHER_ADDR_LEN)) == 0) {
+    if ((memcmp(livedata->options->intf1_mac, srcmac, ETHER_ADDR_LEN)) == 0) {
         dbgx(1, "Packet matches the MAC of %s, skipping.", livedata->options->intf1);
         return;
-    } else if ((memcmp(livedata->options->intf2_mac, &finder.key, ETHER_ADDR_LEN)) == 0) {
+    } else if ((memcmp(livedata->options->intf2_mac, srcmac, ETHER_ADDR_LEN)) == 0) {
         dbgx(1, "Packet matches the MAC of %s, skipping.", livedata->options->intf2);
         return;
     }
 
-    node = RB_FIND(macsrc_tree, &macsrc_root, &finder);
-
-    /* if we can't find the node, build a new one */
-    if (node == NULL) {
-        dbg(1, "Unable to find MAC in the tree");
-        node = new_node();
-        node->source = livedata->source;
-        memcpy(&node->key, &finder.key, ETHER_ADDR_LEN);
-        RB_INSERT(macsrc_tree, &macsrc_root, node);
-    }
-
-    /* otherwise compare sources */
-    else if (node->source != livedata->source) {
-        dbg(1, "Found the dest MAC in the tree and it doesn't match this source NIC... skipping packet");
+    /* learn the MAC if it's new, otherwise compare sources */
+    source = macsrc_learn(srcmac, livedata->source);
+    if (source != livedata->source) {
+        dbg(1, "Found the dest MAC in the table and it doesn't match this source NIC... skipping packet");
         /*
          * IMPORTANT!!!
          * Never send a packet out the same interface we sourced it on!
@@ -296,6 +513,33 @@ live_callback(u_char *usr_data, const struct pcap_pkthdr *const_pkthdr, const u_
         return;
     }
 
+    if (livedata->passthru) {
+        u_char out = source == PCAP_INT1 ? PCAP_INT2 : PCAP_INT1;
+        sendpacket_pkt_t *pkt;
+
+        /* don't queue more than --limit lets us send */
+        if (livedata->options->limit_send > 0 &&
+            stats.pkts_sent + (COUNTER)livedata->batch_cnt >= livedata->options->limit_send)
+            return;
+
+        if (livedata->batch_cnt == BRIDGE_BATCH_CNT || livedata->batch_used + pkthdr->caplen > BRIDGE_BATCH_BYTES ||
+            (livedata->batch_cnt > 0 && livedata->batch_out != out))
+            bridge_flush(livedata);
+
+        /* libpcap may hand its buffer back to the kernel once we return */
+        memcpy(livedata->batch_buf + livedata->batch_used, nextpkt, pkthdr->caplen);
+        livedata->batch_hdr[livedata->batch_cnt] = *pkthdr;
+
+        pkt = &livedata->batch[livedata->batch_cnt++];
+        memset(pkt, 0, sizeof(*pkt));
+        pkt->data = livedata->batch_buf + livedata->batch_used;
+        pkt->len = pkthdr->caplen;
+        pkt->pkthdr = &livedata->batch_hdr[livedata->batch_cnt - 1];
+        livedata->batch_used += pkthdr->caplen;
+        livedata->batch_out = out;
+        return;
+    }
+
     /* what is our cache mode? */
     cache_mode = livedata->source == PCAP_INT1 ? TCPR_DIR_C2S : TCPR_DIR_S2C;
 
@@ -328,14 +572,37 @@ live_callback(u_char *usr_data, const struct pcap_pkthdr *const_pkthdr, const u_
         }
     }
 
+    copied = tcpedit_get_growth(livedata->tcpedit) != 0;
+    if (copied) {
+        /*
+         * No need to clear the rest of the buffer, tcpedit writes
+         * everything it adds (--fixlen=pad zeroes its own padding).
+         * --fixlen=pad may also have shrunk the buffer last time.
+         */
+        if (livedata->pktdata_size < pkthdr->caplen + PACKET_HEADROOM) {
+            livedata->pktdata = (u_char *)safe_realloc(livedata->pktdata, MAXPACKET + PACKET_HEADROOM);
+            livedata->pktdata_size = MAXPACKET + PACKET_HEADROOM;
+        }
+
+        /* copy the packet to our buffer */
+        memcpy(livedata->pktdata, nextpkt, pkthdr->caplen);
+        pktdata = livedata->pktdata;
+    }
+
     if (tcpedit_packet(livedata->tcpedit, &pkthdr, &pktdata, cache_mode) < 0)
         return;
 
+    /* --fixlen=pad may have reallocated it */
+    if (copied && pktdata != livedata->pktdata) {
+        livedata->pktdata = pktdata;
+        livedata->pktdata_size = pkthdr->caplen + PACKET_HEADROOM;
+    }
+
     /*
      * send packets out the OTHER interface
      * and update the dst mac if necessary
      */
-    switch (node->source) {
+    switch (source) {
     case PCAP_INT1:
         dbgx(2, "Packet source was %s... sending out on %s", livedata->options->intf1, livedata->options->intf2);
         send = livedata->options->pcap2;
@@ -347,7 +614,12 @@ live_callback(u_char *usr_data, const struct pcap_pkthdr *const_pkthdr, const u_
         break;
 
     default:
-        errx(-1, "wtf?  our node->source != PCAP_INT1 and != PCAP_INT2: %c", node->source);
+        errx(-1, "wtf?  our source != PCAP_INT1 and != PCAP_INT2: %c", source);
+    }
+
+    if (livedata->delay != NULL) {
+        delayline_queue(livedata->delay, source == PCAP_INT1 ? PCAP_INT2 : PCAP_INT1, pkthdr, pktdata);
+        return;
     }
 
     /*
@@ -359,8 +631,9 @@ live_callback(u_char *usr_data, const struct pcap_pkthdr *const_pkthdr, const u_
              send == livedata->options->pcap1 ? livedata->options->intf1 : livedata->options->intf2,
              pcap_geterr(send));
 
-    stats.bytes_sent += pkthdr->caplen;
-    stats.pkts_sent++;
+    /* the bridge threads share the stats */
+    __sync_add_and_fetch(&stats.bytes_sent, pkthdr->caplen);
+    __sync_add_and_fetch(&stats.pkts_sent, 1);
 
     dbgx(1, "Sent packet " COUNTER_SPEC, stats.pkts_sent);
 } /* live_callback() */
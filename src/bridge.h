@@ -22,25 +22,39 @@
 
 #include "config.h"
 #include "tcpbridge.h"
-#include <lib/tree.h>
+#include "delayline.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <tcpedit/tcpedit.h>
 
 /*
- * RBTree node object for tracking which side of tcpreplay where
- * each source MAC address lives
+ * Hash table tracking which side of tcpbridge each source MAC address
+ * lives on.  Each slot holds the MAC in the upper 48 bits and the
+ * interface + 1 in the low byte, 0 being an empty slot.  Entries are only
+ * ever added and claimed with a compare and swap, so both bridge threads
+ * can share the table without a lock.
  */
-struct macsrc_t {
-    RB_ENTRY(macsrc_t) node;
-    u_char key[ETHER_ADDR_LEN];
-    u_char source;    /* interface device name we first saw the source MAC */
-    sendpacket_t *sp; /* sendpacket handle to send packets out */
-};
+#define MACSRC_HASH_BITS 16
+#define MACSRC_HASH_SIZE (1 << MACSRC_HASH_BITS)
+#define MACSRC_MAX_PROBE 64 /* slots to try before giving up on learning a MAC */
 
 /* pri and secondary pcap interfaces */
 #define PCAP_INT1 0
 #define PCAP_INT2 1
 
-/* our custom pcap_dispatch handler user struct */
+/* poll() timeout of the bridge threads, so they notice Ctrl-C and --limit */
+#define BRIDGE_THREAD_POLL_MS 100
+
+/*
+ * With no edits and no CIDR filter, packets are copied as they are into a
+ * batch which goes out in one sendpacket_batch() once libpcap has handed
+ * us all it had, or once it's full
+ */
+#define BRIDGE_BATCH_CNT SENDPACKET_BATCH_MAX
+#define BRIDGE_BATCH_BYTES (1 << 20)
+
+/* our custom pcap_dispatch handler user struct, one per direction */
 struct live_data_t {
     u_int32_t linktype;
     int l2enabled;
@@ -50,7 +64,21 @@ struct live_data_t {
     pcap_t *pcap;
     tcpedit_t *tcpedit;
     tcpbridge_opt_t *options;
+    u_char *pktdata;      /* copy of the packet when tcpedit may grow it */
+    size_t pktdata_size;
+    COUNTER packetnum;
+    bool passthru;        /* forward packets untouched in batches, see BRIDGE_BATCH_CNT */
+    sendpacket_t *sp[2];  /* per interface a batch may go out of */
+    u_char batch_out;     /* which one the batch goes out of */
+    u_char *batch_buf;    /* BRIDGE_BATCH_BYTES the batched packets are copied into */
+    size_t batch_used;
+    int batch_cnt;
+    sendpacket_pkt_t batch[BRIDGE_BATCH_CNT];
+    struct pcap_pkthdr batch_hdr[BRIDGE_BATCH_CNT];
+    delayline_t *delay;   /* --delay: packets go here rather than out */
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
 };
 
-void rbinit(void);
 void do_bridge(tcpbridge_opt_t *, tcpedit_t *);
@@ -0,0 +1,567 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_PRELOAD /* see memstat.h */
+
+#include "cache_image.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/**
+ * \brief get the path of the cache image of pcapfile.  Free with safe_free()
+ */
+char *
+cache_image_path(const char *pcapfile)
+{
+    size_t len;
+    char *path;
+
+    assert(pcapfile);
+
+    len = strlen(pcapfile) + sizeof(CACHE_IMAGE_SUFFIX);
+    path = (char *)safe_malloc(len);
+    snprintf(path, len, "%s%s", pcapfile, CACHE_IMAGE_SUFFIX);
+    return path;
+}
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#ifdef HAVE_FLOCK
+#include <sys/file.h>
+#endif
+
+/* descriptors are written this many at a time */
+#define CACHE_IMAGE_CHUNK 4096
+/* packet data starts on a page of its own */
+#define CACHE_IMAGE_ALIGN 4096
+
+/* an arena and where its data goes in the image */
+typedef struct cache_image_arena_s {
+    const packet_arena_t *arena;
+    u_int64_t offset;
+} cache_image_arena_t;
+
+/* the CACHE_IMAGE_F_SHAPE flags the options call for */
+static u_int32_t
+cache_image_shape(const tcpreplay_opt_t *options)
+{
+    u_int32_t flags = 0;
+
+    if (options->unique_ip)
+        flags |= CACHE_IMAGE_F_UNIQUE_IP;
+    if (options->gen_field_cnt != 0)
+        flags |= CACHE_IMAGE_F_GEN_FIELD;
+    if (options->gso)
+        flags |= CACHE_IMAGE_F_GSO;
+    if (options->preload_dedup)
+        flags |= CACHE_IMAGE_F_DEDUP;
+
+    return flags;
+}
+
+/* bytes of a cached packet stored in its arena */
+static inline u_int64_t
+cache_image_stored(const file_cache_t *file_cache, const packet_cache_t *cached_packet)
+{
+    if (file_cache->snaplen != 0)
+        return min(cached_packet->pkthdr.caplen, file_cache->snaplen);
+
+    return cached_packet->pkthdr.caplen;
+}
+
+static int
+cache_image_write_all(int fd, const void *buf, size_t len)
+{
+    const u_char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = write(fd, p, len);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= (size_t)ret;
+    }
+
+    return 0;
+}
+
+static int
+cache_image_arena_cmp(const void *a, const void *b)
+{
+    const u_char *x = ((const cache_image_arena_t *)a)->arena->data;
+    const u_char *y = ((const cache_image_arena_t *)b)->arena->data;
+
+    return x < y ? -1 : x > y;
+}
+
+/* offset in the image of packet data in one of the arenas, -1 if in none */
+static int64_t
+cache_image_offset(const cache_image_arena_t *arenas, int cnt, const u_char *pktdata)
+{
+    int lo = 0, hi = cnt;
+
+    /* the last arena starting at or before pktdata */
+    while (hi - lo > 1) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (arenas[mid].arena->data <= pktdata)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if (cnt == 0 || pktdata < arenas[lo].arena->data || pktdata >= arenas[lo].arena->data + arenas[lo].arena->used)
+        return -1;
+
+    return (int64_t)(arenas[lo].offset + (u_int64_t)(pktdata - arenas[lo].arena->data));
+}
+
+/*
+ * Processes preloading the same pcap at once take turns, so the first
+ * builds the image and the rest map it.  The lock is on the pcap itself,
+ * which is always there to be opened.  When another holder can't be
+ * waited for, returns -1 and the cache is built without an image.
+ */
+static int
+cache_image_lock(file_cache_t *file_cache, const char *pcapfile, bool wait)
+{
+#ifdef HAVE_FLOCK
+    int fd;
+
+    if ((fd = open(pcapfile, O_RDONLY)) < 0)
+        return -1;
+
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno != EWOULDBLOCK || !wait) {
+            close(fd);
+            return -1;
+        }
+
+        notice("Waiting for another process to write the cache image of %s", pcapfile);
+        while (flock(fd, LOCK_EX) < 0) {
+            if (errno != EINTR) {
+                close(fd);
+                return -1;
+            }
+        }
+    }
+
+    file_cache->image_lock = fd;
+#else
+    (void)pcapfile;
+    (void)wait;
+    file_cache->image_lock = -1;
+#endif
+    file_cache->image_locked = true;
+    return 0;
+}
+
+static void
+cache_image_unlock(file_cache_t *file_cache)
+{
+    if (!file_cache->image_locked)
+        return;
+
+    if (file_cache->image_lock >= 0)
+        close(file_cache->image_lock);
+    file_cache->image_locked = false;
+}
+
+/*
+ * Point the cache at the image just written, in place of the arenas,
+ * so the process which built it shares its pages with those mapping it
+ */
+static void
+cache_image_adopt(file_cache_t *file_cache, const cache_image_arena_t *arenas, int cnt, int fd, const cache_image_hdr_t *hdr)
+{
+    size_t size = (size_t)(hdr->data_offset + hdr->data_size);
+    packet_arena_t *arena, *next;
+    u_char *map, *data;
+    COUNTER i;
+
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        dbgx(1, "Keeping the private cache, unable to mmap the image: %s", strerror(errno));
+        return;
+    }
+
+    data = map + hdr->data_offset;
+    for (i = 0; i < file_cache->packet_cnt; i++) {
+        packet_cache_t *cached_packet = &file_cache->packet_cache[i];
+
+        cached_packet->pktdata = data + cache_image_offset(arenas, cnt, cached_packet->pktdata);
+    }
+
+    arena = file_cache->arena;
+    while (arena != NULL) {
+        next = arena->next;
+        sendpacket_unregister_mem(arena->data, arena->size);
+        tcpr_huge_free(arena->data, arena->size);
+        tcpr_mem_unmap(TCPR_MEM_PRELOAD, arena->size);
+        safe_free(arena);
+        arena = next;
+    }
+    file_cache->arena = NULL;
+    file_cache->image = map;
+    file_cache->image_size = size;
+    tcpr_mem_map(TCPR_MEM_PRELOAD, size);
+}
+
+/**
+ * \brief write the preloaded cache of file idx to its image
+ *
+ * The image is written under a temporary name and renamed into place,
+ * so a run reading it never sees half an image, and the cache is then
+ * moved onto it.  Only done when cache_image_load() got the build lock,
+ * which is released here.  Returns 0 on success, -1 on error
+ */
+int
+cache_image_save(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *file_cache = &options->file_cache[idx];
+    const char *pcapfile = options->sources[idx].filename;
+    cache_image_arena_t *arenas = NULL;
+    packet_cache_t *chunk = NULL;
+    const packet_arena_t *arena;
+    cache_image_hdr_t hdr;
+    struct stat statbuf;
+    u_int64_t offset = 0;
+    char *path, *tmp;
+    size_t len;
+    COUNTER i;
+    int cnt = 0, n, j, fd, ret = -1;
+
+    /* packets in a mapped file are in no arena */
+    if (!file_cache->image_locked || file_cache->mmap != NULL) {
+        cache_image_unlock(file_cache);
+        return -1;
+    }
+
+    if (stat(pcapfile, &statbuf) < 0) {
+        warnx("Unable to write cache image: %s: %s", pcapfile, strerror(errno));
+        cache_image_unlock(file_cache);
+        return -1;
+    }
+
+    /* another process may still be writing an image of another run's options */
+    path = cache_image_path(pcapfile);
+    len = strlen(path) + sizeof(".tmp.") + 20;
+    tmp = (char *)safe_malloc(len);
+    snprintf(tmp, len, "%s.tmp.%ld", path, (long)getpid());
+
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        warnx("Unable to write cache image %s: %s", tmp, strerror(errno));
+        goto out;
+    }
+
+    for (arena = file_cache->arena; arena != NULL; arena = arena->next)
+        cnt++;
+    if (cnt > 0)
+        arenas = (cache_image_arena_t *)safe_malloc(cnt * sizeof(cache_image_arena_t));
+    for (n = 0, arena = file_cache->arena; arena != NULL; arena = arena->next)
+        arenas[n++].arena = arena;
+    qsort(arenas, cnt, sizeof(cache_image_arena_t), cache_image_arena_cmp);
+    for (n = 0; n < cnt; n++) {
+        arenas[n].offset = offset;
+        offset += arenas[n].arena->used;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, CACHE_IMAGE_MAGIC, sizeof(hdr.magic));
+    strncpy(hdr.version, CACHE_IMAGE_VERSION, sizeof(hdr.version));
+    hdr.byte_order = CACHE_IMAGE_BYTE_ORDER;
+    hdr.desc_size = sizeof(packet_cache_t);
+    hdr.flags = cache_image_shape(options);
+    if (file_cache->nsec)
+        hdr.flags |= CACHE_IMAGE_F_NSEC;
+    hdr.pcap_size = (u_int64_t)statbuf.st_size;
+    hdr.pcap_mtime = (u_int64_t)statbuf.st_mtime;
+    hdr.dlt = file_cache->dlt;
+    hdr.snaplen = file_cache->snaplen;
+    hdr.pad_max = file_cache->pad_max;
+    hdr.packet_cnt = file_cache->packet_cnt;
+    hdr.data_offset = sizeof(hdr) + file_cache->packet_cnt * sizeof(packet_cache_t);
+    hdr.data_offset = (hdr.data_offset + CACHE_IMAGE_ALIGN - 1) & ~((u_int64_t)CACHE_IMAGE_ALIGN - 1);
+    hdr.data_size = offset;
+    hdr.dedup_bytes = file_cache->dedup_bytes;
+    hdr.dedup_saved = file_cache->dedup_saved;
+    hdr.gso_packets = file_cache->gso_packets;
+    hdr.gso_frames = file_cache->gso_frames;
+    if (options->flow_stats) {
+        hdr.flags |= CACHE_IMAGE_F_FLOW_STATS;
+        hdr.flow_expiry = options->flow_expiry;
+
+        /* with a single file, the flow counts so far are its own */
+        if (options->source_cnt == 1) {
+            hdr.flags |= CACHE_IMAGE_F_FLOWS_ALONE;
+            hdr.flows = ctx->stats.flows;
+            hdr.flows_unique = ctx->stats.flows_unique;
+            hdr.flows_expired = ctx->stats.flows_expired;
+            hdr.flow_packets = ctx->stats.flow_packets;
+            hdr.flow_non_flow_packets = ctx->stats.flow_non_flow_packets;
+            hdr.flows_invalid_packets = ctx->stats.flows_invalid_packets;
+        }
+    }
+
+    if (cache_image_write_all(fd, &hdr, sizeof(hdr)) < 0)
+        goto fail;
+
+    chunk = (packet_cache_t *)safe_malloc(CACHE_IMAGE_CHUNK * sizeof(packet_cache_t));
+    for (i = 0; i < file_cache->packet_cnt; i += n) {
+        n = (int)min(file_cache->packet_cnt - i, (COUNTER)CACHE_IMAGE_CHUNK);
+        memcpy(chunk, &file_cache->packet_cache[i], n * sizeof(packet_cache_t));
+        for (j = 0; j < n; j++) {
+            int64_t pkt_offset = cache_image_offset(arenas, cnt, chunk[j].pktdata);
+
+            if (pkt_offset < 0) {
+                warnx("Unable to write cache image %s: packet " COUNTER_SPEC " is not in the cache", path, i + j + 1);
+                goto abandon;
+            }
+            chunk[j].pktdata = (u_char *)(uintptr_t)pkt_offset;
+        }
+
+        if (cache_image_write_all(fd, chunk, n * sizeof(packet_cache_t)) < 0)
+            goto fail;
+    }
+
+    if (lseek(fd, (off_t)hdr.data_offset, SEEK_SET) < 0)
+        goto fail;
+
+    for (n = 0; n < cnt; n++) {
+        if (cache_image_write_all(fd, arenas[n].arena->data, arenas[n].arena->used) < 0)
+            goto fail;
+    }
+
+    if (close(fd) < 0) {
+        fd = -1;
+        goto fail;
+    }
+    fd = -1;
+
+    if (rename(tmp, path) < 0)
+        goto fail;
+
+    dbgx(1, "Wrote cache image %s: " COUNTER_SPEC " packets", path, file_cache->packet_cnt);
+    if ((fd = open(path, O_RDONLY)) >= 0) {
+        cache_image_adopt(file_cache, arenas, cnt, fd, &hdr);
+        close(fd);
+        fd = -1;
+    }
+    ret = 0;
+    goto out;
+
+fail:
+    warnx("Unable to write cache image %s: %s", tmp, strerror(errno));
+abandon:
+    if (fd >= 0)
+        close(fd);
+    unlink(tmp);
+out:
+    cache_image_unlock(file_cache);
+    safe_free(chunk);
+    safe_free(arenas);
+    safe_free(tmp);
+    safe_free(path);
+    return ret;
+}
+
+/**
+ * \brief load the preloaded cache of file idx from its image, if there
+ * is an up to date one built with the same options
+ *
+ * The image is mapped copy on write, so what the cached send paths
+ * change in place stays private to this run.  The flow counts of a
+ * single file come from the image; file_cache->image_flows is left
+ * false when they still have to be counted from the cache.
+ *
+ * With wait, an image another process is writing is waited for.  Without
+ * an image, the build lock is kept for cache_image_save() if it was had.
+ *
+ * Returns 0 with the cache loaded, -1 if there is no usable image
+ */
+int
+cache_image_load(tcpreplay_t *ctx, int idx, bool wait)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *file_cache = &options->file_cache[idx];
+    const char *pcapfile = options->sources[idx].filename;
+    struct stat statbuf, pcapstat;
+    cache_image_hdr_t hdr;
+    u_char *map = MAP_FAILED;
+    u_char *data;
+    char *path;
+    COUNTER i;
+    int fd, ret = -1;
+
+    if (strcmp(pcapfile, "-") == 0 || stat(pcapfile, &pcapstat) < 0)
+        return -1;
+
+    if (cache_image_lock(file_cache, pcapfile, wait) < 0)
+        dbgx(1, "Not writing a cache image of %s, another process is", pcapfile);
+
+    path = cache_image_path(pcapfile);
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        safe_free(path);
+        return -1;
+    }
+
+    if (fstat(fd, &statbuf) < 0 || read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, CACHE_IMAGE_MAGIC, sizeof(CACHE_IMAGE_MAGIC)) != 0 ||
+        strtol(hdr.version, NULL, 10) != strtol(CACHE_IMAGE_VERSION, NULL, 10) ||
+        hdr.byte_order != CACHE_IMAGE_BYTE_ORDER || hdr.desc_size != sizeof(packet_cache_t)) {
+        notice("Rebuilding cache image %s: not an image of this version", path);
+        goto out;
+    }
+
+    if (hdr.pcap_size != (u_int64_t)pcapstat.st_size || hdr.pcap_mtime != (u_int64_t)pcapstat.st_mtime) {
+        notice("Rebuilding cache image %s: out of date", path);
+        goto out;
+    }
+
+    if ((hdr.flags & CACHE_IMAGE_F_SHAPE) != cache_image_shape(options) || hdr.snaplen != options->preload_snaplen) {
+        notice("Rebuilding cache image %s: built with other options", path);
+        goto out;
+    }
+
+    if (hdr.packet_cnt > (u_int64_t)statbuf.st_size / sizeof(packet_cache_t) ||
+        hdr.data_offset < sizeof(hdr) + hdr.packet_cnt * sizeof(packet_cache_t) ||
+        hdr.data_offset % CACHE_IMAGE_ALIGN != 0 || hdr.data_offset + hdr.data_size != (u_int64_t)statbuf.st_size) {
+        warnx("Ignoring cache image %s: invalid header", path);
+        goto out;
+    }
+
+    map = mmap(NULL, (size_t)statbuf.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        warnx("Ignoring cache image %s: unable to mmap: %s", path, strerror(errno));
+        goto out;
+    }
+#ifdef HAVE_MADVISE
+    madvise(map, (size_t)statbuf.st_size, MADV_WILLNEED);
+#endif
+
+    file_cache->snaplen = hdr.snaplen;
+    data = map + hdr.data_offset;
+    if (hdr.packet_cnt > 0) {
+        file_cache->packet_cache = (packet_cache_t *)safe_malloc(hdr.packet_cnt * sizeof(packet_cache_t));
+        memcpy(file_cache->packet_cache, map + sizeof(hdr), hdr.packet_cnt * sizeof(packet_cache_t));
+    }
+
+    for (i = 0; i < hdr.packet_cnt; i++) {
+        packet_cache_t *cached_packet = &file_cache->packet_cache[i];
+        u_int64_t offset = (u_int64_t)(uintptr_t)cached_packet->pktdata;
+
+        if (offset > hdr.data_size || cache_image_stored(file_cache, cached_packet) > hdr.data_size - offset) {
+            warnx("Ignoring cache image %s: packet " COUNTER_SPEC " is out of bounds", path, i + 1);
+            safe_free(file_cache->packet_cache);
+            file_cache->packet_cache = NULL;
+            goto out;
+        }
+        cached_packet->pktdata = data + offset;
+    }
+
+    file_cache->packet_cnt = hdr.packet_cnt;
+    file_cache->packet_max = hdr.packet_cnt;
+    file_cache->dlt = hdr.dlt;
+    file_cache->nsec = (hdr.flags & CACHE_IMAGE_F_NSEC) != 0;
+    file_cache->pad_max = hdr.pad_max;
+    file_cache->dedup_bytes = hdr.dedup_bytes;
+    file_cache->dedup_saved = hdr.dedup_saved;
+    file_cache->gso_packets = hdr.gso_packets;
+    file_cache->gso_frames = hdr.gso_frames;
+    file_cache->image = map;
+    file_cache->image_size = (size_t)statbuf.st_size;
+    tcpr_mem_map(TCPR_MEM_PRELOAD, file_cache->image_size);
+    map = MAP_FAILED;
+
+    /* flows are numbered across all files, so only a lone file's counts are its own */
+    file_cache->image_flows = false;
+    if (options->flow_stats && (hdr.flags & CACHE_IMAGE_F_FLOW_STATS) && (hdr.flags & CACHE_IMAGE_F_FLOWS_ALONE) &&
+        options->source_cnt == 1 && hdr.flow_expiry == options->flow_expiry) {
+        ctx->stats.flows += hdr.flows;
+        ctx->stats.flows_unique += hdr.flows_unique;
+        ctx->stats.flows_expired += hdr.flows_expired;
+        ctx->stats.flow_packets += hdr.flow_packets;
+        ctx->stats.flow_non_flow_packets += hdr.flow_non_flow_packets;
+        ctx->stats.flows_invalid_packets += hdr.flows_invalid_packets;
+        file_cache->image_flows = true;
+    }
+
+    dbgx(1, "Loaded cache image %s: " COUNTER_SPEC " packets", path, file_cache->packet_cnt);
+    cache_image_unlock(file_cache);
+    ret = 0;
+
+out:
+    if (map != MAP_FAILED)
+        munmap(map, (size_t)statbuf.st_size);
+    if (ret < 0)
+        file_cache->snaplen = options->preload_snaplen;
+    close(fd);
+    safe_free(path);
+    return ret;
+}
+
+/**
+ * \brief unmap the cache image of a file, after its cache is freed
+ */
+void
+cache_image_close(file_cache_t *file_cache)
+{
+    cache_image_unlock(file_cache);
+    if (file_cache->image == NULL)
+        return;
+
+    munmap(file_cache->image, file_cache->image_size);
+    tcpr_mem_unmap(TCPR_MEM_PRELOAD, file_cache->image_size);
+    file_cache->image = NULL;
+    file_cache->image_size = 0;
+    file_cache->image_flows = false;
+}
+
+#else
+
+int
+cache_image_load(_U_ tcpreplay_t *ctx, _U_ int idx, _U_ bool wait)
+{
+    return -1;
+}
+
+int
+cache_image_save(_U_ tcpreplay_t *ctx, _U_ int idx)
+{
+    return -1;
+}
+
+void
+cache_image_close(_U_ file_cache_t *file_cache)
+{
+}
+
+#endif /* HAVE_MMAP */
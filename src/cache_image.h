@@ -0,0 +1,100 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+/*
+ * Preloaded cache image, --cache-image.
+ *
+ * Written next to the capture as <file>.img once it is preloaded, it
+ * holds the packet_cache_t of every packet followed by the packet
+ * arenas, as they are in memory.  Later runs map it rather than read
+ * the pcap, so the cache is ready without parsing a single packet.
+ *
+ * Processes sending the same pcap share the pages of its image through
+ * the page cache, the one which wrote it included.  The mapping is
+ * private, so packets edited in place by --unique-ip are copied on write
+ * into the process editing them.
+ *
+ * The image is only meant for the host which wrote it, and is ignored
+ * once the pcap changes, or when it was built with options which shape
+ * the cache differently (CACHE_IMAGE_F_SHAPE).
+ */
+#define CACHE_IMAGE_MAGIC "tcprimg"
+#define CACHE_IMAGE_VERSION "01"
+#define CACHE_IMAGE_SUFFIX ".img"
+
+/* written as is, so an image from another byte order reads differently */
+#define CACHE_IMAGE_BYTE_ORDER 0x01020304
+
+/*
+ * CACHE_IMAGE_VERSION History:
+ * 01 - Initial release
+ */
+
+#define CACHE_IMAGE_F_NSEC 0x01        /* tv_usec of packet timestamps holds nanoseconds */
+#define CACHE_IMAGE_F_FLOW_STATS 0x02  /* flow_id and flow_type are set */
+#define CACHE_IMAGE_F_FLOWS_ALONE 0x04 /* the flow counts are of this file alone */
+#define CACHE_IMAGE_F_UNIQUE_IP 0x08   /* the --unique-ip offsets are set */
+#define CACHE_IMAGE_F_GEN_FIELD 0x10   /* the --gen-field offsets are set */
+#define CACHE_IMAGE_F_GSO 0x20         /* --gso super-frames */
+#define CACHE_IMAGE_F_DEDUP 0x40       /* --preload-dedup shared packet data */
+#define CACHE_IMAGE_F_SHAPE (CACHE_IMAGE_F_UNIQUE_IP | CACHE_IMAGE_F_GEN_FIELD | CACHE_IMAGE_F_GSO | CACHE_IMAGE_F_DEDUP)
+
+/*
+ * On-disk file header, followed by packet_cnt packet_cache_t, where
+ * pktdata is the offset of the packet in the data, and then data_size
+ * bytes of packet data at data_offset.
+ *
+ * If you need to enhance this struct, do so AFTER the version field and be
+ * sure to increment CACHE_IMAGE_VERSION
+ */
+typedef struct cache_image_hdr_s {
+    char magic[8];
+    char version[4];
+    u_int32_t byte_order;
+    u_int32_t desc_size;  /* sizeof(packet_cache_t) */
+    u_int32_t flags;      /* CACHE_IMAGE_F_* */
+    u_int64_t pcap_size;  /* size of the cached pcap */
+    u_int64_t pcap_mtime; /* mtime of the cached pcap, in seconds */
+    int32_t dlt;
+    u_int32_t snaplen;    /* --preload-snaplen */
+    int32_t flow_expiry;  /* --flow-expiry, with CACHE_IMAGE_F_FLOW_STATS */
+    u_int32_t pad_max;
+    u_int64_t packet_cnt;
+    u_int64_t data_offset;
+    u_int64_t data_size;
+    u_int64_t dedup_bytes;
+    u_int64_t dedup_saved;
+    u_int64_t gso_packets;
+    u_int64_t gso_frames;
+    /* with CACHE_IMAGE_F_FLOWS_ALONE */
+    u_int64_t flows;
+    u_int64_t flows_unique;
+    u_int64_t flows_expired;
+    u_int64_t flow_packets;
+    u_int64_t flow_non_flow_packets;
+    u_int64_t flows_invalid_packets;
+} __attribute__((__packed__)) cache_image_hdr_t;
+
+char *cache_image_path(const char *pcapfile);
+int cache_image_load(tcpreplay_t *ctx, int idx, bool wait);
+int cache_image_save(tcpreplay_t *ctx, int idx);
+void cache_image_close(file_cache_t *file_cache);
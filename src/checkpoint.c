@@ -0,0 +1,441 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * --checkpoint and --resume: carry on with a long replay from where an
+ * earlier run of it stopped.
+ *
+ * Every --checkpoint-interval seconds, and when the run is aborted, the
+ * send loop writes how far it got: the file, the packet in it, the pass
+ * and --unique-ip pass, and the counters so far.  The file is written
+ * aside and renamed over the old one, so a crash leaves either the old
+ * checkpoint or the new one.  It is removed once the run completes.
+ *
+ * --resume reads it back.  A file read straight from disk is positioned
+ * using its sidecar index (see pcap_index.h), so only packets since the
+ * last index entry are read again; a cached file just skips ahead.  The
+ * pacing starts over at the first packet sent, so packets keep their
+ * original spacing from there on and the counters, --limit and
+ * --duration carry on where they were.
+ *
+ * The flow table can't be saved, so it is rebuilt from the packets
+ * before the checkpoint and compared with the digest saved with it.
+ */
+
+#include "checkpoint.h"
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+#include "pkt_source.h"
+#include "send_packets.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * \brief FNV-1a of len bytes, carrying on from hv
+ */
+static u_int64_t
+checkpoint_fnv(u_int64_t hv, const void *data, size_t len)
+{
+    const u_char *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hv ^= p[i];
+        hv *= 0x100000001b3ULL;
+    }
+
+    return hv;
+}
+
+/**
+ * \brief digest of the name, size and mtime of every source, so a
+ * checkpoint isn't applied to different files
+ */
+static u_int64_t
+checkpoint_sources_digest(tcpreplay_t *ctx)
+{
+    u_int64_t hv = 0xcbf29ce484222325ULL;
+    int i;
+
+    for (i = 0; i < ctx->options->source_cnt; i++) {
+        const char *path = ctx->options->sources[i].filename;
+        struct stat st;
+        u_int64_t v;
+
+        hv = checkpoint_fnv(hv, path, strlen(path) + 1);
+        if (stat(path, &st) == 0) {
+            v = (u_int64_t)st.st_size;
+            hv = checkpoint_fnv(hv, &v, sizeof(v));
+            v = (u_int64_t)st.st_mtime;
+            hv = checkpoint_fnv(hv, &v, sizeof(v));
+        }
+    }
+
+    return hv;
+}
+
+/**
+ * \brief run the first count packets of a file through the flow table,
+ * without counting them; count 0 is every packet
+ */
+static void
+checkpoint_warm_file(tcpreplay_t *ctx, int idx, COUNTER count)
+{
+    const char *path = ctx->options->sources[idx].filename;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    struct pcap_pkthdr pkthdr;
+    const u_char *pktdata;
+    pcap_t *pcap;
+    COUNTER n = 0;
+    uint32_t flow_id;
+    int dlt;
+
+    if ((pcap = tcpr_pcap_open_offline_with_tstamp_precision(path, PCAP_TSTAMP_PRECISION_NANO, ebuf)) == NULL) {
+        warnx("Unable to rebuild the flow table from %s: %s", path, ebuf);
+        return;
+    }
+
+    dlt = pcap_datalink(pcap);
+    while ((count == 0 || n < count) && (pktdata = pcap_next(pcap, &pkthdr)) != NULL) {
+        flow_decode(ctx->flow_hash_table, &pkthdr, pktdata, dlt, ctx->options->flow_expiry, &flow_id);
+        ++n;
+    }
+
+    pcap_close(pcap);
+}
+
+/**
+ * \brief rebuild the flow table as it was at the checkpoint
+ *
+ * Preloaded files went through it while loading.  Otherwise, once a
+ * whole pass is done further passes see the same flows again, so one
+ * pass plus the part of the current one is enough.  That is exact
+ * without --flow-expiry; with it and with --unique-ip's new flows every
+ * pass, the digest will tell.
+ */
+static void
+checkpoint_warm_flows(tcpreplay_t *ctx, const checkpoint_file_t *cp)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int idx = (int)ntohl(cp->source_idx);
+    int i;
+
+    if (!options->flow_stats || options->preload_pcap || options->unique_ip)
+        return;
+
+    if (ntohll(cp->iteration) > 0) {
+        for (i = 0; i < options->source_cnt; i++)
+            checkpoint_warm_file(ctx, i, 0);
+    }
+    for (i = 0; i < idx; i++)
+        checkpoint_warm_file(ctx, i, 0);
+    if (ntohll(cp->packetnum) > 0)
+        checkpoint_warm_file(ctx, idx, ntohll(cp->packetnum));
+}
+
+/**
+ * \brief read options->checkpoint_file into cp
+ *
+ * Returns 0 if there is none, 1 if read and -1 on error
+ */
+static int
+checkpoint_read(tcpreplay_t *ctx, checkpoint_file_t *cp)
+{
+    const char *path = ctx->options->checkpoint_file;
+    ssize_t len;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        if (errno == ENOENT)
+            return 0;
+
+        tcpreplay_seterr(ctx, "Unable to open checkpoint %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    len = read(fd, cp, sizeof(*cp));
+    close(fd);
+
+    if (len != (ssize_t)sizeof(*cp) || strncmp(cp->magic, CHECKPOINT_MAGIC, sizeof(cp->magic)) != 0) {
+        tcpreplay_seterr(ctx, "%s is not a tcpreplay checkpoint", path);
+        return -1;
+    }
+
+    if (strncmp(cp->version, CHECKPOINT_VERSION, sizeof(cp->version)) != 0) {
+        tcpreplay_seterr(ctx, "%s is a version %.4s checkpoint, this tcpreplay only reads version %s",
+                         path,
+                         cp->version,
+                         CHECKPOINT_VERSION);
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * \brief check --checkpoint can be used and, with --resume, pick up
+ * from the checkpoint
+ *
+ * Called by tcpreplay_replay() once the counters are reset.  A missing
+ * checkpoint just means starting at the beginning.  Returns 0 or -1 on
+ * error.
+ */
+int
+checkpoint_start(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    checkpoint_file_t cp;
+    u_int64_t now_ns;
+    int i, rcode;
+
+    assert(ctx);
+
+    for (i = 0; i < options->source_cnt; i++) {
+        if (options->sources[i].type != source_filename || strcmp(options->sources[i].filename, "-") == 0 ||
+            shm_pipe_path(options->sources[i].filename)) {
+            tcpreplay_seterr(ctx, "%s", "--checkpoint can only be used with pcap files, not STDIN or a pipe");
+            return -1;
+        }
+    }
+
+    now_ns = tcpr_clock_ns();
+    ctx->checkpoint_next_ns = now_ns + SEC_TO_NANOSEC(options->checkpoint_interval);
+    ctx->checkpoint_loops = ctx->loop_forever ? 0 : options->loop;
+
+    if (!options->resume)
+        return 0;
+
+    if ((rcode = checkpoint_read(ctx, &cp)) <= 0) {
+        if (rcode == 0 && options->stats >= 0)
+            notice("No checkpoint in %s, starting from the beginning", options->checkpoint_file);
+        return rcode;
+    }
+
+    if (ntohll(cp.sources_digest) != checkpoint_sources_digest(ctx) ||
+        (int)ntohl(cp.source_idx) >= options->source_cnt) {
+        tcpreplay_seterr(ctx, "Checkpoint %s is of different pcap files", options->checkpoint_file);
+        return -1;
+    }
+
+    if (ntohll(cp.loop_total) != (u_int64_t)ctx->checkpoint_loops) {
+        tcpreplay_seterr(ctx,
+                         "Checkpoint %s is of a run with --loop=%" PRIu64,
+                         options->checkpoint_file,
+                         ntohll(cp.loop_total));
+        return -1;
+    }
+
+    checkpoint_warm_flows(ctx, &cp);
+    if (options->flow_stats && ntohll(cp.flow_digest) != flow_hash_table_digest(ctx->flow_hash_table))
+        warnx("%s", "The flow table rebuilt for --resume differs from that of the checkpoint, flow statistics are approximate");
+
+    ctx->iteration = ntohll(cp.iteration);
+    ctx->unique_iteration = ntohll(cp.unique_iteration);
+    ctx->last_unique_iteration = ntohll(cp.last_unique_iteration);
+    /* tcpreplay_replay() takes this pass off again before starting it */
+    if (!ctx->loop_forever)
+        options->loop = ntohll(cp.loops_left) + 1;
+
+    ctx->stats.pkts_sent = ntohll(cp.pkts_sent);
+    ctx->stats.bytes_sent = ntohll(cp.bytes_sent);
+    ctx->stats.failed = ntohll(cp.failed);
+    ctx->stats.flow_non_flow_packets = ntohll(cp.flow_non_flow_packets);
+    ctx->stats.flows = ntohll(cp.flows);
+    ctx->stats.flows_unique = ntohll(cp.flows_unique);
+    ctx->stats.flow_packets = ntohll(cp.flow_packets);
+    ctx->stats.flows_expired = ntohll(cp.flows_expired);
+    ctx->stats.flows_invalid_packets = ntohll(cp.flows_invalid_packets);
+    /* rates and --duration count the time before the checkpoint */
+    ctx->stats.start_time_ns = now_ns - ntohll(cp.elapsed_ns);
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    unique_ip_resume(ctx, (int)ntohl(cp.source_idx));
+#endif
+
+    ctx->resume = safe_malloc(sizeof(*ctx->resume));
+    ctx->resume->source_idx = (int)ntohl(cp.source_idx);
+    ctx->resume->packetnum = ntohll(cp.packetnum);
+
+    if (options->stats >= 0)
+        notice("Resuming at packet " COUNTER_SPEC " of %s, loop " COUNTER_SPEC,
+               ctx->resume->packetnum + 1,
+               options->sources[ctx->resume->source_idx].filename,
+               ctx->iteration + 1);
+
+    return 0;
+}
+
+/**
+ * \brief time for another checkpoint?
+ */
+bool
+checkpoint_due(tcpreplay_t *ctx)
+{
+    return tcpr_clock_ns() >= ctx->checkpoint_next_ns;
+}
+
+/**
+ * \brief note that packetnum packets of source idx are done with
+ *
+ * Anything batched or queued must have been sent already.  Returns 0,
+ * or -1 and warns if the checkpoint couldn't be written; the replay
+ * goes on regardless.
+ */
+int
+checkpoint_save(tcpreplay_t *ctx, int idx, COUNTER packetnum)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_stats_t *stats = &ctx->stats;
+    checkpoint_file_t cp;
+    char *tmp;
+    u_int64_t now_ns = tcpr_clock_ns();
+    u_int64_t digest, loops_left, elapsed_ns;
+    int fd, ret = 0;
+
+    assert(ctx);
+
+    ctx->checkpoint_next_ns = now_ns + SEC_TO_NANOSEC(options->checkpoint_interval);
+
+    /* not there yet, the checkpoint we resumed from still holds */
+    if (ctx->resume != NULL)
+        return 0;
+
+    /* htonll() takes its argument more than once */
+    digest = checkpoint_sources_digest(ctx);
+    loops_left = ctx->loop_forever ? 0 : options->loop;
+    elapsed_ns = stats->start_time_ns && now_ns > stats->start_time_ns ? now_ns - stats->start_time_ns : 0;
+
+    memset(&cp, 0, sizeof(cp));
+    strncpy(cp.magic, CHECKPOINT_MAGIC, sizeof(cp.magic));
+    strncpy(cp.version, CHECKPOINT_VERSION, sizeof(cp.version));
+    cp.source_idx = htonl((u_int32_t)idx);
+    cp.sources_digest = htonll(digest);
+    cp.packetnum = htonll(packetnum);
+    cp.iteration = htonll(ctx->iteration);
+    cp.unique_iteration = htonll(ctx->unique_iteration);
+    cp.last_unique_iteration = htonll(ctx->last_unique_iteration);
+    cp.loop_total = htonll(ctx->checkpoint_loops);
+    cp.loops_left = htonll(loops_left);
+    cp.elapsed_ns = htonll(elapsed_ns);
+    cp.pkts_sent = htonll(stats->pkts_sent);
+    cp.bytes_sent = htonll(stats->bytes_sent);
+    cp.failed = htonll(stats->failed);
+    cp.flow_non_flow_packets = htonll(stats->flow_non_flow_packets);
+    cp.flows = htonll(stats->flows);
+    cp.flows_unique = htonll(stats->flows_unique);
+    cp.flow_packets = htonll(stats->flow_packets);
+    cp.flows_expired = htonll(stats->flows_expired);
+    cp.flows_invalid_packets = htonll(stats->flows_invalid_packets);
+    if (options->flow_stats) {
+        digest = flow_hash_table_digest(ctx->flow_hash_table);
+        cp.flow_digest = htonll(digest);
+    }
+
+    /* write aside and rename, so there is always a whole checkpoint */
+    tmp = safe_malloc(strlen(options->checkpoint_file) + sizeof(".tmp"));
+    sprintf(tmp, "%s.tmp", options->checkpoint_file);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        warnx("Unable to write checkpoint %s: %s", tmp, strerror(errno));
+        ret = -1;
+    } else if (write(fd, &cp, sizeof(cp)) != (ssize_t)sizeof(cp) || fsync(fd) < 0) {
+        warnx("Unable to write checkpoint %s: %s", tmp, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        ret = -1;
+    } else if (close(fd), rename(tmp, options->checkpoint_file) < 0) {
+        warnx("Unable to write checkpoint %s: %s", options->checkpoint_file, strerror(errno));
+        unlink(tmp);
+        ret = -1;
+    } else {
+        dbgx(1, "Checkpoint: packet " COUNTER_SPEC " of source %d, iteration " COUNTER_SPEC, packetnum, idx, ctx->iteration);
+    }
+
+    safe_free(tmp);
+    return ret;
+}
+
+/**
+ * \brief position a file opened for --resume near the checkpoint
+ *
+ * Uses the sidecar index to jump to the last indexed packet at or before
+ * it, for send_packets() to read on from.  Files without an index, and
+ * those which can't seek (compressed ones), are read from the start.
+ */
+void
+checkpoint_seek(tcpreplay_t *ctx, int idx)
+{
+    tcpr_checkpoint_t *resume = ctx->resume;
+    file_cache_t *file_cache = &ctx->options->file_cache[idx];
+    const pcap_index_entry_t *entry;
+    const pcap_index_t *index;
+
+    if (resume == NULL || resume->source_idx != idx || resume->packetnum == 0 || file_cache->cached ||
+        file_cache->source == NULL)
+        return;
+
+    if ((index = pkt_source_index(file_cache->source)) == NULL) {
+        dbgx(1, "No index of %s, reading up to the checkpoint", ctx->options->sources[idx].filename);
+        return;
+    }
+
+    if ((entry = pcap_index_find_packet(index, resume->packetnum)) != NULL && entry->packet > 0 &&
+        pkt_source_seek(file_cache->source, entry))
+        resume->seeked = entry->packet;
+
+    dbgx(1, "Seeked past " COUNTER_SPEC " packets of %s", resume->seeked, ctx->options->sources[idx].filename);
+}
+
+/**
+ * \brief send_packets() got to the checkpoint, from here on it's a normal run
+ */
+void
+checkpoint_resumed(tcpreplay_t *ctx)
+{
+    safe_free(ctx->resume);
+    ctx->resume = NULL;
+}
+
+/**
+ * \brief the run is over: keep the checkpoint if it was cut short, or
+ * else remove it, so the next --resume starts over
+ *
+ * Stopping at --limit or --duration is the end of the run too.
+ */
+void
+checkpoint_finish(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    bool done = !ctx->abort;
+
+    safe_free(ctx->resume);
+    ctx->resume = NULL;
+
+    if (options->limit_send > 0 && ctx->stats.pkts_sent >= options->limit_send)
+        done = true;
+    if (options->limit_time > 0 &&
+        ctx->stats.end_time_ns >= ctx->stats.start_time_ns + SEC_TO_NANOSEC(options->limit_time))
+        done = true;
+
+    if (done && unlink(ctx->options->checkpoint_file) < 0 && errno != ENOENT)
+        warnx("Unable to remove checkpoint %s: %s", ctx->options->checkpoint_file, strerror(errno));
+}
@@ -0,0 +1,76 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+#define CHECKPOINT_MAGIC "tcprckp"
+#define CHECKPOINT_VERSION "01"
+#define CHECKPOINT_DEFAULT_INTERVAL 10
+/* packets between looks at the clock for --checkpoint-interval, minus one */
+#define CHECKPOINT_POLL_MASK 1023
+
+/*
+ * CHECKPOINT_VERSION History:
+ * 01 - Initial release
+ */
+
+/*
+ * On-disk --checkpoint file.  All integers are in network byte order.
+ *
+ * If you need to enhance this struct, do so AFTER the version field and be
+ * sure to increment CHECKPOINT_VERSION
+ */
+typedef struct checkpoint_file_s {
+    char magic[8];
+    char version[4];
+    u_int32_t source_idx;     /* file being sent */
+    u_int64_t sources_digest; /* names, sizes and mtimes of all the files */
+    u_int64_t packetnum;      /* packets of the file done with */
+    u_int64_t iteration;      /* passes over the files completed */
+    u_int64_t unique_iteration;
+    u_int64_t last_unique_iteration;
+    u_int64_t loop_total;     /* --loop */
+    u_int64_t loops_left;
+    u_int64_t elapsed_ns;     /* since the start of the test */
+    u_int64_t pkts_sent;
+    u_int64_t bytes_sent;
+    u_int64_t failed;
+    u_int64_t flow_non_flow_packets;
+    u_int64_t flows;
+    u_int64_t flows_unique;
+    u_int64_t flow_packets;
+    u_int64_t flows_expired;
+    u_int64_t flows_invalid_packets;
+    u_int64_t flow_digest;    /* flow_hash_table_digest(), 0 without --flow-stats */
+} __attribute__((__packed__)) checkpoint_file_t;
+
+/* where --resume carries on from, until send_packets() gets there */
+struct tcpr_checkpoint_s {
+    int source_idx;
+    COUNTER packetnum;
+    COUNTER seeked; /* packets of the file skipped by seeking, see checkpoint_seek() */
+};
+
+int checkpoint_start(tcpreplay_t *ctx);
+bool checkpoint_due(tcpreplay_t *ctx);
+int checkpoint_save(tcpreplay_t *ctx, int idx, COUNTER packetnum);
+void checkpoint_seek(tcpreplay_t *ctx, int idx);
+void checkpoint_resumed(tcpreplay_t *ctx);
+void checkpoint_finish(tcpreplay_t *ctx);
@@ -29,18 +29,29 @@ extern "C" {
 
 #include <common/cache.h>
 #include <common/cidr.h>
+#include <common/crc32.h>
+#include <common/csum.h>
+#include <common/decompress.h>
 #include <common/err.h>
 #include <common/fakepcap.h>
 #include <common/fakepcapnav.h>
 #include <common/fakepoll.h>
 #include <common/flows.h>
 #include <common/get.h>
+#include <common/hugepage.h>
 #include <common/interface.h>
 #include <common/list.h>
 #include <common/mac.h>
+#include <common/mmap_pcap.h>
+#include <common/numa.h>
 #include <common/pcap_dlt.h>
+#include <common/pcap_index.h>
+#include <common/pcap_readahead.h>
+#include <common/pcap_writer.h>
+#include <common/remote.h>
 #include <common/sendpacket.h>
 #include <common/services.h>
+#include <common/shm_pipe.h>
 #include <common/tcpdump.h>
 #include <common/timer.h>
 #include <common/utils.h>
@@ -18,17 +18,45 @@
  *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define TCPR_MEM_SUBSYS TCPR_MEM_TCPPREP /* see memstat.h */
+
 #include "defines.h"
 #include "config.h"
 #include "common.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+
+/* cache files mapped by read_cache(), so free_cache() can unmap them */
+typedef struct cache_map_s {
+    char *data;
+    void *base;
+    size_t size;
+    struct cache_map_s *next;
+} cache_map_t;
+
+static cache_map_t *cache_maps = NULL;
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+/* contexts on other threads may read and free their cache files at once */
+static pthread_mutex_t cache_maps_lock = PTHREAD_MUTEX_INITIALIZER;
+#define CACHE_MAPS_LOCK() pthread_mutex_lock(&cache_maps_lock)
+#define CACHE_MAPS_UNLOCK() pthread_mutex_unlock(&cache_maps_lock)
+#else
+#define CACHE_MAPS_LOCK()
+#define CACHE_MAPS_UNLOCK()
+#endif
+#endif
+
 static tcpr_cache_t *new_cache(void);
 
 /**
@@ -51,21 +79,101 @@ byte2bits(char byte, char *bitstring)
 }
 #endif
 
+#ifdef HAVE_MMAP
+/**
+ * maps the cache data of cachefd, which begins at offset, read-only.
+ * Returns NULL if the file can't be mapped
+ */
+static char *
+map_cache(int cachefd, const char *cachefile, off_t offset, COUNTER cache_size)
+{
+    cache_map_t *map;
+    struct stat statbuf;
+    void *base;
+
+    if (fstat(cachefd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+        return NULL;
+
+    if ((COUNTER)statbuf.st_size < (COUNTER)offset + cache_size)
+        errx(-1,
+             "Cache data length (" COUNTER_SPEC " bytes) doesn't match "
+             "cache header (" COUNTER_SPEC " bytes)",
+             (COUNTER)statbuf.st_size - (COUNTER)offset,
+             cache_size);
+
+    base = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_PRIVATE, cachefd, 0);
+    if (base == MAP_FAILED) {
+        dbgx(1, "Unable to mmap %s: %s", cachefile, strerror(errno));
+        return NULL;
+    }
+
+#ifdef HAVE_MADVISE
+    /* lookups walk the bitmap in packet order */
+    madvise(base, (size_t)statbuf.st_size, MADV_SEQUENTIAL);
+#endif
+
+    map = (cache_map_t *)safe_malloc(sizeof(cache_map_t));
+    map->base = base;
+    map->size = (size_t)statbuf.st_size;
+    map->data = (char *)base + offset;
+    CACHE_MAPS_LOCK();
+    map->next = cache_maps;
+    cache_maps = map;
+    CACHE_MAPS_UNLOCK();
+
+    return map->data;
+}
+#endif
+
 /**
  * simple function to read in a cache file created with tcpprep this let's us
  * be really damn fast in picking an interface to send the packet out returns
  * number of cache entries read
  *
- * now also checks for the cache magic and version
+ * now also checks for the cache magic and version.  Where possible the cache
+ * data is mapped rather than read, release it with free_cache()
  */
 
 COUNTER
 read_cache(char **cachedata, const char *cachefile, char **comment)
+{
+    return read_cache_pairs(cachedata, NULL, NULL, cachefile, comment);
+}
+
+/**
+ * same as read_cache(), but also returns the interface pair of each packet
+ * in pairdata and the number of pairs in num_pairs.  Caches without
+ * interface pairs set pairdata to NULL and num_pairs to 1.  pairdata is
+ * released along with cachedata by free_cache()
+ */
+COUNTER
+read_cache_pairs(char **cachedata, u_char **pairdata, int *num_pairs, const char *cachefile, char **comment)
+{
+    return read_cache_shards(cachedata, pairdata, num_pairs, NULL, NULL, cachefile, comment);
+}
+
+/**
+ * same as read_cache_pairs(), but also returns the shard of each packet in
+ * sharddata and the number of shards in num_shards.  Caches without a shard
+ * map set sharddata to NULL and num_shards to 0
+ */
+COUNTER
+read_cache_shards(char **cachedata,
+                  u_char **pairdata,
+                  int *num_pairs,
+                  u_char **sharddata,
+                  int *num_shards,
+                  const char *cachefile,
+                  char **comment)
 {
     int cachefd;
     tcpr_cache_file_hdr_t header;
+    tcpr_cache_pair_hdr_t pair_header;
     ssize_t read_size;
-    COUNTER cache_size;
+    COUNTER cache_size, data_size, i;
+    long version;
+    u_char *pairs = NULL, *shards = NULL;
+    int pair_cnt = 1, shard_cnt = 0;
 
     assert(cachedata);
     assert(comment);
@@ -86,7 +194,9 @@ read_cache(char **cachedata, const char *cachefile, char **comment)
         errx(-1, "Unable to process %s: not a tcpprep cache file", cachefile);
 
     /* verify version */
-    if (strtol(header.version, NULL, 10) != strtol(CACHEVERSION, NULL, 10))
+    version = strtol(header.version, NULL, 10);
+    if (version != strtol(CACHEVERSION, NULL, 10) && version != strtol(CACHEVERSION_PAIRS, NULL, 10) &&
+        version != strtol(CACHEVERSION_SHARDS, NULL, 10))
         errx(-1, "Unable to process %s: cache file version mismatch", cachefile);
 
     /* read the comment */
@@ -119,42 +229,154 @@ read_cache(char **cachedata, const char *cachefile, char **comment)
 
     dbgx(1, "Cache uses %d packets per byte", header.packets_per_byte);
 
-    *cachedata = (char *)safe_malloc(cache_size);
+    /* version 5 adds the pair header and a byte per packet */
+    data_size = cache_size;
+    if (version == strtol(CACHEVERSION_PAIRS, NULL, 10))
+        data_size += sizeof(pair_header) + header.num_packets;
+
+    /* version 6 says in the pair header what follows it */
+    if (version == strtol(CACHEVERSION_SHARDS, NULL, 10)) {
+        if ((read_size = pread(cachefd,
+                               &pair_header,
+                               sizeof(pair_header),
+                               (off_t)(sizeof(header) + header.comment_len + cache_size))) < 0)
+            errx(-1, "unable to read from %s:%s,", cachefile, strerror(errno));
+
+        if (read_size != (ssize_t)sizeof(pair_header))
+            errx(-1, "Cache file %s doesn't contain a full shard header", cachefile);
+
+        data_size += sizeof(pair_header) + header.num_packets;
+        if (ntohs(pair_header.num_pairs) > 1)
+            data_size += header.num_packets;
+    }
 
-    /* read in the cache */
-    if ((COUNTER)(read_size = read(cachefd, *cachedata, cache_size)) != cache_size)
-        errx(-1,
-             "Cache data length (%zu bytes) doesn't match "
-             "cache header (" COUNTER_SPEC " bytes)",
-             read_size,
-             cache_size);
+    *cachedata = NULL;
+#ifdef HAVE_MMAP
+    /* data follows the header and comment */
+    *cachedata = map_cache(cachefd, cachefile, (off_t)(sizeof(header) + header.comment_len), data_size);
+    if (*cachedata != NULL)
+        dbgx(1, "Mapped in %" PRIu64 " packets from cache.", header.num_packets);
+#endif
+
+    if (*cachedata == NULL) {
+        *cachedata = (char *)safe_malloc(data_size);
+
+        /* read in the cache */
+        if ((COUNTER)(read_size = read(cachefd, *cachedata, data_size)) != data_size)
+            errx(-1,
+                 "Cache data length (%zu bytes) doesn't match "
+                 "cache header (" COUNTER_SPEC " bytes)",
+                 read_size,
+                 data_size);
 
-    dbgx(1, "Loaded in %" PRIu64 " packets from cache.", header.num_packets);
+        dbgx(1, "Loaded in %" PRIu64 " packets from cache.", header.num_packets);
+    }
 
     close(cachefd);
+
+    if (data_size > cache_size) {
+        memcpy(&pair_header, *cachedata + cache_size, sizeof(pair_header));
+        pair_cnt = ntohs(pair_header.num_pairs);
+        if (pair_cnt < 1 || pair_cnt > CACHE_MAX_PAIRS)
+            errx(-1, "Unable to process %s: invalid number of interface pairs %d", cachefile, pair_cnt);
+
+        pairs = (u_char *)*cachedata + cache_size + sizeof(pair_header);
+        if (version == strtol(CACHEVERSION_SHARDS, NULL, 10)) {
+            shard_cnt = ntohs(pair_header.num_shards);
+            if (shard_cnt < 1 || shard_cnt > CACHE_MAX_SHARDS)
+                errx(-1, "Unable to process %s: invalid number of shards %d", cachefile, shard_cnt);
+
+            shards = pairs;
+            if (pair_cnt > 1) {
+                shards += header.num_packets;
+            } else {
+                pairs = NULL;
+            }
+
+            for (i = 0; i < header.num_packets; i++) {
+                if (shards[i] >= shard_cnt)
+                    errx(-1,
+                         "Unable to process %s: packet " COUNTER_SPEC " is in shard %u of %d",
+                         cachefile,
+                         i + 1,
+                         shards[i],
+                         shard_cnt);
+            }
+
+            dbgx(1, "Cache uses %d shards", shard_cnt);
+        }
+
+        for (i = 0; pairs != NULL && i < header.num_packets; i++) {
+            if (pairs[i] >= pair_cnt)
+                errx(-1,
+                     "Unable to process %s: packet " COUNTER_SPEC " uses interface pair %u of %d",
+                     cachefile,
+                     i + 1,
+                     pairs[i],
+                     pair_cnt);
+        }
+
+        dbgx(1, "Cache uses %d interface pairs", pair_cnt);
+    }
+
+    if (pairdata != NULL)
+        *pairdata = pairs;
+    if (num_pairs != NULL)
+        *num_pairs = pair_cnt;
+    if (sharddata != NULL)
+        *sharddata = shards;
+    if (num_shards != NULL)
+        *num_shards = shard_cnt;
+
     return (header.num_packets);
 }
 
 /**
- * writes out the cache file header, comment and then the
- * contents of *cachedata to out_file and then returns the number
- * of cache entries written
+ * releases cache data returned by read_cache()
  */
-COUNTER
-write_cache(tcpr_cache_t *cachedata, const int out_file, COUNTER numpackets, char *comment)
+void
+free_cache(char *cachedata)
+{
+#ifdef HAVE_MMAP
+    cache_map_t **map;
+
+    CACHE_MAPS_LOCK();
+    for (map = &cache_maps; *map != NULL; map = &(*map)->next) {
+        if ((*map)->data == cachedata) {
+            cache_map_t *found = *map;
+
+            *map = found->next;
+            CACHE_MAPS_UNLOCK();
+            munmap(found->base, found->size);
+            safe_free(found);
+            return;
+        }
+    }
+    CACHE_MAPS_UNLOCK();
+#endif
+
+    safe_free(cachedata);
+}
+
+/**
+ * writes the cache file header and comment to out_file
+ */
+static void
+write_cache_header(const int out_file, COUNTER numpackets, char *comment, int num_pairs, int num_shards)
 {
-    tcpr_cache_t *mycache = NULL;
     tcpr_cache_file_hdr_t *cache_header = NULL;
-    uint32_t chars, last = 0;
-    COUNTER packets = 0;
     ssize_t written;
 
-    assert(out_file);
-
     /* write a header to our file */
     cache_header = (tcpr_cache_file_hdr_t *)safe_malloc(sizeof(tcpr_cache_file_hdr_t));
     strncpy(cache_header->magic, CACHEMAGIC, strlen(CACHEMAGIC) + 1);
-    strncpy(cache_header->version, CACHEVERSION, strlen(CACHEVERSION) + 1);
+    if (num_shards > 0) {
+        strncpy(cache_header->version, CACHEVERSION_SHARDS, strlen(CACHEVERSION_SHARDS) + 1);
+    } else if (num_pairs > 1) {
+        strncpy(cache_header->version, CACHEVERSION_PAIRS, strlen(CACHEVERSION_PAIRS) + 1);
+    } else {
+        strncpy(cache_header->version, CACHEVERSION, strlen(CACHEVERSION) + 1);
+    }
     cache_header->packets_per_byte = htons(CACHE_PACKETS_PER_BYTE);
     cache_header->num_packets = htonll((u_int64_t)numpackets);
 
@@ -188,6 +410,88 @@ write_cache(tcpr_cache_t *cachedata, const int out_file, COUNTER numpackets, cha
                  written == -1 ? strerror(errno) : "");
     }
 
+    safe_free(cache_header);
+}
+
+/**
+ * writes the interface pair header, the pair of each packet and, for a
+ * version 6 cache, the shard of each packet to out_file
+ */
+static void
+write_cache_pairs(const int out_file,
+                  COUNTER numpackets,
+                  const u_char *pairdata,
+                  int num_pairs,
+                  const u_char *sharddata,
+                  int num_shards)
+{
+    tcpr_cache_pair_hdr_t pair_header;
+    ssize_t written;
+
+    if (num_pairs <= 1 && num_shards == 0)
+        return;
+
+    memset(&pair_header, 0, sizeof(pair_header));
+    pair_header.num_pairs = htons((u_int16_t)(num_pairs > 1 ? num_pairs : 1));
+    pair_header.num_shards = htons((u_int16_t)num_shards);
+
+    written = write(out_file, &pair_header, sizeof(pair_header));
+    if (written != sizeof(pair_header))
+        errx(-1,
+             "Only wrote %zu of %zu bytes of the interface pair header!\n%s",
+             written,
+             sizeof(pair_header),
+             written == -1 ? strerror(errno) : "");
+
+    /* the reader expects a pair for each packet in the header */
+    if (num_pairs > 1) {
+        assert(pairdata);
+        written = write(out_file, pairdata, numpackets);
+        dbgx(1, "Wrote %zd bytes of interface pairs", written);
+        if ((COUNTER)written != numpackets)
+            errx(-1, "Only wrote %zd of " COUNTER_SPEC " bytes of interface pairs!", written, numpackets);
+    }
+
+    if (num_shards > 0) {
+        assert(sharddata);
+        written = write(out_file, sharddata, numpackets);
+        dbgx(1, "Wrote %zd bytes of shards", written);
+        if ((COUNTER)written != numpackets)
+            errx(-1, "Only wrote %zd of " COUNTER_SPEC " bytes of shards!", written, numpackets);
+    }
+}
+
+/**
+ * writes out the cache file header, comment and then the
+ * contents of *cachedata to out_file and then returns the number
+ * of cache entries written
+ *
+ * If num_pairs is more than 1, pairdata holds the interface pair of each
+ * packet and a version 5 cache is written.  If num_shards is more than 0,
+ * sharddata holds the shard of each packet and a version 6 cache is written
+ */
+COUNTER
+write_cache(tcpr_cache_t *cachedata,
+            const int out_file,
+            COUNTER numpackets,
+            char *comment,
+            const u_char *pairdata,
+            int num_pairs,
+            const u_char *sharddata,
+            int num_shards)
+{
+    tcpr_cache_t *mycache = NULL;
+    uint32_t chars, last = 0;
+    COUNTER packets = 0;
+    ssize_t written;
+
+    assert(out_file);
+
+    if (pairdata == NULL)
+        num_pairs = 1;
+
+    write_cache_header(out_file, numpackets, comment, num_pairs, num_shards);
+
     if (cachedata) {
         mycache = cachedata;
 
@@ -219,11 +523,148 @@ write_cache(tcpr_cache_t *cachedata, const int out_file, COUNTER numpackets, cha
             }
         }
     }
-    safe_free(cache_header);
+
+    write_cache_pairs(out_file, numpackets, pairdata, num_pairs, sharddata, num_shards);
+
     /* return number of packets written */
     return (packets);
 }
 
+/**
+ * starts a cache file whose data will be written by add_cache_stream().
+ * The packet count is filled in by finish_cache_stream().  Returns the
+ * file offset of the cache data, or -1 if out_file can't seek
+ */
+off_t
+start_cache_stream(const int out_file, char *comment, int num_pairs, int num_shards)
+{
+    off_t offset;
+
+    if (lseek(out_file, 0, SEEK_CUR) == -1)
+        return -1;
+
+    write_cache_header(out_file, 0, comment, num_pairs, num_shards);
+
+    if ((offset = lseek(out_file, 0, SEEK_CUR)) == -1)
+        errx(-1, "Unable to seek in cache file: %s", strerror(errno));
+
+    return offset;
+}
+
+/**
+ * sets up stream to write the cache data of packets, starting at offset
+ */
+void
+init_cache_stream(tcpr_cache_stream_t *stream, const int out_file, off_t offset)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->fd = out_file;
+    stream->offset = offset;
+}
+
+/**
+ * picks up a stream whose first byte already holds the cache data of
+ * packets (fewer than CACHE_PACKETS_PER_BYTE) packets, to append to a cache
+ */
+void
+resume_cache_stream(tcpr_cache_stream_t *stream, COUNTER packets)
+{
+    assert(packets < CACHE_PACKETS_PER_BYTE);
+
+    if (packets == 0)
+        return;
+
+    if (pread(stream->fd, stream->data, 1, stream->offset) != 1)
+        errx(-1, "Unable to read cache file: %s", strerror(errno));
+
+    stream->data[0] &= (u_char)((1 << (packets * CACHE_BITS_PER_PACKET)) - 1);
+    stream->packets = packets;
+}
+
+/**
+ * same as add_cache(), but for a stream
+ */
+tcpr_dir_t
+add_cache_stream(tcpr_cache_stream_t *stream, const int send, const tcpr_dir_t interface)
+{
+    u_char *byte;
+    uint32_t bit;
+
+    if (stream->packets == CACHE_STREAM_BUFSIZE * CACHE_PACKETS_PER_BYTE)
+        flush_cache_stream(stream);
+
+    byte = &stream->data[stream->packets / CACHE_PACKETS_PER_BYTE];
+    bit = (uint32_t)((stream->packets % CACHE_PACKETS_PER_BYTE) * CACHE_BITS_PER_PACKET) + 1;
+    stream->packets++;
+
+    if (send != SEND)
+        return TCPR_DIR_NOSEND;
+
+    *byte += (u_char)(1 << bit);
+    if (interface == TCPR_DIR_C2S) {
+        *byte += (u_char)(1 << (bit - 1));
+        return TCPR_DIR_C2S;
+    }
+
+    return TCPR_DIR_S2C;
+}
+
+/**
+ * writes what is collected in stream.  Only the last flush may end
+ * part way through a byte
+ */
+void
+flush_cache_stream(tcpr_cache_stream_t *stream)
+{
+    size_t chars = (stream->packets + CACHE_PACKETS_PER_BYTE - 1) / CACHE_PACKETS_PER_BYTE;
+    ssize_t written;
+
+    if (chars == 0)
+        return;
+
+    written = pwrite(stream->fd, stream->data, chars, stream->offset);
+    dbgx(1, "Wrote %zd bytes of cache data", written);
+    if (written != (ssize_t)chars)
+        errx(-1,
+             "Only wrote %zd of %zu bytes to cache file!\n%s",
+             written,
+             chars,
+             written == -1 ? strerror(errno) : "");
+
+    stream->offset += (off_t)chars;
+    stream->packets = 0;
+    memset(stream->data, 0, chars);
+}
+
+/**
+ * completes a cache file started by start_cache_stream() once all
+ * numpackets have been streamed to it, whose data begins at offset.
+ * Returns numpackets
+ */
+COUNTER
+finish_cache_stream(const int out_file,
+                    off_t offset,
+                    COUNTER numpackets,
+                    const u_char *pairdata,
+                    int num_pairs,
+                    const u_char *sharddata,
+                    int num_shards)
+{
+    u_int64_t num_packets = htonll((u_int64_t)numpackets);
+    off_t end = offset + (off_t)((numpackets + CACHE_PACKETS_PER_BYTE - 1) / CACHE_PACKETS_PER_BYTE);
+
+    if (pwrite(out_file, &num_packets, sizeof(num_packets), offsetof(tcpr_cache_file_hdr_t, num_packets)) !=
+        sizeof(num_packets))
+        errx(-1, "Unable to update cache file header: %s", strerror(errno));
+
+    if (lseek(out_file, end, SEEK_SET) != end)
+        errx(-1, "Unable to seek in cache file: %s", strerror(errno));
+
+    write_cache_pairs(out_file, numpackets, pairdata, num_pairs, sharddata, num_shards);
+
+    return numpackets;
+}
+
 /**
  * mallocs a new CACHE struct all pre-set to sane defaults
  */
@@ -239,13 +680,26 @@ new_cache(void)
 }
 
 /**
- * adds the cache data for a packet to the given cachedata
+ * adds the cache data for a packet to the given cachedata.  Only one list
+ * can be built at a time, see add_cache_r()
  */
 
 tcpr_dir_t
 add_cache(tcpr_cache_t **cachedata, const int send, const tcpr_dir_t interface)
 {
     static tcpr_cache_t *lastcache = NULL;
+
+    return add_cache_r(cachedata, &lastcache, send, interface);
+}
+
+/**
+ * same as add_cache(), but the caller keeps track of the last entry of
+ * cachedata, so several lists can be built at once
+ */
+tcpr_dir_t
+add_cache_r(tcpr_cache_t **cachedata, tcpr_cache_t **last, const int send, const tcpr_dir_t interface)
+{
+    tcpr_cache_t *lastcache = *last;
     tcpr_dir_t result;
 #ifdef DEBUG
     char bitstring[9] = EIGHT_ZEROS;
@@ -268,6 +722,7 @@ add_cache(tcpr_cache_t **cachedata, const int send, const tcpr_dir_t interface)
             lastcache = lastcache->next;
         }
     }
+    *last = lastcache;
 
     /* always increment our bit count */
     lastcache->packets++;
@@ -320,35 +775,15 @@ add_cache(tcpr_cache_t **cachedata, const int send, const tcpr_dir_t interface)
 tcpr_dir_t
 check_cache(char *cachedata, COUNTER packetid)
 {
-    COUNTER index;
-    uint32_t bit;
-
     assert(cachedata);
 
     if (packetid == 0)
         err(-1, "packetid must be > 0");
 
-    index = (packetid - 1) / (COUNTER)CACHE_PACKETS_PER_BYTE;
-    bit = (uint32_t)(((packetid - 1) % (COUNTER)CACHE_PACKETS_PER_BYTE) * (COUNTER)CACHE_BITS_PER_PACKET) + 1;
-
-#ifdef DEBUG
     dbgx(3,
-         "Index: " COUNTER_SPEC "\tBit: %d\tByte: %hhu\tMask: %hhu",
-         index,
-         bit,
-         cachedata[index],
-         (uint8_t)(cachedata[index] & (char)(1 << bit)));
-#endif
+         "Index: " COUNTER_SPEC "\tByte: %hhu",
+         (packetid - 1) / (COUNTER)CACHE_PACKETS_PER_BYTE,
+         (uint8_t)cachedata[(packetid - 1) / (COUNTER)CACHE_PACKETS_PER_BYTE]);
 
-    if (!(cachedata[index] & (char)(1 << bit))) {
-        return TCPR_DIR_NOSEND;
-    }
-
-    /* go back a bit to get the interface */
-    bit--;
-    if (cachedata[index] & (char)(1 << bit)) {
-        return TCPR_DIR_C2S;
-    } else {
-        return TCPR_DIR_S2C;
-    }
+    return cache_lookup(cachedata, packetid);
 }
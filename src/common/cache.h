@@ -24,9 +24,13 @@
 
 #define CACHEMAGIC "tcpprep"
 #define CACHEVERSION "04"
+#define CACHEVERSION_PAIRS "05"     /* written when the cache has interface pairs */
+#define CACHEVERSION_SHARDS "06"    /* written when the cache has a shard map */
 #define CACHEDATASIZE 255
 #define CACHE_PACKETS_PER_BYTE 4    /* number of packets / byte */
 #define CACHE_BITS_PER_PACKET 2     /* number of bits / packet */
+#define CACHE_MAX_PAIRS 16          /* max interface pairs in a cache file */
+#define CACHE_MAX_SHARDS 256        /* max shards in a cache file */
 
 #define SEND 1
 #define DONT_SEND 0
@@ -37,6 +41,8 @@
  * 02 - 2 bits of data/packet (drop/send & primary or secondary nic)
  * 03 - Write integers in network-byte order
  * 04 - Increase num_packets from 32 to 64 bit integer
+ * 05 - Optional interface pair of each packet after the 2 bit data
+ * 06 - Optional shard of each packet after the interface pairs
  */
 
 struct tcpr_cache_s {
@@ -46,6 +52,23 @@ struct tcpr_cache_s {
 };
 typedef struct tcpr_cache_s tcpr_cache_t;
 
+/* bytes of cache data a tcpr_cache_stream_t collects between writes */
+#define CACHE_STREAM_BUFSIZE (64 * 1024)
+
+/*
+ * Writes the cache data of a run of packets straight into the cache file
+ * at offset, rather than building a tcpr_cache_t list.  A run that isn't
+ * the last must be a whole number of bytes, so several can be written at
+ * once.  See start_cache_stream()
+ */
+struct tcpr_cache_stream_s {
+    int fd;
+    off_t offset;      /* where data goes in the file */
+    COUNTER packets;   /* packets in data */
+    u_char data[CACHE_STREAM_BUFSIZE];
+};
+typedef struct tcpr_cache_stream_s tcpr_cache_stream_t;
+
 /*
  * Each byte in cache_type.data represents CACHE_PACKETS_PER_BYTE (4) number of packets
  * Each packet has CACHE_BITS_PER_PACKETS (2) bits of data.
@@ -73,6 +96,24 @@ struct tcpr_cache_file_hdr_s {
 
 typedef struct tcpr_cache_file_hdr_s tcpr_cache_file_hdr_t;
 
+/*
+ * Version 5 caches follow the 2 bit data with this header and one byte per
+ * packet holding the interface pair (0 to num_pairs - 1) the packet is sent
+ * on.  Pair 0 is the primary/secondary interfaces, the 2 bit data still
+ * selects which side of the pair is used so older tools can ignore it.
+ *
+ * Version 6 caches set num_shards and follow the header with the interface
+ * pairs, only if num_pairs is more than 1, then one byte per packet holding
+ * its shard (0 to num_shards - 1).  Both directions of a flow are in the
+ * same shard, so separate tcpreplay processes can each send one shard.
+ */
+struct tcpr_cache_pair_hdr_s {
+    u_int16_t num_pairs;
+    u_int16_t num_shards;       /* version 6, 0 in version 5 */
+} __attribute__((__packed__));
+
+typedef struct tcpr_cache_pair_hdr_s tcpr_cache_pair_hdr_t;
+
 enum tcpr_dir_e {
     TCPR_DIR_ERROR  = -1,
     TCPR_DIR_NOSEND = 0,
@@ -82,11 +123,39 @@ enum tcpr_dir_e {
 typedef enum tcpr_dir_e tcpr_dir_t;
 
 
-COUNTER write_cache(tcpr_cache_t *, const int, COUNTER, char *);
+COUNTER write_cache(tcpr_cache_t *, const int, COUNTER, char *, const u_char *, int, const u_char *, int);
 tcpr_dir_t add_cache(tcpr_cache_t **, const int, const tcpr_dir_t);
+tcpr_dir_t add_cache_r(tcpr_cache_t **, tcpr_cache_t **, const int, const tcpr_dir_t);
+off_t start_cache_stream(const int, char *, int, int);
+void init_cache_stream(tcpr_cache_stream_t *, const int, off_t);
+void resume_cache_stream(tcpr_cache_stream_t *, COUNTER);
+tcpr_dir_t add_cache_stream(tcpr_cache_stream_t *, const int, const tcpr_dir_t);
+void flush_cache_stream(tcpr_cache_stream_t *);
+COUNTER finish_cache_stream(const int, off_t, COUNTER, const u_char *, int, const u_char *, int);
 COUNTER read_cache(char **, const char *, char **);
+COUNTER read_cache_pairs(char **, u_char **, int *, const char *, char **);
+COUNTER read_cache_shards(char **, u_char **, int *, u_char **, int *, const char *, char **);
+void free_cache(char *);
 tcpr_dir_t check_cache(char *, COUNTER);
 
+/**
+ * returns the action for the given packet (> 0) without branching.  The
+ * caller is responsible for checking packetid against the cache size.
+ *
+ * Each packet's 2 bits hold the send bit (high) and the interface bit
+ * (low), so the code is 0 or 1 for don't send, 2 for secondary and 3 for
+ * primary
+ */
+static inline tcpr_dir_t
+cache_lookup(const char *cachedata, COUNTER packetid)
+{
+    COUNTER i = packetid - 1;
+    unsigned int code = ((u_char)cachedata[i / CACHE_PACKETS_PER_BYTE] >>
+                         ((i % CACHE_PACKETS_PER_BYTE) * CACHE_BITS_PER_PACKET)) & 3;
+
+    return (tcpr_dir_t)((code >> 1) * (2 - (code & 1)));
+}
+
 /* return values for check_cache 
 #define CACHE_ERROR -1
 #define CACHE_NOSEND 0  // NULL 
@@ -25,10 +25,50 @@
 #include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+
+/*
+ * A compiled list of CIDRs.  Each level of the trie consumes
+ * CIDR_TRIE_STRIDE bits of the address, and a prefix ending inside a level
+ * fills every slot it covers.  Slots keep the position in the list of the
+ * first prefix that covers them, so a lookup returns the same entry as
+ * walking the list in order, in at most 32 / CIDR_TRIE_STRIDE steps for
+ * IPv4 and 128 / CIDR_TRIE_STRIDE for IPv6.
+ *
+ * Host entries, /32 and /128, would cost a node per level each, so they
+ * go in an open addressed hash of their own instead, and a lookup takes
+ * the earlier of the two rules it finds.
+ */
+#define CIDR_TRIE_STRIDE 4
+#define CIDR_TRIE_SLOTS (1 << CIDR_TRIE_STRIDE)
+#define CIDR_TRIE_V4 0
+#define CIDR_TRIE_V6 1
+
+typedef struct cidr_trie_node_s {
+    u_int32_t rule[CIDR_TRIE_SLOTS]; /* list position + 1 of the first match, 0 for none */
+    struct cidr_trie_node_s *child[CIDR_TRIE_SLOTS];
+} cidr_trie_node_t;
+
+typedef struct cidr_host_s {
+    u_int32_t rule; /* list position + 1, 0 for an empty slot */
+    u_char addr[16];
+} cidr_host_t;
+
+struct tcpr_cidr_trie_s {
+    cidr_trie_node_t *root[2];
+    u_int32_t any[2]; /* list position + 1 of the first /0 */
+    cidr_host_t *host[2];
+    u_int32_t host_mask[2]; /* slots - 1 */
+    void **entries;   /* list entry of each position */
+    u_int32_t count;
+};
 
 static tcpr_cidr_t *cidr2cidr(char *);
+static u_int32_t cidr_trie_lookup(const tcpr_cidr_trie_t *trie, int af, const u_char *key, int bits);
 
 /**
  * prints to the given fd all the entries in mycidr
@@ -65,6 +105,7 @@ destroy_cidr(tcpr_cidr_t *cidr)
         if (cidr->next != NULL)
             destroy_cidr(cidr->next);
 
+        destroy_cidr_trie(cidr->trie);
         safe_free(cidr);
     }
 }
@@ -83,6 +124,10 @@ add_cidr(tcpr_cidr_t **cidrdata, tcpr_cidr_t **newcidr)
     } else {
         cidr_ptr = *cidrdata;
 
+        /* the list is changing, so any compiled lookup is stale */
+        destroy_cidr_trie(cidr_ptr->trie);
+        cidr_ptr->trie = NULL;
+
         while (cidr_ptr->next != NULL)
             cidr_ptr = cidr_ptr->next;
 
@@ -404,6 +449,8 @@ parse_cidr_map(tcpr_cidrmap_t **cidrmap, const char *optarg)
         ptr->from->next = NULL;
     }
 
+    compile_cidr_map(*cidrmap);
+
     /* success */
     res = 1;
 
@@ -412,6 +459,281 @@ done:
     return res;
 }
 
+/**
+ * parses one x.x.x.x/y or [addr/y] of a rule file, len bytes long, into
+ * cidr.  Names aren't looked up.  Returns 1 for success, 0 on failure
+ */
+static int
+cidr_parse_addr(const char *str, size_t len, tcpr_cidr_t *cidr)
+{
+    char buf[INET6_ADDRSTRLEN + 8];
+    char *slash, *end;
+    long masklen = -1;
+
+    if (len >= 2 && str[0] == '[' && str[len - 1] == ']') {
+        str++;
+        len -= 2;
+    }
+
+    if (len == 0 || len >= sizeof(buf))
+        return 0;
+
+    memcpy(buf, str, len);
+    buf[len] = '\0';
+
+    if ((slash = strchr(buf, '/')) != NULL) {
+        *slash++ = '\0';
+        masklen = strtol(slash, &end, 10);
+        if (end == slash || *end != '\0' || masklen < 0)
+            return 0;
+    }
+
+    if (inet_pton(AF_INET, buf, &cidr->u.network) == 1) {
+        if (masklen > 32)
+            return 0;
+        cidr->family = AF_INET;
+        cidr->masklen = masklen < 0 ? 32 : (int)masklen;
+    } else if (inet_pton(AF_INET6, buf, &cidr->u.network6) == 1) {
+        if (masklen > 128)
+            return 0;
+        cidr->family = AF_INET6;
+        cidr->masklen = masklen < 0 ? 128 : (int)masklen;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * reads all of path into a NUL terminated buffer, returns NULL on failure
+ */
+static char *
+cidr_read_file(const char *path, size_t *len)
+{
+    struct stat st;
+    char *buf;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        warnx("Unable to open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fileno(fp), &st) < 0) {
+        warnx("Unable to stat %s: %s", path, strerror(errno));
+        fclose(fp);
+        return NULL;
+    }
+
+    buf = (char *)safe_malloc((size_t)st.st_size + 1);
+    *len = fread(buf, 1, (size_t)st.st_size, fp);
+    if (ferror(fp)) {
+        warnx("Unable to read %s: %s", path, strerror(errno));
+        safe_free(buf);
+        buf = NULL;
+    } else {
+        buf[*len] = '\0';
+    }
+
+    fclose(fp);
+    return buf;
+}
+
+/**
+ * returns the next rule of a rule file starting at *pos, with comments
+ * and surrounding blanks left out, and its length in *len.  Rules are
+ * separated by newlines or commas, and *line counts the newlines.
+ * Returns NULL at the end
+ */
+static const char *
+cidr_next_rule(const char **pos, const char *end, size_t *len, u_int32_t *line)
+{
+    const char *p = *pos, *rule, *last;
+
+    while (p < end) {
+        /* skip blanks, empty rules and comments */
+        if (*p == '\n') {
+            (*line)++;
+            p++;
+            continue;
+        }
+        if (*p == ',' || isspace((u_char)*p)) {
+            p++;
+            continue;
+        }
+        if (*p == '#') {
+            while (p < end && *p != '\n')
+                p++;
+            continue;
+        }
+
+        rule = p;
+        while (p < end && *p != '\n' && *p != ',' && *p != '#')
+            p++;
+
+        last = p;
+        while (last > rule && isspace((u_char)last[-1]))
+            last--;
+
+        *pos = p;
+        *len = (size_t)(last - rule);
+        return rule;
+    }
+
+    *pos = p;
+    return NULL;
+}
+
+/**
+ * bulk loads a list of CIDRs from the file path, one or more to a line
+ * and separated by blanks or commas, # starting a comment.  Appends to
+ * *cidrdata.  Returns 1 for success, or 0 on failure with a warning
+ * naming the line
+ */
+int
+parse_cidr_file(tcpr_cidr_t **cidrdata, const char *path)
+{
+    tcpr_cidr_t **tail = cidrdata, *cidr;
+    const char *pos, *end, *rule;
+    u_int32_t line = 1, count = 0;
+    size_t len, total;
+    char *buf;
+    int res = 0;
+
+    if ((buf = cidr_read_file(path, &total)) == NULL)
+        return 0;
+
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+
+    pos = buf;
+    end = buf + total;
+    while ((rule = cidr_next_rule(&pos, end, &len, &line)) != NULL) {
+        const char *p = rule, *stop = rule + len;
+
+        /* a rule may hold several CIDRs separated by blanks */
+        while (p < stop) {
+            const char *q = p;
+
+            while (q < stop && !isspace((u_char)*q))
+                q++;
+
+            cidr = new_cidr();
+            if (!cidr_parse_addr(p, (size_t)(q - p), cidr)) {
+                warnx("%s:%u: Unable to parse as a valid CIDR: %.*s", path, line, (int)(q - p), p);
+                safe_free(cidr);
+                goto done;
+            }
+
+            *tail = cidr;
+            tail = &cidr->next;
+            count++;
+
+            for (p = q; p < stop && isspace((u_char)*p); p++)
+                ;
+        }
+    }
+
+    if (count == 0) {
+        warnx("%s: no CIDRs found", path);
+        goto done;
+    }
+
+    dbgx(1, "Loaded %u CIDRs from %s", count, path);
+    res = 1;
+
+done:
+    safe_free(buf);
+    return res;
+}
+
+/**
+ * bulk loads a CIDR map from the file path, with a rule for each line in
+ * the form of --pnat, from:to, or from and to separated by blanks:
+ *
+ *   # comment
+ *   192.168.0.0/16:10.77.0.0/16
+ *   10.1.2.3 172.16.2.3
+ *   [2001:db8::/32]:[dead::/16]
+ *
+ * Commas may separate rules on a line too.  Addresses are parsed without
+ * looking names up, and the map is compiled once at the end, so large
+ * maps load quickly.  Returns 1 for success, or 0 on failure with a
+ * warning naming the line
+ */
+int
+parse_cidr_map_file(tcpr_cidrmap_t **cidrmap, const char *path)
+{
+    tcpr_cidrmap_t *head = NULL, **tail = &head, *map;
+    const char *pos, *end, *rule;
+    u_int32_t line = 1, count = 0;
+    size_t len, total;
+    char *buf;
+    int res = 0;
+
+    if ((buf = cidr_read_file(path, &total)) == NULL)
+        return 0;
+
+    pos = buf;
+    end = buf + total;
+    while ((rule = cidr_next_rule(&pos, end, &len, &line)) != NULL) {
+        const char *to, *stop = rule + len, *from_end;
+
+        /* split at the first : or blank outside of [] */
+        if (*rule == '[') {
+            from_end = memchr(rule, ']', len);
+            from_end = from_end ? from_end + 1 : stop;
+        } else {
+            for (from_end = rule; from_end < stop && *from_end != ':' && !isspace((u_char)*from_end); from_end++)
+                ;
+        }
+
+        for (to = from_end; to < stop && isspace((u_char)*to); to++)
+            ;
+        if (to < stop && *to == ':')
+            to++;
+        for (; to < stop && isspace((u_char)*to); to++)
+            ;
+
+        map = new_cidr_map();
+        map->from = new_cidr();
+        map->to = new_cidr();
+        *tail = map;
+        tail = &map->next;
+
+        if (!cidr_parse_addr(rule, (size_t)(from_end - rule), map->from) ||
+            !cidr_parse_addr(to, (size_t)(stop - to), map->to)) {
+            warnx("%s:%u: Unable to parse as a valid CIDR map: %.*s", path, line, (int)len, rule);
+            goto done;
+        }
+
+        count++;
+    }
+
+    if (count == 0) {
+        warnx("%s: no CIDR maps found", path);
+        goto done;
+    }
+
+    compile_cidr_map(head);
+    *cidrmap = head;
+    head = NULL;
+    dbgx(1, "Loaded %u CIDR maps from %s", count, path);
+    res = 1;
+
+done:
+    while (head != NULL) {
+        map = head->next;
+        destroy_cidr(head->from);
+        destroy_cidr(head->to);
+        safe_free(head);
+        head = map;
+    }
+    safe_free(buf);
+    return res;
+}
+
 /**
  * checks to see if the ip address is in the cidr
  * returns 1 for true, 0 for false
@@ -539,6 +861,18 @@ check_ip_cidr(tcpr_cidr_t *cidrdata, const unsigned long ip)
     if (cidrdata == NULL)
         return 1;
 
+    if (cidrdata->trie != NULL) {
+        u_int32_t addr = (u_int32_t)ip;
+
+        if (cidr_trie_lookup(cidrdata->trie, CIDR_TRIE_V4, (const u_char *)&addr, 32)) {
+            dbgx(3, "Found %s in cidr", get_addr2name4(ip, RESOLVE));
+            return 1;
+        }
+
+        dbgx(3, "Didn't find %s in cidr", get_addr2name4(ip, RESOLVE));
+        return 0;
+    }
+
     mycidr = cidrdata;
 
     /* loop through cidr */
@@ -574,6 +908,16 @@ check_ip6_cidr(tcpr_cidr_t *cidrdata, const struct tcpr_in6_addr *addr)
         return 1;
     }
 
+    if (cidrdata->trie != NULL) {
+        if (cidr_trie_lookup(cidrdata->trie, CIDR_TRIE_V6, addr->tcpr_s6_addr, 128)) {
+            dbgx(3, "Found %s in cidr", get_addr2name6(addr, RESOLVE));
+            return 1;
+        }
+
+        dbgx(3, "Didn't find %s in cidr", get_addr2name6(addr, RESOLVE));
+        return 0;
+    }
+
     mycidr = cidrdata;
 
     /* loop through cidr */
@@ -596,3 +940,330 @@ check_ip6_cidr(tcpr_cidr_t *cidrdata, const struct tcpr_in6_addr *addr)
     dbgx(3, "Didn't find %s in cidr", get_addr2name6(addr, RESOLVE));
     return 0;
 }
+
+/**
+ * returns the trie slot of the CIDR_TRIE_STRIDE bits of key at depth
+ */
+static inline int
+cidr_trie_slot(const u_char *key, int depth)
+{
+    return (key[depth >> 3] >> (8 - CIDR_TRIE_STRIDE - (depth & 7))) & (CIDR_TRIE_SLOTS - 1);
+}
+
+/**
+ * adds a prefix of masklen bits of key (network byte order) as list
+ * position rule.  Prefixes must be added in list order
+ */
+static void
+cidr_trie_insert(tcpr_cidr_trie_t *trie, int af, const u_char *key, int masklen, u_int32_t rule)
+{
+    cidr_trie_node_t **node = &trie->root[af];
+    int depth = 0, first, i;
+
+    if (masklen == 0) {
+        if (trie->any[af] == 0)
+            trie->any[af] = rule;
+        return;
+    }
+
+    while (1) {
+        if (*node == NULL)
+            *node = (cidr_trie_node_t *)safe_malloc(sizeof(cidr_trie_node_t));
+
+        if (masklen - depth <= CIDR_TRIE_STRIDE)
+            break;
+
+        node = &(*node)->child[cidr_trie_slot(key, depth)];
+        depth += CIDR_TRIE_STRIDE;
+    }
+
+    /* fill every slot covered by the rest of the prefix */
+    first = cidr_trie_slot(key, depth) & ~((1 << (CIDR_TRIE_STRIDE - (masklen - depth))) - 1);
+    for (i = first; i < first + (1 << (CIDR_TRIE_STRIDE - (masklen - depth))); i++) {
+        if ((*node)->rule[i] == 0)
+            (*node)->rule[i] = rule;
+    }
+}
+
+static inline u_int32_t
+cidr_host_hash(const u_char *key, int bytes)
+{
+    u_int32_t h = 0x9e3779b9, w;
+    int i;
+
+    for (i = 0; i < bytes; i += 4) {
+        memcpy(&w, key + i, sizeof(w));
+        h = (h ^ w) * 0x85ebca6b;
+        h ^= h >> 15;
+    }
+
+    return h;
+}
+
+/**
+ * adds the host address key, bytes long, as list position rule unless
+ * an earlier entry has it already.  The hash is sized to stay at most
+ * half full, so there always is a free slot
+ */
+static void
+cidr_host_insert(tcpr_cidr_trie_t *trie, int af, const u_char *key, int bytes, u_int32_t rule)
+{
+    cidr_host_t *host = trie->host[af];
+    u_int32_t i = cidr_host_hash(key, bytes) & trie->host_mask[af];
+
+    assert(host);
+
+    for (; host[i].rule != 0; i = (i + 1) & trie->host_mask[af]) {
+        if (memcmp(host[i].addr, key, bytes) == 0)
+            return;
+    }
+
+    host[i].rule = rule;
+    memcpy(host[i].addr, key, bytes);
+}
+
+static inline u_int32_t
+cidr_host_lookup(const tcpr_cidr_trie_t *trie, int af, const u_char *key, int bytes)
+{
+    const cidr_host_t *host = trie->host[af];
+    u_int32_t i;
+
+    if (host == NULL)
+        return 0;
+
+    for (i = cidr_host_hash(key, bytes) & trie->host_mask[af]; host[i].rule != 0; i = (i + 1) & trie->host_mask[af]) {
+        if (memcmp(host[i].addr, key, bytes) == 0)
+            return host[i].rule;
+    }
+
+    return 0;
+}
+
+/**
+ * returns the list position + 1 of the first prefix matching key, which
+ * is bits long, or 0 if none match
+ */
+static u_int32_t
+cidr_trie_lookup(const tcpr_cidr_trie_t *trie, int af, const u_char *key, int bits)
+{
+    const cidr_trie_node_t *node = trie->root[af];
+    u_int32_t best = trie->any[af], host;
+    int depth;
+
+    host = cidr_host_lookup(trie, af, key, bits >> 3);
+    if (host != 0 && (best == 0 || host < best))
+        best = host;
+
+    for (depth = 0; node != NULL && depth < bits; depth += CIDR_TRIE_STRIDE) {
+        int slot = cidr_trie_slot(key, depth);
+
+        if (node->rule[slot] != 0 && (best == 0 || node->rule[slot] < best))
+            best = node->rule[slot];
+
+        node = node->child[slot];
+    }
+
+    return best;
+}
+
+static inline bool
+cidr_is_host(const tcpr_cidr_t *cidr)
+{
+    return (cidr->family == AF_INET && cidr->masklen >= 32) || (cidr->family == AF_INET6 && cidr->masklen >= 128);
+}
+
+/**
+ * allocates a trie for count entries, hosts[] of which are IPv4 and
+ * IPv6 host entries
+ */
+static tcpr_cidr_trie_t *
+cidr_trie_new(u_int32_t count, const u_int32_t hosts[2])
+{
+    tcpr_cidr_trie_t *trie;
+    int af;
+
+    trie = (tcpr_cidr_trie_t *)safe_malloc(sizeof(tcpr_cidr_trie_t));
+    trie->entries = (void **)safe_malloc(count * sizeof(void *));
+
+    for (af = CIDR_TRIE_V4; af <= CIDR_TRIE_V6; af++) {
+        u_int32_t slots = 16;
+
+        if (hosts[af] == 0)
+            continue;
+
+        while (slots < hosts[af] * 2)
+            slots <<= 1;
+
+        trie->host[af] = (cidr_host_t *)safe_malloc(slots * sizeof(cidr_host_t));
+        trie->host_mask[af] = slots - 1;
+    }
+
+    return trie;
+}
+
+static void
+cidr_trie_add(tcpr_cidr_trie_t *trie, const tcpr_cidr_t *cidr, void *entry)
+{
+    trie->entries[trie->count++] = entry;
+
+    if (cidr_is_host(cidr)) {
+        if (cidr->family == AF_INET)
+            cidr_host_insert(trie, CIDR_TRIE_V4, (const u_char *)&cidr->u.network, 4, trie->count);
+        else
+            cidr_host_insert(trie, CIDR_TRIE_V6, cidr->u.network6.tcpr_s6_addr, 16, trie->count);
+    } else if (cidr->family == AF_INET) {
+        cidr_trie_insert(trie,
+                         CIDR_TRIE_V4,
+                         (const u_char *)&cidr->u.network,
+                         cidr->masklen > 32 ? 32 : cidr->masklen,
+                         trie->count);
+    } else if (cidr->family == AF_INET6) {
+        cidr_trie_insert(trie,
+                         CIDR_TRIE_V6,
+                         cidr->u.network6.tcpr_s6_addr,
+                         cidr->masklen > 128 ? 128 : cidr->masklen,
+                         trie->count);
+    }
+}
+
+static void
+cidr_trie_free_node(cidr_trie_node_t *node)
+{
+    int i;
+
+    if (node == NULL)
+        return;
+
+    for (i = 0; i < CIDR_TRIE_SLOTS; i++)
+        cidr_trie_free_node(node->child[i]);
+
+    safe_free(node);
+}
+
+/**
+ * frees a trie built by compile_cidr() or compile_cidr_map()
+ */
+void
+destroy_cidr_trie(tcpr_cidr_trie_t *trie)
+{
+    if (trie == NULL)
+        return;
+
+    cidr_trie_free_node(trie->root[CIDR_TRIE_V4]);
+    cidr_trie_free_node(trie->root[CIDR_TRIE_V6]);
+    safe_free(trie->host[CIDR_TRIE_V4]);
+    safe_free(trie->host[CIDR_TRIE_V6]);
+    safe_free(trie->entries);
+    safe_free(trie);
+}
+
+/**
+ * builds the lookup trie used by check_ip_cidr() and check_ip6_cidr()
+ * for the list starting at cidrdata.  Call again if the list is changed
+ * by anything other than add_cidr()
+ */
+void
+compile_cidr(tcpr_cidr_t *cidrdata)
+{
+    tcpr_cidr_trie_t *trie;
+    tcpr_cidr_t *cidr;
+    u_int32_t count = 0, hosts[2] = {0, 0};
+
+    if (cidrdata == NULL)
+        return;
+
+    for (cidr = cidrdata; cidr != NULL; cidr = cidr->next) {
+        if (cidr_is_host(cidr))
+            hosts[cidr->family == AF_INET ? CIDR_TRIE_V4 : CIDR_TRIE_V6]++;
+        count++;
+    }
+
+    trie = cidr_trie_new(count, hosts);
+
+    for (cidr = cidrdata; cidr != NULL; cidr = cidr->next)
+        cidr_trie_add(trie, cidr, cidr);
+
+    destroy_cidr_trie(cidrdata->trie);
+    cidrdata->trie = trie;
+    dbgx(1, "Compiled %u CIDRs", count);
+}
+
+/**
+ * builds the lookup trie used by find_cidr_map() and find_cidr6_map()
+ * for the map starting at cidrmap
+ */
+void
+compile_cidr_map(tcpr_cidrmap_t *cidrmap)
+{
+    tcpr_cidr_trie_t *trie;
+    tcpr_cidrmap_t *map;
+    u_int32_t count = 0, hosts[2] = {0, 0};
+
+    if (cidrmap == NULL)
+        return;
+
+    for (map = cidrmap; map != NULL; map = map->next) {
+        if (cidr_is_host(map->from))
+            hosts[map->from->family == AF_INET ? CIDR_TRIE_V4 : CIDR_TRIE_V6]++;
+        count++;
+    }
+
+    trie = cidr_trie_new(count, hosts);
+
+    for (map = cidrmap; map != NULL; map = map->next)
+        cidr_trie_add(trie, map->from, map);
+
+    destroy_cidr_trie(cidrmap->trie);
+    cidrmap->trie = trie;
+    dbgx(1, "Compiled %u CIDR maps", count);
+}
+
+/**
+ * returns the first entry of cidrmap whose source network contains the
+ * IPv4 address ip, or NULL if there is none
+ */
+tcpr_cidrmap_t *
+find_cidr_map(tcpr_cidrmap_t *cidrmap, const unsigned long ip)
+{
+    u_int32_t addr = (u_int32_t)ip, rule;
+
+    if (cidrmap == NULL)
+        return NULL;
+
+    if (cidrmap->trie != NULL) {
+        rule = cidr_trie_lookup(cidrmap->trie, CIDR_TRIE_V4, (const u_char *)&addr, 32);
+        return rule ? (tcpr_cidrmap_t *)cidrmap->trie->entries[rule - 1] : NULL;
+    }
+
+    for (; cidrmap != NULL; cidrmap = cidrmap->next) {
+        if (ip_in_cidr(cidrmap->from, ip))
+            return cidrmap;
+    }
+
+    return NULL;
+}
+
+/**
+ * returns the first entry of cidrmap whose source network contains the
+ * IPv6 address addr, or NULL if there is none
+ */
+tcpr_cidrmap_t *
+find_cidr6_map(tcpr_cidrmap_t *cidrmap, const struct tcpr_in6_addr *addr)
+{
+    u_int32_t rule;
+
+    if (cidrmap == NULL)
+        return NULL;
+
+    if (cidrmap->trie != NULL) {
+        rule = cidr_trie_lookup(cidrmap->trie, CIDR_TRIE_V6, addr->tcpr_s6_addr, 128);
+        return rule ? (tcpr_cidrmap_t *)cidrmap->trie->entries[rule - 1] : NULL;
+    }
+
+    for (; cidrmap != NULL; cidrmap = cidrmap->next) {
+        if (ip6_in_cidr(cidrmap->from, addr))
+            return cidrmap;
+    }
+
+    return NULL;
+}
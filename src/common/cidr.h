@@ -22,6 +22,9 @@
 
 #include "cache.h"
 
+/* compiled lookup over a list of CIDRs, see compile_cidr() */
+typedef struct tcpr_cidr_trie_s tcpr_cidr_trie_t;
+
 struct tcpr_cidr_s {
     int family; /* AF_INET or AF_INET6 */
     union {
@@ -30,6 +33,7 @@ struct tcpr_cidr_s {
     } u;
     int masklen;
     struct tcpr_cidr_s *next;
+    tcpr_cidr_trie_t *trie; /* only set on the head of a compiled list */
 };
 
 typedef struct tcpr_cidr_s tcpr_cidr_t;
@@ -38,6 +42,7 @@ struct tcpr_cidrmap_s {
     tcpr_cidr_t *from;
     tcpr_cidr_t *to;
     struct tcpr_cidrmap_s *next;
+    tcpr_cidr_trie_t *trie; /* only set on the head of a compiled map */
 };
 typedef struct tcpr_cidrmap_s tcpr_cidrmap_t;
 
@@ -46,12 +51,19 @@ int check_ip_cidr(tcpr_cidr_t *, const unsigned long);
 int check_ip6_cidr(tcpr_cidr_t *, const struct tcpr_in6_addr *addr);
 int parse_cidr(tcpr_cidr_t **, char *, char *delim);
 int parse_cidr_map(tcpr_cidrmap_t **, const char *);
+int parse_cidr_file(tcpr_cidr_t **, const char *path);
+int parse_cidr_map_file(tcpr_cidrmap_t **, const char *path);
 int parse_endpoints(tcpr_cidrmap_t **, tcpr_cidrmap_t **, const char *);
 void add_cidr(tcpr_cidr_t **, tcpr_cidr_t **);
 tcpr_cidr_t *new_cidr(void);
 tcpr_cidrmap_t *new_cidr_map(void);
 void destroy_cidr(tcpr_cidr_t *);
 void print_cidr(tcpr_cidr_t *);
+void compile_cidr(tcpr_cidr_t *);
+void compile_cidr_map(tcpr_cidrmap_t *);
+void destroy_cidr_trie(tcpr_cidr_trie_t *);
+tcpr_cidrmap_t *find_cidr_map(tcpr_cidrmap_t *, const unsigned long);
+tcpr_cidrmap_t *find_cidr6_map(tcpr_cidrmap_t *, const struct tcpr_in6_addr *);
 
 int ip6_in_cidr(const tcpr_cidr_t *mycidr, const struct tcpr_in6_addr *addr);
 int check_ip6_cidr(tcpr_cidr_t *, const struct tcpr_in6_addr *addr);
@@ -0,0 +1,275 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "crc32.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <string.h>
+
+/*
+ * Every kernel works on the CRC as the bit reflected remainder, before
+ * the final inversion, so they can hand over to each other part way
+ * through a buffer.
+ */
+typedef uint32_t (*crc32_kernel_t)(uint32_t crc, const u_char *p, size_t len);
+
+#define CRC32_POLY 0xedb88320U /* 0x04c11db7 reflected */
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__) &&                                                \
+        (defined __clang__ || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CRC32_HAVE_PCLMUL
+#include <immintrin.h>
+#endif
+
+/* before GCC 10 arm_acle.h only has the CRC32 intrinsics when built for +crc */
+#if defined __GNUC__ && defined __aarch64__ && defined __linux__ &&                                                 \
+        (defined __ARM_FEATURE_CRC32 || (!defined __clang__ && __GNUC__ >= 10))
+#define CRC32_HAVE_ARMV8
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+/* slicing by 8, crc32_table[k][b] is the CRC of byte b followed by k zeros */
+static uint32_t crc32_table[8][256];
+
+static void
+crc32_table_init(void)
+{
+    uint32_t c;
+    int i, j, k;
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t)i;
+        for (j = 0; j < 8; j++)
+            c = c & 1 ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        crc32_table[0][i] = c;
+    }
+
+    for (k = 1; k < 8; k++) {
+        for (i = 0; i < 256; i++) {
+            c = crc32_table[k - 1][i];
+            crc32_table[k][i] = (c >> 8) ^ crc32_table[0][c & 0xff];
+        }
+    }
+}
+
+/* portable version, eight bytes a round whatever the byte order */
+static uint32_t
+crc32_generic(uint32_t crc, const u_char *p, size_t len)
+{
+    uint32_t lo;
+
+    while (len >= 8) {
+        lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc32_table[7][lo & 0xff] ^ crc32_table[6][(lo >> 8) & 0xff] ^ crc32_table[5][(lo >> 16) & 0xff] ^
+              crc32_table[4][lo >> 24] ^ crc32_table[3][p[4]] ^ crc32_table[2][p[5]] ^ crc32_table[1][p[6]] ^
+              crc32_table[0][p[7]];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = crc32_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#ifdef CRC32_HAVE_PCLMUL
+/*
+ * Folding with carry-less multiplies, after "Fast CRC Computation for
+ * Generic Polynomials Using PCLMULQDQ Instruction", Gopal et al., Intel
+ * 2009.  Four 128-bit lanes are folded 64 bytes at a time, then into one
+ * lane, which is reduced to 32 bits with Barrett reduction.  The
+ * constants are those of the paper for the reflected polynomial.
+ */
+#define CRC32_PCLMUL_MIN 64
+
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crc32_pclmul_fold(uint32_t crc, const u_char *p, size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+    /* len is at least CRC32_PCLMUL_MIN and a multiple of 16 */
+    x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+    p += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+        p += 64;
+        len -= 64;
+    }
+
+    /* four lanes into one */
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+        p += 16;
+        len -= 16;
+    }
+
+    /* 128 bits to 64 */
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask32);
+    x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 */
+    x2 = _mm_and_si128(x1, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x10);
+    x2 = _mm_and_si128(x2, mask32);
+    x2 = _mm_clmulepi64_si128(x2, poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+
+static uint32_t
+crc32_pclmul(uint32_t crc, const u_char *p, size_t len)
+{
+    size_t fold;
+
+    if (len >= CRC32_PCLMUL_MIN) {
+        fold = len & ~(size_t)15;
+        crc = crc32_pclmul_fold(crc, p, fold);
+        p += fold;
+        len -= fold;
+    }
+
+    return crc32_generic(crc, p, len);
+}
+#endif /* CRC32_HAVE_PCLMUL */
+
+#ifdef CRC32_HAVE_ARMV8
+/* the ARMv8 CRC32 instructions use the Ethernet polynomial */
+__attribute__((target("+crc"))) static uint32_t
+crc32_armv8(uint32_t crc, const u_char *p, size_t len)
+{
+    uint64_t d;
+    uint32_t w;
+    uint16_t h;
+
+    while (len >= 8) {
+        memcpy(&d, p, sizeof(d));
+        crc = __crc32d(crc, d);
+        p += 8;
+        len -= 8;
+    }
+
+    if (len >= 4) {
+        memcpy(&w, p, sizeof(w));
+        crc = __crc32w(crc, w);
+        p += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        memcpy(&h, p, sizeof(h));
+        crc = __crc32h(crc, h);
+        p += 2;
+        len -= 2;
+    }
+
+    if (len == 1)
+        crc = __crc32b(crc, *p);
+
+    return crc;
+}
+#endif /* CRC32_HAVE_ARMV8 */
+
+static crc32_kernel_t crc32_kernel;
+
+/* pick the fastest kernel this CPU can run */
+static crc32_kernel_t
+crc32_select(void)
+{
+    crc32_kernel_t kernel = crc32_generic;
+    const char *name = "generic";
+
+    /* every kernel finishes off with the tables */
+    crc32_table_init();
+
+#ifdef CRC32_HAVE_PCLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        kernel = crc32_pclmul;
+        name = "pclmul";
+    }
+#endif
+
+#ifdef CRC32_HAVE_ARMV8
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        kernel = crc32_armv8;
+        name = "armv8";
+    }
+#endif
+
+    dbgx(1, "Using %s CRC32 kernel", name);
+    /* threads which see the kernel see the tables too */
+    __atomic_store_n(&crc32_kernel, kernel, __ATOMIC_RELEASE);
+    return kernel;
+}
+
+uint32_t
+tcpr_crc32(const void *data, size_t len, uint32_t crc)
+{
+    crc32_kernel_t kernel = __atomic_load_n(&crc32_kernel, __ATOMIC_ACQUIRE);
+
+    if (kernel == NULL)
+        kernel = crc32_select();
+
+    return ~kernel(~crc, data, len);
+}
@@ -0,0 +1,66 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+/* bytes of FCS at the end of an Ethernet frame */
+#define TCPR_FCS_LEN 4
+
+/*
+ * CRC-32 of IEEE 802.3, as used for the Ethernet frame check sequence
+ *
+ * tcpr_crc32() carries on from crc over len bytes of data, so calls can
+ * be chained over several buffers; pass 0 to start.  The FCS is the CRC
+ * of the frame up to it, stored least significant byte first.
+ */
+uint32_t tcpr_crc32(const void *data, size_t len, uint32_t crc);
+
+/**
+ * \brief write the FCS of the len byte frame right after it
+ */
+static inline void
+tcpr_fcs_put(u_char *frame, size_t len)
+{
+    uint32_t crc = tcpr_crc32(frame, len, 0);
+
+    frame[len] = (u_char)crc;
+    frame[len + 1] = (u_char)(crc >> 8);
+    frame[len + 2] = (u_char)(crc >> 16);
+    frame[len + 3] = (u_char)(crc >> 24);
+}
+
+/**
+ * \brief the last TCPR_FCS_LEN of the len bytes of frame are its FCS
+ */
+static inline bool
+tcpr_fcs_ok(const u_char *frame, size_t len)
+{
+    uint32_t crc;
+
+    if (len < TCPR_FCS_LEN)
+        return false;
+
+    len -= TCPR_FCS_LEN;
+    crc = tcpr_crc32(frame, len, 0);
+    return frame[len] == (u_char)crc && frame[len + 1] == (u_char)(crc >> 8) &&
+           frame[len + 2] == (u_char)(crc >> 16) && frame[len + 3] == (u_char)(crc >> 24);
+}
@@ -0,0 +1,280 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "csum.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <string.h>
+
+/*
+ * Every kernel returns the plain (not ones' complement) sum of the
+ * data taken as native order 32-bit words, which folds down to the same
+ * 16-bit ones' complement sum as adding 16-bit words would. A trailing
+ * odd byte is added as if padded with a zero byte. If dst is set, the
+ * data is copied there as it is summed.
+ */
+typedef uint64_t (*csum_kernel_t)(const u_char *src, u_char *dst, size_t len);
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__) &&                                                \
+        (defined __clang__ || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CSUM_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined __SSE2__
+#include <emmintrin.h>
+#endif
+
+#if defined __ARM_NEON && defined __aarch64__
+#define CSUM_HAVE_NEON
+#include <arm_neon.h>
+#endif
+
+/* fold a 64-bit sum down to 16 bits with end around carry */
+static inline uint32_t
+csum_fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint32_t)sum;
+}
+
+/* sum whatever is left after the vector loop */
+static inline uint64_t
+csum_tail(const u_char *src, u_char *dst, size_t len)
+{
+    uint64_t sum = 0;
+    uint32_t w;
+    union {
+        uint16_t s;
+        uint8_t b[2];
+    } pad;
+
+    if (dst)
+        memcpy(dst, src, len);
+
+    while (len >= 4) {
+        memcpy(&w, src, sizeof(w));
+        sum += w;
+        src += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        memcpy(&pad.s, src, sizeof(pad.s));
+        sum += pad.s;
+        src += 2;
+        len -= 2;
+    }
+
+    if (len == 1) {
+        pad.b[0] = *src;
+        pad.b[1] = 0;
+        sum += pad.s;
+    }
+
+    return sum;
+}
+
+/* portable version: four 32-bit words per round into a 64-bit sum */
+static uint64_t
+csum_generic(const u_char *src, u_char *dst, size_t len)
+{
+    uint64_t sum = 0;
+    uint32_t w[4];
+
+    while (len >= sizeof(w)) {
+        memcpy(w, src, sizeof(w));
+        if (dst) {
+            memcpy(dst, w, sizeof(w));
+            dst += sizeof(w);
+        }
+        sum += (uint64_t)w[0] + w[1] + w[2] + w[3];
+        src += sizeof(w);
+        len -= sizeof(w);
+    }
+
+    return sum + csum_tail(src, dst, len);
+}
+
+#ifdef __SSE2__
+/*
+ * Split each 32-bit lane into its 16-bit halves and add those, so a
+ * lane can absorb 32K rounds before it has to be widened to 64 bits.
+ */
+#define CSUM_SSE2_ROUNDS 32768
+
+static uint64_t
+csum_sse2(const u_char *src, u_char *dst, size_t len)
+{
+    const __m128i mask = _mm_set1_epi32(0xffff);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc64 = zero;
+    uint64_t lanes[2];
+
+    while (len >= 16) {
+        __m128i acc = zero;
+        size_t rounds = min(len / 16, (size_t)CSUM_SSE2_ROUNDS);
+
+        len -= rounds * 16;
+        while (rounds--) {
+            __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+            if (dst) {
+                _mm_storeu_si128((__m128i *)dst, v);
+                dst += 16;
+            }
+            acc = _mm_add_epi32(acc, _mm_and_si128(v, mask));
+            acc = _mm_add_epi32(acc, _mm_srli_epi32(v, 16));
+            src += 16;
+        }
+        acc64 = _mm_add_epi64(acc64, _mm_unpacklo_epi32(acc, zero));
+        acc64 = _mm_add_epi64(acc64, _mm_unpackhi_epi32(acc, zero));
+    }
+
+    _mm_storeu_si128((__m128i *)lanes, acc64);
+    return lanes[0] + lanes[1] + csum_tail(src, dst, len);
+}
+#endif /* __SSE2__ */
+
+#ifdef CSUM_HAVE_AVX2
+#define CSUM_AVX2_ROUNDS 32768
+
+__attribute__((target("avx2"))) static uint64_t
+csum_avx2(const u_char *src, u_char *dst, size_t len)
+{
+    const __m256i mask = _mm256_set1_epi32(0xffff);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc64 = zero;
+    uint64_t lanes[4];
+
+    while (len >= 32) {
+        __m256i acc = zero;
+        size_t rounds = min(len / 32, (size_t)CSUM_AVX2_ROUNDS);
+
+        len -= rounds * 32;
+        while (rounds--) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)src);
+
+            if (dst) {
+                _mm256_storeu_si256((__m256i *)dst, v);
+                dst += 32;
+            }
+            acc = _mm256_add_epi32(acc, _mm256_and_si256(v, mask));
+            acc = _mm256_add_epi32(acc, _mm256_srli_epi32(v, 16));
+            src += 32;
+        }
+        acc64 = _mm256_add_epi64(acc64, _mm256_unpacklo_epi32(acc, zero));
+        acc64 = _mm256_add_epi64(acc64, _mm256_unpackhi_epi32(acc, zero));
+    }
+
+    _mm256_storeu_si256((__m256i *)lanes, acc64);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + csum_tail(src, dst, len);
+}
+#endif /* CSUM_HAVE_AVX2 */
+
+#ifdef CSUM_HAVE_NEON
+/* pairwise add the 16-bit halves straight into 32-bit lanes */
+#define CSUM_NEON_ROUNDS 16384
+
+static uint64_t
+csum_neon(const u_char *src, u_char *dst, size_t len)
+{
+    uint64x2_t acc64 = vdupq_n_u64(0);
+
+    while (len >= 16) {
+        uint32x4_t acc = vdupq_n_u32(0);
+        size_t rounds = min(len / 16, (size_t)CSUM_NEON_ROUNDS);
+
+        len -= rounds * 16;
+        while (rounds--) {
+            uint16x8_t v = vld1q_u16((const uint16_t *)src);
+
+            if (dst) {
+                vst1q_u16((uint16_t *)dst, v);
+                dst += 16;
+            }
+            acc = vpadalq_u16(acc, v);
+            src += 16;
+        }
+        acc64 = vpadalq_u32(acc64, acc);
+    }
+
+    return vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1) + csum_tail(src, dst, len);
+}
+#endif /* CSUM_HAVE_NEON */
+
+static csum_kernel_t csum_kernel;
+
+/* pick the fastest kernel this CPU can run */
+static void
+csum_select(void)
+{
+    csum_kernel_t kernel = csum_generic;
+    const char *name = "generic";
+
+#ifdef __SSE2__
+    kernel = csum_sse2;
+    name = "sse2";
+#endif
+
+#ifdef CSUM_HAVE_NEON
+    kernel = csum_neon;
+    name = "neon";
+#endif
+
+#ifdef CSUM_HAVE_AVX2
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = csum_avx2;
+        name = "avx2";
+    }
+#endif
+
+    dbgx(1, "Using %s checksum kernel", name);
+    csum_kernel = kernel;
+}
+
+uint32_t
+tcpr_csum_partial(const void *data, int len, uint32_t sum)
+{
+    if (csum_kernel == NULL)
+        csum_select();
+
+    if (len <= 0)
+        return csum_fold64(sum);
+
+    return csum_fold64(csum_kernel(data, NULL, (size_t)len) + sum);
+}
+
+uint32_t
+tcpr_csum_partial_copy(void *dst, const void *data, int len, uint32_t sum)
+{
+    if (csum_kernel == NULL)
+        csum_select();
+
+    if (len <= 0)
+        return csum_fold64(sum);
+
+    return csum_fold64(csum_kernel(data, dst, (size_t)len) + sum);
+}
@@ -0,0 +1,38 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+/*
+ * Internet checksum (RFC 1071) helpers shared by all the tools
+ *
+ * tcpr_csum_partial() adds the ones' complement sum of len bytes of
+ * data to sum and returns the result folded to 16 bits, in the byte
+ * order of the data. Calls can be chained over several buffers as long
+ * as all but the last have an even length. The checksum field is the
+ * complement of the final sum, e.g. via CHECKSUM_CARRY().
+ *
+ * tcpr_csum_partial_copy() does the same while copying data to dst,
+ * touching each byte only once.
+ */
+uint32_t tcpr_csum_partial(const void *data, int len, uint32_t sum);
+uint32_t tcpr_csum_partial_copy(void *dst, const void *data, int len, uint32_t sum);
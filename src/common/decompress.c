@@ -0,0 +1,680 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "decompress.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined HAVE_PTHREAD && (defined HAVE_LIBZSTD || defined HAVE_LIBLZ4)
+#define ENABLE_DECOMPRESS
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LIBLZ4
+#include <lz4frame.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+/* first 4 bytes of each format, as a little-endian integer */
+#define ZSTD_FRAME_MAGIC 0xFD2FB528
+#define LZ4_FRAME_MAGIC 0x184D2204
+
+#define DECOMPRESS_BUFSIZE (256 * 1024)
+
+/* pipes are grown to this, or as near as fs.pipe-max-size allows */
+#define DECOMPRESS_PIPE_SIZE (1024 * 1024)
+#define DECOMPRESS_PIPE_SIZE_MIN (64 * 1024)
+
+/* stdio buffer libpcap reads stdin through */
+#define DECOMPRESS_STDIN_BUFSIZE (1024 * 1024)
+
+/**
+ * \brief grow the pipe fd is an end of, if it is one
+ *
+ * A 64 KB pipe makes a writer like zstdcat and libpcap take turns
+ * a page or so at a time.  Past fs.pipe-max-size F_SETPIPE_SZ fails
+ * with EPERM for anybody but root, so smaller sizes are tried too.
+ */
+void
+decompress_grow_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+    struct stat statinfo;
+    int size;
+
+    if (fstat(fd, &statinfo) < 0 || !S_ISFIFO(statinfo.st_mode))
+        return;
+
+    for (size = DECOMPRESS_PIPE_SIZE; size >= DECOMPRESS_PIPE_SIZE_MIN; size /= 2) {
+        if (fcntl(fd, F_SETPIPE_SZ, size) >= 0) {
+            dbgx(1, "Grew pipe %d to %d bytes", fd, size);
+            return;
+        }
+    }
+#else
+    (void)fd;
+#endif
+}
+
+/**
+ * \brief figure out how the given file is compressed, if at all
+ */
+decompress_type_t
+decompress_detect(const char *path)
+{
+    u_char buf[4];
+    u_int32_t magic;
+    int fd;
+
+    assert(path);
+
+    if (strcmp(path, "-") == 0)
+        return DECOMPRESS_NONE;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return DECOMPRESS_NONE;
+
+    if (read(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf)) {
+        close(fd);
+        return DECOMPRESS_NONE;
+    }
+    close(fd);
+
+    magic = (u_int32_t)buf[0] | ((u_int32_t)buf[1] << 8) | ((u_int32_t)buf[2] << 16) | ((u_int32_t)buf[3] << 24);
+    switch (magic) {
+    case ZSTD_FRAME_MAGIC:
+        return DECOMPRESS_ZSTD;
+    case LZ4_FRAME_MAGIC:
+        return DECOMPRESS_LZ4;
+    default:
+        return DECOMPRESS_NONE;
+    }
+}
+
+#ifdef ENABLE_DECOMPRESS
+typedef struct decompress_s {
+    decompress_type_t type;
+    char *path;
+    int in_fd;  /* compressed file */
+    int out_fd; /* write end of the pipe */
+} decompress_t;
+
+/**
+ * \brief write all of buf to the pipe
+ *
+ * Returns 0 or the errno of the failure.  EPIPE means the reader has
+ * closed its end, which isn't an error worth reporting
+ */
+static int
+decompress_write(decompress_t *d, const u_char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        if ((ret = write(d->out_fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE)
+                warnx("Unable to decompress %s: %s", d->path, strerror(errno));
+            return errno;
+        }
+
+        buf += ret;
+        len -= (size_t)ret;
+    }
+
+    return 0;
+}
+
+static ssize_t
+decompress_read(decompress_t *d, u_char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while ((ret = read(d->in_fd, buf, len)) < 0 && errno == EINTR)
+        ;
+
+    if (ret < 0)
+        warnx("Unable to read %s: %s", d->path, strerror(errno));
+
+    return ret;
+}
+
+#ifdef HAVE_LIBZSTD
+/**
+ * \brief decompress a zstd file a buffer at a time
+ */
+static void
+zstd_stream(decompress_t *d)
+{
+    ZSTD_DStream *ds;
+    size_t insize = ZSTD_DStreamInSize();
+    size_t outsize = ZSTD_DStreamOutSize();
+    u_char *inbuf, *outbuf;
+    ssize_t len;
+
+    if ((ds = ZSTD_createDStream()) == NULL) {
+        warnx("Unable to decompress %s: %s", d->path, "out of memory");
+        return;
+    }
+    ZSTD_initDStream(ds);
+
+    inbuf = (u_char *)safe_malloc(insize);
+    outbuf = (u_char *)safe_malloc(outsize);
+
+    while ((len = decompress_read(d, inbuf, insize)) > 0) {
+        ZSTD_inBuffer in = {inbuf, (size_t)len, 0};
+        ZSTD_outBuffer out;
+        size_t ret;
+
+        do {
+            out.dst = outbuf;
+            out.size = outsize;
+            out.pos = 0;
+
+            ret = ZSTD_decompressStream(ds, &out, &in);
+            if (ZSTD_isError(ret)) {
+                warnx("Unable to decompress %s: %s", d->path, ZSTD_getErrorName(ret));
+                goto done;
+            }
+
+            if (decompress_write(d, outbuf, out.pos) != 0)
+                goto done;
+        } while (in.pos < in.size || out.pos == out.size);
+    }
+
+done:
+    safe_free(outbuf);
+    safe_free(inbuf);
+    ZSTD_freeDStream(ds);
+}
+
+#ifdef HAVE_MMAP
+/* frames larger than this are left to zstd_stream() */
+#define ZSTD_MT_MAX_FRAME (256 * 1024 * 1024)
+
+typedef struct zstd_frame_s {
+    const u_char *src;
+    size_t csize;
+    size_t dsize;
+    u_char *dst;
+    bool ready;
+} zstd_frame_t;
+
+typedef struct zstd_mt_s {
+    decompress_t *d;
+    zstd_frame_t *frames;
+    COUNTER cnt;
+    COUNTER next_claim; /* next frame for a worker to decompress */
+    COUNTER next_write; /* next frame to write to the pipe */
+    COUNTER window;     /* max frames decompressed ahead of next_write */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool abort;
+} zstd_mt_t;
+
+static void *
+zstd_worker(void *arg)
+{
+    zstd_mt_t *mt = arg;
+    ZSTD_DCtx *dctx;
+
+    pthread_mutex_lock(&mt->lock);
+    if ((dctx = ZSTD_createDCtx()) == NULL) {
+        warnx("Unable to decompress %s: %s", mt->d->path, "out of memory");
+        mt->abort = true;
+        pthread_cond_broadcast(&mt->cond);
+        pthread_mutex_unlock(&mt->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        zstd_frame_t *f;
+        size_t ret;
+
+        while (!mt->abort && mt->next_claim < mt->cnt && mt->next_claim >= mt->next_write + mt->window)
+            pthread_cond_wait(&mt->cond, &mt->lock);
+
+        if (mt->abort || mt->next_claim >= mt->cnt)
+            break;
+
+        f = &mt->frames[mt->next_claim++];
+        pthread_mutex_unlock(&mt->lock);
+
+        f->dst = (u_char *)safe_malloc(f->dsize ? f->dsize : 1);
+        ret = ZSTD_decompressDCtx(dctx, f->dst, f->dsize, f->src, f->csize);
+
+        pthread_mutex_lock(&mt->lock);
+        if (ZSTD_isError(ret) || ret != f->dsize) {
+            warnx("Unable to decompress %s: %s",
+                  mt->d->path,
+                  ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "frame size mismatch");
+            mt->abort = true;
+        }
+        f->ready = true;
+        pthread_cond_broadcast(&mt->cond);
+    }
+    pthread_mutex_unlock(&mt->lock);
+
+    ZSTD_freeDCtx(dctx);
+    return NULL;
+}
+
+/**
+ * \brief decompress the frames of a zstd file in parallel, writing them in order
+ *
+ * Returns 0 when done (or on error, which has been reported), or 1 if the
+ * file isn't suitable and should go through zstd_stream() instead
+ */
+static int
+zstd_parallel(decompress_t *d)
+{
+    pthread_t workers[DECOMPRESS_MAX_THREADS];
+    zstd_frame_t *frames = NULL;
+    COUNTER cnt = 0, max = 0, i;
+    const u_char *base;
+    struct stat statbuf;
+    size_t offset = 0;
+    zstd_mt_t mt;
+    long cpus;
+    int threads, started = 0, t;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cpus > DECOMPRESS_MAX_THREADS ? DECOMPRESS_MAX_THREADS : (int)cpus;
+    if (threads < 2)
+        return 1;
+
+    if (fstat(d->in_fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_size == 0)
+        return 1;
+
+    base = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_PRIVATE, d->in_fd, 0);
+    if (base == MAP_FAILED)
+        return 1;
+
+    /* every frame must have a known size for the output to be preallocated */
+    while (offset < (size_t)statbuf.st_size) {
+        size_t csize = ZSTD_findFrameCompressedSize(base + offset, (size_t)statbuf.st_size - offset);
+        unsigned long long dsize;
+
+        if (ZSTD_isError(csize))
+            goto fallback;
+
+        dsize = ZSTD_getFrameContentSize(base + offset, csize);
+        if (dsize == ZSTD_CONTENTSIZE_UNKNOWN || dsize == ZSTD_CONTENTSIZE_ERROR || dsize > ZSTD_MT_MAX_FRAME)
+            goto fallback;
+
+        if (cnt == max) {
+            max = max ? max * 2 : 64;
+            frames = safe_realloc(frames, max * sizeof(zstd_frame_t));
+        }
+        frames[cnt].src = base + offset;
+        frames[cnt].csize = csize;
+        frames[cnt].dsize = (size_t)dsize;
+        frames[cnt].dst = NULL;
+        frames[cnt].ready = false;
+        cnt++;
+        offset += csize;
+    }
+
+    if (cnt < 2)
+        goto fallback;
+
+    dbgx(1, "Decompressing %s: " COUNTER_SPEC " frames on %d threads", d->path, cnt, threads);
+
+    memset(&mt, 0, sizeof(mt));
+    mt.d = d;
+    mt.frames = frames;
+    mt.cnt = cnt;
+    mt.window = (COUNTER)threads * 2;
+    pthread_mutex_init(&mt.lock, NULL);
+    pthread_cond_init(&mt.cond, NULL);
+
+    for (t = 0; t < threads; t++) {
+        if (pthread_create(&workers[t], NULL, zstd_worker, &mt) != 0)
+            break;
+        started++;
+    }
+
+    if (started == 0) {
+        pthread_cond_destroy(&mt.cond);
+        pthread_mutex_destroy(&mt.lock);
+        goto fallback;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        pthread_mutex_lock(&mt.lock);
+        while (!frames[i].ready && !mt.abort)
+            pthread_cond_wait(&mt.cond, &mt.lock);
+        pthread_mutex_unlock(&mt.lock);
+
+        if (mt.abort || decompress_write(d, frames[i].dst, frames[i].dsize) != 0)
+            break;
+
+        safe_free(frames[i].dst);
+        frames[i].dst = NULL;
+
+        pthread_mutex_lock(&mt.lock);
+        mt.next_write++;
+        pthread_cond_broadcast(&mt.cond);
+        pthread_mutex_unlock(&mt.lock);
+    }
+
+    pthread_mutex_lock(&mt.lock);
+    mt.abort = true;
+    pthread_cond_broadcast(&mt.cond);
+    pthread_mutex_unlock(&mt.lock);
+
+    for (t = 0; t < started; t++)
+        pthread_join(workers[t], NULL);
+
+    pthread_cond_destroy(&mt.cond);
+    pthread_mutex_destroy(&mt.lock);
+
+    for (i = 0; i < cnt; i++)
+        safe_free(frames[i].dst);
+    safe_free(frames);
+    munmap((void *)base, (size_t)statbuf.st_size);
+    return 0;
+
+fallback:
+    safe_free(frames);
+    munmap((void *)base, (size_t)statbuf.st_size);
+    return 1;
+}
+#endif /* HAVE_MMAP */
+#endif /* HAVE_LIBZSTD */
+
+#ifdef HAVE_LIBLZ4
+/**
+ * \brief decompress an lz4 frame file a buffer at a time
+ */
+static void
+lz4_stream(decompress_t *d)
+{
+    LZ4F_dctx *dctx;
+    LZ4F_errorCode_t rcode;
+    u_char *inbuf, *outbuf;
+    ssize_t len;
+
+    rcode = LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION);
+    if (LZ4F_isError(rcode)) {
+        warnx("Unable to decompress %s: %s", d->path, LZ4F_getErrorName(rcode));
+        return;
+    }
+
+    inbuf = (u_char *)safe_malloc(DECOMPRESS_BUFSIZE);
+    outbuf = (u_char *)safe_malloc(DECOMPRESS_BUFSIZE);
+
+    while ((len = decompress_read(d, inbuf, DECOMPRESS_BUFSIZE)) > 0) {
+        size_t pos = 0;
+
+        /* keep going until all input is used and there's no more output */
+        for (;;) {
+            size_t srcsize = (size_t)len - pos;
+            size_t dstsize = DECOMPRESS_BUFSIZE;
+            size_t ret;
+
+            ret = LZ4F_decompress(dctx, outbuf, &dstsize, inbuf + pos, &srcsize, NULL);
+            if (LZ4F_isError(ret)) {
+                warnx("Unable to decompress %s: %s", d->path, LZ4F_getErrorName(ret));
+                goto done;
+            }
+
+            if (decompress_write(d, outbuf, dstsize) != 0)
+                goto done;
+
+            pos += srcsize;
+            if (pos >= (size_t)len && dstsize < DECOMPRESS_BUFSIZE)
+                break;
+        }
+    }
+
+done:
+    safe_free(outbuf);
+    safe_free(inbuf);
+    LZ4F_freeDecompressionContext(dctx);
+}
+#endif /* HAVE_LIBLZ4 */
+
+static void *
+decompress_thread(void *arg)
+{
+    decompress_t *d = arg;
+    sigset_t set;
+
+    /* if the reader goes away, we want EPIPE rather than SIGPIPE */
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    switch (d->type) {
+#ifdef HAVE_LIBZSTD
+    case DECOMPRESS_ZSTD:
+#ifdef HAVE_MMAP
+        if (zstd_parallel(d) == 0)
+            break;
+#endif
+        zstd_stream(d);
+        break;
+#endif
+#ifdef HAVE_LIBLZ4
+    case DECOMPRESS_LZ4:
+        lz4_stream(d);
+        break;
+#endif
+    default:
+        break;
+    }
+
+    close(d->out_fd);
+    close(d->in_fd);
+    safe_free(d->path);
+    safe_free(d);
+    return NULL;
+}
+#endif /* ENABLE_DECOMPRESS */
+
+/**
+ * \brief open a compressed file for reading
+ *
+ * Returns a file descriptor the decompressed contents can be read from, or
+ * -1 and fills in ebuf on error.  Closing the descriptor early is fine.
+ */
+int
+decompress_open(const char *path, char *ebuf)
+{
+    decompress_type_t type;
+#ifdef ENABLE_DECOMPRESS
+    decompress_t *d;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int fds[2];
+    int in_fd;
+#endif
+
+    assert(path);
+    assert(ebuf);
+
+    type = decompress_detect(path);
+    switch (type) {
+#ifdef HAVE_LIBZSTD
+    case DECOMPRESS_ZSTD:
+        break;
+#endif
+#ifdef HAVE_LIBLZ4
+    case DECOMPRESS_LZ4:
+        break;
+#endif
+    case DECOMPRESS_NONE:
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s is not compressed", path);
+        return -1;
+    default:
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s support was not compiled in. See INSTALL.",
+                 path, type == DECOMPRESS_ZSTD ? "zstd" : "lz4");
+        return -1;
+    }
+
+#ifdef ENABLE_DECOMPRESS
+    if ((in_fd = open(path, O_RDONLY)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    if (pipe(fds) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to create pipe: %s", strerror(errno));
+        close(in_fd);
+        return -1;
+    }
+    decompress_grow_pipe(fds[0]);
+
+    d = (decompress_t *)safe_malloc(sizeof(decompress_t));
+    d->type = type;
+    d->path = safe_strdup(path);
+    d->in_fd = in_fd;
+    d->out_fd = fds[1];
+
+    /* nobody waits for the thread, it cleans up after itself */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, decompress_thread, d) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start decompression thread");
+        pthread_attr_destroy(&attr);
+        close(fds[0]);
+        close(fds[1]);
+        close(in_fd);
+        safe_free(d->path);
+        safe_free(d);
+        return -1;
+    }
+    pthread_attr_destroy(&attr);
+
+    return fds[0];
+#else
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: decompression requires POSIX threads", path);
+    return -1;
+#endif
+}
+
+/**
+ * \brief pcap_open_offline_with_tstamp_precision() which also reads zstd
+ * and lz4 compressed files, and http://, https:// and s3:// URLs
+ *
+ * "-" is stdin, which is read in large blocks, through a pipe made as
+ * big as we are allowed if it is one.
+ *
+ * With PCAP_TSTAMP_PRECISION_NANO, tv_usec of every pcap_pkthdr holds
+ * nanoseconds.  If libpcap is too old to scale timestamps, the file is
+ * opened at its own precision; use tcpr_pcap_tstamp_nsec() to find out
+ * what you got.
+ */
+pcap_t *
+tcpr_pcap_open_offline_with_tstamp_precision(const char *path, int precision, char *ebuf)
+{
+    pcap_t *pcap;
+    FILE *fp;
+    int fd;
+
+    assert(path);
+    assert(ebuf);
+
+    if (strcmp(path, "-") == 0) {
+        static char stdin_buf[DECOMPRESS_STDIN_BUFSIZE];
+        static bool stdin_setup;
+
+        /*
+         * libpcap does a fread() per record header and per packet, which
+         * through the default stdio buffer is a read() every few packets.
+         * Only possible before the first read
+         */
+        if (!stdin_setup) {
+            decompress_grow_pipe(STDIN_FILENO);
+            setvbuf(stdin, stdin_buf, _IOFBF, sizeof(stdin_buf));
+            stdin_setup = true;
+        }
+        fp = stdin;
+    } else if (!remote_is_url(path) && decompress_detect(path) == DECOMPRESS_NONE) {
+#ifdef HAVE_PCAP_OPEN_OFFLINE_WITH_TSTAMP_PRECISION
+        return pcap_open_offline_with_tstamp_precision(path, (u_int)precision, ebuf);
+#else
+        (void)precision;
+        return pcap_open_offline(path, ebuf);
+#endif
+    } else {
+        fd = remote_is_url(path) ? remote_open(path, ebuf) : decompress_open(path, ebuf);
+        if (fd < 0)
+            return NULL;
+
+        if ((fp = fdopen(fd, "r")) == NULL) {
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+            close(fd);
+            return NULL;
+        }
+    }
+
+    /* pcap_close() closes fp for us, but for stdin */
+#ifdef HAVE_PCAP_OPEN_OFFLINE_WITH_TSTAMP_PRECISION
+    pcap = pcap_fopen_offline_with_tstamp_precision(fp, (u_int)precision, ebuf);
+#else
+    pcap = pcap_fopen_offline(fp, ebuf);
+#endif
+    if (pcap == NULL && fp != stdin)
+        fclose(fp);
+
+    return pcap;
+}
+
+/**
+ * \brief drop-in replacement for pcap_open_offline() which also reads
+ * zstd and lz4 compressed files
+ */
+pcap_t *
+tcpr_pcap_open_offline(const char *path, char *ebuf)
+{
+    return tcpr_pcap_open_offline_with_tstamp_precision(path, PCAP_TSTAMP_PRECISION_MICRO, ebuf);
+}
+
+/**
+ * \brief true if tv_usec of packets read from pcap holds nanoseconds
+ */
+bool
+tcpr_pcap_tstamp_nsec(pcap_t *pcap)
+{
+#ifdef HAVE_PCAP_OPEN_OFFLINE_WITH_TSTAMP_PRECISION
+    return pcap_get_tstamp_precision(pcap) == PCAP_TSTAMP_PRECISION_NANO;
+#else
+    (void)pcap;
+    return false;
+#endif
+}
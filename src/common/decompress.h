@@ -0,0 +1,55 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include <pcap.h>
+
+/*
+ * Reading zstd and lz4 compressed pcap files.
+ *
+ * Compression is detected by magic number, not by file name.  The file is
+ * decompressed by a background thread into a pipe which libpcap (or
+ * anything else wanting a file descriptor) reads from, so decompression
+ * and packet parsing run on separate cores.  zstd files made of several
+ * frames with known sizes (zstd -T, pzstd, etc...) are decompressed by
+ * multiple threads, one frame each.  Pipes, and stdin when it is one,
+ * are grown so the writer and libpcap don't take turns a page at a time.
+ */
+typedef enum {
+    DECOMPRESS_NONE = 0,
+    DECOMPRESS_ZSTD,
+    DECOMPRESS_LZ4,
+} decompress_type_t;
+
+/* max threads used to decompress a multi-frame zstd file */
+#define DECOMPRESS_MAX_THREADS 8
+
+decompress_type_t decompress_detect(const char *path);
+int decompress_open(const char *path, char *ebuf);
+void decompress_grow_pipe(int fd);
+#ifndef PCAP_TSTAMP_PRECISION_MICRO
+#define PCAP_TSTAMP_PRECISION_MICRO 0
+#define PCAP_TSTAMP_PRECISION_NANO 1
+#endif
+
+pcap_t *tcpr_pcap_open_offline(const char *path, char *ebuf);
+pcap_t *tcpr_pcap_open_offline_with_tstamp_precision(const char *path, int precision, char *ebuf);
+bool tcpr_pcap_tstamp_nsec(pcap_t *pcap);
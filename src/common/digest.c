@@ -0,0 +1,307 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "digest.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "flows.h"
+#include <stdio.h>
+#include <string.h>
+
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
+/* flows a digest starts with room for, grown as they are seen */
+#define DIGEST_FLOWS_MIN 1024
+
+/* the key the chain of packets without a flow is summed under, above any flow_hash() */
+#define DIGEST_OTHER_KEY (1ULL << 32)
+
+static inline uint64_t
+xxh_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+/* XXH64 reads its input as little endian words */
+static inline uint64_t
+xxh_read64(const u_char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+#ifdef WORDS_BIGENDIAN
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t
+xxh_read32(const u_char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+#ifdef WORDS_BIGENDIAN
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+static inline uint64_t
+xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t
+xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+/**
+ * \brief XXH64 of len bytes of data
+ *
+ * The same value as the reference implementation.  The four lanes of the
+ * main loop are independent, so they keep a superscalar core busy and
+ * packets hash at several bytes a cycle without any vector code.
+ */
+uint64_t
+tcpr_xxh64(const void *data, size_t len, uint64_t seed)
+{
+    const u_char *p = (const u_char *)data;
+    const u_char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        const u_char *limit = end - 32;
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+
+    h += (uint64_t)len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+
+    if (p + 4 <= end) {
+        h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+
+    for (; p < end; p++) {
+        h ^= (uint64_t)*p * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/**
+ * \brief a new digest, which also keeps one per flow if datalink isn't -1
+ */
+tcpr_digest_t *
+tcpr_digest_new(int datalink)
+{
+    tcpr_digest_t *digest = safe_malloc(sizeof(*digest));
+
+    digest->ordered = true;
+    digest->datalink = datalink;
+    return digest;
+}
+
+void
+tcpr_digest_free(tcpr_digest_t *digest)
+{
+    if (digest == NULL)
+        return;
+
+    safe_free(digest->flows);
+    safe_free(digest);
+}
+
+/* what a flow whose packets hashed to chain adds to flow_sum */
+static inline uint64_t
+digest_flow_value(uint64_t key, uint64_t chain)
+{
+    uint64_t words[2];
+
+    words[0] = key;
+    words[1] = chain;
+    return flow_hash_words(words, sizeof(words), 0);
+}
+
+/* the entry of the flow with key, a free one to fill in if it's new */
+static tcpr_digest_flow_t *
+digest_flow_find(tcpr_digest_flow_t *flows, uint32_t size, uint32_t key)
+{
+    /* already a hash */
+    uint32_t i = key & (size - 1);
+
+    while (flows[i].used && flows[i].key != key)
+        i = (i + 1) & (size - 1);
+
+    return &flows[i];
+}
+
+/* keep the table at most half full */
+static void
+digest_flows_grow(tcpr_digest_t *digest)
+{
+    tcpr_digest_flow_t *old = digest->flows;
+    uint32_t old_size = digest->flows_size;
+    uint32_t i;
+
+    digest->flows_size = old_size ? old_size * 2 : DIGEST_FLOWS_MIN;
+    digest->flows = safe_malloc(sizeof(tcpr_digest_flow_t) * digest->flows_size);
+
+    for (i = 0; i < old_size; i++) {
+        if (old[i].used)
+            *digest_flow_find(digest->flows, digest->flows_size, old[i].key) = old[i];
+    }
+
+    safe_free(old);
+}
+
+/**
+ * \brief fold a packet of len bytes which was sent into the digest
+ */
+void
+tcpr_digest_add(tcpr_digest_t *digest, const u_char *data, size_t len)
+{
+    uint64_t h = tcpr_xxh64(data, len, 0);
+
+    digest->state = xxh_round(digest->state, h);
+    digest->packets++;
+    digest->bytes += len;
+
+    if (digest->datalink != -1) {
+        struct pcap_pkthdr pkthdr;
+        uint32_t key;
+
+        memset(&pkthdr, 0, sizeof(pkthdr));
+        pkthdr.caplen = pkthdr.len = (bpf_u_int32)len;
+
+        if (flow_hash(&pkthdr, data, digest->datalink, &key)) {
+            tcpr_digest_flow_t *flow;
+
+            if (digest->flows_cnt >= digest->flows_size / 2)
+                digest_flows_grow(digest);
+
+            flow = digest_flow_find(digest->flows, digest->flows_size, key);
+            if (flow->used) {
+                digest->flow_sum -= digest_flow_value(key, flow->chain);
+            } else {
+                flow->used = true;
+                flow->key = key;
+                digest->flows_cnt++;
+            }
+            flow->chain = xxh_round(flow->chain, h);
+            digest->flow_sum += digest_flow_value(key, flow->chain);
+        } else {
+            if (digest->other != 0)
+                digest->flow_sum -= digest_flow_value(DIGEST_OTHER_KEY, digest->other);
+            digest->other = xxh_round(digest->other, h);
+            digest->flow_sum += digest_flow_value(DIGEST_OTHER_KEY, digest->other);
+        }
+    }
+}
+
+/**
+ * \brief add the digest of a parallel sender into to and start from again
+ *
+ * Only the sum of the flows stays meaningful, unless from had nothing.
+ */
+void
+tcpr_digest_merge(tcpr_digest_t *to, tcpr_digest_t *from)
+{
+    if (from->packets == 0)
+        return;
+
+    to->flow_sum += from->flow_sum;
+    to->packets += from->packets;
+    to->bytes += from->bytes;
+    to->flows_cnt += from->flows_cnt;
+    to->ordered = false;
+
+    from->state = 0;
+    from->flow_sum = 0;
+    from->packets = 0;
+    from->bytes = 0;
+    from->flows_cnt = 0;
+    from->other = 0;
+    if (from->flows != NULL)
+        memset(from->flows, 0, sizeof(tcpr_digest_flow_t) * from->flows_size);
+}
+
+/**
+ * \brief one line of what the digest has seen
+ */
+void
+tcpr_digest_summary(const tcpr_digest_t *digest, char *buf, size_t len)
+{
+    int n = 0;
+
+    buf[0] = '\0';
+    if (digest->ordered)
+        n = snprintf(buf, len, "xxh64 %016llx, ", (unsigned long long)digest->state);
+    if (digest->datalink != -1 && n >= 0 && (size_t)n < len)
+        snprintf(buf + n,
+                 len - n,
+                 "by flow %016llx over %u flows, ",
+                 (unsigned long long)digest->flow_sum,
+                 digest->flows_cnt);
+    n = (int)strlen(buf);
+    if ((size_t)n < len)
+        snprintf(buf + n, len - n, COUNTER_SPEC " packets (" COUNTER_SPEC " bytes)", digest->packets, digest->bytes);
+}
@@ -0,0 +1,66 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+/*
+ * --digest: a hash of every packet sent or written, to tell whether two
+ * runs put the same bytes on the wire.  Each packet is hashed on its own
+ * with XXH64, then the packet hashes are folded in:
+ *
+ *  - in order, into state, which changes if packets are reordered
+ *  - with flows, into a chain for each flow, in the order of its
+ *    packets, which are summed.  Their sum is the same whichever way
+ *    the flows were interleaved, so it can be compared between runs
+ *    with --threads or --fleet, and the digests of several workers are
+ *    added together.  Packets which aren't part of a flow are chained
+ *    together like another flow.
+ *
+ * A tcpr_digest_t is only updated by the thread sending on its
+ * sendpacket_t; state, flow_sum, packets and bytes may be read with
+ * relaxed atomic loads at any time.
+ */
+typedef struct tcpr_digest_flow_s {
+    uint32_t key; /* flow_hash() of the flow */
+    bool used;
+    uint64_t chain;
+} tcpr_digest_flow_t;
+
+typedef struct tcpr_digest_s {
+    uint64_t state;    /* every packet in order, 0 until the first */
+    uint64_t flow_sum; /* of the chains of every flow, with flows */
+    COUNTER packets;
+    COUNTER bytes;
+    bool ordered; /* false once digests of parallel senders were added in */
+    int datalink; /* to find the flow of a packet, -1 if not wanted */
+    tcpr_digest_flow_t *flows;
+    uint32_t flows_size; /* power of two */
+    uint32_t flows_cnt;
+    uint64_t other; /* chain of the packets without a flow */
+} tcpr_digest_t;
+
+uint64_t tcpr_xxh64(const void *data, size_t len, uint64_t seed);
+
+tcpr_digest_t *tcpr_digest_new(int datalink);
+void tcpr_digest_free(tcpr_digest_t *digest);
+void tcpr_digest_add(tcpr_digest_t *digest, const u_char *data, size_t len);
+void tcpr_digest_merge(tcpr_digest_t *to, tcpr_digest_t *from);
+void tcpr_digest_summary(const tcpr_digest_t *digest, char *buf, size_t len);
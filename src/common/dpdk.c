@@ -0,0 +1,677 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * DPDK transmit support, for ports bound to a DPDK poll mode driver
+ * and so invisible to the kernel.
+ *
+ * sendpacket_open() hands -i dpdk:PORT here.  The EAL is brought up on
+ * the first open, with the arguments of --dpdk-eal, and the port gets a
+ * TX queue for every send thread.  No RX queue is set up since we never
+ * receive.  Packets are either copied into an mbuf or, if they lie in
+ * packet cache memory registered with sendpacket_dpdk_register(), sent
+ * from where they are in an mbuf attached to them as an external
+ * buffer.
+ */
+
+#include "dpdk.h"
+#include "config.h"
+#include "common.h"
+#include "tcpreplay_api.h"
+
+#ifdef HAVE_DPDK
+
+#include <errno.h>
+#include <inttypes.h>
+#include <rte_dev.h>
+#include <rte_eal.h>
+#include <rte_errno.h>
+#include <rte_ethdev.h>
+#include <rte_mbuf.h>
+#include <rte_memory.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+/* most --dpdk-eal arguments */
+#define DPDK_EAL_ARGS_MAX 64
+
+struct dpdk_port_s {
+    uint16_t id;
+    uint16_t nb_queues;
+    int refs; /* queues open */
+    struct rte_device *device;
+    dpdk_t *queues[TCPR_DPDK_QUEUES_MAX];
+};
+
+/* packet cache memory the NIC can send from, see sendpacket_dpdk_register() */
+typedef struct dpdk_mem_s {
+    const u_char *base;
+    size_t len; /* 0 once unregistered */
+    rte_iova_t iova;
+    dpdk_port_t *port; /* the port which may send from it, NULL once closed */
+    bool mapped;       /* DMA mapped for the device of port */
+    struct rte_mbuf_ext_shared_info shinfo;
+} dpdk_mem_t;
+
+static bool dpdk_eal_up;
+static dpdk_port_t *dpdk_ports[RTE_MAX_ETHPORTS];
+static dpdk_mem_t dpdk_mem[TCPR_DPDK_MEM_MAX];
+static uint32_t dpdk_mem_cnt;
+
+/**
+ * start the EAL with the whitespace separated arguments args, or a
+ * default of running from memory of our own if NULL
+ */
+static int
+dpdk_eal_init(const char *args, char *errbuf)
+{
+    char *argv[DPDK_EAL_ARGS_MAX + 2];
+    char *copy, *tok, *save = NULL;
+    int argc = 0;
+
+    if (dpdk_eal_up)
+        return 0;
+
+    copy = safe_strdup(args != NULL ? args : "--in-memory");
+    argv[argc++] = "tcpreplay";
+    for (tok = strtok_r(copy, " \t", &save); tok != NULL; tok = strtok_r(NULL, " \t", &save)) {
+        if (argc > DPDK_EAL_ARGS_MAX) {
+            snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "More than %d --dpdk-eal arguments", DPDK_EAL_ARGS_MAX);
+            safe_free(copy);
+            return -1;
+        }
+        argv[argc++] = tok;
+    }
+    argv[argc] = NULL;
+
+    /* the EAL keeps pointers into argv, so copy isn't freed */
+    if (rte_eal_init(argc, argv) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to start the DPDK EAL: %s", rte_strerror(rte_errno));
+        return -1;
+    }
+
+    dbgx(1, "DPDK EAL up, IOVA as %s", rte_eal_iova_mode() == RTE_IOVA_VA ? "VA" : "PA");
+    dpdk_eal_up = true;
+    return 0;
+}
+
+/**
+ * port id of a DPDK device name or number
+ */
+static int
+dpdk_port_id(const char *name, uint16_t *id)
+{
+    char *end;
+    unsigned long n;
+
+    if (rte_eth_dev_get_port_by_name(name, id) == 0)
+        return 0;
+
+    n = strtoul(name, &end, 10);
+    if (*name == '\0' || *end != '\0' || n >= RTE_MAX_ETHPORTS || !rte_eth_dev_is_valid_port((uint16_t)n))
+        return -1;
+
+    *id = (uint16_t)n;
+    return 0;
+}
+
+/**
+ * make the mbuf pools of a TX queue, on the NUMA node of the port
+ */
+static int
+dpdk_queue_pools(dpdk_t *dpdk, int socket, char *errbuf)
+{
+    char name[RTE_MEMPOOL_NAMESIZE];
+
+    snprintf(name, sizeof(name), "tcpr_p%u_q%u", dpdk->port->id, dpdk->queue);
+    dpdk->pool = rte_pktmbuf_pool_create(name,
+                                         TCPR_DPDK_POOL_SIZE,
+                                         TCPR_DPDK_POOL_CACHE,
+                                         0,
+                                         RTE_PKTMBUF_HEADROOM + TCPR_DPDK_MTU_MAX,
+                                         socket);
+    if (dpdk->pool == NULL) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to create mbuf pool %s: %s", name, rte_strerror(rte_errno));
+        return -1;
+    }
+
+    /* only the zero copy sends need these, so do without if short of memory */
+    snprintf(name, sizeof(name), "tcpr_x%u_q%u", dpdk->port->id, dpdk->queue);
+    dpdk->ext_pool = rte_pktmbuf_pool_create(name, TCPR_DPDK_POOL_SIZE, TCPR_DPDK_POOL_CACHE, 0, 0, socket);
+    if (dpdk->ext_pool == NULL)
+        dbgx(1, "No zero copy sends on DPDK port %u queue %u: %s", dpdk->port->id, dpdk->queue, rte_strerror(rte_errno));
+
+    return 0;
+}
+
+/**
+ * \brief sendpacket_open() entry point for dpdk:PORT
+ *
+ * Configures and starts the port with a TX queue for each of the
+ * --threads, and returns a sendpacket_t for queue 0.  The other queues
+ * are opened with sendpacket_open_dpdk_queue().
+ */
+void *
+sendpacket_open_dpdk(const char *device, char *errbuf, void *arg)
+{
+    tcpreplay_t *ctx = (tcpreplay_t *)arg;
+    const char *name = device + strlen(TCPR_DPDK_PREFIX);
+    struct rte_eth_dev_info info;
+    struct rte_eth_conf conf;
+    struct rte_ether_addr mac;
+    dpdk_port_t *port;
+    sendpacket_t *sp;
+    uint16_t id, q, nb_queues = 1;
+    int socket, ret;
+
+    assert(device);
+    assert(errbuf);
+
+    if (ctx != NULL && ctx->options->threads > 1)
+        nb_queues = (uint16_t)ctx->options->threads;
+
+    if (dpdk_eal_init(ctx != NULL ? ctx->options->dpdk_eal : NULL, errbuf) < 0)
+        return NULL;
+
+    if (dpdk_port_id(name, &id) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unknown DPDK port %s, %u ports found", name, rte_eth_dev_count_avail());
+        return NULL;
+    }
+
+    if (dpdk_ports[id] != NULL) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "DPDK port %s is already open", name);
+        return NULL;
+    }
+
+    if ((ret = rte_eth_dev_info_get(id, &info)) != 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to get info of DPDK port %s: %s", name, rte_strerror(-ret));
+        return NULL;
+    }
+
+    if (nb_queues > info.max_tx_queues || nb_queues > TCPR_DPDK_QUEUES_MAX) {
+        snprintf(errbuf,
+                 SENDPACKET_ERRBUF_SIZE,
+                 "DPDK port %s has %u TX queues, %u needed",
+                 name,
+                 min(info.max_tx_queues, TCPR_DPDK_QUEUES_MAX),
+                 nb_queues);
+        return NULL;
+    }
+
+    memset(&conf, 0, sizeof(conf));
+    if ((ret = rte_eth_dev_configure(id, 0, nb_queues, &conf)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to configure DPDK port %s: %s", name, rte_strerror(-ret));
+        return NULL;
+    }
+
+    port = safe_malloc(sizeof(dpdk_port_t));
+    port->id = id;
+    port->nb_queues = nb_queues;
+    port->device = info.device;
+    socket = rte_eth_dev_socket_id(id);
+    if (socket < 0)
+        socket = SOCKET_ID_ANY;
+
+    for (q = 0; q < nb_queues; q++) {
+        dpdk_t *dpdk = safe_malloc(sizeof(dpdk_t));
+
+        dpdk->port = port;
+        dpdk->queue = q;
+        port->queues[q] = dpdk;
+        if (dpdk_queue_pools(dpdk, socket, errbuf) < 0)
+            goto fail;
+
+        if ((ret = rte_eth_tx_queue_setup(id, q, TCPR_DPDK_TX_DESC, (unsigned int)socket, NULL)) < 0) {
+            snprintf(errbuf,
+                     SENDPACKET_ERRBUF_SIZE,
+                     "Unable to set up TX queue %u of DPDK port %s: %s",
+                     q,
+                     name,
+                     rte_strerror(-ret));
+            goto fail;
+        }
+    }
+
+    if ((ret = rte_eth_dev_start(id)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to start DPDK port %s: %s", name, rte_strerror(-ret));
+        goto fail;
+    }
+
+    dbgx(1, "DPDK port %s (%u) started with %u TX queues", name, id, nb_queues);
+    dpdk_ports[id] = port;
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.fd = -1;
+    sp->handle_type = SP_TYPE_DPDK;
+    sp->dpdk = port->queues[0];
+    port->refs = 1;
+    if (rte_eth_macaddr_get(id, &mac) == 0)
+        memcpy(&sp->ether, mac.addr_bytes, sizeof(sp->ether));
+
+    return sp;
+
+fail:
+    for (q = 0; q < nb_queues; q++) {
+        if (port->queues[q] != NULL) {
+            rte_mempool_free(port->queues[q]->pool);
+            rte_mempool_free(port->queues[q]->ext_pool);
+            safe_free(port->queues[q]);
+        }
+    }
+    safe_free(port);
+    return NULL;
+}
+
+/**
+ * \brief open TX queue queue of the DPDK port first is open on, for a
+ * send thread of its own
+ */
+void *
+sendpacket_open_dpdk_queue(void *first, char *errbuf, int queue)
+{
+    sendpacket_t *owner = first;
+    dpdk_port_t *port;
+    sendpacket_t *sp;
+
+    assert(owner);
+    assert(errbuf);
+
+    port = owner->dpdk->port;
+    if (queue < 0 || queue >= port->nb_queues) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "DPDK port %u has no TX queue %d", port->id, queue);
+        return NULL;
+    }
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, owner->device, sizeof(sp->device));
+    sp->handle.fd = -1;
+    sp->handle_type = SP_TYPE_DPDK;
+    sp->dpdk = port->queues[queue];
+    memcpy(&sp->ether, &owner->ether, sizeof(sp->ether));
+    port->refs++;
+
+    return sp;
+}
+
+/**
+ * \brief hand the queued packets to the NIC
+ *
+ * Waits for the TX queue to take them all.  Returns 0
+ */
+int
+sendpacket_flush_dpdk(void *p)
+{
+    sendpacket_t *sp = p;
+    dpdk_t *dpdk = sp->dpdk;
+    int done = 0;
+
+    while (done < dpdk->pending_cnt) {
+        done += rte_eth_tx_burst(dpdk->port->id,
+                                 dpdk->queue,
+                                 &dpdk->pending[done],
+                                 (uint16_t)(dpdk->pending_cnt - done));
+        if (done < dpdk->pending_cnt) {
+            dpdk->busy++;
+            if (sp->abort) {
+                rte_pktmbuf_free_bulk(&dpdk->pending[done], (unsigned int)(dpdk->pending_cnt - done));
+                break;
+            }
+        }
+    }
+
+    dpdk->pending_cnt = 0;
+    return 0;
+}
+
+/**
+ * registered packet cache region holding all len bytes at data, NULL if none
+ */
+static inline dpdk_mem_t *
+dpdk_mem_find(dpdk_t *dpdk, const u_char *data, size_t len)
+{
+    uint32_t cnt = __atomic_load_n(&dpdk_mem_cnt, __ATOMIC_ACQUIRE);
+    uint32_t i;
+
+    /* packets are sent in the order they were cached, so mostly in the last region */
+    for (i = 0; i < cnt; i++) {
+        uint32_t at = (dpdk->mem_hint + i) % cnt;
+        dpdk_mem_t *mem = &dpdk_mem[at];
+        size_t mem_len = __atomic_load_n(&mem->len, __ATOMIC_ACQUIRE);
+
+        if (mem->port == dpdk->port && data >= mem->base && (size_t)(data - mem->base) + len <= mem_len) {
+            dpdk->mem_hint = at;
+            return mem;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+dpdk_ext_free(void *addr _U_, void *opaque _U_)
+{
+    /* the packet cache outlives its mbufs, see sendpacket_dpdk_unregister() */
+}
+
+/**
+ * an mbuf with a packet, attached to it where it lies if possible,
+ * else holding a copy.  NULL if the pool is empty
+ */
+static inline struct rte_mbuf *
+dpdk_mbuf(dpdk_t *dpdk, const u_char *data, size_t len)
+{
+    struct rte_mbuf *m;
+    dpdk_mem_t *mem;
+    char *dst;
+
+    if (dpdk->ext_pool != NULL && (mem = dpdk_mem_find(dpdk, data, len)) != NULL) {
+        if ((m = rte_pktmbuf_alloc(dpdk->ext_pool)) == NULL)
+            return NULL;
+
+        rte_mbuf_ext_refcnt_update(&mem->shinfo, 1);
+        rte_pktmbuf_attach_extbuf(m, (void *)data, mem->iova + (rte_iova_t)(data - mem->base), (uint16_t)len, &mem->shinfo);
+        m->data_len = (uint16_t)len;
+        m->pkt_len = (uint32_t)len;
+        dpdk->zero_copy++;
+        return m;
+    }
+
+    if ((m = rte_pktmbuf_alloc(dpdk->pool)) == NULL)
+        return NULL;
+
+    dst = rte_pktmbuf_append(m, (uint16_t)len);
+    memcpy(dst, data, len);
+    dpdk->copied++;
+    return m;
+}
+
+/**
+ * \brief queue one packet on the TX queue
+ *
+ * If flush is set the packets queued go to the NIC right away,
+ * otherwise once TCPR_DPDK_BURST are queued or the caller calls
+ * sendpacket_flush_dpdk().
+ *
+ * Returns bytes queued, -2 if the mbufs are all in flight and the
+ * caller should retry, or -1 on error
+ */
+int
+sendpacket_send_dpdk(void *p, const u_char *data, size_t len, bool flush)
+{
+    sendpacket_t *sp = p;
+    dpdk_t *dpdk = sp->dpdk;
+    struct rte_mbuf *m;
+
+    if (sp->abort)
+        return 0;
+
+    if (len > TCPR_DPDK_MTU_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (dpdk->pending_cnt == TCPR_DPDK_BURST)
+        sendpacket_flush_dpdk(sp);
+
+    if ((m = dpdk_mbuf(dpdk, data, len)) == NULL) {
+        /* the NIC frees sent mbufs as it's given more */
+        sendpacket_flush_dpdk(sp);
+        if ((m = dpdk_mbuf(dpdk, data, len)) == NULL) {
+            rte_eth_tx_done_cleanup(dpdk->port->id, dpdk->queue, 0);
+            return -2;
+        }
+    }
+
+    dpdk->pending[dpdk->pending_cnt++] = m;
+    if (flush)
+        sendpacket_flush_dpdk(sp);
+
+    return (int)len;
+}
+
+/**
+ * \brief speed of the link of the port in Mbps, 0 if unknown or down
+ */
+COUNTER
+sendpacket_get_link_mbps_dpdk(void *p)
+{
+    sendpacket_t *sp = p;
+    struct rte_eth_link link;
+
+    memset(&link, 0, sizeof(link));
+    if (rte_eth_link_get_nowait(sp->dpdk->port->id, &link) != 0 || link.link_status != RTE_ETH_LINK_UP ||
+        link.link_speed == RTE_ETH_SPEED_NUM_UNKNOWN)
+        return 0;
+
+    return (COUNTER)link.link_speed;
+}
+
+/**
+ * \brief print the counters of every TX queue of the port, ours and the
+ * NIC's.  Returns the bytes printed.
+ */
+size_t
+sendpacket_getstat_dpdk(void *p, char *buf, size_t buf_size)
+{
+    sendpacket_t *sp = p;
+    dpdk_port_t *port = sp->dpdk->port;
+    struct rte_eth_stats stats;
+    bool hw;
+    size_t offset = 0;
+    uint16_t q;
+
+    hw = rte_eth_stats_get(port->id, &stats) == 0;
+    for (q = 0; q < port->nb_queues && offset < buf_size; q++) {
+        const dpdk_t *dpdk = port->queues[q];
+        int n;
+
+        n = snprintf(&buf[offset],
+                     buf_size - offset,
+                     "\tDPDK TX queue %-2u:         zero copy " COUNTER_SPEC ", copied " COUNTER_SPEC
+                     ", queue full " COUNTER_SPEC,
+                     q,
+                     dpdk->zero_copy,
+                     dpdk->copied,
+                     dpdk->busy);
+        if (n < 0)
+            break;
+        offset += (size_t)n;
+
+        /* the NIC only counts the first few queues */
+        if (hw && q < RTE_ETHDEV_QUEUE_STAT_CNTRS && offset < buf_size)
+            n = snprintf(&buf[offset],
+                         buf_size - offset,
+                         ", NIC sent %" PRIu64 " packets %" PRIu64 " bytes\n",
+                         stats.q_opackets[q],
+                         stats.q_obytes[q]);
+        else if (offset < buf_size)
+            n = snprintf(&buf[offset], buf_size - offset, "\n");
+        if (n < 0)
+            break;
+        offset += (size_t)n;
+    }
+
+    if (hw && offset < buf_size) {
+        int n = snprintf(&buf[offset],
+                         buf_size - offset,
+                         "\tDPDK port errors:          %" PRIu64 "\n",
+                         stats.oerrors);
+
+        if (n > 0)
+            offset += (size_t)n;
+    }
+
+    return min(offset, buf_size);
+}
+
+/**
+ * \brief let the NIC of sp send packets straight from len bytes of page
+ * aligned packet cache memory at addr
+ *
+ * Only done where the NIC takes virtual addresses, as with VFIO and an
+ * IOMMU.  Elsewhere, or if the memory can't be mapped for the NIC, the
+ * packets in it are copied as any others.  The memory must stay as it
+ * is until sendpacket_dpdk_unregister().
+ */
+void
+sendpacket_dpdk_register(void *p, void *addr, size_t len)
+{
+    sendpacket_t *sp = p;
+    dpdk_port_t *port = sp->dpdk->port;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    dpdk_mem_t *mem;
+    int ret;
+
+    if (rte_eal_iova_mode() != RTE_IOVA_VA || dpdk_mem_cnt == TCPR_DPDK_MEM_MAX ||
+        (((uintptr_t)addr | len) & (page - 1)) != 0)
+        return;
+
+    if (rte_extmem_register(addr, len, NULL, 0, page) < 0 && rte_errno != EEXIST) {
+        dbgx(1, "Unable to register %zu bytes at %p with DPDK: %s", len, addr, rte_strerror(rte_errno));
+        return;
+    }
+
+    mem = &dpdk_mem[dpdk_mem_cnt];
+    mem->base = addr;
+    mem->iova = (rte_iova_t)(uintptr_t)addr;
+    mem->port = port;
+
+    /* devices which don't DMA map memory themselves use it as it is */
+    ret = rte_dev_dma_map(port->device, addr, mem->iova, len);
+    if (ret < 0 && rte_errno != ENOTSUP) {
+        dbgx(1, "Unable to DMA map %zu bytes at %p for DPDK port %u: %s", len, addr, port->id, rte_strerror(rte_errno));
+        rte_extmem_unregister(addr, len);
+        return;
+    }
+    mem->mapped = ret == 0;
+
+    mem->shinfo.free_cb = dpdk_ext_free;
+    mem->shinfo.fcb_opaque = NULL;
+    rte_mbuf_ext_refcnt_set(&mem->shinfo, 1);
+    __atomic_store_n(&mem->len, len, __ATOMIC_RELEASE);
+    __atomic_store_n(&dpdk_mem_cnt, dpdk_mem_cnt + 1, __ATOMIC_RELEASE);
+    dbgx(2, "Registered %zu bytes at %p with DPDK port %u", len, addr, port->id);
+}
+
+/**
+ * wait until the NICs are done with every mbuf attached to mem.  Sent
+ * mbufs are only given back as the NIC is given more, or on request
+ * where the driver supports it, so stop the port if need be.  Not to
+ * be called while sending.
+ */
+static void
+dpdk_mem_drain(dpdk_mem_t *mem)
+{
+    int tries = 1000;
+    uint16_t id, q;
+
+    while (rte_mbuf_ext_refcnt_read(&mem->shinfo) > 1 && tries-- > 0) {
+        for (id = 0; id < RTE_MAX_ETHPORTS; id++) {
+            if (dpdk_ports[id] == NULL)
+                continue;
+            for (q = 0; q < dpdk_ports[id]->nb_queues; q++)
+                rte_eth_tx_done_cleanup(id, q, 0);
+        }
+        usleep(1000);
+    }
+
+    if (rte_mbuf_ext_refcnt_read(&mem->shinfo) > 1) {
+        for (id = 0; id < RTE_MAX_ETHPORTS; id++) {
+            if (dpdk_ports[id] != NULL)
+                rte_eth_dev_stop(id);
+        }
+    }
+}
+
+/**
+ * \brief forget packet cache memory given to sendpacket_dpdk_register()
+ *
+ * Does nothing if it wasn't
+ */
+void
+sendpacket_dpdk_unregister(void *addr, size_t len)
+{
+    uint32_t i;
+
+    for (i = 0; i < dpdk_mem_cnt; i++) {
+        dpdk_mem_t *mem = &dpdk_mem[i];
+
+        if (mem->base != addr || mem->len != len)
+            continue;
+
+        dpdk_mem_drain(mem);
+        if (mem->port != NULL && mem->mapped)
+            rte_dev_dma_unmap(mem->port->device, addr, mem->iova, len);
+        rte_extmem_unregister(addr, len);
+        __atomic_store_n(&mem->len, 0, __ATOMIC_RELEASE);
+        mem->base = NULL;
+        return;
+    }
+}
+
+/**
+ * \brief close a TX queue, and the port with the last of them
+ */
+void
+sendpacket_close_dpdk(void *p)
+{
+    sendpacket_t *sp = p;
+    dpdk_port_t *port;
+    uint32_t i;
+    uint16_t q;
+
+    if (sp->dpdk == NULL)
+        return;
+
+    port = sp->dpdk->port;
+    sendpacket_flush_dpdk(sp);
+    sp->dpdk = NULL;
+    if (--port->refs > 0)
+        return;
+
+    /* stopping gives back the mbufs still in the TX rings */
+    rte_eth_dev_stop(port->id);
+    for (i = 0; i < dpdk_mem_cnt; i++) {
+        dpdk_mem_t *mem = &dpdk_mem[i];
+
+        if (mem->port == port && mem->len != 0) {
+            if (mem->mapped)
+                rte_dev_dma_unmap(port->device, (void *)mem->base, mem->iova, mem->len);
+            mem->mapped = false;
+            mem->port = NULL;
+        }
+    }
+    rte_eth_dev_close(port->id);
+
+    for (q = 0; q < port->nb_queues; q++) {
+        rte_mempool_free(port->queues[q]->pool);
+        rte_mempool_free(port->queues[q]->ext_pool);
+        safe_free(port->queues[q]);
+    }
+    dpdk_ports[port->id] = NULL;
+    safe_free(port);
+}
+
+#endif /* HAVE_DPDK */
@@ -0,0 +1,68 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+#ifdef HAVE_DPDK
+#include <stdbool.h>
+#include <stdint.h>
+
+/* -i dpdk:PORT, PORT being a DPDK port id or device name, e.g. a PCI address */
+#define TCPR_DPDK_PREFIX "dpdk:"
+#define TCPR_DPDK_QUEUES_MAX 64  /* TX queues per port, one per send thread */
+#define TCPR_DPDK_TX_DESC 1024   /* descriptors per TX queue */
+#define TCPR_DPDK_POOL_SIZE 8191 /* mbufs per queue and pool, best 2^n - 1 */
+#define TCPR_DPDK_POOL_CACHE 256
+#define TCPR_DPDK_MTU_MAX 9216  /* largest packet the copy mbufs take */
+#define TCPR_DPDK_BURST 32      /* packets queued per rte_eth_tx_burst() */
+#define TCPR_DPDK_MEM_MAX 4096  /* packet cache regions sent without a copy */
+
+struct rte_mbuf;
+struct rte_mempool;
+typedef struct dpdk_port_s dpdk_port_t;
+
+/* a TX queue of a DPDK port, one per sendpacket_t */
+struct dpdk_s {
+    dpdk_port_t *port;
+    uint16_t queue;
+    struct rte_mempool *pool;     /* mbufs packets are copied into */
+    struct rte_mempool *ext_pool; /* mbufs attached to the packet cache, without data room */
+    struct rte_mbuf *pending[TCPR_DPDK_BURST];
+    int pending_cnt;
+    uint32_t mem_hint; /* packet cache region the last packet was in */
+    COUNTER zero_copy; /* packets sent straight from the packet cache */
+    COUNTER copied;
+    COUNTER busy; /* bursts the queue didn't take in full */
+};
+typedef struct dpdk_s dpdk_t;
+
+void *sendpacket_open_dpdk(const char *device, char *errbuf, void *arg);
+void *sendpacket_open_dpdk_queue(void *first, char *errbuf, int queue);
+void sendpacket_close_dpdk(void *p);
+int sendpacket_send_dpdk(void *p, const u_char *data, size_t len, bool flush);
+int sendpacket_flush_dpdk(void *p);
+COUNTER sendpacket_get_link_mbps_dpdk(void *p);
+size_t sendpacket_getstat_dpdk(void *p, char *buf, size_t buf_size);
+void sendpacket_dpdk_register(void *p, void *addr, size_t len);
+void sendpacket_dpdk_unregister(void *addr, size_t len);
+
+#endif /* HAVE_DPDK */
@@ -16,6 +16,8 @@
  *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define TCPR_MEM_SUBSYS TCPR_MEM_FLOWS /* see memstat.h */
+
 #include "flows.h"
 #include "tcpreplay_api.h"
 #include <stdio.h>
@@ -26,7 +28,13 @@
 #define JUNIPER_FLAG_EXT            0x80     /* Juniper extensions present */
 #define JUNIPER_PCAP_MAGIC          "MGC"
 
-/* 5-tuple plus VLAN ID */
+/*
+ * 5-tuple plus VLAN ID
+ *
+ * Always memset() before filling so the padding compares and hashes
+ * consistently. Size is a multiple of 8 so hash_func() can read it as
+ * fixed-width words.
+ */
 typedef struct flow_entry_data {
     union {
         struct in_addr in;
@@ -41,18 +49,77 @@ typedef struct flow_entry_data {
     uint16_t dst_port;
     uint16_t vlan;
     uint8_t protocol;
+    uint8_t pad;
 } flow_entry_data_t;
 
+#define FLOW_ENTRY_WORDS (sizeof(flow_entry_data_t) / sizeof(uint64_t))
+
+/* flow entries live in fixed size slabs, so they never move once added */
+#define FLOW_SLAB_SHIFT 12
+#define FLOW_SLAB_SIZE (1 << FLOW_SLAB_SHIFT)
+
 typedef struct flow_hash_entry {
-    uint32_t key;
     flow_entry_data_t data;
-    struct timeval ts_last_seen;
-    struct flow_hash_entry *next;
+    uint64_t key;
+    time_t ts_last_seen;
+    uint32_t next; /* index + 1 of the next entry in its wheel slot or the free list */
+    bool free;     /* expired, waiting on the free list to be reused */
 } flow_hash_entry_t;
 
+/*
+ * One cache line of open addressed slots. A slot is empty when its
+ * index is zero and was emptied by expiry when it is FLOW_SLOT_DELETED;
+ * otherwise index - 1 names an entry in the slabs and tag holds the upper
+ * half of its hash, so most mismatches are rejected without touching the
+ * entry itself.
+ */
+#define FLOW_BUCKET_SLOTS 8
+#define FLOW_SLOT_DELETED UINT32_MAX
+
+typedef struct flow_hash_bucket {
+    uint32_t tag[FLOW_BUCKET_SLOTS];
+    uint32_t index[FLOW_BUCKET_SLOTS];
+} flow_hash_bucket_t;
+
+/*
+ * With an expiry, flows sit in a hierarchical timer wheel of one second
+ * ticks of capture time: FLOW_WHEEL_LEVELS levels of FLOW_WHEEL_SLOTS
+ * slots, each level's slot spanning all of the level below.  A flow is
+ * filed under the tick it would expire at, when it was last filed; when
+ * that tick comes it is either reclaimed or filed again under its new
+ * expiry, so packets of a flow never have to move it.
+ */
+#define FLOW_WHEEL_BITS 6
+#define FLOW_WHEEL_SLOTS (1 << FLOW_WHEEL_BITS)
+#define FLOW_WHEEL_LEVELS 4
+#define FLOW_WHEEL_SPAN ((time_t)1 << (FLOW_WHEEL_BITS * FLOW_WHEEL_LEVELS))
+
+/* initial size of the set of expired flow keys */
+#define FLOW_EXPIRED_KEYS_INITIAL 1024
+
 struct flow_hash_table {
-    size_t num_buckets;
-    flow_hash_entry_t **buckets;
+    size_t num_buckets; /* power of two */
+    flow_hash_bucket_t *buckets;
+    void *buckets_mem; /* unaligned allocation behind buckets */
+    flow_hash_entry_t **slabs;
+    size_t num_slabs;
+    uint32_t num_entries;   /* entries ever allocated in the slabs */
+    uint32_t num_live;      /* of those, not expired */
+    size_t num_used_slots;  /* live entries plus FLOW_SLOT_DELETED slots */
+    uint32_t free_list;     /* index + 1 of the first free entry */
+    /* timer wheel of the live entries, heads are index + 1 */
+    uint32_t wheel[FLOW_WHEEL_LEVELS][FLOW_WHEEL_SLOTS];
+    time_t wheel_now;       /* last tick expired */
+    int expiry;
+    /*
+     * Keys of the flows expired so far.  A flow that comes back after
+     * being reclaimed is found here, so it is still counted as expired
+     * rather than unique, for 8 bytes rather than a whole entry.
+     */
+    uint64_t *expired_keys; /* open addressed, 0 is empty */
+    size_t expired_size;    /* power of two */
+    size_t expired_cnt;
+    COUNTER reclaimed;
 };
 
 static bool is_power_of_2(size_t n)
@@ -61,48 +128,311 @@ static bool is_power_of_2(size_t n)
 }
 
 /*
- * Perl's hash function
- *
- * We do extensive hashing to prevent hash table collisions.
- * It will save time in the long run.
+ * Every input bit of the fixed size flow key affects both the bucket
+ * (low bits) and the tag (high bits).
+ */
+static inline uint64_t hash_func(const flow_entry_data_t *entry)
+{
+    return flow_hash_words(entry, FLOW_ENTRY_WORDS * sizeof(uint64_t), 0x9e3779b97f4a7c15ULL);
+}
+
+static inline flow_hash_entry_t *hash_entry(const flow_hash_table_t *fht, uint32_t index)
+{
+    return &fht->slabs[index >> FLOW_SLAB_SHIFT][index & (FLOW_SLAB_SIZE - 1)];
+}
+
+static void hash_alloc_buckets(flow_hash_table_t *fht, size_t num_buckets)
+{
+    uintptr_t p;
+
+    fht->num_buckets = num_buckets;
+    fht->buckets_mem = safe_malloc(sizeof(flow_hash_bucket_t) * num_buckets + 63);
+    p = ((uintptr_t)fht->buckets_mem + 63) & ~(uintptr_t)63;
+    fht->buckets = (flow_hash_bucket_t *)p;
+}
+
+/*
+ * Claim the first free slot in the probe sequence for key
+ */
+static inline void hash_insert_slot(flow_hash_table_t *fht, uint64_t key, uint32_t index)
+{
+    size_t b = key & (fht->num_buckets - 1);
+    int i;
+
+    for (;; b = (b + 1) & (fht->num_buckets - 1)) {
+        flow_hash_bucket_t *bucket = &fht->buckets[b];
+
+        for (i = 0; i < FLOW_BUCKET_SLOTS; i++) {
+            if (bucket->index[i] == 0 || bucket->index[i] == FLOW_SLOT_DELETED) {
+                if (bucket->index[i] == 0)
+                    ++fht->num_used_slots;
+                bucket->tag[i] = (uint32_t)(key >> 32);
+                bucket->index[i] = index + 1;
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * Rebuild the bucket array once it is 3/4 full, doubling it unless most
+ * of the used slots were only left behind by expired flows. Entries stay
+ * where they are in the slabs and keep their hash, so this only rewrites
+ * the 8 byte slots, in a single sequential pass over the slabs.
+ */
+static void hash_grow(flow_hash_table_t *fht)
+{
+    void *old_mem = fht->buckets_mem;
+    size_t num_buckets = fht->num_buckets;
+    uint32_t i;
+
+    if ((size_t)fht->num_live + 1 > num_buckets * FLOW_BUCKET_SLOTS / 8 * 3)
+        num_buckets *= 2;
+
+    hash_alloc_buckets(fht, num_buckets);
+    fht->num_used_slots = 0;
+    for (i = 0; i < fht->num_entries; i++) {
+        if (!hash_entry(fht, i)->free)
+            hash_insert_slot(fht, hash_entry(fht, i)->key, i);
+    }
+
+    safe_free(old_mem);
+    dbgx(1, "flow hash table rebuilt with %zu buckets", fht->num_buckets);
+}
+
+/*
+ * Add key to the set of expired flows
+ */
+static void expired_key_add(flow_hash_table_t *fht, uint64_t key)
+{
+    size_t i;
+
+    if (key == 0)
+        key = 1;
+
+    if (fht->expired_cnt + 1 > fht->expired_size / 4 * 3) {
+        uint64_t *old_keys = fht->expired_keys;
+        size_t old_size = fht->expired_size;
+
+        fht->expired_size = old_size ? old_size * 2 : FLOW_EXPIRED_KEYS_INITIAL;
+        fht->expired_keys = safe_malloc(sizeof(uint64_t) * fht->expired_size);
+        fht->expired_cnt = 0;
+        for (i = 0; i < old_size; i++) {
+            if (old_keys[i] != 0)
+                expired_key_add(fht, old_keys[i]);
+        }
+        safe_free(old_keys);
+    }
+
+    for (i = key & (fht->expired_size - 1); fht->expired_keys[i] != 0; i = (i + 1) & (fht->expired_size - 1)) {
+        if (fht->expired_keys[i] == key)
+            return;
+    }
+
+    fht->expired_keys[i] = key;
+    ++fht->expired_cnt;
+}
+
+static bool expired_key_find(const flow_hash_table_t *fht, uint64_t key)
+{
+    size_t i;
+
+    if (fht->expired_size == 0)
+        return false;
+
+    if (key == 0)
+        key = 1;
+
+    for (i = key & (fht->expired_size - 1); fht->expired_keys[i] != 0; i = (i + 1) & (fht->expired_size - 1)) {
+        if (fht->expired_keys[i] == key)
+            return true;
+    }
+
+    return false;
+}
+
+/*
+ * File entry index under the tick it expires at, which must not be
+ * before wheel_now
+ */
+static void wheel_insert(flow_hash_table_t *fht, uint32_t index, time_t tick)
+{
+    flow_hash_entry_t *he = hash_entry(fht, index);
+    time_t delta = tick - fht->wheel_now;
+    uint32_t *slot;
+    int level;
+
+    /* beyond the wheel, park in the furthest slot and look again then */
+    if (delta >= FLOW_WHEEL_SPAN)
+        tick = fht->wheel_now + FLOW_WHEEL_SPAN - 1;
+
+    for (level = 0; level < FLOW_WHEEL_LEVELS - 1; level++) {
+        if (delta < ((time_t)1 << (FLOW_WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    slot = &fht->wheel[level][(tick >> (FLOW_WHEEL_BITS * level)) & (FLOW_WHEEL_SLOTS - 1)];
+    he->next = *slot;
+    *slot = index + 1;
+}
+
+/*
+ * Take an expired entry out of the buckets and onto the free list
  */
-static inline uint32_t hash_func(const void *key, size_t length)
+static void wheel_reclaim(flow_hash_table_t *fht, uint32_t index)
 {
-    register size_t i = length;
-    register uint32_t hv = 0;
-    register const u_char *s = (u_char *)key;
-    while (i--) {
-        hv += *s++;
-        hv += (hv << 10);
-        hv ^= (hv >> 6);
+    flow_hash_entry_t *he = hash_entry(fht, index);
+    size_t b = he->key & (fht->num_buckets - 1);
+    int i;
+
+    for (;; b = (b + 1) & (fht->num_buckets - 1)) {
+        flow_hash_bucket_t *bucket = &fht->buckets[b];
+
+        for (i = 0; i < FLOW_BUCKET_SLOTS; i++) {
+            if (bucket->index[i] == index + 1) {
+                bucket->index[i] = FLOW_SLOT_DELETED;
+                goto found;
+            }
+        }
     }
-    hv += (hv << 3);
-    hv ^= (hv >> 11);
-    hv += (hv << 15);
 
-    return hv;
+found:
+    expired_key_add(fht, he->key);
+    he->free = true;
+    he->next = fht->free_list;
+    fht->free_list = index + 1;
+    --fht->num_live;
+    ++fht->reclaimed;
 }
 
 /*
- * add hash value to hash table bucket
+ * Reclaim or refile each entry of a slot that came due
  */
-static inline flow_hash_entry_t *hash_add_entry(flow_hash_table_t *fht, const uint32_t hv,
-        const uint32_t key, const flow_entry_data_t *hash_entry)
+static void wheel_expire_slot(flow_hash_table_t *fht, uint32_t *slot)
+{
+    uint32_t next = *slot;
+
+    *slot = 0;
+    while (next != 0) {
+        uint32_t index = next - 1;
+        flow_hash_entry_t *he = hash_entry(fht, index);
+        time_t tick = he->ts_last_seen + fht->expiry + 1;
+
+        next = he->next;
+        if (tick <= fht->wheel_now)
+            wheel_reclaim(fht, index);
+        else
+            wheel_insert(fht, index, tick);
+    }
+}
+
+/*
+ * Move the wheel on to capture time now, reclaiming every flow which has
+ * been idle for longer than the expiry by then
+ */
+static void wheel_advance(flow_hash_table_t *fht, time_t now)
+{
+    int level, i;
+
+    if (now <= fht->wheel_now)
+        return;
+
+    if (fht->num_live == 0) {
+        fht->wheel_now = now;
+        return;
+    }
+
+    /* a jump past the whole wheel; refile everything from scratch */
+    if (now - fht->wheel_now >= FLOW_WHEEL_SPAN) {
+        uint32_t all = 0;
+
+        for (level = 0; level < FLOW_WHEEL_LEVELS; level++) {
+            for (i = 0; i < FLOW_WHEEL_SLOTS; i++) {
+                uint32_t next = fht->wheel[level][i];
+
+                while (next != 0) {
+                    flow_hash_entry_t *he = hash_entry(fht, next - 1);
+                    uint32_t index = next;
+
+                    next = he->next;
+                    he->next = all;
+                    all = index;
+                }
+                fht->wheel[level][i] = 0;
+            }
+        }
+
+        fht->wheel_now = now;
+        while (all != 0) {
+            flow_hash_entry_t *he = hash_entry(fht, all - 1);
+            uint32_t index = all - 1;
+            time_t tick = he->ts_last_seen + fht->expiry + 1;
+
+            all = he->next;
+            if (tick <= now)
+                wheel_reclaim(fht, index);
+            else
+                wheel_insert(fht, index, tick);
+        }
+        return;
+    }
+
+    while (fht->wheel_now < now) {
+        ++fht->wheel_now;
+
+        /* when a level wraps, spread the next slot up over the lower levels */
+        for (level = 1; level < FLOW_WHEEL_LEVELS; level++) {
+            if (fht->wheel_now & (((time_t)1 << (FLOW_WHEEL_BITS * level)) - 1))
+                break;
+        }
+        while (--level > 0)
+            wheel_expire_slot(fht,
+                              &fht->wheel[level][(fht->wheel_now >> (FLOW_WHEEL_BITS * level)) & (FLOW_WHEEL_SLOTS - 1)]);
+
+        wheel_expire_slot(fht, &fht->wheel[0][fht->wheel_now & (FLOW_WHEEL_SLOTS - 1)]);
+    }
+}
+
+/*
+ * add hash value to hash table
+ */
+static inline flow_hash_entry_t *hash_add_entry(flow_hash_table_t *fht, const uint64_t key,
+        const flow_entry_data_t *data, uint32_t *flow_id)
 {
     flow_hash_entry_t *he;
+    uint32_t index;
+    bool reused = fht->free_list != 0;
 
-    assert(hv < fht->num_buckets);
+    if (reused) {
+        /* reuse the entry of an expired flow */
+        index = fht->free_list - 1;
+        fht->free_list = hash_entry(fht, index)->next;
+    } else {
+        index = fht->num_entries;
+        if (index >= FLOW_SLOT_DELETED - 1) {
+            warn("flow hash table is full");
+            return NULL;
+        }
 
-    he = safe_malloc(sizeof (*he));
-    if (!he) {
-        warn("out of memory");
-        return NULL;
+        if ((index >> FLOW_SLAB_SHIFT) == fht->num_slabs) {
+            fht->slabs = safe_realloc(fht->slabs, sizeof(*fht->slabs) * (fht->num_slabs + 1));
+            fht->slabs[fht->num_slabs++] = safe_malloc(sizeof(flow_hash_entry_t) * FLOW_SLAB_SIZE);
+        }
     }
 
+    if (fht->num_used_slots + 1 > fht->num_buckets * FLOW_BUCKET_SLOTS / 4 * 3)
+        hash_grow(fht);
+
+    if (!reused)
+        ++fht->num_entries;
+
+    he = hash_entry(fht, index);
     he->key = key;
-    he->next = fht->buckets[hv];
-    fht->buckets[hv] = he;
-    memcpy(&he->data, hash_entry, sizeof(he->data));
+    he->free = false;
+    memcpy(&he->data, data, sizeof(he->data));
+    hash_insert_slot(fht, key, index);
+    ++fht->num_live;
+    *flow_id = index + 1;
 
     return he;
 }
@@ -112,40 +442,69 @@ static inline flow_hash_entry_t *hash_add_entry(flow_hash_table_t *fht, const ui
  * insert it if not found. Report whether this
  * is a new, existing or expired flow.
  *
- * Only check for expiry if 'expiry' is set
+ * Only check for expiry if 'expiry' is set. Flows idle for longer than
+ * that as of the packet's time are reclaimed first, and the id of a
+ * reclaimed flow may then be given to a new one.
  */
-static inline flow_entry_type_t hash_put_data(flow_hash_table_t *fht, const uint32_t key,
-        const flow_entry_data_t *hash_entry, const struct timeval *tv, const int expiry)
+static inline flow_entry_type_t hash_put_data(flow_hash_table_t *fht, const uint64_t key,
+        const flow_entry_data_t *data, const struct timeval *tv, const int expiry, uint32_t *flow_id)
 {
-    uint32_t hash_value = key & (fht->num_buckets - 1);
-    flow_hash_entry_t *he;
+    uint32_t tag = (uint32_t)(key >> 32);
+    size_t b = key & (fht->num_buckets - 1);
+    flow_hash_entry_t *he = NULL;
     flow_entry_type_t res;
+    int i;
 
-    for (he = fht->buckets[hash_value]; he; he = he->next) {
-        /*
-         * found an existing entry with similar hash. double
-         * check to see if it is our flow or just a collision
-         */
-        if (he->key == key && !memcmp(&he->data, hash_entry, sizeof(he->data)))
-            break;
+    if (expiry) {
+        fht->expiry = expiry;
+        wheel_advance(fht, tv->tv_sec);
+    }
+
+    for (;; b = (b + 1) & (fht->num_buckets - 1)) {
+        flow_hash_bucket_t *bucket = &fht->buckets[b];
+
+        for (i = 0; i < FLOW_BUCKET_SLOTS; i++) {
+            /* expired entries leave FLOW_SLOT_DELETED, so only an empty slot ends the probe */
+            if (bucket->index[i] == 0)
+                goto probe_done;
+
+            if (bucket->index[i] == FLOW_SLOT_DELETED)
+                continue;
+
+            if (bucket->tag[i] == tag) {
+                /* same tag; double check it's our flow and not a collision */
+                he = hash_entry(fht, bucket->index[i] - 1);
+                if (he->key == key && !memcmp(&he->data, data, sizeof(he->data))) {
+                    *flow_id = bucket->index[i];
+                    goto probe_done;
+                }
+                he = NULL;
+            }
+        }
     }
 
+probe_done:
     if (he) {
         /* this is not a new flow */
-        if (expiry && tv->tv_sec > (expiry + he->ts_last_seen.tv_sec))
+        if (expiry && tv->tv_sec > (expiry + he->ts_last_seen))
             res = FLOW_ENTRY_EXPIRED;
         else
             res = FLOW_ENTRY_EXISTING;
 
         if (expiry)
-            TIMEVAL_SET(&he->ts_last_seen, tv);
+            he->ts_last_seen = tv->tv_sec;
     } else {
-        /* this is a new flow */
-        if ((he = hash_add_entry(fht, hash_value, key, hash_entry)) != NULL) {
-            res = FLOW_ENTRY_NEW;
+        /* this is a new flow, unless it was reclaimed after expiring */
+        if ((he = hash_add_entry(fht, key, data, flow_id)) != NULL) {
+            res = expiry && expired_key_find(fht, key) ? FLOW_ENTRY_EXPIRED : FLOW_ENTRY_NEW;
+
+            if (expiry) {
+                time_t tick = tv->tv_sec + expiry + 1;
 
-            if (expiry)
-                TIMEVAL_SET(&he->ts_last_seen, tv);
+                he->ts_last_seen = tv->tv_sec;
+                /* a packet from before the wheel's time expires on the next tick */
+                wheel_insert(fht, (uint32_t)(*flow_id - 1), tick > fht->wheel_now ? tick : fht->wheel_now + 1);
+            }
         } else
             res = FLOW_ENTRY_INVALID;
     }
@@ -155,10 +514,13 @@ static inline flow_entry_type_t hash_put_data(flow_hash_table_t *fht, const uint
 }
 
 /*
- * Decode the packet, study it's flow status and report
+ * Extract the 5-tuple of the packet into entry.
+ *
+ * Returns FLOW_ENTRY_NEW if entry was populated, otherwise
+ * FLOW_ENTRY_INVALID or FLOW_ENTRY_NON_IP
  */
-flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
-        const u_char *pktdata, const int datalink, const int expiry)
+static flow_entry_type_t flow_extract(const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const int datalink, flow_entry_data_t *entry_out, int *ip_version)
 {
     uint32_t pkt_len = pkthdr->caplen;
     const u_char *packet = pktdata;
@@ -173,11 +535,9 @@ flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *
     flow_entry_data_t entry;
     uint32_t l2len = 0;
     uint8_t protocol;
-    uint32_t hash;
     int ip_len;
     int res;
 
-    assert(fht);
     assert(packet);
 
     /*
@@ -213,6 +573,8 @@ flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *
         protocol = ip_hdr->ip_p;
         entry.src_ip.in = ip_hdr->ip_src;
         entry.dst_ip.in = ip_hdr->ip_dst;
+        if (ip_version)
+            *ip_version = 4;
     } else if (ether_type == ETHERTYPE_IP6) {
         if (pkt_len < l2len + sizeof(ipv6_hdr_t))
                 return FLOW_ENTRY_INVALID;
@@ -231,6 +593,8 @@ flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *
         }
         memcpy(&entry.src_ip.in6, &ip6_hdr->ip_src, sizeof(entry.src_ip.in6));
         memcpy(&entry.dst_ip.in6, &ip6_hdr->ip_dst, sizeof(entry.dst_ip.in6));
+        if (ip_version)
+            *ip_version = 6;
     } else {
         return FLOW_ENTRY_NON_IP;
     }
@@ -267,39 +631,222 @@ flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *
         entry.dst_port = 0;
     }
 
+    memcpy(entry_out, &entry, sizeof(entry));
+    return FLOW_ENTRY_NEW;
+}
+
+/*
+ * Decode the packet, study it's flow status and report
+ *
+ * If flow_id is set it receives a small number unique to the flow,
+ * starting at 1, or 0 if the packet isn't part of an IP flow
+ */
+flow_entry_type_t flow_decode(flow_hash_table_t *fht, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const int datalink, const int expiry, uint32_t *flow_id)
+{
+    flow_entry_data_t entry;
+    flow_entry_type_t res;
+    uint32_t id = 0;
+    uint64_t hash;
+
+    assert(fht);
+
+    if (flow_id)
+        *flow_id = 0;
+
+    if ((res = flow_extract(pkthdr, pktdata, datalink, &entry, NULL)) != FLOW_ENTRY_NEW)
+        return res;
+
     /* hash the 5-tuple */
-    hash = hash_func(&entry, sizeof(entry));
+    hash = hash_func(&entry);
 
-    return hash_put_data(fht, hash, &entry, &pkthdr->ts, expiry);
+    res = hash_put_data(fht, hash, &entry, &pkthdr->ts, expiry, &id);
+    if (flow_id)
+        *flow_id = id;
+
+    return res;
+}
+
+/*
+ * Hash the 5-tuple of the packet regardless of direction, so that both
+ * sides of a conversation produce the same value.
+ *
+ * Returns false if the packet is not part of an IP flow
+ */
+bool flow_hash(const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+        const int datalink, uint32_t *hash)
+{
+    flow_entry_data_t entry;
+
+    assert(hash);
+
+    if (flow_extract(pkthdr, pktdata, datalink, &entry, NULL) != FLOW_ENTRY_NEW)
+        return false;
+
+    /* put the "lower" endpoint first */
+    if (memcmp(&entry.src_ip, &entry.dst_ip, sizeof(entry.src_ip)) > 0 ||
+            (!memcmp(&entry.src_ip, &entry.dst_ip, sizeof(entry.src_ip)) &&
+             entry.src_port > entry.dst_port)) {
+        flow_entry_data_t swapped = entry;
+
+        memcpy(&swapped.src_ip, &entry.dst_ip, sizeof(swapped.src_ip));
+        memcpy(&swapped.dst_ip, &entry.src_ip, sizeof(swapped.dst_ip));
+        swapped.src_port = entry.dst_port;
+        swapped.dst_port = entry.src_port;
+        entry = swapped;
+    }
+
+    *hash = (uint32_t)hash_func(&entry);
+    return true;
+}
+
+/* the key of the Microsoft RSS specification, also the default of many NIC drivers */
+const u_char flow_rss_default_key[FLOW_RSS_KEY_LEN] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3,
+    0x8f, 0xb0, 0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3,
+    0x80, 0x30, 0xf2, 0x0c, 0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+/*
+ * Build the tables of the Toeplitz hash for key, of which the first
+ * FLOW_RSS_KEY_LEN bytes are used.  Input bit i adds the 32 key bits from
+ * bit i on, so the hash of a byte at a given position only depends on its
+ * value.
+ */
+flow_rss_t *flow_rss_init(const u_char *key, size_t key_len)
+{
+    flow_rss_t *rss;
+    size_t pos;
+    int bit, v;
+
+    assert(key);
+    if (key_len < FLOW_RSS_KEY_LEN)
+        errx(-1, "RSS key of %zu bytes is too short, %d are needed", key_len, FLOW_RSS_KEY_LEN);
+
+    rss = safe_malloc(sizeof(*rss));
+    for (pos = 0; pos < FLOW_RSS_INPUT_MAX; pos++) {
+        uint32_t window[8];
+        uint64_t bits = 0;
+        size_t i;
+
+        /* key bits 8 * pos to 8 * pos + 39, in range as the key is 4 bytes longer than the input */
+        for (i = 0; i < 5; i++)
+            bits = (bits << 8) | key[pos + i];
+        for (bit = 0; bit < 8; bit++)
+            window[bit] = (uint32_t)(bits >> (8 - bit));
+
+        for (v = 0; v < 256; v++) {
+            uint32_t hash = 0;
+
+            for (bit = 0; bit < 8; bit++)
+                if (v & (0x80 >> bit))
+                    hash ^= window[bit];
+            rss->table[pos][v] = hash;
+        }
+    }
+
+    return rss;
+}
+
+void flow_rss_free(flow_rss_t *rss)
+{
+    safe_free(rss);
+}
+
+/*
+ * The Toeplitz hash a NIC computes for receive side scaling: source and
+ * destination address, then the ports for TCP and UDP.  Other protocols
+ * only hash the addresses.
+ *
+ * Returns false if the packet is not IP, which NICs leave on their
+ * default queue
+ */
+bool flow_rss_hash(const flow_rss_t *rss, const struct pcap_pkthdr *pkthdr,
+        const u_char *pktdata, const int datalink, uint32_t *hash)
+{
+    flow_entry_data_t entry;
+    size_t addr_len;
+    int version = 0;
+
+    assert(rss);
+    assert(hash);
+
+    if (flow_extract(pkthdr, pktdata, datalink, &entry, &version) != FLOW_ENTRY_NEW)
+        return false;
+
+    addr_len = version == 4 ? sizeof(entry.src_ip.in) : sizeof(entry.src_ip.in6);
+    *hash = flow_rss_bytes(rss, 0, (const u_char *)&entry.src_ip, addr_len) ^
+            flow_rss_bytes(rss, addr_len, (const u_char *)&entry.dst_ip, addr_len);
+    /* src_port and dst_port are next to each other, in network byte order */
+    if (entry.protocol == IPPROTO_TCP || entry.protocol == IPPROTO_UDP)
+        *hash ^= flow_rss_bytes(rss, 2 * addr_len, (const u_char *)&entry.src_port, 2 * sizeof(entry.src_port));
+
+    return true;
 }
 
 static void flow_cache_clear(flow_hash_table_t *fht)
 {
-    flow_hash_entry_t *fhe = NULL;
-    flow_hash_entry_t *fhe_next = NULL;
     size_t i;
 
-    for (i = 0; i < fht->num_buckets; i++) {
-        if ((fhe = fht->buckets[i]) != NULL) {
-            while (fhe) {
-                fhe_next = fhe->next;
-                safe_free(fhe);
-                fhe = fhe_next;
-            }
-            fht->buckets[i] = NULL;
-        }
+    dbgx(1, "flow hash table: %u entries, %u live, " COUNTER_SPEC " reclaimed on expiry",
+         fht->num_entries, fht->num_live, fht->reclaimed);
+
+    for (i = 0; i < fht->num_slabs; i++)
+        safe_free(fht->slabs[i]);
+    safe_free(fht->slabs);
+    safe_free(fht->expired_keys);
+    fht->slabs = NULL;
+    fht->num_slabs = 0;
+    fht->num_entries = 0;
+    fht->num_live = 0;
+    fht->num_used_slots = 0;
+    fht->free_list = 0;
+    fht->expired_keys = NULL;
+    fht->expired_size = 0;
+    fht->expired_cnt = 0;
+    memset(fht->wheel, 0, sizeof(fht->wheel));
+    memset(fht->buckets, 0, sizeof(flow_hash_bucket_t) * fht->num_buckets);
+}
+
+/*
+ * n is the number of flows to size the table for up front; it will
+ * grow past that as needed
+ */
+/*
+ * A digest of the flows in the table which haven't expired, the same
+ * whatever order they were added in.  Used to tell whether a table
+ * rebuilt from the same packets ended up in the same state.
+ */
+uint64_t flow_hash_table_digest(const flow_hash_table_t *fht)
+{
+    uint64_t sum = 0, mix = 0;
+    uint32_t i;
+
+    for (i = 0; i < fht->num_entries; i++) {
+        const flow_hash_entry_t *he = hash_entry(fht, i);
+        uint64_t words[2];
+
+        if (he->free)
+            continue;
+
+        words[0] = he->key;
+        words[1] = (uint64_t)he->ts_last_seen;
+        words[0] = flow_hash_words(words, sizeof(words), 0);
+        sum += words[0];
+        mix ^= words[0];
     }
+
+    return sum ^ (mix << 1) ^ fht->num_live;
 }
 
 flow_hash_table_t *flow_hash_table_init(size_t n)
 {
     flow_hash_table_t *fht;
-    if (!is_power_of_2(n))
+    if (!is_power_of_2(n) || n < FLOW_BUCKET_SLOTS)
         errx(-1, "invalid table size: %zu", n);
 
     fht = safe_malloc(sizeof(*fht));
-    fht->num_buckets = n;
-    fht->buckets = safe_malloc(sizeof(flow_hash_entry_t) * n);
+    hash_alloc_buckets(fht, n / FLOW_BUCKET_SLOTS * 2);
 
     return fht;
 }
@@ -310,6 +857,6 @@ void flow_hash_table_release(flow_hash_table_t *fht)
         return;
 
     flow_cache_clear(fht);
-    safe_free(fht->buckets);
+    safe_free(fht->buckets_mem);
     safe_free(fht);
 }
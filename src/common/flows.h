@@ -19,6 +19,7 @@
 
 #include "defines.h"
 #include "common.h"
+#include <string.h>
 
 #define DEFAULT_FLOW_HASH_BUCKET_SIZE (1 << 16) /* 64K - must be a power of two */
 
@@ -32,10 +33,74 @@ typedef enum flow_entry_type_e {
 
 typedef struct flow_hash_table flow_hash_table_t;
 
+/*
+ * Hash len bytes, a multiple of 8, a word at a time, then run the
+ * MurmurHash3 finalizer so every input bit affects every output bit.
+ * Used for the flow table, and by editors keyed on a flow.
+ */
+static inline uint64_t
+flow_hash_words(const void *key, size_t len, uint64_t seed)
+{
+    const u_char *s = (const u_char *)key;
+    uint64_t hv = seed;
+    uint64_t w;
+    size_t i;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, s + i, sizeof(w));
+        hv = (hv ^ w) * 0x100000001b3ULL;
+        hv ^= hv >> 29;
+    }
+    hv ^= hv >> 33;
+    hv *= 0xff51afd7ed558ccdULL;
+    hv ^= hv >> 33;
+    hv *= 0xc4ceb9fe1a85ec53ULL;
+    hv ^= hv >> 33;
+
+    return hv;
+}
+
 flow_hash_table_t *flow_hash_table_init(size_t n);
 void flow_hash_table_release(flow_hash_table_t *table);
+uint64_t flow_hash_table_digest(const flow_hash_table_t *table);
 flow_entry_type_t flow_decode(flow_hash_table_t *fht,
                               const struct pcap_pkthdr *pkthdr,
                               const u_char *pktdata,
                               const int datalink,
-                              const int expiry);
+                              const int expiry,
+                              uint32_t *flow_id);
+bool flow_hash(const struct pcap_pkthdr *pkthdr, const u_char *pktdata, const int datalink, uint32_t *hash);
+
+/*
+ * Receive side scaling: the Toeplitz hash of the addresses and ports,
+ * which NICs use to spread flows over their receive queues.  The table
+ * has the hash of every byte value at every position of the input, so
+ * hashing a flow is a lookup a byte, and the share of a field can be
+ * swapped for that of a new value without hashing the rest again.
+ */
+#define FLOW_RSS_KEY_LEN 40   /* key bytes used, the usual key length */
+#define FLOW_RSS_INPUT_MAX 36 /* IPv6 source and destination, then the ports */
+
+typedef struct flow_rss_s {
+    uint32_t table[FLOW_RSS_INPUT_MAX][256];
+} flow_rss_t;
+
+extern const u_char flow_rss_default_key[FLOW_RSS_KEY_LEN];
+
+flow_rss_t *flow_rss_init(const u_char *key, size_t key_len);
+void flow_rss_free(flow_rss_t *rss);
+bool flow_rss_hash(const flow_rss_t *rss, const struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+                   const int datalink, uint32_t *hash);
+
+/* the share of the hash of len bytes at offset pos of the input */
+static inline uint32_t
+flow_rss_bytes(const flow_rss_t *rss, size_t pos, const u_char *data, size_t len)
+{
+    uint32_t hash = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        hash ^= rss->table[pos + i][data[i]];
+
+    return hash;
+}
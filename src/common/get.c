@@ -175,6 +175,43 @@ parse_vlan(const u_char *pktdata, uint32_t datalen, uint16_t *next_protocol, uin
     return 0;
 }
 
+/*
+ * Kinds of L2 tag parse_metadata() knows how to step over
+ */
+typedef enum {
+    L2_TAG_NONE = 0,
+    L2_TAG_VLAN,
+    L2_TAG_MPLS,
+} l2_tag_kind_t;
+
+/*
+ * Direct-mapped table of tag ethertypes. L2_TAG_SLOT() puts each of the
+ * five in its own slot, so a lookup is one load and one compare.
+ */
+#define L2_TAG_SLOT(ether_type) ((((ether_type) >> 3) ^ ((ether_type) >> 10)) & 7)
+
+static const struct {
+    uint16_t ether_type;
+    uint8_t kind;
+} l2_tag_table[8] = {
+        [L2_TAG_SLOT(ETHERTYPE_VLAN)] = {ETHERTYPE_VLAN, L2_TAG_VLAN},
+        [L2_TAG_SLOT(ETHERTYPE_Q_IN_Q)] = {ETHERTYPE_Q_IN_Q, L2_TAG_VLAN},
+        [L2_TAG_SLOT(ETHERTYPE_8021QINQ)] = {ETHERTYPE_8021QINQ, L2_TAG_VLAN},
+        [L2_TAG_SLOT(ETHERTYPE_MPLS)] = {ETHERTYPE_MPLS, L2_TAG_MPLS},
+        [L2_TAG_SLOT(ETHERTYPE_MPLS_MULTI)] = {ETHERTYPE_MPLS_MULTI, L2_TAG_MPLS},
+};
+
+static inline l2_tag_kind_t
+l2_tag_kind(uint16_t ether_type)
+{
+    unsigned int slot = L2_TAG_SLOT(ether_type);
+
+    if (l2_tag_table[slot].ether_type != ether_type)
+        return L2_TAG_NONE;
+
+    return (l2_tag_kind_t)l2_tag_table[slot].kind;
+}
+
 /*
  * Loop through all non-protocol L2 headers while updating key variables
  *
@@ -185,6 +222,9 @@ parse_vlan(const u_char *pktdata, uint32_t datalen, uint16_t *next_protocol, uin
  * l2offset:      reference to the offset to the start of the L2 header - typically 0
  * vlan_offset: reference to the offset to the start of the VLAN headers, if any
  *
+ * The walk runs on local copies and stores them once at the end. VLAN tags,
+ * by far the most common, are stepped over inline.
+ *
  * return 0 on success, -1 on failure
  */
 static int
@@ -195,27 +235,38 @@ parse_metadata(const u_char *pktdata,
                uint32_t *l2offset,
                uint32_t *vlan_offset)
 {
-    bool done = false;
+    uint16_t proto = *next_protocol;
+    uint32_t len = *l2len;
     int res = 0;
-    while (!done && res == 0) {
-        switch (*next_protocol) {
-        case ETHERTYPE_VLAN:
-        case ETHERTYPE_Q_IN_Q:
-        case ETHERTYPE_8021QINQ:
+
+    for (;;) {
+        l2_tag_kind_t kind = l2_tag_kind(proto);
+
+        if (kind == L2_TAG_VLAN) {
+            const vlan_hdr_t *vlan_hdr;
+
             if (*vlan_offset == 0)
-                *vlan_offset = *l2len;
+                *vlan_offset = len;
 
-            res = parse_vlan(pktdata, datalen, next_protocol, l2len);
-            break;
-        case ETHERTYPE_MPLS:
-        case ETHERTYPE_MPLS_MULTI:
-            res = parse_mpls(pktdata, datalen, next_protocol, l2len, l2offset);
+            if ((size_t)datalen < len + sizeof(*vlan_hdr)) {
+                res = -1;
+                break;
+            }
+
+            vlan_hdr = (const vlan_hdr_t *)(pktdata + len);
+            proto = ntohs(vlan_hdr->vlan_tpid);
+            len += sizeof(*vlan_hdr);
+        } else if (kind == L2_TAG_MPLS) {
+            res = parse_mpls(pktdata, datalen, &proto, &len, l2offset);
+            if (res != 0)
+                break;
+        } else {
             break;
-        default:
-            done = true;
         }
     }
 
+    *next_protocol = proto;
+    *l2len = len;
     return res;
 }
 
@@ -622,6 +673,62 @@ get_layer4_v6(const ipv6_hdr_t *ip6_hdr, const u_char *end_ptr)
     return next;
 }
 
+/**
+ * returns the layer 4 header like get_layer4_v6() and stores its protocol
+ * in *proto like get_ipv6_l4proto(), walking the extension headers once
+ * for both.  Unlike get_layer4_v6(), v6-in-v6 returns the inner L4 header
+ * and a truncated extension header returns NULL.
+ */
+void *
+get_layer4_v6_proto(const ipv6_hdr_t *ip6_hdr, const u_char *end_ptr, uint8_t *proto)
+{
+    struct tcpr_ipv6_ext_hdr_base *next, *exthdr;
+
+    assert(ip6_hdr);
+    assert(end_ptr);
+    assert(proto);
+
+    /* jump to the end of the IPv6 header */
+    next = (struct tcpr_ipv6_ext_hdr_base *)((u_char *)ip6_hdr + TCPR_IPV6_H);
+    if ((u_char *)next > end_ptr) {
+        *proto = TCPR_IPV6_NH_NO_NEXT;
+        return NULL;
+    }
+
+    *proto = ip6_hdr->ip_nh;
+    while (TRUE) {
+        dbgx(3, "Processing proto: 0x%02X", *proto);
+        switch (*proto) {
+        case TCPR_IPV6_NH_FRAGMENT:
+        case TCPR_IPV6_NH_ESP:
+            return NULL;
+
+        case TCPR_IPV6_NH_IPV6:
+            dbg(3, "recursing due to v6-in-v6");
+            return get_layer4_v6_proto((ipv6_hdr_t *)next, end_ptr, proto);
+
+        case TCPR_IPV6_NH_AH:
+        case TCPR_IPV6_NH_ROUTING:
+        case TCPR_IPV6_NH_DESTOPTS:
+        case TCPR_IPV6_NH_HBH:
+            exthdr = get_ipv6_next(next, end_ptr);
+            if (exthdr == NULL || (u_char *)exthdr + sizeof(*exthdr) > end_ptr) {
+                *proto = TCPR_IPV6_NH_NO_NEXT;
+                return NULL;
+            }
+            *proto = exthdr->ip_nh;
+            next = exthdr;
+            break;
+
+        default:
+            if (*proto != ip6_hdr->ip_nh)
+                return (u_char *)next + IPV6_EXTLEN_TO_BYTES(next->ip_len);
+
+            return next;
+        } /* switch */
+    }     /* while */
+}
+
 /**
  * returns the next payload or header of the current extension header
  * returns NULL for none/ESP.
@@ -629,7 +736,7 @@ get_layer4_v6(const ipv6_hdr_t *ip6_hdr, const u_char *end_ptr)
 static void *
 get_ipv6_next(struct tcpr_ipv6_ext_hdr_base *exthdr, const u_char *end_ptr)
 {
-    uint8_t extlen;
+    uint32_t extlen;
     u_char *ptr;
     assert(exthdr);
 
@@ -841,10 +948,7 @@ const char *
 get_addr2name4(uint32_t ip, bool _U_ dnslookup)
 {
     struct in_addr addr;
-    static char *new_string = NULL;
-
-    if (new_string == NULL)
-        new_string = (char *)safe_malloc(255);
+    static TCPR_THREAD_LOCAL char new_string[255];
 
     new_string[0] = '\0';
     addr.s_addr = ip;
@@ -870,10 +974,7 @@ get_addr2name4(uint32_t ip, bool _U_ dnslookup)
 const char *
 get_addr2name6(const struct tcpr_in6_addr *addr, _U_ bool dnslookup)
 {
-    static char *new_string = NULL;
-
-    if (new_string == NULL)
-        new_string = (char *)safe_malloc(255);
+    static TCPR_THREAD_LOCAL char new_string[255];
 
     new_string[0] = '\0';
 
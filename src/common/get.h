@@ -50,6 +50,7 @@ void *get_layer4_v4(const ipv4_hdr_t *ip_hdr, const u_char *end_ptr);
 void *get_layer4_v6(const ipv6_hdr_t *ip_hdr, const u_char *end_ptr);
 
 u_int8_t get_ipv6_l4proto(const ipv6_hdr_t *ip6_hdr, const u_char *end_ptr);
+void *get_layer4_v6_proto(const ipv6_hdr_t *ip6_hdr, const u_char *end_ptr, uint8_t *proto);
 
 const u_char *get_ipv4(const u_char *pktdata, int datalen, int datalink, u_char **newbuff);
 const u_char *get_ipv6(const u_char *pktdata, int datalen, int datalink, u_char **newbuff);
@@ -0,0 +1,145 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "histogram.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * \brief smallest value counted in the given bucket
+ */
+u_int64_t
+tcpr_hist_bucket_low(int index)
+{
+    int group = index / TCPR_HIST_SUB;
+    int sub = index % TCPR_HIST_SUB;
+
+    if (group == 0)
+        return (u_int64_t)sub;
+
+    return (u_int64_t)(TCPR_HIST_SUB + sub) << (group - 1);
+}
+
+/**
+ * \brief number of values less than value
+ *
+ * Exact when value is the low end of a bucket, e.g. any power of two
+ */
+COUNTER
+tcpr_hist_count_below(const tcpr_hist_t *h, u_int64_t value)
+{
+    COUNTER count = 0;
+    int i;
+
+    for (i = 0; i < TCPR_HIST_BUCKETS && tcpr_hist_bucket_low(i) < value; i++)
+        count += h->bucket[i];
+
+    return count;
+}
+
+/**
+ * \brief value below which the given percentage (0-100) of values fall
+ *
+ * Returns the highest value of the bucket containing the percentile,
+ * capped to the largest value seen.
+ */
+u_int64_t
+tcpr_hist_percentile(const tcpr_hist_t *h, double percentile)
+{
+    COUNTER target, count = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+
+    target = (COUNTER)((double)h->count * percentile / 100.0 + 0.5);
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < TCPR_HIST_BUCKETS; i++) {
+        count += h->bucket[i];
+        if (count >= target) {
+            u_int64_t high = i + 1 < TCPR_HIST_BUCKETS ? tcpr_hist_bucket_low(i + 1) - 1 : UINT64_MAX;
+
+            return high < h->max ? high : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+/**
+ * \brief add all the values of from to to
+ */
+void
+tcpr_hist_merge(tcpr_hist_t *to, const tcpr_hist_t *from)
+{
+    int i;
+
+    for (i = 0; i < TCPR_HIST_BUCKETS; i++)
+        to->bucket[i] += from->bucket[i];
+
+    to->count += from->count;
+    to->sum += from->sum;
+    if (from->max > to->max)
+        to->max = from->max;
+}
+
+/**
+ * \brief copy a histogram another thread is adding to
+ *
+ * The copy is not a consistent snapshot, but every field is read whole.
+ */
+void
+tcpr_hist_load(tcpr_hist_t *to, const tcpr_hist_t *from)
+{
+    int i;
+
+    for (i = 0; i < TCPR_HIST_BUCKETS; i++)
+        to->bucket[i] = __atomic_load_n(&from->bucket[i], __ATOMIC_RELAXED);
+
+    to->count = __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    to->sum = __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    to->max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief print count, percentiles and max, in microseconds, of a
+ * histogram of nanoseconds
+ */
+size_t
+tcpr_hist_summary(const tcpr_hist_t *h, char *buf, size_t len)
+{
+    int n;
+
+    n = snprintf(buf,
+                 len,
+                 "count " COUNTER_SPEC ", avg %.3f, p50 %.3f, p90 %.3f, p99 %.3f, p99.9 %.3f, max %.3f usec",
+                 h->count,
+                 h->count ? (double)h->sum / (double)h->count / 1000.0 : 0.0,
+                 (double)tcpr_hist_percentile(h, 50.0) / 1000.0,
+                 (double)tcpr_hist_percentile(h, 90.0) / 1000.0,
+                 (double)tcpr_hist_percentile(h, 99.0) / 1000.0,
+                 (double)tcpr_hist_percentile(h, 99.9) / 1000.0,
+                 (double)h->max / 1000.0);
+
+    return n < 0 ? 0 : (size_t)n;
+}
@@ -0,0 +1,70 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+/*
+ * Log-linear histogram of 64 bit values (HDR histogram style).
+ *
+ * Values below TCPR_HIST_SUB are counted exactly.  Above that every power
+ * of two is split into TCPR_HIST_SUB equal buckets, so a value is known
+ * to within 1/TCPR_HIST_SUB (6.25%) over the whole range.  Adding a value
+ * is a count-leading-zeros and an increment.
+ */
+#define TCPR_HIST_SUB_BITS 4
+#define TCPR_HIST_SUB (1 << TCPR_HIST_SUB_BITS)
+#define TCPR_HIST_BUCKETS ((64 - TCPR_HIST_SUB_BITS + 1) * TCPR_HIST_SUB)
+
+typedef struct tcpr_hist_s {
+    COUNTER count;
+    u_int64_t sum;
+    u_int64_t max;
+    COUNTER bucket[TCPR_HIST_BUCKETS];
+} tcpr_hist_t;
+
+static inline int
+tcpr_hist_index(u_int64_t value)
+{
+    int e;
+
+    if (value < TCPR_HIST_SUB)
+        return (int)value;
+
+    e = 63 - __builtin_clzll(value);
+    return (e - TCPR_HIST_SUB_BITS + 1) * TCPR_HIST_SUB + (int)((value >> (e - TCPR_HIST_SUB_BITS)) & (TCPR_HIST_SUB - 1));
+}
+
+static inline void
+tcpr_hist_add(tcpr_hist_t *h, u_int64_t value)
+{
+    h->bucket[tcpr_hist_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max)
+        h->max = value;
+}
+
+u_int64_t tcpr_hist_bucket_low(int index);
+COUNTER tcpr_hist_count_below(const tcpr_hist_t *h, u_int64_t value);
+u_int64_t tcpr_hist_percentile(const tcpr_hist_t *h, double percentile);
+void tcpr_hist_merge(tcpr_hist_t *to, const tcpr_hist_t *from);
+void tcpr_hist_load(tcpr_hist_t *to, const tcpr_hist_t *from);
+size_t tcpr_hist_summary(const tcpr_hist_t *h, char *buf, size_t len);
@@ -0,0 +1,203 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hugepage.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#define HUGE_2M (2UL * 1024 * 1024)
+#define HUGE_1G (1024UL * 1024 * 1024)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+/* from <numaif.h>, which needs libnuma */
+#define TCPR_MPOL_PREFERRED 1
+
+static bool huge_enabled;
+static int huge_node = -1;
+/* bytes obtained of each kind of page, preload threads may add at once */
+static size_t huge_bytes[TCPR_PAGES_KINDS];
+
+/**
+ * \brief allocate from huge pages from now on, preferably on the given
+ * NUMA node (-1 for any)
+ */
+void
+tcpr_huge_init(int node)
+{
+    huge_enabled = true;
+    huge_node = node;
+}
+
+bool
+tcpr_huge_enabled(void)
+{
+    return huge_enabled;
+}
+
+#if defined HAVE_MMAP && defined MAP_HUGETLB
+/**
+ * \brief prefer huge_node for the pages of a mapping not touched yet
+ *
+ * Only a preference: binding could leave us with SIGBUS when the node
+ * runs out of huge pages.
+ */
+static void
+huge_place(void *data, size_t size)
+{
+#if defined __linux__ && defined SYS_mbind
+    unsigned long mask[4];
+
+    if (huge_node < 0 || huge_node >= (int)(sizeof(mask) * 8))
+        return;
+
+    memset(mask, 0, sizeof(mask));
+    mask[huge_node / (sizeof(unsigned long) * 8)] = 1UL << (huge_node % (sizeof(unsigned long) * 8));
+    if (syscall(SYS_mbind, data, size, TCPR_MPOL_PREFERRED, mask, sizeof(mask) * 8, 0) < 0)
+        dbgx(1, "mbind to node %d failed: %s", huge_node, strerror(errno));
+#else
+    (void)data;
+    (void)size;
+#endif
+}
+
+static void *
+huge_map(size_t size, int flags)
+{
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+
+    return data == MAP_FAILED ? NULL : data;
+}
+#endif /* HAVE_MMAP && MAP_HUGETLB */
+
+/**
+ * \brief allocate *size bytes, from huge pages if we can
+ *
+ * *size is rounded up to the page size used and *pages says which it
+ * was.  Without tcpr_huge_init() this is just malloc().  Returns NULL if
+ * no memory could be had at all.  Free with tcpr_huge_free() and the
+ * rounded size.
+ */
+void *
+tcpr_huge_alloc(size_t *size, tcpr_pages_t *pages)
+{
+    void *data = NULL;
+    size_t len;
+
+#if defined HAVE_MMAP && defined MAP_HUGETLB
+    if (huge_enabled) {
+        /* 1 GB pages only for allocations that fill them */
+        if (*size >= HUGE_1G) {
+            len = (*size + HUGE_1G - 1) & ~(HUGE_1G - 1);
+            if ((data = huge_map(len, MAP_HUGETLB | MAP_HUGE_1GB)) != NULL)
+                *pages = TCPR_PAGES_1G;
+        }
+
+        if (data == NULL) {
+            len = (*size + HUGE_2M - 1) & ~(HUGE_2M - 1);
+            if ((data = huge_map(len, MAP_HUGETLB | MAP_HUGE_2MB)) != NULL) {
+                *pages = TCPR_PAGES_2M;
+            } else if ((data = huge_map(len, 0)) != NULL) {
+                *pages = TCPR_PAGES_NORMAL;
+#if defined HAVE_MADVISE && defined MADV_HUGEPAGE
+                if (madvise(data, len, MADV_HUGEPAGE) == 0)
+                    *pages = TCPR_PAGES_THP;
+#endif
+            }
+        }
+
+        if (data == NULL)
+            return NULL;
+
+        huge_place(data, len);
+        *size = len;
+        __atomic_add_fetch(&huge_bytes[*pages], len, __ATOMIC_RELAXED);
+        return data;
+    }
+#endif
+
+    len = *size;
+    if ((data = malloc(len)) == NULL)
+        return NULL;
+
+    *pages = TCPR_PAGES_NORMAL;
+    __atomic_add_fetch(&huge_bytes[TCPR_PAGES_NORMAL], len, __ATOMIC_RELAXED);
+    return data;
+}
+
+/**
+ * \brief free what tcpr_huge_alloc() returned
+ */
+void
+tcpr_huge_free(void *data, size_t size)
+{
+    if (data == NULL)
+        return;
+
+#if defined HAVE_MMAP && defined MAP_HUGETLB
+    if (huge_enabled) {
+        munmap(data, size);
+        return;
+    }
+#endif
+
+    (void)size;
+    free(data);
+}
+
+/**
+ * \brief describe the pages tcpr_huge_alloc() obtained
+ */
+size_t
+tcpr_huge_report(char *buf, size_t len)
+{
+    int n;
+
+    n = snprintf(buf,
+                 len,
+                 "%zu MB in 1 GB pages, %zu MB in 2 MB pages, %zu MB transparent huge pages, %zu MB normal pages",
+                 huge_bytes[TCPR_PAGES_1G] >> 20,
+                 huge_bytes[TCPR_PAGES_2M] >> 20,
+                 huge_bytes[TCPR_PAGES_THP] >> 20,
+                 huge_bytes[TCPR_PAGES_NORMAL] >> 20);
+    if (n >= 0 && (size_t)n < len && huge_node >= 0)
+        n += snprintf(buf + n, len - (size_t)n, ", preferring NUMA node %d", huge_node);
+
+    return n < 0 ? 0 : (size_t)n;
+}
@@ -0,0 +1,47 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include <stddef.h>
+
+/*
+ * Large allocations (the preload arenas, the AF_XDP UMEM) backed by huge
+ * pages, so that sending from tens of GB of packets isn't TLB bound.
+ *
+ * tcpr_huge_alloc() tries, in order, 1 GB and 2 MB hugetlbfs pages
+ * (MAP_HUGETLB, which need to be reserved in /proc/sys/vm/nr_hugepages
+ * or the hugepages= boot option), then transparent huge pages via
+ * madvise(), then plain pages.  Memory is placed on the NUMA node given
+ * to tcpr_huge_init() when it has room.
+ */
+typedef enum {
+    TCPR_PAGES_NORMAL,
+    TCPR_PAGES_THP,
+    TCPR_PAGES_2M,
+    TCPR_PAGES_1G,
+    TCPR_PAGES_KINDS
+} tcpr_pages_t;
+
+void tcpr_huge_init(int node);
+bool tcpr_huge_enabled(void);
+void *tcpr_huge_alloc(size_t *size, tcpr_pages_t *pages);
+void tcpr_huge_free(void *data, size_t size);
+size_t tcpr_huge_report(char *buf, size_t len);
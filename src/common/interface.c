@@ -42,6 +42,12 @@ get_interface(interface_list_t *list, const char *alias)
 
     assert(alias);
 
+#ifdef HAVE_DPDK
+    /* DPDK ports only show up once the EAL is up, sendpacket_open() looks them up */
+    if (strncmp(alias, "dpdk:", 5) == 0)
+        return (char *)alias;
+#endif
+
     ptr = list;
 
     while (ptr) {
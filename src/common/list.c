@@ -32,6 +32,31 @@
 #include <string.h>
 #include <sys/types.h>
 
+/* bitmaps up to this size are used whatever the number of ranges */
+#define LIST_BITMAP_MIN_BYTES 4096
+
+/* largest value a bitmap can cover */
+#define LIST_BITMAP_MAX ((COUNTER)1 << 27)
+
+typedef struct list_range_s {
+    COUNTER min;
+    COUNTER max;
+} list_range_t;
+
+/*
+ * A compiled list: its closed ranges sorted and merged so they can be
+ * searched, and when they don't cover much, a bitmap of every value in
+ * them.  "N-0" ranges, which match everything from N up, are kept apart.
+ */
+struct tcpr_list_index_s {
+    list_range_t *ranges;
+    u_int32_t count;
+    bool open;        /* there was at least one "N-0" range */
+    COUNTER open_min; /* smallest N of those */
+    u_char *bitmap;   /* covers every closed range, if set */
+    COUNTER bitmap_len;
+};
+
 /**
  * Creates a new tcpr_list entry.  Malloc's memory.
  */
@@ -133,9 +158,152 @@ parse_list(tcpr_list_t **listdata, char *ourstr)
 
     regfree(&preg);
 
+    /* packet numbers are checked against every packet */
+    compile_list(*listdata);
+
     return 1;
 }
 
+static int
+list_range_cmp(const void *a, const void *b)
+{
+    const list_range_t *ra = (const list_range_t *)a;
+    const list_range_t *rb = (const list_range_t *)b;
+
+    if (ra->min != rb->min)
+        return ra->min < rb->min ? -1 : 1;
+
+    return 0;
+}
+
+static void
+destroy_list_index(tcpr_list_index_t *index)
+{
+    if (index == NULL)
+        return;
+
+    safe_free(index->ranges);
+    safe_free(index->bitmap);
+    safe_free(index);
+}
+
+/**
+ * builds the index used by check_list() and check_list_from() for the
+ * list starting at list.  Call again if the list is changed
+ */
+void
+compile_list(tcpr_list_t *list)
+{
+    tcpr_list_index_t *index;
+    tcpr_list_t *cur;
+    list_range_t *ranges;
+    u_int32_t count = 0, n = 0, i;
+
+    if (list == NULL)
+        return;
+
+    for (cur = list; cur != NULL; cur = cur->next)
+        count++;
+
+    index = (tcpr_list_index_t *)safe_malloc(sizeof(tcpr_list_index_t));
+    ranges = (list_range_t *)safe_malloc(count * sizeof(list_range_t));
+
+    for (cur = list; cur != NULL; cur = cur->next) {
+        if (cur->min != 0 && cur->max == 0) {
+            if (!index->open || cur->min < index->open_min)
+                index->open_min = cur->min;
+            index->open = true;
+        } else if (cur->min <= cur->max) {
+            ranges[n].min = cur->min;
+            ranges[n].max = cur->max;
+            n++;
+        }
+    }
+
+    qsort(ranges, n, sizeof(list_range_t), list_range_cmp);
+
+    /* merge overlapping and adjacent ranges */
+    count = 0;
+    for (i = 0; i < n; i++) {
+        list_range_t *last = count > 0 ? &ranges[count - 1] : NULL;
+
+        if (last != NULL && (ranges[i].min <= last->max || ranges[i].min - 1 == last->max)) {
+            if (ranges[i].max > last->max)
+                last->max = ranges[i].max;
+        } else {
+            ranges[count++] = ranges[i];
+        }
+    }
+
+    index->ranges = ranges;
+    index->count = count;
+
+    /* a bitmap no bigger than the ranges makes every lookup one bit test */
+    if (count > 0 && ranges[count - 1].max < LIST_BITMAP_MAX) {
+        COUNTER bits = ranges[count - 1].max + 1;
+        COUNTER bytes = (bits + 7) / 8;
+
+        if (bytes <= LIST_BITMAP_MIN_BYTES || bytes <= count * sizeof(list_range_t)) {
+            COUNTER v;
+
+            index->bitmap = (u_char *)safe_malloc(bytes);
+            index->bitmap_len = bits;
+            for (i = 0; i < count; i++) {
+                for (v = ranges[i].min; v <= ranges[i].max; v++)
+                    index->bitmap[v / 8] |= (u_char)(1 << (v % 8));
+            }
+        }
+    }
+
+    destroy_list_index(list->index);
+    list->index = index;
+    dbgx(1, "Compiled %u ranges%s", count, index->bitmap != NULL ? " into a bitmap" : "");
+}
+
+/**
+ * looks value up in a compiled list.  If cursor is set it is the range
+ * the last lookup stopped at, so rising values only step forward
+ */
+static int
+list_index_lookup(const tcpr_list_index_t *index, COUNTER value, u_int32_t *cursor)
+{
+    u_int32_t i;
+
+    if (index->open && value >= index->open_min)
+        return 1;
+
+    if (index->bitmap != NULL) {
+        if (value >= index->bitmap_len)
+            return 0;
+
+        return (index->bitmap[value / 8] >> (value % 8)) & 1;
+    }
+
+    i = cursor != NULL ? *cursor : 0;
+    if (cursor == NULL || i == 0 || i > index->count || value <= index->ranges[i - 1].max) {
+        /* binary search for the first range ending at or after value */
+        u_int32_t lo = 0, hi = index->count;
+
+        while (lo < hi) {
+            u_int32_t mid = lo + (hi - lo) / 2;
+
+            if (index->ranges[mid].max < value)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        i = lo;
+    } else {
+        while (i < index->count && index->ranges[i].max < value)
+            i++;
+    }
+
+    if (cursor != NULL)
+        *cursor = i;
+
+    return i < index->count && value >= index->ranges[i].min;
+}
+
 /**
  * Checks to see if the given integer exists in the LIST.
  * Return 1 if in the list, otherwise 0
@@ -146,6 +314,9 @@ check_list(tcpr_list_t *list, COUNTER value)
     tcpr_list_t *current;
     current = list;
 
+    if (list->index != NULL)
+        return list_index_lookup(list->index, value, NULL);
+
     do {
         if ((current->min != 0) && (current->max != 0)) {
             if ((value >= current->min) && (value <= current->max))
@@ -167,15 +338,34 @@ check_list(tcpr_list_t *list, COUNTER value)
     return 0;
 }
 
+/**
+ * Like check_list(), for callers whose values only go up: cursor starts
+ * at 0 and is kept between calls.  Values that go down still work
+ */
+int
+check_list_from(tcpr_list_t *list, COUNTER value, u_int32_t *cursor)
+{
+    if (list->index != NULL)
+        return list_index_lookup(list->index, value, cursor);
+
+    return check_list(list, value);
+}
+
 /**
  * Free's all the memory associated with the given LIST
  */
 void
 free_list(tcpr_list_t *list)
 {
-    /* recursively go down the list */
-    if (list->next != NULL)
-        free_list(list->next);
+    tcpr_list_t *next;
 
-    safe_free(list);
+    if (list != NULL)
+        destroy_list_index(list->index);
+
+    /* not recursive: lists can have many thousands of entries */
+    while (list != NULL) {
+        next = list->next;
+        safe_free(list);
+        list = next;
+    }
 }
@@ -20,14 +20,20 @@
 
 #pragma once
 
+/* compiled lookup over a list of ranges, see compile_list() */
+typedef struct tcpr_list_index_s tcpr_list_index_t;
+
 struct list_s {
     COUNTER max;
     COUNTER min;
     struct list_s *next;
+    tcpr_list_index_t *index; /* only set on the head of a compiled list */
 };
 
 typedef struct list_s tcpr_list_t;
 
 int parse_list(tcpr_list_t **, char *);
+void compile_list(tcpr_list_t *);
 int check_list(tcpr_list_t *, COUNTER);
+int check_list_from(tcpr_list_t *, COUNTER, u_int32_t *);
 void free_list(tcpr_list_t *);
@@ -95,6 +95,69 @@ done:
     return ret;
 }
 
+static void
+macset_add(tcpr_macset_t *set, u_int64_t key)
+{
+    u_int32_t i;
+
+    for (i = macset_hash(key) & set->mask; set->slot[i] != 0; i = (i + 1) & set->mask) {
+        if (set->slot[i] == key)
+            return;
+    }
+
+    set->slot[i] = key;
+    ++set->cnt;
+}
+
+/**
+ * Parses a comma delimited string of MAC addresses into a set, so that
+ * macset_lookup() doesn't have to parse the string for every packet as
+ * macinstring() does.  Entries are parsed the same way, so both always
+ * agree.  Free with macset_free().
+ */
+tcpr_macset_t *
+macset_new(const char *macstring)
+{
+    tcpr_macset_t *set;
+    char *tok = NULL, *tempstr, *ourstring;
+    u_char tempmac[6];
+    u_int32_t entries = 1, size = 2;
+    const char *c;
+
+    for (c = macstring; *c != '\0'; c++) {
+        if (*c == ',')
+            ++entries;
+    }
+    while (size < entries * 2)
+        size <<= 1;
+
+    set = safe_malloc(sizeof(*set));
+    set->slot = safe_malloc(size * sizeof(set->slot[0]));
+    set->mask = size - 1;
+
+    /* like macinstring(), an entry mac2hex() can't parse leaves tempmac as it was */
+    ourstring = safe_strdup(macstring);
+    memset(&tempmac[0], 0, sizeof(tempmac));
+    for (tempstr = strtok_r(ourstring, ",", &tok); tempstr != NULL; tempstr = strtok_r(NULL, ",", &tok)) {
+        mac2hex(tempstr, tempmac, sizeof(tempmac));
+        macset_add(set, macset_key(tempmac));
+    }
+    safe_free(ourstring);
+
+    dbgx(1, "%u MAC addresses in set of %u slots", set->cnt, size);
+    return set;
+}
+
+void
+macset_free(tcpr_macset_t *set)
+{
+    if (set == NULL)
+        return;
+
+    safe_free(set->slot);
+    safe_free(set);
+}
+
 /**
  * Figures out if a MAC is listed in a comma delimited
  * string of MAC addresses.
@@ -26,3 +26,45 @@
 void mac2hex(const char *mac, u_char *dst, int len);
 int dualmac2hex(const char *dualmac, u_char *first, u_char *second, int len);
 tcpr_dir_t macinstring(const char *macstring, const u_char *mac);
+
+/* the MAC addresses of a comma delimited string, parsed once for lookups */
+typedef struct tcpr_macset_s {
+    u_int64_t *slot; /* open addressing, MACSET_USED | the MAC, 0 when free */
+    u_int32_t mask;  /* slots - 1, a power of two at least twice the MACs */
+    u_int32_t cnt;
+} tcpr_macset_t;
+
+#define MACSET_USED ((u_int64_t)1 << 48)
+
+tcpr_macset_t *macset_new(const char *macstring);
+void macset_free(tcpr_macset_t *set);
+
+static inline u_int64_t
+macset_key(const u_char *mac)
+{
+    return MACSET_USED | (u_int64_t)mac[0] << 40 | (u_int64_t)mac[1] << 32 | (u_int64_t)mac[2] << 24 |
+           (u_int64_t)mac[3] << 16 | (u_int64_t)mac[4] << 8 | (u_int64_t)mac[5];
+}
+
+static inline u_int32_t
+macset_hash(u_int64_t key)
+{
+    return (u_int32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32);
+}
+
+/**
+ * \brief same as macinstring() on the string set was made from
+ */
+static inline tcpr_dir_t
+macset_lookup(const tcpr_macset_t *set, const u_char *mac)
+{
+    u_int64_t key = macset_key(mac);
+    u_int32_t i;
+
+    for (i = macset_hash(key) & set->mask; set->slot[i] != 0; i = (i + 1) & set->mask) {
+        if (set->slot[i] == key)
+            return TCPR_DIR_C2S;
+    }
+
+    return TCPR_DIR_S2C;
+}
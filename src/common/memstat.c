@@ -0,0 +1,252 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The counters behind memstat.h.  safe_malloc() and safe_free() are
+ * everywhere, so each thread counts its allocations in counters of its
+ * own, which only it writes: a plain add rather than an atomic one on a
+ * cache line every thread fights over.  Reports add up the counters of
+ * every thread, including threads which have ended.  Mapping is rare,
+ * and its peak needs the total, so those counters are shared.  Nothing
+ * is ordered by any of them, and a report read while the run goes on may
+ * be a few counts off.
+ */
+
+#include "memstat.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* the allocations counted by one thread */
+typedef struct mem_thread_s {
+    tcpr_mem_stats_t stats[TCPR_MEM_SUBSYSTEMS]; /* mapped and mapped_peak are unused */
+    struct mem_thread_s *next;
+} mem_thread_t;
+
+static __thread mem_thread_t *mem_thread;
+static mem_thread_t *mem_threads; /* every thread which counted anything, never freed */
+static tcpr_mem_stats_t mem_maps[TCPR_MEM_SUBSYSTEMS]; /* only mapped and mapped_peak */
+static bool mem_guard_armed;
+static bool mem_guard_warn;
+static COUNTER mem_guard_warnings;
+
+static const char *mem_subsys_names[TCPR_MEM_SUBSYSTEMS] = {
+        "other",
+        "preload",
+        "flows",
+        "tcpprep",
+        "tcpedit",
+        "fragroute",
+        "rings",
+};
+
+#define MEM_ADD(field, n) __atomic_fetch_add(&(field), (COUNTER)(n), __ATOMIC_RELAXED)
+#define MEM_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+/* a counter of this thread, the store only so a report never reads it torn */
+#define MEM_COUNT(field, n) __atomic_store_n(&(field), (field) + (COUNTER)(n), __ATOMIC_RELAXED)
+
+static inline unsigned
+mem_index(tcpr_mem_subsys_t subsys)
+{
+    return (unsigned)subsys < TCPR_MEM_SUBSYSTEMS ? (unsigned)subsys : TCPR_MEM_OTHER;
+}
+
+/**
+ * the counters of the calling thread, made on its first allocation
+ */
+static tcpr_mem_stats_t *
+mem_subsys(tcpr_mem_subsys_t subsys)
+{
+    mem_thread_t *t = mem_thread;
+
+    if (t == NULL) {
+        /* not safe_malloc(), that would count itself */
+        if ((t = calloc(1, sizeof(*t))) == NULL) {
+            fprintf(stderr, "ERROR: Unable to calloc() %zu bytes for memory statistics\n", sizeof(*t));
+            exit(-1);
+        }
+        t->next = MEM_LOAD(mem_threads);
+        while (!__atomic_compare_exchange_n(&mem_threads, &t->next, t, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        mem_thread = t;
+    }
+
+    return &t->stats[mem_index(subsys)];
+}
+
+/**
+ * \brief count an allocation of len bytes, made by safe_malloc() and friends
+ */
+void
+tcpr_mem_alloc(tcpr_mem_subsys_t subsys, size_t len, const char *funcname, int line, const char *file)
+{
+    tcpr_mem_stats_t *ms = mem_subsys(subsys);
+
+    MEM_COUNT(ms->allocs, 1);
+    MEM_COUNT(ms->bytes, len);
+
+    if (!__atomic_load_n(&mem_guard_armed, __ATOMIC_RELAXED))
+        return;
+
+    MEM_COUNT(ms->steady, 1);
+    MEM_COUNT(ms->steady_bytes, len);
+    if (mem_guard_warn && MEM_ADD(mem_guard_warnings, 1) < TCPR_MEM_GUARD_WARNINGS)
+        warnx("steady-state allocation of %zu bytes (%s) in %s:%s() line %d",
+              len,
+              tcpr_mem_subsys_name(subsys),
+              file,
+              funcname,
+              line);
+}
+
+/**
+ * \brief count a safe_free()
+ */
+void
+tcpr_mem_free(tcpr_mem_subsys_t subsys)
+{
+    tcpr_mem_stats_t *ms = mem_subsys(subsys);
+
+    MEM_COUNT(ms->frees, 1);
+}
+
+/**
+ * \brief count len bytes mapped for a subsystem, rather than allocated
+ */
+void
+tcpr_mem_map(tcpr_mem_subsys_t subsys, size_t len)
+{
+    tcpr_mem_stats_t *ms = &mem_maps[mem_index(subsys)];
+    COUNTER mapped = MEM_ADD(ms->mapped, len) + len;
+    COUNTER peak = MEM_LOAD(ms->mapped_peak);
+
+    while (mapped > peak &&
+           !__atomic_compare_exchange_n(&ms->mapped_peak, &peak, mapped, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/**
+ * \brief count len bytes given back, which tcpr_mem_map() counted
+ */
+void
+tcpr_mem_unmap(tcpr_mem_subsys_t subsys, size_t len)
+{
+    __atomic_fetch_sub(&mem_maps[mem_index(subsys)].mapped, (COUNTER)len, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief arm or disarm the steady-state guard
+ *
+ * The send loop arms it once it is past warm-up, and disarms it when it
+ * gets to the end of a pass.
+ */
+void
+tcpr_mem_guard(bool armed)
+{
+    __atomic_store_n(&mem_guard_armed, armed, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief report where each steady-state allocation is made, for the first
+ * TCPR_MEM_GUARD_WARNINGS of them
+ */
+void
+tcpr_mem_guard_warn(bool warn)
+{
+    mem_guard_warn = warn;
+}
+
+/**
+ * \brief add up the counters of a subsystem over every thread
+ */
+void
+tcpr_mem_get(tcpr_mem_subsys_t subsys, tcpr_mem_stats_t *stats)
+{
+    unsigned i = mem_index(subsys);
+    const mem_thread_t *t;
+
+    memset(stats, 0, sizeof(*stats));
+    for (t = __atomic_load_n(&mem_threads, __ATOMIC_ACQUIRE); t != NULL; t = t->next) {
+        const tcpr_mem_stats_t *ms = &t->stats[i];
+
+        stats->allocs += MEM_LOAD(ms->allocs);
+        stats->frees += MEM_LOAD(ms->frees);
+        stats->bytes += MEM_LOAD(ms->bytes);
+        stats->steady += MEM_LOAD(ms->steady);
+        stats->steady_bytes += MEM_LOAD(ms->steady_bytes);
+    }
+    stats->mapped = MEM_LOAD(mem_maps[i].mapped);
+    stats->mapped_peak = MEM_LOAD(mem_maps[i].mapped_peak);
+}
+
+const char *
+tcpr_mem_subsys_name(tcpr_mem_subsys_t subsys)
+{
+    return mem_subsys_names[mem_index(subsys)];
+}
+
+/**
+ * \brief a line for each subsystem which allocated or mapped anything,
+ * and the steady-state allocations if there were any
+ *
+ * Returns the length written, as snprintf()
+ */
+size_t
+tcpr_mem_report(char *buf, size_t len)
+{
+    tcpr_mem_stats_t ms;
+    COUNTER steady = 0, steady_bytes = 0;
+    size_t used = 0;
+    int i, n;
+
+    if (len > 0)
+        buf[0] = '\0';
+
+    for (i = 0; i < TCPR_MEM_SUBSYSTEMS; i++) {
+        tcpr_mem_get((tcpr_mem_subsys_t)i, &ms);
+        steady += ms.steady;
+        steady_bytes += ms.steady_bytes;
+        if (ms.allocs == 0 && ms.mapped_peak == 0)
+            continue;
+
+        n = snprintf(used < len ? buf + used : NULL,
+                     used < len ? len - used : 0,
+                     "\t%-10s " COUNTER_SPEC " bytes in " COUNTER_SPEC " allocations, " COUNTER_SPEC
+                     " freed, " COUNTER_SPEC " bytes mapped (peak " COUNTER_SPEC ")\n",
+                     tcpr_mem_subsys_name((tcpr_mem_subsys_t)i),
+                     ms.bytes,
+                     ms.allocs,
+                     ms.frees,
+                     ms.mapped,
+                     ms.mapped_peak);
+        if (n < 0)
+            return used;
+        used += (size_t)n;
+    }
+
+    n = snprintf(used < len ? buf + used : NULL,
+                 used < len ? len - used : 0,
+                 "\tsteady state: " COUNTER_SPEC " allocations, " COUNTER_SPEC " bytes\n",
+                 steady,
+                 steady_bytes);
+
+    return n < 0 ? used : used + (size_t)n;
+}
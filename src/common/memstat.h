@@ -0,0 +1,72 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+/*
+ * What the tools allocate, by subsystem.  safe_malloc() and friends count
+ * every allocation against the subsystem of the file calling them, which
+ * is TCPR_MEM_SUBSYS there, and the preload cache and rings count what
+ * they map with tcpr_mem_map() and tcpr_mem_unmap().
+ *
+ * Once the send loop is past warm-up it arms the guard, and until it is
+ * disarmed again every allocation is a steady-state one: a latency hazard
+ * which is counted, and with tcpr_mem_guard_warn() reported where it was
+ * made.
+ */
+typedef enum {
+    TCPR_MEM_OTHER,
+    TCPR_MEM_PRELOAD,   /* the preload cache and its schedule */
+    TCPR_MEM_FLOWS,     /* the flow table */
+    TCPR_MEM_TCPPREP,   /* tcpprep and its cache files */
+    TCPR_MEM_TCPEDIT,   /* tcpedit and its DLT plugins */
+    TCPR_MEM_FRAGROUTE, /* fragroute and its packet pools */
+    TCPR_MEM_RINGS,     /* TX rings and the queues between threads */
+    TCPR_MEM_SUBSYSTEMS
+} tcpr_mem_subsys_t;
+
+/* the files of a subsystem define this before their first #include */
+#ifndef TCPR_MEM_SUBSYS
+#define TCPR_MEM_SUBSYS TCPR_MEM_OTHER
+#endif
+
+/* stop reporting steady-state allocations after this many */
+#define TCPR_MEM_GUARD_WARNINGS 32
+
+typedef struct tcpr_mem_stats_s {
+    COUNTER allocs;       /* safe_malloc(), safe_realloc() and safe_strdup() calls */
+    COUNTER frees;        /* safe_free() calls */
+    COUNTER bytes;        /* asked for over the whole run */
+    COUNTER mapped;       /* mapped now */
+    COUNTER mapped_peak;  /* most mapped at once */
+    COUNTER steady;       /* allocations while the guard was armed */
+    COUNTER steady_bytes; /* and their bytes */
+} tcpr_mem_stats_t;
+
+void tcpr_mem_alloc(tcpr_mem_subsys_t subsys, size_t len, const char *funcname, int line, const char *file);
+void tcpr_mem_free(tcpr_mem_subsys_t subsys);
+void tcpr_mem_map(tcpr_mem_subsys_t subsys, size_t len);
+void tcpr_mem_unmap(tcpr_mem_subsys_t subsys, size_t len);
+void tcpr_mem_guard(bool armed);
+void tcpr_mem_guard_warn(bool warn);
+void tcpr_mem_get(tcpr_mem_subsys_t subsys, tcpr_mem_stats_t *stats);
+const char *tcpr_mem_subsys_name(tcpr_mem_subsys_t subsys);
+size_t tcpr_mem_report(char *buf, size_t len);
@@ -0,0 +1,605 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mmap_pcap.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+
+#ifdef HAVE_MMAP
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define MMAP_PCAP_MAGIC 0xa1b2c3d4
+#define MMAP_PCAP_NSEC_MAGIC 0xa1b23c4d
+#define MMAP_PCAP_KUZNETZOV_MAGIC 0xa1b2cd34
+
+/* on-disk file header; struct pcap_file_header matches this */
+#define MMAP_PCAP_FILE_HDRLEN 24
+
+/* on-disk record header. struct pcap_pkthdr does NOT match on 64bit systems */
+#define MMAP_PCAP_PKT_HDRLEN 16
+#define MMAP_PCAP_KUZNETZOV_PKT_HDRLEN 24
+
+/* pcapng block types */
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_PB 0x00000002 /* obsolete packet block */
+#define PCAPNG_SPB 0x00000003
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+
+/* smallest valid length of each block, including the type and both lengths */
+#define PCAPNG_BLOCK_MIN 12
+#define PCAPNG_SHB_MIN 28
+#define PCAPNG_IDB_MIN 20
+#define PCAPNG_SPB_MIN 16
+#define PCAPNG_EPB_MIN 32
+#define PCAPNG_PB_MIN 32
+
+/* interface description block options */
+#define PCAPNG_OPT_ENDOFOPT 0
+#define PCAPNG_OPT_IF_TSRESOL 9
+#define PCAPNG_OPT_IF_TSOFFSET 14
+
+static mmap_pcap_t *mmap_pcap_map(const char *path, bool shared, char *ebuf);
+
+static inline uint32_t
+read_u32(const mmap_pcap_t *mp, const u_char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return mp->swapped ? SWAPLONG(v) : v;
+}
+
+static inline uint16_t
+read_u16(const mmap_pcap_t *mp, const u_char *p)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return mp->swapped ? (uint16_t)SWAPSHORT(v) : v;
+}
+
+static inline uint64_t
+read_u64(const mmap_pcap_t *mp, const u_char *p)
+{
+    uint32_t w[2];
+    uint64_t v;
+
+    if (!mp->swapped) {
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+
+    memcpy(w, p, sizeof(w));
+    return (uint64_t)SWAPLONG(w[0]) << 32 | SWAPLONG(w[1]);
+}
+
+/* fill in pkthdr->ts from mp->ts_ns */
+static inline void
+set_pkthdr_ts(const mmap_pcap_t *mp, struct pcap_pkthdr *pkthdr)
+{
+    pkthdr->ts.tv_sec = (time_t)(mp->ts_ns / 1000000000);
+    if (mp->tstamp_nsec)
+        pkthdr->ts.tv_usec = (suseconds_t)(mp->ts_ns % 1000000000);
+    else
+        pkthdr->ts.tv_usec = (suseconds_t)(mp->ts_ns % 1000000000 / 1000);
+}
+
+/**
+ * \brief Get the pcapng block at the current offset
+ *
+ * Section header blocks set the byte order used for the rest of the
+ * section.  Returns NULL at the end of the file or if the block is
+ * invalid.
+ */
+static const u_char *
+pcapng_block(mmap_pcap_t *mp, uint32_t *type, uint32_t *len)
+{
+    size_t left = mp->size - mp->offset;
+    const u_char *block;
+    uint32_t magic;
+
+    if (left < PCAPNG_BLOCK_MIN) {
+        if (left != 0)
+            warnx("truncated pcapng block at offset %zu", mp->offset);
+        return NULL;
+    }
+
+    block = mp->base + mp->offset;
+    memcpy(type, block, sizeof(*type));
+    if (*type == PCAPNG_SHB) {
+        if (left < PCAPNG_SHB_MIN) {
+            warnx("truncated pcapng section header at offset %zu", mp->offset);
+            return NULL;
+        }
+
+        memcpy(&magic, block + 8, sizeof(magic));
+        if (magic == PCAPNG_BYTE_ORDER_MAGIC) {
+            mp->swapped = false;
+        } else if (magic == SWAPLONG(PCAPNG_BYTE_ORDER_MAGIC)) {
+            mp->swapped = true;
+        } else {
+            warnx("invalid pcapng byte order magic 0x%08x at offset %zu", magic, mp->offset);
+            return NULL;
+        }
+    } else {
+        *type = read_u32(mp, block);
+    }
+
+    *len = read_u32(mp, block + 4);
+    if (*len < PCAPNG_BLOCK_MIN || *len % 4 != 0 || *len > left) {
+        warnx("invalid pcapng block length %u at offset %zu", *len, mp->offset);
+        return NULL;
+    }
+
+    return block;
+}
+
+/**
+ * \brief Add the interface described by an interface description block
+ */
+static void
+pcapng_interface(mmap_pcap_t *mp, const u_char *block, uint32_t len)
+{
+    const u_char *opt, *end = block + len - 4;
+    mmap_pcap_if_t *ifp;
+
+    mp->ifs = safe_realloc(mp->ifs, sizeof(mmap_pcap_if_t) * (mp->num_ifs + 1));
+    ifp = &mp->ifs[mp->num_ifs++];
+    memset(ifp, 0, sizeof(*ifp));
+    ifp->dlt = read_u16(mp, block + 8);
+    ifp->ts_units = 1000000; /* default resolution is usec */
+
+    /* options follow the link type, a reserved field and the snaplen */
+    for (opt = block + 16; opt + 4 <= end;) {
+        uint16_t code = read_u16(mp, opt);
+        uint16_t optlen = read_u16(mp, opt + 2);
+        const u_char *value = opt + 4;
+
+        if (code == PCAPNG_OPT_ENDOFOPT || value + optlen > end)
+            break;
+
+        if (code == PCAPNG_OPT_IF_TSRESOL && optlen >= 1) {
+            /* negative power of 2 if the high bit is set, else of 10 */
+            int exp = value[0] & 0x7f;
+
+            if (value[0] & 0x80) {
+                if (exp < 64)
+                    ifp->ts_units = (uint64_t)1 << exp;
+            } else if (exp <= 19) {
+                for (ifp->ts_units = 1; exp > 0; exp--)
+                    ifp->ts_units *= 10;
+            }
+        } else if (code == PCAPNG_OPT_IF_TSOFFSET && optlen >= 8) {
+            ifp->ts_offset = (int64_t)read_u64(mp, value);
+        }
+
+        /* option values are padded to 32 bits */
+        opt = value + ((optlen + 3) & ~3);
+    }
+
+    dbgx(2, "pcapng interface %u: dlt=%d, %" PRIu64 " timestamp units/sec",
+         mp->num_ifs - 1, ifp->dlt, ifp->ts_units);
+}
+
+/**
+ * \brief Read the first interface of a pcapng file to learn its DLT and snaplen
+ */
+static int
+pcapng_first_interface(mmap_pcap_t *mp, char *ebuf)
+{
+    const u_char *block;
+    uint32_t type, len;
+    int ret = -1;
+
+    while ((block = pcapng_block(mp, &type, &len)) != NULL) {
+        if (type == PCAPNG_IDB && len >= PCAPNG_IDB_MIN) {
+            mp->dlt = read_u16(mp, block + 8);
+            mp->snaplen = (int)read_u32(mp, block + 12);
+            if (mp->snaplen <= 0 || mp->snaplen > MAX_SNAPLEN)
+                mp->snaplen = MAX_SNAPLEN;
+            ret = 0;
+            break;
+        }
+
+        if (type == PCAPNG_EPB || type == PCAPNG_SPB || type == PCAPNG_PB) {
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "packet before any interface description at offset %zu", mp->offset);
+            break;
+        }
+
+        mp->offset += len;
+    }
+
+    if (block == NULL)
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "no valid interface description block");
+
+    /* mmap_pcap_next() starts again from the section header */
+    mp->offset = 0;
+    return ret;
+}
+
+/**
+ * \brief Convert a timestamp in the units of the interface to a timeval
+ * plus the full resolution timestamp in mp->ts_ns
+ */
+static void
+pcapng_timestamp(mmap_pcap_t *mp, const mmap_pcap_if_t *ifp, uint64_t units, struct pcap_pkthdr *pkthdr)
+{
+    uint64_t per_sec = ifp->ts_units;
+    uint64_t sec = units / per_sec;
+    uint64_t frac = units % per_sec;
+    uint64_t nsec;
+
+    /* keep frac * 10^9 within 64 bits, losing well under 1ns */
+    while (per_sec > ((uint64_t)1 << 34)) {
+        per_sec >>= 1;
+        frac >>= 1;
+    }
+
+    nsec = min(frac * 1000000000 / per_sec, (uint64_t)999999999);
+    sec += (uint64_t)ifp->ts_offset;
+
+    mp->ts_ns = sec * 1000000000 + nsec;
+    set_pkthdr_ts(mp, pkthdr);
+}
+
+/**
+ * \brief Get the next packet from a mapped pcapng file
+ */
+static u_char *
+pcapng_next(mmap_pcap_t *mp, struct pcap_pkthdr *pkthdr)
+{
+    const mmap_pcap_if_t *ifp;
+    const u_char *block, *data;
+    uint32_t type, len, ifid, caplen, origlen;
+    uint64_t units = 0;
+    bool has_ts;
+    size_t offset;
+
+    while ((block = pcapng_block(mp, &type, &len)) != NULL) {
+        offset = mp->offset;
+        mp->offset += len;
+        has_ts = true;
+
+        switch (type) {
+        case PCAPNG_SHB:
+            /* interface ids start again at 0 in every section */
+            mp->num_ifs = 0;
+            continue;
+
+        case PCAPNG_IDB:
+            if (len >= PCAPNG_IDB_MIN)
+                pcapng_interface(mp, block, len);
+            continue;
+
+        case PCAPNG_EPB:
+        case PCAPNG_PB:
+            if (len < PCAPNG_EPB_MIN)
+                goto invalid;
+
+            /* the obsolete packet block has a 16 bit id and a drop count */
+            ifid = type == PCAPNG_EPB ? read_u32(mp, block + 8) : read_u16(mp, block + 8);
+            units = (uint64_t)read_u32(mp, block + 12) << 32 | read_u32(mp, block + 16);
+            caplen = read_u32(mp, block + 20);
+            origlen = read_u32(mp, block + 24);
+            data = block + 28;
+            if (caplen > len - PCAPNG_EPB_MIN)
+                goto invalid;
+            break;
+
+        case PCAPNG_SPB:
+            if (len < PCAPNG_SPB_MIN)
+                goto invalid;
+
+            /* no interface id or timestamp, so send it hard on the previous packet */
+            ifid = 0;
+            has_ts = false;
+            origlen = read_u32(mp, block + 8);
+            caplen = min(origlen, len - PCAPNG_SPB_MIN);
+            data = block + 12;
+            break;
+
+        default:
+            continue;
+        }
+
+        if (ifid >= mp->num_ifs) {
+            warnx("skipping pcapng packet at offset %zu for undescribed interface %u", offset, ifid);
+            continue;
+        }
+
+        ifp = &mp->ifs[ifid];
+        if (ifp->dlt != mp->dlt) {
+            if (!mp->ifs[ifid].warned)
+                warnx("skipping packets of pcapng interface %u: link type %d differs from %d",
+                      ifid, ifp->dlt, mp->dlt);
+            mp->ifs[ifid].warned = true;
+            continue;
+        }
+
+        mp->ifid = ifid;
+        if (has_ts) {
+            pcapng_timestamp(mp, ifp, units, pkthdr);
+        } else {
+            set_pkthdr_ts(mp, pkthdr);
+        }
+
+        pkthdr->caplen = caplen;
+        pkthdr->len = origlen;
+
+        if (pkthdr->len > MAX_SNAPLEN || pkthdr->caplen > MAX_SNAPLEN)
+            errx(-1,
+                 "Invalid packet length at offset %zu: packet length=%u capture length=%u maximum=%u",
+                 offset,
+                 pkthdr->len,
+                 pkthdr->caplen,
+                 MAX_SNAPLEN);
+
+        if (!pkthdr->len || !pkthdr->caplen)
+            errx(-1,
+                 "Invalid packet length at offset %zu: packet length=%u capture length=%u",
+                 offset,
+                 pkthdr->len,
+                 pkthdr->caplen);
+
+        if (pkthdr->len < pkthdr->caplen) {
+            dbgx(1, "Correcting invalid packet capture length %d: packet length=%u", pkthdr->caplen, pkthdr->len);
+            pkthdr->caplen = pkthdr->len;
+        }
+
+        return (u_char *)data;
+    }
+
+    return NULL;
+
+invalid:
+    warnx("invalid pcapng packet block at offset %zu", offset);
+    return NULL;
+}
+
+/**
+ * \brief Map a classic pcap or pcapng file into memory
+ *
+ * Returns NULL and fills in ebuf if the file can not be mapped or is not a
+ * pcap file (compressed, stdin, etc...).  Callers are expected to fall back
+ * to libpcap in that case.
+ */
+mmap_pcap_t *
+mmap_pcap_open(const char *path, char *ebuf)
+{
+    return mmap_pcap_map(path, false, ebuf);
+}
+
+/**
+ * \brief Map a pcap file so that editing its packets edits the file
+ *
+ * Like mmap_pcap_open(), but the mapping is shared, so packet data written
+ * within caplen goes back to the file (only the pages touched are written)
+ */
+mmap_pcap_t *
+mmap_pcap_open_rw(const char *path, char *ebuf)
+{
+    return mmap_pcap_map(path, true, ebuf);
+}
+
+static mmap_pcap_t *
+mmap_pcap_map(const char *path, bool shared, char *ebuf)
+{
+    mmap_pcap_t *mp;
+    struct stat statinfo;
+    uint32_t magic;
+    u_char *base;
+    int fd;
+
+    assert(path);
+    assert(ebuf);
+
+    if (strcmp(path, "-") == 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "unable to mmap stdin");
+        return NULL;
+    }
+
+    if ((fd = open(path, shared ? O_RDWR : O_RDONLY)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &statinfo) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    if (!S_ISREG(statinfo.st_mode) || statinfo.st_size < MMAP_PCAP_FILE_HDRLEN) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: not a regular pcap file", path);
+        close(fd);
+        return NULL;
+    }
+
+    /*
+     * private writable mapping so --unique-ip and friends can edit packets
+     * in place.  Only dirtied pages are copied.
+     */
+    base = mmap(NULL, (size_t)statinfo.st_size, PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: mmap failed: %s", path, strerror(errno));
+        return NULL;
+    }
+
+#ifdef HAVE_MADVISE
+    madvise(base, (size_t)statinfo.st_size, MADV_SEQUENTIAL);
+    madvise(base, (size_t)statinfo.st_size, MADV_WILLNEED);
+#endif
+
+    mp = (mmap_pcap_t *)safe_malloc(sizeof(mmap_pcap_t));
+    mp->base = base;
+    mp->size = (size_t)statinfo.st_size;
+    mp->hdrlen = MMAP_PCAP_PKT_HDRLEN;
+
+    memcpy(&magic, base, sizeof(magic));
+    switch (magic) {
+    case SWAPLONG(MMAP_PCAP_MAGIC):
+        mp->swapped = true;
+        /* fall through */
+    case MMAP_PCAP_MAGIC:
+        break;
+
+    case SWAPLONG(MMAP_PCAP_NSEC_MAGIC):
+        mp->swapped = true;
+        /* fall through */
+    case MMAP_PCAP_NSEC_MAGIC:
+        mp->nsec = true;
+        break;
+
+    case SWAPLONG(MMAP_PCAP_KUZNETZOV_MAGIC):
+        mp->swapped = true;
+        /* fall through */
+    case MMAP_PCAP_KUZNETZOV_MAGIC:
+        mp->hdrlen = MMAP_PCAP_KUZNETZOV_PKT_HDRLEN;
+        break;
+
+    case PCAPNG_SHB:
+        mp->pcapng = true;
+        if (pcapng_first_interface(mp, ebuf) < 0) {
+            char reason[PCAP_ERRBUF_SIZE];
+
+            strlcpy(reason, ebuf, sizeof(reason));
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, reason);
+            mmap_pcap_close(mp);
+            return NULL;
+        }
+        break;
+
+    default:
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: unsupported file format (magic 0x%08x)", path, magic);
+        mmap_pcap_close(mp);
+        return NULL;
+    }
+
+    if (!mp->pcapng) {
+        /* snaplen and linktype are the last two words of the file header */
+        mp->snaplen = (int)read_u32(mp, base + 16);
+        mp->dlt = (int)(read_u32(mp, base + 20) & 0x03ffffff);
+        mp->offset = MMAP_PCAP_FILE_HDRLEN;
+    }
+
+    dbgx(1, "mmap'd %s: %zu bytes, dlt=%d, snaplen=%d%s%s%s",
+         path,
+         mp->size,
+         mp->dlt,
+         mp->snaplen,
+         mp->pcapng ? ", pcapng" : "",
+         mp->swapped ? ", swapped" : "",
+         mp->nsec ? ", nsec" : "");
+
+    return mp;
+}
+
+/**
+ * \brief Get the next packet from a mapped pcap file
+ *
+ * Returns a pointer into the mapping, or NULL at the end of the file.
+ * Applies the same sanity checks as safe_pcap_next()
+ */
+u_char *
+mmap_pcap_next(mmap_pcap_t *mp, struct pcap_pkthdr *pkthdr)
+{
+    const u_char *hdr;
+    uint32_t frac;
+
+    assert(mp);
+    assert(pkthdr);
+
+    if (mp->pcapng)
+        return pcapng_next(mp, pkthdr);
+
+    if (mp->offset + mp->hdrlen > mp->size) {
+        if (mp->offset != mp->size)
+            warnx("truncated pcap record header at offset %zu", mp->offset);
+        return NULL;
+    }
+
+    hdr = mp->base + mp->offset;
+    frac = read_u32(mp, hdr + 4);
+    mp->ts_ns = (uint64_t)read_u32(mp, hdr) * 1000000000 + (mp->nsec ? frac : (uint64_t)frac * 1000);
+    set_pkthdr_ts(mp, pkthdr);
+    pkthdr->caplen = read_u32(mp, hdr + 8);
+    pkthdr->len = read_u32(mp, hdr + 12);
+
+    if (pkthdr->len > MAX_SNAPLEN || pkthdr->caplen > MAX_SNAPLEN)
+        errx(-1,
+             "Invalid packet length at offset %zu: packet length=%u capture length=%u maximum=%u",
+             mp->offset,
+             pkthdr->len,
+             pkthdr->caplen,
+             MAX_SNAPLEN);
+
+    if (!pkthdr->len || !pkthdr->caplen)
+        errx(-1,
+             "Invalid packet length at offset %zu: packet length=%u capture length=%u",
+             mp->offset,
+             pkthdr->len,
+             pkthdr->caplen);
+
+    if (mp->offset + mp->hdrlen + pkthdr->caplen > mp->size) {
+        warnx("truncated pcap record at offset %zu", mp->offset);
+        return NULL;
+    }
+
+    mp->offset += mp->hdrlen;
+    hdr = mp->base + mp->offset;
+    mp->offset += pkthdr->caplen;
+
+    /* attempt to correct invalid captures */
+    if (pkthdr->len < pkthdr->caplen) {
+        dbgx(1, "Correcting invalid packet capture length %d: packet length=%u", pkthdr->caplen, pkthdr->len);
+        pkthdr->caplen = pkthdr->len;
+    }
+
+    return (u_char *)hdr;
+}
+
+/**
+ * \brief Unmap the file and free the reader
+ */
+void
+mmap_pcap_close(mmap_pcap_t *mp)
+{
+    if (mp == NULL)
+        return;
+
+    if (mp->base != NULL)
+        munmap(mp->base, mp->size);
+
+    safe_free(mp->ifs);
+    safe_free(mp);
+}
+
+#endif /* HAVE_MMAP */
@@ -0,0 +1,69 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include <pcap.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Zero-copy reader for uncompressed classic pcap and pcapng files.
+ *
+ * The whole file is mapped copy-on-write, so packet data handed back by
+ * mmap_pcap_next() points directly into the mapping and may be edited
+ * in place (within caplen) without touching the file on disk.
+ *
+ * pcapng files are parsed natively: every section and interface
+ * description is honoured, with each interface's timestamp resolution
+ * and offset.  The reader has a single DLT, that of the first interface,
+ * so packets captured on interfaces of a different link type are
+ * skipped with a warning.
+ */
+typedef struct mmap_pcap_if_s {
+    int dlt;
+    u_int64_t ts_units; /* timestamp units per second */
+    int64_t ts_offset;  /* seconds added to every timestamp */
+    bool warned;        /* already warned its packets are skipped */
+} mmap_pcap_if_t;
+
+typedef struct mmap_pcap_s {
+    u_char *base;      /* start of the mapping */
+    size_t size;       /* size of the mapping */
+    size_t offset;     /* offset of the next record header */
+    size_t hdrlen;     /* on-disk size of each record header */
+    bool swapped;      /* file was written with the opposite byte order */
+    bool nsec;         /* timestamps are in nanoseconds */
+    int dlt;
+    int snaplen;
+    bool pcapng;
+    mmap_pcap_if_t *ifs; /* interfaces of the current pcapng section */
+    u_int32_t num_ifs;
+    u_int32_t ifid;      /* interface of the last packet, 0 for classic pcap */
+    u_int64_t ts_ns;     /* timestamp of the last packet at full resolution */
+    bool tstamp_nsec;    /* return nanoseconds in tv_usec, like PCAP_TSTAMP_PRECISION_NANO */
+} mmap_pcap_t;
+
+#ifdef HAVE_MMAP
+mmap_pcap_t *mmap_pcap_open(const char *path, char *ebuf);
+mmap_pcap_t *mmap_pcap_open_rw(const char *path, char *ebuf);
+u_char *mmap_pcap_next(mmap_pcap_t *mp, struct pcap_pkthdr *pkthdr);
+void mmap_pcap_close(mmap_pcap_t *mp);
+#endif
@@ -20,6 +20,7 @@
 #include "common.h"
 #include "tcpreplay_api.h"
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -29,6 +30,9 @@
 #include <unistd.h>
 
 static int nm_do_ioctl(sendpacket_t *sp, u_long what, int subcmd);
+static void nm_zc_setup(sendpacket_t *sp, uint32_t extra_bufs, sendpacket_t *owner);
+static void nm_zc_release(sendpacket_t *sp);
+static int nm_wait_tx(sendpacket_t *sp);
 
 /**
  * Method takes an open "/dev/netmap" file descriptor and returns
@@ -170,12 +174,12 @@ done:
 }
 
 /**
- * Inner sendpacket_open() method for using netmap
+ * Open device, or with owner one more TX ring of the NIC owner already has
+ * open.  The NIC is only switched to netmap mode, and reset, by the first.
  */
-void *
-sendpacket_open_netmap(const char *device, char *errbuf, void *arg)
+static void *
+netmap_open(const char *device, char *errbuf, tcpreplay_t *ctx, sendpacket_t *owner)
 {
-    tcpreplay_t *ctx = (tcpreplay_t *)arg;
     sendpacket_t *sp = NULL;
     nmreq_t nmr;
     char ifname_buf[MAX_IFNAMELEN];
@@ -327,6 +331,9 @@ sendpacket_open_netmap(const char *device, char *errbuf, void *arg)
     }
 
     nmr.nr_version = sp->netmap_version;
+    /* preloaded packets go straight into netmap buffers */
+    if (ctx->options->preload_pcap && owner == NULL)
+        nmr.nr_arg3 = NETMAP_EXTRA_BUFS;
     memcpy(nmr.nr_name, ifname, namelen);
     nmr.nr_name[namelen] = '\0';
     strlcpy(sp->device, nmr.nr_name, sizeof(sp->device));
@@ -338,9 +345,11 @@ sendpacket_open_netmap(const char *device, char *errbuf, void *arg)
      *
      * Cards take a long time to reset the PHY.
      */
-    fprintf(stderr, "Switching network driver for %s to netmap bypass mode... ", sp->device);
-    fflush(NULL);
-    sleep(1); /* ensure message prints when user is connected via ssh */
+    if (owner == NULL) {
+        fprintf(stderr, "Switching network driver for %s to netmap bypass mode... ", sp->device);
+        fflush(NULL);
+        sleep(1); /* ensure message prints when user is connected via ssh */
+    }
 
     if (ioctl(sp->handle.fd, NIOCREGIF, &nmr)) {
         snprintf(errbuf,
@@ -429,6 +438,14 @@ sendpacket_open_netmap(const char *device, char *errbuf, void *arg)
         }
     }
 
+    nm_zc_setup(sp, nmr.nr_arg3, owner);
+
+    /* the rest was done when owner was opened */
+    if (owner != NULL) {
+        sp->nm_ring_only = true;
+        return sp;
+    }
+
     dbgx(2, "Waiting %d seconds for phy reset...", ctx->options->netmap_delay);
     sleep(ctx->options->netmap_delay);
     dbg(2, "Ready!");
@@ -485,6 +502,7 @@ NETMAP_IF_NOT_RUNNING:
 NETMAP_ABORT:
     fprintf(stderr, " Switching network driver for %s to normal mode... ", sp->device);
     fflush(NULL);
+    nm_zc_release(sp);
     munmap(sp->mmap_addr, sp->mmap_size);
 MMAP_FAILED:
 #if NETMAP_API < 10
@@ -501,10 +519,59 @@ NETMAP_NOT_INSTALLED:
     return NULL;
 }
 
+/**
+ * Inner sendpacket_open() method for using netmap
+ */
+void *
+sendpacket_open_netmap(const char *device, char *errbuf, void *arg)
+{
+    return netmap_open(device, errbuf, (tcpreplay_t *)arg, NULL);
+}
+
+/**
+ * \brief open TX ring ring of the NIC owner is open on, counting from the
+ * ring owner sends on, for a send thread of its own
+ */
+void *
+sendpacket_open_netmap_ring(void *p, int ring, char *errbuf, void *arg)
+{
+    sendpacket_t *owner = p;
+    char device[MAX_IFNAMELEN];
+
+    if (owner->is_vale || owner->first_tx_ring != owner->last_tx_ring) {
+        snprintf(errbuf,
+                 SENDPACKET_ERRBUF_SIZE,
+                 "send threads need %s bound to a single hardware TX ring, e.g. netmap:%s-0",
+                 owner->device,
+                 owner->device);
+        return NULL;
+    }
+
+    ring += owner->first_tx_ring;
+    if (ring >= owner->nmr.nr_tx_rings) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "%s has only %d TX rings", owner->device, owner->nmr.nr_tx_rings);
+        return NULL;
+    }
+
+    snprintf(device, sizeof(device), "netmap:%s-%d", owner->device, ring);
+    return netmap_open(device, errbuf, (tcpreplay_t *)arg, owner);
+}
+
 void
 sendpacket_close_netmap(void *p)
 {
     sendpacket_t *sp = p;
+
+    if (sp->nm_ring_only) {
+        /* just one more ring of a NIC closed elsewhere */
+        ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+        nm_zc_release(sp);
+        if (sp->mmap_addr)
+            munmap(sp->mmap_addr, sp->mmap_size);
+        close(sp->handle.fd);
+        return;
+    }
+
     fprintf(stderr, "Switching network driver for %s to normal mode... ", sp->device);
     fflush(NULL);
 
@@ -535,6 +602,9 @@ sendpacket_close_netmap(void *p)
     }
 #endif /* linux */
 
+    /* the rings and the extra buffers must be as netmap handed them out */
+    nm_zc_release(sp);
+
     /* restore interface to normal mode */
 #if NETMAP_API < 10
     ioctl(sp->handle.fd, NIOCUNREGIF, NULL);
@@ -601,15 +671,13 @@ sendpacket_send_netmap(void *p, const u_char *data, size_t len)
              */
             sp->cur_tx_ring = sp->first_tx_ring;
 
-            /* send TX interrupt signal
-             *
-             * On Linux this makes one slot free on the
-             * ring, which increases speed by about 10Mbps.
-             *
-             * But it will never free up all the slots. For
-             * that we must poll and call again.
+            /*
+             * poll() syncs the TX rings and sleeps until the NIC has
+             * freed some slots.  NIOCTXSYNC alone frees only about one
+             * slot per call on Linux, which turns into a busy loop.
              */
-            ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+            if (nm_wait_tx(sp) < 0)
+                ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
 
             /* loop again */
             return -2;
@@ -624,12 +692,31 @@ sendpacket_send_netmap(void *p, const u_char *data, size_t len)
     cur = txring->cur;
     slot = &txring->slot[cur];
     slot->flags = 0;
+    if (sp->nm_slot_buf != NULL) {
+        uint32_t *orig = &sp->nm_slot_buf[sp->cur_tx_ring - sp->first_tx_ring][cur];
+        uintptr_t at = (uintptr_t)data;
+
+        if (at >= sp->nm_zc_base && at < sp->nm_zc_end && (at - sp->nm_zc_base) % txring->nr_buf_size == 0) {
+            /* a cached packet in a buffer of its own, just hang it on the slot */
+            slot->buf_idx = (uint32_t)((at - sp->nm_zc_base) / txring->nr_buf_size);
+            slot->flags = NS_BUF_CHANGED;
+            goto queued;
+        }
+
+        /* the slot may still point at a cached packet, which mustn't be overwritten */
+        if (slot->buf_idx != *orig) {
+            slot->buf_idx = *orig;
+            slot->flags = NS_BUF_CHANGED;
+        }
+    }
     pkt = NETMAP_BUF(txring, slot->buf_idx);
     memcpy(pkt, data, min(len, txring->nr_buf_size));
+
+queued:
     slot->len = len;
 
     if (avail <= 1)
-        slot->flags = NS_REPORT;
+        slot->flags |= NS_REPORT;
 
     dbgx(3,
          "netmap cur=%d slot index=%d flags=0x%x empty=%d avail=%u bufsize=%d\n",
@@ -651,3 +738,139 @@ sendpacket_send_netmap(void *p, const u_char *data, size_t len)
 
     return len;
 }
+
+/**
+ * \brief wait for room on the TX rings
+ *
+ * Returns -1 if poll() failed
+ */
+static int
+nm_wait_tx(sendpacket_t *sp)
+{
+    struct pollfd pfd;
+
+    pfd.fd = sp->handle.fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, NETMAP_POLL_MS) < 0 && errno != EINTR)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * \brief take the extra buffers NIOCREGIF gave us for the packet cache
+ *
+ * They come as a list through ni_bufs_head, each buffer holding the index
+ * of the next in its first word.  Sending from them swaps the buffer of
+ * the TX slot, so remember what each slot came with.  A ring opened for
+ * owner sends from owner's buffers, when both share netmap's memory.
+ */
+static void
+nm_zc_setup(sendpacket_t *sp, uint32_t extra_bufs, sendpacket_t *owner)
+{
+    int i, rings = sp->last_tx_ring - sp->first_tx_ring + 1;
+    struct netmap_ring *txring;
+    uint32_t j;
+
+    if (owner != NULL) {
+        if (owner->nm_bufs == NULL || owner->nmr.nr_arg2 != sp->nmr.nr_arg2)
+            return;
+        sp->nm_zc_base = owner->nm_zc_base;
+        sp->nm_zc_end = owner->nm_zc_end;
+    } else {
+        if (extra_bufs == 0 || sp->nm_if->ni_bufs_head == 0)
+            return;
+        sp->nm_extra_head = sp->nm_if->ni_bufs_head;
+        sp->nm_bufs = safe_malloc(sizeof(uint32_t) * extra_bufs);
+        txring = NETMAP_TXRING(sp->nm_if, sp->first_tx_ring);
+        sp->nm_zc_base = (uintptr_t)NETMAP_BUF(txring, 0);
+        sp->nm_zc_end = (uintptr_t)sp->mmap_addr + sp->mmap_size;
+    }
+
+    sp->nm_slot_buf = safe_malloc(sizeof(uint32_t *) * rings);
+    for (i = 0; i < rings; i++) {
+        txring = NETMAP_TXRING(sp->nm_if, sp->first_tx_ring + i);
+        sp->nm_slot_buf[i] = safe_malloc(sizeof(uint32_t) * txring->num_slots);
+        for (j = 0; j < txring->num_slots; j++)
+            sp->nm_slot_buf[i][j] = txring->slot[j].buf_idx;
+    }
+
+    dbgx(1, "sendpacket_open_netmap: %u extra buffers for zero copy sends", extra_bufs);
+}
+
+/**
+ * \brief put the TX slots and the extra buffers back the way netmap gave
+ * them out, so it frees every buffer once
+ */
+static void
+nm_zc_release(sendpacket_t *sp)
+{
+    struct netmap_ring *txring;
+    int i, rings = sp->last_tx_ring - sp->first_tx_ring + 1;
+    uint32_t j, head;
+
+    if (sp->nm_slot_buf == NULL)
+        return;
+
+    for (i = 0; i < rings; i++) {
+        txring = NETMAP_TXRING(sp->nm_if, sp->first_tx_ring + i);
+        for (j = 0; j < txring->num_slots; j++) {
+            if (txring->slot[j].buf_idx != sp->nm_slot_buf[i][j]) {
+                txring->slot[j].buf_idx = sp->nm_slot_buf[i][j];
+                txring->slot[j].flags = NS_BUF_CHANGED;
+            }
+        }
+        safe_free(sp->nm_slot_buf[i]);
+    }
+    safe_free(sp->nm_slot_buf);
+
+    /* the buffers belong to whoever we share them with */
+    if (sp->nm_bufs == NULL)
+        return;
+
+    /* chain the buffers handed out in front of those still free */
+    txring = NETMAP_TXRING(sp->nm_if, sp->first_tx_ring);
+    head = sp->nm_extra_head;
+    for (j = sp->nm_bufs_cnt; j > 0; j--) {
+        *(uint32_t *)NETMAP_BUF(txring, sp->nm_bufs[j - 1]) = head;
+        head = sp->nm_bufs[j - 1];
+    }
+    *(uint32_t *)&sp->nm_if->ni_bufs_head = head;
+
+    safe_free(sp->nm_bufs);
+    sp->nm_bufs_cnt = 0;
+    sp->nm_extra_head = 0;
+}
+
+/**
+ * \brief a netmap buffer to preload a packet of len bytes into
+ *
+ * Packets sent from such a buffer are not copied: the buffer itself is
+ * put on the TX ring.  The buffers stay ours until the interface is
+ * closed.  Returns NULL once the extra buffers run out, or if the packet
+ * doesn't fit
+ */
+u_char *
+sendpacket_netmap_alloc(void *p, size_t len)
+{
+    sendpacket_t *sp = p;
+    struct netmap_ring *txring;
+    uint32_t idx;
+    u_char *buf;
+
+    if (sp == NULL || sp->handle_type != SP_TYPE_NETMAP || sp->nm_extra_head == 0)
+        return NULL;
+
+    txring = NETMAP_TXRING(sp->nm_if, sp->first_tx_ring);
+    if (len > txring->nr_buf_size)
+        return NULL;
+
+    idx = sp->nm_extra_head;
+    buf = (u_char *)NETMAP_BUF(txring, idx);
+    sp->nm_extra_head = *(uint32_t *)buf;
+    sp->nm_bufs[sp->nm_bufs_cnt++] = idx;
+
+    return buf;
+}
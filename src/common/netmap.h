@@ -38,6 +38,15 @@
 #define NETMAP_API 0
 #endif
 
+/* extra buffers asked for to preload packets into, we get what the pool has */
+#define NETMAP_EXTRA_BUFS (1024 * 1024)
+/* longest wait in poll() for the TX rings to drain */
+#define NETMAP_POLL_MS 100
+
+#ifndef NS_BUF_CHANGED
+#define NS_BUF_CHANGED 0x0001
+#endif
+
 #if NETMAP_API >= 10
 #define NETMAP_TX_RING_EMPTY(ring) (!nm_tx_pending(ring))
 #define NETMAP_RING_NEXT(r, i) nm_ring_next(r, i)
@@ -130,3 +139,5 @@ void *sendpacket_open_netmap(const char *device, char *errbuf, void *arg);
 void sendpacket_close_netmap(void *p);
 bool netmap_tx_queues_empty(void *p);
 int sendpacket_send_netmap(void *p, const u_char *data, size_t len);
+u_char *sendpacket_netmap_alloc(void *p, size_t len);
+void *sendpacket_open_netmap_ring(void *p, int ring, char *errbuf, void *arg);
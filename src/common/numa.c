@@ -0,0 +1,146 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+
+#include "numa.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_SCHED_H
+#include <sched.h>
+#endif
+
+/**
+ * \brief NUMA node of a network interface, -1 if unknown
+ */
+int
+tcpr_numa_node(const char *device)
+{
+    char path[128];
+    FILE *f;
+    int node = -1;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", device);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+
+    if (fscanf(f, "%d", &node) != 1)
+        node = -1;
+    fclose(f);
+
+    return node;
+}
+
+/**
+ * \brief parse a CPU list such as "0,2,8-11" into cpus
+ *
+ * Returns the number of CPUs, or -1 if the list is malformed or names a
+ * CPU of TCPR_CPU_MAX or above.  Only the first max are stored.
+ */
+int
+tcpr_cpu_list_parse(const char *list, int *cpus, int max)
+{
+    const char *p = list;
+    int cnt = 0;
+
+    while (*p != '\0' && *p != '\n') {
+        char *end;
+        long first, last, cpu;
+
+        if (!isdigit((unsigned char)*p))
+            return -1;
+        first = last = strtol(p, &end, 10);
+        if (*end == '-') {
+            p = end + 1;
+            if (!isdigit((unsigned char)*p))
+                return -1;
+            last = strtol(p, &end, 10);
+        }
+        if (first > last || last >= TCPR_CPU_MAX)
+            return -1;
+
+        for (cpu = first; cpu <= last; cpu++) {
+            if (cnt < max)
+                cpus[cnt] = (int)cpu;
+            cnt++;
+        }
+
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return -1;
+    }
+
+    return cnt > max ? max : cnt;
+}
+
+/**
+ * \brief the CPUs of a NUMA node
+ *
+ * Returns their number, or -1 if the node is unknown.
+ */
+int
+tcpr_numa_cpus(int node, int *cpus, int max)
+{
+    char path[128], list[4096];
+    FILE *f;
+    int cnt = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if ((f = fopen(path, "r")) == NULL)
+        return -1;
+
+    if (fgets(list, sizeof(list), f) != NULL)
+        cnt = tcpr_cpu_list_parse(list, cpus, max);
+    fclose(f);
+
+    return cnt;
+}
+
+/**
+ * \brief restrict the calling thread to the given CPUs
+ *
+ * Returns 0 on success, -1 if that isn't possible here.
+ */
+int
+tcpr_cpus_pin(_U_ const int *cpus, _U_ int cnt)
+{
+#if defined HAVE_PTHREAD && defined HAVE_PTHREAD_SETAFFINITY_NP
+    cpu_set_t cpuset;
+    int i;
+
+    CPU_ZERO(&cpuset);
+    for (i = 0; i < cnt; i++)
+        CPU_SET(cpus[i], &cpuset);
+
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) == 0 ? 0 : -1;
+#else
+    return -1;
+#endif
+}
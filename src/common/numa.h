@@ -0,0 +1,35 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+/*
+ * Where the NICs are: NUMA nodes and CPU lists from sysfs, so the send
+ * threads and the memory they send from can be kept on the NIC's node.
+ */
+
+/* largest CPU number we pin to, as for cpu_set_t */
+#define TCPR_CPU_MAX 1024
+
+int tcpr_numa_node(const char *device);
+int tcpr_cpu_list_parse(const char *list, int *cpus, int max);
+int tcpr_numa_cpus(int node, int *cpus, int max);
+int tcpr_cpus_pin(const int *cpus, int cnt);
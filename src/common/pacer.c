@@ -0,0 +1,133 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pacer.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <string.h>
+
+/**
+ * \brief when the given running total of units will have been paid for
+ */
+static inline u_int64_t
+tcpr_pacer_due(const tcpr_pacer_t *p, COUNTER units)
+{
+    if (units <= p->base_units)
+        return p->base_ns;
+
+    /* from the base in floating point, so rounding doesn't add up */
+    return p->base_ns + (u_int64_t)((double)(units - p->base_units) * p->ns_per_unit);
+}
+
+/**
+ * \brief set up a pacer earning a token every ns_per_unit from start_ns
+ *
+ * burst_units is how many tokens may be saved up, 0 for no limit
+ */
+void
+tcpr_pacer_init(tcpr_pacer_t *p, double ns_per_unit, COUNTER burst_units, u_int64_t start_ns)
+{
+    assert(p);
+
+    memset(p, 0, sizeof(*p));
+    p->ns_per_unit = ns_per_unit;
+    p->burst_units = burst_units;
+    p->burst_ns = (u_int64_t)((double)burst_units * ns_per_unit);
+    p->base_ns = start_ns;
+}
+
+/**
+ * \brief change the rate, for the units after the running total units
+ */
+void
+tcpr_pacer_set_rate(tcpr_pacer_t *p, double ns_per_unit, COUNTER units)
+{
+    assert(p);
+
+    p->base_ns = tcpr_pacer_due(p, units);
+    p->base_units = units;
+    p->ns_per_unit = ns_per_unit;
+    p->burst_ns = (u_int64_t)((double)p->burst_units * ns_per_unit);
+}
+
+/**
+ * \brief ns to wait before a total of units has been sent
+ *
+ * units includes the packet about to be sent.  If the sender is more than
+ * the bucket depth behind, the excess is dropped.
+ */
+u_int64_t
+tcpr_pacer_delay(tcpr_pacer_t *p, COUNTER units, u_int64_t now_ns)
+{
+    u_int64_t due;
+
+    assert(p);
+
+    due = tcpr_pacer_due(p, units);
+    if (p->burst_ns && now_ns > due + p->burst_ns) {
+        p->base_ns = now_ns - p->burst_ns;
+        p->base_units = units;
+        due = p->base_ns;
+    }
+
+    return due > now_ns ? due - now_ns : 0;
+}
+
+/**
+ * \brief how many more units could be sent right away, after sending a
+ * total of units
+ */
+COUNTER
+tcpr_pacer_credit(const tcpr_pacer_t *p, COUNTER units, u_int64_t now_ns)
+{
+    u_int64_t due;
+
+    assert(p);
+
+    due = tcpr_pacer_due(p, units);
+    if (now_ns <= due || p->ns_per_unit <= 0.0)
+        return 0;
+
+    return (COUNTER)((double)(now_ns - due) / p->ns_per_unit);
+}
+
+/**
+ * \brief how long ago a total of units was due, 0 if it isn't yet
+ */
+u_int64_t
+tcpr_pacer_behind(const tcpr_pacer_t *p, COUNTER units, u_int64_t now_ns)
+{
+    u_int64_t due;
+
+    assert(p);
+
+    due = tcpr_pacer_due(p, units);
+    return now_ns > due ? now_ns - due : 0;
+}
+
+/**
+ * \brief make every unit not yet paid for due ns later
+ */
+void
+tcpr_pacer_shift(tcpr_pacer_t *p, u_int64_t ns)
+{
+    assert(p);
+
+    p->base_ns += ns;
+}
@@ -0,0 +1,50 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+/*
+ * Token bucket pacer, kept as a GCRA: tokens (bits or packets) are spent
+ * in the order they are earned, and each is paid for ns_per_unit after
+ * the one before.  When the sender falls behind by more than burst_ns the
+ * pacer forgets the difference, so catching up after a stall never sends
+ * more than a burst back to back.  burst_ns of 0 never forgets, which is
+ * exactly the cumulative average since the start.
+ *
+ * Callers pass the running total of units sent rather than the units of
+ * each packet, so packets sent without asking (batches, skip_length) are
+ * paid for by the next call.  One pacer per flow, thread, interface...
+ * whatever is being paced.
+ */
+typedef struct tcpr_pacer_s {
+    double ns_per_unit;
+    COUNTER burst_units;
+    u_int64_t burst_ns; /* bucket depth, 0 for unlimited */
+    u_int64_t base_ns;  /* when base_units were paid for */
+    COUNTER base_units;
+} tcpr_pacer_t;
+
+void tcpr_pacer_init(tcpr_pacer_t *p, double ns_per_unit, COUNTER burst_units, u_int64_t start_ns);
+void tcpr_pacer_set_rate(tcpr_pacer_t *p, double ns_per_unit, COUNTER units);
+u_int64_t tcpr_pacer_delay(tcpr_pacer_t *p, COUNTER units, u_int64_t now_ns);
+COUNTER tcpr_pacer_credit(const tcpr_pacer_t *p, COUNTER units, u_int64_t now_ns);
+u_int64_t tcpr_pacer_behind(const tcpr_pacer_t *p, COUNTER units, u_int64_t now_ns);
+void tcpr_pacer_shift(tcpr_pacer_t *p, u_int64_t ns);
@@ -0,0 +1,423 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcap_index.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* refuse to load indexes claiming more entries than this */
+#define PCAP_INDEX_MAX_ENTRIES (1ULL << 32)
+
+static int
+pcap_index_stat(const char *pcapfile, pcap_index_t *index, char *ebuf)
+{
+    struct stat statbuf;
+
+    if (stat(pcapfile, &statbuf) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", pcapfile, strerror(errno));
+        return -1;
+    }
+
+    index->pcap_size = (u_int64_t)statbuf.st_size;
+    index->pcap_mtime = (u_int64_t)statbuf.st_mtime;
+    return 0;
+}
+
+static pcap_index_entry_t *
+pcap_index_new_entry(pcap_index_t *index, COUNTER *max)
+{
+    if (index->num_entries == *max) {
+        *max = *max ? *max * 2 : 1024;
+        index->entries = safe_realloc(index->entries, *max * sizeof(pcap_index_entry_t));
+    }
+
+    return &index->entries[index->num_entries++];
+}
+
+/**
+ * \brief get the path of the sidecar index of pcapfile.  Free with safe_free()
+ */
+char *
+pcap_index_path(const char *pcapfile)
+{
+    size_t len;
+    char *path;
+
+    assert(pcapfile);
+
+    len = strlen(pcapfile) + sizeof(PCAP_INDEX_SUFFIX);
+    path = (char *)safe_malloc(len);
+    snprintf(path, len, "%s%s", pcapfile, PCAP_INDEX_SUFFIX);
+    return path;
+}
+
+/**
+ * \brief scan a pcap file and build its index
+ *
+ * An entry is recorded every interval packets, starting with the first.
+ * Returns NULL and fills in ebuf on error
+ */
+pcap_index_t *
+pcap_index_build(const char *pcapfile, u_int32_t interval, char *ebuf)
+{
+    pcap_index_t *index;
+    pcap_t *pcap;
+    struct pcap_pkthdr *pkthdr;
+    const u_char *pktdata;
+    COUNTER max = 0;
+    long offset;
+    int ret;
+
+    assert(pcapfile);
+    assert(ebuf);
+
+    if (interval == 0)
+        interval = PCAP_INDEX_DEFAULT_INTERVAL;
+
+    if (strcmp(pcapfile, "-") == 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to index STDIN");
+        return NULL;
+    }
+
+#ifdef HAVE_PCAP_OPEN_OFFLINE_WITH_TSTAMP_PRECISION
+    pcap = pcap_open_offline_with_tstamp_precision(pcapfile, PCAP_TSTAMP_PRECISION_NANO, ebuf);
+#else
+    pcap = pcap_open_offline(pcapfile, ebuf);
+#endif
+    if (pcap == NULL)
+        return NULL;
+
+    index = (pcap_index_t *)safe_malloc(sizeof(pcap_index_t));
+    if (pcap_index_stat(pcapfile, index, ebuf) < 0) {
+        pcap_close(pcap);
+        safe_free(index);
+        return NULL;
+    }
+
+    index->dlt = pcap_datalink(pcap);
+    index->snaplen = pcap_snapshot(pcap);
+    index->interval = interval;
+
+    for (;;) {
+        u_int64_t ts_ns;
+
+        /* libpcap reads records straight from its FILE, so this is the record offset */
+        offset = ftell(pcap_file(pcap));
+        if ((ret = pcap_next_ex(pcap, &pkthdr, &pktdata)) != 1)
+            break;
+
+#ifdef HAVE_PCAP_OPEN_OFFLINE_WITH_TSTAMP_PRECISION
+        ts_ns = (u_int64_t)pkthdr->ts.tv_sec * 1000000000 + (u_int64_t)pkthdr->ts.tv_usec;
+#else
+        ts_ns = TIMEVAL_TO_NANOSEC(&pkthdr->ts);
+#endif
+
+        if (index->num_packets % interval == 0) {
+            pcap_index_entry_t *entry = pcap_index_new_entry(index, &max);
+
+            entry->packet = index->num_packets;
+            entry->offset = (u_int64_t)offset;
+            entry->ts_ns = ts_ns;
+            entry->bytes = index->num_bytes;
+        }
+
+        if (index->num_packets == 0)
+            index->first_ts_ns = ts_ns;
+        index->last_ts_ns = ts_ns;
+        index->num_packets++;
+        index->num_bytes += pkthdr->caplen;
+    }
+
+    if (ret == -1) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", pcap_geterr(pcap));
+        pcap_close(pcap);
+        pcap_index_free(index);
+        return NULL;
+    }
+
+    pcap_close(pcap);
+
+    dbgx(1, "Indexed " COUNTER_SPEC " packets of %s in " COUNTER_SPEC " entries",
+         index->num_packets, pcapfile, index->num_entries);
+
+    return index;
+}
+
+/**
+ * \brief write the index to path
+ *
+ * Returns 0 on success, -1 and fills in ebuf on error
+ */
+int
+pcap_index_write(const pcap_index_t *index, const char *path, char *ebuf)
+{
+    pcap_index_file_hdr_t hdr;
+    pcap_index_entry_t entry;
+    COUNTER i;
+    int fd;
+
+    assert(index);
+    assert(path);
+    assert(ebuf);
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to open %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    strncpy(hdr.magic, PCAP_INDEX_MAGIC, sizeof(hdr.magic));
+    strncpy(hdr.version, PCAP_INDEX_VERSION, sizeof(hdr.version));
+    hdr.dlt = htonl((u_int32_t)index->dlt);
+    hdr.snaplen = htonl((u_int32_t)index->snaplen);
+    hdr.interval = htonl(index->interval);
+    hdr.pcap_size = htonll(index->pcap_size);
+    hdr.pcap_mtime = htonll(index->pcap_mtime);
+    hdr.num_packets = htonll((u_int64_t)index->num_packets);
+    hdr.num_bytes = htonll((u_int64_t)index->num_bytes);
+    hdr.first_ts_ns = htonll(index->first_ts_ns);
+    hdr.last_ts_ns = htonll(index->last_ts_ns);
+    hdr.num_entries = htonll((u_int64_t)index->num_entries);
+
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr))
+        goto fail;
+
+    for (i = 0; i < index->num_entries; i++) {
+        entry.packet = htonll(index->entries[i].packet);
+        entry.offset = htonll(index->entries[i].offset);
+        entry.ts_ns = htonll(index->entries[i].ts_ns);
+        entry.bytes = htonll(index->entries[i].bytes);
+
+        if (write(fd, &entry, sizeof(entry)) != (ssize_t)sizeof(entry))
+            goto fail;
+    }
+
+    if (close(fd) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to write %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+
+fail:
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to write %s: %s", path, strerror(errno));
+    close(fd);
+    unlink(path);
+    return -1;
+}
+
+/**
+ * \brief read an index from path
+ *
+ * If pcapfile is not NULL, the index is rejected unless it was built from
+ * the current version of that file.  Returns NULL and fills in ebuf on error
+ */
+pcap_index_t *
+pcap_index_read(const char *path, const char *pcapfile, char *ebuf)
+{
+    pcap_index_file_hdr_t hdr;
+    pcap_index_t *index;
+    pcap_index_t current;
+    ssize_t len;
+    COUNTER i;
+    int fd;
+
+    assert(path);
+    assert(ebuf);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to open %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Index file %s doesn't contain a full header", path);
+        close(fd);
+        return NULL;
+    }
+
+    if (memcmp(hdr.magic, PCAP_INDEX_MAGIC, sizeof(PCAP_INDEX_MAGIC)) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to process %s: not a pcap index file", path);
+        close(fd);
+        return NULL;
+    }
+
+    if (strtol(hdr.version, NULL, 10) != strtol(PCAP_INDEX_VERSION, NULL, 10)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to process %s: index file version mismatch", path);
+        close(fd);
+        return NULL;
+    }
+
+    index = (pcap_index_t *)safe_malloc(sizeof(pcap_index_t));
+    index->dlt = (int)ntohl(hdr.dlt);
+    index->snaplen = (int)ntohl(hdr.snaplen);
+    index->interval = ntohl(hdr.interval);
+    index->pcap_size = ntohll(hdr.pcap_size);
+    index->pcap_mtime = ntohll(hdr.pcap_mtime);
+    index->num_packets = ntohll(hdr.num_packets);
+    index->num_bytes = ntohll(hdr.num_bytes);
+    index->first_ts_ns = ntohll(hdr.first_ts_ns);
+    index->last_ts_ns = ntohll(hdr.last_ts_ns);
+    index->num_entries = ntohll(hdr.num_entries);
+
+    if (pcapfile != NULL) {
+        if (pcap_index_stat(pcapfile, &current, ebuf) < 0)
+            goto fail;
+
+        if (current.pcap_size != index->pcap_size || current.pcap_mtime != index->pcap_mtime) {
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "Index file %s is out of date", path);
+            goto fail;
+        }
+    }
+
+    if (index->interval == 0 || index->num_entries > PCAP_INDEX_MAX_ENTRIES) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to process %s: invalid header", path);
+        goto fail;
+    }
+
+    if (index->num_entries > 0) {
+        size_t size = index->num_entries * sizeof(pcap_index_entry_t);
+
+        index->entries = (pcap_index_entry_t *)safe_malloc(size);
+        if ((len = read(fd, index->entries, size)) != (ssize_t)size) {
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "Index data length (%zd bytes) doesn't match header (%zu bytes)",
+                     len, size);
+            goto fail;
+        }
+
+        for (i = 0; i < index->num_entries; i++) {
+            index->entries[i].packet = ntohll(index->entries[i].packet);
+            index->entries[i].offset = ntohll(index->entries[i].offset);
+            index->entries[i].ts_ns = ntohll(index->entries[i].ts_ns);
+            index->entries[i].bytes = ntohll(index->entries[i].bytes);
+        }
+    }
+
+    close(fd);
+    return index;
+
+fail:
+    close(fd);
+    pcap_index_free(index);
+    return NULL;
+}
+
+/**
+ * \brief load the sidecar index of pcapfile, if there is an up to date one
+ *
+ * Returns NULL if there is none; that's not an error
+ */
+pcap_index_t *
+pcap_index_load(const char *pcapfile)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    pcap_index_t *index;
+    char *path;
+
+    assert(pcapfile);
+
+    if (strcmp(pcapfile, "-") == 0)
+        return NULL;
+
+    path = pcap_index_path(pcapfile);
+
+    if (access(path, R_OK) < 0) {
+        safe_free(path);
+        return NULL;
+    }
+
+    if ((index = pcap_index_read(path, pcapfile, ebuf)) == NULL)
+        warnx("Ignoring index: %s", ebuf);
+    else
+        dbgx(1, "Loaded index %s: " COUNTER_SPEC " packets", path, index->num_packets);
+
+    safe_free(path);
+    return index;
+}
+
+/**
+ * \brief find the last entry at or before the given packet number
+ *
+ * Returns NULL if the index has no entries
+ */
+const pcap_index_entry_t *
+pcap_index_find_packet(const pcap_index_t *index, COUNTER packet)
+{
+    COUNTER i;
+
+    assert(index);
+
+    if (index->num_entries == 0)
+        return NULL;
+
+    /* entries are evenly spaced */
+    i = packet / index->interval;
+    if (i >= index->num_entries)
+        i = index->num_entries - 1;
+
+    return &index->entries[i];
+}
+
+/**
+ * \brief find the last entry with a timestamp at or before ts_ns
+ *
+ * Assumes timestamps never go backwards, which isn't always true of real
+ * captures; the result is then only a starting point.  Returns the first
+ * entry if ts_ns is before it, or NULL if the index has no entries
+ */
+const pcap_index_entry_t *
+pcap_index_find_time(const pcap_index_t *index, u_int64_t ts_ns)
+{
+    COUNTER lo, hi;
+
+    assert(index);
+
+    if (index->num_entries == 0)
+        return NULL;
+
+    lo = 0;
+    hi = index->num_entries;
+    while (hi - lo > 1) {
+        COUNTER mid = lo + (hi - lo) / 2;
+
+        if (index->entries[mid].ts_ns <= ts_ns)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    return &index->entries[lo];
+}
+
+void
+pcap_index_free(pcap_index_t *index)
+{
+    if (index == NULL)
+        return;
+
+    safe_free(index->entries);
+    safe_free(index);
+}
@@ -0,0 +1,98 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include <pcap.h>
+
+/*
+ * Sidecar index for large pcap files.
+ *
+ * Written next to the capture as <file>.idx, it records the totals of
+ * the file (packets, bytes, first and last timestamp) and, every
+ * `interval` packets, the byte offset of the record in the file along
+ * with its timestamp and the bytes before it.  Tools can then learn the
+ * size and duration of a capture, or find a packet by number or time,
+ * without scanning it.
+ *
+ * The index stores the size and mtime of the pcap it was built from and
+ * is ignored once the pcap changes.
+ */
+#define PCAP_INDEX_MAGIC "tcpridx"
+#define PCAP_INDEX_VERSION "01"
+#define PCAP_INDEX_SUFFIX ".idx"
+#define PCAP_INDEX_DEFAULT_INTERVAL 1000
+
+/*
+ * PCAP_INDEX_VERSION History:
+ * 01 - Initial release
+ */
+
+/*
+ * On-disk file header, followed by num_entries pcap_index_entry_t.  All
+ * integers are in network byte order.
+ *
+ * If you need to enhance this struct, do so AFTER the version field and be
+ * sure to increment PCAP_INDEX_VERSION
+ */
+typedef struct pcap_index_file_hdr_s {
+    char magic[8];
+    char version[4];
+    u_int32_t dlt;
+    u_int32_t snaplen;
+    u_int32_t interval;    /* packets between entries */
+    u_int64_t pcap_size;   /* size of the indexed pcap */
+    u_int64_t pcap_mtime;  /* mtime of the indexed pcap, in seconds */
+    u_int64_t num_packets;
+    u_int64_t num_bytes;   /* sum of caplen of all packets */
+    u_int64_t first_ts_ns;
+    u_int64_t last_ts_ns;
+    u_int64_t num_entries;
+} __attribute__((__packed__)) pcap_index_file_hdr_t;
+
+typedef struct pcap_index_entry_s {
+    u_int64_t packet; /* packet number, starting at 0 */
+    u_int64_t offset; /* file offset of the packet's record */
+    u_int64_t ts_ns;
+    u_int64_t bytes;  /* sum of caplen of all packets before this one */
+} __attribute__((__packed__)) pcap_index_entry_t;
+
+typedef struct pcap_index_s {
+    int dlt;
+    int snaplen;
+    u_int32_t interval;
+    u_int64_t pcap_size;
+    u_int64_t pcap_mtime;
+    COUNTER num_packets;
+    COUNTER num_bytes;
+    u_int64_t first_ts_ns;
+    u_int64_t last_ts_ns;
+    COUNTER num_entries;
+    pcap_index_entry_t *entries; /* host byte order */
+} pcap_index_t;
+
+char *pcap_index_path(const char *pcapfile);
+pcap_index_t *pcap_index_build(const char *pcapfile, u_int32_t interval, char *ebuf);
+int pcap_index_write(const pcap_index_t *index, const char *path, char *ebuf);
+pcap_index_t *pcap_index_read(const char *path, const char *pcapfile, char *ebuf);
+pcap_index_t *pcap_index_load(const char *pcapfile);
+const pcap_index_entry_t *pcap_index_find_packet(const pcap_index_t *index, COUNTER packet);
+const pcap_index_entry_t *pcap_index_find_time(const pcap_index_t *index, u_int64_t ts_ns);
+void pcap_index_free(pcap_index_t *index);
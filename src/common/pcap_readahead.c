@@ -0,0 +1,244 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_RINGS /* see memstat.h */
+
+#include "pcap_readahead.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+
+/* publish progress to the caller every this many packets */
+#define PCAP_READAHEAD_PUBLISH 32
+
+#define PCAP_READAHEAD_ALIGN(x) (((x) + 7) & ~(size_t)7)
+#define PCAP_READAHEAD_HDRLEN PCAP_READAHEAD_ALIGN(sizeof(struct pcap_pkthdr))
+
+static inline size_t
+record_len(const struct pcap_pkthdr *pkthdr)
+{
+    return PCAP_READAHEAD_HDRLEN + PCAP_READAHEAD_ALIGN(pkthdr->caplen + PACKET_HEADROOM);
+}
+
+/**
+ * \brief wait for the chunk after the current one to be released, and start on it
+ *
+ * Returns the new chunk or NULL if we're being shut down
+ */
+static pcap_readahead_chunk_t *
+pcap_readahead_next_chunk(pcap_readahead_t *ra, pcap_readahead_chunk_t *c, size_t filled)
+{
+    pcap_readahead_chunk_t *next = NULL;
+
+    pthread_mutex_lock(&ra->lock);
+    c->filled = filled;
+    c->done = true;
+    pthread_cond_broadcast(&ra->cond);
+
+    while (!ra->stop && ra->fill_seq + 1 - ra->read_seq >= PCAP_READAHEAD_CHUNKS)
+        pthread_cond_wait(&ra->cond, &ra->lock);
+
+    if (!ra->stop) {
+        ra->fill_seq++;
+        next = &ra->chunks[ra->fill_seq % PCAP_READAHEAD_CHUNKS];
+        next->filled = 0;
+        next->done = false;
+    }
+    pthread_mutex_unlock(&ra->lock);
+
+    return next;
+}
+
+/**
+ * \brief reader thread: keep the ring full
+ */
+static void *
+pcap_readahead_reader(void *arg)
+{
+    pcap_readahead_t *ra = arg;
+    pcap_readahead_chunk_t *c = &ra->chunks[0];
+    struct pcap_pkthdr pkthdr;
+    const u_char *pktdata;
+    size_t offset = 0;
+    COUNTER cnt = 0;
+
+    while ((pktdata = safe_pcap_next(ra->pcap, &pkthdr)) != NULL) {
+        size_t len;
+
+        /*
+         * chunks are only guaranteed to hold MAXPACKET.  safe_pcap_next()
+         * has already failed on anything longer than MAX_SNAPLEN, so only
+         * a broken libpcap gets here, but fail as it does rather than cut
+         * the packet short
+         */
+        if (pkthdr.caplen > MAXPACKET)
+            errx(-1, "Frame too big, caplen %u exceeds %u", pkthdr.caplen, (u_int32_t)MAXPACKET);
+
+        len = record_len(&pkthdr);
+
+        if (offset + len > ra->chunk_size) {
+            if ((c = pcap_readahead_next_chunk(ra, c, offset)) == NULL)
+                return NULL;
+            offset = 0;
+        }
+
+        memcpy(c->data + offset, &pkthdr, sizeof(pkthdr));
+        memcpy(c->data + offset + PCAP_READAHEAD_HDRLEN, pktdata, pkthdr.caplen);
+        offset += len;
+
+        if (++cnt % PCAP_READAHEAD_PUBLISH == 0) {
+            bool stop;
+
+            pthread_mutex_lock(&ra->lock);
+            c->filled = offset;
+            stop = ra->stop;
+            pthread_cond_broadcast(&ra->cond);
+            pthread_mutex_unlock(&ra->lock);
+
+            if (stop)
+                return NULL;
+        }
+    }
+
+    pthread_mutex_lock(&ra->lock);
+    c->filled = offset;
+    c->done = true;
+    ra->eof = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+
+    return NULL;
+}
+
+/**
+ * \brief start reading ahead on pcap, buffering up to size bytes
+ *
+ * Returns NULL if the reader thread can't be started, in which case the
+ * caller should keep using pcap directly
+ */
+pcap_readahead_t *
+pcap_readahead_open(pcap_t *pcap, size_t size)
+{
+    pcap_readahead_t *ra;
+    int i;
+
+    assert(pcap);
+
+    ra = (pcap_readahead_t *)safe_malloc(sizeof(pcap_readahead_t));
+    ra->pcap = pcap;
+
+    /* every chunk must be able to hold the largest possible record */
+    ra->chunk_size = size / PCAP_READAHEAD_CHUNKS;
+    if (ra->chunk_size < PCAP_READAHEAD_HDRLEN + PCAP_READAHEAD_ALIGN(MAXPACKET + PACKET_HEADROOM))
+        ra->chunk_size = PCAP_READAHEAD_HDRLEN + PCAP_READAHEAD_ALIGN(MAXPACKET + PACKET_HEADROOM);
+
+    for (i = 0; i < PCAP_READAHEAD_CHUNKS; i++)
+        ra->chunks[i].data = (u_char *)safe_malloc(ra->chunk_size);
+
+    pthread_mutex_init(&ra->lock, NULL);
+    pthread_cond_init(&ra->cond, NULL);
+
+    if (pthread_create(&ra->reader, NULL, pcap_readahead_reader, ra) != 0) {
+        warn("Unable to start read-ahead thread");
+        pthread_cond_destroy(&ra->cond);
+        pthread_mutex_destroy(&ra->lock);
+        for (i = 0; i < PCAP_READAHEAD_CHUNKS; i++)
+            safe_free(ra->chunks[i].data);
+        safe_free(ra);
+        return NULL;
+    }
+
+    dbgx(1, "Reading ahead %zu bytes", ra->chunk_size * PCAP_READAHEAD_CHUNKS);
+    return ra;
+}
+
+/**
+ * \brief get the next packet, blocking only if the reader has fallen behind
+ *
+ * Returns NULL at the end of the file.
+ */
+u_char *
+pcap_readahead_next(pcap_readahead_t *ra, struct pcap_pkthdr *pkthdr)
+{
+    pcap_readahead_chunk_t *c = &ra->chunks[ra->read_seq % PCAP_READAHEAD_CHUNKS];
+    u_char *rec;
+
+    assert(pkthdr);
+
+    if (ra->offset >= ra->avail) {
+        pthread_mutex_lock(&ra->lock);
+        for (;;) {
+            if (ra->offset < c->filled)
+                break;
+
+            if (c->done && ra->read_seq == ra->fill_seq && ra->eof) {
+                pthread_mutex_unlock(&ra->lock);
+                return NULL;
+            }
+
+            if (c->done && ra->read_seq < ra->fill_seq) {
+                /* hand the chunk back to the reader */
+                ra->read_seq++;
+                ra->offset = 0;
+                c = &ra->chunks[ra->read_seq % PCAP_READAHEAD_CHUNKS];
+                pthread_cond_broadcast(&ra->cond);
+                continue;
+            }
+
+            pthread_cond_wait(&ra->cond, &ra->lock);
+        }
+        ra->avail = c->filled;
+        pthread_mutex_unlock(&ra->lock);
+    }
+
+    rec = c->data + ra->offset;
+    memcpy(pkthdr, rec, sizeof(*pkthdr));
+    ra->offset += record_len(pkthdr);
+
+    return rec + PCAP_READAHEAD_HDRLEN;
+}
+
+/**
+ * \brief stop the reader and free the ring.  Does not close the pcap
+ */
+void
+pcap_readahead_close(pcap_readahead_t *ra)
+{
+    int i;
+
+    if (ra == NULL)
+        return;
+
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    pthread_join(ra->reader, NULL);
+
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    for (i = 0; i < PCAP_READAHEAD_CHUNKS; i++)
+        safe_free(ra->chunks[i].data);
+    safe_free(ra);
+}
+
+#endif /* HAVE_PTHREAD */
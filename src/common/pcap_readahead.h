@@ -0,0 +1,67 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include <pcap.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Read-ahead for pcap files which are not preloaded.
+ *
+ * A background thread reads records with libpcap into a ring of chunks,
+ * so disk latency is absorbed by the ring rather than showing up in
+ * send timing.  Each packet is followed by PACKET_HEADROOM bytes so it
+ * may be edited in place.  As with pcap_next(), the packet returned by
+ * pcap_readahead_next() is only valid until the following call.
+ */
+#define PCAP_READAHEAD_CHUNKS 8
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+
+typedef struct pcap_readahead_chunk_s {
+    u_char *data;
+    size_t filled; /* bytes published by the reader */
+    bool done;     /* reader has moved past this chunk */
+} pcap_readahead_chunk_t;
+
+typedef struct pcap_readahead_s {
+    pcap_t *pcap;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pcap_readahead_chunk_t chunks[PCAP_READAHEAD_CHUNKS];
+    size_t chunk_size;
+    COUNTER fill_seq; /* chunk the reader is filling */
+    COUNTER read_seq; /* chunk the caller is reading */
+    size_t offset;    /* caller's offset into chunks[read_seq] */
+    size_t avail;     /* last filled value seen by the caller */
+    bool eof;         /* reader has reached the end of the file */
+    bool stop;
+} pcap_readahead_t;
+
+pcap_readahead_t *pcap_readahead_open(pcap_t *pcap, size_t size);
+u_char *pcap_readahead_next(pcap_readahead_t *ra, struct pcap_pkthdr *pkthdr);
+void pcap_readahead_close(pcap_readahead_t *ra);
+#else
+typedef struct pcap_readahead_s pcap_readahead_t;
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,444 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pcap_writer.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+
+#ifdef HAVE_PCAP_DUMP_FOPEN
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* on-disk file header; struct pcap_file_header matches this */
+#define PCAP_WRITER_FILE_HDRLEN 24
+
+/* on-disk record header. struct pcap_pkthdr does NOT match on 64bit systems */
+typedef struct pcap_writer_pkthdr_s {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t caplen;
+    uint32_t len;
+} pcap_writer_pkthdr_t;
+
+/**
+ * \brief write all of iov to fd, retrying short writes
+ *
+ * Returns 0 on success, or the errno of the failure
+ */
+static int
+write_all(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    while (iovcnt > 0) {
+        if ((ret = writev(fd, iov, iovcnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+
+        while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+            ret -= (ssize_t)iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (u_char *)iov->iov_base + ret;
+            iov->iov_len -= (size_t)ret;
+        }
+    }
+
+    return 0;
+}
+
+static int
+write_buf(int fd, u_char *buf, size_t len)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    return write_all(fd, &iov, 1);
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * \brief background thread writing out each buffer handed over by the producer
+ */
+static void *
+pcap_writer_flusher(void *arg)
+{
+    pcap_writer_t *pw = arg;
+    u_char *buf;
+    size_t len;
+    int error;
+
+    pthread_mutex_lock(&pw->lock);
+    for (;;) {
+        while (pw->pending == 0 && !pw->stop)
+            pthread_cond_wait(&pw->cond, &pw->lock);
+
+        if (pw->pending == 0)
+            break;
+
+        buf = pw->buf[!pw->cur];
+        len = pw->pending;
+        pthread_mutex_unlock(&pw->lock);
+        error = write_buf(pw->fd, buf, len);
+        pthread_mutex_lock(&pw->lock);
+
+        if (error && !pw->error)
+            pw->error = error;
+
+        pw->pending = 0;
+        pthread_cond_broadcast(&pw->cond);
+    }
+    pthread_mutex_unlock(&pw->lock);
+
+    return NULL;
+}
+
+/* wait for the flusher to finish with the other buffer */
+static void
+pcap_writer_wait(pcap_writer_t *pw)
+{
+    pthread_mutex_lock(&pw->lock);
+    while (pw->pending > 0)
+        pthread_cond_wait(&pw->cond, &pw->lock);
+    pthread_mutex_unlock(&pw->lock);
+}
+#endif
+
+/**
+ * \brief hand off the current buffer to be written
+ *
+ * With threads this only blocks if the previous buffer is still being
+ * written, otherwise the buffer is written synchronously.
+ */
+static int
+pcap_writer_swap(pcap_writer_t *pw)
+{
+#ifndef HAVE_PTHREAD
+    int error;
+#endif
+
+    if (pw->used == 0)
+        return pw->error ? -1 : 0;
+
+#ifdef HAVE_PTHREAD
+    pcap_writer_wait(pw);
+
+    pthread_mutex_lock(&pw->lock);
+    pw->pending = pw->used;
+    pw->cur = !pw->cur;
+    pw->used = 0;
+    pthread_cond_broadcast(&pw->cond);
+    pthread_mutex_unlock(&pw->lock);
+#else
+    error = write_buf(pw->fd, pw->buf[pw->cur], pw->used);
+    if (error && !pw->error)
+        pw->error = error;
+    pw->used = 0;
+#endif
+
+    return pw->error ? -1 : 0;
+}
+
+/**
+ * \brief get the file header libpcap would write for this DLT and snaplen
+ */
+static int
+pcap_writer_file_header(int dlt, int snaplen, u_char *hdr, char *ebuf)
+{
+    pcap_dumper_t *dumper;
+    pcap_t *dead;
+    FILE *fp;
+    int ret = -1;
+
+    if ((dead = pcap_open_dead(dlt, snaplen)) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to open dead pcap handle");
+        return -1;
+    }
+
+    if ((fp = tmpfile()) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to create temporary file: %s", strerror(errno));
+        pcap_close(dead);
+        return -1;
+    }
+
+    /* pcap_dump_close() closes fp for us */
+    if ((dumper = pcap_dump_fopen(dead, fp)) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s", pcap_geterr(dead));
+        fclose(fp);
+        pcap_close(dead);
+        return -1;
+    }
+
+    pcap_dump_flush(dumper);
+    rewind(fp);
+    if (fread(hdr, 1, PCAP_WRITER_FILE_HDRLEN, fp) == PCAP_WRITER_FILE_HDRLEN) {
+        ret = 0;
+    } else {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to generate pcap file header");
+    }
+
+    pcap_dump_close(dumper);
+    pcap_close(dead);
+    return ret;
+}
+
+/**
+ * \brief Open a pcap file for buffered writing
+ *
+ * path may be "-" for STDOUT, or "shm:NAME" for a shm_pipe.  bufsize is
+ * the size of each of the write buffers.  Returns NULL and fills in ebuf
+ * on error.
+ */
+pcap_writer_t *
+pcap_writer_open(const char *path, int dlt, int snaplen, size_t bufsize, char *ebuf)
+{
+    u_char hdr[PCAP_WRITER_FILE_HDRLEN];
+    pcap_writer_t *pw;
+    int fd;
+
+    assert(path);
+    assert(ebuf);
+
+    if (bufsize < MAXPACKET)
+        bufsize = MAXPACKET;
+
+    if (shm_pipe_path(path)) {
+#ifdef HAVE_SHM_PIPE
+        shm_pipe_t *shm;
+
+        if ((shm = shm_pipe_create(path, dlt, snaplen, false, ebuf)) == NULL)
+            return NULL;
+
+        pw = (pcap_writer_t *)safe_malloc(sizeof(pcap_writer_t));
+        pw->fd = -1;
+        pw->shm = shm;
+        return pw;
+#else
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: shared memory pipes aren't supported on this platform", path);
+        return NULL;
+#endif
+    }
+
+    if (pcap_writer_file_header(dlt, snaplen, hdr, ebuf) < 0)
+        return NULL;
+
+    if (strcmp(path, "-") == 0) {
+        fd = STDOUT_FILENO;
+    } else if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    pw = (pcap_writer_t *)safe_malloc(sizeof(pcap_writer_t));
+    pw->fd = fd;
+    pw->size = bufsize;
+    pw->buf[0] = (u_char *)safe_malloc(bufsize);
+#ifdef HAVE_PTHREAD
+    pw->buf[1] = (u_char *)safe_malloc(bufsize);
+    pthread_mutex_init(&pw->lock, NULL);
+    pthread_cond_init(&pw->cond, NULL);
+    if (pthread_create(&pw->flusher, NULL, pcap_writer_flusher, pw) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start pcap writer thread");
+        pthread_cond_destroy(&pw->cond);
+        pthread_mutex_destroy(&pw->lock);
+        safe_free(pw->buf[1]);
+        safe_free(pw->buf[0]);
+        safe_free(pw);
+        if (fd != STDOUT_FILENO)
+            close(fd);
+        return NULL;
+    }
+#endif
+
+    memcpy(pw->buf[0], hdr, sizeof(hdr));
+    pw->used = sizeof(hdr);
+
+    return pw;
+}
+
+/**
+ * \brief append a packet to the output file
+ *
+ * Returns 0 on success, -1 if a previous write failed.  The error is sticky,
+ * see pcap_writer_geterr()
+ */
+int
+pcap_writer_write(pcap_writer_t *pw, const struct pcap_pkthdr *pkthdr, const u_char *pktdata)
+{
+    struct iovec iov;
+
+    iov.iov_base = (u_char *)pktdata;
+    iov.iov_len = pkthdr->caplen;
+
+    return pcap_writer_writev(pw, pkthdr, &iov, 1);
+}
+
+/**
+ * \brief append a packet made of up to PCAP_WRITER_IOV_MAX segments
+ *
+ * The segments are gathered straight into the output buffer, so callers
+ * building a packet out of pieces don't have to assemble it first.  Their
+ * lengths must add up to pkthdr->caplen.  Returns like pcap_writer_write()
+ */
+int
+pcap_writer_writev(pcap_writer_t *pw, const struct pcap_pkthdr *pkthdr, const struct iovec *iov, int iovcnt)
+{
+    pcap_writer_pkthdr_t rec;
+    size_t reclen;
+    u_char *p;
+    int i;
+
+    assert(pw);
+    assert(pkthdr);
+    assert(iovcnt > 0 && iovcnt <= PCAP_WRITER_IOV_MAX);
+
+#ifdef HAVE_SHM_PIPE
+    if (pw->shm != NULL)
+        return shm_pipe_writev(pw->shm, pkthdr, iov, iovcnt);
+#endif
+
+    rec.ts_sec = (uint32_t)pkthdr->ts.tv_sec;
+    rec.ts_usec = (uint32_t)pkthdr->ts.tv_usec;
+    rec.caplen = pkthdr->caplen;
+    rec.len = pkthdr->len;
+    reclen = sizeof(rec) + pkthdr->caplen;
+
+    if (pw->used + reclen > pw->size && pcap_writer_swap(pw) < 0)
+        return -1;
+
+    /* bigger than a whole buffer, write it straight out */
+    if (reclen > pw->size) {
+        struct iovec out[PCAP_WRITER_IOV_MAX + 1];
+        int error;
+
+#ifdef HAVE_PTHREAD
+        pcap_writer_wait(pw);
+#endif
+        out[0].iov_base = &rec;
+        out[0].iov_len = sizeof(rec);
+        memcpy(&out[1], iov, iovcnt * sizeof(struct iovec));
+        if ((error = write_all(pw->fd, out, iovcnt + 1)) != 0 && !pw->error)
+            pw->error = error;
+
+        return pw->error ? -1 : 0;
+    }
+
+    p = pw->buf[pw->cur] + pw->used;
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(p, iov[i].iov_base, iov[i].iov_len);
+        p += iov[i].iov_len;
+    }
+    pw->used += reclen;
+
+    return 0;
+}
+
+/**
+ * \brief write out everything buffered so far and wait for it to complete
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int
+pcap_writer_flush(pcap_writer_t *pw)
+{
+    assert(pw);
+
+#ifdef HAVE_SHM_PIPE
+    if (pw->shm != NULL)
+        return shm_pipe_flush(pw->shm);
+#endif
+
+    pcap_writer_swap(pw);
+#ifdef HAVE_PTHREAD
+    pcap_writer_wait(pw);
+#endif
+
+    return pw->error ? -1 : 0;
+}
+
+/**
+ * \brief flush and close the output file
+ */
+void
+pcap_writer_close(pcap_writer_t *pw)
+{
+    assert(pw);
+
+#ifdef HAVE_SHM_PIPE
+    if (pw->shm != NULL) {
+        shm_pipe_close(pw->shm);
+        safe_free(pw);
+        return;
+    }
+#endif
+
+    pcap_writer_flush(pw);
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&pw->lock);
+    pw->stop = true;
+    pthread_cond_broadcast(&pw->cond);
+    pthread_mutex_unlock(&pw->lock);
+    pthread_join(pw->flusher, NULL);
+    pthread_cond_destroy(&pw->cond);
+    pthread_mutex_destroy(&pw->lock);
+    safe_free(pw->buf[1]);
+#endif
+
+    if (pw->fd != STDOUT_FILENO)
+        close(pw->fd);
+
+    safe_free(pw->buf[0]);
+    safe_free(pw);
+}
+
+const char *
+pcap_writer_geterr(pcap_writer_t *pw)
+{
+    assert(pw);
+
+#ifdef HAVE_SHM_PIPE
+    if (pw->shm != NULL)
+        return shm_pipe_geterr(pw->shm);
+#endif
+
+    if (pw->error)
+        snprintf(pw->errbuf, sizeof(pw->errbuf), "Unable to write pcap file: %s", strerror(pw->error));
+    else
+        pw->errbuf[0] = '\0';
+
+    return pw->errbuf;
+}
+
+#endif /* HAVE_PCAP_DUMP_FOPEN */
@@ -0,0 +1,81 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include "shm_pipe.h"
+#include <pcap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/*
+ * Buffered writer for classic pcap files.
+ *
+ * Record headers and packet data are assembled directly into a large
+ * buffer which is written out in one write(2) per buffer, instead of going
+ * through stdio a record at a time like pcap_dump().  With POSIX threads
+ * there are two buffers and the full one is written by a background thread,
+ * so a slow output device (NFS, etc...) doesn't stall the caller until
+ * both buffers are full.
+ *
+ * The file header is generated by libpcap so the output is byte for byte
+ * what pcap_dump() would have written.
+ *
+ * A "shm:NAME" path is a shm_pipe to a tcpreplay instead of a file, and
+ * packets go straight into it.
+ */
+#define PCAP_WRITER_DEFAULT_BUFSIZE (4 * 1024 * 1024)
+
+/* most segments one packet can be made of for pcap_writer_writev() */
+#define PCAP_WRITER_IOV_MAX 8
+
+typedef struct pcap_writer_s {
+    int fd;
+    u_char *buf[2];
+    size_t size; /* bytes allocated for each buffer */
+    size_t used; /* bytes used in buf[cur] */
+    int cur;
+    int error; /* errno of the first failed write */
+    char errbuf[PCAP_ERRBUF_SIZE];
+#ifdef HAVE_SHM_PIPE
+    shm_pipe_t *shm; /* instead of fd and the buffers */
+#endif
+#ifdef HAVE_PTHREAD
+    pthread_t flusher;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t pending; /* bytes of buf[!cur] waiting to be written */
+    bool stop;
+#endif
+} pcap_writer_t;
+
+#ifdef HAVE_PCAP_DUMP_FOPEN
+pcap_writer_t *pcap_writer_open(const char *path, int dlt, int snaplen, size_t bufsize, char *ebuf);
+int pcap_writer_write(pcap_writer_t *pw, const struct pcap_pkthdr *pkthdr, const u_char *pktdata);
+int pcap_writer_writev(pcap_writer_t *pw, const struct pcap_pkthdr *pkthdr, const struct iovec *iov, int iovcnt);
+int pcap_writer_flush(pcap_writer_t *pw);
+void pcap_writer_close(pcap_writer_t *pw);
+const char *pcap_writer_geterr(pcap_writer_t *pw);
+#endif
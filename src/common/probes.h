@@ -0,0 +1,57 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "config.h"
+
+/*
+ * USDT (user space statically defined tracing) probes, e.g. for bpftrace:
+ *
+ *   bpftrace -e 'usdt:./tcpreplay:tcpreplay:sleep__end { @ = hist(arg1 - arg0); }'
+ *
+ * lists how far each sleep overshot what was asked.  A probe is a single
+ * nop until a tracer attaches, and is compiled out without sys/sdt.h or
+ * with ./configure --disable-usdt.  Arguments must be integers or
+ * pointers; keep them to values at hand so a probe costs nothing.
+ *
+ * tcpreplay:packet__read(packetnum, len)      next packet is in hand
+ * tcpreplay:edit__done(packetnum, len)        tcpedit and --unique-ip done
+ * tcpreplay:sleep__begin(nap_ns)              about to wait for a packet
+ * tcpreplay:sleep__end(nap_ns, slept_ns)      done waiting
+ * tcpreplay:send__done(device, len, retcode, errno)
+ * tcpreplay:loop__begin(loop), loop__end(loop)
+ * tcpreplay:flow__new(sp), flow__expired(sp)
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define TCPR_PROBE1(name, a) DTRACE_PROBE1(tcpreplay, name, a)
+#define TCPR_PROBE2(name, a, b) DTRACE_PROBE2(tcpreplay, name, a, b)
+#define TCPR_PROBE4(name, a, b, c, d) DTRACE_PROBE4(tcpreplay, name, a, b, c, d)
+#else
+#define TCPR_PROBE1(name, a) \
+    do {                     \
+    } while (0)
+#define TCPR_PROBE2(name, a, b) \
+    do {                        \
+    } while (0)
+#define TCPR_PROBE4(name, a, b, c, d) \
+    do {                              \
+    } while (0)
+#endif
@@ -0,0 +1,143 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "profile.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <stdio.h>
+#include <string.h>
+
+static const char *tcpr_prof_names[TCPR_PROF_STAGES] = {"read", "edit", "flow", "pace", "send"};
+
+/* where the ticks and the clock were at tcpr_prof_calibrate() */
+static u_int64_t tcpr_prof_base_ticks;
+static u_int64_t tcpr_prof_base_ns;
+
+#if !defined __x86_64__ && !defined __i386__
+u_int64_t
+tcpr_prof_ticks(void)
+{
+    return tcpr_clock_ns();
+}
+#endif
+
+/**
+ * \brief name of a stage, e.g. for a label
+ */
+const char *
+tcpr_prof_stage_name(int stage)
+{
+    assert(stage >= 0 && stage < TCPR_PROF_STAGES);
+    return tcpr_prof_names[stage];
+}
+
+/**
+ * \brief start measuring the tick rate, before the first packet
+ */
+void
+tcpr_prof_calibrate(void)
+{
+    tcpr_prof_base_ticks = tcpr_prof_ticks();
+    tcpr_prof_base_ns = tcpr_clock_ns();
+}
+
+/**
+ * \brief ns per tick since tcpr_prof_calibrate()
+ *
+ * The time stamp counter of current CPUs runs at a constant rate, so the
+ * longer the run the closer this gets.
+ */
+double
+tcpr_prof_ns_per_tick(void)
+{
+    u_int64_t ticks = tcpr_prof_ticks() - tcpr_prof_base_ticks;
+    u_int64_t ns = tcpr_clock_ns() - tcpr_prof_base_ns;
+
+    if (ticks == 0 || ns == 0)
+        return 1.0;
+
+    return (double)ns / (double)ticks;
+}
+
+/**
+ * \brief add all the stages of from to to
+ */
+void
+tcpr_prof_merge(tcpr_profile_t *to, const tcpr_profile_t *from)
+{
+    int i;
+
+    for (i = 0; i < TCPR_PROF_STAGES; i++)
+        to->ticks[i] += from->ticks[i];
+    to->packets += from->packets;
+}
+
+/**
+ * \brief copy a profile another thread is adding to
+ */
+void
+tcpr_prof_load(tcpr_profile_t *to, const tcpr_profile_t *from)
+{
+    int i;
+
+    for (i = 0; i < TCPR_PROF_STAGES; i++)
+        to->ticks[i] = __atomic_load_n(&from->ticks[i], __ATOMIC_RELAXED);
+    to->packets = __atomic_load_n(&from->packets, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief print the ns per packet and share of wall_ns of every stage
+ *
+ * What isn't in any stage, e.g. printing --stats, is left as other.
+ */
+size_t
+tcpr_prof_summary(const tcpr_profile_t *prof, u_int64_t wall_ns, char *buf, size_t len)
+{
+    double ns_per_tick = tcpr_prof_ns_per_tick();
+    double staged = 0.0;
+    size_t used = 0;
+    int i, n;
+
+    for (i = 0; i < TCPR_PROF_STAGES && used < len; i++) {
+        double ns = (double)prof->ticks[i] * ns_per_tick;
+
+        staged += ns;
+        n = snprintf(buf + used,
+                     len - used,
+                     "%s%s %.1f ns/pkt %.1f%%",
+                     i ? ", " : "",
+                     tcpr_prof_names[i],
+                     prof->packets ? ns / (double)prof->packets : 0.0,
+                     wall_ns ? ns * 100.0 / (double)wall_ns : 0.0);
+        if (n < 0)
+            return used;
+        used = min(used + (size_t)n, len - 1);
+    }
+
+    if (used < len) {
+        n = snprintf(buf + used,
+                     len - used,
+                     ", other %.1f%%",
+                     wall_ns && staged < (double)wall_ns ? 100.0 - staged * 100.0 / (double)wall_ns : 0.0);
+        if (n > 0)
+            used = min(used + (size_t)n, len - 1);
+    }
+
+    return used;
+}
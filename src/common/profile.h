@@ -0,0 +1,74 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include <stddef.h>
+
+/*
+ * --profile: where a send loop spends its time, stage by stage.
+ *
+ * Every send loop (the main one and each --threads worker) adds the ticks
+ * spent in each stage of sending a packet to the tcpr_profile_t of its
+ * sendpacket_t.  A stage lasts from the end of the one before it, so it
+ * costs a single read of the time stamp counter.  Ticks are turned into
+ * ns against the clock over the whole run, see tcpr_prof_ns_per_tick().
+ */
+typedef enum {
+    TCPR_PROF_READ,  /* the next packet, from the cache or the pcap */
+    TCPR_PROF_EDIT,  /* tcpreplay-edit and --unique-ip */
+    TCPR_PROF_FLOW,  /* flow statistics */
+    TCPR_PROF_PACE,  /* working out when to send and waiting for it */
+    TCPR_PROF_SEND,  /* handing the packet or batch to the kernel */
+    TCPR_PROF_STAGES
+} tcpr_prof_stage_t;
+
+typedef struct tcpr_profile_s {
+    u_int64_t ticks[TCPR_PROF_STAGES];
+    COUNTER packets;
+} tcpr_profile_t;
+
+#if defined __x86_64__ || defined __i386__
+static inline u_int64_t
+tcpr_prof_ticks(void)
+{
+    return __builtin_ia32_rdtsc();
+}
+#else
+/* ns of tcpr_clock_ns() where there is no time stamp counter */
+u_int64_t tcpr_prof_ticks(void);
+#endif
+
+/* add the ticks since *mark to stage, and start the next one */
+static inline void
+tcpr_prof_lap(tcpr_profile_t *prof, tcpr_prof_stage_t stage, u_int64_t *mark)
+{
+    u_int64_t now = tcpr_prof_ticks();
+
+    prof->ticks[stage] += now - *mark;
+    *mark = now;
+}
+
+const char *tcpr_prof_stage_name(int stage);
+void tcpr_prof_calibrate(void);
+double tcpr_prof_ns_per_tick(void);
+void tcpr_prof_merge(tcpr_profile_t *to, const tcpr_profile_t *from);
+void tcpr_prof_load(tcpr_profile_t *to, const tcpr_profile_t *from);
+size_t tcpr_prof_summary(const tcpr_profile_t *prof, u_int64_t wall_ns, char *buf, size_t len);
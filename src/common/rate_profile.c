@@ -0,0 +1,205 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rate_profile.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Rate profile files have one point per line:
+ *
+ *   <seconds since start> <rate> [linear]
+ *
+ * plus the directives "units mbps" (the default) or "units pps", and
+ * "repeat".  Everything after a # is a comment.
+ */
+
+/**
+ * \brief parse a rate profile file
+ *
+ * Returns NULL and a message in ebuf on error
+ */
+rate_profile_t *
+rate_profile_load(const char *path, char *ebuf, size_t len)
+{
+    rate_profile_t *rp;
+    char line[RATE_PROFILE_MAX_LINE];
+    int lineno = 0, max = 0;
+    FILE *fp;
+
+    assert(path);
+    assert(ebuf);
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        snprintf(ebuf, len, "Unable to open rate profile %s: %s", path, strerror(errno));
+        return NULL;
+    }
+
+    rp = safe_malloc(sizeof(rate_profile_t));
+    rp->units = rate_profile_mbps;
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char word[16], value[16], extra[16];
+        double at, rate;
+        char *p;
+        int n;
+
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+
+        extra[0] = '\0';
+        if ((n = sscanf(line, "%lf %lf %15s %15s", &at, &rate, word, extra)) >= 2) {
+            rate_profile_point_t *point;
+
+            if (at < 0.0 || rate <= 0.0 || (n >= 3 && strcmp(word, "linear") != 0) || n > 3) {
+                snprintf(ebuf, len, "%s:%d: expected <seconds> <rate> [linear]", path, lineno);
+                goto error;
+            }
+
+            if (rp->cnt > 0 && (u_int64_t)(at * 1000000000.0) <= rp->points[rp->cnt - 1].at_ns) {
+                snprintf(ebuf, len, "%s:%d: times must increase", path, lineno);
+                goto error;
+            }
+
+            if (rp->cnt == max) {
+                max = max ? max * 2 : 16;
+                rp->points = safe_realloc(rp->points, sizeof(rate_profile_point_t) * max);
+            }
+
+            point = &rp->points[rp->cnt++];
+            point->at_ns = (u_int64_t)(at * 1000000000.0);
+            point->rate = rate;
+            point->linear = n == 3;
+        } else if ((n = sscanf(line, "%15s %15s %15s", word, value, extra)) > 0) {
+            if (n == 2 && strcmp(word, "units") == 0 && strcmp(value, "mbps") == 0) {
+                rp->units = rate_profile_mbps;
+            } else if (n == 2 && strcmp(word, "units") == 0 && strcmp(value, "pps") == 0) {
+                rp->units = rate_profile_pps;
+            } else if (n == 1 && strcmp(word, "repeat") == 0) {
+                rp->repeat = true;
+            } else {
+                snprintf(ebuf, len, "%s:%d: unable to parse '%s'", path, lineno, word);
+                goto error;
+            }
+        }
+    }
+
+    fclose(fp);
+
+    if (rp->cnt == 0) {
+        snprintf(ebuf, len, "Rate profile %s has no rates", path);
+        rate_profile_free(rp);
+        return NULL;
+    }
+
+    /* a profile of one point never ends, so there is nothing to repeat */
+    if (rp->points[rp->cnt - 1].at_ns == 0)
+        rp->repeat = false;
+
+    return rp;
+
+error:
+    fclose(fp);
+    rate_profile_free(rp);
+    return NULL;
+}
+
+void
+rate_profile_free(rate_profile_t *rp)
+{
+    if (rp == NULL)
+        return;
+
+    safe_free(rp->points);
+    safe_free(rp);
+}
+
+/**
+ * \brief rate at the given time since the start of the replay
+ */
+double
+rate_profile_rate(const rate_profile_t *rp, u_int64_t elapsed_ns)
+{
+    const rate_profile_point_t *from, *to;
+    int lo = 0, hi;
+
+    assert(rp);
+    assert(rp->cnt > 0);
+
+    if (rp->repeat)
+        elapsed_ns %= rp->points[rp->cnt - 1].at_ns;
+
+    if (elapsed_ns < rp->points[0].at_ns)
+        return rp->points[0].rate;
+
+    /* last point at or before elapsed_ns */
+    hi = rp->cnt - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+
+        if (rp->points[mid].at_ns <= elapsed_ns)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+
+    from = &rp->points[lo];
+    if (!from->linear || lo + 1 == rp->cnt)
+        return from->rate;
+
+    to = from + 1;
+    return from->rate +
+           (to->rate - from->rate) * (double)(elapsed_ns - from->at_ns) / (double)(to->at_ns - from->at_ns);
+}
+
+/**
+ * \brief ns per pacer token at a rate: a bit for mbps, a packet for pps
+ */
+double
+rate_profile_ns_per_unit(const rate_profile_t *rp, double rate)
+{
+    if (rp->units == rate_profile_pps)
+        return 1000000000.0 / rate;
+
+    return 1000.0 / rate;
+}
+
+/**
+ * \brief have the pacer follow the profile
+ *
+ * Changes smaller than 0.1% are left for later, so linear ramps don't
+ * rebase the pacer on every packet.
+ */
+void
+rate_profile_pace(rate_profile_t *rp, tcpr_pacer_t *p, COUNTER units, u_int64_t start_ns, u_int64_t now_ns)
+{
+    double ns_per_unit;
+
+    assert(rp);
+    assert(p);
+
+    ns_per_unit = rate_profile_ns_per_unit(rp, rate_profile_rate(rp, now_ns > start_ns ? now_ns - start_ns : 0));
+    if (ns_per_unit > p->ns_per_unit * 1.001 || ns_per_unit < p->ns_per_unit * 0.999)
+        tcpr_pacer_set_rate(p, ns_per_unit, units);
+}
@@ -0,0 +1,56 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include "pacer.h"
+
+/*
+ * A rate profile is a list of points in time, each with a rate (in Mbps or
+ * packets/sec).  The rate holds from one point to the next, or changes
+ * linearly to that of the next point if the point is marked "linear".
+ * The rate of the last point holds forever, unless the profile repeats,
+ * in which case the last point only marks the end of the cycle.
+ */
+#define RATE_PROFILE_MAX_LINE 256
+
+typedef enum {
+    rate_profile_mbps,
+    rate_profile_pps,
+} rate_profile_units_t;
+
+typedef struct rate_profile_point_s {
+    u_int64_t at_ns; /* since the start of the replay */
+    double rate;
+    bool linear;
+} rate_profile_point_t;
+
+typedef struct rate_profile_s {
+    rate_profile_units_t units;
+    rate_profile_point_t *points;
+    int cnt;
+    bool repeat; /* start over once the last point is reached */
+} rate_profile_t;
+
+rate_profile_t *rate_profile_load(const char *path, char *ebuf, size_t len);
+void rate_profile_free(rate_profile_t *rp);
+double rate_profile_rate(const rate_profile_t *rp, u_int64_t elapsed_ns);
+double rate_profile_ns_per_unit(const rate_profile_t *rp, double rate);
+void rate_profile_pace(rate_profile_t *rp, tcpr_pacer_t *p, COUNTER units, u_int64_t start_ns, u_int64_t now_ns);
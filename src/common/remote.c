@@ -0,0 +1,665 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "remote.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#if defined HAVE_PTHREAD && defined HAVE_LIBCURL
+#define ENABLE_REMOTE
+#include <curl/curl.h>
+#include <pthread.h>
+
+/* CURLOPT_AWS_SIGV4 came with curl 7.75 */
+#if LIBCURL_VERSION_NUM >= 0x074b00
+#define ENABLE_REMOTE_SIGV4
+#endif
+#endif
+
+/**
+ * \brief true if path is a URL remote_open() takes
+ */
+bool
+remote_is_url(const char *path)
+{
+    assert(path);
+
+    return strncmp(path, "http://", 7) == 0 || strncmp(path, "https://", 8) == 0 || strncmp(path, "s3://", 5) == 0;
+}
+
+#ifdef ENABLE_REMOTE
+typedef struct remote_chunk_s {
+    u_int64_t offset;
+    u_int64_t len;
+    u_char *data;
+    bool ready;
+} remote_chunk_t;
+
+typedef struct remote_s {
+    char *path;    /* as given, for messages */
+    char *url;     /* what is fetched, s3:// made http */
+    char *userpwd; /* s3: the AWS keys, NULL if anonymous */
+    char *sigv4;
+    struct curl_slist *headers;
+    CURL *curl; /* of the thread writing to the pipe */
+    int out_fd; /* write end of the pipe */
+    u_int64_t size;
+    bool ranges; /* the server takes range requests */
+
+    remote_chunk_t *chunks;
+    COUNTER cnt;
+    COUNTER next_claim; /* next range for a worker to fetch */
+    COUNTER next_write; /* next range to write to the pipe */
+    COUNTER window;     /* max ranges fetched ahead of next_write */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool abort;
+} remote_t;
+
+/* where remote_write() puts what comes in */
+typedef struct remote_sink_s {
+    remote_t *r;
+    u_char *data; /* a range of len bytes, or NULL for the pipe */
+    size_t len;
+    size_t got;
+} remote_sink_t;
+
+static pthread_once_t remote_once = PTHREAD_ONCE_INIT;
+
+static void
+remote_init(void)
+{
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+}
+
+static bool
+remote_aborted(remote_t *r)
+{
+    return __atomic_load_n(&r->abort, __ATOMIC_RELAXED);
+}
+
+/**
+ * \brief write all of buf to the pipe
+ *
+ * Returns 0 or the errno of the failure.  EPIPE means the reader has
+ * closed its end, which isn't an error worth reporting
+ */
+static int
+remote_pipe(remote_t *r, const u_char *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        if ((ret = write(r->out_fd, buf, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EPIPE)
+                warnx("Unable to read %s: %s", r->path, strerror(errno));
+            return errno;
+        }
+
+        buf += ret;
+        len -= (size_t)ret;
+    }
+
+    return 0;
+}
+
+static size_t
+remote_write(char *ptr, size_t size, size_t nmemb, void *arg)
+{
+    remote_sink_t *sink = (remote_sink_t *)arg;
+    size_t len = size * nmemb;
+
+    if (remote_aborted(sink->r))
+        return 0;
+
+    if (sink->data == NULL)
+        return remote_pipe(sink->r, (u_char *)ptr, len) == 0 ? len : 0;
+
+    /* more than was asked for, the range was ignored */
+    if (sink->got + len > sink->len)
+        return 0;
+
+    memcpy(sink->data + sink->got, ptr, len);
+    sink->got += len;
+    return len;
+}
+
+static size_t
+remote_header(char *buf, size_t size, size_t nitems, void *arg)
+{
+    bool *ranges = (bool *)arg;
+    size_t len = size * nitems;
+    char line[64];
+
+    if (len < sizeof(line)) {
+        memcpy(line, buf, len);
+        line[len] = '\0';
+        if (strncasecmp(line, "accept-ranges:", 14) == 0 && strstr(line + 14, "bytes") != NULL)
+            *ranges = true;
+    }
+
+    return len;
+}
+
+/**
+ * \brief why a transfer failed, the HTTP status if it got that far
+ */
+static void
+remote_error(CURL *curl, CURLcode res, char *buf, size_t len)
+{
+    long code = 0;
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    if (res == CURLE_HTTP_RETURNED_ERROR && code != 0)
+        snprintf(buf, len, "HTTP status %ld", code);
+    else
+        snprintf(buf, len, "%s", curl_easy_strerror(res));
+}
+
+/**
+ * \brief the https URL of s3://bucket/key, and the AWS keys to sign with
+ */
+static bool
+remote_s3(remote_t *r, const char *path, char *ebuf)
+{
+    const char *bucket = path + 5;
+    const char *key = strchr(bucket, '/');
+    const char *endpoint = getenv("AWS_ENDPOINT_URL");
+    const char *region = getenv("AWS_REGION");
+    const char *id = getenv("AWS_ACCESS_KEY_ID");
+    const char *secret = getenv("AWS_SECRET_ACCESS_KEY");
+    const char *token = getenv("AWS_SESSION_TOKEN");
+    size_t len;
+
+    if (key == NULL || key == bucket || key[1] == '\0') {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: S3 URLs are s3://bucket/key", path);
+        return false;
+    }
+
+    if (region == NULL)
+        region = getenv("AWS_DEFAULT_REGION");
+    if (region == NULL)
+        region = "us-east-1";
+
+    len = strlen(path) + strlen(region) + (endpoint != NULL ? strlen(endpoint) : 0) + 64;
+    r->url = (char *)safe_malloc(len);
+    if (endpoint != NULL) {
+        /* MinIO and friends want the bucket in the path */
+        len = strlen(endpoint);
+        while (len > 0 && endpoint[len - 1] == '/')
+            len--;
+        snprintf(r->url, strlen(path) + len + 64, "%.*s/%.*s%s", (int)len, endpoint, (int)(key - bucket), bucket, key);
+    } else {
+        snprintf(r->url, len, "https://%.*s.s3.%s.amazonaws.com%s", (int)(key - bucket), bucket, region, key);
+    }
+
+    if (id == NULL || secret == NULL)
+        return true;
+
+#ifdef ENABLE_REMOTE_SIGV4
+    len = strlen(id) + strlen(secret) + 2;
+    r->userpwd = (char *)safe_malloc(len);
+    snprintf(r->userpwd, len, "%s:%s", id, secret);
+
+    len = strlen(region) + 16;
+    r->sigv4 = (char *)safe_malloc(len);
+    snprintf(r->sigv4, len, "aws:amz:%s:s3", region);
+
+    if (token != NULL) {
+        char *header;
+
+        len = strlen(token) + 32;
+        header = (char *)safe_malloc(len);
+        snprintf(header, len, "x-amz-security-token: %s", token);
+        r->headers = curl_slist_append(r->headers, header);
+        safe_free(header);
+    }
+
+    return true;
+#else
+    (void)token;
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: signing S3 requests needs libcurl 7.75 or later", path);
+    return false;
+#endif
+}
+
+static CURL *
+remote_easy(remote_t *r)
+{
+    CURL *curl;
+
+    if ((curl = curl_easy_init()) == NULL)
+        return NULL;
+
+    curl_easy_setopt(curl, CURLOPT_URL, r->url);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "tcpreplay/" VERSION);
+    /* a stalled connection is given up on, and the range asked for again */
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+    if (r->headers != NULL)
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, r->headers);
+#ifdef ENABLE_REMOTE_SIGV4
+    if (r->userpwd != NULL) {
+        curl_easy_setopt(curl, CURLOPT_USERPWD, r->userpwd);
+        curl_easy_setopt(curl, CURLOPT_AWS_SIGV4, r->sigv4);
+    }
+#endif
+
+    return curl;
+}
+
+static void
+remote_free(remote_t *r)
+{
+    if (r->curl != NULL)
+        curl_easy_cleanup(r->curl);
+    if (r->headers != NULL)
+        curl_slist_free_all(r->headers);
+    safe_free(r->sigv4);
+    safe_free(r->userpwd);
+    safe_free(r->url);
+    safe_free(r->path);
+    safe_free(r);
+}
+
+/**
+ * \brief fetch len bytes from offset into data, retrying a few times
+ */
+static bool
+remote_fetch(remote_t *r, CURL *curl, u_int64_t offset, u_int64_t len, u_char *data)
+{
+    char range[64], why[128];
+    remote_sink_t sink;
+    CURLcode res;
+    int tries;
+
+    snprintf(range, sizeof(range), "%" PRIu64 "-%" PRIu64, offset, offset + len - 1);
+    curl_easy_setopt(curl, CURLOPT_RANGE, range);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, remote_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+
+    for (tries = 1; !remote_aborted(r); tries++) {
+        memset(&sink, 0, sizeof(sink));
+        sink.r = r;
+        sink.data = data;
+        sink.len = (size_t)len;
+
+        res = curl_easy_perform(curl);
+        if (res == CURLE_OK && sink.got == len)
+            return true;
+
+        if (res == CURLE_OK)
+            snprintf(why, sizeof(why), "%zu of %" PRIu64 " bytes", sink.got, len);
+        else
+            remote_error(curl, res, why, sizeof(why));
+        dbgx(1, "Fetching bytes %s of %s, try %d: %s", range, r->path, tries, why);
+
+        if (tries == REMOTE_RETRIES) {
+            warnx("Unable to fetch %s: %s", r->path, why);
+            break;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * \brief fetching thread, takes the next range until there are none left
+ */
+static void *
+remote_worker(void *arg)
+{
+    remote_t *r = (remote_t *)arg;
+    CURL *curl;
+
+    pthread_mutex_lock(&r->lock);
+    if ((curl = remote_easy(r)) == NULL) {
+        warnx("Unable to fetch %s: %s", r->path, "out of memory");
+        r->abort = true;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+        return NULL;
+    }
+
+    for (;;) {
+        remote_chunk_t *c;
+        bool ok;
+
+        while (!r->abort && r->next_claim < r->cnt && r->next_claim >= r->next_write + r->window)
+            pthread_cond_wait(&r->cond, &r->lock);
+
+        if (r->abort || r->next_claim >= r->cnt)
+            break;
+
+        c = &r->chunks[r->next_claim++];
+        pthread_mutex_unlock(&r->lock);
+
+        c->data = (u_char *)safe_malloc((size_t)c->len);
+        ok = remote_fetch(r, curl, c->offset, c->len, c->data);
+
+        pthread_mutex_lock(&r->lock);
+        if (!ok)
+            r->abort = true;
+        c->ready = true;
+        pthread_cond_broadcast(&r->cond);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    curl_easy_cleanup(curl);
+    return NULL;
+}
+
+/**
+ * \brief the sidecar index of the file, if the server has one for it
+ */
+static pcap_index_t *
+remote_index(remote_t *r)
+{
+    char tmp[] = "/tmp/tcpreplay-idx-XXXXXX";
+    char ebuf[PCAP_ERRBUF_SIZE];
+    pcap_index_t *index = NULL;
+    char *url;
+    FILE *fp;
+    CURLcode res;
+    size_t len;
+    int fd;
+
+    if ((fd = mkstemp(tmp)) < 0)
+        return NULL;
+
+    if ((fp = fdopen(fd, "w")) == NULL) {
+        close(fd);
+        unlink(tmp);
+        return NULL;
+    }
+
+    len = strlen(r->url) + sizeof(PCAP_INDEX_SUFFIX);
+    url = (char *)safe_malloc(len);
+    snprintf(url, len, "%s%s", r->url, PCAP_INDEX_SUFFIX);
+
+    /* curl's own write function fwrite()s to fp */
+    curl_easy_setopt(r->curl, CURLOPT_URL, url);
+    curl_easy_setopt(r->curl, CURLOPT_WRITEFUNCTION, NULL);
+    curl_easy_setopt(r->curl, CURLOPT_WRITEDATA, fp);
+    res = curl_easy_perform(r->curl);
+    curl_easy_setopt(r->curl, CURLOPT_URL, r->url);
+    fclose(fp);
+
+    if (res == CURLE_OK && (index = pcap_index_read(tmp, NULL, ebuf)) == NULL)
+        dbgx(1, "Ignoring index of %s: %s", r->path, ebuf);
+
+    /* the mtime can't be checked, the size has to do */
+    if (index != NULL && index->pcap_size != r->size) {
+        dbgx(1, "Ignoring index of %s: it is of a file of %" PRIu64 " bytes", r->path, index->pcap_size);
+        pcap_index_free(index);
+        index = NULL;
+    }
+
+    unlink(tmp);
+    safe_free(url);
+    return index;
+}
+
+/**
+ * \brief cut the file into ranges, at the records listed in the index if any
+ */
+static void
+remote_plan(remote_t *r, const pcap_index_t *index)
+{
+    u_int64_t start = 0, want = REMOTE_FIRST_CHUNK;
+    COUNTER max = 0, e = 0;
+
+    while (start < r->size) {
+        u_int64_t end = start + want;
+
+        if (index != NULL) {
+            /* the first record at or past where the range would end, unless it is far off */
+            while (e < index->num_entries && index->entries[e].offset < end)
+                e++;
+            if (e < index->num_entries && index->entries[e].offset - start <= want * 2)
+                end = index->entries[e].offset;
+        }
+        if (end > r->size)
+            end = r->size;
+
+        if (r->cnt == max) {
+            max = max ? max * 2 : 64;
+            r->chunks = (remote_chunk_t *)safe_realloc(r->chunks, max * sizeof(remote_chunk_t));
+        }
+        memset(&r->chunks[r->cnt], 0, sizeof(remote_chunk_t));
+        r->chunks[r->cnt].offset = start;
+        r->chunks[r->cnt].len = end - start;
+        r->cnt++;
+
+        start = end;
+        want = REMOTE_CHUNK;
+    }
+}
+
+/**
+ * \brief fetch the ranges in parallel, writing them to the pipe in order
+ */
+static void
+remote_parallel(remote_t *r)
+{
+    pthread_t workers[REMOTE_STREAMS];
+    pcap_index_t *index;
+    int started = 0, t;
+    COUNTER i;
+
+    index = remote_index(r);
+    remote_plan(r, index);
+    dbgx(1,
+         "Fetching %s: %" PRIu64 " bytes in " COUNTER_SPEC " ranges%s",
+         r->path,
+         r->size,
+         r->cnt,
+         index != NULL ? " at record boundaries" : "");
+    if (index != NULL)
+        pcap_index_free(index);
+
+    r->window = REMOTE_STREAMS * 2;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->cond, NULL);
+
+    for (t = 0; t < REMOTE_STREAMS && (COUNTER)t < r->cnt; t++) {
+        if (pthread_create(&workers[t], NULL, remote_worker, r) != 0)
+            break;
+        started++;
+    }
+
+    if (started == 0)
+        warnx("Unable to fetch %s: %s", r->path, "no threads");
+
+    for (i = 0; started > 0 && i < r->cnt; i++) {
+        remote_chunk_t *c = &r->chunks[i];
+
+        pthread_mutex_lock(&r->lock);
+        while (!c->ready && !r->abort)
+            pthread_cond_wait(&r->cond, &r->lock);
+        pthread_mutex_unlock(&r->lock);
+
+        if (remote_aborted(r) || remote_pipe(r, c->data, (size_t)c->len) != 0)
+            break;
+
+        safe_free(c->data);
+        c->data = NULL;
+
+        pthread_mutex_lock(&r->lock);
+        r->next_write++;
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->lock);
+    }
+
+    pthread_mutex_lock(&r->lock);
+    r->abort = true;
+    pthread_cond_broadcast(&r->cond);
+    pthread_mutex_unlock(&r->lock);
+
+    for (t = 0; t < started; t++)
+        pthread_join(workers[t], NULL);
+
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->lock);
+
+    for (i = 0; i < r->cnt; i++)
+        safe_free(r->chunks[i].data);
+    safe_free(r->chunks);
+}
+
+/**
+ * \brief fetch the file in one request, straight to the pipe
+ */
+static void
+remote_stream(remote_t *r)
+{
+    remote_sink_t sink;
+    CURLcode res;
+    char why[128];
+
+    memset(&sink, 0, sizeof(sink));
+    sink.r = r;
+    curl_easy_setopt(r->curl, CURLOPT_WRITEFUNCTION, remote_write);
+    curl_easy_setopt(r->curl, CURLOPT_WRITEDATA, &sink);
+
+    /* a failed write to the pipe has been reported already */
+    if ((res = curl_easy_perform(r->curl)) != CURLE_OK && res != CURLE_WRITE_ERROR) {
+        remote_error(r->curl, res, why, sizeof(why));
+        warnx("Unable to fetch %s: %s", r->path, why);
+    }
+}
+
+static void *
+remote_thread(void *arg)
+{
+    remote_t *r = (remote_t *)arg;
+    sigset_t set;
+
+    /* if the reader goes away, we want EPIPE rather than SIGPIPE */
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (r->ranges && r->size > 0)
+        remote_parallel(r);
+    else
+        remote_stream(r);
+
+    close(r->out_fd);
+    remote_free(r);
+    return NULL;
+}
+#endif /* ENABLE_REMOTE */
+
+/**
+ * \brief open a URL for reading
+ *
+ * Returns a file descriptor the file can be read from, or -1 and fills in
+ * ebuf on error.  Closing the descriptor early is fine.
+ */
+int
+remote_open(const char *url, char *ebuf)
+{
+#ifdef ENABLE_REMOTE
+    pthread_attr_t attr;
+    pthread_t thread;
+    curl_off_t size = -1;
+    remote_t *r;
+    CURLcode res;
+    char why[128];
+    int fds[2];
+
+    assert(url);
+    assert(ebuf);
+
+    pthread_once(&remote_once, remote_init);
+
+    r = (remote_t *)safe_malloc(sizeof(remote_t));
+    r->path = safe_strdup(url);
+    if (strncmp(url, "s3://", 5) == 0) {
+        if (!remote_s3(r, url, ebuf))
+            goto fail;
+    } else {
+        r->url = safe_strdup(url);
+    }
+
+    if ((r->curl = remote_easy(r)) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: unable to start a transfer", url);
+        goto fail;
+    }
+
+    /* how big it is and whether it can be fetched in ranges, before saying it opened */
+    curl_easy_setopt(r->curl, CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(r->curl, CURLOPT_HEADERFUNCTION, remote_header);
+    curl_easy_setopt(r->curl, CURLOPT_HEADERDATA, &r->ranges);
+    if ((res = curl_easy_perform(r->curl)) != CURLE_OK) {
+        remote_error(r->curl, res, why, sizeof(why));
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", url, why);
+        goto fail;
+    }
+    curl_easy_getinfo(r->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &size);
+    curl_easy_setopt(r->curl, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(r->curl, CURLOPT_HEADERDATA, NULL);
+    curl_easy_setopt(r->curl, CURLOPT_HTTPGET, 1L);
+    r->size = size > 0 ? (u_int64_t)size : 0;
+
+    if (pipe(fds) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to create pipe: %s", strerror(errno));
+        goto fail;
+    }
+    decompress_grow_pipe(fds[0]);
+    r->out_fd = fds[1];
+
+    /* nobody waits for the thread, it cleans up after itself */
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, remote_thread, r) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start fetching thread");
+        pthread_attr_destroy(&attr);
+        close(fds[0]);
+        close(fds[1]);
+        goto fail;
+    }
+    pthread_attr_destroy(&attr);
+
+    return fds[0];
+
+fail:
+    remote_free(r);
+    return -1;
+#else
+    assert(url);
+    assert(ebuf);
+
+    snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: reading URLs requires libcurl and POSIX threads. See INSTALL.", url);
+    return -1;
+#endif
+}
@@ -0,0 +1,52 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include <stdbool.h>
+
+/*
+ * Reading pcap files from http://, https:// and s3:// URLs.
+ *
+ * Like a compressed file, the URL is read by a background thread into a
+ * pipe.  The file is fetched as ranges of REMOTE_CHUNK bytes, up to
+ * REMOTE_STREAMS at a time, and written to the pipe in order as each
+ * arrives, so reading can start once the first range is in.  If the
+ * server has a sidecar index for the file at <url>.idx, ranges are cut at
+ * the record offsets it lists.  Servers which don't say how big the file
+ * is are read in a single request.
+ *
+ * s3://bucket/key is fetched from AWS_ENDPOINT_URL if set, with the
+ * bucket in the path, otherwise from the bucket's virtual host in
+ * AWS_REGION.  Requests are signed with AWS_ACCESS_KEY_ID and
+ * AWS_SECRET_ACCESS_KEY (and AWS_SESSION_TOKEN) if set, and anonymous
+ * if not.
+ */
+
+/* ranges requested at once */
+#define REMOTE_STREAMS 8
+/* size of a range, the first being smaller so reading starts sooner */
+#define REMOTE_CHUNK (8 * 1024 * 1024)
+#define REMOTE_FIRST_CHUNK (1024 * 1024)
+/* times a range is asked for before giving up */
+#define REMOTE_RETRIES 3
+
+bool remote_is_url(const char *path);
+int remote_open(const char *url, char *ebuf);
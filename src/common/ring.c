@@ -0,0 +1,400 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Producers reserve slots by moving prod_head, with a CAS when there may
+ * be several of them, fill the slots, then publish them by moving
+ * prod_tail once every producer which reserved before them has published.
+ * The consumer copies out up to prod_tail and then moves cons_tail, which
+ * hands the slots back.  Indices are free running 32 bit counters, so
+ * head - tail is the number of slots in use even across a wrap.
+ *
+ * A waiting side sleeps on the index the other side moves, prod_tail or
+ * cons_tail, which is what makes it a futex word.  It announces itself in
+ * prod_waiting or cons_waiting first, so the other side only pays for a
+ * wake up system call when someone is asleep.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_RINGS /* see memstat.h */
+
+#include "ring.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_LINUX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/* polls of a full or empty ring before yielding or sleeping */
+#define TCPR_RING_SPINS 128
+/* longest futex sleep, so an abort flag is still noticed */
+#define TCPR_RING_SLEEP_NS 1000000
+
+#if defined __x86_64__ || defined __i386__
+#define TCPR_RING_RELAX() __builtin_ia32_pause()
+#elif defined __aarch64__
+#define TCPR_RING_RELAX() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define TCPR_RING_RELAX() __asm__ __volatile__("" ::: "memory")
+#endif
+
+static const char *tcpr_ring_wait_names[] = {"spin", "yield", "futex"};
+
+/* size rounded up to a power of two, 0 if it is out of range */
+static u_int32_t
+ring_pow2(u_int32_t size)
+{
+    u_int32_t pow2 = 1;
+
+    if (size == 0 || size > TCPR_RING_SIZE_MAX)
+        return 0;
+    while (pow2 < size)
+        pow2 <<= 1;
+
+    return pow2;
+}
+
+/**
+ * \brief bytes tcpr_ring_init() needs for a ring of size descriptors of
+ * elt_size bytes each, 0 if size is out of range
+ */
+size_t
+tcpr_ring_memsize(u_int32_t size, u_int32_t elt_size)
+{
+    u_int32_t pow2 = ring_pow2(size);
+
+    if (pow2 == 0)
+        return 0;
+
+    return sizeof(tcpr_ring_t) + (size_t)pow2 * elt_size;
+}
+
+/**
+ * \brief lay out a ring in mem, which holds tcpr_ring_memsize() bytes
+ *
+ * size is rounded up to a power of two.  flags is 0 or TCPR_RING_MP, and
+ * TCPR_RING_SHARED when mem is shared with other processes.
+ */
+tcpr_ring_t *
+tcpr_ring_init(void *mem, u_int32_t size, u_int32_t elt_size, int flags, tcpr_ring_wait_t wait)
+{
+    tcpr_ring_t *r = mem;
+    u_int32_t pow2 = ring_pow2(size);
+
+    assert(mem);
+    assert(elt_size > 0);
+
+    if (pow2 == 0)
+        return NULL;
+
+    memset(r, 0, sizeof(*r));
+    r->size = pow2;
+    r->mask = pow2 - 1;
+    r->elt_size = elt_size;
+    r->flags = flags;
+    r->wait = wait;
+
+    return r;
+}
+
+/**
+ * \brief create a ring of size descriptors of elt_size bytes each
+ *
+ * size is rounded up to a power of two.  flags is 0 or TCPR_RING_MP.
+ */
+tcpr_ring_t *
+tcpr_ring_new(u_int32_t size, u_int32_t elt_size, int flags, tcpr_ring_wait_t wait)
+{
+    size_t memsize;
+
+    assert(elt_size > 0);
+
+    if ((memsize = tcpr_ring_memsize(size, elt_size)) == 0)
+        return NULL;
+
+    return tcpr_ring_init(safe_malloc(memsize), size, elt_size, flags, wait);
+}
+
+void
+tcpr_ring_free(tcpr_ring_t *r)
+{
+    if (r == NULL)
+        return;
+
+    safe_free(r);
+}
+
+#if defined HAVE_LINUX && defined SYS_futex
+static void
+ring_futex_wait(const tcpr_ring_t *r, u_int32_t *word, u_int32_t seen)
+{
+    struct timespec nap = {0, TCPR_RING_SLEEP_NS};
+
+    syscall(SYS_futex, word, (r->flags & TCPR_RING_SHARED) ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE, seen, &nap, NULL, 0);
+}
+
+static void
+ring_futex_wake(const tcpr_ring_t *r, u_int32_t *word)
+{
+    syscall(SYS_futex, word, (r->flags & TCPR_RING_SHARED) ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+#define TCPR_RING_HAVE_FUTEX 1
+#endif
+
+/**
+ * \brief wait for *word to move on from seen, as the ring was asked to
+ */
+static void
+ring_wait(tcpr_ring_t *r, u_int32_t *word, u_int32_t seen, u_int32_t *waiting, int *spins)
+{
+    if (r->wait == TCPR_RING_SPIN || ++*spins < TCPR_RING_SPINS) {
+        TCPR_RING_RELAX();
+        return;
+    }
+    *spins = 0;
+
+#ifdef TCPR_RING_HAVE_FUTEX
+    if (r->wait == TCPR_RING_FUTEX) {
+        /* pairs with the seq_cst store of word then load of waiting in ring_wake() */
+        __atomic_store_n(waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(word, __ATOMIC_SEQ_CST) == seen)
+            ring_futex_wait(r, word, seen);
+        __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+        return;
+    }
+#else
+    (void)word;
+    (void)seen;
+    (void)waiting;
+#endif
+
+    sched_yield();
+}
+
+/**
+ * \brief publish *word and wake whoever sleeps on it
+ */
+static inline void
+ring_wake(tcpr_ring_t *r, u_int32_t *word, u_int32_t value, u_int32_t *waiting)
+{
+#ifdef TCPR_RING_HAVE_FUTEX
+    if (r->wait == TCPR_RING_FUTEX) {
+        __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(waiting, __ATOMIC_SEQ_CST))
+            ring_futex_wake(r, word);
+        return;
+    }
+#else
+    (void)r;
+    (void)waiting;
+#endif
+
+    __atomic_store_n(word, value, __ATOMIC_RELEASE);
+}
+
+/**
+ * \brief copy n descriptors between elts and the ring starting at slot index
+ */
+static inline void
+ring_copy_in(tcpr_ring_t *r, u_int32_t index, const void *elts, u_int32_t n)
+{
+    u_int32_t first = index & r->mask;
+    u_int32_t part = r->size - first < n ? r->size - first : n;
+
+    memcpy(TCPR_RING_ELTS(r) + (size_t)first * r->elt_size, elts, (size_t)part * r->elt_size);
+    if (part < n)
+        memcpy(TCPR_RING_ELTS(r), (const u_char *)elts + (size_t)part * r->elt_size, (size_t)(n - part) * r->elt_size);
+}
+
+static inline void
+ring_copy_out(const tcpr_ring_t *r, u_int32_t index, void *elts, u_int32_t n)
+{
+    u_int32_t first = index & r->mask;
+    u_int32_t part = r->size - first < n ? r->size - first : n;
+
+    memcpy(elts, TCPR_RING_ELTS(r) + (size_t)first * r->elt_size, (size_t)part * r->elt_size);
+    if (part < n)
+        memcpy((u_char *)elts + (size_t)part * r->elt_size, TCPR_RING_ELTS(r), (size_t)(n - part) * r->elt_size);
+}
+
+/**
+ * \brief queue up to n descriptors without waiting
+ *
+ * Returns how many were queued, 0 when the ring is full.
+ */
+u_int32_t
+tcpr_ring_enqueue(tcpr_ring_t *r, const void *elts, u_int32_t n)
+{
+    u_int32_t head, cnt;
+    int spins = 0;
+
+    assert(r);
+
+    if (r->flags & TCPR_RING_MP) {
+        head = __atomic_load_n(&r->prod_head, __ATOMIC_RELAXED);
+        do {
+            u_int32_t room = r->size - (head - __atomic_load_n(&r->cons_tail, __ATOMIC_ACQUIRE));
+
+            cnt = room < n ? room : n;
+            if (cnt == 0)
+                return 0;
+        } while (!__atomic_compare_exchange_n(&r->prod_head,
+                                              &head,
+                                              head + cnt,
+                                              true,
+                                              __ATOMIC_ACQUIRE,
+                                              __ATOMIC_RELAXED));
+    } else {
+        u_int32_t room;
+
+        head = r->prod_head;
+        room = r->size - (head - __atomic_load_n(&r->cons_tail, __ATOMIC_ACQUIRE));
+        cnt = room < n ? room : n;
+        if (cnt == 0)
+            return 0;
+        r->prod_head = head + cnt;
+    }
+
+    ring_copy_in(r, head, elts, cnt);
+
+    /* slots are published in the order they were reserved */
+    while (__atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE) != head) {
+        if (++spins < TCPR_RING_SPINS) {
+            TCPR_RING_RELAX();
+        } else {
+            spins = 0;
+            sched_yield();
+        }
+    }
+    ring_wake(r, &r->prod_tail, head + cnt, &r->cons_waiting);
+
+    return cnt;
+}
+
+/**
+ * \brief queue all n descriptors, waiting for room as needed
+ *
+ * Gives up if *abort becomes true, abort may be NULL.  Returns how many
+ * were queued, n unless aborted.
+ */
+u_int32_t
+tcpr_ring_enqueue_wait(tcpr_ring_t *r, const void *elts, u_int32_t n, const volatile bool *abort)
+{
+    u_int32_t done = 0;
+    int spins = 0;
+
+    while (done < n) {
+        u_int32_t tail = __atomic_load_n(&r->cons_tail, __ATOMIC_ACQUIRE);
+        u_int32_t cnt = tcpr_ring_enqueue(r, (const u_char *)elts + (size_t)done * r->elt_size, n - done);
+
+        if (cnt != 0) {
+            done += cnt;
+            spins = 0;
+            continue;
+        }
+        if (abort != NULL && *abort)
+            break;
+
+        ring_wait(r, &r->cons_tail, tail, &r->prod_waiting, &spins);
+    }
+
+    return done;
+}
+
+/**
+ * \brief copy out up to max descriptors without waiting
+ *
+ * Only one thread may dequeue.  Returns how many were dequeued, 0 when
+ * the ring is empty.
+ */
+u_int32_t
+tcpr_ring_dequeue(tcpr_ring_t *r, void *elts, u_int32_t max)
+{
+    u_int32_t tail, cnt;
+
+    assert(r);
+
+    tail = r->cons_tail;
+    cnt = __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE) - tail;
+    if (cnt > max)
+        cnt = max;
+    if (cnt == 0)
+        return 0;
+
+    ring_copy_out(r, tail, elts, cnt);
+    ring_wake(r, &r->cons_tail, tail + cnt, &r->prod_waiting);
+
+    return cnt;
+}
+
+/**
+ * \brief copy out between 1 and max descriptors, waiting for the first
+ *
+ * Returns 0 only once the ring is closed and empty.
+ */
+u_int32_t
+tcpr_ring_dequeue_wait(tcpr_ring_t *r, void *elts, u_int32_t max)
+{
+    int spins = 0;
+
+    for (;;) {
+        u_int32_t head = __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE);
+        u_int32_t cnt = tcpr_ring_dequeue(r, elts, max);
+
+        if (cnt != 0)
+            return cnt;
+
+        /* whatever was queued before closing comes out first */
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE))
+            return tcpr_ring_dequeue(r, elts, max);
+
+        ring_wait(r, &r->prod_tail, head, &r->cons_waiting, &spins);
+    }
+}
+
+/**
+ * \brief no more descriptors will be queued
+ *
+ * The consumer still gets what is queued, then tcpr_ring_dequeue_wait()
+ * returns 0.
+ */
+void
+tcpr_ring_close(tcpr_ring_t *r)
+{
+    __atomic_store_n(&r->closed, true, __ATOMIC_RELEASE);
+#ifdef TCPR_RING_HAVE_FUTEX
+    if (r->wait == TCPR_RING_FUTEX && __atomic_load_n(&r->cons_waiting, __ATOMIC_SEQ_CST))
+        ring_futex_wake(r, &r->prod_tail);
+#endif
+}
+
+/**
+ * \brief name of a wait strategy: spin, yield or futex
+ */
+const char *
+tcpr_ring_wait_name(tcpr_ring_wait_t wait)
+{
+    return tcpr_ring_wait_names[wait];
+}
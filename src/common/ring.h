@@ -0,0 +1,111 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+/*
+ * Lock-free bounded ring of fixed size descriptors, for handing packets
+ * from one pipeline stage to the next.
+ *
+ * There is exactly one consumer, and either one producer or, with
+ * TCPR_RING_MP, any number of them.  Descriptors are copied in and out
+ * whole, in batches, so a stage pays for the shared indices once per
+ * batch rather than once per packet.  The order of descriptors is kept
+ * per producer.
+ *
+ * When a ring is full or empty the _wait() calls spin, yield the CPU or
+ * sleep on a futex, as the ring was created with.
+ *
+ * The descriptors follow the tcpr_ring_t in one block, so a ring made
+ * with tcpr_ring_init() in memory shared between processes works from
+ * each of them at whatever address it is mapped.
+ */
+
+/* largest number of descriptors in a ring */
+#define TCPR_RING_SIZE_MAX (1U << 30)
+
+/* more than one thread enqueues */
+#define TCPR_RING_MP 0x1
+/* the ring is in memory shared between processes, so futexes can't be private */
+#define TCPR_RING_SHARED 0x2
+
+typedef enum {
+    TCPR_RING_SPIN,  /* poll, lowest latency, burns a CPU */
+    TCPR_RING_YIELD, /* poll, but give up the CPU after a while */
+    TCPR_RING_FUTEX, /* poll a while, then sleep until woken (yields where there are no futexes) */
+} tcpr_ring_wait_t;
+
+typedef struct tcpr_ring_s {
+    /* written by producers */
+    u_int32_t prod_head __attribute__((aligned(64))); /* next slot reserved */
+    u_int32_t prod_tail;                              /* slots before it may be dequeued */
+    u_int32_t prod_waiting;
+    /* written by the consumer */
+    u_int32_t cons_tail __attribute__((aligned(64))); /* slots before it may be enqueued again */
+    u_int32_t cons_waiting;
+    bool closed;
+    /* read only */
+    u_int32_t size __attribute__((aligned(64))); /* a power of two */
+    u_int32_t mask;
+    u_int32_t elt_size;
+    int flags;
+    tcpr_ring_wait_t wait;
+} tcpr_ring_t;
+
+/* the descriptors, right after the ring */
+#define TCPR_RING_ELTS(r) ((u_char *)((r) + 1))
+
+size_t tcpr_ring_memsize(u_int32_t size, u_int32_t elt_size);
+tcpr_ring_t *tcpr_ring_init(void *mem, u_int32_t size, u_int32_t elt_size, int flags, tcpr_ring_wait_t wait);
+tcpr_ring_t *tcpr_ring_new(u_int32_t size, u_int32_t elt_size, int flags, tcpr_ring_wait_t wait);
+void tcpr_ring_free(tcpr_ring_t *r);
+u_int32_t tcpr_ring_enqueue(tcpr_ring_t *r, const void *elts, u_int32_t n);
+u_int32_t tcpr_ring_enqueue_wait(tcpr_ring_t *r, const void *elts, u_int32_t n, const volatile bool *abort);
+u_int32_t tcpr_ring_dequeue(tcpr_ring_t *r, void *elts, u_int32_t max);
+u_int32_t tcpr_ring_dequeue_wait(tcpr_ring_t *r, void *elts, u_int32_t max);
+void tcpr_ring_close(tcpr_ring_t *r);
+const char *tcpr_ring_wait_name(tcpr_ring_wait_t wait);
+
+/**
+ * \brief descriptors queued and not yet dequeued
+ */
+static inline u_int32_t
+tcpr_ring_count(const tcpr_ring_t *r)
+{
+    return __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE) - __atomic_load_n(&r->cons_tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * \brief the next descriptor the consumer will dequeue, NULL when empty
+ *
+ * Only safe for the single producer of a ring: the consumer may dequeue
+ * it meanwhile, but no one can overwrite it.
+ */
+static inline const void *
+tcpr_ring_oldest(const tcpr_ring_t *r)
+{
+    u_int32_t tail = __atomic_load_n(&r->cons_tail, __ATOMIC_ACQUIRE);
+
+    if (tail == __atomic_load_n(&r->prod_tail, __ATOMIC_ACQUIRE))
+        return NULL;
+
+    return TCPR_RING_ELTS(r) + (size_t)(tail & r->mask) * r->elt_size;
+}
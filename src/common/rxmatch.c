@@ -0,0 +1,588 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "rxmatch.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "flows.h"
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ENABLE_RXMATCH
+
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+/* how long the reader waits for packets before looking at stop */
+#define RXMATCH_POLL_MS 10
+/* enough for VLAN tags, IPv6 extension headers and TCP options before the payload */
+#define RXMATCH_SNAPLEN 256
+#define RXMATCH_BUFSIZE (64 * 1024 * 1024)
+
+/*
+ * Header fields a router, switch or firewall forwards as they are.  Not
+ * the MACs, VLAN tags, TTL, addresses (--unique-ip, NAT) or checksums.
+ * Whole words, as flow_hash_words() wants them.
+ */
+typedef struct rxmatch_key_s {
+    u_int16_t ip_len;  /* IPv4 total length, IPv6 payload length */
+    u_int8_t ip_v;
+    u_int8_t proto;
+    u_int32_t ip_id;   /* IPv4 id and fragment offset, IPv6 flow label */
+    u_int16_t sport;
+    u_int16_t dport;
+    u_int32_t seq;     /* TCP */
+    u_int32_t ack;
+    u_int32_t pad;
+    u_char payload[16];
+} rxmatch_key_t;
+
+/**
+ * \brief signature of a packet to know it by when it comes back
+ *
+ * A hash of the IP length, id or flow label and protocol, the ports, TCP
+ * sequence numbers and up to 16 bytes of payload.  0 if the packet isn't
+ * IP, which isn't tracked.
+ */
+u_int32_t
+rxmatch_sig(const u_char *data, u_int32_t caplen, int dlt)
+{
+    const u_char *end = data + caplen;
+    const u_char *l3, *l4 = NULL, *l3_end;
+    uint32_t _U_ vlan_offset;
+    uint32_t l2offset, l2len;
+    uint16_t ether_type;
+    rxmatch_key_t key;
+    u_int64_t hv;
+    size_t n;
+
+    if (get_l2len_protocol(data, caplen, dlt, &ether_type, &l2len, &l2offset, &vlan_offset) < 0)
+        return 0;
+
+    memset(&key, 0, sizeof(key));
+    l3 = data + l2len;
+
+    switch (ether_type) {
+    case ETHERTYPE_IP: {
+        ipv4_hdr_t ip;
+
+        if (l3 + TCPR_IPV4_H > end)
+            return 0;
+        memcpy(&ip, l3, TCPR_IPV4_H);
+        if (ip.ip_hl < 5)
+            return 0;
+        key.ip_v = 4;
+        key.ip_len = ip.ip_len;
+        key.ip_id = (u_int32_t)ip.ip_id << 16 | ip.ip_off;
+        key.proto = ip.ip_p;
+        l3_end = l3 + ntohs(ip.ip_len);
+        if ((ntohs(ip.ip_off) & IP_OFFMASK) == 0)
+            l4 = l3 + (ip.ip_hl << 2);
+        break;
+    }
+
+    case ETHERTYPE_IP6: {
+        ipv6_hdr_t ip6;
+
+        if (l3 + TCPR_IPV6_H > end)
+            return 0;
+        memcpy(&ip6, l3, TCPR_IPV6_H);
+        key.ip_v = 6;
+        key.ip_len = ip6.ip_len;
+        memcpy(&key.ip_id, ip6.ip_flags, sizeof(key.ip_id));
+        key.ip_id &= htonl(0x000fffff);
+        l3_end = l3 + TCPR_IPV6_H + ntohs(ip6.ip_len);
+        l4 = get_layer4_v6_proto((const ipv6_hdr_t *)l3, end, &key.proto);
+        break;
+    }
+
+    default:
+        return 0;
+    }
+
+    /* the rest is left to the capture, which may be short or padded */
+    if (l3_end > end)
+        l3_end = end;
+
+    if (l4 != NULL && l4 < l3_end) {
+        const u_char *payload = l4;
+
+        if (key.proto == IPPROTO_TCP && l4 + TCPR_TCP_H <= l3_end) {
+            tcp_hdr_t tcp;
+
+            memcpy(&tcp, l4, TCPR_TCP_H);
+            key.sport = tcp.th_sport;
+            key.dport = tcp.th_dport;
+            key.seq = tcp.th_seq;
+            key.ack = tcp.th_ack;
+            payload = l4 + (tcp.th_off << 2);
+        } else if (key.proto == IPPROTO_UDP && l4 + TCPR_UDP_H <= l3_end) {
+            udp_hdr_t udp;
+
+            memcpy(&udp, l4, TCPR_UDP_H);
+            key.sport = udp.uh_sport;
+            key.dport = udp.uh_dport;
+            payload = l4 + TCPR_UDP_H;
+        }
+
+        if (payload < l3_end) {
+            n = min((size_t)(l3_end - payload), sizeof(key.payload));
+            memcpy(key.payload, payload, n);
+        }
+    }
+
+    hv = flow_hash_words(&key, sizeof(key), 0);
+    hv ^= hv >> 32;
+
+    return (u_int32_t)hv != 0 ? (u_int32_t)hv : 1;
+}
+
+/**
+ * \brief open device to capture what comes back, with room for window sends
+ *
+ * window is rounded up to a power of two.  Returns NULL with the error in
+ * ebuf, of PCAP_ERRBUF_SIZE, on failure.
+ */
+rxmatch_t *
+rxmatch_open(const char *device, u_int32_t window, char *ebuf)
+{
+    rxmatch_t *rm;
+    pcap_t *pcap;
+    u_int32_t pow2 = 1;
+
+    assert(device);
+    assert(ebuf);
+
+    if (window == 0 || window > RXMATCH_WINDOW_MAX) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "--rx-window must be between 1 and %u", RXMATCH_WINDOW_MAX);
+        return NULL;
+    }
+    while (pow2 < window)
+        pow2 <<= 1;
+
+#ifdef HAVE_PCAP_SET_TSTAMP_PRECISION
+    /* on Linux libpcap reads a TPACKET_V3 ring, so packets come in blocks without a copy */
+    if ((pcap = pcap_create(device, ebuf)) == NULL)
+        return NULL;
+    pcap_set_snaplen(pcap, RXMATCH_SNAPLEN);
+    pcap_set_promisc(pcap, 1);
+    pcap_set_timeout(pcap, RXMATCH_POLL_MS);
+    pcap_set_buffer_size(pcap, RXMATCH_BUFSIZE);
+    pcap_set_tstamp_precision(pcap, PCAP_TSTAMP_PRECISION_NANO);
+    if (pcap_activate(pcap) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to capture on %s: %s", device, pcap_geterr(pcap));
+        pcap_close(pcap);
+        return NULL;
+    }
+    /* not what we send, when it is the interface sent on */
+    pcap_setdirection(pcap, PCAP_D_IN);
+#else
+    if ((pcap = pcap_open_live(device, RXMATCH_SNAPLEN, 1, RXMATCH_POLL_MS, ebuf)) == NULL)
+        return NULL;
+#endif
+
+#ifdef HAVE_PCAP_SETNONBLOCK
+    /* we poll() before reading, pcap_dispatch() must not block once the ring is empty */
+    if (pcap_setnonblock(pcap, 1, ebuf) < 0) {
+        pcap_close(pcap);
+        return NULL;
+    }
+#endif
+
+    rm = safe_malloc(sizeof(rxmatch_t));
+    rm->rec = safe_malloc(sizeof(rxmatch_rec_t) * pow2);
+    rm->index = safe_malloc(sizeof(u_int32_t) * pow2 * 2);
+    rm->mask = pow2 - 1;
+    rm->index_mask = pow2 * 2 - 1;
+    rm->device = device;
+    rm->pcap = pcap;
+    rm->dlt = pcap_datalink(pcap);
+#ifdef HAVE_PCAP_SET_TSTAMP_PRECISION
+    rm->nsec = pcap_get_tstamp_precision(pcap) == PCAP_TSTAMP_PRECISION_NANO;
+#endif
+
+    return rm;
+}
+
+/**
+ * \brief take the offset of the capture clock, right before reading
+ */
+static void
+rxmatch_clock_sync(rxmatch_t *rm)
+{
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec real;
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    rm->dispatch_ns = tcpr_clock_ns();
+    rm->clock_offset = (int64_t)(TIMESPEC_TO_NANOSEC(&real) - rm->dispatch_ns);
+#else
+    struct timeval real;
+
+    gettimeofday(&real, NULL);
+    rm->dispatch_ns = tcpr_clock_ns();
+    rm->clock_offset = (int64_t)(TIMEVAL_TO_NANOSEC(&real) - rm->dispatch_ns);
+#endif
+}
+
+/**
+ * \brief note probe sequence number seq came in
+ *
+ * Returns false if it had already, within RXMATCH_PROBE_HISTORY.
+ */
+static bool
+rxmatch_probe_seq(rxmatch_t *rm, u_int32_t seq)
+{
+    int32_t ahead = (int32_t)(seq - rm->probe_max_seq);
+
+    if (rm->probe_received == 0 || ahead > 0) {
+        u_int32_t s;
+
+        if (rm->probe_received == 0 || ahead >= RXMATCH_PROBE_HISTORY)
+            memset(rm->probe_seen, 0, sizeof(rm->probe_seen));
+        else
+            for (s = rm->probe_max_seq + 1; s != seq; s++)
+                rm->probe_seen[(s / 64) % (RXMATCH_PROBE_HISTORY / 64)] &= ~(1ULL << (s % 64));
+        rm->probe_max_seq = seq;
+    } else if (-ahead < RXMATCH_PROBE_HISTORY) {
+        if (rm->probe_seen[(seq / 64) % (RXMATCH_PROBE_HISTORY / 64)] & (1ULL << (seq % 64)))
+            return false;
+        rm->probe_reordered++;
+    } else {
+        /* too late to tell */
+        rm->probe_reordered++;
+        return true;
+    }
+
+    rm->probe_seen[(seq / 64) % (RXMATCH_PROBE_HISTORY / 64)] |= 1ULL << (seq % 64);
+    return true;
+}
+
+/**
+ * \brief account for a packet if it's one of our probes
+ *
+ * Returns true if it was.
+ */
+static bool
+rxmatch_probe(rxmatch_t *rm, const struct pcap_pkthdr *pkthdr, const u_char *data)
+{
+    const u_char *end = data + pkthdr->caplen;
+    const u_char *l3, *l4;
+    uint32_t _U_ vlan_offset;
+    uint32_t l2offset, l2len;
+    uint16_t ether_type;
+    tcpr_probe_payload_t probe;
+    ipv4_hdr_t ip;
+    udp_hdr_t udp;
+    u_int64_t tx_ns, rx_ns;
+    int64_t transit, delta;
+
+    if (get_l2len_protocol(data, pkthdr->caplen, rm->dlt, &ether_type, &l2len, &l2offset, &vlan_offset) < 0 ||
+        ether_type != ETHERTYPE_IP)
+        return false;
+
+    l3 = data + l2len;
+    if (l3 + TCPR_IPV4_H > end)
+        return false;
+    memcpy(&ip, l3, TCPR_IPV4_H);
+    if (ip.ip_p != IPPROTO_UDP || ip.ip_hl < 5 || (ntohs(ip.ip_off) & IP_OFFMASK) != 0)
+        return false;
+
+    l4 = l3 + (ip.ip_hl << 2);
+    if (l4 + TCPR_UDP_H + sizeof(probe) > end)
+        return false;
+    memcpy(&udp, l4, TCPR_UDP_H);
+    memcpy(&probe, l4 + TCPR_UDP_H, sizeof(probe));
+    if (udp.uh_dport != htons(rm->probe_port) || probe.magic != htonl(TCPR_PROBE_MAGIC))
+        return false;
+
+    if (!rxmatch_probe_seq(rm, ntohl(probe.seq))) {
+        rm->probe_duplicated++;
+        return true;
+    }
+    rm->probe_received++;
+
+    /* both on the system clock */
+    tx_ns = (u_int64_t)ntohl(probe.tx_sec) * 1000000000 + ntohl(probe.tx_nsec);
+    if (pkthdr->ts.tv_sec != 0)
+        rx_ns = (u_int64_t)pkthdr->ts.tv_sec * 1000000000 + (u_int64_t)pkthdr->ts.tv_usec * (rm->nsec ? 1 : 1000);
+    else
+        rx_ns = rm->dispatch_ns + (u_int64_t)rm->clock_offset;
+    transit = (int64_t)(rx_ns - tx_ns);
+    tcpr_hist_add(&rm->probe_latency, transit > 0 ? (u_int64_t)transit : 0);
+
+    if (rm->probe_received > 1) {
+        delta = transit - rm->probe_transit;
+        if (delta < 0)
+            delta = -delta;
+        tcpr_hist_add(&rm->probe_delta, (u_int64_t)delta);
+        rm->probe_jitter += ((double)delta - rm->probe_jitter) / 16.0;
+    }
+    rm->probe_transit = transit;
+
+    return true;
+}
+
+/**
+ * \brief match one captured packet to the oldest send it can be
+ */
+static void
+rxmatch_got(u_char *arg, const struct pcap_pkthdr *pkthdr, const u_char *data)
+{
+    rxmatch_t *rm = (rxmatch_t *)arg;
+    u_int32_t sig, i, best = 0;
+    rxmatch_rec_t *rec;
+    u_int64_t tx_ns, rx_ns;
+    bool back = false;
+    int p;
+
+    if (rm->probe_port != 0 && rxmatch_probe(rm, pkthdr, data))
+        return;
+
+    if ((sig = rxmatch_sig(data, pkthdr->caplen, rm->dlt)) == 0) {
+        rm->other++;
+        return;
+    }
+
+    i = sig & rm->index_mask;
+    for (p = 0; p < RXMATCH_PROBES; p++, i = (i + 1) & rm->index_mask) {
+        u_int32_t e = __atomic_load_n(&rm->index[i], __ATOMIC_ACQUIRE);
+        u_int32_t state;
+
+        /* slots fill in probe order and never empty again */
+        if (e == 0)
+            break;
+
+        rec = &rm->rec[e & rm->mask];
+        state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if ((state & RXMATCH_SEQ_MASK) != e || __atomic_load_n(&rec->sig, __ATOMIC_RELAXED) != sig)
+            continue;
+        /* the signature was the send's if state didn't change meanwhile */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&rec->state, __ATOMIC_RELAXED) != state)
+            continue;
+
+        if (state & RXMATCH_MATCHED)
+            back = true;
+        else if (best == 0 || rxmatch_seq_before(e, best))
+            best = e;
+    }
+
+    if (best == 0) {
+        if (back)
+            rm->duplicated++;
+        else
+            rm->unknown++;
+        return;
+    }
+
+    rec = &rm->rec[best & rm->mask];
+    tx_ns = __atomic_load_n(&rec->tx_ns, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!__atomic_compare_exchange_n(&rec->state, &best, best | RXMATCH_MATCHED, false, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_RELAXED)) {
+        /* the record went to a later send just now */
+        rm->unknown++;
+        return;
+    }
+
+    rm->received++;
+    if (rm->max_seq != 0 && rxmatch_seq_before(best, rm->max_seq))
+        rm->reordered++;
+    else
+        rm->max_seq = best;
+
+    /* on the tcpr_clock_ns() clock, and no later than it was read */
+    rx_ns = rm->dispatch_ns;
+    if (pkthdr->ts.tv_sec != 0) {
+        u_int64_t ts = (u_int64_t)pkthdr->ts.tv_sec * 1000000000 +
+                       (u_int64_t)pkthdr->ts.tv_usec * (rm->nsec ? 1 : 1000);
+
+        if (ts - (u_int64_t)rm->clock_offset < rx_ns)
+            rx_ns = ts - (u_int64_t)rm->clock_offset;
+    }
+    tcpr_hist_add(&rm->latency, rx_ns > tx_ns ? rx_ns - tx_ns : 0);
+}
+
+static void *
+rxmatch_reader(void *arg)
+{
+    rxmatch_t *rm = arg;
+    struct pollfd pfd;
+    bool last = false;
+
+    pfd.fd = pcap_fileno(rm->pcap);
+    pfd.events = POLLIN;
+
+    while (!last) {
+        int ready;
+
+        /* one more read after stop, for what came in while deciding to */
+        last = rm->stop;
+        pfd.revents = 0;
+        ready = poll(&pfd, 1, last ? 0 : RXMATCH_POLL_MS);
+        if (ready < 0 && errno != EINTR) {
+            snprintf(rm->err, sizeof(rm->err), "poll() on %s: %s", rm->device, strerror(errno));
+            break;
+        }
+
+        /* a TPACKET_V3 block may be ready a while before poll() says so */
+        rxmatch_clock_sync(rm);
+        if (pcap_dispatch(rm->pcap, -1, rxmatch_got, (u_char *)rm) < 0) {
+            snprintf(rm->err, sizeof(rm->err), "Error reading %s: %s", rm->device, pcap_geterr(rm->pcap));
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief start the reader thread for a replay
+ *
+ * Returns 0 on success, -1 with the error in ebuf.
+ */
+int
+rxmatch_start(rxmatch_t *rm, char *ebuf)
+{
+    assert(rm);
+
+    if (rm->running)
+        return 0;
+
+    rm->stop = false;
+    if (pthread_create(&rm->reader, NULL, rxmatch_reader, rm) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start the RX reader for %s", rm->device);
+        return -1;
+    }
+
+    rm->running = true;
+    return 0;
+}
+
+/**
+ * \brief give the last packets wait_ms to come back and stop the reader
+ */
+void
+rxmatch_stop(rxmatch_t *rm, u_int32_t wait_ms)
+{
+    struct timespec nap;
+
+    if (rm == NULL || !rm->running)
+        return;
+
+    nap.tv_sec = wait_ms / 1000;
+    nap.tv_nsec = (long)(wait_ms % 1000) * 1000000;
+    while (nanosleep(&nap, &nap) < 0 && errno == EINTR)
+        ;
+
+    rm->stop = true;
+    pthread_join(rm->reader, NULL);
+    rm->running = false;
+
+    if (rm->err[0] != '\0')
+        warnx("RX matching ended early: %s", rm->err);
+}
+
+void
+rxmatch_close(rxmatch_t *rm)
+{
+    if (rm == NULL)
+        return;
+
+    rxmatch_stop(rm, 0);
+    pcap_close(rm->pcap);
+    safe_free(rm->index);
+    safe_free(rm->rec);
+    safe_free(rm);
+}
+
+/**
+ * \brief print the counts and the latency percentiles, in microseconds
+ */
+size_t
+rxmatch_summary(const rxmatch_t *rm, char *buf, size_t len)
+{
+    char latency[192];
+    COUNTER lost = rm->sent - rm->received;
+    int n;
+
+    tcpr_hist_summary(&rm->latency, latency, sizeof(latency));
+
+    n = snprintf(buf,
+                 len,
+                 "\tReceived:        " COUNTER_SPEC " of " COUNTER_SPEC " sent, " COUNTER_SPEC " lost (%.4f%%)\n"
+                 "\tReordered:       " COUNTER_SPEC "\n"
+                 "\tDuplicated:      " COUNTER_SPEC "\n"
+                 "\tNot ours:        " COUNTER_SPEC " IP, " COUNTER_SPEC " other\n"
+                 "\tLatency:         %s\n",
+                 rm->received,
+                 rm->sent,
+                 lost,
+                 rm->sent ? (double)lost * 100.0 / (double)rm->sent : 0.0,
+                 rm->reordered,
+                 rm->duplicated,
+                 rm->unknown,
+                 rm->other,
+                 latency);
+    if (n >= 0 && (size_t)n < len && rm->crowded != 0)
+        n += snprintf(buf + n,
+                      len - (size_t)n,
+                      "\tCrowded out:     " COUNTER_SPEC " sends, raise --rx-window\n",
+                      rm->crowded);
+
+    return n < 0 ? 0 : (size_t)n;
+}
+
+/**
+ * \brief print what came of the sent --probe-rate probes, in microseconds
+ */
+size_t
+rxmatch_probe_summary(const rxmatch_t *rm, COUNTER sent, char *buf, size_t len)
+{
+    char latency[192], delta[192];
+    COUNTER lost = sent > rm->probe_received ? sent - rm->probe_received : 0;
+    int n;
+
+    tcpr_hist_summary(&rm->probe_latency, latency, sizeof(latency));
+    tcpr_hist_summary(&rm->probe_delta, delta, sizeof(delta));
+
+    n = snprintf(buf,
+                 len,
+                 "\tReceived:        " COUNTER_SPEC " of " COUNTER_SPEC " sent, " COUNTER_SPEC " lost (%.4f%%)\n"
+                 "\tReordered:       " COUNTER_SPEC "\n"
+                 "\tDuplicated:      " COUNTER_SPEC "\n"
+                 "\tLatency:         %s\n"
+                 "\tDelay variation: %s\n"
+                 "\tJitter:          %.3f usec (RFC 3550)\n",
+                 rm->probe_received,
+                 sent,
+                 lost,
+                 sent ? (double)lost * 100.0 / (double)sent : 0.0,
+                 rm->probe_reordered,
+                 rm->probe_duplicated,
+                 latency,
+                 delta,
+                 rm->probe_jitter / 1000.0);
+
+    return n < 0 ? 0 : (size_t)n;
+}
+
+#endif /* ENABLE_RXMATCH */
@@ -0,0 +1,198 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include "common/histogram.h"
+#include "common/timer.h"
+#include <pcap.h>
+
+/*
+ * --probe-rate: UDP payload of a probe, in network byte order.  The time
+ * it was sent is on the system clock, so a receiver on another host with
+ * a synchronised clock can work the latency out as well.
+ */
+#define TCPR_PROBE_MAGIC 0x54525042 /* "TRPB" */
+
+typedef struct tcpr_probe_payload_s {
+    u_int32_t magic;
+    u_int32_t seq;
+    u_int32_t tx_sec;
+    u_int32_t tx_nsec;
+} tcpr_probe_payload_t;
+
+/*
+ * --rx-interface: which packets came back through the device under test,
+ * in what order and how long they took.
+ *
+ * Every packet sent is known by a 32 bit signature of the header fields a
+ * forwarding device leaves alone, see rxmatch_sig().  The send loop notes
+ * the signature and the time in the record of its send number, in a ring
+ * of window records, and points a slot of an open addressed index of
+ * twice that many at it.  A reader thread captures on the RX interface,
+ * looks the signature of each packet up in the index and claims the
+ * oldest send with it which hasn't come back yet.
+ *
+ * There is one writer of a record, the send loop, and one reader, so a
+ * record is a seqlock: the send loop clears state, fills it in and
+ * publishes the send number in state again, and the reader claims it by
+ * setting RXMATCH_MATCHED with a compare and swap on the state it read.
+ * A send whose record is reused before it came back can't be matched any
+ * more, so the window has to cover the packets in flight.
+ */
+#ifdef HAVE_PTHREAD
+#define ENABLE_RXMATCH 1
+#include <pthread.h>
+
+#define RXMATCH_WINDOW_DEFAULT 65536
+#define RXMATCH_WINDOW_MAX (1U << 24)
+#define RXMATCH_WAIT_DEFAULT 500 /* ms */
+/* index slots looked at for a signature */
+#define RXMATCH_PROBES 8
+/* send numbers are 31 bits, wrapping from RXMATCH_SEQ_MASK to 1 */
+#define RXMATCH_SEQ_MASK 0x7fffffffU
+#define RXMATCH_MATCHED 0x80000000U
+/* probe sequence numbers a duplicate is recognised within */
+#define RXMATCH_PROBE_HISTORY 4096
+
+typedef struct rxmatch_rec_s {
+    u_int64_t tx_ns; /* tcpr_clock_ns() the packet was handed over */
+    u_int32_t sig;
+    u_int32_t state; /* send number, | RXMATCH_MATCHED once back, 0 while written */
+} rxmatch_rec_t;
+
+typedef struct rxmatch_s {
+    /* written by the send loop */
+    u_int32_t next_seq __attribute__((aligned(64)));
+    COUNTER sent;
+    COUNTER crowded; /* sends the index had no room for near their signature */
+    /* read only */
+    rxmatch_rec_t *rec __attribute__((aligned(64)));
+    u_int32_t *index;
+    u_int32_t mask;       /* records - 1 */
+    u_int32_t index_mask; /* index slots - 1 */
+    const char *device;
+    pcap_t *pcap;
+    int dlt;
+    bool nsec; /* capture time stamps are in ns */
+    pthread_t reader;
+    volatile bool stop;
+    bool running;
+    /* only touched by the reader, and read once it's stopped */
+    char err[PCAP_ERRBUF_SIZE];
+    COUNTER received;
+    COUNTER reordered;  /* came back before a packet sent ahead of them */
+    COUNTER duplicated; /* every send with the signature had come back already */
+    COUNTER unknown;    /* IP, but no send with the signature */
+    COUNTER other;      /* no signature, i.e. not IP */
+    u_int32_t max_seq;  /* latest send which came back */
+    int64_t clock_offset; /* capture clock minus tcpr_clock_ns() */
+    u_int64_t dispatch_ns;
+    tcpr_hist_t latency;
+    /* --probe-rate, UDP to probe_port, 0 if none are sent */
+    u_int16_t probe_port;
+    COUNTER probe_received;
+    COUNTER probe_reordered;
+    COUNTER probe_duplicated;
+    u_int32_t probe_max_seq;
+    u_int64_t probe_seen[RXMATCH_PROBE_HISTORY / 64];
+    int64_t probe_transit; /* of the last probe, receive minus send time */
+    double probe_jitter;   /* RFC 3550 interarrival jitter, in ns */
+    tcpr_hist_t probe_latency;
+    tcpr_hist_t probe_delta; /* transit time change from the probe before */
+} rxmatch_t;
+
+rxmatch_t *rxmatch_open(const char *device, u_int32_t window, char *ebuf);
+int rxmatch_start(rxmatch_t *rm, char *ebuf);
+void rxmatch_stop(rxmatch_t *rm, u_int32_t wait_ms);
+void rxmatch_close(rxmatch_t *rm);
+u_int32_t rxmatch_sig(const u_char *data, u_int32_t caplen, int dlt);
+size_t rxmatch_summary(const rxmatch_t *rm, char *buf, size_t len);
+size_t rxmatch_probe_summary(const rxmatch_t *rm, COUNTER sent, char *buf, size_t len);
+
+/**
+ * \brief a is an earlier send number than b
+ */
+static inline bool
+rxmatch_seq_before(u_int32_t a, u_int32_t b)
+{
+    u_int32_t diff = (b - a) & RXMATCH_SEQ_MASK;
+
+    return diff != 0 && diff < (RXMATCH_SEQ_MASK >> 1);
+}
+
+/**
+ * \brief point a free index slot near sig at send seq
+ *
+ * A slot is free when the send it points at has come back or its record
+ * was reused.  When none is, the oldest send probed gives way.
+ */
+static inline void
+rxmatch_index(rxmatch_t *rm, u_int32_t sig, u_int32_t seq)
+{
+    u_int32_t i = sig & rm->index_mask;
+    u_int32_t slot = i, oldest = 0;
+    int p;
+
+    for (p = 0; p < RXMATCH_PROBES; p++, i = (i + 1) & rm->index_mask) {
+        u_int32_t e = __atomic_load_n(&rm->index[i], __ATOMIC_RELAXED);
+
+        if (e == 0 || __atomic_load_n(&rm->rec[e & rm->mask].state, __ATOMIC_RELAXED) != e) {
+            __atomic_store_n(&rm->index[i], seq, __ATOMIC_RELEASE);
+            return;
+        }
+        if (p == 0 || rxmatch_seq_before(e, oldest)) {
+            oldest = e;
+            slot = i;
+        }
+    }
+
+    rm->crowded++;
+    __atomic_store_n(&rm->index[slot], seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * note a packet with signature sig, which isn't 0, is about to be sent
+ *
+ * Called by the send loop's thread only, before the packet is handed
+ * over, so it can't come back before it's known.
+ */
+static inline void
+rxmatch_sent(rxmatch_t *rm, u_int32_t sig)
+{
+    u_int32_t seq = (rm->next_seq + 1) & RXMATCH_SEQ_MASK;
+    rxmatch_rec_t *rec;
+
+    if (seq == 0)
+        seq = 1;
+    rm->next_seq = seq;
+    rec = &rm->rec[seq & rm->mask];
+
+    __atomic_store_n(&rec->state, 0, __ATOMIC_RELAXED);
+    /* pairs with the acquire fence of the reader, see rxmatch_got() */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&rec->sig, sig, __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->tx_ns, tcpr_clock_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&rec->state, seq, __ATOMIC_RELEASE);
+
+    rxmatch_index(rm, sig, seq);
+    rm->sent++;
+}
+#endif /* ENABLE_RXMATCH */
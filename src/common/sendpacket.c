@@ -27,12 +27,11 @@
  * injection method, then by all means add it here (and send me a patch).
  *
  * Anyways, long story short, for now the order of preference is:
- * 1. TX_RING
- * 2. PF_PACKET
- * 3. BPF
- * 4. libdnet
- * 5. pcap_inject()
- * 6. pcap_sendpacket()
+ * 1. PF_PACKET (TX_RING only with --inject=tx_ring or --enable-force-tx-ring)
+ * 2. BPF
+ * 3. libdnet
+ * 4. pcap_inject()
+ * 5. pcap_sendpacket()
  *
  * Right now, one big problem with the pcap_* methods is that libpcap
  * doesn't provide a reliable method of getting the MAC address of
@@ -44,11 +43,17 @@
  * Please note that some of this code was copied from Libnet 1.1.3
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sendmmsg() */
+#endif
+
 #include "sendpacket.h"
 #include "defines.h"
 #include "config.h"
 #include "common.h"
+#include "probes.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -57,6 +62,21 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
+
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#ifdef HAVE_TIMERFD_WAIT
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
 #ifdef FORCE_INJECT_TX_RING
 /* TX_RING uses PF_PACKET API so don't undef it here */
 #undef HAVE_LIBDNET
@@ -129,25 +149,70 @@
 #ifdef HAVE_PF_PACKET
 #undef INJECT_METHOD
 
-/* give priority to TX_RING */
-#ifndef HAVE_TX_RING
-#define INJECT_METHOD "PF_PACKET send()"
-#else
+/* TX_RING is only the default when forced, else it has to be asked for */
+#if defined HAVE_TX_RING && defined FORCE_INJECT_TX_RING
 #define INJECT_METHOD "PF_PACKET / TX_RING"
+#define SENDPACKET_PF_TX_RING true
+#else
+#define INJECT_METHOD "PF_PACKET send()"
+#define SENDPACKET_PF_TX_RING false
 #endif
 
 #include <fcntl.h>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <netinet/in.h>
-#include <netpacket/packet.h>
 #include <sys/utsname.h>
 
 #ifdef HAVE_TX_RING
 #include "txring.h"
 #endif
 
-static sendpacket_t *sendpacket_open_pf(const char *, char *);
+#ifdef HAVE_SO_TXTIME
+#include <linux/net_tstamp.h>
+#endif
+
+#ifdef HAVE_PACKET_VNET_HDR
+#include <linux/virtio_net.h>
+
+/* the header sendpacket_enable_vnet_hdr() puts in front of a packet */
+static inline void
+sendpacket_vnet_hdr(struct virtio_net_hdr *vnet,
+                    uint16_t csum_start,
+                    uint16_t csum_offset,
+                    uint16_t gso_size,
+                    uint16_t gso_hdr_len,
+                    bool gso_v6)
+{
+    memset(vnet, 0, sizeof(*vnet));
+    vnet->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    if (csum_offset != 0) {
+        vnet->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vnet->csum_start = csum_start;
+        vnet->csum_offset = csum_offset;
+    }
+    if (gso_size != 0) {
+        vnet->gso_type = gso_v6 ? VIRTIO_NET_HDR_GSO_TCPV6 : VIRTIO_NET_HDR_GSO_TCPV4;
+        vnet->gso_size = gso_size;
+        vnet->hdr_len = gso_hdr_len;
+    }
+}
+
+/* a super-frame sent in full counts as the segments it goes out as */
+static inline void
+sendpacket_account_gso(sendpacket_t *sp, size_t len, uint16_t gso_size, uint16_t gso_hdr_len)
+{
+    COUNTER segs = sendpacket_gso_segs(len, gso_size, gso_hdr_len);
+
+    sp->sent += segs - 1;
+    sp->bytes_sent += (segs - 1) * gso_hdr_len;
+}
+#endif
+
+static sendpacket_t *sendpacket_open_pf(const char *, char *, bool);
+#ifdef HAVE_IO_URING
+static sendpacket_t *sendpacket_open_pf_uring(const char *, char *, void *);
+#endif
 static struct tcpr_ether_addr *sendpacket_get_hwaddr_pf(sendpacket_t *);
 static int get_iface_index(int fd, const char *device, char *);
 
@@ -157,6 +222,11 @@ static int get_iface_index(int fd, const char *device, char *);
 #ifdef HAVE_LINUX
 #include <linux/if_tun.h>
 #include <net/if.h>
+#ifdef IFF_MULTI_QUEUE
+#define TUNTAP_MULTI_QUEUE IFF_MULTI_QUEUE
+#else
+#define TUNTAP_MULTI_QUEUE 0
+#endif
 #elif defined(HAVE_FREEBSD)
 #define TUNTAP_DEVICE_PREFIX "/dev/"
 #endif
@@ -198,24 +268,213 @@ static sendpacket_t *sendpacket_open_libdnet(const char *, char *) _U_;
 static struct tcpr_ether_addr *sendpacket_get_hwaddr_libdnet(sendpacket_t *) _U_;
 #endif /* HAVE_LIBDNET */
 
-#if (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET) &&                                                      \
-        !(defined HAVE_PF_PACKET || defined BPF || defined HAVE_LIBDNET)
+/* libpcap can also be asked for by type, see sendpacket_methods */
+#if (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
 static sendpacket_t *sendpacket_open_pcap(const char *, char *) _U_;
 static struct tcpr_ether_addr *sendpacket_get_hwaddr_pcap(sendpacket_t *) _U_;
 #endif /* HAVE_PCAP_INJECT || HAVE_PACKET_SENDPACKET */
 
-#if defined HAVE_PCAP_INJECT && !defined INJECT_METHOD
-#undef INJECT_METHOD
-#define INJECT_METHOD "pcap_inject()"
-#elif defined HAVE_PCAP_SENDPACKET && !defined INJECT_METHOD
+#if defined HAVE_PCAP_INJECT
+#define PCAP_INJECT_METHOD "pcap_inject()"
+#elif defined HAVE_PCAP_SENDPACKET
+#define PCAP_INJECT_METHOD "pcap_sendpacket()"
+#endif
+
+#if defined PCAP_INJECT_METHOD && !defined INJECT_METHOD
 #undef INJECT_METHOD
-#define INJECT_METHOD "pcap_sendpacket()"
+#define INJECT_METHOD PCAP_INJECT_METHOD
 #endif
 
 static void sendpacket_seterr(sendpacket_t *sp, const char *fmt, ...);
 static sendpacket_t *sendpacket_open_khial(const char *, char *) _U_;
+static sendpacket_t *sendpacket_open_null(const char *, char *);
+static sendpacket_t *sendpacket_open_simulate(const char *, char *);
 static struct tcpr_ether_addr *sendpacket_get_hwaddr_khial(sendpacket_t *) _U_;
 
+/**
+ * update the sendpacket counters with the result of sending a packet
+ * of the given length, data is only read for the --digest
+ */
+static inline void
+sendpacket_account(sendpacket_t *sp, int retcode, const u_char *data, size_t len)
+{
+    TCPR_PROBE4(send__done, (const char *)sp->device, len, retcode, retcode < 0 ? errno : 0);
+    if (retcode < 0) {
+        sp->failed++;
+    } else if (sp->abort) {
+        sendpacket_seterr(sp, "User abort");
+    } else if (retcode != (int)len) {
+        sendpacket_seterr(sp, "Only able to write %d bytes out of %lu bytes total", retcode, len);
+        sp->trunc_packets++;
+    } else {
+        sp->bytes_sent += len;
+        sp->sent++;
+        sp->backoff_ns = 0;
+        if (sp->digest != NULL)
+            tcpr_digest_add(sp->digest, data, len);
+    }
+}
+
+/**
+ * \brief wait for room to send after EAGAIN or ENOBUFS
+ *
+ * Retrying straight away spins for as long as the queue stays full.
+ * A full socket buffer (EAGAIN) is waited out with poll() on fd where
+ * there is one.  A full NIC or qdisc queue (ENOBUFS) leaves the socket
+ * writable, so that backs off with sleeps twice as long each time, up
+ * to SENDPACKET_BACKOFF_MAX_NS.  Either wait ends early on sendpacket_wake(),
+ * but the packet is only given up on for an abort: a suspend or pause
+ * waits until it is out.  The wait counts in sp->backpressure_ns.
+ */
+static void
+sendpacket_backpressure(sendpacket_t *sp, int fd, int err)
+{
+    u_int64_t start = tcpr_clock_ns();
+
+    /* an earlier wake up would end every wait at once */
+    if (sendpacket_is_woken(sp) && !sp->abort)
+        sendpacket_wake_clear(sp);
+
+    if (err == EAGAIN && fd >= 0) {
+        struct pollfd pfd[2];
+        int nfds = 1, wake_fd;
+
+#ifdef HAVE_TIMERFD_WAIT
+        if (sp->wait_epfd > 0) {
+            sendpacket_wait(sp, start + (u_int64_t)SENDPACKET_POLL_TIMEOUT * 1000000, fd);
+            sp->backpressure_ns += tcpr_clock_ns() - start;
+            return;
+        }
+#endif
+        pfd[0].fd = fd;
+        pfd[0].events = POLLOUT;
+        pfd[0].revents = 0;
+        wake_fd = sendpacket_wake_fd(sp);
+        if (wake_fd > 0) {
+            pfd[1].fd = wake_fd;
+            pfd[1].events = POLLIN;
+            pfd[1].revents = 0;
+            nfds = 2;
+        }
+        if (!sendpacket_is_woken(sp) && poll(pfd, nfds, SENDPACKET_POLL_TIMEOUT) > 0 && nfds == 2 &&
+            (pfd[1].revents & POLLIN))
+            sendpacket_wake_drain(sp);
+    } else {
+        sp->backoff_ns = sp->backoff_ns ? min(sp->backoff_ns * 2, SENDPACKET_BACKOFF_MAX_NS) : SENDPACKET_BACKOFF_MIN_NS;
+#ifdef HAVE_TIMERFD_WAIT
+        if (sp->wait_epfd > 0) {
+            sendpacket_wait(sp, start + sp->backoff_ns, -1);
+            sp->backpressure_ns += tcpr_clock_ns() - start;
+            return;
+        }
+#endif
+        sendpacket_nap(sp, sp->backoff_ns);
+    }
+
+    sp->backpressure_ns += tcpr_clock_ns() - start;
+}
+
+/**
+ * backends which can send a packet made of several segments as is
+ */
+static inline bool
+sendpacket_has_iov(const sendpacket_t *sp)
+{
+    switch (sp->handle_type) {
+    case SP_TYPE_KHIAL:
+    case SP_TYPE_TUNTAP:
+    case SP_TYPE_BPF:
+    case SP_TYPE_PF_PACKET:
+    case SP_TYPE_NULL:
+    case SP_TYPE_SIMULATE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * gather a multi-segment packet into sp->gather_buf
+ */
+static const u_char *
+sendpacket_linearize(sendpacket_t *sp, const struct iovec *iov, int iovcnt, size_t len)
+{
+    size_t offset = 0;
+    int i;
+
+    if (len > sp->gather_size) {
+        sp->gather_buf = safe_realloc(sp->gather_buf, len);
+        sp->gather_size = len;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(sp->gather_buf + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    return sp->gather_buf;
+}
+
+/**
+ * \brief "send" a packet of len bytes for --simulate: add it to the pcap
+ * file, stamped with the virtual time it goes out at
+ */
+static int
+sendpacket_simulate(sendpacket_t *sp, const struct iovec *iov, int iovcnt, size_t len)
+{
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    struct pcap_pkthdr hdr;
+    struct iovec flat;
+    int ret;
+
+    tcpr_clock_to_timeval(tcpr_clock_ns(), &hdr.ts);
+    hdr.caplen = hdr.len = (bpf_u_int32)len;
+
+    if (iovcnt > PCAP_WRITER_IOV_MAX) {
+        flat.iov_base = (void *)sendpacket_linearize(sp, iov, iovcnt, len);
+        flat.iov_len = len;
+        iov = &flat;
+        iovcnt = 1;
+    }
+
+    if ((ret = pcap_writer_writev(sp->sim_writer, &hdr, iov, iovcnt)) < 0) {
+        sendpacket_seterr(sp, "Error writing %s: %s", sp->device, pcap_writer_geterr(sp->sim_writer));
+        return -1;
+    }
+
+    return (int)len;
+#else
+    sendpacket_seterr(sp, "Error writing %s: not supported", sp->device);
+    return -1;
+#endif
+}
+
+#ifdef HAVE_TX_RING
+/**
+ * queue a packet in the TX_RING of sp, waiting out a full ring, which
+ * kicks the frames it holds.  The caller kicks once it has queued all
+ * it has.  Returns what txring_put() did
+ */
+static int
+sendpacket_txring_put(sendpacket_t *sp, const u_char *data, size_t len)
+{
+    int retcode;
+
+    while ((retcode = txring_put(sp->tx_ring, data, len)) < 0 && !sp->abort) {
+        u_int64_t start = tcpr_clock_ns();
+        int waited;
+
+        sp->retry_enobufs++;
+        waited = txring_wait(sp->tx_ring, TXRING_POLL_TIMEOUT);
+        sp->backpressure_ns += tcpr_clock_ns() - start;
+        if (waited < 0)
+            break;
+    }
+
+    return retcode;
+}
+#endif
+
 /**
  * returns number of bytes sent on success or -1 on error
  * Note: it is theoretically possible to get a return code >0 and < len
@@ -229,27 +488,57 @@ static struct tcpr_ether_addr *sendpacket_get_hwaddr_khial(sendpacket_t *) _U_;
 int
 sendpacket(sendpacket_t *sp, const u_char *data, size_t len, struct pcap_pkthdr *pkthdr)
 {
-    int retcode = 0, val;
-    static u_char buffer[10000]; /* 10K bytes, enough for jumbo frames + pkthdr
-                                  * larger than page size so made static to
-                                  * prevent page misses on stack
-                                  */
-    static const size_t buffer_payload_size = sizeof(buffer) + sizeof(struct pcap_pkthdr);
+    struct iovec iov;
+
+    iov.iov_base = (void *)data;
+    iov.iov_len = len;
+
+    return sendpacket_iov(sp, &iov, 1, pkthdr);
+}
+
+/**
+ * \brief send one packet made up of iovcnt segments
+ *
+ * Segments are handed to the kernel with writev()/sendmsg() where the
+ * backend allows it, else they are gathered into a single per-handle
+ * buffer first. Since there is no fixed size buffer involved, frames
+ * larger than the MTU (jumbo or GSO sized) are passed on untouched.
+ *
+ * Return value is the same as sendpacket()
+ */
+int
+sendpacket_iov(sendpacket_t *sp, const struct iovec *iov, int iovcnt, struct pcap_pkthdr *pkthdr)
+{
+    int retcode = 0, val, i;
+    const u_char *data = NULL;
+    size_t len = 0;
 
     assert(sp);
-    assert(data);
+    assert(iov);
+    assert(iovcnt > 0 && iovcnt <= SENDPACKET_IOV_MAX);
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
 
     if (len == 0)
         return -1;
 
+    if (iovcnt == 1)
+        data = iov[0].iov_base;
+    else if (!sendpacket_has_iov(sp) || sp->digest != NULL)
+        data = sendpacket_linearize(sp, iov, iovcnt, len); /* the --digest needs it in one piece too */
+
 TRY_SEND_AGAIN:
     sp->attempt++;
 
     switch (sp->handle_type) {
-    case SP_TYPE_KHIAL:
+    case SP_TYPE_KHIAL: {
+        struct iovec kiov[SENDPACKET_IOV_MAX + 1];
 
-        memcpy(buffer, pkthdr, sizeof(struct pcap_pkthdr));
-        memcpy(buffer + sizeof(struct pcap_pkthdr), data, min(len, buffer_payload_size));
+        /* the driver wants the pkthdr in front of the packet data */
+        kiov[0].iov_base = pkthdr;
+        kiov[0].iov_len = sizeof(struct pcap_pkthdr);
+        memcpy(&kiov[1], iov, sizeof(struct iovec) * iovcnt);
 
         /* tell the kernel module which direction the traffic is going */
         if (sp->cache_dir == TCPR_DIR_C2S) { /* aka PRIMARY */
@@ -267,16 +556,19 @@ TRY_SEND_AGAIN:
         }
 
         /* write the pkthdr + packet data all at once */
-        retcode = (int)write(sp->handle.fd, (void *)buffer, sizeof(struct pcap_pkthdr) + len);
-        retcode -= sizeof(struct pcap_pkthdr); /* only record packet bytes we sent, not pcap data too */
+        retcode = (int)writev(sp->handle.fd, kiov, iovcnt + 1);
+        if (retcode >= 0)
+            retcode -= sizeof(struct pcap_pkthdr); /* only record packet bytes we sent, not pcap data too */
 
         if (retcode < 0 && !sp->abort) {
             switch (errno) {
             case EAGAIN:
                 sp->retry_eagain++;
+                sendpacket_backpressure(sp, sp->handle.fd, EAGAIN);
                 goto TRY_SEND_AGAIN;
             case ENOBUFS:
                 sp->retry_enobufs++;
+                sendpacket_backpressure(sp, sp->handle.fd, ENOBUFS);
                 goto TRY_SEND_AGAIN;
             default:
                 sendpacket_seterr(sp,
@@ -290,9 +582,34 @@ TRY_SEND_AGAIN:
         }
 
         break;
+    }
 
     case SP_TYPE_TUNTAP:
-        retcode = (int)write(sp->handle.fd, (void *)data, len);
+#ifdef HAVE_PACKET_VNET_HDR
+        if (sp->vnet_hdr) {
+            struct iovec viov[SENDPACKET_IOV_MAX + 1];
+            struct virtio_net_hdr vnet;
+
+            sendpacket_vnet_hdr(&vnet, sp->csum_start, sp->csum_offset, sp->gso_size, sp->gso_hdr_len, sp->gso_v6);
+            viov[0].iov_base = &vnet;
+            viov[0].iov_len = sizeof(vnet);
+            memcpy(&viov[1], iov, sizeof(struct iovec) * iovcnt);
+            retcode = (int)writev(sp->handle.fd, viov, iovcnt + 1);
+            /* only count packet bytes, not the header */
+            if (retcode > 0)
+                retcode -= (int)sizeof(vnet);
+            break;
+        }
+#endif
+        retcode = (int)writev(sp->handle.fd, iov, iovcnt);
+        break;
+
+    case SP_TYPE_NULL:
+        retcode = (int)len;
+        break;
+
+    case SP_TYPE_SIMULATE:
+        retcode = sendpacket_simulate(sp, iov, iovcnt, len);
         break;
 
         /* Linux PF_PACKET and TX_RING */
@@ -300,10 +617,69 @@ TRY_SEND_AGAIN:
     case SP_TYPE_TX_RING:
 #if defined HAVE_PF_PACKET
 #ifdef HAVE_TX_RING
-        retcode = (int)txring_put(sp->tx_ring, data, len);
-#else
-        retcode = (int)send(sp->handle.fd, (void *)data, len, 0);
+        if (sp->handle_type == SP_TYPE_TX_RING) {
+            /* a batch of one, the ring has its own wait for room */
+            retcode = sendpacket_txring_put(sp, data, len);
+            if (retcode >= 0 && txring_kick(sp->tx_ring) < 0)
+                retcode = -1;
+            if (retcode < 0 && !sp->abort)
+                sendpacket_seterr(sp, "Error with TX ring on %s: %s", sp->device, strerror(errno));
+            break;
+        }
+#endif
+        {
+            struct msghdr msg;
+#ifdef HAVE_SO_TXTIME
+            union {
+                char buf[CMSG_SPACE(sizeof(uint64_t))];
+                struct cmsghdr align;
+            } control;
 #endif
+#ifdef HAVE_PACKET_VNET_HDR
+            struct iovec viov[SENDPACKET_IOV_MAX + 1];
+            struct virtio_net_hdr vnet;
+#endif
+
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = (struct iovec *)iov;
+            msg.msg_iovlen = iovcnt;
+#ifdef HAVE_PACKET_VNET_HDR
+            if (sp->vnet_hdr) {
+                sendpacket_vnet_hdr(&vnet, sp->csum_start, sp->csum_offset, sp->gso_size, sp->gso_hdr_len, sp->gso_v6);
+                viov[0].iov_base = &vnet;
+                viov[0].iov_len = sizeof(vnet);
+                memcpy(&viov[1], iov, sizeof(struct iovec) * iovcnt);
+                msg.msg_iov = viov;
+                msg.msg_iovlen = iovcnt + 1;
+            }
+#endif
+#ifdef HAVE_SO_TXTIME
+            /* ask the qdisc/NIC to hold the packet until its launch time */
+            if (sp->txtime_enabled && sp->txtime != 0) {
+                struct cmsghdr *cmsg;
+
+                memset(&control, 0, sizeof(control));
+                msg.msg_control = control.buf;
+                msg.msg_controllen = sizeof(control.buf);
+                cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_TXTIME;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+                memcpy(CMSG_DATA(cmsg), &sp->txtime, sizeof(uint64_t));
+            }
+#endif
+            retcode = (int)sendmsg(sp->handle.fd, &msg, 0);
+#ifdef ENABLE_TXSTAMP
+            /* the kernel keyed a timestamp for this send unless the skb never got built */
+            if (sp->txstamp != NULL && (retcode >= 0 || errno == ENOBUFS))
+                txstamp_sent(sp->txstamp, pkthdr, len);
+#endif
+#ifdef HAVE_PACKET_VNET_HDR
+            /* only count packet bytes, not the header */
+            if (sp->vnet_hdr && retcode > 0)
+                retcode -= (int)sizeof(vnet);
+#endif
+        }
 
         /* out of buffers, or hit max PHY speed, silently retry
          * as long as we're not told to abort
@@ -312,9 +688,11 @@ TRY_SEND_AGAIN:
             switch (errno) {
             case EAGAIN:
                 sp->retry_eagain++;
+                sendpacket_backpressure(sp, sp->handle.fd, EAGAIN);
                 goto TRY_SEND_AGAIN;
             case ENOBUFS:
                 sp->retry_enobufs++;
+                sendpacket_backpressure(sp, sp->handle.fd, ENOBUFS);
                 goto TRY_SEND_AGAIN;
             default:
                 sendpacket_seterr(sp,
@@ -333,18 +711,20 @@ TRY_SEND_AGAIN:
     /* BPF */
     case SP_TYPE_BPF:
 #if defined HAVE_BPF
-        retcode = write(sp->handle.fd, (void *)data, len);
+        retcode = writev(sp->handle.fd, iov, iovcnt);
 
         /* out of buffers, or hit max PHY speed, silently retry */
         if (retcode < 0 && !sp->abort) {
             switch (errno) {
             case EAGAIN:
                 sp->retry_eagain++;
+                sendpacket_backpressure(sp, sp->handle.fd, EAGAIN);
                 goto TRY_SEND_AGAIN;
                 break;
 
             case ENOBUFS:
                 sp->retry_enobufs++;
+                sendpacket_backpressure(sp, sp->handle.fd, ENOBUFS);
                 goto TRY_SEND_AGAIN;
                 break;
 
@@ -371,11 +751,13 @@ TRY_SEND_AGAIN:
             switch (errno) {
             case EAGAIN:
                 sp->retry_eagain++;
+                sendpacket_backpressure(sp, -1, EAGAIN);
                 goto TRY_SEND_AGAIN;
                 break;
 
             case ENOBUFS:
                 sp->retry_enobufs++;
+                sendpacket_backpressure(sp, -1, ENOBUFS);
                 goto TRY_SEND_AGAIN;
                 break;
 
@@ -408,14 +790,16 @@ TRY_SEND_AGAIN:
             switch (errno) {
             case EAGAIN:
                 sp->retry_eagain++;
+                sendpacket_backpressure(sp, -1, EAGAIN);
                 goto TRY_SEND_AGAIN;
             case ENOBUFS:
                 sp->retry_enobufs++;
+                sendpacket_backpressure(sp, -1, ENOBUFS);
                 goto TRY_SEND_AGAIN;
             default:
                 sendpacket_seterr(sp,
                                   "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
-                                  INJECT_METHOD,
+                                  PCAP_INJECT_METHOD,
                                   sp->sent + sp->failed + 1,
                                   pcap_geterr(sp->handle.pcap),
                                   errno);
@@ -453,62 +837,620 @@ TRY_SEND_AGAIN:
 #endif /* HAVE_NETMAP */
         break;
 
+    case SP_TYPE_AF_XDP:
+#ifdef HAVE_AF_XDP
+        retcode = sendpacket_send_xdp(sp, data, len, true);
+
+        if (retcode == -1) {
+            sendpacket_seterr(sp, "Error with AF_XDP send on %s: %s", sp->device, strerror(errno));
+        } else if (retcode == -2) {
+            /* TX ring or UMEM is full - not a failure */
+            sp->retry_eagain++;
+            retcode = 0;
+#ifdef HAVE_SCHED_H
+            sched_yield();
+#endif
+            goto TRY_SEND_AGAIN;
+        }
+#endif /* HAVE_AF_XDP */
+        break;
+
+    case SP_TYPE_DPDK:
+#ifdef HAVE_DPDK
+        retcode = sendpacket_send_dpdk(sp, data, len, true);
+
+        if (retcode == -1) {
+            sendpacket_seterr(sp, "Error with DPDK send on %s: %s", sp->device, strerror(errno));
+        } else if (retcode == -2) {
+            /* every mbuf is in flight - not a failure */
+            sp->retry_eagain++;
+            retcode = 0;
+#ifdef HAVE_SCHED_H
+            sched_yield();
+#endif
+            goto TRY_SEND_AGAIN;
+        }
+#endif /* HAVE_DPDK */
+        break;
+
+    case SP_TYPE_IO_URING:
+#ifdef HAVE_IO_URING
+    {
+        sendpacket_pkt_t pkt;
+        int res;
+
+        memset(&pkt, 0, sizeof(pkt));
+        pkt.data = data;
+        pkt.len = len;
+        if (sendpacket_send_uring(sp, &pkt, 1, &res) < 0) {
+            sendpacket_seterr(sp, "Error with io_uring send on %s: %s", sp->device, strerror(errno));
+            retcode = -1;
+            break;
+        }
+
+        retcode = res;
+        if (res < 0) {
+            errno = -res;
+            retcode = -1;
+            if (sp->abort)
+                break;
+
+            switch (errno) {
+            case EAGAIN:
+                sp->retry_eagain++;
+                sendpacket_backpressure(sp, sp->handle.fd, EAGAIN);
+                goto TRY_SEND_AGAIN;
+            case ENOBUFS:
+                sp->retry_enobufs++;
+                sendpacket_backpressure(sp, sp->handle.fd, ENOBUFS);
+                goto TRY_SEND_AGAIN;
+            default:
+                sendpacket_seterr(sp,
+                                  "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
+                                  "io_uring",
+                                  sp->sent + sp->failed + 1,
+                                  strerror(errno),
+                                  errno);
+            }
+        }
+        break;
+    }
+#else
+        break;
+#endif /* HAVE_IO_URING */
+
     default:
         errx(-1, "Unsupported sp->handle_type = %d", sp->handle_type);
     } /* end case */
 
-    if (retcode < 0) {
-        sp->failed++;
-    } else if (sp->abort) {
-        sendpacket_seterr(sp, "User abort");
-    } else if (retcode != (int)len) {
-        sendpacket_seterr(sp, "Only able to write %d bytes out of %lu bytes total", retcode, len);
-        sp->trunc_packets++;
-    } else {
-        sp->bytes_sent += len;
-        sp->sent++;
-    }
+    sendpacket_account(sp, retcode, data, len);
+#ifdef HAVE_PACKET_VNET_HDR
+    if (sp->vnet_hdr && retcode == (int)len && !sp->abort)
+        sendpacket_account_gso(sp, len, sp->gso_size, sp->gso_hdr_len);
+#endif
     return retcode;
 }
 
+#if defined HAVE_PF_PACKET && defined HAVE_SENDMMSG
 /**
- * Open the given network device name and returns a sendpacket_t struct
- * pass the error buffer (in case there's a problem) and the direction
- * that this interface represents
+ * push a batch of packets out a PF_PACKET socket with as few
+ * sendmmsg() system calls as possible.  Returns the number of
+ * packets sent in full
  */
-sendpacket_t *
-sendpacket_open(const char *device,
-                char *errbuf,
-                tcpr_dir_t direction,
-                sendpacket_type_t sendpacket_type _U_,
-                void *arg _U_)
+static int
+sendpacket_batch_mmsg(sendpacket_t *sp, const sendpacket_pkt_t *pkts, int cnt)
 {
-#ifdef HAVE_TUNTAP
-    char sys_dev_dir[128];
-    bool device_exists;
+    struct mmsghdr msgs[SENDPACKET_BATCH_MAX];
+    struct iovec iovs[2 * SENDPACKET_BATCH_MAX];
+#ifdef HAVE_PACKET_VNET_HDR
+    struct virtio_net_hdr vnet[SENDPACKET_BATCH_MAX];
 #endif
-    sendpacket_t *sp;
-    struct stat sdata;
+    unsigned int hdr_len = 0;
+    int i, retcode, done = 0, sent = 0;
+
+    memset(msgs, 0, sizeof(msgs[0]) * cnt);
+    for (i = 0; i < cnt; i++) {
+        struct iovec *iov = &iovs[2 * i];
+        int iovlen = 0;
+
+#ifdef HAVE_PACKET_VNET_HDR
+        if (sp->vnet_hdr) {
+            sendpacket_vnet_hdr(&vnet[i],
+                                pkts[i].csum_start,
+                                pkts[i].csum_offset,
+                                pkts[i].gso_size,
+                                pkts[i].gso_hdr_len,
+                                pkts[i].gso_v6);
+            iov[iovlen].iov_base = &vnet[i];
+            iov[iovlen++].iov_len = sizeof(vnet[i]);
+            hdr_len = sizeof(vnet[i]);
+        }
+#endif
+        iov[iovlen].iov_base = (void *)pkts[i].data;
+        iov[iovlen++].iov_len = pkts[i].len;
+        msgs[i].msg_hdr.msg_iov = iov;
+        msgs[i].msg_hdr.msg_iovlen = iovlen;
+    }
 
-    assert(device);
-    assert(errbuf);
+    while (done < cnt) {
+        sp->attempt++;
+        retcode = sendmmsg(sp->handle.fd, &msgs[done], cnt - done, 0);
 
-    errbuf[0] = '\0';
+        if (retcode < 0) {
+            if (sp->abort)
+                break;
 
-#ifdef HAVE_TUNTAP
-    snprintf(sys_dev_dir, sizeof(sys_dev_dir), "/sys/class/net/%s/", device);
-    device_exists = access(sys_dev_dir, R_OK) == 0;
-#endif
+            /* out of buffers, or hit max PHY speed, silently retry */
+            switch (errno) {
+            case EAGAIN:
+                sp->retry_eagain++;
+                sendpacket_backpressure(sp, sp->handle.fd, EAGAIN);
+                continue;
+            case ENOBUFS:
+                sp->retry_enobufs++;
+                sendpacket_backpressure(sp, sp->handle.fd, ENOBUFS);
+                continue;
+            default:
+                sendpacket_seterr(sp,
+                                  "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
+                                  INJECT_METHOD,
+                                  sp->sent + sp->failed + 1,
+                                  strerror(errno),
+                                  errno);
+            }
 
-    /* khial is universal */
-    if (stat(device, &sdata) == 0) {
-        if (((sdata.st_mode & S_IFMT) == S_IFCHR)) {
-            sp = sendpacket_open_khial(device, errbuf);
+            /* skip the offending packet and carry on with the rest */
+            sendpacket_account(sp, -1, pkts[done].data, pkts[done].len);
+            done++;
+            continue;
+        }
 
-        } else {
-            switch (sdata.st_mode & S_IFMT) {
-            case S_IFBLK:
-                errx(-1, "\"%s\" is a block device and is not a valid Tcpreplay device", device);
+        for (i = done; i < done + retcode; i++) {
+            int len = (int)(msgs[i].msg_len - hdr_len);
+
+            sendpacket_account(sp, len, pkts[i].data, pkts[i].len);
+            if (len == (int)pkts[i].len) {
+#ifdef HAVE_PACKET_VNET_HDR
+                if (!sp->abort)
+                    sendpacket_account_gso(sp, pkts[i].len, pkts[i].gso_size, pkts[i].gso_hdr_len);
+#endif
+                sent++;
+            }
+        }
+        done += retcode;
+    }
+
+    return sent;
+}
+#endif /* HAVE_PF_PACKET && HAVE_SENDMMSG */
+
+#ifdef HAVE_IO_URING
+/**
+ * queue a batch of packets on the io_uring of sp, and submit and reap
+ * them with a single io_uring_enter().  Packets the socket or the NIC
+ * had no room for are sent again, in the order they came in, once there
+ * is.  Returns the number of packets sent in full
+ */
+static int
+sendpacket_batch_uring(sendpacket_t *sp, const sendpacket_pkt_t *pkts, int cnt)
+{
+    sendpacket_pkt_t retry[SENDPACKET_BATCH_MAX];
+    int res[SENDPACKET_BATCH_MAX];
+    const sendpacket_pkt_t *todo = pkts;
+    int i, sent = 0;
+
+    while (cnt > 0 && !sp->abort) {
+        int again = 0, wait_err = 0;
+
+        sp->attempt++;
+        if (sendpacket_send_uring(sp, todo, cnt, res) < 0) {
+            sendpacket_seterr(sp, "Error with io_uring send on %s: %s", sp->device, strerror(errno));
+            for (i = 0; i < cnt; i++)
+                sendpacket_account(sp, -1, todo[i].data, todo[i].len);
+            break;
+        }
+
+        for (i = 0; i < cnt; i++) {
+            if (res[i] == -EAGAIN || res[i] == -ENOBUFS) {
+                if (res[i] == -EAGAIN)
+                    sp->retry_eagain++;
+                else
+                    sp->retry_enobufs++;
+                wait_err = -res[i];
+                /* never ahead of i, so fine when todo is retry */
+                retry[again++] = todo[i];
+                continue;
+            }
+
+            if (res[i] < 0) {
+                errno = -res[i];
+                sendpacket_seterr(sp,
+                                  "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
+                                  "io_uring",
+                                  sp->sent + sp->failed + 1,
+                                  strerror(errno),
+                                  errno);
+            }
+
+            sendpacket_account(sp, res[i] < 0 ? -1 : res[i], todo[i].data, todo[i].len);
+            if (res[i] == (int)todo[i].len)
+                sent++;
+        }
+
+        if (again > 0)
+            sendpacket_backpressure(sp, sp->handle.fd, wait_err);
+        todo = retry;
+        cnt = again;
+    }
+
+    return sent;
+}
+#endif /* HAVE_IO_URING */
+
+#ifdef HAVE_TUNTAP
+/**
+ * write a batch of packets to a tap queue.  A tap takes one frame per
+ * write(), so this is a writev() per packet without the per packet
+ * work of sendpacket().  Returns the number of packets sent in full
+ */
+static int
+sendpacket_batch_tuntap(sendpacket_t *sp, const sendpacket_pkt_t *pkts, int cnt)
+{
+    struct iovec iov[2];
+#ifdef HAVE_PACKET_VNET_HDR
+    struct virtio_net_hdr vnet;
+#endif
+    int i, iovlen, hdr_len = 0, sent = 0;
+
+    for (i = 0; i < cnt && !sp->abort; i++) {
+        int retcode;
+
+        iovlen = 0;
+#ifdef HAVE_PACKET_VNET_HDR
+        if (sp->vnet_hdr) {
+            sendpacket_vnet_hdr(&vnet,
+                                pkts[i].csum_start,
+                                pkts[i].csum_offset,
+                                pkts[i].gso_size,
+                                pkts[i].gso_hdr_len,
+                                pkts[i].gso_v6);
+            iov[iovlen].iov_base = &vnet;
+            iov[iovlen++].iov_len = sizeof(vnet);
+            hdr_len = (int)sizeof(vnet);
+        }
+#endif
+        iov[iovlen].iov_base = (void *)pkts[i].data;
+        iov[iovlen++].iov_len = pkts[i].len;
+
+        sp->attempt++;
+        retcode = (int)writev(sp->handle.fd, iov, iovlen);
+        if (retcode < 0)
+            sendpacket_seterr(sp,
+                              "Error with %s [" COUNTER_SPEC "]: %s (errno = %d)",
+                              sendpacket_get_method(sp),
+                              sp->sent + sp->failed + 1,
+                              strerror(errno),
+                              errno);
+        else
+            retcode -= hdr_len;
+
+        sendpacket_account(sp, retcode, pkts[i].data, pkts[i].len);
+        if (retcode == (int)pkts[i].len) {
+#ifdef HAVE_PACKET_VNET_HDR
+            if (sp->vnet_hdr && !sp->abort)
+                sendpacket_account_gso(sp, pkts[i].len, pkts[i].gso_size, pkts[i].gso_hdr_len);
+#endif
+            sent++;
+        }
+    }
+
+    return sent;
+}
+#endif /* HAVE_TUNTAP */
+
+/**
+ * \brief send a batch of packets
+ *
+ * Takes up to SENDPACKET_BATCH_MAX packet descriptors and pushes them out
+ * as a unit, which amortizes the per call overhead of sendpacket():
+ *
+ * - PF_PACKET uses sendmmsg()
+ * - TX_RING fills as many ring frames as possible before a single kick
+ * - netmap fills TX slots and issues a single NIOCTXSYNC
+ * - tuntap does a bare writev() per packet, as a tap takes one frame per call
+ * - AF_XDP and DPDK queue every packet before a single wakeup or TX burst
+ *
+ * Other injection methods simply call sendpacket() for each packet.
+ * Packets which fail are counted in sp->failed and skipped.
+ * Returns the number of packets that were sent in full.
+ */
+int
+sendpacket_batch(sendpacket_t *sp, const sendpacket_pkt_t *pkts, int cnt)
+{
+    int i, sent = 0;
+#ifdef HAVE_SO_TXTIME
+    uint64_t txtime;
+#endif
+
+    assert(sp);
+    assert(pkts);
+    assert(cnt <= SENDPACKET_BATCH_MAX);
+
+    tcpr_hist_add(&sp->batch, (u_int64_t)cnt);
+
+    switch (sp->handle_type) {
+    case SP_TYPE_TX_RING:
+#if defined HAVE_PF_PACKET && defined HAVE_TX_RING
+        for (i = 0; i < cnt && !sp->abort; i++) {
+            int retcode;
+
+            sp->attempt++;
+            retcode = sendpacket_txring_put(sp, pkts[i].data, pkts[i].len);
+            sendpacket_account(sp, retcode, pkts[i].data, pkts[i].len);
+            if (retcode == (int)pkts[i].len)
+                sent++;
+        }
+
+        /* one kick for the whole batch */
+        if (txring_kick(sp->tx_ring) < 0)
+            sendpacket_seterr(sp, "Error with TX ring on %s: %s", sp->device, strerror(errno));
+        return sent;
+#else
+        break;
+#endif
+
+    case SP_TYPE_PF_PACKET:
+#if defined HAVE_PF_PACKET && defined HAVE_SENDMMSG
+#ifdef HAVE_SO_TXTIME
+        /* launch times are only attached by sendpacket() */
+        if (sp->txtime_enabled)
+            break;
+#endif
+#ifdef ENABLE_TXSTAMP
+        /* a send which fails part way through sendmmsg() may or may not have been keyed */
+        if (sp->txstamp != NULL)
+            break;
+#endif
+        return sendpacket_batch_mmsg(sp, pkts, cnt);
+#else
+        break;
+#endif
+
+    case SP_TYPE_NETMAP:
+#ifdef HAVE_NETMAP
+        for (i = 0; i < cnt && !sp->abort; i++) {
+            int retcode;
+
+            sp->attempt++;
+            while ((retcode = sendpacket_send_netmap(sp, pkts[i].data, pkts[i].len)) == -2) {
+                sp->retry_eagain++;
+#ifdef HAVE_SCHED_H
+                sched_yield();
+#endif
+            }
+
+            if (retcode == -1)
+                sendpacket_seterr(sp, "interface hung!!");
+
+            sendpacket_account(sp, retcode, pkts[i].data, pkts[i].len);
+            if (retcode == (int)pkts[i].len)
+                sent++;
+        }
+
+        /* hand all the filled slots to the kernel at once */
+        ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+        return sent;
+#else
+        break;
+#endif
+
+    case SP_TYPE_TUNTAP:
+#ifdef HAVE_TUNTAP
+        return sendpacket_batch_tuntap(sp, pkts, cnt);
+#else
+        break;
+#endif
+
+    case SP_TYPE_AF_XDP:
+#ifdef HAVE_AF_XDP
+        for (i = 0; i < cnt && !sp->abort; i++) {
+            int retcode;
+
+            sp->attempt++;
+            while ((retcode = sendpacket_send_xdp(sp, pkts[i].data, pkts[i].len, false)) == -2) {
+                sp->retry_eagain++;
+#ifdef HAVE_SCHED_H
+                sched_yield();
+#endif
+            }
+
+            if (retcode == -1)
+                sendpacket_seterr(sp, "Error with AF_XDP send on %s: %s", sp->device, strerror(errno));
+
+            sendpacket_account(sp, retcode, pkts[i].data, pkts[i].len);
+            if (retcode == (int)pkts[i].len)
+                sent++;
+        }
+
+        /* one wakeup for the whole batch */
+        if (sendpacket_flush_xdp(sp) < 0)
+            sendpacket_seterr(sp, "Error with AF_XDP send on %s: %s", sp->device, strerror(errno));
+        return sent;
+#else
+        break;
+#endif
+
+    case SP_TYPE_DPDK:
+#ifdef HAVE_DPDK
+        for (i = 0; i < cnt && !sp->abort; i++) {
+            int retcode;
+
+            sp->attempt++;
+            while ((retcode = sendpacket_send_dpdk(sp, pkts[i].data, pkts[i].len, false)) == -2) {
+                sp->retry_eagain++;
+#ifdef HAVE_SCHED_H
+                sched_yield();
+#endif
+            }
+
+            if (retcode == -1)
+                sendpacket_seterr(sp, "Error with DPDK send on %s: %s", sp->device, strerror(errno));
+
+            sendpacket_account(sp, retcode, pkts[i].data, pkts[i].len);
+            if (retcode == (int)pkts[i].len)
+                sent++;
+        }
+
+        /* whatever is left of the last burst */
+        sendpacket_flush_dpdk(sp);
+        return sent;
+#else
+        break;
+#endif
+
+    case SP_TYPE_IO_URING:
+#ifdef HAVE_IO_URING
+        return sendpacket_batch_uring(sp, pkts, cnt);
+#else
+        break;
+#endif
+
+    default:
+        break;
+    }
+
+#ifdef HAVE_SO_TXTIME
+    txtime = sp->txtime;
+#endif
+    for (i = 0; i < cnt && !sp->abort; i++) {
+#ifdef HAVE_PACKET_VNET_HDR
+        sp->csum_start = pkts[i].csum_start;
+        sp->csum_offset = pkts[i].csum_offset;
+        sp->gso_size = pkts[i].gso_size;
+        sp->gso_hdr_len = pkts[i].gso_hdr_len;
+        sp->gso_v6 = pkts[i].gso_v6;
+#endif
+#ifdef HAVE_SO_TXTIME
+        /* packets of a --wakeup-slack batch each keep their place in the schedule */
+        if (sp->txtime_enabled)
+            sp->txtime = pkts[i].txtime != 0 ? pkts[i].txtime : txtime;
+#endif
+        if (sendpacket(sp, pkts[i].data, pkts[i].len, pkts[i].pkthdr) == (int)pkts[i].len)
+            sent++;
+    }
+#ifdef HAVE_SO_TXTIME
+    sp->txtime = txtime;
+#endif
+
+    return sent;
+}
+
+/**
+ * \brief How many packets sendpacket_batch() can take right now without
+ * waiting on the interface, at most SENDPACKET_BATCH_MAX
+ *
+ * Only a TX_RING knows, the other methods say SENDPACKET_BATCH_MAX.
+ */
+int
+sendpacket_batch_room(sendpacket_t *sp)
+{
+    assert(sp);
+
+#ifdef HAVE_TX_RING
+    if (sp->handle_type == SP_TYPE_TX_RING)
+        return (int)txring_room(sp->tx_ring, SENDPACKET_BATCH_MAX);
+#endif
+
+    return SENDPACKET_BATCH_MAX;
+}
+
+/*
+ * The injection methods a network interface can be opened with by type,
+ * besides the default, in the order --inject=auto tries them.  Ends with
+ * a NULL name.
+ */
+const sendpacket_method_t sendpacket_methods[] = {
+#ifdef HAVE_PF_PACKET
+        {"pf_packet", "PF_PACKET send()", SP_TYPE_PF_PACKET},
+#ifdef HAVE_TX_RING
+        {"tx_ring", "PF_PACKET / TX_RING", SP_TYPE_TX_RING},
+#endif
+#endif
+#ifdef HAVE_IO_URING
+        {"io_uring", "io_uring", SP_TYPE_IO_URING},
+#endif
+#ifdef HAVE_AF_XDP
+        {"xdp", "AF_XDP", SP_TYPE_AF_XDP},
+#endif
+#ifdef PCAP_INJECT_METHOD
+        {"libpcap", PCAP_INJECT_METHOD, SP_TYPE_LIBPCAP},
+#endif
+        {NULL, NULL, SP_TYPE_NONE},
+};
+
+/**
+ * Open the given network device name and returns a sendpacket_t struct
+ * pass the error buffer (in case there's a problem) and the direction
+ * that this interface represents
+ */
+sendpacket_t *
+sendpacket_open(const char *device, char *errbuf, tcpr_dir_t direction, sendpacket_type_t sendpacket_type, void *arg)
+{
+    sendpacket_t *sp;
+
+    if ((sp = sendpacket_try_open(device, errbuf, direction, sendpacket_type, arg)) == NULL)
+        errx(-1, "failed to open device %s: %s", device, errbuf);
+
+    return sp;
+}
+
+/**
+ * \brief sendpacket_open(), but returns NULL with the reason in errbuf if
+ * the device can't be opened, rather than exit
+ *
+ * A device which isn't a valid tcpreplay device at all is still fatal.
+ */
+sendpacket_t *
+sendpacket_try_open(const char *device,
+                    char *errbuf,
+                    tcpr_dir_t direction,
+                    sendpacket_type_t sendpacket_type _U_,
+                    void *arg _U_)
+{
+#ifdef HAVE_TUNTAP
+    char sys_dev_dir[128];
+    bool device_exists;
+#endif
+    sendpacket_t *sp;
+    struct stat sdata;
+
+    assert(device);
+    assert(errbuf);
+
+    errbuf[0] = '\0';
+
+#ifdef HAVE_TUNTAP
+    snprintf(sys_dev_dir, sizeof(sys_dev_dir), "/sys/class/net/%s/", device);
+    device_exists = access(sys_dev_dir, R_OK) == 0;
+#endif
+
+    if (sendpacket_type == SP_TYPE_NULL) {
+        sp = sendpacket_open_null(device, errbuf);
+    } else if (sendpacket_type == SP_TYPE_SIMULATE) {
+        sp = sendpacket_open_simulate(device, errbuf);
+#ifdef HAVE_DPDK
+    } else if (strncmp(device, TCPR_DPDK_PREFIX, strlen(TCPR_DPDK_PREFIX)) == 0) {
+        sp = (sendpacket_t *)sendpacket_open_dpdk(device, errbuf, arg);
+#endif
+    } else if (stat(device, &sdata) == 0) {
+        /* khial is universal */
+        if (((sdata.st_mode & S_IFMT) == S_IFCHR)) {
+            sp = sendpacket_open_khial(device, errbuf);
+
+        } else {
+            switch (sdata.st_mode & S_IFMT) {
+            case S_IFBLK:
+                errx(-1, "\"%s\" is a block device and is not a valid Tcpreplay device", device);
             case S_IFDIR:
                 errx(-1, "\"%s\" is a directory and is not a valid Tcpreplay device", device);
             case S_IFIFO:
@@ -531,8 +1473,28 @@ sendpacket_open(const char *device,
             sp = (sendpacket_t *)sendpacket_open_netmap(device, errbuf, arg);
         else
 #endif
+#ifdef HAVE_AF_XDP
+        if (sendpacket_type == SP_TYPE_AF_XDP)
+            sp = (sendpacket_t *)sendpacket_open_xdp(device, errbuf, arg);
+        else
+#endif
+#ifdef HAVE_IO_URING
+        if (sendpacket_type == SP_TYPE_IO_URING)
+            sp = sendpacket_open_pf_uring(device, errbuf, arg);
+        else
+#endif
+#if defined HAVE_PF_PACKET
+        if (sendpacket_type == SP_TYPE_PF_PACKET || sendpacket_type == SP_TYPE_TX_RING)
+            sp = sendpacket_open_pf(device, errbuf, sendpacket_type == SP_TYPE_TX_RING);
+        else
+#endif
+#ifdef PCAP_INJECT_METHOD
+        if (sendpacket_type == SP_TYPE_LIBPCAP)
+            sp = sendpacket_open_pcap(device, errbuf);
+        else
+#endif
 #if defined HAVE_PF_PACKET
-            sp = sendpacket_open_pf(device, errbuf);
+            sp = sendpacket_open_pf(device, errbuf, SENDPACKET_PF_TX_RING);
 #elif defined HAVE_BPF
         sp = sendpacket_open_bpf(device, errbuf);
 #elif defined HAVE_LIBDNET
@@ -547,17 +1509,16 @@ sendpacket_open(const char *device,
     if (sp) {
         sp->open = 1;
         sp->cache_dir = direction;
-    } else {
-        errx(-1, "failed to open device %s: %s", device, errbuf);
     }
     return sp;
 }
 
 /**
- * Get packet stats for the given sendpacket_t
+ * Get packet stats for the given sendpacket_t, with its share of the
+ * flows if flows is set
  */
 size_t
-sendpacket_getstat(sendpacket_t *sp, char *buf, size_t buf_size)
+sendpacket_getstat(sendpacket_t *sp, char *buf, size_t buf_size, bool flows)
 {
     size_t offset;
 
@@ -580,7 +1541,14 @@ sendpacket_getstat(sendpacket_t *sp, char *buf, size_t buf_size)
                       sp->retry_enobufs,
                       sp->retry_eagain);
 
-    if (sp->flow_packets && offset > 0) {
+    /* the NIC couldn't keep up */
+    if (sp->backpressure_ns > 0 && offset > 0)
+        offset += snprintf(&buf[offset],
+                           buf_size - offset,
+                           "\tBackpressure wait:         %.6f sec\n",
+                           (double)sp->backpressure_ns / 1000000000.0);
+
+    if (flows && sp->flow_packets && offset > 0) {
         offset += snprintf(&buf[offset],
                            buf_size - offset,
                            "\tFlows total:               " COUNTER_SPEC "\n"
@@ -590,13 +1558,39 @@ sendpacket_getstat(sendpacket_t *sp, char *buf, size_t buf_size)
                            "\tNon-flow packets:          " COUNTER_SPEC "\n"
                            "\tInvalid flow packets:      " COUNTER_SPEC "\n",
                            sp->flows,
-                           sp->flows_expired,
+                           sp->flows_unique,
                            sp->flows_expired,
                            sp->flow_packets,
                            sp->flow_non_flow_packets,
                            sp->flows_invalid_packets);
     }
 
+#ifdef HAVE_TX_RING
+    if (sp->handle_type == SP_TYPE_TX_RING && sp->tx_ring != NULL && offset > 0) {
+        const txring_stats_t *ts = &sp->tx_ring->stats;
+        offset += snprintf(&buf[offset],
+                           buf_size - offset,
+                           "\tTX ring frames queued:     " COUNTER_SPEC "\n"
+                           "\tTX ring kicks:             " COUNTER_SPEC "\n"
+                           "\tTX ring full stalls:       " COUNTER_SPEC "\n"
+                           "\tTX ring wrong format:      " COUNTER_SPEC "\n",
+                           ts->queued,
+                           ts->kicks,
+                           ts->full_stalls,
+                           ts->wrong_format);
+    }
+#endif
+
+#ifdef HAVE_DPDK
+    if (sp->handle_type == SP_TYPE_DPDK && sp->dpdk != NULL && offset > 0 && offset < buf_size)
+        offset += sendpacket_getstat_dpdk(sp, &buf[offset], buf_size - offset);
+#endif
+
+#ifdef HAVE_IO_URING
+    if (sp->handle_type == SP_TYPE_IO_URING && sp->uring != NULL && offset > 0 && offset < buf_size)
+        offset += sendpacket_getstat_uring(sp, &buf[offset], buf_size - offset);
+#endif
+
     return offset;
 }
 
@@ -607,6 +1601,10 @@ void
 sendpacket_close(sendpacket_t *sp)
 {
     assert(sp);
+#ifdef ENABLE_TXSTAMP
+    /* the reader thread polls the socket, so it goes first */
+    txstamp_close(sp->txstamp);
+#endif
     switch (sp->handle_type) {
     case SP_TYPE_KHIAL:
         close(sp->handle.fd);
@@ -621,6 +1619,10 @@ sendpacket_close(sendpacket_t *sp)
     case SP_TYPE_PF_PACKET:
     case SP_TYPE_TX_RING:
 #ifdef HAVE_PF_PACKET
+#ifdef HAVE_TX_RING
+        txring_close(sp->tx_ring);
+        sp->tx_ring = NULL;
+#endif
         close(sp->handle.fd);
 #endif
         break;
@@ -647,11 +1649,52 @@ sendpacket_close(sendpacket_t *sp)
     case SP_TYPE_TUNTAP:
 #ifdef HAVE_TUNTAP
         close(sp->handle.fd);
+#endif
+        break;
+    case SP_TYPE_AF_XDP:
+#ifdef HAVE_AF_XDP
+        sendpacket_close_xdp(sp);
+#endif
+        break;
+    case SP_TYPE_DPDK:
+#ifdef HAVE_DPDK
+        sendpacket_close_dpdk(sp);
+#endif
+        break;
+    case SP_TYPE_IO_URING:
+#ifdef HAVE_IO_URING
+        sendpacket_close_uring(sp);
+        close(sp->handle.fd);
+#endif
+        break;
+    case SP_TYPE_NULL:
+        break;
+    case SP_TYPE_SIMULATE:
+#ifdef HAVE_PCAP_DUMP_FOPEN
+        pcap_writer_close(sp->sim_writer);
 #endif
         break;
     case SP_TYPE_NONE:
         err(-1, "no injector selected!");
     }
+#ifdef HAVE_KQUEUE
+    if (sp->kq > 0)
+        close(sp->kq);
+#endif
+#ifdef HAVE_TIMERFD_WAIT
+    if (sp->wait_epfd > 0) {
+        close(sp->wait_epfd);
+        close(sp->wait_timerfd);
+    }
+#endif
+    if (sp->wake_rfd > 0) {
+        close(sp->wake_rfd);
+        if (sp->wake_wfd != sp->wake_rfd)
+            close(sp->wake_wfd);
+    }
+    tcpr_trace_free(sp->trace);
+    tcpr_digest_free(sp->digest);
+    safe_free(sp->gather_buf);
     safe_free(sp);
 }
 
@@ -671,6 +1714,9 @@ sendpacket_get_hwaddr(sendpacket_t *sp)
 
     if (sp->handle_type == SP_TYPE_KHIAL) {
         addr = sendpacket_get_hwaddr_khial(sp);
+    } else if (sp->handle_type == SP_TYPE_NULL || sp->handle_type == SP_TYPE_SIMULATE) {
+        sendpacket_seterr(sp, "Error: sendpacket_get_hwaddr() not supported for the %s injector", sendpacket_get_method(sp));
+        addr = NULL;
     } else {
 #if defined HAVE_PF_PACKET
         addr = sendpacket_get_hwaddr_pf(sp);
@@ -713,8 +1759,7 @@ sendpacket_seterr(sendpacket_t *sp, const char *fmt, ...)
     sp->errbuf[(SENDPACKET_ERRBUF_SIZE - 1)] = '\0'; // be safe
 }
 
-#if (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET) &&                                                      \
-        !(defined HAVE_PF_PACKET || defined BPF || defined HAVE_LIBDNET)
+#if (defined HAVE_PCAP_INJECT || defined HAVE_PCAP_SENDPACKET)
 /**
  * Inner sendpacket_open() method for using libpcap
  */
@@ -815,33 +1860,93 @@ sendpacket_get_hwaddr_libdnet(sendpacket_t *sp)
 #endif /* HAVE_LIBDNET */
 
 #if defined HAVE_TUNTAP
+#ifdef HAVE_LINUX
 /**
- * Inner sendpacket_open() method for tuntap devices
+ * attach a new fd to the tap device with the given TUNSETIFF flags,
+ * creating the device if it doesn't exist.  Returns the fd or -1
  */
-static sendpacket_t *
-sendpacket_open_tuntap(const char *device, char *errbuf)
+static int
+sendpacket_attach_tuntap(const char *device, short flags, char *errbuf)
 {
-    sendpacket_t *sp;
     struct ifreq ifr;
     int tapfd;
 
-    assert(device);
-    assert(errbuf);
-
-#if defined HAVE_LINUX
     if ((tapfd = open("/dev/net/tun", O_RDWR)) < 0) {
         snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Could not open /dev/net/tun control file: %s", strerror(errno));
-        return NULL;
+        return -1;
     }
     memset(&ifr, 0, sizeof(ifr));
-    ifr.ifr_flags = (IFF_TAP | IFF_NO_PI);
+    ifr.ifr_flags = flags;
     strncpy(ifr.ifr_name, device, sizeof(ifr.ifr_name) - 1);
 
     if (ioctl(tapfd, TUNSETIFF, (void *)&ifr) < 0) {
         snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to create tuntap interface: %s", device);
         close(tapfd);
+        return -1;
+    }
+
+    return tapfd;
+}
+
+/**
+ * \brief open another queue of the multiqueue tap first is open on, for
+ * a send thread of its own
+ *
+ * The queue gets the flags of the first, so it sends behind a
+ * virtio_net_hdr too if first does.
+ */
+sendpacket_t *
+sendpacket_open_tuntap_queue(sendpacket_t *first, char *errbuf)
+{
+    sendpacket_t *sp;
+    struct ifreq ifr;
+    int tapfd;
+
+    assert(first);
+    assert(errbuf);
+    assert(first->handle_type == SP_TYPE_TUNTAP);
+
+    memset(&ifr, 0, sizeof(ifr));
+    if (ioctl(first->handle.fd, TUNGETIFF, (void *)&ifr) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to get flags of %s: %s", first->device, strerror(errno));
+        return NULL;
+    }
+
+    if (TUNTAP_MULTI_QUEUE == 0 || !(ifr.ifr_flags & TUNTAP_MULTI_QUEUE)) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "%s is not a multiqueue tap", first->device);
         return NULL;
     }
+
+    if ((tapfd = sendpacket_attach_tuntap(first->device, ifr.ifr_flags, errbuf)) < 0)
+        return NULL;
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, first->device, sizeof(sp->device));
+    sp->handle.fd = tapfd;
+    sp->handle_type = SP_TYPE_TUNTAP;
+#ifdef HAVE_PACKET_VNET_HDR
+    sp->vnet_hdr = first->vnet_hdr;
+#endif
+    return sp;
+}
+#endif /* HAVE_LINUX */
+
+/**
+ * Inner sendpacket_open() method for tuntap devices
+ */
+static sendpacket_t *
+sendpacket_open_tuntap(const char *device, char *errbuf)
+{
+    sendpacket_t *sp;
+    int tapfd;
+
+    assert(device);
+    assert(errbuf);
+
+#if defined HAVE_LINUX
+    /* multiqueue, so send threads can each attach a queue of their own */
+    if ((tapfd = sendpacket_attach_tuntap(device, IFF_TAP | IFF_NO_PI | TUNTAP_MULTI_QUEUE, errbuf)) < 0)
+        return NULL;
 #elif defined(HAVE_FREEBSD)
     if (*device == '/') {
         if ((tapfd = open(device, O_RDWR)) < 0) {
@@ -877,10 +1982,11 @@ sendpacket_open_tuntap(const char *device, char *errbuf)
 
 #if defined HAVE_PF_PACKET
 /**
- * Inner sendpacket_open() method for using Linux's PF_PACKET or TX_RING
+ * Inner sendpacket_open() method for using Linux's PF_PACKET, or TX_RING
+ * if tx_ring is set and it was compiled in
  */
 static sendpacket_t *
-sendpacket_open_pf(const char *device, char *errbuf)
+sendpacket_open_pf(const char *device, char *errbuf, bool tx_ring _U_)
 {
     int mysocket;
     sendpacket_t *sp;
@@ -896,11 +2002,12 @@ sendpacket_open_pf(const char *device, char *errbuf)
     assert(device);
     assert(errbuf);
 
-#if defined TX_RING
-    dbg(1, "sendpacket: using TX_RING");
-#else
-    dbg(1, "sendpacket: using PF_PACKET");
+#if defined HAVE_TX_RING
+    if (tx_ring)
+        dbg(1, "sendpacket: using TX_RING");
+    else
 #endif
+        dbg(1, "sendpacket: using PF_PACKET");
 
     memset(&sa, 0, sizeof(sa));
 
@@ -976,7 +2083,12 @@ sendpacket_open_pf(const char *device, char *errbuf)
     strlcpy(sp->device, device, sizeof(sp->device));
     sp->handle.fd = mysocket;
 
+    sp->handle_type = SP_TYPE_PF_PACKET;
+
 #ifdef HAVE_TX_RING
+    if (!tx_ring)
+        return sp;
+
     /* Look up for MTU */
     memset(&ifr, 0, sizeof(ifr));
     strlcpy(ifr.ifr_name, sp->device, sizeof(ifr.ifr_name));
@@ -992,14 +2104,36 @@ sendpacket_open_pf(const char *device, char *errbuf)
     if ((sp->tx_ring = txring_init(sp->handle.fd, mtu)) == 0) {
         snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "txring_init: %s", strerror(errno));
         close(mysocket);
+        safe_free(sp);
+        return NULL;
+    }
+    sp->handle_type = SP_TYPE_TX_RING;
+#endif
+    return sp;
+}
+
+#ifdef HAVE_IO_URING
+/**
+ * open a PF_PACKET socket for the given device, and put an io_uring on it
+ */
+static sendpacket_t *
+sendpacket_open_pf_uring(const char *device, char *errbuf, void *arg)
+{
+    sendpacket_t *sp;
+
+    /* a TX_RING socket only sends what is in its frames */
+    if ((sp = sendpacket_open_pf(device, errbuf, false)) == NULL)
+        return NULL;
+
+    if (sendpacket_open_uring(sp, errbuf, arg) < 0) {
+        close(sp->handle.fd);
+        safe_free(sp);
         return NULL;
     }
-    sp->handle_type = SP_TYPE_TX_RING;
-#else
-    sp->handle_type = SP_TYPE_PF_PACKET;
-#endif
+
     return sp;
 }
+#endif
 
 /**
  * get the interface index (necessary for sending packets w/ PF_PACKET)
@@ -1236,7 +2370,9 @@ sendpacket_get_dlt(sendpacket_t *sp)
 {
     int dlt = DLT_EN10MB;
 
-    if (sp->handle_type == SP_TYPE_KHIAL || sp->handle_type == SP_TYPE_NETMAP || sp->handle_type == SP_TYPE_TUNTAP) {
+    if (sp->handle_type == SP_TYPE_KHIAL || sp->handle_type == SP_TYPE_NETMAP || sp->handle_type == SP_TYPE_TUNTAP ||
+        sp->handle_type == SP_TYPE_AF_XDP || sp->handle_type == SP_TYPE_DPDK || sp->handle_type == SP_TYPE_NULL ||
+        sp->handle_type == SP_TYPE_SIMULATE) {
         /* always EN10MB */
     } else {
 #if defined HAVE_BPF
@@ -1263,6 +2399,225 @@ sendpacket_get_dlt(sendpacket_t *sp)
     return dlt;
 }
 
+#ifdef HAVE_SO_TXTIME
+/**
+ * \brief Turn on SO_TXTIME launch time scheduling
+ *
+ * After this, sendpacket() attaches sp->txtime (if set) to each packet so
+ * the ETF qdisc or the NIC does the pacing.  Launch times can't be given
+ * for TX_RING frames, so a TX_RING handle gives up its ring and falls
+ * back to plain PF_PACKET sends.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+sendpacket_enable_txtime(sendpacket_t *sp)
+{
+    struct sock_txtime cfg;
+
+    assert(sp);
+
+    if (sp->handle_type != SP_TYPE_PF_PACKET && sp->handle_type != SP_TYPE_TX_RING) {
+        sendpacket_seterr(sp, "SO_TXTIME is not supported by the %s injection method", sendpacket_get_method(sp));
+        return -1;
+    }
+
+#ifdef HAVE_TX_RING
+    if (sp->handle_type == SP_TYPE_TX_RING) {
+        txring_close(sp->tx_ring);
+        sp->tx_ring = NULL;
+        sp->handle_type = SP_TYPE_PF_PACKET;
+    }
+#endif
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.clockid = CLOCK_TAI;
+    if (setsockopt(sp->handle.fd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) < 0) {
+        sendpacket_seterr(sp, "Unable to enable SO_TXTIME on %s: %s", sp->device, strerror(errno));
+        return -1;
+    }
+
+    sp->txtime_enabled = true;
+    sp->txtime = 0;
+    return 0;
+}
+#endif /* HAVE_SO_TXTIME */
+
+#ifdef ENABLE_TXSTAMP
+/**
+ * \brief Collect a TX timestamp of every packet, see txstamp.h
+ *
+ * Like SO_TXTIME, this only works on the socket path, so a TX_RING handle
+ * gives up its ring.  With pcap_file, the packets are also written there
+ * with the time they were sent, in the given DLT.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+sendpacket_enable_txstamp(sendpacket_t *sp, const char *pcap_file, int dlt)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+
+    assert(sp);
+
+    if (sp->handle_type != SP_TYPE_PF_PACKET && sp->handle_type != SP_TYPE_TX_RING) {
+        sendpacket_seterr(sp, "TX timestamps are not supported by the %s injection method", sendpacket_get_method(sp));
+        return -1;
+    }
+
+#ifdef HAVE_TX_RING
+    if (sp->handle_type == SP_TYPE_TX_RING) {
+        txring_close(sp->tx_ring);
+        sp->tx_ring = NULL;
+        sp->handle_type = SP_TYPE_PF_PACKET;
+    }
+#endif
+
+    if ((sp->txstamp = txstamp_open(sp->handle.fd, sp->device, pcap_file, dlt, ebuf)) == NULL) {
+        sendpacket_seterr(sp, "%s", ebuf);
+        return -1;
+    }
+
+    return 0;
+}
+#endif /* ENABLE_TXSTAMP */
+
+#ifdef HAVE_PACKET_VNET_HDR
+#if defined HAVE_TUNTAP && defined HAVE_LINUX
+/**
+ * sendpacket_enable_vnet_hdr() for a tap.  IFF_VNET_HDR can only be
+ * set as a queue attaches, so attach a new queue asking for it and
+ * drop the old one.  A multiqueue tap is kept alive by the new queue,
+ * a single queue one is created anew.
+ */
+static int
+sendpacket_enable_vnet_hdr_tuntap(sendpacket_t *sp)
+{
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    int hdr_len = sizeof(struct virtio_net_hdr);
+    struct ifreq ifr;
+    int tapfd;
+
+    memset(&ifr, 0, sizeof(ifr));
+    if (ioctl(sp->handle.fd, TUNGETIFF, (void *)&ifr) < 0) {
+        sendpacket_seterr(sp, "Unable to get flags of %s: %s", sp->device, strerror(errno));
+        return -1;
+    }
+
+    if (!(ifr.ifr_flags & IFF_VNET_HDR)) {
+        if (!(ifr.ifr_flags & TUNTAP_MULTI_QUEUE))
+            close(sp->handle.fd);
+
+        if ((tapfd = sendpacket_attach_tuntap(sp->device, ifr.ifr_flags | IFF_VNET_HDR, ebuf)) < 0) {
+            sendpacket_seterr(sp, "Unable to enable IFF_VNET_HDR on %s: %s", sp->device, ebuf);
+            if (!(ifr.ifr_flags & TUNTAP_MULTI_QUEUE))
+                sp->handle.fd = -1;
+            return -1;
+        }
+
+        if (ifr.ifr_flags & TUNTAP_MULTI_QUEUE)
+            close(sp->handle.fd);
+        sp->handle.fd = tapfd;
+    }
+
+    if (ioctl(sp->handle.fd, TUNSETVNETHDRSZ, &hdr_len) < 0) {
+        sendpacket_seterr(sp, "Unable to set the vnet header size of %s: %s", sp->device, strerror(errno));
+        return -1;
+    }
+
+    sp->vnet_hdr = true;
+    sp->csum_start = 0;
+    sp->csum_offset = 0;
+    sp->gso_size = 0;
+    return 0;
+}
+#endif
+
+/**
+ * \brief Send every packet behind a struct virtio_net_hdr
+ *
+ * The header can ask for the TCP/UDP checksum of a packet to be
+ * filled in on the way out, by the NIC if it offloads transmit
+ * checksums and by the kernel if not, and for a TCP super-frame to
+ * be split into segments (TSO, or GSO in the kernel).  Each packet's
+ * request comes from the sp->csum_* and sp->gso_* fields, or from the
+ * sendpacket_pkt_t of a batch.  This backend only sends the header on the socket path,
+ * so a TX_RING handle gives up its ring and falls back to plain
+ * PF_PACKET sends.  A tap takes the same header with IFF_VNET_HDR.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+sendpacket_enable_vnet_hdr(sendpacket_t *sp)
+{
+    int on = 1;
+
+    assert(sp);
+
+#if defined HAVE_TUNTAP && defined HAVE_LINUX
+    if (sp->handle_type == SP_TYPE_TUNTAP)
+        return sendpacket_enable_vnet_hdr_tuntap(sp);
+#endif
+
+    if (sp->handle_type != SP_TYPE_PF_PACKET && sp->handle_type != SP_TYPE_TX_RING) {
+        sendpacket_seterr(sp,
+                          "PACKET_VNET_HDR is not supported by the %s injection method",
+                          sendpacket_get_method(sp));
+        return -1;
+    }
+
+#ifdef HAVE_TX_RING
+    if (sp->handle_type == SP_TYPE_TX_RING) {
+        txring_close(sp->tx_ring);
+        sp->tx_ring = NULL;
+        sp->handle_type = SP_TYPE_PF_PACKET;
+    }
+#endif
+
+    if (setsockopt(sp->handle.fd, SOL_PACKET, PACKET_VNET_HDR, &on, sizeof(on)) < 0) {
+        sendpacket_seterr(sp, "Unable to enable PACKET_VNET_HDR on %s: %s", sp->device, strerror(errno));
+        return -1;
+    }
+
+    sp->vnet_hdr = true;
+    sp->csum_start = 0;
+    sp->csum_offset = 0;
+    sp->gso_size = 0;
+    return 0;
+}
+#endif /* HAVE_PACKET_VNET_HDR */
+
+/**
+ * \brief Speed of the link the device is on in Mbps, 0 if unknown
+ *
+ * Read from sysfs, so only known on Linux.  Links which are down or
+ * don't have a speed, e.g. tun/tap, report -1 there.
+ */
+COUNTER
+sendpacket_get_link_mbps(sendpacket_t *sp)
+{
+    char path[128];
+    long long mbps;
+    FILE *f;
+
+    assert(sp);
+
+#ifdef HAVE_DPDK
+    if (sp->handle_type == SP_TYPE_DPDK)
+        return sendpacket_get_link_mbps_dpdk(sp);
+#endif
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/speed", sp->device);
+    if ((f = fopen(path, "r")) == NULL)
+        return 0;
+
+    if (fscanf(f, "%lld", &mbps) != 1 || mbps < 0)
+        mbps = 0;
+    fclose(f);
+
+    return (COUNTER)mbps;
+}
+
 /**
  * \brief Returns a string of the name of the injection method being used
  */
@@ -1275,6 +2630,28 @@ sendpacket_get_method(sendpacket_t *sp)
         return "khial";
     } else if (sp->handle_type == SP_TYPE_NETMAP) {
         return "netmap";
+    } else if (sp->handle_type == SP_TYPE_AF_XDP) {
+        return "AF_XDP";
+    } else if (sp->handle_type == SP_TYPE_DPDK) {
+        return "DPDK";
+    } else if (sp->handle_type == SP_TYPE_IO_URING) {
+        return "io_uring";
+    } else if (sp->handle_type == SP_TYPE_TUNTAP) {
+        return "tuntap writev()";
+    } else if (sp->handle_type == SP_TYPE_NULL) {
+        return "null";
+    } else if (sp->handle_type == SP_TYPE_SIMULATE) {
+        return "simulate";
+#ifdef HAVE_PF_PACKET
+    } else if (sp->handle_type == SP_TYPE_PF_PACKET) {
+        return "PF_PACKET send()";
+    } else if (sp->handle_type == SP_TYPE_TX_RING) {
+        return "PF_PACKET / TX_RING";
+#endif
+#ifdef PCAP_INJECT_METHOD
+    } else if (sp->handle_type == SP_TYPE_LIBPCAP) {
+        return PCAP_INJECT_METHOD;
+#endif
     } else {
         return INJECT_METHOD;
     }
@@ -1306,6 +2683,57 @@ sendpacket_open_khial(const char *device, char *errbuf)
     return sp;
 }
 
+/**
+ * Opens a handle which accepts and throws away every packet, so the cost
+ * of everything but the actual injection can be measured
+ */
+static sendpacket_t *
+sendpacket_open_null(const char *device, char *errbuf _U_)
+{
+    sendpacket_t *sp;
+
+    assert(device);
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.fd = -1;
+    sp->handle_type = SP_TYPE_NULL;
+
+    return sp;
+}
+
+/**
+ * Opens a handle which writes every packet to the pcap file device,
+ * stamped with the time it would have been sent, see --simulate
+ */
+static sendpacket_t *
+sendpacket_open_simulate(const char *device, char *errbuf)
+{
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    char pbuf[PCAP_ERRBUF_SIZE];
+    pcap_writer_t *pw;
+    sendpacket_t *sp;
+
+    assert(device);
+
+    if ((pw = pcap_writer_open(device, DLT_EN10MB, MAXPACKET, PCAP_WRITER_DEFAULT_BUFSIZE, pbuf)) == NULL) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to open %s: %s", device, pbuf);
+        return NULL;
+    }
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.fd = -1;
+    sp->handle_type = SP_TYPE_SIMULATE;
+    sp->sim_writer = pw;
+
+    return sp;
+#else
+    snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to open %s: libpcap has no pcap_dump_fopen()", device);
+    return NULL;
+#endif
+}
+
 /**
  * Get the hardware MAC address for the given interface using khial
  */
@@ -1326,4 +2754,293 @@ sendpacket_abort(sendpacket_t *sp)
     assert(sp);
 
     sp->abort = true;
+    sendpacket_wake(sp);
+}
+
+/**
+ * \brief cut short whatever interruptible wait sp is in, or the next one
+ *
+ * Sets sp->woken and makes the fd from sendpacket_wake_fd() readable,
+ * which ends sendpacket_nap(), sendpacket_wait(), the backpressure waits
+ * and the sleeps of the --timer methods which sleep in the kernel.  The
+ * sleeper decides what the wake up was for, an abort, a suspend or a
+ * pause, and calls sendpacket_wake_clear() when it carries on.  Safe to
+ * call from a signal handler or another thread.
+ */
+void
+sendpacket_wake(sendpacket_t *sp)
+{
+    int fd;
+
+    assert(sp);
+
+    /* pairs with the seq_cst loads in sendpacket_wake_fd() and sendpacket_nap() */
+    __atomic_store_n(&sp->woken, true, __ATOMIC_SEQ_CST);
+    fd = __atomic_load_n(&sp->wake_wfd, __ATOMIC_SEQ_CST);
+    if (fd > 0) {
+        u_int64_t one = 1;
+
+        /* a full pipe is already readable */
+        if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            return;
+    }
+}
+
+/**
+ * \brief fd which becomes readable on sendpacket_wake(), -1 if there is none
+ *
+ * Created by the first wait, an eventfd where there are eventfds, else a
+ * pipe.  Without one, waits still end on sp->woken but only when they
+ * time out.
+ */
+int
+sendpacket_wake_fd(sendpacket_t *sp)
+{
+    int fds[2];
+
+    assert(sp);
+
+    if (sp->wake_rfd != 0)
+        return sp->wake_rfd;
+
+#if defined HAVE_SYS_EVENTFD_H && defined EFD_NONBLOCK
+    fds[0] = fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (fds[0] < 0)
+#endif
+    {
+        if (pipe(fds) < 0) {
+            sendpacket_seterr(sp, "Unable to create wake up pipe: %s", strerror(errno));
+            sp->wake_rfd = -1;
+            return -1;
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    }
+
+    /* a wake up from before wake_wfd was set was seen in sp->woken */
+    __atomic_store_n(&sp->wake_rfd, fds[0], __ATOMIC_SEQ_CST);
+    __atomic_store_n(&sp->wake_wfd, fds[1], __ATOMIC_SEQ_CST);
+
+    return fds[0];
+}
+
+/**
+ * \brief make the sendpacket_wake_fd() unreadable again
+ */
+void
+sendpacket_wake_drain(sendpacket_t *sp)
+{
+    u_int64_t buf[8];
+
+    assert(sp);
+
+    if (sp->wake_rfd > 0) {
+        while (read(sp->wake_rfd, buf, sizeof(buf)) > 0)
+            ;
+    }
+}
+
+/**
+ * \brief sleep for nap_ns, less if sendpacket_wake() is called
+ *
+ * Returns true when woken, straight away if sp is woken already.
+ */
+bool
+sendpacket_nap(sendpacket_t *sp, u_int64_t nap_ns)
+{
+    u_int64_t until = tcpr_clock_ns() + nap_ns;
+    struct timespec nap;
+    int fd;
+
+    assert(sp);
+
+    fd = sendpacket_wake_fd(sp);
+    if (fd < 0 || fd >= FD_SETSIZE) {
+        if (!sendpacket_is_woken(sp)) {
+            NANOSEC_TO_TIMESPEC(nap_ns, &nap);
+            nanosleep(&nap, NULL);
+        }
+        return sendpacket_is_woken(sp);
+    }
+
+    while (!sendpacket_is_woken(sp)) {
+        u_int64_t now = tcpr_clock_ns();
+        fd_set rfds;
+
+        if (now >= until)
+            break;
+
+        NANOSEC_TO_TIMESPEC(until - now, &nap);
+        FD_ZERO(&rfds);
+        FD_SET(fd, &rfds);
+        /* readable with sp->woken unset is a stale wake up, sleep on */
+        if (pselect(fd + 1, &rfds, NULL, NULL, &nap, NULL) > 0)
+            sendpacket_wake_drain(sp);
+    }
+
+    return sendpacket_is_woken(sp);
+}
+
+#ifdef HAVE_TIMERFD_WAIT
+/**
+ * \brief set up sendpacket_wait() for the calling thread
+ *
+ * An epoll set holds a timerfd for the deadline and the fd which
+ * sendpacket_wake() makes readable.  The timer slack of the thread is cut
+ * to the minimum, or the kernel may add 50 usec to every wake up.  Returns
+ * -1 when not possible, and sendpacket_wait() must not be used.
+ */
+int
+sendpacket_wait_open(sendpacket_t *sp)
+{
+    struct epoll_event ev;
+    int wake_fd;
+
+    assert(sp);
+
+    sp->wait_epfd = -1;
+    sp->wait_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    wake_fd = sendpacket_wake_fd(sp);
+    if (sp->wait_timerfd < 0 || wake_fd < 0 || (sp->wait_epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        goto fail;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = sp->wait_timerfd;
+    if (epoll_ctl(sp->wait_epfd, EPOLL_CTL_ADD, sp->wait_timerfd, &ev) < 0)
+        goto fail;
+    ev.data.fd = wake_fd;
+    if (epoll_ctl(sp->wait_epfd, EPOLL_CTL_ADD, wake_fd, &ev) < 0)
+        goto fail;
+
+#if defined HAVE_SYS_PRCTL_H && defined PR_SET_TIMERSLACK
+    prctl(PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+#endif
+
+    return 0;
+
+fail:
+    sendpacket_seterr(sp, "Unable to set up timerfd waits: %s", strerror(errno));
+    if (sp->wait_epfd >= 0)
+        close(sp->wait_epfd);
+    if (sp->wait_timerfd >= 0)
+        close(sp->wait_timerfd);
+    sp->wait_epfd = -1;
+    return -1;
+}
+
+/**
+ * \brief wait until deadline_ns on the tcpr_clock_ns() clock, fd becomes
+ * writable, or sp is woken, whichever comes first
+ *
+ * fd is -1 to only wait for the deadline.  The timer is armed with an
+ * absolute time, so however late the call, the wait ends on time.
+ * Returns SENDPACKET_WAIT_DEADLINE, SENDPACKET_WAIT_WRITABLE or
+ * SENDPACKET_WAIT_WAKE, or -1 on error.
+ */
+int
+sendpacket_wait(sendpacket_t *sp, u_int64_t deadline_ns, int fd)
+{
+    struct epoll_event ev[3];
+    struct itimerspec its;
+    struct timespec mono;
+    u_int64_t now_ns;
+    int ret = -1, n, i;
+
+    assert(sp);
+    assert(sp->wait_epfd > 0);
+
+    if (sendpacket_is_woken(sp))
+        return SENDPACKET_WAIT_WAKE;
+
+    /* timerfd has no CLOCK_MONOTONIC_RAW, so move the deadline over to CLOCK_MONOTONIC */
+    now_ns = tcpr_clock_ns();
+    if (now_ns >= deadline_ns)
+        return SENDPACKET_WAIT_DEADLINE;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+
+    memset(&its, 0, sizeof(its));
+    NANOSEC_TO_TIMESPEC(TIMESPEC_TO_NANOSEC(&mono) + (deadline_ns - now_ns), &its.it_value);
+    if (timerfd_settime(sp->wait_timerfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+        sendpacket_seterr(sp, "Unable to arm timerfd: %s", strerror(errno));
+        return -1;
+    }
+
+    /* a writable fd is only watched for the wait, or it would end every nap */
+    if (fd >= 0) {
+        memset(&ev[0], 0, sizeof(ev[0]));
+        ev[0].events = EPOLLOUT;
+        ev[0].data.fd = fd;
+        if (epoll_ctl(sp->wait_epfd, EPOLL_CTL_ADD, fd, &ev[0]) < 0) {
+            sendpacket_seterr(sp, "Unable to wait for %s to be writable: %s", sp->device, strerror(errno));
+            return -1;
+        }
+    }
+
+    do {
+        n = epoll_wait(sp->wait_epfd, ev, 3, -1);
+    } while (n < 0 && errno == EINTR && !sendpacket_is_woken(sp));
+
+    if (n < 0 && errno != EINTR) {
+        sendpacket_seterr(sp, "epoll_wait() failed: %s", strerror(errno));
+    } else {
+        /* a wake up wins over room to send, room to send over the deadline */
+        ret = SENDPACKET_WAIT_DEADLINE;
+        for (i = 0; i < n; i++) {
+            if (ev[i].data.fd == sp->wake_rfd)
+                sendpacket_wake_drain(sp);
+            else if (ev[i].data.fd == fd)
+                ret = SENDPACKET_WAIT_WRITABLE;
+        }
+        if (sendpacket_is_woken(sp))
+            ret = SENDPACKET_WAIT_WAKE;
+    }
+
+    if (fd >= 0)
+        epoll_ctl(sp->wait_epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    return ret;
+}
+#endif /* HAVE_TIMERFD_WAIT */
+
+/**
+ * \brief let sp send packets straight out of len bytes of memory at addr
+ *
+ * For the packet cache.  DPDK registers the memory with the NIC and
+ * io_uring with every ring, other injection methods do nothing.
+ * The memory must be given to sendpacket_unregister_mem() before it is
+ * freed.
+ */
+void
+sendpacket_register_mem(sendpacket_t *sp, void *addr, size_t len)
+{
+    assert(sp);
+
+#ifdef HAVE_DPDK
+    if (sp->handle_type == SP_TYPE_DPDK)
+        sendpacket_dpdk_register(sp, addr, len);
+#endif
+#ifdef HAVE_IO_URING
+    if (sp->handle_type == SP_TYPE_IO_URING)
+        sendpacket_uring_register(addr, len);
+#endif
+    (void)addr;
+    (void)len;
+}
+
+/**
+ * \brief undo sendpacket_register_mem() for memory about to be freed.
+ * Does nothing for memory which wasn't registered
+ */
+void
+sendpacket_unregister_mem(void *addr _U_, size_t len _U_)
+{
+#ifdef HAVE_DPDK
+    sendpacket_dpdk_unregister(addr, len);
+#endif
+#ifdef HAVE_IO_URING
+    sendpacket_uring_unregister(addr, len);
+#endif
 }
@@ -22,7 +22,14 @@
 
 #include "defines.h"
 #include "config.h"
+#include "common/digest.h"
+#include "common/histogram.h"
+#include "common/pcap_writer.h"
+#include "common/profile.h"
+#include "common/trace_ring.h"
+#include "common/txstamp.h"
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 #ifdef __NetBSD__
 #include <net/if_ether.h>
@@ -36,13 +43,30 @@
 #endif
 
 #ifdef HAVE_PF_PACKET
+#ifdef HAVE_TX_RING
+/* clashes with netpacket/packet.h, but has all of it plus TPACKET_* */
+#include <linux/if_packet.h>
+#else
 #include <netpacket/packet.h>
 #endif
+#endif
 
 #ifdef HAVE_TX_RING
 #include "txring.h"
 #endif
 
+#ifdef HAVE_AF_XDP
+#include "common/xdp.h"
+#endif
+
+#ifdef HAVE_DPDK
+#include "common/dpdk.h"
+#endif
+
+#ifdef HAVE_IO_URING
+#include "common/uring.h"
+#endif
+
 #ifdef HAVE_LIBDNET
 /* need to undef these which are pulled in via defines.h, prior to importing dnet.h */
 #undef icmp_id
@@ -67,9 +91,22 @@ typedef enum sendpacket_type_e {
     SP_TYPE_TX_RING,
     SP_TYPE_KHIAL,
     SP_TYPE_NETMAP,
-    SP_TYPE_TUNTAP
+    SP_TYPE_TUNTAP,
+    SP_TYPE_AF_XDP,
+    SP_TYPE_DPDK,
+    SP_TYPE_IO_URING, /* PF_PACKET socket fed through an io_uring */
+    SP_TYPE_NULL, /* discards packets, for benchmarks */
+    SP_TYPE_SIMULATE /* --simulate: writes packets to a pcap, stamped when they would have gone out */
 } sendpacket_type_t;
 
+typedef struct sendpacket_method_s {
+    const char *name;   /* as given to --inject */
+    const char *descr;  /* as sendpacket_get_method() puts it */
+    sendpacket_type_t type;
+} sendpacket_method_t;
+
+extern const sendpacket_method_t sendpacket_methods[];
+
 /* these are the file_operations ioctls */
 #define KHIAL_SET_DIRECTION (0x1)
 #define KHIAL_GET_DIRECTION (0x2)
@@ -89,8 +126,23 @@ union sendpacket_handle {
 };
 
 #define SENDPACKET_ERRBUF_SIZE 1024
+/* how long to poll() for a full socket to become writable, in ms */
+#define SENDPACKET_POLL_TIMEOUT 10
+/* first and longest sleep while the NIC queue stays full */
+#define SENDPACKET_BACKOFF_MIN_NS 1000
+#define SENDPACKET_BACKOFF_MAX_NS 1000000
 #define MAX_IFNAMELEN 64
 
+/* sendpacket_wait(): one epoll set for the deadline, room to send and wake ups */
+#if defined HAVE_SYS_TIMERFD_H && defined HAVE_SYS_EPOLL_H && defined HAVE_SYS_EVENTFD_H
+#define HAVE_TIMERFD_WAIT 1
+#endif
+
+/* what sendpacket_wait() woke up for */
+#define SENDPACKET_WAIT_DEADLINE 0
+#define SENDPACKET_WAIT_WRITABLE 1
+#define SENDPACKET_WAIT_WAKE 2
+
 struct sendpacket_s {
     tcpr_dir_t cache_dir;
     int open;
@@ -109,6 +161,32 @@ struct sendpacket_s {
     COUNTER flows_unique;
     COUNTER flows_expired;
     COUNTER flows_invalid_packets;
+    COUNTER sleep_ns;          /* time spent waiting to send */
+    COUNTER backpressure_ns;   /* time spent waiting for room in a full queue */
+    u_int64_t backoff_ns;      /* next ENOBUFS back off, 0 after a packet was sent */
+    u_int64_t sleep_margin_ns; /* --timer=hybrid: how early to wake up and spin */
+    int kq;                    /* --timer=kqueue: 0 until the first nap, -1 if unusable */
+    /*
+     * sendpacket_wake() cuts interruptible waits short, see
+     * sendpacket_wake_fd().  0 until the first wait, -1 if unusable
+     */
+    int wake_rfd;
+    int wake_wfd;
+    bool woken;
+#ifdef HAVE_TIMERFD_WAIT
+    /* --timer=timerfd, see sendpacket_wait_open() */
+    int wait_epfd; /* 0 until the first nap, -1 if unusable */
+    int wait_timerfd;
+#endif
+    volatile bool paused;      /* hold packets for this interface, see tcpreplay_control_pause() */
+    /* --timing-stats, all in ns */
+    tcpr_hist_t late;      /* actual minus scheduled send time */
+    tcpr_hist_t gap;       /* inter-packet gap error vs. the schedule */
+    tcpr_hist_t overshoot; /* sleeps which took longer than asked */
+    tcpr_hist_t batch;     /* packets per sendpacket_batch() call, always kept */
+    tcpr_profile_t profile; /* --profile: time spent in each stage of the send loop */
+    tcpr_trace_t *trace;    /* --trace-ring, NULL if off */
+    tcpr_digest_t *digest;  /* --digest, NULL if off */
     sendpacket_type_t handle_type;
     union sendpacket_handle handle;
     struct tcpr_ether_addr ether;
@@ -126,6 +204,14 @@ struct sendpacket_s {
     uint32_t is_vale;
     int netmap_version;
     uint16_t first_tx_ring, last_tx_ring, cur_tx_ring;
+    /* zero copy sends of cached packets, see sendpacket_netmap_alloc() */
+    uint32_t **nm_slot_buf; /* per TX ring, the buffer each slot came with */
+    uint32_t *nm_bufs;      /* extra buffers handed out to the packet cache */
+    uint32_t nm_bufs_cnt;
+    uint32_t nm_extra_head; /* first extra buffer not handed out yet, 0 if none */
+    uintptr_t nm_zc_base;   /* where buffer 0 of the cached packets is mapped */
+    uintptr_t nm_zc_end;
+    bool nm_ring_only;      /* another TX ring of a NIC opened elsewhere */
 #ifdef linux
     uint32_t data;
     uint32_t gso;
@@ -141,17 +227,125 @@ struct sendpacket_s {
     txring_t *tx_ring;
 #endif
 #endif
+#ifdef HAVE_AF_XDP
+    xdp_t *xdp;
+#endif
+#ifdef HAVE_DPDK
+    dpdk_t *dpdk;
+#endif
+#ifdef HAVE_IO_URING
+    uring_t *uring;
+#endif
+#ifdef HAVE_SO_TXTIME
+    bool txtime_enabled;
+    uint64_t txtime; /* CLOCK_TAI launch time (ns) of the next packet, 0 to send now */
+#endif
+#ifdef HAVE_PACKET_VNET_HDR
+    bool vnet_hdr;        /* packets go out behind a struct virtio_net_hdr */
+    uint16_t csum_start;  /* of the next packet, see sendpacket_pkt_t */
+    uint16_t csum_offset;
+    uint16_t gso_size;
+    uint16_t gso_hdr_len;
+    bool gso_v6;
+#endif
+#ifdef ENABLE_TXSTAMP
+    txstamp_t *txstamp; /* --tx-timestamps, NULL if off */
+#endif
+    pcap_writer_t *sim_writer; /* SP_TYPE_SIMULATE */
+    /* contiguous copy of a multi-segment packet for backends which need it */
+    u_char *gather_buf;
+    size_t gather_size;
     bool abort;
 };
 
 typedef struct sendpacket_s sendpacket_t;
 
+/* packet descriptor for sendpacket_batch() */
+#define SENDPACKET_BATCH_MAX 256
+typedef struct sendpacket_pkt_s {
+    const u_char *data;
+    size_t len;
+    struct pcap_pkthdr *pkthdr;
+    /*
+     * with sendpacket_enable_vnet_hdr(), the NIC sums from csum_start to
+     * the end and stores it at csum_start + csum_offset, which holds the
+     * sum of the pseudo header.  csum_offset is 0 for none.
+     */
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    /*
+     * a packet with a gso_size is a TCP super-frame, which goes out as
+     * segments of gso_size bytes of payload, each behind a copy of the
+     * first gso_hdr_len bytes.  Requires a csum_offset.  0 for none.
+     */
+    uint16_t gso_size;
+    uint16_t gso_hdr_len;
+    bool gso_v6;
+#ifdef HAVE_SO_TXTIME
+    /* with sendpacket_enable_txtime(), the launch time of the packet, 0 for sp->txtime */
+    uint64_t txtime;
+#endif
+} sendpacket_pkt_t;
+
+/* packets a super-frame of len bytes goes out as, see sendpacket_pkt_t */
+static inline COUNTER
+sendpacket_gso_segs(size_t len, uint16_t gso_size, uint16_t gso_hdr_len)
+{
+    if (gso_size == 0 || len <= gso_hdr_len)
+        return 1;
+
+    return (len - gso_hdr_len + gso_size - 1) / gso_size;
+}
+
+/* most segments a single packet may be split into for sendpacket_iov() */
+#define SENDPACKET_IOV_MAX 16
+
 int sendpacket(sendpacket_t *, const u_char *, size_t, struct pcap_pkthdr *);
+int sendpacket_iov(sendpacket_t *, const struct iovec *, int, struct pcap_pkthdr *);
+int sendpacket_batch(sendpacket_t *, const sendpacket_pkt_t *, int);
+int sendpacket_batch_room(sendpacket_t *);
+#ifdef HAVE_SO_TXTIME
+int sendpacket_enable_txtime(sendpacket_t *);
+#endif
+#ifdef HAVE_PACKET_VNET_HDR
+int sendpacket_enable_vnet_hdr(sendpacket_t *);
+#endif
+#if defined HAVE_TUNTAP && defined HAVE_LINUX
+sendpacket_t *sendpacket_open_tuntap_queue(sendpacket_t *, char *);
+#endif
+#ifdef ENABLE_TXSTAMP
+int sendpacket_enable_txstamp(sendpacket_t *, const char *, int);
+#endif
 void sendpacket_close(sendpacket_t *);
 char *sendpacket_geterr(sendpacket_t *);
-size_t sendpacket_getstat(sendpacket_t *, char *, size_t);
+size_t sendpacket_getstat(sendpacket_t *, char *, size_t, bool);
 sendpacket_t *sendpacket_open(const char *, char *, tcpr_dir_t, sendpacket_type_t, void *arg);
+sendpacket_t *sendpacket_try_open(const char *, char *, tcpr_dir_t, sendpacket_type_t, void *arg);
 struct tcpr_ether_addr *sendpacket_get_hwaddr(sendpacket_t *);
 int sendpacket_get_dlt(sendpacket_t *);
+COUNTER sendpacket_get_link_mbps(sendpacket_t *);
 const char *sendpacket_get_method(sendpacket_t *);
 void sendpacket_abort(sendpacket_t *);
+void sendpacket_wake(sendpacket_t *);
+int sendpacket_wake_fd(sendpacket_t *);
+void sendpacket_wake_drain(sendpacket_t *);
+bool sendpacket_nap(sendpacket_t *, u_int64_t nap_ns);
+#ifdef HAVE_TIMERFD_WAIT
+int sendpacket_wait_open(sendpacket_t *);
+int sendpacket_wait(sendpacket_t *, u_int64_t deadline_ns, int fd);
+#endif
+void sendpacket_register_mem(sendpacket_t *, void *, size_t);
+void sendpacket_unregister_mem(void *, size_t);
+
+/* true from sendpacket_wake() until sendpacket_wake_clear() */
+static inline bool
+sendpacket_is_woken(sendpacket_t *sp)
+{
+    return __atomic_load_n(&sp->woken, __ATOMIC_SEQ_CST);
+}
+
+static inline void
+sendpacket_wake_clear(sendpacket_t *sp)
+{
+    __atomic_store_n(&sp->woken, false, __ATOMIC_SEQ_CST);
+}
@@ -0,0 +1,421 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The writer and the reader each keep their own side of the data area:
+ * the writer's data_head, and data_tail, which the reader moves to the
+ * end of a batch when it asks for the next one.  A packet never wraps
+ * round the end of the data area, the writer skips to the start instead,
+ * so the reader can hand it out where it is.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_RINGS /* see memstat.h */
+
+#include "shm_pipe.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+
+#ifdef HAVE_SHM_PIPE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_PIPE_MAGIC 0x74637270 /* "tcrp" */
+#define SHM_PIPE_VERSION 1
+
+/* polls of a full or empty pipe before yielding the CPU */
+#define SHM_PIPE_SPINS 128
+/* how often the reader looks for the writer to create the pipe */
+#define SHM_PIPE_OPEN_POLL_US 10000
+
+#define SHM_PIPE_ALIGN(x, a) (((x) + (a)-1) & ~((u_int64_t)(a)-1))
+
+/* "shm:NAME" to "/NAME" for shm_open() */
+static char *
+shm_pipe_name(const char *path, char *ebuf)
+{
+    const char *name = path + strlen(SHM_PIPE_PREFIX);
+    char *shm_name;
+
+    if (*name == '\0' || strchr(name, '/') != NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: shared memory pipe names can't be empty or contain '/'", path);
+        return NULL;
+    }
+
+    shm_name = safe_malloc(strlen(name) + 2);
+    shm_name[0] = '/';
+    strcpy(shm_name + 1, name);
+    return shm_name;
+}
+
+/* the writer is still there, or we can't tell */
+static bool
+shm_pipe_writer_alive(const shm_pipe_t *p)
+{
+    return kill(p->hdr->writer, 0) == 0 || errno != ESRCH;
+}
+
+/**
+ * \brief create the pipe named by path, "shm:NAME", for writing
+ *
+ * A pipe left behind under the same name, if no reader ever opened it,
+ * is replaced.  Returns NULL and fills in ebuf on error.
+ */
+shm_pipe_t *
+shm_pipe_create(const char *path, int dlt, int snaplen, bool nsec, char *ebuf)
+{
+    size_t ring_size = tcpr_ring_memsize(SHM_PIPE_SLOTS, sizeof(shm_pipe_desc_t));
+    u_int64_t ring_off, data_off, mapsize;
+    shm_pipe_hdr_t *hdr;
+    shm_pipe_t *p;
+    char *name;
+    void *map;
+    int fd;
+
+    assert(path);
+    assert(ebuf);
+
+    if ((name = shm_pipe_name(path, ebuf)) == NULL)
+        return NULL;
+
+    ring_off = SHM_PIPE_ALIGN(sizeof(shm_pipe_hdr_t), 64);
+    data_off = SHM_PIPE_ALIGN(ring_off + ring_size, (u_int64_t)getpagesize());
+    mapsize = data_off + SHM_PIPE_DATA_SIZE;
+
+    shm_unlink(name);
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        safe_free(name);
+        return NULL;
+    }
+
+    if (ftruncate(fd, (off_t)mapsize) < 0 ||
+        (map = mmap(NULL, (size_t)mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        safe_free(name);
+        return NULL;
+    }
+    close(fd);
+
+    hdr = map;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->version = SHM_PIPE_VERSION;
+    hdr->dlt = dlt;
+    hdr->snaplen = snaplen;
+    hdr->nsec = nsec ? 1 : 0;
+    hdr->writer = getpid();
+    hdr->mapsize = mapsize;
+    hdr->ring_off = ring_off;
+    hdr->data_off = data_off;
+    hdr->data_size = SHM_PIPE_DATA_SIZE;
+
+    p = safe_malloc(sizeof(*p));
+    p->name = name;
+    p->writer = true;
+    p->hdr = hdr;
+    p->ring = tcpr_ring_init((u_char *)map + ring_off,
+                             SHM_PIPE_SLOTS,
+                             sizeof(shm_pipe_desc_t),
+                             TCPR_RING_SHARED,
+                             TCPR_RING_FUTEX);
+    p->data = (u_char *)map + data_off;
+
+    /* the reader may look at the rest once the magic is there */
+    __atomic_store_n(&hdr->magic, SHM_PIPE_MAGIC, __ATOMIC_RELEASE);
+
+    return p;
+}
+
+/**
+ * \brief queue the descriptors written so far, waiting for room as needed
+ *
+ * Returns 0, or -1 if the reader has gone away.
+ */
+int
+shm_pipe_flush(shm_pipe_t *p)
+{
+    assert(p && p->writer);
+
+    if (p->pending_cnt == 0)
+        return p->hdr->reader_gone ? -1 : 0;
+
+    if (tcpr_ring_enqueue_wait(p->ring, p->pending, p->pending_cnt, (const volatile bool *)&p->hdr->reader_gone) <
+        p->pending_cnt) {
+        snprintf(p->errbuf, sizeof(p->errbuf), "%s", "The reader of the shared memory pipe went away");
+        return -1;
+    }
+
+    p->pending_cnt = 0;
+    return 0;
+}
+
+/**
+ * \brief wait for len contiguous bytes of the data area at data_head
+ */
+static int
+shm_pipe_reserve(shm_pipe_t *p, u_int64_t len)
+{
+    u_int64_t size = p->hdr->data_size;
+    u_int64_t pos = p->data_head % size;
+    int spins = 0;
+
+    /* packets don't wrap, skip the end of the area instead */
+    if (pos + len > size)
+        p->data_head += size - pos;
+
+    while (p->data_head + len - __atomic_load_n(&p->hdr->data_tail, __ATOMIC_ACQUIRE) > size) {
+        /* the reader can only give back bytes it has the descriptors of */
+        if (shm_pipe_flush(p) < 0)
+            return -1;
+
+        if (__atomic_load_n(&p->hdr->reader_gone, __ATOMIC_ACQUIRE)) {
+            snprintf(p->errbuf, sizeof(p->errbuf), "%s", "The reader of the shared memory pipe went away");
+            return -1;
+        }
+
+        if (++spins < SHM_PIPE_SPINS) {
+            __asm__ __volatile__("" ::: "memory");
+        } else {
+            spins = 0;
+            sched_yield();
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \brief write a packet made of iovcnt segments into the pipe
+ *
+ * Their lengths must add up to pkthdr->caplen.  Returns 0, or -1 if the
+ * reader has gone away, see shm_pipe_geterr().
+ */
+int
+shm_pipe_writev(shm_pipe_t *p, const struct pcap_pkthdr *pkthdr, const struct iovec *iov, int iovcnt)
+{
+    shm_pipe_desc_t *desc;
+    u_char *dst;
+    int i;
+
+    assert(p && p->writer);
+    assert(pkthdr);
+
+    if (pkthdr->caplen > p->hdr->data_size / 2) {
+        snprintf(p->errbuf,
+                 sizeof(p->errbuf),
+                 "Packet of %u bytes is too big for a shared memory pipe",
+                 pkthdr->caplen);
+        return -1;
+    }
+
+    if (shm_pipe_reserve(p, SHM_PIPE_ALIGN(pkthdr->caplen, 8)) < 0)
+        return -1;
+
+    dst = p->data + p->data_head % p->hdr->data_size;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+        dst += iov[i].iov_len;
+    }
+
+    desc = &p->pending[p->pending_cnt++];
+    desc->offset = p->data_head;
+    desc->ts_sec = (u_int64_t)pkthdr->ts.tv_sec;
+    desc->ts_frac = (u_int32_t)pkthdr->ts.tv_usec;
+    desc->caplen = pkthdr->caplen;
+    desc->len = pkthdr->len;
+    desc->pad = 0;
+    p->data_head += SHM_PIPE_ALIGN(pkthdr->caplen, 8);
+
+    if (p->pending_cnt == SHM_PIPE_BATCH)
+        return shm_pipe_flush(p);
+
+    return 0;
+}
+
+/**
+ * \brief open the pipe named by path, "shm:NAME", for reading
+ *
+ * Waits for the writer to create it, then takes the name away so the
+ * next writer starts a new pipe.  Returns NULL and fills in ebuf on error.
+ */
+shm_pipe_t *
+shm_pipe_open(const char *path, char *ebuf)
+{
+    shm_pipe_hdr_t *hdr;
+    shm_pipe_t *p;
+    struct stat st;
+    bool waited = false;
+    char *name;
+    void *map;
+    int fd;
+
+    assert(path);
+    assert(ebuf);
+
+    if ((name = shm_pipe_name(path, ebuf)) == NULL)
+        return NULL;
+
+    /* the writer creates, sizes and fills in the header, in that order */
+    for (;;) {
+        if ((fd = shm_open(name, O_RDWR, 0)) < 0 && errno != ENOENT) {
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+            safe_free(name);
+            return NULL;
+        }
+
+        if (fd >= 0) {
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(*hdr)) {
+                if ((map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+                    snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: %s", path, strerror(errno));
+                    close(fd);
+                    safe_free(name);
+                    return NULL;
+                }
+
+                hdr = map;
+                if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) == SHM_PIPE_MAGIC)
+                    break;
+                munmap(map, (size_t)st.st_size);
+            }
+            close(fd);
+        }
+
+        if (!waited) {
+            notice("Waiting for a writer to create %s", path);
+            waited = true;
+        }
+        usleep(SHM_PIPE_OPEN_POLL_US);
+    }
+    close(fd);
+
+    if (hdr->version != SHM_PIPE_VERSION || hdr->mapsize != (u_int64_t)st.st_size) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: shared memory pipe of an unknown version", path);
+        munmap(map, (size_t)st.st_size);
+        safe_free(name);
+        return NULL;
+    }
+
+    /* one reader per pipe */
+    shm_unlink(name);
+
+    p = safe_malloc(sizeof(*p));
+    p->name = name;
+    p->hdr = hdr;
+    p->ring = (tcpr_ring_t *)((u_char *)map + hdr->ring_off);
+    p->data = (u_char *)map + hdr->data_off;
+
+    return p;
+}
+
+/**
+ * \brief the next 1 to max packets, 0 once the writer has closed the pipe
+ *
+ * The packets are in the data area, and only good until the next call.
+ */
+int
+shm_pipe_next(shm_pipe_t *p, struct pcap_pkthdr *pkthdr, u_char **data, int max)
+{
+    shm_pipe_desc_t desc[SHM_PIPE_BATCH];
+    u_int32_t cnt, i;
+    int spins = 0;
+
+    assert(p && !p->writer);
+
+    /* done with the last batch */
+    __atomic_store_n(&p->hdr->data_tail, p->released, __ATOMIC_RELEASE);
+
+    if (max > SHM_PIPE_BATCH)
+        max = SHM_PIPE_BATCH;
+
+    while ((cnt = tcpr_ring_dequeue(p->ring, desc, (u_int32_t)max)) == 0) {
+        /* whatever was queued before closing comes out first */
+        if (__atomic_load_n(&p->ring->closed, __ATOMIC_ACQUIRE)) {
+            if ((cnt = tcpr_ring_dequeue(p->ring, desc, (u_int32_t)max)) == 0)
+                return 0;
+            break;
+        }
+
+        if (++spins < SHM_PIPE_SPINS) {
+            __asm__ __volatile__("" ::: "memory");
+            continue;
+        }
+        spins = 0;
+
+        if (!shm_pipe_writer_alive(p)) {
+            warnx("The writer of the shared memory pipe %s went away", p->name + 1);
+            return 0;
+        }
+        sched_yield();
+    }
+
+    for (i = 0; i < cnt; i++) {
+        pkthdr[i].ts.tv_sec = (time_t)desc[i].ts_sec;
+        pkthdr[i].ts.tv_usec = (suseconds_t)desc[i].ts_frac;
+        pkthdr[i].caplen = desc[i].caplen;
+        pkthdr[i].len = desc[i].len;
+        data[i] = p->data + desc[i].offset % p->hdr->data_size;
+    }
+    p->released = desc[cnt - 1].offset + desc[cnt - 1].caplen;
+
+    return (int)cnt;
+}
+
+/**
+ * \brief close either end of the pipe
+ *
+ * The writer's descriptors are queued first, and closing the ring tells
+ * the reader the stream is over.  The reader tells the writer it can
+ * stop.
+ */
+void
+shm_pipe_close(shm_pipe_t *p)
+{
+    if (p == NULL)
+        return;
+
+    if (p->writer) {
+        shm_pipe_flush(p);
+        tcpr_ring_close(p->ring);
+    } else {
+        __atomic_store_n(&p->hdr->reader_gone, true, __ATOMIC_RELEASE);
+    }
+
+    munmap(p->hdr, (size_t)p->hdr->mapsize);
+    safe_free(p->name);
+    safe_free(p);
+}
+
+const char *
+shm_pipe_geterr(shm_pipe_t *p)
+{
+    assert(p);
+
+    return p->errbuf;
+}
+
+#endif /* HAVE_SHM_PIPE */
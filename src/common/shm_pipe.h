@@ -0,0 +1,123 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include "ring.h"
+#include <pcap.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * A packet pipe in shared memory, from one tcprewrite to one tcpreplay,
+ * named "shm:NAME" in place of a file on either side.
+ *
+ * The writer lays out a header, a tcpr_ring_t of shm_pipe_desc_t and a
+ * data area in a POSIX shared memory object.  Packet data is copied into
+ * the data area, which is used like a ring of bytes, and a descriptor
+ * pointing at it is queued.  The reader hands out the packets where they
+ * are, and gives their bytes back once it asks for the next batch.  A
+ * full ring or data area makes the writer wait, so the slower side sets
+ * the pace, and closing the ring is the end of the stream.
+ *
+ * The reader waits for the writer to create the pipe, and unlinks the
+ * name once it has it mapped.
+ */
+#define SHM_PIPE_PREFIX "shm:"
+#define SHM_PIPE_SLOTS 8192                      /* descriptors in the ring */
+#define SHM_PIPE_DATA_SIZE (64 * 1024 * 1024)    /* bytes of packet data */
+#define SHM_PIPE_BATCH 32                        /* descriptors the writer queues at once */
+
+#if defined HAVE_SHM_OPEN && defined HAVE_MMAP
+#define HAVE_SHM_PIPE 1
+
+/* a packet in the data area */
+typedef struct shm_pipe_desc_s {
+    u_int64_t offset; /* free running, the data is at offset % data_size */
+    u_int64_t ts_sec;
+    u_int32_t ts_frac; /* usec, or nsec if the pipe says so */
+    u_int32_t caplen;
+    u_int32_t len;
+    u_int32_t pad;
+} shm_pipe_desc_t;
+
+/* the start of the shared memory */
+typedef struct shm_pipe_hdr_s {
+    u_int32_t magic; /* stored last by the writer */
+    u_int32_t version;
+    int32_t dlt;
+    int32_t snaplen;
+    u_int32_t nsec;
+    pid_t writer;
+    u_int64_t mapsize;
+    u_int64_t ring_off;
+    u_int64_t data_off;
+    u_int64_t data_size;
+    /* written by the reader */
+    u_int64_t data_tail __attribute__((aligned(64))); /* bytes before it may be written again */
+    bool reader_gone;
+} shm_pipe_hdr_t;
+
+typedef struct shm_pipe_s {
+    char *name; /* for shm_open(), "/NAME" */
+    bool writer;
+    shm_pipe_hdr_t *hdr;
+    tcpr_ring_t *ring;
+    u_char *data;
+    /* writer: next free byte, and descriptors not queued yet */
+    u_int64_t data_head;
+    shm_pipe_desc_t pending[SHM_PIPE_BATCH];
+    u_int32_t pending_cnt;
+    /* reader: end of the last batch handed out */
+    u_int64_t released;
+    char errbuf[PCAP_ERRBUF_SIZE];
+} shm_pipe_t;
+
+shm_pipe_t *shm_pipe_create(const char *path, int dlt, int snaplen, bool nsec, char *ebuf);
+int shm_pipe_writev(shm_pipe_t *p, const struct pcap_pkthdr *pkthdr, const struct iovec *iov, int iovcnt);
+int shm_pipe_flush(shm_pipe_t *p);
+shm_pipe_t *shm_pipe_open(const char *path, char *ebuf);
+int shm_pipe_next(shm_pipe_t *p, struct pcap_pkthdr *pkthdr, u_char **data, int max);
+void shm_pipe_close(shm_pipe_t *p);
+const char *shm_pipe_geterr(shm_pipe_t *p);
+
+static inline int
+shm_pipe_datalink(const shm_pipe_t *p)
+{
+    return p->hdr->dlt;
+}
+
+static inline bool
+shm_pipe_nsec(const shm_pipe_t *p)
+{
+    return p->hdr->nsec != 0;
+}
+#endif /* HAVE_SHM_OPEN && HAVE_MMAP */
+
+/**
+ * \brief does path name a shared memory pipe rather than a file?
+ */
+static inline bool
+shm_pipe_path(const char *path)
+{
+    return path != NULL && strncmp(path, SHM_PIPE_PREFIX, strlen(SHM_PIPE_PREFIX)) == 0;
+}
@@ -51,33 +51,25 @@ char *options_vec[OPTIONS_VEC_SIZE];
 static int tcpdump_fill_in_options(char *opt);
 static int can_exec(const char *filename);
 
+/* file-format packet header */
+struct tcpdump_pkthdr {
+    struct {
+        uint32_t ts_sec;
+        uint32_t ts_usec;
+    } ts;
+    uint32_t caplen; /* length of portion present */
+    uint32_t len;    /* length this packet (off wire) */
+};
+
 /**
- * given a packet, print a decode of via tcpdump
+ * write a packet to tcpdump and print its decode
  */
-int
-tcpdump_print(tcpdump_t *tcpdump, struct pcap_pkthdr *pkthdr, const u_char *data)
+static void
+tcpdump_feed(tcpdump_t *tcpdump, const struct tcpdump_pkthdr *pkthdr, const u_char *data)
 {
     struct pollfd poller;
     int res, total;
     char decode[TCPDUMP_DECODE_LEN];
-    struct compact_pkthdr {
-        struct {
-            uint32_t ts_sec;
-            uint32_t ts_usec;
-        } ts;
-        uint32_t caplen; /* length of portion present */
-        uint32_t len;    /* length this packet (off wire) */
-    } actual_pkthdr;
-
-    assert(tcpdump);
-    assert(pkthdr);
-    assert(data);
-
-    /* convert header to file-format packet header */
-    actual_pkthdr.ts.ts_sec = (uint32_t)pkthdr->ts.tv_sec;
-    actual_pkthdr.ts.ts_usec = (uint32_t)pkthdr->ts.tv_sec;
-    actual_pkthdr.caplen = pkthdr->caplen;
-    actual_pkthdr.len = pkthdr->len;
 
     total = 0;
 header_again:
@@ -100,13 +92,13 @@ header_again:
 
 #ifdef DEBUG
     if (debug >= 5) {
-        if (write(tcpdump->debugfd, (char *)&actual_pkthdr, sizeof(actual_pkthdr)) != sizeof(actual_pkthdr))
+        if (write(tcpdump->debugfd, (const char *)pkthdr, sizeof(*pkthdr)) != sizeof(*pkthdr))
             errx(-1, "Error writing pcap file header to tcpdump debug\n%s", strerror(errno));
     }
 #endif
     /* res > 0 if we get here */
-    while (total != sizeof(actual_pkthdr) &&
-           (res = (int)write(PARENT_WRITE_FD, &actual_pkthdr + total, sizeof(actual_pkthdr) - total))) {
+    while (total != sizeof(*pkthdr) &&
+           (res = (int)write(PARENT_WRITE_FD, (const u_char *)pkthdr + total, sizeof(*pkthdr) - total))) {
         if (res < 0) {
             if (errno == EAGAIN)
                 goto header_again;
@@ -178,7 +170,125 @@ data_again:
         dbgx(4, "read %d byte from tcpdump", res);
         printf("%s", decode);
     }
+}
+
+#ifdef HAVE_PTHREAD
+/*
+ * A packet in the ring.  Records are 8 byte aligned and never wrap: a
+ * record that does not fit before the end of the ring is put at the start,
+ * and the gap is marked with a size of 0 (or is too small for a record).
+ */
+typedef struct {
+    uint32_t size; /* bytes to the next record */
+    struct tcpdump_pkthdr pkthdr;
+} tcpdump_rec_t;
+
+#define TCPDUMP_REC_SIZE(caplen) ((sizeof(tcpdump_rec_t) + (caplen) + 7) & ~(size_t)7)
+
+/**
+ * copy a packet into the ring, or count it as dropped if the ring is full
+ */
+static void
+tcpdump_queue(tcpdump_t *tcpdump, const struct tcpdump_pkthdr *pkthdr, const u_char *data)
+{
+    uint64_t head = tcpdump->head;
+    uint64_t tail = __atomic_load_n(&tcpdump->tail, __ATOMIC_ACQUIRE);
+    size_t pos = head % TCPDUMP_RING_SIZE;
+    size_t contig = TCPDUMP_RING_SIZE - pos;
+    size_t need = TCPDUMP_REC_SIZE(pkthdr->caplen);
+    size_t skip = need > contig ? contig : 0;
+    tcpdump_rec_t *rec;
+
+    if (TCPDUMP_RING_SIZE - (head - tail) < skip + need) {
+        tcpdump->dropped++;
+        return;
+    }
+
+    if (skip) {
+        if (skip >= sizeof(tcpdump_rec_t))
+            ((tcpdump_rec_t *)(tcpdump->ring + pos))->size = 0;
+        head += skip;
+        pos = 0;
+    }
+
+    rec = (tcpdump_rec_t *)(tcpdump->ring + pos);
+    rec->size = (uint32_t)need;
+    rec->pkthdr = *pkthdr;
+    memcpy(rec + 1, data, pkthdr->caplen);
+
+    __atomic_store_n(&tcpdump->head, head + need, __ATOMIC_RELEASE);
+}
+
+/**
+ * feeder thread: decode queued packets until tcpdump_close() says stop
+ * and the ring is empty
+ */
+static void *
+tcpdump_feeder(void *arg)
+{
+    tcpdump_t *tcpdump = (tcpdump_t *)arg;
+    uint64_t tail = tcpdump->tail;
+
+    while (1) {
+        bool stop = __atomic_load_n(&tcpdump->stop, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&tcpdump->head, __ATOMIC_ACQUIRE);
+        size_t pos, contig;
+        tcpdump_rec_t *rec;
+
+        if (tail == head) {
+            if (stop)
+                break;
+
+            usleep(TCPDUMP_FEEDER_NAP);
+            continue;
+        }
+
+        pos = tail % TCPDUMP_RING_SIZE;
+        contig = TCPDUMP_RING_SIZE - pos;
+        rec = (tcpdump_rec_t *)(tcpdump->ring + pos);
+        if (contig < sizeof(tcpdump_rec_t) || rec->size == 0) {
+            tail += contig;
+            continue;
+        }
+
+        tcpdump_feed(tcpdump, &rec->pkthdr, (const u_char *)(rec + 1));
+        tail += rec->size;
+        __atomic_store_n(&tcpdump->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+#endif
+
+/**
+ * given a packet, print a decode of via tcpdump
+ */
+int
+tcpdump_print(tcpdump_t *tcpdump, struct pcap_pkthdr *pkthdr, const u_char *data)
+{
+    struct tcpdump_pkthdr actual_pkthdr;
+
+    assert(tcpdump);
+    assert(pkthdr);
+    assert(data);
+
+    if (tcpdump->sample > 1 && tcpdump->seen++ % tcpdump->sample != 0)
+        return TRUE;
+
+    /* convert header to file-format packet header */
+    actual_pkthdr.ts.ts_sec = (uint32_t)pkthdr->ts.tv_sec;
+    actual_pkthdr.ts.ts_usec = (uint32_t)pkthdr->ts.tv_usec;
+    actual_pkthdr.caplen = pkthdr->caplen;
+    actual_pkthdr.len = pkthdr->len;
+
+#ifdef HAVE_PTHREAD
+    if (tcpdump->ring) {
+        tcpdump_queue(tcpdump, &actual_pkthdr, data);
+        return TRUE;
+    }
+#endif
 
+    tcpdump_feed(tcpdump, &actual_pkthdr, data);
     return TRUE;
 }
 
@@ -190,6 +300,10 @@ data_again:
 int
 tcpdump_open(tcpdump_t *tcpdump, pcap_t *pcap)
 {
+#ifdef HAVE_PTHREAD
+    int res;
+#endif
+
     assert(tcpdump);
     assert(pcap);
 
@@ -255,6 +369,19 @@ tcpdump_open(tcpdump_t *tcpdump, pcap_t *pcap)
 
         if (fcntl(PARENT_READ_FD, F_SETFL, O_NONBLOCK) < 0)
             warnx("[parent] Unable to fnctl read pip:\n%s", strerror(errno));
+
+        tcpdump->seen = 0;
+        tcpdump->dropped = 0;
+#ifdef HAVE_PTHREAD
+        if (tcpdump->async) {
+            tcpdump->ring = safe_malloc(TCPDUMP_RING_SIZE);
+            tcpdump->head = 0;
+            tcpdump->tail = 0;
+            tcpdump->stop = false;
+            if ((res = pthread_create(&tcpdump->feeder, NULL, tcpdump_feeder, tcpdump)) != 0)
+                errx(-1, "Unable to start tcpdump feeder thread: %s", strerror(res));
+        }
+#endif
     } else {
         dbg(2, "[child] started the kid");
 
@@ -300,6 +427,19 @@ tcpdump_close(tcpdump_t *tcpdump)
     if (tcpdump->pid <= 0)
         return;
 
+#ifdef HAVE_PTHREAD
+    if (tcpdump->ring) {
+        /* let the feeder finish what is queued */
+        __atomic_store_n(&tcpdump->stop, true, __ATOMIC_RELEASE);
+        pthread_join(tcpdump->feeder, NULL);
+        safe_free(tcpdump->ring);
+        tcpdump->ring = NULL;
+    }
+#endif
+
+    if (tcpdump->dropped)
+        warnx(COUNTER_SPEC " packets were not decoded because tcpdump could not keep up", tcpdump->dropped);
+
     dbgx(2, "[parent] killing tcpdump pid: %d", tcpdump->pid);
 
     kill(tcpdump->pid, SIGKILL);
@@ -20,6 +20,10 @@
 
 #pragma once
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 /* line buffer stdout, read from stdin */
 #define TCPDUMP_ARGS " -n -l -r -"
 
@@ -41,6 +45,12 @@
 
 #define TCPDUMP_DECODE_LEN 65535
 
+/* bytes of packets an async tcpdump_t can queue for the decoder */
+#define TCPDUMP_RING_SIZE (4 * 1024 * 1024)
+
+/* how long (in usec) the feeder thread naps when there is nothing to decode */
+#define TCPDUMP_FEEDER_NAP 1000
+
 /*
  * fork a copy of tcpdump so we can parse packets and print to the screen. We
  * don't allow tcpdump to write directly to the screen, otherwise there
@@ -88,6 +98,27 @@ typedef struct tcpdump_s {
     int debugfd;
     char debugfile[255];
 #endif
+
+    /* decode only 1 in every sample packets; 0 or 1 decodes them all */
+    uint32_t sample;
+    COUNTER seen;
+
+    /* packets not decoded because the ring was full */
+    COUNTER dropped;
+
+#ifdef HAVE_PTHREAD
+    /*
+     * if set before tcpdump_open(), tcpdump_print() copies packets into a
+     * ring and a feeder thread writes them to tcpdump, so the caller never
+     * waits on the decoder.  Single producer, single consumer.
+     */
+    bool async;
+    u_char *ring;
+    uint64_t head; /* bytes queued, written by tcpdump_print() */
+    uint64_t tail; /* bytes decoded, written by the feeder */
+    bool stop;
+    pthread_t feeder;
+#endif
 } tcpdump_t;
 
 // int tcpdump_init(tcpdump_t *tcpdump);
@@ -43,3 +43,82 @@ init_timestamp(timestamp_t *ctx)
 {
     timerclear(ctx);
 }
+
+/* wall clock minus monotonic clock, sampled once by tcpr_clock_init() */
+static int64_t tcpr_clock_offset;
+static bool tcpr_clock_offset_set;
+
+u_int64_t tcpr_clock_sim_ns;
+
+/**
+ * \brief Latch the offset used to turn tcpr_clock_ns() values into dates
+ *
+ * Called once before the first replay so every date tcpreplay prints
+ * is derived from the same sample, even if the wall clock is stepped
+ * mid run.
+ */
+void
+tcpr_clock_init(void)
+{
+    struct timeval wall;
+    u_int64_t mono;
+
+    /* virtual time runs ahead of the wall clock, the first sample has to stay */
+    if (tcpr_clock_offset_set && tcpr_clock_simulated())
+        return;
+
+    mono = tcpr_clock_ns();
+    gettimeofday(&wall, NULL);
+    tcpr_clock_offset = (int64_t)TIMEVAL_TO_NANOSEC(&wall) - (int64_t)mono;
+    tcpr_clock_offset_set = true;
+}
+
+/**
+ * \brief Convert a tcpr_clock_ns() value to wall clock time
+ */
+void
+tcpr_clock_to_timeval(u_int64_t ns, struct timeval *tv)
+{
+    u_int64_t wall;
+
+    if (!tcpr_clock_offset_set)
+        tcpr_clock_init();
+
+    wall = (u_int64_t)((int64_t)ns + tcpr_clock_offset);
+    NANOSEC_TO_TIMEVAL(wall, tv);
+}
+
+/**
+ * \brief Switch tcpr_clock_ns() over to a virtual clock, for --simulate
+ *
+ * The virtual clock starts at the real time and only moves on when
+ * tcpr_clock_sim_advance() is called in place of sleeping, so a replay
+ * runs at CPU speed while everything timed off tcpr_clock_ns() sees the
+ * intended schedule.
+ */
+void
+tcpr_clock_simulate(void)
+{
+    u_int64_t now = tcpr_clock_ns();
+
+    __atomic_store_n(&tcpr_clock_sim_ns, now != 0 ? now : 1, __ATOMIC_RELAXED);
+    tcpr_clock_offset_set = false;
+    tcpr_clock_init();
+}
+
+/**
+ * \brief Move the virtual clock on to until_ns, in place of a sleep
+ *
+ * It never goes backwards.  Returns the time it is now at.
+ */
+u_int64_t
+tcpr_clock_sim_advance(u_int64_t until_ns)
+{
+    u_int64_t now = __atomic_load_n(&tcpr_clock_sim_ns, __ATOMIC_RELAXED);
+
+    while (now < until_ns &&
+           !__atomic_compare_exchange_n(&tcpr_clock_sim_ns, &now, until_ns, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    return now < until_ns ? until_ns : now;
+}
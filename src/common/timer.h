@@ -151,3 +151,53 @@ void timesdiv_float(struct timespec *tvs, float div);
 typedef struct timeval timestamp_t;
 
 void init_timestamp(timestamp_t *ctx);
+
+/*
+ * Clock used for all pacing and run time statistics. It is monotonic,
+ * so an NTP step of the wall clock can neither stall nor burst a
+ * replay, and on Linux clock_gettime() is served from the vDSO without
+ * a system call. CLOCK_MONOTONIC_RAW is preferred because it is not
+ * slewed by NTP either.
+ */
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC_RAW
+#define TCPR_CLOCK_ID CLOCK_MONOTONIC_RAW
+#elif defined HAVE_CLOCK_GETTIME && defined CLOCK_MONOTONIC
+#define TCPR_CLOCK_ID CLOCK_MONOTONIC
+#endif
+
+/* --simulate: the virtual time tcpr_clock_ns() returns, 0 for the real clock */
+extern u_int64_t tcpr_clock_sim_ns;
+
+/* current time in nanoseconds on the monotonic clock */
+static inline u_int64_t
+tcpr_clock_ns(void)
+{
+    u_int64_t sim = __atomic_load_n(&tcpr_clock_sim_ns, __ATOMIC_RELAXED);
+
+    if (sim != 0)
+        return sim;
+
+#ifdef TCPR_CLOCK_ID
+    struct timespec ts;
+
+    clock_gettime(TCPR_CLOCK_ID, &ts);
+    return TIMESPEC_TO_NANOSEC(&ts);
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return TIMEVAL_TO_NANOSEC(&tv);
+#endif
+}
+
+void tcpr_clock_init(void);
+void tcpr_clock_to_timeval(u_int64_t ns, struct timeval *tv);
+void tcpr_clock_simulate(void);
+u_int64_t tcpr_clock_sim_advance(u_int64_t until_ns);
+
+/* is tcpr_clock_ns() the virtual clock of --simulate? */
+static inline bool
+tcpr_clock_simulated(void)
+{
+    return __atomic_load_n(&tcpr_clock_sim_ns, __ATOMIC_RELAXED) != 0;
+}
@@ -0,0 +1,106 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_RINGS /* see memstat.h */
+
+#include "trace_ring.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <string.h>
+
+/**
+ * \brief allocate a ring of at least size records, rounded up to a power of two
+ */
+tcpr_trace_t *
+tcpr_trace_new(u_int32_t size)
+{
+    tcpr_trace_t *trace = safe_malloc(sizeof(tcpr_trace_t));
+    u_int64_t n = 1;
+
+    while (n < size)
+        n <<= 1;
+
+    trace->rec = safe_malloc(n * sizeof(tcpr_trace_rec_t));
+    trace->mask = n - 1;
+    trace->next = 0;
+    return trace;
+}
+
+void
+tcpr_trace_free(tcpr_trace_t *trace)
+{
+    if (trace == NULL)
+        return;
+
+    safe_free(trace->rec);
+    safe_free(trace);
+}
+
+/**
+ * \brief start a trace file
+ *
+ * Returns 0 on success, -1 on error with errno set
+ */
+int
+tcpr_trace_write_header(FILE *f)
+{
+    tcpr_trace_file_hdr_t hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TCPR_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TCPR_TRACE_VERSION;
+    hdr.rec_size = sizeof(tcpr_trace_rec_t);
+
+    return fwrite(&hdr, sizeof(hdr), 1, f) == 1 ? 0 : -1;
+}
+
+/**
+ * \brief append a ring to a trace file, oldest record first
+ *
+ * Returns 0 on success, -1 on error with errno set
+ */
+int
+tcpr_trace_write(FILE *f, const tcpr_trace_t *trace, const char *device, int thread)
+{
+    tcpr_trace_ring_hdr_t hdr;
+    u_int64_t size = trace->mask + 1;
+    u_int64_t first, head;
+
+    memset(&hdr, 0, sizeof(hdr));
+    strlcpy(hdr.device, device, sizeof(hdr.device));
+    hdr.thread = (u_int32_t)thread;
+    hdr.recorded = trace->next;
+    hdr.count = trace->next < size ? trace->next : size;
+
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+        return -1;
+
+    if (hdr.count == 0)
+        return 0;
+
+    /* the oldest record is where the next one goes */
+    first = (trace->next - hdr.count) & trace->mask;
+    head = min(hdr.count, size - first);
+    if (fwrite(&trace->rec[first], sizeof(tcpr_trace_rec_t), head, f) != head)
+        return -1;
+    if (head < hdr.count && fwrite(trace->rec, sizeof(tcpr_trace_rec_t), hdr.count - head, f) != hdr.count - head)
+        return -1;
+
+    return 0;
+}
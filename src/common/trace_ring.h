@@ -0,0 +1,93 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include <stdio.h>
+
+/*
+ * --trace-ring: the last scheduling decisions of each send loop.
+ *
+ * Every sendpacket_t gets its own ring, so the main loop and each
+ * --threads worker write without sharing anything.  Once the ring is
+ * full the oldest records are overwritten.  At the end of the run all
+ * rings are written to one file in host byte order:
+ *
+ *   tcpr_trace_file_hdr_t
+ *   for each ring: tcpr_trace_ring_hdr_t, then count tcpr_trace_rec_t, oldest first
+ *
+ * scripts/trace_ring_dump.pl prints them.
+ */
+#define TCPR_TRACE_MAGIC "TCPRTRC1"
+#define TCPR_TRACE_VERSION 1
+#define TCPR_TRACE_DEFAULT_SIZE 65536
+
+typedef struct tcpr_trace_rec_s {
+    u_int64_t packetnum;    /* in the file, or packets sent by all --threads workers */
+    u_int64_t deadline_ns;  /* when the packet was due, 0 when not paced */
+    u_int64_t actual_ns;    /* when it was handed to the interface */
+    u_int64_t skip_length;  /* bytes still to send before the next time stamp */
+    u_int64_t skip_packets; /* packets still to send before the next time stamp */
+    u_int64_t len;
+} tcpr_trace_rec_t;
+
+typedef struct tcpr_trace_file_hdr_s {
+    char magic[8];
+    u_int32_t version;
+    u_int32_t rec_size;
+} tcpr_trace_file_hdr_t;
+
+typedef struct tcpr_trace_ring_hdr_s {
+    char device[32];
+    u_int32_t thread;
+    u_int32_t reserved;
+    u_int64_t recorded; /* ever, more than count once the ring wrapped */
+    u_int64_t count;    /* records which follow */
+} tcpr_trace_ring_hdr_t;
+
+typedef struct tcpr_trace_s {
+    tcpr_trace_rec_t *rec;
+    u_int64_t mask; /* size - 1, size is a power of two */
+    u_int64_t next; /* records added so far */
+} tcpr_trace_t;
+
+tcpr_trace_t *tcpr_trace_new(u_int32_t size);
+void tcpr_trace_free(tcpr_trace_t *trace);
+int tcpr_trace_write_header(FILE *f);
+int tcpr_trace_write(FILE *f, const tcpr_trace_t *trace, const char *device, int thread);
+
+static inline void
+tcpr_trace_add(tcpr_trace_t *trace,
+               u_int64_t packetnum,
+               u_int64_t deadline_ns,
+               u_int64_t actual_ns,
+               u_int64_t skip_length,
+               u_int64_t skip_packets,
+               u_int64_t len)
+{
+    tcpr_trace_rec_t *rec = &trace->rec[trace->next++ & trace->mask];
+
+    rec->packetnum = packetnum;
+    rec->deadline_ns = deadline_ns;
+    rec->actual_ns = actual_ns;
+    rec->skip_length = skip_length;
+    rec->skip_packets = skip_packets;
+    rec->len = len;
+}
@@ -31,106 +31,168 @@
  * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifdef HAVE_TX_RING
+#define TCPR_MEM_SUBSYS TCPR_MEM_RINGS /* see memstat.h */
 
 #include "txring.h"
 #include "err.h"
 #include "utils.h"
+
+#ifdef HAVE_TX_RING
+
 #include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
-volatile int shutdown_flag = 0;
-int tdata_offset = TPACKET_HDRLEN - sizeof(struct sockaddr_ll);
+/*
+ * The frame header layout differs between TPACKET_V2 and TPACKET_V3,
+ * these hide the difference from the rest of the code.
+ */
+static inline volatile uint32_t *
+txring_status(const txring_t *txp, void *frame)
+{
+    if (txp->version == TPACKET_V3)
+        return (volatile uint32_t *)&((struct tpacket3_hdr *)frame)->tp_status;
+
+    return (volatile uint32_t *)&((struct tpacket2_hdr *)frame)->tp_status;
+}
+
+static inline void
+txring_set_len(const txring_t *txp, void *frame, uint32_t len)
+{
+    if (txp->version == TPACKET_V3) {
+        struct tpacket3_hdr *hdr = frame;
+        hdr->tp_next_offset = 0; /* kernel rejects variable sized slots */
+        hdr->tp_len = len;
+        hdr->tp_snaplen = len;
+    } else {
+        struct tpacket2_hdr *hdr = frame;
+        hdr->tp_len = len;
+        hdr->tp_snaplen = len;
+    }
+}
+
+static inline void *
+txring_frame(const txring_t *txp, unsigned int index)
+{
+    return txp->tx_head + (size_t)txp->treq.tp_frame_size * index;
+}
 
 /**
- * This task will call send() procedure
+ * \brief Copy a packet into the next free frame of the TX ring
+ *
+ * This only queues the frame, call txring_kick() to have the kernel
+ * send it.  Never blocks: if the ring is full, returns -1 with errno
+ * set to ENOBUFS and the caller should txring_wait() and retry.
+ *
+ * Returns the number of bytes queued, or -1 on error
  */
-void *
-txring_send(void *arg)
+int
+txring_put(txring_t *txp, const void *data, size_t length)
 {
-    int ec_send;
-    static int total = 0;
-    int fd_socket = (int)arg;
-
-    do {
-        /* send all buffers with TP_STATUS_SEND_REQUEST */
-        ec_send = sendto(fd_socket, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)NULL, sizeof(struct sockaddr_ll));
-
-        if (ec_send > 0) {
-            total += ec_send;
-            dbgx(2, "Sent %d bytes (+%d bytes)", total, ec_send);
-        } else {
-            /* nothing to do => schedule : useful if no SMP */
-            usleep(100);
-        }
+    void *frame = txring_frame(txp, txp->tx_index);
+    volatile uint32_t *status = txring_status(txp, frame);
+
+    switch (__atomic_load_n(status, __ATOMIC_ACQUIRE)) {
+    case TP_STATUS_WRONG_FORMAT:
+        /* the kernel gave the frame back to us, so just reuse it */
+        txp->stats.wrong_format++;
+        warnx("TX ring: kernel rejected frame %u", txp->tx_index);
+        break;
+
+    case TP_STATUS_AVAILABLE:
+        break;
+
+    default:
+        /* still owned by the kernel */
+        txp->stats.full_stalls++;
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    if (length > txp->max_len) {
+        dbgx(1, "TX ring: %zu bytes from %zu byte packet truncated", length - txp->max_len, length);
+        length = txp->max_len;
+    }
 
-    } while (!shutdown_flag);
+    memcpy((u_char *)frame + txp->data_offset, data, length);
+    txring_set_len(txp, frame, (uint32_t)length);
+    __atomic_store_n(status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
 
-    // if(blocking) printf("end of task send()\n");
-    // printf("end of task send(ec=%x)\n", ec_send);
+    if (++txp->tx_index >= txp->treq.tp_frame_nr)
+        txp->tx_index = 0;
 
-    return (void *)ec_send;
+    txp->pending++;
+    txp->stats.queued++;
+
+    return (int)length;
 }
 
 /**
- * Put data in TX ring buffer and rotate it if necessary
+ * \brief Have the kernel send every frame queued so far
+ *
+ * Returns 0 on success, -1 on error
  */
 int
-txring_put(txring_t *txp, const void *data, size_t length)
+txring_kick(txring_t *txp)
 {
-    struct tpacket_hdr *ps_header;
-    char *to_data;
-    int loop = 1;
-    int first_loop = 1;
-    unsigned int start_index = txp->tx_index;
-
-    do {
-        ps_header = ((struct tpacket_hdr *)((void *)txp->tx_head + (txp->treq->tp_frame_size * txp->tx_index)));
-        to_data = ((void *)ps_header) + tdata_offset;
-
-        switch ((volatile uint32_t)ps_header->tp_status) {
-        case TP_STATUS_WRONG_FORMAT:
-            warnx("TP_STATUS_WRONG_FORMAT occuries O_o. Frame %d, pkt len %d\n", txp->tx_index, length);
-            break;
+    if (txp->pending == 0)
+        return 0;
 
-        case TP_STATUS_AVAILABLE:
-            if (length > txp->treq->tp_frame_size) {
-                // TODO Fragment packet
-                warnx("[!] %d bytes from %d packet truncated\n", length - txp->treq->tp_frame_size, length);
-                length = txp->treq->tp_frame_size;
-            }
-            memcpy(to_data, data, length);
-            ps_header->tp_len = length;
-            ps_header->tp_status = TP_STATUS_SEND_REQUEST;
-            loop = 0;
-            break;
+    txp->stats.kicks++;
+    txp->pending = 0;
+    if (sendto(txp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != ENOBUFS)
+        return -1;
 
-        default:
-            dbgx(2,
-                 "TPACKET status %u at frame %d with length %d\n",
-                 ps_header->tp_status,
-                 txp->tx_index,
-                 ps_header->tp_len);
-            usleep(0);
-            break;
-        }
-        txp->tx_index++;
+    return 0;
+}
 
-        if (txp->tx_index >= txp->treq->tp_frame_nr) {
-            txp->tx_index = 0;
-            first_loop = 0;
-        }
+/**
+ * \brief Wait for the kernel to free up a frame
+ *
+ * Flushes anything still pending then blocks in poll() for at most
+ * timeout ms until the next frame of the ring is writable.
+ *
+ * Returns > 0 if a frame is available, 0 on timeout, -1 on error
+ */
+int
+txring_wait(txring_t *txp, int timeout)
+{
+    struct pollfd pfd;
 
-        /* check if we've ran over all ring */
-        if ((txp->tx_index == start_index) && !first_loop) {
-            errno = ENOBUFS;
-            return -1;
-        }
-    } while (loop == 1);
+    if (txring_kick(txp) < 0)
+        return -1;
+
+    pfd.fd = txp->fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
 
-    return ps_header->tp_len;
+    return poll(&pfd, 1, timeout);
+}
+
+/**
+ * \brief Count the frames which can be filled without waiting, up to max
+ *
+ * The kernel hands frames back in ring order, so this stops at the first
+ * one it still owns.
+ */
+unsigned int
+txring_room(const txring_t *txp, unsigned int max)
+{
+    unsigned int room, index = txp->tx_index;
+
+    for (room = 0; room < max && room < txp->treq.tp_frame_nr; room++) {
+        uint32_t status = __atomic_load_n(txring_status(txp, txring_frame(txp, index)), __ATOMIC_ACQUIRE);
+
+        if (status != TP_STATUS_AVAILABLE && status != TP_STATUS_WRONG_FORMAT)
+            break;
+        if (++index >= txp->treq.tp_frame_nr)
+            index = 0;
+    }
+
+    return room;
 }
 
 /**
@@ -141,8 +203,8 @@ txring_put(txring_t *txp, const void *data, size_t length)
  * is the size of the MTU doesn't get truncated. We also
  * need to structure things with minimum memory wastage
  */
-void
-txring_mkreq(struct tpacket_req *treq, unsigned int mtu)
+static void
+txring_mkreq(struct tpacket_req3 *treq, unsigned int mtu, size_t hdrlen)
 {
     unsigned int pg, bs;
     unsigned int s;
@@ -150,88 +212,142 @@ txring_mkreq(struct tpacket_req *treq, unsigned int mtu)
     unsigned nr_blocks = 1000;
 
     bs = pg = getpagesize();
-    s = mtu + TPACKET_HDRLEN;
+    s = TPACKET_ALIGN(mtu + hdrlen);
 
-    memset(treq, 0, sizeof(struct tpacket_req));
+    memset(treq, 0, sizeof(*treq));
     if (bs <= s) {
-        while (bs < s) {
+        /* one frame per block, made up of as many pages as needed */
+        while (bs < s)
             bs += pg;
-            mult++;
-        }
 
         treq->tp_block_size = bs;
-        treq->tp_frame_size = bs / mult;
+        treq->tp_frame_size = bs;
         treq->tp_block_nr = nr_blocks;
-        treq->tp_frame_nr = mult * nr_blocks;
+        treq->tp_frame_nr = nr_blocks;
     } else {
+        /* pack as many frames into a page as will fit */
         while ((s * (mult + 1)) <= pg) {
             mult++;
         }
         treq->tp_block_size = pg;
-        treq->tp_frame_size = pg / mult;
+        treq->tp_frame_size = (pg / mult) & ~(TPACKET_ALIGNMENT - 1);
         treq->tp_block_nr = nr_blocks;
         treq->tp_frame_nr = mult * nr_blocks;
     }
     dbgx(1,
-         "txring: block_size=%d block_nr=%d frame_size=%d frame_nr=%d",
+         "txring: block_size=%u block_nr=%u frame_size=%u frame_nr=%u",
          treq->tp_block_size,
          treq->tp_block_nr,
          treq->tp_frame_size,
          treq->tp_frame_nr);
 }
 
+/**
+ * try to set up a TX ring with the given TPACKET version
+ */
+static int
+txring_setup(txring_t *txp, int version, unsigned int mtu)
+{
+    size_t hdrlen = version == TPACKET_V3 ? TPACKET3_HDRLEN : TPACKET2_HDRLEN;
+    socklen_t reqlen = version == TPACKET_V3 ? sizeof(struct tpacket_req3) : sizeof(struct tpacket_req);
+
+    if (setsockopt(txp->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+        return -1;
+
+    txring_mkreq(&txp->treq, mtu, hdrlen);
+    if (setsockopt(txp->fd, SOL_PACKET, PACKET_TX_RING, &txp->treq, reqlen) < 0)
+        return -1;
+
+    txp->version = version;
+    txp->data_offset = hdrlen - sizeof(struct sockaddr_ll);
+    txp->max_len = txp->treq.tp_frame_size - txp->data_offset;
+    return 0;
+}
+
 /**
  * \brief Create TX ring for socket and init indexes
  *
- * Creates our pthread for sending, currently hardcoded for priority = 20
+ * Prefers TPACKET_V3 and falls back to TPACKET_V2 on kernels which
+ * don't support a V3 TX ring (< 4.11).  Frames are pushed out by the
+ * caller with txring_kick(), there is no background thread.
  */
 txring_t *
 txring_init(int fd, unsigned int mtu)
 {
-    pthread_attr_t t_attr_send;
-    struct sched_param para_send;
     int mode_loss = 0;
     txring_t *txp;
+#ifdef PACKET_QDISC_BYPASS
+    int bypass = 1;
+#endif
 
-    /* allocate memory for structure and fill it with different stuff*/
-    *txp = (txring_t *)safe_malloc(sizeof(txring_t));
-    txp->treq = (struct tpacket_req *)safe_malloc(sizeof(struct tpacket_req));
-
-    txring_mkreq(txp->treq, mtu);
-    txp->tx_size = txp->treq->tp_block_size * txp->treq->tp_block_nr;
-    txp->tx_index = 0; /* Set index on start*/
+    txp = (txring_t *)safe_malloc(sizeof(txring_t));
+    txp->fd = fd;
 
     /* Set PACKET_LOSS sockoption */
     if (setsockopt(fd, SOL_PACKET, PACKET_LOSS, (char *)&mode_loss, sizeof(mode_loss)) < 0) {
-        perror("setsockopt: PACKET_LOSS");
-        return NULL;
+        warn("setsockopt: PACKET_LOSS");
+        goto fail;
     }
 
+#ifdef PACKET_QDISC_BYPASS
+    /* skip the qdisc layer, we do our own pacing (Linux 3.14+) */
+    if (setsockopt(fd, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass)) < 0)
+        dbgx(1, "txring: PACKET_QDISC_BYPASS not supported: %s", strerror(errno));
+#endif
+
     /* Enable TX Ring */
-    if (setsockopt(fd, SOL_PACKET, PACKET_TX_RING, (char *)txp->treq, sizeof(struct tpacket_req)) < 0) {
-        perror("Can't setsockopt PACKET_TX_RING");
-        return NULL;
+    if (txring_setup(txp, TPACKET_V3, mtu) < 0 && txring_setup(txp, TPACKET_V2, mtu) < 0) {
+        warn("Can't setsockopt PACKET_TX_RING");
+        goto fail;
     }
 
     /* mmap unswapped memory with TX ring buffer*/
-    txp->tx_head = mmap(0, txp->tx_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    txp->tx_size = (size_t)txp->treq.tp_block_size * txp->treq.tp_block_nr;
+    txp->tx_head = mmap(0, txp->tx_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+    if (txp->tx_head == MAP_FAILED)
+        txp->tx_head = mmap(0, txp->tx_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
     if (txp->tx_head == MAP_FAILED) {
-        perror("mmap() failed ");
-        return NULL;
+        warn("mmap() failed ");
+        goto fail;
     }
 
-    /* Start poll thread*/
-    pthread_attr_init(&t_attr_send);
-    pthread_attr_setschedpolicy(&t_attr_send, SCHED_RR);
-    para_send.sched_priority = 20;
-    pthread_attr_setschedparam(&t_attr_send, &para_send);
+    dbgx(1, "txring: using TPACKET_V%d", txp->version == TPACKET_V3 ? 3 : 2);
+    tcpr_mem_map(TCPR_MEM_RINGS, txp->tx_size);
+    return txp;
 
-    if (pthread_create(&txp->tx_send, &t_attr_send, txring_send, (void *)fd) != 0) {
-        perror("pthread_create() failed\n");
-        abort();
-    }
+fail:
+    safe_free(txp);
+    return NULL;
+}
 
-    return txp;
+/**
+ * \brief Flush and release the TX ring
+ *
+ * The blocking sendto() only returns once the kernel has sent
+ * everything on the ring, so no queued frames are lost.  The ring is
+ * detached from the socket, which stays usable for plain send().
+ */
+void
+txring_close(txring_t *txp)
+{
+    struct tpacket_req3 treq;
+
+    if (txp == NULL)
+        return;
+
+    txp->stats.kicks++;
+    sendto(txp->fd, NULL, 0, 0, NULL, 0);
+    munmap(txp->tx_head, txp->tx_size);
+    tcpr_mem_unmap(TCPR_MEM_RINGS, txp->tx_size);
+
+    memset(&treq, 0, sizeof(treq));
+    setsockopt(txp->fd,
+               SOL_PACKET,
+               PACKET_TX_RING,
+               &treq,
+               txp->version == TPACKET_V3 ? sizeof(struct tpacket_req3) : sizeof(struct tpacket_req));
+    safe_free(txp);
 }
 
 #endif /* HAVE_TX_RING */
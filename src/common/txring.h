@@ -33,31 +33,44 @@
 
 #pragma once
 
-#ifdef HAVE_TX_RING
-
 #include "defines.h"
 #include "config.h"
 
-#if __GLIBC__ >= 2 && __GLIBC_MINOR >= 1
-#include <net/ethernet.h> /* the L2 protocols */
-#include <netpacket/packet.h>
-#else
-#include <asm/types.h>
-#include <linux/if_ether.h> /* The L2 protocols */
+#ifdef HAVE_TX_RING
+
 #include <linux/if_packet.h>
-#endif
-#include <pthread.h>
+#include <net/ethernet.h> /* the L2 protocols */
+#include <stddef.h>
 
-struct txring_s {
-    pthread_t tx_send; /*Poll TX thread*/
+/* how long txring_wait() blocks in poll() before giving up, in ms */
+#define TXRING_POLL_TIMEOUT 100
+
+struct txring_stats_s {
+    COUNTER queued;       /* frames handed to the ring */
+    COUNTER kicks;        /* sendto() calls to flush the ring */
+    COUNTER wrong_format; /* frames rejected by the kernel */
+    COUNTER full_stalls;  /* times we had to wait for a free frame */
+};
+typedef struct txring_stats_s txring_stats_t;
 
-    volatile struct tpacket_hdr *tx_head; /* Pointer to mmaped memory with TX ring */
-    struct tpacket_req *treq;             /* TX ring parametrs */
-    volatile unsigned int tx_index;       /* TX index */
-    int tx_size;                          /* Size of mmaped TX ring */
+struct txring_s {
+    int fd;
+    int version;              /* TPACKET_V2 or TPACKET_V3 */
+    u_char *tx_head;          /* mmaped TX ring */
+    size_t tx_size;           /* size of mmaped TX ring */
+    struct tpacket_req3 treq; /* TX ring parameters */
+    unsigned int tx_index;    /* next frame to fill */
+    size_t data_offset;       /* offset of packet data within a frame */
+    size_t max_len;           /* largest packet a frame can hold */
+    unsigned int pending;     /* frames filled since the last kick */
+    txring_stats_t stats;
 };
 typedef struct txring_s txring_t;
 
-int txring_put(txring_t *txp, const void *data, size_t length);
 txring_t *txring_init(int fd, unsigned int mtu);
+int txring_put(txring_t *txp, const void *data, size_t length);
+int txring_kick(txring_t *txp);
+int txring_wait(txring_t *txp, int timeout);
+unsigned int txring_room(const txring_t *txp, unsigned int max);
+void txring_close(txring_t *txp);
 #endif /* HAVE_TX_RING */
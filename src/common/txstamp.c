@@ -0,0 +1,320 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "txstamp.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+
+#ifdef ENABLE_TXSTAMP
+
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+/* how long the reader waits for the error queue, and for stragglers when stopping */
+#define TXSTAMP_POLL_MS 100
+
+/**
+ * \brief ask the NIC of device to time stamp every packet it sends
+ *
+ * Returns 0 on success, -1 if the driver or the device can't
+ */
+static int
+txstamp_enable_hw(int fd, const char *device)
+{
+    struct hwtstamp_config cfg;
+    struct ifreq ifr;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.tx_type = HWTSTAMP_TX_ON;
+    cfg.rx_filter = HWTSTAMP_FILTER_NONE;
+
+    memset(&ifr, 0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, device, sizeof(ifr.ifr_name));
+    ifr.ifr_data = (char *)&cfg;
+
+    return ioctl(fd, SIOCSHWTSTAMP, &ifr) < 0 ? -1 : 0;
+}
+
+/**
+ * \brief turn on TX timestamps on the PF_PACKET socket fd
+ *
+ * Uses the NIC's timestamps where it has them, the kernel's otherwise.
+ * The packets only come back on the error queue when they're written to
+ * pcap_file.  Returns NULL with the error in ebuf, of PCAP_ERRBUF_SIZE,
+ * on failure.
+ */
+txstamp_t *
+txstamp_open(int fd, const char *device, const char *pcap_file, int dlt, char *ebuf)
+{
+    txstamp_t *ts;
+    int flags = SOF_TIMESTAMPING_OPT_ID;
+    bool hardware = txstamp_enable_hw(fd, device) == 0;
+
+    assert(device);
+    assert(ebuf);
+
+    if (hardware)
+        flags |= SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE;
+    else
+        flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (pcap_file == NULL)
+        flags |= SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to enable SO_TIMESTAMPING on %s: %s", device, strerror(errno));
+        return NULL;
+    }
+
+    ts = safe_malloc(sizeof(txstamp_t));
+    ts->slot = safe_malloc(sizeof(txstamp_slot_t) * TXSTAMP_SLOTS);
+    ts->fd = fd;
+    ts->device = device;
+    ts->hardware = hardware;
+
+    if (pcap_file != NULL) {
+        char pbuf[PCAP_ERRBUF_SIZE];
+
+        if ((ts->pcap = pcap_writer_open(pcap_file, dlt, MAXPACKET, PCAP_WRITER_DEFAULT_BUFSIZE, pbuf)) == NULL) {
+            snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to open %s: %s", pcap_file, pbuf);
+            safe_free(ts->slot);
+            safe_free(ts);
+            return NULL;
+        }
+    }
+
+    return ts;
+}
+
+/**
+ * \brief account for one timestamp the kernel handed back
+ */
+static void
+txstamp_add(txstamp_t *ts, u_int32_t key, const struct scm_timestamping *stamp, const u_char *data, size_t caplen)
+{
+    const struct timespec *t = ts->hardware ? &stamp->ts[2] : &stamp->ts[0];
+    txstamp_slot_t *slot = &ts->slot[key & (TXSTAMP_SLOTS - 1)];
+    u_int64_t tx_ns = (u_int64_t)t->tv_sec * 1000000000 + (u_int64_t)t->tv_nsec;
+    u_int64_t cap_ns;
+    u_int32_t len;
+
+    cap_ns = slot->cap_ns;
+    len = slot->len;
+    /* a late timestamp whose slot was reused */
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != key + 1 || tx_ns == 0) {
+        ts->lost++;
+        return;
+    }
+
+    ts->stamped++;
+    if (ts->prev_seq != 0 && ts->prev_seq == key && tx_ns >= ts->prev_tx_ns) {
+        u_int64_t gap = tx_ns - ts->prev_tx_ns;
+
+        tcpr_hist_add(&ts->gap, gap);
+        if (ts->multiplier > 0.0 && cap_ns >= ts->prev_cap_ns) {
+            int64_t err = (int64_t)gap - (int64_t)((double)(cap_ns - ts->prev_cap_ns) / ts->multiplier);
+
+            tcpr_hist_add(&ts->gap_error, err < 0 ? -err : err);
+        }
+    }
+    ts->prev_seq = key + 1;
+    ts->prev_tx_ns = tx_ns;
+    ts->prev_cap_ns = cap_ns;
+
+    if (ts->pcap != NULL && data != NULL) {
+        struct pcap_pkthdr pkthdr;
+
+        pkthdr.ts.tv_sec = (time_t)(tx_ns / 1000000000);
+        pkthdr.ts.tv_usec = (suseconds_t)(tx_ns % 1000000000 / 1000);
+        pkthdr.caplen = (bpf_u_int32)caplen;
+        pkthdr.len = (size_t)len > caplen ? len : (bpf_u_int32)caplen;
+        pcap_writer_write(ts->pcap, &pkthdr, data);
+    }
+}
+
+/**
+ * \brief read everything on the error queue
+ */
+static void
+txstamp_drain(txstamp_t *ts, u_char *data, size_t size)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct cmsghdr align;
+    } control;
+
+    for (;;) {
+        struct scm_timestamping *stamp = NULL;
+        struct sock_extended_err *serr = NULL;
+        struct cmsghdr *cmsg;
+        struct msghdr msg;
+        struct iovec iov;
+        ssize_t n;
+
+        iov.iov_base = data;
+        iov.iov_len = size;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+
+        if ((n = recvmsg(ts->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING)
+                stamp = (struct scm_timestamping *)CMSG_DATA(cmsg);
+            else if (cmsg->cmsg_level == SOL_PACKET && cmsg->cmsg_type == PACKET_TX_TIMESTAMP)
+                serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        }
+
+        if (stamp == NULL || serr == NULL || serr->ee_errno != ENOMSG ||
+            serr->ee_origin != SO_EE_ORIGIN_TIMESTAMPING)
+            continue;
+
+        txstamp_add(ts, serr->ee_data, stamp, n > 0 ? data : NULL, (size_t)n);
+    }
+}
+
+static void *
+txstamp_reader(void *arg)
+{
+    txstamp_t *ts = arg;
+    u_char *data = safe_malloc(MAXPACKET);
+    struct pollfd pfd;
+
+    pfd.fd = ts->fd;
+    /* the error queue is only ever signalled as POLLERR */
+    pfd.events = 0;
+
+    for (;;) {
+        int ready = poll(&pfd, 1, TXSTAMP_POLL_MS);
+
+        /* keep going after stop until the last timestamps came in */
+        if (ready == 0 && ts->stop)
+            break;
+        if (ready > 0)
+            txstamp_drain(ts, data, MAXPACKET);
+    }
+
+    safe_free(data);
+    return NULL;
+}
+
+/**
+ * \brief start the reader thread for a replay
+ *
+ * multiplier is the --multiplier the capture gaps are compared at, 0 if
+ * packets aren't sent at the gaps of the capture.  Returns 0 on success,
+ * -1 with the error in ebuf.
+ */
+int
+txstamp_start(txstamp_t *ts, double multiplier, char *ebuf)
+{
+    assert(ts);
+
+    if (ts->running)
+        return 0;
+
+    ts->multiplier = multiplier;
+    ts->stop = false;
+    ts->prev_seq = 0;
+    if (pthread_create(&ts->reader, NULL, txstamp_reader, ts) != 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "Unable to start the TX timestamp reader for %s", ts->device);
+        return -1;
+    }
+
+    ts->running = true;
+    return 0;
+}
+
+/**
+ * \brief wait for the outstanding timestamps and stop the reader
+ */
+void
+txstamp_stop(txstamp_t *ts)
+{
+    if (ts == NULL || !ts->running)
+        return;
+
+    ts->stop = true;
+    pthread_join(ts->reader, NULL);
+    ts->running = false;
+
+    if (ts->pcap != NULL)
+        pcap_writer_flush(ts->pcap);
+}
+
+void
+txstamp_close(txstamp_t *ts)
+{
+    if (ts == NULL)
+        return;
+
+    txstamp_stop(ts);
+    if (ts->pcap != NULL)
+        pcap_writer_close(ts->pcap);
+    safe_free(ts->slot);
+    safe_free(ts);
+}
+
+/**
+ * \brief print the counts and gap percentiles, in microseconds
+ */
+size_t
+txstamp_summary(const txstamp_t *ts, char *buf, size_t len)
+{
+    char gap[192], gap_error[192];
+    int n;
+
+    tcpr_hist_summary(&ts->gap, gap, sizeof(gap));
+    if (ts->multiplier > 0.0)
+        tcpr_hist_summary(&ts->gap_error, gap_error, sizeof(gap_error));
+    else
+        strlcpy(gap_error, "not sent at the capture's gaps", sizeof(gap_error));
+
+    n = snprintf(buf,
+                 len,
+                 "\tSource:          %s\n"
+                 "\tStamped:         " COUNTER_SPEC " of %u sends, " COUNTER_SPEC " lost\n"
+                 "\tGap:             %s\n"
+                 "\tGap error:       %s\n",
+                 ts->hardware ? "NIC" : "kernel",
+                 ts->stamped,
+                 ts->next_key,
+                 ts->lost,
+                 gap,
+                 gap_error);
+
+    return n < 0 ? 0 : (size_t)n;
+}
+
+#endif /* ENABLE_TXSTAMP */
@@ -0,0 +1,97 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include "common/histogram.h"
+#include "common/pcap_writer.h"
+#include <pcap.h>
+
+/*
+ * --tx-timestamps: when packets really left, from SO_TIMESTAMPING.
+ *
+ * The kernel keys the timestamp of every send on a PF_PACKET socket with
+ * a counter (SOF_TIMESTAMPING_OPT_ID) and queues it on the socket's error
+ * queue.  The send loop only notes the capture time and length of the
+ * packet in the slot for its key; a reader thread drains the error queue,
+ * looks the key up and does the rest, so sending isn't slowed down.
+ * Slots are reused after TXSTAMP_SLOTS sends, so a timestamp which comes
+ * back later than that is counted as lost.
+ */
+#if defined HAVE_SO_TIMESTAMPING && defined HAVE_PF_PACKET && defined HAVE_PTHREAD
+#define ENABLE_TXSTAMP 1
+#include <pthread.h>
+
+#define TXSTAMP_SLOTS 65536
+
+typedef struct txstamp_slot_s {
+    u_int32_t seq; /* key + 1, 0 while never used */
+    u_int32_t len;
+    u_int64_t cap_ns;
+} txstamp_slot_t;
+
+typedef struct txstamp_s {
+    txstamp_slot_t *slot;
+    u_int32_t next_key; /* what the kernel keys the next send with */
+    bool nsec;          /* capture time stamps of the file being sent are in ns */
+    bool hardware;      /* NIC timestamps, else the kernel's when the driver took the packet */
+    int fd;
+    const char *device;
+    pcap_writer_t *pcap; /* --tx-timestamps-pcap */
+    double multiplier;   /* capture gaps are divided by this, 0 if they don't count */
+    pthread_t reader;
+    volatile bool stop;
+    bool running;
+    /* only touched by the reader, and read once it's stopped */
+    COUNTER stamped;
+    COUNTER lost;
+    u_int32_t prev_seq;
+    u_int64_t prev_tx_ns;
+    u_int64_t prev_cap_ns;
+    tcpr_hist_t gap;       /* achieved gap from the previous packet */
+    tcpr_hist_t gap_error; /* achieved minus the capture gap, when multiplier is set */
+} txstamp_t;
+
+txstamp_t *txstamp_open(int fd, const char *device, const char *pcap_file, int dlt, char *ebuf);
+int txstamp_start(txstamp_t *ts, double multiplier, char *ebuf);
+void txstamp_stop(txstamp_t *ts);
+void txstamp_close(txstamp_t *ts);
+size_t txstamp_summary(const txstamp_t *ts, char *buf, size_t len);
+
+/*
+ * note a send the kernel keyed, i.e. it returned the length or ENOBUFS
+ *
+ * Called by the send loop's thread only.
+ */
+static inline void
+txstamp_sent(txstamp_t *ts, const struct pcap_pkthdr *pkthdr, size_t len)
+{
+    txstamp_slot_t *slot = &ts->slot[ts->next_key & (TXSTAMP_SLOTS - 1)];
+
+    if (pkthdr != NULL)
+        slot->cap_ns = (u_int64_t)pkthdr->ts.tv_sec * 1000000000 +
+                       (u_int64_t)pkthdr->ts.tv_usec * (ts->nsec ? 1 : 1000);
+    else
+        slot->cap_ns = 0;
+    slot->len = (u_int32_t)len;
+    __atomic_store_n(&slot->seq, ts->next_key + 1, __ATOMIC_RELEASE);
+    ts->next_key++;
+}
+#endif /* ENABLE_TXSTAMP */
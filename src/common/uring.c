@@ -0,0 +1,496 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Linux io_uring transmit support for PF_PACKET sockets.
+ *
+ * Like AF_XDP this talks to the kernel directly, no liburing needed.
+ * Every sendpacket_t gets a ring of its own on top of its PF_PACKET
+ * socket, and a batch of packets is a batch of SQEs, submitted and
+ * reaped with a single io_uring_enter(), or none at all with SQPOLL,
+ * where a kernel thread picks the SQEs up as they are queued.
+ * Packets still take the regular path through the kernel and driver.
+ *
+ * Packets in packet cache memory given to sendpacket_uring_register()
+ * are sent with IORING_OP_WRITE_FIXED, which saves pinning their pages
+ * for every send.  All others go out with IORING_OP_SEND.  A batch is
+ * only done once every packet of it completed, so the caller is free
+ * to reuse its buffers right away.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_RINGS /* see memstat.h */
+
+#include "uring.h"
+#include "config.h"
+#include "common.h"
+#include "tcpreplay_api.h"
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define ring_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* packet cache regions, the same buffer index in every ring */
+typedef struct uring_mem_s {
+    const u_char *base;
+    size_t len; /* 0 for a free slot */
+} uring_mem_t;
+
+static uring_mem_t uring_mem[TCPR_URING_BUFS];
+static uint32_t uring_mem_cnt;
+static uring_t *uring_list; /* every open ring */
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+/* rings are opened, closed and given packet cache memory by several threads */
+static pthread_mutex_t uring_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+#define URING_MEM_LOCK() pthread_mutex_lock(&uring_mem_lock)
+#define URING_MEM_UNLOCK() pthread_mutex_unlock(&uring_mem_lock)
+#else
+#define URING_MEM_LOCK()
+#define URING_MEM_UNLOCK()
+#endif
+
+static int
+uring_enter(uring_t *uring, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    uring->enters++;
+    return (int)syscall(__NR_io_uring_enter, uring->fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+/**
+ * point buffer slot of uring at len bytes at addr, or empty it for a NULL addr
+ */
+static void
+uring_buf_update(uring_t *uring, uint32_t slot, const void *addr, size_t len)
+{
+#ifdef IORING_RSRC_REGISTER_SPARSE
+    struct io_uring_rsrc_update2 up;
+    struct iovec iov;
+
+    if (!uring->fixed)
+        return;
+
+    iov.iov_base = (void *)addr;
+    iov.iov_len = addr != NULL ? len : 0;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.data = (uint64_t)(uintptr_t)&iov;
+    up.nr = 1;
+
+    /* mostly out of RLIMIT_MEMLOCK, the region is then sent as any other memory */
+    uring->buf_ok[slot] = uring_register(uring->fd, IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up)) == 1 && addr != NULL;
+    if (addr != NULL && !uring->buf_ok[slot])
+        dbgx(1, "Unable to register %zu bytes at %p with io_uring: %s", len, addr, strerror(errno));
+#else
+    (void)uring;
+    (void)slot;
+    (void)addr;
+    (void)len;
+#endif
+}
+
+/**
+ * \brief put an io_uring on the PF_PACKET socket of sp
+ *
+ * With --io-uring-sqpoll a kernel thread polls the ring for packets.
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+sendpacket_open_uring(void *p, char *errbuf, void *arg)
+{
+    sendpacket_t *sp = p;
+    tcpreplay_t *ctx = (tcpreplay_t *)arg;
+    struct io_uring_params params;
+    uring_t *uring;
+    size_t sq_len, cq_len;
+    uint32_t i;
+
+    assert(sp);
+    assert(errbuf);
+
+    uring = (uring_t *)safe_malloc(sizeof(uring_t));
+    memset(&params, 0, sizeof(params));
+    if (ctx != NULL && ctx->options->io_uring_sqpoll) {
+        params.flags = IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = 1000; /* ms */
+        uring->sqpoll = true;
+    }
+
+    if ((uring->fd = (int)syscall(__NR_io_uring_setup, TCPR_URING_DEPTH, &params)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "io_uring_setup: %s", strerror(errno));
+        safe_free(uring);
+        return -1;
+    }
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = max(sq_len, cq_len);
+
+    uring->ring_map_len = sq_len;
+    uring->ring_map = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+    if (uring->ring_map == MAP_FAILED) {
+        uring->ring_map = NULL;
+        goto fail_map;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        uring->cq_map_len = cq_len;
+        uring->cq_map = mmap(NULL, cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+        if (uring->cq_map == MAP_FAILED) {
+            uring->cq_map = NULL;
+            goto fail_map;
+        }
+    }
+
+    uring->sqe_map_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqe_map = mmap(NULL,
+                          uring->sqe_map_len,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE,
+                          uring->fd,
+                          IORING_OFF_SQES);
+    if (uring->sqe_map == MAP_FAILED) {
+        uring->sqe_map = NULL;
+        goto fail_map;
+    }
+
+    uring->sq_head = (uint32_t *)((u_char *)uring->ring_map + params.sq_off.head);
+    uring->sq_tail = (uint32_t *)((u_char *)uring->ring_map + params.sq_off.tail);
+    uring->sq_flags = (uint32_t *)((u_char *)uring->ring_map + params.sq_off.flags);
+    uring->sq_array = (uint32_t *)((u_char *)uring->ring_map + params.sq_off.array);
+    uring->sq_mask = *(uint32_t *)((u_char *)uring->ring_map + params.sq_off.ring_mask);
+    uring->sqes = (struct io_uring_sqe *)uring->sqe_map;
+    {
+        u_char *cq = uring->cq_map != NULL ? (u_char *)uring->cq_map : (u_char *)uring->ring_map;
+
+        uring->cq_head = (uint32_t *)(cq + params.cq_off.head);
+        uring->cq_tail = (uint32_t *)(cq + params.cq_off.tail);
+        uring->cq_mask = *(uint32_t *)(cq + params.cq_off.ring_mask);
+        uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    }
+
+#ifdef IORING_RSRC_REGISTER_SPARSE
+    {
+        struct io_uring_rsrc_register reg;
+
+        /* an empty table, filled in as the packet cache grows */
+        memset(&reg, 0, sizeof(reg));
+        reg.nr = TCPR_URING_BUFS;
+        reg.flags = IORING_RSRC_REGISTER_SPARSE;
+        uring->fixed = uring_register(uring->fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) == 0;
+    }
+#endif
+    URING_MEM_LOCK();
+    for (i = 0; i < uring_mem_cnt; i++) {
+        if (uring_mem[i].len != 0)
+            uring_buf_update(uring, i, uring_mem[i].base, uring_mem[i].len);
+    }
+    uring->next = uring_list;
+    uring_list = uring;
+    URING_MEM_UNLOCK();
+
+    dbgx(1,
+         "io_uring on %s, %u entries%s%s",
+         sp->device,
+         params.sq_entries,
+         uring->sqpoll ? ", SQPOLL" : "",
+         uring->fixed ? ", registered buffers" : "");
+
+    sp->uring = uring;
+    sp->handle_type = SP_TYPE_IO_URING;
+    return 0;
+
+fail_map:
+    snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to map io_uring rings: %s", strerror(errno));
+    if (uring->ring_map != NULL)
+        munmap(uring->ring_map, uring->ring_map_len);
+    if (uring->cq_map != NULL)
+        munmap(uring->cq_map, uring->cq_map_len);
+    close(uring->fd);
+    safe_free(uring);
+    return -1;
+}
+
+/**
+ * registered buffer holding all len bytes at data, -1 if none
+ */
+static inline int
+uring_mem_find(uring_t *uring, const u_char *data, size_t len)
+{
+    uint32_t cnt = ring_load_acquire(&uring_mem_cnt);
+    uint32_t i;
+
+    /* packets are sent in the order they were cached, so mostly from the last region */
+    for (i = 0; i < cnt; i++) {
+        uint32_t at = (uring->mem_hint + i) % cnt;
+        const uring_mem_t *mem = &uring_mem[at];
+
+        if (uring->buf_ok[at] && data >= mem->base && (size_t)(data - mem->base) + len <= mem->len) {
+            uring->mem_hint = at;
+            return (int)at;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * move the completions of the current batch of cnt packets to res, by
+ * the index of their packets.  Returns how many there were
+ *
+ * Completions of an earlier batch which failed may still turn up, and
+ * are dropped.
+ */
+static int
+uring_reap(uring_t *uring, int *res, int cnt)
+{
+    uint32_t head = *uring->cq_head;
+    uint32_t tail = ring_load_acquire(uring->cq_tail);
+    int n = 0;
+
+    while (head != tail) {
+        const struct io_uring_cqe *cqe = &uring->cqes[head & uring->cq_mask];
+        uint32_t i = (uint32_t)cqe->user_data;
+
+        if ((uint32_t)(cqe->user_data >> 32) == uring->batch && i < (uint32_t)cnt) {
+            res[i] = cqe->res;
+            n++;
+        }
+        head++;
+    }
+
+    if (head != *uring->cq_head)
+        ring_store_release(uring->cq_head, head);
+
+    return n;
+}
+
+/**
+ * \brief send cnt packets and wait for them all
+ *
+ * res[i] is then what a send() of packet i would have returned, or
+ * -errno.  Returns 0 on success, or -1 if the ring failed as a whole.
+ */
+int
+sendpacket_send_uring(void *p, const struct sendpacket_pkt_s *pkts, int cnt, int *res)
+{
+    sendpacket_t *sp = p;
+    uring_t *uring = sp->uring;
+    uint32_t tail = *uring->sq_tail;
+    int i, done = 0, submitted = 0, spins = 0;
+
+    assert(cnt <= TCPR_URING_DEPTH);
+
+    uring->batch++;
+    for (i = 0; i < cnt; i++) {
+        uint32_t idx = tail & uring->sq_mask;
+        struct io_uring_sqe *sqe = &uring->sqes[idx];
+        int buf = uring_mem_find(uring, pkts[i].data, pkts[i].len);
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = sp->handle.fd;
+        sqe->addr = (uint64_t)(uintptr_t)pkts[i].data;
+        sqe->len = (uint32_t)pkts[i].len;
+        sqe->user_data = (uint64_t)uring->batch << 32 | (uint32_t)i;
+        if (buf >= 0) {
+            /* a socket takes no offset, so off stays 0 */
+            sqe->opcode = IORING_OP_WRITE_FIXED;
+            sqe->buf_index = (uint16_t)buf;
+            uring->fixed_sends++;
+        } else {
+            sqe->opcode = IORING_OP_SEND;
+            uring->plain_sends++;
+        }
+        uring->sq_array[idx] = idx;
+        tail++;
+    }
+    ring_store_release(uring->sq_tail, tail);
+
+    if (uring->sqpoll) {
+        /* the flag is only good once the kernel can see the new tail */
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (ring_load_acquire(uring->sq_flags) & IORING_SQ_NEED_WAKEUP)
+            uring_enter(uring, 0, 0, IORING_ENTER_SQ_WAKEUP);
+        submitted = cnt;
+    }
+
+    while (done < cnt) {
+        int ret;
+
+        if (submitted < cnt) {
+            ret = uring_enter(uring, (unsigned int)(cnt - submitted), (unsigned int)(cnt - done), IORING_ENTER_GETEVENTS);
+        } else if (uring->sqpoll && spins++ < TCPR_URING_SPIN) {
+            done += uring_reap(uring, res, cnt);
+            continue;
+        } else {
+            ret = uring_enter(uring, 0, (unsigned int)(cnt - done), IORING_ENTER_GETEVENTS);
+        }
+
+        if (ret < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+                /* out of room for completions or some such, make some */
+                done += uring_reap(uring, res, cnt);
+                if (sp->abort && submitted == 0)
+                    return -1;
+                continue;
+            }
+            /* SQEs the kernel never took are dropped and the SQ is left as it was */
+            if (submitted < cnt)
+                ring_store_release(uring->sq_tail, tail - (uint32_t)(cnt - submitted));
+            return -1;
+        }
+
+        if (submitted < cnt)
+            submitted += ret;
+        done += uring_reap(uring, res, cnt);
+    }
+
+    return 0;
+}
+
+/**
+ * \brief print what the ring did.  Returns the bytes printed.
+ */
+size_t
+sendpacket_getstat_uring(void *p, char *buf, size_t buf_size)
+{
+    sendpacket_t *sp = p;
+    uring_t *uring = sp->uring;
+    int n;
+
+    n = snprintf(buf,
+                 buf_size,
+                 "\tio_uring fixed buffers:    " COUNTER_SPEC "\n"
+                 "\tio_uring plain sends:      " COUNTER_SPEC "\n"
+                 "\tio_uring_enter() calls:    " COUNTER_SPEC "\n",
+                 uring->fixed_sends,
+                 uring->plain_sends,
+                 uring->enters);
+
+    return n < 0 ? 0 : min((size_t)n, buf_size);
+}
+
+/**
+ * \brief register len bytes of packet cache memory at addr with every
+ * ring, now and to come, so packets in it are sent from fixed buffers
+ *
+ * A region of more than 1 GB, or beyond TCPR_URING_BUFS, isn't
+ * registered.  Other threads may be sending on their rings meanwhile.
+ */
+void
+sendpacket_uring_register(void *addr, size_t len)
+{
+    uring_t *uring;
+    uint32_t i;
+
+    if (len > 1024UL * 1024 * 1024)
+        return;
+
+    URING_MEM_LOCK();
+    /* reuse a slot freed by sendpacket_uring_unregister() */
+    for (i = 0; i < uring_mem_cnt && uring_mem[i].len != 0; i++)
+        ;
+    if (i == TCPR_URING_BUFS) {
+        URING_MEM_UNLOCK();
+        return;
+    }
+
+    uring_mem[i].base = addr;
+    uring_mem[i].len = len;
+    if (i == uring_mem_cnt)
+        ring_store_release(&uring_mem_cnt, uring_mem_cnt + 1);
+
+    for (uring = uring_list; uring != NULL; uring = uring->next)
+        uring_buf_update(uring, i, addr, len);
+    URING_MEM_UNLOCK();
+}
+
+/**
+ * \brief unregister memory given to sendpacket_uring_register() before
+ * it is freed, so its pages aren't held and the address can't be
+ * mistaken for new memory.  Does nothing if it wasn't registered.
+ */
+void
+sendpacket_uring_unregister(void *addr, size_t len)
+{
+    uring_t *uring;
+    uint32_t i;
+
+    URING_MEM_LOCK();
+    for (i = 0; i < uring_mem_cnt; i++) {
+        if (uring_mem[i].base != addr || uring_mem[i].len != len)
+            continue;
+
+        for (uring = uring_list; uring != NULL; uring = uring->next)
+            uring_buf_update(uring, i, NULL, 0);
+        uring_mem[i].len = 0;
+        uring_mem[i].base = NULL;
+        break;
+    }
+    URING_MEM_UNLOCK();
+}
+
+/**
+ * \brief tear down the ring of sp, leaving the socket
+ */
+void
+sendpacket_close_uring(void *p)
+{
+    sendpacket_t *sp = p;
+    uring_t *uring = sp->uring;
+    uring_t **at;
+
+    if (uring == NULL)
+        return;
+
+    URING_MEM_LOCK();
+    for (at = &uring_list; *at != NULL; at = &(*at)->next) {
+        if (*at == uring) {
+            *at = uring->next;
+            break;
+        }
+    }
+    URING_MEM_UNLOCK();
+
+    munmap(uring->sqe_map, uring->sqe_map_len);
+    if (uring->cq_map != NULL)
+        munmap(uring->cq_map, uring->cq_map_len);
+    munmap(uring->ring_map, uring->ring_map_len);
+    close(uring->fd);
+    safe_free(uring);
+    sp->uring = NULL;
+}
+
+#endif /* HAVE_IO_URING */
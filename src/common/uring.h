@@ -0,0 +1,73 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TCPR_URING_DEPTH 256  /* SQ entries, a full sendpacket_batch() */
+#define TCPR_URING_BUFS 1024  /* registered buffers, i.e. packet cache regions */
+#define TCPR_URING_SPIN 100000 /* CQ polls with SQPOLL before sleeping in the kernel */
+
+struct uring_s {
+    int fd;
+    bool sqpoll;
+    bool fixed; /* a sparse buffer table is registered */
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_flags;
+    uint32_t *sq_array;
+    uint32_t sq_mask;
+    struct io_uring_sqe *sqes;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_map;
+    size_t ring_map_len;
+    void *cq_map; /* NULL if in ring_map */
+    size_t cq_map_len;
+    void *sqe_map;
+    size_t sqe_map_len;
+    uint8_t buf_ok[TCPR_URING_BUFS]; /* the packet cache regions registered with this ring */
+    uint32_t mem_hint;               /* region the last packet was in */
+    uint32_t batch;                  /* number of the last batch, the top half of its user_data */
+    COUNTER fixed_sends; /* packets sent from a registered buffer */
+    COUNTER plain_sends;
+    COUNTER enters; /* io_uring_enter() calls */
+    struct uring_s *next;
+};
+typedef struct uring_s uring_t;
+
+struct sendpacket_pkt_s;
+
+int sendpacket_open_uring(void *p, char *errbuf, void *arg);
+void sendpacket_close_uring(void *p);
+int sendpacket_send_uring(void *p, const struct sendpacket_pkt_s *pkts, int cnt, int *res);
+size_t sendpacket_getstat_uring(void *p, char *buf, size_t buf_size);
+void sendpacket_uring_register(void *addr, size_t len);
+void sendpacket_uring_unregister(void *addr, size_t len);
+
+#endif /* HAVE_IO_URING */
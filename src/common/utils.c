@@ -35,7 +35,7 @@
  */
 
 void *
-our_safe_malloc(size_t len, const char *funcname, int line, const char *file)
+our_safe_malloc(size_t len, tcpr_mem_subsys_t subsys, const char *funcname, int line, const char *file)
 {
     u_char *ptr;
 
@@ -46,6 +46,7 @@ our_safe_malloc(size_t len, const char *funcname, int line, const char *file)
 
     /* zero memory */
     memset(ptr, 0, len);
+    tcpr_mem_alloc(subsys, len, funcname, line, file);
 
     /* wrapped inside an #ifdef for better performance */
     dbgx(5, "Malloc'd %zu bytes in %s:%s() line %d", len, file, funcname, line);
@@ -61,7 +62,7 @@ our_safe_malloc(size_t len, const char *funcname, int line, const char *file)
  * ptr = safe_realloc(ptr, size)
  */
 void *
-our_safe_realloc(void *ptr, size_t len, const char *funcname, int line, const char *file)
+our_safe_realloc(void *ptr, size_t len, tcpr_mem_subsys_t subsys, const char *funcname, int line, const char *file)
 {
     if ((ptr = realloc(ptr, len)) == NULL) {
         fprintf(stderr,
@@ -74,6 +75,7 @@ our_safe_realloc(void *ptr, size_t len, const char *funcname, int line, const ch
     }
 
     dbgx(5, "Remalloc'd buffer to %zu bytes in %s:%s() line %d", len, file, funcname, line);
+    tcpr_mem_alloc(subsys, len, funcname, line, file);
 
     return ptr;
 }
@@ -83,7 +85,7 @@ our_safe_realloc(void *ptr, size_t len, const char *funcname, int line, const ch
  * This function, detects failures to realloc memory
  */
 char *
-our_safe_strdup(const char *str, const char *funcname, int line, const char *file)
+our_safe_strdup(const char *str, tcpr_mem_subsys_t subsys, const char *funcname, int line, const char *file)
 {
     char *newstr;
 
@@ -93,6 +95,7 @@ our_safe_strdup(const char *str, const char *funcname, int line, const char *fil
     }
 
     memcpy(newstr, str, strlen(str) + 1);
+    tcpr_mem_alloc(subsys, strlen(str) + 1, funcname, line, file);
 
     return newstr;
 }
@@ -101,7 +104,7 @@ our_safe_strdup(const char *str, const char *funcname, int line, const char *fil
  * calls free and sets to NULL.
  */
 void
-our_safe_free(void *ptr, const char *funcname, int line, const char *file)
+our_safe_free(void *ptr, tcpr_mem_subsys_t subsys, const char *funcname, int line, const char *file)
 {
     assert(funcname);
     assert(line);
@@ -111,6 +114,7 @@ our_safe_free(void *ptr, const char *funcname, int line, const char *file)
         return;
 
     free(ptr);
+    tcpr_mem_free(subsys);
 }
 
 /**
@@ -205,6 +209,29 @@ our_safe_pcap_next_ex(pcap_t *pcap,
     return res;
 }
 
+/**
+ * Fill in the struct timeval copies of the stats times from the
+ * nanosecond ones: wall clock for the start, end and last print times,
+ * and plain durations for the deltas.  Times not set yet are cleared.
+ */
+void
+packet_stats_timevals(tcpreplay_stats_t *stats)
+{
+    assert(stats);
+
+    timerclear(&stats->start_time);
+    timerclear(&stats->end_time);
+    timerclear(&stats->last_print);
+    if (stats->start_time_ns != 0)
+        tcpr_clock_to_timeval(stats->start_time_ns, &stats->start_time);
+    if (stats->end_time_ns != 0)
+        tcpr_clock_to_timeval(stats->end_time_ns, &stats->end_time);
+    if (stats->last_print_ns != 0)
+        tcpr_clock_to_timeval(stats->last_print_ns, &stats->last_print);
+    NANOSEC_TO_TIMEVAL(stats->time_delta_ns, &stats->time_delta);
+    NANOSEC_TO_TIMEVAL(stats->pkt_ts_delta_ns, &stats->pkt_ts_delta);
+}
+
 /**
  * Print various packet statistics
  */
@@ -212,6 +239,7 @@ void
 packet_stats(const tcpreplay_stats_t *stats)
 {
     struct timeval diff;
+    COUNTER diff_ns = 0;
     COUNTER diff_us;
     COUNTER bytes_sec = 0;
     u_int32_t bytes_sec_10ths = 0;
@@ -221,7 +249,9 @@ packet_stats(const tcpreplay_stats_t *stats)
     COUNTER pkts_sec = 0;
     u_int32_t pkts_sec_100ths = 0;
 
-    timersub(&stats->end_time, &stats->start_time, &diff);
+    if (stats->end_time_ns > stats->start_time_ns)
+        diff_ns = stats->end_time_ns - stats->start_time_ns;
+    NANOSEC_TO_TIMEVAL(diff_ns, &diff);
     diff_us = TIMEVAL_TO_MICROSEC(&diff);
 
     if (diff_us && stats->pkts_sent && stats->bytes_sent) {
@@ -280,10 +310,33 @@ packet_stats(const tcpreplay_stats_t *stats)
                mb_sec_1000ths,
                pkts_sec,
                pkts_sec_100ths);
+
+    /* the L1 rate, which is what a link or switch port counts */
+    if (stats->wire_overhead != 0 && diff_us != 0) {
+        COUNTER wire_bits = (stats->bytes_sent + stats->pkts_sent * stats->wire_overhead) * 8;
+        COUNTER wire_mb_sec_X100 = wire_bits * 100 / diff_us;
+
+        printf("Rated on the wire: " COUNTER_SPEC ".%02u Mbps with preamble, IFG and FCS\n",
+               wire_mb_sec_X100 / 100,
+               (u_int32_t)(wire_mb_sec_X100 % 100));
+    }
+
+    /* bits per us are Mbps */
+    if (stats->bursts != 0 && stats->burst_ns != 0 && diff_us != 0)
+        printf("Microbursts: " COUNTER_SPEC " sent at %.2f Mbps within a burst, %.2f Mbps on average\n",
+               stats->bursts,
+               (double)stats->burst_bytes * 8 * 1000 / (double)stats->burst_ns,
+               (double)stats->bytes_sent * 8 / (double)diff_us);
     fflush(NULL);
 
     if (stats->failed)
         printf("Failed write attempts: " COUNTER_SPEC "\n", stats->failed);
+
+    if (stats->late_pkts)
+        printf("Late packets: " COUNTER_SPEC ", dropped " COUNTER_SPEC ", timeline shifted %.6f sec\n",
+               stats->late_pkts,
+               stats->late_dropped,
+               (double)stats->late_shift_ns / 1000000000.0);
 }
 
 /**
@@ -23,6 +23,7 @@
 #include "defines.h"
 #include "config.h"
 #include "common.h"
+#include "common/memstat.h"
 
 typedef struct {
     char *active_pcap;
@@ -40,26 +41,47 @@ typedef struct {
     COUNTER flow_packets;
     COUNTER flows_expired;
     COUNTER flows_invalid_packets;
+    /*
+     * the times above in nanoseconds on the tcpr_clock_ns() clock, which
+     * is what tcpreplay keeps.  The timevals are filled in from these by
+     * packet_stats_timevals()
+     */
+    u_int64_t start_time_ns;
+    u_int64_t time_delta_ns;
+    u_int64_t end_time_ns;
+    u_int64_t pkt_ts_delta_ns;
+    u_int64_t last_print_ns;
+    u_int32_t wire_overhead; /* --wire-rate: bytes per frame on the wire beyond its length */
+    COUNTER bursts;          /* --microburst: bursts sent */
+    COUNTER burst_bytes;     /* and their bytes */
+    u_int64_t burst_ns;      /* time taken sending them */
+    COUNTER late_pkts;       /* packets more than --late-threshold behind */
+    COUNTER late_dropped;    /* of which --late-policy=drop didn't send */
+    u_int64_t late_shift_ns; /* --late-policy=shift: how far the timeline moved */
 } tcpreplay_stats_t;
 
 int read_hexstring(const char *l2string, u_char *hex, int hexlen);
 void packet_stats(const tcpreplay_stats_t *stats);
+void packet_stats_timevals(tcpreplay_stats_t *stats);
 int format_date_time(struct timeval *when, char *buf, size_t len);
 uint32_t tcpr_random(uint32_t *seed);
 void restore_stdin(void);
 
-/* our "safe" implimentations of functions which allocate memory */
-#define safe_malloc(x) our_safe_malloc(x, __FUNCTION__, __LINE__, __FILE__)
-void *our_safe_malloc(size_t len, const char *, int, const char *);
+/*
+ * our "safe" implimentations of functions which allocate memory, each
+ * counted against the TCPR_MEM_SUBSYS of the caller, see memstat.h
+ */
+#define safe_malloc(x) our_safe_malloc(x, TCPR_MEM_SUBSYS, __FUNCTION__, __LINE__, __FILE__)
+void *our_safe_malloc(size_t len, tcpr_mem_subsys_t, const char *, int, const char *);
 
-#define safe_realloc(x, y) our_safe_realloc(x, y, __FUNCTION__, __LINE__, __FILE__)
-void *our_safe_realloc(void *ptr, size_t len, const char *, int, const char *);
+#define safe_realloc(x, y) our_safe_realloc(x, y, TCPR_MEM_SUBSYS, __FUNCTION__, __LINE__, __FILE__)
+void *our_safe_realloc(void *ptr, size_t len, tcpr_mem_subsys_t, const char *, int, const char *);
 
-#define safe_strdup(x) our_safe_strdup(x, __FUNCTION__, __LINE__, __FILE__)
-char *our_safe_strdup(const char *str, const char *, int, const char *);
+#define safe_strdup(x) our_safe_strdup(x, TCPR_MEM_SUBSYS, __FUNCTION__, __LINE__, __FILE__)
+char *our_safe_strdup(const char *str, tcpr_mem_subsys_t, const char *, int, const char *);
 
-#define safe_free(x) our_safe_free(x, __FUNCTION__, __LINE__, __FILE__)
-void our_safe_free(void *ptr, const char *, int, const char *);
+#define safe_free(x) our_safe_free(x, TCPR_MEM_SUBSYS, __FUNCTION__, __LINE__, __FILE__)
+void our_safe_free(void *ptr, tcpr_mem_subsys_t, const char *, int, const char *);
 
 #define safe_pcap_next(x, y) our_safe_pcap_next(x, y, __FUNCTION__, __LINE__, __FILE__)
 u_char *
@@ -94,6 +94,9 @@ parse_xX_str(tcpr_xX_t *xX, char *str, tcpr_bpf_t *bpf)
         errx(-1, "Invalid -%c option: %c", xX->mode, *str);
     }
 
+    /* CIDRs are checked against every packet */
+    compile_cidr(xX->cidr);
+
     if (xX->mode == 'X') { /* run in exclude mode */
         out += xXExclude;
         if (bpf->filter != NULL)
@@ -0,0 +1,376 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Linux AF_XDP transmit support.
+ *
+ * This talks to the kernel directly (no libbpf/libxdp needed): a TX only
+ * socket does not require an XDP program to be loaded.  Each socket owns
+ * a UMEM of fixed size frames; packets are copied into a free frame and
+ * posted on the TX ring, and frames are recycled from the completion ring.
+ * When the driver supports it the socket is bound in zero-copy mode so the
+ * NIC transmits straight out of the UMEM.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_RINGS /* see memstat.h */
+
+#include "xdp.h"
+#include "config.h"
+#include "common.h"
+#include "tcpreplay_api.h"
+
+#ifdef HAVE_AF_XDP
+
+#include <errno.h>
+#include <net/if.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+
+#ifndef XDP_USE_NEED_WAKEUP
+#define XDP_USE_NEED_WAKEUP (1 << 3)
+#endif
+#ifndef XDP_RING_NEED_WAKEUP
+#define XDP_RING_NEED_WAKEUP (1 << 0)
+#endif
+
+/* sxdp_flags bind() is tried with, in order */
+static const uint16_t xdp_bind_flags[] = {
+        XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP,
+        XDP_COPY | XDP_USE_NEED_WAKEUP,
+        XDP_ZEROCOPY,
+        XDP_COPY,
+};
+
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+
+#define ring_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/**
+ * map one of the socket rings
+ */
+static int
+xdp_map_ring(int fd, xdp_ring_t *ring, const struct xdp_ring_offset *off, size_t desc_size, off_t pgoff)
+{
+    ring->map_len = off->desc + TCPR_XDP_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -1;
+    }
+
+    ring->producer = (uint32_t *)((u_char *)ring->map + off->producer);
+    ring->consumer = (uint32_t *)((u_char *)ring->map + off->consumer);
+    ring->flags = (uint32_t *)((u_char *)ring->map + off->flags);
+    ring->desc = (u_char *)ring->map + off->desc;
+    ring->size = TCPR_XDP_RING_SIZE;
+    ring->mask = TCPR_XDP_RING_SIZE - 1;
+    ring->cached_prod = *ring->producer;
+    ring->cached_cons = *ring->consumer;
+
+    return 0;
+}
+
+/**
+ * return frames the kernel has finished with to the free list
+ */
+static void
+xdp_reclaim(xdp_t *xdp)
+{
+    xdp_ring_t *cq = &xdp->cq;
+    uint64_t *addrs = (uint64_t *)cq->desc;
+    uint32_t prod = ring_load_acquire(cq->producer);
+    uint32_t cons = cq->cached_cons;
+
+    while (cons != prod)
+        xdp->free_frames[xdp->free_cnt++] = addrs[cons++ & cq->mask];
+
+    if (cons != cq->cached_cons) {
+        cq->cached_cons = cons;
+        ring_store_release(cq->consumer, cons);
+    }
+}
+
+/**
+ * \brief Open an AF_XDP socket on the given queue of device
+ */
+void *
+sendpacket_open_xdp_queue(const char *device, char *errbuf, int queue)
+{
+    sendpacket_t *sp = NULL;
+    xdp_t *xdp;
+    struct xdp_umem_reg mr;
+    struct xdp_mmap_offsets off;
+    struct sockaddr_xdp sxdp;
+    socklen_t optlen;
+    unsigned int ifindex;
+    int fd, ring_size = TCPR_XDP_RING_SIZE;
+    uint32_t i;
+
+    assert(device);
+    assert(errbuf);
+
+    dbgx(1, "sendpacket_open_xdp: using AF_XDP on %s queue %d", device, queue);
+
+    if ((ifindex = if_nametoindex(device)) == 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unknown interface %s: %s", device, strerror(errno));
+        return NULL;
+    }
+
+    if ((fd = socket(AF_XDP, SOCK_RAW, 0)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "AF_XDP socket: %s", strerror(errno));
+        return NULL;
+    }
+
+    xdp = (xdp_t *)safe_malloc(sizeof(xdp_t));
+    xdp->queue = queue;
+    xdp->umem_size = (size_t)TCPR_XDP_FRAME_SIZE * TCPR_XDP_FRAME_CNT;
+    if (tcpr_huge_enabled()) {
+        tcpr_pages_t pages;
+
+        /* the UMEM must stay page aligned, which tcpr_huge_alloc() is when enabled */
+        xdp->umem = tcpr_huge_alloc(&xdp->umem_size, &pages);
+        dbgx(1, "sendpacket_open_xdp: %zu byte UMEM, pages %d", xdp->umem_size, pages);
+    } else {
+        xdp->umem = mmap(NULL, xdp->umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (xdp->umem == MAP_FAILED)
+            xdp->umem = NULL;
+    }
+    if (xdp->umem == NULL) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to allocate UMEM: %s", strerror(errno));
+        goto fail;
+    }
+
+    memset(&mr, 0, sizeof(mr));
+    mr.addr = (uint64_t)(uintptr_t)xdp->umem;
+    mr.len = xdp->umem_size;
+    mr.chunk_size = TCPR_XDP_FRAME_SIZE;
+    if (setsockopt(fd, SOL_XDP, XDP_UMEM_REG, &mr, sizeof(mr)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "XDP_UMEM_REG: %s", strerror(errno));
+        goto fail;
+    }
+
+    /* the kernel insists on a fill ring even though we never receive */
+    if (setsockopt(fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to size AF_XDP rings: %s", strerror(errno));
+        goto fail;
+    }
+
+    optlen = sizeof(off);
+    if (getsockopt(fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "XDP_MMAP_OFFSETS: %s", strerror(errno));
+        goto fail;
+    }
+
+    if (xdp_map_ring(fd, &xdp->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING) < 0 ||
+        xdp_map_ring(fd, &xdp->cq, &off.cr, sizeof(uint64_t), XDP_UMEM_PGOFF_COMPLETION_RING) < 0) {
+        snprintf(errbuf, SENDPACKET_ERRBUF_SIZE, "Unable to map AF_XDP rings: %s", strerror(errno));
+        goto fail;
+    }
+
+    /*
+     * prefer zero-copy, fall back to copy mode if the driver can't.  Ask
+     * for need_wakeup so a zero-copy driver says when it has stopped
+     * polling the TX ring, and only if the kernel turns that down go
+     * without it and kick on every flush
+     */
+    memset(&sxdp, 0, sizeof(sxdp));
+    sxdp.sxdp_family = AF_XDP;
+    sxdp.sxdp_ifindex = ifindex;
+    sxdp.sxdp_queue_id = queue;
+    for (i = 0; i < sizeof(xdp_bind_flags) / sizeof(xdp_bind_flags[0]); i++) {
+        sxdp.sxdp_flags = xdp_bind_flags[i];
+        if (bind(fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0)
+            break;
+    }
+
+    if (i == sizeof(xdp_bind_flags) / sizeof(xdp_bind_flags[0])) {
+        snprintf(errbuf,
+                 SENDPACKET_ERRBUF_SIZE,
+                 "Unable to bind AF_XDP socket to %s queue %d: %s",
+                 device,
+                 queue,
+                 strerror(errno));
+        goto fail;
+    }
+
+    xdp->zerocopy = (sxdp.sxdp_flags & XDP_ZEROCOPY) != 0;
+    xdp->need_wakeup = (sxdp.sxdp_flags & XDP_USE_NEED_WAKEUP) != 0;
+
+    xdp->free_frames = safe_malloc(sizeof(uint64_t) * TCPR_XDP_FRAME_CNT);
+    for (i = 0; i < TCPR_XDP_FRAME_CNT; i++)
+        xdp->free_frames[i] = (uint64_t)i * TCPR_XDP_FRAME_SIZE;
+    xdp->free_cnt = TCPR_XDP_FRAME_CNT;
+
+    dbgx(1,
+         "AF_XDP bound to %s queue %d in %s mode%s",
+         device,
+         queue,
+         xdp->zerocopy ? "zero-copy" : "copy",
+         xdp->need_wakeup ? " with need_wakeup" : "");
+
+    sp = (sendpacket_t *)safe_malloc(sizeof(sendpacket_t));
+    strlcpy(sp->device, device, sizeof(sp->device));
+    sp->handle.fd = fd;
+    sp->handle_type = SP_TYPE_AF_XDP;
+    sp->xdp = xdp;
+
+    return sp;
+
+fail:
+    if (xdp->tx.map != NULL)
+        munmap(xdp->tx.map, xdp->tx.map_len);
+    if (xdp->cq.map != NULL)
+        munmap(xdp->cq.map, xdp->cq.map_len);
+    if (xdp->umem != NULL)
+        munmap(xdp->umem, xdp->umem_size);
+    safe_free(xdp);
+    close(fd);
+    return NULL;
+}
+
+/**
+ * \brief sendpacket_open() entry point, uses the queue given by --xdp-queue
+ */
+void *
+sendpacket_open_xdp(const char *device, char *errbuf, void *arg)
+{
+    tcpreplay_t *ctx = (tcpreplay_t *)arg;
+    int queue = 0;
+
+    if (ctx != NULL)
+        queue = ctx->options->xdp_queue;
+
+    return sendpacket_open_xdp_queue(device, errbuf, queue);
+}
+
+/**
+ * \brief wake up the kernel to process the TX ring
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+sendpacket_flush_xdp(void *p)
+{
+    sendpacket_t *sp = p;
+    xdp_t *xdp = sp->xdp;
+
+    ring_store_release(xdp->tx.producer, xdp->tx.cached_prod);
+
+    /*
+     * copy mode always needs a kick, as does zero-copy without need_wakeup,
+     * where the kernel never says whether the driver is still polling
+     */
+    if (!xdp->zerocopy || !xdp->need_wakeup || (ring_load_acquire(xdp->tx.flags) & XDP_RING_NEED_WAKEUP)) {
+        if (sendto(sp->handle.fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN && errno != EBUSY &&
+            errno != ENOBUFS && errno != ENETDOWN)
+            return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief queue one packet on the TX ring
+ *
+ * If flush is set the ring is handed to the kernel right away, otherwise
+ * the caller must call sendpacket_flush_xdp() once it is done queueing.
+ *
+ * Returns bytes queued, -2 if the ring is full and the caller should
+ * retry, or -1 on error, with errno EMSGSIZE for a packet larger than
+ * a UMEM chunk
+ */
+int
+sendpacket_send_xdp(void *p, const u_char *data, size_t len, bool flush)
+{
+    sendpacket_t *sp = p;
+    xdp_t *xdp = sp->xdp;
+    xdp_ring_t *tx = &xdp->tx;
+    struct xdp_desc *desc;
+    uint64_t addr;
+
+    if (sp->abort)
+        return 0;
+
+    /* a frame has to fit in one UMEM chunk */
+    if (len > TCPR_XDP_FRAME_SIZE) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (xdp->free_cnt == 0)
+        xdp_reclaim(xdp);
+
+    if (tx->cached_prod - tx->cached_cons >= tx->size)
+        tx->cached_cons = ring_load_acquire(tx->consumer);
+
+    if (xdp->free_cnt == 0 || tx->cached_prod - tx->cached_cons >= tx->size) {
+        /* everything is in flight, make sure the kernel is working on it */
+        if (sendpacket_flush_xdp(sp) < 0)
+            return -1;
+        return -2;
+    }
+
+    addr = xdp->free_frames[--xdp->free_cnt];
+    memcpy(xdp->umem + addr, data, len);
+
+    desc = &((struct xdp_desc *)tx->desc)[tx->cached_prod & tx->mask];
+    desc->addr = addr;
+    desc->len = (uint32_t)len;
+    desc->options = 0;
+    tx->cached_prod++;
+
+    if (flush && sendpacket_flush_xdp(sp) < 0)
+        return -1;
+
+    return (int)len;
+}
+
+/**
+ * \brief close the AF_XDP socket and release the UMEM
+ */
+void
+sendpacket_close_xdp(void *p)
+{
+    sendpacket_t *sp = p;
+    xdp_t *xdp = sp->xdp;
+
+    if (xdp != NULL) {
+        munmap(xdp->tx.map, xdp->tx.map_len);
+        munmap(xdp->cq.map, xdp->cq.map_len);
+        munmap(xdp->umem, xdp->umem_size);
+        safe_free(xdp->free_frames);
+        safe_free(xdp);
+        sp->xdp = NULL;
+    }
+
+    close(sp->handle.fd);
+}
+
+#endif /* HAVE_AF_XDP */
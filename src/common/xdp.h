@@ -0,0 +1,67 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+
+#ifdef HAVE_AF_XDP
+#include <linux/if_xdp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* UMEM layout: TCPR_XDP_FRAME_CNT frames of TCPR_XDP_FRAME_SIZE bytes each */
+#define TCPR_XDP_FRAME_SIZE 4096
+#define TCPR_XDP_FRAME_CNT 4096
+#define TCPR_XDP_RING_SIZE 2048 /* must be a power of two */
+
+/* a single producer/consumer ring shared with the kernel */
+typedef struct xdp_ring_s {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *desc;
+    uint32_t size;
+    uint32_t mask;
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+    void *map;
+    size_t map_len;
+} xdp_ring_t;
+
+struct xdp_s {
+    int queue;
+    bool zerocopy;
+    bool need_wakeup; /* bound with XDP_USE_NEED_WAKEUP */
+    u_char *umem;
+    size_t umem_size;
+    xdp_ring_t tx;
+    xdp_ring_t cq;
+    uint64_t *free_frames; /* stack of unused UMEM frame addresses */
+    uint32_t free_cnt;
+};
+typedef struct xdp_s xdp_t;
+
+void *sendpacket_open_xdp(const char *device, char *errbuf, void *arg);
+void *sendpacket_open_xdp_queue(const char *device, char *errbuf, int queue);
+void sendpacket_close_xdp(void *p);
+int sendpacket_send_xdp(void *p, const u_char *data, size_t len, bool flush);
+int sendpacket_flush_xdp(void *p);
+
+#endif /* HAVE_AF_XDP */
@@ -0,0 +1,339 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tcpbridge --delay.  The bridge loop hands every packet it would have
+ * sent to delayline_queue(), and calls delayline_run() each time around to
+ * send those which came due, then polls no longer than delayline_timeout()
+ * says.  All of it runs in the one thread, so nothing here is locked.
+ */
+
+#include "delayline.h"
+#include "bridge.h"
+#include "config.h"
+#include "common.h"
+#include <string.h>
+#include <time.h>
+
+extern tcpreplay_stats_t stats;
+
+/**
+ * \brief the delay line --delay and friends ask for
+ */
+delayline_t *
+delayline_new(tcpbridge_opt_t *options)
+{
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    delayline_t *dl;
+    u_int32_t slots, buckets;
+    u_int64_t span;
+    int i;
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec real;
+#else
+    struct timeval real;
+#endif
+
+    assert(options);
+    assert(options->delay_ns > 0);
+
+    dl = safe_malloc(sizeof(delayline_t));
+    dl->delay_ns = options->delay_ns;
+    dl->jitter_ns = options->delay_jitter_ns;
+    dl->dist = (delay_dist_t)options->delay_dist;
+    dl->seed = (uint32_t)tcpr_clock_ns();
+
+    /* Irwin-Hall, see delay_jitter(), never strays more than 6 deviations */
+    dl->max_ns = dl->delay_ns + (dl->dist == DELAY_DIST_NORMAL ? 6 : 1) * dl->jitter_ns;
+
+    dl->buf_size = options->delay_buffer;
+    dl->buf = safe_malloc(dl->buf_size);
+
+    for (slots = 1; slots <= dl->buf_size / DELAY_BYTES_PER_SLOT / 2; slots <<= 1)
+        ;
+    dl->slots = safe_malloc(sizeof(delay_slot_t) * slots);
+    dl->slot_mask = slots - 1;
+
+    /* a bucket a tick, and enough that the longest delay can't wrap around */
+    dl->tick_ns = DELAY_TICK_NS;
+    while (dl->max_ns / dl->tick_ns + 2 > DELAY_WHEEL_MAX)
+        dl->tick_ns <<= 1;
+    span = dl->max_ns / dl->tick_ns + 2;
+    for (buckets = 1; buckets < span; buckets <<= 1)
+        ;
+    dl->bucket_head = safe_malloc(sizeof(u_int32_t) * buckets);
+    dl->bucket_tail = safe_malloc(sizeof(u_int32_t) * buckets);
+    memset(dl->bucket_head, 0xff, sizeof(u_int32_t) * buckets);
+    dl->wheel_mask = buckets - 1;
+    dl->wheel_tick = tcpr_clock_ns() / dl->tick_ns;
+
+#ifdef HAVE_CLOCK_GETTIME
+    clock_gettime(CLOCK_REALTIME, &real);
+    dl->clock_offset = (int64_t)(TIMESPEC_TO_NANOSEC(&real) - tcpr_clock_ns());
+#else
+    gettimeofday(&real, NULL);
+    dl->clock_offset = (int64_t)(TIMEVAL_TO_NANOSEC(&real) - tcpr_clock_ns());
+#endif
+
+    for (i = PCAP_INT1; i <= PCAP_INT2; i++) {
+        const char *intf = i == PCAP_INT1 ? options->intf1 : options->intf2;
+
+        dl->sp[i] = sendpacket_open(intf, ebuf, i == PCAP_INT1 ? TCPR_DIR_C2S : TCPR_DIR_S2C, SP_TYPE_NONE, NULL);
+        if (dl->sp[i] == NULL)
+            errx(-1, "Unable to open interface %s: %s", intf, ebuf);
+    }
+
+    dbgx(1,
+         "Delay line: %u slots, %u buckets of %llu ns, up to %llu ns",
+         slots,
+         buckets,
+         (unsigned long long)dl->tick_ns,
+         (unsigned long long)dl->max_ns);
+
+    return dl;
+}
+
+void
+delayline_free(delayline_t *dl)
+{
+    int i;
+
+    assert(dl);
+
+    for (i = PCAP_INT1; i <= PCAP_INT2; i++)
+        sendpacket_close(dl->sp[i]);
+
+    safe_free(dl->bucket_tail);
+    safe_free(dl->bucket_head);
+    safe_free(dl->slots);
+    safe_free(dl->buf);
+    safe_free(dl);
+}
+
+/**
+ * \brief how long the next packet is held
+ */
+static u_int64_t
+delay_jitter(delayline_t *dl)
+{
+    double r;
+    int64_t d;
+    int i;
+
+    if (dl->jitter_ns == 0)
+        return dl->delay_ns;
+
+    if (dl->dist == DELAY_DIST_NORMAL) {
+        /* the sum of 12 uniforms less 6 is close to normal, and needs no libm */
+        r = -6.0;
+        for (i = 0; i < 12; i++)
+            r += (double)tcpr_random(&dl->seed) / 2147483648.0;
+    } else {
+        r = (double)tcpr_random(&dl->seed) / 1073741824.0 - 1.0;
+    }
+
+    d = (int64_t)dl->delay_ns + (int64_t)(r * (double)dl->jitter_ns);
+    if (d < 0)
+        return 0;
+    if ((u_int64_t)d > dl->max_ns)
+        return dl->max_ns;
+    return (u_int64_t)d;
+}
+
+/**
+ * \brief room for len bytes in buf, or false
+ */
+static bool
+delay_alloc(delayline_t *dl, u_int32_t len, size_t *offset)
+{
+    if (dl->slot_head == dl->slot_tail)
+        dl->buf_head = dl->buf_tail = 0;
+
+    /* tail == head is only ever an empty buffer */
+    if (dl->buf_tail >= dl->buf_head) {
+        if (dl->buf_tail + len <= dl->buf_size)
+            *offset = dl->buf_tail;
+        else if (len < dl->buf_head)
+            *offset = 0;
+        else
+            return false;
+    } else if (dl->buf_tail + len < dl->buf_head) {
+        *offset = dl->buf_tail;
+    } else {
+        return false;
+    }
+
+    dl->buf_tail = *offset + len;
+    return true;
+}
+
+static void
+delay_flush(delayline_t *dl)
+{
+    sendpacket_t *sp = dl->sp[dl->batch_out];
+    COUNTER bytes = sp->bytes_sent;
+    int sent;
+
+    if (dl->batch_cnt == 0)
+        return;
+
+    sent = sendpacket_batch(sp, dl->batch, dl->batch_cnt);
+    if (sent == 0)
+        errx(-1, "Unable to send packets out %s: %s", sp->device, sendpacket_geterr(sp));
+
+    stats.bytes_sent += sp->bytes_sent - bytes;
+    stats.pkts_sent += sent;
+    stats.failed += dl->batch_cnt - sent;
+
+    dbgx(2, "Sent %d of %d delayed packets", sent, dl->batch_cnt);
+    dl->batch_cnt = 0;
+}
+
+/**
+ * \brief hold a copy of a packet received at pkthdr->ts to go out of out
+ *
+ * The packet is dropped if the delay line is full.
+ */
+void
+delayline_queue(delayline_t *dl, u_char out, const struct pcap_pkthdr *pkthdr, const u_char *pktdata)
+{
+    u_int64_t now = tcpr_clock_ns();
+    u_int64_t rx_ns, tick;
+    u_int32_t idx, b;
+    delay_slot_t *slot;
+    size_t offset;
+
+    assert(dl);
+    assert(pkthdr);
+    assert(pktdata);
+
+    /* the wheel has to be up to date, or a long delay could wrap around it */
+    if (dl->wheel_tick <= now / dl->tick_ns)
+        delayline_run(dl, now);
+
+    if (dl->slot_tail - dl->slot_head > dl->slot_mask || !delay_alloc(dl, pkthdr->caplen, &offset)) {
+        dl->dropped++;
+        dbg(2, "Delay line is full, dropping packet");
+        return;
+    }
+
+    /* held from when it was received, the capture clock is CLOCK_REALTIME */
+    rx_ns = TIMEVAL_TO_NANOSEC(&pkthdr->ts) - (u_int64_t)dl->clock_offset;
+    if (pkthdr->ts.tv_sec == 0 || rx_ns > now)
+        rx_ns = now;
+
+    tick = (rx_ns + delay_jitter(dl)) / dl->tick_ns;
+    if (tick < dl->wheel_tick)
+        tick = dl->wheel_tick;
+
+    idx = dl->slot_tail++ & dl->slot_mask;
+    slot = &dl->slots[idx];
+    slot->next = DELAY_NONE;
+    slot->len = pkthdr->caplen;
+    slot->offset = offset;
+    slot->pkthdr = *pkthdr;
+    slot->out = out;
+    slot->sent = false;
+    memcpy(dl->buf + offset, pktdata, pkthdr->caplen);
+
+    /* appended, so packets due in the same tick keep their order */
+    b = (u_int32_t)(tick & dl->wheel_mask);
+    if (dl->bucket_head[b] == DELAY_NONE)
+        dl->bucket_head[b] = idx;
+    else
+        dl->slots[dl->bucket_tail[b]].next = idx;
+    dl->bucket_tail[b] = idx;
+    dl->pending++;
+}
+
+/**
+ * \brief send every packet due by now_ns
+ */
+void
+delayline_run(delayline_t *dl, u_int64_t now_ns)
+{
+    u_int64_t now_tick = now_ns / dl->tick_ns;
+    u_int32_t idx, b;
+    u_int64_t end;
+
+    assert(dl);
+
+    /* after a long wait once around the wheel takes in every packet */
+    end = now_tick;
+    if (end >= dl->wheel_tick && end - dl->wheel_tick > dl->wheel_mask)
+        end = dl->wheel_tick + dl->wheel_mask;
+
+    for (; dl->wheel_tick <= end && dl->pending > 0; dl->wheel_tick++) {
+        b = (u_int32_t)(dl->wheel_tick & dl->wheel_mask);
+
+        for (idx = dl->bucket_head[b]; idx != DELAY_NONE; idx = dl->slots[idx].next) {
+            delay_slot_t *slot = &dl->slots[idx];
+            sendpacket_pkt_t *pkt;
+
+            if (dl->batch_cnt == SENDPACKET_BATCH_MAX || (dl->batch_cnt > 0 && dl->batch_out != slot->out))
+                delay_flush(dl);
+
+            pkt = &dl->batch[dl->batch_cnt++];
+            memset(pkt, 0, sizeof(*pkt));
+            pkt->data = dl->buf + slot->offset;
+            pkt->len = slot->len;
+            pkt->pkthdr = &slot->pkthdr;
+            dl->batch_out = slot->out;
+
+            slot->sent = true;
+            dl->pending--;
+        }
+        dl->bucket_head[b] = DELAY_NONE;
+    }
+
+    if (dl->wheel_tick <= now_tick)
+        dl->wheel_tick = now_tick + 1;
+
+    delay_flush(dl);
+
+    /* give back the room of the oldest packets which went out */
+    while (dl->slot_head != dl->slot_tail && dl->slots[dl->slot_head & dl->slot_mask].sent)
+        dl->slot_head++;
+    if (dl->slot_head != dl->slot_tail)
+        dl->buf_head = dl->slots[dl->slot_head & dl->slot_mask].offset;
+}
+
+/**
+ * \brief poll() timeout for the bridge loop, which would otherwise wait timeout ms
+ *
+ * With a packet due within the next millisecond we don't wait at all,
+ * with none that soon we look again in a millisecond.
+ */
+int
+delayline_timeout(delayline_t *dl, u_int64_t now_ns, int timeout)
+{
+    u_int64_t tick, end;
+
+    assert(dl);
+
+    if (dl->pending == 0 || timeout == 0)
+        return timeout;
+
+    end = (now_ns + 1000000) / dl->tick_ns;
+    for (tick = dl->wheel_tick; tick <= end; tick++) {
+        if (dl->bucket_head[tick & dl->wheel_mask] != DELAY_NONE)
+            return 0;
+    }
+
+    return 1;
+}
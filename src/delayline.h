@@ -0,0 +1,90 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpbridge.h"
+
+/* resolution of the timer wheel, made coarser for delays needing more buckets */
+#define DELAY_TICK_NS 1000
+#define DELAY_WHEEL_MAX (1 << 20)
+/* a packet slot for every so many bytes of --delay-buffer */
+#define DELAY_BYTES_PER_SLOT 128
+/* the end of a bucket */
+#define DELAY_NONE 0xffffffff
+
+typedef enum {
+    DELAY_DIST_UNIFORM = 0,
+    DELAY_DIST_NORMAL
+} delay_dist_t;
+
+typedef struct {
+    u_int32_t next; /* slot after it in its bucket */
+    u_int32_t len;
+    size_t offset;  /* of the packet in buf */
+    struct pcap_pkthdr pkthdr;
+    u_char out;     /* interface it goes out of */
+    bool sent;
+} delay_slot_t;
+
+/*
+ * --delay: packets are copied into buf, a byte ring, in the order they
+ * came in, and have a slot of their own in slots, a ring of the same
+ * order.  The slot also sits in the bucket of the timer wheel for the tick
+ * it is due in, and buckets are sent in one go as the clock passes them.
+ * Slots and bytes are given back once all those before them went out, so
+ * jitter holding one packet a long time holds up the room after it too.
+ */
+typedef struct {
+    u_int64_t delay_ns;
+    u_int64_t jitter_ns;
+    u_int64_t max_ns; /* longest delay a packet may get */
+    delay_dist_t dist;
+    uint32_t seed;
+    int64_t clock_offset; /* capture clock minus tcpr_clock_ns() */
+
+    u_char *buf;
+    size_t buf_size;
+    size_t buf_head; /* of the oldest packet held */
+    size_t buf_tail; /* where the next one goes */
+
+    delay_slot_t *slots;
+    u_int32_t slot_mask;
+    u_int32_t slot_head; /* free running, masked to index slots */
+    u_int32_t slot_tail;
+
+    u_int32_t *bucket_head;
+    u_int32_t *bucket_tail;
+    u_int32_t wheel_mask;
+    u_int64_t tick_ns;
+    u_int64_t wheel_tick; /* next tick to send the bucket of */
+    u_int32_t pending;    /* packets in the wheel */
+
+    sendpacket_t *sp[2];
+    sendpacket_pkt_t batch[SENDPACKET_BATCH_MAX];
+    int batch_cnt;
+    u_char batch_out;
+
+    COUNTER dropped;
+} delayline_t;
+
+delayline_t *delayline_new(tcpbridge_opt_t *options);
+void delayline_free(delayline_t *dl);
+void delayline_queue(delayline_t *dl, u_char out, const struct pcap_pkthdr *pkthdr, const u_char *pktdata);
+void delayline_run(delayline_t *dl, u_int64_t now_ns);
+int delayline_timeout(delayline_t *dl, u_int64_t now_ns, int timeout);
@@ -0,0 +1,646 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * --fleet, see fleet.h.
+ *
+ * Every stream has the time of its next packet, and sits in the bucket of
+ * its worker's timer wheel for the tick that falls in.  A worker runs the
+ * buckets the clock has passed: a stream sends what is due, up to
+ * FLEET_BURST packets, and goes into the bucket of its next packet.  So a
+ * worker wakes up once a tick at most, whatever the number of streams,
+ * and only for ticks something is due in.  The packets of all the streams
+ * due go out in the same batches.
+ */
+
+#include "fleet.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENABLE_FLEET
+
+#define FLEET_WHEEL_MASK (FLEET_WHEEL_SIZE - 1)
+
+/**
+ * \brief add a line of the --fleet file, 0 for a blank line or comment
+ */
+static int
+fleet_parse(tcpreplay_t *ctx, tcpr_fleet_t *fleet, char *line, const char *path, int lineno)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    fleet_stream_t *st;
+    char *token, *value, *end, *save = NULL;
+    u_int32_t i;
+    int idx;
+
+    if ((end = strchr(line, '#')) != NULL)
+        *end = '\0';
+    if ((token = strtok_r(line, " \t\r\n", &save)) == NULL)
+        return 0;
+
+    /* the streams of a pcap share its source, and so what is preloaded of it */
+    for (idx = 0; idx < options->source_cnt; idx++) {
+        if (options->sources[idx].type == source_filename && strcmp(options->sources[idx].filename, token) == 0)
+            break;
+    }
+    if (idx == options->source_cnt) {
+        if (tcpreplay_add_pcapfile(ctx, token) < 0)
+            return -1;
+        ++fleet->pcaps;
+    }
+
+    if (fleet->cnt == fleet->max) {
+        fleet->max = fleet->max ? fleet->max * 2 : 64;
+        fleet->streams = safe_realloc(fleet->streams, sizeof(fleet_stream_t) * fleet->max);
+    }
+
+    st = &fleet->streams[fleet->cnt];
+    memset(st, 0, sizeof(*st));
+    st->idx = idx;
+    st->line = lineno;
+    st->loop = 1;
+
+    /* the rate on the command line, unless the line has its own */
+    switch (options->speed.mode) {
+    case speed_mbpsrate:
+        st->mode = speed_mbpsrate;
+        st->rate = (double)options->speed.speed;
+        break;
+    case speed_packetrate:
+        st->mode = speed_packetrate;
+        st->rate = (double)options->speed.speed / (60.0 * 60.0);
+        break;
+    default:
+        st->mode = speed_multiplier;
+        st->rate = options->speed.multiplier > 0 ? options->speed.multiplier : 1.0;
+    }
+
+    /* copies of a pcap each get addresses of their own, the first those of the pcap */
+    for (i = 0; i < fleet->cnt; i++) {
+        if (fleet->streams[i].idx == idx)
+            ++st->shift;
+    }
+
+    while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+        if ((value = strchr(token, '=')) == NULL)
+            goto bad;
+        *value++ = '\0';
+
+        if (strcmp(token, "multiplier") == 0 || strcmp(token, "pps") == 0 || strcmp(token, "mbps") == 0) {
+            double n = strtod(value, &end);
+
+            if (end == value || *end != '\0' || !(n > 0))
+                goto bad;
+
+            if (strcmp(token, "multiplier") == 0) {
+                st->mode = speed_multiplier;
+                st->rate = n;
+            } else if (strcmp(token, "pps") == 0) {
+                st->mode = speed_packetrate;
+                st->rate = n;
+            } else {
+                st->mode = speed_mbpsrate;
+                st->rate = n * 1000000.0;
+            }
+        } else if (strcmp(token, "loop") == 0 || strcmp(token, "shift") == 0 || strcmp(token, "start") == 0) {
+            unsigned long long n = strtoull(value, &end, 10);
+
+            if (end == value || *end != '\0')
+                goto bad;
+
+            if (strcmp(token, "loop") == 0) {
+                if (n > UINT32_MAX)
+                    goto bad;
+                st->loop = (u_int32_t)n;
+            } else if (strcmp(token, "shift") == 0) {
+                st->shift = (COUNTER)n;
+            } else {
+                st->start_set = true;
+                st->start_ns = (u_int64_t)n * 1000;
+            }
+        } else {
+            goto bad;
+        }
+    }
+
+    ++fleet->cnt;
+    return 0;
+
+bad:
+    tcpreplay_seterr(ctx,
+                     "%s:%d: invalid %s, expected PCAP [multiplier=X|pps=N|mbps=N] [loop=N] [shift=N] [start=USEC]",
+                     path,
+                     lineno,
+                     token);
+    return -1;
+}
+
+/**
+ * \brief Replay the streams of a --fleet file, see fleet.h
+ *
+ * One stream per line: the pcap, then any of multiplier=X, pps=N or
+ * mbps=N for its rate, loop=N for its passes, 0 forever, shift=N for its
+ * --unique-ip address shift and start=USEC for when it starts.  The
+ * pcaps are added as sources, once each.  Call before preloading, with
+ * no other sources.
+ */
+int
+tcpreplay_set_fleet(tcpreplay_t *ctx, const char *path)
+{
+    tcpreplay_opt_t *options;
+    tcpr_fleet_t *fleet;
+    char line[4096];
+    int lineno = 0;
+    FILE *f;
+
+    assert(ctx);
+    assert(path);
+    options = ctx->options;
+
+    if (ctx->fleet != NULL || options->source_cnt > 0) {
+        tcpreplay_seterr(ctx, "%s", "a fleet takes its pcaps from its file, and only one file");
+        return -1;
+    }
+
+    if (options->speed.mode == speed_topspeed || options->speed.mode == speed_oneatatime) {
+        tcpreplay_seterr(ctx, "%s", "the streams of a fleet need a rate, not --topspeed or --oneatatime");
+        return -1;
+    }
+
+    if ((f = fopen(path, "r")) == NULL) {
+        tcpreplay_seterr(ctx, "Unable to open fleet file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    fleet = safe_malloc(sizeof(tcpr_fleet_t));
+    fleet->ctx = ctx;
+    ctx->fleet = fleet;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (fleet_parse(ctx, fleet, line, path, ++lineno) < 0) {
+            fclose(f);
+            fleet_free(ctx);
+            return -1;
+        }
+    }
+    fclose(f);
+
+    if (fleet->cnt == 0) {
+        tcpreplay_seterr(ctx, "fleet file %s has no streams", path);
+        fleet_free(ctx);
+        return -1;
+    }
+
+    options->preload_pcap = true;
+    return 0;
+}
+
+/* the tick of the wheel ns falls in */
+static inline u_int64_t
+fleet_tick(const tcpr_fleet_t *fleet, u_int64_t ns)
+{
+    return ns > fleet->start_ns ? (ns - fleet->start_ns) / FLEET_TICK_NS : 0;
+}
+
+static inline void
+fleet_wheel_add(fleet_worker_t *w, u_int32_t s, u_int64_t tick)
+{
+    u_int32_t *head = &w->bucket[tick & FLEET_WHEEL_MASK];
+
+    w->fleet->streams[s].wheel_next = *head;
+    *head = s;
+}
+
+/**
+ * \brief when the next packet of the stream is due
+ */
+static u_int64_t
+fleet_due(const fleet_stream_t *st, const file_cache_t *file_cache)
+{
+    u_int64_t first, ts;
+
+    switch (st->mode) {
+    case speed_packetrate:
+        return st->pass_start_ns + (u_int64_t)((double)st->next * 1000000000.0 / st->rate);
+    case speed_mbpsrate:
+        return st->pass_start_ns + (u_int64_t)((double)st->pass_bytes * 8000000000.0 / st->rate);
+    default:
+        first = pkthdr_ts_ns(&file_cache->packet_cache[0].pkthdr, file_cache->nsec);
+        ts = pkthdr_ts_ns(&file_cache->packet_cache[st->next].pkthdr, file_cache->nsec);
+        return st->pass_start_ns + (ts > first ? (u_int64_t)((double)(ts - first) / st->rate) : 0);
+    }
+}
+
+/**
+ * \brief time from the start of one pass of the stream to the next
+ *
+ * At a multiplier, the pcap is taken to last one more average gap than
+ * from its first packet to its last, or a second if they are all at once.
+ */
+static u_int64_t
+fleet_pass_ns(const fleet_stream_t *st, const file_cache_t *file_cache, u_int64_t bytes)
+{
+    u_int64_t first, last, pass_ns;
+
+    switch (st->mode) {
+    case speed_packetrate:
+        pass_ns = (u_int64_t)((double)file_cache->packet_cnt * 1000000000.0 / st->rate);
+        break;
+    case speed_mbpsrate:
+        pass_ns = (u_int64_t)((double)bytes * 8000000000.0 / st->rate);
+        break;
+    default:
+        first = pkthdr_ts_ns(&file_cache->packet_cache[0].pkthdr, file_cache->nsec);
+        last = pkthdr_ts_ns(&file_cache->packet_cache[file_cache->packet_cnt - 1].pkthdr, file_cache->nsec);
+        if (last > first)
+            pass_ns = (last - first) + (last - first) / (file_cache->packet_cnt - 1);
+        else
+            pass_ns = 1000000000;
+        pass_ns = (u_int64_t)((double)pass_ns / st->rate);
+    }
+
+    /* a stream never sends a pass all at once */
+    return pass_ns > FLEET_TICK_NS ? pass_ns : FLEET_TICK_NS;
+}
+
+/**
+ * \brief send the batch of the worker
+ */
+static void
+fleet_flush(fleet_worker_t *w)
+{
+    tcpreplay_stats_t *stats = &w->fleet->ctx->stats;
+    sendpacket_t *sp = w->sp;
+    COUNTER pkts_sent = sp->sent;
+    COUNTER bytes_sent = sp->bytes_sent;
+    int sent;
+
+    if (w->batch_cnt == 0)
+        return;
+
+    sent = sendpacket_batch(sp, w->batch, w->batch_cnt);
+    if (sent < w->batch_cnt)
+        warnx("Unable to send %d of %d packets: %s", w->batch_cnt - sent, w->batch_cnt, sendpacket_geterr(sp));
+
+    /* the workers add up to the one total */
+    __sync_fetch_and_add(&stats->pkts_sent, sp->sent - pkts_sent);
+    __sync_fetch_and_add(&stats->bytes_sent, sp->bytes_sent - bytes_sent);
+    w->batch_cnt = 0;
+    w->scratch_used = 0;
+}
+
+/**
+ * \brief add a packet of the stream to the batch of the worker
+ */
+static void
+fleet_queue(fleet_worker_t *w, const fleet_stream_t *st, const packet_cache_t *cached_packet, int datalink)
+{
+    tcpreplay_opt_t *options = w->fleet->ctx->options;
+    bool shifted = st->shift != 0 && cached_packet->pkthdr.caplen <= MAXPACKET;
+    struct pcap_pkthdr *pkthdr;
+    sendpacket_pkt_t *pkt;
+    u_char *pktdata = cached_packet->pktdata;
+
+    if (shifted && w->scratch_used + cached_packet->pkthdr.caplen > FLEET_SCRATCH)
+        fleet_flush(w);
+
+    pkthdr = &w->batch_pkthdr[w->batch_cnt];
+    pkt = &w->batch[w->batch_cnt];
+    memcpy(pkthdr, &cached_packet->pkthdr, sizeof(*pkthdr));
+
+    /* the streams of a pcap share its cache, so they are shifted in a copy */
+    if (shifted) {
+        pktdata = w->scratch + w->scratch_used;
+        memcpy(pktdata, cached_packet->pktdata, pkthdr->caplen);
+        w->scratch_used += (pkthdr->caplen + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        unique_ip_shift(pkthdr, pktdata, st->shift, datalink);
+    }
+
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->data = pktdata;
+    pkt->len = options->use_pkthdr_len ? pkthdr->len : pkthdr->caplen;
+    pkt->pkthdr = pkthdr;
+    if (options->gso) {
+        pkt->csum_start = cached_packet->csum_start;
+        pkt->csum_offset = cached_packet->csum_offset;
+        pkt->gso_size = cached_packet->gso_size;
+        pkt->gso_hdr_len = cached_packet->gso_hdr_len;
+        pkt->gso_v6 = cached_packet->gso_v6;
+    }
+
+    if (++w->batch_cnt == SENDPACKET_BATCH_MAX)
+        fleet_flush(w);
+}
+
+/**
+ * \brief queue the packets of the stream due by now_ns, false once it is
+ * done
+ */
+static bool
+fleet_send(fleet_worker_t *w, fleet_stream_t *st, u_int64_t now_ns)
+{
+    tcpreplay_opt_t *options = w->fleet->ctx->options;
+    const file_cache_t *file_cache = &options->file_cache[st->idx];
+    int n;
+
+    for (n = 0; n < FLEET_BURST && st->due_ns <= now_ns; n++) {
+        const packet_cache_t *cached_packet = &file_cache->packet_cache[st->next];
+
+        if (now_ns > st->due_ns + options->speed.late_ns)
+            ++w->late;
+
+        fleet_queue(w, st, cached_packet, file_cache->dlt);
+        st->pass_bytes += options->use_pkthdr_len ? cached_packet->pkthdr.len : cached_packet->pkthdr.caplen;
+        if (++st->next == file_cache->packet_cnt) {
+            if (st->loop != 0 && ++st->passes == st->loop)
+                return false;
+
+            st->next = 0;
+            st->pass_bytes = 0;
+            st->pass_start_ns += st->pass_ns;
+        }
+        st->due_ns = fleet_due(st, file_cache);
+    }
+
+    return true;
+}
+
+/**
+ * \brief run the streams in the bucket of the worker's tick
+ *
+ * Those due in a later round of the wheel go back, the others into the
+ * bucket of their next packet, the next tick at the soonest.
+ */
+static void
+fleet_run_tick(fleet_worker_t *w, u_int64_t now_ns)
+{
+    tcpr_fleet_t *fleet = w->fleet;
+    u_int64_t tick = w->tick;
+    u_int32_t s, next;
+
+    s = w->bucket[tick & FLEET_WHEEL_MASK];
+    w->bucket[tick & FLEET_WHEEL_MASK] = FLEET_NONE;
+    for (; s != FLEET_NONE; s = next) {
+        fleet_stream_t *st = &fleet->streams[s];
+        u_int64_t due;
+
+        next = st->wheel_next;
+        if (fleet_tick(fleet, st->due_ns) <= tick && !fleet_send(w, st, now_ns)) {
+            --w->active;
+            continue;
+        }
+
+        due = fleet_tick(fleet, st->due_ns);
+        fleet_wheel_add(w, s, due > tick ? due : tick + 1);
+    }
+}
+
+/**
+ * \brief wait while suspended, then move the streams of the worker on by
+ * the time it took
+ */
+static void
+fleet_suspend(fleet_worker_t *w)
+{
+    tcpr_fleet_t *fleet = w->fleet;
+    tcpreplay_t *ctx = fleet->ctx;
+    u_int64_t paused_ns = tcpr_clock_ns();
+    u_int32_t i;
+
+    fleet_flush(w);
+    while (ctx->suspend && !ctx->abort) {
+        if (sendpacket_nap(w->sp, 1000000) && !ctx->abort)
+            sendpacket_wake_clear(w->sp);
+    }
+
+    /* the streams stay in their buckets, which just run early */
+    paused_ns = tcpr_clock_ns() - paused_ns;
+    for (i = (u_int32_t)w->id; i < fleet->cnt; i += (u_int32_t)fleet->cnt_workers) {
+        fleet->streams[i].pass_start_ns += paused_ns;
+        fleet->streams[i].due_ns += paused_ns;
+    }
+}
+
+/**
+ * \brief when the worker next has a tick to run, at most FLEET_MAX_NAP_NS
+ * from now
+ */
+static u_int64_t
+fleet_next_wake(const fleet_worker_t *w, u_int64_t now_ns)
+{
+    u_int64_t tick;
+
+    for (tick = w->tick; tick < w->tick + FLEET_MAX_NAP_NS / FLEET_TICK_NS; tick++) {
+        if (w->bucket[tick & FLEET_WHEEL_MASK] != FLEET_NONE)
+            return w->fleet->start_ns + tick * FLEET_TICK_NS;
+    }
+
+    return now_ns + FLEET_MAX_NAP_NS;
+}
+
+static void *
+fleet_worker(void *arg)
+{
+    fleet_worker_t *w = (fleet_worker_t *)arg;
+    tcpr_fleet_t *fleet = w->fleet;
+    tcpreplay_t *ctx = fleet->ctx;
+
+    while (!ctx->abort && w->active > 0) {
+        u_int64_t now_ns = tcpr_clock_ns();
+        u_int64_t until, wake_ns;
+
+        if (fleet->end_ns != 0 && now_ns >= fleet->end_ns)
+            break;
+
+        if (ctx->suspend) {
+            fleet_suspend(w);
+            continue;
+        }
+
+        until = fleet_tick(fleet, now_ns);
+        for (; w->tick <= until && w->active > 0; ++w->tick)
+            fleet_run_tick(w, now_ns);
+        fleet_flush(w);
+
+        now_ns = tcpr_clock_ns();
+        wake_ns = fleet_next_wake(w, now_ns);
+        if (wake_ns > now_ns && sendpacket_nap(w->sp, wake_ns - now_ns) && !ctx->abort)
+            sendpacket_wake_clear(w->sp);
+    }
+
+    fleet_flush(w);
+    return NULL;
+}
+
+/**
+ * \brief send the streams of ctx->fleet until they are done, see fleet.h
+ *
+ * Streams of a pcap without a start of their own are spread over its
+ * pass, as --flow-copies spreads its copies.
+ */
+int
+fleet_run(tcpreplay_t *ctx)
+{
+    tcpr_fleet_t *fleet = ctx->fleet;
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_stats_t *stats = &ctx->stats;
+    u_int64_t *bytes;
+    u_int32_t *spread, *placed;
+    u_int32_t i;
+    int w, started;
+
+    assert(fleet);
+
+    fleet->cnt_workers = options->threads > 1 ? options->threads : 1;
+    /* one socket per worker, shared by its streams */
+    if (fleet->cnt_workers > 1 && send_threads_init(ctx) < 0)
+        return -1;
+
+    fleet->workers = safe_malloc(sizeof(fleet_worker_t) * fleet->cnt_workers);
+    for (w = 0; w < fleet->cnt_workers; w++) {
+        fleet->workers[w].fleet = fleet;
+        fleet->workers[w].id = w;
+        fleet->workers[w].sp = w == 0 ? ctx->intf1 : ctx->threads->workers[w].sp;
+        memset(fleet->workers[w].bucket, 0xff, sizeof(fleet->workers[w].bucket));
+    }
+
+    /* per pcap, bytes of a pass and the streams spread over it */
+    bytes = safe_malloc(sizeof(u_int64_t) * options->source_cnt);
+    spread = safe_malloc(sizeof(u_int32_t) * options->source_cnt);
+    placed = safe_malloc(sizeof(u_int32_t) * options->source_cnt);
+    for (i = 0; i < (u_int32_t)options->source_cnt; i++) {
+        const file_cache_t *file_cache = &options->file_cache[i];
+        COUNTER p;
+
+        for (p = 0; p < file_cache->packet_cnt; p++)
+            bytes[i] += options->use_pkthdr_len ? file_cache->packet_cache[p].pkthdr.len
+                                                : file_cache->packet_cache[p].pkthdr.caplen;
+    }
+    for (i = 0; i < fleet->cnt; i++) {
+        if (!fleet->streams[i].start_set)
+            ++spread[fleet->streams[i].idx];
+    }
+
+    fleet->start_ns = tcpr_clock_ns();
+    if (stats->start_time_ns == 0) {
+        stats->start_time_ns = fleet->start_ns;
+        if (options->stats >= 0) {
+            char buf[64];
+            struct timeval start;
+
+            tcpr_clock_to_timeval(stats->start_time_ns, &start);
+            if (format_date_time(&start, buf, sizeof(buf)) > 0)
+                printf("Test start: %s ...\n", buf);
+        }
+    }
+    fleet->end_ns = options->limit_time > 0 ? fleet->start_ns + SEC_TO_NANOSEC(options->limit_time) : 0;
+
+    for (i = 0; i < fleet->cnt; i++) {
+        fleet_stream_t *st = &fleet->streams[i];
+        const file_cache_t *file_cache = &options->file_cache[st->idx];
+        fleet_worker_t *wk = &fleet->workers[i % (u_int32_t)fleet->cnt_workers];
+
+        if (!file_cache->cached || file_cache->packet_cnt == 0) {
+            warnx("%s has no packets to send, skipping line %d of the fleet", options->sources[st->idx].filename,
+                  st->line);
+            continue;
+        }
+
+        st->pass_ns = fleet_pass_ns(st, file_cache, bytes[st->idx]);
+        if (!st->start_set)
+            st->start_ns = st->pass_ns / spread[st->idx] * placed[st->idx]++;
+
+        st->next = 0;
+        st->passes = 0;
+        st->pass_bytes = 0;
+        st->pass_start_ns = fleet->start_ns + st->start_ns;
+        st->due_ns = fleet_due(st, file_cache);
+        if (st->shift != 0 && wk->scratch == NULL)
+            wk->scratch = safe_malloc(FLEET_SCRATCH);
+        fleet_wheel_add(wk, i, fleet_tick(fleet, st->due_ns));
+        ++wk->active;
+    }
+    safe_free(bytes);
+    safe_free(spread);
+    safe_free(placed);
+
+    for (w = 1, started = 1; w < fleet->cnt_workers; w++, started++) {
+        if (pthread_create(&fleet->workers[w].thread, NULL, fleet_worker, &fleet->workers[w]) != 0) {
+            warnx("Unable to start fleet thread %d: %s", w, strerror(errno));
+            ctx->abort = true;
+            break;
+        }
+    }
+    fleet_worker(&fleet->workers[0]);
+    for (w = 1; w < started; w++)
+        pthread_join(fleet->workers[w].thread, NULL);
+
+    stats->end_time_ns = tcpr_clock_ns();
+    for (w = 0; w < fleet->cnt_workers; w++) {
+        stats->late_pkts += fleet->workers[w].late;
+        safe_free(fleet->workers[w].scratch);
+    }
+    safe_free(fleet->workers);
+
+    return 0;
+}
+
+/**
+ * \brief forget the streams of the fleet
+ */
+void
+fleet_free(tcpreplay_t *ctx)
+{
+    tcpr_fleet_t *fleet = ctx->fleet;
+
+    if (fleet == NULL)
+        return;
+
+    safe_free(fleet->streams);
+    safe_free(fleet);
+    ctx->fleet = NULL;
+}
+
+#else
+
+int
+tcpreplay_set_fleet(tcpreplay_t *ctx, _U_ const char *path)
+{
+    tcpreplay_seterr(ctx, "%s", "--fleet requires POSIX threads and is not supported by tcpreplay-edit");
+    return -1;
+}
+
+int
+fleet_run(tcpreplay_t *ctx)
+{
+    tcpreplay_seterr(ctx, "%s", "--fleet is not supported by this build");
+    return -1;
+}
+
+void
+fleet_free(_U_ tcpreplay_t *ctx)
+{
+}
+
+#endif /* ENABLE_FLEET */
@@ -0,0 +1,106 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "tcpreplay_api.h"
+#include "send_packets.h"
+#include "send_threads.h"
+
+/* the streams share the sockets of the send threads, see send_threads_init() */
+#ifdef ENABLE_SEND_THREADS
+#define ENABLE_FLEET 1
+#include <pthread.h>
+#endif
+
+/* resolution of the timer wheel, a packet goes out up to a tick after it is due */
+#define FLEET_TICK_NS 50000
+/* ticks in the wheel, a power of two.  Streams due later wait for it to come round */
+#define FLEET_WHEEL_SIZE 16384
+/* most packets a stream sends when it is woken, so one far behind can't hold up the rest */
+#define FLEET_BURST 16
+/* longest a worker sleeps, so an abort is seen */
+#define FLEET_MAX_NAP_NS 100000000
+/* the end of a bucket */
+#define FLEET_NONE 0xffffffff
+/* bytes of shifted copies a batch holds before it is sent early */
+#define FLEET_SCRATCH FLOW_COPY_SCRATCH
+
+/* one line of the --fleet file, replayed on its own schedule */
+typedef struct fleet_stream_s {
+    int idx;                   /* into options->file_cache, shared by the streams of a pcap */
+    int line;                  /* of the --fleet file, for messages */
+    tcpreplay_speed_mode mode; /* speed_multiplier, speed_mbpsrate or speed_packetrate */
+    double rate;               /* the multiplier, bits or packets per second */
+    u_int32_t loop;            /* passes, 0 forever */
+    COUNTER shift;             /* --unique-ip shift of the addresses, 0 to send them as they are */
+    bool start_set;
+    u_int64_t start_ns;        /* first packet, from the start of the fleet */
+    u_int64_t pass_ns;         /* from the start of one pass to the next */
+
+    /* while sending, only touched by the worker of the stream */
+    COUNTER next;              /* packet of the file to send next */
+    u_int32_t passes;          /* done */
+    u_int64_t pass_start_ns;
+    u_int64_t pass_bytes;      /* mbps: bytes of the pass before next */
+    u_int64_t due_ns;          /* when next goes out */
+    u_int32_t wheel_next;      /* stream after it in its bucket */
+} fleet_stream_t;
+
+#ifdef ENABLE_FLEET
+/* a thread sending the streams it was given, every cnt_workers'th from its id */
+typedef struct fleet_worker_s {
+    tcpr_fleet_t *fleet;
+    int id;
+    pthread_t thread;
+    sendpacket_t *sp;  /* worker 0 uses ctx->intf1, the others those of ctx->threads */
+    u_int32_t bucket[FLEET_WHEEL_SIZE];
+    u_int64_t tick;    /* the next to run, from the start of the fleet */
+    u_int32_t active;  /* streams with passes left */
+    sendpacket_pkt_t batch[SENDPACKET_BATCH_MAX];
+    struct pcap_pkthdr batch_pkthdr[SENDPACKET_BATCH_MAX];
+    int batch_cnt;
+    u_char *scratch;   /* shifted copies of the batched packets */
+    size_t scratch_used;
+    COUNTER late;      /* packets sent more than --late-threshold after they were due */
+} fleet_worker_t;
+
+/*
+ * --fleet: many small replays at once, each its own pcap, rate and
+ * addresses.  Every pcap is preloaded once, however many streams send it,
+ * and the streams are spread over --threads workers.  A worker keeps its
+ * streams on a timer wheel by when their next packet is due, sleeps until
+ * the next tick with something in it, and batches what the streams of
+ * that tick send into its socket.
+ */
+struct tcpr_fleet_s {
+    tcpreplay_t *ctx;
+    fleet_stream_t *streams;
+    u_int32_t cnt;
+    u_int32_t max;
+    int pcaps;    /* distinct pcap files of the streams */
+    int cnt_workers;
+    fleet_worker_t *workers;
+    u_int64_t start_ns;
+    u_int64_t end_ns; /* --duration, 0 for none */
+};
+#endif /* ENABLE_FLEET */
+
+int fleet_run(tcpreplay_t *ctx);
+void fleet_free(tcpreplay_t *ctx);
@@ -0,0 +1,330 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * --follow-dir, see follow.h.
+ *
+ * A file is known to be closed once a file sorting after it shows up,
+ * which is when a capture process rotates, or once the newest file has
+ * kept the same size and mtime for FOLLOW_SETTLE_NS, for the last file of
+ * a capture.  Files whose names start with a dot are left alone, so a
+ * writer can also create them hidden and rename them into place.
+ */
+
+#include "follow.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "playlist.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+
+static int
+follow_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * \brief the names in the directory sorting after follow->last, in order
+ */
+static char **
+follow_scan(tcpr_follow_t *follow, int *cnt)
+{
+    struct dirent *ent;
+    char **names = NULL;
+    int n = 0, max = 0;
+    DIR *dir;
+
+    *cnt = 0;
+    if ((dir = opendir(follow->dir)) == NULL)
+        return NULL;
+
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.' || (follow->last != NULL && strcmp(ent->d_name, follow->last) <= 0))
+            continue;
+
+        if (n == max) {
+            max = max ? max * 2 : 16;
+            names = safe_realloc(names, max * sizeof(char *));
+        }
+        names[n++] = safe_strdup(ent->d_name);
+    }
+    closedir(dir);
+
+    if (n > 1)
+        qsort(names, n, sizeof(char *), follow_cmp);
+
+    *cnt = n;
+    return names;
+}
+
+/**
+ * \brief the path of the next file once it is closed, NULL if there is
+ * none yet.  Free it with safe_free()
+ */
+static char *
+follow_ready(tcpr_follow_t *follow)
+{
+    struct stat statbuf;
+    char **names;
+    char *path, *ret = NULL;
+    size_t len;
+    int cnt, i;
+
+    names = follow_scan(follow, &cnt);
+    for (i = 0; i < cnt && ret == NULL; i++) {
+        len = strlen(follow->dir) + strlen(names[i]) + 2;
+        path = safe_malloc(len);
+        snprintf(path, len, "%s/%s", follow->dir, names[i]);
+
+        if (stat(path, &statbuf) != 0 || !S_ISREG(statbuf.st_mode)) {
+            safe_free(path);
+            continue;
+        }
+
+        /* the newest file: wait for it to stop changing */
+        if (i == cnt - 1) {
+            u_int64_t now_ns = tcpr_clock_ns();
+
+            if (follow->settling == NULL || strcmp(follow->settling, names[i]) != 0 ||
+                follow->settling_size != statbuf.st_size || follow->settling_mtime != statbuf.st_mtime) {
+                safe_free(follow->settling);
+                follow->settling = safe_strdup(names[i]);
+                follow->settling_size = statbuf.st_size;
+                follow->settling_mtime = statbuf.st_mtime;
+                follow->settling_since = now_ns;
+            }
+
+            if (now_ns - follow->settling_since < FOLLOW_SETTLE_NS) {
+                safe_free(path);
+                continue;
+            }
+        }
+
+        safe_free(follow->last);
+        follow->last = safe_strdup(names[i]);
+        ret = path;
+    }
+
+    for (i = 0; i < cnt; i++)
+        safe_free(names[i]);
+    safe_free(names);
+
+    return ret;
+}
+
+/**
+ * \brief without --preload-pcap, at least have the next file in the page
+ * cache by the time it is sent
+ */
+static void
+follow_readahead(tcpreplay_t *ctx, const char *path)
+{
+#ifdef HAVE_POSIX_FADVISE
+    int fd;
+
+    if (ctx->options->preload_pcap || (fd = open(path, O_RDONLY)) < 0)
+        return;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+#else
+    (void)ctx;
+    (void)path;
+#endif
+}
+
+/**
+ * \brief the watcher thread, queues one file at a time on the playlist
+ */
+static void *
+follow_thread(void *arg)
+{
+    tcpr_follow_t *follow = (tcpr_follow_t *)arg;
+    tcpreplay_t *ctx = follow->ctx;
+    struct timespec nap;
+    char *path;
+
+    nap.tv_sec = 0;
+    nap.tv_nsec = FOLLOW_POLL_MS * 1000000L;
+
+    while (!__atomic_load_n(&follow->stop, __ATOMIC_ACQUIRE)) {
+        /* the next file is read ahead, no further */
+        if (playlist_adds(ctx) == 0 && (path = follow_ready(follow)) != NULL) {
+            dbgx(1, "Follow: queueing %s", path);
+            follow_readahead(ctx, path);
+            if (tcpreplay_playlist_add(ctx, path) < 0)
+                warnx("Skipping %s: %s", path, tcpreplay_geterr(ctx));
+            safe_free(path);
+            continue;
+        }
+
+        nanosleep(&nap, NULL);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief Replay the files of dir as a capture process closes them, see
+ * follow.h
+ *
+ * Without any sources yet, this waits for the first file of dir.  Call it
+ * after adding any other files, before tcpreplay_replay().  Not possible
+ * with --dualfile or --mix.
+ */
+int
+tcpreplay_follow_dir(tcpreplay_t *ctx, const char *dir)
+{
+    tcpr_follow_t *follow;
+    struct stat statbuf;
+    struct timespec nap;
+    char *path = NULL;
+
+    assert(ctx);
+    assert(dir);
+
+    if (ctx->options->dualfile || ctx->options->mix_cnt > 0) {
+        tcpreplay_seterr(ctx, "%s", "a directory can't be followed with --dualfile or --mix");
+        return -1;
+    }
+
+    if (ctx->follow != NULL) {
+        tcpreplay_seterr(ctx, "already following %s", ctx->follow->dir);
+        return -1;
+    }
+
+    if (stat(dir, &statbuf) != 0 || !S_ISDIR(statbuf.st_mode)) {
+        tcpreplay_seterr(ctx, "%s is not a directory", dir);
+        return -1;
+    }
+
+    follow = safe_malloc(sizeof(tcpr_follow_t));
+    follow->ctx = ctx;
+    follow->dir = safe_strdup(dir);
+
+    /* something to start with */
+    nap.tv_sec = 0;
+    nap.tv_nsec = FOLLOW_POLL_MS * 1000000L;
+    while (ctx->options->source_cnt == 0 && !ctx->abort && (path = follow_ready(follow)) == NULL)
+        nanosleep(&nap, NULL);
+
+    if (path != NULL) {
+        tcpreplay_add_pcapfile(ctx, path);
+        safe_free(path);
+    }
+
+    ctx->follow = follow;
+    if (pthread_create(&follow->thread, NULL, follow_thread, follow) != 0) {
+        tcpreplay_seterr(ctx, "Unable to start thread to follow %s: %s", dir, strerror(errno));
+        follow_free(ctx);
+        return -1;
+    }
+    follow->running = true;
+
+    return 0;
+}
+
+/**
+ * \brief the source to send after the one before next, in the send loop
+ * of a --follow-dir replay
+ *
+ * The files already sent go, but for the last one so the list is never
+ * empty, and at the end of the list this waits for the next file.
+ * Returns source_cnt if the replay is aborted
+ */
+int
+follow_next(tcpreplay_t *ctx, int next)
+{
+    struct timespec nap;
+
+    assert(ctx->follow);
+
+    if (next > 1) {
+        playlist_retire(ctx, next - 1);
+        next = 1;
+    }
+
+    nap.tv_sec = 0;
+    nap.tv_nsec = FOLLOW_POLL_MS * 1000000L;
+    while (!ctx->abort) {
+        if (playlist_pending(ctx))
+            next = playlist_apply(ctx, next);
+
+        if (next < ctx->options->source_cnt)
+            break;
+
+        nanosleep(&nap, NULL);
+    }
+
+    return next;
+}
+
+/**
+ * \brief stop following the directory
+ */
+void
+follow_free(tcpreplay_t *ctx)
+{
+    tcpr_follow_t *follow = ctx->follow;
+
+    if (follow == NULL)
+        return;
+
+    if (follow->running) {
+        __atomic_store_n(&follow->stop, true, __ATOMIC_RELEASE);
+        pthread_join(follow->thread, NULL);
+    }
+
+    safe_free(follow->dir);
+    safe_free(follow->last);
+    safe_free(follow->settling);
+    safe_free(follow);
+    ctx->follow = NULL;
+}
+
+#else
+
+int
+tcpreplay_follow_dir(tcpreplay_t *ctx, _U_ const char *dir)
+{
+    tcpreplay_seterr(ctx, "%s", "following a directory requires POSIX threads");
+    return -1;
+}
+
+int
+follow_next(_U_ tcpreplay_t *ctx, int next)
+{
+    return next;
+}
+
+void
+follow_free(_U_ tcpreplay_t *ctx)
+{
+}
+
+#endif /* HAVE_PTHREAD */
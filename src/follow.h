@@ -0,0 +1,61 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "tcpreplay_api.h"
+#include <sys/types.h>
+#include <time.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+/* how often the directory is looked at */
+#define FOLLOW_POLL_MS 100
+/* the newest file is taken to be closed once it hasn't changed for this long */
+#define FOLLOW_SETTLE_NS (2ULL * 1000 * 1000 * 1000)
+
+/*
+ * --follow-dir: replay the files a capture process rotates through in a
+ * directory, in name order, as each is closed.  A thread watches the
+ * directory and hands each file to the playlist, see playlist.c, once the
+ * one before it has been switched in, so the next file is read ahead
+ * while the current one is sent.  The send loop drops the files it is
+ * done with and waits at the end of the list for the next one.
+ */
+struct tcpr_follow_s {
+    tcpreplay_t *ctx;
+    char *dir;
+    char *last;     /* name of the last file taken, files sorting after it are new */
+    char *settling; /* the newest file, not known to be closed yet */
+    off_t settling_size;
+    time_t settling_mtime;
+    u_int64_t settling_since;
+    /* kept by the send loop, so the files are one timeline */
+    u_int64_t last_pkt_ns;  /* capture time of the last packet sent */
+    u_int64_t last_send_ns; /* when the last file was done */
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
+    bool running;
+    bool stop;
+};
+
+int follow_next(tcpreplay_t *ctx, int next);
+void follow_free(tcpreplay_t *ctx);
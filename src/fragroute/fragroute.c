@@ -37,9 +37,10 @@ void
 fragroute_close(fragroute_t *ctx)
 {
     assert(ctx);
+    pktq_free(ctx->pktq);
+    pkt_pool_close(ctx->pool);
     free(ctx->pktq);
     free(ctx);
-    pkt_close();
 }
 
 int
@@ -49,12 +50,15 @@ fragroute_process(fragroute_t *ctx, void *buf, size_t len)
     assert(ctx);
     assert(buf);
 
-    ctx->first_packet = 0;
+    /* the fragments of the previous packet go back to the pool */
+    pktq_free(ctx->pktq);
+    ctx->frag_next = NULL;
+
     /* save the l2 header of the original packet for later */
     ctx->l2len = get_l2len(buf, (int)len, ctx->dlt);
     memcpy(ctx->l2header, buf, ctx->l2len);
 
-    if ((pkt = pkt_new(len)) == NULL) {
+    if ((pkt = pkt_new(ctx->pool, len)) == NULL) {
         strcpy(ctx->errbuf, "unable to pkt_new()");
         return -1;
     }
@@ -65,6 +69,7 @@ fragroute_process(fragroute_t *ctx, void *buf, size_t len)
     pkt_decorate(pkt);
 
     if (pkt->pkt_ip == NULL) {
+        pkt_free(pkt);
         strcpy(ctx->errbuf, "skipping non-IP packet");
         return -1;
     }
@@ -78,42 +83,55 @@ fragroute_process(fragroute_t *ctx, void *buf, size_t len)
     TAILQ_INSERT_TAIL(ctx->pktq, pkt, pkt_next);
 
     mod_apply(ctx->pktq);
+    ctx->frag_next = TAILQ_FIRST(ctx->pktq);
 
     return 0;
 }
 
 /*
  * keep calling this after fragroute_process() to get all the fragments.
- * Each call returns the fragment length which is stored in **packet.
+ * Each call points iov[0] at the original L2 header and iov[1] at the rest
+ * of the fragment, which stays valid until the next fragroute_process(),
+ * and returns the fragment length.  iov needs FRAGROUTE_IOV_MAX entries.
+ * Returns 0 when no more fragments remain
+ */
+int
+fragroute_getfragment_iov(fragroute_t *ctx, struct iovec *iov)
+{
+    struct pkt *pkt = ctx->frag_next;
+    size_t length;
+
+    if (pkt == TAILQ_END(ctx->pktq))
+        return 0; // nothing
+
+    ctx->frag_next = TAILQ_NEXT(pkt, pkt_next);
+    length = pkt->pkt_end - pkt->pkt_data;
+
+    /* return the original L2 header */
+    iov[0].iov_base = ctx->l2header;
+    iov[0].iov_len = min((size_t)ctx->l2len, length);
+    iov[1].iov_base = pkt->pkt_data + iov[0].iov_len;
+    iov[1].iov_len = length - iov[0].iov_len;
+
+    return (int)length;
+}
+
+/*
+ * like fragroute_getfragment_iov(), but copies the fragment into *packet
  * Returns 0 when no more fragments remain or -1 on error
  */
 int
 fragroute_getfragment(fragroute_t *ctx, char **packet)
 {
-    static struct pkt *pkt = NULL;
-    static struct pkt *next = NULL;
-    char *pkt_data = *packet;
-    u_int32_t length;
-
-    if (ctx->first_packet != 0) {
-        pkt = next;
-    } else {
-        ctx->first_packet = 1;
-        pkt = TAILQ_FIRST(ctx->pktq);
-    }
-
-    if (pkt != TAILQ_END(&(ctx->pktq))) {
-        next = TAILQ_NEXT(pkt, pkt_next);
-        memcpy(pkt_data, pkt->pkt_data, pkt->pkt_end - pkt->pkt_data);
+    struct iovec iov[FRAGROUTE_IOV_MAX];
+    int length;
 
-        /* return the original L2 header */
-        memcpy(pkt_data, ctx->l2header, ctx->l2len);
-        length = pkt->pkt_end - pkt->pkt_data;
-        pkt = next;
-        return (int)length;
+    if ((length = fragroute_getfragment_iov(ctx, iov)) > 0) {
+        memcpy(*packet, iov[0].iov_base, iov[0].iov_len);
+        memcpy(*packet + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
     }
 
-    return 0; // nothing
+    return length;
 }
 
 fragroute_t *
@@ -128,9 +146,14 @@ fragroute_init(const int mtu, const int dlt, const char *config, char *errbuf)
 
     ctx = (fragroute_t *)safe_malloc(sizeof(fragroute_t));
     ctx->pktq = (struct pktq *)safe_malloc(sizeof(struct pktq));
+    TAILQ_INIT(ctx->pktq);
     ctx->dlt = dlt;
 
-    pkt_init(128);
+    if ((ctx->pool = pkt_pool_open()) == NULL) {
+        sprintf(errbuf, "Unable to allocate fragroute packet pool");
+        fragroute_close(ctx);
+        return NULL;
+    }
 
     ctx->mtu = mtu;
 
@@ -23,9 +23,13 @@
 
 #include "config.h"
 #include "pkt.h"
+#include <sys/uio.h>
 
 #define FRAGROUTE_ERRBUF_LEN 1024
 
+/* segments returned per fragment by fragroute_getfragment_iov() */
+#define FRAGROUTE_IOV_MAX 2
+
 /* Fragroute context. */
 struct fragroute_s {
     struct addr src;
@@ -34,16 +38,18 @@ struct fragroute_s {
     struct addr dmac;
     int dlt;
     int mtu;
-    int first_packet; /* have we called getfragment() yet after process()? */
     int l2len;
     u_char l2header[50];
     char errbuf[FRAGROUTE_ERRBUF_LEN];
-    struct pktq *pktq; /* packet chain */
+    struct pktq *pktq;     /* packet chain */
+    struct pkt *frag_next; /* next packet for getfragment() to return */
+    struct pkt_pool *pool; /* pkts for pktq, reused from one packet to the next */
 };
 
 typedef struct fragroute_s fragroute_t;
 
 int fragroute_process(fragroute_t *ctx, void *buf, size_t len);
 int fragroute_getfragment(fragroute_t *ctx, char **packet);
+int fragroute_getfragment_iov(fragroute_t *ctx, struct iovec *iov);
 fragroute_t *fragroute_init(const int mtu, const int dlt, const char *config, char *errbuf);
 void fragroute_close(fragroute_t *ctx);
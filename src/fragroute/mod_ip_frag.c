@@ -132,7 +132,7 @@ ip_frag_apply_ipv4(_U_ void *d, struct pktq *pktq)
             continue;
 
         for (p = pkt->pkt_ip_data; p < pkt->pkt_end;) {
-            new = pkt_new(pkt->pkt_buf_size);
+            new = pkt_new(pkt->pkt_pool, pkt->pkt_buf_size);
             memcpy(new->pkt_eth, pkt->pkt_eth, (u_char *)pkt->pkt_eth_data - (u_char *)pkt->pkt_eth);
             memcpy(new->pkt_ip, pkt->pkt_ip, hl);
             new->pkt_ip_data = new->pkt_eth_data + hl;
@@ -235,7 +235,7 @@ ip_frag_apply_ipv6(_U_ void *d, struct pktq *pktq)
         next_hdr = pkt->pkt_ip6->ip6_nxt;
 
         for (p = pkt->pkt_ip_data; p < pkt->pkt_end;) {
-            new = pkt_new(pkt->pkt_buf_size);
+            new = pkt_new(pkt->pkt_pool, pkt->pkt_buf_size);
             memcpy(new->pkt_eth, pkt->pkt_eth, (u_char *)pkt->pkt_eth_data - (u_char *)pkt->pkt_eth);
             memcpy(new->pkt_ip, pkt->pkt_ip, hl);
             ext = (struct ip6_ext_hdr *)((u_char *)new->pkt_eth_data + hl);
@@ -109,7 +109,7 @@ tcp_seg_apply(_U_ void *d, struct pktq *pktq)
         for (p = pkt->pkt_tcp_data; p < pkt->pkt_end; p += len) {
             u_char *p1, *p2;
 
-            new = pkt_new(pkt->pkt_buf_size);
+            new = pkt_new(pkt->pkt_pool, pkt->pkt_buf_size);
             memcpy(new->pkt_eth, pkt->pkt_eth, (u_char *)pkt->pkt_eth_data - (u_char *)pkt->pkt_eth);
             p1 = p, p2 = NULL;
             len = MIN(pkt->pkt_end - p, tcp_seg_data.size);
@@ -8,47 +8,73 @@
 
 #include "pkt.h"
 #include "config.h"
-#include "bget.h"
 #include "common/err.h"
+#include "common/memstat.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
-static struct pkt **pvbase;
-static int pvlen;
-
-void
-pkt_init(int size)
+struct pkt_pool *
+pkt_pool_open(void)
 {
-    bectl(NULL, malloc, free, sizeof(struct pkt) * size);
+    struct pkt_pool *pool;
+
+    if ((pool = calloc(1, sizeof(*pool))) == NULL)
+        return (NULL);
+
+    TAILQ_INIT(&pool->pool_free);
+
+    return (pool);
 }
 
 void
-pkt_close(void)
+pkt_pool_close(struct pkt_pool *pool)
 {
-    if (pvbase) {
-        pvlen = 0;
-        free(pvbase);
+    struct pkt *pkt;
+
+    if (pool == NULL)
+        return;
+
+    while ((pkt = TAILQ_FIRST(&pool->pool_free)) != NULL) {
+        TAILQ_REMOVE(&pool->pool_free, pkt, pkt_next);
+        free(pkt->pkt_buf);
+        free(pkt);
     }
+
+    free(pool->pvbase);
+    free(pool);
 }
 
 struct pkt *
-pkt_new(size_t len)
+pkt_new(struct pkt_pool *pool, size_t len)
 {
     struct pkt *pkt;
+    size_t alloc;
 
-    if ((pkt = bget(sizeof(*pkt))) == NULL)
-        return (NULL);
+    alloc = max((size_t)PKT_BUF_LEN, PKT_BUF_ALIGN + len);
 
-    timerclear(&pkt->pkt_ts);
-    pkt->pkt_buf_size = PKT_BUF_ALIGN + len;
-    pkt->pkt_buf = malloc(max((size_t)PKT_BUF_LEN, pkt->pkt_buf_size));
-    if (pkt->pkt_buf == NULL) {
-        free(pkt);
-        return NULL;
+    if ((pkt = TAILQ_FIRST(&pool->pool_free)) != NULL) {
+        TAILQ_REMOVE(&pool->pool_free, pkt, pkt_next);
+    } else {
+        if ((pkt = calloc(1, sizeof(*pkt))) == NULL)
+            return (NULL);
+        tcpr_mem_alloc(TCPR_MEM_FRAGROUTE, sizeof(*pkt), __FUNCTION__, __LINE__, __FILE__);
+        pkt->pkt_pool = pool;
     }
 
+    if (pkt->pkt_buf_alloc < alloc) {
+        free(pkt->pkt_buf);
+        if ((pkt->pkt_buf = malloc(alloc)) == NULL) {
+            free(pkt);
+            return (NULL);
+        }
+        tcpr_mem_alloc(TCPR_MEM_FRAGROUTE, alloc, __FUNCTION__, __LINE__, __FILE__);
+        pkt->pkt_buf_alloc = alloc;
+    }
+
+    timerclear(&pkt->pkt_ts);
+    pkt->pkt_buf_size = PKT_BUF_ALIGN + len;
     pkt->pkt_data = pkt->pkt_buf + PKT_BUF_ALIGN;
     pkt->pkt_eth = (struct eth_hdr *)pkt->pkt_data;
     pkt->pkt_eth_data = pkt->pkt_data + ETH_HDR_LEN;
@@ -65,15 +91,9 @@ pkt_dup(struct pkt *pkt)
     struct pkt *new;
     off_t off;
 
-    if ((new = bget(sizeof(*new))) == NULL)
+    if ((new = pkt_new(pkt->pkt_pool, pkt->pkt_buf_size - PKT_BUF_ALIGN)) == NULL)
         return (NULL);
 
-    new->pkt_buf = malloc(pkt->pkt_buf_size);
-    if (new->pkt_buf == NULL) {
-        free(pkt);
-        return NULL;
-    }
-
     off = new->pkt_buf - pkt->pkt_buf;
 
     new->pkt_ts = pkt->pkt_ts;
@@ -267,11 +287,23 @@ pkt_decorate(struct pkt *pkt)
 void
 pkt_free(struct pkt *pkt)
 {
-    if (pkt && pkt->pkt_buf) {
-        free(pkt->pkt_buf);
-    }
+    if (pkt == NULL)
+        return;
 
-    brel(pkt);
+    /* most recently used first, its buffer is likely still in cache */
+    TAILQ_INSERT_HEAD(&pkt->pkt_pool->pool_free, pkt, pkt_next);
+}
+
+/* release every pkt in the queue and leave it empty */
+void
+pktq_free(struct pktq *pktq)
+{
+    struct pkt *pkt;
+
+    while ((pkt = TAILQ_FIRST(pktq)) != NULL) {
+        TAILQ_REMOVE(pktq, pkt, pkt_next);
+        pkt_free(pkt);
+    }
 }
 
 void
@@ -291,23 +323,27 @@ pktq_reverse(struct pktq *pktq)
 void
 pktq_shuffle(rand_t *r, struct pktq *pktq)
 {
+    struct pkt_pool *pool;
+    struct pkt **pvbase;
     struct pkt *pkt;
     int i;
 
+    if ((pkt = TAILQ_FIRST(pktq)) == NULL)
+        return;
+    pool = pkt->pkt_pool;
+
     i = 0;
     TAILQ_FOREACH(pkt, pktq, pkt_next)
     {
         i++;
     }
-    if (i > 0 && i > pvlen) {
-        pvlen = i;
-        if (pvbase == NULL)
-            pvbase = malloc(sizeof(pkt) * pvlen);
-        else
-            pvbase = realloc(pvbase, sizeof(pkt) * pvlen);
+    if (i > pool->pvlen) {
+        pool->pvlen = i;
+        pool->pvbase = realloc(pool->pvbase, sizeof(pkt) * pool->pvlen);
     }
-    if (!pvbase)
+    if (!pool->pvbase)
         err(-1, "out of memory\n");
+    pvbase = pool->pvbase;
 
     i = 0;
     TAILQ_FOREACH(pkt, pktq, pkt_next)
@@ -52,6 +52,8 @@ struct pkt {
 
     u_char *pkt_buf;
     size_t pkt_buf_size;
+    size_t pkt_buf_alloc;      /* bytes allocated for pkt_buf */
+    struct pkt_pool *pkt_pool; /* pool the pkt goes back to */
     u_char *pkt_data;
     u_char *pkt_end;
 
@@ -72,14 +74,27 @@ struct pkt {
 
 TAILQ_HEAD(pktq, pkt);
 
-void pkt_init(int size);
-void pkt_close(void);
+/*
+ * Freed pkts are kept, buffer and all, by the pool they came from and
+ * handed out again by pkt_new(), so once a few packets have been through
+ * fragroute it stops calling malloc().  Each fragroute_t has its own pool.
+ */
+struct pkt_pool {
+    struct pktq pool_free; /* released pkts */
+    struct pkt **pvbase;   /* scratch space for pktq_shuffle() */
+    int pvlen;
+};
 
-struct pkt *pkt_new(size_t len);
+struct pkt_pool *pkt_pool_open(void);
+void pkt_pool_close(struct pkt_pool *pool);
+
+struct pkt *pkt_new(struct pkt_pool *pool, size_t len);
 struct pkt *pkt_dup(struct pkt *);
 void pkt_decorate(struct pkt *pkt);
 void pkt_free(struct pkt *pkt);
 
+void pktq_free(struct pktq *pktq);
+
 void pktq_reverse(struct pktq *pktq);
 void pktq_shuffle(rand_t *r, struct pktq *pktq);
 struct pkt *pktq_random(rand_t *r, struct pktq *pktq);
@@ -0,0 +1,436 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Traffic generator mode, --gen-field.
+ *
+ * The preloaded packets serve as templates.  Each time one is sent from
+ * the cache it is copied to a buffer of the file's pad ring, and the
+ * fields named by --gen-field are given the next value of their rule,
+ * with the IP, TCP and UDP checksums patched to match (RFC 1624).  Where
+ * the fields are in each template is found once while preloading, so a
+ * packet costs a copy and a few stores.  It then goes out through the
+ * usual batching, pacing and sendpacket backends.
+ *
+ * With --gen-vlan-add, untagged Ethernet templates get an 802.1Q tag in
+ * that copy, so a vlan rule can fan them out over many VLANs as well.
+ * Their offsets are those of the untagged template and are moved past
+ * the tag while stamping.
+ */
+
+#include "generator.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "send_packets.h"
+#include "tcpreplay_api.h"
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const struct {
+    const char *name;
+    gen_field_name_t field;
+    int width;
+} gen_names[] = {
+        {"ipsrc", gen_ip_src, 4},
+        {"ipdst", gen_ip_dst, 4},
+        {"sport", gen_sport, 2},
+        {"dport", gen_dport, 2},
+        {"vlan", gen_vlan, 2},
+};
+
+/* largest value of a field, the VLAN ID being 12 bits of its tag */
+static uint32_t
+gen_field_max(const gen_field_t *field)
+{
+    if (field->name == gen_vlan)
+        return 0x0fff;
+
+    return field->width == 4 ? UINT32_MAX : ((uint32_t)1 << (8 * field->width)) - 1;
+}
+
+/* a value of the given field, a dotted quad for addresses */
+static int
+gen_parse_value(const gen_field_t *field, const char *str, uint32_t *value)
+{
+    unsigned long v;
+    char *end;
+
+    if (field->name == gen_ip_src || field->name == gen_ip_dst) {
+        struct in_addr addr;
+
+        if (inet_pton(AF_INET, str, &addr) != 1)
+            return -1;
+        *value = ntohl(addr.s_addr);
+        return 0;
+    }
+
+    if (!isdigit((unsigned char)*str))
+        return -1;
+
+    errno = 0;
+    v = strtoul(str, &end, 0);
+    if (errno != 0 || *end != '\0' || v > gen_field_max(field))
+        return -1;
+
+    *value = (uint32_t)v;
+    return 0;
+}
+
+/**
+ * \brief Parse a --gen-field rule, FIELD:MODE[:LOW-HIGH]
+ *
+ * FIELD is ipsrc, ipdst, sport, dport, vlan, or @OFFSET/WIDTH for the
+ * WIDTH (1, 2 or 4) bytes at OFFSET into the TCP/UDP payload.  MODE is
+ * inc, rand or loop.  Returns 0 on success, -1 if spec is invalid.
+ */
+int
+gen_field_parse(gen_field_t *field, const char *spec)
+{
+    char *copy = safe_strdup(spec);
+    char *mode, *range, *high;
+    int ret = -1;
+    size_t i;
+
+    memset(field, 0, sizeof(*field));
+
+    if ((mode = strchr(copy, ':')) == NULL)
+        goto out;
+    *mode++ = '\0';
+    if ((range = strchr(mode, ':')) != NULL)
+        *range++ = '\0';
+
+    if (copy[0] == '@') {
+        unsigned long offset, width;
+        char *end;
+
+        if (!isdigit((unsigned char)copy[1]))
+            goto out;
+        errno = 0;
+        offset = strtoul(copy + 1, &end, 0);
+        if (errno != 0 || *end != '/' || offset > GEN_PAYLOAD_OFFSET_MAX)
+            goto out;
+        width = strtoul(end + 1, &end, 0);
+        if (*end != '\0' || (width != 1 && width != 2 && width != 4))
+            goto out;
+
+        field->name = gen_payload;
+        field->offset = (uint32_t)offset;
+        field->width = (int)width;
+    } else {
+        for (i = 0; i < sizeof(gen_names) / sizeof(gen_names[0]); i++) {
+            if (strcmp(copy, gen_names[i].name) == 0) {
+                field->name = gen_names[i].field;
+                field->width = gen_names[i].width;
+                break;
+            }
+        }
+        if (field->name == 0)
+            goto out;
+    }
+
+    if (strcmp(mode, "inc") == 0)
+        field->mode = gen_inc;
+    else if (strcmp(mode, "rand") == 0)
+        field->mode = gen_rand;
+    else if (strcmp(mode, "loop") == 0)
+        field->mode = gen_loop;
+    else
+        goto out;
+
+    if (range != NULL) {
+        if ((high = strchr(range, '-')) == NULL)
+            goto out;
+        *high++ = '\0';
+        if (gen_parse_value(field, range, &field->low) < 0 || gen_parse_value(field, high, &field->high) < 0 ||
+            field->low > field->high)
+            goto out;
+        field->range = true;
+    }
+
+    ret = 0;
+
+out:
+    safe_free(copy);
+    return ret;
+}
+
+/**
+ * \brief Find the fields --gen-field may set in a preloaded packet
+ *
+ * Only the bytes stored in the cache count, so --preload-snaplen may
+ * leave a template without some of them.  Fragments after the first
+ * have no layer 4 header of their own.  Untagged Ethernet templates are
+ * marked for --gen-vlan-add whether or not it's given, so a cache image
+ * serves either way.
+ */
+void
+gen_template_offsets(file_cache_t *file_cache, packet_cache_t *cached_packet)
+{
+    const u_char *pktdata = cached_packet->pktdata;
+    uint32_t caplen = cached_packet->pkthdr.caplen;
+    const ipv4_hdr_t *ip_hdr;
+    uint32_t vlan_offset;
+    uint32_t l2offset;
+    uint32_t l2len;
+    uint32_t l4, payload, end;
+    uint16_t ether_type;
+    bool udp;
+
+    /* every packet is stamped in a buffer of the pad ring */
+    file_cache->pad_max = max(file_cache->pad_max, max(cached_packet->pkthdr.caplen, cached_packet->pkthdr.len));
+
+    if (get_l2len_protocol(pktdata, caplen, file_cache->dlt, &ether_type, &l2len, &l2offset, &vlan_offset) < 0)
+        return;
+
+    if (vlan_offset != 0 && vlan_offset + 2 <= caplen && vlan_offset <= UINT16_MAX) {
+        cached_packet->gen_vlan = vlan_offset;
+    } else if (vlan_offset == 0 && file_cache->dlt == DLT_EN10MB && caplen >= TCPR_ETH_H) {
+        cached_packet->gen_tag = true;
+        file_cache->pad_max = max(file_cache->pad_max,
+                                  max(cached_packet->pkthdr.caplen, cached_packet->pkthdr.len) + GEN_VLAN_TAG_LEN);
+    }
+
+    if (ether_type != ETHERTYPE_IP || caplen < l2len + sizeof(ipv4_hdr_t) || l2len + sizeof(ipv4_hdr_t) > UINT16_MAX)
+        return;
+
+    ip_hdr = (const ipv4_hdr_t *)(pktdata + l2len);
+    cached_packet->gen_ip_sum = l2len + offsetof(ipv4_hdr_t, ip_sum);
+
+    if ((ntohs(ip_hdr->ip_off) & IP_OFFMASK) != 0)
+        return;
+
+    /* Ethernet padding isn't covered by the checksum; TSO captures may have no length */
+    l4 = l2len + (ip_hdr->ip_hl << 2);
+    end = ip_hdr->ip_len != 0 ? min(caplen, l2len + ntohs(ip_hdr->ip_len)) : caplen;
+
+    switch (ip_hdr->ip_p) {
+    case IPPROTO_TCP:
+        if (end < l4 + TCPR_TCP_H)
+            return;
+        payload = l4 + (((const tcp_hdr_t *)(pktdata + l4))->th_off << 2);
+        udp = false;
+        break;
+
+    case IPPROTO_UDP:
+        if (end < l4 + TCPR_UDP_H)
+            return;
+        payload = l4 + TCPR_UDP_H;
+        udp = true;
+        break;
+
+    default:
+        return;
+    }
+
+    if (end > UINT16_MAX)
+        return;
+
+    cached_packet->gen_l4 = l4;
+    cached_packet->gen_udp = udp;
+    if (payload <= end) {
+        cached_packet->gen_payload = payload;
+        cached_packet->gen_payload_len = end - payload;
+    }
+}
+
+/* splitmix64, so that a random value only depends on the packet and field */
+static inline u_int64_t
+gen_random(u_int64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/*
+ * The value of field i for packet number seq of loop number iteration.
+ * Without a range, inc and loop count up from the template's own value
+ * and rand covers the whole field.
+ */
+static inline uint32_t
+gen_value(const gen_field_t *field, int i, uint32_t value, COUNTER seq, COUNTER iteration)
+{
+    u_int64_t n;
+
+    switch (field->mode) {
+    case gen_inc:
+        n = seq;
+        break;
+    case gen_loop:
+        n = iteration;
+        break;
+    default:
+        n = gen_random(seq * GEN_FIELDS_MAX + i);
+        break;
+    }
+
+    if (field->range)
+        return field->low + (uint32_t)(n % ((u_int64_t)field->high - field->low + 1));
+
+    if (field->mode != gen_rand)
+        n += value;
+
+    return (uint32_t)n & gen_field_max(field);
+}
+
+static inline uint32_t
+gen_load(const u_char *p, int width)
+{
+    uint32_t v = 0;
+    int i;
+
+    for (i = 0; i < width; i++)
+        v = v << 8 | p[i];
+
+    return v;
+}
+
+static inline void
+gen_store(u_char *p, int width, uint32_t v)
+{
+    int i;
+
+    for (i = width - 1; i >= 0; i--) {
+        p[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+/*
+ * How much the one's complement sum of the data changed when width bytes
+ * went from from to to.  odd is set when they start at an odd offset into
+ * the checksummed data, i.e. in the low byte of a word.
+ */
+static uint32_t
+gen_csum_diff(const u_char *from, const u_char *to, int width, int odd)
+{
+    u_char f[6] = {0}, t[6] = {0};
+    uint16_t fw, tw;
+    uint32_t diff = 0;
+    int i;
+
+    memcpy(f + odd, from, width);
+    memcpy(t + odd, to, width);
+    for (i = 0; i < odd + width; i += 2) {
+        memcpy(&fw, f + i, sizeof(fw));
+        memcpy(&tw, t + i, sizeof(tw));
+        diff = tcpr_csum_add(diff, (uint16_t)~fw);
+        diff = tcpr_csum_add(diff, tw);
+    }
+
+    return diff;
+}
+
+/**
+ * \brief Give the copy at pktdata of a template its next field values
+ *
+ * Rules are applied in order and all count the same packet number, so
+ * two inc rules step together.  Fields the template doesn't have are
+ * left alone.  With --gen-vlan-add the copy of an untagged template has
+ * a tag inserted, which moves everything after the MAC addresses.
+ */
+void
+gen_stamp(tcpreplay_t *ctx, const packet_cache_t *cached_packet, u_char *pktdata)
+{
+    const tcpreplay_opt_t *options = ctx->options;
+    COUNTER seq = ctx->gen_seq++;
+    bool tagged = options->gen_vlan_add && cached_packet->gen_tag;
+    uint32_t shift = tagged ? GEN_VLAN_TAG_LEN : 0;
+    uint32_t ip_sum = cached_packet->gen_ip_sum + shift;
+    uint32_t l4 = cached_packet->gen_l4 + shift;
+    int i;
+
+    for (i = 0; i < options->gen_field_cnt; i++) {
+        const gen_field_t *field = &options->gen_fields[i];
+        uint32_t off, value, tci = 0, diff;
+        bool in_ip = false;
+        u_char old[4];
+        u_char *l4_sum;
+
+        switch (field->name) {
+        case gen_ip_src:
+        case gen_ip_dst:
+            if (cached_packet->gen_ip_sum == 0)
+                continue;
+            off = ip_sum + (field->name == gen_ip_src ? offsetof(ipv4_hdr_t, ip_src) : offsetof(ipv4_hdr_t, ip_dst)) -
+                  offsetof(ipv4_hdr_t, ip_sum);
+            in_ip = true;
+            break;
+
+        case gen_sport:
+        case gen_dport:
+            if (cached_packet->gen_l4 == 0)
+                continue;
+            off = l4 + (field->name == gen_sport ? 0 : 2);
+            break;
+
+        case gen_vlan:
+            if (tagged)
+                off = TCPR_ETH_H;
+            else if (cached_packet->gen_vlan != 0)
+                off = cached_packet->gen_vlan;
+            else
+                continue;
+            break;
+
+        case gen_payload:
+            if (cached_packet->gen_payload == 0 || field->offset + field->width > cached_packet->gen_payload_len)
+                continue;
+            off = cached_packet->gen_payload + shift + field->offset;
+            break;
+
+        default:
+            continue;
+        }
+
+        memcpy(old, pktdata + off, field->width);
+        value = gen_load(old, field->width);
+        if (field->name == gen_vlan) {
+            /* keep the priority and DEI bits */
+            tci = value & 0xf000;
+            value &= 0x0fff;
+        }
+        gen_store(pktdata + off, field->width, tci | gen_value(field, i, value, seq, ctx->iteration));
+
+        /* the VLAN tag isn't checksummed */
+        if (field->name == gen_vlan)
+            continue;
+
+        /* addresses are word aligned in the IP header and pseudo header alike */
+        diff = gen_csum_diff(old, pktdata + off, field->width, in_ip ? 0 : (int)((off - l4) & 1));
+        if (in_ip)
+            tcpr_csum_patch(pktdata + ip_sum, diff);
+
+        if (cached_packet->gen_l4 == 0)
+            continue;
+
+        l4_sum = pktdata + l4 + (cached_packet->gen_udp ? offsetof(udp_hdr_t, uh_sum) : offsetof(tcp_hdr_t, th_sum));
+        /* a UDP checksum of 0 means there is none */
+        if (cached_packet->gen_udp && l4_sum[0] == 0 && l4_sum[1] == 0)
+            continue;
+        tcpr_csum_patch(l4_sum, diff);
+        if (cached_packet->gen_udp && l4_sum[0] == 0 && l4_sum[1] == 0)
+            l4_sum[0] = l4_sum[1] = 0xff;
+    }
+}
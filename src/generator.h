@@ -0,0 +1,28 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+/* largest @OFFSET of a --gen-field payload rule */
+#define GEN_PAYLOAD_OFFSET_MAX UINT16_MAX
+
+int gen_field_parse(gen_field_t *field, const char *spec);
+void gen_template_offsets(file_cache_t *file_cache, packet_cache_t *cached_packet);
+void gen_stamp(tcpreplay_t *ctx, const packet_cache_t *cached_packet, u_char *pktdata);
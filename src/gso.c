@@ -0,0 +1,277 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * TCP segmentation offload of preloaded packets, --gso.
+ *
+ * Bulk TCP transfers are captured as runs of back to back segments of
+ * one flow, each a full MSS.  Once a file is preloaded, such runs are
+ * coalesced in the cache into a single super-frame with the headers of
+ * the first segment and the payload of them all.  It is sent behind a
+ * virtio_net_hdr asking for TSO, and the NIC (or the kernel's GSO if
+ * the NIC can't) cuts it back into the original segments: same
+ * sequence numbers, IP IDs counting up, PSH/FIN on the last one only.
+ * A single system call then puts up to 64 KB on the wire.
+ *
+ * Segments are only merged when the result is exactly what was
+ * captured, so headers have to match but for the fields the
+ * segmentation fills in.
+ */
+
+#include "gso.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "send_packets.h"
+#include <stddef.h>
+#include <string.h>
+
+/* where a TCP segment's headers are and what segmentation fills in */
+typedef struct gso_seg_s {
+    uint32_t l3;      /* offset of the IP header */
+    uint32_t l4;      /* offset of the TCP header */
+    uint32_t payload; /* offset of the TCP payload */
+    uint32_t len;     /* bytes of payload */
+    bool v6;
+    uint32_t seq;   /* host byte order */
+    uint16_t ip_id; /* host byte order, IPv4 only */
+    uint8_t flags;
+} gso_seg_t;
+
+/* flags the segmentation only leaves on the last segment */
+#define GSO_LAST_FLAGS (TH_PUSH | TH_FIN)
+
+/*
+ * find the headers of a cached TCP segment with a payload, false if it
+ * can't be part of a super-frame
+ */
+static bool
+gso_parse(const file_cache_t *file_cache, const packet_cache_t *cached_packet, gso_seg_t *seg)
+{
+    const u_char *pktdata = cached_packet->pktdata;
+    uint32_t caplen = cached_packet->pkthdr.caplen;
+    const tcp_hdr_t *tcp_hdr;
+    uint32_t vlan_offset;
+    uint32_t l2offset;
+    uint32_t l2len;
+    uint16_t ether_type;
+
+    /* the whole packet has to be there, with no Ethernet padding past the IP packet */
+    if (caplen != cached_packet->pkthdr.len || cached_packet->pad_caplen != 0)
+        return false;
+
+    if (get_l2len_protocol(pktdata, caplen, file_cache->dlt, &ether_type, &l2len, &l2offset, &vlan_offset) < 0)
+        return false;
+
+    memset(seg, 0, sizeof(*seg));
+    seg->l3 = l2len;
+    if (ether_type == ETHERTYPE_IP) {
+        const ipv4_hdr_t *ip_hdr = (const ipv4_hdr_t *)(pktdata + l2len);
+
+        if (caplen < l2len + TCPR_IPV4_H || ip_hdr->ip_hl < 5 || ip_hdr->ip_p != IPPROTO_TCP ||
+            (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)) != 0 || l2len + ntohs(ip_hdr->ip_len) != caplen)
+            return false;
+
+        seg->l4 = l2len + (ip_hdr->ip_hl << 2);
+        seg->ip_id = ntohs(ip_hdr->ip_id);
+    } else if (ether_type == ETHERTYPE_IP6) {
+        const ipv6_hdr_t *ip6_hdr = (const ipv6_hdr_t *)(pktdata + l2len);
+
+        /* extension headers would be repeated with the rest */
+        if (caplen < l2len + TCPR_IPV6_H || ip6_hdr->ip_nh != IPPROTO_TCP ||
+            l2len + TCPR_IPV6_H + ntohs(ip6_hdr->ip_len) != caplen)
+            return false;
+
+        seg->l4 = l2len + TCPR_IPV6_H;
+        seg->v6 = true;
+    } else {
+        return false;
+    }
+
+    if (caplen < seg->l4 + TCPR_TCP_H)
+        return false;
+
+    tcp_hdr = (const tcp_hdr_t *)(pktdata + seg->l4);
+    seg->payload = seg->l4 + (tcp_hdr->th_off << 2);
+    if (tcp_hdr->th_off < 5 || seg->payload >= caplen)
+        return false;
+
+    seg->len = caplen - seg->payload;
+    seg->seq = ntohl(tcp_hdr->th_seq);
+    seg->flags = tcp_hdr->th_flags;
+
+    /* these don't survive segmentation as they were */
+    return (seg->flags & (TH_SYN | TH_RST | TH_URG)) == 0;
+}
+
+/* bytes from..to of both packets are the same */
+static inline bool
+gso_same(const u_char *a, const u_char *b, uint32_t from, uint32_t to)
+{
+    return memcmp(a + from, b + from, to - from) == 0;
+}
+
+/*
+ * next has the headers of first, but for the lengths, IP ID, sequence
+ * number, checksums and the flags of a last segment
+ */
+static bool
+gso_same_headers(const u_char *first, const gso_seg_t *f, const u_char *next, const gso_seg_t *n)
+{
+    uint32_t l3 = f->l3, l4 = f->l4;
+
+    if (n->v6 != f->v6 || n->l3 != l3 || n->l4 != l4 || n->payload != f->payload)
+        return false;
+
+    if (f->v6) {
+        if (!gso_same(first, next, 0, l3 + offsetof(ipv6_hdr_t, ip_len)) ||
+            !gso_same(first, next, l3 + offsetof(ipv6_hdr_t, ip_nh), l4 + offsetof(tcp_hdr_t, th_seq)))
+            return false;
+    } else {
+        if (!gso_same(first, next, 0, l3 + offsetof(ipv4_hdr_t, ip_len)) ||
+            !gso_same(first, next, l3 + offsetof(ipv4_hdr_t, ip_off), l3 + offsetof(ipv4_hdr_t, ip_sum)) ||
+            !gso_same(first, next, l3 + offsetof(ipv4_hdr_t, ip_src), l4 + offsetof(tcp_hdr_t, th_seq)))
+            return false;
+    }
+
+    /* ack, data offset, window, urgent pointer and options */
+    return gso_same(first, next, l4 + offsetof(tcp_hdr_t, th_ack), l4 + offsetof(tcp_hdr_t, th_flags)) &&
+           gso_same(first, next, l4 + offsetof(tcp_hdr_t, th_win), l4 + offsetof(tcp_hdr_t, th_sum)) &&
+           gso_same(first, next, l4 + offsetof(tcp_hdr_t, th_urp), f->payload) &&
+           (n->flags & ~GSO_LAST_FLAGS) == (f->flags & ~TH_CWR);
+}
+
+/*
+ * turn the first segment, now holding the payload of cnt segments of
+ * seg->len bytes but the last, into a super-frame of last_flags
+ */
+static void
+gso_finish(packet_cache_t *cached_packet, const gso_seg_t *seg, uint32_t caplen, uint8_t last_flags)
+{
+    u_char *pktdata = cached_packet->pktdata;
+    tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)(pktdata + seg->l4);
+    uint32_t l4_len = caplen - seg->l4;
+    uint32_t sum;
+    uint16_t csum;
+
+    cached_packet->pkthdr.caplen = caplen;
+    cached_packet->pkthdr.len = caplen;
+
+    if (seg->v6) {
+        ipv6_hdr_t *ip6_hdr = (ipv6_hdr_t *)(pktdata + seg->l3);
+
+        ip6_hdr->ip_len = htons(l4_len);
+        sum = tcpr_csum_partial(&ip6_hdr->ip_src, 2 * sizeof(ip6_hdr->ip_src), 0);
+    } else {
+        ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pktdata + seg->l3);
+
+        ip_hdr->ip_len = htons(caplen - seg->l3);
+        ip_hdr->ip_sum = 0;
+        sum = tcpr_csum_partial(ip_hdr, ip_hdr->ip_hl << 2, 0);
+        ip_hdr->ip_sum = (uint16_t)~sum;
+        sum = tcpr_csum_partial(&ip_hdr->ip_src, 2 * sizeof(ip_hdr->ip_src), 0);
+    }
+
+    tcp_hdr->th_flags |= last_flags & GSO_LAST_FLAGS;
+
+    /* the segmentation sums each segment from its share of the pseudo header sum */
+    sum = tcpr_csum_add(sum, htons(IPPROTO_TCP));
+    sum = tcpr_csum_add(sum, htons(l4_len));
+    sum = (sum & 0xffff) + (sum >> 16);
+    csum = (uint16_t)((sum & 0xffff) + (sum >> 16));
+    memcpy(&tcp_hdr->th_sum, &csum, sizeof(csum));
+
+    cached_packet->csum_start = seg->l4;
+    cached_packet->csum_offset = offsetof(tcp_hdr_t, th_sum);
+    cached_packet->gso_size = seg->len;
+    cached_packet->gso_hdr_len = seg->payload;
+    cached_packet->gso_v6 = seg->v6;
+}
+
+/**
+ * \brief Coalesce runs of TCP segments of a preloaded file into super-frames
+ *
+ * A run is a segment followed by others of the same flow which continue
+ * its sequence numbers, all a full MSS but the last.  Their payloads
+ * are moved down over the headers of all but the first segment, which
+ * packet_cache_append() stored right after each other, and the run
+ * becomes a single cache entry.  The packets are then counted again as
+ * they're sent.
+ */
+void
+gso_coalesce(file_cache_t *file_cache)
+{
+    packet_cache_t *cache = file_cache->packet_cache;
+    COUNTER i = 0, out = 0;
+
+    /* packets in a mapped file can't be moved */
+    if (file_cache->mmap != NULL)
+        return;
+
+    while (i < file_cache->packet_cnt) {
+        packet_cache_t *first = &cache[i];
+        gso_seg_t f, prev, n;
+        uint32_t caplen, stored;
+        u_char *prev_data;
+        COUNTER cnt = 1;
+
+        if (gso_parse(file_cache, first, &f) && (f.flags & GSO_LAST_FLAGS) == 0) {
+            caplen = first->pkthdr.caplen;
+            prev = f;
+            prev_data = first->pktdata;
+            stored = caplen;
+
+            while (i + cnt < file_cache->packet_cnt) {
+                packet_cache_t *next = &cache[i + cnt];
+                size_t needed = (stored + PACKET_HEADROOM + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+                /* stored right behind the previous segment, in the same arena */
+                if (next->pktdata != prev_data + needed || !gso_parse(file_cache, next, &n) ||
+                    n.len > f.len || prev.len != f.len || caplen + n.len > GSO_FRAME_MAX ||
+                    n.seq != prev.seq + prev.len || (!f.v6 && n.ip_id != (uint16_t)(prev.ip_id + 1)) ||
+                    !gso_same_headers(first->pktdata, &f, next->pktdata, &n))
+                    break;
+
+                prev_data = next->pktdata;
+                stored = next->pkthdr.caplen;
+                memmove(first->pktdata + caplen, next->pktdata + n.payload, n.len);
+                caplen += n.len;
+                prev = n;
+                cnt++;
+
+                if ((n.flags & GSO_LAST_FLAGS) != 0)
+                    break;
+            }
+
+            if (cnt > 1) {
+                gso_finish(first, &f, caplen, prev.flags);
+                file_cache->gso_packets += cnt;
+                file_cache->gso_frames++;
+            }
+        }
+
+        if (out != i)
+            cache[out] = cache[i];
+        out++;
+        i += cnt;
+    }
+
+    dbgx(1, "GSO coalesced " COUNTER_SPEC " packets into " COUNTER_SPEC " frames", file_cache->gso_packets,
+         file_cache->gso_frames);
+    file_cache->packet_cnt = out;
+}
@@ -0,0 +1,275 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * --inject: pick the injection method by name, or time each of them on
+ * intf1 and go with the fastest.  Every method gets the same frames: a
+ * sacrificial burst first, so sockets, rings and the CPU caches start
+ * warm, then a timed one.  The frames go to a reserved group address
+ * bridges don't forward and carry the local experimental EtherType, so
+ * they die at the first switch or device under test.
+ */
+
+#include "inject.h"
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include "common/timer.h"
+
+/* 802.1Q reserved, never forwarded by a bridge */
+static const u_char inject_dst[ETHER_ADDR_LEN] = {0x01, 0x80, 0xc2, 0x00, 0x00, 0x0f};
+/* locally administered, when the interface has no MAC address to use */
+static const u_char inject_src[ETHER_ADDR_LEN] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+#define INJECT_ETHERTYPE 0x88b5 /* IEEE 802 local experimental */
+
+/**
+ * \brief user and system time of this thread so far, in ns
+ */
+static u_int64_t
+inject_cpu_ns(void)
+{
+    struct rusage ru;
+    int who = RUSAGE_SELF;
+
+#ifdef RUSAGE_THREAD
+    who = RUSAGE_THREAD;
+#endif
+    if (getrusage(who, &ru) < 0)
+        return 0;
+
+    return TIMEVAL_TO_NANOSEC(&ru.ru_utime) + TIMEVAL_TO_NANOSEC(&ru.ru_stime);
+}
+
+/**
+ * \brief send cnt frames, in batches if batch is set, returns those sent
+ */
+static COUNTER
+inject_send(sendpacket_t *sp, const sendpacket_pkt_t *pkts, bool batch, COUNTER cnt)
+{
+    COUNTER sent = 0;
+    int i, n;
+
+    while (cnt > 0 && !sp->abort) {
+        n = cnt < SENDPACKET_BATCH_MAX ? (int)cnt : SENDPACKET_BATCH_MAX;
+        if (batch) {
+            sent += sendpacket_batch(sp, pkts, n);
+        } else {
+            for (i = 0; i < n; i++) {
+                if (sendpacket(sp, pkts[i].data, pkts[i].len, pkts[i].pkthdr) > 0)
+                    sent++;
+            }
+        }
+        cnt -= n;
+    }
+
+    return sent;
+}
+
+/**
+ * \brief open the method of r on intf1, time it and close it again
+ *
+ * Leaves why in r->err if it couldn't be opened or send anything.
+ */
+static void
+inject_time(tcpreplay_t *ctx, tcpr_inject_result_t *r, bool batch)
+{
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    u_char frame[INJECT_FRAME_LEN];
+    sendpacket_pkt_t pkts[SENDPACKET_BATCH_MAX];
+    struct pcap_pkthdr pkthdr;
+    struct tcpr_ether_addr *src;
+    sendpacket_t *sp;
+    u_int64_t start, end, cpu;
+    COUNTER tried = 0;
+    int i;
+
+    if ((sp = sendpacket_try_open(ctx->options->intf1_name, ebuf, TCPR_DIR_C2S, r->method->type, ctx)) == NULL) {
+        strlcpy(r->err, ebuf[0] != '\0' ? ebuf : "can't be opened", sizeof(r->err));
+        return;
+    }
+
+    memset(frame, 0, sizeof(frame));
+    memcpy(frame, inject_dst, ETHER_ADDR_LEN);
+    src = sendpacket_get_hwaddr(sp);
+    memcpy(frame + ETHER_ADDR_LEN, src != NULL ? (const u_char *)src : inject_src, ETHER_ADDR_LEN);
+    frame[2 * ETHER_ADDR_LEN] = INJECT_ETHERTYPE >> 8;
+    frame[2 * ETHER_ADDR_LEN + 1] = INJECT_ETHERTYPE & 0xff;
+
+    memset(&pkthdr, 0, sizeof(pkthdr));
+    pkthdr.caplen = pkthdr.len = INJECT_FRAME_LEN;
+    memset(pkts, 0, sizeof(pkts));
+    for (i = 0; i < SENDPACKET_BATCH_MAX; i++) {
+        pkts[i].data = frame;
+        pkts[i].len = INJECT_FRAME_LEN;
+        pkts[i].pkthdr = &pkthdr;
+    }
+
+    if (inject_send(sp, pkts, batch, INJECT_WARMUP) == 0) {
+        strlcpy(r->err, sendpacket_geterr(sp)[0] != '\0' ? sendpacket_geterr(sp) : "sent nothing", sizeof(r->err));
+        sendpacket_close(sp);
+        return;
+    }
+
+    cpu = inject_cpu_ns();
+    start = end = tcpr_clock_ns();
+    while (tried < INJECT_BURST && end - start < INJECT_TIME_NS && !ctx->abort) {
+        r->sent += inject_send(sp, pkts, batch, SENDPACKET_BATCH_MAX);
+        tried += SENDPACKET_BATCH_MAX;
+        end = tcpr_clock_ns();
+    }
+    cpu = inject_cpu_ns() - cpu;
+
+    if (r->sent == 0) {
+        strlcpy(r->err, sendpacket_geterr(sp)[0] != '\0' ? sendpacket_geterr(sp) : "sent nothing", sizeof(r->err));
+    } else {
+        r->pps = (double)r->sent * 1000000000.0 / (double)(end > start ? end - start : 1);
+        r->cpu_ns = (double)cpu / (double)r->sent;
+    }
+
+    sendpacket_close(sp);
+}
+
+/**
+ * \brief what the rest of tcpreplay has to know about the method in use
+ */
+static void
+inject_use(tcpreplay_t *ctx, sendpacket_type_t type)
+{
+    ctx->sp_type = type;
+#ifdef HAVE_AF_XDP
+    if (type == SP_TYPE_AF_XDP)
+        ctx->options->xdp = 1;
+#endif
+#ifdef HAVE_IO_URING
+    if (type == SP_TYPE_IO_URING)
+        ctx->options->io_uring = true;
+#endif
+}
+
+static int
+inject_auto(tcpreplay_t *ctx)
+{
+    tcpr_inject_t *inj;
+    bool batch = ctx->options->speed.mode == speed_topspeed;
+    int i, cnt = 0;
+
+    while (sendpacket_methods[cnt].name != NULL)
+        cnt++;
+    if (cnt == 0) {
+        tcpreplay_seterr(ctx, "%s", "--inject=auto: no injection method can be chosen at run time on this system");
+        return -1;
+    }
+
+    inj = safe_malloc(sizeof(tcpr_inject_t));
+    inj->result = safe_malloc(cnt * sizeof(tcpr_inject_result_t));
+    inj->pick = -1;
+    inj->by_cpu = !batch;
+    ctx->inject = inj;
+
+    for (i = 0; i < cnt && !ctx->abort; i++) {
+        tcpr_inject_result_t *r = &inj->result[i];
+
+        r->method = &sendpacket_methods[i];
+        inject_time(ctx, r, batch);
+        inj->cnt++;
+        if (r->err[0] != '\0')
+            continue;
+
+        if (inj->pick < 0 ||
+            (inj->by_cpu ? r->cpu_ns < inj->result[inj->pick].cpu_ns : r->pps > inj->result[inj->pick].pps))
+            inj->pick = i;
+    }
+
+    if (inj->pick < 0) {
+        tcpreplay_seterr(ctx, "--inject=auto: no injection method could send on %s", ctx->options->intf1_name);
+        return -1;
+    }
+
+    inject_use(ctx, inj->result[inj->pick].method->type);
+    return 0;
+}
+
+/**
+ * \brief set ctx->sp_type for --inject, timing the methods for auto
+ */
+int
+inject_select(tcpreplay_t *ctx, const char *method)
+{
+    const sendpacket_method_t *m;
+
+    assert(ctx);
+    assert(method);
+
+    if (strcmp(method, "auto") == 0)
+        return inject_auto(ctx);
+
+    for (m = sendpacket_methods; m->name != NULL; m++) {
+        if (strcmp(method, m->name) == 0) {
+            inject_use(ctx, m->type);
+            return 0;
+        }
+    }
+
+    tcpreplay_seterr(ctx, "--inject: unknown method, or not compiled in: %s", method);
+    return -1;
+}
+
+void
+inject_free(tcpr_inject_t *inj)
+{
+    if (inj == NULL)
+        return;
+
+    safe_free(inj->result);
+    safe_free(inj);
+}
+
+/**
+ * \brief print each method timed, marking the one picked
+ */
+size_t
+inject_summary(const tcpr_inject_t *inj, char *buf, size_t len)
+{
+    size_t off = 0;
+    int i, n;
+
+    for (i = 0; i < inj->cnt && off < len; i++) {
+        const tcpr_inject_result_t *r = &inj->result[i];
+
+        if (r->err[0] != '\0')
+            n = snprintf(buf + off, len - off, "\t  %-20s %s\n", r->method->descr, r->err);
+        else
+            n = snprintf(buf + off,
+                         len - off,
+                         "\t%c %-20s %.0f pps, %.0f ns CPU/packet\n",
+                         i == inj->pick ? '*' : ' ',
+                         r->method->descr,
+                         r->pps,
+                         r->cpu_ns);
+        if (n < 0)
+            break;
+        off += (size_t)n;
+    }
+
+    return off < len ? off : len - 1;
+}
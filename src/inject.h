@@ -0,0 +1,56 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+#pragma once
+
+#include "tcpreplay_api.h"
+
+/* packets of the sacrificial burst each method gets to warm up on, untimed */
+#define INJECT_WARMUP 256
+/* a method is timed for this many packets, or this long, whichever is first */
+#define INJECT_BURST 20000
+#define INJECT_TIME_NS 20000000ULL
+/* shortest Ethernet frame, without the FCS, so per packet costs dominate */
+#define INJECT_FRAME_LEN 60
+#define INJECT_ERR_LEN 256
+
+typedef struct tcpr_inject_result_s {
+    const sendpacket_method_t *method;
+    COUNTER sent;
+    double pps;
+    double cpu_ns;             /* user and system time a packet */
+    char err[INJECT_ERR_LEN];  /* why it couldn't be timed, empty if it was */
+} tcpr_inject_result_t;
+
+/*
+ * --inject=auto: every method of sendpacket_methods which compiled in is
+ * opened on intf1 in turn and timed on a burst of frames nothing forwards,
+ * and the replay uses the winner.  At top speed that is the one sending
+ * the most packets a second, else the one costing the least CPU a packet.
+ */
+struct tcpr_inject_s {
+    tcpr_inject_result_t *result;
+    int cnt;
+    int pick;    /* index into result, -1 if none could be timed */
+    bool by_cpu; /* picked for CPU a packet rather than packets a second */
+};
+
+int inject_select(tcpreplay_t *ctx, const char *method);
+void inject_free(tcpr_inject_t *inj);
+size_t inject_summary(const tcpr_inject_t *inj, char *buf, size_t len);
@@ -0,0 +1,247 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * One transmit thread per interface for tcpprep cache files, --nic-threads,
+ * and for --spray.
+ *
+ * send_packets() still reads, classifies and paces every packet, but
+ * rather than sending it hands the packet to the queue of the interface
+ * the cache, or the flow hash of --spray, picked, a tcpr_ring_t.  Each
+ * interface's thread empties its queue in batches, so a slow or
+ * backpressured interface only holds up its own packets.  The queues hold pointers into the packet cache, so
+ * packets are never copied, and are drained before the cache is touched.
+ *
+ * To keep the interfaces in step, a packet isn't queued while another
+ * interface still has one waiting which was queued more than --nic-skew
+ * ago.  The order of packets across interfaces is then kept to within
+ * that tolerance, and within an interface it is always kept.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_RINGS /* see memstat.h */
+
+#include "nic_threads.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "tcpreplay_api.h"
+#include <sched.h>
+#include <string.h>
+
+#ifdef ENABLE_SEND_THREADS
+
+/**
+ * \brief transmit thread of an interface: send whatever is queued
+ */
+static void *
+nic_thread(void *arg)
+{
+    nic_queue_t *q = arg;
+    nic_slot_t slot[SENDPACKET_BATCH_MAX];
+    sendpacket_pkt_t batch[SENDPACKET_BATCH_MAX];
+    int cnt;
+
+    /* stops once the last packet queued before tcpr_ring_close() is out */
+    while ((cnt = (int)tcpr_ring_dequeue_wait(q->ring, slot, SENDPACKET_BATCH_MAX)) > 0) {
+        int sent, i;
+
+        for (i = 0; i < cnt; i++) {
+            nic_slot_t *s = &slot[i];
+
+            batch[i].data = s->data;
+            batch[i].len = s->len;
+            batch[i].pkthdr = &s->pkthdr;
+            batch[i].csum_start = s->csum_start;
+            batch[i].csum_offset = s->csum_offset;
+            batch[i].gso_size = s->gso_size;
+            batch[i].gso_hdr_len = s->gso_hdr_len;
+            batch[i].gso_v6 = s->gso_v6;
+        }
+
+        sent = sendpacket_batch(q->sp, batch, cnt);
+        if (sent < cnt) {
+            warnx("Unable to send %d of %d packets: %s", cnt - sent, cnt, sendpacket_geterr(q->sp));
+            for (i = sent; i < cnt; i++) {
+                COUNTER segs = sendpacket_gso_segs(batch[i].len, batch[i].gso_size, batch[i].gso_hdr_len);
+
+                q->failed_pkts += segs;
+                q->failed_bytes += batch[i].len + (segs - 1) * batch[i].gso_hdr_len;
+            }
+        }
+
+        /* the packets' cache memory may be reused */
+        __atomic_store_n(&q->sent, q->sent + cnt, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief start a transmit thread for every interface of the cache
+ */
+int
+nic_threads_start(tcpreplay_t *ctx)
+{
+    nic_threads_t *nt;
+    int i;
+
+    assert(ctx);
+
+    if (ctx->nic_threads != NULL)
+        return 0;
+
+    nt = safe_malloc(sizeof(nic_threads_t));
+    nt->skew_ns = ctx->options->nic_skew_us * 1000;
+    nt->queue[nt->cnt++].sp = ctx->intf1;
+    if (ctx->intf2 != NULL)
+        nt->queue[nt->cnt++].sp = ctx->intf2;
+    for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+        nt->queue[nt->cnt++].sp = ctx->pair_intf[i];
+
+    for (i = 0; i < nt->cnt; i++) {
+        nic_queue_t *q = &nt->queue[i];
+
+        q->ctx = ctx;
+        q->ring = tcpr_ring_new(NIC_QUEUE_SIZE, sizeof(nic_slot_t), 0, TCPR_RING_YIELD);
+        if (pthread_create(&q->thread, NULL, nic_thread, q) != 0) {
+            tcpreplay_seterr(ctx, "Unable to start the --nic-threads thread of %s", q->sp->device);
+            tcpr_ring_free(q->ring);
+            nt->cnt = i;
+            ctx->nic_threads = nt;
+            nic_threads_stop(ctx);
+            return -1;
+        }
+    }
+
+    ctx->nic_threads = nt;
+    return 0;
+}
+
+/**
+ * \brief queue a packet on the thread of sp
+ *
+ * Waits for room in the queue, and while another interface has fallen
+ * more than --nic-skew behind.  False if the replay was aborted meanwhile
+ * and the packet wasn't queued.
+ */
+bool
+nic_threads_push(tcpreplay_t *ctx, sendpacket_t *sp, const sendpacket_pkt_t *pkt)
+{
+    nic_threads_t *nt = ctx->nic_threads;
+    nic_queue_t *q;
+    nic_slot_t s;
+    u_int64_t now_ns = 0;
+    int i;
+
+    for (i = 0; i < nt->cnt - 1 && nt->queue[i].sp != sp; i++)
+        ;
+    q = &nt->queue[i];
+    assert(q->sp == sp);
+
+    s.data = pkt->data;
+    s.len = (u_int32_t)pkt->len;
+    memcpy(&s.pkthdr, pkt->pkthdr, sizeof(s.pkthdr));
+    s.csum_start = pkt->csum_start;
+    s.csum_offset = pkt->csum_offset;
+    s.gso_size = pkt->gso_size;
+    s.gso_hdr_len = pkt->gso_hdr_len;
+    s.gso_v6 = pkt->gso_v6;
+
+    for (;;) {
+        bool wait = false;
+
+        if (nt->skew_ns != 0)
+            now_ns = tcpr_clock_ns();
+
+        /* we are the only producer, so the oldest slot of another queue can't be refilled under us */
+        for (i = 0; nt->skew_ns != 0 && !wait && i < nt->cnt; i++) {
+            const nic_slot_t *oldest;
+
+            if (&nt->queue[i] == q)
+                continue;
+            oldest = tcpr_ring_oldest(nt->queue[i].ring);
+            wait = oldest != NULL && oldest->queued_ns + nt->skew_ns < now_ns;
+        }
+
+        s.queued_ns = now_ns;
+        if (!wait && tcpr_ring_enqueue(q->ring, &s, 1) == 1)
+            break;
+        if (ctx->abort)
+            return false;
+
+        sched_yield();
+    }
+    q->queued++;
+
+    return true;
+}
+
+/**
+ * \brief wait until every queued packet has been sent
+ *
+ * Packets which couldn't be sent are taken back out of ctx->stats, which
+ * counted them when they were queued.
+ */
+void
+nic_threads_drain(tcpreplay_t *ctx)
+{
+    nic_threads_t *nt = ctx->nic_threads;
+    int i;
+
+    if (nt == NULL)
+        return;
+
+    for (i = 0; i < nt->cnt; i++) {
+        nic_queue_t *q = &nt->queue[i];
+
+        while (__atomic_load_n(&q->sent, __ATOMIC_ACQUIRE) != q->queued)
+            sched_yield();
+
+        ctx->stats.pkts_sent -= q->failed_pkts;
+        ctx->stats.bytes_sent -= q->failed_bytes;
+        ctx->stats.failed += q->failed_pkts;
+        q->failed_pkts = 0;
+        q->failed_bytes = 0;
+    }
+}
+
+/**
+ * \brief send what's left and stop the transmit threads
+ */
+void
+nic_threads_stop(tcpreplay_t *ctx)
+{
+    nic_threads_t *nt = ctx->nic_threads;
+    int i;
+
+    if (nt == NULL)
+        return;
+
+    for (i = 0; i < nt->cnt; i++)
+        tcpr_ring_close(nt->queue[i].ring);
+    for (i = 0; i < nt->cnt; i++)
+        pthread_join(nt->queue[i].thread, NULL);
+    nic_threads_drain(ctx);
+
+    for (i = 0; i < nt->cnt; i++)
+        tcpr_ring_free(nt->queue[i].ring);
+    safe_free(nt);
+    ctx->nic_threads = NULL;
+}
+
+#endif /* ENABLE_SEND_THREADS */
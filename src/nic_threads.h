@@ -0,0 +1,68 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+#include "send_threads.h"
+#include "common/ring.h"
+
+#ifdef ENABLE_SEND_THREADS
+#include <pthread.h>
+
+/* packets queued for each interface, a power of two */
+#define NIC_QUEUE_SIZE 4096
+/* default most usec one interface may fall behind the others, --nic-skew */
+#define NIC_SKEW_DEFAULT 1000
+
+/* a packet handed to the transmit thread of its interface */
+typedef struct nic_slot_s {
+    const u_char *data;
+    struct pcap_pkthdr pkthdr;
+    u_int32_t len;
+    uint16_t csum_start; /* see sendpacket_pkt_t */
+    uint16_t csum_offset;
+    uint16_t gso_size;
+    uint16_t gso_hdr_len;
+    bool gso_v6;
+    u_int64_t queued_ns; /* when the schedule was done with it, for --nic-skew */
+} nic_slot_t;
+
+/* single producer (send_packets()), single consumer (the interface's thread) */
+typedef struct nic_queue_s {
+    tcpreplay_t *ctx;
+    sendpacket_t *sp;
+    pthread_t thread;
+    tcpr_ring_t *ring; /* of nic_slot_t */
+    u_int64_t queued;                            /* by send_packets() */
+    u_int64_t sent __attribute__((aligned(64))); /* or failed, by the thread */
+    COUNTER failed_pkts; /* taken back out of the stats by nic_threads_drain() */
+    COUNTER failed_bytes;
+} nic_queue_t;
+
+struct nic_threads_s {
+    int cnt;
+    nic_queue_t queue[2 * CACHE_MAX_PAIRS]; /* intf1, intf2, then the --intf-pair interfaces */
+    u_int64_t skew_ns;
+};
+
+int nic_threads_start(tcpreplay_t *ctx);
+bool nic_threads_push(tcpreplay_t *ctx, sendpacket_t *sp, const sendpacket_pkt_t *pkt);
+void nic_threads_drain(tcpreplay_t *ctx);
+void nic_threads_stop(tcpreplay_t *ctx);
+#endif /* ENABLE_SEND_THREADS */
@@ -0,0 +1,426 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The readers behind pkt_source_t, see pkt_source.h.  A file is opened
+ * with libpcap, or mapped if asked for, and may then be switched to the
+ * --readahead ring.  A shm:NAME source is a shm_pipe instead.  Whoever opens the source stores it in the
+ * file_cache_t, where send_packets() and preloading read it from.
+ */
+
+#include "pkt_source.h"
+#include "config.h"
+#include "common.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* libpcap: the packet is only good until the next read */
+static int
+pcap_source_next(pkt_source_t *src, struct pcap_pkthdr *pkthdr, u_char **data, _U_ int max)
+{
+    return (data[0] = safe_pcap_next(src->pcap, pkthdr)) != NULL ? 1 : 0;
+}
+
+/* libpcap reads records straight from its FILE, unless it is a pipe from a decompressor */
+static bool
+pcap_source_seek(pkt_source_t *src, u_int64_t offset)
+{
+    return fseeko(pcap_file(src->pcap), (off_t)offset, SEEK_SET) == 0;
+}
+
+static bool
+pcap_source_reset(_U_ pkt_source_t *src)
+{
+    return false;
+}
+
+static void
+pcap_source_close(pkt_source_t *src)
+{
+    pcap_close(src->pcap);
+    src->pcap = NULL;
+}
+
+static const pkt_source_ops_t pcap_source_ops = {
+        "libpcap",
+        pcap_source_next,
+        pcap_source_seek,
+        pcap_source_reset,
+        pcap_source_close,
+};
+
+#ifdef HAVE_MMAP
+/*
+ * a mapped file: the packets are in the mapping, which the file_cache_t
+ * owns, as the preload cache may point into it after the source is gone
+ */
+static int
+mmap_source_next(pkt_source_t *src, struct pcap_pkthdr *pkthdr, u_char **data, int max)
+{
+    mmap_pcap_t *mp = src->file_cache->mmap;
+    int cnt;
+
+    for (cnt = 0; cnt < max; cnt++) {
+        if ((data[cnt] = mmap_pcap_next(mp, &pkthdr[cnt])) == NULL)
+            break;
+    }
+
+    return cnt;
+}
+
+/* only classic pcap files can be mapped part way in, pcapng needs its section and interface blocks */
+static bool
+mmap_source_seek(pkt_source_t *src, u_int64_t offset)
+{
+    mmap_pcap_t *mp = src->file_cache->mmap;
+
+    if (mp->pcapng || offset >= mp->size)
+        return false;
+
+    mp->offset = (size_t)offset;
+    return true;
+}
+
+static bool
+mmap_source_reset(pkt_source_t *src)
+{
+    mmap_pcap_t *mp = src->file_cache->mmap;
+
+    if (mp->pcapng)
+        return false;
+
+    mp->offset = src->first;
+    return true;
+}
+
+static void
+mmap_source_close(_U_ pkt_source_t *src)
+{
+}
+
+static const pkt_source_ops_t mmap_source_ops = {
+        "mmap",
+        mmap_source_next,
+        mmap_source_seek,
+        mmap_source_reset,
+        mmap_source_close,
+};
+#endif /* HAVE_MMAP */
+
+#ifdef HAVE_PTHREAD
+/* --readahead: like libpcap, the packet is only good until the next read */
+static int
+readahead_source_next(pkt_source_t *src, struct pcap_pkthdr *pkthdr, u_char **data, _U_ int max)
+{
+    return (data[0] = pcap_readahead_next(src->readahead, pkthdr)) != NULL ? 1 : 0;
+}
+
+/* the reader thread is already past wherever we'd seek to */
+static bool
+readahead_source_seek(_U_ pkt_source_t *src, _U_ u_int64_t offset)
+{
+    return false;
+}
+
+static void
+readahead_source_close(pkt_source_t *src)
+{
+    /* the reader stops before libpcap is closed under it */
+    pcap_readahead_close(src->readahead);
+    src->readahead = NULL;
+    pcap_source_close(src);
+}
+
+static const pkt_source_ops_t readahead_source_ops = {
+        "readahead",
+        readahead_source_next,
+        readahead_source_seek,
+        pcap_source_reset,
+        readahead_source_close,
+};
+#endif /* HAVE_PTHREAD */
+
+#ifdef HAVE_SHM_PIPE
+/* a shm_pipe: a batch is good until the next read, and there is no going back */
+static int
+shm_source_next(pkt_source_t *src, struct pcap_pkthdr *pkthdr, u_char **data, int max)
+{
+    return shm_pipe_next(src->shm, pkthdr, data, max);
+}
+
+static bool
+shm_source_seek(_U_ pkt_source_t *src, _U_ u_int64_t offset)
+{
+    return false;
+}
+
+static bool
+shm_source_reset(_U_ pkt_source_t *src)
+{
+    return false;
+}
+
+static void
+shm_source_close(pkt_source_t *src)
+{
+    shm_pipe_close(src->shm);
+    src->shm = NULL;
+}
+
+static const pkt_source_ops_t shm_source_ops = {
+        "shm",
+        shm_source_next,
+        shm_source_seek,
+        shm_source_reset,
+        shm_source_close,
+};
+#endif /* HAVE_SHM_PIPE */
+
+/* the caller's memory, lent for as long as the source is open */
+static int
+mem_source_next(pkt_source_t *src, struct pcap_pkthdr *pkthdr, u_char **data, int max)
+{
+    int cnt;
+
+    for (cnt = 0; cnt < max && src->mem_next < src->mem_cnt; cnt++, src->mem_next++) {
+        memcpy(&pkthdr[cnt], &src->mem_pkthdr[src->mem_next], sizeof(*pkthdr));
+        data[cnt] = src->mem_data[src->mem_next];
+    }
+
+    return cnt;
+}
+
+static bool
+mem_source_seek(_U_ pkt_source_t *src, _U_ u_int64_t offset)
+{
+    return false;
+}
+
+static bool
+mem_source_reset(pkt_source_t *src)
+{
+    src->mem_next = 0;
+    return true;
+}
+
+static void
+mem_source_close(_U_ pkt_source_t *src)
+{
+}
+
+static const pkt_source_ops_t mem_source_ops = {
+        "memory",
+        mem_source_next,
+        mem_source_seek,
+        mem_source_reset,
+        mem_source_close,
+};
+
+/**
+ * \brief open the file of the given source, mapped if try_mmap is set and it
+ * can be, or else via libpcap with nanosecond timestamps if libpcap
+ * supports them
+ *
+ * Sets the dlt and nsec of the file_cache_t and stores the source there.
+ * Returns NULL with the reason in ebuf if the file can't be opened.
+ */
+pkt_source_t *
+pkt_source_open(tcpreplay_t *ctx, int idx, _U_ bool try_mmap, char *ebuf)
+{
+    file_cache_t *file_cache = &ctx->options->file_cache[idx];
+    pkt_source_t *src;
+    char *index_path;
+
+    assert(file_cache->source == NULL);
+
+    src = safe_malloc(sizeof(*src));
+    src->file_cache = file_cache;
+    src->path = ctx->options->sources[idx].filename;
+
+    if (shm_pipe_path(src->path)) {
+#ifdef HAVE_SHM_PIPE
+        if ((src->shm = shm_pipe_open(src->path, ebuf)) == NULL) {
+            safe_free(src);
+            return NULL;
+        }
+
+        file_cache->dlt = shm_pipe_datalink(src->shm);
+        file_cache->nsec = shm_pipe_nsec(src->shm);
+        src->ops = &shm_source_ops;
+        file_cache->source = src;
+        return src;
+#else
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s: shared memory pipes aren't supported on this platform", src->path);
+        safe_free(src);
+        return NULL;
+#endif
+    }
+
+#ifdef HAVE_MMAP
+    if (try_mmap && file_cache->mmap == NULL && (file_cache->mmap = mmap_pcap_open(src->path, ebuf)) == NULL)
+        dbgx(1, "Unable to mmap pcap file, using libpcap instead: %s", ebuf);
+
+    if (try_mmap && file_cache->mmap != NULL) {
+        file_cache->mmap->tstamp_nsec = true;
+        file_cache->nsec = true;
+        file_cache->dlt = file_cache->mmap->dlt;
+        src->ops = &mmap_source_ops;
+        src->caps = PKT_SOURCE_STABLE;
+        if (!file_cache->mmap->pcapng)
+            src->caps |= PKT_SOURCE_SEEKABLE | PKT_SOURCE_REWIND;
+        src->first = file_cache->mmap->offset;
+    } else
+#endif
+    {
+        if ((src->pcap = tcpr_pcap_open_offline_with_tstamp_precision(src->path, PCAP_TSTAMP_PRECISION_NANO, ebuf)) ==
+            NULL) {
+            safe_free(src);
+            return NULL;
+        }
+
+        file_cache->dlt = pcap_datalink(src->pcap);
+        file_cache->nsec = tcpr_pcap_tstamp_nsec(src->pcap);
+        src->ops = &pcap_source_ops;
+        if (pcap_file(src->pcap) != NULL && ftello(pcap_file(src->pcap)) >= 0)
+            src->caps = PKT_SOURCE_SEEKABLE;
+    }
+
+    if ((src->caps & PKT_SOURCE_SEEKABLE) && strcmp(src->path, "-") != 0) {
+        index_path = pcap_index_path(src->path);
+        if (access(index_path, R_OK) == 0)
+            src->caps |= PKT_SOURCE_INDEXED;
+        safe_free(index_path);
+    }
+
+    file_cache->source = src;
+    return src;
+}
+
+/**
+ * \brief a source of cnt packets from the caller's memory, see
+ * tcpreplay_send_batch()
+ */
+pkt_source_t *
+pkt_source_mem(file_cache_t *file_cache, const struct pcap_pkthdr *pkthdrs, u_char *const *data, int cnt)
+{
+    pkt_source_t *src;
+
+    assert(file_cache->source == NULL);
+
+    src = safe_malloc(sizeof(*src));
+    src->ops = &mem_source_ops;
+    src->caps = PKT_SOURCE_STABLE | PKT_SOURCE_REWIND | PKT_SOURCE_BORROWED;
+    src->file_cache = file_cache;
+    src->mem_pkthdr = pkthdrs;
+    src->mem_data = data;
+    src->mem_cnt = cnt;
+
+    file_cache->nsec = false;
+    file_cache->source = src;
+    return src;
+}
+
+/**
+ * \brief read a libpcap source through a --readahead ring of size bytes
+ *
+ * Any seeking must be done first.  Other sources are left as they are.
+ */
+void
+pkt_source_readahead(_U_ pkt_source_t *src, _U_ size_t size)
+{
+#ifdef HAVE_PTHREAD
+    if (size == 0 || src->ops != &pcap_source_ops || src->cnt != 0)
+        return;
+
+    if ((src->readahead = pcap_readahead_open(src->pcap, size)) != NULL) {
+        src->ops = &readahead_source_ops;
+        src->caps = PKT_SOURCE_HEADROOM;
+    }
+#endif
+}
+
+/**
+ * \brief move a newly opened source on to the record of an index entry
+ *
+ * Returns true if the source was moved
+ */
+bool
+pkt_source_seek(pkt_source_t *src, const pcap_index_entry_t *entry)
+{
+    if (!(src->caps & PKT_SOURCE_SEEKABLE) || src->taken != 0)
+        return false;
+
+    src->cnt = src->pos = 0;
+    return src->ops->seek(src, entry->offset);
+}
+
+/**
+ * \brief go back to the first packet for another pass
+ *
+ * Returns false if the source can't, and has to be opened again
+ */
+bool
+pkt_source_reset(pkt_source_t *src)
+{
+    if (!(src->caps & PKT_SOURCE_REWIND) || !src->ops->reset(src))
+        return false;
+
+    src->cnt = src->pos = 0;
+    src->taken = 0;
+    return true;
+}
+
+/**
+ * \brief the pcap_index of the file, loaded the first time it is asked for
+ *
+ * NULL if the file has none, or it is out of date
+ */
+const pcap_index_t *
+pkt_source_index(pkt_source_t *src)
+{
+    if (!(src->caps & PKT_SOURCE_INDEXED))
+        return NULL;
+
+    if (!src->index_loaded) {
+        src->index = pcap_index_load(src->path);
+        src->index_loaded = true;
+    }
+
+    return src->index;
+}
+
+/**
+ * \brief close the source and take it out of its file_cache_t
+ *
+ * A mapping stays with the file_cache_t, see close_source() in replay.c
+ */
+void
+pkt_source_close(pkt_source_t *src)
+{
+    if (src == NULL)
+        return;
+
+    src->ops->close(src);
+    if (src->index != NULL)
+        pcap_index_free(src->index);
+    if (src->file_cache->source == src)
+        src->file_cache->source = NULL;
+    safe_free(src);
+}
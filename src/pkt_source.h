@@ -0,0 +1,117 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+#include "common/pcap_index.h"
+#include "common/shm_pipe.h"
+#include <string.h>
+
+/*
+ * Where the packets of a file come from when they aren't in the preload
+ * cache: libpcap, a mapping of the file, the --readahead ring, a shm_pipe
+ * from tcprewrite or the caller's memory (tcpreplay_send_batch()).  Each is a pkt_source_ops_t,
+ * and says what it can do in its caps, so the send loop and preloading
+ * ask for PKT_SOURCE_STABLE and the like rather than which reader it is.
+ *
+ * next() hands out up to PKT_SOURCE_BATCH packets at once and
+ * pkt_source_next() gives them out one at a time, so the indirect call
+ * is made once a batch.  Sources whose packet data is only good until
+ * the next read return one packet at a time.
+ */
+#define PKT_SOURCE_BATCH 32
+
+#define PKT_SOURCE_STABLE 0x01   /* packet data stays put until the source is closed */
+#define PKT_SOURCE_HEADROOM 0x02 /* PACKET_HEADROOM is free after every packet */
+#define PKT_SOURCE_SEEKABLE 0x04 /* pkt_source_seek() to the offset of an index entry works */
+#define PKT_SOURCE_INDEXED 0x08  /* the file has a pcap_index, see pkt_source_index() */
+#define PKT_SOURCE_REWIND 0x10   /* pkt_source_reset() goes back to the first packet */
+#define PKT_SOURCE_BORROWED 0x20 /* the caller's packets, never cached or sliced */
+#define PKT_SOURCE_CACHED 0x40   /* only from pkt_source_caps(): sent from the preload cache */
+
+typedef struct pkt_source_ops_s {
+    const char *name;
+    /* read up to max packets, 0 at the end */
+    int (*next)(pkt_source_t *src, struct pcap_pkthdr *pkthdr, u_char **data, int max);
+    /* go to the record at offset, before anything is read */
+    bool (*seek)(pkt_source_t *src, u_int64_t offset);
+    /* back to the first packet, for another pass */
+    bool (*reset)(pkt_source_t *src);
+    void (*close)(pkt_source_t *src);
+} pkt_source_ops_t;
+
+struct pkt_source_s {
+    const pkt_source_ops_t *ops;
+    u_int32_t caps;
+    file_cache_t *file_cache;
+    const char *path; /* NULL for the caller's memory */
+    pcap_t *pcap;     /* libpcap, also under the readahead ring */
+    pcap_readahead_t *readahead;
+#ifdef HAVE_SHM_PIPE
+    shm_pipe_t *shm;
+#endif
+    size_t first; /* mapping: offset of the first record */
+    const struct pcap_pkthdr *mem_pkthdr;
+    u_char *const *mem_data;
+    int mem_cnt;
+    int mem_next;
+    pcap_index_t *index;
+    bool index_loaded;
+    COUNTER taken; /* packets pkt_source_next() has handed out */
+    /* the last batch from next(), pos is the next one to hand out */
+    int cnt;
+    int pos;
+    struct pcap_pkthdr pkthdr[PKT_SOURCE_BATCH];
+    u_char *data[PKT_SOURCE_BATCH];
+};
+
+pkt_source_t *pkt_source_open(tcpreplay_t *ctx, int idx, bool try_mmap, char *ebuf);
+pkt_source_t *pkt_source_mem(file_cache_t *file_cache, const struct pcap_pkthdr *pkthdrs, u_char *const *data, int cnt);
+void pkt_source_readahead(pkt_source_t *src, size_t size);
+bool pkt_source_seek(pkt_source_t *src, const pcap_index_entry_t *entry);
+bool pkt_source_reset(pkt_source_t *src);
+const pcap_index_t *pkt_source_index(pkt_source_t *src);
+void pkt_source_close(pkt_source_t *src);
+
+/* the next packet of the source, NULL at the end */
+static inline u_char *
+pkt_source_next(pkt_source_t *src, struct pcap_pkthdr *pkthdr)
+{
+    if (src->pos == src->cnt) {
+        src->pos = 0;
+        if ((src->cnt = src->ops->next(src, src->pkthdr, src->data, PKT_SOURCE_BATCH)) <= 0) {
+            src->cnt = 0;
+            return NULL;
+        }
+    }
+
+    memcpy(pkthdr, &src->pkthdr[src->pos], sizeof(*pkthdr));
+    ++src->taken;
+    return src->data[src->pos++];
+}
+
+/* what the packets of a file are read from can do */
+static inline u_int32_t
+pkt_source_caps(const file_cache_t *file_cache)
+{
+    if (file_cache->cached)
+        return PKT_SOURCE_CACHED | PKT_SOURCE_STABLE;
+
+    return file_cache->source != NULL ? file_cache->source->caps : 0;
+}
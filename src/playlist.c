@@ -0,0 +1,554 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Changing the sources of a running replay, for long soak tests which
+ * shouldn't stop to take on new captures.
+ *
+ * tcpreplay_playlist_add(), _remove() and _replace() queue a change and
+ * return.  tcpr_replay_index() applies the queue between two files, in
+ * order, which means the list is only ever changed by the thread
+ * sending.  A new file is switched in once it is loaded, so while it is
+ * the replay goes on with the sources it has: with --preload-pcap the
+ * loader thread here reads it into a slot past the sources in use, as
+ * preload_pcap_files() would have, and switching it in only moves it
+ * down and does what preload_pcap_finish() does.
+ *
+ * --stats-breakdown keeps the counters of a source with it as the list
+ * changes; those of a removed source go with it.
+ */
+
+#include "playlist.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "breakdown.h"
+#include "send_packets.h"
+#include "send_threads.h"
+#include <string.h>
+
+#ifdef HAVE_PTHREAD
+
+/**
+ * \brief the playlist of ctx, made on first use
+ */
+static tcpr_playlist_t *
+playlist_get(tcpreplay_t *ctx)
+{
+    tcpr_playlist_t *pl, *expected = NULL;
+
+    if ((pl = __atomic_load_n(&ctx->playlist, __ATOMIC_ACQUIRE)) != NULL)
+        return pl;
+
+    pl = safe_malloc(sizeof(tcpr_playlist_t));
+    pl->ctx = ctx;
+    pl->tail = &pl->head;
+    pthread_mutex_init(&pl->lock, NULL);
+    pthread_cond_init(&pl->wake, NULL);
+
+    /* another thread may have beaten us to it */
+    if (!__atomic_compare_exchange_n(&ctx->playlist, &expected, pl, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        pthread_cond_destroy(&pl->wake);
+        pthread_mutex_destroy(&pl->lock);
+        safe_free(pl);
+        return expected;
+    }
+
+    return pl;
+}
+
+/* the file of an add is read by the loader rather than when it's sent */
+static bool
+playlist_preloading(tcpreplay_t *ctx)
+{
+    return ctx->options->preload_pcap && !ctx->options->preload_stream;
+}
+
+/**
+ * \brief the loader thread, reads files being added in the order they were
+ */
+static void *
+playlist_loader(void *arg)
+{
+    tcpr_playlist_t *pl = (tcpr_playlist_t *)arg;
+    playlist_op_t *op;
+    int slot;
+
+    pthread_mutex_lock(&pl->lock);
+    while (!pl->stop) {
+        for (op = pl->head; op != NULL; op = op->next) {
+            if (op->type == playlist_add && !op->loaded)
+                break;
+        }
+
+        if (op == NULL) {
+            pthread_cond_wait(&pl->wake, &pl->lock);
+            continue;
+        }
+
+        /* the op stays queued until it is loaded, so it can't go away */
+        slot = op->slot;
+        pthread_mutex_unlock(&pl->lock);
+
+        dbgx(1, "Playlist: loading %s", op->path);
+        preload_pcap_defer(pl->ctx, slot);
+
+        pthread_mutex_lock(&pl->lock);
+        op->loaded = true;
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return NULL;
+}
+
+/**
+ * \brief can path be added to the sources of ctx?
+ */
+static int
+playlist_check(tcpreplay_t *ctx, const char *path)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    pcap_t *pcap;
+
+    if (ctx->options->dualfile || ctx->options->mix_cnt > 0) {
+        tcpreplay_seterr(ctx, "%s", "sources can't be changed with --dualfile or --mix");
+        return -1;
+    }
+
+    if (strcmp(path, "-") == 0) {
+        tcpreplay_seterr(ctx, "%s", "STDIN can't be added to a running replay");
+        return -1;
+    }
+
+    if (shm_pipe_path(path)) {
+        tcpreplay_seterr(ctx, "%s", "A shared memory pipe can't be added to a running replay");
+        return -1;
+    }
+
+    /* a file which won't open would end the replay when it came up */
+    if ((pcap = tcpr_pcap_open_offline(path, ebuf)) == NULL) {
+        tcpreplay_seterr(ctx, "%s", ebuf);
+        return -1;
+    }
+    pcap_close(pcap);
+
+    return 0;
+}
+
+/* with pl->lock held; playlist_pending() reads head without it */
+static void
+playlist_enqueue(tcpr_playlist_t *pl, playlist_op_t *op)
+{
+    __atomic_store_n(pl->tail, op, __ATOMIC_RELEASE);
+    pl->tail = &op->next;
+}
+
+/**
+ * \brief queue cnt files to be added, removing every source first if clear
+ *
+ * The files are switched in together, once all are loaded
+ */
+static int
+playlist_queue_adds(tcpreplay_t *ctx, char *const *paths, int cnt, bool clear)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpr_playlist_t *pl;
+    playlist_op_t *op;
+    int i, slot, free_slots = 0;
+    int ret = 0;
+
+    if (cnt <= 0) {
+        tcpreplay_seterr(ctx, "invalid file count: %d", cnt);
+        return -1;
+    }
+
+    for (i = 0; i < cnt; i++) {
+        if (playlist_check(ctx, paths[i]) < 0)
+            return -1;
+    }
+
+    pl = playlist_get(ctx);
+    pthread_mutex_lock(&pl->lock);
+
+    for (slot = 0; slot < PLAYLIST_SLOTS; slot++)
+        free_slots += !pl->slot_used[slot];
+
+    if (cnt > free_slots) {
+        tcpreplay_seterr(ctx, "only %d more files can be loading at once", free_slots);
+        ret = -1;
+        goto out;
+    }
+
+    /* the sources can't grow into the slots */
+    if (options->source_cnt + pl->adds + cnt > PLAYLIST_SLOT_FIRST) {
+        tcpreplay_seterr(ctx, "Unable to add more then %u files", PLAYLIST_SLOT_FIRST);
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0, slot = 0; i < cnt; i++, slot++) {
+        while (pl->slot_used[slot])
+            slot++;
+
+        op = safe_malloc(sizeof(playlist_op_t));
+        op->type = playlist_add;
+        op->path = safe_strdup(paths[i]);
+        op->slot = PLAYLIST_SLOT_FIRST + slot;
+        op->clear = clear && i == 0;
+        op->batch = i == 0 ? cnt : 1;
+        op->loaded = !playlist_preloading(ctx);
+        pl->slot_used[slot] = true;
+        pl->adds++;
+
+        options->sources[op->slot].type = source_filename;
+        options->sources[op->slot].filename = safe_strdup(paths[i]);
+        memset(&options->file_cache[op->slot], 0, sizeof(file_cache_t));
+        options->file_cache[op->slot].index = op->slot;
+
+        playlist_enqueue(pl, op);
+    }
+
+    if (playlist_preloading(ctx) && !pl->loader_running) {
+        if (pthread_create(&pl->loader, NULL, playlist_loader, pl) == 0) {
+            pl->loader_running = true;
+        } else {
+            /* they're read when switched in instead */
+            warn("Unable to start playlist loader thread");
+            for (op = pl->head; op != NULL; op = op->next)
+                op->loaded = true;
+        }
+    }
+    pthread_cond_signal(&pl->wake);
+
+out:
+    pthread_mutex_unlock(&pl->lock);
+    return ret;
+}
+
+/**
+ * \brief Add a pcap file to the end of the sources of a running replay
+ *
+ * Safe to call from any thread, before or while replaying.  The file is
+ * switched in at the next file boundary once it's loaded, see playlist.c.
+ * Not possible with --dualfile or --mix.
+ */
+int
+tcpreplay_playlist_add(tcpreplay_t *ctx, const char *path)
+{
+    char *paths[1];
+
+    assert(ctx);
+    assert(path);
+
+    paths[0] = (char *)path;
+    return playlist_queue_adds(ctx, paths, 1, false);
+}
+
+/**
+ * \brief Replace all sources of a running replay with the given files
+ *
+ * Like tcpreplay_playlist_add(), but the old sources go as the new ones
+ * come in, all at once.  The replay goes on with the first of them.
+ */
+int
+tcpreplay_playlist_replace(tcpreplay_t *ctx, char *const *paths, int cnt)
+{
+    assert(ctx);
+    assert(paths);
+
+    return playlist_queue_adds(ctx, paths, cnt, true);
+}
+
+/**
+ * \brief Remove every source named path from a running replay
+ *
+ * Safe to call from any thread.  The file being sent is finished first.
+ * The last source left isn't removed.
+ */
+int
+tcpreplay_playlist_remove(tcpreplay_t *ctx, const char *path)
+{
+    tcpr_playlist_t *pl;
+    playlist_op_t *op;
+
+    assert(ctx);
+    assert(path);
+
+    if (ctx->options->dualfile || ctx->options->mix_cnt > 0) {
+        tcpreplay_seterr(ctx, "%s", "sources can't be changed with --dualfile or --mix");
+        return -1;
+    }
+
+    pl = playlist_get(ctx);
+    op = safe_malloc(sizeof(playlist_op_t));
+    op->type = playlist_remove;
+    op->path = safe_strdup(path);
+    op->batch = 1;
+    op->loaded = true;
+
+    pthread_mutex_lock(&pl->lock);
+    playlist_enqueue(pl, op);
+    pthread_mutex_unlock(&pl->lock);
+
+    return 0;
+}
+
+/* op and the rest of its batch are loaded */
+static bool
+playlist_ready(const playlist_op_t *op)
+{
+    int i;
+
+    for (i = op->batch; i > 0 && op != NULL; i--, op = op->next) {
+        if (!op->loaded)
+            return false;
+    }
+
+    return i == 0;
+}
+
+/**
+ * \brief take source idx out of the list, moving those after it down
+ */
+static void
+playlist_drop(tcpreplay_t *ctx, tcpr_playlist_t *pl, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int cnt = options->source_cnt;
+    int i;
+
+    dbgx(1, "Playlist: removing %s, source %d", options->sources[idx].filename, idx);
+
+    file_cache_free(&options->file_cache[idx]);
+
+    /* the exporter may be printing the name */
+    pl->retired = safe_realloc(pl->retired, (pl->retired_cnt + 1) * sizeof(char *));
+    pl->retired[pl->retired_cnt++] = options->sources[idx].filename;
+
+    __atomic_store_n(&options->source_cnt, cnt - 1, __ATOMIC_RELEASE);
+
+    memmove(&options->sources[idx], &options->sources[idx + 1], (cnt - idx - 1) * sizeof(tcpreplay_source_t));
+    memmove(&options->file_cache[idx], &options->file_cache[idx + 1], (cnt - idx - 1) * sizeof(file_cache_t));
+    memset(&options->sources[cnt - 1], 0, sizeof(tcpreplay_source_t));
+    memset(&options->file_cache[cnt - 1], 0, sizeof(file_cache_t));
+    for (i = idx; i < cnt - 1; i++)
+        options->file_cache[i].index = i;
+
+    if (ctx->breakdown != NULL) {
+        memmove(&ctx->breakdown->sources[idx],
+                &ctx->breakdown->sources[idx + 1],
+                (cnt - idx - 1) * sizeof(tcpr_breakdown_t));
+        memset(&ctx->breakdown->sources[cnt - 1], 0, sizeof(tcpr_breakdown_t));
+    }
+
+#ifdef ENABLE_SEND_THREADS
+    send_threads_forget(ctx, idx);
+#endif
+}
+
+/**
+ * \brief move a file loaded in its slot to the end of the sources
+ */
+static void
+playlist_switch_in(tcpreplay_t *ctx, tcpr_playlist_t *pl, playlist_op_t *op)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int idx = options->source_cnt;
+
+    options->sources[idx] = options->sources[op->slot];
+    options->file_cache[idx] = options->file_cache[op->slot];
+    options->file_cache[idx].index = idx;
+    memset(&options->sources[op->slot], 0, sizeof(tcpreplay_source_t));
+    memset(&options->file_cache[op->slot], 0, sizeof(file_cache_t));
+    pl->slot_used[op->slot - PLAYLIST_SLOT_FIRST] = false;
+    pl->adds--;
+
+    if (ctx->breakdown != NULL)
+        memset(&ctx->breakdown->sources[idx], 0, sizeof(tcpr_breakdown_t));
+
+    /* without a loader thread, it's read now */
+    if (playlist_preloading(ctx) && !options->file_cache[idx].cached)
+        preload_pcap_file(ctx, idx);
+    else if (options->file_cache[idx].cached)
+        preload_pcap_finish(ctx, idx);
+
+#ifdef ENABLE_SEND_THREADS
+    send_threads_forget(ctx, idx);
+#endif
+
+    __atomic_store_n(&options->source_cnt, idx + 1, __ATOMIC_RELEASE);
+    dbgx(1, "Playlist: added %s as source %d", options->sources[idx].filename, idx);
+}
+
+/**
+ * \brief apply the queued changes which are ready, at a file boundary
+ *
+ * Only called by the thread sending, between files.  next is the source
+ * which would have been sent next; returns the one to send now.
+ */
+int
+playlist_apply(tcpreplay_t *ctx, int next)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpr_playlist_t *pl = ctx->playlist;
+    playlist_op_t *op;
+    int i, batch = 0;
+
+    assert(pl);
+
+    pthread_mutex_lock(&pl->lock);
+    while ((op = pl->head) != NULL && (batch > 0 || playlist_ready(op))) {
+        if (batch == 0)
+            batch = op->batch;
+
+        if (op->type == playlist_remove) {
+            for (i = options->source_cnt - 1; i >= 0; i--) {
+                if (strcmp(options->sources[i].filename, op->path) != 0)
+                    continue;
+
+                if (options->source_cnt == 1) {
+                    warnx("Not removing %s, it is the only source left", op->path);
+                    break;
+                }
+
+                playlist_drop(ctx, pl, i);
+                if (i < next)
+                    next--;
+            }
+        } else {
+            if (op->clear) {
+                while (options->source_cnt > 0)
+                    playlist_drop(ctx, pl, options->source_cnt - 1);
+                next = 0;
+            }
+            playlist_switch_in(ctx, pl, op);
+        }
+
+        batch--;
+        __atomic_store_n(&pl->head, op->next, __ATOMIC_RELEASE);
+        if (pl->head == NULL)
+            pl->tail = &pl->head;
+        safe_free(op->path);
+        safe_free(op);
+    }
+    pthread_mutex_unlock(&pl->lock);
+
+    return next;
+}
+
+/**
+ * \brief adds queued but not switched in yet
+ */
+int
+playlist_adds(tcpreplay_t *ctx)
+{
+    tcpr_playlist_t *pl = __atomic_load_n(&ctx->playlist, __ATOMIC_ACQUIRE);
+    int adds;
+
+    if (pl == NULL)
+        return 0;
+
+    pthread_mutex_lock(&pl->lock);
+    adds = pl->adds;
+    pthread_mutex_unlock(&pl->lock);
+
+    return adds;
+}
+
+/**
+ * \brief drop the first cnt sources, once they have been sent
+ *
+ * Only called by the thread sending, between files, see follow_next()
+ */
+void
+playlist_retire(tcpreplay_t *ctx, int cnt)
+{
+    tcpr_playlist_t *pl = playlist_get(ctx);
+
+    pthread_mutex_lock(&pl->lock);
+    while (cnt-- > 0 && ctx->options->source_cnt > 1)
+        playlist_drop(ctx, pl, 0);
+    pthread_mutex_unlock(&pl->lock);
+}
+
+/**
+ * \brief stop the loader and free what's left of the queue
+ */
+void
+playlist_free(tcpreplay_t *ctx)
+{
+    tcpr_playlist_t *pl = ctx->playlist;
+    playlist_op_t *op, *next;
+    int i;
+
+    if (pl == NULL)
+        return;
+
+    if (pl->loader_running) {
+        pthread_mutex_lock(&pl->lock);
+        pl->stop = true;
+        pthread_cond_signal(&pl->wake);
+        pthread_mutex_unlock(&pl->lock);
+        pthread_join(pl->loader, NULL);
+    }
+
+    for (op = pl->head; op != NULL; op = next) {
+        next = op->next;
+        if (op->type == playlist_add) {
+            file_cache_free(&ctx->options->file_cache[op->slot]);
+            safe_free(ctx->options->sources[op->slot].filename);
+            memset(&ctx->options->sources[op->slot], 0, sizeof(tcpreplay_source_t));
+        }
+        safe_free(op->path);
+        safe_free(op);
+    }
+
+    for (i = 0; i < pl->retired_cnt; i++)
+        safe_free(pl->retired[i]);
+    safe_free(pl->retired);
+
+    pthread_cond_destroy(&pl->wake);
+    pthread_mutex_destroy(&pl->lock);
+    safe_free(pl);
+    ctx->playlist = NULL;
+}
+
+#else
+
+int
+tcpreplay_playlist_add(tcpreplay_t *ctx, _U_ const char *path)
+{
+    tcpreplay_seterr(ctx, "%s", "changing the sources while replaying requires POSIX threads");
+    return -1;
+}
+
+int
+tcpreplay_playlist_replace(tcpreplay_t *ctx, _U_ char *const *paths, _U_ int cnt)
+{
+    tcpreplay_seterr(ctx, "%s", "changing the sources while replaying requires POSIX threads");
+    return -1;
+}
+
+int
+tcpreplay_playlist_remove(tcpreplay_t *ctx, _U_ const char *path)
+{
+    tcpreplay_seterr(ctx, "%s", "changing the sources while replaying requires POSIX threads");
+    return -1;
+}
+
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,82 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+
+/* files which may be loading at once, at the top of options->sources below MEM_SOURCE_IDX */
+#define PLAYLIST_SLOTS 8
+#define PLAYLIST_SLOT_FIRST (MEM_SOURCE_IDX - PLAYLIST_SLOTS)
+
+typedef enum { playlist_add = 1, playlist_remove } playlist_op_type_t;
+
+/*
+ * A change to the sources, waiting for the next file boundary.  A file
+ * being added is loaded into its slot of options->sources and
+ * options->file_cache, past any source in use, and moved down when it is
+ * switched in.
+ */
+typedef struct playlist_op_s {
+    playlist_op_type_t type;
+    char *path;
+    int slot;   /* playlist_add: where the file is loaded */
+    bool clear; /* playlist_add: remove every source first */
+    int batch;  /* ops from this one which are switched in together */
+    bool loaded;
+    struct playlist_op_s *next;
+} playlist_op_t;
+
+/*
+ * Sources added and removed while replaying, see tcpreplay_playlist_add().
+ * The send loop applies the changes between files, and while preloading
+ * a background thread reads new files in first, so switching one in only
+ * costs the work preload_pcap_finish() does.
+ */
+struct tcpr_playlist_s {
+    tcpreplay_t *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t wake; /* for the loader, something to load or stop */
+    playlist_op_t *head; /* oldest change first */
+    playlist_op_t **tail;
+    int adds;             /* playlist_add ops queued */
+    bool slot_used[PLAYLIST_SLOTS];
+    pthread_t loader;
+    bool loader_running;
+    bool stop;
+    char **retired; /* names of removed sources, the exporter may still be reading them */
+    int retired_cnt;
+};
+
+void playlist_free(tcpreplay_t *ctx);
+int playlist_apply(tcpreplay_t *ctx, int next);
+int playlist_adds(tcpreplay_t *ctx);
+void playlist_retire(tcpreplay_t *ctx, int cnt);
+
+/* any changes for the send loop to apply before its next file? */
+static inline bool
+playlist_pending(tcpreplay_t *ctx)
+{
+    tcpr_playlist_t *pl = __atomic_load_n(&ctx->playlist, __ATOMIC_ACQUIRE);
+
+    return pl != NULL && __atomic_load_n(&pl->head, __ATOMIC_ACQUIRE) != NULL;
+}
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,286 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_PRELOAD /* see memstat.h */
+
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+#include "preload_lz4.h"
+
+#ifdef ENABLE_PRELOAD_LZ4
+
+#include <lz4.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * \brief compress the raw_len bytes of raw into a new block
+ */
+static void
+preload_lz4_block_add(preload_lz4_t *lz, const u_char *raw, size_t raw_len, COUNTER first, COUNTER *max_blocks)
+{
+    preload_lz4_block_t *block;
+    int bound = LZ4_compressBound((int)raw_len);
+    int comp_len;
+
+    if (lz->block_cnt == *max_blocks) {
+        *max_blocks = *max_blocks ? *max_blocks * 2 : 64;
+        lz->blocks = safe_realloc(lz->blocks, *max_blocks * sizeof(preload_lz4_block_t));
+    }
+
+    block = &lz->blocks[lz->block_cnt++];
+    block->data = safe_malloc((size_t)bound);
+    if ((comp_len = LZ4_compress_default((const char *)raw, block->data, (int)raw_len, bound)) <= 0)
+        errx(-1, "Unable to LZ4 compress %zu bytes of the packet cache", raw_len);
+    block->data = safe_realloc(block->data, (size_t)comp_len);
+    block->comp_len = (uint32_t)comp_len;
+    block->raw_len = (uint32_t)raw_len;
+    block->first = first;
+
+    lz->raw_max = max(lz->raw_max, block->raw_len);
+    lz->raw_bytes += raw_len;
+    lz->comp_bytes += (COUNTER)comp_len;
+}
+
+/**
+ * \brief decompress the blocks ahead of sending
+ *
+ * Block number seq goes into slot seq % PRELOAD_LZ4_SLOTS once that slot
+ * no longer holds a block the sender may still be using.  Blocks pick up
+ * from the first again after the last, for the next loop.
+ */
+static void *
+preload_lz4_thread(void *arg)
+{
+    preload_lz4_t *lz = arg;
+    const preload_lz4_block_t *block;
+    COUNTER seq, oldest;
+    unsigned int gen;
+    u_char *buf;
+
+    pthread_mutex_lock(&lz->lock);
+    while (!lz->stop) {
+        seq = lz->produced;
+        oldest = lz->consumed > 0 ? lz->consumed - 1 : 0;
+        if (seq >= oldest + PRELOAD_LZ4_SLOTS) {
+            pthread_cond_wait(&lz->room, &lz->lock);
+            continue;
+        }
+
+        gen = lz->gen;
+        block = &lz->blocks[(lz->base_block + seq) % lz->block_cnt];
+        buf = lz->slot[seq % PRELOAD_LZ4_SLOTS];
+        pthread_mutex_unlock(&lz->lock);
+
+        if (LZ4_decompress_safe(block->data, (char *)buf, (int)block->comp_len, (int)lz->raw_max) != (int)block->raw_len)
+            errx(-1, "%s", "Corrupt LZ4 block in the packet cache");
+
+        pthread_mutex_lock(&lz->lock);
+        /* if sending jumped meanwhile, the block is for the old position */
+        if (gen == lz->gen) {
+            lz->produced = seq + 1;
+            pthread_cond_signal(&lz->ready);
+        }
+    }
+    pthread_mutex_unlock(&lz->lock);
+
+    return NULL;
+}
+
+/**
+ * \brief pack the preloaded packets of a file into LZ4 blocks
+ *
+ * Frees the arenas and starts the thread which decompresses the blocks
+ * for sending.  Packets are stored without PACKET_HEADROOM, so this is
+ * only for packets that are not edited in place.
+ */
+void
+preload_lz4_compress(file_cache_t *file_cache)
+{
+    packet_cache_t *pc = file_cache->packet_cache;
+    COUNTER cnt = file_cache->packet_cnt, first = 0, max_blocks = 0, i;
+    size_t raw_size = 2 * PRELOAD_LZ4_BLOCK_RAW, raw_len = 0;
+    packet_arena_t *arena, *next;
+    preload_lz4_t *lz;
+    u_char *raw;
+    int s;
+
+    /* the packets of a mapping or an image take no RAM of ours anyway */
+    if (cnt == 0 || file_cache->mmap != NULL || file_cache->image != NULL || file_cache->lz4 != NULL)
+        return;
+
+    lz = safe_malloc(sizeof(preload_lz4_t));
+    lz->packet_cnt = cnt;
+    lz->offset = safe_malloc(cnt * sizeof(uint32_t));
+    raw = safe_malloc(raw_size);
+
+    for (i = 0; i < cnt; i++) {
+        size_t len = pc[i].pkthdr.caplen;
+
+        if (raw_len >= PRELOAD_LZ4_BLOCK_RAW && i - first >= PRELOAD_LZ4_BLOCK_PKTS) {
+            preload_lz4_block_add(lz, raw, raw_len, first, &max_blocks);
+            first = i;
+            raw_len = 0;
+        }
+
+        if (raw_len + len + sizeof(void *) > raw_size) {
+            raw_size = 2 * (raw_len + len + sizeof(void *));
+            raw = safe_realloc(raw, raw_size);
+        }
+
+        memcpy(raw + raw_len, pc[i].pktdata, len);
+        lz->offset[i] = (uint32_t)raw_len;
+        /* keep each packet aligned for the header parsing done when sending */
+        raw_len += (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    }
+    preload_lz4_block_add(lz, raw, raw_len, first, &max_blocks);
+    safe_free(raw);
+
+    for (arena = file_cache->arena; arena != NULL; arena = next) {
+        next = arena->next;
+        sendpacket_unregister_mem(arena->data, arena->size);
+        tcpr_huge_free(arena->data, arena->size);
+        safe_free(arena);
+    }
+    file_cache->arena = NULL;
+
+    /* until preload_lz4_fetch() points them into a slot */
+    for (i = 0; i < cnt; i++)
+        pc[i].pktdata = NULL;
+
+    for (s = 0; s < PRELOAD_LZ4_SLOTS; s++)
+        lz->slot[s] = safe_malloc(lz->raw_max);
+
+    pthread_mutex_init(&lz->lock, NULL);
+    pthread_cond_init(&lz->ready, NULL);
+    pthread_cond_init(&lz->room, NULL);
+    if (pthread_create(&lz->thread, NULL, preload_lz4_thread, lz) != 0)
+        errx(-1, "%s", "Unable to start the LZ4 decompression thread");
+
+    dbgx(1, "LZ4 packed " COUNTER_SPEC " packets into " COUNTER_SPEC " blocks, " COUNTER_SPEC " of " COUNTER_SPEC " bytes",
+         cnt, lz->block_cnt, lz->comp_bytes, lz->raw_bytes);
+
+    file_cache->lz4 = lz;
+}
+
+/**
+ * \brief the block holding the given packet
+ */
+static COUNTER
+preload_lz4_find(const preload_lz4_t *lz, COUNTER packet)
+{
+    COUNTER low = 0, high = lz->block_cnt - 1;
+
+    while (low < high) {
+        COUNTER mid = low + (high - low + 1) / 2;
+
+        if (lz->blocks[mid].first <= packet)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    return low;
+}
+
+/**
+ * \brief move sending on to the block holding packet
+ *
+ * Hands the slot before the current one back to the thread, waits for the
+ * block to be decompressed and points its packets into its slot.  Sending
+ * nearly always moves on to the next block, which is then ready; when it
+ * jumps elsewhere, decompressing starts over from there.
+ */
+void
+preload_lz4_switch(file_cache_t *file_cache, COUNTER packet)
+{
+    preload_lz4_t *lz = file_cache->lz4;
+    packet_cache_t *pc = file_cache->packet_cache;
+    COUNTER want, expected, i;
+    u_char *buf;
+
+    if (lz->holding && packet == lz->cur_end)
+        want = lz->cur_block + 1;
+    else
+        want = preload_lz4_find(lz, packet);
+
+    pthread_mutex_lock(&lz->lock);
+    if (lz->holding)
+        lz->consumed++;
+    expected = (lz->base_block + lz->consumed) % lz->block_cnt;
+    if (want != expected) {
+        lz->gen++;
+        lz->base_block = want;
+        lz->produced = 0;
+        lz->consumed = 0;
+    }
+    lz->holding = true;
+    pthread_cond_signal(&lz->room);
+
+    if (lz->produced <= lz->consumed) {
+        lz->stalls++;
+        while (lz->produced <= lz->consumed)
+            pthread_cond_wait(&lz->ready, &lz->lock);
+    }
+    buf = lz->slot[lz->consumed % PRELOAD_LZ4_SLOTS];
+    pthread_mutex_unlock(&lz->lock);
+
+    lz->cur_block = want;
+    lz->cur_first = lz->blocks[want].first;
+    lz->cur_end = want + 1 < lz->block_cnt ? lz->blocks[want + 1].first : lz->packet_cnt;
+    for (i = lz->cur_first; i < lz->cur_end; i++)
+        pc[i].pktdata = buf + lz->offset[i];
+}
+
+/**
+ * \brief stop the thread and free the blocks of a file
+ */
+void
+preload_lz4_free(file_cache_t *file_cache)
+{
+    preload_lz4_t *lz = file_cache->lz4;
+    COUNTER i;
+    int s;
+
+    if (lz == NULL)
+        return;
+
+    pthread_mutex_lock(&lz->lock);
+    lz->stop = true;
+    pthread_cond_signal(&lz->room);
+    pthread_mutex_unlock(&lz->lock);
+    pthread_join(lz->thread, NULL);
+
+    dbgx(1, "LZ4 cache: sending waited for " COUNTER_SPEC " blocks", lz->stalls);
+
+    for (i = 0; i < lz->block_cnt; i++)
+        safe_free(lz->blocks[i].data);
+    safe_free(lz->blocks);
+    safe_free(lz->offset);
+    for (s = 0; s < PRELOAD_LZ4_SLOTS; s++)
+        safe_free(lz->slot[s]);
+    pthread_mutex_destroy(&lz->lock);
+    pthread_cond_destroy(&lz->ready);
+    pthread_cond_destroy(&lz->room);
+    safe_free(lz);
+    file_cache->lz4 = NULL;
+}
+
+#endif /* ENABLE_PRELOAD_LZ4 */
@@ -0,0 +1,99 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+/*
+ * --preload-lz4: once a file is preloaded its packets are packed into LZ4
+ * blocks of consecutive packets and the arenas freed.  A helper thread per
+ * file decompresses the blocks, in send order, into a small ring ahead of
+ * sending, and preload_lz4_fetch() points the packet_cache_t entries of
+ * a block into its ring slot as sending gets to it, so the send loop only
+ * ever sees plain packets.
+ */
+#if defined HAVE_LIBLZ4 && defined HAVE_PTHREAD
+#define ENABLE_PRELOAD_LZ4 1
+
+#include <pthread.h>
+
+/* a block is closed once it has this many bytes... */
+#define PRELOAD_LZ4_BLOCK_RAW (256 * 1024)
+/* ...and this many packets, so a send batch spans at most two blocks */
+#define PRELOAD_LZ4_BLOCK_PKTS SENDPACKET_BATCH_MAX
+/* size of the ring of decompressed blocks */
+#define PRELOAD_LZ4_SLOTS 8
+
+typedef struct preload_lz4_block_s {
+    char *data;        /* compressed */
+    uint32_t comp_len;
+    uint32_t raw_len;
+    COUNTER first;     /* first packet of the block */
+} preload_lz4_block_t;
+
+struct preload_lz4_s {
+    preload_lz4_block_t *blocks;
+    COUNTER block_cnt;
+    COUNTER packet_cnt;
+    uint32_t *offset;  /* of each packet in the raw block */
+    uint32_t raw_max;  /* largest raw_len, the size of every slot */
+    u_char *slot[PRELOAD_LZ4_SLOTS];
+    COUNTER raw_bytes;
+    COUNTER comp_bytes;
+
+    /* block in the slot being sent from, and the packets it holds */
+    COUNTER cur_block;
+    COUNTER cur_first;
+    COUNTER cur_end;
+    bool holding;      /* the consumer has a slot, and the one before it */
+
+    /*
+     * Block sequence numbers: base_block is number 0, the helper has
+     * decompressed up to produced, the sender is on consumed and keeps
+     * consumed - 1 too, for packets still in a batch.
+     */
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_cond_t room;
+    COUNTER base_block;
+    COUNTER produced;
+    COUNTER consumed;
+    unsigned int gen; /* bumped when sending jumps, so blocks in flight are dropped */
+    bool stop;
+    COUNTER stalls;   /* times sending had to wait for a block */
+};
+
+void preload_lz4_compress(file_cache_t *file_cache);
+void preload_lz4_switch(file_cache_t *file_cache, COUNTER packet);
+void preload_lz4_free(file_cache_t *file_cache);
+
+/**
+ * \brief make sure the packet_cache_t of a packet points at its data
+ */
+static inline void
+preload_lz4_fetch(file_cache_t *file_cache, COUNTER packet)
+{
+    preload_lz4_t *lz = file_cache->lz4;
+
+    if (packet < lz->cur_first || packet >= lz->cur_end || !lz->holding)
+        preload_lz4_switch(file_cache, packet);
+}
+#endif /* HAVE_LIBLZ4 && HAVE_PTHREAD */
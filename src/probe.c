@@ -0,0 +1,164 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In-band latency probes.  The send loop asks probe_due() before each
+ * packet of intf1 and, when a probe is, queues probe_next() ahead of the
+ * packet through the same pacing and batches.  Each probe is a copy of
+ * the template with its sequence number, IP id and checksum and send
+ * time filled in, in a buffer of its own, so a batch may hold several.
+ */
+
+#include "probe.h"
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * \brief probes sent rate times a second to UDP port
+ */
+tcpr_probe_t *
+probe_new(u_int32_t rate, u_int16_t port)
+{
+    tcpr_probe_t *pr;
+
+    assert(rate > 0);
+
+    pr = safe_malloc(sizeof(tcpr_probe_t));
+    pr->interval_ns = 1000000000ULL / rate;
+    pr->port = port;
+
+    return pr;
+}
+
+void
+probe_free(tcpr_probe_t *pr)
+{
+    safe_free(pr);
+}
+
+/**
+ * \brief model the probes on a packet about to be sent
+ *
+ * Takes its layer 2 header, the VLAN tags included, and its IPv4 source,
+ * destination and TOS.  Returns false if it isn't IPv4, and the next
+ * packet is tried.
+ */
+bool
+probe_template(tcpr_probe_t *pr, const u_char *pktdata, uint32_t caplen, int datalink)
+{
+    uint32_t _U_ vlan_offset;
+    uint32_t l2offset, l2len;
+    uint16_t ether_type;
+    ipv4_hdr_t from, *ip_hdr;
+    udp_hdr_t *udp_hdr;
+
+    if (get_l2len_protocol(pktdata, caplen, datalink, &ether_type, &l2len, &l2offset, &vlan_offset) < 0 ||
+        ether_type != ETHERTYPE_IP || l2len > PROBE_L2_MAX || l2len + TCPR_IPV4_H > caplen)
+        return false;
+
+    memcpy(&from, pktdata + l2len, TCPR_IPV4_H);
+    if (from.ip_v != 4)
+        return false;
+
+    memset(pr->template, 0, sizeof(pr->template));
+    memcpy(pr->template, pktdata, l2len);
+    pr->l2len = l2len;
+
+    ip_hdr = (ipv4_hdr_t *)(pr->template + l2len);
+    ip_hdr->ip_v = 4;
+    ip_hdr->ip_hl = 5;
+    ip_hdr->ip_tos = from.ip_tos;
+    ip_hdr->ip_len = htons(TCPR_IPV4_H + TCPR_UDP_H + sizeof(tcpr_probe_payload_t));
+    ip_hdr->ip_ttl = 64;
+    ip_hdr->ip_p = IPPROTO_UDP;
+    ip_hdr->ip_src = from.ip_src;
+    ip_hdr->ip_dst = from.ip_dst;
+
+    /* no UDP checksum, so only the IP header changes from one probe to the next */
+    udp_hdr = (udp_hdr_t *)(pr->template + l2len + TCPR_IPV4_H);
+    udp_hdr->uh_sport = htons(pr->port);
+    udp_hdr->uh_dport = htons(pr->port);
+    udp_hdr->uh_ulen = htons(TCPR_UDP_H + sizeof(tcpr_probe_payload_t));
+
+    pr->len = max(l2len + TCPR_IPV4_H + TCPR_UDP_H + (uint32_t)sizeof(tcpr_probe_payload_t), PROBE_LEN_MIN);
+    pr->ready = true;
+
+    return true;
+}
+
+/**
+ * \brief fill in the probe due at now_ns and schedule the next
+ *
+ * Returns the probe, and its header in *pkthdr.  Both stay put until
+ * PROBE_BUFS more probes were made.
+ */
+const u_char *
+probe_next(tcpr_probe_t *pr, u_int64_t now_ns, struct pcap_pkthdr **pkthdr)
+{
+    int i = (int)(pr->seq % PROBE_BUFS);
+    u_char *pkt = pr->buf[i];
+    ipv4_hdr_t *ip_hdr = (ipv4_hdr_t *)(pkt + pr->l2len);
+    tcpr_probe_payload_t payload;
+    struct pcap_pkthdr *hdr = &pr->pkthdr[i];
+    uint16_t sum;
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec real;
+
+    clock_gettime(CLOCK_REALTIME, &real);
+#else
+    struct timeval tv;
+    struct timespec real;
+
+    gettimeofday(&tv, NULL);
+    real.tv_sec = tv.tv_sec;
+    real.tv_nsec = tv.tv_usec * 1000;
+#endif
+
+    assert(pr->ready);
+
+    memcpy(pkt, pr->template, pr->len);
+    ip_hdr->ip_id = htons((uint16_t)pr->seq);
+    sum = (uint16_t)tcpr_csum_partial(ip_hdr, TCPR_IPV4_H, 0);
+    ip_hdr->ip_sum = (uint16_t)~sum;
+
+    payload.magic = htonl(TCPR_PROBE_MAGIC);
+    payload.seq = htonl(pr->seq);
+    payload.tx_sec = htonl((u_int32_t)real.tv_sec);
+    payload.tx_nsec = htonl((u_int32_t)real.tv_nsec);
+    memcpy(pkt + pr->l2len + TCPR_IPV4_H + TCPR_UDP_H, &payload, sizeof(payload));
+
+    hdr->ts.tv_sec = real.tv_sec;
+    hdr->ts.tv_usec = real.tv_nsec / 1000;
+    hdr->caplen = pr->len;
+    hdr->len = pr->len;
+    *pkthdr = hdr;
+
+    /* after a pause or a long sleep carry on at the rate, don't catch up */
+    pr->next_ns += pr->interval_ns;
+    if (pr->next_ns < now_ns)
+        pr->next_ns = now_ns + pr->interval_ns;
+    pr->seq++;
+    pr->sent++;
+
+    return pkt;
+}
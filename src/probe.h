@@ -0,0 +1,67 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+#define PROBE_PORT_DEFAULT 9 /* discard */
+/* packets between looks at the clock for a due probe at top speed, minus one */
+#define PROBE_POLL_MASK 63
+/* layer 2 header copied from the packet the probes are modelled on */
+#define PROBE_L2_MAX 64
+#define PROBE_LEN_MAX (PROBE_L2_MAX + TCPR_IPV4_H + TCPR_UDP_H + sizeof(tcpr_probe_payload_t))
+/* shortest Ethernet frame, without the FCS */
+#define PROBE_LEN_MIN 60
+/* probes which may be queued in a batch at once, each in a buffer of its own */
+#define PROBE_BUFS SENDPACKET_BATCH_MAX
+
+/*
+ * --probe-rate: UDP probes slipped in between the packets sent out of
+ * intf1, carrying a sequence number and the time they were sent, see
+ * tcpr_probe_payload_t.  They have the layer 2 header and IPv4 addresses
+ * of the first IPv4 packet sent, so they take the same path through the
+ * device under test.
+ */
+struct tcpr_probe_s {
+    u_int64_t interval_ns;
+    u_int64_t next_ns; /* when the next probe is due */
+    u_int32_t seq;
+    u_int16_t port;
+    bool ready;        /* the template is filled in */
+    u_int32_t l2len;
+    u_int32_t len;     /* of a probe */
+    u_char template[PROBE_LEN_MAX];
+    u_char buf[PROBE_BUFS][PROBE_LEN_MAX];
+    struct pcap_pkthdr pkthdr[PROBE_BUFS];
+    COUNTER sent;
+};
+
+tcpr_probe_t *probe_new(u_int32_t rate, u_int16_t port);
+void probe_free(tcpr_probe_t *pr);
+bool probe_template(tcpr_probe_t *pr, const u_char *pktdata, uint32_t caplen, int datalink);
+const u_char *probe_next(tcpr_probe_t *pr, u_int64_t now_ns, struct pcap_pkthdr **pkthdr);
+
+/**
+ * \brief a probe should go out ahead of the next packet
+ */
+static inline bool
+probe_due(const tcpr_probe_t *pr, u_int64_t now_ns)
+{
+    return pr->ready && now_ns >= pr->next_ns;
+}
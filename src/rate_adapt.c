@@ -0,0 +1,242 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Closed loop --mbps for --rate-adapt.
+ *
+ * A thread samples the TX counters every interval and searches for the
+ * highest rate which goes out without drops, changing the speed with
+ * tcpreplay_control_speed() like a POST to --stats-socket does.  Drops
+ * are those of the kernel and NIC in sysfs (tx_dropped, tx_fifo_errors)
+ * plus ours: packets a full qdisc turned away with ENOBUFS, which
+ * sendpacket resends, and failed writes.
+ *
+ * The rate doubles until there are drops, then the range between the
+ * last rate without drops and the first with them is halved every
+ * interval.  A sample which didn't come close to the rate, e.g. as the
+ * sender can't go that fast or was between loops, says nothing about it
+ * and is tried again.  Drops at a rate thought safe start the search
+ * over from there, so the rate keeps following the link.
+ */
+
+#include "rate_adapt.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "send_threads.h"
+#include "tcpreplay_api.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+
+#define RATE_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* a counter of /sys/class/net/DEVICE/statistics, 0 if there is none */
+static COUNTER
+rate_adapt_sysfs(const char *device, const char *counter)
+{
+    char path[128];
+    unsigned long long value;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/%s", device, counter);
+    if ((f = fopen(path, "r")) == NULL)
+        return 0;
+
+    if (fscanf(f, "%llu", &value) != 1)
+        value = 0;
+    fclose(f);
+
+    return (COUNTER)value;
+}
+
+/* add the counters of sp, and those of its device when it has its own */
+static void
+rate_adapt_count(sendpacket_t *sp, bool device, COUNTER *pkts, COUNTER *bytes, COUNTER *drops)
+{
+    *pkts += RATE_LOAD(sp->sent);
+    *bytes += RATE_LOAD(sp->bytes_sent);
+    *drops += RATE_LOAD(sp->failed) + RATE_LOAD(sp->retry_enobufs);
+    if (device)
+        *drops += rate_adapt_sysfs(sp->device, "tx_dropped") + rate_adapt_sysfs(sp->device, "tx_fifo_errors");
+}
+
+/* packets, bytes and drops of every interface and send thread so far */
+static void
+rate_adapt_sample(tcpreplay_t *ctx, COUNTER *pkts, COUNTER *bytes, COUNTER *drops)
+{
+    int i;
+
+    *pkts = *bytes = *drops = 0;
+    rate_adapt_count(ctx->intf1, true, pkts, bytes, drops);
+    if (ctx->intf2 != NULL)
+        rate_adapt_count(ctx->intf2, true, pkts, bytes, drops);
+    for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+        rate_adapt_count(ctx->pair_intf[i], true, pkts, bytes, drops);
+
+#ifdef ENABLE_SEND_THREADS
+    {
+        /* workers send out the device of intf1 */
+        send_threads_t *st = __atomic_load_n(&ctx->threads, __ATOMIC_ACQUIRE);
+
+        for (i = 1; st != NULL && i < st->cnt; i++) {
+            sendpacket_t *sp = __atomic_load_n(&st->workers[i].sp, __ATOMIC_ACQUIRE);
+
+            if (sp != NULL)
+                rate_adapt_count(sp, false, pkts, bytes, drops);
+        }
+    }
+#endif
+}
+
+/* the rate to try after a sample of the current one */
+static COUNTER
+rate_adapt_next(rate_adapt_t *ra, bool dropped)
+{
+    COUNTER rate = ra->rate;
+
+    if (dropped) {
+        /* a rate which was fine before isn't any more */
+        if (ra->low >= rate)
+            ra->low = 0;
+        ra->high = rate;
+    } else {
+        ra->low = rate;
+        if (ra->high != 0 && ra->high <= rate)
+            ra->high = 0;
+    }
+
+    if (ra->high == 0) {
+        rate *= 2;
+        if (ra->max != 0 && rate > ra->max)
+            rate = ra->max;
+    } else if (ra->low == 0) {
+        rate /= 2;
+    } else if ((ra->high - ra->low) * 100 > ra->high * RATE_ADAPT_RESOLUTION_PCT) {
+        rate = ra->low + (ra->high - ra->low) / 2;
+    } else {
+        rate = ra->low;
+    }
+
+    return max(rate, 1);
+}
+
+static void *
+rate_adapt_thread(void *arg)
+{
+    rate_adapt_t *ra = arg;
+    tcpreplay_t *ctx = ra->ctx;
+    const tcpreplay_speed_t *speed = &ctx->options->speed;
+    u_int64_t start_ns = tcpr_clock_ns();
+
+    while (!__atomic_load_n(&ra->stop, __ATOMIC_ACQUIRE)) {
+        COUNTER pkts, bytes, drops, sent_bits, rate;
+        u_int64_t now_ns;
+
+        usleep(RATE_ADAPT_POLL_MS * 1000);
+        now_ns = tcpr_clock_ns();
+        if (now_ns - start_ns < (u_int64_t)ra->interval_ms * 1000000)
+            continue;
+
+        rate_adapt_sample(ctx, &pkts, &bytes, &drops);
+        sent_bits = tcpreplay_pace_bits(speed, pkts - ra->pkts, bytes - ra->bytes);
+
+        /* in bps; nothing is learnt about a rate which wasn't reached */
+        if (drops > ra->drops || (double)sent_bits * 1000000000.0 / (double)(now_ns - start_ns) >=
+                                         (double)ra->rate * (100 - RATE_ADAPT_SLACK_PCT) / 100.0) {
+            rate = rate_adapt_next(ra, drops > ra->drops);
+            dbgx(1,
+                 "--rate-adapt: " COUNTER_SPEC " bps %s, " COUNTER_SPEC " bps next",
+                 ra->rate,
+                 drops > ra->drops ? "dropped" : "ok",
+                 rate);
+            if (rate != ra->rate && tcpreplay_control_speed(ctx, speed_mbpsrate, (double)rate / 1000000.0) == 0)
+                ra->rate = rate;
+            __atomic_store_n(&ctx->rate_adapt_bps, ra->low, __ATOMIC_RELAXED);
+        }
+
+        ra->pkts = pkts;
+        ra->bytes = bytes;
+        ra->drops = drops;
+        start_ns = now_ns;
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief start adapting the --mbps of ctx to the drops seen
+ *
+ * Starts from the current speed.  Returns 0 on success, -1 on error.
+ */
+int
+rate_adapt_start(tcpreplay_t *ctx)
+{
+    rate_adapt_t *ra;
+
+    assert(ctx);
+
+    if (ctx->adapter != NULL)
+        return 0;
+
+    if (ctx->options->speed.mode != speed_mbpsrate || ctx->options->speed.speed == 0) {
+        tcpreplay_seterr(ctx, "%s", "--rate-adapt requires --mbps");
+        return -1;
+    }
+
+    ra = safe_malloc(sizeof(rate_adapt_t));
+    ra->ctx = ctx;
+    ra->interval_ms = ctx->options->rate_adapt_ms;
+    ra->rate = ctx->options->speed.speed;
+    ra->max = sendpacket_get_link_mbps(ctx->intf1) * 1000000;
+    rate_adapt_sample(ctx, &ra->pkts, &ra->bytes, &ra->drops);
+
+    if (pthread_create(&ra->thread, NULL, rate_adapt_thread, ra) != 0) {
+        tcpreplay_seterr(ctx, "%s", "Unable to start the --rate-adapt thread");
+        safe_free(ra);
+        return -1;
+    }
+
+    ctx->adapter = ra;
+    return 0;
+}
+
+/**
+ * \brief stop adapting the rate
+ *
+ * ctx->rate_adapt_bps is left at the highest rate last seen without
+ * drops, 0 if there was none.
+ */
+void
+rate_adapt_stop(tcpreplay_t *ctx)
+{
+    rate_adapt_t *ra = ctx->adapter;
+
+    if (ra == NULL)
+        return;
+
+    __atomic_store_n(&ra->stop, true, __ATOMIC_RELEASE);
+    pthread_join(ra->thread, NULL);
+
+    safe_free(ra);
+    ctx->adapter = NULL;
+}
+
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,49 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+
+/* how often the adapter thread checks whether it should stop */
+#define RATE_ADAPT_POLL_MS 10
+/* a sample counts as reaching the rate within this many percent of it */
+#define RATE_ADAPT_SLACK_PCT 5
+/* the search stops when the drop-free and dropping rates are this close, in percent */
+#define RATE_ADAPT_RESOLUTION_PCT 1
+
+struct rate_adapt_s {
+    tcpreplay_t *ctx;
+    u_int32_t interval_ms;
+    COUNTER rate;    /* bps being tried */
+    COUNTER low;     /* highest bps seen without drops, 0 if none yet */
+    COUNTER high;    /* lowest bps seen with drops, 0 if none yet */
+    COUNTER max;     /* bps of the link, 0 if unknown */
+    COUNTER pkts;    /* counters as of the last sample */
+    COUNTER bytes;
+    COUNTER drops;
+    pthread_t thread;
+    volatile bool stop;
+};
+
+int rate_adapt_start(tcpreplay_t *ctx);
+void rate_adapt_stop(tcpreplay_t *ctx);
+#endif /* HAVE_PTHREAD */
@@ -21,17 +21,45 @@
 #include "defines.h"
 #include "config.h"
 #include "common.h"
+#include "breakdown.h"
+#include "checkpoint.h"
+#include "pkt_source.h"
+#include "playlist.h"
+#include "follow.h"
+#include "fleet.h"
 #include "send_packets.h"
+#include "send_threads.h"
 #include "tcpreplay_api.h"
 #include <string.h>
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 static int replay_file(tcpreplay_t *ctx, int idx);
+static int replay_mix(tcpreplay_t *ctx);
 static int replay_two_files(tcpreplay_t *ctx, int idx1, int idx2);
 static int replay_cache(tcpreplay_t *ctx, int idx);
 static int replay_two_caches(tcpreplay_t *ctx, int idx1, int idx2);
 static int replay_fd(tcpreplay_t *ctx, int idx);
 static int replay_two_fds(tcpreplay_t *ctx, int idx1, int idx2);
 
+/* state of the --preload-stream background loader */
+typedef struct preload_stream_s {
+    tcpreplay_t *ctx;
+    int first;
+    int cnt;
+#ifdef HAVE_PTHREAD
+    pthread_t loader;
+#endif
+    bool running;
+} preload_stream_t;
+
+static void preload_stream_load(tcpreplay_t *ctx, int first, int cnt, bool streamed);
+static void preload_stream_start(preload_stream_t *ps, int first, int cnt);
+static void preload_stream_wait(preload_stream_t *ps);
+static void preload_stream_release(tcpreplay_t *ctx, int first, int cnt);
+
 /**
  * \brief Internal tcpreplay method to replay a given index
  *
@@ -42,12 +70,52 @@ tcpr_replay_index(tcpreplay_t *ctx)
 {
     int rcode = 0;
     int idx;
+    int step = ctx->options->dualfile ? 2 : 1;
+    preload_stream_t ps;
+    bool stream;
     assert(ctx);
 
+    /* streaming a single file (or pair) is the same as preloading it */
+    stream = ctx->options->preload_stream && ctx->options->source_cnt > step;
+    memset(&ps, 0, sizeof(ps));
+    ps.ctx = ctx;
+
+    /* --fleet: the streams, each on its own schedule */
+    if (ctx->fleet != NULL) {
+        rcode = fleet_run(ctx);
+    }
+
+    /* --mix: every file at once */
+    else if (ctx->options->mix_cnt > 0) {
+        rcode = replay_mix(ctx);
+    }
+
     /* only process a single file */
-    if (!ctx->options->dualfile) {
-        /* process each pcap file in order */
-        for (idx = 0; idx < ctx->options->source_cnt && !ctx->abort; idx++) {
+    else if (!ctx->options->dualfile) {
+        /* process each pcap file in order, --resume starts with the one it stopped in */
+        for (idx = ctx->resume ? ctx->resume->source_idx : 0; !ctx->abort; idx++) {
+#ifdef HAVE_PTHREAD
+            /* changes to the sources go in between files, see playlist.c */
+            if (ctx->follow != NULL) {
+                idx = follow_next(ctx, idx);
+            } else if (playlist_pending(ctx)) {
+                preload_stream_wait(&ps);
+                idx = playlist_apply(ctx, idx);
+            }
+#endif
+            if (idx >= ctx->options->source_cnt)
+                break;
+
+            if (ctx->options->preload_stream) {
+                preload_stream_wait(&ps);
+                preload_stream_load(ctx, idx, 1, stream);
+                if (stream)
+                    preload_stream_start(&ps, idx + 1, 1);
+            }
+
+            if (ctx->breakdown != NULL)
+                breakdown_source_start(ctx);
+
             /* reset cache markers for each iteration */
             switch (ctx->options->sources[idx].type) {
             case source_filename:
@@ -63,6 +131,12 @@ tcpr_replay_index(tcpreplay_t *ctx)
                 tcpreplay_seterr(ctx, "Invalid source type: %d", ctx->options->sources[idx].type);
                 rcode = -1;
             }
+
+            if (ctx->breakdown != NULL && rcode >= 0)
+                breakdown_source_end(ctx, idx);
+
+            if (stream)
+                preload_stream_release(ctx, idx, 1);
         }
     }
 
@@ -71,9 +145,21 @@ tcpr_replay_index(tcpreplay_t *ctx)
         /* process each pcap file in order */
         for (idx = 0; idx < ctx->options->source_cnt && !ctx->abort; idx += 2) {
             if (ctx->options->sources[idx].type != ctx->options->sources[(idx + 1)].type) {
+                preload_stream_wait(&ps);
                 tcpreplay_seterr(ctx, "Both source indexes (%d, %d) must be of the same type", idx, (idx + 1));
                 return -1;
             }
+
+            if (ctx->options->preload_stream) {
+                preload_stream_wait(&ps);
+                preload_stream_load(ctx, idx, 2, stream);
+                if (stream)
+                    preload_stream_start(&ps, idx + 2, 2);
+            }
+
+            if (ctx->breakdown != NULL)
+                breakdown_source_start(ctx);
+
             switch (ctx->options->sources[idx].type) {
             case source_filename:
                 rcode = replay_two_files(ctx, idx, (idx + 1));
@@ -88,8 +174,18 @@ tcpr_replay_index(tcpreplay_t *ctx)
                 tcpreplay_seterr(ctx, "Invalid source type: %d", ctx->options->sources[idx].type);
                 rcode = -1;
             }
+
+            if (ctx->breakdown != NULL && rcode >= 0)
+                breakdown_source_end(ctx, idx);
+
+            if (stream)
+                preload_stream_release(ctx, idx, 2);
         }
     }
+
+    /* on abort the loader may still be running */
+    preload_stream_wait(&ps);
+
     if (rcode < 0) {
         ctx->running = false;
         return -1;
@@ -98,6 +194,133 @@ tcpr_replay_index(tcpreplay_t *ctx)
     return rcode;
 }
 
+/**
+ * \brief preload any of the given sources which aren't cached yet
+ *
+ * Streamed files are freed once sent.  They may be loaded while another
+ * file is being sent, so their flow stats are left to the send loop
+ */
+static void
+preload_stream_load(tcpreplay_t *ctx, int first, int cnt, bool streamed)
+{
+    int idx;
+
+    for (idx = first; idx < first + cnt && idx < ctx->options->source_cnt; idx++) {
+        file_cache_t *file_cache = &ctx->options->file_cache[idx];
+
+        if (file_cache->cached || ctx->options->sources[idx].type != source_filename)
+            continue;
+
+        file_cache->index = idx;
+        file_cache->streamed = streamed;
+        preload_pcap_file(ctx, idx);
+    }
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+preload_stream_loader(void *arg)
+{
+    preload_stream_t *ps = arg;
+
+    preload_stream_load(ps->ctx, ps->first, ps->cnt, true);
+    return NULL;
+}
+#endif
+
+/**
+ * \brief start loading the given sources on a background thread
+ *
+ * If the thread can't be started, the files are loaded when they're needed
+ */
+static void
+preload_stream_start(_U_ preload_stream_t *ps, _U_ int first, _U_ int cnt)
+{
+#ifdef HAVE_PTHREAD
+    if (first >= ps->ctx->options->source_cnt)
+        return;
+
+    ps->first = first;
+    ps->cnt = cnt;
+    if (pthread_create(&ps->loader, NULL, preload_stream_loader, ps) == 0)
+        ps->running = true;
+    else
+        warn("Unable to start preload thread");
+#endif
+}
+
+/**
+ * \brief wait for the background loader, if any, to finish
+ */
+static void
+preload_stream_wait(_U_ preload_stream_t *ps)
+{
+#ifdef HAVE_PTHREAD
+    if (ps->running) {
+        pthread_join(ps->loader, NULL);
+        ps->running = false;
+    }
+#endif
+}
+
+/**
+ * \brief free sources which have been sent, they're reloaded on the next pass
+ */
+static void
+preload_stream_release(tcpreplay_t *ctx, int first, int cnt)
+{
+    int idx;
+
+    for (idx = first; idx < first + cnt; idx++) {
+        if (ctx->options->file_cache[idx].streamed) {
+            file_cache_free(&ctx->options->file_cache[idx]);
+            ctx->options->file_cache[idx].streamed = false;
+        }
+    }
+}
+
+/**
+ * \brief open the file of the given source to send from, mapped if
+ * try_mmap is set and it can be
+ *
+ * Returns NULL with the reason in ebuf if the file can't be opened
+ */
+static pkt_source_t *
+open_source(tcpreplay_t *ctx, int idx, bool try_mmap, char *ebuf)
+{
+    pkt_source_t *src;
+
+    if ((src = pkt_source_open(ctx, idx, try_mmap, ebuf)) == NULL)
+        return NULL;
+
+#ifdef HAVE_MMAP
+    if (ctx->options->file_cache[idx].mmap != NULL && ctx->options->file_cache[idx].mmap->snaplen < 65535)
+        warnx("%s was captured using a snaplen of %d bytes.  This may mean you have truncated packets.",
+              ctx->options->sources[idx].filename,
+              ctx->options->file_cache[idx].mmap->snaplen);
+#endif
+
+    slice_open(ctx, idx);
+    return src;
+}
+
+/**
+ * \brief close the source opened by open_source(), if any
+ *
+ * When preloading, the cache keeps referencing the mapping until it is freed
+ */
+static void
+close_source(tcpreplay_t *ctx, int idx)
+{
+    pkt_source_close(ctx->options->file_cache[idx].source);
+#ifdef HAVE_MMAP
+    if (!ctx->options->preload_pcap) {
+        mmap_pcap_close(ctx->options->file_cache[idx].mmap);
+        ctx->options->file_cache[idx].mmap = NULL;
+    }
+#endif
+}
+
 /**
  * \brief replay a pcap file out interface(s)
  *
@@ -108,7 +331,11 @@ replay_file(tcpreplay_t *ctx, int idx)
 {
     char *path;
     pcap_t *pcap = NULL;
+    pkt_source_t *src;
     char ebuf[PCAP_ERRBUF_SIZE];
+#ifdef ENABLE_VERBOSE
+    pcap_t *dump = NULL;
+#endif
 
     assert(ctx);
     assert(ctx->options->sources[idx].type == source_filename);
@@ -116,39 +343,43 @@ replay_file(tcpreplay_t *ctx, int idx)
     path = ctx->options->sources[idx].filename;
 
     /* read from pcap file if we haven't cached things yet */
-    if (!ctx->options->preload_pcap) {
-        if ((pcap = pcap_open_offline(path, ebuf)) == NULL) {
+    if (!ctx->options->preload_pcap || !ctx->options->file_cache[idx].cached) {
+        if ((src = open_source(ctx, idx, !ctx->options->preload_pcap && ctx->options->mmap_pcap, ebuf)) == NULL) {
             tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
             return -1;
         }
+        pcap = src->pcap;
 
-        ctx->options->file_cache[idx].dlt = pcap_datalink(pcap);
-
+        if (!ctx->options->preload_pcap) {
 #ifdef HAVE_PCAP_SNAPSHOT
-        if (pcap_snapshot(pcap) < 65535)
-            warnx("%s was captured using a snaplen of %d bytes.  This may mean you have truncated packets.",
-                  path,
-                  pcap_snapshot(pcap));
+            if (pcap != NULL && pcap_snapshot(pcap) < 65535)
+                warnx("%s was captured using a snaplen of %d bytes.  This may mean you have truncated packets.",
+                      path,
+                      pcap_snapshot(pcap));
 #endif
-
-    } else {
-        if (!ctx->options->file_cache[idx].cached) {
-            if ((pcap = pcap_open_offline(path, ebuf)) == NULL) {
-                tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
-                return -1;
-            }
-            ctx->options->file_cache[idx].dlt = pcap_datalink(pcap);
+            checkpoint_seek(ctx, idx);
+            pkt_source_readahead(src, ctx->options->readahead);
         }
     }
 
 #ifdef ENABLE_VERBOSE
     if (ctx->options->verbose) {
-        /* in cache mode, we may not have opened the file */
-        if (pcap == NULL)
-            if ((pcap = pcap_open_offline(path, ebuf)) == NULL) {
+        /* in cache mode, or when mapped, we may not have opened the file.  A pipe can't be opened twice */
+        if (pcap == NULL) {
+            if (shm_pipe_path(path)) {
+                if ((dump = pcap_open_dead(ctx->options->file_cache[idx].dlt, MAX_SNAPLEN)) == NULL)
+                    strlcpy(ebuf, "Unable to open dead pcap handle", sizeof(ebuf));
+            } else {
+                dump = tcpr_pcap_open_offline(path, ebuf);
+            }
+
+            if (dump == NULL) {
                 tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+                close_source(ctx, idx);
                 return -1;
             }
+            pcap = dump;
+        }
 
         ctx->options->file_cache[idx].dlt = pcap_datalink(pcap);
         /* init tcpdump */
@@ -175,17 +406,58 @@ replay_file(tcpreplay_t *ctx, int idx)
     }
 
     ctx->stats.active_pcap = ctx->options->sources[idx].filename;
-    send_packets(ctx, pcap, idx);
+    if (ctx->options->flow_copies > 1 && ctx->options->file_cache[idx].cached)
+        send_flow_copies(ctx, idx);
+    else
+#ifdef ENABLE_SEND_THREADS
+    if (ctx->options->threads > 1 && ctx->options->file_cache[idx].cached)
+        send_threads_packets(ctx, idx);
+    else
+#endif
+        send_packets(ctx, idx);
 
-    if (pcap != NULL)
-        pcap_close(pcap);
+    close_source(ctx, idx);
 
 #ifdef ENABLE_VERBOSE
+    if (dump != NULL)
+        pcap_close(dump);
     tcpdump_close(ctx->options->tcpdump);
 #endif
     return 0;
 }
 
+/**
+ * \brief replay all the preloaded pcap files at once, weighted by --mix
+ *
+ * Internal to tcpreplay, does the heavy lifting for --mix
+ */
+static int
+replay_mix(tcpreplay_t *ctx)
+{
+    send_source_t sources[MAX_FILES];
+    int idx;
+
+    assert(ctx);
+    assert(ctx->options->mix_cnt == ctx->options->source_cnt);
+
+    memset(sources, 0, sizeof(sources[0]) * ctx->options->source_cnt);
+    for (idx = 0; idx < ctx->options->source_cnt; idx++) {
+        if (ctx->options->sources[idx].type != source_filename || !ctx->options->file_cache[idx].cached) {
+            tcpreplay_seterr(ctx, "%s", "--mix requires preloaded pcap files");
+            return -1;
+        }
+
+        sources[idx].idx = idx;
+        sources[idx].sp = ctx->intf1;
+        sources[idx].weight = ctx->options->mix_weight[idx];
+    }
+
+    ctx->stats.active_pcap = ctx->options->sources[0].filename;
+    send_merged_packets(ctx, sources, ctx->options->source_cnt);
+
+    return 0;
+}
+
 /**
  * \brief replay two pcap files out two interfaces
  *
@@ -196,8 +468,13 @@ replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
 {
     char *path1, *path2;
     pcap_t *pcap1 = NULL, *pcap2 = NULL;
+    pkt_source_t *src1 = NULL, *src2 = NULL;
+    send_source_t sources[2];
     char ebuf[PCAP_ERRBUF_SIZE];
     int rcode = 0;
+#ifdef ENABLE_VERBOSE
+    pcap_t *dump = NULL;
+#endif
 
     assert(ctx);
     assert(ctx->options->sources[idx1].type == source_filename);
@@ -214,34 +491,41 @@ replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
 
     /* read from first pcap file if we haven't cached things yet */
     if (!ctx->options->preload_pcap) {
-        if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
+        if ((src1 = open_source(ctx, idx1, ctx->options->mmap_pcap, ebuf)) == NULL ||
+            (src2 = open_source(ctx, idx2, ctx->options->mmap_pcap, ebuf)) == NULL) {
+            close_source(ctx, idx1);
             tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
             return -1;
         }
-        ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
-        if ((pcap2 = pcap_open_offline(path2, ebuf)) == NULL) {
-            tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
-            return -1;
-        }
-        ctx->options->file_cache[idx2].dlt = pcap_datalink(pcap2);
-    } else {
-        if (!ctx->options->file_cache[idx1].cached) {
-            if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
+
+        /* the two are either both mapped or both read via libpcap */
+        if ((src1->pcap == NULL) != (src2->pcap == NULL)) {
+            close_source(ctx, idx1);
+            close_source(ctx, idx2);
+            if ((src1 = open_source(ctx, idx1, false, ebuf)) == NULL ||
+                (src2 = open_source(ctx, idx2, false, ebuf)) == NULL) {
+                close_source(ctx, idx1);
                 tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
                 return -1;
             }
-            ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
         }
-        if (!ctx->options->file_cache[idx2].cached) {
-            if ((pcap2 = pcap_open_offline(path2, ebuf)) == NULL) {
-                tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
-                return -1;
-            }
-            ctx->options->file_cache[idx2].dlt = pcap_datalink(pcap2);
+        pkt_source_readahead(src1, ctx->options->readahead);
+        pkt_source_readahead(src2, ctx->options->readahead);
+    } else {
+        if (!ctx->options->file_cache[idx1].cached && (src1 = open_source(ctx, idx1, false, ebuf)) == NULL) {
+            tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+            return -1;
+        }
+        if (!ctx->options->file_cache[idx2].cached && (src2 = open_source(ctx, idx2, false, ebuf)) == NULL) {
+            close_source(ctx, idx1);
+            tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+            return -1;
         }
     }
+    pcap1 = src1 != NULL ? src1->pcap : NULL;
+    pcap2 = src2 != NULL ? src2->pcap : NULL;
 
-    if (pcap1 != NULL) {
+    if (pcap1 != NULL && pcap2 != NULL) {
 #ifdef HAVE_PCAP_SNAPSHOT
         if (pcap_snapshot(pcap1) < 65535) {
             tcpreplay_setwarn(ctx,
@@ -285,6 +569,8 @@ replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
 
         if (ctx->intf1dlt != ctx->intf2dlt) {
             tcpreplay_seterr(ctx, "DLT mismatch for %s (%d) and %s (%d)", path1, ctx->intf1dlt, path2, ctx->intf2dlt);
+            close_source(ctx, idx1);
+            close_source(ctx, idx2);
             return -1;
         }
     }
@@ -293,10 +579,13 @@ replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
     if (ctx->options->verbose) {
         /* in cache mode, we may not have opened the file */
         if (pcap1 == NULL) {
-            if ((pcap1 = pcap_open_offline(path1, ebuf)) == NULL) {
+            if ((dump = tcpr_pcap_open_offline(path1, ebuf)) == NULL) {
                 tcpreplay_seterr(ctx, "Error opening pcap file: %s", ebuf);
+                close_source(ctx, idx1);
+                close_source(ctx, idx2);
                 return -1;
             }
+            pcap1 = dump;
             ctx->options->file_cache[idx1].dlt = pcap_datalink(pcap1);
         }
         /* init tcpdump */
@@ -304,15 +593,19 @@ replay_two_files(tcpreplay_t *ctx, int idx1, int idx2)
     }
 #endif
 
-    send_dual_packets(ctx, pcap1, idx1, pcap2, idx2);
-
-    if (pcap1 != NULL)
-        pcap_close(pcap1);
+    memset(sources, 0, sizeof(sources));
+    sources[0].idx = idx1;
+    sources[0].sp = ctx->intf1;
+    sources[1].idx = idx2;
+    sources[1].sp = ctx->intf2;
+    send_merged_packets(ctx, sources, 2);
 
-    if (pcap2 != NULL)
-        pcap_close(pcap2);
+    close_source(ctx, idx1);
+    close_source(ctx, idx2);
 
 #ifdef ENABLE_VERBOSE
+    if (dump != NULL)
+        pcap_close(dump);
     tcpdump_close(ctx->options->tcpdump);
 #endif
 
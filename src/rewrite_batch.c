@@ -0,0 +1,893 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tcprewrite --batch: rewrite every file of a directory or list with the
+ * same options, in parallel.
+ *
+ * Each file becomes one job, or several when it is larger than the chunk
+ * size and has a pcap_index: the index gives the offset of a record every
+ * so many packets, so a worker can seek straight to its piece.  The jobs
+ * are dealt out largest first to the worker with the least work so far,
+ * each into its own deque.  A worker takes jobs from the front of its
+ * own deque and, once it is empty, steals from the back of the busiest
+ * one, so the guesses the dealing was based on even out at the end.
+ *
+ * Workers keep a tcpedit_t for every DLT they have seen, reused from one
+ * file to the next.  The first piece of a file is written to its output,
+ * later pieces to temporary files which whoever finishes the last piece
+ * appends to it.  Packets are numbered as in their whole file, which is
+ * all --fuzz-seed needs to fuzz a piece as it would the whole file.
+ */
+
+#include "rewrite_batch.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "tcprewrite_opts.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef ENABLE_REWRITE_THREADS
+#include <pthread.h>
+
+#define BATCH_COPY_SIZE (64 * 1024) /* bytes copied at a time when joining pieces */
+
+extern tcprewrite_opt_t options;
+
+typedef struct batch_file_s {
+    char *infile;
+    char *outfile;
+    u_int64_t size;
+    int parts;      /* jobs the file was split into */
+    int parts_left; /* under the lock of the batch */
+    bool failed;    /* likewise */
+} batch_file_t;
+
+typedef struct batch_job_s {
+    batch_file_t *file;
+    int part;
+    u_int64_t offset; /* record the job starts at, 0 for the start of the file */
+    COUNTER first;    /* number of that record in the file */
+    COUNTER packets;  /* 0 for the rest of the file */
+    u_int64_t bytes;  /* of the file the job reads */
+} batch_job_t;
+
+/* jobs[head] to jobs[tail - 1] are waiting */
+typedef struct batch_deque_s {
+    pthread_mutex_t lock;
+    batch_job_t **jobs;
+    int head; /* the owner takes from here */
+    int tail; /* other workers take from here */
+    u_int64_t bytes;
+} batch_deque_t;
+
+typedef struct batch_edit_s {
+    int dlt;
+    tcpedit_t *tcpedit;
+} batch_edit_t;
+
+struct batch_state_s;
+
+typedef struct batch_worker_s {
+    struct batch_state_s *rb;
+    int id;
+    pthread_t thread;
+    batch_deque_t deque;
+    batch_edit_t *edits;
+    int edit_cnt;
+    u_char *pktbuf;
+    COUNTER stolen;
+    COUNTER packets;
+} batch_worker_t;
+
+typedef struct batch_state_s {
+    pthread_mutex_t lock; /* the state of the files, building tcpedit_t's */
+    batch_file_t *files;
+    int file_cnt;
+    batch_job_t *jobs;
+    int job_cnt;
+    size_t chunk;
+    bool warned;
+    int failed;
+    int cnt;
+    batch_worker_t workers[MAX_REWRITE_THREADS];
+} batch_state_t;
+
+/**
+ * \brief the output of infile by the template: %b is its basename, %n
+ * the basename without its extension and %% a %
+ */
+static char *
+batch_outfile(const char *template, const char *infile)
+{
+    const char *base, *dot, *t;
+    size_t len, stem, used = 0;
+    char *outfile;
+
+    base = strrchr(infile, '/');
+    base = base != NULL ? base + 1 : infile;
+    dot = strrchr(base, '.');
+    stem = dot != NULL && dot != base ? (size_t)(dot - base) : strlen(base);
+
+    len = strlen(template) + 1;
+    for (t = template; *t != '\0'; t++) {
+        if (*t == '%')
+            len += strlen(base);
+    }
+
+    outfile = (char *)safe_malloc(len);
+    for (t = template; *t != '\0'; t++) {
+        if (*t != '%') {
+            outfile[used++] = *t;
+            continue;
+        }
+
+        switch (*++t) {
+        case 'b':
+            memcpy(outfile + used, base, strlen(base));
+            used += strlen(base);
+            break;
+        case 'n':
+            memcpy(outfile + used, base, stem);
+            used += stem;
+            break;
+        case '%':
+            outfile[used++] = '%';
+            break;
+        default:
+            errx(-1, "Unknown %%%c in --outfile: %s", *t == '\0' ? ' ' : *t, template);
+        }
+    }
+
+    outfile[used] = '\0';
+    return outfile;
+}
+
+/**
+ * \brief queue an input file
+ */
+static void
+batch_add_file(batch_state_t *rb, const char *infile, const char *template)
+{
+    batch_file_t *file;
+    struct stat st;
+
+    rb->files = (batch_file_t *)safe_realloc(rb->files, (rb->file_cnt + 1) * sizeof(batch_file_t));
+    file = &rb->files[rb->file_cnt++];
+    memset(file, 0, sizeof(*file));
+    file->infile = safe_strdup(infile);
+    file->outfile = batch_outfile(template, infile);
+
+    if (remote_is_url(infile))
+        return;
+
+    if (stat(infile, &st) < 0)
+        errx(-1, "Unable to read %s: %s", infile, strerror(errno));
+    file->size = (u_int64_t)st.st_size;
+}
+
+static int
+batch_name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * \brief queue every regular file of dir in name order, leaving out hidden
+ * files and pcap index sidecars
+ */
+static void
+batch_read_dir(batch_state_t *rb, const char *dir, const char *template)
+{
+    size_t suffix = strlen(PCAP_INDEX_SUFFIX);
+    char **names = NULL;
+    struct dirent *ent;
+    int cnt = 0, i;
+    DIR *dp;
+
+    if ((dp = opendir(dir)) == NULL)
+        errx(-1, "Unable to open %s: %s", dir, strerror(errno));
+
+    while ((ent = readdir(dp)) != NULL) {
+        size_t len = strlen(ent->d_name);
+        struct stat st;
+        char *path;
+
+        if (ent->d_name[0] == '.' || (len > suffix && strcmp(ent->d_name + len - suffix, PCAP_INDEX_SUFFIX) == 0))
+            continue;
+
+        path = (char *)safe_malloc(strlen(dir) + len + 2);
+        sprintf(path, "%s/%s", dir, ent->d_name);
+        if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+            safe_free(path);
+            continue;
+        }
+
+        names = (char **)safe_realloc(names, (cnt + 1) * sizeof(char *));
+        names[cnt++] = path;
+    }
+    closedir(dp);
+
+    qsort(names, cnt, sizeof(char *), batch_name_cmp);
+    for (i = 0; i < cnt; i++) {
+        batch_add_file(rb, names[i], template);
+        safe_free(names[i]);
+    }
+    safe_free(names);
+}
+
+/**
+ * \brief queue the files named in list, one per line.  Blank lines and
+ * lines starting with # are skipped, and - reads the list from stdin
+ */
+static void
+batch_read_list(batch_state_t *rb, const char *list, const char *template)
+{
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    FILE *fp;
+
+    if (strcmp(list, "-") == 0) {
+        fp = stdin;
+    } else if ((fp = fopen(list, "r")) == NULL) {
+        errx(-1, "Unable to open %s: %s", list, strerror(errno));
+    }
+
+    while ((len = getline(&line, &size, fp)) >= 0) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '))
+            line[--len] = '\0';
+
+        if (len > 0 && line[0] != '#')
+            batch_add_file(rb, line, template);
+    }
+
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+}
+
+/**
+ * \brief two inputs written to the same file, or an input to itself, would
+ * lose packets
+ */
+static void
+batch_check_outfiles(batch_state_t *rb)
+{
+    char **names;
+    int i;
+
+    names = (char **)safe_malloc(rb->file_cnt * sizeof(char *));
+    for (i = 0; i < rb->file_cnt; i++) {
+        if (strcmp(rb->files[i].infile, rb->files[i].outfile) == 0)
+            errx(-1, "%s would be written over itself, check --outfile", rb->files[i].infile);
+        names[i] = rb->files[i].outfile;
+    }
+
+    qsort(names, rb->file_cnt, sizeof(char *), batch_name_cmp);
+    for (i = 1; i < rb->file_cnt; i++) {
+        if (strcmp(names[i - 1], names[i]) == 0)
+            errx(-1, "More than one input would be written to %s, check --outfile", names[i]);
+    }
+
+    safe_free(names);
+}
+
+static void
+batch_add_job(batch_state_t *rb, batch_file_t *file, u_int64_t offset, COUNTER first, COUNTER packets, u_int64_t bytes)
+{
+    batch_job_t *job;
+
+    rb->jobs = (batch_job_t *)safe_realloc(rb->jobs, (rb->job_cnt + 1) * sizeof(batch_job_t));
+    job = &rb->jobs[rb->job_cnt++];
+    job->file = file;
+    job->part = file->parts++;
+    job->offset = offset;
+    job->first = first;
+    job->packets = packets;
+    job->bytes = bytes;
+    file->parts_left = file->parts;
+}
+
+/**
+ * \brief split a file into pieces of about rb->chunk bytes at the records of
+ * its index, or make it a single job when it is small or has no index
+ */
+static void
+batch_plan_file(batch_state_t *rb, batch_file_t *file)
+{
+    pcap_index_t *index = NULL;
+    u_int64_t offset = 0;
+    COUNTER first = 0;
+    COUNTER i;
+
+    if (file->size > rb->chunk && decompress_detect(file->infile) == DECOMPRESS_NONE)
+        index = pcap_index_load(file->infile);
+
+    if (index != NULL) {
+        for (i = 0; i < index->num_entries; i++) {
+            const pcap_index_entry_t *entry = &index->entries[i];
+
+            /* don't leave a piece much smaller than the others at the end */
+            if (entry->offset - offset < rb->chunk || file->size - entry->offset < rb->chunk / 2)
+                continue;
+
+            batch_add_job(rb, file, offset, first, entry->packet - first, entry->offset - offset);
+            offset = entry->offset;
+            first = entry->packet;
+        }
+        pcap_index_free(index);
+    }
+
+    batch_add_job(rb, file, offset, first, 0, file->size - offset);
+}
+
+static int
+batch_job_cmp(const void *a, const void *b)
+{
+    const batch_job_t *ja = *(batch_job_t *const *)a;
+    const batch_job_t *jb = *(batch_job_t *const *)b;
+
+    if (ja->bytes != jb->bytes)
+        return ja->bytes > jb->bytes ? -1 : 1;
+    return ja < jb ? -1 : ja > jb;
+}
+
+/**
+ * \brief deal the jobs out, largest first, to the worker with the fewest
+ * bytes to get through so far
+ */
+static void
+batch_deal(batch_state_t *rb)
+{
+    batch_job_t **jobs;
+    int i, j;
+
+    jobs = (batch_job_t **)safe_malloc(rb->job_cnt * sizeof(batch_job_t *));
+    for (i = 0; i < rb->job_cnt; i++)
+        jobs[i] = &rb->jobs[i];
+    qsort(jobs, rb->job_cnt, sizeof(batch_job_t *), batch_job_cmp);
+
+    for (i = 0; i < rb->cnt; i++)
+        rb->workers[i].deque.jobs = (batch_job_t **)safe_malloc(rb->job_cnt * sizeof(batch_job_t *));
+
+    for (i = 0; i < rb->job_cnt; i++) {
+        batch_deque_t *least = &rb->workers[0].deque;
+
+        for (j = 1; j < rb->cnt; j++) {
+            if (rb->workers[j].deque.bytes < least->bytes)
+                least = &rb->workers[j].deque;
+        }
+
+        least->jobs[least->tail++] = jobs[i];
+        least->bytes += jobs[i]->bytes;
+    }
+
+    safe_free(jobs);
+}
+
+/**
+ * \brief the next job of w: the front of its own deque, else the back of
+ * the deque with the most bytes left.  NULL once every deque is empty
+ */
+static batch_job_t *
+batch_take(batch_worker_t *w)
+{
+    batch_state_t *rb = w->rb;
+    batch_deque_t *d = &w->deque;
+    batch_job_t *job = NULL;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->head < d->tail) {
+        job = d->jobs[d->head++];
+        __atomic_store_n(&d->bytes, d->bytes - job->bytes, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&d->lock);
+
+    while (job == NULL) {
+        batch_deque_t *victim = NULL;
+        u_int64_t most = 0;
+        bool waiting = false;
+        int i;
+
+        for (i = 0; i < rb->cnt; i++) {
+            batch_deque_t *v = &rb->workers[i].deque;
+            u_int64_t bytes;
+
+            if (v == d || __atomic_load_n(&v->head, __ATOMIC_RELAXED) >= __atomic_load_n(&v->tail, __ATOMIC_RELAXED))
+                continue;
+
+            waiting = true;
+            bytes = __atomic_load_n(&v->bytes, __ATOMIC_RELAXED);
+            if (victim == NULL || bytes > most) {
+                victim = v;
+                most = bytes;
+            }
+        }
+
+        if (!waiting)
+            return NULL;
+
+        pthread_mutex_lock(&victim->lock);
+        if (victim->head < victim->tail) {
+            job = victim->jobs[--victim->tail];
+            __atomic_store_n(&victim->bytes, victim->bytes - job->bytes, __ATOMIC_RELAXED);
+            w->stolen++;
+        }
+        pthread_mutex_unlock(&victim->lock);
+    }
+
+    return job;
+}
+
+/**
+ * \brief the tcpedit_t of w for packets of the given DLT, built the first
+ * time one is needed
+ */
+static tcpedit_t *
+batch_tcpedit(batch_worker_t *w, int dlt, const char *infile)
+{
+    batch_state_t *rb = w->rb;
+    tcpedit_t *tcpedit = NULL;
+    int i, rcode;
+
+    for (i = 0; i < w->edit_cnt; i++) {
+        if (w->edits[i].dlt == dlt)
+            return w->edits[i].tcpedit;
+    }
+
+    /* the options are parsed from the same globals by every thread */
+    pthread_mutex_lock(&rb->lock);
+    if (tcpedit_init(&tcpedit, dlt) < 0) {
+        warnx("Error initializing tcpedit for %s: %s", infile, tcpedit_geterr(tcpedit));
+        goto fail;
+    }
+
+    if ((rcode = tcpedit_post_args(tcpedit)) < 0) {
+        warnx("Unable to parse args for %s: %s", infile, tcpedit_geterr(tcpedit));
+        goto fail;
+    } else if (rcode == 1 && !rb->warned) {
+        warnx("%s", tcpedit_geterr(tcpedit));
+        rb->warned = true;
+    }
+
+    if (tcpedit_validate(tcpedit) < 0) {
+        warnx("Unable to edit packets of %s given options:\n%s", infile, tcpedit_geterr(tcpedit));
+        goto fail;
+    }
+    pthread_mutex_unlock(&rb->lock);
+
+    w->edits = (batch_edit_t *)safe_realloc(w->edits, (w->edit_cnt + 1) * sizeof(batch_edit_t));
+    w->edits[w->edit_cnt].dlt = dlt;
+    w->edits[w->edit_cnt].tcpedit = tcpedit;
+    w->edit_cnt++;
+
+    return tcpedit;
+
+fail:
+    pthread_mutex_unlock(&rb->lock);
+    if (tcpedit != NULL)
+        tcpedit_close(&tcpedit);
+    return NULL;
+}
+
+/**
+ * \brief where a piece of a file is written: the output itself for the
+ * first one, a temporary file next to it for the others
+ */
+static char *
+batch_part_path(const batch_file_t *file, int part)
+{
+    size_t len = strlen(file->outfile) + 32;
+    char *path = (char *)safe_malloc(len);
+
+    if (part == 0)
+        snprintf(path, len, "%s", file->outfile);
+    else
+        snprintf(path, len, "%s.part%d.tmp", file->outfile, part);
+
+    return path;
+}
+
+/**
+ * \brief open output->filename, buffered if --write-buffer is set
+ */
+static int
+batch_open_output(tcprewrite_output_t *output, int dlt)
+{
+    pcap_t *dlt_pcap;
+
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    if (options.write_buffer > 0) {
+        char ebuf[PCAP_ERRBUF_SIZE];
+
+        if ((output->pwriter = pcap_writer_open(output->filename, dlt, 65535, options.write_buffer, ebuf)) == NULL) {
+            warnx("Unable to open output pcap file: %s", ebuf);
+            return -1;
+        }
+
+        return 0;
+    }
+#endif
+
+    if ((dlt_pcap = pcap_open_dead(dlt, 65535)) == NULL) {
+        warnx("%s", "Unable to open dead pcap handle.");
+        return -1;
+    }
+
+    if ((output->pout = pcap_dump_open(dlt_pcap, output->filename)) == NULL) {
+        warnx("Unable to open output pcap file: %s", pcap_geterr(dlt_pcap));
+        pcap_close(dlt_pcap);
+        return -1;
+    }
+
+    pcap_close(dlt_pcap);
+    return 0;
+}
+
+static int
+batch_dump(tcprewrite_output_t *output, struct pcap_pkthdr *pkthdr, const u_char *pktdata)
+{
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    if (output->pwriter != NULL) {
+        if (pcap_writer_write(output->pwriter, pkthdr, pktdata) < 0) {
+            warnx("%s", pcap_writer_geterr(output->pwriter));
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    pcap_dump((u_char *)output->pout, pkthdr, pktdata);
+    return 0;
+}
+
+static int
+batch_close_output(tcprewrite_output_t *output)
+{
+    int ret = 0;
+
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    if (output->pwriter != NULL) {
+        if (pcap_writer_flush(output->pwriter) < 0) {
+            warnx("%s", pcap_writer_geterr(output->pwriter));
+            ret = -1;
+        }
+        pcap_writer_close(output->pwriter);
+        output->pwriter = NULL;
+    }
+#endif
+
+    if (output->pout != NULL) {
+        pcap_dump_close(output->pout);
+        output->pout = NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * \brief rewrite the packets of a job into its piece of the output
+ */
+static int
+batch_run_job(batch_worker_t *w, batch_job_t *job)
+{
+    batch_file_t *file = job->file;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    tcprewrite_output_t output;
+    struct pcap_pkthdr pkthdr, *pkthdr_ptr;
+    const u_char *pktconst;
+    u_char **pktdata;
+    tcpedit_t *tcpedit;
+    COUNTER packetnum = job->first;
+    pcap_t *pin;
+    int rcode, ret = -1;
+
+    memset(&output, 0, sizeof(output));
+
+    /* libpcap reads records straight from its FILE, so we can seek to one */
+    if (job->offset == 0)
+        pin = tcpr_pcap_open_offline(file->infile, ebuf);
+    else
+        pin = pcap_open_offline(file->infile, ebuf);
+
+    if (pin == NULL) {
+        warnx("Unable to open input pcap file: %s", ebuf);
+        return -1;
+    }
+
+    if (job->offset > 0 && fseeko(pcap_file(pin), (off_t)job->offset, SEEK_SET) != 0) {
+        warnx("Unable to seek in %s: %s", file->infile, strerror(errno));
+        goto done;
+    }
+
+    if ((tcpedit = batch_tcpedit(w, pcap_datalink(pin), file->infile)) == NULL)
+        goto done;
+
+    output.filename = batch_part_path(file, job->part);
+    if (batch_open_output(&output, tcpedit_get_output_dlt(tcpedit)) < 0)
+        goto done;
+
+    /* as rewrite_packets(), edit a copy of libpcap's read only buffer */
+    if (w->pktbuf == NULL)
+        w->pktbuf = (u_char *)safe_malloc(MAXPACKET);
+    pktdata = &w->pktbuf;
+
+    while ((job->packets == 0 || packetnum < job->first + job->packets) &&
+           (pktconst = safe_pcap_next(pin, &pkthdr)) != NULL) {
+        if (pkthdr.caplen > MAX_SNAPLEN) {
+            warnx("%s: frame too big, caplen %d exceeds %d", file->infile, pkthdr.caplen, MAX_SNAPLEN);
+            goto done;
+        }
+
+        memcpy(*pktdata, pktconst, pkthdr.caplen);
+
+        pkthdr_ptr = &pkthdr;
+        tcpedit->runtime.packetnum = packetnum++;
+        if ((rcode = tcpedit_packet(tcpedit, &pkthdr_ptr, pktdata, TCPR_DIR_C2S)) == TCPEDIT_ERROR) {
+            warnx("Error rewriting %s: %s", file->infile, tcpedit_geterr(tcpedit));
+            goto done;
+        } else if (rcode == TCPEDIT_SOFT_ERROR && HAVE_OPT(SKIP_SOFT_ERRORS)) {
+            continue;
+        }
+
+        if (pkthdr_ptr->caplen && batch_dump(&output, pkthdr_ptr, *pktdata) < 0)
+            goto done;
+    }
+
+    if (job->packets != 0 && packetnum != job->first + job->packets) {
+        warnx("%s changed while it was being read", file->infile);
+        goto done;
+    }
+
+    w->packets += packetnum - job->first;
+    ret = 0;
+
+done:
+    if (batch_close_output(&output) < 0)
+        ret = -1;
+    safe_free(output.filename);
+    pcap_close(pin);
+
+    return ret;
+}
+
+/**
+ * \brief append the records of every later piece of file to its output and
+ * remove them
+ */
+static int
+batch_join(batch_file_t *file)
+{
+    u_char *buf;
+    FILE *out;
+    int part, ret = 0;
+
+    if (file->parts == 1)
+        return 0;
+
+    if ((out = fopen(file->outfile, "ab")) == NULL) {
+        warnx("Unable to open %s: %s", file->outfile, strerror(errno));
+        return -1;
+    }
+
+    buf = (u_char *)safe_malloc(BATCH_COPY_SIZE);
+    for (part = 1; part < file->parts && ret == 0; part++) {
+        char *path = batch_part_path(file, part);
+        FILE *in;
+        size_t len;
+
+        if ((in = fopen(path, "rb")) == NULL || fseeko(in, sizeof(struct pcap_file_header), SEEK_SET) != 0) {
+            warnx("Unable to read %s: %s", path, strerror(errno));
+            ret = -1;
+        } else {
+            while ((len = fread(buf, 1, BATCH_COPY_SIZE, in)) > 0) {
+                if (fwrite(buf, 1, len, out) != len) {
+                    warnx("Unable to write %s: %s", file->outfile, strerror(errno));
+                    ret = -1;
+                    break;
+                }
+            }
+        }
+
+        if (in != NULL)
+            fclose(in);
+        unlink(path);
+        safe_free(path);
+    }
+
+    safe_free(buf);
+    if (fclose(out) != 0 && ret == 0) {
+        warnx("Unable to write %s: %s", file->outfile, strerror(errno));
+        ret = -1;
+    }
+
+    return ret;
+}
+
+/**
+ * \brief remove whatever was written for a file which failed
+ */
+static void
+batch_discard(batch_file_t *file)
+{
+    int part;
+
+    for (part = 0; part < file->parts; part++) {
+        char *path = batch_part_path(file, part);
+
+        unlink(path);
+        safe_free(path);
+    }
+}
+
+/**
+ * \brief account for a finished job, putting its file together after the
+ * last piece
+ */
+static void
+batch_finish_job(batch_state_t *rb, batch_job_t *job, bool ok)
+{
+    batch_file_t *file = job->file;
+    bool failed;
+    int left;
+
+    pthread_mutex_lock(&rb->lock);
+    if (!ok)
+        file->failed = true;
+    left = --file->parts_left;
+    failed = file->failed;
+    pthread_mutex_unlock(&rb->lock);
+
+    if (left > 0)
+        return;
+
+    if (!failed && batch_join(file) < 0)
+        failed = true;
+
+    if (failed) {
+        batch_discard(file);
+        pthread_mutex_lock(&rb->lock);
+        rb->failed++;
+        pthread_mutex_unlock(&rb->lock);
+    }
+}
+
+static void *
+batch_worker(void *arg)
+{
+    batch_worker_t *w = (batch_worker_t *)arg;
+    batch_state_t *rb = w->rb;
+    batch_job_t *job;
+
+    while ((job = batch_take(w)) != NULL) {
+        bool failed;
+
+        /* no point in the rest of a file once a piece of it failed */
+        pthread_mutex_lock(&rb->lock);
+        failed = job->file->failed;
+        pthread_mutex_unlock(&rb->lock);
+
+        dbgx(1, "Thread %d: %s piece %d", w->id, job->file->infile, job->part);
+        batch_finish_job(rb, job, !failed && batch_run_job(w, job) == 0);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief rewrite every file of the directory, or named by the list, source
+ * into the files named by template, on the given number of threads.  Files
+ * larger than chunk bytes with an index are split between threads.
+ *
+ * Returns 0 if every file was rewritten, otherwise -1 with the reason for
+ * each file that failed printed.
+ */
+int
+rewrite_batch_files(const char *source, const char *template, int threads, size_t chunk)
+{
+    batch_state_t *rb;
+    COUNTER packets = 0, stolen = 0;
+    struct stat st;
+    int started, i, j, ret = 0;
+
+    assert(source);
+    assert(template);
+    assert(threads > 0 && threads <= MAX_REWRITE_THREADS);
+
+    if (strstr(template, "%b") == NULL && strstr(template, "%n") == NULL)
+        errx(-1, "--outfile needs %%b or %%n with --batch: %s", template);
+
+    rb = (batch_state_t *)safe_malloc(sizeof(*rb));
+    rb->chunk = chunk;
+    pthread_mutex_init(&rb->lock, NULL);
+
+    if (strcmp(source, "-") != 0 && stat(source, &st) == 0 && S_ISDIR(st.st_mode))
+        batch_read_dir(rb, source, template);
+    else
+        batch_read_list(rb, source, template);
+
+    if (rb->file_cnt == 0)
+        errx(-1, "No files to rewrite in %s", source);
+
+    batch_check_outfiles(rb);
+
+    for (i = 0; i < rb->file_cnt; i++)
+        batch_plan_file(rb, &rb->files[i]);
+
+    rb->cnt = threads < rb->job_cnt ? threads : rb->job_cnt;
+    for (i = 0; i < rb->cnt; i++) {
+        rb->workers[i].rb = rb;
+        rb->workers[i].id = i;
+        pthread_mutex_init(&rb->workers[i].deque.lock, NULL);
+    }
+    batch_deal(rb);
+
+    dbgx(1, "Rewriting %d files in %d pieces with %d threads", rb->file_cnt, rb->job_cnt, rb->cnt);
+
+    for (started = 0; started < rb->cnt; started++) {
+        if (pthread_create(&rb->workers[started].thread, NULL, batch_worker, &rb->workers[started]) != 0)
+            errx(-1, "Unable to start rewrite thread %d: %s", started, strerror(errno));
+    }
+
+    for (i = 0; i < started; i++) {
+        batch_worker_t *w = &rb->workers[i];
+
+        pthread_join(w->thread, NULL);
+        packets += w->packets;
+        stolen += w->stolen;
+
+        for (j = 0; j < w->edit_cnt; j++)
+            tcpedit_close(&w->edits[j].tcpedit);
+        safe_free(w->edits);
+        safe_free(w->pktbuf);
+        safe_free(w->deque.jobs);
+        pthread_mutex_destroy(&w->deque.lock);
+    }
+
+    notice("Rewrote %d of %d files, " COUNTER_SPEC " packets in %d pieces on %d threads (" COUNTER_SPEC " stolen)",
+           rb->file_cnt - rb->failed,
+           rb->file_cnt,
+           packets,
+           rb->job_cnt,
+           rb->cnt,
+           stolen);
+
+    if (rb->failed > 0)
+        ret = -1;
+
+    for (i = 0; i < rb->file_cnt; i++) {
+        safe_free(rb->files[i].infile);
+        safe_free(rb->files[i].outfile);
+    }
+    safe_free(rb->files);
+    safe_free(rb->jobs);
+    pthread_mutex_destroy(&rb->lock);
+    safe_free(rb);
+
+    return ret;
+}
+
+#endif /* ENABLE_REWRITE_THREADS */
@@ -0,0 +1,131 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * tcprewrite --in-place.
+ *
+ * When no edit changes the length of a packet, the input file is mapped
+ * shared and writable and each packet is edited in a scratch buffer, then
+ * copied back over the original only if it changed.  Record headers are
+ * never written, so the file only costs the I/O of the pages holding
+ * edited packets.
+ */
+
+#include "rewrite_inplace.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "tcprewrite_opts.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+extern tcprewrite_opt_t options;
+#ifdef ENABLE_VERBOSE
+extern tcpdump_t tcpdump;
+#endif
+
+/**
+ * edit every packet of the pcap file at path in place.  The caller has
+ * checked that the edits never change a packet's length.  Returns 0,
+ * TCPEDIT_ERROR, or REWRITE_INPLACE_UNSUPPORTED if the file can't be
+ * mapped (compressed, not a regular file...) and has not been touched
+ */
+int
+rewrite_inplace_packets(_U_ tcpedit_t *tcpedit_ctx, _U_ const char *path)
+{
+#ifdef HAVE_MMAP
+    tcpr_dir_t cache_result = TCPR_DIR_C2S; /* default to primary */
+    struct pcap_pkthdr pkthdr, *pkthdr_ptr;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    COUNTER packetnum = 0, edited = 0;
+    u_char *pktdata, *packet;
+    u_char *pktdata_buff;
+    mmap_pcap_t *mp;
+    int rcode = 0;
+
+    if (decompress_detect(path) != DECOMPRESS_NONE) {
+        dbgx(1, "Unable to edit %s in place: it is compressed", path);
+        return REWRITE_INPLACE_UNSUPPORTED;
+    }
+
+    if ((mp = mmap_pcap_open_rw(path, ebuf)) == NULL) {
+        dbgx(1, "Unable to edit %s in place: %s", path, ebuf);
+        return REWRITE_INPLACE_UNSUPPORTED;
+    }
+
+    pktdata_buff = (u_char *)safe_malloc(MAXPACKET);
+
+    while ((packet = mmap_pcap_next(mp, &pkthdr)) != NULL) {
+        u_int32_t caplen = pkthdr.caplen, len = pkthdr.len;
+
+        packetnum++;
+        dbgx(2, "packet " COUNTER_SPEC " caplen %d", packetnum, pkthdr.caplen);
+
+        /* Dual nic processing? */
+        if (options.cachedata != NULL)
+            cache_result = check_cache(options.cachedata, packetnum);
+
+        /* packets we would not send are written unedited */
+        if (cache_result == TCPR_DIR_NOSEND)
+            continue;
+
+        memcpy(pktdata_buff, packet, caplen);
+        pktdata = pktdata_buff;
+        pkthdr_ptr = &pkthdr;
+
+        tcpedit_ctx->runtime.packetnum = packetnum - 1;
+        if ((rcode = tcpedit_packet(tcpedit_ctx, &pkthdr_ptr, &pktdata, cache_result)) == TCPEDIT_ERROR)
+            break;
+
+        rcode = 0;
+        if (pkthdr_ptr->caplen != caplen || pkthdr_ptr->len != len)
+            errx(-1,
+                 "Packet " COUNTER_SPEC " of %s changed length from %u to %u while editing in place",
+                 packetnum,
+                 path,
+                 caplen,
+                 pkthdr_ptr->caplen);
+
+        /* only dirty the pages of packets that changed */
+        if (memcmp(packet, pktdata, caplen) != 0) {
+            memcpy(packet, pktdata, caplen);
+            edited++;
+        }
+
+#ifdef ENABLE_VERBOSE
+        if (options.verbose)
+            tcpdump_print(&tcpdump, pkthdr_ptr, pktdata);
+#endif
+    }
+
+    if (msync(mp->base, mp->size, MS_SYNC) < 0)
+        warnx("Unable to sync %s: %s", path, strerror(errno));
+    mmap_pcap_close(mp);
+    safe_free(pktdata_buff);
+
+    dbgx(1, "Edited " COUNTER_SPEC " of " COUNTER_SPEC " packets in place", edited, packetnum);
+    return rcode;
+#else
+    return REWRITE_INPLACE_UNSUPPORTED;
+#endif
+}
@@ -0,0 +1,601 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * tcprewrite --sort: write packets in timestamp order with bounded memory.
+ *
+ * Packets are read into an arena of --sort-memory bytes, records growing
+ * up from the bottom and pointers to them down from the top.  Once full,
+ * the pointers are split into one slice per thread, each slice sorted by
+ * its own thread, and the slices merged into a run file in the temporary
+ * directory.  At the end of the input, up to SORT_MERGE_WAY runs at a time
+ * are merged until one pass over them can write the output, so any size
+ * of capture sorts with a fixed number of open files.  A capture that fits
+ * in memory never touches the disk.
+ *
+ * Packets with the same timestamp stay in the order they were read: a
+ * slice breaks ties by where the record sits in the arena, which is the
+ * read order, and a merge of runs by run number, as consecutive runs are
+ * always merged together.
+ *
+ * Editing happens on the way out of the last merge, so the editor sees
+ * the packets in their new order.
+ */
+
+#include "rewrite_sort.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "tcprewrite_opts.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef ENABLE_REWRITE_SORT
+
+#define SORT_MERGE_WAY 64         /* most runs open at once */
+#define SORT_MIN_SLICE 4096       /* fewest packets worth a thread of their own */
+#define SORT_MAX_THREADS 64
+#define SORT_DEDUP_WINDOW 256     /* packets --sort-dedup looks back over */
+
+extern tcprewrite_opt_t options;
+
+/* a packet in the arena, its data follows */
+typedef struct sort_rec_s {
+    u_int64_t key; /* timestamp in usec */
+    struct pcap_pkthdr pkthdr;
+} sort_rec_t;
+
+/* one input of a merge: a sorted slice of the arena, or a run file */
+typedef struct sort_src_s {
+    sort_rec_t **recs;
+    size_t pos;
+    size_t end;
+    pcap_t *pcap;
+    /* current packet */
+    u_int64_t key;
+    u_int64_t tie; /* orders packets with the same key */
+    struct pcap_pkthdr pkthdr;
+    const u_char *pktdata;
+} sort_src_t;
+
+/* a packet recently written, for --sort-dedup */
+typedef struct sort_dedup_s {
+    u_int64_t key;
+    u_int64_t hash;
+    u_int32_t caplen;
+    u_int32_t len;
+} sort_dedup_t;
+
+typedef struct rewrite_sort_s {
+    tcpedit_t *tcpedit;
+    pcap_dumper_t *pout;
+    int dlt;
+    int threads;
+
+    u_char *arena;
+    size_t size;
+    size_t used;        /* bytes of records */
+    sort_rec_t **ptrs;  /* first pointer, array runs to the end of the arena */
+    size_t nrecs;
+
+    char **runs;
+    int nruns;
+    int runs_written;
+    pcap_writer_t *run_out; /* the run being written, NULL for the output */
+
+    sort_dedup_t dedup[SORT_DEDUP_WINDOW];
+    int dedup_cnt;
+    int dedup_next;
+    u_char *pktdata_buff;
+
+    u_int64_t last_key;
+    COUNTER packets;
+    COUNTER backwards; /* read earlier than the packet before them */
+    COUNTER fixed;
+    COUNTER duplicates;
+    COUNTER written;
+} rewrite_sort_t;
+
+#ifdef HAVE_PTHREAD
+typedef struct sort_slice_s {
+    sort_rec_t **recs;
+    size_t cnt;
+    pthread_t thread;
+} sort_slice_t;
+#endif
+
+static int
+sort_rec_cmp(const void *a, const void *b)
+{
+    const sort_rec_t *x = *(sort_rec_t *const *)a;
+    const sort_rec_t *y = *(sort_rec_t *const *)b;
+
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+
+    /* records are laid out in the order they were read */
+    return x < y ? -1 : (x > y);
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+sort_slice(void *arg)
+{
+    sort_slice_t *slice = arg;
+
+    qsort(slice->recs, slice->cnt, sizeof(sort_rec_t *), sort_rec_cmp);
+    return NULL;
+}
+#endif
+
+static inline u_int64_t
+sort_key(const struct pcap_pkthdr *pkthdr)
+{
+    return (u_int64_t)pkthdr->ts.tv_sec * 1000000 + (u_int64_t)pkthdr->ts.tv_usec;
+}
+
+/**
+ * \brief FNV-1a of the packet data, for --sort-dedup
+ */
+static u_int64_t
+sort_hash(const u_char *data, u_int32_t len)
+{
+    u_int64_t hash = 0xcbf29ce484222325ULL;
+    u_int32_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * \brief was the same packet written within --sort-dedup usec before this one?
+ */
+static bool
+sort_is_duplicate(rewrite_sort_t *s, const struct pcap_pkthdr *pkthdr, const u_char *pktdata, u_int64_t key)
+{
+    u_int64_t hash = sort_hash(pktdata, pkthdr->caplen);
+    sort_dedup_t *d;
+    int i;
+
+    /* newest first, packets come out in order so older ones are out of the window */
+    for (i = 1; i <= s->dedup_cnt; i++) {
+        d = &s->dedup[(s->dedup_next - i + SORT_DEDUP_WINDOW) % SORT_DEDUP_WINDOW];
+        if (key - d->key > options.sort_dedup_us)
+            break;
+        if (d->hash == hash && d->caplen == pkthdr->caplen && d->len == pkthdr->len)
+            return true;
+    }
+
+    d = &s->dedup[s->dedup_next];
+    d->key = key;
+    d->hash = hash;
+    d->caplen = pkthdr->caplen;
+    d->len = pkthdr->len;
+    s->dedup_next = (s->dedup_next + 1) % SORT_DEDUP_WINDOW;
+    if (s->dedup_cnt < SORT_DEDUP_WINDOW)
+        s->dedup_cnt++;
+
+    return false;
+}
+
+/**
+ * \brief write a packet to the current run, or edit it and write it to the output
+ */
+static int
+sort_emit(rewrite_sort_t *s, const struct pcap_pkthdr *pkthdr, const u_char *pktdata, u_int64_t key)
+{
+    struct pcap_pkthdr hdr, *hdr_ptr = &hdr;
+    u_char **data = &s->pktdata_buff;
+    int rcode;
+
+    if (s->run_out != NULL) {
+        if (pcap_writer_write(s->run_out, pkthdr, pktdata) < 0)
+            errx(-1, "Unable to write sort run: %s", pcap_writer_geterr(s->run_out));
+        return 0;
+    }
+
+    if (options.sort_dedup && sort_is_duplicate(s, pkthdr, pktdata, key)) {
+        s->duplicates++;
+        return 0;
+    }
+
+    /* the editor may grow the packet, so it gets a copy with room to spare */
+    memcpy(&hdr, pkthdr, sizeof(hdr));
+    memcpy(*data, pktdata, hdr.caplen);
+
+    /* number packets as they are written */
+    s->tcpedit->runtime.packetnum = s->written++;
+    if ((rcode = tcpedit_packet(s->tcpedit, &hdr_ptr, data, TCPR_DIR_C2S)) == TCPEDIT_ERROR) {
+        return rcode;
+    } else if (rcode == TCPEDIT_SOFT_ERROR && HAVE_OPT(SKIP_SOFT_ERRORS)) {
+        dbgx(1, "Packet " COUNTER_SPEC " is suppressed from being written due to soft errors", s->written);
+        return 0;
+    }
+
+    tcprewrite_write_packet(s->tcpedit, s->pout, hdr_ptr, *data, TCPR_DIR_C2S, s->written);
+    return 0;
+}
+
+/**
+ * \brief load the next packet of a merge input, false once it is empty
+ */
+static bool
+sort_src_next(sort_src_t *src)
+{
+    if (src->pcap != NULL) {
+        if ((src->pktdata = safe_pcap_next(src->pcap, &src->pkthdr)) == NULL)
+            return false;
+    } else {
+        sort_rec_t *rec;
+
+        if (src->pos == src->end)
+            return false;
+        rec = src->recs[src->pos++];
+        memcpy(&src->pkthdr, &rec->pkthdr, sizeof(src->pkthdr));
+        src->pktdata = (const u_char *)(rec + 1);
+        src->tie = (u_int64_t)(uintptr_t)rec;
+    }
+
+    src->key = sort_key(&src->pkthdr);
+    return true;
+}
+
+static inline bool
+sort_src_less(const sort_src_t *a, const sort_src_t *b)
+{
+    return a->key < b->key || (a->key == b->key && a->tie < b->tie);
+}
+
+static void
+sort_sift_down(sort_src_t **heap, int n, int i)
+{
+    for (;;) {
+        int least = i, l = 2 * i + 1, r = 2 * i + 2;
+        sort_src_t *tmp;
+
+        if (l < n && sort_src_less(heap[l], heap[least]))
+            least = l;
+        if (r < n && sort_src_less(heap[r], heap[least]))
+            least = r;
+        if (least == i)
+            return;
+
+        tmp = heap[i];
+        heap[i] = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+/**
+ * \brief merge n sorted inputs, emitting their packets in order
+ */
+static int
+sort_merge(rewrite_sort_t *s, sort_src_t *srcs, int n)
+{
+    sort_src_t *heap[SORT_MERGE_WAY > SORT_MAX_THREADS ? SORT_MERGE_WAY : SORT_MAX_THREADS];
+    int i, cnt = 0, rcode;
+
+    for (i = 0; i < n; i++) {
+        if (sort_src_next(&srcs[i]))
+            heap[cnt++] = &srcs[i];
+    }
+    for (i = cnt / 2 - 1; i >= 0; i--)
+        sort_sift_down(heap, cnt, i);
+
+    while (cnt > 0) {
+        sort_src_t *top = heap[0];
+
+        if ((rcode = sort_emit(s, &top->pkthdr, top->pktdata, top->key)) != 0)
+            return rcode;
+
+        if (!sort_src_next(top))
+            heap[0] = heap[--cnt];
+        sort_sift_down(heap, cnt, 0);
+    }
+
+    return 0;
+}
+
+/**
+ * \brief create an empty run file and start writing it
+ */
+static void
+sort_run_open(rewrite_sort_t *s)
+{
+    char ebuf[PCAP_ERRBUF_SIZE];
+    size_t len = strlen(options.sort_tmpdir) + 32;
+    char *path = safe_malloc(len);
+    int fd;
+
+    snprintf(path, len, "%s/tcprewrite-sort.XXXXXX", options.sort_tmpdir);
+    if ((fd = mkstemp(path)) < 0)
+        errx(-1, "Unable to create sort run in %s: %s", options.sort_tmpdir, strerror(errno));
+    close(fd);
+
+    /* no snaplen, or reading the run back would truncate what the input didn't */
+    s->run_out = pcap_writer_open(path,
+                                  s->dlt,
+                                  MAX_SNAPLEN,
+                                  options.write_buffer > 0 ? options.write_buffer : PCAP_WRITER_DEFAULT_BUFSIZE,
+                                  ebuf);
+    if (s->run_out == NULL)
+        errx(-1, "Unable to open sort run %s: %s", path, ebuf);
+
+    s->runs = safe_realloc(s->runs, (s->nruns + 1) * sizeof(char *));
+    s->runs[s->nruns++] = path;
+    s->runs_written++;
+}
+
+static void
+sort_run_close(rewrite_sort_t *s)
+{
+    if (pcap_writer_flush(s->run_out) < 0)
+        errx(-1, "Unable to write sort run: %s", pcap_writer_geterr(s->run_out));
+    pcap_writer_close(s->run_out);
+    s->run_out = NULL;
+}
+
+/**
+ * \brief sort the packets in the arena and write them to a new run, or to
+ * the output when to_output is set
+ */
+static int
+sort_arena(rewrite_sort_t *s, bool to_output)
+{
+    sort_src_t srcs[SORT_MAX_THREADS];
+    size_t per;
+    int i, n, rcode;
+#ifdef HAVE_PTHREAD
+    sort_slice_t slices[SORT_MAX_THREADS];
+#endif
+
+    n = s->threads;
+    if ((size_t)n > s->nrecs / SORT_MIN_SLICE)
+        n = (int)(s->nrecs / SORT_MIN_SLICE);
+    if (n < 1)
+        n = 1;
+    per = (s->nrecs + n - 1) / n;
+
+    memset(srcs, 0, sizeof(srcs));
+    for (i = 0; i < n; i++) {
+        srcs[i].recs = s->ptrs;
+        srcs[i].pos = (size_t)i * per;
+        srcs[i].end = srcs[i].pos + per < s->nrecs ? srcs[i].pos + per : s->nrecs;
+    }
+
+#ifdef HAVE_PTHREAD
+    for (i = 1; i < n; i++) {
+        slices[i].recs = s->ptrs + srcs[i].pos;
+        slices[i].cnt = srcs[i].end - srcs[i].pos;
+        if (pthread_create(&slices[i].thread, NULL, sort_slice, &slices[i]) != 0)
+            errx(-1, "Unable to create sort thread: %s", strerror(errno));
+    }
+#endif
+    qsort(s->ptrs, srcs[0].end, sizeof(sort_rec_t *), sort_rec_cmp);
+#ifdef HAVE_PTHREAD
+    for (i = 1; i < n; i++)
+        pthread_join(slices[i].thread, NULL);
+#endif
+
+    dbgx(1, "Sorted " COUNTER_SPEC " packets in %d slices", (COUNTER)s->nrecs, n);
+
+    if (!to_output)
+        sort_run_open(s);
+    rcode = sort_merge(s, srcs, n);
+    if (!to_output)
+        sort_run_close(s);
+
+    s->used = 0;
+    s->nrecs = 0;
+    s->ptrs = (sort_rec_t **)(s->arena + s->size);
+
+    return rcode;
+}
+
+/**
+ * \brief merge the runs first to first + n - 1, into a new run unless to_output
+ */
+static int
+sort_merge_runs(rewrite_sort_t *s, char **runs, int n, bool to_output)
+{
+    sort_src_t srcs[SORT_MERGE_WAY];
+    char ebuf[PCAP_ERRBUF_SIZE];
+    int i, rcode;
+
+    memset(srcs, 0, sizeof(srcs));
+    for (i = 0; i < n; i++) {
+        if ((srcs[i].pcap = tcpr_pcap_open_offline(runs[i], ebuf)) == NULL)
+            errx(-1, "Unable to open sort run %s: %s", runs[i], ebuf);
+        srcs[i].tie = (u_int64_t)i;
+        /* it goes away once closed */
+        unlink(runs[i]);
+    }
+
+    if (!to_output)
+        sort_run_open(s);
+    rcode = sort_merge(s, srcs, n);
+    if (!to_output)
+        sort_run_close(s);
+
+    for (i = 0; i < n; i++) {
+        pcap_close(srcs[i].pcap);
+        safe_free(runs[i]);
+    }
+
+    return rcode;
+}
+
+/**
+ * \brief merge all the runs to the output, in as many passes as it takes
+ */
+static int
+sort_finish_runs(rewrite_sort_t *s)
+{
+    int rcode;
+
+    while (s->nruns > SORT_MERGE_WAY) {
+        char **runs = s->runs;
+        int nruns = s->nruns, i;
+
+        dbgx(1, "Merging %d sort runs into %d", nruns, (nruns + SORT_MERGE_WAY - 1) / SORT_MERGE_WAY);
+
+        /* consecutive runs are merged together, which keeps ties in input order */
+        s->runs = NULL;
+        s->nruns = 0;
+        for (i = 0; i < nruns; i += SORT_MERGE_WAY) {
+            int n = nruns - i < SORT_MERGE_WAY ? nruns - i : SORT_MERGE_WAY;
+
+            if ((rcode = sort_merge_runs(s, runs + i, n, false)) != 0)
+                return rcode;
+        }
+        safe_free(runs);
+    }
+
+    return sort_merge_runs(s, s->runs, s->nruns, true);
+}
+
+/**
+ * \brief clean up the header of a packet for --sort-fix: caplen no more
+ * than the snaplen of the file, and len no less than caplen
+ */
+static void
+sort_fix_pkthdr(rewrite_sort_t *s, struct pcap_pkthdr *pkthdr, u_int32_t snaplen)
+{
+    bool fixed = false;
+
+    if (snaplen > 0 && pkthdr->caplen > snaplen) {
+        pkthdr->caplen = snaplen;
+        fixed = true;
+    }
+    if (pkthdr->len < pkthdr->caplen) {
+        pkthdr->len = pkthdr->caplen;
+        fixed = true;
+    }
+
+    if (fixed)
+        s->fixed++;
+}
+
+/**
+ * \brief tcprewrite --sort: read the whole input, then write it in
+ * timestamp order through the editor
+ */
+int
+rewrite_sort_packets(tcpedit_t *tcpedit_ctx, int threads, pcap_t *pin, pcap_dumper_t *pout)
+{
+    rewrite_sort_t *s;
+    struct pcap_pkthdr pkthdr;
+    const u_char *pktconst;
+    u_int32_t snaplen = 0;
+    int rcode = 0;
+
+    s = safe_malloc(sizeof(*s));
+    s->tcpedit = tcpedit_ctx;
+    s->pout = pout;
+    s->dlt = pcap_datalink(pin);
+    s->threads = threads < 1 ? 1 : threads > SORT_MAX_THREADS ? SORT_MAX_THREADS : threads;
+#ifndef HAVE_PTHREAD
+    s->threads = 1;
+#endif
+    s->size = options.sort_memory & ~(size_t)(sizeof(void *) - 1);
+    s->arena = safe_malloc(s->size);
+    s->ptrs = (sort_rec_t **)(s->arena + s->size);
+    s->pktdata_buff = safe_malloc(MAXPACKET);
+
+#ifdef HAVE_PCAP_SNAPSHOT
+    if (pcap_snapshot(pin) > 0)
+        snaplen = (u_int32_t)pcap_snapshot(pin);
+#endif
+
+    while ((pktconst = safe_pcap_next(pin, &pkthdr)) != NULL) {
+        size_t need;
+        sort_rec_t *rec;
+
+        dbgx(2, "packet " COUNTER_SPEC " caplen %d", s->packets + 1, pkthdr.caplen);
+        if (pkthdr.caplen > MAX_SNAPLEN)
+            errx(-1, "Frame too big, caplen %d exceeds %d", pkthdr.caplen, MAX_SNAPLEN);
+
+        if (options.sort_fix)
+            sort_fix_pkthdr(s, &pkthdr, snaplen);
+
+        need = (sizeof(sort_rec_t) + pkthdr.caplen + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+        if (s->used + need + sizeof(sort_rec_t *) > (size_t)((u_char *)s->ptrs - s->arena)) {
+            if ((rcode = sort_arena(s, false)) != 0)
+                goto out;
+            if (need + sizeof(sort_rec_t *) > s->size)
+                errx(-1, "--sort-memory of %zu bytes can not hold a packet of %u bytes", s->size, pkthdr.caplen);
+        }
+
+        rec = (sort_rec_t *)(s->arena + s->used);
+        rec->key = sort_key(&pkthdr);
+        memcpy(&rec->pkthdr, &pkthdr, sizeof(pkthdr));
+        memcpy(rec + 1, pktconst, pkthdr.caplen);
+        s->used += need;
+        *--s->ptrs = rec;
+        s->nrecs++;
+
+        if (s->packets++ > 0 && rec->key < s->last_key)
+            s->backwards++;
+        s->last_key = rec->key;
+    }
+
+    if (s->nruns == 0) {
+        /* it all fit */
+        rcode = sort_arena(s, true);
+    } else {
+        if (s->nrecs > 0 && (rcode = sort_arena(s, false)) != 0)
+            goto out;
+        /* the arena isn't needed any more, the merge only streams */
+        safe_free(s->arena);
+        s->arena = NULL;
+        rcode = sort_finish_runs(s);
+    }
+    if (rcode != 0)
+        goto out;
+
+    notice("Sorted " COUNTER_SPEC " packets, " COUNTER_SPEC " of them out of order, using %d runs",
+           s->packets,
+           s->backwards,
+           s->runs_written);
+    if (options.sort_fix)
+        notice("Fixed the caplen or len of " COUNTER_SPEC " packets", s->fixed);
+    if (options.sort_dedup)
+        notice("Dropped " COUNTER_SPEC " duplicate packets", s->duplicates);
+
+out:
+    safe_free(s->arena);
+    safe_free(s->runs);
+    safe_free(s->pktdata_buff);
+    safe_free(s);
+
+    return rcode;
+}
+
+#endif /* ENABLE_REWRITE_SORT */
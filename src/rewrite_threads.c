@@ -0,0 +1,397 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Multi-threaded tcprewrite.
+ *
+ * A reader thread fills batches of packets from the input file, a pool of
+ * editor threads each run tcpedit_packet() with their own tcpedit_t, and
+ * the calling thread writes the batches back out strictly in the order they
+ * were read.  Batches live in a fixed ring, so the reader can never get
+ * more than a few batches per editor ahead of the writer.
+ *
+ * Everything order dependent stays in the writer (fragroute, verbose
+ * printing, --skip-soft-errors), and --seed randomization is a pure function
+ * of each address, as is --fuzz-seed of each packet number, so the output
+ * is identical to a single threaded run.
+ */
+
+#include "rewrite_threads.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "tcprewrite_opts.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ENABLE_REWRITE_THREADS
+
+#define REWRITE_BATCH 256           /* most packets per batch, see --thread-batch */
+#define REWRITE_BATCHES_PER_THREAD 4 /* how far the reader may get ahead */
+
+extern tcprewrite_opt_t options;
+
+typedef enum {
+    REWRITE_BATCH_FREE = 0,
+    REWRITE_BATCH_FILLED,
+    REWRITE_BATCH_EDITING,
+    REWRITE_BATCH_DONE,
+} rewrite_batch_state_t;
+
+typedef struct rewrite_pkt_s {
+    struct pcap_pkthdr pkthdr;
+    u_char *pktdata;
+    size_t size; /* bytes allocated for pktdata */
+    COUNTER packetnum;
+    tcpr_dir_t cache_result;
+    int rcode;
+} rewrite_pkt_t;
+
+typedef struct rewrite_batch_s {
+    rewrite_batch_state_t state;
+    int cnt;
+    int worker; /* editor which processed this batch */
+    rewrite_pkt_t pkts[REWRITE_BATCH];
+} rewrite_batch_t;
+
+struct rewrite_threads_s;
+
+typedef struct rewrite_worker_s {
+    struct rewrite_threads_s *rt;
+    int id;
+    pthread_t thread;
+    tcpedit_t *tcpedit;
+} rewrite_worker_t;
+
+typedef struct rewrite_threads_s {
+    pthread_mutex_t lock;
+    pthread_cond_t filled; /* reader -> editors */
+    pthread_cond_t done;   /* editors -> writer */
+    pthread_cond_t freed;  /* writer -> reader */
+
+    rewrite_batch_t *batches;
+    int nbatches;
+    COUNTER read_seq;  /* next batch to be filled */
+    COUNTER edit_seq;  /* next batch to be edited */
+    COUNTER write_seq; /* next batch to be written */
+    bool eof;
+    bool abort;
+
+    pcap_t *pin;
+    pthread_t reader;
+    int cnt;
+    rewrite_worker_t workers[MAX_REWRITE_THREADS];
+} rewrite_threads_t;
+
+/**
+ * \brief reader thread: fill batches from the input file in order
+ */
+static void *
+rewrite_reader(void *arg)
+{
+    rewrite_threads_t *rt = arg;
+    const u_char *pktconst;
+    COUNTER packetnum = 0;
+    bool eof = false;
+
+    while (!eof) {
+        rewrite_batch_t *b;
+        int cnt;
+
+        pthread_mutex_lock(&rt->lock);
+        b = &rt->batches[rt->read_seq % rt->nbatches];
+        while (!rt->abort && b->state != REWRITE_BATCH_FREE)
+            pthread_cond_wait(&rt->freed, &rt->lock);
+        pthread_mutex_unlock(&rt->lock);
+
+        if (rt->abort)
+            break;
+
+        for (cnt = 0; cnt < options.thread_batch; cnt++) {
+            rewrite_pkt_t *p = &b->pkts[cnt];
+
+            if ((pktconst = safe_pcap_next(rt->pin, &p->pkthdr)) == NULL) {
+                eof = true;
+                break;
+            }
+
+            p->packetnum = ++packetnum;
+            dbgx(2, "packet " COUNTER_SPEC " caplen %d", packetnum, p->pkthdr.caplen);
+
+            if (p->pkthdr.caplen > MAX_SNAPLEN)
+                errx(-1, "Frame too big, caplen %d exceeds %d", p->pkthdr.caplen, MAX_SNAPLEN);
+
+            /* leave the editors room to grow the packet, as with a single thread */
+            if (p->size < p->pkthdr.caplen + PACKET_HEADROOM) {
+                p->size = p->pkthdr.caplen + PACKET_HEADROOM;
+                p->pktdata = safe_realloc(p->pktdata, p->size);
+            }
+            memcpy(p->pktdata, pktconst, p->pkthdr.caplen);
+
+            p->cache_result = TCPR_DIR_C2S;
+            if (options.cachedata != NULL)
+                p->cache_result = check_cache(options.cachedata, packetnum);
+        }
+
+        pthread_mutex_lock(&rt->lock);
+        b->cnt = cnt;
+        b->state = REWRITE_BATCH_FILLED;
+        rt->read_seq++;
+        rt->eof = eof;
+        pthread_cond_broadcast(&rt->filled);
+        pthread_cond_signal(&rt->done);
+        pthread_mutex_unlock(&rt->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief editor thread: run tcpedit_packet_batch() over whole batches
+ */
+static void *
+rewrite_worker(void *arg)
+{
+    rewrite_worker_t *w = arg;
+    rewrite_threads_t *rt = w->rt;
+    tcpedit_t *tcpedit = w->tcpedit;
+    tcpedit_pkt_t pkts[REWRITE_BATCH];
+
+    for (;;) {
+        rewrite_batch_t *b;
+        int i;
+
+        pthread_mutex_lock(&rt->lock);
+        while (!rt->abort && rt->edit_seq == rt->read_seq && !rt->eof)
+            pthread_cond_wait(&rt->filled, &rt->lock);
+
+        if (rt->abort || rt->edit_seq == rt->read_seq) {
+            pthread_mutex_unlock(&rt->lock);
+            break;
+        }
+
+        b = &rt->batches[rt->edit_seq % rt->nbatches];
+        b->state = REWRITE_BATCH_EDITING;
+        rt->edit_seq++;
+        pthread_mutex_unlock(&rt->lock);
+
+        /* NOSEND packets are still written unedited so the tcpprep cache stays in sync */
+        for (i = 0; i < b->cnt; i++) {
+            pkts[i].pkthdr = &b->pkts[i].pkthdr;
+            pkts[i].pktdata = b->pkts[i].pktdata;
+            pkts[i].direction = b->pkts[i].cache_result;
+            pkts[i].rcode = TCPEDIT_OK;
+        }
+
+        /* keep error messages in terms of the input file, the writer stops at an error */
+        if (b->cnt > 0)
+            tcpedit->runtime.packetnum = b->pkts[0].packetnum - 1;
+        tcpedit_packet_batch(tcpedit, pkts, b->cnt);
+
+        for (i = 0; i < b->cnt; i++) {
+            rewrite_pkt_t *p = &b->pkts[i];
+
+            p->pktdata = pkts[i].pktdata;
+            p->rcode = pkts[i].rcode;
+
+            /* untrunc_packet() may have reallocated the buffer */
+            if (tcpedit->fixlen != TCPEDIT_FIXLEN_OFF && p->size > p->pkthdr.caplen + PACKET_HEADROOM)
+                p->size = p->pkthdr.caplen + PACKET_HEADROOM;
+        }
+
+        pthread_mutex_lock(&rt->lock);
+        b->worker = w->id;
+        b->state = REWRITE_BATCH_DONE;
+        pthread_cond_signal(&rt->done);
+        pthread_mutex_unlock(&rt->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief write one edited batch, returns TCPEDIT_ERROR to stop
+ */
+static int
+rewrite_write_batch(rewrite_threads_t *rt, rewrite_batch_t *b, tcpedit_t *tcpedit_ctx, pcap_dumper_t *pout)
+{
+    int i;
+
+    for (i = 0; i < b->cnt; i++) {
+        rewrite_pkt_t *p = &b->pkts[i];
+
+        if (p->rcode == TCPEDIT_ERROR) {
+            tcpedit_seterr(tcpedit_ctx, "%s", tcpedit_geterr(rt->workers[b->worker].tcpedit));
+            return TCPEDIT_ERROR;
+        } else if (p->rcode == TCPEDIT_SOFT_ERROR && HAVE_OPT(SKIP_SOFT_ERRORS)) {
+            dbgx(1, "Packet " COUNTER_SPEC " is suppressed from being written due to soft errors", p->packetnum);
+            continue;
+        }
+
+        tcprewrite_write_packet(tcpedit_ctx, pout, &p->pkthdr, p->pktdata, p->cache_result, p->packetnum);
+    }
+
+    return TCPEDIT_OK;
+}
+
+/**
+ * \brief give every editor its own tcpedit_t, built from the same options
+ */
+static int
+rewrite_threads_init(rewrite_threads_t *rt, tcpedit_t *tcpedit_ctx)
+{
+    int i;
+
+    for (i = 0; i < rt->cnt; i++) {
+        rewrite_worker_t *w = &rt->workers[i];
+
+        w->rt = rt;
+        w->id = i;
+
+        if (tcpedit_init(&w->tcpedit, pcap_datalink(rt->pin)) < 0) {
+            tcpedit_seterr(tcpedit_ctx, "Error initializing tcpedit for thread %d: %s", i, tcpedit_geterr(w->tcpedit));
+            return TCPEDIT_ERROR;
+        }
+
+        /* warnings were already reported when parsing for the main context */
+        if (tcpedit_post_args(w->tcpedit) < 0) {
+            tcpedit_seterr(tcpedit_ctx, "Unable to parse args for thread %d: %s", i, tcpedit_geterr(w->tcpedit));
+            return TCPEDIT_ERROR;
+        }
+
+        if (tcpedit_validate(w->tcpedit) < 0) {
+            tcpedit_seterr(tcpedit_ctx, "Unable to edit packets in thread %d: %s", i, tcpedit_geterr(w->tcpedit));
+            return TCPEDIT_ERROR;
+        }
+    }
+
+    return TCPEDIT_OK;
+}
+
+/**
+ * \brief rewrite every packet in pin into pout using the given number of editors
+ *
+ * Same contract as rewrite_packets(): returns 0 on success or TCPEDIT_ERROR
+ * with the error set on tcpedit_ctx.
+ */
+int
+rewrite_threads_packets(tcpedit_t *tcpedit_ctx, int threads, pcap_t *pin, pcap_dumper_t *pout)
+{
+    rewrite_threads_t *rt;
+    bool reader_started = false;
+    int started = 0;
+    int ret = 0;
+    int i, j;
+
+    assert(tcpedit_ctx);
+    assert(threads > 1 && threads <= MAX_REWRITE_THREADS);
+
+    rt = safe_malloc(sizeof(*rt));
+    rt->cnt = threads;
+    rt->pin = pin;
+    rt->nbatches = threads * REWRITE_BATCHES_PER_THREAD;
+    rt->batches = safe_malloc(sizeof(rewrite_batch_t) * rt->nbatches);
+    pthread_mutex_init(&rt->lock, NULL);
+    pthread_cond_init(&rt->filled, NULL);
+    pthread_cond_init(&rt->done, NULL);
+    pthread_cond_init(&rt->freed, NULL);
+
+    if (rewrite_threads_init(rt, tcpedit_ctx) < 0) {
+        ret = TCPEDIT_ERROR;
+        goto done;
+    }
+
+    dbgx(1, "Rewriting with %d editor threads", threads);
+
+    for (started = 0; started < rt->cnt; started++) {
+        if (pthread_create(&rt->workers[started].thread, NULL, rewrite_worker, &rt->workers[started]) != 0) {
+            tcpedit_seterr(tcpedit_ctx, "Unable to start rewrite thread %d", started);
+            ret = TCPEDIT_ERROR;
+            goto stop;
+        }
+    }
+
+    if (pthread_create(&rt->reader, NULL, rewrite_reader, rt) != 0) {
+        tcpedit_seterr(tcpedit_ctx, "%s", "Unable to start reader thread");
+        ret = TCPEDIT_ERROR;
+        goto stop;
+    }
+    reader_started = true;
+
+    /* we are the writer */
+    for (;;) {
+        rewrite_batch_t *b;
+
+        pthread_mutex_lock(&rt->lock);
+        b = &rt->batches[rt->write_seq % rt->nbatches];
+        while (b->state != REWRITE_BATCH_DONE && !(rt->eof && rt->write_seq == rt->read_seq))
+            pthread_cond_wait(&rt->done, &rt->lock);
+        pthread_mutex_unlock(&rt->lock);
+
+        if (b->state != REWRITE_BATCH_DONE)
+            break; /* everything has been written */
+
+        if (rewrite_write_batch(rt, b, tcpedit_ctx, pout) == TCPEDIT_ERROR) {
+            ret = TCPEDIT_ERROR;
+            break;
+        }
+
+        pthread_mutex_lock(&rt->lock);
+        b->state = REWRITE_BATCH_FREE;
+        rt->write_seq++;
+        pthread_cond_signal(&rt->freed);
+        pthread_mutex_unlock(&rt->lock);
+    }
+
+stop:
+    pthread_mutex_lock(&rt->lock);
+    rt->abort = true;
+    pthread_cond_broadcast(&rt->filled);
+    pthread_cond_broadcast(&rt->freed);
+    pthread_mutex_unlock(&rt->lock);
+
+    if (reader_started)
+        pthread_join(rt->reader, NULL);
+
+    for (i = 0; i < started; i++)
+        pthread_join(rt->workers[i].thread, NULL);
+
+done:
+    for (i = 0; i < rt->cnt; i++) {
+        if (rt->workers[i].tcpedit != NULL)
+            tcpedit_close(&rt->workers[i].tcpedit);
+    }
+
+    for (i = 0; i < rt->nbatches; i++) {
+        for (j = 0; j < REWRITE_BATCH; j++)
+            safe_free(rt->batches[i].pkts[j].pktdata);
+    }
+
+    pthread_cond_destroy(&rt->freed);
+    pthread_cond_destroy(&rt->done);
+    pthread_cond_destroy(&rt->filled);
+    pthread_mutex_destroy(&rt->lock);
+    safe_free(rt->batches);
+    safe_free(rt);
+
+    return ret;
+}
+
+#endif /* ENABLE_REWRITE_THREADS */
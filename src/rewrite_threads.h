@@ -0,0 +1,34 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include "tcprewrite.h"
+
+/* multi-threaded editing is only available to tcprewrite and requires POSIX threads */
+#if defined HAVE_PTHREAD && defined TCPREWRITE
+#define ENABLE_REWRITE_THREADS 1
+#endif
+
+#define MAX_REWRITE_THREADS 64
+
+#ifdef ENABLE_REWRITE_THREADS
+int rewrite_threads_packets(tcpedit_t *tcpedit_ctx, int threads, pcap_t *pin, pcap_dumper_t *pout);
+#endif
@@ -0,0 +1,190 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Predict how a receiver with receive side scaling spreads the replay
+ * over its queues.  Each preloaded packet is hashed as the NIC would,
+ * with the same key, so a capture which would load one core of the
+ * device under test more than the others shows up before it is sent.
+ */
+
+#include "rss.h"
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <string.h>
+
+tcpr_rss_t *
+rss_new(const tcpreplay_opt_t *options)
+{
+    tcpr_rss_t *rss;
+
+    assert(options->rss_queues > 0);
+    assert(options->rss_reta >= (uint32_t)options->rss_queues);
+
+    rss = safe_malloc(sizeof(tcpr_rss_t));
+    if (options->rss_key != NULL)
+        rss->toeplitz = flow_rss_init(options->rss_key, options->rss_key_len);
+    else
+        rss->toeplitz = flow_rss_init(flow_rss_default_key, FLOW_RSS_KEY_LEN);
+    rss->queues = options->rss_queues;
+    rss->reta_mask = options->rss_reta - 1;
+    rss->packets = safe_malloc(sizeof(COUNTER) * rss->queues);
+    rss->bytes = safe_malloc(sizeof(COUNTER) * rss->queues);
+    rss->balance = options->rss_balance;
+    if (rss->balance)
+        rss->loads = safe_malloc(sizeof(COUNTER) * rss->queues);
+
+    return rss;
+}
+
+void
+rss_free(tcpr_rss_t *rss)
+{
+    if (rss == NULL)
+        return;
+
+    flow_rss_free(rss->toeplitz);
+    safe_free(rss->packets);
+    safe_free(rss->bytes);
+    safe_free(rss->flows);
+    safe_free(rss->loads);
+    safe_free(rss);
+}
+
+static inline uint32_t
+rss_flow_slot(uint32_t src_host, uint32_t dst_host, uint32_t ports, uint32_t mask)
+{
+    return ((src_host * 0x9e3779b1U) ^ (dst_host * 0x85ebca6bU) ^ ports) & mask;
+}
+
+/**
+ * \brief --rss-balance: count a packet of the pool hosts to its flow
+ *
+ * Only the share of the ports is kept, the rest of the hash follows from
+ * the addresses each unique loop gives the hosts.
+ */
+static void
+rss_add_flow(tcpr_rss_t *rss, const packet_cache_t *cached_packet, uint32_t hash)
+{
+    uint32_t src, dst, ports, i, mask;
+
+    /* keep the table at most half full */
+    if ((rss->flow_cnt + 1) * 2 > rss->flow_size) {
+        uint32_t size = rss->flow_size ? rss->flow_size * 2 : 1024;
+        rss_flow_t *grown = safe_malloc(sizeof(rss_flow_t) * size);
+
+        for (i = 0; i < rss->flow_size; i++) {
+            const rss_flow_t *flow = &rss->flows[i];
+            uint32_t j;
+
+            if (flow->src_host == 0)
+                continue;
+
+            for (j = rss_flow_slot(flow->src_host, flow->dst_host, flow->ports, size - 1); grown[j].src_host;
+                 j = (j + 1) & (size - 1))
+                ;
+            grown[j] = *flow;
+        }
+        safe_free(rss->flows);
+        rss->flows = grown;
+        rss->flow_size = size;
+    }
+
+    /* the hash is linear, so XORing out the addresses leaves the ports */
+    memcpy(&src, cached_packet->pktdata + cached_packet->unique_src, sizeof(src));
+    memcpy(&dst, cached_packet->pktdata + cached_packet->unique_dst, sizeof(dst));
+    ports = hash ^ flow_rss_bytes(rss->toeplitz, 0, (const u_char *)&src, sizeof(src)) ^
+            flow_rss_bytes(rss->toeplitz, sizeof(src), (const u_char *)&dst, sizeof(dst));
+
+    mask = rss->flow_size - 1;
+    for (i = rss_flow_slot(cached_packet->unique_src_host, cached_packet->unique_dst_host, ports, mask);
+         rss->flows[i].src_host;
+         i = (i + 1) & mask) {
+        rss_flow_t *flow = &rss->flows[i];
+
+        if (flow->src_host == cached_packet->unique_src_host && flow->dst_host == cached_packet->unique_dst_host &&
+            flow->ports == ports) {
+            ++flow->packets;
+            return;
+        }
+    }
+
+    rss->flows[i].src_host = cached_packet->unique_src_host;
+    rss->flows[i].dst_host = cached_packet->unique_dst_host;
+    rss->flows[i].ports = ports;
+    rss->flows[i].packets = 1;
+    ++rss->flow_cnt;
+}
+
+/**
+ * \brief count a preloaded packet to the queue it would be received on
+ *
+ * Called after unique_ip_offsets(), so --rss-balance knows the pool hosts
+ * of the packet.
+ */
+void
+rss_count(tcpr_rss_t *rss, const packet_cache_t *cached_packet, int datalink)
+{
+    uint32_t hash;
+    int queue = 0;
+
+    if (flow_rss_hash(rss->toeplitz, &cached_packet->pkthdr, cached_packet->pktdata, datalink, &hash)) {
+        queue = rss_queue(rss, hash);
+        if (rss->balance && cached_packet->unique_src_host != 0)
+            rss_add_flow(rss, cached_packet, hash);
+    } else {
+        ++rss->unhashed;
+    }
+
+    ++rss->packets[queue];
+    rss->bytes[queue] += cached_packet->pkthdr.len;
+}
+
+/**
+ * \brief print the packets and bytes each queue gets
+ */
+void
+rss_report(const tcpr_rss_t *rss)
+{
+    COUNTER total = 0, busiest = 0;
+    int i;
+
+    for (i = 0; i < rss->queues; i++) {
+        total += rss->packets[i];
+        if (rss->packets[i] > busiest)
+            busiest = rss->packets[i];
+    }
+    if (total == 0)
+        return;
+
+    notice("RSS: %d queues through a %u entry indirection table:", rss->queues, rss->reta_mask + 1);
+    for (i = 0; i < rss->queues; i++)
+        notice("    queue %d: " COUNTER_SPEC " packets (%.1f%%), " COUNTER_SPEC " bytes",
+               i,
+               rss->packets[i],
+               (double)rss->packets[i] * 100.0 / (double)total,
+               rss->bytes[i]);
+    notice("RSS: busiest queue gets %.2fx its share, " COUNTER_SPEC " packets not IP are on queue 0",
+           (double)busiest * rss->queues / (double)total,
+           rss->unhashed);
+    if (rss->balance)
+        notice("RSS: --rss-balance spreads %u flows of the --unique-ip-pool hosts", rss->flow_cnt);
+}
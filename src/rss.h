@@ -0,0 +1,71 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "tcpreplay_api.h"
+#include "common/flows.h"
+
+#define RSS_RETA_DEFAULT 128 /* indirection table entries of most NICs */
+#define RSS_RETA_MAX 65536
+/* --rss-balance: offsets into its block the pool addresses of a unique loop may start at */
+#define RSS_BALANCE_TRIES 16
+
+/* --rss-balance: the packets of an IPv4 flow between two --unique-ip-pool hosts */
+typedef struct rss_flow_s {
+    uint32_t src_host; /* unique_hosts_t ids, 0 for a free slot */
+    uint32_t dst_host;
+    uint32_t ports; /* share of the ports in the hash, 0 if they aren't hashed */
+    COUNTER packets;
+} rss_flow_t;
+
+/*
+ * --rss-queues: which receive queue the Toeplitz hash of a NIC puts each
+ * packet of the preloaded files on, with the default indirection table
+ * spreading its entries over the queues round robin.  Counted while
+ * preloading and reported before sending.
+ */
+struct tcpr_rss_s {
+    flow_rss_t *toeplitz;
+    int queues;
+    uint32_t reta_mask; /* indirection table entries, a power of two, minus one */
+    COUNTER *packets;   /* per queue */
+    COUNTER *bytes;
+    COUNTER unhashed; /* not IP, left on queue 0 */
+    /* --rss-balance: the flows of the pool hosts, open addressed */
+    bool balance;
+    rss_flow_t *flows;
+    uint32_t flow_size; /* power of two */
+    uint32_t flow_cnt;
+    COUNTER *loads;      /* per queue, for trying an offset */
+    COUNTER balanced;    /* unique loop nudge was picked for, 0 for none yet */
+    uint32_t nudge;
+};
+
+tcpr_rss_t *rss_new(const tcpreplay_opt_t *options);
+void rss_free(tcpr_rss_t *rss);
+void rss_count(tcpr_rss_t *rss, const packet_cache_t *cached_packet, int datalink);
+void rss_report(const tcpr_rss_t *rss);
+
+/* the queue of a hash, as the NIC masks it into the table */
+static inline int
+rss_queue(const tcpr_rss_t *rss, uint32_t hash)
+{
+    return (int)((hash & rss->reta_mask) % (uint32_t)rss->queues);
+}
@@ -18,17 +18,21 @@
  *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define TCPR_MEM_SUBSYS TCPR_MEM_PRELOAD /* see memstat.h */
+
 #include "defines.h"
 #include "config.h"
 #include "common.h"
 #include "tcpreplay_api.h"
-#include "timestamp_trace.h"
+#include "common/probes.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -41,34 +45,84 @@
 #include <sys/ioctl.h>
 #endif /* HAVE_NETMAP */
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#include <sys/stat.h>
+
 #ifdef TCPREPLAY
 
 #ifdef TCPREPLAY_EDIT
 #include "tcpedit/tcpedit.h"
 #include "tcpreplay_edit_opts.h"
 extern tcpedit_t *tcpedit;
+#ifdef ENABLE_FRAGROUTE
+#include "fragroute/fragroute.h"
+extern fragroute_t *frag_ctx;
+#endif
 #else
+#include "cache_image.h"
+#include "generator.h"
+#include "gso.h"
+#include "nic_threads.h"
+#include "preload_lz4.h"
 #include "tcpreplay_opts.h"
 #endif /* TCPREPLAY_EDIT */
 
 #endif /* TCPREPLAY */
 
+#include "checkpoint.h"
+#include "follow.h"
+#include "pkt_source.h"
+#include "probe.h"
+#include "rss.h"
 #include "send_packets.h"
 #include "sleep.h"
 
-static void calc_sleep_time(tcpreplay_t *ctx,
-                            struct timeval *pkt_ts_delta,
-                            struct timeval *time_delta,
+static bool calc_sleep_time(tcpreplay_t *ctx,
+                            u_int64_t pkt_ts_delta,
+                            u_int64_t time_delta,
                             COUNTER len,
                             sendpacket_t *sp,
                             COUNTER counter,
-                            timestamp_t *sent_timestamp,
-                            COUNTER start_us,
+                            u_int64_t sent_ns,
+                            u_int64_t start_ns,
                             COUNTER *skip_length);
-static void tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp _U_, struct timespec *nap_this_time, struct timeval *now);
+static void tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp, struct timespec *nap_this_time, u_int64_t *now_ns);
 static u_char *
-get_next_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int file_idx, packet_cache_t **prev_packet);
+get_next_packet(tcpreplay_t *ctx, struct pcap_pkthdr *pkthdr, int file_idx, packet_cache_t **prev_packet);
 static uint32_t get_user_count(tcpreplay_t *ctx, sendpacket_t *sp, COUNTER counter);
+static void cache_memory_release(file_cache_t *file_cache);
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+static void build_send_schedule(tcpreplay_t *ctx, file_cache_t *file_cache);
+#endif
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+static void edit_packet(tcpreplay_t *ctx,
+                        int file_idx,
+                        packet_cache_t *cached_packet,
+                        struct pcap_pkthdr **pkthdr,
+                        u_char **pktdata,
+                        tcpr_dir_t direction,
+                        COUNTER packetnum,
+                        uint16_t *csum_start,
+                        uint16_t *csum_offset);
+#ifdef ENABLE_FRAGROUTE
+static void preload_fragroute(tcpreplay_t *ctx, int idx);
+#endif
+#endif
+
+#ifdef HAVE_SO_TXTIME
+/* with --timer=txtime, queue packets at most this far ahead of their launch time */
+#define TXTIME_MAX_LEAD_NS 2000000
+/* packets due sooner than this are sent right away instead */
+#define TXTIME_MIN_LEAD_NS 50000
+#endif
+
+/* with --cache-memory, bytes of the file mapping read ahead of sending */
+#define CACHE_MEMORY_READAHEAD (32 * 1024 * 1024)
 
 #ifdef HAVE_NETMAP
 static inline void
@@ -79,126 +133,214 @@ wake_send_queues(sendpacket_t *sp _U_, tcpreplay_opt_t *options _U_)
 }
 #endif
 
-static inline int
-fast_edit_packet(struct pcap_pkthdr *pkthdr, u_char **pktdata, COUNTER iteration, bool cached, int datalink)
+/**
+ * \brief capture time from one packet to the next, pkt_ns after last_ns,
+ * shortened to --idle-gap if it was a quiet spell
+ */
+static inline u_int64_t
+idle_gap_delta(const tcpreplay_opt_t *options, u_int64_t last_ns, u_int64_t pkt_ns)
 {
-    uint32_t pkt_len = pkthdr->caplen;
-    u_char *packet = *pktdata;
-    ipv4_hdr_t *ip_hdr = NULL;
-    ipv6_hdr_t *ip6_hdr = NULL;
-    uint32_t src_ip, dst_ip;
-    uint32_t src_ip_orig, dst_ip_orig;
-    uint32_t _U_ vlan_offset;
-    uint16_t ether_type;
-    uint32_t l2offset;
-    uint32_t l2len;
-    int res;
+    u_int64_t delta = pkt_ns - last_ns;
 
-    res = get_l2len_protocol(packet, pkt_len, datalink, &ether_type, &l2len, &l2offset, &vlan_offset);
+    return options->idle_gap_ns != 0 && delta > options->idle_gap_ns ? options->idle_gap_ns : delta;
+}
 
-    if (res < 0)
-        return res;
+/**
+ * \brief --follow-dir: how much later than the last packet of the
+ * previous file the schedule of the cached file idx starts
+ */
+static u_int64_t
+follow_gap_ns(const tcpreplay_t *ctx, int idx)
+{
+    const tcpreplay_opt_t *options = ctx->options;
+    const file_cache_t *file_cache = &options->file_cache[idx];
+    u_int64_t last_ns = ctx->follow->last_pkt_ns;
+    u_int64_t first_ns;
 
-    switch (ether_type) {
-    case ETHERTYPE_IP:
-        if (pkt_len < (bpf_u_int32)(l2len + sizeof(ipv4_hdr_t))) {
-            dbgx(1, "IP packet too short for Unique IP feature: %u", pkthdr->caplen);
-            return -1;
-        }
-        ip_hdr = (ipv4_hdr_t *)(packet + l2len);
-        src_ip_orig = src_ip = ntohl(ip_hdr->ip_src.s_addr);
-        dst_ip_orig = dst_ip = ntohl(ip_hdr->ip_dst.s_addr);
-        break;
+    if (options->speed.mode != speed_multiplier || last_ns == 0 || file_cache->packet_cnt == 0)
+        return 0;
 
-    case ETHERTYPE_IP6:
-        if (pkt_len < (bpf_u_int32)(l2len + sizeof(ipv6_hdr_t))) {
-            dbgx(1, "IP6 packet too short for Unique IP feature: %u", pkthdr->caplen);
-            return -1;
-        }
-        ip6_hdr = (ipv6_hdr_t *)(packet + l2len);
-        src_ip_orig = src_ip = ntohl(ip6_hdr->ip_src.__u6_addr.__u6_addr32[3]);
-        dst_ip_orig = dst_ip = ntohl(ip6_hdr->ip_dst.__u6_addr.__u6_addr32[3]);
-        break;
+    first_ns = pkthdr_ts_ns(&file_cache->packet_cache[0].pkthdr, file_cache->nsec);
+    if (first_ns <= last_ns)
+        return 0;
 
-    default:
-        return -1; /* non-IP or packet too short */
-    }
+    return (u_int64_t)((double)idle_gap_delta(options, last_ns, first_ns) / options->speed.multiplier);
+}
 
-    dbgx(2, "Layer 3 protocol type is: 0x%04x", ether_type);
+/**
+ * \brief times --repeat sends the packet, cached_packet may be NULL when not preloading
+ */
+static inline u_int32_t
+repeat_copies(const tcpreplay_opt_t *options, const packet_cache_t *cached_packet)
+{
+    if (options->repeat <= 1)
+        return 1;
+
+    /* --repeat-flows: flows 1, N + 1, 2N + 1 ... */
+    if (options->repeat_flows > 1 &&
+        (cached_packet == NULL || cached_packet->flow_id == 0 || (cached_packet->flow_id - 1) % options->repeat_flows != 0))
+        return 1;
+
+    return options->repeat;
+}
+
+#ifdef ENABLE_RXMATCH
+/**
+ * \brief --rx-interface: note the packet about to go out, cached_packet may be NULL
+ */
+static inline void
+rx_sent(tcpreplay_t *ctx, const packet_cache_t *cached_packet, const u_char *pktdata, uint32_t caplen, int datalink)
+{
+    uint32_t sig = 0;
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    /* worked out while preloading, unless --gen-field rewrites the packet */
+    if (cached_packet != NULL && ctx->options->gen_field_cnt == 0)
+        sig = cached_packet->rx_sig;
+#else
+    (void)cached_packet;
+#endif
+    if (sig == 0 && (sig = rxmatch_sig(pktdata, caplen, datalink)) == 0)
+        return;
+
+    rxmatch_sent(ctx->rxmatch, sig);
+}
+#endif
+
+/**
+ * \brief Shift a src/dst IP pair for --unique-ip
+ *
+ * One address moves up and the other down by the same amount, so the IP
+ * and layer 4 checksums don't change.  When cached is set the packet was
+ * already shifted on the previous pass and only moves by one more.
+ */
+static inline void
+unique_ip_adjust(uint32_t *src_ip, uint32_t *dst_ip, COUNTER iteration, bool cached)
+{
+    uint32_t src_orig = *src_ip, dst_orig = *dst_ip;
 
     /* swap src/dst IP's in a manner that does not affect CRC */
-    if ((!cached && dst_ip > src_ip) || (cached && (dst_ip - iteration) > (src_ip - 1 - iteration))) {
+    if ((!cached && *dst_ip > *src_ip) || (cached && (*dst_ip - iteration) > (*src_ip - 1 - iteration))) {
         if (cached) {
-            --src_ip;
-            ++dst_ip;
+            --*src_ip;
+            ++*dst_ip;
         } else {
-            src_ip -= iteration;
-            dst_ip += iteration;
+            *src_ip -= iteration;
+            *dst_ip += iteration;
         }
 
         /* CRC compensations  for wrap conditions */
-        if (src_ip > src_ip_orig && dst_ip > dst_ip_orig) {
+        if (*src_ip > src_orig && *dst_ip > dst_orig) {
             dbgx(1,
                  "dst_ip > src_ip(" COUNTER_SPEC "): before(1) src_ip=0x%08x dst_ip=0x%08x",
                  iteration,
-                 src_ip,
-                 dst_ip);
-            --src_ip;
+                 *src_ip,
+                 *dst_ip);
+            --*src_ip;
             dbgx(1,
                  "dst_ip > src_ip(" COUNTER_SPEC "): after(1)  src_ip=0x%08x dst_ip=0x%08x",
                  iteration,
-                 src_ip,
-                 dst_ip);
-        } else if (dst_ip < dst_ip_orig && src_ip < src_ip_orig) {
+                 *src_ip,
+                 *dst_ip);
+        } else if (*dst_ip < dst_orig && *src_ip < src_orig) {
             dbgx(1,
                  "dst_ip > src_ip(" COUNTER_SPEC "): before(2) src_ip=0x%08x dst_ip=0x%08x",
                  iteration,
-                 src_ip,
-                 dst_ip);
-            ++dst_ip;
+                 *src_ip,
+                 *dst_ip);
+            ++*dst_ip;
             dbgx(1,
                  "dst_ip > src_ip(" COUNTER_SPEC "): after(2)  src_ip=0x%08x dst_ip=0x%08x",
                  iteration,
-                 src_ip,
-                 dst_ip);
+                 *src_ip,
+                 *dst_ip);
         }
     } else {
         if (cached) {
-            ++src_ip;
-            --dst_ip;
+            ++*src_ip;
+            --*dst_ip;
         } else {
-            src_ip += iteration;
-            dst_ip -= iteration;
+            *src_ip += iteration;
+            *dst_ip -= iteration;
         }
 
         /* CRC compensations  for wrap conditions */
-        if (dst_ip > dst_ip_orig && src_ip > src_ip_orig) {
+        if (*dst_ip > dst_orig && *src_ip > src_orig) {
             dbgx(1,
                  "src_ip > dst_ip(" COUNTER_SPEC "): before(1) dst_ip=0x%08x src_ip=0x%08x",
                  iteration,
-                 dst_ip,
-                 src_ip);
-            --dst_ip;
+                 *dst_ip,
+                 *src_ip);
+            --*dst_ip;
             dbgx(1,
                  "src_ip > dst_ip(" COUNTER_SPEC "): after(1)  dst_ip=0x%08x src_ip=0x%08x",
                  iteration,
-                 dst_ip,
-                 src_ip);
-        } else if (src_ip < src_ip_orig && dst_ip < dst_ip_orig) {
+                 *dst_ip,
+                 *src_ip);
+        } else if (*src_ip < src_orig && *dst_ip < dst_orig) {
             dbgx(1,
                  "src_ip > dst_ip(" COUNTER_SPEC "): before(2) dst_ip=0x%08x src_ip=0x%08x",
                  iteration,
-                 dst_ip,
-                 src_ip);
-            ++src_ip;
+                 *dst_ip,
+                 *src_ip);
+            ++*src_ip;
             dbgx(1,
                  "src_ip > dst_ip(" COUNTER_SPEC "): after(2)  dst_ip=0x%08x src_ip=0x%08x",
                  iteration,
-                 dst_ip,
-                 src_ip);
+                 *dst_ip,
+                 *src_ip);
+        }
+    }
+}
+
+static inline int
+fast_edit_packet(struct pcap_pkthdr *pkthdr, u_char **pktdata, COUNTER iteration, bool cached, int datalink)
+{
+    uint32_t pkt_len = pkthdr->caplen;
+    u_char *packet = *pktdata;
+    ipv4_hdr_t *ip_hdr = NULL;
+    ipv6_hdr_t *ip6_hdr = NULL;
+    uint32_t src_ip, dst_ip;
+    uint32_t _U_ vlan_offset;
+    uint16_t ether_type;
+    uint32_t l2offset;
+    uint32_t l2len;
+    int res;
+
+    res = get_l2len_protocol(packet, pkt_len, datalink, &ether_type, &l2len, &l2offset, &vlan_offset);
+
+    if (res < 0)
+        return res;
+
+    switch (ether_type) {
+    case ETHERTYPE_IP:
+        if (pkt_len < (bpf_u_int32)(l2len + sizeof(ipv4_hdr_t))) {
+            dbgx(1, "IP packet too short for Unique IP feature: %u", pkthdr->caplen);
+            return -1;
+        }
+        ip_hdr = (ipv4_hdr_t *)(packet + l2len);
+        src_ip = ntohl(ip_hdr->ip_src.s_addr);
+        dst_ip = ntohl(ip_hdr->ip_dst.s_addr);
+        break;
+
+    case ETHERTYPE_IP6:
+        if (pkt_len < (bpf_u_int32)(l2len + sizeof(ipv6_hdr_t))) {
+            dbgx(1, "IP6 packet too short for Unique IP feature: %u", pkthdr->caplen);
+            return -1;
         }
+        ip6_hdr = (ipv6_hdr_t *)(packet + l2len);
+        src_ip = ntohl(ip6_hdr->ip_src.__u6_addr.__u6_addr32[3]);
+        dst_ip = ntohl(ip6_hdr->ip_dst.__u6_addr.__u6_addr32[3]);
+        break;
+
+    default:
+        return -1; /* non-IP or packet too short */
     }
 
+    dbgx(2, "Layer 3 protocol type is: 0x%04x", ether_type);
+
+    unique_ip_adjust(&src_ip, &dst_ip, iteration, cached);
+
     dbgx(1, "(" COUNTER_SPEC "): final src_ip=0x%08x dst_ip=0x%08x", iteration, src_ip, dst_ip);
 
     switch (ether_type) {
@@ -218,24 +360,317 @@ fast_edit_packet(struct pcap_pkthdr *pkthdr, u_char **pktdata, COUNTER iteration
 }
 
 /**
- * \brief Update flow stats
+ * \brief shift the addresses of a copy of a cached packet as --unique-ip
+ * does on loop shift + 1, -1 if it isn't IP
+ */
+int
+unique_ip_shift(struct pcap_pkthdr *pkthdr, u_char *pktdata, COUNTER shift, int datalink)
+{
+    return fast_edit_packet(pkthdr, &pktdata, shift, false, datalink);
+}
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+/**
+ * \brief the --unique-ip-pool number of an IPv4 address, adding it if new
+ */
+static uint32_t
+unique_host_id(unique_hosts_t *hosts, uint32_t addr)
+{
+    uint32_t i, mask;
+
+    /* keep the table at most half full */
+    if ((hosts->cnt + 1) * 2 > hosts->size) {
+        unique_hosts_t grown;
+
+        grown.size = hosts->size ? hosts->size * 2 : 1024;
+        grown.cnt = hosts->cnt;
+        grown.slot = safe_malloc(sizeof(unique_host_t) * grown.size);
+        for (i = 0; i < hosts->size; i++) {
+            uint32_t j;
+
+            if (hosts->slot[i].id == 0)
+                continue;
+
+            for (j = (hosts->slot[i].addr * 0x9e3779b1U) & (grown.size - 1); grown.slot[j].id;
+                 j = (j + 1) & (grown.size - 1))
+                ;
+            grown.slot[j] = hosts->slot[i];
+        }
+        safe_free(hosts->slot);
+        *hosts = grown;
+    }
+
+    mask = hosts->size - 1;
+    for (i = (addr * 0x9e3779b1U) & mask; hosts->slot[i].id; i = (i + 1) & mask) {
+        if (hosts->slot[i].addr == addr)
+            return hosts->slot[i].id;
+    }
+
+    hosts->slot[i].addr = addr;
+    hosts->slot[i].id = ++hosts->cnt;
+    return hosts->cnt;
+}
+
+/**
+ * \brief Remember what --unique-ip-pool changes in a cached IPv4 packet
  *
- * Finds out if flow is unique and updates stats.
+ * The host numbers of both addresses and where the IP and TCP/UDP
+ * checksums covering them are.  Fragments after the first have no
+ * layer 4 header of their own.
  */
-static inline void
-update_flow_stats(tcpreplay_t *ctx,
-                  sendpacket_t *sp,
-                  const struct pcap_pkthdr *pkthdr,
-                  const u_char *pktdata,
-                  int datalink)
+static void
+unique_ip_pool_offsets(tcpreplay_t *ctx, packet_cache_t *cached_packet, uint32_t l2len)
+{
+    const ipv4_hdr_t *ip_hdr = (const ipv4_hdr_t *)(cached_packet->pktdata + l2len);
+    uint32_t caplen = cached_packet->pkthdr.caplen;
+    uint32_t l4 = l2len + (ip_hdr->ip_hl << 2);
+
+    cached_packet->unique_src_host = unique_host_id(&ctx->unique_hosts, ip_hdr->ip_src.s_addr);
+    cached_packet->unique_dst_host = unique_host_id(&ctx->unique_hosts, ip_hdr->ip_dst.s_addr);
+    cached_packet->unique_ip_sum = l2len + offsetof(ipv4_hdr_t, ip_sum);
+
+    if ((ntohs(ip_hdr->ip_off) & IP_OFFMASK) != 0)
+        return;
+
+    switch (ip_hdr->ip_p) {
+    case IPPROTO_TCP:
+        if (caplen >= l4 + TCPR_TCP_H && l4 + TCPR_TCP_H <= UINT16_MAX)
+            cached_packet->unique_l4_sum = l4 + offsetof(tcp_hdr_t, th_sum);
+        break;
+
+    case IPPROTO_UDP:
+        if (caplen >= l4 + TCPR_UDP_H && l4 + TCPR_UDP_H <= UINT16_MAX) {
+            cached_packet->unique_l4_sum = l4 + offsetof(udp_hdr_t, uh_sum);
+            cached_packet->unique_udp = true;
+        }
+        break;
+
+    default:
+        break;
+    }
+}
+
+/**
+ * \brief Remember where --unique-ip edits a cached packet
+ *
+ * Done once while preloading so the loops don't have to parse layer 2
+ * again.  Leaves the offsets at 0 for packets fast_edit_packet() rejects.
+ */
+static void
+unique_ip_offsets(tcpreplay_t *ctx, packet_cache_t *cached_packet, int datalink)
+{
+    uint32_t _U_ vlan_offset;
+    uint16_t ether_type;
+    uint32_t l2offset;
+    uint32_t l2len;
+    uint32_t caplen = cached_packet->pkthdr.caplen;
+
+    if (get_l2len_protocol(cached_packet->pktdata, caplen, datalink, &ether_type, &l2len, &l2offset, &vlan_offset) < 0)
+        return;
+
+    switch (ether_type) {
+    case ETHERTYPE_IP:
+        if (caplen < l2len + sizeof(ipv4_hdr_t) || l2len + sizeof(ipv4_hdr_t) > UINT16_MAX)
+            return;
+        cached_packet->unique_src = l2len + offsetof(ipv4_hdr_t, ip_src);
+        cached_packet->unique_dst = l2len + offsetof(ipv4_hdr_t, ip_dst);
+        if (ctx->options->unique_pool_size)
+            unique_ip_pool_offsets(ctx, cached_packet, l2len);
+        break;
+
+    case ETHERTYPE_IP6:
+        if (caplen < l2len + sizeof(ipv6_hdr_t) || l2len + sizeof(ipv6_hdr_t) > UINT16_MAX)
+            return;
+        /* only the last 32 bits of IPv6 addresses are changed */
+        cached_packet->unique_src = l2len + offsetof(ipv6_hdr_t, ip_src) + 12;
+        cached_packet->unique_dst = l2len + offsetof(ipv6_hdr_t, ip_dst) + 12;
+        break;
+
+    default:
+        break;
+    }
+}
+
+/*
+ * the --unique-ip-pool address of host on the given loop, network byte
+ * order.  With --rss-balance the blocks have room for the loop's addresses
+ * to start up to RSS_BALANCE_TRIES - 1 further on, by nudge.
+ */
+static inline uint32_t
+unique_pool_addr(const tcpreplay_t *ctx, uint32_t host, COUNTER iteration, uint32_t nudge)
+{
+    const tcpreplay_opt_t *options = ctx->options;
+    /* not the network and broadcast addresses */
+    u_int64_t usable = options->unique_pool_size - 2;
+    u_int64_t block = ctx->unique_hosts.cnt + (options->rss_balance ? RSS_BALANCE_TRIES - 1 : 0);
+    u_int64_t offset = ((u_int64_t)(iteration - 1) * block + nudge + host - 1) % usable;
+
+    return htonl(options->unique_pool + 1 + (uint32_t)offset);
+}
+
+/**
+ * \brief --rss-balance: where the pool addresses of a unique loop start
+ *
+ * Of the RSS_BALANCE_TRIES offsets, the one leaving the fewest packets on
+ * the busiest receive queue.  The flows gathered while preloading only
+ * need the hash of the new addresses XORed into that of their ports, so
+ * this is done once a loop, before the pass, and not per packet.
+ */
+static uint32_t
+unique_pool_nudge(tcpreplay_t *ctx, COUNTER iteration)
+{
+    tcpr_rss_t *rss = ctx->rss;
+    COUNTER least = 0;
+    uint32_t nudge, best = 0, i;
+
+    if (rss == NULL || !rss->balance)
+        return 0;
+    if (rss->balanced == iteration)
+        return rss->nudge;
+
+    for (nudge = 0; nudge < RSS_BALANCE_TRIES; nudge++) {
+        COUNTER busiest = 0;
+
+        memset(rss->loads, 0, sizeof(COUNTER) * rss->queues);
+        for (i = 0; i < rss->flow_size; i++) {
+            const rss_flow_t *flow = &rss->flows[i];
+            uint32_t src, dst, hash;
+            int queue;
+
+            if (flow->src_host == 0)
+                continue;
+
+            src = unique_pool_addr(ctx, flow->src_host, iteration, nudge);
+            dst = unique_pool_addr(ctx, flow->dst_host, iteration, nudge);
+            hash = flow_rss_bytes(rss->toeplitz, 0, (const u_char *)&src, sizeof(src)) ^
+                   flow_rss_bytes(rss->toeplitz, sizeof(src), (const u_char *)&dst, sizeof(dst)) ^ flow->ports;
+            queue = rss_queue(rss, hash);
+            rss->loads[queue] += flow->packets;
+            if (rss->loads[queue] > busiest)
+                busiest = rss->loads[queue];
+        }
+
+        if (nudge == 0 || busiest < least) {
+            least = busiest;
+            best = nudge;
+        }
+    }
+
+    dbgx(1, "--rss-balance: unique loop " COUNTER_SPEC " starts %u into its block, busiest queue " COUNTER_SPEC,
+         iteration, best, least);
+    rss->balanced = iteration;
+    rss->nudge = best;
+    return best;
+}
+
+/**
+ * \brief Apply --unique-ip to a whole cached file before a pass
+ *
+ * Same edit as fast_edit_packet() in cached mode, run as one tight loop
+ * over the offsets found by unique_ip_offsets(), so the send loop itself
+ * runs as fast as it does without --unique-ip.  With --unique-ip-pool,
+ * IPv4 addresses are set to those of the loop instead and the checksums
+ * patched to match.
+ */
+static void
+unique_ip_cache(tcpreplay_t *ctx, file_cache_t *file_cache, COUNTER iteration)
+{
+    packet_cache_t *cached_packet = file_cache->packet_cache;
+    packet_cache_t *end = cached_packet + file_cache->packet_cnt;
+    uint32_t src_ip, dst_ip;
+    uint32_t nudge = unique_pool_nudge(ctx, iteration);
+
+    for (; cached_packet < end; ++cached_packet) {
+        if (cached_packet->unique_src == 0)
+            continue;
+
+        if (cached_packet->unique_src_host != 0) {
+            uint32_t old_src, old_dst, diff;
+            u_char *l4_sum = cached_packet->pktdata + cached_packet->unique_l4_sum;
+
+            memcpy(&old_src, cached_packet->pktdata + cached_packet->unique_src, sizeof(old_src));
+            memcpy(&old_dst, cached_packet->pktdata + cached_packet->unique_dst, sizeof(old_dst));
+            src_ip = unique_pool_addr(ctx, cached_packet->unique_src_host, iteration, nudge);
+            dst_ip = unique_pool_addr(ctx, cached_packet->unique_dst_host, iteration, nudge);
+            memcpy(cached_packet->pktdata + cached_packet->unique_src, &src_ip, sizeof(src_ip));
+            memcpy(cached_packet->pktdata + cached_packet->unique_dst, &dst_ip, sizeof(dst_ip));
+
+            diff = tcpr_csum_add(tcpr_csum_add(~old_src, src_ip), tcpr_csum_add(~old_dst, dst_ip));
+            tcpr_csum_patch(cached_packet->pktdata + cached_packet->unique_ip_sum, diff);
+            if (cached_packet->unique_l4_sum != 0 && !(cached_packet->unique_udp && l4_sum[0] == 0 && l4_sum[1] == 0)) {
+                tcpr_csum_patch(l4_sum, diff);
+                /* a UDP checksum of 0 would mean there is none */
+                if (cached_packet->unique_udp && l4_sum[0] == 0 && l4_sum[1] == 0)
+                    l4_sum[0] = l4_sum[1] = 0xff;
+            }
+            continue;
+        }
+
+        memcpy(&src_ip, cached_packet->pktdata + cached_packet->unique_src, sizeof(src_ip));
+        memcpy(&dst_ip, cached_packet->pktdata + cached_packet->unique_dst, sizeof(dst_ip));
+        src_ip = ntohl(src_ip);
+        dst_ip = ntohl(dst_ip);
+
+        unique_ip_adjust(&src_ip, &dst_ip, iteration, true);
+
+        src_ip = htonl(src_ip);
+        dst_ip = htonl(dst_ip);
+        memcpy(cached_packet->pktdata + cached_packet->unique_src, &src_ip, sizeof(src_ip));
+        memcpy(cached_packet->pktdata + cached_packet->unique_dst, &dst_ip, sizeof(dst_ip));
+    }
+}
+
+/**
+ * \brief --resume: bring the --unique-ip edits of the cached files up to
+ * the pass of the checkpoint
+ *
+ * unique_ip_cache() moves a cached file on by one step every new unique
+ * pass, so a fresh cache takes again the steps of the passes before the
+ * checkpoint's.  Files before idx had this pass's step too; the others
+ * take it from send_packets() as usual.
+ */
+void
+unique_ip_resume(tcpreplay_t *ctx, int idx)
 {
-    flow_entry_type_t res = flow_decode(ctx->flow_hash_table, pkthdr, pktdata, datalink, ctx->options->flow_expiry);
+    tcpreplay_opt_t *options = ctx->options;
+    COUNTER it, unique, last_unique = 0;
+    int i;
+
+    if (!options->unique_ip)
+        return;
+
+    for (it = 1; it <= ctx->iteration; it++) {
+        unique = ((it * 1000) / (COUNTER)(options->unique_loops * 1000.0)) + 1;
+        if (unique > last_unique) {
+            for (i = 0; i < options->source_cnt && (it < ctx->iteration || i < idx); i++) {
+                file_cache_t *file_cache = &options->file_cache[i];
+
+                if (file_cache->cached && !file_cache->streamed)
+                    unique_ip_cache(ctx, file_cache, unique - 1);
+            }
+        }
+        last_unique = unique;
+    }
+}
+#endif
 
+/**
+ * \brief Count a classified packet in the flow stats
+ *
+ * Either of stats or sp may be NULL.  The counters of sp are the live
+ * ones --stats-socket reads, so they're kept for every pass, cached or not.
+ */
+void
+count_flow_stats(tcpreplay_stats_t *stats, sendpacket_t *sp, flow_entry_type_t res)
+{
     switch (res) {
     case FLOW_ENTRY_NEW:
-        ++ctx->stats.flows;
-        ++ctx->stats.flows_unique;
-        ++ctx->stats.flow_packets;
+        TCPR_PROBE1(flow__new, sp);
+        if (stats) {
+            ++stats->flows;
+            ++stats->flows_unique;
+            ++stats->flow_packets;
+        }
         if (sp) {
             ++sp->flows;
             ++sp->flows_unique;
@@ -244,15 +679,19 @@ update_flow_stats(tcpreplay_t *ctx,
         break;
 
     case FLOW_ENTRY_EXISTING:
-        ++ctx->stats.flow_packets;
+        if (stats)
+            ++stats->flow_packets;
         if (sp)
             ++sp->flow_packets;
         break;
 
     case FLOW_ENTRY_EXPIRED:
-        ++ctx->stats.flows_expired;
-        ++ctx->stats.flows;
-        ++ctx->stats.flow_packets;
+        TCPR_PROBE1(flow__expired, sp);
+        if (stats) {
+            ++stats->flows_expired;
+            ++stats->flows;
+            ++stats->flow_packets;
+        }
         if (sp) {
             ++sp->flows_expired;
             ++sp->flows;
@@ -261,34 +700,104 @@ update_flow_stats(tcpreplay_t *ctx,
         break;
 
     case FLOW_ENTRY_NON_IP:
-        ++ctx->stats.flow_non_flow_packets;
+        if (stats)
+            ++stats->flow_non_flow_packets;
         if (sp)
             ++sp->flow_non_flow_packets;
         break;
 
     case FLOW_ENTRY_INVALID:
-        ++ctx->stats.flows_invalid_packets;
+        if (stats)
+            ++stats->flows_invalid_packets;
         if (sp)
             ++sp->flows_invalid_packets;
         break;
     }
 }
+
 /**
- * \brief Preloads the memory cache for the given pcap file_idx
+ * \brief Update flow stats
  *
- * Preloading can be used with or without --loop
+ * Finds out if flow is unique and updates stats. When building the
+ * cache, the result is also stored with the cached packet so later
+ * passes don't have to decode the packet again.
  */
-void
-preload_pcap_file(tcpreplay_t *ctx, int idx)
+static inline void
+update_flow_stats(tcpreplay_t *ctx,
+                  sendpacket_t *sp,
+                  const struct pcap_pkthdr *pkthdr,
+                  const u_char *pktdata,
+                  int datalink,
+                  packet_cache_t *cached_packet)
+{
+    uint32_t flow_id;
+    flow_entry_type_t res =
+            flow_decode(ctx->flow_hash_table, pkthdr, pktdata, datalink, ctx->options->flow_expiry, &flow_id);
+
+    if (cached_packet != NULL) {
+        cached_packet->flow_id = flow_id;
+        cached_packet->flow_type = (uint8_t)res;
+    }
+
+    count_flow_stats(&ctx->stats, sp, res);
+}
+/**
+ * \brief compile --preload-filter for the link type of a file about to be
+ * preloaded
+ */
+static void
+preload_filter_open(const tcpreplay_opt_t *options, file_cache_t *file_cache, const char *path)
+{
+    pcap_t *dead;
+
+    file_cache->filter_kept = 0;
+    file_cache->filter_dropped = 0;
+    if (options->preload_filter == NULL)
+        return;
+
+    if ((dead = pcap_open_dead(file_cache->dlt, MAX_SNAPLEN)) == NULL)
+        errx(-1, "Unable to compile --preload-filter for %s", path);
+
+    file_cache->filter = safe_malloc(sizeof(struct bpf_program));
+    if (pcap_compile(dead, file_cache->filter, options->preload_filter, 1, 0) != 0)
+        errx(-1, "--preload-filter '%s' can't be used for %s: %s", options->preload_filter, path, pcap_geterr(dead));
+    pcap_close(dead);
+}
+
+/**
+ * \brief the file is cached, its packets aren't filtered again
+ */
+static void
+preload_filter_close(file_cache_t *file_cache)
+{
+    if (file_cache->filter == NULL)
+        return;
+
+    pcap_freecode(file_cache->filter);
+    safe_free(file_cache->filter);
+    file_cache->filter = NULL;
+}
+
+/**
+ * \brief Read the given pcap file into its memory cache
+ *
+ * With defer, only the file's own cache is touched, so several files can
+ * be read at once.  Their flow stats and the rest are then left to
+ * preload_pcap_finish().
+ */
+static void
+preload_pcap_read(tcpreplay_t *ctx, int idx, bool defer)
 {
     tcpreplay_opt_t *options = ctx->options;
     char *path = options->sources[idx].filename;
-    pcap_t *pcap = NULL;
+    pkt_source_t *src;
     char ebuf[PCAP_ERRBUF_SIZE];
     const u_char *pktdata = NULL;
     struct pcap_pkthdr pkthdr;
     packet_cache_t *cached_packet = NULL;
     packet_cache_t **prev_packet = &cached_packet;
+    file_cache_t *file_cache = &options->file_cache[idx];
+    pcap_index_t *index;
     int dlt;
 
     /* close stdin if reading from it (needed for some OS's) */
@@ -296,133 +805,1897 @@ preload_pcap_file(tcpreplay_t *ctx, int idx)
         if (close(1) == -1)
             warnx("unable to close stdin: %s", strerror(errno));
 
-    if ((pcap = pcap_open_offline(path, ebuf)) == NULL)
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    /* an up to date cache image saves reading the pcap at all */
+    if (options->cache_image && cache_image_load(ctx, idx, !defer) == 0) {
+        file_cache->cached = TRUE;
+        if (defer)
+            return;
+
+        if (options->flow_stats && !file_cache->image_flows) {
+            for (cached_packet = file_cache->packet_cache;
+                 cached_packet < file_cache->packet_cache + file_cache->packet_cnt;
+                 ++cached_packet)
+                update_flow_stats(ctx, NULL, &cached_packet->pkthdr, cached_packet->pktdata, file_cache->dlt, cached_packet);
+        }
+        if (ctx->rss != NULL) {
+            for (cached_packet = file_cache->packet_cache;
+                 cached_packet < file_cache->packet_cache + file_cache->packet_cnt;
+                 ++cached_packet)
+                rss_count(ctx->rss, cached_packet, file_cache->dlt);
+        }
+
+        if (options->threads <= 1)
+            build_send_schedule(ctx, file_cache);
+        return;
+    }
+#endif
+
+    /* for classic pcap files the cache only indexes the file mapping */
+    if ((src = pkt_source_open(ctx, idx, options->mmap_pcap || options->cache_memory != 0, ebuf)) == NULL)
         errx(-1, "Error opening pcap file: %s", ebuf);
 
-    dlt = pcap_datalink(pcap);
-    /* loop through the pcap.  get_next_packet() builds the cache for us! */
-    while ((pktdata = get_next_packet(ctx, pcap, &pkthdr, idx, prev_packet)) != NULL) {
-        if (options->flow_stats)
-            update_flow_stats(ctx, NULL, &pkthdr, pktdata, dlt);
+    dlt = file_cache->dlt;
+    file_cache->snaplen = options->preload_snaplen;
+    slice_open(ctx, idx);
+    preload_filter_open(options, file_cache, path);
+    if (options->preload_dedup && file_cache->mmap == NULL)
+        file_cache->dedup = safe_malloc(sizeof(preload_dedup_t));
+
+    /* an up to date index tells us how big the cache will be, unless only a slice or a filter's subset is kept */
+    if (file_cache->packet_cache == NULL && !options->slice && file_cache->filter == NULL &&
+        (index = pcap_index_load(path)) != NULL) {
+        if (index->num_packets > 0) {
+            file_cache->packet_max = index->num_packets;
+            file_cache->packet_cache = (packet_cache_t *)safe_malloc(index->num_packets * sizeof(packet_cache_t));
+        }
+        pcap_index_free(index);
+    }
+
+    /*
+     * loop through the pcap.  get_next_packet() builds the cache for us!
+     * Streamed files may be loaded on another thread while ctx is sending,
+     * so their flow stats are counted while sending instead
+     */
+    while ((pktdata = get_next_packet(ctx, &pkthdr, idx, prev_packet)) != NULL) {
+        if (defer)
+            continue;
+        if (options->flow_stats && !options->file_cache[idx].streamed)
+            update_flow_stats(ctx, NULL, &pkthdr, pktdata, dlt, cached_packet);
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+        if (options->unique_ip && !options->file_cache[idx].streamed)
+            unique_ip_offsets(ctx, cached_packet, dlt);
+        if (ctx->rss != NULL && !options->file_cache[idx].streamed)
+            rss_count(ctx->rss, cached_packet, dlt);
+        if (options->gen_field_cnt != 0)
+            gen_template_offsets(file_cache, cached_packet);
+#ifdef ENABLE_RXMATCH
+        if (options->rx_intf != NULL && options->gen_field_cnt == 0)
+            cached_packet->rx_sig = rxmatch_sig(cached_packet->pktdata, cached_packet->pkthdr.caplen, dlt);
+#endif
+#endif
+    }
+
+    if (file_cache->dedup != NULL) {
+        safe_free(file_cache->dedup->slot);
+        safe_free(file_cache->dedup);
+        file_cache->dedup = NULL;
     }
+    preload_filter_close(file_cache);
 
     /* mark this file as cached */
     options->file_cache[idx].cached = TRUE;
     options->file_cache[idx].dlt = dlt;
-    pcap_close(pcap);
+    pkt_source_close(src);
+    if (options->cache_memory != 0)
+        cache_memory_release(file_cache);
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT && defined ENABLE_FRAGROUTE
+    if (frag_ctx != NULL && !defer)
+        preload_fragroute(ctx, idx);
+#endif
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    if (options->gso && !defer)
+        gso_coalesce(file_cache);
+    if (options->cache_image && !defer)
+        cache_image_save(ctx, idx);
+#ifdef ENABLE_PRELOAD_LZ4
+    if (options->preload_lz4 && !defer)
+        preload_lz4_compress(file_cache);
+#endif
+
+    /* tcpreplay-edit may change packet sizes while sending */
+    if (options->threads <= 1 && !defer)
+        build_send_schedule(ctx, &options->file_cache[idx]);
+#endif
+}
+
+/**
+ * \brief Preloads the memory cache for the given pcap file_idx
+ *
+ * Preloading can be used with or without --loop
+ */
+void
+preload_pcap_file(tcpreplay_t *ctx, int idx)
+{
+    preload_pcap_read(ctx, idx, false);
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * \brief Preload the given file, leaving the rest to preload_pcap_finish()
+ *
+ * Only touches the file's own cache, so it may run on any thread, even
+ * while ctx is sending
+ */
+void
+preload_pcap_defer(tcpreplay_t *ctx, int idx)
+{
+    preload_pcap_read(ctx, idx, true);
+}
+
+/**
+ * \brief Do what preload_pcap_read() left for later, in file order
+ *
+ * Flows are numbered in the order they are first seen, so walking the
+ * files one after another gives the same flow stats as preloading them
+ * one at a time.
+ */
+void
+preload_pcap_finish(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *file_cache = &options->file_cache[idx];
+    packet_cache_t *cached_packet = file_cache->packet_cache;
+    packet_cache_t *end = cached_packet + file_cache->packet_cnt;
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    /* a cache image already has everything but maybe the flow stats */
+    bool fresh = file_cache->image == NULL;
+#endif
+
+    for (; cached_packet < end; ++cached_packet) {
+        if (options->flow_stats && !file_cache->image_flows)
+            update_flow_stats(ctx, NULL, &cached_packet->pkthdr, cached_packet->pktdata, file_cache->dlt, cached_packet);
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+        if (options->unique_ip && fresh)
+            unique_ip_offsets(ctx, cached_packet, file_cache->dlt);
+        if (ctx->rss != NULL)
+            rss_count(ctx->rss, cached_packet, file_cache->dlt);
+        if (options->gen_field_cnt != 0 && fresh)
+            gen_template_offsets(file_cache, cached_packet);
+#ifdef ENABLE_RXMATCH
+        if (options->rx_intf != NULL && options->gen_field_cnt == 0 && fresh)
+            cached_packet->rx_sig =
+                    rxmatch_sig(cached_packet->pktdata, cached_packet->pkthdr.caplen, file_cache->dlt);
+#endif
+#endif
+    }
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT && defined ENABLE_FRAGROUTE
+    if (frag_ctx != NULL)
+        preload_fragroute(ctx, idx);
+#endif
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    if (options->gso && fresh)
+        gso_coalesce(file_cache);
+    if (options->cache_image && fresh)
+        cache_image_save(ctx, idx);
+#ifdef ENABLE_PRELOAD_LZ4
+    if (options->preload_lz4 && fresh)
+        preload_lz4_compress(file_cache);
+#endif
+
+    if (options->threads <= 1)
+        build_send_schedule(ctx, file_cache);
+#endif
+}
+
+typedef struct preload_pool_s {
+    tcpreplay_t *ctx;
+    int next;          /* next file for a thread to take */
+    bool *done;        /* per file, set once it's read */
+    pthread_mutex_t lock;
+    pthread_cond_t file_done;
+} preload_pool_t;
+
+/*
+ * Worker thread, reads the next file until there are none left
+ */
+static void *
+preload_pool_thread(void *arg)
+{
+    preload_pool_t *pool = (preload_pool_t *)arg;
+    int idx;
+
+    while ((idx = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < pool->ctx->options->source_cnt) {
+        preload_pcap_read(pool->ctx, idx, true);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done[idx] = true;
+        pthread_cond_broadcast(&pool->file_done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief how many threads to read the pcap files with, 1 to read them here
+ *
+ * Files are only read in parallel when nothing but their own cache is
+ * touched while reading: not stdin, and not into netmap buffers, which
+ * are handed out from the one interface.
+ */
+static int
+preload_pool_size(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i, cnt = options->source_cnt;
+
+#ifdef HAVE_NETMAP
+    if (options->netmap)
+        return 1;
+#endif
+
+    for (i = 0; i < options->source_cnt; i++) {
+        if (options->sources[i].type != source_filename || strncmp(options->sources[i].filename, "-", 1) == 0 ||
+            shm_pipe_path(options->sources[i].filename))
+            return 1;
+    }
+
+    if (ncpus > 0 && cnt > ncpus)
+        cnt = (int)ncpus;
+
+    return min(cnt, PRELOAD_MAX_THREADS);
+}
+#endif /* HAVE_PTHREAD */
+
+/**
+ * \brief estimate how many bytes preloading the files takes
+ *
+ * Exact, bar the arenas' slack, for files with an up to date index.  For
+ * the others only the file size is counted, so the estimate is low by
+ * PACKET_HEADROOM and a packet_cache_t for each of their packets; their
+ * number is returned in unindexed.
+ */
+COUNTER
+preload_footprint(tcpreplay_t *ctx, int *unindexed)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    pcap_index_t *index;
+    struct stat statinfo;
+    COUNTER bytes = 0;
+    int i;
+
+    *unindexed = 0;
+    for (i = 0; i < options->source_cnt; i++) {
+        const char *path = options->sources[i].filename;
+
+        if (options->sources[i].type != source_filename || path == NULL || strcmp(path, "-") == 0 ||
+            shm_pipe_path(path)) {
+            ++*unindexed;
+            continue;
+        }
+
+        if ((index = pcap_index_load(path)) != NULL) {
+            bytes += index->num_bytes + index->num_packets * (PACKET_HEADROOM + sizeof(packet_cache_t));
+            pcap_index_free(index);
+        } else {
+            if (stat(path, &statinfo) == 0)
+                bytes += (COUNTER)statinfo.st_size;
+            ++*unindexed;
+        }
+    }
+
+    return bytes;
+}
+
+/**
+ * \brief Preload every pcap file, reading several at once if we can
+ *
+ * Each file is read by a thread of its own into its own cache.  The
+ * flow stats are then merged here, file by file as each is done, while
+ * the threads go on with the files after it.
+ */
+void
+preload_pcap_files(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int i;
+#ifdef HAVE_PTHREAD
+    pthread_t threads[PRELOAD_MAX_THREADS];
+    preload_pool_t pool;
+    int num_threads;
+#endif
+
+    /* Initialize each of the file cache structures */
+    for (i = 0; i < options->source_cnt; i++) {
+        options->file_cache[i].index = i;
+        options->file_cache[i].cached = FALSE;
+        options->file_cache[i].packet_cache = NULL;
+    }
+
+#ifdef HAVE_PTHREAD
+    num_threads = preload_pool_size(ctx);
+    if (num_threads > 1) {
+        memset(&pool, 0, sizeof(pool));
+        pool.ctx = ctx;
+        pool.done = safe_malloc(sizeof(bool) * options->source_cnt);
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.file_done, NULL);
+
+        for (i = 0; i < num_threads; i++) {
+            if (pthread_create(&threads[i], NULL, preload_pool_thread, &pool) != 0)
+                break;
+        }
+        num_threads = i;
+
+        if (num_threads > 0) {
+            dbgx(1, "Preloading %d files with %d threads", options->source_cnt, num_threads);
+
+            for (i = 0; i < options->source_cnt; i++) {
+                pthread_mutex_lock(&pool.lock);
+                while (!pool.done[i])
+                    pthread_cond_wait(&pool.file_done, &pool.lock);
+                pthread_mutex_unlock(&pool.lock);
+
+                preload_pcap_finish(ctx, i);
+            }
+
+            for (i = 0; i < num_threads; i++)
+                pthread_join(threads[i], NULL);
+        } else {
+            warn("Unable to start preload threads");
+        }
+
+        pthread_cond_destroy(&pool.file_done);
+        pthread_mutex_destroy(&pool.lock);
+        safe_free(pool.done);
+
+        if (num_threads > 0)
+            return;
+    }
+#endif
+
+    /* preload our pcap files */
+    for (i = 0; i < options->source_cnt; i++)
+        preload_pcap_file(ctx, i);
 }
 
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+/**
+ * \brief Turn the packet timestamps of a cached file into a send schedule
+ *
+ * For the multiplier, mbps and pps speed modes, each packet gets the
+ * absolute time (in ns from the start of the pass) at which it should
+ * go out, so the send loop only has to compare the clock against it.
+ * The file_cache->schedule_period is the offset of the following pass,
+ * which keeps the rate steady when looping.
+ */
 static void
-increment_iteration(tcpreplay_t *ctx)
+build_send_schedule(tcpreplay_t *ctx, file_cache_t *file_cache)
 {
     tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_speed_t *speed = &options->speed;
+    COUNTER i, pkt_cnt = file_cache->packet_cnt;
+    uint64_t *schedule;
+    uint64_t first_ns = 0, last_ns = 0, idle_ns = 0;
+    double ns_per_unit = 0;
+    COUNTER units = 0, burst_units = 0;
+    COUNTER burst = speed->pps_multi > 1 ? (COUNTER)speed->pps_multi : 1;
+
+    /* --microburst: the packets of a burst share the deadline of its first */
+    if (speed->microburst > 1)
+        burst = speed->microburst;
+
+    switch (speed->mode) {
+    case speed_multiplier:
+        ns_per_unit = 1.0 / speed->multiplier;
+        break;
+    case speed_mbpsrate:
+        if (speed->speed == 0)
+            return; /* top speed */
+        ns_per_unit = 1000000000.0 / (double)speed->speed; /* per bit */
+        break;
+    case speed_packetrate:
+        /* speed is in packets per hour */
+        ns_per_unit = 3600.0 * 1000000000.0 / (double)speed->speed;
+        break;
+    default:
+        return;
+    }
 
-    ctx->last_unique_iteration = ctx->unique_iteration;
-    ++ctx->iteration;
-    if (options->unique_ip) {
-        assert(options->unique_loops > 0.0);
-        ctx->unique_iteration = ((ctx->iteration * 1000) / (COUNTER)(options->unique_loops * 1000.0)) + 1;
+    /* the rate of a --rate-profile changes while sending, so is paced as it goes */
+    if (pkt_cnt == 0 || speed->profile != NULL)
+        return;
+
+    schedule = safe_malloc(sizeof(uint64_t) * pkt_cnt);
+    for (i = 0; i < pkt_cnt; i++) {
+        const struct pcap_pkthdr *pkthdr = &file_cache->packet_cache[i].pkthdr;
+        /* --repeat: the rates count every copy */
+        COUNTER copies = repeat_copies(options, &file_cache->packet_cache[i]);
+
+        switch (speed->mode) {
+        case speed_multiplier: {
+            uint64_t ts_ns = pkthdr_ts_ns(pkthdr, file_cache->nsec);
+
+            /* timestamps which go backwards in time don't cause a wait */
+            if (i == 0) {
+                first_ns = last_ns = ts_ns;
+            } else if (ts_ns > last_ns) {
+                /* --idle-gap: the quiet spell is cut out of the rest of the timeline */
+                idle_ns += ts_ns - last_ns - idle_gap_delta(options, last_ns, ts_ns);
+                last_ns = ts_ns;
+            }
+
+            schedule[i] = (uint64_t)((double)(last_ns - first_ns - idle_ns) * ns_per_unit);
+            break;
+        }
+        case speed_mbpsrate: {
+            const packet_cache_t *cached_packet = &file_cache->packet_cache[i];
+            COUNTER caplen = cached_packet->pad_caplen ? cached_packet->pad_caplen : pkthdr->caplen;
+
+            /* a packet may leave once its last bit fits in the rate, a burst once the ones before it do */
+            if (i % burst == 0)
+                burst_units = units;
+            units += copies * tcpreplay_pace_bits(speed, 1, options->use_pkthdr_len ? (COUNTER)pkthdr->len : caplen);
+            schedule[i] = (uint64_t)((double)(speed->microburst > 1 ? burst_units : units) * ns_per_unit);
+            break;
+        }
+        case speed_packetrate:
+            /* packets of a pps_multi burst share the deadline of the first, units are the packets before */
+            if (i % burst == 0)
+                burst_units = units;
+            schedule[i] = (uint64_t)((double)(speed->microburst > 1 ? burst_units : units - units % burst) * ns_per_unit);
+            units += copies;
+            break;
+        default:
+            assert(0);
+        }
+    }
+
+    if (speed->mode == speed_packetrate)
+        file_cache->schedule_period = (uint64_t)((double)units * ns_per_unit);
+    else if (speed->mode == speed_mbpsrate && speed->microburst > 1)
+        file_cache->schedule_period = (uint64_t)((double)units * ns_per_unit);
+    else
+        file_cache->schedule_period = schedule[pkt_cnt - 1];
+
+    /* --burst, in the units of the rate */
+    if (speed->mode == speed_mbpsrate)
+        file_cache->schedule_burst_ns = (uint64_t)((double)speed->burst * 8 * ns_per_unit);
+    else if (speed->mode == speed_packetrate)
+        file_cache->schedule_burst_ns = (uint64_t)((double)speed->burst * ns_per_unit);
+
+    file_cache->schedule = schedule;
+    dbgx(1,
+         "Built send schedule for " COUNTER_SPEC " packets, period %" PRIu64 " ns, %" PRIu64 " ns of idle time cut",
+         pkt_cnt,
+         file_cache->schedule_period,
+         idle_ns);
+}
+
+#endif /* TCPREPLAY && !TCPREPLAY_EDIT */
+
+static void send_packet_batch(tcpreplay_t *ctx, sendpacket_t *sp, const sendpacket_pkt_t *batch, int cnt);
+
+/**
+ * \brief --microburst: send what is left of a burst and count it
+ */
+static void
+microburst_end(tcpreplay_t *ctx, sendpacket_t *sp, const sendpacket_pkt_t *batch, int *batch_cnt, u_int64_t start_ns, COUNTER start_bytes)
+{
+    tcpreplay_stats_t *stats = &ctx->stats;
+    u_int64_t now_ns;
+
+    if (*batch_cnt > 0) {
+        send_packet_batch(ctx, sp, batch, *batch_cnt);
+        *batch_cnt = 0;
+    }
+
+    now_ns = tcpr_clock_ns();
+    ++stats->bursts;
+    stats->burst_bytes += stats->bytes_sent - start_bytes;
+    stats->burst_ns += now_ns - start_ns;
+    stats->end_time_ns = now_ns;
+}
+
+/**
+ * \brief how close together scheduled packets have to be due to go out in one batch
+ *
+ * Packets the timer can't tell apart may as well be sent together: within
+ * the margin --timer=hybrid has learned, the nanosleep() overshoot for the
+ * other sleeping timers, or about the cost of a send for those which spin.
+ * --wakeup-slack widens it to save wakeups at low rates.
+ */
+static u_int64_t
+batch_window_ns(const tcpreplay_opt_t *options, const sendpacket_t *sp)
+{
+    u_int64_t window;
+
+    switch (options->accurate) {
+    case accurate_hybrid:
+        window = sp->sleep_margin_ns != 0 ? sp->sleep_margin_ns : options->hybrid_margin_ns;
+        break;
+    case accurate_gtod:
+    case accurate_ioport:
+        window = HYBRID_MIN_MARGIN_NS;
+        break;
+    case accurate_txtime:
+        /* the kernel spaces the packets out, only the slack counts */
+        window = 0;
+        break;
+    default:
+        window = options->hybrid_margin_ns;
+        break;
+    }
+
+    return options->speed.wakeup_slack_ns > window ? options->speed.wakeup_slack_ns : window;
+}
+
+/**
+ * \brief hand a batch of queued packets to sendpacket_batch()
+ */
+static void
+send_packet_batch(tcpreplay_t *ctx, sendpacket_t *sp, const sendpacket_pkt_t *batch, int cnt)
+{
+    tcpreplay_stats_t *stats = &ctx->stats;
+    COUNTER pkts_sent = sp->sent;
+    COUNTER bytes_sent = sp->bytes_sent;
+    int sent;
+
+    dbgx(2, "Sending batch of %d packets", cnt);
+    sent = sendpacket_batch(sp, batch, cnt);
+    if (sent < cnt)
+        warnx("Unable to send %d of %d packets: %s", cnt - sent, cnt, sendpacket_geterr(sp));
+
+    /* as counted by sendpacket, where a --gso super-frame is several packets */
+    stats->pkts_sent += sp->sent - pkts_sent;
+    stats->bytes_sent += sp->bytes_sent - bytes_sent;
+}
+
+/**
+ * \brief --probe-rate: queue a probe ahead of the packet about to go out, if one is due
+ *
+ * The first IPv4 packet shows what the probes look like.
+ */
+static void
+send_probe(tcpreplay_t *ctx,
+           sendpacket_t *sp,
+           const u_char *pktdata,
+           uint32_t caplen,
+           int datalink,
+           u_int64_t now_ns,
+           bool use_batch,
+           sendpacket_pkt_t *batch,
+           struct pcap_pkthdr *batch_pkthdr,
+           int *batch_cnt)
+{
+    tcpr_probe_t *pr = ctx->probe;
+    tcpreplay_stats_t *stats = &ctx->stats;
+    struct pcap_pkthdr *pkthdr;
+    const u_char *data;
+
+    if (!pr->ready && !probe_template(pr, pktdata, caplen, datalink))
+        return;
+    if (!probe_due(pr, now_ns))
+        return;
+
+    data = probe_next(pr, now_ns, &pkthdr);
+    if (use_batch) {
+        sendpacket_pkt_t *pkt = &batch[*batch_cnt];
+
+        memcpy(&batch_pkthdr[*batch_cnt], pkthdr, sizeof(struct pcap_pkthdr));
+        memset(pkt, 0, sizeof(*pkt));
+        pkt->data = data;
+        pkt->len = pkthdr->caplen;
+        pkt->pkthdr = &batch_pkthdr[*batch_cnt];
+        if (++*batch_cnt == SENDPACKET_BATCH_MAX) {
+            send_packet_batch(ctx, sp, batch, *batch_cnt);
+            *batch_cnt = 0;
+        }
+        return;
+    }
+
+#ifdef HAVE_PACKET_VNET_HDR
+    sp->csum_start = 0;
+    sp->csum_offset = 0;
+    sp->gso_size = 0;
+#endif
+    if (sendpacket(sp, data, pkthdr->caplen, pkthdr) < (int)pkthdr->caplen) {
+        warnx("Unable to send probe: %s", sendpacket_geterr(sp));
+        return;
     }
+
+    ++stats->pkts_sent;
+    stats->bytes_sent += pkthdr->caplen;
+}
+
+/**
+ * \brief ns between the last packet of a --loop-seamless iteration and the
+ * first of the next
+ *
+ * --loopdelay-ms when given.  Otherwise the multiplier spaces them by the
+ * mean packet gap of the file, while the mbps and pps rates already leave
+ * room for the first packet.
+ */
+static u_int64_t
+loop_gap_ns(tcpreplay_t *ctx, const file_cache_t *file_cache)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    u_int64_t first_ns, last_ns;
+
+    if (options->loopdelay_ms > 0)
+        return (u_int64_t)options->loopdelay_ms * 1000000;
+
+    if (options->speed.mode != speed_multiplier || file_cache->packet_cnt < 2)
+        return 0;
+
+    /* the quiet spells --idle-gap cut don't count either */
+    if (options->idle_gap_ns != 0 && file_cache->schedule != NULL)
+        return file_cache->schedule[file_cache->packet_cnt - 1] / (file_cache->packet_cnt - 1);
+
+    first_ns = pkthdr_ts_ns(&file_cache->packet_cache[0].pkthdr, file_cache->nsec);
+    last_ns = pkthdr_ts_ns(&file_cache->packet_cache[file_cache->packet_cnt - 1].pkthdr, file_cache->nsec);
+    if (last_ns <= first_ns)
+        return 0;
+
+    return (u_int64_t)((double)(last_ns - first_ns) / (double)(file_cache->packet_cnt - 1) / options->speed.multiplier);
+}
+
+/**
+ * \brief wait while suspended or sp is paused
+ *
+ * Speed changes meanwhile are applied when changed isn't NULL, and set
+ * *changed.  The wait ends within a millisecond of the resume, at once on
+ * an abort.  Returns how long it was paused for.
+ */
+static u_int64_t
+send_pause(tcpreplay_t *ctx, sendpacket_t *sp, bool *changed)
+{
+    tcpreplay_stats_t *stats = &ctx->stats;
+    u_int64_t start_ns = tcpr_clock_ns(), paused_ns;
+
+    dbgx(1, "%s paused", sp->device);
+    while ((ctx->suspend || sp->paused) && !ctx->abort) {
+        if (changed != NULL)
+            *changed |= tcpreplay_control_apply(ctx, stats->pkts_sent, stats->bytes_sent, tcpr_clock_ns());
+        if (sendpacket_nap(sp, 1000000) && !ctx->abort)
+            sendpacket_wake_clear(sp);
+    }
+
+    paused_ns = tcpr_clock_ns() - start_ns;
+    ctx->schedule_next_ns += paused_ns;
+    tcpreplay_pace_restart(ctx, stats->pkts_sent, stats->bytes_sent, tcpr_clock_ns());
+    dbgx(1, "%s resumed after %" PRIu64 " ns", sp->device, paused_ns);
+
+    return paused_ns;
+}
+
+/**
+ * \brief apply tcpreplay_control_speed() and wait while suspended or sp is
+ * paused
+ *
+ * The --mbps/--pps pacer starts over after a pause, so the replay doesn't
+ * try to make up for the time.  Returns true if the speed changed, after
+ * which the send schedules of preloaded files no longer apply and are
+ * dropped.
+ */
+static bool
+send_control(tcpreplay_t *ctx, sendpacket_t *sp, uint64_t *schedule_base)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_stats_t *stats = &ctx->stats;
+    bool changed = false;
+    int i;
+
+    if (ctx->suspend || sp->paused) {
+        u_int64_t paused_ns = send_pause(ctx, sp, &changed);
+
+        if (schedule_base != NULL)
+            *schedule_base += paused_ns;
+    }
+
+    changed |= tcpreplay_control_apply(ctx, stats->pkts_sent, stats->bytes_sent, tcpr_clock_ns());
+    if (changed) {
+        for (i = 0; i < MAX_FILES; i++) {
+            safe_free(options->file_cache[i].schedule);
+            options->file_cache[i].schedule = NULL;
+        }
+    }
+
+    return changed;
+}
+
+void
+increment_iteration(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    ctx->last_unique_iteration = ctx->unique_iteration;
+    ++ctx->iteration;
+    if (options->unique_ip) {
+        assert(options->unique_loops > 0.0);
+        ctx->unique_iteration = ((ctx->iteration * 1000) / (COUNTER)(options->unique_loops * 1000.0)) + 1;
+    }
+}
+
+/* what a variant of send_packets_loop() can leave out, see send_loop_variant() */
+#define SEND_LOOP_SINGLE 0x01   /* no --intf2 */
+#define SEND_LOOP_PLAIN 0x02    /* no per-packet extras: --profile, --verbose, --trace-ring, --repeat and the like */
+#define SEND_LOOP_CACHED 0x04   /* sent from the preload cache, not streamed */
+#define SEND_LOOP_TOPSPEED 0x08 /* started out at top speed */
+
+/*
+ * The variants of the send loop send_packets() picks from, see
+ * send_loop_variant(): cached at top speed on one interface, cached and
+ * paced, streamed and paced, and the generic one for everything else,
+ * two interfaces included.
+ */
+#define SEND_LOOP_FAST (SEND_LOOP_SINGLE | SEND_LOOP_PLAIN | SEND_LOOP_CACHED | SEND_LOOP_TOPSPEED)
+#define SEND_LOOP_CACHED_PACED (SEND_LOOP_SINGLE | SEND_LOOP_PLAIN | SEND_LOOP_CACHED)
+#define SEND_LOOP_STREAM_PACED (SEND_LOOP_SINGLE | SEND_LOOP_PLAIN)
+
+/**
+ * \brief --spray: the interface of the packet's flow
+ *
+ * Both directions of a flow hash the same, so a flow keeps its order on
+ * one interface.  Non-IP packets all go out intf1 to keep theirs.
+ */
+static sendpacket_t *
+spray_intf(tcpreplay_t *ctx, const struct pcap_pkthdr *pkthdr, const u_char *pktdata, int datalink)
+{
+    uint32_t hash;
+    int i;
+
+    if (!flow_hash(pkthdr, pktdata, datalink, &hash))
+        return ctx->intf1;
+
+    i = (int)(hash % (uint32_t)ctx->options->spray_cnt);
+    return i == 0 ? ctx->intf1 : i == 1 ? ctx->intf2 : ctx->pair_intf[i - 2];
+}
+
+/**
+ * the main loop function for tcpreplay.  This is where we figure out
+ * what to do with each packet
+ *
+ * Instantiated by send_packets() for each SEND_LOOP_* variant, which
+ * leaves out the checks its flags say are never true
+ */
+static inline __attribute__((always_inline)) void
+send_packets_loop(tcpreplay_t *ctx, int idx, const unsigned int variant)
+{
+    u_int64_t last_pkt_ns;
+    u_int64_t follow_spent = 0; /* --follow-dir: capture time which went by between the files */
+    u_int64_t now_ns;
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_stats_t *stats = &ctx->stats;
+    COUNTER packetnum = 0;
+    COUNTER limit_send = options->limit_send;
+    struct pcap_pkthdr pkthdr;
+    u_char *pktdata = NULL;
+    sendpacket_t *sp = ctx->intf1;
+    COUNTER pktlen, segs;
+    packet_cache_t *cached_packet = NULL;
+    packet_cache_t **prev_packet = NULL;
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+    struct pcap_pkthdr *pkthdr_ptr;
+#endif
+    int datalink = options->file_cache[idx].dlt;
+    COUNTER skip_length = 0;
+    COUNTER end_ns;
+    u_int64_t prof_mark = 0; /* --profile: when the current stage started */
+    u_int64_t trace_deadline = 0; /* --trace-ring: when the packet was due */
+    bool preload = options->file_cache[idx].cached;
+    /* a streamed file is fresh every pass, as if it wasn't cached */
+    bool fresh = !(variant & SEND_LOOP_CACHED) && (!preload || options->file_cache[idx].streamed);
+    /* constant false in the variants which leave them out */
+    const bool dual = !(variant & SEND_LOOP_SINGLE) && ctx->intf2 != NULL;
+    const bool extras = !(variant & SEND_LOOP_PLAIN);
+    const bool profile = extras && options->profile;
+    bool top_speed = (options->speed.mode == speed_topspeed ||
+                      (options->speed.mode == speed_mbpsrate && options->speed.speed == 0));
+    bool now_is_now = true;
+    sendpacket_pkt_t batch[SENDPACKET_BATCH_MAX];
+    struct pcap_pkthdr batch_pkthdr[SENDPACKET_BATCH_MAX];
+    int batch_cnt = 0;
+    uint16_t csum_start = 0, csum_offset = 0; /* set by edit_packet(), or by --gso */
+    uint16_t gso_size = 0, gso_hdr_len = 0;
+    bool gso_v6 = false;
+    bool use_batch = false;
+    bool unique_cached = false;
+    /* only a lone cached file can just wrap around */
+    bool seamless = options->loop_seamless && preload && !options->file_cache[idx].streamed &&
+                    options->source_cnt == 1;
+    const uint64_t *schedule = preload ? options->file_cache[idx].schedule : NULL;
+    uint64_t schedule_base = 0;
+    uint64_t schedule_skip = 0; /* --resume: where in the schedule this pass starts */
+    uint64_t prev_deadline = 0, prev_send_ns = 0;
+    /* --microburst: packets per burst when following the schedule, 0 if not */
+    COUNTER microburst = schedule != NULL ? options->speed.microburst : 0;
+    bool in_burst = false;
+    COUNTER burst_id = 0; /* which burst of the pass, from the first packet */
+    u_int64_t burst_start_ns = 0;
+    COUNTER burst_start_bytes = 0;
+    /* following the schedule, the packets due within a timer window of the first go out as one batch */
+    bool window_batch = false;
+    uint64_t window_end = 0;
+    int window_room = 0; /* what the interface can take, see sendpacket_batch_room() */
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    u_int32_t copy, copies;
+    u_char *repeat_scratch = NULL; /* --repeat-unique: shifted copies of the batched packets */
+    size_t repeat_used = 0;
+#endif
+#ifdef HAVE_SO_TXTIME
+    int64_t tai_offset = 0;
+#endif
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    /*
+     * at top speed, within a --microburst, and for the packets of the
+     * schedule due within one timer window, hand packets to
+     * sendpacket_batch() in bulk.  This requires packet data to stay put
+     * until the batch is flushed, which is the case when reading from the
+     * cache or a PKT_SOURCE_STABLE source such as a mmap'd file
+     */
+    use_batch = (top_speed || schedule != NULL) && ctx->intf2 == NULL &&
+                (options->preload_pcap || (pkt_source_caps(&options->file_cache[idx]) & PKT_SOURCE_STABLE));
+#ifdef ENABLE_VERBOSE
+    if (options->verbose)
+        use_batch = false;
+#endif
+
+    /* with --timer=txtime every packet carries its own launch time, only --wakeup-slack batches them */
+    window_batch = use_batch && schedule != NULL && microburst == 0 &&
+                   (options->accurate != accurate_txtime || options->speed.wakeup_slack_ns != 0);
+    if (!top_speed && microburst == 0 && !window_batch)
+        use_batch = false;
+    if (window_batch && options->hybrid_margin_ns == 0)
+        options->hybrid_margin_ns = hybrid_sleep_calibrate();
+
+    if (options->repeat_unique)
+        repeat_scratch = safe_malloc(FLOW_COPY_SCRATCH);
+
+    /* cached files get --unique-ip applied in one go, before the pass */
+    unique_cached = !fresh && options->unique_ip;
+    if (unique_cached && ctx->unique_iteration && ctx->unique_iteration > ctx->last_unique_iteration)
+        unique_ip_cache(ctx, &options->file_cache[idx], ctx->unique_iteration - 1);
+#endif
+
+    now_ns = tcpr_clock_ns();
+    if (stats->start_time_ns == 0) {
+        stats->start_time_ns = now_ns;
+        if (ctx->options->stats >= 0) {
+            char buf[64];
+            struct timeval start;
+
+            tcpr_clock_to_timeval(stats->start_time_ns, &start);
+            if (format_date_time(&start, buf, sizeof(buf)) > 0)
+                printf("Test start: %s ...\n", buf);
+        }
+        ctx->schedule_next_ns = 0;
+    }
+
+    if (schedule != NULL) {
+        uint64_t next_ns = ctx->schedule_next_ns;
+
+        /* --follow-dir: the quiet spell between two files is part of the timeline */
+        if (ctx->follow != NULL && next_ns != 0)
+            next_ns += follow_gap_ns(ctx, idx);
+
+        /* carry on from the previous pass unless we've fallen behind it */
+        schedule_base = now_ns;
+        if (next_ns > schedule_base)
+            schedule_base = next_ns;
+        ctx->schedule_next_ns = schedule_base + options->file_cache[idx].schedule_period;
+
+#ifdef HAVE_SO_TXTIME
+        /*
+         * the schedule runs on tcpr_clock_ns(), launch times on CLOCK_TAI.
+         * The two drift apart slowly, so re-sample the offset every pass
+         */
+        if (options->accurate == accurate_txtime) {
+            struct timespec tai;
+
+            clock_gettime(CLOCK_TAI, &tai);
+            tai_offset = (int64_t)TIMESPEC_TO_NANOSEC(&tai) - (int64_t)tcpr_clock_ns();
+        }
+#endif
+    }
+
+    ctx->skip_packets = 0;
+    last_pkt_ns = 0;
+    if (options->limit_time > 0)
+        end_ns = stats->start_time_ns + SEC_TO_NANOSEC(options->limit_time);
+    else
+        end_ns = 0;
+
+    /*
+     * --follow-dir: carry on from the last packet of the previous file,
+     * less the time spent getting to this one
+     */
+    if (ctx->follow != NULL && options->speed.mode == speed_multiplier && ctx->follow->last_pkt_ns != 0) {
+        last_pkt_ns = ctx->follow->last_pkt_ns;
+        follow_spent = (u_int64_t)((double)(now_ns - ctx->follow->last_send_ns) * options->speed.multiplier);
+    }
+
+    /* the caller's packets are sent from where they are, never cached */
+    if (options->preload_pcap && !(pkt_source_caps(&options->file_cache[idx]) & PKT_SOURCE_BORROWED)) {
+        prev_packet = &cached_packet;
+    } else {
+        prev_packet = NULL;
+    }
+
+    /*
+     * --resume: read on to the packet after the checkpoint, checkpoint_seek()
+     * got us most of the way.  The pacing starts over from here, so the
+     * packets keep their original spacing
+     */
+    if (ctx->resume != NULL && ctx->resume->source_idx == idx) {
+        packetnum = ctx->resume->seeked;
+        while (packetnum < ctx->resume->packetnum && get_next_packet(ctx, &pkthdr, idx, prev_packet) != NULL)
+            ++packetnum;
+
+        if (schedule != NULL && packetnum < options->file_cache[idx].packet_cnt) {
+            schedule_skip = schedule[packetnum];
+            ctx->schedule_next_ns -= schedule_skip;
+        }
+        tcpreplay_pace_restart(ctx, stats->pkts_sent, stats->bytes_sent, tcpr_clock_ns());
+        checkpoint_resumed(ctx);
+    }
+
+    /* past warm-up, anything allocated from here on is a steady-state allocation, see memstat.h */
+    tcpr_mem_guard(ctx->iteration > 0 || ctx->warmup_touched > 0);
+
+    /* MAIN LOOP
+     * Keep sending while we have packets or until
+     * we've sent enough packets
+     */
+    while (!ctx->abort) {
+        if (profile)
+            prof_mark = tcpr_prof_ticks();
+        if ((pktdata = get_next_packet(ctx, &pkthdr, idx, prev_packet)) == NULL) {
+            u_int64_t gap_ns;
+
+            if (!seamless || (!ctx->loop_forever && options->loop == 0))
+                break;
+
+            /* --loop-seamless: the next iteration starts from the top of the cache */
+            if (in_burst) {
+                microburst_end(ctx, sp, batch, &batch_cnt, burst_start_ns, burst_start_bytes);
+                in_burst = false;
+            }
+            increment_iteration(ctx);
+            tcpr_mem_guard(true);
+            if (options->loop > 0)
+                --options->loop;
+            if (options->stats == 0) {
+                packet_stats(stats);
+                printf("Loop " COUNTER_SPEC "...\n", ctx->iteration + 1);
+            }
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+            /* batched packets may still point at what unique_ip_cache() rewrites */
+            if (unique_cached && ctx->unique_iteration > ctx->last_unique_iteration) {
+                if (batch_cnt > 0) {
+                    send_packet_batch(ctx, sp, batch, batch_cnt);
+                    batch_cnt = 0;
+                }
+#ifdef ENABLE_SEND_THREADS
+                nic_threads_drain(ctx);
+#endif
+                unique_ip_cache(ctx, &options->file_cache[idx], ctx->unique_iteration - 1);
+            }
+#endif
+
+            gap_ns = loop_gap_ns(ctx, &options->file_cache[idx]);
+            if (schedule != NULL) {
+                schedule_base += options->file_cache[idx].schedule_period + gap_ns - schedule_skip;
+                schedule_skip = 0;
+                ctx->schedule_next_ns = schedule_base + options->file_cache[idx].schedule_period;
+            } else if (options->speed.mode == speed_multiplier) {
+                /* the gap is in capture time, like the rest of pkt_ts_delta */
+                stats->pkt_ts_delta_ns += (u_int64_t)((double)gap_ns * options->speed.multiplier);
+                last_pkt_ns = 0;
+            } else if (gap_ns > 0) {
+                if (batch_cnt > 0) {
+                    send_packet_batch(ctx, sp, batch, batch_cnt);
+                    batch_cnt = 0;
+                }
+                now_ns = tcpr_clock_ns();
+                NANOSEC_TO_TIMESPEC(gap_ns, &ctx->nap);
+                tcpr_sleep(ctx, sp, &ctx->nap, &now_ns);
+                /* don't make up for the gap at the rate of the pacer */
+                tcpreplay_pace_restart(ctx, stats->pkts_sent, stats->bytes_sent, now_ns);
+            }
+
+            packetnum = 0;
+            cached_packet = NULL;
+            continue;
+        }
+
+        now_is_now = false;
+        trace_deadline = 0;
+        packetnum++;
+#if defined TCPREPLAY || defined TCPREPLAY_EDIT
+        /* do we use the snaplen (caplen) or the "actual" packet len? */
+        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr.len : (COUNTER)pkthdr.caplen;
+#elif TCPBRIDGE
+        pktlen = (COUNTER)pkthdr.caplen;
+#else
+#error WTF???  We should not be here!
+#endif
+
+        dbgx(2, "packet " COUNTER_SPEC " caplen " COUNTER_SPEC, packetnum, pktlen);
+
+        /* --shard: leave the other flows to the tcpreplay of their shard */
+        if (extras && options->cacheshards != NULL &&
+            (packetnum > options->cache_packets || options->cacheshards[packetnum - 1] != options->shard))
+            continue;
+
+        /* Dual nic processing */
+        if (dual && options->spray_cnt > 0) {
+            sp = spray_intf(ctx, &pkthdr, pktdata, datalink);
+        } else if (dual) {
+            sp = (sendpacket_t *)cache_mode(ctx, options->cachedata, packetnum);
+
+            /* sometimes we should not send the packet */
+            if (sp == TCPR_DIR_NOSEND)
+                continue;
+        }
+#ifdef ENABLE_TXSTAMP
+        if (sp->txstamp != NULL)
+            sp->txstamp->nsec = options->file_cache[idx].nsec;
+#endif
+        /* read on the interface the packet goes out of */
+        if (profile)
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_READ, &prof_mark);
+        TCPR_PROBE2(packet__read, packetnum, pktlen);
+
+        if (tcpreplay_control_pending(ctx, sp) && send_control(ctx, sp, &schedule_base)) {
+            /* the schedule and batching were set up for the old speed */
+            if (batch_cnt > 0) {
+                send_packet_batch(ctx, sp, batch, batch_cnt);
+                batch_cnt = 0;
+            }
+            schedule = NULL;
+            microburst = 0;
+            in_burst = false;
+            window_batch = false;
+            window_end = 0;
+            top_speed = (options->speed.mode == speed_topspeed ||
+                         (options->speed.mode == speed_mbpsrate && options->speed.speed == 0));
+            use_batch = use_batch && top_speed;
+        }
+
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+        pkthdr_ptr = &pkthdr;
+        edit_packet(ctx, idx, cached_packet, &pkthdr_ptr, &pktdata, sp->cache_dir, packetnum, &csum_start, &csum_offset);
+        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr_ptr->len : (COUNTER)pkthdr_ptr->caplen;
+#elif defined TCPREPLAY
+        /* a super-frame of gso_coalesce() */
+        if (options->gso && cached_packet != NULL) {
+            csum_start = cached_packet->csum_start;
+            csum_offset = cached_packet->csum_offset;
+            gso_size = cached_packet->gso_size;
+            gso_hdr_len = cached_packet->gso_hdr_len;
+            gso_v6 = cached_packet->gso_v6;
+        }
+#endif
+
+        if (ctx->options->unique_ip && ctx->unique_iteration && ctx->unique_iteration > ctx->last_unique_iteration) {
+            /* edit packet to ensure every pass has unique IP addresses */
+            if (unique_cached) {
+                if (cached_packet->unique_src == 0) {
+                    ++stats->failed;
+                    continue;
+                }
+            } else if (fast_edit_packet(&pkthdr, &pktdata, ctx->unique_iteration - 1, !fresh, datalink) == -1) {
+                ++stats->failed;
+                continue;
+            }
+        }
+
+        if (profile)
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_EDIT, &prof_mark);
+        TCPR_PROBE2(edit__done, packetnum, pktlen);
+
+        /*
+         * update flow stats. The totals for cached files were counted
+         * while preloading, but the interface counters are live, so they
+         * are kept on every pass using the stored result
+         */
+        if (options->flow_stats && fresh)
+            update_flow_stats(ctx, sp, &pkthdr, pktdata, datalink, NULL);
+        else if (options->flow_stats)
+            count_flow_stats(NULL, sp, (flow_entry_type_t)cached_packet->flow_type);
+        if (profile)
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_FLOW, &prof_mark);
+
+        /*
+         * this accelerator improves performance by avoiding expensive
+         * time stamps during periods where we have fallen behind in our
+         * sending
+         */
+        if ((variant & SEND_LOOP_TOPSPEED) && top_speed) {
+            /* nothing to wait for, all calc_sleep_time() would do at top speed */
+            ctx->first_time = false;
+            timesclear(&ctx->nap);
+        } else if (in_burst && (packetnum - 1) / microburst == burst_id) {
+            /* the rest of a --microburst goes straight after its first packet */
+        } else if (window_batch && batch_cnt > 0 && batch_cnt < window_room &&
+                   schedule_base + schedule[packetnum - 1] - schedule_skip <= window_end) {
+            /* due before the timer could wake us for it, so it goes with the batch being filled */
+#ifdef HAVE_SO_TXTIME
+            if (options->accurate == accurate_txtime) {
+                uint64_t due = schedule_base + schedule[packetnum - 1] - schedule_skip;
+
+                now_is_now = true;
+                now_ns = tcpr_clock_ns();
+                sp->txtime = due > now_ns + TXTIME_MIN_LEAD_NS ? due + tai_offset : 0;
+            }
+#endif
+        } else if (schedule != NULL) {
+            uint64_t deadline = schedule_base + schedule[packetnum - 1] - schedule_skip;
+            uint64_t burst_ns = options->file_cache[idx].schedule_burst_ns;
+
+            /* the last window is over, send it before waiting for this one */
+            if (window_batch && batch_cnt > 0) {
+                send_packet_batch(ctx, sp, batch, batch_cnt);
+                batch_cnt = 0;
+            }
+
+            now_is_now = true;
+            now_ns = tcpr_clock_ns();
+
+            if (now_ns > deadline + options->speed.late_ns) {
+                ++stats->late_pkts;
+                if (options->speed.late_policy == late_drop) {
+                    ++stats->late_dropped;
+                    continue;
+                } else if (options->speed.late_policy == late_shift) {
+                    uint64_t shift = now_ns - deadline;
+
+                    schedule_base += shift;
+                    ctx->schedule_next_ns += shift;
+                    deadline += shift;
+                    stats->late_shift_ns += shift;
+                }
+            }
+
+            /* after a stall, only catch up on --burst worth of the schedule */
+            if (burst_ns && now_ns > deadline + burst_ns) {
+                uint64_t shift = now_ns - deadline - burst_ns;
+
+                schedule_base += shift;
+                ctx->schedule_next_ns += shift;
+                deadline += shift;
+            }
+            trace_deadline = deadline;
+
+#ifdef HAVE_SO_TXTIME
+            if (options->accurate == accurate_txtime) {
+                /* the kernel does the waiting, just don't get too far ahead of it */
+                if (deadline > now_ns + TXTIME_MAX_LEAD_NS) {
+                    NANOSEC_TO_TIMESPEC(deadline - TXTIME_MAX_LEAD_NS - now_ns, &ctx->nap);
+                    tcpr_sleep(ctx, sp, &ctx->nap, &now_ns);
+                    /* a pause in the sleep moves the rest of the schedule along */
+                    schedule_base += ctx->sleep_paused_ns;
+                    deadline += ctx->sleep_paused_ns;
+                }
+
+                sp->txtime = deadline > now_ns + TXTIME_MIN_LEAD_NS ? deadline + tai_offset : 0;
+            } else
+#endif
+            /* late packets go out right away */
+            if (deadline > now_ns) {
+                NANOSEC_TO_TIMESPEC(deadline - now_ns, &ctx->nap);
+                tcpr_sleep(ctx, sp, &ctx->nap, &now_ns);
+                schedule_base += ctx->sleep_paused_ns;
+                deadline += ctx->sleep_paused_ns;
+            }
+
+            if (options->timing_stats) {
+                tcpr_hist_add(&sp->late, now_ns > deadline ? now_ns - deadline : 0);
+                if (prev_send_ns) {
+                    int64_t gap_err = (int64_t)(now_ns - prev_send_ns) - (int64_t)(deadline - prev_deadline);
+
+                    tcpr_hist_add(&sp->gap, gap_err < 0 ? -gap_err : gap_err);
+                }
+                prev_send_ns = now_ns;
+                prev_deadline = deadline;
+            }
+
+            /* a low rate gets batches of one, a high rate as many as are due at once */
+            if (window_batch) {
+                window_end = deadline + batch_window_ns(options, sp);
+                if ((window_room = sendpacket_batch_room(sp)) < 1)
+                    window_room = 1;
+            }
+
+            if (microburst != 0) {
+                /* a burst whose last packets weren't sent ends here */
+                if (in_burst)
+                    microburst_end(ctx, sp, batch, &batch_cnt, burst_start_ns, burst_start_bytes);
+                in_burst = true;
+                burst_id = (packetnum - 1) / microburst;
+                burst_start_ns = now_ns;
+                burst_start_bytes = stats->bytes_sent;
+            }
+        } else if (skip_length && pktlen < skip_length) {
+            skip_length -= pktlen;
+        } else if (ctx->skip_packets) {
+            --ctx->skip_packets;
+        } else {
+            /*
+             * time stamping is expensive, but now is the
+             * time to do it.
+             */
+            u_int64_t pkt_ns = pkthdr_ts_ns(&pkthdr, options->file_cache[idx].nsec);
+
+            dbgx(4, "This packet time: %" PRIu64 " ns", pkt_ns);
+            skip_length = 0;
+            ctx->skip_packets = 0;
+
+            if (options->speed.mode == speed_multiplier) {
+                if (last_pkt_ns == 0) {
+                    last_pkt_ns = pkt_ns;
+                } else if (pkt_ns > last_pkt_ns) {
+                    u_int64_t gap_ns = idle_gap_delta(options, last_pkt_ns, pkt_ns);
+
+                    if (follow_spent > 0) {
+                        u_int64_t spent = follow_spent < gap_ns ? follow_spent : gap_ns;
+
+                        gap_ns -= spent;
+                        follow_spent = 0;
+                    }
+                    stats->pkt_ts_delta_ns += gap_ns;
+                    last_pkt_ns = pkt_ns;
+                }
+            }
+
+            if (!top_speed) {
+                now_is_now = true;
+                now_ns = tcpr_clock_ns();
+            }
+
+            /*
+             * Only if the current packet is not late.
+             *
+             * This also sets skip_length and skip_packets which will avoid
+             * timestamping for a given number of packets.
+             */
+            if (!calc_sleep_time(ctx,
+                                 stats->pkt_ts_delta_ns,
+                                 stats->time_delta_ns,
+                                 pktlen,
+                                 sp,
+                                 packetnum,
+                                 stats->end_time_ns,
+                                 stats->start_time_ns,
+                                 &skip_length))
+                continue;
+
+            /*
+             * Track the time of the "last packet sent".
+             *
+             * A number of 3rd party tools generate bad timestamps which go backwards
+             * in time.  Hence, don't update the "last" unless pkthdr.ts > last
+             */
+            if (stats->time_delta_ns < stats->pkt_ts_delta_ns)
+                stats->time_delta_ns = stats->pkt_ts_delta_ns;
+
+            /*
+             * we know how long to sleep between sends, now do it.
+             */
+            if (!top_speed && extras && sp->trace != NULL)
+                trace_deadline = now_ns + TIMESPEC_TO_NANOSEC(&ctx->nap);
+            if (!top_speed)
+                tcpr_sleep(ctx, sp, &ctx->nap, &now_ns);
+        }
+
+        if (profile)
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_PACE, &prof_mark);
+
+#ifdef ENABLE_VERBOSE
+        /* do we need to print the packet via tcpdump? */
+        if (extras && options->verbose)
+            tcpdump_print(options->tcpdump, &pkthdr, pktdata);
+#endif
+
+        /* at top speed the clock is only read every so often for it */
+        if (extras && ctx->probe != NULL && sp == ctx->intf1 && (now_is_now || (packetnum & PROBE_POLL_MASK) == 0))
+            send_probe(ctx,
+                       sp,
+                       pktdata,
+                       pkthdr.caplen,
+                       datalink,
+                       now_is_now ? now_ns : tcpr_clock_ns(),
+                       use_batch,
+                       batch,
+                       batch_pkthdr,
+                       &batch_cnt);
+
+#ifdef ENABLE_RXMATCH
+        if (extras && ctx->rxmatch != NULL)
+            rx_sent(ctx, cached_packet, pktdata, pkthdr.caplen, datalink);
+#endif
+
+#ifdef ENABLE_SEND_THREADS
+        if (extras && ctx->nic_threads != NULL) {
+            sendpacket_pkt_t pkt = {pktdata, pktlen, &pkthdr, csum_start, csum_offset, gso_size, gso_hdr_len, gso_v6};
+
+            /* --nic-threads: the thread of the interface sends it, see nic_threads_push() */
+            dbgx(2, "Queueing packet #" COUNTER_SPEC " for %s", packetnum, sp->device);
+            if (!nic_threads_push(ctx, sp, &pkt))
+                continue;
+
+            segs = sendpacket_gso_segs(pktlen, gso_size, gso_hdr_len);
+            stats->pkts_sent += segs;
+            stats->bytes_sent += pktlen + (segs - 1) * gso_hdr_len;
+        } else
+#endif
+        if (use_batch) {
+            dbgx(2, "Queueing packet #" COUNTER_SPEC, packetnum);
+            memcpy(&batch_pkthdr[batch_cnt], &pkthdr, sizeof(struct pcap_pkthdr));
+            batch[batch_cnt].data = pktdata;
+            batch[batch_cnt].len = pktlen;
+            batch[batch_cnt].pkthdr = &batch_pkthdr[batch_cnt];
+            batch[batch_cnt].csum_start = csum_start;
+            batch[batch_cnt].csum_offset = csum_offset;
+            batch[batch_cnt].gso_size = gso_size;
+            batch[batch_cnt].gso_hdr_len = gso_hdr_len;
+            batch[batch_cnt].gso_v6 = gso_v6;
+#ifdef HAVE_SO_TXTIME
+            batch[batch_cnt].txtime = sp->txtime;
+#endif
+            if (++batch_cnt == SENDPACKET_BATCH_MAX) {
+                send_packet_batch(ctx, sp, batch, batch_cnt);
+                batch_cnt = 0;
+            }
+        } else {
+            dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
+            /* write packet out on network */
+#ifdef HAVE_PACKET_VNET_HDR
+            sp->csum_start = csum_start;
+            sp->csum_offset = csum_offset;
+            sp->gso_size = gso_size;
+            sp->gso_hdr_len = gso_hdr_len;
+            sp->gso_v6 = gso_v6;
+#endif
+            if (sendpacket(sp, pktdata, pktlen, &pkthdr) < (int)pktlen) {
+                warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+                continue;
+            }
+
+            /* a super-frame counts as the packets it was coalesced from */
+            segs = sendpacket_gso_segs(pktlen, gso_size, gso_hdr_len);
+            stats->pkts_sent += segs;
+            stats->bytes_sent += pktlen + (segs - 1) * gso_hdr_len;
+        }
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+        /* --repeat: the copies follow straight after, from the packet itself unless shifted */
+        copies = extras ? repeat_copies(options, cached_packet) : 1;
+        for (copy = 1; copy < copies && !ctx->abort; copy++) {
+            sendpacket_pkt_t pkt = {pktdata, pktlen, &pkthdr, csum_start, csum_offset, gso_size, gso_hdr_len, gso_v6};
+
+            if (repeat_scratch != NULL && pkthdr.caplen <= MAXPACKET) {
+                if (use_batch && batch_cnt > 0 && repeat_used + pkthdr.caplen > FLOW_COPY_SCRATCH) {
+                    send_packet_batch(ctx, sp, batch, batch_cnt);
+                    batch_cnt = 0;
+                }
+                if (batch_cnt == 0)
+                    repeat_used = 0;
+
+                memcpy(repeat_scratch + repeat_used, pktdata, pkthdr.caplen);
+                pkt.data = repeat_scratch + repeat_used;
+                if (use_batch)
+                    repeat_used += (pkthdr.caplen + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+                /* non-IP packets go out as they are */
+                fast_edit_packet(&pkthdr, (u_char **)&pkt.data, copy, false, datalink);
+            }
+#ifdef ENABLE_RXMATCH
+            if (ctx->rxmatch != NULL)
+                rx_sent(ctx, cached_packet, pkt.data, pkthdr.caplen, datalink);
+#endif
+
+#ifdef ENABLE_SEND_THREADS
+            if (ctx->nic_threads != NULL) {
+                if (!nic_threads_push(ctx, sp, &pkt))
+                    break;
+            } else
+#endif
+            if (use_batch) {
+                memcpy(&batch_pkthdr[batch_cnt], &pkthdr, sizeof(struct pcap_pkthdr));
+                pkt.pkthdr = &batch_pkthdr[batch_cnt];
+                batch[batch_cnt] = pkt;
+                if (++batch_cnt == SENDPACKET_BATCH_MAX) {
+                    send_packet_batch(ctx, sp, batch, batch_cnt);
+                    batch_cnt = 0;
+                }
+                continue;
+            } else if (sendpacket(sp, pkt.data, pktlen, &pkthdr) < (int)pktlen) {
+                warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+                break;
+            }
+
+            segs = sendpacket_gso_segs(pktlen, gso_size, gso_hdr_len);
+            stats->pkts_sent += segs;
+            stats->bytes_sent += pktlen + (segs - 1) * gso_hdr_len;
+        }
+#endif
+
+        if (profile) {
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_SEND, &prof_mark);
+            ++sp->profile.packets;
+        }
+
+        /*
+         * Mark the time when we sent the last packet
+         */
+        stats->end_time_ns = now_ns;
+        if (extras && sp->trace != NULL)
+            tcpr_trace_add(sp->trace,
+                           packetnum,
+                           trace_deadline,
+                           now_is_now ? now_ns : tcpr_clock_ns(),
+                           skip_length,
+                           ctx->skip_packets,
+                           pktlen);
+
+        if (in_burst && packetnum % microburst == 0) {
+            microburst_end(ctx, sp, batch, &batch_cnt, burst_start_ns, burst_start_bytes);
+            in_burst = false;
+        }
+
+        /* print stats during the run? */
+        if (options->stats > 0) {
+            if (stats->last_print_ns == 0) {
+                stats->last_print_ns = now_ns;
+            } else if (now_ns - stats->last_print_ns >= SEC_TO_NANOSEC(options->stats)) {
+                stats->end_time_ns = now_ns;
+                packet_stats(stats);
+                stats->last_print_ns = now_ns;
+            }
+        }
+
+#if defined HAVE_NETMAP
+        if (sp->first_packet || timesisset(&ctx->nap)) {
+            wake_send_queues(sp, options);
+            sp->first_packet = false;
+        }
+#endif
+        /* --checkpoint: note how far we got, once everything before is out */
+        if (extras && options->checkpoint_file != NULL && (packetnum & CHECKPOINT_POLL_MASK) == 0 && checkpoint_due(ctx)) {
+            if (batch_cnt > 0) {
+                send_packet_batch(ctx, sp, batch, batch_cnt);
+                batch_cnt = 0;
+            }
+#ifdef ENABLE_SEND_THREADS
+            nic_threads_drain(ctx);
+#endif
+            checkpoint_save(ctx, idx, packetnum);
+        }
+
+        /* stop sending based on the duration limit... */
+        if ((end_ns > 0 && now_ns > end_ns) ||
+            /* ... or stop sending based on the limit -L? */
+            (limit_send > 0 && stats->pkts_sent + batch_cnt >= limit_send)) {
+            ctx->abort = true;
+        }
+    } /* while */
+    tcpr_mem_guard(false);
+
+    /* send whatever is left in the batch, even when aborting due to limits */
+    if (in_burst)
+        microburst_end(ctx, sp, batch, &batch_cnt, burst_start_ns, burst_start_bytes);
+    if (batch_cnt > 0)
+        send_packet_batch(ctx, sp, batch, batch_cnt);
+#ifdef ENABLE_SEND_THREADS
+    nic_threads_drain(ctx);
+#endif
+    if (options->checkpoint_file != NULL && ctx->abort)
+        checkpoint_save(ctx, idx, packetnum);
+
+#ifdef HAVE_NETMAP
+    /* when completing test, wait until the last packet is sent */
+    if (options->netmap && (ctx->abort || options->loop == 1)) {
+        int i;
+
+        while (ctx->intf1 && !netmap_tx_queues_empty(ctx->intf1)) {
+            now_is_now = true;
+            now_ns = tcpr_clock_ns();
+        }
+
+        while (ctx->intf2 && !netmap_tx_queues_empty(ctx->intf2)) {
+            now_is_now = true;
+            now_ns = tcpr_clock_ns();
+        }
+
+        for (i = 0; i < options->pair_intf_cnt; i++) {
+            while (!netmap_tx_queues_empty(ctx->pair_intf[i])) {
+                now_is_now = true;
+                now_ns = tcpr_clock_ns();
+            }
+        }
+    }
+#endif /* HAVE_NETMAP */
+
+    if (!now_is_now)
+        now_ns = tcpr_clock_ns();
+
+    stats->end_time_ns = now_ns;
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    safe_free(repeat_scratch);
+#endif
+
+    /* --follow-dir: where the next file carries on from */
+    if (ctx->follow != NULL) {
+        const file_cache_t *file_cache = &options->file_cache[idx];
+
+        if (schedule != NULL && file_cache->packet_cnt > 0)
+            last_pkt_ns = pkthdr_ts_ns(&file_cache->packet_cache[file_cache->packet_cnt - 1].pkthdr, file_cache->nsec);
+        ctx->follow->last_pkt_ns = last_pkt_ns;
+        ctx->follow->last_send_ns = now_ns;
+    }
+
+    /* a batch of the caller's packets isn't a pass over a file */
+    if (!(pkt_source_caps(&options->file_cache[idx]) & PKT_SOURCE_BORROWED))
+        increment_iteration(ctx);
+}
+
+/**
+ * \brief the send loop variant for a pass over the file idx
+ *
+ * Only what holds for the whole pass is used.  The speed may be changed
+ * by tcpreplay_control_set_speed() at any time, so SEND_LOOP_TOPSPEED
+ * still checks for top speed, it only saves the rest of the pacing.
+ */
+static unsigned int
+send_loop_variant(const tcpreplay_t *ctx, int idx)
+{
+    const tcpreplay_opt_t *options = ctx->options;
+    const file_cache_t *file_cache = &options->file_cache[idx];
+    unsigned int variant = 0;
+
+    if (ctx->intf2 == NULL)
+        variant |= SEND_LOOP_SINGLE;
+
+    if (!options->profile && ctx->probe == NULL && ctx->intf1->trace == NULL && options->checkpoint_file == NULL &&
+        options->cacheshards == NULL && options->repeat <= 1
+#ifdef ENABLE_VERBOSE
+        && !options->verbose
+#endif
+#ifdef ENABLE_RXMATCH
+        && ctx->rxmatch == NULL
+#endif
+#ifdef ENABLE_SEND_THREADS
+        && ctx->nic_threads == NULL
+#endif
+    )
+        variant |= SEND_LOOP_PLAIN;
+
+    if (file_cache->cached && !file_cache->streamed)
+        variant |= SEND_LOOP_CACHED;
+
+    if (options->speed.mode == speed_topspeed || (options->speed.mode == speed_mbpsrate && options->speed.speed == 0))
+        variant |= SEND_LOOP_TOPSPEED;
+
+    if ((variant & SEND_LOOP_FAST) == SEND_LOOP_FAST)
+        return SEND_LOOP_FAST;
+    if ((variant & SEND_LOOP_CACHED_PACED) == SEND_LOOP_CACHED_PACED)
+        return SEND_LOOP_CACHED_PACED;
+    if ((variant & SEND_LOOP_STREAM_PACED) == SEND_LOOP_STREAM_PACED)
+        return SEND_LOOP_STREAM_PACED;
+
+    return 0;
+}
+
+/**
+ * \brief send the packets of the file idx, with the send loop made for
+ * the options in use
+ */
+void
+send_packets(tcpreplay_t *ctx, int idx)
+{
+    switch (send_loop_variant(ctx, idx)) {
+    case SEND_LOOP_FAST:
+        send_packets_loop(ctx, idx, SEND_LOOP_FAST);
+        break;
+    case SEND_LOOP_CACHED_PACED:
+        send_packets_loop(ctx, idx, SEND_LOOP_CACHED_PACED);
+        break;
+    case SEND_LOOP_STREAM_PACED:
+        send_packets_loop(ctx, idx, SEND_LOOP_STREAM_PACED);
+        break;
+    default:
+        send_packets_loop(ctx, idx, 0);
+    }
+}
+
+/* where send_merged_packets() is in one of the captures it interleaves */
+typedef struct merge_cursor_s {
+    send_source_t src;
+    struct pcap_pkthdr pkthdr;
+    u_char *pktdata;
+    packet_cache_t *cached_packet;
+    u_int64_t ts_ns;
+    bool unique_cached;
+    u_int64_t mix_sent; /* --mix: bytes or packets sent this pass */
+    bool mix_wrapped;   /* --mix: sent whole at least once this pass */
+} merge_cursor_t;
+
+/*
+ * the captures are kept in a min-heap on the time of their next packet.
+ * Ties go to the capture given first, so two files stay in the order
+ * --dualfile always sent them in.  With --mix it is the capture furthest
+ * behind its share, the least sent for its weight, instead.
+ */
+static inline bool
+merge_before(const merge_cursor_t *cur, int a, int b)
+{
+    if (cur[a].src.weight != 0) {
+        u_int64_t sa = cur[a].mix_sent * cur[b].src.weight, sb = cur[b].mix_sent * cur[a].src.weight;
+
+        return sa < sb || (sa == sb && a < b);
+    }
+
+    return cur[a].ts_ns < cur[b].ts_ns || (cur[a].ts_ns == cur[b].ts_ns && a < b);
+}
+
+static void
+merge_sift_down(const merge_cursor_t *cur, int *heap, int n, int i)
+{
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i, t;
+
+        if (l < n && merge_before(cur, heap[l], heap[m]))
+            m = l;
+        if (r < n && merge_before(cur, heap[r], heap[m]))
+            m = r;
+        if (m == i)
+            return;
+
+        t = heap[i];
+        heap[i] = heap[m];
+        heap[m] = t;
+        i = m;
+    }
+}
+
+/**
+ * \brief read the next packet of a capture, false at the end of it
+ */
+static bool
+merge_next(tcpreplay_t *ctx, merge_cursor_t *c)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    c->pktdata = get_next_packet(ctx, &c->pkthdr, c->src.idx, options->preload_pcap ? &c->cached_packet : NULL);
+    if (c->pktdata == NULL)
+        return false;
+
+    c->ts_ns = pkthdr_ts_ns(&c->pkthdr, options->file_cache[c->src.idx].nsec) + c->src.offset_ns;
+    return true;
 }
 
 /**
- * the main loop function for tcpreplay.  This is where we figure out
- * what to do with each packet
+ * the alternate main loop function for tcpreplay.  Sends the packets of
+ * several captures at the same time, each out its own interface, in the
+ * order of their timestamps.  Used for --dualfile, and for --flow-copies,
+ * where the captures are copies of one preloaded file.
+ *
+ * For --mix the sources are weighted instead, and the next packet always
+ * comes from the one furthest behind its share.  Those start over when
+ * they run out, and the pass ends when every one has been sent whole.
  */
 void
-send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
+send_merged_packets(tcpreplay_t *ctx, const send_source_t *sources, int cnt)
 {
-    struct timeval print_delta, now, last_pkt_ts;
+    u_int64_t last_pkt_ns;
+    u_int64_t now_ns;
     tcpreplay_opt_t *options = ctx->options;
     tcpreplay_stats_t *stats = &ctx->stats;
     COUNTER packetnum = 0;
     COUNTER limit_send = options->limit_send;
-    struct pcap_pkthdr pkthdr;
-    u_char *pktdata = NULL;
-    sendpacket_t *sp = ctx->intf1;
+    merge_cursor_t cur[MAX_FILES];
+    int heap[MAX_FILES];
+    int i, n = 0;
+    merge_cursor_t *c;
+    file_cache_t *file_cache;
+    u_char *pktdata;
+    sendpacket_t *sp, *batch_sp = NULL;
     COUNTER pktlen;
-    packet_cache_t *cached_packet = NULL;
-    packet_cache_t **prev_packet = NULL;
-#if defined TCPREPLAY && defined TCPREPLAY_EDIT
     struct pcap_pkthdr *pkthdr_ptr;
-#endif
-    int datalink = options->file_cache[idx].dlt;
+    int datalink;
+    COUNTER end_ns;
     COUNTER skip_length = 0;
-    COUNTER end_us;
-    bool preload = options->file_cache[idx].cached;
     bool top_speed = (options->speed.mode == speed_topspeed ||
                       (options->speed.mode == speed_mbpsrate && options->speed.speed == 0));
     bool now_is_now = true;
+    sendpacket_pkt_t batch[SENDPACKET_BATCH_MAX];
+    struct pcap_pkthdr batch_pkthdr[SENDPACKET_BATCH_MAX];
+    int batch_cnt = 0;
+    uint16_t csum_start = 0, csum_offset = 0; /* set by edit_packet() */
+    u_int64_t prof_mark = 0; /* --profile: when the current stage started */
+    u_int64_t trace_deadline = 0; /* --trace-ring: when the packet was due */
+    bool use_batch = false;
+    u_char *scratch = NULL; /* --flow-copies: edited copies of the batched packets */
+    size_t scratch_used = 0;
+    int mix_left = 0; /* --mix: sources not yet sent whole */
+
+    assert(cnt > 0 && cnt <= MAX_FILES);
+
+    memset(cur, 0, sizeof(cur[0]) * cnt);
+    for (i = 0; i < cnt; i++) {
+        cur[i].src = sources[i];
+        if (sources[i].shift != 0 && scratch == NULL)
+            scratch = safe_malloc(FLOW_COPY_SCRATCH);
+    }
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    /* batch at top speed as send_packets() does, one interface at a time */
+    use_batch = top_speed;
+    for (i = 0; i < cnt; i++) {
+        file_cache = &options->file_cache[sources[i].idx];
+        if (!options->preload_pcap && file_cache->mmap == NULL)
+            use_batch = false;
+
+        /* copies share the cache, so it is left as it is */
+        cur[i].unique_cached = options->unique_ip && file_cache->cached && !file_cache->streamed && scratch == NULL;
+        if (cur[i].unique_cached && ctx->unique_iteration && ctx->unique_iteration > ctx->last_unique_iteration)
+            unique_ip_cache(ctx, file_cache, ctx->unique_iteration - 1);
+    }
+#ifdef ENABLE_VERBOSE
+    if (options->verbose)
+        use_batch = false;
+#endif
+#endif
 
-    gettimeofday(&now, NULL);
-    if (!timerisset(&stats->start_time)) {
-        TIMEVAL_SET(&stats->start_time, &now);
+    now_ns = tcpr_clock_ns();
+    if (stats->start_time_ns == 0) {
+        stats->start_time_ns = now_ns;
         if (ctx->options->stats >= 0) {
             char buf[64];
-            if (format_date_time(&stats->start_time, buf, sizeof(buf)) > 0)
-                printf("Test start: %s ...\n", buf);
+            struct timeval start;
+
+            tcpr_clock_to_timeval(stats->start_time_ns, &start);
+            if (format_date_time(&start, buf, sizeof(buf)) > 0)
+                printf("Dual test start: %s ...\n", buf);
         }
     }
 
     ctx->skip_packets = 0;
-    timerclear(&last_pkt_ts);
+    last_pkt_ns = 0;
     if (options->limit_time > 0)
-        end_us = TIMEVAL_TO_MICROSEC(&stats->start_time) + SEC_TO_MICROSEC(options->limit_time);
+        end_ns = stats->start_time_ns + SEC_TO_NANOSEC(options->limit_time);
     else
-        end_us = 0;
+        end_ns = 0;
 
-    if (options->preload_pcap) {
-        prev_packet = &cached_packet;
-    } else {
-        prev_packet = NULL;
+    for (i = 0; i < cnt; i++) {
+        if (merge_next(ctx, &cur[i]))
+            heap[n++] = i;
     }
+    for (i = n / 2 - 1; i >= 0; i--)
+        merge_sift_down(cur, heap, n, i);
+    if (sources[0].weight != 0)
+        mix_left = n;
+
+    tcpr_mem_guard(ctx->iteration > 0 || ctx->warmup_touched > 0);
 
     /* MAIN LOOP
      * Keep sending while we have packets or until
      * we've sent enough packets
      */
-    while (!ctx->abort && (pktdata = get_next_packet(ctx, pcap, &pkthdr, idx, prev_packet)) != NULL) {
+    while (!ctx->abort && n > 0) {
+        if (options->profile)
+            prof_mark = tcpr_prof_ticks();
+        c = &cur[heap[0]];
+        file_cache = &options->file_cache[c->src.idx];
+        sp = c->src.sp;
+        datalink = file_cache->dlt;
+        pkthdr_ptr = &c->pkthdr;
+        pktdata = c->pktdata;
         now_is_now = false;
+        trace_deadline = 0;
         packetnum++;
+#ifdef ENABLE_TXSTAMP
+        if (sp->txstamp != NULL)
+            sp->txstamp->nsec = file_cache->nsec;
+#endif
+        TCPR_PROBE2(packet__read, packetnum, pkthdr_ptr->caplen);
+
+        /* a batch only ever goes out one interface */
+        if (batch_cnt > 0 && sp != batch_sp) {
+            send_packet_batch(ctx, batch_sp, batch, batch_cnt);
+            batch_cnt = 0;
+        }
+
+        if (tcpreplay_control_pending(ctx, sp) && send_control(ctx, sp, NULL)) {
+            if (batch_cnt > 0) {
+                send_packet_batch(ctx, batch_sp, batch, batch_cnt);
+                batch_cnt = 0;
+            }
+            top_speed = (options->speed.mode == speed_topspeed ||
+                         (options->speed.mode == speed_mbpsrate && options->speed.speed == 0));
+            use_batch = use_batch && top_speed;
+        }
+
 #if defined TCPREPLAY || defined TCPREPLAY_EDIT
         /* do we use the snaplen (caplen) or the "actual" packet len? */
-        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr.len : (COUNTER)pkthdr.caplen;
+        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr_ptr->len : (COUNTER)pkthdr_ptr->caplen;
 #elif TCPBRIDGE
-        pktlen = (COUNTER)pkthdr.caplen;
+        pktlen = (COUNTER)pkthdr_ptr->caplen;
 #else
 #error WTF???  We should not be here!
 #endif
 
         dbgx(2, "packet " COUNTER_SPEC " caplen " COUNTER_SPEC, packetnum, pktlen);
 
-        /* Dual nic processing */
-        if (ctx->intf2 != NULL) {
-            sp = (sendpacket_t *)cache_mode(ctx, options->cachedata, packetnum);
-
-            /* sometimes we should not send the packet */
-            if (sp == TCPR_DIR_NOSEND)
-                continue;
-        }
-
 #if defined TCPREPLAY && defined TCPREPLAY_EDIT
-        pkthdr_ptr = &pkthdr;
-        if (tcpedit_packet(tcpedit, &pkthdr_ptr, &pktdata, sp->cache_dir) == -1) {
-            errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(tcpedit));
-        }
+        edit_packet(ctx,
+                    c->src.idx,
+                    c->cached_packet,
+                    &pkthdr_ptr,
+                    &pktdata,
+                    sp->cache_dir,
+                    packetnum,
+                    &csum_start,
+                    &csum_offset);
         pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr_ptr->len : (COUNTER)pkthdr_ptr->caplen;
 #endif
 
-        if (ctx->options->unique_ip && ctx->unique_iteration && ctx->unique_iteration > ctx->last_unique_iteration) {
-            /* edit packet to ensure every pass has unique IP addresses */
-            if (fast_edit_packet(&pkthdr, &pktdata, ctx->unique_iteration - 1, preload, datalink) == -1) {
+        if (scratch != NULL) {
+            /* copies share the cache, so they are shifted in a copy, see send_flow_copies() */
+            if (c->src.shift != 0 && pkthdr_ptr->caplen <= MAXPACKET) {
+                if (use_batch && batch_cnt > 0 && scratch_used + pkthdr_ptr->caplen > FLOW_COPY_SCRATCH) {
+                    send_packet_batch(ctx, batch_sp, batch, batch_cnt);
+                    batch_cnt = 0;
+                }
+                if (batch_cnt == 0)
+                    scratch_used = 0;
+
+                memcpy(scratch + scratch_used, pktdata, pkthdr_ptr->caplen);
+                pktdata = scratch + scratch_used;
+                if (use_batch)
+                    scratch_used += (pkthdr_ptr->caplen + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+                /* non-IP packets go out as they are */
+                fast_edit_packet(pkthdr_ptr, &pktdata, c->src.shift, false, datalink);
+            }
+        } else if (ctx->options->unique_ip && ctx->unique_iteration && ctx->unique_iteration > ctx->last_unique_iteration) {
+            /* edit packet to ensure every pass is unique */
+            if (c->unique_cached) {
+                if (c->cached_packet->unique_src == 0) {
+                    ++stats->failed;
+                    goto next;
+                }
+            } else if (fast_edit_packet(pkthdr_ptr,
+                                        &pktdata,
+                                        ctx->unique_iteration - 1,
+                                        file_cache->cached && !file_cache->streamed,
+                                        datalink) == -1) {
                 ++stats->failed;
-                continue;
+                goto next;
             }
         }
 
-        /* update flow stats */
-        if (options->flow_stats && !preload)
-            update_flow_stats(ctx, options->cache_packets ? sp : NULL, &pkthdr, pktdata, datalink);
+        if (options->profile)
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_EDIT, &prof_mark);
+        TCPR_PROBE2(edit__done, packetnum, pkthdr_ptr->caplen);
+
+        /* update flow stats; see send_packets() */
+        if (options->flow_stats && (!file_cache->cached || file_cache->streamed))
+            update_flow_stats(ctx, sp, pkthdr_ptr, pktdata, datalink, NULL);
+        else if (options->flow_stats)
+            count_flow_stats(NULL, sp, (flow_entry_type_t)c->cached_packet->flow_type);
+        if (options->profile)
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_FLOW, &prof_mark);
 
         /*
          * this accelerator improves performance by avoiding expensive
@@ -438,25 +2711,22 @@ send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
              * time stamping is expensive, but now is the
              * time to do it.
              */
-            dbgx(4, "This packet time: " TIMEVAL_FORMAT, pkthdr.ts.tv_sec, pkthdr.ts.tv_usec);
+            dbgx(4, "This packet time: %" PRIu64 " ns", c->ts_ns);
             skip_length = 0;
             ctx->skip_packets = 0;
 
             if (options->speed.mode == speed_multiplier) {
-                if (!timerisset(&last_pkt_ts)) {
-                    TIMEVAL_SET(&last_pkt_ts, &pkthdr.ts);
-                } else if (timercmp(&pkthdr.ts, &last_pkt_ts, >)) {
-                    struct timeval delta;
-
-                    timersub(&pkthdr.ts, &last_pkt_ts, &delta);
-                    timeradd(&stats->pkt_ts_delta, &delta, &stats->pkt_ts_delta);
-                    TIMEVAL_SET(&last_pkt_ts, &pkthdr.ts);
+                if (last_pkt_ns == 0) {
+                    last_pkt_ns = c->ts_ns;
+                } else if (c->ts_ns > last_pkt_ns) {
+                    stats->pkt_ts_delta_ns += idle_gap_delta(options, last_pkt_ns, c->ts_ns);
+                    last_pkt_ns = c->ts_ns;
                 }
             }
 
             if (!top_speed) {
+                now_ns = tcpr_clock_ns();
                 now_is_now = true;
-                gettimeofday(&now, NULL);
             }
 
             /*
@@ -465,68 +2735,108 @@ send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
              * This also sets skip_length and skip_packets which will avoid
              * timestamping for a given number of packets.
              */
-            calc_sleep_time(ctx,
-                            &stats->pkt_ts_delta,
-                            &stats->time_delta,
-                            pktlen,
-                            sp,
-                            packetnum,
-                            &stats->end_time,
-                            TIMEVAL_TO_MICROSEC(&stats->start_time),
-                            &skip_length);
+            if (!calc_sleep_time(ctx,
+                                 stats->pkt_ts_delta_ns,
+                                 stats->time_delta_ns,
+                                 pktlen,
+                                 sp,
+                                 packetnum,
+                                 stats->end_time_ns,
+                                 stats->start_time_ns,
+                                 &skip_length))
+                goto next;
 
             /*
              * Track the time of the "last packet sent".
              *
              * A number of 3rd party tools generate bad timestamps which go backwards
-             * in time.  Hence, don't update the "last" unless pkthdr.ts > last
+             * in time.  Hence, don't update the "last" unless pkthdr_ptr->ts > last
              */
-            if (timercmp(&stats->time_delta, &stats->pkt_ts_delta, <))
-                TIMEVAL_SET(&stats->time_delta, &stats->pkt_ts_delta);
+            if (stats->time_delta_ns < stats->pkt_ts_delta_ns)
+                stats->time_delta_ns = stats->pkt_ts_delta_ns;
 
             /*
              * we know how long to sleep between sends, now do it.
              */
+            if (!top_speed && sp->trace != NULL)
+                trace_deadline = now_ns + TIMESPEC_TO_NANOSEC(&ctx->nap);
             if (!top_speed)
-                tcpr_sleep(ctx, sp, &ctx->nap, &now);
+                tcpr_sleep(ctx, sp, &ctx->nap, &now_ns);
         }
 
+        if (options->profile)
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_PACE, &prof_mark);
+
 #ifdef ENABLE_VERBOSE
         /* do we need to print the packet via tcpdump? */
         if (options->verbose)
-            tcpdump_print(options->tcpdump, &pkthdr, pktdata);
+            tcpdump_print(options->tcpdump, pkthdr_ptr, pktdata);
 #endif
 
-        dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
-        /* write packet out on network */
-        if (sendpacket(sp, pktdata, pktlen, &pkthdr) < (int)pktlen) {
-            warnx("Unable to send packet: %s", sendpacket_geterr(sp));
-            continue;
+#ifdef ENABLE_RXMATCH
+        if (ctx->rxmatch != NULL)
+            rx_sent(ctx, c->cached_packet, pktdata, pkthdr_ptr->caplen, datalink);
+#endif
+
+        if (use_batch) {
+            dbgx(2, "Queueing packet #" COUNTER_SPEC, packetnum);
+            memcpy(&batch_pkthdr[batch_cnt], pkthdr_ptr, sizeof(struct pcap_pkthdr));
+            batch[batch_cnt].data = pktdata;
+            batch[batch_cnt].len = pktlen;
+            batch[batch_cnt].pkthdr = &batch_pkthdr[batch_cnt];
+            batch[batch_cnt].csum_start = csum_start;
+            batch[batch_cnt].csum_offset = csum_offset;
+            batch[batch_cnt].gso_size = 0;
+#ifdef HAVE_SO_TXTIME
+            batch[batch_cnt].txtime = 0;
+#endif
+            batch_sp = sp;
+            if (++batch_cnt == SENDPACKET_BATCH_MAX) {
+                send_packet_batch(ctx, sp, batch, batch_cnt);
+                batch_cnt = 0;
+            }
+        } else {
+            dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
+            /* write packet out on network */
+#ifdef HAVE_PACKET_VNET_HDR
+            sp->csum_start = csum_start;
+            sp->csum_offset = csum_offset;
+            sp->gso_size = 0;
+#endif
+            if (sendpacket(sp, pktdata, pktlen, pkthdr_ptr) < (int)pktlen) {
+                warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+                goto next;
+            }
+
+            ++stats->pkts_sent;
+            stats->bytes_sent += pktlen;
+        }
+        if (options->profile) {
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_SEND, &prof_mark);
+            ++sp->profile.packets;
         }
 
         /*
          * Mark the time when we sent the last packet
          */
-        TIMEVAL_SET(&stats->end_time, &now);
-
-#ifdef TIMESTAMP_TRACE
-        add_timestamp_trace_entry(pktlen, &stats->end_time, skip_length);
-#endif
-
-        stats->pkts_sent++;
-        stats->bytes_sent += pktlen;
+        stats->end_time_ns = now_ns;
+        if (sp->trace != NULL)
+            tcpr_trace_add(sp->trace,
+                           packetnum,
+                           trace_deadline,
+                           now_is_now ? now_ns : tcpr_clock_ns(),
+                           skip_length,
+                           ctx->skip_packets,
+                           pktlen);
 
         /* print stats during the run? */
         if (options->stats > 0) {
-            if (!timerisset(&stats->last_print)) {
-                TIMEVAL_SET(&stats->last_print, &now);
-            } else {
-                timersub(&now, &stats->last_print, &print_delta);
-                if (print_delta.tv_sec >= options->stats) {
-                    TIMEVAL_SET(&stats->end_time, &now);
-                    packet_stats(stats);
-                    TIMEVAL_SET(&stats->last_print, &now);
-                }
+            if (stats->last_print_ns == 0) {
+                stats->last_print_ns = now_ns;
+            } else if (now_ns - stats->last_print_ns >= SEC_TO_NANOSEC(options->stats)) {
+                stats->end_time_ns = now_ns;
+                packet_stats(stats);
+                stats->last_print_ns = now_ns;
             }
         }
 
@@ -536,322 +2846,863 @@ send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx)
             sp->first_packet = false;
         }
 #endif
+
         /* stop sending based on the duration limit... */
-        if ((end_us > 0 && (COUNTER)TIMEVAL_TO_MICROSEC(&now) > end_us) ||
+        if ((end_ns > 0 && now_ns > end_ns) ||
             /* ... or stop sending based on the limit -L? */
-            (limit_send > 0 && stats->pkts_sent >= limit_send)) {
+            (limit_send > 0 && stats->pkts_sent + batch_cnt >= limit_send)) {
             ctx->abort = true;
         }
+
+next:
+        /* move on in the capture we just sent from, dropping it at its end */
+        if (c->src.weight != 0) {
+            c->mix_sent += options->mix_packets ? 1 : pktlen;
+            if (!merge_next(ctx, c)) {
+                /* --mix: start it over, unless that was the last to be sent whole */
+                if (!c->mix_wrapped) {
+                    c->mix_wrapped = true;
+                    --mix_left;
+                }
+                c->cached_packet = NULL;
+                if (mix_left == 0 || !merge_next(ctx, c))
+                    n = 0;
+            }
+        } else if (!merge_next(ctx, c)) {
+            heap[0] = heap[--n];
+        }
+        merge_sift_down(cur, heap, n, 0);
+        if (options->profile)
+            tcpr_prof_lap(&sp->profile, TCPR_PROF_READ, &prof_mark);
     } /* while */
+    tcpr_mem_guard(false);
+
+    /* send whatever is left in the batch, even when aborting due to limits */
+    if (batch_cnt > 0)
+        send_packet_batch(ctx, batch_sp, batch, batch_cnt);
+    safe_free(scratch);
 
 #ifdef HAVE_NETMAP
     /* when completing test, wait until the last packet is sent */
     if (options->netmap && (ctx->abort || options->loop == 1)) {
-        while (ctx->intf1 && !netmap_tx_queues_empty(ctx->intf1)) {
-            now_is_now = true;
-            gettimeofday(&now, NULL);
-        }
-
-        while (ctx->intf2 && !netmap_tx_queues_empty(ctx->intf2)) {
-            now_is_now = true;
-            gettimeofday(&now, NULL);
+        for (i = 0; i < cnt; i++) {
+            while (!netmap_tx_queues_empty(cur[i].src.sp)) {
+                now_ns = tcpr_clock_ns();
+                now_is_now = true;
+            }
         }
     }
 #endif /* HAVE_NETMAP */
 
     if (!now_is_now)
-        gettimeofday(&now, NULL);
+        now_ns = tcpr_clock_ns();
 
-    TIMEVAL_SET(&stats->end_time, &now);
+    stats->end_time_ns = now_ns;
 
     increment_iteration(ctx);
 }
 
 /**
- * the alternate main loop function for tcpreplay.  This is where we figure out
- * what to do with each packet when processing two files a the same time
+ * \brief send --flow-copies copies of a preloaded pcap at the same time
+ *
+ * Copy n is sent n offsets later than the first and has its addresses
+ * shifted as --unique-ip would on its nth loop, so every copy is a set
+ * of flows of its own, while all of them share the one cache.  Without
+ * --unique-ip every loop sends the same copies, with it later loops carry
+ * on where the copies of the last left off.
+ * The offset is --flow-copy-offset, or the length of the pcap divided by
+ * the number of copies.
  */
 void
-send_dual_packets(tcpreplay_t *ctx, pcap_t *pcap1, int cache_file_idx1, pcap_t *pcap2, int cache_file_idx2)
+send_flow_copies(tcpreplay_t *ctx, int idx)
 {
-    struct timeval print_delta, now, last_pkt_ts;
     tcpreplay_opt_t *options = ctx->options;
-    tcpreplay_stats_t *stats = &ctx->stats;
-    COUNTER packetnum = 0;
-    COUNTER limit_send = options->limit_send;
-    int cache_file_idx;
-    struct pcap_pkthdr pkthdr1, pkthdr2;
-    u_char *pktdata1 = NULL, *pktdata2 = NULL, *pktdata = NULL;
-    sendpacket_t *sp;
-    COUNTER pktlen;
-    packet_cache_t *cached_packet1 = NULL, *cached_packet2 = NULL;
-    packet_cache_t **prev_packet1 = NULL, **prev_packet2 = NULL;
-    struct pcap_pkthdr *pkthdr_ptr;
-    int datalink;
-    COUNTER end_us;
-    COUNTER skip_length = 0;
-    bool top_speed = (options->speed.mode == speed_topspeed ||
-                      (options->speed.mode == speed_mbpsrate && options->speed.speed == 0));
-    bool now_is_now = true;
+    file_cache_t *file_cache = &options->file_cache[idx];
+    send_source_t sources[MAX_FILES];
+    int copies = options->flow_copies;
+    /* the --unique-ip pass, 0 for the first or without it */
+    COUNTER pass = options->unique_ip && ctx->unique_iteration ? ctx->unique_iteration - 1 : 0;
+    u_int64_t offset_ns;
+    int i;
+
+    assert(copies > 1 && copies <= MAX_FILES);
+    assert(file_cache->cached);
+
+    if (options->flow_copy_offset != 0) {
+        offset_ns = options->flow_copy_offset * 1000;
+    } else if (file_cache->packet_cnt > 1) {
+        u_int64_t first = pkthdr_ts_ns(&file_cache->packet_cache[0].pkthdr, file_cache->nsec);
+        u_int64_t last = pkthdr_ts_ns(&file_cache->packet_cache[file_cache->packet_cnt - 1].pkthdr, file_cache->nsec);
+
+        offset_ns = last > first ? (last - first) / (u_int64_t)copies : 0;
+    } else {
+        offset_ns = 0;
+    }
 
-    gettimeofday(&now, NULL);
-    if (!timerisset(&stats->start_time)) {
-        TIMEVAL_SET(&stats->start_time, &now);
-        if (ctx->options->stats >= 0) {
-            char buf[64];
-            if (format_date_time(&stats->start_time, buf, sizeof(buf)) > 0)
-                printf("Dual test start: %s ...\n", buf);
-        }
+    memset(sources, 0, sizeof(sources[0]) * copies);
+    for (i = 0; i < copies; i++) {
+        sources[i].idx = idx;
+        sources[i].sp = ctx->intf1;
+        sources[i].offset_ns = offset_ns * (u_int64_t)i;
+        sources[i].shift = pass * (COUNTER)copies + (COUNTER)i;
     }
 
-    ctx->skip_packets = 0;
-    timerclear(&last_pkt_ts);
-    if (options->limit_time > 0)
-        end_us = TIMEVAL_TO_MICROSEC(&stats->start_time) + SEC_TO_MICROSEC(options->limit_time);
-    else
-        end_us = 0;
+    send_merged_packets(ctx, sources, copies);
+}
+
+/**
+ * Reserve the next entry in the packet_cache array, growing it as needed
+ */
+static packet_cache_t *
+packet_cache_new_entry(file_cache_t *file_cache)
+{
+    packet_cache_t *packet;
+
+    if (file_cache->packet_cnt == file_cache->packet_max) {
+        file_cache->packet_max = file_cache->packet_max ? file_cache->packet_max * 2 : PACKET_CACHE_INITIAL_CNT;
+        file_cache->packet_cache =
+                safe_realloc(file_cache->packet_cache, file_cache->packet_max * sizeof(packet_cache_t));
+    }
+
+    packet = &file_cache->packet_cache[file_cache->packet_cnt++];
+    memset(packet, 0, sizeof(*packet));
+
+    return packet;
+}
+
+/**
+ * \brief Take the bytes a --preload-snaplen packet lost off its checksum
+ *
+ * The packet is sent with zeros in place of the bytes dropped, which add
+ * nothing to the TCP or UDP checksum, so the checksum stored is made to
+ * cover the kept bytes only.  Packets whose checksum didn't make the cut,
+ * and fragments after the first, are left as they are.  Bytes past the
+ * end of the IP packet, such as Ethernet padding, aren't covered anyway.
+ */
+static void
+preload_snaplen_csum(u_char *stored, const u_char *pktdata, uint32_t caplen, uint32_t snaplen, int datalink)
+{
+    uint32_t _U_ vlan_offset;
+    uint16_t ether_type;
+    uint32_t l2offset, l2len, l4, end, sum_off;
+    uint16_t csum;
+    uint32_t sum;
+    uint8_t proto;
+    bool udp = false;
 
-    if (options->preload_pcap) {
-        prev_packet1 = &cached_packet1;
-        prev_packet2 = &cached_packet2;
+    if (get_l2len_protocol(pktdata, caplen, datalink, &ether_type, &l2len, &l2offset, &vlan_offset) < 0)
+        return;
+
+    if (ether_type == ETHERTYPE_IP) {
+        const ipv4_hdr_t *ip_hdr = (const ipv4_hdr_t *)(pktdata + l2len);
+
+        if (caplen < l2len + sizeof(ipv4_hdr_t) || (ntohs(ip_hdr->ip_off) & IP_OFFMASK) != 0)
+            return;
+        proto = ip_hdr->ip_p;
+        l4 = l2len + (ip_hdr->ip_hl << 2);
+        end = l2len + ntohs(ip_hdr->ip_len);
+    } else if (ether_type == ETHERTYPE_IP6) {
+        const ipv6_hdr_t *ip6_hdr = (const ipv6_hdr_t *)(pktdata + l2len);
+        const u_char *l4_hdr;
+
+        if (caplen < l2len + TCPR_IPV6_H ||
+            (l4_hdr = get_layer4_v6_proto(ip6_hdr, pktdata + caplen, &proto)) == NULL)
+            return;
+        l4 = (uint32_t)(l4_hdr - pktdata);
+        end = l2len + TCPR_IPV6_H + ntohs(ip6_hdr->ip_len);
     } else {
-        prev_packet1 = NULL;
-        prev_packet2 = NULL;
+        return;
     }
 
-    pktdata1 = get_next_packet(ctx, pcap1, &pkthdr1, cache_file_idx1, prev_packet1);
-    pktdata2 = get_next_packet(ctx, pcap2, &pkthdr2, cache_file_idx2, prev_packet2);
+    if (proto == IPPROTO_TCP && snaplen >= l4 + TCPR_TCP_H) {
+        sum_off = l4 + offsetof(tcp_hdr_t, th_sum);
+    } else if (proto == IPPROTO_UDP && snaplen >= l4 + TCPR_UDP_H) {
+        sum_off = l4 + offsetof(udp_hdr_t, uh_sum);
+        udp = true;
+    } else {
+        return;
+    }
 
-    /* MAIN LOOP
-     * Keep sending while we have packets or until
-     * we've sent enough packets
-     */
-    while (!ctx->abort && !(pktdata1 == NULL && pktdata2 == NULL)) {
-        now_is_now = false;
-        packetnum++;
+    if (end > caplen)
+        end = caplen;
+    if (end <= snaplen)
+        return;
 
-        /* figure out which pcap file we need to process next
-         * when get_next_packet() returns null for pktdata, the pkthdr
-         * will still have the old values from the previous call.  This
-         * means we can't always trust the timestamps to tell us which
-         * file to process.
-         */
-        if (pktdata1 == NULL || (pktdata2 != NULL && timercmp(&pkthdr1.ts, &pkthdr2.ts, >))) {
-            /* file 2 is next */
-            sp = ctx->intf2;
-            datalink = options->file_cache[cache_file_idx2].dlt;
-            pkthdr_ptr = &pkthdr2;
-            cache_file_idx = cache_file_idx2;
-            pktdata = pktdata2;
-        } else {
-            /* file 1 is next */
-            sp = ctx->intf1;
-            datalink = options->file_cache[cache_file_idx1].dlt;
-            pkthdr_ptr = &pkthdr1;
-            cache_file_idx = cache_file_idx1;
-            pktdata = pktdata1;
+    memcpy(&csum, stored + sum_off, sizeof(csum));
+    /* no UDP checksum at all */
+    if (udp && csum == 0)
+        return;
+
+    /* the sum of the dropped bytes, swapped if they start on an odd byte of the segment */
+    sum = tcpr_csum_partial(pktdata + snaplen, (int)(end - snaplen), 0);
+    if ((snaplen - l4) & 1)
+        sum = ((sum & 0xff) << 8) | (sum >> 8);
+
+    /* ones' complement subtraction from the sum the checksum is the complement of */
+    sum = (uint16_t)~csum + (uint16_t)~sum;
+    sum = (sum & 0xffff) + (sum >> 16);
+    csum = (uint16_t)~sum;
+    if (udp && csum == 0)
+        csum = 0xffff;
+    memcpy(stored + sum_off, &csum, sizeof(csum));
+}
+
+/* hash the bytes of a packet for --preload-dedup, a word at a time */
+static inline uint64_t
+preload_dedup_hash(const u_char *data, uint32_t len)
+{
+    uint64_t hv = 0x9e3779b97f4a7c15ULL ^ len;
+    uint64_t w;
+    uint32_t i;
+
+    for (i = 0; i + sizeof(w) <= len; i += sizeof(w)) {
+        memcpy(&w, data + i, sizeof(w));
+        hv = (hv ^ w) * 0x100000001b3ULL;
+        hv ^= hv >> 29;
+    }
+    for (; i < len; i++)
+        hv = (hv ^ data[i]) * 0x100000001b3ULL;
+
+    hv ^= hv >> 33;
+    hv *= 0xff51afd7ed558ccdULL;
+    hv ^= hv >> 33;
+
+    return hv;
+}
+
+/**
+ * \brief Find an earlier copy of the len bytes at data, or remember them
+ *
+ * Returns the earlier copy, or NULL if data is the first of its kind.
+ */
+static const u_char *
+preload_dedup_find(preload_dedup_t *dedup, const u_char *data, uint32_t len)
+{
+    uint64_t hash = preload_dedup_hash(data, len);
+    size_t i, mask;
+
+    if (dedup->cnt + 1 > dedup->size / 4 * 3) {
+        preload_dedup_slot_t *old_slot = dedup->slot;
+        size_t old_size = dedup->size;
+
+        dedup->size = old_size ? old_size * 2 : PRELOAD_DEDUP_INITIAL;
+        dedup->slot = safe_malloc(sizeof(preload_dedup_slot_t) * dedup->size);
+        mask = dedup->size - 1;
+        for (i = 0; i < old_size; i++) {
+            size_t j;
+
+            if (old_slot[i].data == NULL)
+                continue;
+            for (j = old_slot[i].hash & mask; dedup->slot[j].data != NULL; j = (j + 1) & mask)
+                ;
+            dedup->slot[j] = old_slot[i];
         }
+        safe_free(old_slot);
+    }
 
-#if defined TCPREPLAY || defined TCPREPLAY_EDIT
-        /* do we use the snaplen (caplen) or the "actual" packet len? */
-        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr_ptr->len : (COUNTER)pkthdr_ptr->caplen;
-#elif TCPBRIDGE
-        pktlen = (COUNTER)pkthdr_ptr->caplen;
+    mask = dedup->size - 1;
+    for (i = hash & mask; dedup->slot[i].data != NULL; i = (i + 1) & mask) {
+        if (dedup->slot[i].hash == hash && dedup->slot[i].len == len && !memcmp(dedup->slot[i].data, data, len))
+            return dedup->slot[i].data;
+    }
+
+    dedup->slot[i].hash = hash;
+    dedup->slot[i].data = data;
+    dedup->slot[i].len = len;
+    ++dedup->cnt;
+
+    return NULL;
+}
+
+/**
+ * \brief Pad a --preload-snaplen packet back out to its caplen
+ *
+ * A packet is only cut if it's longer than the snaplen, so exactly
+ * snaplen bytes are ever written to the start of a buffer of the ring and
+ * the rest of it stays zero.  Buffers are reused PACKET_PAD_SLOTS packets
+ * later, after any batch they were queued in has gone out.
+ *
+ * With tag set, an 802.1Q tag is inserted after the MAC addresses, for
+ * --gen-vlan-add.  Tagged copies may write GEN_VLAN_TAG_LEN bytes past
+ * the snaplen, which cut packets without a tag clear again.
+ */
+static u_char *
+packet_cache_pad(file_cache_t *file_cache, const packet_cache_t *cached_packet, bool tag)
+{
+    uint32_t stored = cached_packet->pkthdr.caplen;
+    u_char *buf;
+
+    if (file_cache->pad_ring == NULL)
+        file_cache->pad_ring = safe_malloc((size_t)file_cache->pad_max * PACKET_PAD_SLOTS);
+
+    buf = file_cache->pad_ring + (size_t)file_cache->pad_next * file_cache->pad_max;
+    file_cache->pad_next = (file_cache->pad_next + 1) % PACKET_PAD_SLOTS;
+    if (tag) {
+        memcpy(buf, cached_packet->pktdata, 2 * ETHER_ADDR_LEN);
+        buf[2 * ETHER_ADDR_LEN] = ETHERTYPE_VLAN >> 8;
+        buf[2 * ETHER_ADDR_LEN + 1] = ETHERTYPE_VLAN & 0xff;
+        buf[2 * ETHER_ADDR_LEN + 2] = 0;
+        buf[2 * ETHER_ADDR_LEN + 3] = 0;
+        memcpy(buf + 2 * ETHER_ADDR_LEN + GEN_VLAN_TAG_LEN,
+               cached_packet->pktdata + 2 * ETHER_ADDR_LEN,
+               stored - 2 * ETHER_ADDR_LEN);
+    } else {
+        memcpy(buf, cached_packet->pktdata, stored);
+        if (cached_packet->pad_caplen != 0)
+            memset(buf + stored, 0, min(GEN_VLAN_TAG_LEN, file_cache->pad_max - stored));
+    }
+
+    return buf;
+}
+
+/**
+ * \brief take needed bytes of the --cache-memory budget for a packet
+ *
+ * The budget is shared by every file, so the packets loaded first are the
+ * ones kept in RAM.  Once a file runs out the rest of it stays in the
+ * mapping, even packets that would still fit, so that the part sent from
+ * the mapping is one range that can be read ahead.
+ */
+static bool
+cache_memory_take(tcpreplay_t *ctx, file_cache_t *file_cache, size_t needed)
+{
+    size_t used;
+
+    if (!file_cache->spilled) {
+        used = __atomic_add_fetch(&ctx->cache_memory_used, needed, __ATOMIC_RELAXED);
+        if (used <= ctx->options->cache_memory)
+            return true;
+
+        __atomic_sub_fetch(&ctx->cache_memory_used, needed, __ATOMIC_RELAXED);
+        file_cache->spilled = true;
+        file_cache->spill_first = file_cache->packet_cnt;
+        dbgx(1, "--cache-memory used up, packets from " COUNTER_SPEC " on are sent from the mapping",
+             file_cache->spill_first);
+    }
+
+    return false;
+}
+
+/**
+ * \brief drop the pages of the mapping whose packets were copied into RAM
+ *
+ * Reading the file to build the cache faulted all of it in.  The mapping
+ * is private and those pages are clean, so the kernel can reclaim them
+ * from the page cache, and the spilled part is read back in as it's sent.
+ */
+static void
+cache_memory_release(file_cache_t *file_cache)
+{
+#if defined HAVE_MMAP && defined HAVE_MADVISE
+    mmap_pcap_t *mp = file_cache->mmap;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t len;
+
+    if (mp == NULL)
+        return;
+
+    if (file_cache->spilled && file_cache->spill_first < file_cache->packet_cnt)
+        len = (size_t)(file_cache->packet_cache[file_cache->spill_first].pktdata - mp->base) & ~(page - 1);
+    else
+        len = mp->size;
+
+    if (len > 0)
+        madvise(mp->base, len, MADV_DONTNEED);
 #else
-#error WTF???  We should not be here!
+    (void)file_cache;
+#endif
+}
+
+/**
+ * \brief read the mapping ahead of a packet sent from it under --cache-memory
+ *
+ * Asks for the next CACHE_MEMORY_READAHEAD bytes whenever sending is half
+ * way through the last lot, or has gone back to the start for another loop.
+ */
+static inline void
+cache_memory_readahead(file_cache_t *file_cache, const u_char *pktdata)
+{
+#if defined HAVE_MMAP && defined HAVE_MADVISE
+    mmap_pcap_t *mp = file_cache->mmap;
+    const u_char *from;
+    size_t len;
+
+    if (pktdata < file_cache->spill_next && pktdata >= file_cache->spill_from)
+        return;
+
+    from = (const u_char *)((uintptr_t)pktdata & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1));
+    len = min((size_t)(mp->base + mp->size - from), (size_t)CACHE_MEMORY_READAHEAD);
+    madvise((void *)from, len, MADV_WILLNEED);
+
+    file_cache->spill_from = from;
+    /* at the end of the file, wait for the next loop */
+    file_cache->spill_next = len < CACHE_MEMORY_READAHEAD ? mp->base + mp->size : from + len / 2;
+#else
+    (void)file_cache;
+    (void)pktdata;
+#endif
+}
+
+/**
+ * Copy a packet into the file cache.  Packet data is appended to the
+ * current arena (a new arena is started when it runs out of room) and
+ * the header is appended to the packet_cache array.
+ *
+ * If the file is memory mapped, only the header is stored and the packet
+ * data is referenced directly in the mapping.  With netmap, packets go
+ * into netmap buffers of sp instead while there are any, so they can be
+ * sent without a copy, and with DPDK and io_uring the arenas are
+ * registered with the NIC or the rings for the same reason.  With
+ * --preload-snaplen, only the first snaplen bytes are stored, without
+ * room for editing, and the packet is padded back out when sent.  With --cache-memory, mapped packets are copied all
+ * the same until the budget runs out.
+ */
+static packet_cache_t *
+packet_cache_append(tcpreplay_t *ctx,
+                    file_cache_t *file_cache,
+                    _U_ sendpacket_t *sp,
+                    const struct pcap_pkthdr *pkthdr,
+                    u_char *pktdata)
+{
+    packet_arena_t *arena = file_cache->arena;
+    packet_cache_t *cached_packet;
+    size_t needed = pkthdr->caplen + PACKET_HEADROOM;
+    uint32_t stored = pkthdr->caplen;
+
+    if (file_cache->snaplen != 0) {
+        stored = min(pkthdr->caplen, file_cache->snaplen);
+        needed = stored;
+    }
+
+#if defined HAVE_NETMAP && defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    /* streamed files come and go, netmap buffers are ours until the end */
+    if (sp != NULL && !file_cache->streamed) {
+        u_char *buf = sendpacket_netmap_alloc(sp, pkthdr->caplen);
+
+        if (buf != NULL) {
+            cached_packet = packet_cache_new_entry(file_cache);
+            cached_packet->pktdata = buf;
+            memcpy(buf, pktdata, pkthdr->caplen);
+            memcpy(&cached_packet->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+            return cached_packet;
+        }
+    }
+#endif
+
+    if (file_cache->mmap != NULL &&
+        (ctx->options->cache_memory == 0 || !cache_memory_take(ctx, file_cache, needed))) {
+        cached_packet = packet_cache_new_entry(file_cache);
+        cached_packet->pktdata = pktdata;
+        memcpy(&cached_packet->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+        return cached_packet;
+    }
+
+    if (file_cache->mmap == NULL && ctx->options->cache_memory != 0 && !cache_memory_take(ctx, file_cache, needed))
+        errx(-1, "%s", "The packets don't fit in --cache-memory and the file can't be memory mapped");
+
+    /* keep each packet aligned for the header parsing done by the editors */
+    needed = (needed + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (arena == NULL || arena->size - arena->used < needed) {
+        size_t size = PACKET_ARENA_SIZE;
+        tcpr_pages_t pages;
+
+        /* big files get big arenas, and so the biggest pages */
+        if (tcpr_huge_enabled() && arena != NULL)
+            size = min(arena->size * 2, (size_t)PACKET_ARENA_HUGE_MAX);
+
+        arena = safe_malloc(sizeof(packet_arena_t));
+        arena->size = max(needed, size);
+        if ((arena->data = tcpr_huge_alloc(&arena->size, &pages)) == NULL)
+            errx(-1, "Unable to allocate a packet arena of %zu bytes", arena->size);
+        tcpr_mem_map(TCPR_MEM_PRELOAD, arena->size);
+        arena->next = file_cache->arena;
+        file_cache->arena = arena;
+        dbgx(2, "Allocated new packet arena of %zu bytes, pages %d", arena->size, pages);
+#if (defined HAVE_DPDK || defined HAVE_IO_URING) && defined TCPREPLAY && !defined TCPREPLAY_EDIT
+        if (sp != NULL && !file_cache->streamed)
+            sendpacket_register_mem(sp, arena->data, arena->size);
 #endif
+    }
+
+    cached_packet = packet_cache_new_entry(file_cache);
+    cached_packet->pktdata = arena->data + arena->used;
+    memcpy(cached_packet->pktdata, pktdata, stored);
+    memcpy(&cached_packet->pkthdr, pkthdr, sizeof(struct pcap_pkthdr));
+    arena->used += needed;
+
+    if (stored < pkthdr->caplen) {
+        preload_snaplen_csum(cached_packet->pktdata, pktdata, pkthdr->caplen, stored, file_cache->dlt);
+        cached_packet->pkthdr.caplen = stored;
+        cached_packet->pad_caplen = pkthdr->caplen;
+        /* --pktlen may send up to len bytes */
+        file_cache->pad_max = max(file_cache->pad_max, max(pkthdr->caplen, pkthdr->len));
+    }
+
+    /* the copy just made is the last thing in the arena, so it's easily undone */
+    if (file_cache->dedup != NULL) {
+        const u_char *dup = preload_dedup_find(file_cache->dedup, cached_packet->pktdata, stored);
+
+        file_cache->dedup_bytes += stored;
+        if (dup != NULL) {
+            cached_packet->pktdata = (u_char *)dup;
+            arena->used -= needed;
+            file_cache->dedup_saved += stored;
+        }
+    }
+
+    return cached_packet;
+}
+
+/**
+ * Read the next packet from the source the file is open with
+ */
+static inline u_char *
+read_next_packet(file_cache_t *file_cache, struct pcap_pkthdr *pkthdr)
+{
+    if (file_cache->source == NULL)
+        return NULL;
+
+    return pkt_source_next(file_cache->source, pkthdr);
+}
+
+/**
+ * \brief --preload-filter and --preload-sample: whether a packet read while
+ * preloading is cached
+ *
+ * Sampling goes by flow_hash(), which is the same both ways, so the flows
+ * kept are kept whole.  Packets which aren't IP are all kept.
+ */
+static inline bool
+preload_filter_keep(const tcpreplay_opt_t *options,
+                    file_cache_t *file_cache,
+                    const struct pcap_pkthdr *pkthdr,
+                    const u_char *pktdata)
+{
+    uint32_t hash;
+
+    if (file_cache->filter == NULL && options->preload_sample <= 1)
+        return true;
+
+    if ((file_cache->filter != NULL && pcap_offline_filter(file_cache->filter, pkthdr, pktdata) == 0) ||
+        (options->preload_sample > 1 && flow_hash(pkthdr, pktdata, file_cache->dlt, &hash) &&
+         hash % options->preload_sample != 0)) {
+        ++file_cache->filter_dropped;
+        return false;
+    }
+
+    ++file_cache->filter_kept;
+    return true;
+}
 
-        dbgx(2, "packet " COUNTER_SPEC " caplen " COUNTER_SPEC, packetnum, pktlen);
+/**
+ * \brief read_next_packet(), but only the packets of the --start-time and
+ * co slice of the file
+ *
+ * Returns NULL once past the end of the slice, as at the end of the file.
+ */
+static u_char *
+read_slice_packet(const tcpreplay_opt_t *options, file_cache_t *file_cache, struct pcap_pkthdr *pkthdr)
+{
+    u_char *pktdata;
 
-#if defined TCPREPLAY && defined TCPREPLAY_EDIT
-        if (tcpedit_packet(tcpedit, &pkthdr_ptr, &pktdata, sp->cache_dir) == -1) {
-            errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(tcpedit));
-        }
-        pktlen = options->use_pkthdr_len ? (COUNTER)pkthdr_ptr->len : (COUNTER)pkthdr_ptr->caplen;
-#endif
+    while (!file_cache->slice_done && (pktdata = read_next_packet(file_cache, pkthdr)) != NULL) {
+        COUNTER packet = ++file_cache->slice_read;
+        u_int64_t ts_ns = pkthdr_ts_ns(pkthdr, file_cache->nsec);
+        u_int64_t offset_ns;
 
-        if (ctx->options->unique_ip && ctx->unique_iteration && ctx->unique_iteration > ctx->last_unique_iteration) {
-            /* edit packet to ensure every pass is unique */
-            if (fast_edit_packet(pkthdr_ptr,
-                                 &pktdata,
-                                 ctx->unique_iteration - 1,
-                                 options->file_cache[cache_file_idx].cached,
-                                 datalink) == -1) {
-                ++stats->failed;
-                continue;
-            }
+        if (packet == 1)
+            file_cache->slice_first_ns = ts_ns;
+        offset_ns = ts_ns > file_cache->slice_first_ns ? ts_ns - file_cache->slice_first_ns : 0;
+
+        if ((options->slice_end_pkt != 0 && packet > options->slice_end_pkt) ||
+            (options->slice_end_ns != 0 && offset_ns >= options->slice_end_ns)) {
+            file_cache->slice_done = true;
+            break;
         }
 
-        /* update flow stats */
-        if (options->flow_stats && !options->file_cache[cache_file_idx].cached)
-            update_flow_stats(ctx, sp, pkthdr_ptr, pktdata, datalink);
+        if (packet >= options->slice_start_pkt && offset_ns >= options->slice_start_ns)
+            return pktdata;
+    }
 
-        /*
-         * this accelerator improves performance by avoiding expensive
-         * time stamps during periods where we have fallen behind in our
-         * sending
-         */
-        if (skip_length && pktlen < skip_length) {
-            skip_length -= pktlen;
-        } else if (ctx->skip_packets) {
-            --ctx->skip_packets;
-        } else {
-            /*
-             * time stamping is expensive, but now is the
-             * time to do it.
-             */
-            dbgx(4, "This packet time: " TIMEVAL_FORMAT, pkthdr_ptr->ts.tv_sec, pkthdr_ptr->ts.tv_usec);
-            skip_length = 0;
-            ctx->skip_packets = 0;
+    return NULL;
+}
 
-            if (options->speed.mode == speed_multiplier) {
-                if (!timerisset(&last_pkt_ts)) {
-                    TIMEVAL_SET(&last_pkt_ts, &pkthdr_ptr->ts);
-                } else if (timercmp(&pkthdr_ptr->ts, &last_pkt_ts, >)) {
-                    struct timeval delta;
-
-                    timersub(&pkthdr_ptr->ts, &last_pkt_ts, &delta);
-                    timeradd(&stats->pkt_ts_delta, &delta, &stats->pkt_ts_delta);
-                    TIMEVAL_SET(&last_pkt_ts, &pkthdr_ptr->ts);
-                }
+/**
+ * \brief start reading a newly opened file at its --start-time and co slice
+ *
+ * The index, if the file has one, takes us to the last indexed packet
+ * before the slice; read_slice_packet() reads and drops the rest.
+ */
+void
+slice_open(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *file_cache = &options->file_cache[idx];
+    const pcap_index_entry_t *entry = NULL, *by_time;
+    const pcap_index_t *index;
 
-                if (!timerisset(&stats->time_delta))
-                    TIMEVAL_SET(&stats->pkt_ts_delta, &stats->pkt_ts_delta);
-            }
+    file_cache->slice_read = 0;
+    file_cache->slice_first_ns = 0;
+    file_cache->slice_done = false;
 
-            if (!top_speed) {
-                gettimeofday(&now, NULL);
-                now_is_now = true;
-            }
+    if (!options->slice || (options->slice_start_pkt <= 1 && options->slice_start_ns == 0))
+        return;
 
-            /*
-             * Only if the current packet is not late.
-             *
-             * This also sets skip_length and skip_packets which will avoid
-             * timestamping for a given number of packets.
-             */
-            calc_sleep_time(ctx,
-                            &stats->pkt_ts_delta,
-                            &stats->time_delta,
-                            pktlen,
-                            sp,
-                            packetnum,
-                            &stats->end_time,
-                            TIMEVAL_TO_MICROSEC(&stats->start_time),
-                            &skip_length);
+    if (file_cache->source == NULL || (index = pkt_source_index(file_cache->source)) == NULL)
+        return;
 
-            /*
-             * Track the time of the "last packet sent".
-             *
-             * A number of 3rd party tools generate bad timestamps which go backwards
-             * in time.  Hence, don't update the "last" unless pkthdr_ptr->ts > last
-             */
-            if (timercmp(&stats->time_delta, &stats->pkt_ts_delta, <))
-                TIMEVAL_SET(&stats->time_delta, &stats->pkt_ts_delta);
+    /* the slice starts at the later of the two */
+    if (options->slice_start_pkt > 1)
+        entry = pcap_index_find_packet(index, options->slice_start_pkt - 1);
+    if (options->slice_start_ns != 0) {
+        by_time = pcap_index_find_time(index, index->first_ts_ns + options->slice_start_ns);
+        if (by_time != NULL && (entry == NULL || by_time->packet > entry->packet))
+            entry = by_time;
+    }
 
-            /*
-             * we know how long to sleep between sends, now do it.
-             */
-            if (!top_speed)
-                tcpr_sleep(ctx, sp, &ctx->nap, &now);
-        }
+    if (entry != NULL && entry->packet > 0 && pkt_source_seek(file_cache->source, entry)) {
+        file_cache->slice_read = entry->packet;
+        file_cache->slice_first_ns = index->first_ts_ns;
+        dbgx(1, "Seeked past " COUNTER_SPEC " packets of %s", file_cache->slice_read, options->sources[idx].filename);
+    }
+}
 
-#ifdef ENABLE_VERBOSE
-        /* do we need to print the packet via tcpdump? */
-        if (options->verbose)
-            tcpdump_print(options->tcpdump, pkthdr_ptr, pktdata);
-#endif
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT
+/**
+ * \brief Find a buffer tcpedit_packet() can edit the packet in
+ *
+ * Packets are edited in place whenever possible.  The preload arena and
+ * PKT_SOURCE_HEADROOM sources such as the readahead ring leave
+ * PACKET_HEADROOM after every packet, which is enough for any layer 2
+ * header the DLT encoders write, but packets read straight from libpcap,
+ * a memory mapped file or the caller's memory have no room after them.
+ * Those are only copied when tcpedit may grow them, and --fixlen=pad,
+ * which may safe_realloc() the packet, always gets a private copy.
+ */
+static u_char *
+get_edit_buffer(tcpreplay_t *ctx, int file_idx, const struct pcap_pkthdr *pkthdr, u_char *pktdata)
+{
+    file_cache_t *file_cache = &ctx->options->file_cache[file_idx];
+    int growth = tcpedit_get_growth(tcpedit);
 
-        dbgx(2, "Sending packet #" COUNTER_SPEC, packetnum);
-        /* write packet out on network */
-        if (sendpacket(sp, pktdata, pktlen, pkthdr_ptr) < (int)pktlen) {
-            warnx("Unable to send packet: %s", sendpacket_geterr(sp));
-            continue;
-        }
+    if (growth == 0)
+        return pktdata;
 
-        /*
-         * Mark the time when we sent the last packet
-         */
-        TIMEVAL_SET(&stats->end_time, &now);
+    if (growth > 0 && growth <= PACKET_HEADROOM &&
+        ((pkt_source_caps(file_cache) & PKT_SOURCE_HEADROOM) ||
+         (ctx->options->preload_pcap && file_cache->mmap == NULL &&
+          !(pkt_source_caps(file_cache) & PKT_SOURCE_BORROWED))))
+        return pktdata;
 
-        ++stats->pkts_sent;
-        stats->bytes_sent += pktlen;
+    if (ctx->edit_buff == NULL)
+        ctx->edit_buff = safe_malloc(MAXPACKET + PACKET_HEADROOM);
 
-        /* print stats during the run? */
-        if (options->stats > 0) {
-            if (!timerisset(&stats->last_print)) {
-                TIMEVAL_SET(&stats->last_print, &now);
-            } else {
-                timersub(&now, &stats->last_print, &print_delta);
-                if (print_delta.tv_sec >= options->stats) {
-                    TIMEVAL_SET(&stats->end_time, &now);
-                    packet_stats(stats);
-                    TIMEVAL_SET(&stats->last_print, &now);
-                }
-            }
-        }
+    memcpy(ctx->edit_buff, pktdata, pkthdr->caplen);
+    return ctx->edit_buff;
+}
 
-#if defined HAVE_NETMAP
-        if (sp->first_packet || timesisset(&ctx->nap)) {
-            wake_send_queues(sp, options);
-            sp->first_packet = false;
-        }
+/**
+ * \brief Run tcpedit over the packet, only once if it's in the file cache
+ *
+ * Cached packets are edited in place, so as long as the edits come out the
+ * same every time (no --fuzz-seed) the edited packet and header are kept in
+ * the cache and later loops send them as is.  Per loop changes such as
+ * --unique-ip are applied by the caller on top.  Packets tcpedit edited in
+ * a private copy (see get_edit_buffer()) are edited again on every loop.
+ *
+ * csum_start and csum_offset are set to where the NIC has to finish the
+ * L4 checksum with --csum-offload, see tcpedit_get_csum_partial().
+ */
+static void
+edit_packet(tcpreplay_t *ctx,
+            int file_idx,
+            packet_cache_t *cached_packet,
+            struct pcap_pkthdr **pkthdr,
+            u_char **pktdata,
+            tcpr_dir_t direction,
+            COUNTER packetnum,
+            uint16_t *csum_start,
+            uint16_t *csum_offset)
+{
+    bool copied;
+
+    if (cached_packet != NULL && cached_packet->edited) {
+        *csum_start = cached_packet->csum_start;
+        *csum_offset = cached_packet->csum_offset;
+        return;
+    }
+
+    *pktdata = get_edit_buffer(ctx, file_idx, *pkthdr, *pktdata);
+    copied = *pktdata == ctx->edit_buff;
+    if (tcpedit_packet(tcpedit, pkthdr, pktdata, direction) == -1) {
+        errx(-1, "Error editing packet #" COUNTER_SPEC ": %s", packetnum, tcpedit_geterr(tcpedit));
+    }
+    tcpedit_get_csum_partial(tcpedit, csum_start, csum_offset);
+
+    if (copied) {
+        /* --fixlen=pad may have reallocated it */
+        ctx->edit_buff = *pktdata;
+    } else if (cached_packet != NULL && *pktdata == cached_packet->pktdata && tcpedit_is_repeatable(tcpedit)) {
+        memcpy(&cached_packet->pkthdr, *pkthdr, sizeof(struct pcap_pkthdr));
+        cached_packet->csum_start = *csum_start;
+        cached_packet->csum_offset = *csum_offset;
+        cached_packet->edited = true;
+    }
+}
 #endif
 
-        /* get the next packet for this file handle depending on which we last used */
-        if (sp == ctx->intf2) {
-            pktdata2 = get_next_packet(ctx, pcap2, &pkthdr2, cache_file_idx2, prev_packet2);
-        } else {
-            pktdata1 = get_next_packet(ctx, pcap1, &pkthdr1, cache_file_idx1, prev_packet1);
-        }
+#if defined TCPREPLAY && defined TCPREPLAY_EDIT && defined ENABLE_FRAGROUTE
+/**
+ * \brief --fragroute: edit and fragment the preloaded packets of a file
+ * once, so every loop sends the fragments straight from the cache
+ *
+ * Each IP packet is run through tcpedit and then the fragroute rules, and
+ * its fragments take its place in the cache, already edited and with its
+ * timestamp.  Other packets are edited and stay where they are, unless
+ * tcpedit had to edit them in a copy, which is then stored instead.
+ */
+static void
+preload_fragroute(tcpreplay_t *ctx, int idx)
+{
+    file_cache_t *file_cache = &ctx->options->file_cache[idx];
+    packet_cache_t *old = file_cache->packet_cache;
+    COUNTER i, old_cnt = file_cache->packet_cnt, fragmented = 0;
+    size_t scratch_size = MAXPACKET;
+    u_char *scratch = safe_malloc(scratch_size);
+
+    assert(file_cache->mmap == NULL);
+
+    file_cache->packet_cache = NULL;
+    file_cache->packet_cnt = 0;
+    file_cache->packet_max = 0;
+
+    for (i = 0; i < old_cnt; i++) {
+        packet_cache_t pkt = old[i];
+        struct pcap_pkthdr *pkthdr = &pkt.pkthdr;
+        u_char *pktdata = pkt.pktdata;
+        struct iovec iov[FRAGROUTE_IOV_MAX];
+        packet_cache_t *frag;
+        int proto, len;
+
+        edit_packet(ctx, idx, &pkt, &pkthdr, &pktdata, TCPR_DIR_C2S, i + 1, &pkt.csum_start, &pkt.csum_offset);
+        proto = tcpedit_l3proto(tcpedit, AFTER_PROCESS, pktdata, (int)pkthdr->caplen);
+
+        if (proto != ETHERTYPE_IP && proto != ETHERTYPE_IP6) {
+            /* shares the packet data where it was edited in place */
+            if (pkt.edited) {
+                *packet_cache_new_entry(file_cache) = pkt;
+                continue;
+            }
 
-        /* stop sending based on the duration limit... */
-        if ((end_us > 0 && (COUNTER)TIMEVAL_TO_MICROSEC(&now) > end_us) ||
-            /* ... or stop sending based on the limit -L? */
-            (limit_send > 0 && stats->pkts_sent >= limit_send)) {
-            ctx->abort = true;
+            frag = packet_cache_append(ctx, file_cache, NULL, pkthdr, pktdata);
+            frag->flow_id = pkt.flow_id;
+            frag->flow_type = pkt.flow_type;
+            frag->csum_start = pkt.csum_start;
+            frag->csum_offset = pkt.csum_offset;
+            frag->edited = true;
+            continue;
         }
-    } /* while */
 
-#ifdef HAVE_NETMAP
-    /* when completing test, wait until the last packet is sent */
-    if (options->netmap && (ctx->abort || options->loop == 1)) {
-        while (ctx->intf1 && !netmap_tx_queues_empty(ctx->intf1)) {
-            gettimeofday(&now, NULL);
-            now_is_now = true;
-        }
+        if (fragroute_process(frag_ctx, pktdata, pkthdr->caplen) < 0)
+            errx(-1, "Error processing packet #" COUNTER_SPEC " via fragroute: %s", i + 1, frag_ctx->errbuf);
 
-        while (ctx->intf2 && !netmap_tx_queues_empty(ctx->intf2)) {
-            gettimeofday(&now, NULL);
-            now_is_now = true;
+        ++fragmented;
+        while ((len = fragroute_getfragment_iov(frag_ctx, iov)) > 0) {
+            struct pcap_pkthdr frag_hdr;
+
+            if ((size_t)len > scratch_size) {
+                scratch_size = (size_t)len;
+                scratch = safe_realloc(scratch, scratch_size);
+            }
+            memcpy(scratch, iov[0].iov_base, iov[0].iov_len);
+            memcpy(scratch + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+
+            /* frags get the same timestamp as the original packet */
+            frag_hdr.ts = pkthdr->ts;
+            frag_hdr.caplen = frag_hdr.len = (bpf_u_int32)len;
+            frag = packet_cache_append(ctx, file_cache, NULL, &frag_hdr, scratch);
+            frag->flow_id = pkt.flow_id;
+            frag->flow_type = pkt.flow_type;
+            frag->edited = true;
         }
     }
-#endif /* HAVE_NETMAP */
 
-    if (!now_is_now)
-        gettimeofday(&now, NULL);
+    dbgx(1, "fragroute turned " COUNTER_SPEC " of " COUNTER_SPEC " packets into " COUNTER_SPEC " in all", fragmented,
+         old_cnt, file_cache->packet_cnt);
+    safe_free(scratch);
+    safe_free(old);
+}
+#endif
 
-    TIMEVAL_SET(&stats->end_time, &now);
+/**
+ * Free the contents of the given file cache
+ */
+void
+file_cache_free(file_cache_t *file_cache)
+{
+    packet_arena_t *arena, *next;
+
+    assert(file_cache);
+
+    arena = file_cache->arena;
+    while (arena != NULL) {
+        next = arena->next;
+        sendpacket_unregister_mem(arena->data, arena->size);
+        tcpr_huge_free(arena->data, arena->size);
+        tcpr_mem_unmap(TCPR_MEM_PRELOAD, arena->size);
+        safe_free(arena);
+        arena = next;
+    }
 
-    increment_iteration(ctx);
+    safe_free(file_cache->packet_cache);
+    safe_free(file_cache->schedule);
+    safe_free(file_cache->pad_ring);
+    file_cache->pad_ring = NULL;
+    file_cache->pad_max = 0;
+    file_cache->pad_next = 0;
+    file_cache->packet_cache = NULL;
+    file_cache->schedule = NULL;
+    file_cache->schedule_period = 0;
+    file_cache->schedule_burst_ns = 0;
+    file_cache->packet_cnt = 0;
+    file_cache->packet_max = 0;
+    file_cache->arena = NULL;
+    file_cache->cached = FALSE;
+    file_cache->spilled = false;
+    file_cache->spill_first = 0;
+    file_cache->spill_from = NULL;
+    file_cache->spill_next = NULL;
+
+#ifdef HAVE_MMAP
+    /* cached packets may point into the mapping, so it goes last */
+    mmap_pcap_close(file_cache->mmap);
+    file_cache->mmap = NULL;
+#endif
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+    cache_image_close(file_cache);
+#ifdef ENABLE_PRELOAD_LZ4
+    preload_lz4_free(file_cache);
+#endif
+#endif
 }
 
 /**
- * Gets the next packet to be sent out. This will either read from the pcap file
- * or will retrieve the packet from the internal cache.
+ * Gets the next packet to be sent out. This will either read from the
+ * file's pkt_source_t or will retrieve the packet from the internal cache.
  *
- * The parameter prev_packet is used as the parent of the new entry in the cache list.
+ * The parameter prev_packet is used as a cursor into the cache array.
  * This should be NULL on the first call to this function for each file and
- * will be updated as new entries are added (or retrieved) from the cache list.
+ * will be updated as new entries are added (or retrieved) from the cache.
  */
 u_char *
-get_next_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int idx, packet_cache_t **prev_packet)
+get_next_packet(tcpreplay_t *ctx, struct pcap_pkthdr *pkthdr, int idx, packet_cache_t **prev_packet)
 {
     tcpreplay_opt_t *options = ctx->options;
+    file_cache_t *file_cache = &options->file_cache[idx];
     u_char *pktdata = NULL;
-    uint32_t pktlen;
 
-    /* pcap may be null in cache mode! */
+    /* file_cache->source may be null in cache mode! */
     /* packet_cache_t may be null in file read mode! */
     assert(pkthdr);
 
@@ -862,58 +3713,96 @@ get_next_packet(tcpreplay_t *ctx, pcap_t *pcap, struct pcap_pkthdr *pkthdr, int
         /*
          * Yes we are caching files - has this one been cached?
          */
-        if (options->file_cache[idx].cached) {
+        if (file_cache->cached) {
+            packet_cache_t *end = file_cache->packet_cache + file_cache->packet_cnt;
+
             if (*prev_packet == NULL) {
                 /*
-                 * Get the first packet in the cache list directly from the file
+                 * Get the first packet in the cache array
                  */
-                *prev_packet = options->file_cache[idx].packet_cache;
-            } else {
+                *prev_packet = file_cache->packet_cache;
+            } else if (*prev_packet < end) {
                 /*
-                 * Get the next packet in the cache list
+                 * Get the next packet in the cache array
                  */
-                *prev_packet = (*prev_packet)->next;
+                ++(*prev_packet);
             }
 
-            if (*prev_packet != NULL) {
+            if (*prev_packet != NULL && *prev_packet < end) {
+                bool tag = options->gen_vlan_add && (*prev_packet)->gen_tag;
+
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT && defined ENABLE_PRELOAD_LZ4
+                if (file_cache->lz4 != NULL)
+                    preload_lz4_fetch(file_cache, (COUNTER)(*prev_packet - file_cache->packet_cache));
+#endif
+                packet_cache_prefetch(*prev_packet, end);
                 pktdata = (*prev_packet)->pktdata;
+                if (file_cache->spilled && *prev_packet >= file_cache->packet_cache + file_cache->spill_first)
+                    cache_memory_readahead(file_cache, pktdata);
                 memcpy(pkthdr, &((*prev_packet)->pkthdr), sizeof(struct pcap_pkthdr));
+                if ((*prev_packet)->pad_caplen != 0) {
+                    pktdata = packet_cache_pad(file_cache, *prev_packet, tag);
+                    pkthdr->caplen = (*prev_packet)->pad_caplen;
+                }
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+                /* templates are stamped in a copy, the cache is left as it is */
+                if (options->gen_field_cnt != 0) {
+                    if ((*prev_packet)->pad_caplen == 0)
+                        pktdata = packet_cache_pad(file_cache, *prev_packet, tag);
+                    if (tag) {
+                        pkthdr->caplen += GEN_VLAN_TAG_LEN;
+                        pkthdr->len += GEN_VLAN_TAG_LEN;
+                    }
+                    gen_stamp(ctx, *prev_packet, pktdata);
+                }
+#endif
             }
         } else {
+            sendpacket_t *zero_copy = NULL;
+
+#ifdef HAVE_NETMAP
+            /* netmap buffers are sent as they are, so can't be padded or stamped */
+            if (options->netmap && options->preload_snaplen == 0 && options->gen_field_cnt == 0)
+                zero_copy = ctx->intf1;
+#endif
+#ifdef HAVE_DPDK
+            /* the NIC sends from the cache as it is, see sendpacket_dpdk_register() */
+            if (ctx->intf1->handle_type == SP_TYPE_DPDK && options->preload_snaplen == 0 &&
+                options->gen_field_cnt == 0 && !options->unique_ip && !options->preload_lz4 && !options->cache_image)
+                zero_copy = ctx->intf1;
+#endif
+#ifdef HAVE_IO_URING
+            /* sent before the next packet is looked at, so edits are fine */
+            if (ctx->intf1->handle_type == SP_TYPE_IO_URING)
+                zero_copy = ctx->intf1;
+#endif
             /*
-             * We should read the pcap file, and cache the results
+             * We should read the pcap file, and cache the results,
+             * only those --preload-filter and --preload-sample keep
              */
-            pktdata = safe_pcap_next(pcap, pkthdr);
+            do {
+                if (options->slice)
+                    pktdata = read_slice_packet(options, file_cache, pkthdr);
+                else
+                    pktdata = read_next_packet(file_cache, pkthdr);
+            } while (pktdata != NULL && !preload_filter_keep(options, file_cache, pkthdr, pktdata));
             if (pktdata != NULL) {
-                if (*prev_packet == NULL) {
-                    /*
-                     * Create the first packet in the list
-                     */
-                    *prev_packet = safe_malloc(sizeof(packet_cache_t));
-                    options->file_cache[idx].packet_cache = *prev_packet;
-                } else {
-                    /*
-                     * Add a packet to the end of the list
-                     */
-                    (*prev_packet)->next = safe_malloc(sizeof(packet_cache_t));
-                    *prev_packet = (*prev_packet)->next;
-                }
-
-                if (*prev_packet != NULL) {
-                    (*prev_packet)->next = NULL;
-                    pktlen = pkthdr->caplen;
-
-                    (*prev_packet)->pktdata = safe_malloc(pktlen + PACKET_HEADROOM);
-                    memcpy((*prev_packet)->pktdata, pktdata, pktlen);
-                    memcpy(&((*prev_packet)->pkthdr), pkthdr, sizeof(struct pcap_pkthdr));
-                }
+                /*
+                 * hand back the cached copy, which has PACKET_HEADROOM
+                 * available for editing (unless memory mapped)
+                 */
+                *prev_packet = packet_cache_append(ctx, file_cache, zero_copy, pkthdr, pktdata);
+                pktdata = (*prev_packet)->pktdata;
             }
         }
     } else {
         /*
          * Read pcap file as normal
          */
-        pktdata = safe_pcap_next(pcap, pkthdr);
+        if (options->slice && !(pkt_source_caps(file_cache) & PKT_SOURCE_BORROWED))
+            pktdata = read_slice_packet(options, file_cache, pkthdr);
+        else
+            pktdata = read_next_packet(file_cache, pkthdr);
     }
 
     /* this gets casted to a const on the way out */
@@ -938,10 +3827,14 @@ cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num)
         return NULL;
     }
 
-    result = check_cache(cachedata, packet_num);
+    result = cache_lookup(cachedata, packet_num);
     if (result == TCPR_DIR_NOSEND) {
         dbgx(2, "Cache: Not sending packet " COUNTER_SPEC ".", packet_num);
         return NULL;
+    } else if (options->cachepairs != NULL && options->cachepairs[packet_num - 1] != 0) {
+        /* pairs after the first, the cache bits pick the side of the pair */
+        sp = ctx->pair_intf[(options->cachepairs[packet_num - 1] - 1) * 2 + result - 1];
+        dbgx(2, "Cache: Sending packet " COUNTER_SPEC " out %s.", packet_num, ((sendpacket_t *)sp)->device);
     } else if (result == TCPR_DIR_C2S) {
         dbgx(2, "Cache: Sending packet " COUNTER_SPEC " out primary interface.", packet_num);
         sp = ctx->intf1;
@@ -956,25 +3849,54 @@ cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num)
     return sp;
 }
 
+/**
+ * \brief --late-policy for a packet of cost units, the pacer being due units
+ *
+ * Returns false if the packet isn't to be sent.
+ */
+static bool
+late_pacer(tcpreplay_t *ctx, COUNTER units, COUNTER cost, u_int64_t sent_ns)
+{
+    tcpreplay_speed_t *speed = &ctx->options->speed;
+    u_int64_t late = tcpr_pacer_behind(&ctx->pacer, units, sent_ns);
+
+    if (late <= speed->late_ns)
+        return true;
+
+    ++ctx->stats.late_pkts;
+    if (speed->late_policy == late_shift) {
+        tcpr_pacer_shift(&ctx->pacer, late);
+        ctx->stats.late_shift_ns += late;
+    } else if (speed->late_policy == late_drop) {
+        /* the time it would have taken is given up with it */
+        tcpr_pacer_shift(&ctx->pacer, (u_int64_t)((double)cost * ctx->pacer.ns_per_unit));
+        ++ctx->stats.late_dropped;
+        ctx->skip_packets = 0;
+        return false;
+    }
+
+    return true;
+}
+
 /**
  * Given the timestamp on the current packet and the last packet sent,
  * calculate the appropriate amount of time to sleep. Sleep time
  * will be in ctx->nap.
+ *
+ * Returns false if --late-policy=drop drops the packet.
  */
-static void
+static bool
 calc_sleep_time(tcpreplay_t *ctx,
-                struct timeval *pkt_ts_delta,
-                struct timeval *time_delta,
+                u_int64_t pkt_ts_delta,
+                u_int64_t time_delta,
                 COUNTER len,
                 sendpacket_t *sp,
                 COUNTER counter,
-                timestamp_t *sent_timestamp,
-                COUNTER start_us,
+                u_int64_t sent_ns,
+                u_int64_t start_ns,
                 COUNTER *skip_length)
 {
     tcpreplay_opt_t *options = ctx->options;
-    struct timeval nap_for;
-    COUNTER now_us;
 
     timesclear(&ctx->nap);
 
@@ -989,7 +3911,7 @@ calc_sleep_time(tcpreplay_t *ctx,
     /* no last packet sent, just leave */
     if (ctx->first_time) {
         ctx->first_time = false;
-        return;
+        return true;
     }
 
     switch (options->speed.mode) {
@@ -998,10 +3920,9 @@ calc_sleep_time(tcpreplay_t *ctx,
          * Replay packets a factor of the time they were originally sent.
          * Make sure the packet is not late.
          */
-        if (timercmp(pkt_ts_delta, time_delta, >)) {
+        if (pkt_ts_delta > time_delta) {
             /* pkt_time_delta has increased, so handle normally */
-            timersub(pkt_ts_delta, time_delta, &nap_for);
-            TIMEVAL_TO_TIMESPEC(&nap_for, &ctx->nap);
+            NANOSEC_TO_TIMESPEC(pkt_ts_delta - time_delta, &ctx->nap);
             dbgx(3, "original packet delta time: " TIMESPEC_FORMAT, ctx->nap.tv_sec, ctx->nap.tv_nsec);
             timesdiv_float(&ctx->nap, options->speed.multiplier);
             dbgx(3, "original packet delta/div: " TIMESPEC_FORMAT, ctx->nap.tv_sec, ctx->nap.tv_nsec);
@@ -1013,31 +3934,26 @@ calc_sleep_time(tcpreplay_t *ctx,
          * Ignore the time supplied by the capture file and send data at
          * a constant 'rate' (bytes per second).
          */
-        now_us = TIMSTAMP_TO_MICROSEC(sent_timestamp);
-        if (now_us) {
-            COUNTER next_tx_us;
-            COUNTER bps = options->speed.speed;
-            COUNTER bits_sent = ((ctx->stats.bytes_sent + len) * 8);
-            COUNTER tx_us = now_us - start_us;
-
-            /*
-             * bits * 1000000 divided by bps = microseconds
-             *
-             * ensure there is no overflow in cases where bits_sent is very high
-             */
-            if (bits_sent > COUNTER_OVERFLOW_RISK && bps > 500000)
-                next_tx_us = (bits_sent * 1000) / bps * 1000;
+        if (sent_ns) {
+            COUNTER bits_sent = tcpreplay_pace_bits(&options->speed, ctx->stats.pkts_sent + 1, ctx->stats.bytes_sent + len);
+            u_int64_t delay;
+
+            /* a token per bit, bps is bits per second */
+            if (ctx->pacer.ns_per_unit == 0.0)
+                tcpr_pacer_init(&ctx->pacer,
+                                1000000000.0 / (double)options->speed.speed,
+                                options->speed.burst * 8,
+                                start_ns);
+            if (options->speed.profile != NULL)
+                rate_profile_pace(options->speed.profile, &ctx->pacer, bits_sent, start_ns, sent_ns);
+            if (!late_pacer(ctx, bits_sent, tcpreplay_pace_bits(&options->speed, 1, len), sent_ns))
+                return false;
+
+            if ((delay = tcpr_pacer_delay(&ctx->pacer, bits_sent, sent_ns)) > 0)
+                NANOSEC_TO_TIMESPEC(delay, &ctx->nap);
             else
-                next_tx_us = (bits_sent * 1000000) / bps;
-
-            if (next_tx_us > tx_us) {
-                NANOSEC_TO_TIMESPEC((next_tx_us - tx_us) * 1000, &ctx->nap);
-            } else if (tx_us > next_tx_us) {
-                tx_us = now_us - start_us;
-                *skip_length = ((tx_us - next_tx_us) * bps) / 8000000;
-            }
+                *skip_length = tcpr_pacer_credit(&ctx->pacer, bits_sent, sent_ns) / 8;
 
-            update_current_timestamp_trace_entry(ctx->stats.bytes_sent + (COUNTER)len, now_us, tx_us, next_tx_us);
         }
 
         dbgx(3, "packet size=" COUNTER_SPEC "\t\tnap=" TIMESPEC_FORMAT, len, ctx->nap.tv_sec, ctx->nap.tv_nsec);
@@ -1048,30 +3964,26 @@ calc_sleep_time(tcpreplay_t *ctx,
          * Ignore the time supplied by the capture file and send data at
          * a constant rate (packets per second).
          */
-        now_us = TIMSTAMP_TO_MICROSEC(sent_timestamp);
-        if (now_us) {
-            COUNTER next_tx_us;
-            COUNTER pph = ctx->options->speed.speed;
+        if (sent_ns) {
             COUNTER pkts_sent = ctx->stats.pkts_sent;
-            COUNTER tx_us = now_us - start_us;
-            /*
-             * packets * 1000000 divided by pps = microseconds
-             * packets per sec (pps) = packets per hour / (60 * 60)
-             *
-             * Adjust for long running tests with high PPS to prevent overflow.
-             * When active, adjusted calculation may add a bit of jitter.
-             */
-            if ((pkts_sent < COUNTER_OVERFLOW_RISK))
-                next_tx_us = (pkts_sent * 1000000) * (60 * 60) / pph;
-            else
-                next_tx_us = ((pkts_sent * 1000000) / pph) * (60 * 60);
-
-            if (next_tx_us > tx_us)
-                NANOSEC_TO_TIMESPEC((next_tx_us - tx_us) * 1000, &ctx->nap);
+            u_int64_t delay;
+
+            /* a token per packet, speed is packets per hour */
+            if (ctx->pacer.ns_per_unit == 0.0)
+                tcpr_pacer_init(&ctx->pacer,
+                                1000000000.0 * (60 * 60) / (double)options->speed.speed,
+                                options->speed.burst,
+                                start_ns);
+            if (options->speed.profile != NULL)
+                rate_profile_pace(options->speed.profile, &ctx->pacer, pkts_sent, start_ns, sent_ns);
+            if (!late_pacer(ctx, pkts_sent, 1, sent_ns))
+                return false;
+
+            if ((delay = tcpr_pacer_delay(&ctx->pacer, pkts_sent, sent_ns)) > 0)
+                NANOSEC_TO_TIMESPEC(delay, &ctx->nap);
             else
                 ctx->skip_packets = options->speed.pps_multi;
 
-            update_current_timestamp_trace_entry(ctx->stats.bytes_sent + (COUNTER)len, now_us, tx_us, next_tx_us);
         }
 
         dbgx(3,
@@ -1088,9 +4000,7 @@ calc_sleep_time(tcpreplay_t *ctx,
         }
 
         /* decrement our send counter */
-        printf("Sending packet " COUNTER_SPEC " out: %s\n",
-               counter,
-               sp == ctx->intf1 ? options->intf1_name : options->intf2_name);
+        printf("Sending packet " COUNTER_SPEC " out: %s\n", counter, sp->device);
         ctx->skip_packets--;
 
         /* leave */
@@ -1102,12 +4012,87 @@ calc_sleep_time(tcpreplay_t *ctx,
     default:
         errx(-1, "Unknown/supported speed mode: %d", options->speed.mode);
     }
+
+    return true;
+}
+
+/**
+ * \brief one nap with the --timer method, cut short by sendpacket_wake()
+ */
+static void
+tcpr_sleep_timer(tcpreplay_t *ctx, sendpacket_t *sp, struct timespec *nap_this_time, u_int64_t *now_ns, bool flush)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    /* --simulate: the clock is moved on rather than slept on */
+    if (tcpr_clock_simulated()) {
+        *now_ns = tcpr_clock_sim_advance(*now_ns + TIMESPEC_TO_NANOSEC(nap_this_time));
+        return;
+    }
+
+    /*
+     * Depending on the accurate method & packet rate computation method
+     * We have multiple methods of sleeping, pick the right one...
+     */
+    switch (options->accurate) {
+#ifdef HAVE_SELECT
+    case accurate_select:
+        select_sleep(sp, nap_this_time, now_ns, flush);
+        break;
+#endif
+
+#if defined HAVE_IOPORT_SLEEP
+    case accurate_ioport:
+        ioport_sleep(sp, nap_this_time, now_ns, flush);
+        break;
+#endif
+
+    case accurate_gtod:
+        gettimeofday_sleep(sp, nap_this_time, now_ns, flush);
+        break;
+
+    case accurate_nanosleep:
+    case accurate_txtime: /* only sleeps to keep from queueing too far ahead */
+        nanosleep_sleep(sp, nap_this_time, now_ns, flush);
+        break;
+
+    case accurate_hybrid:
+        if (sp->sleep_margin_ns == 0)
+            sp->sleep_margin_ns = options->hybrid_margin_ns;
+        hybrid_sleep(sp, nap_this_time, now_ns, flush);
+        break;
+
+#ifdef HAVE_KQUEUE_SLEEP
+    case accurate_kqueue:
+        kqueue_sleep(sp, nap_this_time, now_ns, flush);
+        break;
+#endif
+
+#ifdef HAVE_TIMERFD_WAIT
+    case accurate_timerfd:
+        timerfd_sleep(sp, nap_this_time, now_ns, flush);
+        break;
+#endif
+
+    default:
+        errx(-1, "Unknown timer mode %d", options->accurate);
+    }
 }
 
+/**
+ * \brief sleep for nap_this_time, or --maxsleep if that is shorter
+ *
+ * Ends at once on an abort.  A suspend or pause is waited out right here,
+ * so nothing more goes out, and then the rest of the nap is slept.  How
+ * long it was paused for is left in ctx->sleep_paused_ns, and isn't
+ * counted as sleep.
+ */
 static void
-tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp, struct timespec *nap_this_time, struct timeval *now)
+tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp, struct timespec *nap_this_time, u_int64_t *now_ns)
 {
     tcpreplay_opt_t *options = ctx->options;
+    u_int64_t sleep_start_ns = *now_ns;
+    u_int64_t sleep_until;
     bool flush =
 #ifdef HAVE_NETMAP
             true;
@@ -1115,6 +4100,8 @@ tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp, struct timespec *nap_this_time, s
             false;
 #endif
 
+    ctx->sleep_paused_ns = 0;
+
     /* don't sleep if nap = {0, 0} */
     if (!timesisset(nap_this_time))
         return;
@@ -1136,34 +4123,37 @@ tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp, struct timespec *nap_this_time, s
 #endif
 
     dbgx(2, "Sleeping:                   " TIMESPEC_FORMAT, nap_this_time->tv_sec, nap_this_time->tv_nsec);
+    TCPR_PROBE1(sleep__begin, TIMESPEC_TO_NANOSEC(nap_this_time));
 
-    /*
-     * Depending on the accurate method & packet rate computation method
-     * We have multiple methods of sleeping, pick the right one...
-     */
-    switch (options->accurate) {
-#ifdef HAVE_SELECT
-    case accurate_select:
-        select_sleep(sp, nap_this_time, now, flush);
-        break;
-#endif
+    sleep_until = sleep_start_ns + TIMESPEC_TO_NANOSEC(nap_this_time);
+    for (;;) {
+        struct timespec nap;
 
-#if defined HAVE_IOPORT_SLEEP
-    case accurate_ioport:
-        ioport_sleep(sp, nap_this_time, now, flush);
-        break;
-#endif
+        NANOSEC_TO_TIMESPEC(sleep_until - *now_ns, &nap);
+        tcpr_sleep_timer(ctx, sp, &nap, now_ns, flush);
+        if (!sendpacket_is_woken(sp) || ctx->abort)
+            break;
 
-    case accurate_gtod:
-        gettimeofday_sleep(sp, nap_this_time, now, flush);
-        break;
+        sendpacket_wake_clear(sp);
+        if (ctx->suspend || sp->paused) {
+            u_int64_t paused_ns = send_pause(ctx, sp, NULL);
 
-    case accurate_nanosleep:
-        nanosleep_sleep(sp, nap_this_time, now, flush);
-        break;
+            ctx->sleep_paused_ns += paused_ns;
+            sleep_until += paused_ns;
+            *now_ns = tcpr_clock_ns();
+        }
+        if (*now_ns >= sleep_until)
+            break;
+    }
 
-    default:
-        errx(-1, "Unknown timer mode %d", options->accurate);
+    TCPR_PROBE2(sleep__end, TIMESPEC_TO_NANOSEC(nap_this_time), *now_ns - sleep_start_ns);
+    if (*now_ns > sleep_start_ns + ctx->sleep_paused_ns) {
+        u_int64_t slept_ns = *now_ns - sleep_start_ns - ctx->sleep_paused_ns;
+        u_int64_t nap_ns = TIMESPEC_TO_NANOSEC(nap_this_time);
+
+        sp->sleep_ns += slept_ns;
+        if (options->timing_stats)
+            tcpr_hist_add(&sp->overshoot, slept_ns > nap_ns ? slept_ns - nap_ns : 0);
     }
 }
 
@@ -1173,14 +4163,13 @@ tcpr_sleep(tcpreplay_t *ctx, sendpacket_t *sp, struct timespec *nap_this_time, s
 static uint32_t
 get_user_count(tcpreplay_t *ctx, sendpacket_t *sp, COUNTER counter)
 {
-    tcpreplay_opt_t *options = ctx->options;
     struct pollfd poller[1]; /* use poll to read from the keyboard */
     char input[EBUF_SIZE];
     unsigned long send = 0;
 
     printf("**** Next packet #" COUNTER_SPEC " out %s.  How many packets do you wish to send? ",
            counter,
-           (sp == ctx->intf1 ? options->intf1_name : options->intf2_name));
+           sp->device);
     fflush(NULL);
     poller[0].fd = STDIN_FILENO;
     poller[0].events = POLLIN | POLLPRI | POLLNVAL;
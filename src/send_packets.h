@@ -22,8 +22,93 @@
 
 #include "tcpreplay_api.h"
 #include <pcap.h>
+#include <string.h>
 
-void send_packets(tcpreplay_t *ctx, pcap_t *pcap, int idx);
-void send_dual_packets(tcpreplay_t *ctx, pcap_t *pcap1, int idx1, pcap_t *pcap2, int idx2);
+/* most threads preload_pcap_files() reads pcap files with */
+#define PRELOAD_MAX_THREADS 16
+
+/* a capture for send_merged_packets() and where its packets go */
+typedef struct send_source_s {
+    int idx; /* into options->file_cache, read from its source unless preloaded */
+    sendpacket_t *sp;
+    u_int64_t offset_ns; /* --flow-copies: added to the time of every packet */
+    COUNTER shift;       /* --flow-copies: --unique-ip shift of the addresses, 0 for none */
+    u_int32_t weight;    /* --mix: share of the traffic, 0 to go by the timestamps */
+} send_source_t;
+
+/* bytes of edited --flow-copies packets a batch holds before it is sent early */
+#define FLOW_COPY_SCRATCH (SENDPACKET_BATCH_MAX * 2048 + MAXPACKET)
+
+/**
+ * \brief timestamp of a packet in nanoseconds
+ *
+ * nsec is the file_cache_t flag telling whether tv_usec actually holds
+ * nanoseconds, as it does for files opened with PCAP_TSTAMP_PRECISION_NANO
+ */
+static inline u_int64_t
+pkthdr_ts_ns(const struct pcap_pkthdr *pkthdr, bool nsec)
+{
+    if (nsec)
+        return (u_int64_t)pkthdr->ts.tv_sec * 1000000000 + (u_int64_t)pkthdr->ts.tv_usec;
+
+    return TIMEVAL_TO_NANOSEC(&pkthdr->ts);
+}
+
+/**
+ * \brief prefetch for sending pc[ahead] and later, pc[0] < end
+ *
+ * The packet_cache_t array is read in order, but the packet data of a
+ * big cache is spread over arenas far larger than the cache, so both
+ * would otherwise miss on every packet.
+ */
+static inline void
+packet_cache_prefetch(const packet_cache_t *pc, const packet_cache_t *end)
+{
+    if (end - pc > 2 * PACKET_PREFETCH_AHEAD)
+        __builtin_prefetch(pc + 2 * PACKET_PREFETCH_AHEAD);
+    if (end - pc > PACKET_PREFETCH_AHEAD)
+        __builtin_prefetch(pc[PACKET_PREFETCH_AHEAD].pktdata);
+}
+
+/* one's complement sum, for tcpr_csum_patch() */
+static inline uint32_t
+tcpr_csum_add(uint32_t sum, uint32_t addend)
+{
+    sum += addend;
+    return sum + (sum < addend);
+}
+
+/* RFC 1624 update of the checksum at sum for data that changed by diff */
+static inline void
+tcpr_csum_patch(u_char *sum, uint32_t diff)
+{
+    uint16_t csum;
+    uint32_t s;
+
+    memcpy(&csum, sum, sizeof(csum));
+    s = tcpr_csum_add((uint16_t)~csum, diff);
+    s = (s & 0xffff) + (s >> 16);
+    s = (s & 0xffff) + (s >> 16);
+    csum = (uint16_t)~s;
+    memcpy(sum, &csum, sizeof(csum));
+}
+
+void send_packets(tcpreplay_t *ctx, int idx);
+void send_merged_packets(tcpreplay_t *ctx, const send_source_t *sources, int cnt);
+void send_flow_copies(tcpreplay_t *ctx, int idx);
 void *cache_mode(tcpreplay_t *ctx, char *cachedata, COUNTER packet_num);
 void preload_pcap_file(tcpreplay_t *ctx, int idx);
+void preload_pcap_files(tcpreplay_t *ctx);
+#ifdef HAVE_PTHREAD
+void preload_pcap_defer(tcpreplay_t *ctx, int idx);
+void preload_pcap_finish(tcpreplay_t *ctx, int idx);
+#endif
+COUNTER preload_footprint(tcpreplay_t *ctx, int *unindexed);
+void file_cache_free(file_cache_t *file_cache);
+void count_flow_stats(tcpreplay_stats_t *stats, sendpacket_t *sp, flow_entry_type_t res);
+void increment_iteration(tcpreplay_t *ctx);
+int unique_ip_shift(struct pcap_pkthdr *pkthdr, u_char *pktdata, COUNTER shift, int datalink);
+void slice_open(tcpreplay_t *ctx, int idx);
+#if defined TCPREPLAY && !defined TCPREPLAY_EDIT
+void unique_ip_resume(tcpreplay_t *ctx, int idx);
+#endif
@@ -0,0 +1,709 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Multi-threaded replay of the preloaded packet cache.
+ *
+ * Each file in the cache is split into one shard per worker using a
+ * direction-agnostic hash of the flow 5-tuple, so all packets of a
+ * conversation are sent by the same worker in their original order.
+ * Every worker is pinned to its own CPU and owns its own sendpacket_t,
+ * which lets the kernel map each worker to a separate NIC TX queue (XPS).
+ *
+ * With --mbps/--pps the workers share a single pace budget, so the
+ * configured rate is the aggregate of all workers.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pthread_setaffinity_np() */
+#endif
+
+#include "send_threads.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "send_packets.h"
+#include "sleep.h"
+#include "tcpreplay_api.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef ENABLE_SEND_THREADS
+
+/* packets handed to sendpacket_batch() per call at top speed */
+#define SEND_THREADS_BATCH 32
+
+/**
+ * \brief pin the calling worker to a CPU
+ */
+static void
+send_worker_pin(_U_ send_worker_t *w)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpuset;
+    long cpu;
+
+    /* round robin over --cpu or the NUMA node of the NIC, if known */
+    if (w->ctx->cpu_cnt > 0)
+        cpu = w->ctx->cpus[w->id % w->ctx->cpu_cnt];
+    else if (ncpus > 0)
+        cpu = w->id % ncpus;
+    else
+        return;
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset) != 0)
+        warnx("Unable to pin send thread %d to CPU %ld", w->id, cpu);
+#endif
+}
+
+/**
+ * \brief most packets to send at a time at the current speed
+ */
+static inline int
+send_threads_batch_max(const tcpreplay_opt_t *options)
+{
+    /* keep bursts short when rate limiting */
+    if (options->speed.mode == speed_packetrate)
+        return min(max(options->speed.pps_multi, 1), SEND_THREADS_BATCH);
+    else if (options->speed.mode == speed_mbpsrate && options->speed.speed)
+        return 1;
+
+    return SEND_THREADS_BATCH;
+}
+
+/**
+ * \brief apply tcpreplay_control_speed() and wait while suspended or sp is
+ * paused
+ */
+static void
+send_threads_control(tcpreplay_t *ctx, sendpacket_t *sp)
+{
+    send_threads_t *st = ctx->threads;
+    bool paused = false;
+
+    while ((ctx->suspend || sp->paused) && !ctx->abort) {
+        paused = true;
+        if (sendpacket_nap(sp, 1000000) && !ctx->abort)
+            sendpacket_wake_clear(sp);
+    }
+
+    if (!paused && __atomic_load_n(&ctx->control.gen, __ATOMIC_RELAXED) == ctx->control.seen)
+        return;
+
+    /* the pacer starts over after a pause rather than make up for the time */
+    pthread_mutex_lock(&st->pace_lock);
+    if (!tcpreplay_control_apply(ctx, st->base_pkts + st->pkts_sent, st->base_bytes + st->bytes_sent, tcpr_clock_ns()) &&
+        paused)
+        tcpreplay_pace_restart(ctx, st->base_pkts + st->pkts_sent, st->base_bytes + st->bytes_sent, tcpr_clock_ns());
+    pthread_mutex_unlock(&st->pace_lock);
+}
+
+/**
+ * \brief sleep until the aggregate rate allows sending more packets
+ *
+ * A suspend or pause meanwhile ends the sleep and is waited out in
+ * send_threads_control() before the batch goes.  --trace-ring gets a
+ * record per paced batch, with the packets in it as len.
+ */
+static void
+send_threads_pace(tcpreplay_t *ctx, sendpacket_t *sp, COUNTER pkts, COUNTER bytes, int batch)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    send_threads_t *st = ctx->threads;
+    struct timespec nap;
+    double ns_per_unit;
+    COUNTER units, burst;
+    u_int64_t now_ns, delay, deadline_ns;
+
+    /* all workers draw on the one bucket, a batch at a time */
+    now_ns = tcpr_clock_ns();
+    pthread_mutex_lock(&st->pace_lock);
+    switch (options->speed.mode) {
+    case speed_mbpsrate:
+        if (!options->speed.speed) {
+            pthread_mutex_unlock(&st->pace_lock);
+            return;
+        }
+        ns_per_unit = 1000000000.0 / (double)options->speed.speed;
+        units = tcpreplay_pace_bits(&options->speed, pkts, bytes);
+        burst = options->speed.burst * 8;
+        break;
+    case speed_packetrate:
+        /* speed is in packets per hour */
+        ns_per_unit = 3600.0 * 1000000000.0 / (double)options->speed.speed;
+        units = pkts;
+        burst = options->speed.burst;
+        break;
+    default:
+        pthread_mutex_unlock(&st->pace_lock);
+        return;
+    }
+
+    if (ctx->pacer.ns_per_unit == 0.0)
+        tcpr_pacer_init(&ctx->pacer, ns_per_unit, burst, ctx->stats.start_time_ns);
+    if (options->speed.profile != NULL)
+        rate_profile_pace(options->speed.profile, &ctx->pacer, units, ctx->stats.start_time_ns, now_ns);
+    delay = tcpr_pacer_delay(&ctx->pacer, units, now_ns);
+    pthread_mutex_unlock(&st->pace_lock);
+
+    deadline_ns = now_ns + delay;
+
+    if (delay > 0) {
+        u_int64_t start_ns = now_ns;
+        COUNTER slept_ns;
+
+        NANOSEC_TO_TIMESPEC(delay, &nap);
+        if (options->accurate == accurate_hybrid) {
+            if (sp->sleep_margin_ns == 0)
+                sp->sleep_margin_ns = options->hybrid_margin_ns;
+            hybrid_sleep(sp, &nap, &now_ns, false);
+#ifdef HAVE_KQUEUE_SLEEP
+        } else if (options->accurate == accurate_kqueue) {
+            kqueue_sleep(sp, &nap, &now_ns, false);
+#endif
+#ifdef HAVE_TIMERFD_WAIT
+        } else if (options->accurate == accurate_timerfd) {
+            timerfd_sleep(sp, &nap, &now_ns, false);
+#endif
+        } else {
+            nanosleep_sleep(sp, &nap, &now_ns, false);
+        }
+        slept_ns = now_ns - start_ns;
+        sp->sleep_ns += slept_ns;
+        if (options->timing_stats)
+            tcpr_hist_add(&sp->overshoot, slept_ns > delay ? slept_ns - delay : 0);
+
+        if (sendpacket_is_woken(sp) && !ctx->abort) {
+            sendpacket_wake_clear(sp);
+            send_threads_control(ctx, sp);
+            now_ns = tcpr_clock_ns();
+        }
+    }
+
+    if (sp->trace != NULL)
+        tcpr_trace_add(sp->trace, pkts, deadline_ns, now_ns, 0, 0, (u_int64_t)batch);
+}
+
+/**
+ * \brief worker thread main loop: send every packet in our shard
+ */
+static void *
+send_worker(void *arg)
+{
+    send_worker_t *w = arg;
+    tcpreplay_t *ctx = w->ctx;
+    tcpreplay_opt_t *options = ctx->options;
+    send_threads_t *st = ctx->threads;
+    const packet_cache_t *packet_cache = w->file_cache->packet_cache;
+    sendpacket_pkt_t batch[SEND_THREADS_BATCH];
+    COUNTER limit_send = options->limit_send;
+    COUNTER end_ns = 0;
+    COUNTER i, pkts, bytes;
+    u_int64_t prof_mark = 0;
+    int n, j, sent;
+
+    send_worker_pin(w);
+
+    if (options->limit_time > 0)
+        end_ns = ctx->stats.start_time_ns + SEC_TO_NANOSEC(options->limit_time);
+
+    for (i = 0; i < w->shard->cnt && !ctx->abort; i += n) {
+        if (options->profile)
+            prof_mark = tcpr_prof_ticks();
+        if (tcpreplay_control_pending(ctx, w->sp))
+            send_threads_control(ctx, w->sp);
+
+        n = (int)min(w->shard->cnt - i, (COUNTER)send_threads_batch_max(options));
+
+        /* try not to overshoot --limit */
+        if (limit_send > 0) {
+            COUNTER done = st->base_pkts + st->pkts_sent;
+
+            if (done >= limit_send) {
+                ctx->abort = true;
+                break;
+            }
+            n = (int)min((COUNTER)n, limit_send - done);
+        }
+
+        for (j = 0; j < n; j++) {
+            const packet_cache_t *pc = &packet_cache[w->shard->index[i + j]];
+
+            /* a shard is every cnt'th packet or so, too sparse for the hardware prefetcher */
+            if (i + j + 2 * PACKET_PREFETCH_AHEAD < w->shard->cnt)
+                __builtin_prefetch(&packet_cache[w->shard->index[i + j + 2 * PACKET_PREFETCH_AHEAD]]);
+            if (i + j + PACKET_PREFETCH_AHEAD < w->shard->cnt)
+                __builtin_prefetch(packet_cache[w->shard->index[i + j + PACKET_PREFETCH_AHEAD]].pktdata);
+
+            batch[j].data = pc->pktdata;
+            batch[j].len = options->use_pkthdr_len ? pc->pkthdr.len : pc->pkthdr.caplen;
+            batch[j].pkthdr = (struct pcap_pkthdr *)&pc->pkthdr;
+            batch[j].csum_start = 0;
+            batch[j].csum_offset = 0;
+            batch[j].gso_size = 0;
+        }
+        if (options->profile)
+            tcpr_prof_lap(&w->sp->profile, TCPR_PROF_READ, &prof_mark);
+
+        if (options->flow_stats) {
+            for (j = 0; j < n; j++)
+                count_flow_stats(NULL, w->sp, (flow_entry_type_t)packet_cache[w->shard->index[i + j]].flow_type);
+            if (options->profile)
+                tcpr_prof_lap(&w->sp->profile, TCPR_PROF_FLOW, &prof_mark);
+        }
+
+        bytes = w->sp->bytes_sent;
+        sent = sendpacket_batch(w->sp, batch, n);
+        if (sent < n)
+            warnx("Unable to send %d of %d packets: %s", n - sent, n, sendpacket_geterr(w->sp));
+        if (options->profile) {
+            tcpr_prof_lap(&w->sp->profile, TCPR_PROF_SEND, &prof_mark);
+            w->sp->profile.packets += (COUNTER)n;
+        }
+
+        pkts = __sync_add_and_fetch(&st->pkts_sent, (COUNTER)sent);
+        bytes = __sync_add_and_fetch(&st->bytes_sent, w->sp->bytes_sent - bytes);
+
+        if (end_ns > 0 && tcpr_clock_ns() > end_ns)
+            ctx->abort = true;
+
+        send_threads_pace(ctx, w->sp, st->base_pkts + pkts, st->base_bytes + bytes, n);
+        if (options->profile)
+            tcpr_prof_lap(&w->sp->profile, TCPR_PROF_PACE, &prof_mark);
+    }
+
+    __sync_sub_and_fetch(&st->running, 1);
+    return NULL;
+}
+
+/**
+ * \brief split a cached file into one shard per worker
+ */
+static send_shard_t *
+send_threads_shard(tcpreplay_t *ctx, int idx)
+{
+    send_threads_t *st = ctx->threads;
+    const file_cache_t *file_cache = &ctx->options->file_cache[idx];
+    send_shard_t *shards;
+    u_char *owner;
+    uint32_t hash;
+    COUNTER i;
+    int w;
+
+    shards = safe_malloc(sizeof(send_shard_t) * st->cnt);
+    owner = safe_malloc(file_cache->packet_cnt > 0 ? file_cache->packet_cnt : 1);
+
+    /* non-IP packets all go to the first worker to keep their order */
+    for (i = 0; i < file_cache->packet_cnt; i++) {
+        const packet_cache_t *pc = &file_cache->packet_cache[i];
+
+        if (flow_hash(&pc->pkthdr, pc->pktdata, file_cache->dlt, &hash))
+            owner[i] = (u_char)(hash % st->cnt);
+        else
+            owner[i] = 0;
+
+        shards[owner[i]].cnt++;
+    }
+
+    for (w = 0; w < st->cnt; w++) {
+        shards[w].index = safe_malloc(sizeof(COUNTER) * (shards[w].cnt > 0 ? shards[w].cnt : 1));
+        dbgx(1, "send thread %d: " COUNTER_SPEC " packets from %s", w, shards[w].cnt,
+             ctx->options->sources[idx].filename);
+        shards[w].cnt = 0;
+    }
+
+    for (i = 0; i < file_cache->packet_cnt; i++) {
+        send_shard_t *shard = &shards[owner[i]];
+        shard->index[shard->cnt++] = i;
+    }
+
+    safe_free(owner);
+    return shards;
+}
+
+/**
+ * \brief move the counters of a worker's sendpacket_t into ctx->intf1
+ */
+static void
+send_threads_fold_stats(sendpacket_t *to, sendpacket_t *from)
+{
+    to->sent += from->sent;
+    to->bytes_sent += from->bytes_sent;
+    to->failed += from->failed;
+    to->trunc_packets += from->trunc_packets;
+    to->retry_enobufs += from->retry_enobufs;
+    to->retry_eagain += from->retry_eagain;
+    to->attempt += from->attempt;
+    to->sleep_ns += from->sleep_ns;
+    to->backpressure_ns += from->backpressure_ns;
+    to->flows += from->flows;
+    to->flows_unique += from->flows_unique;
+    to->flows_expired += from->flows_expired;
+    to->flow_packets += from->flow_packets;
+    to->flow_non_flow_packets += from->flow_non_flow_packets;
+    to->flows_invalid_packets += from->flows_invalid_packets;
+    tcpr_hist_merge(&to->late, &from->late);
+    tcpr_hist_merge(&to->gap, &from->gap);
+    tcpr_hist_merge(&to->overshoot, &from->overshoot);
+    tcpr_hist_merge(&to->batch, &from->batch);
+    tcpr_prof_merge(&to->profile, &from->profile);
+    if (to->digest != NULL && from->digest != NULL)
+        tcpr_digest_merge(to->digest, from->digest);
+
+    from->sent = 0;
+    from->bytes_sent = 0;
+    from->failed = 0;
+    from->trunc_packets = 0;
+    from->retry_enobufs = 0;
+    from->retry_eagain = 0;
+    from->attempt = 0;
+    from->sleep_ns = 0;
+    from->backpressure_ns = 0;
+    from->flows = 0;
+    from->flows_unique = 0;
+    from->flows_expired = 0;
+    from->flow_packets = 0;
+    from->flow_non_flow_packets = 0;
+    from->flows_invalid_packets = 0;
+    memset(&from->late, 0, sizeof(from->late));
+    memset(&from->gap, 0, sizeof(from->gap));
+    memset(&from->overshoot, 0, sizeof(from->overshoot));
+    memset(&from->batch, 0, sizeof(from->batch));
+    memset(&from->profile, 0, sizeof(from->profile));
+}
+
+/**
+ * \brief open a sendpacket_t for each additional worker
+ *
+ * Returns 0 on success, -1 on error
+ */
+int
+send_threads_init(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    send_threads_t *st;
+    char ebuf[SENDPACKET_ERRBUF_SIZE];
+    int i;
+
+    assert(ctx);
+    assert(options->threads > 1 && options->threads <= MAX_SEND_THREADS);
+
+    if (ctx->threads != NULL)
+        return 0;
+
+    st = safe_malloc(sizeof(send_threads_t));
+    st->cnt = options->threads;
+    pthread_mutex_init(&st->pace_lock, NULL);
+    /* the stats exporter walks the workers while we fill them in */
+    __atomic_store_n(&ctx->threads, st, __ATOMIC_RELEASE);
+
+    for (i = 0; i < st->cnt; i++) {
+        sendpacket_t *sp;
+
+        st->workers[i].ctx = ctx;
+        st->workers[i].id = i;
+
+        if (i == 0) {
+            __atomic_store_n(&st->workers[i].sp, ctx->intf1, __ATOMIC_RELEASE);
+            continue;
+        }
+
+#ifdef HAVE_AF_XDP
+        /* AF_XDP sockets are per queue, so give each worker its own */
+        if (ctx->sp_type == SP_TYPE_AF_XDP) {
+            sp = sendpacket_open_xdp_queue(options->intf1_name, ebuf, options->xdp_queue + i);
+            if (sp == NULL) {
+                tcpreplay_seterr(ctx, "Can't open %s for send thread %d: %s", options->intf1_name, i, ebuf);
+                return -1;
+            }
+            sp->open = 1;
+            sp->cache_dir = TCPR_DIR_C2S;
+            __atomic_store_n(&st->workers[i].sp, sp, __ATOMIC_RELEASE);
+            continue;
+        }
+#endif
+
+#ifdef HAVE_NETMAP
+        /* one TX ring per worker, counting up from the ring intf1 is on */
+        if (ctx->sp_type == SP_TYPE_NETMAP) {
+            sp = sendpacket_open_netmap_ring(ctx->intf1, i, ebuf, ctx);
+            if (sp == NULL) {
+                tcpreplay_seterr(ctx, "Can't open %s for send thread %d: %s", options->intf1_name, i, ebuf);
+                return -1;
+            }
+            sp->open = 1;
+            sp->cache_dir = TCPR_DIR_C2S;
+            __atomic_store_n(&st->workers[i].sp, sp, __ATOMIC_RELEASE);
+            continue;
+        }
+#endif
+
+#ifdef HAVE_DPDK
+        /* the port was set up with a TX queue per worker */
+        if (ctx->intf1->handle_type == SP_TYPE_DPDK) {
+            sp = sendpacket_open_dpdk_queue(ctx->intf1, ebuf, i);
+            if (sp == NULL) {
+                tcpreplay_seterr(ctx, "Can't open %s for send thread %d: %s", options->intf1_name, i, ebuf);
+                return -1;
+            }
+            sp->open = 1;
+            sp->cache_dir = TCPR_DIR_C2S;
+            __atomic_store_n(&st->workers[i].sp, sp, __ATOMIC_RELEASE);
+            continue;
+        }
+#endif
+
+#if defined HAVE_TUNTAP && defined HAVE_LINUX
+        /* a queue of the multiqueue tap per worker */
+        if (ctx->intf1->handle_type == SP_TYPE_TUNTAP) {
+            sp = sendpacket_open_tuntap_queue(ctx->intf1, ebuf);
+            if (sp == NULL) {
+                tcpreplay_seterr(ctx, "Can't open %s for send thread %d: %s", options->intf1_name, i, ebuf);
+                return -1;
+            }
+            sp->open = 1;
+            sp->cache_dir = TCPR_DIR_C2S;
+            __atomic_store_n(&st->workers[i].sp, sp, __ATOMIC_RELEASE);
+            continue;
+        }
+#endif
+
+        if ((sp = sendpacket_open(options->intf1_name, ebuf, TCPR_DIR_C2S, ctx->sp_type, ctx)) == NULL) {
+            tcpreplay_seterr(ctx, "Can't open %s for send thread %d: %s", options->intf1_name, i, ebuf);
+            return -1;
+        }
+        __atomic_store_n(&st->workers[i].sp, sp, __ATOMIC_RELEASE);
+    }
+
+    /* --trace-ring: every worker records into its own */
+    if (options->trace_file != NULL) {
+        for (i = 1; i < st->cnt; i++)
+            st->workers[i].sp->trace = tcpr_trace_new(options->trace_size);
+    }
+
+    if (options->digest) {
+        for (i = 1; i < st->cnt; i++)
+            st->workers[i].sp->digest = tcpreplay_digest_new(ctx, ctx->intf1dlt);
+    }
+
+    return 0;
+}
+
+/**
+ * \brief send a cached file using all workers
+ *
+ * Blocks until every worker has sent its shard (or we abort)
+ */
+void
+send_threads_packets(tcpreplay_t *ctx, int idx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    tcpreplay_stats_t *stats = &ctx->stats;
+    send_threads_t *st;
+    u_int64_t now_ns;
+    int i, started = 0;
+
+    assert(ctx);
+    assert(options->file_cache[idx].cached);
+
+    if (send_threads_init(ctx) < 0)
+        errx(-1, "%s", tcpreplay_geterr(ctx));
+
+    st = ctx->threads;
+
+    if (stats->start_time_ns == 0) {
+        stats->start_time_ns = tcpr_clock_ns();
+        if (options->stats >= 0) {
+            char buf[64];
+            struct timeval start;
+
+            tcpr_clock_to_timeval(stats->start_time_ns, &start);
+            if (format_date_time(&start, buf, sizeof(buf)) > 0)
+                printf("Test start: %s ...\n", buf);
+        }
+    }
+
+    if (st->shards[idx] == NULL)
+        st->shards[idx] = send_threads_shard(ctx, idx);
+
+    st->pkts_sent = 0;
+    st->bytes_sent = 0;
+    st->base_pkts = stats->pkts_sent;
+    st->base_bytes = stats->bytes_sent;
+    st->running = st->cnt;
+
+    for (i = 0; i < st->cnt; i++) {
+        send_worker_t *w = &st->workers[i];
+
+        w->file_cache = &options->file_cache[idx];
+        w->shard = &st->shards[idx][i];
+        if (pthread_create(&w->thread, NULL, send_worker, w) != 0) {
+            warnx("Unable to start send thread %d: %s", i, strerror(errno));
+            __sync_sub_and_fetch(&st->running, 1);
+            ctx->abort = true;
+            break;
+        }
+        started++;
+    }
+
+    /* print stats during the run? */
+    while (st->running > 0) {
+        usleep(10000);
+        if (options->stats > 0) {
+            now_ns = tcpr_clock_ns();
+            if (stats->last_print_ns == 0) {
+                stats->last_print_ns = now_ns;
+            } else if (now_ns - stats->last_print_ns >= SEC_TO_NANOSEC(options->stats)) {
+                tcpreplay_stats_t snapshot = *stats;
+
+                snapshot.pkts_sent += st->pkts_sent;
+                snapshot.bytes_sent += st->bytes_sent;
+                snapshot.end_time_ns = now_ns;
+                packet_stats(&snapshot);
+                stats->last_print_ns = now_ns;
+            }
+        }
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(st->workers[i].thread, NULL);
+
+    stats->pkts_sent += st->pkts_sent;
+    stats->bytes_sent += st->bytes_sent;
+
+    stats->end_time_ns = tcpr_clock_ns();
+
+    increment_iteration(ctx);
+}
+
+/**
+ * \brief add the counters of all workers to ctx->intf1
+ *
+ * Workers keep their own counters during the replay so they can be
+ * exported per thread; this is done once at the end, before they're
+ * printed.
+ */
+void
+send_threads_fold(tcpreplay_t *ctx)
+{
+    send_threads_t *st = ctx->threads;
+    int i;
+
+    if (st == NULL)
+        return;
+
+    for (i = 1; i < st->cnt; i++) {
+        if (st->workers[i].sp != NULL)
+            send_threads_fold_stats(ctx->intf1, st->workers[i].sp);
+    }
+}
+
+/**
+ * \brief tell every worker's sendpacket_t to abort
+ */
+void
+send_threads_abort(tcpreplay_t *ctx)
+{
+    send_threads_t *st = ctx->threads;
+    int i;
+
+    if (st == NULL)
+        return;
+
+    for (i = 1; i < st->cnt; i++) {
+        if (st->workers[i].sp != NULL)
+            sendpacket_abort(st->workers[i].sp);
+    }
+}
+
+/**
+ * \brief end the sleeps of every worker's sendpacket_t, see sendpacket_wake()
+ */
+void
+send_threads_wake(tcpreplay_t *ctx)
+{
+    send_threads_t *st = __atomic_load_n(&ctx->threads, __ATOMIC_ACQUIRE);
+    int i;
+
+    if (st == NULL)
+        return;
+
+    for (i = 1; i < st->cnt; i++) {
+        sendpacket_t *sp = __atomic_load_n(&st->workers[i].sp, __ATOMIC_ACQUIRE);
+
+        if (sp != NULL)
+            sendpacket_wake(sp);
+    }
+}
+
+/**
+ * \brief free the shards of the sources from first on
+ *
+ * For when the sources move, see playlist_apply().  They are made again
+ * when next sent
+ */
+void
+send_threads_forget(tcpreplay_t *ctx, int first)
+{
+    send_threads_t *st = ctx->threads;
+    int i, w;
+
+    if (st == NULL)
+        return;
+
+    for (i = first; i < MAX_FILES; i++) {
+        if (st->shards[i] == NULL)
+            continue;
+
+        for (w = 0; w < st->cnt; w++)
+            safe_free(st->shards[i][w].index);
+        safe_free(st->shards[i]);
+        st->shards[i] = NULL;
+    }
+}
+
+/**
+ * \brief close the worker interfaces and free the shards
+ */
+void
+send_threads_close(tcpreplay_t *ctx)
+{
+    send_threads_t *st = ctx->threads;
+    int i;
+
+    if (st == NULL)
+        return;
+
+    for (i = 1; i < st->cnt; i++) {
+        if (st->workers[i].sp != NULL)
+            sendpacket_close(st->workers[i].sp);
+    }
+
+    send_threads_forget(ctx, 0);
+
+    pthread_mutex_destroy(&st->pace_lock);
+    safe_free(st);
+    ctx->threads = NULL;
+}
+
+#endif /* ENABLE_SEND_THREADS */
@@ -0,0 +1,74 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+/*
+ * multi-threaded replay of the preloaded packet cache is only available
+ * to tcpreplay (not tcpreplay-edit) and requires POSIX threads
+ */
+#if defined HAVE_PTHREAD && defined TCPREPLAY && !defined TCPREPLAY_EDIT
+#define ENABLE_SEND_THREADS 1
+#endif
+
+#define MAX_SEND_THREADS 64
+
+#ifdef ENABLE_SEND_THREADS
+#include <pthread.h>
+
+/* the packets of one file assigned to one worker */
+typedef struct send_shard_s {
+    COUNTER *index; /* indexes into file_cache->packet_cache, in file order */
+    COUNTER cnt;
+} send_shard_t;
+
+typedef struct send_worker_s {
+    tcpreplay_t *ctx;
+    int id;
+    pthread_t thread;
+    sendpacket_t *sp; /* worker 0 uses ctx->intf1 */
+    const file_cache_t *file_cache;
+    const send_shard_t *shard;
+} send_worker_t;
+
+struct send_threads_s {
+    int cnt;
+    send_worker_t workers[MAX_SEND_THREADS];
+    send_shard_t *shards[MAX_FILES]; /* per file, array of cnt shards */
+
+    /* shared by all workers for the current file; also the pace budget */
+    volatile COUNTER pkts_sent;
+    volatile COUNTER bytes_sent;
+    volatile int running;
+    pthread_mutex_t pace_lock; /* guards ctx->pacer */
+
+    /* totals prior to the current file */
+    COUNTER base_pkts;
+    COUNTER base_bytes;
+};
+
+int send_threads_init(tcpreplay_t *ctx);
+void send_threads_packets(tcpreplay_t *ctx, int idx);
+void send_threads_fold(tcpreplay_t *ctx);
+void send_threads_abort(tcpreplay_t *ctx);
+void send_threads_wake(tcpreplay_t *ctx);
+void send_threads_forget(tcpreplay_t *ctx, int first);
+void send_threads_close(tcpreplay_t *ctx);
+#endif /* ENABLE_SEND_THREADS */
@@ -24,10 +24,12 @@
 #include "common.h"
 #include "tcpreplay_api.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -130,3 +132,72 @@ abort_handler(int signo)
         tcpreplay_abort(ctx);
     }
 }
+
+/**
+ * \brief tell whoever runs us we're ready and wait for SIGUSR2
+ *
+ * Writes our PID to ready_file, if given, by renaming a temporary file so
+ * it's never seen half written.  With wait_start, blocks until SIGUSR2, or
+ * SIGINT which exits.  The signals are blocked before the file appears, so
+ * one sent as soon as it's seen isn't missed.  Returns -1 if the file
+ * couldn't be written.
+ */
+int
+signal_ready(const char *ready_file, bool wait_start)
+{
+    sigset_t set, old;
+    int signo = 0;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGINT);
+    if (wait_start)
+        sigprocmask(SIG_BLOCK, &set, &old);
+
+    if (ready_file != NULL) {
+        size_t len = strlen(ready_file) + sizeof(".XXXXXX");
+        char *tmp = safe_malloc(len);
+        FILE *f = NULL;
+        int fd;
+
+        snprintf(tmp, len, "%s.XXXXXX", ready_file);
+        if ((fd = mkstemp(tmp)) < 0 || (f = fdopen(fd, "w")) == NULL) {
+            warnx("Unable to create %s: %s", tmp, strerror(errno));
+            if (fd >= 0) {
+                close(fd);
+                unlink(tmp);
+            }
+            safe_free(tmp);
+            goto fail;
+        }
+        fchmod(fd, 0644);
+        fprintf(f, "%d\n", (int)getpid());
+        if (fclose(f) != 0 || rename(tmp, ready_file) < 0) {
+            warnx("Unable to write %s: %s", ready_file, strerror(errno));
+            unlink(tmp);
+            safe_free(tmp);
+            goto fail;
+        }
+        safe_free(tmp);
+    }
+
+    if (!wait_start)
+        return 0;
+
+    notice("Ready, waiting for SIGUSR2 to start...");
+    while (sigwait(&set, &signo) != 0 || (signo != SIGUSR2 && signo != SIGINT))
+        ;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (signo == SIGINT) {
+        notice(" User interrupt...");
+        exit(0);
+    }
+
+    return 0;
+
+fail:
+    if (wait_start)
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    return -1;
+}
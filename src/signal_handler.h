@@ -20,5 +20,8 @@
 
 #pragma once
 
+#include <stdbool.h>
+
 void init_signal_handlers();
 void reset_suspend_time();
+int signal_ready(const char *ready_file, bool wait_start);
@@ -19,6 +19,7 @@
 #include "sleep.h"
 #include "config.h"
 #include "common.h"
+#include <inttypes.h>
 #include <string.h>
 #include <sys/time.h>
 
@@ -49,7 +50,7 @@ ioport_sleep_init(void)
 }
 
 void
-ioport_sleep(sendpacket_t *sp _U_, const struct timespec *nap _U_, struct timeval *now _U_, bool flush _U_)
+ioport_sleep(sendpacket_t *sp _U_, const struct timespec *nap _U_, u_int64_t *now_ns _U_, bool flush _U_)
 {
 #if defined HAVE_IOPORT_SLEEP__
     struct timeval nap_for;
@@ -77,7 +78,36 @@ ioport_sleep(sendpacket_t *sp _U_, const struct timespec *nap _U_, struct timeva
         usec--;
         outb(ioport_sleep_value, 0x80);
     }
+
+    *now_ns = tcpr_clock_ns();
 #else
     err(-1, "Platform does not support IO Port for timing");
 #endif
 }
+
+/**
+ * \brief measure how late nanosleep() wakes up on this host
+ *
+ * Returns the worst overshoot of a few short naps, which hybrid_sleep()
+ * starts from as its margin.
+ */
+u_int64_t
+hybrid_sleep_calibrate(void)
+{
+    const struct timespec nap = {0, 50000};
+    u_int64_t worst = 0;
+    int i;
+
+    for (i = 0; i < HYBRID_CALIBRATE_NAPS; i++) {
+        u_int64_t start = tcpr_clock_ns();
+        u_int64_t slept;
+
+        nanosleep(&nap, NULL);
+        slept = tcpr_clock_ns() - start;
+        if (slept > TIMESPEC_TO_NANOSEC(&nap) && slept - TIMESPEC_TO_NANOSEC(&nap) > worst)
+            worst = slept - TIMESPEC_TO_NANOSEC(&nap);
+    }
+
+    dbgx(1, "nanosleep() overshoots by up to %" PRIu64 " ns", worst);
+    return min(max(worst, (u_int64_t)HYBRID_MIN_MARGIN_NS), (u_int64_t)HYBRID_MAX_MARGIN_NS);
+}
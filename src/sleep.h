@@ -33,7 +33,7 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
-#ifdef HAVE_SYS_EVENT
+#ifdef HAVE_SYS_EVENT_H
 #include <sys/event.h>
 #endif
 
@@ -50,55 +50,61 @@
 #include <sys/ioctl.h>
 #endif /* HAVE_NETMAP */
 
+/* --timer=kqueue wants nanosecond EVFILT_TIMERs, FreeBSD 11+ and macOS */
+#if defined HAVE_KQUEUE && defined HAVE_SYS_EVENT_H && defined EVFILT_TIMER && defined NOTE_NSECONDS
+#define HAVE_KQUEUE_SLEEP 1
+#endif
+
+/*
+ * Every sleep ends early on sendpacket_wake(), for an abort, suspend or
+ * pause.  Those which sleep in the kernel wait on the fd from
+ * sendpacket_wake_fd(), those which spin look at sendpacket_is_woken().
+ */
+
 static inline void
-nanosleep_sleep(sendpacket_t *sp _U_, const struct timespec *nap, struct timeval *now, bool flush _U_)
+nanosleep_sleep(sendpacket_t *sp, const struct timespec *nap, u_int64_t *now_ns, bool flush _U_)
 {
-    nanosleep(nap, NULL);
+    sendpacket_nap(sp, TIMESPEC_TO_NANOSEC(nap));
 #ifdef HAVE_NETMAP
     if (flush)
         ioctl(sp->handle.fd, NIOCTXSYNC, NULL); /* flush TX buffer */
 #endif                                          /* HAVE_NETMAP */
 
-    gettimeofday(now, NULL);
+    *now_ns = tcpr_clock_ns();
 }
 
 /*
- * Straight forward... keep calling gettimeofday() until the appropriate amount
+ * Straight forward... keep reading the clock until the appropriate amount
  * of time has passed.  Pretty damn accurate.
  *
- * Note: make sure "now" has recently been updated.
+ * Note: make sure "now_ns" has recently been updated.
  */
 static inline void
-gettimeofday_sleep(sendpacket_t *sp _U_, struct timespec *nap, struct timeval *now, bool flush _U_)
+gettimeofday_sleep(sendpacket_t *sp _U_, struct timespec *nap, u_int64_t *now_ns, bool flush _U_)
 {
-    struct timeval sleep_until, nap_for;
+    u_int64_t sleep_until;
 #ifdef HAVE_NETMAP
-    struct timeval last;
-    uint32_t i = 0;
-
-    TIMEVAL_SET(&last, now);
+    u_int64_t last_flush = *now_ns;
 #endif /* HAVE_NETMAP */
 
-    TIMESPEC_TO_TIMEVAL(&nap_for, nap);
-    timeradd(now, &nap_for, &sleep_until);
+    sleep_until = *now_ns + TIMESPEC_TO_NANOSEC(nap);
 
-    while (!sp->abort) {
+    while (!sendpacket_is_woken(sp)) {
 #ifdef HAVE_NETMAP
-        if (flush && timercmp(now, &last, !=)) {
-            TIMEVAL_SET(&last, now);
-            if ((++i & 0xf) == 0)
-                /* flush TX buffer every 16 usec */
-                ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+        if (flush && *now_ns - last_flush >= 16000) {
+            /* flush TX buffer every 16 usec */
+            last_flush = *now_ns;
+            ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
         }
 #endif /* HAVE_NETMAP */
-        if (timercmp(now, &sleep_until, >=))
+        if (*now_ns >= sleep_until)
             break;
 
 #ifdef HAVE_SCHED_H
         /* yield the CPU so other apps remain responsive */
         sched_yield();
 #endif
-        gettimeofday(now, NULL);
+        *now_ns = tcpr_clock_ns();
     }
 }
 
@@ -110,9 +116,11 @@ gettimeofday_sleep(sendpacket_t *sp _U_, struct timespec *nap, struct timeval *n
  * for future reference
  */
 static inline void
-select_sleep(sendpacket_t *sp _U_, const struct timespec *nap, struct timeval *now, bool flush _U_)
+select_sleep(sendpacket_t *sp, const struct timespec *nap, u_int64_t *now_ns, bool flush _U_)
 {
     struct timeval timeout;
+    fd_set rfds;
+    int fd, n;
 #ifdef HAVE_NETMAP
     if (flush)
         ioctl(sp->handle.fd, NIOCTXSYNC, NULL); /* flush TX buffer */
@@ -120,18 +128,151 @@ select_sleep(sendpacket_t *sp _U_, const struct timespec *nap, struct timeval *n
 
     TIMESPEC_TO_TIMEVAL(&timeout, nap);
 
-    if (select(0, NULL, NULL, NULL, &timeout) < 0)
-        warnx("select_sleep() returned early due to error: %s", strerror(errno));
+    FD_ZERO(&rfds);
+    fd = sendpacket_wake_fd(sp);
+    if (fd >= 0 && fd < FD_SETSIZE)
+        FD_SET(fd, &rfds);
+    else
+        fd = -1;
+
+    if (!sendpacket_is_woken(sp)) {
+        if ((n = select(fd + 1, &rfds, NULL, NULL, &timeout)) < 0 && errno != EINTR)
+            warnx("select_sleep() returned early due to error: %s", strerror(errno));
+        else if (n > 0)
+            sendpacket_wake_drain(sp);
+    }
 
 #ifdef HAVE_NETMAP
     if (flush)
         ioctl(sp->handle.fd, NIOCTXSYNC, NULL); /* flush TX buffer */
 #endif
 
-    gettimeofday(now, NULL);
+    *now_ns = tcpr_clock_ns();
 }
 #endif /* HAVE_SELECT */
 
+#ifdef HAVE_KQUEUE_SLEEP
+/*
+ * kqueue_sleep() arms a one shot EVFILT_TIMER for the end of the nap and
+ * waits for it in the same kevent() call.  Where the kernel takes absolute timers the deadline is given on
+ * the realtime clock, so the time spent getting here doesn't add to the
+ * nap.  The timer never fires late on purpose, but may fire a little
+ * early, which the clock loop at the end makes up for.  The wake up fd
+ * is watched in the same kevent() call.
+ */
+#if defined NOTE_ABSTIME /* FreeBSD */
+#define KQUEUE_SLEEP_ABS NOTE_ABSTIME
+#elif defined NOTE_ABSOLUTE /* macOS */
+#define KQUEUE_SLEEP_ABS NOTE_ABSOLUTE
+#endif
+
+#ifdef NOTE_CRITICAL /* macOS: don't coalesce with other timers */
+#define KQUEUE_SLEEP_FLAGS (NOTE_NSECONDS | NOTE_CRITICAL)
+#else
+#define KQUEUE_SLEEP_FLAGS NOTE_NSECONDS
+#endif
+
+static inline void
+kqueue_sleep(sendpacket_t *sp, const struct timespec *nap, u_int64_t *now_ns, bool flush _U_)
+{
+    u_int64_t sleep_until = *now_ns + TIMESPEC_TO_NANOSEC(nap);
+    struct kevent kev[2];
+    int64_t when;
+    int fflags = KQUEUE_SLEEP_FLAGS;
+    int nchanges = 0, wake_fd, n;
+
+    if (sp->kq == 0 && (sp->kq = kqueue()) < 0)
+        warnx("Unable to create kqueue, falling back to nanosleep(): %s", strerror(errno));
+    if (sp->kq < 0) {
+        nanosleep_sleep(sp, nap, now_ns, flush);
+        return;
+    }
+
+#ifdef HAVE_NETMAP
+    if (flush)
+        ioctl(sp->handle.fd, NIOCTXSYNC, NULL); /* flush TX buffer */
+#endif
+
+    *now_ns = tcpr_clock_ns();
+    if (*now_ns >= sleep_until || sendpacket_is_woken(sp))
+        return;
+
+#ifdef KQUEUE_SLEEP_ABS
+    {
+        struct timespec real;
+
+        clock_gettime(CLOCK_REALTIME, &real);
+        when = (int64_t)(TIMESPEC_TO_NANOSEC(&real) + (sleep_until - *now_ns));
+        fflags |= KQUEUE_SLEEP_ABS;
+    }
+#else
+    when = (int64_t)(sleep_until - *now_ns);
+#endif
+
+    /* adding the wake up fd again each time is harmless */
+    if ((wake_fd = sendpacket_wake_fd(sp)) >= 0)
+        EV_SET(&kev[nchanges++], wake_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    EV_SET(&kev[nchanges++], 1, EVFILT_TIMER, EV_ADD | EV_ONESHOT, fflags, when, NULL);
+    if ((n = kevent(sp->kq, kev, nchanges, kev, 1, NULL)) < 0) {
+        *now_ns = tcpr_clock_ns();
+        if (errno == EINTR)
+            return;
+
+        warnx("kqueue timer failed, falling back to nanosleep(): %s", strerror(errno));
+        close(sp->kq);
+        sp->kq = -1;
+        return;
+    }
+
+    if (n > 0 && kev[0].filter == EVFILT_READ) {
+        /* woken, the timer mustn't end the next nap */
+        sendpacket_wake_drain(sp);
+        EV_SET(&kev[0], 1, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+        kevent(sp->kq, kev, 1, NULL, 0, NULL);
+        *now_ns = tcpr_clock_ns();
+        return;
+    }
+
+    *now_ns = tcpr_clock_ns();
+    while (*now_ns < sleep_until && !sendpacket_is_woken(sp))
+        *now_ns = tcpr_clock_ns();
+}
+#endif /* HAVE_KQUEUE_SLEEP */
+
+#ifdef HAVE_TIMERFD_WAIT
+/*
+ * timerfd_sleep() waits in sendpacket_wait() for an absolute timerfd
+ * deadline, so the nap ends on time however long it took to get here,
+ * and an abort ends it at once.
+ */
+static inline void
+timerfd_sleep(sendpacket_t *sp, const struct timespec *nap, u_int64_t *now_ns, bool flush _U_)
+{
+    u_int64_t sleep_until = *now_ns + TIMESPEC_TO_NANOSEC(nap);
+
+    if (sp->wait_epfd == 0 && sendpacket_wait_open(sp) < 0)
+        warnx("%s, falling back to nanosleep()", sendpacket_geterr(sp));
+    if (sp->wait_epfd < 0) {
+        nanosleep_sleep(sp, nap, now_ns, flush);
+        return;
+    }
+
+#ifdef HAVE_NETMAP
+    if (flush)
+        ioctl(sp->handle.fd, NIOCTXSYNC, NULL); /* flush TX buffer */
+#endif
+
+    if (sendpacket_wait(sp, sleep_until, -1) < 0) {
+        warnx("%s, falling back to nanosleep()", sendpacket_geterr(sp));
+        close(sp->wait_epfd);
+        close(sp->wait_timerfd);
+        sp->wait_epfd = -1;
+    }
+
+    *now_ns = tcpr_clock_ns();
+}
+#endif /* HAVE_TIMERFD_WAIT */
+
 /*
  * ioport_sleep() only works on Intel 32-bit and quite possibly only Linux.
  * But the basic idea is to write to the IO Port 0x80 which should
@@ -143,4 +284,50 @@ select_sleep(sendpacket_t *sp _U_, const struct timespec *nap, struct timeval *n
 /* before calling port_sleep(), you have to call port_sleep_init() */
 void ioport_sleep_init(void);
 
-void ioport_sleep(sendpacket_t *sp _U_, const struct timespec *nap, struct timeval *now, bool flush);
+void ioport_sleep(sendpacket_t *sp _U_, const struct timespec *nap, u_int64_t *now_ns, bool flush);
+
+/*
+ * hybrid_sleep() kernel sleeps for all but the last sleep_margin_ns of the
+ * nap, then spins on the clock for the rest.  The margin follows the
+ * nanosleep() overshoot actually seen: it grows quickly when a sleep wakes
+ * up late and shrinks slowly when there was time left to spin.
+ */
+#define HYBRID_MIN_MARGIN_NS 2000    /* never trust nanosleep() closer than this */
+#define HYBRID_MAX_MARGIN_NS 2000000 /* spin at most this long */
+#define HYBRID_CALIBRATE_NAPS 32
+
+u_int64_t hybrid_sleep_calibrate(void);
+
+static inline void
+hybrid_sleep(sendpacket_t *sp, const struct timespec *nap, u_int64_t *now_ns, bool flush _U_)
+{
+    u_int64_t nap_ns = TIMESPEC_TO_NANOSEC(nap);
+    u_int64_t sleep_until = *now_ns + nap_ns;
+    u_int64_t margin = sp->sleep_margin_ns;
+
+#ifdef HAVE_NETMAP
+    if (flush)
+        ioctl(sp->handle.fd, NIOCTXSYNC, NULL); /* flush TX buffer */
+#endif
+
+    if (nap_ns > margin) {
+        u_int64_t wake_at = sleep_until - margin;
+        u_int64_t overshoot;
+
+        if (sendpacket_nap(sp, nap_ns - margin)) {
+            *now_ns = tcpr_clock_ns();
+            return;
+        }
+        *now_ns = tcpr_clock_ns();
+
+        overshoot = *now_ns > wake_at ? *now_ns - wake_at : 0;
+        if (overshoot > margin)
+            margin += (overshoot - margin) / 2;
+        else
+            margin -= (margin - overshoot) / 64;
+        sp->sleep_margin_ns = min(max(margin, (u_int64_t)HYBRID_MIN_MARGIN_NS), (u_int64_t)HYBRID_MAX_MARGIN_NS);
+    }
+
+    while (*now_ns < sleep_until && !sendpacket_is_woken(sp))
+        *now_ns = tcpr_clock_ns();
+}
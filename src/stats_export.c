@@ -0,0 +1,972 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Live statistics for --stats-socket.
+ *
+ * A thread answers HTTP GET requests on a Unix domain socket with the
+ * counters of every sendpacket_t in use: the interfaces and, with
+ * --threads, the socket of each send worker.  Those counters are only
+ * ever written by the thread sending on them, so they are read here with
+ * relaxed atomic loads and no locking; the send path is unchanged.
+ *
+ *   /metrics   Prometheus text exposition format
+ *   /json      the same counters as a JSON document
+ *
+ * POST requests change the replay while it runs, see stats_control():
+ *
+ *   /speed?mbps=N, ?pps=N, ?multiplier=N or ?topspeed
+ *   /pause[?intf=NAME]    hold packets on one or all interfaces
+ *   /resume[?intf=NAME]
+ *   /playlist/add?file=PATH[&file=PATH...]     see playlist.c
+ *   /playlist/remove?file=PATH
+ *   /playlist/replace?file=PATH[&file=PATH...]
+ */
+
+#include "stats_export.h"
+#include "defines.h"
+#include "config.h"
+#include "common.h"
+#include "send_threads.h"
+#include "breakdown.h"
+#include "playlist.h"
+#include "tcpreplay_api.h"
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef HAVE_PTHREAD
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define STATS_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* most sendpacket_t a context can have */
+#define STATS_MAX_SOURCES (2 + 2 * (CACHE_MAX_PAIRS - 1) + MAX_SEND_THREADS)
+
+/* a copy of the counters of one sendpacket_t */
+typedef struct stats_snap_s {
+    const char *device;
+    int thread;
+    COUNTER sent;
+    COUNTER bytes_sent;
+    COUNTER failed;
+    COUNTER trunc_packets;
+    COUNTER retry_eagain;
+    COUNTER retry_enobufs;
+    COUNTER sleep_ns;
+    COUNTER backpressure_ns;
+    COUNTER flows;
+    COUNTER flows_unique;
+    COUNTER flows_expired;
+    tcpr_hist_t hist[3];
+    tcpr_hist_t batch;
+    tcpr_profile_t profile;
+    /* --digest, the hashes are only set if kept */
+    bool digest;
+    bool digest_ordered;
+    bool digest_by_flow;
+    uint64_t digest_state;
+    uint64_t digest_flow_sum;
+} stats_snap_t;
+
+static const struct {
+    const char *name;
+    const char *json;
+    const char *help;
+    size_t offset;
+} stats_counters[] = {
+        {"tcpreplay_packets_sent_total", "packets", "Packets sent", offsetof(stats_snap_t, sent)},
+        {"tcpreplay_bytes_sent_total", "bytes", "Bytes sent", offsetof(stats_snap_t, bytes_sent)},
+        {"tcpreplay_packets_failed_total", "failed", "Packets which failed to send", offsetof(stats_snap_t, failed)},
+        {"tcpreplay_packets_truncated_total",
+         "truncated",
+         "Packets only partially sent",
+         offsetof(stats_snap_t, trunc_packets)},
+        {"tcpreplay_retry_eagain_total", "retry_eagain", "Sends retried after EAGAIN", offsetof(stats_snap_t, retry_eagain)},
+        {"tcpreplay_retry_enobufs_total",
+         "retry_enobufs",
+         "Sends retried after ENOBUFS",
+         offsetof(stats_snap_t, retry_enobufs)},
+        {"tcpreplay_flows_total", "flows", "Flows started, new or after expiring", offsetof(stats_snap_t, flows)},
+        {"tcpreplay_flows_new_total", "flows_new", "Flows never seen before", offsetof(stats_snap_t, flows_unique)},
+        {"tcpreplay_flows_expired_total",
+         "flows_expired",
+         "Flows started again after expiring",
+         offsetof(stats_snap_t, flows_expired)},
+};
+
+#define STATS_COUNTER(snap, i) (*(const COUNTER *)((const char *)(snap) + stats_counters[i].offset))
+
+/* the --timing-stats histograms, in the order of stats_snap_t.hist */
+static const struct {
+    const char *name;
+    const char *json;
+    const char *help;
+} stats_hists[] = {
+        {"tcpreplay_lateness_seconds", "lateness", "Actual minus scheduled send time"},
+        {"tcpreplay_gap_error_seconds", "gap_error", "Achieved minus scheduled gap from the previous packet"},
+        {"tcpreplay_sleep_overshoot_seconds", "sleep_overshoot", "Time sleeps took beyond what was asked"},
+};
+
+/* Prometheus buckets are the powers of two from 2^MIN to 2^MAX ns, ~1us to ~1s */
+#define STATS_HIST_LE_MIN 10
+#define STATS_HIST_LE_MAX 30
+
+/* the batch size buckets are the powers of two up to SENDPACKET_BATCH_MAX packets */
+#define STATS_BATCH_LE_MAX 8
+
+/* growable output buffer */
+typedef struct stats_buf_s {
+    char *data;
+    size_t len;
+    size_t size;
+} stats_buf_t;
+
+static void stats_printf(stats_buf_t *buf, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void
+stats_printf(stats_buf_t *buf, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(buf->data + buf->len, buf->size - buf->len, fmt, ap);
+        va_end(ap);
+
+        if (n < 0)
+            return;
+
+        if ((size_t)n < buf->size - buf->len) {
+            buf->len += n;
+            return;
+        }
+
+        buf->size = max(buf->size * 2, buf->len + n + 1);
+        buf->data = safe_realloc(buf->data, buf->size);
+    }
+}
+
+/**
+ * \brief a file name as a Prometheus label value or JSON string, without the quotes
+ *
+ * Control characters, which neither can take as they are, become '?'.
+ */
+static void
+stats_print_name(stats_buf_t *buf, const char *name)
+{
+    for (; name != NULL && *name != '\0'; name++) {
+        if (*name == '"' || *name == '\\')
+            stats_printf(buf, "\\%c", *name);
+        else if (*name == '\n')
+            stats_printf(buf, "\\n");
+        else
+            stats_printf(buf, "%c", (unsigned char)*name < 0x20 ? '?' : *name);
+    }
+}
+
+static void
+stats_breakdown_load(tcpr_breakdown_t *to, const tcpr_breakdown_t *from)
+{
+    to->passes = STATS_LOAD(from->passes);
+    to->pkts = STATS_LOAD(from->pkts);
+    to->bytes = STATS_LOAD(from->bytes);
+    to->failed = STATS_LOAD(from->failed);
+    to->retries = STATS_LOAD(from->retries);
+    to->sleep_ns = STATS_LOAD(from->sleep_ns);
+    to->backpressure_ns = STATS_LOAD(from->backpressure_ns);
+    to->elapsed_ns = STATS_LOAD(from->elapsed_ns);
+}
+
+/* the --stats-breakdown counters, for the Prometheus output */
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;
+    bool ns; /* printed in seconds */
+} stats_breakdown_counters[] = {
+        {"packets_total", "Packets sent", offsetof(tcpr_breakdown_t, pkts), false},
+        {"bytes_total", "Bytes sent", offsetof(tcpr_breakdown_t, bytes), false},
+        {"packets_failed_total", "Packets which failed to send", offsetof(tcpr_breakdown_t, failed), false},
+        {"retries_total", "Sends retried after EAGAIN or ENOBUFS", offsetof(tcpr_breakdown_t, retries), false},
+        {"sleep_seconds_total", "Time spent waiting to send", offsetof(tcpr_breakdown_t, sleep_ns), true},
+        {"backpressure_seconds_total",
+         "Time spent waiting for a full queue",
+         offsetof(tcpr_breakdown_t, backpressure_ns),
+         true},
+        {"seconds_total", "Time spent sending it", offsetof(tcpr_breakdown_t, elapsed_ns), true},
+};
+
+#define STATS_BREAKDOWN_COUNTER(b, i) (*(const COUNTER *)((const char *)(b) + stats_breakdown_counters[i].offset))
+
+/**
+ * \brief Prometheus metrics per --stats-breakdown file, and of the last loop
+ */
+static void
+stats_breakdown_prometheus(tcpreplay_t *ctx, stats_buf_t *buf)
+{
+    const tcpr_breakdowns_t *bd = ctx->breakdown;
+    tcpr_breakdown_t b;
+    COUNTER loops;
+    size_t c;
+    int i;
+
+    for (c = 0; c < sizeof(stats_breakdown_counters) / sizeof(stats_breakdown_counters[0]); c++) {
+        stats_printf(buf,
+                     "# HELP tcpreplay_source_%s %s, per file\n",
+                     stats_breakdown_counters[c].name,
+                     stats_breakdown_counters[c].help);
+        stats_printf(buf, "# TYPE tcpreplay_source_%s counter\n", stats_breakdown_counters[c].name);
+        for (i = 0; i < ctx->options->source_cnt; i++) {
+            stats_breakdown_load(&b, &bd->sources[i]);
+            if (b.passes == 0)
+                continue;
+
+            stats_printf(buf, "tcpreplay_source_%s{source=\"", stats_breakdown_counters[c].name);
+            stats_print_name(buf, ctx->options->sources[i].filename);
+            if (stats_breakdown_counters[c].ns)
+                stats_printf(buf, "\"} %.9f\n", (double)STATS_BREAKDOWN_COUNTER(&b, c) / 1000000000.0);
+            else
+                stats_printf(buf, "\"} " COUNTER_SPEC "\n", STATS_BREAKDOWN_COUNTER(&b, c));
+        }
+    }
+
+    loops = __atomic_load_n(&bd->loop_cnt, __ATOMIC_ACQUIRE);
+    if (loops == 0)
+        return;
+
+    stats_breakdown_load(&b, &bd->loops[(loops - 1) % BREAKDOWN_LOOPS]);
+    for (c = 0; c < sizeof(stats_breakdown_counters) / sizeof(stats_breakdown_counters[0]); c++) {
+        stats_printf(buf,
+                     "# HELP tcpreplay_last_loop_%s %s, in the last loop\n",
+                     stats_breakdown_counters[c].name,
+                     stats_breakdown_counters[c].help);
+        stats_printf(buf, "# TYPE tcpreplay_last_loop_%s gauge\n", stats_breakdown_counters[c].name);
+        if (stats_breakdown_counters[c].ns)
+            stats_printf(buf,
+                         "tcpreplay_last_loop_%s %.9f\n",
+                         stats_breakdown_counters[c].name,
+                         (double)STATS_BREAKDOWN_COUNTER(&b, c) / 1000000000.0);
+        else
+            stats_printf(buf,
+                         "tcpreplay_last_loop_%s " COUNTER_SPEC "\n",
+                         stats_breakdown_counters[c].name,
+                         STATS_BREAKDOWN_COUNTER(&b, c));
+    }
+}
+
+static void
+stats_breakdown_json_one(stats_buf_t *buf, const tcpr_breakdown_t *b)
+{
+    stats_printf(buf,
+                 "\"passes\":" COUNTER_SPEC ",\"packets\":" COUNTER_SPEC ",\"bytes\":" COUNTER_SPEC
+                 ",\"failed\":" COUNTER_SPEC ",\"retries\":" COUNTER_SPEC ",\"sleep_ns\":%llu,"
+                 "\"backpressure_ns\":%llu,\"elapsed_ns\":%llu}",
+                 b->passes,
+                 b->pkts,
+                 b->bytes,
+                 b->failed,
+                 b->retries,
+                 (unsigned long long)b->sleep_ns,
+                 (unsigned long long)b->backpressure_ns,
+                 (unsigned long long)b->elapsed_ns);
+}
+
+/**
+ * \brief the --stats-breakdown files and the loops kept, as JSON arrays
+ */
+static void
+stats_breakdown_json(tcpreplay_t *ctx, stats_buf_t *buf)
+{
+    const tcpr_breakdowns_t *bd = ctx->breakdown;
+    tcpr_breakdown_t b;
+    COUNTER loops, loop, first = 1;
+    bool comma = false;
+    int i;
+
+    stats_printf(buf, ",\"sources\":[");
+    for (i = 0; i < ctx->options->source_cnt; i++) {
+        stats_breakdown_load(&b, &bd->sources[i]);
+        if (b.passes == 0)
+            continue;
+
+        stats_printf(buf, "%s{\"source\":\"", comma ? "," : "");
+        stats_print_name(buf, ctx->options->sources[i].filename);
+        stats_printf(buf, "\",");
+        stats_breakdown_json_one(buf, &b);
+        comma = true;
+    }
+
+    loops = __atomic_load_n(&bd->loop_cnt, __ATOMIC_ACQUIRE);
+    if (loops > BREAKDOWN_LOOPS)
+        first = loops - BREAKDOWN_LOOPS + 1;
+    stats_printf(buf, "],\"loops\":[");
+    for (loop = first; loop <= loops; loop++) {
+        stats_breakdown_load(&b, &bd->loops[(loop - 1) % BREAKDOWN_LOOPS]);
+        stats_printf(buf, "%s{\"loop\":" COUNTER_SPEC ",", loop > first ? "," : "", loop);
+        stats_breakdown_json_one(buf, &b);
+    }
+    stats_printf(buf, "]");
+}
+
+/**
+ * \brief copy the counters of every sendpacket_t of ctx
+ *
+ * Returns the number of snapshots in *snap_out, which the caller frees
+ */
+static int
+stats_collect(tcpreplay_t *ctx, stats_snap_t **snap_out)
+{
+    sendpacket_t *sources[STATS_MAX_SOURCES];
+    int threads[STATS_MAX_SOURCES];
+    stats_snap_t *snap;
+    int i, n = 0;
+
+    sources[n] = ctx->intf1;
+    threads[n++] = 0;
+    if (ctx->intf2 != NULL) {
+        sources[n] = ctx->intf2;
+        threads[n++] = 0;
+    }
+    for (i = 0; i < ctx->options->pair_intf_cnt; i++) {
+        sources[n] = ctx->pair_intf[i];
+        threads[n++] = 0;
+    }
+
+#ifdef ENABLE_SEND_THREADS
+    {
+        /* workers are filled in by send_threads_init() while we may be running */
+        send_threads_t *st = __atomic_load_n(&ctx->threads, __ATOMIC_ACQUIRE);
+
+        for (i = 1; st != NULL && i < st->cnt; i++) {
+            sendpacket_t *sp = __atomic_load_n(&st->workers[i].sp, __ATOMIC_ACQUIRE);
+
+            if (sp == NULL)
+                continue;
+            sources[n] = sp;
+            threads[n++] = i;
+        }
+    }
+#endif
+
+    snap = safe_malloc(sizeof(stats_snap_t) * n);
+    for (i = 0; i < n; i++) {
+        sendpacket_t *sp = sources[i];
+
+        snap[i].device = sp->device;
+        snap[i].thread = threads[i];
+        snap[i].sent = STATS_LOAD(sp->sent);
+        snap[i].bytes_sent = STATS_LOAD(sp->bytes_sent);
+        snap[i].failed = STATS_LOAD(sp->failed);
+        snap[i].trunc_packets = STATS_LOAD(sp->trunc_packets);
+        snap[i].retry_eagain = STATS_LOAD(sp->retry_eagain);
+        snap[i].retry_enobufs = STATS_LOAD(sp->retry_enobufs);
+        snap[i].sleep_ns = STATS_LOAD(sp->sleep_ns);
+        snap[i].backpressure_ns = STATS_LOAD(sp->backpressure_ns);
+        snap[i].flows = STATS_LOAD(sp->flows);
+        snap[i].flows_unique = STATS_LOAD(sp->flows_unique);
+        snap[i].flows_expired = STATS_LOAD(sp->flows_expired);
+        tcpr_hist_load(&snap[i].hist[0], &sp->late);
+        tcpr_hist_load(&snap[i].hist[1], &sp->gap);
+        tcpr_hist_load(&snap[i].hist[2], &sp->overshoot);
+        tcpr_hist_load(&snap[i].batch, &sp->batch);
+        tcpr_prof_load(&snap[i].profile, &sp->profile);
+        snap[i].digest = sp->digest != NULL;
+        snap[i].digest_ordered = false;
+        snap[i].digest_by_flow = false;
+        if (sp->digest != NULL) {
+            snap[i].digest_ordered = STATS_LOAD(sp->digest->ordered);
+            snap[i].digest_by_flow = sp->digest->datalink != -1;
+            snap[i].digest_state = STATS_LOAD(sp->digest->state);
+            snap[i].digest_flow_sum = STATS_LOAD(sp->digest->flow_sum);
+        }
+    }
+
+    *snap_out = snap;
+    return n;
+}
+
+static void
+stats_prometheus(tcpreplay_t *ctx, const stats_snap_t *snap, int n, stats_buf_t *buf)
+{
+    size_t c;
+    int i, j;
+
+    stats_printf(buf, "# HELP tcpreplay_running Whether a replay is in progress\n");
+    stats_printf(buf, "# TYPE tcpreplay_running gauge\n");
+    stats_printf(buf, "tcpreplay_running %d\n", STATS_LOAD(ctx->running) ? 1 : 0);
+    stats_printf(buf, "# HELP tcpreplay_loops_total Passes completed over all files\n");
+    stats_printf(buf, "# TYPE tcpreplay_loops_total counter\n");
+    stats_printf(buf, "tcpreplay_loops_total " COUNTER_SPEC "\n", STATS_LOAD(ctx->iteration));
+    stats_printf(buf, "# HELP tcpreplay_timer_info The packet timing method in use\n");
+    stats_printf(buf, "# TYPE tcpreplay_timer_info gauge\n");
+    stats_printf(buf, "tcpreplay_timer_info{timer=\"%s\"} 1\n", tcpreplay_accurate_name(ctx->options->accurate));
+
+    for (c = 0; c < sizeof(stats_counters) / sizeof(stats_counters[0]); c++) {
+        stats_printf(buf, "# HELP %s %s\n", stats_counters[c].name, stats_counters[c].help);
+        stats_printf(buf, "# TYPE %s counter\n", stats_counters[c].name);
+        for (i = 0; i < n; i++)
+            stats_printf(buf,
+                         "%s{interface=\"%s\",thread=\"%d\"} " COUNTER_SPEC "\n",
+                         stats_counters[c].name,
+                         snap[i].device,
+                         snap[i].thread,
+                         STATS_COUNTER(&snap[i], c));
+    }
+
+    stats_printf(buf, "# HELP tcpreplay_sleep_seconds_total Time spent waiting to send\n");
+    stats_printf(buf, "# TYPE tcpreplay_sleep_seconds_total counter\n");
+    for (i = 0; i < n; i++)
+        stats_printf(buf,
+                     "tcpreplay_sleep_seconds_total{interface=\"%s\",thread=\"%d\"} %.9f\n",
+                     snap[i].device,
+                     snap[i].thread,
+                     (double)snap[i].sleep_ns / 1000000000.0);
+
+    stats_printf(buf, "# HELP tcpreplay_backpressure_seconds_total Time spent waiting for a full queue\n");
+    stats_printf(buf, "# TYPE tcpreplay_backpressure_seconds_total counter\n");
+    for (i = 0; i < n; i++)
+        stats_printf(buf,
+                     "tcpreplay_backpressure_seconds_total{interface=\"%s\",thread=\"%d\"} %.9f\n",
+                     snap[i].device,
+                     snap[i].thread,
+                     (double)snap[i].backpressure_ns / 1000000000.0);
+
+    for (c = 0; c < sizeof(stats_hists) / sizeof(stats_hists[0]); c++) {
+        stats_printf(buf, "# HELP %s %s\n", stats_hists[c].name, stats_hists[c].help);
+        stats_printf(buf, "# TYPE %s histogram\n", stats_hists[c].name);
+        for (i = 0; i < n; i++) {
+            const tcpr_hist_t *h = &snap[i].hist[c];
+
+            for (j = STATS_HIST_LE_MIN; j <= STATS_HIST_LE_MAX; j++)
+                stats_printf(buf,
+                             "%s_bucket{interface=\"%s\",thread=\"%d\",le=\"%.9g\"} " COUNTER_SPEC "\n",
+                             stats_hists[c].name,
+                             snap[i].device,
+                             snap[i].thread,
+                             (double)(1ULL << j) / 1000000000.0,
+                             tcpr_hist_count_below(h, 1ULL << j));
+            stats_printf(buf,
+                         "%s_bucket{interface=\"%s\",thread=\"%d\",le=\"+Inf\"} " COUNTER_SPEC "\n",
+                         stats_hists[c].name,
+                         snap[i].device,
+                         snap[i].thread,
+                         h->count);
+            stats_printf(buf,
+                         "%s_sum{interface=\"%s\",thread=\"%d\"} %.9f\n",
+                         stats_hists[c].name,
+                         snap[i].device,
+                         snap[i].thread,
+                         (double)h->sum / 1000000000.0);
+            stats_printf(buf,
+                         "%s_count{interface=\"%s\",thread=\"%d\"} " COUNTER_SPEC "\n",
+                         stats_hists[c].name,
+                         snap[i].device,
+                         snap[i].thread,
+                         h->count);
+        }
+    }
+
+    stats_printf(buf, "# HELP tcpreplay_batch_packets Packets handed to the interface in one batch\n");
+    stats_printf(buf, "# TYPE tcpreplay_batch_packets histogram\n");
+    for (i = 0; i < n; i++) {
+        const tcpr_hist_t *h = &snap[i].batch;
+
+        for (j = 0; j <= STATS_BATCH_LE_MAX; j++)
+            stats_printf(buf,
+                         "tcpreplay_batch_packets_bucket{interface=\"%s\",thread=\"%d\",le=\"%u\"} " COUNTER_SPEC "\n",
+                         snap[i].device,
+                         snap[i].thread,
+                         1U << j,
+                         tcpr_hist_count_below(h, (1ULL << j) + 1));
+        stats_printf(buf,
+                     "tcpreplay_batch_packets_bucket{interface=\"%s\",thread=\"%d\",le=\"+Inf\"} " COUNTER_SPEC "\n",
+                     snap[i].device,
+                     snap[i].thread,
+                     h->count);
+        stats_printf(buf,
+                     "tcpreplay_batch_packets_sum{interface=\"%s\",thread=\"%d\"} %llu\n",
+                     snap[i].device,
+                     snap[i].thread,
+                     (unsigned long long)h->sum);
+        stats_printf(buf,
+                     "tcpreplay_batch_packets_count{interface=\"%s\",thread=\"%d\"} " COUNTER_SPEC "\n",
+                     snap[i].device,
+                     snap[i].thread,
+                     h->count);
+    }
+
+    if (ctx->options->profile) {
+        double ns_per_tick = tcpr_prof_ns_per_tick();
+
+        stats_printf(buf, "# HELP tcpreplay_profile_seconds_total Time the send loop spent in each stage\n");
+        stats_printf(buf, "# TYPE tcpreplay_profile_seconds_total counter\n");
+        for (i = 0; i < n; i++)
+            for (j = 0; j < TCPR_PROF_STAGES; j++)
+                stats_printf(buf,
+                             "tcpreplay_profile_seconds_total{interface=\"%s\",thread=\"%d\",stage=\"%s\"} %.9f\n",
+                             snap[i].device,
+                             snap[i].thread,
+                             tcpr_prof_stage_name(j),
+                             (double)snap[i].profile.ticks[j] * ns_per_tick / 1000000000.0);
+    }
+
+    if (ctx->options->digest) {
+        stats_printf(buf, "# HELP tcpreplay_digest_info The --digest of what was sent so far, as labels\n");
+        stats_printf(buf, "# TYPE tcpreplay_digest_info gauge\n");
+        for (i = 0; i < n; i++) {
+            if (!snap[i].digest)
+                continue;
+            stats_printf(buf, "tcpreplay_digest_info{interface=\"%s\",thread=\"%d\"", snap[i].device, snap[i].thread);
+            if (snap[i].digest_ordered)
+                stats_printf(buf, ",xxh64=\"%016llx\"", (unsigned long long)snap[i].digest_state);
+            if (snap[i].digest_by_flow)
+                stats_printf(buf, ",by_flow=\"%016llx\"", (unsigned long long)snap[i].digest_flow_sum);
+            stats_printf(buf, "} 1\n");
+        }
+    }
+
+    if (ctx->breakdown != NULL)
+        stats_breakdown_prometheus(ctx, buf);
+}
+
+static void
+stats_json(tcpreplay_t *ctx, const stats_snap_t *snap, int n, stats_buf_t *buf)
+{
+    double ns_per_tick = ctx->options->profile ? tcpr_prof_ns_per_tick() : 1.0;
+    size_t c;
+    int i, j;
+
+    stats_printf(buf,
+                 "{\"running\":%s,\"loops\":" COUNTER_SPEC ",\"timer\":\"%s\",\"interfaces\":[",
+                 STATS_LOAD(ctx->running) ? "true" : "false",
+                 STATS_LOAD(ctx->iteration),
+                 tcpreplay_accurate_name(ctx->options->accurate));
+
+    for (i = 0; i < n; i++) {
+        stats_printf(buf, "%s{\"interface\":\"%s\",\"thread\":%d", i ? "," : "", snap[i].device, snap[i].thread);
+        for (c = 0; c < sizeof(stats_counters) / sizeof(stats_counters[0]); c++)
+            stats_printf(buf, ",\"%s\":" COUNTER_SPEC, stats_counters[c].json, STATS_COUNTER(&snap[i], c));
+        stats_printf(buf, ",\"sleep_ns\":" COUNTER_SPEC, snap[i].sleep_ns);
+        stats_printf(buf, ",\"backpressure_ns\":" COUNTER_SPEC, snap[i].backpressure_ns);
+
+        for (c = 0; c < sizeof(stats_hists) / sizeof(stats_hists[0]); c++) {
+            const tcpr_hist_t *h = &snap[i].hist[c];
+
+            stats_printf(buf,
+                         ",\"%s\":{\"count\":" COUNTER_SPEC ",\"sum_ns\":%llu,\"max_ns\":%llu,\"p50_ns\":%llu,"
+                         "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+                         stats_hists[c].json,
+                         h->count,
+                         (unsigned long long)h->sum,
+                         (unsigned long long)h->max,
+                         (unsigned long long)tcpr_hist_percentile(h, 50.0),
+                         (unsigned long long)tcpr_hist_percentile(h, 90.0),
+                         (unsigned long long)tcpr_hist_percentile(h, 99.0),
+                         (unsigned long long)tcpr_hist_percentile(h, 99.9));
+        }
+
+        stats_printf(buf,
+                     ",\"batch_size\":{\"count\":" COUNTER_SPEC ",\"sum\":%llu,\"max\":%llu,\"p50\":%llu,"
+                     "\"p90\":%llu,\"p99\":%llu}",
+                     snap[i].batch.count,
+                     (unsigned long long)snap[i].batch.sum,
+                     (unsigned long long)snap[i].batch.max,
+                     (unsigned long long)tcpr_hist_percentile(&snap[i].batch, 50.0),
+                     (unsigned long long)tcpr_hist_percentile(&snap[i].batch, 90.0),
+                     (unsigned long long)tcpr_hist_percentile(&snap[i].batch, 99.0));
+
+        if (ctx->options->profile) {
+            stats_printf(buf, ",\"profile\":{\"packets\":" COUNTER_SPEC, snap[i].profile.packets);
+            for (j = 0; j < TCPR_PROF_STAGES; j++)
+                stats_printf(buf,
+                             ",\"%s_ns\":%.0f",
+                             tcpr_prof_stage_name(j),
+                             (double)snap[i].profile.ticks[j] * ns_per_tick);
+            stats_printf(buf, "}");
+        }
+        if (snap[i].digest_ordered)
+            stats_printf(buf, ",\"digest\":\"%016llx\"", (unsigned long long)snap[i].digest_state);
+        if (snap[i].digest_by_flow)
+            stats_printf(buf, ",\"digest_by_flow\":\"%016llx\"", (unsigned long long)snap[i].digest_flow_sum);
+        stats_printf(buf, "}");
+    }
+
+    stats_printf(buf, "]");
+    if (ctx->breakdown != NULL)
+        stats_breakdown_json(ctx, buf);
+    stats_printf(buf, "}\n");
+}
+
+/**
+ * \brief write all of len bytes to a client, giving up on error
+ */
+static void
+stats_write(int fd, const char *data, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        data += n;
+        len -= (size_t)n;
+    }
+}
+
+/**
+ * \brief undo the %XX escapes of a query string value, in place
+ */
+static void
+stats_unescape(char *s)
+{
+    char *out = s;
+    unsigned int c;
+
+    for (; *s != '\0'; s++) {
+        if (*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2]) &&
+            sscanf(s + 1, "%2x", &c) == 1) {
+            *out++ = (char)c;
+            s += 2;
+        } else {
+            *out++ = *s == '+' ? ' ' : *s;
+        }
+    }
+    *out = '\0';
+}
+
+/**
+ * \brief handle a POST to /playlist/<what>?file=PATH[&file=PATH...]
+ *
+ * Returns 0 on success, -1 with the error in body.
+ */
+static int
+stats_playlist(stats_export_t *exp, const char *what, char *query, stats_buf_t *body)
+{
+    tcpreplay_t *ctx = exp->ctx;
+    char *files[PLAYLIST_SLOTS];
+    char *param, *next;
+    int i, cnt = 0, ret = 0;
+
+    for (param = query; param != NULL; param = next) {
+        if ((next = strchr(param, '&')) != NULL)
+            *next++ = '\0';
+
+        if (strncmp(param, "file=", 5) != 0 || param[5] == '\0') {
+            stats_printf(body, "unknown parameter: %s\n", param);
+            return -1;
+        }
+
+        if (cnt == PLAYLIST_SLOTS) {
+            stats_printf(body, "at most %d files at once\n", PLAYLIST_SLOTS);
+            return -1;
+        }
+
+        stats_unescape(param + 5);
+        files[cnt++] = param + 5;
+    }
+
+    if (cnt == 0) {
+        stats_printf(body, "try /playlist/%s?file=PATH\n", what);
+        return -1;
+    }
+
+    if (strcmp(what, "add") == 0) {
+        for (i = 0; i < cnt && ret == 0; i++)
+            ret = tcpreplay_playlist_add(ctx, files[i]);
+    } else if (strcmp(what, "remove") == 0) {
+        for (i = 0; i < cnt && ret == 0; i++)
+            ret = tcpreplay_playlist_remove(ctx, files[i]);
+    } else if (strcmp(what, "replace") == 0) {
+        ret = tcpreplay_playlist_replace(ctx, files, cnt);
+    } else {
+        stats_printf(body, "try /playlist/add, /playlist/remove or /playlist/replace\n");
+        return -1;
+    }
+
+    if (ret < 0) {
+        stats_printf(body, "%s\n", tcpreplay_geterr(ctx));
+        return -1;
+    }
+
+    stats_printf(body, "ok\n");
+    return 0;
+}
+
+/**
+ * \brief handle a POST to path with the given query string
+ *
+ * Returns 0 on success, -1 with the error in body.
+ */
+static int
+stats_control(stats_export_t *exp, const char *path, char *query, stats_buf_t *body)
+{
+    tcpreplay_t *ctx = exp->ctx;
+    char *key = query, *value = NULL;
+    int ret = -1;
+
+    if (strncmp(path, "/playlist/", 10) == 0)
+        return stats_playlist(exp, path + 10, query, body);
+
+    if (key != NULL && (value = strchr(key, '=')) != NULL)
+        *value++ = '\0';
+
+    if (strcmp(path, "/speed") == 0) {
+        if (key != NULL && strcmp(key, "topspeed") == 0)
+            ret = tcpreplay_control_speed(ctx, speed_topspeed, 0.0);
+        else if (key == NULL || value == NULL || *value == '\0')
+            stats_printf(body, "try /speed?mbps=N, ?pps=N, ?multiplier=N or ?topspeed\n");
+        else if (strcmp(key, "mbps") == 0)
+            ret = tcpreplay_control_speed(ctx, speed_mbpsrate, strtod(value, NULL));
+        else if (strcmp(key, "pps") == 0)
+            ret = tcpreplay_control_speed(ctx, speed_packetrate, strtod(value, NULL));
+        else if (strcmp(key, "multiplier") == 0)
+            ret = tcpreplay_control_speed(ctx, speed_multiplier, strtod(value, NULL));
+        else
+            stats_printf(body, "unknown speed: %s\n", key);
+    } else if (strcmp(path, "/pause") == 0 || strcmp(path, "/resume") == 0) {
+        if (key != NULL && strcmp(key, "intf") != 0)
+            stats_printf(body, "unknown parameter: %s\n", key);
+        else
+            ret = tcpreplay_control_pause(ctx, value, path[1] == 'p');
+    } else {
+        stats_printf(body, "try /speed, /pause, /resume or /playlist\n");
+        return -1;
+    }
+
+    if (ret < 0) {
+        if (body->len == 0)
+            stats_printf(body, "%s\n", tcpreplay_geterr(ctx));
+        return -1;
+    }
+
+    stats_printf(body, "ok\n");
+    return 0;
+}
+
+/**
+ * \brief read a request from a client and answer it
+ */
+static void
+stats_client(stats_export_t *exp, int fd)
+{
+    stats_snap_t *snap;
+    char req[STATS_EXPORT_REQ_MAX + 1];
+    char hdr[256];
+    const char *status = "200 OK";
+    const char *type = "text/plain; version=0.0.4";
+    stats_buf_t body;
+    struct timeval tv = {1, 0};
+    size_t len = 0;
+    ssize_t n;
+    char *path, *end, *query = NULL;
+    bool post;
+    int hdr_len;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    /* only the request line matters */
+    while (len < STATS_EXPORT_REQ_MAX) {
+        n = recv(fd, req + len, STATS_EXPORT_REQ_MAX - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += (size_t)n;
+        req[len] = '\0';
+        if (strstr(req, "\r\n") != NULL || strchr(req, '\n') != NULL)
+            break;
+    }
+    req[len] = '\0';
+
+    post = strncmp(req, "POST ", 5) == 0;
+    if (!post && strncmp(req, "GET ", 4) != 0) {
+        hdr_len = snprintf(hdr, sizeof(hdr), "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n");
+        stats_write(fd, hdr, (size_t)hdr_len);
+        return;
+    }
+
+    path = req + (post ? 5 : 4);
+    end = path + strcspn(path, " ?\r\n");
+    if (*end == '?') {
+        query = end + 1;
+        query[strcspn(query, " \r\n")] = '\0';
+        if (*query == '\0')
+            query = NULL;
+    }
+    *end = '\0';
+
+    body.size = 4096;
+    body.len = 0;
+    body.data = safe_malloc(body.size);
+
+    if (post) {
+        type = "text/plain";
+        if (stats_control(exp, path, query, &body) < 0)
+            status = "400 Bad Request";
+        goto reply;
+    }
+
+    n = stats_collect(exp->ctx, &snap);
+    if (strcmp(path, "/metrics") == 0 || strcmp(path, "/") == 0) {
+        stats_prometheus(exp->ctx, snap, (int)n, &body);
+    } else if (strcmp(path, "/json") == 0) {
+        type = "application/json";
+        stats_json(exp->ctx, snap, (int)n, &body);
+    } else {
+        status = "404 Not Found";
+        type = "text/plain";
+        stats_printf(&body, "try /metrics or /json\n");
+    }
+    safe_free(snap);
+
+reply:
+    hdr_len = snprintf(hdr,
+                       sizeof(hdr),
+                       "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                       status,
+                       type,
+                       body.len);
+    stats_write(fd, hdr, (size_t)hdr_len);
+    stats_write(fd, body.data, body.len);
+    safe_free(body.data);
+}
+
+static void *
+stats_export_thread(void *arg)
+{
+    stats_export_t *exp = arg;
+    struct pollfd pfd;
+    int fd;
+
+    pfd.fd = exp->fd;
+    pfd.events = POLLIN;
+
+    while (!__atomic_load_n(&exp->stop, __ATOMIC_ACQUIRE)) {
+        pfd.revents = 0;
+        if (poll(&pfd, 1, STATS_EXPORT_POLL_MS) <= 0)
+            continue;
+
+        if ((fd = accept(exp->fd, NULL, NULL)) < 0)
+            continue;
+
+        stats_client(exp, fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+/**
+ * \brief start serving the stats of ctx on the Unix socket at path
+ *
+ * A stale socket left behind at path is replaced.  Returns 0 on success,
+ * -1 on error.
+ */
+int
+stats_export_start(tcpreplay_t *ctx, const char *path)
+{
+    stats_export_t *exp;
+    struct sockaddr_un sun;
+    struct stat st;
+    int fd;
+
+    assert(ctx);
+    assert(path);
+
+    if (ctx->exporter != NULL)
+        return 0;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        tcpreplay_seterr(ctx, "stats socket path is too long: %s", path);
+        return -1;
+    }
+
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        tcpreplay_seterr(ctx, "Unable to create stats socket: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+    if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0 || listen(fd, 8) < 0) {
+        tcpreplay_seterr(ctx, "Unable to listen on stats socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    exp = safe_malloc(sizeof(stats_export_t));
+    exp->ctx = ctx;
+    exp->path = safe_strdup(path);
+    exp->fd = fd;
+
+    if (pthread_create(&exp->thread, NULL, stats_export_thread, exp) != 0) {
+        tcpreplay_seterr(ctx, "Unable to start stats thread: %s", strerror(errno));
+        close(fd);
+        unlink(exp->path);
+        safe_free(exp->path);
+        safe_free(exp);
+        return -1;
+    }
+
+    ctx->exporter = exp;
+    return 0;
+}
+
+/**
+ * \brief stop the stats thread and remove its socket
+ */
+void
+stats_export_stop(tcpreplay_t *ctx)
+{
+    stats_export_t *exp = ctx->exporter;
+
+    if (exp == NULL)
+        return;
+
+    __atomic_store_n(&exp->stop, true, __ATOMIC_RELEASE);
+    pthread_join(exp->thread, NULL);
+
+    close(exp->fd);
+    unlink(exp->path);
+    safe_free(exp->path);
+    safe_free(exp);
+    ctx->exporter = NULL;
+}
+
+#endif /* HAVE_PTHREAD */
@@ -0,0 +1,41 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpreplay_api.h"
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+
+/* how often the exporter thread checks whether it should stop */
+#define STATS_EXPORT_POLL_MS 100
+/* largest HTTP request we bother reading */
+#define STATS_EXPORT_REQ_MAX 1024
+
+struct stats_export_s {
+    tcpreplay_t *ctx;
+    char *path;
+    int fd;
+    pthread_t thread;
+    volatile bool stop;
+};
+
+int stats_export_start(tcpreplay_t *ctx, const char *path);
+void stats_export_stop(tcpreplay_t *ctx);
+#endif /* HAVE_PTHREAD */
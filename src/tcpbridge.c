@@ -29,6 +29,7 @@
 #include "config.h"
 #include "common.h"
 #include "bridge.h"
+#include "delayline.h"
 #include "tcpbridge_opts.h"
 #include "tcpedit/tcpedit.h"
 #include <errno.h>
@@ -91,10 +92,7 @@ main(int argc, char *argv[])
     }
 #endif
 
-    if (gettimeofday(&stats.start_time, NULL) < 0) {
-        tcpedit_close(&tcpedit);
-        err(-1, "gettimeofday() failed");
-    }
+    stats.start_time_ns = tcpr_clock_ns();
 
     /* process packets */
     do_bridge(&options, tcpedit);
@@ -164,6 +162,21 @@ post_args(_U_ int argc, _U_ char *argv[])
     if (HAVE_OPT(LIMIT))
         options.limit_send = OPT_VALUE_LIMIT; /* default is -1 */
 
+    if (HAVE_OPT(DELAY)) {
+        options.delay_ns = (u_int64_t)OPT_VALUE_DELAY * 1000;
+        options.delay_buffer = (size_t)OPT_VALUE_DELAY_BUFFER << 20;
+
+        if (HAVE_OPT(DELAY_JITTER))
+            options.delay_jitter_ns = (u_int64_t)OPT_VALUE_DELAY_JITTER * 1000;
+
+        if (strcmp(OPT_ARG(DELAY_DIST), "uniform") == 0)
+            options.delay_dist = DELAY_DIST_UNIFORM;
+        else if (strcmp(OPT_ARG(DELAY_DIST), "normal") == 0)
+            options.delay_dist = DELAY_DIST_NORMAL;
+        else
+            errx(-1, "Invalid --delay-dist: %s", OPT_ARG(DELAY_DIST));
+    }
+
     if ((intname = get_interface(intlist, OPT_ARG(INTF1))) == NULL) {
         if (!strncmp(OPT_ARG(INTF1), "netmap:", 7) || !strncmp(OPT_ARG(INTF1), "vale", 4))
             errx(-1,
@@ -71,6 +71,12 @@ typedef struct {
     regex_t preg;
     tcpr_cidr_t *cidrdata;
 
+    /* --delay, see delayline.h */
+    u_int64_t delay_ns;
+    u_int64_t delay_jitter_ns;
+    int delay_dist;
+    size_t delay_buffer;
+
     int mtu;
     int maxpacket;
     int fixcsum;
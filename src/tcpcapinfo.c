@@ -22,6 +22,8 @@
 #include "config.h"
 #include "common.h"
 #include "tcpcapinfo_opts.h"
+#include "tcpreplay_api.h"
+#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
@@ -32,7 +34,10 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-static int do_checksum_math(u_int16_t *data, int len);
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
 
 #ifdef DEBUG
 int debug = 0;
@@ -86,279 +91,1003 @@ struct pcap_sf_patched_pkthdr {
  */
 #define NSEC_TCPDUMP_MAGIC 0xa1b23c4d
 
-int
-main(int argc, char *argv[])
+/* LINKTYPE_RAW as stored in pcap files, DLT_RAW differs between platforms */
+#define LINKTYPE_RAW 101
+
+/* bytes read from a file at a time, rather than a read() per header and frame */
+#define CAPINFO_BLOCK (1024 * 1024)
+/* largest frame read, anything bigger is TOOBIG anyway */
+#define CAPINFO_MAX_FRAME UINT16_MAX
+/* anomalies of each kind listed per file with --summary */
+#define CAPINFO_MAX_NOTES 10
+#define CAPINFO_MAX_THREADS 64
+/* --profile: preamble and SFD, FCS and inter-frame gap, as tcpreplay --wire-rate */
+#define CAPINFO_WIRE_OVERHEAD (8 + 4 + 12)
+/* --profile: link types told apart in the totals */
+#define CAPINFO_MAX_LINKTYPES 16
+
+typedef enum capinfo_note_e {
+    CAPINFO_BAD_TS,
+    CAPINFO_TOOBIG,
+    CAPINFO_BAD_CSUM,
+    CAPINFO_BAD_FCS,
+    CAPINFO_NOTES,
+} capinfo_note_t;
+
+static const char *capinfo_note_names[] = {"BAD_TS", "TOOBIG", "BAD_CSUM", "BAD_FCS"};
+
+typedef struct capinfo_stats_s {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t notes[CAPINFO_NOTES];
+    bool damaged; /* truncated, unreadable or unsupported */
+} capinfo_stats_t;
+
+/* --profile packet sizes, on the wire: up to 64, 127, 255 ... 1518, 9216 and bigger */
+#define CAPINFO_SIZES 8
+static const uint32_t capinfo_size_max[CAPINFO_SIZES - 1] = {64, 127, 255, 511, 1023, 1518, 9216};
+static const char *capinfo_size_names[CAPINFO_SIZES] = {
+        "64", "65-127", "128-255", "256-511", "512-1023", "1024-1518", "1519-9216", "9217-"};
+
+/*
+ * --profile: what it takes to replay a file, worked out in the same pass.
+ * Rates are by second of capture time, so bursts within a second are
+ * averaged out.
+ */
+typedef struct capinfo_profile_s {
+    uint32_t linktype;
+    bool nsec;
+    uint64_t sizes[CAPINFO_SIZES];
+    uint64_t wire_bytes; /* the original lengths */
+    uint64_t wire_bits;  /* with CAPINFO_WIRE_OVERHEAD for Ethernet */
+    uint64_t first_ns;
+    uint64_t last_ns;
+    int64_t sec; /* second of capture time being counted */
+    uint64_t sec_pkts;
+    uint64_t sec_bits;
+    uint64_t peak_pps;
+    uint64_t peak_bps;
+    uint64_t flows;
+    uint64_t non_ip;
+    flow_hash_table_t *flow_table;
+    uint64_t link_bps; /* --link-speed */
+    uint64_t ram;      /* of this host, 0 if unknown */
+} capinfo_profile_t;
+
+typedef struct capinfo_file_s {
+    const char *path;
+    FILE *out;
+    capinfo_stats_t stats;
+    capinfo_profile_t *profile; /* --profile, otherwise NULL */
+    bool done;
+} capinfo_file_t;
+
+typedef struct capinfo_s {
+    capinfo_file_t *files;
+    int num_files;
+    int next_file;
+    bool summary;
+    bool fcs; /* --fcs */
+#ifdef HAVE_PTHREAD
+    pthread_mutex_t lock;
+    pthread_cond_t file_done;
+#endif
+} capinfo_t;
+
+/*
+ * Buffer in front of a file descriptor, so a file is read a CAPINFO_BLOCK
+ * at a time whatever the size of its packets
+ */
+typedef struct capinfo_reader_s {
+    int fd;
+    u_char *buf;
+    size_t start; /* next unread byte */
+    size_t end;   /* end of the bytes read */
+} capinfo_reader_t;
+
+/*
+ * read() which only returns short at EOF or on error, as compressed files
+ * are read through a pipe
+ */
+static ssize_t
+read_full(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t ret;
+
+    while (done < len) {
+        if ((ret = read(fd, (u_char *)buf + done, len - done)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return ret;
+        }
+
+        if (ret == 0)
+            break;
+
+        done += (size_t)ret;
+    }
+
+    return (ssize_t)done;
+}
+
+/*
+ * Returns the next len bytes of the file, valid until the next call, or
+ * NULL if there are less than len left.  *got is set to the number of
+ * bytes returned or left, or -1 on error.
+ */
+static const u_char *
+reader_next(capinfo_reader_t *r, size_t len, ssize_t *got)
+{
+    const u_char *data;
+    ssize_t ret;
+
+    assert(len <= CAPINFO_BLOCK);
+
+    if (r->end - r->start < len) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+
+        if ((ret = read_full(r->fd, r->buf + r->end, CAPINFO_BLOCK - r->end)) < 0) {
+            *got = -1;
+            return NULL;
+        }
+
+        r->end += (size_t)ret;
+        if (r->end < len) {
+            *got = (ssize_t)r->end;
+            return NULL;
+        }
+    }
+
+    data = r->buf + r->start;
+    r->start += len;
+    *got = (ssize_t)len;
+    return data;
+}
+
+/*
+ * Check the IPv4 header checksum and, if the whole segment was captured,
+ * the TCP or UDP checksum.  Only Ethernet (with up to one VLAN tag) and
+ * raw IP captures are checked.
+ */
+static bool
+capinfo_bad_csum(uint32_t linktype, const u_char *data, uint32_t caplen)
+{
+    const u_char *ip, *l4;
+    u_char pseudo[12];
+    uint32_t l3off, iphl, iplen, l4len, sum;
+    uint16_t ethertype;
+
+    if (linktype == DLT_EN10MB) {
+        if (caplen < TCPR_ETH_H)
+            return false;
+
+        l3off = TCPR_ETH_H;
+        ethertype = (uint16_t)(data[12] << 8 | data[13]);
+        if (ethertype == ETHERTYPE_VLAN && caplen >= TCPR_ETH_H + 4) {
+            ethertype = (uint16_t)(data[16] << 8 | data[17]);
+            l3off += 4;
+        }
+
+        if (ethertype != ETHERTYPE_IP)
+            return false;
+    } else if (linktype == LINKTYPE_RAW) {
+        l3off = 0;
+    } else {
+        return false;
+    }
+
+    ip = data + l3off;
+    if (caplen < l3off + TCPR_IPV4_H || (ip[0] >> 4) != 4)
+        return false;
+
+    iphl = (uint32_t)(ip[0] & 0x0f) << 2;
+    if (iphl < TCPR_IPV4_H || caplen < l3off + iphl)
+        return false;
+
+    if (tcpr_csum_partial(ip, (int)iphl, 0) != 0xffff)
+        return true;
+
+    /* fragments and partly captured packets can't be checked any further */
+    iplen = (uint32_t)(ip[2] << 8 | ip[3]);
+    if ((ip[6] << 8 | ip[7]) & 0x3fff || iplen < iphl || l3off + iplen > caplen)
+        return false;
+
+    l4 = ip + iphl;
+    l4len = iplen - iphl;
+    if (!(ip[9] == IPPROTO_TCP && l4len >= TCPR_TCP_H) &&
+        !(ip[9] == IPPROTO_UDP && l4len >= TCPR_UDP_H && (l4[6] | l4[7]) != 0))
+        return false;
+
+    memcpy(pseudo, ip + 12, 8);
+    pseudo[8] = 0;
+    pseudo[9] = ip[9];
+    pseudo[10] = (u_char)(l4len >> 8);
+    pseudo[11] = (u_char)l4len;
+
+    sum = tcpr_csum_partial(pseudo, sizeof(pseudo), 0);
+    return tcpr_csum_partial(l4, (int)l4len, sum) != 0xffff;
+}
+
+/*
+ * with --summary list the first few anomalies of each kind
+ */
+static void
+capinfo_note(capinfo_file_t *file, bool summary, capinfo_note_t note)
 {
-    int i, fd, swapped, pkthdrlen, optct, backwards, caplentoobig;
+    if (summary && file->stats.notes[note] < CAPINFO_MAX_NOTES)
+        fprintf(file->out, "%s: packet %" PRIu64 ": %s\n", file->path, file->stats.packets, capinfo_note_names[note]);
+
+    file->stats.notes[note]++;
+}
+
+static void
+capinfo_profile_start(capinfo_profile_t *p, uint32_t linktype, bool nsec)
+{
+    p->linktype = linktype;
+    p->nsec = nsec;
+    p->sec = -1;
+    p->first_ns = UINT64_MAX;
+    p->flow_table = flow_hash_table_init(DEFAULT_FLOW_HASH_BUCKET_SIZE);
+}
+
+/*
+ * the second counted is over, is it the busiest yet?
+ */
+static void
+capinfo_profile_second(capinfo_profile_t *p)
+{
+    if (p->sec_pkts > p->peak_pps)
+        p->peak_pps = p->sec_pkts;
+    if (p->sec_bits > p->peak_bps)
+        p->peak_bps = p->sec_bits;
+    p->sec_pkts = p->sec_bits = 0;
+}
+
+static void
+capinfo_profile_add(capinfo_profile_t *p, int32_t ts_sec, int32_t ts_frac, uint32_t wirelen, const u_char *data,
+                    uint32_t caplen)
+{
+    struct pcap_pkthdr pkthdr;
+    uint64_t ts_ns, bits;
+    int i, dlt;
+
+    for (i = 0; i < CAPINFO_SIZES - 1 && wirelen > capinfo_size_max[i]; i++)
+        ;
+    p->sizes[i]++;
+    p->wire_bytes += wirelen;
+
+    bits = ((uint64_t)wirelen + (p->linktype == DLT_EN10MB ? CAPINFO_WIRE_OVERHEAD : 0)) * 8;
+    p->wire_bits += bits;
+
+    ts_ns = (uint64_t)(uint32_t)ts_sec * 1000000000 + (uint64_t)(uint32_t)ts_frac * (p->nsec ? 1 : 1000);
+    if (ts_ns < p->first_ns)
+        p->first_ns = ts_ns;
+    if (ts_ns > p->last_ns)
+        p->last_ns = ts_ns;
+
+    if (ts_sec != p->sec) {
+        capinfo_profile_second(p);
+        p->sec = ts_sec;
+    }
+    p->sec_pkts++;
+    p->sec_bits += bits;
+
+    memset(&pkthdr, 0, sizeof(pkthdr));
+    pkthdr.ts.tv_sec = ts_sec;
+    pkthdr.ts.tv_usec = p->nsec ? ts_frac / 1000 : ts_frac;
+    pkthdr.caplen = caplen;
+    pkthdr.len = wirelen;
+    dlt = p->linktype == LINKTYPE_RAW ? DLT_RAW : (int)p->linktype;
+    switch (flow_decode(p->flow_table, &pkthdr, data, dlt, 0, NULL)) {
+    case FLOW_ENTRY_NEW:
+        p->flows++;
+        break;
+    case FLOW_ENTRY_NON_IP:
+        p->non_ip++;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * a string as JSON, quotes included
+ */
+static void
+capinfo_json_string(FILE *out, const char *s)
+{
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((u_char)*s < 0x20)
+            fprintf(out, "\\u%04x", (u_char)*s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+/*
+ * what tcpreplay --preload-pcap takes to hold the file, as worked out by
+ * preload_footprint()
+ */
+static uint64_t
+capinfo_preload_bytes(const capinfo_stats_t *stats)
+{
+    return stats->bytes + stats->packets * (PACKET_HEADROOM + sizeof(packet_cache_t));
+}
+
+/*
+ * fastest --multiplier the link keeps up with at the busiest second, 0 if
+ * there's nothing to go by
+ */
+static double
+capinfo_max_multiplier(uint64_t link_bps, uint64_t peak_bps)
+{
+    return peak_bps != 0 ? (double)link_bps / (double)peak_bps : 0.0;
+}
+
+/*
+ * the --profile of a file, as one line of JSON
+ */
+static void
+capinfo_profile_end(capinfo_file_t *file)
+{
+    capinfo_profile_t *p = file->profile;
+    const char *dlt = pcap_datalink_val_to_name(p->linktype == LINKTYPE_RAW ? DLT_RAW : (int)p->linktype);
+    uint64_t duration_ns = p->last_ns > p->first_ns ? p->last_ns - p->first_ns : 0;
+    uint64_t preload = capinfo_preload_bytes(&file->stats);
+    double avg_pps = 0.0, avg_bps = 0.0;
+    FILE *out = file->out;
+    int i;
+
+    capinfo_profile_second(p);
+    if (duration_ns != 0) {
+        avg_pps = (double)file->stats.packets * 1000000000.0 / (double)duration_ns;
+        avg_bps = (double)p->wire_bits * 1000000000.0 / (double)duration_ns;
+    }
+
+    /* in a capture of less than a second or two the busiest is only part of one */
+    if (avg_pps > (double)p->peak_pps)
+        p->peak_pps = (uint64_t)avg_pps;
+    if (avg_bps > (double)p->peak_bps)
+        p->peak_bps = (uint64_t)avg_bps;
+    if (p->flow_table != NULL)
+        flow_hash_table_release(p->flow_table);
+    p->flow_table = NULL;
+
+    fprintf(out, "{\"file\":");
+    capinfo_json_string(out, file->path);
+    fprintf(out, ",\"linktype\":%" PRIu32 ",\"dlt\":", p->linktype);
+    capinfo_json_string(out, dlt != NULL ? dlt : "unknown");
+    fprintf(out,
+            ",\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"wire_bytes\":%" PRIu64 ",\"duration\":%.6f",
+            file->stats.packets,
+            file->stats.bytes,
+            p->wire_bytes,
+            (double)duration_ns / 1000000000.0);
+    fprintf(out, ",\"sizes\":{");
+    for (i = 0; i < CAPINFO_SIZES; i++)
+        fprintf(out, "%s\"%s\":%" PRIu64, i ? "," : "", capinfo_size_names[i], p->sizes[i]);
+    fprintf(out,
+            "},\"avg_pps\":%.2f,\"avg_bps\":%.0f,\"peak_pps\":%" PRIu64 ",\"peak_bps\":%" PRIu64,
+            avg_pps,
+            avg_bps,
+            p->peak_pps,
+            p->peak_bps);
+    fprintf(out, ",\"flows\":%" PRIu64 ",\"non_ip\":%" PRIu64, p->flows, p->non_ip);
+    fprintf(out,
+            ",\"preload_bytes\":%" PRIu64 ",\"ram_bytes\":%" PRIu64 ",\"preload_fits\":%s",
+            preload,
+            p->ram,
+            p->ram == 0 || preload <= p->ram ? "true" : "false");
+    fprintf(out,
+            ",\"link_bps\":%" PRIu64 ",\"max_multiplier\":%.2f,\"damaged\":%s}\n",
+            p->link_bps,
+            capinfo_max_multiplier(p->link_bps, p->peak_bps),
+            file->stats.damaged ? "true" : "false");
+}
+
+/*
+ * Dissect one file, writing the results to file->out
+ */
+static void
+capinfo_file(capinfo_file_t *file, bool summary, bool fcs)
+{
+    int fd, swapped, pkthdrlen, backwards, caplentoobig;
     struct pcap_file_header pcap_fh;
     struct pcap_pkthdr pcap_ph;
     struct pcap_sf_patched_pkthdr pcap_patched_ph; /* Kuznetzov */
-    char buf[UINT16_MAX];
+    capinfo_reader_t reader;
+    const u_char *buf;
     struct stat statinfo;
     uint64_t pktcnt;
-    uint32_t readword;
-    int32_t last_sec, last_usec, caplen, maxread;
+    uint32_t readword, wirelen;
+    int32_t last_sec, last_usec, ts_sec, ts_usec, caplen, maxread;
+    bool badfcs;
+    /* --profile prints nothing until the end, as JSON */
+    bool verbose = !summary && file->profile == NULL;
+    FILE *out = file->out;
     ssize_t ret;
 
-    optct = optionProcess(&tcpcapinfoOptions, argc, argv);
-    argc -= optct;
-    argv += optct;
+    dbgx(1, "processing:  %s\n", file->path);
+    if (remote_is_url(file->path)) {
+        char ebuf[PCAP_ERRBUF_SIZE];
 
-#ifdef DEBUG
-    if (HAVE_OPT(DBUG))
-        debug = OPT_VALUE_DBUG;
-#endif
+        if ((fd = remote_open(file->path, ebuf)) < 0)
+            errx(-1, "Error opening file %s: %s", file->path, ebuf);
+    } else if (decompress_detect(file->path) != DECOMPRESS_NONE) {
+        char ebuf[PCAP_ERRBUF_SIZE];
 
-    for (i = 0; i < argc; i++) {
-        dbgx(1, "processing:  %s\n", argv[i]);
-        if ((fd = open(argv[i], O_RDONLY)) < 0)
-            errx(-1, "Error opening file %s: %s", argv[i], strerror(errno));
+        if ((fd = decompress_open(file->path, ebuf)) < 0)
+            errx(-1, "Error opening file %s: %s", file->path, ebuf);
+    } else if ((fd = open(file->path, O_RDONLY)) < 0) {
+        errx(-1, "Error opening file %s: %s", file->path, strerror(errno));
+    }
 
-        if (fstat(fd, &statinfo) < 0)
-            errx(-1, "Error getting file stat info %s: %s", argv[i], strerror(errno));
+    /* the size of a URL isn't known here */
+    if (!remote_is_url(file->path)) {
+        if (stat(file->path, &statinfo) < 0)
+            errx(-1, "Error getting file stat info %s: %s", file->path, strerror(errno));
 
-        printf("file size   = %" PRIu64 " bytes\n", (uint64_t)statinfo.st_size);
+        if (verbose)
+            fprintf(out, "file size   = %" PRIu64 " bytes\n", (uint64_t)statinfo.st_size);
+    }
 
-        if ((ret = read(fd, &buf, sizeof(pcap_fh))) != (int)sizeof(pcap_fh))
-            errx(-1, "File too small.  Unable to read pcap_file_header from %s", argv[i]);
+    reader.fd = fd;
+    reader.buf = safe_malloc(CAPINFO_BLOCK);
+    reader.start = reader.end = 0;
 
-        dbgx(3, "Read %ld bytes for file header", ret);
+    if ((buf = reader_next(&reader, sizeof(pcap_fh), &ret)) == NULL)
+        errx(-1, "File too small.  Unable to read pcap_file_header from %s", file->path);
 
-        swapped = 0;
+    dbgx(3, "Read %ld bytes for file header", ret);
 
-        memcpy(&pcap_fh, &buf, sizeof(pcap_fh));
+    swapped = 0;
 
-        pkthdrlen = 16; /* pcap_pkthdr isn't the actual on-disk format for 64bit systems! */
+    memcpy(&pcap_fh, buf, sizeof(pcap_fh));
 
-        switch (pcap_fh.magic) {
-        case TCPDUMP_MAGIC:
-            printf("magic       = 0x%08" PRIx32 " (tcpdump) (%s)\n", pcap_fh.magic, is_not_swapped);
-            break;
+    pkthdrlen = 16; /* pcap_pkthdr isn't the actual on-disk format for 64bit systems! */
 
-        case SWAPLONG(TCPDUMP_MAGIC):
-            printf("magic       = 0x%08" PRIx32 " (tcpdump/swapped) (%s)\n", pcap_fh.magic, is_swapped);
-            swapped = 1;
-            break;
+    switch (pcap_fh.magic) {
+    case TCPDUMP_MAGIC:
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (tcpdump) (%s)\n", pcap_fh.magic, is_not_swapped);
+        break;
 
-        case KUZNETZOV_TCPDUMP_MAGIC:
-            pkthdrlen = sizeof(pcap_patched_ph);
-            printf("magic       = 0x%08" PRIx32 " (Kuznetzov) (%s)\n", pcap_fh.magic, is_not_swapped);
-            break;
+    case SWAPLONG(TCPDUMP_MAGIC):
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (tcpdump/swapped) (%s)\n", pcap_fh.magic, is_swapped);
+        swapped = 1;
+        break;
 
-        case SWAPLONG(KUZNETZOV_TCPDUMP_MAGIC):
-            pkthdrlen = sizeof(pcap_patched_ph);
-            printf("magic       = 0x%08" PRIx32 " (Kuznetzov/swapped) (%s)\n", pcap_fh.magic, is_swapped);
-            swapped = 1;
-            break;
+    case KUZNETZOV_TCPDUMP_MAGIC:
+        pkthdrlen = sizeof(pcap_patched_ph);
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (Kuznetzov) (%s)\n", pcap_fh.magic, is_not_swapped);
+        break;
 
-        case FMESQUITA_TCPDUMP_MAGIC:
-            printf("magic       = 0x%08" PRIx32 " (Fmesquita) (%s)\n", pcap_fh.magic, is_not_swapped);
-            break;
+    case SWAPLONG(KUZNETZOV_TCPDUMP_MAGIC):
+        pkthdrlen = sizeof(pcap_patched_ph);
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (Kuznetzov/swapped) (%s)\n", pcap_fh.magic, is_swapped);
+        swapped = 1;
+        break;
 
-        case SWAPLONG(FMESQUITA_TCPDUMP_MAGIC):
-            printf("magic       = 0x%08" PRIx32 " (Fmesquita) (%s)\n", pcap_fh.magic, is_swapped);
-            swapped = 1;
-            break;
+    case FMESQUITA_TCPDUMP_MAGIC:
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (Fmesquita) (%s)\n", pcap_fh.magic, is_not_swapped);
+        break;
 
-        case NAVTEL_TCPDUMP_MAGIC:
-            printf("magic       = 0x%08" PRIx32 " (Navtel) (%s)\n", pcap_fh.magic, is_not_swapped);
-            break;
+    case SWAPLONG(FMESQUITA_TCPDUMP_MAGIC):
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (Fmesquita) (%s)\n", pcap_fh.magic, is_swapped);
+        swapped = 1;
+        break;
 
-        case SWAPLONG(NAVTEL_TCPDUMP_MAGIC):
-            printf("magic       = 0x%08" PRIx32 " (Navtel/swapped) (%s)\n", pcap_fh.magic, is_swapped);
-            swapped = 1;
-            break;
+    case NAVTEL_TCPDUMP_MAGIC:
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (Navtel) (%s)\n", pcap_fh.magic, is_not_swapped);
+        break;
 
-        case NSEC_TCPDUMP_MAGIC:
-            printf("magic       = 0x%08" PRIx32 " (Nsec) (%s)\n", pcap_fh.magic, is_not_swapped);
-            break;
+    case SWAPLONG(NAVTEL_TCPDUMP_MAGIC):
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (Navtel/swapped) (%s)\n", pcap_fh.magic, is_swapped);
+        swapped = 1;
+        break;
 
-        case SWAPLONG(NSEC_TCPDUMP_MAGIC):
-            printf("magic       = 0x%08" PRIx32 " (Nsec/swapped) (%s)\n", pcap_fh.magic, is_swapped);
-            swapped = 1;
-            break;
+    case NSEC_TCPDUMP_MAGIC:
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (Nsec) (%s)\n", pcap_fh.magic, is_not_swapped);
+        break;
 
-        default:
-            printf("magic       = 0x%08" PRIx32 " (unknown)\n", pcap_fh.magic);
-        }
+    case SWAPLONG(NSEC_TCPDUMP_MAGIC):
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (Nsec/swapped) (%s)\n", pcap_fh.magic, is_swapped);
+        swapped = 1;
+        break;
 
-        if (swapped == 1) {
-            pcap_fh.version_major = SWAPSHORT(pcap_fh.version_major);
-            pcap_fh.version_minor = SWAPSHORT(pcap_fh.version_minor);
-            pcap_fh.thiszone = SWAPLONG(pcap_fh.thiszone);
-            pcap_fh.sigfigs = SWAPLONG(pcap_fh.sigfigs);
-            pcap_fh.snaplen = SWAPLONG(pcap_fh.snaplen);
-            pcap_fh.linktype = SWAPLONG(pcap_fh.linktype);
-        }
+    default:
+        if (verbose)
+            fprintf(out, "magic       = 0x%08" PRIx32 " (unknown)\n", pcap_fh.magic);
+    }
 
-        printf("version     = %hu.%hu\n", pcap_fh.version_major, pcap_fh.version_minor);
-        printf("thiszone    = 0x%08" PRIx32 "\n", pcap_fh.thiszone);
-        printf("sigfigs     = 0x%08" PRIx32 "\n", pcap_fh.sigfigs);
-        printf("snaplen     = %" PRIu32 "\n", pcap_fh.snaplen);
-        printf("linktype    = 0x%08" PRIx32 "\n", pcap_fh.linktype);
+    if (swapped == 1) {
+        pcap_fh.version_major = SWAPSHORT(pcap_fh.version_major);
+        pcap_fh.version_minor = SWAPSHORT(pcap_fh.version_minor);
+        pcap_fh.thiszone = SWAPLONG(pcap_fh.thiszone);
+        pcap_fh.sigfigs = SWAPLONG(pcap_fh.sigfigs);
+        pcap_fh.snaplen = SWAPLONG(pcap_fh.snaplen);
+        pcap_fh.linktype = SWAPLONG(pcap_fh.linktype);
+    }
 
-        if (pcap_fh.version_major != 2 && pcap_fh.version_minor != 4) {
-            printf("Sorry, we only support file format version 2.4\n");
-            close(fd);
-            continue;
-        }
+    if (file->profile != NULL)
+        capinfo_profile_start(file->profile,
+                              pcap_fh.linktype,
+                              pcap_fh.magic == NSEC_TCPDUMP_MAGIC || pcap_fh.magic == SWAPLONG(NSEC_TCPDUMP_MAGIC));
 
-        dbgx(5, "Packet header len: %d", pkthdrlen);
+    if (verbose) {
+        fprintf(out, "version     = %hu.%hu\n", pcap_fh.version_major, pcap_fh.version_minor);
+        fprintf(out, "thiszone    = 0x%08" PRIx32 "\n", pcap_fh.thiszone);
+        fprintf(out, "sigfigs     = 0x%08" PRIx32 "\n", pcap_fh.sigfigs);
+        fprintf(out, "snaplen     = %" PRIu32 "\n", pcap_fh.snaplen);
+        fprintf(out, "linktype    = 0x%08" PRIx32 "\n", pcap_fh.linktype);
+    }
 
-        if (pkthdrlen == 24) {
-            printf("Packet\tOrigLen\t\tCaplen\t\tTimestamp\t\tIndex\tProto\tPktType\tPktCsum\tNote\n");
-        } else {
-            printf("Packet\tOrigLen\t\tCaplen\t\tTimestamp\tCsum\tNote\n");
-        }
+    if (pcap_fh.version_major != 2 && pcap_fh.version_minor != 4) {
+        if (summary)
+            fprintf(out, "%s: unsupported file format version %hu.%hu\n",
+                    file->path, pcap_fh.version_major, pcap_fh.version_minor);
+        else if (verbose)
+            fprintf(out, "Sorry, we only support file format version 2.4\n");
+        file->stats.damaged = true;
+        goto done;
+    }
+
+    dbgx(5, "Packet header len: %d", pkthdrlen);
+
+    if (!verbose) {
+        /* nothing per packet */
+    } else if (pkthdrlen == 24) {
+        fprintf(out, "Packet\tOrigLen\t\tCaplen\t\tTimestamp\t\tIndex\tProto\tPktType\tPktCsum\tNote\n");
+    } else {
+        fprintf(out, "Packet\tOrigLen\t\tCaplen\t\tTimestamp\tCsum\tNote\n");
+    }
+
+    pktcnt = 0;
+    last_sec = 0;
+    last_usec = 0;
+    while ((buf = reader_next(&reader, (size_t)pkthdrlen, &ret)) != NULL) {
+        pktcnt++;
+        file->stats.packets = pktcnt;
+        backwards = 0;
+        caplentoobig = 0;
+        dbgx(3, "Read %ld bytes for packet %" PRIu64 " header", ret, pktcnt);
 
-        pktcnt = 0;
-        last_sec = 0;
-        last_usec = 0;
-        while ((ret = read(fd, &buf, (size_t)pkthdrlen)) == pkthdrlen) {
-            pktcnt++;
-            backwards = 0;
-            caplentoobig = 0;
-            dbgx(3, "Read %ld bytes for packet %" PRIu64 " header", ret, pktcnt);
-
-            memset(&pcap_ph, 0, sizeof(pcap_ph));
-
-            /* see what packet header we're using */
-            if (pkthdrlen == sizeof(pcap_patched_ph)) {
-                memcpy(&pcap_patched_ph, &buf, sizeof(pcap_patched_ph));
-
-                if (swapped == 1) {
-                    dbg(3, "Swapping packet header bytes...");
-                    pcap_patched_ph.caplen = SWAPLONG(pcap_patched_ph.caplen);
-                    pcap_patched_ph.len = SWAPLONG(pcap_patched_ph.len);
-                    pcap_patched_ph.ts.tv_sec = SWAPLONG(pcap_patched_ph.ts.tv_sec);
-                    pcap_patched_ph.ts.tv_usec = SWAPLONG(pcap_patched_ph.ts.tv_usec);
-                    pcap_patched_ph.index = SWAPLONG(pcap_patched_ph.index);
-                    pcap_patched_ph.protocol = SWAPSHORT(pcap_patched_ph.protocol);
-                }
-                printf("%" PRIu64 "\t%4" PRIu32 "\t\t%4" PRIu32 "\t\t%" PRIx32 ".%" PRIx32 "\t\t%4" PRIu32
-                       "\t%4hu\t%4hhu",
-                       pktcnt,
-                       pcap_patched_ph.len,
-                       pcap_patched_ph.caplen,
-                       pcap_patched_ph.ts.tv_sec,
-                       pcap_patched_ph.ts.tv_usec,
-                       pcap_patched_ph.index,
-                       pcap_patched_ph.protocol,
-                       pcap_patched_ph.pkt_type);
-
-                if (pcap_fh.snaplen < pcap_patched_ph.caplen) {
-                    caplentoobig = 1;
-                }
-
-                caplen = (int32_t)pcap_patched_ph.caplen;
-
-            } else {
-                /* manually map on-disk bytes to our memory structure */
-                memcpy(&readword, buf, 4);
-                pcap_ph.ts.tv_sec = readword;
-                memcpy(&readword, &buf[4], 4);
-                pcap_ph.ts.tv_usec = readword;
-                memcpy(&pcap_ph.caplen, &buf[8], 4);
-                memcpy(&pcap_ph.len, &buf[12], 4);
-
-                if (swapped == 1) {
-                    dbg(3, "Swapping packet header bytes...");
-                    pcap_ph.caplen = SWAPLONG(pcap_ph.caplen);
-                    pcap_ph.len = SWAPLONG(pcap_ph.len);
-                    pcap_ph.ts.tv_sec = SWAPLONG(pcap_ph.ts.tv_sec);
-                    pcap_ph.ts.tv_usec = SWAPLONG(pcap_ph.ts.tv_usec);
-                }
-                printf("%" PRIu64 "\t%4" PRIu32 "\t\t%4" PRIu32 "\t\t%" PRIx32 ".%" PRIx32,
-                       pktcnt,
-                       pcap_ph.len,
-                       pcap_ph.caplen,
-                       (unsigned int)pcap_ph.ts.tv_sec,
-                       (unsigned int)pcap_ph.ts.tv_usec);
-                if (pcap_fh.snaplen < pcap_ph.caplen || pcap_ph.caplen > MAX_SNAPLEN) {
-                    caplentoobig = 1;
-                }
-                caplen = (int32_t)pcap_ph.caplen;
+        memset(&pcap_ph, 0, sizeof(pcap_ph));
+
+        /* see what packet header we're using */
+        if (pkthdrlen == sizeof(pcap_patched_ph)) {
+            memcpy(&pcap_patched_ph, buf, sizeof(pcap_patched_ph));
+
+            if (swapped == 1) {
+                dbg(3, "Swapping packet header bytes...");
+                pcap_patched_ph.caplen = SWAPLONG(pcap_patched_ph.caplen);
+                pcap_patched_ph.len = SWAPLONG(pcap_patched_ph.len);
+                pcap_patched_ph.ts.tv_sec = SWAPLONG(pcap_patched_ph.ts.tv_sec);
+                pcap_patched_ph.ts.tv_usec = SWAPLONG(pcap_patched_ph.ts.tv_usec);
+                pcap_patched_ph.index = SWAPLONG(pcap_patched_ph.index);
+                pcap_patched_ph.protocol = SWAPSHORT(pcap_patched_ph.protocol);
+            }
+            if (verbose)
+                fprintf(out,
+                        "%" PRIu64 "\t%4" PRIu32 "\t\t%4" PRIu32 "\t\t%" PRIx32 ".%" PRIx32 "\t\t%4" PRIu32
+                        "\t%4hu\t%4hhu",
+                        pktcnt,
+                        pcap_patched_ph.len,
+                        pcap_patched_ph.caplen,
+                        pcap_patched_ph.ts.tv_sec,
+                        pcap_patched_ph.ts.tv_usec,
+                        pcap_patched_ph.index,
+                        pcap_patched_ph.protocol,
+                        pcap_patched_ph.pkt_type);
+
+            if (pcap_fh.snaplen < pcap_patched_ph.caplen) {
+                caplentoobig = 1;
             }
 
-            /* check to make sure timestamps don't go backwards */
-            if (last_sec > 0 && last_usec > 0) {
-                if ((pcap_ph.ts.tv_sec == last_sec) ? (pcap_ph.ts.tv_usec < last_usec)
-                                                    : (pcap_ph.ts.tv_sec < last_sec)) {
-                    backwards = 1;
-                }
+            caplen = (int32_t)pcap_patched_ph.caplen;
+            wirelen = pcap_patched_ph.len;
+            ts_sec = pcap_patched_ph.ts.tv_sec;
+            ts_usec = pcap_patched_ph.ts.tv_usec;
+
+        } else {
+            /* manually map on-disk bytes to our memory structure */
+            memcpy(&readword, buf, 4);
+            pcap_ph.ts.tv_sec = readword;
+            memcpy(&readword, &buf[4], 4);
+            pcap_ph.ts.tv_usec = readword;
+            memcpy(&pcap_ph.caplen, &buf[8], 4);
+            memcpy(&pcap_ph.len, &buf[12], 4);
+
+            if (swapped == 1) {
+                dbg(3, "Swapping packet header bytes...");
+                pcap_ph.caplen = SWAPLONG(pcap_ph.caplen);
+                pcap_ph.len = SWAPLONG(pcap_ph.len);
+                pcap_ph.ts.tv_sec = SWAPLONG(pcap_ph.ts.tv_sec);
+                pcap_ph.ts.tv_usec = SWAPLONG(pcap_ph.ts.tv_usec);
             }
-            if (pkthdrlen == sizeof(pcap_patched_ph)) {
-                last_sec = pcap_patched_ph.ts.tv_sec;
-                last_usec = pcap_patched_ph.ts.tv_usec;
-            } else {
-                last_sec = (int32_t)pcap_ph.ts.tv_sec;
-                last_usec = (int32_t)pcap_ph.ts.tv_usec;
+            if (verbose)
+                fprintf(out,
+                        "%" PRIu64 "\t%4" PRIu32 "\t\t%4" PRIu32 "\t\t%" PRIx32 ".%" PRIx32,
+                        pktcnt,
+                        pcap_ph.len,
+                        pcap_ph.caplen,
+                        (unsigned int)pcap_ph.ts.tv_sec,
+                        (unsigned int)pcap_ph.ts.tv_usec);
+            if (pcap_fh.snaplen < pcap_ph.caplen || pcap_ph.caplen > MAX_SNAPLEN) {
+                caplentoobig = 1;
             }
+            caplen = (int32_t)pcap_ph.caplen;
+            wirelen = pcap_ph.len;
+            ts_sec = (int32_t)pcap_ph.ts.tv_sec;
+            ts_usec = (int32_t)pcap_ph.ts.tv_usec;
+        }
 
-            /* read the frame */
-            maxread = min((size_t)caplen, sizeof(buf));
-            if ((ret = read(fd, &buf, maxread)) != maxread) {
-                if (ret < 0) {
-                    printf("Error reading file: %s: %s\n", argv[i], strerror(errno));
-                } else {
-                    printf("File truncated!  Unable to jump to next packet.\n");
-                }
-
-                close(fd);
-                break;
+        /* check to make sure timestamps don't go backwards */
+        if (last_sec > 0 && last_usec > 0) {
+            if ((ts_sec == last_sec) ? (ts_usec < last_usec) : (ts_sec < last_sec)) {
+                backwards = 1;
             }
+        }
+        last_sec = ts_sec;
+        last_usec = ts_usec;
+
+        /* read the frame */
+        maxread = min((uint32_t)caplen, CAPINFO_MAX_FRAME);
+        if ((buf = reader_next(&reader, (size_t)maxread, &ret)) == NULL) {
+            if (summary)
+                fprintf(out, "%s: packet %" PRIu64 ": %s\n", file->path, pktcnt,
+                        ret < 0 ? strerror(errno) : "file truncated");
+            else if (verbose && ret < 0)
+                fprintf(out, "Error reading file: %s: %s\n", file->path, strerror(errno));
+            else if (verbose)
+                fprintf(out, "File truncated!  Unable to jump to next packet.\n");
+
+            file->stats.damaged = true;
+            break;
+        }
+
+        file->stats.bytes += (uint64_t)maxread;
+        if (file->profile != NULL)
+            capinfo_profile_add(file->profile, ts_sec, ts_usec, wirelen, buf, (uint32_t)maxread);
 
-            /* print the frame checksum */
-            printf("\t%x\t", do_checksum_math((u_int16_t *)buf, maxread));
-
-            /* print the Note */
-            if (!backwards && !caplentoobig)
-                printf("OK\n");
-            else if (backwards && !caplentoobig)
-                printf("BAD_TS\n");
-            else if (caplentoobig && !backwards)
-                printf("TOOBIG\n");
-            else if (backwards && caplentoobig)
-                printf("BAD_TS|TOOBIG");
-
-            if (caplentoobig) {
-                printf("\n\nCapture file appears to be damaged or corrupt.\n"
-                       "Contains packet of size %d, bigger than snap length %u\n",
-                       caplen,
-                       pcap_fh.snaplen);
-
-                close(fd);
-                break;
+        /* with --fcs, frames captured whole end in their FCS */
+        badfcs = fcs && !caplentoobig && pcap_fh.linktype == DLT_EN10MB && maxread == caplen &&
+                 (uint32_t)caplen == wirelen && !tcpr_fcs_ok(buf, (size_t)maxread);
+
+        if (summary) {
+            /* anomalies only */
+            if (backwards)
+                capinfo_note(file, summary, CAPINFO_BAD_TS);
+            if (caplentoobig)
+                capinfo_note(file, summary, CAPINFO_TOOBIG);
+            else if (capinfo_bad_csum(pcap_fh.linktype, buf, (uint32_t)maxread))
+                capinfo_note(file, summary, CAPINFO_BAD_CSUM);
+            if (badfcs)
+                capinfo_note(file, summary, CAPINFO_BAD_FCS);
+        } else {
+            if (verbose) {
+                /* print the frame checksum */
+                fprintf(out, "\t%x\t", tcpr_csum_partial(buf, maxread, 0));
+
+                /* print the Note */
+                if (!backwards && !caplentoobig && !badfcs)
+                    fprintf(out, "OK\n");
+                else
+                    fprintf(out,
+                            "%s%s%s%s%s\n",
+                            backwards ? "BAD_TS" : "",
+                            backwards && caplentoobig ? "|" : "",
+                            caplentoobig ? "TOOBIG" : "",
+                            (backwards || caplentoobig) && badfcs ? "|" : "",
+                            badfcs ? "BAD_FCS" : "");
             }
+
+            if (backwards)
+                capinfo_note(file, summary, CAPINFO_BAD_TS);
+            if (caplentoobig)
+                capinfo_note(file, summary, CAPINFO_TOOBIG);
+            if (badfcs)
+                capinfo_note(file, summary, CAPINFO_BAD_FCS);
+        }
+
+        if (caplentoobig) {
+            if (verbose)
+                fprintf(out,
+                        "\n\nCapture file appears to be damaged or corrupt.\n"
+                        "Contains packet of size %d, bigger than snap length %u\n",
+                        caplen,
+                        pcap_fh.snaplen);
+
+            file->stats.damaged = true;
+            break;
         }
     }
 
-    restore_stdin();
-    return 0;
+    if (buf == NULL && ret != 0 && !file->stats.damaged) {
+        /* a partial record header, or a read error, at the end of the file */
+        if (summary)
+            fprintf(out, "%s: packet %" PRIu64 ": %s\n", file->path, pktcnt + 1,
+                    ret < 0 ? strerror(errno) : "file truncated");
+        file->stats.damaged = true;
+    }
+
+done:
+    if (summary) {
+        int n;
+
+        fprintf(out, "%s: %" PRIu64 " packets, %" PRIu64 " bytes", file->path, file->stats.packets,
+                file->stats.bytes);
+        for (n = 0; n < CAPINFO_NOTES; n++) {
+            if (file->stats.notes[n])
+                fprintf(out, ", %" PRIu64 " %s", file->stats.notes[n], capinfo_note_names[n]);
+        }
+        fprintf(out, "%s\n", file->stats.damaged ? ", DAMAGED" : "");
+    }
+
+    if (file->profile != NULL)
+        capinfo_profile_end(file);
+
+    safe_free(reader.buf);
+    close(fd);
+}
+
+/*
+ * Copy a finished file's output, buffered by a worker thread, to stdout
+ */
+static void
+capinfo_flush(capinfo_file_t *file)
+{
+    char copy[BUFSIZ];
+    size_t len;
+
+    if (file->out == stdout)
+        return;
+
+    rewind(file->out);
+    while ((len = fread(copy, 1, sizeof(copy), file->out)) > 0)
+        fwrite(copy, 1, len, stdout);
+
+    fclose(file->out);
+    file->out = stdout;
 }
 
-/**
- * code to do a ones-compliment checksum
+/*
+ * the --profile of all the files, replayed one after the other by a single
+ * tcpreplay: the busiest of them sets the rate, and they are all preloaded
  */
-static int
-do_checksum_math(u_int16_t *data, int len)
+static void
+capinfo_profile_total(const capinfo_t *ctx)
 {
-    int sum = 0;
-    union {
-        u_int16_t s;
-        u_int8_t b[2];
-    } pad;
-
-    while (len > 1) {
-        sum += *data++;
-        len -= 2;
+    uint32_t linktypes[CAPINFO_MAX_LINKTYPES];
+    uint64_t linktype_pkts[CAPINFO_MAX_LINKTYPES];
+    uint64_t packets = 0, bytes = 0, flows = 0, preload = 0, peak_pps = 0, peak_bps = 0, ram = 0, link_bps = 0;
+    int i, n, num_linktypes = 0;
+
+    for (i = 0; i < ctx->num_files; i++) {
+        const capinfo_file_t *file = &ctx->files[i];
+        const capinfo_profile_t *p = file->profile;
+
+        packets += file->stats.packets;
+        bytes += file->stats.bytes;
+        flows += p->flows;
+        preload += capinfo_preload_bytes(&file->stats);
+        peak_pps = max(peak_pps, p->peak_pps);
+        peak_bps = max(peak_bps, p->peak_bps);
+        ram = p->ram;
+        link_bps = p->link_bps;
+
+        for (n = 0; n < num_linktypes && linktypes[n] != p->linktype; n++)
+            ;
+        if (n == num_linktypes && num_linktypes < CAPINFO_MAX_LINKTYPES) {
+            linktypes[n] = p->linktype;
+            linktype_pkts[n] = 0;
+            num_linktypes++;
+        }
+        if (n < num_linktypes)
+            linktype_pkts[n] += file->stats.packets;
     }
 
-    if (len == 1) {
-        pad.b[0] = *(u_int8_t *)data;
-        pad.b[1] = 0;
-        sum += pad.s;
+    printf("{\"total\":{\"files\":%d,\"packets\":%" PRIu64 ",\"bytes\":%" PRIu64 ",\"dlts\":{",
+           ctx->num_files,
+           packets,
+           bytes);
+    for (n = 0; n < num_linktypes; n++) {
+        const char *dlt = pcap_datalink_val_to_name(linktypes[n] == LINKTYPE_RAW ? DLT_RAW : (int)linktypes[n]);
+
+        if (n)
+            putchar(',');
+        capinfo_json_string(stdout, dlt != NULL ? dlt : "unknown");
+        printf(":%" PRIu64, linktype_pkts[n]);
     }
+    printf("},\"flows\":%" PRIu64 ",\"peak_pps\":%" PRIu64 ",\"peak_bps\":%" PRIu64, flows, peak_pps, peak_bps);
+    printf(",\"preload_bytes\":%" PRIu64 ",\"ram_bytes\":%" PRIu64 ",\"preload_fits\":%s",
+           preload,
+           ram,
+           ram == 0 || preload <= ram ? "true" : "false");
+    printf(",\"link_bps\":%" PRIu64 ",\"max_multiplier\":%.2f}}\n",
+           link_bps,
+           capinfo_max_multiplier(link_bps, peak_bps));
+}
 
-    return (sum);
+#ifdef HAVE_PTHREAD
+/*
+ * Worker thread, takes the next file until there are none left
+ */
+static void *
+capinfo_thread(void *arg)
+{
+    capinfo_t *ctx = (capinfo_t *)arg;
+    int i;
+
+    while ((i = __sync_fetch_and_add(&ctx->next_file, 1)) < ctx->num_files) {
+        capinfo_file_t *file = &ctx->files[i];
+
+        capinfo_file(file, ctx->summary, ctx->fcs);
+
+        pthread_mutex_lock(&ctx->lock);
+        file->done = true;
+        pthread_cond_broadcast(&ctx->file_done);
+        pthread_mutex_unlock(&ctx->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Dissect files in parallel.  Each file's output is buffered in a
+ * temporary file and printed, in the order given, once it is done.
+ */
+static void
+capinfo_threads(capinfo_t *ctx, int num_threads)
+{
+    pthread_t threads[CAPINFO_MAX_THREADS];
+    int i;
+
+    for (i = 0; i < ctx->num_files; i++) {
+        if ((ctx->files[i].out = tmpfile()) == NULL)
+            errx(-1, "Unable to create temporary file: %s", strerror(errno));
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->file_done, NULL);
+
+    for (i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, capinfo_thread, ctx) != 0)
+            errx(-1, "Unable to create thread %d", i);
+    }
+
+    for (i = 0; i < ctx->num_files; i++) {
+        pthread_mutex_lock(&ctx->lock);
+        while (!ctx->files[i].done)
+            pthread_cond_wait(&ctx->file_done, &ctx->lock);
+        pthread_mutex_unlock(&ctx->lock);
+
+        capinfo_flush(&ctx->files[i]);
+    }
+
+    for (i = 0; i < num_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&ctx->file_done);
+    pthread_mutex_destroy(&ctx->lock);
+}
+#endif /* HAVE_PTHREAD */
+
+int
+main(int argc, char *argv[])
+{
+    capinfo_t ctx;
+    capinfo_stats_t total;
+    capinfo_profile_t *profiles = NULL;
+    int i, n, optct, num_threads = 1;
+
+    optct = optionProcess(&tcpcapinfoOptions, argc, argv);
+    argc -= optct;
+    argv += optct;
+
+#ifdef DEBUG
+    if (HAVE_OPT(DBUG))
+        debug = OPT_VALUE_DBUG;
+#endif
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.summary = HAVE_OPT(SUMMARY);
+    ctx.fcs = HAVE_OPT(FCS);
+    ctx.num_files = argc;
+    ctx.files = safe_malloc(sizeof(capinfo_file_t) * (argc ? argc : 1));
+    for (i = 0; i < argc; i++) {
+        ctx.files[i].path = argv[i];
+        ctx.files[i].out = stdout;
+    }
+
+    if (HAVE_OPT(PROFILE)) {
+        uint64_t ram = 0;
+
+#ifdef _SC_PHYS_PAGES
+        if (sysconf(_SC_PHYS_PAGES) > 0 && sysconf(_SC_PAGESIZE) > 0)
+            ram = (uint64_t)sysconf(_SC_PHYS_PAGES) * (uint64_t)sysconf(_SC_PAGESIZE);
+#endif
+        profiles = safe_malloc(sizeof(capinfo_profile_t) * (argc ? argc : 1));
+        for (i = 0; i < argc; i++) {
+            profiles[i].link_bps = (uint64_t)OPT_VALUE_LINK_SPEED * 1000000;
+            profiles[i].ram = ram;
+            ctx.files[i].profile = &profiles[i];
+        }
+    }
+
+#ifdef HAVE_PTHREAD
+    if (HAVE_OPT(THREADS))
+        num_threads = min((int)OPT_VALUE_THREADS, argc);
+#endif
+
+    if (num_threads > 1) {
+#ifdef HAVE_PTHREAD
+        capinfo_threads(&ctx, num_threads);
+#endif
+    } else {
+        for (i = 0; i < argc; i++)
+            capinfo_file(&ctx.files[i], ctx.summary, ctx.fcs);
+    }
+
+    if (ctx.summary) {
+        int damaged = 0;
+
+        memset(&total, 0, sizeof(total));
+        for (i = 0; i < argc; i++) {
+            total.packets += ctx.files[i].stats.packets;
+            total.bytes += ctx.files[i].stats.bytes;
+            for (n = 0; n < CAPINFO_NOTES; n++)
+                total.notes[n] += ctx.files[i].stats.notes[n];
+            if (ctx.files[i].stats.damaged)
+                damaged++;
+        }
+
+        printf("total: %d files, %" PRIu64 " packets, %" PRIu64 " bytes", argc, total.packets, total.bytes);
+        for (n = 0; n < CAPINFO_NOTES; n++)
+            printf(", %" PRIu64 " %s", total.notes[n], capinfo_note_names[n]);
+        printf(", %d DAMAGED\n", damaged);
+    }
+
+    if (profiles != NULL) {
+        capinfo_profile_total(&ctx);
+        safe_free(profiles);
+    }
+
+    safe_free(ctx.files);
+
+    if (HAVE_OPT(INDEX)) {
+        for (i = 0; i < argc; i++) {
+            char ebuf[PCAP_ERRBUF_SIZE];
+            char *idxfile = pcap_index_path(argv[i]);
+            pcap_index_t *index;
+
+            if ((index = pcap_index_build(argv[i], (u_int32_t)OPT_VALUE_INDEX_INTERVAL, ebuf)) == NULL ||
+                pcap_index_write(index, idxfile, ebuf) < 0)
+                errx(-1, "Unable to index %s: %s", argv[i], ebuf);
+
+            printf("wrote index %s: " COUNTER_SPEC " packets, " COUNTER_SPEC " entries\n",
+                   idxfile, index->num_packets, index->num_entries);
+            pcap_index_free(index);
+            safe_free(idxfile);
+        }
+    }
+
+    restore_stdin();
+    return 0;
 }
@@ -0,0 +1,148 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "addr_cache.h"
+#include "config.h"
+#include "common.h"
+#include <string.h>
+#include <sys/socket.h>
+
+static inline size_t
+addr_len(int family)
+{
+    return family == AF_INET6 ? sizeof(struct tcpr_in6_addr) : sizeof(uint32_t);
+}
+
+static inline uint32_t
+addr_hash(addr_cache_kind_t kind, int family, const void *addr)
+{
+    uint32_t w[4] = {0, 0, 0, 0};
+    uint64_t h;
+
+    memcpy(w, addr, addr_len(family));
+    h = ((uint64_t)w[0] << 32 | w[1]) * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)w[2] << 32 | w[3]) + kind;
+    h *= 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(h >> 32);
+}
+
+static inline bool
+addr_match(const addr_cache_entry_t *e, addr_cache_kind_t kind, int family, const void *addr)
+{
+    return e->kind == kind && e->family == family && memcmp(&e->from, addr, addr_len(family)) == 0;
+}
+
+/**
+ * \brief the entry for addr rewritten the kind of way, NULL if there is none
+ */
+addr_cache_entry_t *
+addr_cache_find(const addr_cache_t *cache, addr_cache_kind_t kind, int family, const void *addr)
+{
+    uint32_t i, mask;
+
+    if (cache->entries == NULL)
+        return NULL;
+
+    mask = cache->size - 1;
+    for (i = addr_hash(kind, family, addr) & mask; cache->entries[i].kind != ADDR_CACHE_FREE; i = (i + 1) & mask) {
+        if (addr_match(&cache->entries[i], kind, family, addr))
+            return &cache->entries[i];
+    }
+
+    return NULL;
+}
+
+static addr_cache_entry_t *
+addr_cache_slot(addr_cache_entry_t *entries, uint32_t size, addr_cache_kind_t kind, int family, const void *addr)
+{
+    uint32_t i, mask = size - 1;
+
+    for (i = addr_hash(kind, family, addr) & mask; entries[i].kind != ADDR_CACHE_FREE; i = (i + 1) & mask)
+        ;
+
+    return &entries[i];
+}
+
+/* keep the table at most half full */
+static bool
+addr_cache_grow(addr_cache_t *cache)
+{
+    addr_cache_entry_t *entries;
+    uint32_t i, size;
+
+    if (cache->cnt >= ADDR_CACHE_MAX)
+        return false;
+
+    if (cache->entries != NULL && (cache->cnt + 1) * 2 <= cache->size)
+        return true;
+
+    size = cache->entries ? cache->size * 2 : ADDR_CACHE_MIN;
+    entries = safe_malloc(sizeof(addr_cache_entry_t) * size);
+    for (i = 0; cache->entries != NULL && i < cache->size; i++) {
+        addr_cache_entry_t *e = &cache->entries[i];
+
+        if (e->kind != ADDR_CACHE_FREE)
+            *addr_cache_slot(entries, size, e->kind, e->family, &e->from) = *e;
+    }
+
+    safe_free(cache->entries);
+    cache->entries = entries;
+    cache->size = size;
+    return true;
+}
+
+/**
+ * \brief remember that addr is rewritten to to
+ *
+ * Returns the new entry, or NULL once the cache is full.  Must not already
+ * be in the cache.
+ */
+addr_cache_entry_t *
+addr_cache_add(addr_cache_t *cache, addr_cache_kind_t kind, int family, const void *from, const void *to)
+{
+    addr_cache_entry_t *e;
+    size_t len = addr_len(family);
+
+    if (!addr_cache_grow(cache))
+        return NULL;
+
+    e = addr_cache_slot(cache->entries, cache->size, kind, family, from);
+    memcpy(&e->from, from, len);
+    memcpy(&e->to, to, len);
+    e->kind = kind;
+    e->family = family;
+    e->changed = memcmp(from, to, len) != 0;
+    if (family == AF_INET6)
+        e->csum_diff = csum_diff16(e->from.tcpr_s6_addr32, e->to.tcpr_s6_addr32);
+    else
+        e->csum_diff = csum_diff4(e->from.tcpr_s6_addr32[0], e->to.tcpr_s6_addr32[0]);
+    cache->cnt++;
+
+    return e;
+}
+
+void
+addr_cache_free(addr_cache_t *cache)
+{
+    safe_free(cache->entries);
+    cache->entries = NULL;
+    cache->size = 0;
+    cache->cnt = 0;
+}
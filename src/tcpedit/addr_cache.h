@@ -0,0 +1,63 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "defines.h"
+#include "incremental_checksum.h"
+#include "tcpr.h"
+
+/*
+ * Remembers what tcpedit rewrote each address to, so a capture with a
+ * bounded set of hosts only pays for the CIDR lookups and the seeded
+ * randomization once per host.  Besides the new address an entry keeps
+ * the checksum difference, applied to every checksum covering it.
+ */
+#define ADDR_CACHE_MIN 1024
+#define ADDR_CACHE_MAX (1 << 19) /* entries, past that we just recompute */
+
+/* the rewrites an address is remembered for */
+typedef enum {
+    ADDR_CACHE_FREE = 0,
+    ADDR_CACHE_SRC_C2S, /* --srcipmap, then -N for a client to server packet */
+    ADDR_CACHE_DST_C2S,
+    ADDR_CACHE_SRC_S2C,
+    ADDR_CACHE_DST_S2C,
+    ADDR_CACHE_SEED, /* --seed */
+} addr_cache_kind_t;
+
+typedef struct addr_cache_entry_s {
+    struct tcpr_in6_addr from; /* IPv4 in the first word */
+    struct tcpr_in6_addr to;
+    __wsum csum_diff;
+    uint8_t kind;
+    uint8_t family;
+    bool changed;
+} addr_cache_entry_t;
+
+typedef struct addr_cache_s {
+    addr_cache_entry_t *entries;
+    uint32_t size; /* power of two */
+    uint32_t cnt;
+} addr_cache_t;
+
+addr_cache_entry_t *addr_cache_find(const addr_cache_t *cache, addr_cache_kind_t kind, int family, const void *addr);
+addr_cache_entry_t *
+addr_cache_add(addr_cache_t *cache, addr_cache_kind_t kind, int family, const void *from, const void *to);
+void addr_cache_free(addr_cache_t *cache);
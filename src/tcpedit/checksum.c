@@ -25,8 +25,7 @@
 
 #include "checksum.h"
 #include "config.h"
-
-static int do_checksum_math(uint16_t *, int);
+#include <stddef.h>
 
 /**
  * Returns -1 on error and 0 on success, 1 on warn
@@ -41,6 +40,7 @@ do_checksum(tcpedit_t *tcpedit, uint8_t *data, int proto, int len, const u_char
     icmpv4_hdr_t *icmp;
     icmpv6_hdr_t *icmp6;
     u_char *layer;
+    uint8_t l4proto;
     int ip_hl;
     int sum;
 
@@ -59,10 +59,10 @@ do_checksum(tcpedit_t *tcpedit, uint8_t *data, int proto, int len, const u_char
         ipv6 = (ipv6_hdr_t *)data;
         ipv4 = NULL;
 
-        proto = get_ipv6_l4proto(ipv6, end_ptr);
+        layer = tcpedit_layer4_v6(tcpedit, ipv6, end_ptr, &l4proto);
+        proto = l4proto;
         dbgx(3, "layer4 proto is 0x%hx", (uint16_t)proto);
 
-        layer = (u_char *)get_layer4_v6(ipv6, end_ptr);
         if (!layer) {
             tcpedit_setwarn(tcpedit, "%s", "Packet to short for checksum");
             return TCPEDIT_WARN;
@@ -94,12 +94,19 @@ do_checksum(tcpedit_t *tcpedit, uint8_t *data, int proto, int len, const u_char
          * length is 2x a single IP
          */
         if (ipv6 != NULL) {
-            sum = do_checksum_math((uint16_t *)&ipv6->ip_src, 32);
+            sum = tcpr_csum_partial(&ipv6->ip_src, 32, 0);
         } else {
-            sum = do_checksum_math((uint16_t *)&ipv4->ip_src, 8);
+            sum = tcpr_csum_partial(&ipv4->ip_src, 8, 0);
         }
         sum += ntohs(IPPROTO_TCP + len);
-        sum += do_checksum_math((uint16_t *)tcp, len);
+        if (tcpedit->csum_offload) {
+            /* the NIC sums the segment, see tcpedit_get_csum_partial() */
+            tcp->th_sum = (uint16_t)~CHECKSUM_CARRY(sum);
+            tcpedit->runtime.csum_start = ip_hl;
+            tcpedit->runtime.csum_offset = offsetof(tcp_hdr_t, th_sum);
+            break;
+        }
+        sum += tcpr_csum_partial(tcp, len, 0);
         tcp->th_sum = CHECKSUM_CARRY(sum);
         break;
 
@@ -114,12 +121,18 @@ do_checksum(tcpedit_t *tcpedit, uint8_t *data, int proto, int len, const u_char
             break;
         udp->uh_sum = 0;
         if (ipv6 != NULL) {
-            sum = do_checksum_math((uint16_t *)&ipv6->ip_src, 32);
+            sum = tcpr_csum_partial(&ipv6->ip_src, 32, 0);
         } else {
-            sum = do_checksum_math((uint16_t *)&ipv4->ip_src, 8);
+            sum = tcpr_csum_partial(&ipv4->ip_src, 8, 0);
         }
         sum += ntohs(IPPROTO_UDP + len);
-        sum += do_checksum_math((uint16_t *)udp, len);
+        if (tcpedit->csum_offload) {
+            udp->uh_sum = (uint16_t)~CHECKSUM_CARRY(sum);
+            tcpedit->runtime.csum_start = ip_hl;
+            tcpedit->runtime.csum_offset = offsetof(udp_hdr_t, uh_sum);
+            break;
+        }
+        sum += tcpr_csum_partial(udp, len, 0);
         udp->uh_sum = CHECKSUM_CARRY(sum);
         break;
 
@@ -131,10 +144,10 @@ do_checksum(tcpedit_t *tcpedit, uint8_t *data, int proto, int len, const u_char
         icmp = (icmpv4_hdr_t *)(data + ip_hl);
         icmp->icmp_sum = 0;
         if (ipv6 != NULL) {
-            sum = do_checksum_math((uint16_t *)&ipv6->ip_src, 32);
+            sum = tcpr_csum_partial(&ipv6->ip_src, 32, 0);
             icmp->icmp_sum = CHECKSUM_CARRY(sum);
         }
-        sum += do_checksum_math((uint16_t *)icmp, len);
+        sum += tcpr_csum_partial(icmp, len, 0);
         icmp->icmp_sum = CHECKSUM_CARRY(sum);
         break;
 
@@ -146,17 +159,17 @@ do_checksum(tcpedit_t *tcpedit, uint8_t *data, int proto, int len, const u_char
         icmp6 = (icmpv6_hdr_t *)(data + ip_hl);
         icmp6->icmp_sum = 0;
         if (ipv6 != NULL) {
-            sum = do_checksum_math((u_int16_t *)&ipv6->ip_src, 32);
+            sum = tcpr_csum_partial(&ipv6->ip_src, 32, 0);
         }
         sum += ntohs(IPPROTO_ICMP6 + len);
-        sum += do_checksum_math((u_int16_t *)icmp6, len);
+        sum += tcpr_csum_partial(icmp6, len, 0);
         icmp6->icmp_sum = CHECKSUM_CARRY(sum);
         break;
 
     default:
         if (ipv4) {
             ipv4->ip_sum = 0;
-            sum = do_checksum_math((uint16_t *)data, ip_hl);
+            sum = tcpr_csum_partial(data, ip_hl, 0);
             ipv4->ip_sum = CHECKSUM_CARRY(sum);
         } else {
             tcpedit_setwarn(tcpedit, "Unsupported protocol for checksum: 0x%x", proto);
@@ -166,29 +179,3 @@ do_checksum(tcpedit_t *tcpedit, uint8_t *data, int proto, int len, const u_char
 
     return TCPEDIT_OK;
 }
-
-/**
- * code to do a ones-compliment checksum
- */
-static int
-do_checksum_math(uint16_t *data, int len)
-{
-    int sum = 0;
-    union {
-        uint16_t s;
-        uint8_t b[2];
-    } pad;
-
-    while (len > 1) {
-        sum += *data++;
-        len -= 2;
-    }
-
-    if (len == 1) {
-        pad.b[0] = *(uint8_t *)data;
-        pad.b[1] = 0;
-        sum += pad.s;
-    }
-
-    return (sum);
-}
@@ -20,6 +20,7 @@
 
 #include "edit_packet.h"
 #include "config.h"
+#include "addr_cache.h"
 #include "checksum.h"
 #include "dlt.h"
 #include "incremental_checksum.h"
@@ -36,6 +37,12 @@ static int is_unicast_ipv4(tcpedit_t *tcpedit, uint32_t ip);
 
 static void randomize_ipv6_addr(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr);
 static int remap_ipv6(tcpedit_t *tcpedit, tcpr_cidr_t *cidr, struct tcpr_in6_addr *addr);
+static void rewrite_ipv6_field(tcpedit_t *tcpedit,
+                               ipv6_hdr_t *ip6_hdr,
+                               bool src,
+                               tcpr_dir_t direction,
+                               addr_cache_kind_t kind,
+                               int l3len);
 static int is_multicast_ipv6(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr);
 static int ipv6_header_length(ipv6_hdr_t const *ip6_hdr, size_t pkt_len, size_t l2len);
 
@@ -92,6 +99,9 @@ fix_ipv4_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv4_hdr_t *i
                            (u_char *)ip_hdr + pkthdr->caplen - l2len);
         if (ret1 < 0)
             return TCPEDIT_ERROR;
+        /* do_checksum() only knows where layer 4 starts in the IP packet */
+        if (tcpedit->runtime.csum_offset != 0)
+            tcpedit->runtime.csum_start += l2len;
     }
 
     /* calc IP checksum */
@@ -174,6 +184,8 @@ fix_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv6_hdr_t *i
                           (u_char *)ip6_hdr + pkthdr->caplen - l2len);
         if (ret < 0)
             return TCPEDIT_ERROR;
+        if (tcpedit->runtime.csum_offset != 0)
+            tcpedit->runtime.csum_start += l2len;
     }
 
     /* what do we return? */
@@ -184,7 +196,7 @@ fix_ipv6_checksums(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv6_hdr_t *i
 }
 
 static void
-ipv4_l34_csum_replace(uint8_t *data, uint8_t protocol, uint32_t old, uint32_t new)
+ipv4_l34_csum_diff(uint8_t *data, uint8_t protocol, __wsum diff)
 {
     ipv4_hdr_t *ipv4;
     tcp_hdr_t *tcp_hdr;
@@ -195,18 +207,18 @@ ipv4_l34_csum_replace(uint8_t *data, uint8_t protocol, uint32_t old, uint32_t ne
     switch (protocol) {
     case IPPROTO_IP:
         ipv4 = (ipv4_hdr_t *)data;
-        csum_replace4(&ipv4->ip_sum, old, new);
+        csum_replace_by_diff(&ipv4->ip_sum, diff);
         break;
 
     case IPPROTO_TCP:
         tcp_hdr = (tcp_hdr_t *)data;
-        csum_replace4(&tcp_hdr->th_sum, old, new);
+        csum_replace_by_diff(&tcp_hdr->th_sum, diff);
         break;
 
     case IPPROTO_UDP:
         udp_hdr = (udp_hdr_t *)data;
         if (udp_hdr->uh_sum)
-            csum_replace4(&udp_hdr->uh_sum, old, new);
+            csum_replace_by_diff(&udp_hdr->uh_sum, diff);
         break;
 
     default:
@@ -215,7 +227,7 @@ ipv4_l34_csum_replace(uint8_t *data, uint8_t protocol, uint32_t old, uint32_t ne
 }
 
 static void
-ipv6_l34_csum_replace(uint8_t *data, uint8_t protocol, uint32_t *old, uint32_t *new)
+ipv6_l34_csum_diff(uint8_t *data, uint8_t protocol, __wsum diff)
 {
     tcp_hdr_t *tcp_hdr;
     udp_hdr_t *udp_hdr;
@@ -227,23 +239,23 @@ ipv6_l34_csum_replace(uint8_t *data, uint8_t protocol, uint32_t *old, uint32_t *
     switch (protocol) {
     case IPPROTO_TCP:
         tcp_hdr = (tcp_hdr_t *)data;
-        csum_replace16(&tcp_hdr->th_sum, old, new);
+        csum_replace_by_diff(&tcp_hdr->th_sum, diff);
         break;
 
     case IPPROTO_UDP:
         udp_hdr = (udp_hdr_t *)data;
         if (udp_hdr->uh_sum)
-            csum_replace16(&udp_hdr->uh_sum, old, new);
+            csum_replace_by_diff(&udp_hdr->uh_sum, diff);
         break;
 
     case IPPROTO_ICMP:
         icmp = (icmpv4_hdr_t *)data;
-        csum_replace16(&icmp->icmp_sum, old, new);
+        csum_replace_by_diff(&icmp->icmp_sum, diff);
         break;
 
     case IPPROTO_ICMP6:
         icmp6 = (icmpv6_hdr_t *)data;
-        csum_replace16(&icmp6->icmp_sum, old, new);
+        csum_replace_by_diff(&icmp6->icmp_sum, diff);
         break;
 
     default:
@@ -251,8 +263,12 @@ ipv6_l34_csum_replace(uint8_t *data, uint8_t protocol, uint32_t *old, uint32_t *
     }
 }
 
+/**
+ * fix the IPv4 header and L4 checksums for an address that changed by
+ * diff, see csum_diff4()
+ */
 static void
-ipv4_addr_csum_replace(ipv4_hdr_t *ip_hdr, uint32_t old_ip, uint32_t new_ip, int l3len)
+ipv4_addr_csum_diff(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, __wsum diff, int l3len)
 {
     uint8_t *l4, protocol;
     int len = l3len;
@@ -262,18 +278,18 @@ ipv4_addr_csum_replace(ipv4_hdr_t *ip_hdr, uint32_t old_ip, uint32_t new_ip, int
     if ((size_t)len < sizeof(*ip_hdr))
         return;
 
-    ipv4_l34_csum_replace((uint8_t *)ip_hdr, IPPROTO_IP, old_ip, new_ip);
+    ipv4_l34_csum_diff((uint8_t *)ip_hdr, IPPROTO_IP, diff);
 
     protocol = ip_hdr->ip_p;
     switch (protocol) {
     case IPPROTO_UDP:
-        l4 = get_layer4_v4(ip_hdr, (u_char *)ip_hdr + l3len);
+        l4 = tcpedit_layer4_v4(tcpedit, ip_hdr, (u_char *)ip_hdr + l3len);
         len -= ip_hdr->ip_hl << 2;
         len -= TCPR_UDP_H;
         break;
 
     case IPPROTO_TCP:
-        l4 = get_layer4_v4(ip_hdr, (u_char *)ip_hdr + l3len);
+        l4 = tcpedit_layer4_v4(tcpedit, ip_hdr, (u_char *)ip_hdr + l3len);
         len -= ip_hdr->ip_hl << 2;
         len -= TCPR_TCP_H;
         break;
@@ -287,11 +303,21 @@ ipv4_addr_csum_replace(ipv4_hdr_t *ip_hdr, uint32_t old_ip, uint32_t new_ip, int
 
     /* if this is a fragment, don't attempt to checksum the Layer4 header */
     if ((htons(ip_hdr->ip_off) & IP_OFFMASK) == 0)
-        ipv4_l34_csum_replace(l4, protocol, old_ip, new_ip);
+        ipv4_l34_csum_diff(l4, protocol, diff);
+}
+
+static void
+ipv4_addr_csum_replace(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, uint32_t old_ip, uint32_t new_ip, int l3len)
+{
+    ipv4_addr_csum_diff(tcpedit, ip_hdr, csum_diff4(old_ip, new_ip), l3len);
 }
 
+/**
+ * fix the L4 checksum for an IPv6 address that changed by diff, see
+ * csum_diff16()
+ */
 static void
-ipv6_addr_csum_replace(ipv6_hdr_t *ip6_hdr, struct tcpr_in6_addr *old_ip, struct tcpr_in6_addr *new_ip, int l3len)
+ipv6_addr_csum_diff(tcpedit_t *tcpedit, ipv6_hdr_t *ip6_hdr, __wsum diff, int l3len)
 {
     uint8_t *l4, protocol;
 
@@ -300,11 +326,10 @@ ipv6_addr_csum_replace(ipv6_hdr_t *ip6_hdr, struct tcpr_in6_addr *old_ip, struct
     if ((size_t)l3len < sizeof(*ip6_hdr))
         return;
 
-    protocol = get_ipv6_l4proto(ip6_hdr, (u_char *)ip6_hdr + l3len);
+    l4 = tcpedit_layer4_v6(tcpedit, ip6_hdr, (u_char *)ip6_hdr + l3len, &protocol);
     switch (protocol) {
     case IPPROTO_UDP:
     case IPPROTO_TCP:
-        l4 = get_layer4_v6(ip6_hdr, (u_char *)ip6_hdr + l3len);
         break;
     default:
         l4 = NULL;
@@ -313,7 +338,17 @@ ipv6_addr_csum_replace(ipv6_hdr_t *ip6_hdr, struct tcpr_in6_addr *old_ip, struct
     if (!l4)
         return;
 
-    ipv6_l34_csum_replace(l4, protocol, (uint32_t *)old_ip, (uint32_t *)new_ip);
+    ipv6_l34_csum_diff(l4, protocol, diff);
+}
+
+static void
+ipv6_addr_csum_replace(tcpedit_t *tcpedit,
+                       ipv6_hdr_t *ip6_hdr,
+                       struct tcpr_in6_addr *old_ip,
+                       struct tcpr_in6_addr *new_ip,
+                       int l3len)
+{
+    ipv6_addr_csum_diff(tcpedit, ip6_hdr, csum_diff16((uint32_t *)old_ip, (uint32_t *)new_ip), l3len);
 }
 
 /**
@@ -424,14 +459,14 @@ randomize_ipv4(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, const u_char *pkt
         !tcpedit->skip_broadcast) {
         uint32_t old_ip = ip_hdr->ip_dst.s_addr;
         ip_hdr->ip_dst.s_addr = randomize_ipv4_addr(tcpedit, ip_hdr->ip_dst.s_addr);
-        ipv4_addr_csum_replace(ip_hdr, old_ip, ip_hdr->ip_dst.s_addr, l3len);
+        ipv4_addr_csum_replace(tcpedit, ip_hdr, old_ip, ip_hdr->ip_dst.s_addr, l3len);
     }
 
     if ((tcpedit->skip_broadcast && is_unicast_ipv4(tcpedit, (u_int32_t)ip_hdr->ip_src.s_addr)) ||
         !tcpedit->skip_broadcast) {
         uint32_t old_ip = ip_hdr->ip_src.s_addr;
         ip_hdr->ip_src.s_addr = randomize_ipv4_addr(tcpedit, ip_hdr->ip_src.s_addr);
-        ipv4_addr_csum_replace(ip_hdr, old_ip, ip_hdr->ip_src.s_addr, l3len);
+        ipv4_addr_csum_replace(tcpedit, ip_hdr, old_ip, ip_hdr->ip_src.s_addr, l3len);
     }
 
 #ifdef DEBUG
@@ -470,20 +505,9 @@ randomize_ipv6(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, const u_char *pkt
         return TCPEDIT_ERROR;
     }
 
-    /* don't rewrite broadcast addresses */
-    if ((tcpedit->skip_broadcast && !is_multicast_ipv6(tcpedit, &ip6_hdr->ip_dst)) || !tcpedit->skip_broadcast) {
-        struct tcpr_in6_addr old_ip6;
-        memcpy(&old_ip6, &ip6_hdr->ip_dst, sizeof(old_ip6));
-        randomize_ipv6_addr(tcpedit, &ip6_hdr->ip_dst);
-        ipv6_addr_csum_replace(ip6_hdr, &old_ip6, &ip6_hdr->ip_dst, l3len);
-    }
-
-    if ((tcpedit->skip_broadcast && !is_multicast_ipv6(tcpedit, &ip6_hdr->ip_src)) || !tcpedit->skip_broadcast) {
-        struct tcpr_in6_addr old_ip6;
-        memcpy(&old_ip6, &ip6_hdr->ip_src, sizeof(old_ip6));
-        randomize_ipv6_addr(tcpedit, &ip6_hdr->ip_src);
-        ipv6_addr_csum_replace(ip6_hdr, &old_ip6, &ip6_hdr->ip_src, l3len);
-    }
+    /* broadcast addresses are left alone, see rewrite_ipv6_field() */
+    rewrite_ipv6_field(tcpedit, ip6_hdr, false, TCPR_DIR_C2S, ADDR_CACHE_SEED, l3len);
+    rewrite_ipv6_field(tcpedit, ip6_hdr, true, TCPR_DIR_C2S, ADDR_CACHE_SEED, l3len);
 
 #ifdef DEBUG
     strlcpy(srcip, get_addr2name6(&ip6_hdr->ip_src, RESOLVE), INET6_ADDRSTRLEN);
@@ -757,99 +781,97 @@ remap_ipv6(tcpedit_t *tcpedit, tcpr_cidr_t *cidr, struct tcpr_in6_addr *addr)
     return 1;
 }
 
+/* the kind of rewrite rewrite_ipv4l3() and rewrite_ipv6l3() do to an address */
+static inline addr_cache_kind_t
+rewrite_l3_kind(bool src, tcpr_dir_t direction)
+{
+    if (direction == TCPR_DIR_C2S)
+        return src ? ADDR_CACHE_SRC_C2S : ADDR_CACHE_DST_C2S;
+
+    return src ? ADDR_CACHE_SRC_S2C : ADDR_CACHE_DST_S2C;
+}
+
+/*
+ * the cidrmap -N rewrites an address of a packet with: the sources of
+ * client to server packets come from cidrmap1, their destinations from
+ * cidrmap2, and the other way around for server to client packets
+ */
+static inline tcpr_cidrmap_t *
+rewrite_l3_cidrmap(tcpedit_t *tcpedit, bool src, tcpr_dir_t direction)
+{
+    return src == (direction == TCPR_DIR_C2S) ? tcpedit->cidrmap1 : tcpedit->cidrmap2;
+}
+
 /**
- * rewrite IP address (layer3)
- * uses -N to rewrite (map) one subnet onto another subnet
- * also support --srcipmap and --dstipmap
- * return 0 if no change, 1 or 2 if changed
+ * what --srcipmap/--dstipmap and then -N rewrite an IPv4 address to
  */
-int
-rewrite_ipv4l3(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, tcpr_dir_t direction, int len)
+static uint32_t
+rewrite_ipv4_addr(tcpedit_t *tcpedit, uint32_t ip, bool src, tcpr_dir_t direction)
 {
-    tcpr_cidrmap_t *cidrmap1 = NULL, *cidrmap2 = NULL;
-    int didsrc = 0, diddst = 0, loop = 1;
     tcpr_cidrmap_t *ipmap;
 
-    assert(tcpedit);
-    assert(ip_hdr);
+    if ((ipmap = find_cidr_map(src ? tcpedit->srcipmap : tcpedit->dstipmap, ip)) != NULL)
+        ip = remap_ipv4(tcpedit, ipmap->to, ip);
 
-    /* first check the src/dst IP maps */
-    ipmap = tcpedit->srcipmap;
-    while (ipmap != NULL) {
-        if (ip_in_cidr(ipmap->from, ip_hdr->ip_src.s_addr)) {
-            uint32_t old_ip = ip_hdr->ip_src.s_addr;
-            ip_hdr->ip_src.s_addr = remap_ipv4(tcpedit, ipmap->to, ip_hdr->ip_src.s_addr);
-            ipv4_addr_csum_replace(ip_hdr, old_ip, ip_hdr->ip_src.s_addr, len);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name4(ip_hdr->ip_src.s_addr, RESOLVE));
-            break;
-        }
-        ipmap = ipmap->next;
-    }
+    /* the first matching entry of each cidrmap does the rewrite */
+    if (tcpedit->cidrmap1 != NULL &&
+        (ipmap = find_cidr_map(rewrite_l3_cidrmap(tcpedit, src, direction), ip)) != NULL)
+        ip = remap_ipv4(tcpedit, ipmap->to, ip);
+
+    return ip;
+}
 
-    ipmap = tcpedit->dstipmap;
-    while (ipmap != NULL) {
-        if (ip_in_cidr(ipmap->from, ip_hdr->ip_dst.s_addr)) {
-            uint32_t old_ip = ip_hdr->ip_dst.s_addr;
-            ip_hdr->ip_dst.s_addr = remap_ipv4(tcpedit, ipmap->to, ip_hdr->ip_dst.s_addr);
-            ipv4_addr_csum_replace(ip_hdr, old_ip, ip_hdr->ip_dst.s_addr, len);
-            dbgx(2, "Remapped dst addr to: %s", get_addr2name4(ip_hdr->ip_dst.s_addr, RESOLVE));
-            break;
+static void
+rewrite_ipv4_field(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, bool src, tcpr_dir_t direction, int len)
+{
+    uint32_t *ip = src ? &ip_hdr->ip_src.s_addr : &ip_hdr->ip_dst.s_addr;
+    addr_cache_kind_t kind = rewrite_l3_kind(src, direction);
+    addr_cache_entry_t *e;
+    uint32_t new_ip;
+
+    if ((e = addr_cache_find(&tcpedit->addr_cache, kind, AF_INET, ip)) == NULL) {
+        new_ip = rewrite_ipv4_addr(tcpedit, *ip, src, direction);
+        if ((e = addr_cache_add(&tcpedit->addr_cache, kind, AF_INET, ip, &new_ip)) == NULL) {
+            /* cache is full */
+            if (new_ip != *ip) {
+                uint32_t old_ip = *ip;
+
+                *ip = new_ip;
+                ipv4_addr_csum_replace(tcpedit, ip_hdr, old_ip, new_ip, len);
+            }
+            return;
         }
-        ipmap = ipmap->next;
     }
 
-    /* anything else to rewrite? */
-    if (tcpedit->cidrmap1 == NULL)
-        return (0);
-
-    /* don't play with the main pointers */
-    if (direction == TCPR_DIR_C2S) {
-        cidrmap1 = tcpedit->cidrmap1;
-        cidrmap2 = tcpedit->cidrmap2;
-    } else {
-        cidrmap1 = tcpedit->cidrmap2;
-        cidrmap2 = tcpedit->cidrmap1;
+    if (e->changed) {
+        *ip = e->to.tcpr_s6_addr32[0];
+        ipv4_addr_csum_diff(tcpedit, ip_hdr, e->csum_diff, len);
+        dbgx(2, "Remapped %s addr to: %s", src ? "src" : "dst", get_addr2name4(*ip, RESOLVE));
     }
+}
 
-    /* loop through the cidrmap to rewrite */
-    do {
-        if ((!diddst) && ip_in_cidr(cidrmap2->from, ip_hdr->ip_dst.s_addr)) {
-            uint32_t old_ip = ip_hdr->ip_dst.s_addr;
-            ip_hdr->ip_dst.s_addr = remap_ipv4(tcpedit, cidrmap2->to, ip_hdr->ip_dst.s_addr);
-            ipv4_addr_csum_replace(ip_hdr, old_ip, ip_hdr->ip_dst.s_addr, len);
-            dbgx(2, "Remapped dst addr to: %s", get_addr2name4(ip_hdr->ip_dst.s_addr, RESOLVE));
-            diddst = 1;
-        }
-        if ((!didsrc) && ip_in_cidr(cidrmap1->from, ip_hdr->ip_src.s_addr)) {
-            uint32_t old_ip = ip_hdr->ip_src.s_addr;
-            ip_hdr->ip_src.s_addr = remap_ipv4(tcpedit, cidrmap1->to, ip_hdr->ip_src.s_addr);
-            ipv4_addr_csum_replace(ip_hdr, old_ip, ip_hdr->ip_src.s_addr, len);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name4(ip_hdr->ip_src.s_addr, RESOLVE));
-            didsrc = 1;
-        }
-
-        /*
-         * loop while we haven't modified both src/dst AND
-         * at least one of the cidr maps have a next pointer
-         */
-        if ((!(diddst && didsrc)) && (!((cidrmap1->next == NULL) && (cidrmap2->next == NULL)))) {
-            /* increment our ptr's if possible */
-            if (cidrmap1->next != NULL)
-                cidrmap1 = cidrmap1->next;
-
-            if (cidrmap2->next != NULL)
-                cidrmap2 = cidrmap2->next;
-
-        } else {
-            loop = 0;
-        }
+/**
+ * rewrite IP address (layer3)
+ * uses -N to rewrite (map) one subnet onto another subnet
+ * also support --srcipmap and --dstipmap
+ *
+ * What each address is rewritten to is looked up once and remembered in
+ * tcpedit->addr_cache.
+ * return 0 if no change, 1 or 2 if changed
+ */
+int
+rewrite_ipv4l3(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, tcpr_dir_t direction, int len)
+{
+    assert(tcpedit);
+    assert(ip_hdr);
 
-        /* Later on we should support various IP protocols which embed
-         * the IP address in the application layer.  Things like
-         * DNS and FTP.
-         */
+    rewrite_ipv4_field(tcpedit, ip_hdr, true, direction, len);
+    rewrite_ipv4_field(tcpedit, ip_hdr, false, direction, len);
 
-    } while (loop);
+    /* Later on we should support various IP protocols which embed
+     * the IP address in the application layer.  Things like
+     * DNS and FTP.
+     */
 
     /* return how many changes we require checksum updates
      * (none required - checksum is already updated)
@@ -857,97 +879,79 @@ rewrite_ipv4l3(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, tcpr_dir_t direction, int
     return 0;
 }
 
-int
-rewrite_ipv6l3(tcpedit_t *tcpedit, ipv6_hdr_t *ip6_hdr, tcpr_dir_t direction, int l3len)
+/**
+ * what --srcipmap/--dstipmap and then -N rewrite an IPv6 address to
+ */
+static void
+rewrite_ipv6_addr(tcpedit_t *tcpedit, struct tcpr_in6_addr *addr, bool src, tcpr_dir_t direction)
 {
-    tcpr_cidrmap_t *cidrmap1 = NULL, *cidrmap2 = NULL;
-    int didsrc = 0, diddst = 0, loop = 1;
     tcpr_cidrmap_t *ipmap;
 
-    assert(tcpedit);
-    assert(ip6_hdr);
+    if ((ipmap = find_cidr6_map(src ? tcpedit->srcipmap : tcpedit->dstipmap, addr)) != NULL)
+        remap_ipv6(tcpedit, ipmap->to, addr);
 
-    /* first check the src/dst IP maps */
-    ipmap = tcpedit->srcipmap;
-    while (ipmap != NULL) {
-        if (ip6_in_cidr(ipmap->from, &ip6_hdr->ip_src)) {
-            struct tcpr_in6_addr old_ip6;
-            memcpy(&old_ip6, &ip6_hdr->ip_src, sizeof(old_ip6));
-            remap_ipv6(tcpedit, ipmap->to, &ip6_hdr->ip_src);
-            ipv6_addr_csum_replace(ip6_hdr, &old_ip6, &ip6_hdr->ip_src, l3len);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name6(&ip6_hdr->ip_src, RESOLVE));
-            break;
-        }
-        ipmap = ipmap->next;
-    }
+    /* the first matching entry of each cidrmap does the rewrite */
+    if (tcpedit->cidrmap1 != NULL &&
+        (ipmap = find_cidr6_map(rewrite_l3_cidrmap(tcpedit, src, direction), addr)) != NULL)
+        remap_ipv6(tcpedit, ipmap->to, addr);
+}
 
-    ipmap = tcpedit->dstipmap;
-    while (ipmap != NULL) {
-        if (ip6_in_cidr(ipmap->from, &ip6_hdr->ip_dst)) {
-            struct tcpr_in6_addr old_ip6;
-            memcpy(&old_ip6, &ip6_hdr->ip_dst, sizeof(old_ip6));
-            remap_ipv6(tcpedit, ipmap->to, &ip6_hdr->ip_dst);
-            ipv6_addr_csum_replace(ip6_hdr, &old_ip6, &ip6_hdr->ip_dst, l3len);
-            dbgx(2, "Remapped dst addr to: %s", get_addr2name6(&ip6_hdr->ip_dst, RESOLVE));
-            break;
+/**
+ * rewrite one address of ip6_hdr, with rewrite_ipv6_addr() or
+ * randomize_ipv6_addr() for ADDR_CACHE_SEED
+ */
+static void
+rewrite_ipv6_field(tcpedit_t *tcpedit,
+                   ipv6_hdr_t *ip6_hdr,
+                   bool src,
+                   tcpr_dir_t direction,
+                   addr_cache_kind_t kind,
+                   int l3len)
+{
+    struct tcpr_in6_addr *addr = src ? &ip6_hdr->ip_src : &ip6_hdr->ip_dst;
+    struct tcpr_in6_addr new_ip6;
+    addr_cache_entry_t *e;
+
+    if ((e = addr_cache_find(&tcpedit->addr_cache, kind, AF_INET6, addr)) == NULL) {
+        memcpy(&new_ip6, addr, sizeof(new_ip6));
+        if (kind != ADDR_CACHE_SEED)
+            rewrite_ipv6_addr(tcpedit, &new_ip6, src, direction);
+        else if (!tcpedit->skip_broadcast || !is_multicast_ipv6(tcpedit, &new_ip6))
+            randomize_ipv6_addr(tcpedit, &new_ip6);
+
+        if ((e = addr_cache_add(&tcpedit->addr_cache, kind, AF_INET6, addr, &new_ip6)) == NULL) {
+            /* cache is full */
+            if (memcmp(&new_ip6, addr, sizeof(new_ip6)) != 0) {
+                struct tcpr_in6_addr old_ip6;
+
+                memcpy(&old_ip6, addr, sizeof(old_ip6));
+                memcpy(addr, &new_ip6, sizeof(new_ip6));
+                ipv6_addr_csum_replace(tcpedit, ip6_hdr, &old_ip6, addr, l3len);
+            }
+            return;
         }
-        ipmap = ipmap->next;
     }
 
-    /* anything else to rewrite? */
-    if (tcpedit->cidrmap1 == NULL)
-        return (0);
-
-    /* don't play with the main pointers */
-    if (direction == TCPR_DIR_C2S) {
-        cidrmap1 = tcpedit->cidrmap1;
-        cidrmap2 = tcpedit->cidrmap2;
-    } else {
-        cidrmap1 = tcpedit->cidrmap2;
-        cidrmap2 = tcpedit->cidrmap1;
+    if (e->changed) {
+        memcpy(addr, &e->to, sizeof(*addr));
+        ipv6_addr_csum_diff(tcpedit, ip6_hdr, e->csum_diff, l3len);
+        dbgx(2, "Remapped %s addr to: %s", src ? "src" : "dst", get_addr2name6(addr, RESOLVE));
     }
+}
 
-    /* loop through the cidrmap to rewrite */
-    do {
-        if ((!diddst) && ip6_in_cidr(cidrmap2->from, &ip6_hdr->ip_dst)) {
-            struct tcpr_in6_addr old_ip6;
-            memcpy(&old_ip6, &ip6_hdr->ip_dst, sizeof(old_ip6));
-            remap_ipv6(tcpedit, cidrmap2->to, &ip6_hdr->ip_dst);
-            ipv6_addr_csum_replace(ip6_hdr, &old_ip6, &ip6_hdr->ip_dst, l3len);
-            dbgx(2, "Remapped dst addr to: %s", get_addr2name6(&ip6_hdr->ip_dst, RESOLVE));
-            diddst = 1;
-        }
-        if ((!didsrc) && ip6_in_cidr(cidrmap1->from, &ip6_hdr->ip_src)) {
-            struct tcpr_in6_addr old_ip6;
-            memcpy(&old_ip6, &ip6_hdr->ip_src, sizeof(old_ip6));
-            remap_ipv6(tcpedit, cidrmap1->to, &ip6_hdr->ip_src);
-            ipv6_addr_csum_replace(ip6_hdr, &old_ip6, &ip6_hdr->ip_src, l3len);
-            dbgx(2, "Remapped src addr to: %s", get_addr2name6(&ip6_hdr->ip_src, RESOLVE));
-            didsrc = 1;
-        }
-
-        /*
-         * loop while we haven't modified both src/dst AND
-         * at least one of the cidr maps have a next pointer
-         */
-        if ((!(diddst && didsrc)) && (!((cidrmap1->next == NULL) && (cidrmap2->next == NULL)))) {
-            /* increment our ptr's if possible */
-            if (cidrmap1->next != NULL)
-                cidrmap1 = cidrmap1->next;
-
-            if (cidrmap2->next != NULL)
-                cidrmap2 = cidrmap2->next;
-
-        } else {
-            loop = 0;
-        }
+int
+rewrite_ipv6l3(tcpedit_t *tcpedit, ipv6_hdr_t *ip6_hdr, tcpr_dir_t direction, int l3len)
+{
+    assert(tcpedit);
+    assert(ip6_hdr);
 
-        /* Later on we should support various IP protocols which embed
-         * the IP address in the application layer.  Things like
-         * DNS and FTP.
-         */
+    rewrite_ipv6_field(tcpedit, ip6_hdr, true, direction, rewrite_l3_kind(true, direction), l3len);
+    rewrite_ipv6_field(tcpedit, ip6_hdr, false, direction, rewrite_l3_kind(false, direction), l3len);
 
-    } while (loop);
+    /* Later on we should support various IP protocols which embed
+     * the IP address in the application layer.  Things like
+     * DNS and FTP.
+     */
 
     /* return how many changes we require checksum updates
      * (none required - checksum is already updated)
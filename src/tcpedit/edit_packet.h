@@ -23,6 +23,17 @@
 #include "common.h"
 #include "tcpedit.h"
 
+/*
+ * per packet record of what tcpedit_packet() changed.  Header rewrites
+ * patch the IP and L4 checksums in place (RFC 1624), so only length and
+ * payload changes require the checksums to be recomputed from scratch.
+ */
+#define TCPEDIT_DIRTY_HDR 0x01     /* header fields, checksums already patched */
+#define TCPEDIT_DIRTY_LEN 0x02     /* IP length field rewritten */
+#define TCPEDIT_DIRTY_PAYLOAD 0x04 /* bytes added, removed or fuzzed */
+
+#define TCPEDIT_DIRTY_RECALC (TCPEDIT_DIRTY_LEN | TCPEDIT_DIRTY_PAYLOAD)
+
 int untrunc_packet(tcpedit_t *tcpedit,
                    struct pcap_pkthdr *pkthdr,
                    u_char **pktdata,
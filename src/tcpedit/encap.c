@@ -0,0 +1,278 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * --encap: wraps every edited Ethernet frame in a VXLAN, Geneve or GRE
+ * overlay header, so captures don't need to be encapsulated beforehand
+ */
+
+#include "encap.h"
+#include "config.h"
+#include "incremental_checksum.h"
+#include "tcpedit.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * sets the overlay from vxlan, geneve or gre.  Returns -1 if it's none of them
+ */
+int
+encap_parse_type(tcpedit_encap_t *encap, const char *type)
+{
+    assert(encap);
+    assert(type);
+
+    if (strcasecmp(type, "vxlan") == 0) {
+        encap->type = TCPEDIT_ENCAP_VXLAN;
+    } else if (strcasecmp(type, "geneve") == 0) {
+        encap->type = TCPEDIT_ENCAP_GENEVE;
+    } else if (strcasecmp(type, "gre") == 0) {
+        encap->type = TCPEDIT_ENCAP_GRE;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * parses the outer <client IP>:<server IP> pair.  Returns -1 on error
+ */
+int
+encap_parse_endpoints(tcpedit_encap_t *encap, const char *endpoints)
+{
+    char *string, *second;
+    int ret = -1;
+
+    assert(encap);
+    assert(endpoints);
+
+    string = safe_strdup(endpoints);
+    if ((second = strchr(string, ':')) == NULL)
+        goto done;
+    *second++ = '\0';
+
+    encap->src = get_name2addr4(string, false);
+    encap->dst = get_name2addr4(second, false);
+    if (encap->src != 0xffffffff && encap->dst != 0xffffffff)
+        ret = 0;
+
+done:
+    safe_free(string);
+    return ret;
+}
+
+/*
+ * builds the outer header of one direction, with the IPv4 checksum summed
+ * over a total length of 0 so encap_packet() only has to add the length in
+ */
+static void
+encap_build(tcpedit_encap_t *encap, u_char *hdr, bool reverse)
+{
+    eth_hdr_t *eth = (eth_hdr_t *)hdr;
+    ipv4_hdr_t *ip = (ipv4_hdr_t *)(hdr + TCPR_ETH_H);
+    u_char *l4 = hdr + TCPR_ETH_H + TCPR_IPV4_H;
+    uint32_t vni = encap->vni << 8;
+
+    memset(hdr, 0, TCPEDIT_ENCAP_MAX_H);
+
+    if (encap->macs) {
+        memcpy(eth->ether_dhost, reverse ? encap->smac : encap->dmac, ETHER_ADDR_LEN);
+        memcpy(eth->ether_shost, reverse ? encap->dmac : encap->smac, ETHER_ADDR_LEN);
+    }
+    eth->ether_type = htons(ETHERTYPE_IP);
+
+    ip->ip_v = 4;
+    ip->ip_hl = TCPR_IPV4_H >> 2;
+    ip->ip_off = htons(IP_DF);
+    ip->ip_ttl = ENCAP_TTL;
+    ip->ip_p = encap->type == TCPEDIT_ENCAP_GRE ? IPPROTO_GRE : IPPROTO_UDP;
+    ip->ip_src.s_addr = reverse ? encap->dst : encap->src;
+    ip->ip_dst.s_addr = reverse ? encap->src : encap->dst;
+    ip->ip_sum = csum_fold(csum_partial(ip, TCPR_IPV4_H, 0));
+
+    if (encap->type == TCPEDIT_ENCAP_GRE) {
+        struct tcpr_gre_hdr *gre = (struct tcpr_gre_hdr *)l4;
+
+        gre->flags_ver = htons(encap->key ? GRE_KEY : 0);
+        gre->type = htons(GRE_TRANSPARENT_ETHERNET_BRIDGING);
+        if (encap->key) {
+            /* with no checksum the key directly follows the base header */
+            vni = htonl(encap->vni);
+            memcpy(l4 + TCPR_GRE_H, &vni, sizeof(vni));
+        }
+    } else {
+        udp_hdr_t *udp = (udp_hdr_t *)l4;
+        u_char *overlay = l4 + TCPR_UDP_H;
+
+        udp->uh_sport = htons(ENCAP_SPORT_BASE);
+        if (encap->type == TCPEDIT_ENCAP_VXLAN) {
+            udp->uh_dport = htons(ENCAP_VXLAN_PORT);
+            overlay[0] = 0x08; /* I flag: the VNI is valid */
+        } else {
+            uint16_t proto = htons(GRE_TRANSPARENT_ETHERNET_BRIDGING);
+
+            udp->uh_dport = htons(ENCAP_GENEVE_PORT);
+            memcpy(overlay + 2, &proto, sizeof(proto));
+        }
+
+        /* the 24 bit VNI goes in bytes 4-6 of both */
+        vni = htonl(vni);
+        memcpy(overlay + 4, &vni, 3);
+    }
+}
+
+/**
+ * builds the outer headers once the options are set.  Returns -1 if the
+ * packets won't be Ethernet frames
+ */
+int
+encap_init(tcpedit_t *tcpedit)
+{
+    tcpedit_encap_t *encap = &tcpedit->encap;
+    int dlt;
+
+    assert(tcpedit);
+
+    if (encap->type == TCPEDIT_ENCAP_NONE)
+        return 0;
+
+    if ((dlt = tcpedit_dlt_output_dlt(tcpedit->dlt_ctx)) != DLT_EN10MB) {
+        tcpedit_seterr(tcpedit, "--encap needs Ethernet frames to wrap, not %s", pcap_datalink_val_to_name(dlt));
+        return -1;
+    }
+
+    if (encap->type == TCPEDIT_ENCAP_GRE)
+        encap->hdrlen = TCPR_ETH_H + TCPR_IPV4_H + TCPR_GRE_H + (encap->key ? 4 : 0);
+    else
+        encap->hdrlen = TCPR_ETH_H + TCPR_IPV4_H + TCPR_UDP_H + 8;
+
+    encap_build(encap, encap->hdr[0], false);
+    encap_build(encap, encap->hdr[1], true);
+
+    return 0;
+}
+
+/*
+ * --encap-entropy: a hash of the inner addresses and ports, the same for
+ * both directions of a flow
+ */
+static uint16_t
+encap_entropy(tcpedit_t *tcpedit, const ipv4_hdr_t *ip_hdr, const ipv6_hdr_t *ip6_hdr, const u_char *end_ptr)
+{
+    const tcpedit_layout_t *layout = &tcpedit->runtime.layout;
+    uint32_t hash;
+    uint16_t ports[2];
+    int i;
+
+    if (ip_hdr != NULL) {
+        hash = ip_hdr->ip_src.s_addr ^ ip_hdr->ip_dst.s_addr;
+    } else if (ip6_hdr != NULL) {
+        hash = 0;
+        for (i = 0; i < 4; i++)
+            hash ^= ip6_hdr->ip_src.tcpr_s6_addr32[i] ^ ip6_hdr->ip_dst.tcpr_s6_addr32[i];
+    } else {
+        return ENCAP_SPORT_BASE;
+    }
+
+    if ((layout->l3 == (const u_char *)ip_hdr || layout->l3 == (const u_char *)ip6_hdr) && layout->l4 != NULL &&
+        (layout->l4proto == IPPROTO_TCP || layout->l4proto == IPPROTO_UDP) && layout->l4 + sizeof(ports) <= end_ptr) {
+        memcpy(ports, layout->l4, sizeof(ports));
+        hash ^= (uint32_t)(ports[0] ^ ports[1]) << 8;
+        hash ^= layout->l4proto;
+    }
+
+    /* murmur3 finalizer, so every input bit reaches the low bits we keep */
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return ENCAP_SPORT_BASE | (hash & 0x3fff);
+}
+
+/**
+ * puts the outer header of direction in front of the packet.  The buffer
+ * needs encap.hdrlen bytes of room after caplen, which
+ * tcpedit_get_growth() includes.  Returns TCPEDIT_ERROR if the result
+ * is too big
+ */
+int
+encap_packet(tcpedit_t *tcpedit,
+             struct pcap_pkthdr *pkthdr,
+             u_char *packet,
+             const ipv4_hdr_t *ip_hdr,
+             const ipv6_hdr_t *ip6_hdr,
+             int l2len,
+             tcpr_dir_t direction)
+{
+    tcpedit_encap_t *encap = &tcpedit->encap;
+    ipv4_hdr_t *outer;
+    uint16_t sport = 0;
+    uint32_t len;
+
+    assert(tcpedit);
+    assert(pkthdr);
+    assert(packet);
+
+    len = pkthdr->len + encap->hdrlen - TCPR_ETH_H;
+    if (pkthdr->caplen + encap->hdrlen > MAXPACKET || len > UINT16_MAX) {
+        tcpedit_seterr(tcpedit,
+                       "Unable to encapsulate packet #" COUNTER_SPEC ": %u bytes is too big",
+                       tcpedit->runtime.packetnum,
+                       pkthdr->len + encap->hdrlen);
+        return TCPEDIT_ERROR;
+    }
+
+    /* before the inner headers move */
+    if (encap->entropy) {
+        const u_char *l3 = ip_hdr != NULL ? (const u_char *)ip_hdr : (const u_char *)ip6_hdr;
+
+        sport = htons(encap_entropy(tcpedit, ip_hdr, ip6_hdr, l3 + pkthdr->caplen - l2len));
+    }
+
+    memmove(packet + encap->hdrlen, packet, pkthdr->caplen);
+    memcpy(packet, encap->hdr[direction == TCPR_DIR_S2C ? 1 : 0], encap->hdrlen);
+    if (!encap->macs)
+        memcpy(packet, packet + encap->hdrlen, 2 * ETHER_ADDR_LEN);
+
+    outer = (ipv4_hdr_t *)(packet + TCPR_ETH_H);
+    outer->ip_len = htons((uint16_t)len);
+    csum_replace2(&outer->ip_sum, 0, outer->ip_len);
+
+    if (encap->type != TCPEDIT_ENCAP_GRE) {
+        /* the UDP checksum is optional over IPv4 and left 0 */
+        udp_hdr_t *udp = (udp_hdr_t *)(packet + TCPR_ETH_H + TCPR_IPV4_H);
+
+        udp->uh_ulen = htons((uint16_t)(len - TCPR_IPV4_H));
+        if (encap->entropy)
+            udp->uh_sport = sport;
+    }
+
+    pkthdr->caplen += encap->hdrlen;
+    pkthdr->len += encap->hdrlen;
+
+    /* --csum-offload: the inner checksum moved along with the packet */
+    if (tcpedit->runtime.csum_offset != 0)
+        tcpedit->runtime.csum_start += encap->hdrlen;
+
+    return TCPEDIT_OK;
+}
@@ -0,0 +1,40 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpedit_types.h"
+
+#define ENCAP_VXLAN_PORT 4789
+#define ENCAP_GENEVE_PORT 6081
+/* outer UDP source port without --encap-entropy, the first dynamic port */
+#define ENCAP_SPORT_BASE 49152
+#define ENCAP_TTL 64
+
+int encap_parse_type(tcpedit_encap_t *encap, const char *type);
+int encap_parse_endpoints(tcpedit_encap_t *encap, const char *endpoints);
+int encap_init(tcpedit_t *tcpedit);
+int encap_packet(tcpedit_t *tcpedit,
+                 struct pcap_pkthdr *pkthdr,
+                 u_char *packet,
+                 const ipv4_hdr_t *ip_hdr,
+                 const ipv6_hdr_t *ip6_hdr,
+                 int l2len,
+                 tcpr_dir_t direction);
@@ -5,18 +5,20 @@
 #include <stdlib.h>
 #include <string.h>
 
-static unsigned int fuzz_seed;
-static unsigned int fuzz_factor;
-static unsigned int fuzz_running;
-
-void
-fuzzing_init(uint32_t _fuzz_seed, uint32_t _fuzz_factor)
+/*
+ * The random number of a packet only depends on --fuzz-seed and the packet's
+ * number in the input (splitmix64 of the two), so editors on several threads
+ * or --batch pieces fuzz exactly like a single one.
+ */
+static uint32_t
+fuzz_random(tcpedit_t *tcpedit)
 {
-    assert(_fuzz_factor);
+    uint64_t x = ((uint64_t)tcpedit->fuzz_seed << 32) ^ tcpedit->runtime.packetnum;
 
-    fuzz_seed = _fuzz_seed;
-    fuzz_factor = _fuzz_factor;
-    fuzz_running = 1;
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return (uint32_t)((x ^ (x >> 31)) >> 32);
 }
 
 #define SGT_MAX_SIZE 16
@@ -76,17 +78,15 @@ fuzzing(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, u_char **pktdata)
     assert(pkthdr);
     assert(*pktdata);
 
-    if (!fuzz_running)
-        goto done;
-
-    assert(fuzz_factor);
+    assert(tcpedit->fuzz_factor);
+    assert(tcpedit->runtime.packetnum > 0);
 
     /*
      * Determine if this is one of the packets that is going to be altered.
      * No fuzzing for the other 7 out of 8 packets
      */
-    r = tcpr_random(&fuzz_seed);
-    if ((r % fuzz_factor) != 0)
+    r = fuzz_random(tcpedit);
+    if ((r % tcpedit->fuzz_factor) != 0)
         goto done;
 
     /* initializations */
@@ -20,11 +20,6 @@ enum {
     FUZZING_TOTAL_ACTION_NUMBER /* always last */
 };
 
-/**
- * init fuzz seed and allocate buffer.
- */
-void fuzzing_init(uint32_t _fuzz_seed, uint32_t _fuzz_factor);
-
 /*
  * fuzz packet data.
  * only one out of 8 packets are fuzzed.
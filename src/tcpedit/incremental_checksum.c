@@ -27,71 +27,6 @@
 #include "config.h"
 #include "tcpedit.h"
 
-static inline unsigned short
-from32to16(unsigned int x)
-{
-    /* add up 16-bit and 16-bit for 16+c bit */
-    x = (x & 0xffff) + (x >> 16);
-    /* add up carry.. */
-    x = (x & 0xffff) + (x >> 16);
-    return x;
-}
-
-static unsigned int
-do_csum(const unsigned char *buff, int len)
-{
-    int odd;
-    unsigned int result = 0;
-
-    if (len <= 0)
-        goto out;
-    odd = 1 & (unsigned long)buff;
-    if (odd) {
-#ifdef WORDS_BIGENDIAN
-        result = *buff;
-#else
-        result += (*buff << 8);
-#endif
-        len--;
-        buff++;
-    }
-    if (len >= 2) {
-        if (2 & (unsigned long)buff) {
-            result += *(unsigned short *)buff;
-            len -= 2;
-            buff += 2;
-        }
-        if (len >= 4) {
-            const unsigned char *end = buff + ((unsigned)len & ~3);
-            unsigned int carry = 0;
-            do {
-                unsigned int w = *(unsigned int *)buff;
-                buff += 4;
-                result += carry;
-                result += w;
-                carry = (w > result);
-            } while (buff < end);
-            result += carry;
-            result = (result & 0xffff) + (result >> 16);
-        }
-        if (len & 2) {
-            result += *(unsigned short *)buff;
-            buff += 2;
-        }
-    }
-    if (len & 1)
-#ifdef WORDS_BIGENDIAN
-        result += (*buff << 8);
-#else
-        result += *buff;
-#endif
-    result = from32to16(result);
-    if (odd)
-        result = ((result >> 8) & 0xff) | ((result & 0xff) << 8);
-out:
-    return result;
-}
-
 /*
  * computes the checksum of a memory block at buff, length len,
  * and adds in "sum" (32-bit)
@@ -101,18 +36,9 @@ out:
  *
  * this function must be called with even lengths, except
  * for the last fragment, which may be odd
- *
- * it's best to have buff aligned on a 32-bit boundary
  */
 __wsum
 csum_partial(const void *buff, int len, __wsum wsum)
 {
-    unsigned int sum = (unsigned int)wsum;
-    unsigned int result = do_csum(buff, len);
-
-    /* add in old sum, and carry.. */
-    result += sum;
-    if (sum > result)
-        result += 1;
-    return (__wsum)result;
+    return (__wsum)tcpr_csum_partial(buff, len, (uint32_t)wsum);
 }
@@ -111,6 +111,39 @@ csum_replace4(__sum16 *sum, __be32 from, __be32 to)
     *sum = csum_fold(csum_add(csum_sub(~csum_unfold(*sum), from), to));
 }
 
+/*
+ * ~from + to, for applying the same csum_replace4()/csum_replace16() to
+ * many checksums with csum_replace_by_diff()
+ */
+static inline __wsum
+csum_diff4(__be32 from, __be32 to)
+{
+    return csum_add(~from, to);
+}
+
+static inline __wsum
+csum_diff16(const __be32 *from, const __be32 *to)
+{
+    __be32 diff[] = {
+            ~from[0],
+            ~from[1],
+            ~from[2],
+            ~from[3],
+            to[0],
+            to[1],
+            to[2],
+            to[3],
+    };
+
+    return csum_partial(diff, sizeof(diff), 0);
+}
+
+static inline void
+csum_replace_by_diff(__sum16 *sum, __wsum diff)
+{
+    *sum = csum_fold(csum_add(~csum_unfold(*sum), diff));
+}
+
 static inline void
 csum_replace2(__sum16 *sum, __be16 from, __be16 to)
 {
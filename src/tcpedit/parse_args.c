@@ -20,6 +20,8 @@
 
 #include "parse_args.h"
 #include "config.h"
+#include "encap.h"
+#include "payload.h"
 #include "portmap.h"
 #include "tcpedit.h"
 #include "tcpedit_stub.h"
@@ -84,6 +86,42 @@ tcpedit_post_args(tcpedit_t *tcpedit)
         }
     }
 
+    /* --pnat-file */
+    if (HAVE_OPT(PNAT_FILE)) {
+        int ct = STACKCT_OPT(PNAT_FILE);
+        char **list = (char **)STACKLST_OPT(PNAT_FILE);
+
+        tcpedit->rewrite_ip = true;
+
+        if (!parse_cidr_map_file(&tcpedit->cidrmap1, list[0])) {
+            tcpedit_seterr(tcpedit, "Unable to load first --pnat-file=%s", list[0]);
+            return -1;
+        }
+
+        if (ct > 1 && !parse_cidr_map_file(&tcpedit->cidrmap2, list[1])) {
+            tcpedit_seterr(tcpedit, "Unable to load second --pnat-file=%s", list[1]);
+            return -1;
+        }
+    }
+
+    /* --srcipmap-file */
+    if (HAVE_OPT(SRCIPMAP_FILE)) {
+        tcpedit->rewrite_ip = true;
+        if (!parse_cidr_map_file(&tcpedit->srcipmap, OPT_ARG(SRCIPMAP_FILE))) {
+            tcpedit_seterr(tcpedit, "Unable to load --srcipmap-file=%s", OPT_ARG(SRCIPMAP_FILE));
+            return -1;
+        }
+    }
+
+    /* --dstipmap-file */
+    if (HAVE_OPT(DSTIPMAP_FILE)) {
+        tcpedit->rewrite_ip = true;
+        if (!parse_cidr_map_file(&tcpedit->dstipmap, OPT_ARG(DSTIPMAP_FILE))) {
+            tcpedit_seterr(tcpedit, "Unable to load --dstipmap-file=%s", OPT_ARG(DSTIPMAP_FILE));
+            return -1;
+        }
+    }
+
     /*
      * If we have one and only one -N, then use the same map data
      * for both interfaces/files
@@ -99,6 +137,10 @@ tcpedit_post_args(tcpedit_t *tcpedit)
     if (HAVE_OPT(EFCS))
         tcpedit->efcs = true;
 
+    /* --add-fcs */
+    if (HAVE_OPT(ADD_FCS))
+        tcpedit->add_fcs = true;
+
     /* --ttl */
     if (HAVE_OPT(TTL)) {
         long ttl;
@@ -169,6 +211,8 @@ tcpedit_post_args(tcpedit_t *tcpedit)
             rand_num = tcpr_random(&seed);
 
         tcpedit->tcp_sequence_adjust = rand_num;
+        if (HAVE_OPT(TCP_SEQUENCE_FLOWS))
+            tcpedit->tcp_sequence_flows = true;
     }
 
     /* TCP/UDP port rewriting */
@@ -199,6 +243,9 @@ tcpedit_post_args(tcpedit_t *tcpedit)
             }
             first = 0;
         } while (--ct > 0);
+
+        /* include the appended chains in the lookup table */
+        compile_portmap(tcpedit->portmap);
     }
 
     /*
@@ -238,6 +285,46 @@ tcpedit_post_args(tcpedit_t *tcpedit)
         }
     }
 
+    /* --encap */
+    if (HAVE_OPT(ENCAP)) {
+        tcpedit_encap_t *encap = &tcpedit->encap;
+
+        if (encap_parse_type(encap, OPT_ARG(ENCAP)) < 0) {
+            tcpedit_seterr(tcpedit, "Invalid --encap=%s", OPT_ARG(ENCAP));
+            return -1;
+        }
+
+        if (encap_parse_endpoints(encap, OPT_ARG(ENCAP_ENDPOINTS)) < 0) {
+            tcpedit_seterr(tcpedit, "Unable to parse --encap-endpoints=%s", OPT_ARG(ENCAP_ENDPOINTS));
+            return -1;
+        }
+
+        if (HAVE_OPT(ENCAP_MAC)) {
+            if (dualmac2hex(OPT_ARG(ENCAP_MAC), encap->smac, encap->dmac, (int)strlen(OPT_ARG(ENCAP_MAC))) != 3) {
+                tcpedit_seterr(tcpedit, "--encap-mac=%s needs both a source and a destination MAC", OPT_ARG(ENCAP_MAC));
+                return -1;
+            }
+            encap->macs = true;
+        }
+
+        if (HAVE_OPT(ENCAP_VNI)) {
+            encap->vni = (uint32_t)OPT_VALUE_ENCAP_VNI;
+            encap->key = true;
+        }
+
+        if (HAVE_OPT(ENCAP_ENTROPY)) {
+            if (encap->type == TCPEDIT_ENCAP_GRE) {
+                tcpedit_seterr(tcpedit, "%s", "--encap-entropy needs a UDP overlay, not --encap=gre");
+                return -1;
+            }
+            encap->entropy = true;
+        }
+    }
+
+    /* --payload-rewrite */
+    if (HAVE_OPT(PAYLOAD_REWRITE) && payload_load(tcpedit, OPT_ARG(PAYLOAD_REWRITE)) < 0)
+        return -1;
+
     /* parse the tcpedit dlt args */
     rcode = tcpedit_dlt_post_args(tcpedit);
     if (rcode < 0) {
@@ -0,0 +1,823 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * --payload-rewrite: replaces byte strings in TCP and UDP payloads.
+ *
+ * All the patterns are found in one pass with an Aho-Corasick automaton,
+ * a transition table over the classes of bytes which occur in patterns.
+ * While no pattern is under way the scan skips ahead to the next byte one
+ * can start with, with memchr() or SSE2 compares when there are only a
+ * few of them.  A match is replaced as soon as it ends, the longest of
+ * the patterns ending there, and the scan starts over after it.
+ *
+ * When a replacement changes the length of a TCP segment, every later
+ * sequence number of that direction, and the acks of the other, have to
+ * move by as much.  Each direction which changed keeps the total change
+ * at the end of every segment which did, in sequence order, so
+ * retransmissions, acks and packets edited again on a later loop all map
+ * back onto the right total.
+ */
+
+#include "payload.h"
+#include "config.h"
+#include "edit_packet.h"
+#include "incremental_checksum.h"
+#include "tcpedit.h"
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+    u_char *match;
+    uint32_t match_len;
+    u_char *repl;
+    uint32_t repl_len;
+} payload_rule_t;
+
+/* one direction of a TCP connection */
+typedef struct {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t family;
+} payload_flow_key_t;
+
+typedef struct {
+    uint32_t end;  /* sequence number after the segment, as captured */
+    int32_t delta; /* total length change up to there */
+} payload_point_t;
+
+typedef struct {
+    payload_flow_key_t key;
+    bool used;
+    uint32_t cnt;
+    uint32_t alloc;
+    payload_point_t *pt; /* in sequence order */
+} payload_flow_t;
+
+struct tcpedit_payload_s {
+    payload_rule_t *rule;
+    uint32_t rules;
+    uint16_t cls[256]; /* class of each byte, 0 for those in no pattern */
+    uint32_t classes;
+    int32_t *next; /* [state * classes + class] */
+    int32_t *out;  /* rule matched on reaching a state, -1 for none */
+    uint32_t states;
+    bool start[256]; /* bytes a pattern starts with */
+    u_char first[PAYLOAD_SIMD_FIRST];
+    int nfirst; /* how many of them, PAYLOAD_SIMD_FIRST + 1 if more */
+    int growth; /* most a rule adds */
+    bool resizes;
+    payload_flow_t *flow;
+    uint32_t flow_mask;
+    uint32_t flows;
+    u_char buf[MAXPACKET];
+    COUNTER replaced;
+    COUNTER packets;
+    COUNTER capped; /* matches left alone for want of room */
+};
+
+/**
+ * decodes a pattern or replacement of the rule file, with \xHH, \\, \s
+ * (space), \t, \r, \n and \# escapes.  Returns its length, or -1 if an
+ * escape is bad
+ */
+static int
+payload_unescape(const char *str, size_t len, u_char *out)
+{
+    size_t i;
+    int o = 0;
+
+    for (i = 0; i < len; i++) {
+        if (str[i] != '\\') {
+            out[o++] = (u_char)str[i];
+            continue;
+        }
+
+        if (++i == len)
+            return -1;
+
+        switch (str[i]) {
+        case 'x': {
+            char hex[3];
+
+            if (i + 2 >= len || !isxdigit((u_char)str[i + 1]) || !isxdigit((u_char)str[i + 2]))
+                return -1;
+            hex[0] = str[i + 1];
+            hex[1] = str[i + 2];
+            hex[2] = '\0';
+            out[o++] = (u_char)strtoul(hex, NULL, 16);
+            i += 2;
+            break;
+        }
+        case 's':
+            out[o++] = ' ';
+            break;
+        case 't':
+            out[o++] = '\t';
+            break;
+        case 'r':
+            out[o++] = '\r';
+            break;
+        case 'n':
+            out[o++] = '\n';
+            break;
+        case '\\':
+        case '#':
+            out[o++] = (u_char)str[i];
+            break;
+        default:
+            return -1;
+        }
+    }
+
+    return o;
+}
+
+/**
+ * adds a rule of the file, the pattern and replacement from line.
+ * Returns 0 for a blank line or comment, 1 for a rule and -1 on error
+ */
+static int
+payload_add_rule(tcpedit_payload_t *payload, const char *line, size_t len, uint32_t *alloc)
+{
+    const char *field[2], *end = line + len;
+    size_t flen[2];
+    payload_rule_t *rule;
+    int f, n;
+
+    for (f = 0; f < 2; f++) {
+        while (line < end && isspace((u_char)*line))
+            line++;
+        if (line == end || *line == '#')
+            return f == 0 ? 0 : -1;
+
+        field[f] = line;
+        while (line < end && !isspace((u_char)*line))
+            line++;
+        flen[f] = (size_t)(line - field[f]);
+    }
+
+    /* nothing but a comment may follow */
+    while (line < end && isspace((u_char)*line))
+        line++;
+    if (line < end && *line != '#')
+        return -1;
+
+    if (payload->rules == *alloc) {
+        *alloc = *alloc ? *alloc * 2 : 16;
+        payload->rule = (payload_rule_t *)safe_realloc(payload->rule, *alloc * sizeof(payload_rule_t));
+    }
+
+    rule = &payload->rule[payload->rules];
+    memset(rule, 0, sizeof(*rule));
+    rule->match = (u_char *)safe_malloc(flen[0] + 1);
+    rule->repl = (u_char *)safe_malloc(flen[1] + 1);
+
+    if ((n = payload_unescape(field[0], flen[0], rule->match)) <= 0)
+        goto bad;
+    rule->match_len = (uint32_t)n;
+
+    if ((n = payload_unescape(field[1], flen[1], rule->repl)) < 0)
+        goto bad;
+    rule->repl_len = (uint32_t)n;
+
+    payload->rules++;
+    return 1;
+
+bad:
+    safe_free(rule->match);
+    safe_free(rule->repl);
+    return -1;
+}
+
+/**
+ * builds the automaton over the rules.  Patterns given twice keep the
+ * first replacement
+ */
+static void
+payload_compile(tcpedit_payload_t *payload)
+{
+    uint32_t alloc, r, i, c, head, tail, *queue;
+    int32_t *fail, *own;
+
+    /* number the bytes patterns are made of */
+    payload->classes = 1;
+    for (r = 0; r < payload->rules; r++) {
+        for (i = 0; i < payload->rule[r].match_len; i++) {
+            u_char b = payload->rule[r].match[i];
+
+            if (payload->cls[b] == 0)
+                payload->cls[b] = (uint16_t)payload->classes++;
+        }
+    }
+
+    /* the trie, -1 for no edge */
+    alloc = 64;
+    payload->next = (int32_t *)safe_malloc(alloc * payload->classes * sizeof(int32_t));
+    own = (int32_t *)safe_malloc(alloc * sizeof(int32_t));
+    memset(payload->next, 0xff, payload->classes * sizeof(int32_t));
+    own[0] = -1;
+    payload->states = 1;
+
+    for (r = 0; r < payload->rules; r++) {
+        const payload_rule_t *rule = &payload->rule[r];
+        int32_t s = 0;
+
+        for (i = 0; i < rule->match_len; i++) {
+            int32_t *edge = &payload->next[s * payload->classes + payload->cls[rule->match[i]]];
+
+            if (*edge < 0) {
+                if (payload->states == alloc) {
+                    alloc *= 2;
+                    payload->next =
+                            (int32_t *)safe_realloc(payload->next, alloc * payload->classes * sizeof(int32_t));
+                    own = (int32_t *)safe_realloc(own, alloc * sizeof(int32_t));
+                    /* the realloc moved it */
+                    edge = &payload->next[s * payload->classes + payload->cls[rule->match[i]]];
+                }
+
+                memset(&payload->next[payload->states * payload->classes], 0xff, payload->classes * sizeof(int32_t));
+                own[payload->states] = -1;
+                *edge = (int32_t)payload->states++;
+            }
+
+            s = *edge;
+        }
+
+        if (own[s] < 0)
+            own[s] = (int32_t)r;
+
+        payload->start[rule->match[0]] = true;
+    }
+
+    /* breadth first, fill in the missing edges from the fail links */
+    fail = (int32_t *)safe_malloc(payload->states * sizeof(int32_t));
+    payload->out = (int32_t *)safe_malloc(payload->states * sizeof(int32_t));
+    queue = (uint32_t *)safe_malloc(payload->states * sizeof(uint32_t));
+    payload->out[0] = -1;
+    head = tail = 0;
+
+    for (c = 0; c < payload->classes; c++) {
+        int32_t u = payload->next[c];
+
+        if (u < 0) {
+            payload->next[c] = 0;
+        } else {
+            fail[u] = 0;
+            payload->out[u] = own[u];
+            queue[tail++] = (uint32_t)u;
+        }
+    }
+
+    while (head < tail) {
+        uint32_t s = queue[head++];
+
+        for (c = 0; c < payload->classes; c++) {
+            int32_t *edge = &payload->next[s * payload->classes + c];
+            int32_t via = payload->next[fail[s] * payload->classes + c];
+
+            if (*edge < 0) {
+                *edge = via;
+            } else {
+                fail[*edge] = via;
+                payload->out[*edge] = own[*edge] >= 0 ? own[*edge] : payload->out[via];
+                queue[tail++] = (uint32_t)*edge;
+            }
+        }
+    }
+
+    for (i = 0, payload->nfirst = 0; i < 256; i++) {
+        if (!payload->start[i])
+            continue;
+        if (payload->nfirst < PAYLOAD_SIMD_FIRST)
+            payload->first[payload->nfirst] = (u_char)i;
+        if (payload->nfirst <= PAYLOAD_SIMD_FIRST)
+            payload->nfirst++;
+    }
+
+    safe_free(queue);
+    safe_free(fail);
+    safe_free(own);
+}
+
+/**
+ * \brief loads the --payload-rewrite rules from path
+ *
+ * One rule to a line, the pattern and its replacement separated by
+ * blanks, # starting a comment.  Returns TCPEDIT_ERROR on failure
+ */
+int
+payload_load(tcpedit_t *tcpedit, const char *path)
+{
+    tcpedit_payload_t *payload;
+    uint32_t alloc = 0, line = 0, r;
+    char buf[4096];
+    FILE *fp;
+
+    assert(tcpedit);
+    assert(path);
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        tcpedit_seterr(tcpedit, "Unable to open --payload-rewrite file %s: %s", path, strerror(errno));
+        return TCPEDIT_ERROR;
+    }
+
+    payload = (tcpedit_payload_t *)safe_malloc(sizeof(tcpedit_payload_t));
+
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        size_t len = strlen(buf);
+
+        line++;
+        if (len == sizeof(buf) - 1 && buf[len - 1] != '\n') {
+            tcpedit_seterr(tcpedit, "%s:%u: line too long", path, line);
+            goto error;
+        }
+
+        while (len > 0 && (buf[len - 1] == '\n' || buf[len - 1] == '\r'))
+            buf[--len] = '\0';
+
+        if (payload_add_rule(payload, buf, len, &alloc) < 0) {
+            tcpedit_seterr(tcpedit, "%s:%u: expected a pattern and its replacement: %s", path, line, buf);
+            goto error;
+        }
+    }
+
+    if (payload->rules == 0) {
+        tcpedit_seterr(tcpedit, "No rules in --payload-rewrite file %s", path);
+        goto error;
+    }
+
+    fclose(fp);
+
+    for (r = 0; r < payload->rules; r++) {
+        const payload_rule_t *rule = &payload->rule[r];
+
+        if (rule->repl_len != rule->match_len)
+            payload->resizes = true;
+        if (rule->repl_len > rule->match_len)
+            payload->growth = PAYLOAD_GROWTH_MAX;
+    }
+
+    payload_compile(payload);
+    dbgx(1, "Loaded %u payload rules, %u states over %u byte classes", payload->rules, payload->states, payload->classes);
+
+    payload_free(tcpedit->payload);
+    tcpedit->payload = payload;
+    return TCPEDIT_OK;
+
+error:
+    fclose(fp);
+    payload_free(payload);
+    return TCPEDIT_ERROR;
+}
+
+void
+payload_free(tcpedit_payload_t *payload)
+{
+    uint32_t r;
+
+    if (payload == NULL)
+        return;
+
+    dbgx(1,
+         "Payload rewrite replaced " COUNTER_SPEC " matches in " COUNTER_SPEC " packets, " COUNTER_SPEC
+         " left for want of room",
+         payload->replaced,
+         payload->packets,
+         payload->capped);
+
+    for (r = 0; r < payload->rules; r++) {
+        safe_free(payload->rule[r].match);
+        safe_free(payload->rule[r].repl);
+    }
+
+    safe_free(payload->rule);
+    safe_free(payload->next);
+    safe_free(payload->out);
+    if (payload->flow != NULL) {
+        for (r = 0; r <= payload->flow_mask; r++)
+            safe_free(payload->flow[r].pt);
+        safe_free(payload->flow);
+    }
+    safe_free(payload);
+}
+
+/**
+ * \brief most bytes a packet may grow by, see tcpedit_get_growth()
+ */
+int
+payload_growth(const tcpedit_payload_t *payload)
+{
+    return payload == NULL ? 0 : payload->growth;
+}
+
+/**
+ * \brief may packets change length?
+ */
+bool
+payload_resizes(const tcpedit_payload_t *payload)
+{
+    return payload != NULL && payload->resizes;
+}
+
+/**
+ * returns the offset from i of the next byte in data a pattern starts
+ * with, or len
+ */
+static inline uint32_t
+payload_skip(const tcpedit_payload_t *payload, const u_char *data, uint32_t i, uint32_t len)
+{
+    if (payload->nfirst == 1) {
+        const u_char *p = memchr(data + i, payload->first[0], len - i);
+
+        return p != NULL ? (uint32_t)(p - data) : len;
+    }
+
+#ifdef __SSE2__
+    if (payload->nfirst <= PAYLOAD_SIMD_FIRST) {
+        __m128i first[PAYLOAD_SIMD_FIRST];
+        int k;
+
+        for (k = 0; k < payload->nfirst; k++)
+            first[k] = _mm_set1_epi8((char)payload->first[k]);
+
+        for (; i + 16 <= len; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+            __m128i m = _mm_cmpeq_epi8(v, first[0]);
+            int bits;
+
+            for (k = 1; k < payload->nfirst; k++)
+                m = _mm_or_si128(m, _mm_cmpeq_epi8(v, first[k]));
+
+            if ((bits = _mm_movemask_epi8(m)) != 0)
+                return i + (uint32_t)__builtin_ctz((unsigned int)bits);
+        }
+    }
+#endif
+
+    while (i < len && !payload->start[data[i]])
+        i++;
+
+    return i;
+}
+
+/**
+ * replaces the matches in the len bytes at data, growing them by at most
+ * room bytes.  Returns how much the length changed, and leaves the new
+ * data in payload->buf if anything was replaced, in which case *changed
+ * is set
+ */
+static int
+payload_scan(tcpedit_payload_t *payload, const u_char *data, uint32_t len, int room, bool *changed)
+{
+    const uint32_t classes = payload->classes;
+    uint32_t i = 0, copied = 0, o = 0;
+    int32_t s = 0, r;
+    int diff = 0;
+
+    *changed = false;
+
+    while (i < len) {
+        const payload_rule_t *rule;
+        int next;
+
+        if (s == 0 && (i = payload_skip(payload, data, i, len)) == len)
+            break;
+
+        s = payload->next[s * classes + payload->cls[data[i++]]];
+        if ((r = payload->out[s]) < 0)
+            continue;
+
+        rule = &payload->rule[r];
+        next = diff + (int)rule->repl_len - (int)rule->match_len;
+        s = 0;
+        if (next > room) {
+            payload->capped++;
+            continue;
+        }
+
+        memcpy(payload->buf + o, data + copied, i - rule->match_len - copied);
+        o += i - rule->match_len - copied;
+        memcpy(payload->buf + o, rule->repl, rule->repl_len);
+        o += rule->repl_len;
+        copied = i;
+        diff = next;
+        payload->replaced++;
+        *changed = true;
+    }
+
+    if (*changed) {
+        memcpy(payload->buf + o, data + copied, len - copied);
+        payload->packets++;
+    }
+
+    return diff;
+}
+
+static payload_flow_t *
+payload_flow_find(tcpedit_payload_t *payload, const payload_flow_key_t *key, bool add)
+{
+    uint32_t i;
+
+    if (payload->flow == NULL) {
+        if (!add)
+            return NULL;
+
+        payload->flow_mask = 1023;
+        payload->flow = (payload_flow_t *)safe_malloc((payload->flow_mask + 1) * sizeof(payload_flow_t));
+    } else if (add && (payload->flows + 1) * 2 > payload->flow_mask + 1) {
+        payload_flow_t *old = payload->flow;
+        uint32_t n = payload->flow_mask + 1, j;
+
+        payload->flow_mask = n * 2 - 1;
+        payload->flow = (payload_flow_t *)safe_malloc(n * 2 * sizeof(payload_flow_t));
+        for (j = 0; j < n; j++) {
+            if (!old[j].used)
+                continue;
+
+            i = (uint32_t)flow_hash_words(&old[j].key, sizeof(old[j].key), 0) & payload->flow_mask;
+            while (payload->flow[i].used)
+                i = (i + 1) & payload->flow_mask;
+            payload->flow[i] = old[j];
+        }
+        safe_free(old);
+    }
+
+    i = (uint32_t)flow_hash_words(key, sizeof(*key), 0) & payload->flow_mask;
+    for (; payload->flow[i].used; i = (i + 1) & payload->flow_mask) {
+        if (memcmp(&payload->flow[i].key, key, sizeof(*key)) == 0)
+            return &payload->flow[i];
+    }
+
+    if (!add)
+        return NULL;
+
+    memset(&payload->flow[i], 0, sizeof(payload_flow_t));
+    payload->flow[i].key = *key;
+    payload->flow[i].used = true;
+    payload->flows++;
+
+    return &payload->flow[i];
+}
+
+/**
+ * total length change of the segments of flow which end at or before the
+ * sequence number seq
+ */
+static int32_t
+payload_flow_delta(const payload_flow_t *flow, uint32_t seq)
+{
+    uint32_t lo = 0, hi;
+
+    if (flow == NULL)
+        return 0;
+
+    /* the last point at or before seq, most often the last one */
+    hi = flow->cnt;
+    if (hi > 0 && (int32_t)(seq - flow->pt[hi - 1].end) >= 0)
+        return flow->pt[hi - 1].delta;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if ((int32_t)(seq - flow->pt[mid].end) >= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo > 0 ? flow->pt[lo - 1].delta : 0;
+}
+
+/**
+ * notes the segment at seq, len bytes long as captured, changed length
+ * by diff.  Retransmissions are known already
+ */
+static void
+payload_flow_note(payload_flow_t *flow, uint32_t seq, uint32_t len, int diff)
+{
+    uint32_t end = seq + len;
+    int32_t delta;
+
+    if (flow->cnt > 0 && (int32_t)(end - flow->pt[flow->cnt - 1].end) <= 0)
+        return;
+
+    delta = payload_flow_delta(flow, seq) + diff;
+
+    if (flow->cnt == flow->alloc) {
+        flow->alloc = flow->alloc ? flow->alloc * 2 : 16;
+        flow->pt = (payload_point_t *)safe_realloc(flow->pt, flow->alloc * sizeof(payload_point_t));
+    }
+
+    flow->pt[flow->cnt].end = end;
+    flow->pt[flow->cnt].delta = delta;
+    flow->cnt++;
+}
+
+/**
+ * rewrites the layer 4 payload of a packet whose IP header is at l3 and
+ * l4 header at l4, and the datagram ends at end.  The captured packet
+ * runs on to l3 + l3len.  Returns the TCPEDIT_DIRTY_* fields changed
+ */
+static int
+rewrite_payload(tcpedit_t *tcpedit,
+                struct pcap_pkthdr *pkthdr,
+                u_char *l3,
+                int l3len,
+                u_char *l4,
+                uint8_t proto,
+                u_char *end,
+                int room,
+                payload_flow_key_t *key)
+{
+    tcpedit_payload_t *payload = tcpedit->payload;
+    tcp_hdr_t *tcp_hdr = NULL;
+    u_char *data;
+    uint32_t len;
+    bool changed;
+    int diff, dirty = 0;
+
+    if (proto == IPPROTO_TCP) {
+        tcp_hdr = (tcp_hdr_t *)l4;
+        if (l4 + TCPR_TCP_H > end || l4 + (tcp_hdr->th_off << 2) > end)
+            return 0;
+        data = l4 + (tcp_hdr->th_off << 2);
+    } else if (proto == IPPROTO_UDP) {
+        if (l4 + TCPR_UDP_H > end)
+            return 0;
+        data = l4 + TCPR_UDP_H;
+    } else {
+        return 0;
+    }
+
+    len = (uint32_t)(end - data);
+    room = min(room, min(PAYLOAD_GROWTH_MAX, MAXPACKET - (int)pkthdr->caplen));
+    diff = payload_scan(payload, data, len, room, &changed);
+
+    if (changed) {
+        u_char *l3end = l3 + l3len;
+
+        /* whatever follows the datagram, such as Ethernet padding, moves along */
+        memmove(end + diff, end, (size_t)(l3end - end));
+        memcpy(data, payload->buf, len + diff);
+        pkthdr->caplen += diff;
+        pkthdr->len += diff;
+        dirty |= TCPEDIT_DIRTY_PAYLOAD;
+
+        if (proto == IPPROTO_UDP) {
+            udp_hdr_t *udp_hdr = (udp_hdr_t *)l4;
+
+            udp_hdr->uh_ulen = htons((uint16_t)(ntohs(udp_hdr->uh_ulen) + diff));
+        }
+    }
+
+    if (tcp_hdr != NULL && payload->resizes) {
+        payload_flow_key_t rev;
+        uint32_t seq = ntohl(tcp_hdr->th_seq), ack = ntohl(tcp_hdr->th_ack);
+        /* SYN takes up a sequence number ahead of the data */
+        uint32_t data_seq = seq + ((tcp_hdr->th_flags & TH_SYN) ? 1 : 0);
+        payload_flow_t *flow;
+        int32_t seq_delta, ack_delta = 0;
+
+        key->sport = tcp_hdr->th_sport;
+        key->dport = tcp_hdr->th_dport;
+        flow = payload_flow_find(payload, key, diff != 0);
+        seq_delta = payload_flow_delta(flow, seq);
+        if (diff != 0)
+            payload_flow_note(flow, data_seq, len, diff);
+
+        if (tcp_hdr->th_flags & TH_ACK) {
+            memset(&rev, 0, sizeof(rev));
+            memcpy(rev.src, key->dst, sizeof(rev.src));
+            memcpy(rev.dst, key->src, sizeof(rev.dst));
+            rev.sport = key->dport;
+            rev.dport = key->sport;
+            rev.family = key->family;
+            ack_delta = payload_flow_delta(payload_flow_find(payload, &rev, false), ack);
+        }
+
+        if (seq_delta != 0) {
+            uint32_t newnum = htonl(seq + (uint32_t)seq_delta);
+
+            csum_replace4(&tcp_hdr->th_sum, tcp_hdr->th_seq, newnum);
+            tcp_hdr->th_seq = newnum;
+            dirty |= TCPEDIT_DIRTY_HDR;
+        }
+
+        if (ack_delta != 0) {
+            uint32_t newnum = htonl(ack + (uint32_t)ack_delta);
+
+            csum_replace4(&tcp_hdr->th_sum, tcp_hdr->th_ack, newnum);
+            tcp_hdr->th_ack = newnum;
+            dirty |= TCPEDIT_DIRTY_HDR;
+        }
+    }
+
+    return dirty;
+}
+
+/**
+ * \brief --payload-rewrite of an IPv4 packet
+ *
+ * Only whole, unfragmented datagrams are rewritten.  Returns the
+ * TCPEDIT_DIRTY_* fields changed
+ */
+int
+rewrite_ipv4_payload(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv4_hdr_t *ip_hdr, int l2len)
+{
+    int l3len = (int)pkthdr->caplen - l2len;
+    int ip_len = ntohs(ip_hdr->ip_len);
+    payload_flow_key_t key;
+    u_char *l4;
+
+    assert(tcpedit);
+    assert(tcpedit->payload);
+
+    if (pkthdr->caplen != pkthdr->len || ip_len > l3len || (ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)) != 0)
+        return 0;
+
+    l4 = tcpedit_layer4_v4(tcpedit, ip_hdr, (u_char *)ip_hdr + l3len);
+    if (l4 == NULL || l4 > (u_char *)ip_hdr + ip_len)
+        return 0;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.src, &ip_hdr->ip_src, 4);
+    memcpy(key.dst, &ip_hdr->ip_dst, 4);
+    key.family = AF_INET;
+
+    return rewrite_payload(tcpedit,
+                           pkthdr,
+                           (u_char *)ip_hdr,
+                           l3len,
+                           l4,
+                           ip_hdr->ip_p,
+                           (u_char *)ip_hdr + ip_len,
+                           UINT16_MAX - ip_len,
+                           &key);
+}
+
+/**
+ * \brief --payload-rewrite of an IPv6 packet
+ *
+ * Only whole datagrams are rewritten, jumbograms and fragments aren't.
+ * Returns the TCPEDIT_DIRTY_* fields changed
+ */
+int
+rewrite_ipv6_payload(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv6_hdr_t *ip6_hdr, int l2len)
+{
+    int l3len = (int)pkthdr->caplen - l2len;
+    int plen = ntohs(ip6_hdr->ip_len);
+    payload_flow_key_t key;
+    uint8_t proto;
+    u_char *l4;
+
+    assert(tcpedit);
+    assert(tcpedit->payload);
+
+    if (pkthdr->caplen != pkthdr->len || plen == 0 || TCPR_IPV6_H + plen > l3len)
+        return 0;
+
+    l4 = tcpedit_layer4_v6(tcpedit, ip6_hdr, (u_char *)ip6_hdr + l3len, &proto);
+    if (l4 == NULL || l4 > (u_char *)ip6_hdr + TCPR_IPV6_H + plen)
+        return 0;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.src, &ip6_hdr->ip_src, 16);
+    memcpy(key.dst, &ip6_hdr->ip_dst, 16);
+    key.family = AF_INET6;
+
+    return rewrite_payload(tcpedit,
+                           pkthdr,
+                           (u_char *)ip6_hdr,
+                           l3len,
+                           l4,
+                           proto,
+                           (u_char *)ip6_hdr + TCPR_IPV6_H + plen,
+                           UINT16_MAX - plen,
+                           &key);
+}
@@ -0,0 +1,35 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpedit_types.h"
+
+/* most bytes --payload-rewrite adds to a packet, later matches are left alone */
+#define PAYLOAD_GROWTH_MAX 256
+/* first bytes of the patterns the SSE2 prefilter compares at once */
+#define PAYLOAD_SIMD_FIRST 8
+
+int payload_load(tcpedit_t *tcpedit, const char *path);
+void payload_free(tcpedit_payload_t *payload);
+int payload_growth(const tcpedit_payload_t *payload);
+bool payload_resizes(const tcpedit_payload_t *payload);
+int rewrite_ipv4_payload(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv4_hdr_t *ip_hdr, int l2len);
+int rewrite_ipv6_payload(tcpedit_t *tcpedit, struct pcap_pkthdr *pkthdr, ipv6_hdr_t *ip6_hdr, int l2len);
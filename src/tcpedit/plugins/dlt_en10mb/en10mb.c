@@ -67,6 +67,7 @@ dlt_en10mb_register(tcpeditdlt_t *ctx)
     plugin->plugin_init = dlt_en10mb_init;
     plugin->plugin_cleanup = dlt_en10mb_cleanup;
     plugin->plugin_parse_opts = dlt_en10mb_parse_opts;
+    plugin->plugin_post_init = dlt_en10mb_post_init;
     plugin->plugin_decode = dlt_en10mb_decode;
     plugin->plugin_encode = dlt_en10mb_encode;
     plugin->plugin_proto = dlt_en10mb_proto;
@@ -146,6 +147,7 @@ dlt_en10mb_cleanup(tcpeditdlt_t *ctx)
     if (plugin->config != NULL) {
         en10mb_config_t *config = (en10mb_config_t *)plugin->config;
         safe_free(config->subs.entries);
+        ethernet_mac_map_free(config->subs.map);
         safe_free(plugin->config);
         plugin->config = NULL;
         plugin->config_size = 0;
@@ -213,9 +215,38 @@ dlt_en10mb_parse_subsmac(tcpeditdlt_t *ctx, en10mb_config_t *config, const char
 
     free(entries);
 
+    dlt_en10mb_compile_subsmac(&config->subs);
+
     return TCPEDIT_OK;
 }
 
+/*
+ * Builds the hash table dlt_en10mb_rewrite_macs() looks addresses up in.
+ * The entries are applied in order, so a target rewritten to the target of
+ * a later entry is rewritten again: the table holds the final address
+ */
+void
+dlt_en10mb_compile_subsmac(en10mb_sub_conf_t *subs)
+{
+    int i, j;
+
+    ethernet_mac_map_free(subs->map);
+    subs->map = ethernet_mac_map_new(subs->count);
+
+    for (i = 0; i < subs->count; i++) {
+        tcpr_macaddr_t mac;
+
+        memcpy(mac, subs->entries[i].target, ETHER_ADDR_LEN);
+        for (j = i; j < subs->count; j++) {
+            if (!memcmp(mac, subs->entries[j].target, ETHER_ADDR_LEN))
+                memcpy(mac, subs->entries[j].rewrite, ETHER_ADDR_LEN);
+        }
+
+        /* a repeated target was already resolved by its first entry */
+        ethernet_mac_map_add(subs->map, subs->entries[i].target, mac);
+    }
+}
+
 /*
  * This is where you should define all your AutoGen AutoOpts option parsing.
  * Any user specified option should have it's bit turned on in the 'provides'
@@ -382,6 +413,106 @@ dlt_en10mb_parse_opts(tcpeditdlt_t *ctx)
     return TCPEDIT_OK; /* success */
 }
 
+/*
+ * Applies --enet-subsmac and --enet-mac-seed to the MAC addresses of eth
+ */
+static void
+dlt_en10mb_rewrite_macs(tcpeditdlt_t *ctx, en10mb_config_t *config, struct tcpr_ethernet_hdr *eth)
+{
+    if (config->subs.map) {
+        const u_char *rewrite;
+
+        if ((rewrite = ethernet_mac_map_find(config->subs.map, eth->ether_dhost)) != NULL)
+            memcpy(eth->ether_dhost, rewrite, ETHER_ADDR_LEN);
+
+        if ((rewrite = ethernet_mac_map_find(config->subs.map, eth->ether_shost)) != NULL)
+            memcpy(eth->ether_shost, rewrite, ETHER_ADDR_LEN);
+    }
+
+    if (config->random.set) {
+        int unicast_src = is_unicast_ethernet(ctx, eth->ether_shost);
+        int unicast_dst = is_unicast_ethernet(ctx, eth->ether_dhost);
+
+        int i = config->random.keep;
+        for (; i < ETHER_ADDR_LEN; i++) {
+            eth->ether_shost[i] = MAC_MASK_APPLY(eth->ether_shost[i], config->random.mask[i], unicast_src);
+            eth->ether_dhost[i] = MAC_MASK_APPLY(eth->ether_dhost[i], config->random.mask[i], unicast_dst);
+        }
+
+        /* avoid making unicast packets multicast */
+        if (!config->random.keep) {
+            eth->ether_shost[0] &= ~(0x01 * unicast_src);
+            eth->ether_dhost[0] &= ~(0x01 * unicast_dst);
+        }
+    }
+}
+
+/*
+ * Prepares the fixed parts of the L2 header of each direction, so the
+ * encoder can copy them rather than work them out for every packet.  Call
+ * again whenever the MAC or VLAN settings in config change
+ */
+void
+dlt_en10mb_build_templates(tcpeditdlt_t *ctx, en10mb_config_t *config)
+{
+    static const tcpedit_mac_mask mac_masks[2][2] = {
+        {TCPEDIT_MAC_MASK_DMAC1, TCPEDIT_MAC_MASK_SMAC1},
+        {TCPEDIT_MAC_MASK_DMAC2, TCPEDIT_MAC_MASK_SMAC2},
+    };
+    struct tcpr_ethernet_hdr eth;
+    int i;
+
+    assert(ctx);
+    assert(config);
+
+    for (i = 0; i < 2; i++) {
+        config->mac_template[i].set = false;
+
+        /* with --skipl2broadcast the original address of some packets is kept */
+        if ((config->mac_mask & mac_masks[i][0]) == 0 || (config->mac_mask & mac_masks[i][1]) == 0 ||
+            (ctx->skip_broadcast && ctx->addr_type == ETHERNET))
+            continue;
+
+        memset(&eth, 0, sizeof(eth));
+        memcpy(eth.ether_dhost, i == 0 ? config->intf1_dmac : config->intf2_dmac, ETHER_ADDR_LEN);
+        memcpy(eth.ether_shost, i == 0 ? config->intf1_smac : config->intf2_smac, ETHER_ADDR_LEN);
+        dlt_en10mb_rewrite_macs(ctx, config, &eth);
+
+        memcpy(config->mac_template[i].macs, eth.ether_dhost, ETHER_ADDR_LEN);
+        memcpy(config->mac_template[i].macs + ETHER_ADDR_LEN, eth.ether_shost, ETHER_ADDR_LEN);
+        config->mac_template[i].set = true;
+    }
+
+    /* the same sum dlt_en10mb_encode() would make */
+    config->tci_template_set = config->vlan_tag < 65535 && config->vlan_pri < 255 && config->vlan_cfi < 255;
+    if (config->tci_template_set) {
+        config->tci_template = htons((uint16_t)config->vlan_tag & TCPR_802_1Q_VIDMASK);
+        config->tci_template += htons((uint16_t)config->vlan_pri << 13);
+        config->tci_template += htons((uint16_t)config->vlan_cfi << 12);
+    }
+}
+
+/*
+ * Called once all the options are parsed
+ * Returns: TCPEDIT_ERROR | TCPEDIT_OK | TCPEDIT_WARN
+ */
+int
+dlt_en10mb_post_init(tcpeditdlt_t *ctx)
+{
+    tcpeditdlt_plugin_t *plugin;
+
+    assert(ctx);
+
+    if ((plugin = tcpedit_dlt_getplugin(ctx, dlt_value)) == NULL || plugin->config == NULL) {
+        tcpedit_seterr(ctx->tcpedit, "Unable to post init unregistered plugin %s", dlt_name);
+        return TCPEDIT_ERROR;
+    }
+
+    dlt_en10mb_build_templates(ctx, (en10mb_config_t *)plugin->config);
+
+    return TCPEDIT_OK;
+}
+
 /*
  * Function to decode the layer 2 header in the packet
  * Returns: TCPEDIT_ERROR | TCPEDIT_OK | TCPEDIT_WARN
@@ -560,7 +691,10 @@ dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
     /* set the src & dst address as the first 12 bytes */
     eth = (struct tcpr_ethernet_hdr *)(packet + ctx->l2offset);
 
-    if (dir == TCPR_DIR_C2S) {
+    if ((dir == TCPR_DIR_C2S || dir == TCPR_DIR_S2C) && config->mac_template[dir - 1].set) {
+        /* both addresses were given and every packet gets them */
+        memcpy(eth, config->mac_template[dir - 1].macs, sizeof(config->mac_template[dir - 1].macs));
+    } else if (dir == TCPR_DIR_C2S) {
         /* copy user supplied SRC MAC if provided or from original packet */
         if (config->mac_mask & TCPEDIT_MAC_MASK_SMAC1) {
             if ((ctx->addr_type == ETHERNET &&
@@ -633,37 +767,8 @@ dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
         return TCPEDIT_ERROR;
     }
 
-    if (config->subs.entries) {
-        int entry = 0;
-        for (entry = 0; entry < config->subs.count; entry++) {
-            en10mb_sub_entry_t *current = &config->subs.entries[entry];
-
-            if (!memcmp(eth->ether_dhost, current->target, ETHER_ADDR_LEN)) {
-                memcpy(eth->ether_dhost, current->rewrite, ETHER_ADDR_LEN);
-            }
-
-            if (!memcmp(eth->ether_shost, current->target, ETHER_ADDR_LEN)) {
-                memcpy(eth->ether_shost, current->rewrite, ETHER_ADDR_LEN);
-            }
-        }
-    }
-
-    if (config->random.set) {
-        int unicast_src = is_unicast_ethernet(ctx, eth->ether_shost);
-        int unicast_dst = is_unicast_ethernet(ctx, eth->ether_dhost);
-
-        int i = config->random.keep;
-        for (; i < ETHER_ADDR_LEN; i++) {
-            eth->ether_shost[i] = MAC_MASK_APPLY(eth->ether_shost[i], config->random.mask[i], unicast_src);
-            eth->ether_dhost[i] = MAC_MASK_APPLY(eth->ether_dhost[i], config->random.mask[i], unicast_dst);
-        }
-
-        /* avoid making unicast packets multicast */
-        if (!config->random.keep) {
-            eth->ether_shost[0] &= ~(0x01 * unicast_src);
-            eth->ether_dhost[0] &= ~(0x01 * unicast_dst);
-        }
-    }
+    if (!config->mac_template[dir - 1].set)
+        dlt_en10mb_rewrite_macs(ctx, config, eth);
 
     if (config->vlan == TCPEDIT_VLAN_ADD || (config->vlan == TCPEDIT_VLAN_OFF && extra->vlan)) {
         vlan_hdr = (struct tcpr_802_1q_hdr *)(packet + extra->vlan_offset);
@@ -675,7 +780,9 @@ dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
         }
 
         /* are we changing VLAN info? */
-        if (config->vlan_tag < 65535) {
+        if (config->tci_template_set) {
+            vlan_hdr->vlan_tci = config->tci_template;
+        } else if (config->vlan_tag < 65535) {
             vlan_hdr->vlan_tci = htons((uint16_t)config->vlan_tag & TCPR_802_1Q_VIDMASK);
         } else if (extra->vlan) {
             vlan_hdr->vlan_tci = htons(extra->vlan_tag);
@@ -684,7 +791,9 @@ dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
             return TCPEDIT_ERROR;
         }
 
-        if (config->vlan_pri < 255) {
+        if (config->tci_template_set) {
+            /* tag, priority and CFI are all in the template */
+        } else if (config->vlan_pri < 255) {
             vlan_hdr->vlan_tci += htons((uint16_t)config->vlan_pri << 13);
         } else if (extra->vlan) {
             vlan_hdr->vlan_tci += htons(extra->vlan_pri);
@@ -693,7 +802,9 @@ dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir)
             return TCPEDIT_ERROR;
         }
 
-        if (config->vlan_cfi < 255) {
+        if (config->tci_template_set) {
+            /* in the template */
+        } else if (config->vlan_cfi < 255) {
             vlan_hdr->vlan_tci += htons((uint16_t)config->vlan_cfi << 12);
         } else if (extra->vlan) {
             vlan_hdr->vlan_tci += htons(extra->vlan_cfi);
@@ -37,6 +37,9 @@ int dlt_en10mb_register(tcpeditdlt_t *ctx);
 int dlt_en10mb_init(tcpeditdlt_t *ctx);
 int dlt_en10mb_cleanup(tcpeditdlt_t *ctx);
 int dlt_en10mb_parse_opts(tcpeditdlt_t *ctx);
+int dlt_en10mb_post_init(tcpeditdlt_t *ctx);
+void dlt_en10mb_build_templates(tcpeditdlt_t *ctx, en10mb_config_t *config);
+void dlt_en10mb_compile_subsmac(en10mb_sub_conf_t *subs);
 int dlt_en10mb_decode(tcpeditdlt_t *ctx, const u_char *packet, int pktlen);
 int dlt_en10mb_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t dir);
 int dlt_en10mb_proto(tcpeditdlt_t *ctx, const u_char *packet, int pktlen);
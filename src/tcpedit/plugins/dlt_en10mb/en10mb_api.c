@@ -96,6 +96,8 @@ tcpedit_en10mb_set_mac(tcpedit_t *tcpedit, char *mac, tcpedit_mac_mask mask)
         break;
     }
 
+    dlt_en10mb_build_templates(ctx, config);
+
     return TCPEDIT_OK;
 }
 
@@ -141,6 +143,7 @@ tcpedit_en10mb_set_vlan_tag(tcpedit_t *tcpedit, uint16_t tag)
     config = (en10mb_config_t *)plugin->config;
 
     config->vlan_tag = tag;
+    dlt_en10mb_build_templates(ctx, config);
 
     return TCPEDIT_OK;
 }
@@ -164,6 +167,7 @@ tcpedit_en10mb_set_vlan_priority(tcpedit_t *tcpedit, uint8_t priority)
     config = (en10mb_config_t *)plugin->config;
 
     config->vlan_pri = priority;
+    dlt_en10mb_build_templates(ctx, config);
 
     return TCPEDIT_OK;
 }
@@ -187,6 +191,7 @@ tcpedit_en10mb_set_vlan_cfi(tcpedit_t *tcpedit, uint8_t cfi)
     config = (en10mb_config_t *)plugin->config;
 
     config->vlan_cfi = cfi;
+    dlt_en10mb_build_templates(ctx, config);
 
     return TCPEDIT_OK;
 }
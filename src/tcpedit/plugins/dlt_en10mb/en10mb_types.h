@@ -59,6 +59,7 @@ typedef struct {
 typedef struct {
     int count;
     en10mb_sub_entry_t *entries;
+    struct ethernet_mac_map_s *map; /* what each target ends up as, see dlt_en10mb_compile_subsmac() */
 } en10mb_sub_conf_t;
 
 typedef struct {
@@ -90,6 +91,19 @@ typedef struct {
 
     /* 802.1Q/802.1ad VLAN Q-in-Q - 0 means 802.1Q */
     u_int16_t vlan_proto;
+
+    /*
+     * prepared by dlt_en10mb_build_templates() from the values above: the
+     * destination and source MAC of each direction (C2S, S2C), with
+     * --enet-subsmac and --enet-mac-seed already applied, and the 802.1Q
+     * TCI.  Only set when they are the same for every packet
+     */
+    struct {
+        bool set;
+        u_char macs[2 * ETHER_ADDR_LEN];
+    } mac_template[2];
+    bool tci_template_set;
+    u_int16_t tci_template; /* network byte order */
 } en10mb_config_t;
 
 #ifdef __cplusplus
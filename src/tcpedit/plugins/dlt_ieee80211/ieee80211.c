@@ -23,6 +23,7 @@
 #include "ieee80211_hdr.h"
 #include "tcpedit.h"
 #include "tcpedit_stub.h"
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -116,6 +117,7 @@ dlt_ieee80211_init(tcpeditdlt_t *ctx)
         ctx->decoded_extra_size = sizeof(ieee80211_extra_t);
         ctx->decoded_extra = safe_malloc(ctx->decoded_extra_size);
     }
+    ((ieee80211_extra_t *)ctx->decoded_extra)->layout.valid = false;
 
     /* allocate memory for our config data */
     plugin->config_size = sizeof(ieee80211_config_t);
@@ -167,6 +169,98 @@ dlt_ieee80211_parse_opts(tcpeditdlt_t *ctx)
     return TCPEDIT_OK; /* success */
 }
 
+/*
+ * return the length of the L2 header of the current packet
+ * based on: http://www.tcpdump.org/lists/workers/2004/07/msg00121.html
+ */
+static int
+ieee80211_parse_l2len(const u_char *packet, int pktlen, ieee80211_layout_t *layout)
+{
+    uint16_t *frame_control, fc;
+    int hdrlen;
+
+    if (pktlen < (int)sizeof(uint16_t))
+        return 0;
+
+    dbgx(2, "packet = %p\t\tplen = %d", packet, pktlen);
+
+    frame_control = (uint16_t *)packet;
+    fc = ntohs(*frame_control);
+
+    if (ieee80211_USE_4(fc)) {
+        hdrlen = sizeof(ieee80211_addr4_hdr_t);
+    } else {
+        hdrlen = sizeof(ieee80211_hdr_t);
+    }
+
+    /* if Data/QoS, then L2 len is + 2 bytes */
+    if ((fc & ieee80211_FC_SUBTYPE_QOS) == ieee80211_FC_SUBTYPE_QOS) {
+        dbgx(2, "total header length (fc %04x) (802.11 + QoS data): %d", fc, hdrlen + 2);
+        hdrlen += 2;
+    }
+    layout->hdrlen = hdrlen;
+
+    if (pktlen >= (hdrlen + (int)sizeof(struct tcpr_802_2snap_hdr))) {
+        struct tcpr_802_2snap_hdr *hdr;
+
+        hdr = (struct tcpr_802_2snap_hdr *)&packet[hdrlen];
+        layout->llc[0] = hdr->snap_dsap;
+        layout->llc[1] = hdr->snap_ssap;
+        layout->valid = true;
+
+        /* verify the header is 802.2SNAP (8 bytes) not 802.2 (3 bytes) */
+        if (hdr->snap_dsap == 0xAA && hdr->snap_ssap == 0xAA) {
+            hdrlen += (int)sizeof(struct tcpr_802_2snap_hdr);
+            layout->snap = true;
+            dbgx(2, "total header length (802.11 + 802.2SNAP): %d", hdrlen);
+        } else {
+            hdrlen += (int)sizeof(struct tcpr_802_2_hdr);
+            dbgx(2, "total header length (802.11 + 802.2): %d (%02x/%02x)", hdrlen, hdr->snap_dsap, hdr->snap_ssap);
+        }
+    }
+
+    if (pktlen < hdrlen) {
+        layout->valid = false;
+        return 0;
+    }
+
+    dbgx(2, "header length: %d", hdrlen);
+    return hdrlen;
+}
+
+/*
+ * returns the layout of the headers of the given packet, that of the
+ * previous packet if it has the same frame control and DSAP/SSAP, or
+ * NULL if the context has no room for it
+ */
+static ieee80211_layout_t *
+ieee80211_get_layout(tcpeditdlt_t *ctx, const u_char *packet, int pktlen)
+{
+    ieee80211_layout_t *layout;
+    uint16_t fc = 0;
+
+    if (ctx->decoded_extra_size < sizeof(*layout))
+        return NULL;
+
+    layout = (ieee80211_layout_t *)ctx->decoded_extra;
+    if (pktlen >= (int)sizeof(fc))
+        memcpy(&fc, packet, sizeof(fc));
+
+    if (layout->valid && fc == layout->fc && pktlen >= layout->hdrlen + (int)sizeof(struct tcpr_802_2snap_hdr) &&
+        packet[layout->hdrlen] == layout->llc[0] && packet[layout->hdrlen + 1] == layout->llc[1])
+        return layout;
+
+    memset(layout, 0, sizeof(*layout));
+    layout->fc = fc;
+    layout->l2len = ieee80211_parse_l2len(packet, pktlen, layout);
+    if (pktlen >= (int)sizeof(fc)) {
+        layout->src = (int)(ieee80211_get_src(packet) - packet);
+        layout->dst = (int)(ieee80211_get_dst(packet) - packet);
+    }
+
+    return layout;
+}
+
 /*
  * Function to decode the layer 2 header in the packet.
  * You need to fill out:
@@ -180,33 +274,39 @@ dlt_ieee80211_parse_opts(tcpeditdlt_t *ctx)
 int
 dlt_ieee80211_decode(tcpeditdlt_t *ctx, const u_char *packet, int pktlen)
 {
-    int l2len;
+    ieee80211_layout_t *layout;
 
     assert(ctx);
     assert(packet);
 
-    l2len = dlt_ieee80211_l2len(ctx, packet, pktlen);
-    if (l2len == -1 || pktlen < l2len)
+    layout = ieee80211_get_layout(ctx, packet, pktlen);
+    if (layout == NULL || pktlen < layout->l2len)
         return TCPEDIT_ERROR;
 
     dbgx(3, "Decoding 802.11 packet " COUNTER_SPEC, ctx->tcpedit->runtime.packetnum);
-    if (!ieee80211_is_data(ctx, packet, pktlen)) {
+    if (!layout->checked) {
+        layout->data = ieee80211_is_data(ctx, packet, pktlen);
+        layout->encrypted = ieee80211_is_encrypted(ctx, packet, pktlen);
+        layout->checked = true;
+    }
+
+    if (!layout->data) {
         tcpedit_seterr(ctx->tcpedit,
                        "Packet " COUNTER_SPEC " is not a normal 802.11 data frame",
                        ctx->tcpedit->runtime.packetnum);
         return TCPEDIT_SOFT_ERROR;
     }
 
-    if (ieee80211_is_encrypted(ctx, packet, pktlen)) {
+    if (layout->encrypted) {
         tcpedit_seterr(ctx->tcpedit,
                        "Packet " COUNTER_SPEC " is encrypted.  Unable to decode frame.",
                        ctx->tcpedit->runtime.packetnum);
         return TCPEDIT_SOFT_ERROR;
     }
 
-    ctx->l2len = l2len;
-    memcpy(&(ctx->srcaddr), ieee80211_get_src((ieee80211_hdr_t *)packet), ETHER_ADDR_LEN);
-    memcpy(&(ctx->dstaddr), ieee80211_get_dst((ieee80211_hdr_t *)packet), ETHER_ADDR_LEN);
+    ctx->l2len = layout->l2len;
+    memcpy(&(ctx->srcaddr), &packet[layout->src], ETHER_ADDR_LEN);
+    memcpy(&(ctx->dstaddr), &packet[layout->dst], ETHER_ADDR_LEN);
     ctx->proto = dlt_ieee80211_proto(ctx, packet, pktlen);
 
     return TCPEDIT_OK; /* success */
@@ -232,48 +332,26 @@ dlt_ieee80211_encode(tcpeditdlt_t *ctx, u_char *packet, _U_ int pktlen, _U_ tcpr
 int
 dlt_ieee80211_proto(tcpeditdlt_t *ctx, const u_char *packet, int pktlen)
 {
-    int l2len;
-    int hdrlen = 0;
-    uint16_t *frame_control, fc;
-    struct tcpr_802_2snap_hdr *hdr;
+    ieee80211_layout_t *layout;
+    uint16_t proto;
 
     assert(ctx);
     assert(packet);
 
-    l2len = dlt_ieee80211_l2len(ctx, packet, pktlen);
-    if (l2len == -1 || pktlen < l2len)
+    layout = ieee80211_get_layout(ctx, packet, pktlen);
+    if (layout == NULL || pktlen < layout->l2len)
         return TCPEDIT_ERROR;
 
-    /* check 802.11 frame control field */
-    frame_control = (uint16_t *)packet;
-    fc = ntohs(*frame_control);
-
     /* Not all 802.11 frames have data */
-    if ((fc & ieee80211_FC_TYPE_MASK) != ieee80211_FC_TYPE_DATA)
-        return TCPEDIT_SOFT_ERROR;
-
-    /* Some data frames are QoS and have no data
-        if (((fc & ieee80211_FC_SUBTYPE_MASK) & ieee80211_FC_SUBTYPE_QOS) == ieee80211_FC_SUBTYPE_QOS)
+    if ((ntohs(layout->fc) & ieee80211_FC_TYPE_MASK) != ieee80211_FC_TYPE_DATA)
         return TCPEDIT_SOFT_ERROR;
-    */
-    if ((fc & ieee80211_FC_SUBTYPE_QOS) == ieee80211_FC_SUBTYPE_QOS) {
-        hdrlen += 2;
-    }
-
-    /* figure out the actual header length */
-    if (ieee80211_USE_4(fc)) {
-        hdrlen += sizeof(ieee80211_addr4_hdr_t);
-    } else {
-        hdrlen += sizeof(ieee80211_hdr_t);
-    }
-
-    hdr = (struct tcpr_802_2snap_hdr *)&packet[hdrlen];
 
     /* verify the header is 802.2SNAP (8 bytes) not 802.2 (3 bytes) */
-    if (hdr->snap_dsap == 0xAA && hdr->snap_ssap == 0xAA)
-        return hdr->snap_type;
+    if (!layout->snap)
+        return TCPEDIT_SOFT_ERROR; /* 802.2 has no type field */
 
-    return TCPEDIT_SOFT_ERROR; /* 802.2 has no type field */
+    memcpy(&proto, &packet[layout->hdrlen + offsetof(struct tcpr_802_2snap_hdr, snap_type)], sizeof(proto));
+    return proto;
 }
 
 /*
@@ -318,57 +396,20 @@ dlt_ieee80211_merge_layer3(tcpeditdlt_t *ctx, u_char *packet, int pktlen, u_char
 
 /*
  * return the length of the L2 header of the current packet
- * based on: http://www.tcpdump.org/lists/workers/2004/07/msg00121.html
  */
 int
 dlt_ieee80211_l2len(tcpeditdlt_t *ctx, const u_char *packet, int pktlen)
 {
-    uint16_t *frame_control, fc;
-    int hdrlen;
+    ieee80211_layout_t *layout;
 
     assert(ctx);
     assert(packet);
 
-    if (pktlen < (int)sizeof(uint16_t))
-        return 0;
-
-    dbgx(2, "packet = %p\t\tplen = %d", packet, pktlen);
-
-    frame_control = (uint16_t *)packet;
-    fc = ntohs(*frame_control);
-
-    if (ieee80211_USE_4(fc)) {
-        hdrlen = sizeof(ieee80211_addr4_hdr_t);
-    } else {
-        hdrlen = sizeof(ieee80211_hdr_t);
-    }
-
-    /* if Data/QoS, then L2 len is + 2 bytes */
-    if ((fc & ieee80211_FC_SUBTYPE_QOS) == ieee80211_FC_SUBTYPE_QOS) {
-        dbgx(2, "total header length (fc %04x) (802.11 + QoS data): %d", fc, hdrlen + 2);
-        hdrlen += 2;
-    }
-
-    if (pktlen >= (hdrlen + (int)sizeof(struct tcpr_802_2snap_hdr))) {
-        struct tcpr_802_2snap_hdr *hdr;
-
-        hdr = (struct tcpr_802_2snap_hdr *)&packet[hdrlen];
-
-        /* verify the header is 802.2SNAP (8 bytes) not 802.2 (3 bytes) */
-        if (hdr->snap_dsap == 0xAA && hdr->snap_ssap == 0xAA) {
-            hdrlen += (int)sizeof(struct tcpr_802_2snap_hdr);
-            dbgx(2, "total header length (802.11 + 802.2SNAP): %d", hdrlen);
-        } else {
-            hdrlen += (int)sizeof(struct tcpr_802_2_hdr);
-            dbgx(2, "total header length (802.11 + 802.2): %d (%02x/%02x)", hdrlen, hdr->snap_dsap, hdr->snap_ssap);
-        }
-    }
-
-    if (pktlen < hdrlen)
-        return 0;
+    layout = ieee80211_get_layout(ctx, packet, pktlen);
+    if (layout == NULL)
+        return -1;
 
-    dbgx(2, "header length: %d", hdrlen);
-    return hdrlen;
+    return layout->l2len;
 }
 
 /*
@@ -378,21 +419,23 @@ dlt_ieee80211_l2len(tcpeditdlt_t *ctx, const u_char *packet, int pktlen)
 u_char *
 dlt_ieee80211_get_mac(tcpeditdlt_t *ctx, tcpeditdlt_mac_type_t mac, const u_char *packet, int pktlen)
 {
+    ieee80211_layout_t *layout;
+
     assert(ctx);
     assert(packet);
-    u_char *macaddr;
 
     if (pktlen < 14)
         return NULL;
 
+    if ((layout = ieee80211_get_layout(ctx, packet, pktlen)) == NULL)
+        return NULL;
+
     switch (mac) {
     case SRC_MAC:
-        macaddr = ieee80211_get_src(packet);
-        memcpy(ctx->srcmac, macaddr, ETHER_ADDR_LEN);
+        memcpy(ctx->srcmac, &packet[layout->src], ETHER_ADDR_LEN);
         return (ctx->srcmac);
     case DST_MAC:
-        macaddr = ieee80211_get_dst(packet);
-        memcpy(ctx->dstmac, macaddr, ETHER_ADDR_LEN);
+        memcpy(ctx->dstmac, &packet[layout->dst], ETHER_ADDR_LEN);
         return (ctx->dstmac);
     default:
         errx(1, "Invalid tcpeditdlt_mac_type_t: %d", mac);
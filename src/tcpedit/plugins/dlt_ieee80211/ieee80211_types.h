@@ -76,11 +76,33 @@ typedef struct {
             (ieee80211_FC_TO_DS_MASK + ieee80211_FC_FROM_DS_MASK)
 
 /*
- * FIXME: structure to hold any data parsed from the packet by the decoder.
- * Example: Ethernet VLAN tag info
+ * Where the headers of an 802.11 data frame end and its addresses are.
+ * That only depends on the frame control field and the DSAP/SSAP after
+ * the 802.11 header, which seldom change within a capture, so it is
+ * worked out once and kept for the following packets as long as those
+ * four bytes are the same.
  */
 typedef struct {
-    u_char packet[MAXPACKET];
+    bool valid;     /* may be reused by the next packet which matches */
+    uint16_t fc;    /* frame control, as found in the packet */
+    u_char llc[2];  /* DSAP and SSAP */
+    int hdrlen;     /* 802.11 header, with the QoS field */
+    int l2len;      /* and the 802.2 or 802.2SNAP header */
+    bool snap;
+    int src;        /* offsets of the source and destination MAC */
+    int dst;
+    bool checked;   /* data and encrypted are known */
+    bool data;
+    bool encrypted;
+} ieee80211_layout_t;
+
+/*
+ * structure to hold any data parsed from the packet by the decoder.
+ * The radiotap plugin uses the same functions, so its extra data starts
+ * with the layout as well.
+ */
+typedef struct {
+    ieee80211_layout_t layout; /* must be first */
 } ieee80211_extra_t;
 
 /*
@@ -256,6 +256,16 @@ tcpedit_dlt_post_init(tcpeditdlt_t *tcpedit)
         if (tcpedit->encoder->plugin_post_init(tcpedit) == TCPEDIT_ERROR)
             return TCPEDIT_ERROR;
 
+    /* pick a specialized code path for the common pairs */
+    tcpedit->fastpath = TCPEDIT_DLT_FAST_NONE;
+    if (tcpedit->encoder->dlt == DLT_EN10MB) {
+        if (tcpedit->decoder->dlt == DLT_EN10MB)
+            tcpedit->fastpath = TCPEDIT_DLT_FAST_EN10MB;
+        else if (tcpedit->decoder->dlt == DLT_RAW)
+            tcpedit->fastpath = TCPEDIT_DLT_FAST_RAW_EN10MB;
+    }
+    dbgx(1, "DLT fast path: %d", tcpedit->fastpath);
+
     return TCPEDIT_OK;
 }
 
@@ -280,6 +290,87 @@ tcpedit_dlt_output_dlt(tcpeditdlt_t *ctx)
     return dlt;
 }
 
+/**
+ * \brief Most bytes the encoder may add to the layer 2 header of a packet
+ *
+ * Returns 0 if the encoder never grows packets, so they can be edited in
+ * any buffer holding them, or -1 if we can't tell.
+ */
+int
+tcpedit_dlt_growth(tcpeditdlt_t *ctx)
+{
+    en10mb_config_t *en10mb_config;
+    user_config_t *user_config;
+
+    assert(ctx);
+
+    switch (ctx->encoder->dlt) {
+    case DLT_EN10MB:
+        en10mb_config = ctx->encoder->config;
+
+        /* ethernet -> ethernet only grows when adding a VLAN tag */
+        if (ctx->encoder == ctx->decoder)
+            return en10mb_config->vlan == TCPEDIT_VLAN_ADD ? (int)sizeof(vlan_hdr_t) : 0;
+
+        return TCPR_802_1Q_H;
+
+    case DLT_C_HDLC:
+        return ctx->encoder == ctx->decoder ? 0 : CISCO_HDLC_LEN;
+
+    case DLT_USER0:
+        user_config = ctx->encoder->config;
+        return user_config->length > 0 ? user_config->length : 0;
+
+    default:
+        return ctx->encoder == ctx->decoder ? 0 : -1;
+    }
+}
+
+/**
+ * \brief Does the encoder leave the length of every packet alone?
+ *
+ * Only when the output DLT is the input's, and for ethernet when VLAN tags
+ * are neither added nor removed.
+ */
+bool
+tcpedit_dlt_preserves_size(tcpeditdlt_t *ctx)
+{
+    en10mb_config_t *en10mb_config;
+
+    assert(ctx);
+
+    if (ctx->encoder != ctx->decoder)
+        return false;
+
+    if (ctx->encoder->dlt == DLT_EN10MB) {
+        en10mb_config = ctx->encoder->config;
+        return en10mb_config->vlan == TCPEDIT_VLAN_OFF;
+    }
+
+    return true;
+}
+
+/**
+ * \brief Does the DLT plugin leave every layer 2 header as it is?
+ *
+ * Only known for Ethernet to Ethernet without any MAC or VLAN edits,
+ * other plugins are assumed to always touch the header.
+ */
+bool
+tcpedit_dlt_is_passthru(tcpeditdlt_t *ctx)
+{
+    en10mb_config_t *en10mb_config;
+
+    assert(ctx);
+
+    if (ctx->encoder != ctx->decoder || ctx->encoder->dlt != DLT_EN10MB)
+        return false;
+
+    en10mb_config = ctx->encoder->config;
+    return en10mb_config->vlan == TCPEDIT_VLAN_OFF && en10mb_config->mac_mask == 0 &&
+           en10mb_config->subs.count == 0 && en10mb_config->random.set == 0;
+}
+
 /**
  * Get the layer 2 length of the packet using the DLT plugin currently in
  * place
@@ -294,12 +385,16 @@ tcpedit_dlt_l2len(tcpeditdlt_t *ctx, int dlt, const u_char *packet, const int pk
     assert(dlt >= 0);
     assert(packet);
 
-    if ((plugin = tcpedit_dlt_getplugin(ctx, dlt)) == NULL) {
-        tcpedit_seterr(ctx->tcpedit, "Unable to find plugin for DLT 0x%04x", dlt);
-        return -1;
-    }
+    if (ctx->fastpath != TCPEDIT_DLT_FAST_NONE && dlt == DLT_EN10MB) {
+        res = dlt_en10mb_l2len(ctx, packet, pktlen);
+    } else {
+        if ((plugin = tcpedit_dlt_getplugin(ctx, dlt)) == NULL) {
+            tcpedit_seterr(ctx->tcpedit, "Unable to find plugin for DLT 0x%04x", dlt);
+            return -1;
+        }
 
-    res = plugin->plugin_l2len(ctx, packet, pktlen);
+        res = plugin->plugin_l2len(ctx, packet, pktlen);
+    }
     if (res == -1) {
         tcpedit_seterr(ctx->tcpedit,
                        "Packet length %d is to short to contain a layer 2 header for DLT 0x%04x",
@@ -323,6 +418,9 @@ tcpedit_dlt_proto(tcpeditdlt_t *ctx, int dlt, const u_char *packet, const int pk
     assert(dlt >= 0);
     assert(packet);
 
+    if (ctx->fastpath != TCPEDIT_DLT_FAST_NONE && dlt == DLT_EN10MB)
+        return dlt_en10mb_proto(ctx, packet, pktlen);
+
     if ((plugin = tcpedit_dlt_getplugin(ctx, dlt)) == NULL) {
         tcpedit_seterr(ctx->tcpedit, "Unable to find plugin for DLT 0x%04x", dlt);
         return -1;
@@ -344,12 +442,16 @@ tcpedit_dlt_l3data(tcpeditdlt_t *ctx, int dlt, u_char *packet, const int pktlen)
     assert(dlt >= 0);
     assert(packet);
 
-    if ((plugin = tcpedit_dlt_getplugin(ctx, dlt)) == NULL) {
-        tcpedit_seterr(ctx->tcpedit, "Unable to find plugin for DLT 0x%04x", dlt);
-        return NULL;
-    }
+    if (ctx->fastpath != TCPEDIT_DLT_FAST_NONE && dlt == DLT_EN10MB) {
+        res = dlt_en10mb_get_layer3(ctx, packet, pktlen);
+    } else {
+        if ((plugin = tcpedit_dlt_getplugin(ctx, dlt)) == NULL) {
+            tcpedit_seterr(ctx->tcpedit, "Unable to find plugin for DLT 0x%04x", dlt);
+            return NULL;
+        }
 
-    res = plugin->plugin_get_layer3(ctx, packet, pktlen);
+        res = plugin->plugin_get_layer3(ctx, packet, pktlen);
+    }
     if (res == NULL)
         tcpedit_seterr(ctx->tcpedit,
                        "Packet length %d is to short to contain a layer 3 header for DLT 0x%04x",
@@ -385,12 +487,16 @@ tcpedit_dlt_merge_l3data(tcpeditdlt_t *ctx,
     if (ipv4_data == NULL && ipv6_data == NULL)
         return packet;
 
-    if ((plugin = tcpedit_dlt_getplugin(ctx, dlt)) == NULL) {
-        tcpedit_seterr(ctx->tcpedit, "Unable to find plugin for DLT 0x%04x", dlt);
-        return NULL;
-    }
+    if (ctx->fastpath != TCPEDIT_DLT_FAST_NONE && dlt == DLT_EN10MB) {
+        res = dlt_en10mb_merge_layer3(ctx, packet, pktlen, ipv4_data, ipv6_data);
+    } else {
+        if ((plugin = tcpedit_dlt_getplugin(ctx, dlt)) == NULL) {
+            tcpedit_seterr(ctx->tcpedit, "Unable to find plugin for DLT 0x%04x", dlt);
+            return NULL;
+        }
 
-    res = plugin->plugin_merge_layer3(ctx, packet, pktlen, ipv4_data, ipv6_data);
+        res = plugin->plugin_merge_layer3(ctx, packet, pktlen, ipv4_data, ipv6_data);
+    }
     if (res == NULL)
         tcpedit_seterr(ctx->tcpedit, "Packet length %d is to short for layer 3 merge for DLT 0x%04x", pktlen, dlt);
 
@@ -403,7 +509,14 @@ tcpedit_dlt_merge_l3data(tcpeditdlt_t *ctx,
 int
 tcpedit_dlt_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
 {
-    return ctx->decoder->plugin_decode(ctx, packet, pktlen);
+    switch (ctx->fastpath) {
+    case TCPEDIT_DLT_FAST_EN10MB:
+        return dlt_en10mb_decode(ctx, packet, pktlen);
+    case TCPEDIT_DLT_FAST_RAW_EN10MB:
+        return dlt_raw_decode(ctx, packet, pktlen);
+    default:
+        return ctx->decoder->plugin_decode(ctx, packet, pktlen);
+    }
 }
 
 /**
@@ -412,6 +525,9 @@ tcpedit_dlt_decode(tcpeditdlt_t *ctx, const u_char *packet, const int pktlen)
 int
 tcpedit_dlt_encode(tcpeditdlt_t *ctx, u_char *packet, int pktlen, tcpr_dir_t direction)
 {
+    if (ctx->fastpath != TCPEDIT_DLT_FAST_NONE)
+        return dlt_en10mb_encode(ctx, packet, pktlen, direction);
+
     return ctx->encoder->plugin_encode(ctx, packet, pktlen, direction);
 }
 
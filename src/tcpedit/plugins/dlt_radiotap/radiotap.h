@@ -20,6 +20,7 @@
 
 #pragma once
 
+#include "../dlt_ieee80211/ieee80211_types.h"
 #include "plugins_types.h"
 
 int dlt_radiotap_register(tcpeditdlt_t *ctx);
@@ -37,11 +38,12 @@ int dlt_radiotap_80211_l2len(tcpeditdlt_t *ctx, const u_char *packet, int pktlen
 u_char *dlt_radiotap_get_mac(tcpeditdlt_t *ctx, tcpeditdlt_mac_type_t mac, const u_char *packet, int pktlen);
 
 /*
- * FIXME: structure to hold any data parsed from the packet by the decoder.
- * Example: Ethernet VLAN tag info
+ * structure to hold any data parsed from the packet by the decoder.
+ * The 802.11 header is decoded in place by the ieee80211 plugin, which
+ * keeps its layout at the start of whatever extra data the context has.
  */
 struct radiotap_extra_s {
-    u_char packet[MAXPACKET];
+    ieee80211_layout_t layout; /* must be first */
 };
 typedef struct radiotap_extra_s radiotap_extra_t;
 
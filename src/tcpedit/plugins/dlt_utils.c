@@ -55,6 +55,13 @@ tcpedit_dlt_getplugin(tcpeditdlt_t *ctx, int dlt)
 
     assert(ctx);
 
+    /* nearly every lookup while editing is for one of these two */
+    if (ctx->decoder != NULL && ctx->decoder->dlt == dlt)
+        return ctx->decoder;
+
+    if (ctx->encoder != NULL && ctx->encoder->dlt == dlt)
+        return ctx->encoder;
+
     ptr = ctx->plugins;
     if (ptr == NULL)
         return NULL;
@@ -19,9 +19,14 @@
  */
 
 #include "ethernet.h"
+#include "defines.h"
+#include "common.h"
 #include <assert.h>
 #include <string.h>
 
+/* marks a used slot, as a MAC only uses the low 48 bits */
+#define MAC_MAP_USED ((u_int64_t)1 << 48)
+
 /*
  * Takes a ptr to an ethernet address and returns
  * 1 if it is unicast or 0 if it is multicast or
@@ -55,3 +60,100 @@ is_unicast_ethernet(tcpeditdlt_t *ctx, const u_char *ether)
     /* everything else is unicast */
     return 1;
 }
+
+static u_int64_t
+mac_map_key(const u_char *mac)
+{
+    u_int64_t key = MAC_MAP_USED;
+    int i;
+
+    for (i = 0; i < ETHER_ADDR_LEN; i++)
+        key |= (u_int64_t)mac[i] << (i * 8);
+
+    return key;
+}
+
+static u_int32_t
+mac_map_slot(const ethernet_mac_map_t *map, u_int64_t key)
+{
+    /* Fibonacci hashing, the high bits are the best mixed */
+    return (u_int32_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & map->mask;
+}
+
+/*
+ * Returns an empty MAC map with room for at least entries rewrites
+ */
+ethernet_mac_map_t *
+ethernet_mac_map_new(int entries)
+{
+    ethernet_mac_map_t *map;
+    u_int32_t slots = 16;
+
+    assert(entries >= 0);
+
+    /* keep the table at most half full, so probes stay short */
+    while (slots < (u_int32_t)entries * 2)
+        slots *= 2;
+
+    map = (ethernet_mac_map_t *)safe_malloc(sizeof(ethernet_mac_map_t));
+    map->mask = slots - 1;
+    map->slots = (ethernet_mac_map_slot_t *)safe_malloc(slots * sizeof(ethernet_mac_map_slot_t));
+
+    return map;
+}
+
+/*
+ * Rewrites mac to value.  Returns false, leaving the map unchanged, if mac
+ * is already in the map or the map is full
+ */
+bool
+ethernet_mac_map_add(ethernet_mac_map_t *map, const u_char *mac, const u_char *value)
+{
+    u_int64_t key = mac_map_key(mac);
+    u_int32_t i;
+
+    assert(map);
+
+    if ((u_int32_t)map->count >= map->mask)
+        return false;
+
+    for (i = mac_map_slot(map, key); map->slots[i].key != 0; i = (i + 1) & map->mask) {
+        if (map->slots[i].key == key)
+            return false;
+    }
+
+    map->slots[i].key = key;
+    memcpy(map->slots[i].value, value, ETHER_ADDR_LEN);
+    map->count++;
+
+    return true;
+}
+
+/*
+ * Returns what mac is rewritten to, or NULL if it isn't in the map
+ */
+const u_char *
+ethernet_mac_map_find(const ethernet_mac_map_t *map, const u_char *mac)
+{
+    u_int64_t key = mac_map_key(mac);
+    u_int32_t i;
+
+    assert(map);
+
+    for (i = mac_map_slot(map, key); map->slots[i].key != 0; i = (i + 1) & map->mask) {
+        if (map->slots[i].key == key)
+            return map->slots[i].value;
+    }
+
+    return NULL;
+}
+
+void
+ethernet_mac_map_free(ethernet_mac_map_t *map)
+{
+    if (map == NULL)
+        return;
+
+    safe_free(map->slots);
+    safe_free(map);
+}
@@ -26,4 +26,23 @@
 
 #include "plugins_types.h"
 
+/*
+ * Open addressing hash table of MAC address rewrites, so looking up an
+ * address costs the same however many rewrites there are
+ */
+typedef struct ethernet_mac_map_slot_s {
+    u_int64_t key; /* the MAC in the low 48 bits, 0 for an empty slot */
+    u_char value[ETHER_ADDR_LEN];
+} ethernet_mac_map_slot_t;
+
+typedef struct ethernet_mac_map_s {
+    u_int32_t mask; /* number of slots - 1 */
+    int count;
+    ethernet_mac_map_slot_t *slots;
+} ethernet_mac_map_t;
+
 int is_unicast_ethernet(tcpeditdlt_t *, const u_char *);
+ethernet_mac_map_t *ethernet_mac_map_new(int);
+bool ethernet_mac_map_add(ethernet_mac_map_t *, const u_char *, const u_char *);
+const u_char *ethernet_mac_map_find(const ethernet_mac_map_t *, const u_char *);
+void ethernet_mac_map_free(ethernet_mac_map_t *);
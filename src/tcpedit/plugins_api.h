@@ -49,6 +49,13 @@ void tcpedit_dlt_cleanup(tcpeditdlt_t *ctx);
 int tcpedit_dlt_output_dlt(tcpeditdlt_t *ctx);
 int tcpedit_dlt_l2len(tcpeditdlt_t *ctx, int dlt, const u_char *packet, const int pktlen);
 
+/* most bytes the encoder may add to a packet, -1 if unknown */
+int tcpedit_dlt_growth(tcpeditdlt_t *ctx);
+
+/* true if the encoder never changes the length of a packet */
+bool tcpedit_dlt_preserves_size(tcpeditdlt_t *ctx);
+bool tcpedit_dlt_is_passthru(tcpeditdlt_t *ctx);
+
 /*
  * process the given packet, by calling decode & encode
  */
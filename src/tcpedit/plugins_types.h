@@ -65,6 +65,17 @@ typedef enum {
 /* MAC address buffer length */
 #define MAX_MAC_LEN 10
 
+/*
+ * Decoder/encoder pairs with their own code path in dlt_plugins.c, picked
+ * by tcpedit_dlt_post_init(), so the common cases call the plugin functions
+ * directly rather than through the tcpeditdlt_plugin_t function pointers
+ */
+typedef enum {
+    TCPEDIT_DLT_FAST_NONE = 0,  /* use the plugin function pointers */
+    TCPEDIT_DLT_FAST_EN10MB,    /* ethernet -> ethernet */
+    TCPEDIT_DLT_FAST_RAW_EN10MB /* raw IP -> ethernet */
+} tcpeditdlt_fastpath_t;
+
 typedef struct tcpeditdlt_plugin_s tcpeditdlt_plugin_t;
 typedef struct tcpeditdlt_s tcpeditdlt_t;
 
@@ -105,6 +116,7 @@ struct tcpeditdlt_s {
     tcpeditdlt_plugin_t *plugins;       /* registered plugins */
     tcpeditdlt_plugin_t *decoder;       /* Encoder plugin */
     tcpeditdlt_plugin_t *encoder;       /* Decoder plugin */      
+    tcpeditdlt_fastpath_t fastpath;     /* specialized decoder/encoder pair, if any */
 
     /* decoder validator tells us which kind of address we're processing */
     tcpeditdlt_l2addr_type_t addr_type;    
@@ -214,9 +214,43 @@ parse_portmap(tcpedit_portmap_t **portmap, const char *ourstr)
     }
 
     safe_free(ourstrcpy);
+    compile_portmap(*portmap);
     return 1;
 }
 
+/**
+ * \brief builds the lookup table of a portmap chain
+ *
+ * The table maps every port (in network byte order) to its new port, so
+ * map_port() is a single lookup no matter how long the chain is.  Call
+ * again after appending to the chain.
+ */
+void
+compile_portmap(tcpedit_portmap_t *portmap)
+{
+    tcpedit_portmap_t *portmap_ptr;
+    uint32_t port;
+
+    assert(portmap);
+
+    if (portmap->table == NULL)
+        portmap->table = (uint16_t *)safe_malloc(65536 * sizeof(uint16_t));
+
+    for (port = 0; port < 65536; port++)
+        portmap->table[port] = (uint16_t)port;
+
+    /* later maps of the same port win, like they do in the chain */
+    for (portmap_ptr = portmap; portmap_ptr != NULL; portmap_ptr = portmap_ptr->next) {
+        portmap->table[portmap_ptr->from & 0xffff] = (uint16_t)portmap_ptr->to;
+
+        /* chains appended to this one only need our table */
+        if (portmap_ptr != portmap && portmap_ptr->table != NULL) {
+            safe_free(portmap_ptr->table);
+            portmap_ptr->table = NULL;
+        }
+    }
+}
+
 /**
  * Free's all the memory associated with the given portmap chain
  */
@@ -229,6 +263,8 @@ free_portmap(tcpedit_portmap_t *portmap)
     if (portmap->next != NULL)
         free_portmap(portmap->next);
 
+    if (portmap->table != NULL)
+        safe_free(portmap->table);
     safe_free(portmap);
 }
 
@@ -244,6 +280,9 @@ map_port(tcpedit_portmap_t *portmap_data, long port)
 
     assert(portmap_data);
 
+    if (portmap_data->table != NULL && port >= 0 && port <= 65535)
+        return portmap_data->table[port];
+
     portmap_ptr = portmap_data;
     newport = port;
 
@@ -338,7 +377,7 @@ rewrite_ipv4_ports(tcpedit_t *tcpedit, ipv4_hdr_t **ip_hdr, int l3len)
         tcpedit_seterr(tcpedit, "rewrite_ipv4_ports: NULL IP header: l3 len=%d", l3len);
         return TCPEDIT_ERROR;
     } else if ((*ip_hdr)->ip_p == IPPROTO_TCP || (*ip_hdr)->ip_p == IPPROTO_UDP) {
-        l4 = get_layer4_v4(*ip_hdr, (u_char *)ip_hdr + l3len);
+        l4 = tcpedit_layer4_v4(tcpedit, *ip_hdr, (u_char *)*ip_hdr + l3len);
         if (l4)
             return rewrite_ports(tcpedit, (*ip_hdr)->ip_p, l4, l3len - (l4 - (u_char *)*ip_hdr));
 
@@ -354,14 +393,17 @@ rewrite_ipv6_ports(tcpedit_t *tcpedit, ipv6_hdr_t **ip6_hdr, int l3len)
 {
     assert(tcpedit);
     u_char *l4;
+    uint8_t proto;
 
     if (*ip6_hdr == NULL || ip6_hdr == NULL) {
         tcpedit_seterr(tcpedit, "rewrite_ipv6_ports: NULL IPv6 header: l3 len=%d", l3len);
         return TCPEDIT_ERROR;
-    } else if ((*ip6_hdr)->ip_nh == IPPROTO_TCP || (*ip6_hdr)->ip_nh == IPPROTO_UDP) {
-        l4 = get_layer4_v6(*ip6_hdr, (u_char *)ip6_hdr + l3len);
+    }
+
+    l4 = tcpedit_layer4_v6(tcpedit, *ip6_hdr, (u_char *)*ip6_hdr + l3len, &proto);
+    if (proto == IPPROTO_TCP || proto == IPPROTO_UDP) {
         if (l4)
-            return rewrite_ports(tcpedit, (*ip6_hdr)->ip_nh, l4, l3len - (l4 - (u_char *)*ip6_hdr));
+            return rewrite_ports(tcpedit, proto, l4, l3len - (l4 - (u_char *)*ip6_hdr));
 
         tcpedit_setwarn(tcpedit, "Unable to rewrite ports on IPv6 header: l3 len=%d", l3len);
         return TCPEDIT_WARN;
@@ -24,6 +24,7 @@
 
 tcpedit_portmap_t *new_portmap();
 int parse_portmap(tcpedit_portmap_t **portmapdata, const char *ourstr);
+void compile_portmap(tcpedit_portmap_t *portmap);
 void free_portmap(tcpedit_portmap_t *portmap);
 long map_port(tcpedit_portmap_t *portmap, long port);
 int rewrite_ipv4_ports(tcpedit_t *tcpedit, ipv4_hdr_t **ip_hdr, int l3len);
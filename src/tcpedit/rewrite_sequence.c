@@ -28,24 +28,51 @@
 #include "incremental_checksum.h"
 #include "tcpedit.h"
 #include <stdlib.h>
+#include <string.h>
+
+/* one side of a TCP connection, as hashed by --tcp-sequence-flows */
+typedef struct {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t pad;
+} seq_flow_key_t;
+
+/* how much --tcp-sequence-flows shifts the sequence numbers sent from src */
+static inline uint32_t
+seq_flow_adjust(tcpedit_t *tcpedit, const void *src, const void *dst, size_t addrlen, uint16_t sport, uint16_t dport)
+{
+    seq_flow_key_t key;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(key.src, src, addrlen);
+    memcpy(key.dst, dst, addrlen);
+    key.sport = sport;
+    key.dport = dport;
+
+    return (uint32_t)flow_hash_words(&key, sizeof(key), tcpedit->tcp_sequence_adjust);
+}
 
 /**
- * rewrites the TCP sequence and ack numbers
+ * rewrites the TCP sequence and ack numbers, the sequence number by
+ * seq_adjust and the ack by ack_adjust, what the other side's sequence
+ * numbers were shifted by
  * returns 1 for changes made or 0 for none
  */
 
 static int
-rewrite_seqs(tcpedit_t *tcpedit, tcp_hdr_t *tcp_hdr)
+rewrite_seqs(tcp_hdr_t *tcp_hdr, uint32_t seq_adjust, uint32_t ack_adjust)
 {
     volatile uint32_t newnum;
 
-    newnum = ntohl(tcp_hdr->th_seq) + tcpedit->tcp_sequence_adjust;
+    newnum = ntohl(tcp_hdr->th_seq) + seq_adjust;
     csum_replace4(&tcp_hdr->th_sum, tcp_hdr->th_seq, htonl(newnum));
     tcp_hdr->th_seq = htonl(newnum);
 
     /* first packet of 3-way handshake must have an ACK of zero - #450 */
     if (!((tcp_hdr->th_flags & TH_SYN) && !(tcp_hdr->th_flags & TH_ACK))) {
-        newnum = ntohl(tcp_hdr->th_ack) + tcpedit->tcp_sequence_adjust;
+        newnum = ntohl(tcp_hdr->th_ack) + ack_adjust;
         csum_replace4(&tcp_hdr->th_sum, tcp_hdr->th_ack, htonl(newnum));
         tcp_hdr->th_ack = htonl(newnum);
     }
@@ -60,13 +87,21 @@ rewrite_ipv4_tcp_sequence(tcpedit_t *tcpedit, ipv4_hdr_t **ip_hdr, int l3len)
     assert(*ip_hdr && ip_hdr);
 
     if (*ip_hdr && (*ip_hdr)->ip_p == IPPROTO_TCP) {
-        tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)get_layer4_v4(*ip_hdr, (u_char *)ip_hdr + l3len);
+        tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)tcpedit_layer4_v4(tcpedit, *ip_hdr, (u_char *)*ip_hdr + l3len);
         if (!tcp_hdr) {
             tcpedit_setwarn(tcpedit, "caplen to small to set TCP sequence for IP packet: l3 len=%d", l3len);
             return TCPEDIT_WARN;
         }
 
-        return rewrite_seqs(tcpedit, tcp_hdr);
+        if (tcpedit->tcp_sequence_flows) {
+            const ipv4_hdr_t *ip = *ip_hdr;
+
+            return rewrite_seqs(tcp_hdr,
+                                seq_flow_adjust(tcpedit, &ip->ip_src, &ip->ip_dst, 4, tcp_hdr->th_sport, tcp_hdr->th_dport),
+                                seq_flow_adjust(tcpedit, &ip->ip_dst, &ip->ip_src, 4, tcp_hdr->th_dport, tcp_hdr->th_sport));
+        }
+
+        return rewrite_seqs(tcp_hdr, tcpedit->tcp_sequence_adjust, tcpedit->tcp_sequence_adjust);
     }
 
     return 0;
@@ -78,14 +113,25 @@ rewrite_ipv6_tcp_sequence(tcpedit_t *tcpedit, ipv6_hdr_t **ip6_hdr, int l3len)
     assert(tcpedit);
     assert(*ip6_hdr && ip6_hdr);
 
-    if (*ip6_hdr && (*ip6_hdr)->ip_nh == IPPROTO_TCP) {
-        tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)get_layer4_v6(*ip6_hdr, (u_char *)ip6_hdr + l3len);
+    uint8_t proto;
+    tcp_hdr_t *tcp_hdr = (tcp_hdr_t *)tcpedit_layer4_v6(tcpedit, *ip6_hdr, (u_char *)*ip6_hdr + l3len, &proto);
+
+    if (proto == IPPROTO_TCP) {
         if (!tcp_hdr) {
             tcpedit_setwarn(tcpedit, "caplen to small to set TCP sequence for IP packet: l3 len=%d", l3len);
             return TCPEDIT_WARN;
         }
 
-        return rewrite_seqs(tcpedit, tcp_hdr);
+        if (tcpedit->tcp_sequence_flows) {
+            const ipv6_hdr_t *ip6 = *ip6_hdr;
+
+            return rewrite_seqs(
+                    tcp_hdr,
+                    seq_flow_adjust(tcpedit, &ip6->ip_src, &ip6->ip_dst, 16, tcp_hdr->th_sport, tcp_hdr->th_dport),
+                    seq_flow_adjust(tcpedit, &ip6->ip_dst, &ip6->ip_src, 16, tcp_hdr->th_dport, tcp_hdr->th_sport));
+        }
+
+        return rewrite_seqs(tcp_hdr, tcpedit->tcp_sequence_adjust, tcpedit->tcp_sequence_adjust);
     }
 
     return 0;
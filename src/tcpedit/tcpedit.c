@@ -22,9 +22,11 @@
 #include "config.h"
 #include "common.h"
 #include "edit_packet.h"
+#include "encap.h"
 #include "fuzzing.h"
 #include "incremental_checksum.h"
 #include "parse_args.h"
+#include "payload.h"
 #include "portmap.h"
 #include "rewrite_sequence.h"
 #include "tcpedit_stub.h"
@@ -34,38 +36,219 @@
 #include <sys/types.h>
 
 /**
- * \brief Edit the given packet
+ * records where the layer 4 header of the packet is, for the editors
+ */
+static void
+tcpedit_set_layout(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr, int l3len)
+{
+    tcpedit_layout_t *layout = &tcpedit->runtime.layout;
+
+    memset(layout, 0, sizeof(*layout));
+
+    if (ip_hdr != NULL) {
+        layout->l3 = (u_char *)ip_hdr;
+        layout->l4 = get_layer4_v4(ip_hdr, (u_char *)ip_hdr + l3len);
+        layout->l4proto = ip_hdr->ip_p;
+    } else if (ip6_hdr != NULL) {
+        layout->l3 = (u_char *)ip6_hdr;
+        layout->l4 = get_layer4_v6_proto(ip6_hdr, (u_char *)ip6_hdr + l3len, &layout->l4proto);
+    }
+}
+
+/**
+ * \brief returns the layer 4 header of the given IPv4 header
  *
- * Process a given packet and edit the pkthdr/pktdata structures
- * according to the rules in tcpedit
- * Returns: TCPEDIT_ERROR on error
- *          TCPEDIT_SOFT_ERROR on remove packet
- *          0 on no change
- *          1 on change
+ * Same as get_layer4_v4(), but uses what tcpedit_packet() already found
+ * when it is for this header
  */
-int
-tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr, u_char **pktdata, tcpr_dir_t direction)
+u_char *
+tcpedit_layer4_v4(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, const u_char *end_ptr)
+{
+    assert(tcpedit);
+
+    if (tcpedit->runtime.layout.l3 == (u_char *)ip_hdr)
+        return tcpedit->runtime.layout.l4;
+
+    return get_layer4_v4(ip_hdr, end_ptr);
+}
+
+/**
+ * \brief returns the layer 4 header of the given IPv6 header
+ *
+ * Same as get_layer4_v6(), and get_ipv6_l4proto() if proto isn't NULL,
+ * without walking the extension headers again when tcpedit_packet()
+ * already did
+ */
+u_char *
+tcpedit_layer4_v6(tcpedit_t *tcpedit, ipv6_hdr_t *ip6_hdr, const u_char *end_ptr, uint8_t *proto)
+{
+    assert(tcpedit);
+
+    if (tcpedit->runtime.layout.l3 == (u_char *)ip6_hdr) {
+        if (proto != NULL)
+            *proto = tcpedit->runtime.layout.l4proto;
+        return tcpedit->runtime.layout.l4;
+    }
+
+    if (proto != NULL)
+        return get_layer4_v6_proto(ip6_hdr, end_ptr, proto);
+    return get_layer4_v6(ip6_hdr, end_ptr);
+}
+
+/*
+ * make one edit of tcpedit_validate()'s list.  Returns TCPEDIT_ERROR,
+ * or the TCPEDIT_DIRTY_* fields changed
+ */
+static int
+tcpedit_op(tcpedit_t *tcpedit,
+           tcpedit_op_t op,
+           struct pcap_pkthdr *pkthdr,
+           u_char **pktdata,
+           ipv4_hdr_t **ip_hdr,
+           ipv6_hdr_t **ip6_hdr,
+           int l2len,
+           tcpr_dir_t direction)
+{
+    int l3len = (int)pkthdr->caplen - l2len;
+    uint32_t ipflags;
+    int retval;
+
+    switch (op) {
+    case TCPEDIT_OP_IPV4_TOS: {
+        volatile uint16_t oldval = *((uint16_t *)*ip_hdr);
+        volatile uint16_t newval;
+
+        (*ip_hdr)->ip_tos = tcpedit->tos;
+        newval = *((uint16_t *)*ip_hdr);
+        csum_replace2(&(*ip_hdr)->ip_sum, oldval, newval);
+        return TCPEDIT_DIRTY_HDR;
+    }
+
+    case TCPEDIT_OP_IPV4_PAYLOAD:
+        return rewrite_ipv4_payload(tcpedit, pkthdr, *ip_hdr, l2len);
+
+    case TCPEDIT_OP_IPV4_TTL:
+        return rewrite_ipv4_ttl(tcpedit, *ip_hdr) > 0 ? TCPEDIT_DIRTY_HDR : 0;
+
+    case TCPEDIT_OP_IPV4_PORTS:
+        if ((retval = rewrite_ipv4_ports(tcpedit, ip_hdr, l3len)) < 0)
+            return TCPEDIT_ERROR;
+        return retval > 0 ? TCPEDIT_DIRTY_HDR : 0;
+
+    case TCPEDIT_OP_IPV4_TCP_SEQUENCE:
+        rewrite_ipv4_tcp_sequence(tcpedit, ip_hdr, l3len);
+        return 0;
+
+    case TCPEDIT_OP_IPV6_PAYLOAD:
+        return rewrite_ipv6_payload(tcpedit, pkthdr, *ip6_hdr, l2len);
+
+    case TCPEDIT_OP_IPV6_HLIM:
+        return rewrite_ipv6_hlim(tcpedit, *ip6_hdr) > 0 ? TCPEDIT_DIRTY_HDR : 0;
+
+    case TCPEDIT_OP_IPV6_TCLASS:
+        /* strip out the old tclass bits and add ours */
+        memcpy(&ipflags, &(*ip6_hdr)->ip_flags, 4);
+        ipflags = (ntohl(ipflags) & 0xf00fffff) + ((uint32_t)tcpedit->tclass << 20);
+        ipflags = htonl(ipflags);
+        memcpy(&(*ip6_hdr)->ip_flags, &ipflags, 4);
+        return 0;
+
+    case TCPEDIT_OP_IPV6_FLOWLABEL:
+        memcpy(&ipflags, &(*ip6_hdr)->ip_flags, 4);
+        ipflags = (ntohl(ipflags) & 0xfff00000) + (uint32_t)tcpedit->flowlabel;
+        ipflags = htonl(ipflags);
+        memcpy(&(*ip6_hdr)->ip_flags, &ipflags, 4);
+        return 0;
+
+    case TCPEDIT_OP_IPV6_PORTS:
+        if ((retval = rewrite_ipv6_ports(tcpedit, ip6_hdr, l3len)) < 0)
+            return TCPEDIT_ERROR;
+        return retval > 0 ? TCPEDIT_DIRTY_HDR : 0;
+
+    case TCPEDIT_OP_IPV6_TCP_SEQUENCE:
+        rewrite_ipv6_tcp_sequence(tcpedit, ip6_hdr, l3len);
+        return 0;
+
+    case TCPEDIT_OP_UNTRUNC:
+        if ((retval = untrunc_packet(tcpedit, pkthdr, pktdata, *ip_hdr, *ip6_hdr)) < 0)
+            return TCPEDIT_ERROR;
+        if (retval == 0)
+            return 0;
+
+        /* truncating may have cut into the layer 4 header */
+        tcpedit_set_layout(tcpedit, *ip_hdr, *ip6_hdr, (int)pkthdr->caplen - l2len);
+        return TCPEDIT_DIRTY_PAYLOAD;
+
+    case TCPEDIT_OP_IPV4_REWRITE:
+        if ((retval = rewrite_ipv4l3(tcpedit, *ip_hdr, direction, l3len)) < 0)
+            return TCPEDIT_ERROR;
+        return retval > 0 ? TCPEDIT_DIRTY_HDR : 0;
+
+    case TCPEDIT_OP_IPV6_REWRITE:
+        if ((retval = rewrite_ipv6l3(tcpedit, *ip6_hdr, direction, l3len)) < 0)
+            return TCPEDIT_ERROR;
+        return retval > 0 ? TCPEDIT_DIRTY_HDR : 0;
+
+    case TCPEDIT_OP_ARP_REWRITE:
+        /*
+         * unlike rewrite_ipl3, we don't care if the packet changed because
+         * we never need to recalc the checksums for an ARP packet
+         */
+        if (rewrite_iparp(tcpedit, (arp_hdr_t *)(*pktdata + l2len), direction) < 0)
+            return TCPEDIT_ERROR;
+        return 0;
+
+    case TCPEDIT_OP_IPV4_SEED:
+        if ((retval = randomize_ipv4(tcpedit, pkthdr, *pktdata, *ip_hdr, l3len)) < 0)
+            return TCPEDIT_ERROR;
+        return retval > 0 ? TCPEDIT_DIRTY_HDR : 0;
+
+    case TCPEDIT_OP_IPV6_SEED:
+        if ((retval = randomize_ipv6(tcpedit, pkthdr, *pktdata, *ip6_hdr, l3len)) < 0)
+            return TCPEDIT_ERROR;
+        return retval > 0 ? TCPEDIT_DIRTY_HDR : 0;
+
+    case TCPEDIT_OP_ARP_SEED:
+        if (randomize_iparp(tcpedit,
+                            pkthdr,
+                            *pktdata,
+                            direction == TCPR_DIR_C2S ? tcpedit->runtime.dlt1 : tcpedit->runtime.dlt2,
+                            l3len) < 0)
+            return TCPEDIT_ERROR;
+        return 0;
+    }
+
+    return 0;
+}
+
+/*
+ * edit one packet of tcpedit_packet() or tcpedit_packet_batch(), which
+ * have checked tcpedit and looked up the source DLT
+ */
+static int
+tcpedit_edit(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr, u_char **pktdata, tcpr_dir_t direction, int src_dlt)
 {
     bool fuzz_once = tcpedit->fuzz_seed != 0;
     ipv4_hdr_t *ip_hdr;
     ipv6_hdr_t *ip6_hdr;
-    arp_hdr_t *arp_hdr;
     int l2len, l2proto, retval;
-    int dst_dlt, src_dlt, pktlen, lendiff;
-    uint32_t ipflags, tclass;
-    int needtorecalc; /* did the packet change? if so, checksum */
+    int dst_dlt, pktlen, lendiff;
+    int dirty; /* TCPEDIT_DIRTY_* fields changed in this packet */
+    const tcpedit_ops_t *ops;
+    tcpedit_l3_t l3;
     u_char *packet;
+    int i;
 
-    assert(tcpedit);
     assert(pkthdr);
     assert(*pkthdr);
     assert(pktdata);
     assert(*pktdata);
-    assert(tcpedit->validated);
 
     packet = *pktdata;
 
     tcpedit->runtime.packetnum++;
+    tcpedit->runtime.csum_start = 0;
+    tcpedit->runtime.csum_offset = 0;
 
     dbgx(3, "packet " COUNTER_SPEC " caplen %d", tcpedit->runtime.packetnum, (*pkthdr)->caplen);
 
@@ -83,15 +266,12 @@ tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr, u_char **pktdata
         (*pkthdr)->len -= 4;
     }
 
-    src_dlt = tcpedit_dlt_src(tcpedit->dlt_ctx);
-
-    needtorecalc = 0;
+    dirty = 0;
 again:
     ip_hdr = NULL;
     ip6_hdr = NULL;
-    arp_hdr = NULL;
     retval = 0;
-    ipflags = 0;
+    memset(&tcpedit->runtime.layout, 0, sizeof(tcpedit_layout_t));
     /* not everything has a L3 header, so check for errors.  returns proto in network byte order */
     if ((l2proto = tcpedit_dlt_proto(tcpedit->dlt_ctx, src_dlt, packet, (int)(*pkthdr)->caplen)) < 0) {
         dbgx(2, "Packet has no L3+ header: %s", tcpedit_geterr(tcpedit));
@@ -178,72 +358,22 @@ again:
         ip6_hdr = NULL;
     }
 
-    /* The following edits only apply for IPv4 */
-    if (ip_hdr != NULL) {
-        /* set TOS ? */
-        if (tcpedit->tos > -1) {
-            volatile uint16_t oldval = *((uint16_t *)ip_hdr);
-            volatile uint16_t newval;
-
-            ip_hdr->ip_tos = tcpedit->tos;
-            newval = *((uint16_t *)ip_hdr);
-            csum_replace2(&ip_hdr->ip_sum, oldval, newval);
-        }
-
-        /* rewrite the TTL */
-        needtorecalc += rewrite_ipv4_ttl(tcpedit, ip_hdr);
-
-        /* rewrite TCP/UDP ports */
-        if (tcpedit->portmap != NULL) {
-            if ((retval = rewrite_ipv4_ports(tcpedit, &ip_hdr, (int)(*pkthdr)->caplen - l2len)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-        }
-
-        if (tcpedit->tcp_sequence_enable)
-            rewrite_ipv4_tcp_sequence(tcpedit, &ip_hdr, (int)(*pkthdr)->caplen - l2len);
-    }
-
-    /* IPv6 edits */
-    else if (ip6_hdr != NULL) {
-        /* rewrite the hop limit */
-        needtorecalc += rewrite_ipv6_hlim(tcpedit, ip6_hdr);
-
-        /* set traffic class? */
-        if (tcpedit->tclass > -1) {
-            /* calculate the bits */
-            tclass = tcpedit->tclass << 20;
+    tcpedit_set_layout(tcpedit, ip_hdr, ip6_hdr, (int)(*pkthdr)->caplen - l2len);
 
-            /* convert our 4 bytes to an int */
-            memcpy(&ipflags, &ip6_hdr->ip_flags, 4);
-
-            /* strip out the old tclass bits */
-            ipflags = ntohl(ipflags) & 0xf00fffff;
-
-            /* add the tclass bits back */
-            ipflags += tclass;
-            ipflags = htonl(ipflags);
-            memcpy(&ip6_hdr->ip_flags, &ipflags, 4);
-        }
-
-        /* set the flow label? */
-        if (tcpedit->flowlabel > -1) {
-            memcpy(&ipflags, &ip6_hdr->ip_flags, 4);
-            ipflags = ntohl(ipflags) & 0xfff00000;
-            ipflags += tcpedit->flowlabel;
-            ipflags = htonl(ipflags);
-            memcpy(&ip6_hdr->ip_flags, &ipflags, 4);
-        }
-
-        /* rewrite TCP/UDP ports */
-        if (tcpedit->portmap != NULL) {
-            if ((retval = rewrite_ipv6_ports(tcpedit, &ip6_hdr, (int)(*pkthdr)->caplen - l2len)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-        }
+    if (ip_hdr != NULL)
+        l3 = TCPEDIT_L3_IPV4;
+    else if (ip6_hdr != NULL)
+        l3 = TCPEDIT_L3_IPV6;
+    else if (l2proto == htons(ETHERTYPE_ARP))
+        l3 = TCPEDIT_L3_ARP;
+    else
+        l3 = TCPEDIT_L3_OTHER;
 
-        if (tcpedit->tcp_sequence_enable)
-            rewrite_ipv6_tcp_sequence(tcpedit, &ip6_hdr, (int)(*pkthdr)->caplen - l2len);
+    ops = &tcpedit->hdr_ops[l3];
+    for (i = 0; i < ops->cnt; i++) {
+        if ((retval = tcpedit_op(tcpedit, ops->op[i], *pkthdr, pktdata, &ip_hdr, &ip6_hdr, l2len, direction)) < 0)
+            return TCPEDIT_ERROR;
+        dirty |= retval;
     }
 
     if (fuzz_once) {
@@ -252,87 +382,46 @@ again:
         if (retval < 0) {
             return TCPEDIT_ERROR;
         }
-        needtorecalc += retval;
+        if (retval > 0)
+            dirty |= TCPEDIT_DIRTY_PAYLOAD;
         goto again;
     }
 
-    /* (Un)truncate or MTU truncate packet? */
-    if (tcpedit->fixlen || tcpedit->mtu_truncate) {
-        if ((retval = untrunc_packet(tcpedit, *pkthdr, pktdata, ip_hdr, ip6_hdr)) < 0)
+    ops = &tcpedit->pkt_ops[l3];
+    for (i = 0; i < ops->cnt; i++) {
+        if ((retval = tcpedit_op(tcpedit, ops->op[i], *pkthdr, pktdata, &ip_hdr, &ip6_hdr, l2len, direction)) < 0)
             return TCPEDIT_ERROR;
-        needtorecalc += retval;
-    }
-
-    /* rewrite IP addresses in IPv4/IPv6 or ARP */
-    if (tcpedit->rewrite_ip) {
-        /* IP packets */
-        if (ip_hdr != NULL) {
-            if ((retval = rewrite_ipv4l3(tcpedit, ip_hdr, direction, (int)(*pkthdr)->caplen - l2len)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-        } else if (ip6_hdr != NULL) {
-            if ((retval = rewrite_ipv6l3(tcpedit, ip6_hdr, direction, (int)(*pkthdr)->caplen - l2len)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-        }
-
-        /* ARP packets */
-        else if (l2proto == htons(ETHERTYPE_ARP)) {
-            arp_hdr = (arp_hdr_t *)&(packet[l2len]);
-            /* unlike, rewrite_ipl3, we don't care if the packet changed
-             * because we never need to recalc the checksums for an ARP
-             * packet.  So ignore the return value
-             */
-            if (rewrite_iparp(tcpedit, arp_hdr, direction) < 0)
-                return TCPEDIT_ERROR;
-        }
+        dirty |= retval;
     }
+    retval = TCPEDIT_OK;
 
-    /* do we need to spoof the src/dst IP address in IPv4 or ARP? */
-    if (tcpedit->seed) {
-        /* IPv4 Packets */
-        if (ip_hdr != NULL) {
-            if ((retval = randomize_ipv4(tcpedit, *pkthdr, packet, ip_hdr, (int)(*pkthdr)->caplen - l2len)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-
-        } else if (ip6_hdr != NULL) {
-            if ((retval = randomize_ipv6(tcpedit, *pkthdr, packet, ip6_hdr, (int)(*pkthdr)->caplen - l2len)) < 0)
-                return TCPEDIT_ERROR;
-            needtorecalc += retval;
-
-            /* ARP packets */
-        } else if (l2proto == htons(ETHERTYPE_ARP)) {
-            if (direction == TCPR_DIR_C2S) {
-                if (randomize_iparp(tcpedit, *pkthdr, packet, tcpedit->runtime.dlt1, (int)(*pkthdr)->caplen - l2len) <
-                    0)
-                    return TCPEDIT_ERROR;
-            } else {
-                if (randomize_iparp(tcpedit, *pkthdr, packet, tcpedit->runtime.dlt2, (int)(*pkthdr)->caplen - l2len) <
-                    0)
-                    return TCPEDIT_ERROR;
-            }
-        }
-    }
-
-    /* ensure IP header length is correct */
+    /*
+     * ensure IP header length is correct.  A new length changes which bytes
+     * the L4 checksum covers, so it can't be patched incrementally.
+     */
     if (ip_hdr != NULL) {
-        fix_ipv4_length(*pkthdr, ip_hdr, l2len);
-        needtorecalc = 1;
+        if (fix_ipv4_length(*pkthdr, ip_hdr, l2len) > 0)
+            dirty |= TCPEDIT_DIRTY_LEN;
     } else if (ip6_hdr != NULL) {
-        needtorecalc |= fix_ipv6_length(*pkthdr, ip6_hdr, l2len);
+        if (fix_ipv6_length(*pkthdr, ip6_hdr, l2len) > 0)
+            dirty |= TCPEDIT_DIRTY_LEN;
     }
 
-    /* do we need to fix checksums? -- must always do this last! */
-    if ((tcpedit->fixcsum || needtorecalc > 0)) {
+    /*
+     * do we need to fix checksums? -- must always do this last!
+     * Header rewrites have already patched the checksums, so only do the
+     * full pass if asked to or if the length/payload changed underneath them.
+     * Checksums which were wrong in the input stay wrong without --fixcsum.
+     */
+    if (tcpedit->fixcsum || (dirty & TCPEDIT_DIRTY_RECALC)) {
         if (ip_hdr != NULL) {
-            dbgx(3, "doing IPv4 checksum: needtorecalc=%d", needtorecalc);
+            dbgx(3, "doing IPv4 checksum: dirty=0x%x", dirty);
             retval = fix_ipv4_checksums(tcpedit, *pkthdr, ip_hdr, l2len);
         } else if (ip6_hdr != NULL) {
-            dbgx(3, "doing IPv6 checksum: needtorecalc=%d", needtorecalc);
+            dbgx(3, "doing IPv6 checksum: dirty=0x%x", dirty);
             retval = fix_ipv6_checksums(tcpedit, *pkthdr, ip6_hdr, l2len);
         } else {
-            dbgx(3, "checksum not performed: needtorecalc=%d", needtorecalc);
+            dbgx(3, "checksum not performed: dirty=0x%x", dirty);
             retval = TCPEDIT_OK;
         }
         if (retval < 0) {
@@ -349,11 +438,84 @@ again:
                              (u_char *)ip_hdr,
                              (u_char *)ip6_hdr);
 
+    /* last of all, wrap the finished frame */
+    if (tcpedit->encap.type != TCPEDIT_ENCAP_NONE &&
+        encap_packet(tcpedit, *pkthdr, *pktdata, ip_hdr, ip6_hdr, l2len, direction) < 0)
+        return TCPEDIT_ERROR;
+
+    /* and the FCS covers the frame as it leaves */
+    if (tcpedit->add_fcs && tcpedit_dlt_output_dlt(tcpedit->dlt_ctx) == DLT_EN10MB &&
+        (*pkthdr)->caplen == (*pkthdr)->len) {
+        tcpr_fcs_put(*pktdata, (*pkthdr)->caplen);
+        (*pkthdr)->caplen += TCPR_FCS_LEN;
+        (*pkthdr)->len += TCPR_FCS_LEN;
+    }
+
+    /* the headers may have been copied back into the packet */
+    memset(&tcpedit->runtime.layout, 0, sizeof(tcpedit_layout_t));
+
     tcpedit->runtime.total_bytes += (*pkthdr)->caplen;
     tcpedit->runtime.pkts_edited++;
     return retval;
 }
 
+/**
+ * \brief Edit the given packet
+ *
+ * Process a given packet and edit the pkthdr/pktdata structures
+ * according to the rules in tcpedit
+ * Returns: TCPEDIT_ERROR on error
+ *          TCPEDIT_SOFT_ERROR on remove packet
+ *          TCPEDIT_WARN if there's a warning for tcpedit_getwarn()
+ *          TCPEDIT_OK otherwise
+ */
+int
+tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr, u_char **pktdata, tcpr_dir_t direction)
+{
+    assert(tcpedit);
+    assert(tcpedit->validated);
+
+    return tcpedit_edit(tcpedit, pkthdr, pktdata, direction, tcpedit_dlt_src(tcpedit->dlt_ctx));
+}
+
+/**
+ * \brief Edit an array of packets
+ *
+ * Same as calling tcpedit_packet() on each packet in turn, with its
+ * result left in rcode.  Packets with the direction TCPR_DIR_NOSEND are
+ * left as they are, but still counted as packets by error messages.
+ * Stops at the first packet giving TCPEDIT_ERROR, leaving the rcode of
+ * those after it alone.
+ * Returns: TCPEDIT_ERROR if a packet gave it
+ *          TCPEDIT_OK otherwise
+ */
+int
+tcpedit_packet_batch(tcpedit_t *tcpedit, tcpedit_pkt_t *pkts, int cnt)
+{
+    int src_dlt, i;
+
+    assert(tcpedit);
+    assert(pkts || cnt == 0);
+    assert(tcpedit->validated);
+
+    src_dlt = tcpedit_dlt_src(tcpedit->dlt_ctx);
+    for (i = 0; i < cnt; i++) {
+        tcpedit_pkt_t *pkt = &pkts[i];
+
+        if (pkt->direction == TCPR_DIR_NOSEND) {
+            tcpedit->runtime.packetnum++;
+            pkt->rcode = TCPEDIT_OK;
+            continue;
+        }
+
+        pkt->rcode = tcpedit_edit(tcpedit, &pkt->pkthdr, &pkt->pktdata, pkt->direction, src_dlt);
+        if (pkt->rcode == TCPEDIT_ERROR)
+            return TCPEDIT_ERROR;
+    }
+
+    return TCPEDIT_OK;
+}
+
 /**
  * initializes the tcpedit library.  returns 0 on success, -1 on error.
  */
@@ -401,27 +563,199 @@ tcpedit_get_output_dlt(tcpedit_t *tcpedit)
     return tcpedit_dlt_output_dlt(tcpedit->dlt_ctx);
 }
 
+/**
+ * \brief Most bytes tcpedit_packet() may add to a packet
+ *
+ * When this is 0 packets are edited in place in whatever buffer holds
+ * them, otherwise the buffer needs this many bytes of room after caplen.
+ * Returns -1 if there's no bound (--fixlen=pad): then tcpedit_packet() may
+ * safe_realloc() the packet, so it has to be in its own malloc'd buffer.
+ */
+int
+tcpedit_get_growth(tcpedit_t *tcpedit)
+{
+    int growth;
+
+    assert(tcpedit);
+
+    if (tcpedit->fixlen == TCPEDIT_FIXLEN_PAD)
+        return -1;
+
+    growth = tcpedit_dlt_growth(tcpedit->dlt_ctx);
+    if (growth < 0)
+        return growth;
+
+    return growth + tcpedit->encap.hdrlen + (tcpedit->add_fcs ? TCPR_FCS_LEN : 0) + payload_growth(tcpedit->payload);
+}
+
+/**
+ * \brief Does tcpedit_packet() keep every packet the same length?
+ *
+ * If so, packets can be edited where they lie in the input file.
+ */
+bool
+tcpedit_is_size_preserving(tcpedit_t *tcpedit)
+{
+    assert(tcpedit);
+
+    return tcpedit->fixlen == TCPEDIT_FIXLEN_OFF && !tcpedit->efcs && !tcpedit->add_fcs && !tcpedit->mtu_truncate &&
+           tcpedit->fuzz_seed == 0 && tcpedit->encap.type == TCPEDIT_ENCAP_NONE && !payload_resizes(tcpedit->payload) &&
+           tcpedit_dlt_preserves_size(tcpedit->dlt_ctx);
+}
+
+/**
+ * \brief Does tcpedit_packet() leave every packet as it is?
+ *
+ * True when nothing was asked of tcpedit, so callers like tcpbridge may
+ * forward packets without calling tcpedit_packet() at all.  Note that
+ * tcpedit_packet() would still fix an IP length which doesn't match the
+ * frame, Ethernet padding included.
+ */
+bool
+tcpedit_is_passthru(tcpedit_t *tcpedit)
+{
+    int l3;
+
+    assert(tcpedit);
+    assert(tcpedit->validated);
+
+    for (l3 = 0; l3 < TCPEDIT_L3_CNT; l3++) {
+        if (tcpedit_get_l3_edits(tcpedit, (tcpedit_l3_t)l3) != 0)
+            return false;
+    }
+
+    return !tcpedit->fixcsum && !tcpedit->csum_offload && tcpedit_is_size_preserving(tcpedit) &&
+           tcpedit_dlt_is_passthru(tcpedit->dlt_ctx);
+}
+
+/**
+ * \brief Does editing the same packet always give the same result?
+ *
+ * True unless the edits are random per packet (--fuzz-seed), in which case
+ * callers who send a packet more than once have to edit it every time.
+ */
+bool
+tcpedit_is_repeatable(tcpedit_t *tcpedit)
+{
+    assert(tcpedit);
+    return tcpedit->fuzz_seed == 0;
+}
+
+/**
+ * \brief Where the last packet edited needs its L4 checksum finished
+ *
+ * With tcpedit_set_csum_offload(), TCP and UDP checksums are left to the
+ * NIC: the checksum field only holds the sum of the pseudo header, and
+ * the NIC has to add the sum from csum_start (from the start of the
+ * frame) to the end and store it at csum_start + csum_offset.  Returns
+ * false if the packet is fully checksummed already.
+ */
+bool
+tcpedit_get_csum_partial(tcpedit_t *tcpedit, uint16_t *csum_start, uint16_t *csum_offset)
+{
+    assert(tcpedit);
+    assert(csum_start);
+    assert(csum_offset);
+
+    *csum_start = tcpedit->runtime.csum_start;
+    *csum_offset = tcpedit->runtime.csum_offset;
+    return *csum_offset != 0;
+}
+
 /**
  * \brief tcpedit option validator.  Call after tcpedit_init()
  *
- * Validates that given the current state of tcpedit that the given
- * pcap source and destination (based on DLT) can be properly rewritten
+ * Compiles the options set so far into the lists of edits tcpedit_packet()
+ * makes to each kind of layer 3, so call it after the last option is set.
  * return 0 on success
  * return -1 on error
- * DO NOT USE!
  */
 int
 tcpedit_validate(tcpedit_t *tcpedit)
 {
+    tcpedit_ops_t *ops;
+    int l3;
+
     assert(tcpedit);
-    tcpedit->validated = 1;
 
-    /* we used to do a bunch of things here, but not anymore...
-     * maybe I should find something to do or just get ride of it
-     */
+    /* the edits before --fuzz-seed, in the order tcpedit_packet() always made them */
+    memset(tcpedit->hdr_ops, 0, sizeof(tcpedit->hdr_ops));
+    ops = &tcpedit->hdr_ops[TCPEDIT_L3_IPV4];
+    /* first, so the sequence numbers it fixes up are still those captured */
+    if (tcpedit->payload != NULL)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV4_PAYLOAD;
+    if (tcpedit->tos > -1)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV4_TOS;
+    if (tcpedit->ttl_mode != TCPEDIT_TTL_MODE_OFF)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV4_TTL;
+    if (tcpedit->portmap != NULL)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV4_PORTS;
+    if (tcpedit->tcp_sequence_enable)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV4_TCP_SEQUENCE;
+
+    ops = &tcpedit->hdr_ops[TCPEDIT_L3_IPV6];
+    if (tcpedit->payload != NULL)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV6_PAYLOAD;
+    if (tcpedit->ttl_mode != TCPEDIT_TTL_MODE_OFF)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV6_HLIM;
+    if (tcpedit->tclass > -1)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV6_TCLASS;
+    if (tcpedit->flowlabel > -1)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV6_FLOWLABEL;
+    if (tcpedit->portmap != NULL)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV6_PORTS;
+    if (tcpedit->tcp_sequence_enable)
+        ops->op[ops->cnt++] = TCPEDIT_OP_IPV6_TCP_SEQUENCE;
+
+    /* and those after */
+    memset(tcpedit->pkt_ops, 0, sizeof(tcpedit->pkt_ops));
+    if (tcpedit->fixlen || tcpedit->mtu_truncate) {
+        for (l3 = 0; l3 < TCPEDIT_L3_CNT; l3++) {
+            ops = &tcpedit->pkt_ops[l3];
+            ops->op[ops->cnt++] = TCPEDIT_OP_UNTRUNC;
+        }
+    }
+
+    if (tcpedit->rewrite_ip) {
+        ops = tcpedit->pkt_ops;
+        ops[TCPEDIT_L3_IPV4].op[ops[TCPEDIT_L3_IPV4].cnt++] = TCPEDIT_OP_IPV4_REWRITE;
+        ops[TCPEDIT_L3_IPV6].op[ops[TCPEDIT_L3_IPV6].cnt++] = TCPEDIT_OP_IPV6_REWRITE;
+        ops[TCPEDIT_L3_ARP].op[ops[TCPEDIT_L3_ARP].cnt++] = TCPEDIT_OP_ARP_REWRITE;
+    }
+
+    if (tcpedit->seed) {
+        ops = tcpedit->pkt_ops;
+        ops[TCPEDIT_L3_IPV4].op[ops[TCPEDIT_L3_IPV4].cnt++] = TCPEDIT_OP_IPV4_SEED;
+        ops[TCPEDIT_L3_IPV6].op[ops[TCPEDIT_L3_IPV6].cnt++] = TCPEDIT_OP_IPV6_SEED;
+        ops[TCPEDIT_L3_ARP].op[ops[TCPEDIT_L3_ARP].cnt++] = TCPEDIT_OP_ARP_SEED;
+    }
+
+    if (encap_init(tcpedit) < 0)
+        return -1;
+
+    for (l3 = 0; l3 < TCPEDIT_L3_CNT; l3++)
+        dbgx(1, "layer 3 type %d: %d header edits, %d more after fuzzing", l3, tcpedit->hdr_ops[l3].cnt, tcpedit->pkt_ops[l3].cnt);
+
+    tcpedit->validated = 1;
     return 0;
 }
 
+/**
+ * \brief Number of edits tcpedit_packet() makes beyond layer 2 to
+ * packets of the given layer 3 kind, as compiled by tcpedit_validate()
+ *
+ * Lengths and checksums are fixed up on top of these as needed.
+ */
+int
+tcpedit_get_l3_edits(tcpedit_t *tcpedit, tcpedit_l3_t l3)
+{
+    assert(tcpedit);
+    assert(tcpedit->validated);
+    assert(l3 < TCPEDIT_L3_CNT);
+
+    return tcpedit->hdr_ops[l3].cnt + tcpedit->pkt_ops[l3].cnt;
+}
+
 /**
  * return the error string when a tcpedit() function returns
  * TCPEDIT_ERROR
@@ -568,10 +902,13 @@ tcpedit_close(tcpedit_t **tcpedit_ex)
         tcpedit->cidrmap2->from = NULL;
         destroy_cidr(tcpedit->cidrmap2->to);
         tcpedit->cidrmap2->to = NULL;
+        destroy_cidr_trie(tcpedit->cidrmap2->trie);
         safe_free(tcpedit->cidrmap2);
         tcpedit->cidrmap2 = NULL;
     }
 
+    if (tcpedit->cidrmap1)
+        destroy_cidr_trie(tcpedit->cidrmap1->trie);
     safe_free(tcpedit->cidrmap1);
     tcpedit->cidrmap1 = NULL;
 
@@ -587,13 +924,21 @@ tcpedit_close(tcpedit_t **tcpedit_ex)
         tcpedit->dstipmap->from = NULL;
         destroy_cidr(tcpedit->dstipmap->to);
         tcpedit->dstipmap->to = NULL;
+        destroy_cidr_trie(tcpedit->dstipmap->trie);
         safe_free(tcpedit->dstipmap);
         tcpedit->dstipmap = NULL;
     }
 
+    if (tcpedit->srcipmap)
+        destroy_cidr_trie(tcpedit->srcipmap->trie);
     safe_free(tcpedit->srcipmap);
     tcpedit->srcipmap = NULL;
 
+    addr_cache_free(&tcpedit->addr_cache);
+
+    payload_free(tcpedit->payload);
+    tcpedit->payload = NULL;
+
     if (tcpedit->portmap) {
         free_portmap(tcpedit->portmap);
         tcpedit->portmap = NULL;
@@ -43,9 +43,16 @@ int tcpedit_checkerror(tcpedit_t *tcpedit, int rcode, const char *prefix);
 int tcpedit_validate(tcpedit_t *tcpedit);
 
 int tcpedit_packet(tcpedit_t *tcpedit, struct pcap_pkthdr **pkthdr, u_char **pktdata, tcpr_dir_t direction);
+int tcpedit_packet_batch(tcpedit_t *tcpedit, tcpedit_pkt_t *pkts, int cnt);
 
 int tcpedit_close(tcpedit_t **tcpedit_ex);
 int tcpedit_get_output_dlt(tcpedit_t *tcpedit);
+int tcpedit_get_growth(tcpedit_t *tcpedit);
+bool tcpedit_is_size_preserving(tcpedit_t *tcpedit);
+bool tcpedit_is_passthru(tcpedit_t *tcpedit);
+bool tcpedit_is_repeatable(tcpedit_t *tcpedit);
+int tcpedit_get_l3_edits(tcpedit_t *tcpedit, tcpedit_l3_t l3);
+bool tcpedit_get_csum_partial(tcpedit_t *tcpedit, uint16_t *csum_start, uint16_t *csum_offset);
 
 const u_char *tcpedit_l3data(tcpedit_t *tcpedit, tcpedit_coder code, u_char *packet, int pktlen);
 
@@ -63,6 +70,9 @@ COUNTER tcpedit_get_pkts_edited(tcpedit_t *tcpedit);
 void __tcpedit_seterr(tcpedit_t *tcpedit, const char *func, int line, const char *file, const char *fmt, ...);
 void tcpedit_setwarn(tcpedit_t *tcpedit, const char *fmt, ...);
 
+u_char *tcpedit_layer4_v4(tcpedit_t *tcpedit, ipv4_hdr_t *ip_hdr, const u_char *end_ptr);
+u_char *tcpedit_layer4_v6(tcpedit_t *tcpedit, ipv6_hdr_t *ip6_hdr, const u_char *end_ptr, uint8_t *proto);
+
 #ifdef __cplusplus
 }
 #endif
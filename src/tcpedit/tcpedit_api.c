@@ -136,6 +136,22 @@ tcpedit_set_fixcsum(tcpedit_t *tcpedit, bool value)
     return TCPEDIT_OK;
 }
 
+/**
+ * \brief leave TCP/UDP checksums to the NIC?
+ *
+ * Only for packets sent out an interface set up for it, such as with
+ * sendpacket_enable_vnet_hdr().  Rather than summing the whole segment,
+ * checksum fixing then stores the pseudo header sum and tells the caller
+ * where the NIC has to finish, see tcpedit_get_csum_partial().
+ */
+int
+tcpedit_set_csum_offload(tcpedit_t *tcpedit, bool value)
+{
+    assert(tcpedit);
+    tcpedit->csum_offload = value;
+    return TCPEDIT_OK;
+}
+
 /**
  * \brief should we remove the EFCS from the frame?
  */
@@ -147,6 +163,19 @@ tcpedit_set_efcs(tcpedit_t *tcpedit, bool value)
     return TCPEDIT_OK;
 }
 
+/**
+ * \brief should we append an FCS to every Ethernet frame once edited?
+ *
+ * Combined with tcpedit_set_efcs() the FCS a frame came with is replaced.
+ */
+int
+tcpedit_set_add_fcs(tcpedit_t *tcpedit, bool value)
+{
+    assert(tcpedit);
+    tcpedit->add_fcs = value;
+    return TCPEDIT_OK;
+}
+
 /**
  * \brief set the IPv4 TTL mode
  */
@@ -23,6 +23,7 @@
 #include "defines.h"
 #include "common.h"
 #include "tcpr.h"
+#include "addr_cache.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -46,6 +47,16 @@ typedef enum { TCPEDIT_EDIT_BOTH = 0, TCPEDIT_EDIT_C2S, TCPEDIT_EDIT_S2C } tcped
 
 typedef enum { BEFORE_PROCESS, AFTER_PROCESS } tcpedit_coder;
 
+/*
+ * where the layer 4 header of the packet being edited is, found once by
+ * tcpedit_packet() so the editors don't parse the packet again
+ */
+typedef struct {
+    const u_char *l3; /* IPv4/IPv6 header this is for, NULL for none */
+    u_char *l4;       /* layer 4 header, NULL if it wasn't captured */
+    uint8_t l4proto;  /* protocol of l4, after any IPv6 extension headers */
+} tcpedit_layout_t;
+
 #define TCPEDIT_ERRSTR_LEN 1024
 typedef struct {
     COUNTER packetnum;
@@ -55,6 +66,10 @@ typedef struct {
     int dlt2;
     char errstr[TCPEDIT_ERRSTR_LEN];
     char warnstr[TCPEDIT_ERRSTR_LEN];
+    tcpedit_layout_t layout;
+    /* --csum-offload: the L4 checksum of this packet left to the NIC, csum_offset 0 if none */
+    uint16_t csum_start;
+    uint16_t csum_offset;
 #ifdef FORCE_ALIGN
     u_char *l3buff;
 #endif
@@ -83,8 +98,80 @@ typedef struct tcpedit_portmap_s {
     long from;
     long to;
     struct tcpedit_portmap_s *next;
+    uint16_t *table; /* only set on the head of a compiled list */
 } tcpedit_portmap_t;
 
+/*
+ * the edits tcpedit_packet() makes beyond layer 2, compiled by
+ * tcpedit_validate() from the options in use into a list per kind of
+ * layer 3, so packets only go through the edits which apply to them
+ */
+typedef enum { TCPEDIT_L3_IPV4 = 0, TCPEDIT_L3_IPV6, TCPEDIT_L3_ARP, TCPEDIT_L3_OTHER, TCPEDIT_L3_CNT } tcpedit_l3_t;
+
+typedef enum {
+    TCPEDIT_OP_IPV4_TOS = 1,
+    TCPEDIT_OP_IPV4_PAYLOAD,
+    TCPEDIT_OP_IPV4_TTL,
+    TCPEDIT_OP_IPV4_PORTS,
+    TCPEDIT_OP_IPV4_TCP_SEQUENCE,
+    TCPEDIT_OP_IPV6_PAYLOAD,
+    TCPEDIT_OP_IPV6_HLIM,
+    TCPEDIT_OP_IPV6_TCLASS,
+    TCPEDIT_OP_IPV6_FLOWLABEL,
+    TCPEDIT_OP_IPV6_PORTS,
+    TCPEDIT_OP_IPV6_TCP_SEQUENCE,
+    TCPEDIT_OP_UNTRUNC,
+    TCPEDIT_OP_IPV4_REWRITE,
+    TCPEDIT_OP_IPV6_REWRITE,
+    TCPEDIT_OP_ARP_REWRITE,
+    TCPEDIT_OP_IPV4_SEED,
+    TCPEDIT_OP_IPV6_SEED,
+    TCPEDIT_OP_ARP_SEED,
+} tcpedit_op_t;
+
+#define TCPEDIT_OPS_MAX 8
+
+typedef struct {
+    uint8_t op[TCPEDIT_OPS_MAX]; /* tcpedit_op_t, in the order they are made */
+    int cnt;
+} tcpedit_ops_t;
+
+/* --payload-rewrite rules, see payload.c */
+typedef struct tcpedit_payload_s tcpedit_payload_t;
+
+/*
+ * --encap overlay header put in front of every edited Ethernet frame
+ */
+typedef enum { TCPEDIT_ENCAP_NONE = 0, TCPEDIT_ENCAP_VXLAN, TCPEDIT_ENCAP_GENEVE, TCPEDIT_ENCAP_GRE } tcpedit_encap_type;
+
+/* outer Ethernet, IPv4, UDP and VXLAN/Geneve header, or GRE with a key */
+#define TCPEDIT_ENCAP_MAX_H (TCPR_ETH_H + TCPR_IPV4_H + TCPR_UDP_H + 8)
+
+typedef struct {
+    tcpedit_encap_type type;
+    uint32_t src; /* outer IPv4 addresses of the client side, network byte order */
+    uint32_t dst;
+    uint32_t vni; /* VXLAN/Geneve VNI or GRE key */
+    bool key;     /* GRE: send vni as the key */
+    bool entropy; /* UDP source port from a hash of the inner flow */
+    bool macs;    /* outer MACs given, else copied from the inner frame */
+    u_char smac[ETHER_ADDR_LEN];
+    u_char dmac[ETHER_ADDR_LEN];
+    /* built by tcpedit_validate(): the C2S and S2C headers with no length */
+    int hdrlen;
+    u_char hdr[2][TCPEDIT_ENCAP_MAX_H];
+} tcpedit_encap_t;
+
+/*
+ * a packet of tcpedit_packet_batch()
+ */
+typedef struct {
+    struct pcap_pkthdr *pkthdr;
+    u_char *pktdata;
+    tcpr_dir_t direction;
+    int rcode; /* what tcpedit_packet() would have returned */
+} tcpedit_pkt_t;
+
 /*
  * all the arguments that the packet editing library supports
  */
@@ -92,6 +179,10 @@ typedef struct {
     bool validated; /* have we run tcpedit_validate()? */
     struct tcpeditdlt_s *dlt_ctx;
 
+    /* compiled by tcpedit_validate(): header edits, then those made after --fuzz-seed */
+    tcpedit_ops_t hdr_ops[TCPEDIT_L3_CNT];
+    tcpedit_ops_t pkt_ops[TCPEDIT_L3_CNT];
+
     /* runtime variables, don't mess with these */
     tcpedit_runtime_t runtime;
 
@@ -108,13 +199,20 @@ typedef struct {
     /* rewrite TCP seq/ack numbers? */
     u_int32_t tcp_sequence_enable;
     u_int32_t tcp_sequence_adjust;
+    bool tcp_sequence_flows; /* shift each flow by its own amount */
 
     /* fix IP/TCP/UDP checksums */
     bool fixcsum;
 
+    /* only sum the pseudo header of TCP/UDP, the NIC does the rest */
+    bool csum_offload;
+
     /* remove ethernet FCS */
     bool efcs;
 
+    /* append a freshly computed ethernet FCS to the edited frame */
+    bool add_fcs;
+
     tcpedit_ttl_mode ttl_mode;
     u_int8_t ttl_value;
 
@@ -138,6 +236,9 @@ typedef struct {
     /* pseudo-randomize IP addresses using a seed */
     uint32_t seed;
 
+    /* what the above rewrote each address to */
+    addr_cache_t addr_cache;
+
     /* rewrite tcp/udp ports */
     tcpedit_portmap_t *portmap;
 
@@ -147,6 +248,12 @@ typedef struct {
 
     uint32_t fuzz_seed;
     uint32_t fuzz_factor;
+
+    /* replace strings in TCP/UDP payloads */
+    tcpedit_payload_t *payload;
+
+    /* wrap packets in a VXLAN/Geneve/GRE header */
+    tcpedit_encap_t encap;
 } tcpedit_t;
 
 #ifdef __cplusplus
@@ -45,9 +45,18 @@
  * If the remote host responds correctly as we expect (checking the schedule position expectation
  * as packets are received) then we proceed in the schedule whether the next event is to send a local
  * packet or wait for a remote packet to arrive.
+ *
+ * With --sessions the schedule is replayed by many sessions at once, each over
+ * its own local port and with its own random local SEQ. A single poll() loop
+ * reads the packets of all sessions, hands each to its session by destination
+ * port and sends the local packets they answer with in batches. Sessions
+ * waiting on the remote host sit in a queue ordered by their timeout.
+ *
+ * Every exchange is timed on the way, see session_measure(): the round
+ * trip time of bare ACKs and the think time of the server before its data.
 
  *
- * Usage: tcpliveplay <eth0/eth1> <file.pcap> <Destination IP [1.2.3.4]> <Destination mac [0a:1b:2c:3d:4e:5f]> <'random'
+ * Usage: tcpliveplay [--sessions=<count>] <eth0/eth1> <file.pcap> <Destination IP [1.2.3.4]> <Destination mac [0a:1b:2c:3d:4e:5f]> <'random'
  dst port OR specify dport #>
  *
  * Example:
@@ -65,11 +74,14 @@
 #include "tcpliveplay.h"
 #include "config.h"
 #include "common/sendpacket.h"
+#include "common/timer.h"
 #include "common/utils.h"
 #include "tcpliveplay_opts.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -86,26 +98,63 @@ volatile int didsig;
 int debug = 0;
 #endif
 
-pcap_t *set_live_filter(char *dev, input_addr *hostip, unsigned int port);
+pcap_t *set_live_filter(char *dev, input_addr *hostip, unsigned int port, unsigned int count);
 pcap_t *set_offline_filter(char *file);
 pcap_t *live_handle;
-unsigned int sched_index = 0;
-unsigned int initial_rseq = 0;
 sendpacket_t *sp;
 unsigned int seed = 0;
 
-/*g for Global header pointers used in pcap_loop callback*/
-tcp_hdr *tcphdr_rprev = NULL;
-unsigned int size_payload_prev = 0;
-unsigned int acked_index = 0;
-unsigned int diff_payload_index = 0;
-bool different_payload = false;
-volatile sig_atomic_t keep_going = 1;
 int random_port();
 unsigned int pkts_scheduled = 0; /* packet counter */
 struct tcp_sched *sched = NULL;
+
+/* sessions replaying the schedule, session k uses local port base_port + k */
+static struct tcp_session *sessions = NULL;
+static unsigned int nsessions = 1;
+static unsigned int sessions_running = 0;
+static unsigned int base_port = 0;
+
+/* sessions waiting on the remote host, in deadline order */
+static TAILQ_HEAD(session_timers_s, tcp_session) session_timers = TAILQ_HEAD_INITIALIZER(session_timers);
+
+/* local packets queued for the next sendpacket_batch(), and whose they are */
+static sendpacket_pkt_t send_batch[SENDPACKET_BATCH_MAX];
+static struct pcap_pkthdr send_hdrs[SENDPACKET_BATCH_MAX];
+static u_char *send_bufs[SENDPACKET_BATCH_MAX];
+static struct tcp_session *send_sessions[SENDPACKET_BATCH_MAX];
+static unsigned int send_index[SENDPACKET_BATCH_MAX];
+static int send_cnt = 0;
+
+static liveplay_stats_t live_stats;
+
+/*
+ * Receive time stamps are on the capture clock, the realtime one, and are
+ * moved over to tcpr_clock_ns() with the offset between the two taken
+ * right before each pcap_dispatch(), see rx_clock_sync()
+ */
+static bool rx_nsec = false;      /* time stamps have ns in tv_usec */
+static int64_t rx_clock_offset;   /* capture clock minus tcpr_clock_ns() */
+static u_int64_t rx_dispatch_ns;  /* when the packets being handled were read */
+
+/* by session_state_t */
+static const char *session_state_names[] = {"running", "done", "timeout", "reset", "retransmit"};
+
+/* per packet progress is only printed when replaying a single session */
+#define session_printf(...)                                                                                            \
+    do {                                                                                                               \
+        if (nsessions == 1)                                                                                            \
+            printf(__VA_ARGS__);                                                                                       \
+    } while (0)
+
 void got_packet(u_char *args, const struct pcap_pkthdr *header, const u_char *packet);
-void catch_alarm(int sig);
+static int tcplp_rand(void);
+static void session_init(struct tcp_session *s, unsigned int port);
+static void session_step(struct tcp_session *s);
+static void session_flush(void);
+static void session_loop(void);
+static unsigned int session_retransmissions(const struct tcp_session *s);
+static void liveplay_stats_print(void);
+static void liveplay_stats_write(const char *path);
 int iface_addrs(char *iface, input_addr *ip, struct mac_addr *mac);
 int extmac(char *new_rmac_ptr, struct mac_addr *new_remotemac);
 int extip(char *ip_string, input_addr *new_remoteip);
@@ -120,7 +169,6 @@ int relative_sched(struct tcp_sched *schedule, u_int32_t first_rseq, int num_pac
 int fix_all_checksum_liveplay(ipv4_hdr *iphdr);
 int compip(input_addr *lip, input_addr *rip, input_addr *pkgip);
 int do_checksum_liveplay(u_int8_t *data, int proto, int len);
-int do_checksum_math_liveplay(u_int16_t *data, int len);
 
 /**
  * This is the main function of the program that handles calling other
@@ -133,7 +181,7 @@ main(int argc, char **argv)
     int num_packets;
     static const char random_strg[] = "random";
 
-    char *iface = argv[1];
+    char *iface;
     char *new_rmac_ptr;
     char *new_rip_ptr;
     input_addr new_remoteip;
@@ -142,21 +190,30 @@ main(int argc, char **argv)
     struct mac_addr mymac;
     int new_src_port;
     unsigned int retransmissions = 0;
-    pcap_t *local_handle;
+    unsigned int pkts_replayed = 0;
+    unsigned int ended[SESSION_RETRANSMIT + 1];
+    unsigned int max_len = 0;
     char errbuf[PCAP_ERRBUF_SIZE];
     char ebuf[SENDPACKET_ERRBUF_SIZE];
-    int i;
+    int i, optct;
+
+    optct = optionProcess(&tcpliveplayOptions, argc, argv); /*Process AutoOpts for manpage options*/
 
-    optionProcess(&tcpliveplayOptions, argc, argv); /*Process AutoOpts for manpage options*/
+    /* keep the positional arguments at argv[1] onwards */
+    argc -= optct - 1;
+    argv += optct - 1;
 
-    if ((argc < 5) || (argv[1] == NULL) || (argv[2] == NULL) || (argv[3] == NULL) || (argv[4] == NULL) ||
+    if ((argc < 6) || (argv[1] == NULL) || (argv[2] == NULL) || (argv[3] == NULL) || (argv[4] == NULL) ||
         (argv[5] == NULL)) {
         printf("ERROR: Incorrect Usage!\n");
-        printf("Usage: tcpliveplay <eth0/eth1> <file.pcap> <Destination IP [1.2.3.4]> <Destination mac [0a:1b:2c:3d:4e:5f]> <specify 'random' or specific port#>\n");
+        printf("Usage: tcpliveplay [--sessions=<count>] <eth0/eth1> <file.pcap> <Destination IP [1.2.3.4]> <Destination mac [0a:1b:2c:3d:4e:5f]> <specify 'random' or specific port#>\n");
         printf("Example:\n    yhsiam@yhsiam-VirtualBox:~$ sudo tcpliveplay eth0 test1.pcap 192.168.1.4 52:57:01:11:31:92 random\n\n");
         exit(0);
     }
 
+    iface = argv[1];
+    nsessions = HAVE_OPT(SESSIONS) ? (unsigned int)OPT_VALUE_SESSIONS : 1;
+
     if (strlen(iface) > IFNAMSIZ - 1)
         errx(-1, "Invalid interface name %s\n", iface);
 
@@ -168,19 +225,22 @@ main(int argc, char **argv)
         errx(-1, "Can't open %s: %s", argv[1], ebuf);
 
     /*for(int i = 0; i<10; i++) tolower(port_mode[i]);*/
-    if (strcmp(argv[5], random_strg) == 0)
+    if (strcmp(argv[5], random_strg) == 0) {
         new_src_port = random_port();
-    else
+        if (new_src_port + nsessions - 1 > 65535)
+            new_src_port = 65536 - nsessions;
+    } else {
         new_src_port = strtol(argv[5], NULL, 10);
+    }
 
-    if (new_src_port < 0 || new_src_port > 65535)
-        errx(new_src_port, "Cannot use source port %d", new_src_port);
-
-    printf("new source port:: %d\n", new_src_port);
+    if (new_src_port < 0 || new_src_port + nsessions - 1 > 65535)
+        errx(new_src_port, "Cannot use source port %d for %u sessions", new_src_port, nsessions);
 
-    /* Establish a handler for SIGALRM signals. */
-    /* This is used as timeout for unresponsive remote hosts */
-    signal(SIGALRM, catch_alarm);
+    base_port = new_src_port;
+    if (nsessions == 1)
+        printf("new source port:: %d\n", new_src_port);
+    else
+        printf("new source ports:: %d-%u\n", new_src_port, new_src_port + nsessions - 1);
 
     /* Extract new Remote MAC & IP inputed at command line */
     new_rmac_ptr = argv[4];
@@ -215,23 +275,23 @@ main(int argc, char **argv)
     relative_sched(sched, sched[1].exp_rseq, num_packets);
     printf("Packets Scheduled %u\n", pkts_scheduled);
 
-    /* Open socket for savedfile traffic to be sent*/
-    local_handle = pcap_open_offline("newfile.pcap", errbuf); /*call pcap library function*/
-    if (local_handle == NULL) {
-        fprintf(stderr, "Couldn't open pcap file %s: %s\n", "newfile.pcap", errbuf);
-        free(sched);
-        return (2);
-    }
-
     /* Open socket for live traffic to be listed to*/
-    live_handle =
-            set_live_filter(iface, &myip, new_src_port); /* returns a pcap_t that filters out traffic other than TCP*/
+    live_handle = set_live_filter(iface,
+                                  &myip,
+                                  base_port,
+                                  nsessions); /* returns a pcap_t that filters out traffic other than TCP*/
     if (live_handle == NULL) {
         fprintf(stderr, "Error occurred while listing on traffic: %s\n", errbuf);
         free(sched);
         return (2);
     }
 
+#ifdef HAVE_PCAP_SETNONBLOCK
+    /* we poll() before reading, pcap_dispatch() must not block once the ring is empty */
+    if (pcap_setnonblock(live_handle, 1, errbuf) < 0)
+        errx(-1, "Unable to set %s non-blocking: %s", iface, errbuf);
+#endif
+
     /* Printout when no packets are scheduled */
     if (pkts_scheduled == 0) {
         printf("\n+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
@@ -243,93 +303,25 @@ main(int argc, char **argv)
         return ERROR;
     }
 
-    /* Start replay by sending the first packet, the SYN, from the schedule */
-    else if (sched[0].local) { /* Send first packet*/
-        sendpacket(sp, sched[sched_index].packet_ptr, sched[sched_index].pkthdr.len, &sched[sched_index].pkthdr);
-        printf("Sending Local Packet...............	[%u]\n", sched_index + 1);
-        sched_index++; /* Proceed in the schedule */
+    /* buffers for the local packets of one batch */
+    for (k = 0; k < pkts_scheduled; k++) {
+        if (sched[k].pkthdr.len > max_len)
+            max_len = sched[k].pkthdr.len;
     }
 
-    /* Main while loop that handles the decision making and the replay oprations */
-    while (sched_index < pkts_scheduled) {
-        if (!keep_going) { /*Check the timeout variable */
-            printf("\n======================================================================\n");
-            printf("= TIMEOUT:: Remote host is not responding. You may have crashed      =\n");
-            printf("= the host you replayed these packets against OR the packet sequence =\n");
-            printf("= changed since the capture was taken resulting in differing         =\n");
-            printf("= expectations. Closing replay...                                    =\n");
-            printf("======================================================================\n\n");
-            break;
-        }
-        /* tcphdr_rprev carries the last remote tcp header */
-        if (tcphdr_rprev == NULL) {
-            // printf("FIRST PASS!\n");
-        }
-        /* Check if received RST or RST-ACK flagged packets*/
-        else if ((tcphdr_rprev->th_flags == TH_RST) || (tcphdr_rprev->th_flags == (TH_RST | TH_ACK))) {
-            printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-            printf("+ ERROR:: Remote host has requested to RESET the connection.   +\n");
-            printf("+ Closing replay...                                            +\n");
-            printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
-            break;
-        }
-        /* Do the following if we receive a packet that ACKs for the same ACKing of next packet */
-        else if ((tcphdr_rprev->th_seq == htonl(sched[sched_index].exp_rseq)) &&
-                 (tcphdr_rprev->th_ack == htonl(sched[sched_index].exp_rack)) && (size_payload_prev > 0)) {
-            printf("Received Remote Packet...............	[%u]\n", sched_index + 1);
-            printf("Skipping Packet......................	[%u] to Packet [%u]\n",
-                   sched_index + 1,
-                   sched_index + 2);
-            printf("Next Remote Packet Expectation met.\nProceeding in replay...\n");
-            sched_index++;
-        }
-        /* Do the following if payload does not meet expectation and re-attempt with the remote host for 3 tries*/
-        else if (different_payload) {
-            printf("\n+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-            printf("+ WARNING: Remote host is not meeting packet size expectations.               +\n");
-            printf("+ for packet %-u. Application layer data differs from capture being replayed.  +\n",
-                   diff_payload_index + 1);
-            printf("+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
-            printf("Requesting retransmission.\n Proceeding...\n");
-            different_payload = false;
-        }
+    for (i = 0; i < SENDPACKET_BATCH_MAX; i++)
+        send_bufs[i] = safe_malloc(max_len);
 
-        /* Local Packets */
-        if (sched[sched_index].local) {
-            /*Reset alarm timeout*/
-            alarm(ALARM_TIMEOUT);
-            printf("Sending Local Packet...............	[%u]\n", sched_index + 1);
-
-            /* edit each packet tcphdr before sending based on the schedule*/
-            if (sched_index > 0) {
-                sched[sched_index].tcphdr->th_ack = htonl(sched[sched_index].curr_lack);
-                fix_all_checksum_liveplay(sched[sched_index].iphdr);
-            }
-
-            /* If 3 attempts of resending was made, then error out to the user */
-            if (sched[sched_index].sent_counter == 3) {
-                printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-                printf("+ ERROR: Re-sent packet [%-u] 3 times, but remote host is not  +\n", sched_index + 1);
-                printf("+ responding as expected. 3 resend attempts are a maximum.     +\n");
-                printf("+ Closing replay...                                            +\n");
-                printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
-                break;
-            }
-
-            /* If nothing goes wrong, then send the packet scheduled to be sent, then proceed in the schedule */
-            sendpacket(sp, sched[sched_index].packet_ptr, sched[sched_index].pkthdr.len, &sched[sched_index].pkthdr);
-            sched[sched_index].sent_counter++; /* Keep track of how many times this specific packet was attempted */
-            sched_index++;                     /* proceed */
-        }
+    /* Start replay by sending the first packet, the SYN, from the schedule of each session */
+    sessions = safe_malloc(nsessions * sizeof(struct tcp_session));
+    for (k = 0; k < nsessions; k++) {
+        session_init(&sessions[k], base_port + k);
+        session_step(&sessions[k]);
+    }
+    session_flush();
 
-        /* Remote Packets */
-        else if (sched[sched_index].remote) {
-            alarm(ALARM_TIMEOUT);
-            printf("Receiving Packets from remote host...\n");
-            pcap_dispatch(live_handle, 1, got_packet, NULL); /* Listen in on NIC for tcp packets */
-            // printf("pcap_loop returned\n");
-        }
-    } /* end of main while loop*/
+    /* Main loop that handles the decision making and the replay oprations */
+    session_loop();
 
     pcap_breakloop(live_handle);
 
@@ -337,12 +329,17 @@ main(int argc, char **argv)
     sendpacket_close(sp);   /* Close Send socket*/
     remove("newfile.pcap"); /* Remote the rewritten file that was created*/
 
-    for (k = 0; k < pkts_scheduled; k++) {
-        retransmissions += sched[k].sent_counter;
+    memset(ended, 0, sizeof(ended));
+    for (k = 0; k < nsessions; k++) {
+        struct tcp_session *s = &sessions[k];
+
+        ended[s->state]++;
+        pkts_replayed += s->index;
+        retransmissions += session_retransmissions(s);
     }
 
     /* User Debug Result Printouts*/
-    if (sched_index == pkts_scheduled) {
+    if (ended[SESSION_DONE] == nsessions) {
         printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n");
         printf("~ CONGRATS!!! You have successfully Replayed your pcap file '%s'\n", argv[2]);
         printf("~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~\n\n");
@@ -354,13 +351,29 @@ main(int argc, char **argv)
     }
 
     printf("----------------TCP Live Play Summary----------------\n");
-    printf("- Packets Scheduled to be Sent & Received:          %-u\n", pkts_scheduled);
-    printf("- Actual Packets Sent & Received:                   %-u\n", sched_index);
+    if (nsessions > 1) {
+        printf("- Sessions Replayed:                                %-u\n", nsessions);
+        printf("- Sessions Completed:                               %-u\n", ended[SESSION_DONE]);
+        printf("- Sessions Timed Out:                               %-u\n", ended[SESSION_TIMEOUT]);
+        printf("- Sessions Reset by Remote Host:                    %-u\n", ended[SESSION_RESET]);
+        printf("- Sessions Aborted after 3 Send Attempts:           %-u\n", ended[SESSION_RETRANSMIT]);
+    }
+    printf("- Packets Scheduled to be Sent & Received:          %-u\n", pkts_scheduled * nsessions);
+    printf("- Actual Packets Sent & Received:                   %-u\n", pkts_replayed);
     printf("- Total Local Packet Re-Transmissions due to packet\n");
     printf("- loss and/or differing payload size than expected: %-u\n", retransmissions);
+    liveplay_stats_print();
     printf("- Thank you for Playing, Play again!\n");
     printf("----------------------------------------------------------\n\n");
 
+    if (HAVE_OPT(STATS_FILE))
+        liveplay_stats_write(OPT_ARG(STATS_FILE));
+
+    for (k = 0; k < nsessions; k++)
+        safe_free(sessions[k].sent_counter);
+    safe_free(sessions);
+    for (i = 0; i < SENDPACKET_BATCH_MAX; i++)
+        safe_free(send_bufs[i]);
     free(sched);
     restore_stdin();
     return 0;
@@ -368,13 +381,408 @@ main(int argc, char **argv)
 /*end of main() function*/
 
 /**
- * This function serves as a timer alarm
+ * Schedule values are relative to the ISNs: these make them absolute for
+ * the given session.  Like the single session replay always did, local ACKs
+ * and remote SEQs only account for the remote ISN after the SYN-ACK.
  */
-void
-catch_alarm(int sig)
+static inline u_int32_t
+session_lseq(const struct tcp_session *s, unsigned int i)
+{
+    return sched[i].curr_lseq + s->lseq;
+}
+
+static inline u_int32_t
+session_lack(const struct tcp_session *s, unsigned int i)
+{
+    return sched[i].curr_lack + (i >= 2 ? s->rseq : 0);
+}
+
+static inline u_int32_t
+session_exp_rseq(const struct tcp_session *s, unsigned int i)
+{
+    return sched[i].exp_rseq + (sched[i].remote ? s->rseq : 0);
+}
+
+static inline u_int32_t
+session_exp_rack(const struct tcp_session *s, unsigned int i)
+{
+    return sched[i].exp_rack + s->lseq;
+}
+
+/**
+ * Set up a session to replay the schedule from the start over the given
+ * local port, with its own random local ISN
+ */
+static void
+session_init(struct tcp_session *s, unsigned int port)
+{
+    memset(s, 0, sizeof(*s));
+    s->port = (u_int16_t)port;
+    s->lseq = tcplp_rand();
+    s->sent_counter = safe_malloc(pkts_scheduled);
+    s->state = SESSION_RUNNING;
+    sessions_running++;
+
+    session_printf("Random Local SEQ: %u\n", s->lseq);
+}
+
+/**
+ * (Re)start the timeout of a session waiting on the remote host.  Every
+ * timeout is ALARM_TIMEOUT long, so appending to the queue keeps it sorted
+ * by deadline.
+ */
+static void
+session_timer(struct tcp_session *s)
+{
+    if (s->timer_set)
+        TAILQ_REMOVE(&session_timers, s, timer);
+
+    s->deadline = tcpr_clock_ns() + (u_int64_t)ALARM_TIMEOUT * 1000000000;
+    TAILQ_INSERT_TAIL(&session_timers, s, timer);
+    s->timer_set = true;
+}
+
+/**
+ * Stop replaying a session
+ */
+static void
+session_end(struct tcp_session *s, session_state_t state)
+{
+    if (s->timer_set) {
+        TAILQ_REMOVE(&session_timers, s, timer);
+        s->timer_set = false;
+    }
+
+    s->state = state;
+    sessions_running--;
+
+    s->end_ns = tcpr_clock_ns();
+    if (state == SESSION_DONE && s->start_ns != 0)
+        tcpr_hist_add(&live_stats.complete, s->end_ns - s->start_ns);
+
+    if (nsessions > 1)
+        return;
+
+    switch (state) {
+    case SESSION_TIMEOUT:
+        printf("\n======================================================================\n");
+        printf("= TIMEOUT:: Remote host is not responding. You may have crashed      =\n");
+        printf("= the host you replayed these packets against OR the packet sequence =\n");
+        printf("= changed since the capture was taken resulting in differing         =\n");
+        printf("= expectations. Closing replay...                                    =\n");
+        printf("======================================================================\n\n");
+        break;
+    case SESSION_RESET:
+        printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+        printf("+ ERROR:: Remote host has requested to RESET the connection.   +\n");
+        printf("+ Closing replay...                                            +\n");
+        printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
+        break;
+    case SESSION_RETRANSMIT:
+        printf("\n++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+        printf("+ ERROR: Re-sent packet [%-u] 3 times, but remote host is not  +\n", s->index + 1);
+        printf("+ responding as expected. 3 resend attempts are a maximum.     +\n");
+        printf("+ Closing replay...                                            +\n");
+        printf("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * Local packet i of the schedule went out for a session at now.  Only a
+ * first attempt is timed: the answer to a retransmission could be to
+ * either copy.
+ */
+static void
+session_sent(struct tcp_session *s, unsigned int i, u_int64_t now)
+{
+    bool first = s->sent_counter[i] == 1;
+
+    if (i == 0 && s->start_ns == 0)
+        s->start_ns = now;
+
+    s->tx_ns = now;
+    s->rtt_due = first;
+    s->think_due = first && sched[i].size_payload > 0;
+}
+
+/**
+ * Send everything queued by session_send()
+ */
+static void
+session_flush(void)
+{
+    u_int64_t now;
+    int i;
+
+    if (send_cnt == 0)
+        return;
+
+    if (sendpacket_batch(sp, send_batch, send_cnt) < send_cnt)
+        warnx("Unable to send packet: %s", sendpacket_geterr(sp));
+
+    now = tcpr_clock_ns();
+    for (i = 0; i < send_cnt; i++)
+        session_sent(send_sessions[i], send_index[i], now);
+
+    send_cnt = 0;
+}
+
+/**
+ * Queue local packet i of the schedule with the SEQ/ACK numbers and port
+ * of the given session
+ */
+static void
+session_send(struct tcp_session *s, unsigned int i)
+{
+    struct tcp_sched *entry = &sched[i];
+    tcp_hdr *tcphdr;
+    u_char *packet;
+#ifndef STUPID_SOLARIS_CHECKSUM_BUG
+    u_int32_t sum;
+#endif
+
+    if (send_cnt == SENDPACKET_BATCH_MAX)
+        session_flush();
+
+    packet = send_bufs[send_cnt];
+    memcpy(packet, entry->packet_ptr, entry->pkthdr.len);
+
+    /* edit each packet tcphdr before sending based on the schedule*/
+    tcphdr = (tcp_hdr *)(packet + SIZE_ETHERNET + entry->size_ip);
+    tcphdr->th_sport = htons(s->port);
+    tcphdr->th_seq = htonl(session_lseq(s, i));
+    if (i > 0)
+        tcphdr->th_ack = htonl(session_lack(s, i));
+
+    /* the IP header is unchanged, and only the fields above need adding to the TCP checksum */
+#ifdef STUPID_SOLARIS_CHECKSUM_BUG
+    tcphdr->th_sum = tcphdr->th_off << 2;
+#else
+    sum = entry->csum_partial + tcphdr->th_sport;
+    sum += (tcphdr->th_seq >> 16) + (tcphdr->th_seq & 0xffff);
+    sum += (tcphdr->th_ack >> 16) + (tcphdr->th_ack & 0xffff);
+    tcphdr->th_sum = CHECKSUM_CARRY(sum);
+#endif
+
+    memcpy(&send_hdrs[send_cnt], &entry->pkthdr, sizeof(struct pcap_pkthdr));
+    send_batch[send_cnt].data = packet;
+    send_batch[send_cnt].len = entry->pkthdr.len;
+    send_batch[send_cnt].pkthdr = &send_hdrs[send_cnt];
+    send_sessions[send_cnt] = s;
+    send_index[send_cnt] = i;
+    send_cnt++;
+}
+
+/**
+ * Move a session along its schedule: send local packets until it has to
+ * wait for the remote host, or it is done
+ */
+static void
+session_step(struct tcp_session *s)
+{
+    while (s->state == SESSION_RUNNING) {
+        if (s->index >= pkts_scheduled) {
+            session_end(s, SESSION_DONE);
+            return;
+        }
+
+        /* rprev carries the last remote tcp header */
+        if (!s->have_rprev) {
+            /* first pass */
+        }
+        /* Check if received RST or RST-ACK flagged packets*/
+        else if ((s->rprev_flags == TH_RST) || (s->rprev_flags == (TH_RST | TH_ACK))) {
+            session_end(s, SESSION_RESET);
+            return;
+        }
+        /* Do the following if we receive a packet that ACKs for the same ACKing of next packet */
+        else if ((s->rprev_seq == htonl(session_exp_rseq(s, s->index))) &&
+                 (s->rprev_ack == htonl(session_exp_rack(s, s->index))) && (s->size_payload_prev > 0)) {
+            session_printf("Received Remote Packet...............	[%u]\n", s->index + 1);
+            session_printf("Skipping Packet......................	[%u] to Packet [%u]\n",
+                           s->index + 1,
+                           s->index + 2);
+            session_printf("Next Remote Packet Expectation met.\nProceeding in replay...\n");
+            s->index++;
+            if (s->index >= pkts_scheduled)
+                continue;
+        }
+        /* Do the following if payload does not meet expectation and re-attempt with the remote host for 3 tries*/
+        else if (s->different_payload) {
+            session_printf("\n+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+            session_printf("+ WARNING: Remote host is not meeting packet size expectations.               +\n");
+            session_printf("+ for packet %-u. Application layer data differs from capture being replayed.  +\n",
+                           s->diff_payload_index + 1);
+            session_printf("+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n\n");
+            session_printf("Requesting retransmission.\n Proceeding...\n");
+            s->different_payload = false;
+        }
+
+        /* Local Packets */
+        if (sched[s->index].local) {
+            /* If 3 attempts of resending was made, then error out to the user */
+            if (s->sent_counter[s->index] == MAX_SENDS) {
+                session_end(s, SESSION_RETRANSMIT);
+                return;
+            }
+
+            /*Reset timeout*/
+            session_timer(s);
+            session_printf("Sending Local Packet...............	[%u]\n", s->index + 1);
+
+            /* If nothing goes wrong, then send the packet scheduled to be sent, then proceed in the schedule */
+            session_send(s, s->index);
+            s->sent_counter[s->index]++; /* Keep track of how many times this specific packet was attempted */
+            s->index++;                  /* proceed */
+        }
+
+        /* Remote Packets */
+        else if (sched[s->index].remote) {
+            session_timer(s);
+            session_printf("Receiving Packets from remote host...\n");
+            return;
+        }
+
+        /* neither ours nor theirs */
+        else {
+            s->index++;
+        }
+    }
+}
+
+/**
+ * Take the offset between the capture clock and tcpr_clock_ns() before
+ * reading packets.  Taken every time, it follows NTP adjusting the clock.
+ */
+static void
+rx_clock_sync(void)
 {
-    keep_going = 0;
-    signal(sig, catch_alarm);
+#ifdef HAVE_CLOCK_GETTIME
+    struct timespec real;
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    rx_dispatch_ns = tcpr_clock_ns();
+    rx_clock_offset = (int64_t)(TIMESPEC_TO_NANOSEC(&real) - rx_dispatch_ns);
+#else
+    struct timeval real;
+
+    gettimeofday(&real, NULL);
+    rx_dispatch_ns = tcpr_clock_ns();
+    rx_clock_offset = (int64_t)(TIMEVAL_TO_NANOSEC(&real) - rx_dispatch_ns);
+#endif
+}
+
+/**
+ * When a packet was received, on the tcpr_clock_ns() clock.  Without a
+ * usable time stamp, when it was read.
+ */
+static u_int64_t
+session_rx_ns(const struct pcap_pkthdr *header)
+{
+    u_int64_t ts, rx;
+
+    if (header->ts.tv_sec == 0)
+        return rx_dispatch_ns;
+
+    ts = (u_int64_t)header->ts.tv_sec * 1000000000 + (u_int64_t)header->ts.tv_usec * (rx_nsec ? 1 : 1000);
+    rx = ts - (u_int64_t)rx_clock_offset;
+
+    /* can't be received after it was read */
+    return rx > rx_dispatch_ns ? rx_dispatch_ns : rx;
+}
+
+/**
+ * A remote packet with size_payload bytes of data met the expectation of
+ * a session, received at rx_ns.
+ *
+ * A bare ACK of a local packet is a round trip time (RTT) sample.  Data
+ * answering local data is an exchange: the time from sending to the
+ * answer, less the smallest RTT of the session, is the think time of the
+ * server.  Data which ACKs a packet no bare ACK did can't tell the RTT
+ * apart, so isn't an RTT sample.
+ */
+static void
+session_measure(struct tcp_session *s, u_int64_t rx_ns, unsigned int size_payload)
+{
+    u_int64_t delta;
+
+    if (!s->rtt_due && !s->think_due)
+        return;
+
+    /* a time stamp from before the packet was even sent is from the wrong clock */
+    if (rx_ns < s->tx_ns)
+        rx_ns = rx_dispatch_ns;
+    delta = rx_ns - s->tx_ns;
+
+    if (size_payload == 0) {
+        if (s->rtt_due) {
+            tcpr_hist_add(&live_stats.rtt, delta);
+            if (s->rtt_cnt == 0 || delta < s->rtt_min)
+                s->rtt_min = delta;
+            s->rtt_cnt++;
+            s->rtt_sum += delta;
+            s->rtt_due = false;
+        }
+        return;
+    }
+
+    if (s->think_due) {
+        u_int64_t think = delta > s->rtt_min ? delta - s->rtt_min : 0;
+
+        tcpr_hist_add(&live_stats.think, think);
+        s->think_cnt++;
+        s->think_sum += think;
+    }
+    s->rtt_due = s->think_due = false;
+}
+
+/**
+ * Wait for packets from the remote host and hand them to their sessions,
+ * until every session is done or has given up
+ */
+static void
+session_loop(void)
+{
+    struct tcp_session *s;
+    struct pollfd poll_fd;
+    int pollresult, timeout;
+    u_int64_t now;
+
+    while (sessions_running > 0) {
+        /* sleep until a packet arrives or the next session times out */
+        now = tcpr_clock_ns();
+        s = TAILQ_FIRST(&session_timers);
+        if (s == NULL)
+            timeout = ALARM_TIMEOUT * 1000;
+        else if (s->deadline > now)
+            timeout = (int)((s->deadline - now + 999999) / 1000000);
+        else
+            timeout = 0;
+
+        poll_fd.fd = pcap_fileno(live_handle);
+        poll_fd.events = POLLIN;
+        poll_fd.revents = 0;
+
+        pollresult = poll(&poll_fd, 1, timeout);
+        if (pollresult < 0 && errno != EINTR)
+            errx(-1, "poll() error: %s", strerror(errno));
+
+        /* Listen in on NIC for tcp packets */
+        if (pollresult > 0) {
+            rx_clock_sync();
+            if (pcap_dispatch(live_handle, -1, got_packet, NULL) < 0)
+                errx(-1, "Error reading packets: %s", pcap_geterr(live_handle));
+        }
+
+        session_flush();
+
+        now = tcpr_clock_ns();
+        while ((s = TAILQ_FIRST(&session_timers)) != NULL && s->deadline <= now)
+            session_end(s, SESSION_TIMEOUT);
+    }
 }
 
 static int
@@ -400,35 +808,55 @@ random_port()
 }
 
 /**
- * This function sets up the scheduled local ACK and Remote SEQ to be relative numbers,
- * While it sets up the local SEQs and remote ACKs to be absolute within the schedule.
+ * Sum up the TCP checksum of a local packet once, leaving out the source
+ * port, SEQ & ACK so each session only has to add its own values
+ */
+static void
+sched_csum_partial(struct tcp_sched *entry)
+{
+    ipv4_hdr *iphdr = entry->iphdr;
+    tcp_hdr *tcphdr = entry->tcphdr;
+    tcp_hdr saved = *tcphdr;
+    int len = ntohs(iphdr->ip_len) - (iphdr->ip_hl << 2);
+    u_int32_t sum;
+
+    tcphdr->th_sport = 0;
+    tcphdr->th_seq = 0;
+    tcphdr->th_ack = 0;
+    tcphdr->th_sum = 0;
+
+    sum = tcpr_csum_partial(&iphdr->ip_src, 8, 0);
+    sum += ntohs(IPPROTO_TCP + len);
+    entry->csum_partial = tcpr_csum_partial(tcphdr, len, sum);
+
+    *tcphdr = saved;
+}
+
+/**
+ * This function sets up the schedule to be relative numbers. Each session
+ * makes the local SEQs and remote ACKs absolute with its own random local SEQ,
+ * see session_lseq() and friends.
  */
 
 int
 relative_sched(struct tcp_sched *schedule, u_int32_t first_rseq, int num_packets)
 {
     int i;
-    u_int32_t lseq_adjust = tcplp_rand();
-    printf("Random Local SEQ: %u\n", lseq_adjust);
-
     u_int32_t first_lseq = schedule[0].curr_lseq; /* SYN Packet SEQ number */
     /* Fix schedule to relative and absolute */
     for (i = 0; i < num_packets; i++) {
         if (schedule[i].local) {
             schedule[i].curr_lseq = schedule[i].curr_lseq - first_lseq; /* Fix current local SEQ to relative */
-            schedule[i].curr_lseq = schedule[i].curr_lseq +
-                                 lseq_adjust; /* Make absolute. lseq_adjust is the locally generated random number */
             schedule[i].curr_lack = schedule[i].curr_lack - first_rseq; /* Fix current local ACK to relative */
             if (schedule[i].tcphdr)
                 schedule[i].tcphdr->th_seq = htonl(schedule[i].curr_lseq); /* Edit the actual packet header data */
             fix_all_checksum_liveplay(schedule[i].iphdr);               /* Fix the checksum */
+            sched_csum_partial(&schedule[i]);
             schedule[i].exp_rseq = schedule[i].exp_rseq - first_rseq;
             schedule[i].exp_rack = schedule[i].exp_rack - first_lseq;
-            schedule[i].exp_rack = schedule[i].exp_rack + lseq_adjust;
         } else if (schedule[i].remote) {
-            schedule[i].exp_rseq = schedule[i].exp_rseq - first_rseq;  /* Fix expected remote SEQ to be relative */
-            schedule[i].exp_rack = schedule[i].exp_rack - first_lseq;  /* Fix expected remote ACK to be relative*/
-            schedule[i].exp_rack = schedule[i].exp_rack + lseq_adjust; /* Fix expected remote ACK to be absolute */
+            schedule[i].exp_rseq = schedule[i].exp_rseq - first_rseq; /* Fix expected remote SEQ to be relative */
+            schedule[i].exp_rack = schedule[i].exp_rack - first_lseq; /* Fix expected remote ACK to be relative*/
         }
     }
 
@@ -538,7 +966,6 @@ setup_sched(struct tcp_sched *schedule)
         schedule[i].size_ip = size_ip;
         schedule[i].size_tcp = size_tcp;
         schedule[i].size_payload = size_payload;
-        schedule[i].sent_counter = 0;
 
         /* Do the following only for the first packet (SYN)*/
         if (i == 0) {
@@ -595,24 +1022,27 @@ setup_sched(struct tcp_sched *schedule)
 
 /**
  * This function returns a pcap_t for the live traffic handler which
- * filters out traffic other than TCP
+ * filters out traffic other than TCP to the count local ports starting
+ * at port
  *
  */
 
 pcap_t *
-set_live_filter(char *dev, input_addr *hostip, unsigned int port)
+set_live_filter(char *dev, input_addr *hostip, unsigned int port, unsigned int count)
 {
     pcap_t *handle = NULL;         /* Session handle */
     char errbuf[PCAP_ERRBUF_SIZE]; /* Error string buffer */
     struct bpf_program fp;         /* The compiled filter */
-    char filter_exp[52];
-    sprintf(filter_exp,
-            "tcp and dst host %d.%d.%d.%d and dst port %u",
-            hostip->byte1,
-            hostip->byte2,
-            hostip->byte3,
-            hostip->byte4,
-            port);    /* The filter expression */
+    char filter_exp[80];
+    snprintf(filter_exp,
+             sizeof(filter_exp),
+             "tcp and dst host %d.%d.%d.%d and dst portrange %u-%u",
+             hostip->byte1,
+             hostip->byte2,
+             hostip->byte3,
+             hostip->byte4,
+             port,
+             port + count - 1); /* The filter expression */
     bpf_u_int32 mask; /* Our network mask */
     bpf_u_int32 net;  /* Our IP */
 
@@ -628,12 +1058,31 @@ set_live_filter(char *dev, input_addr *hostip, unsigned int port)
         mask = 0;
     }
 
+#ifdef HAVE_PCAP_SET_TSTAMP_PRECISION
+    /* ns receive time stamps, where the platform has them */
+    handle = pcap_create(dev, errbuf);
+    if (handle == NULL) {
+        fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
+        return handle;
+    }
+    pcap_set_snaplen(handle, BUFSIZ_PLUS);
+    pcap_set_promisc(handle, PROMISC_OFF);
+    pcap_set_timeout(handle, TIMEOUT_ms);
+    pcap_set_tstamp_precision(handle, PCAP_TSTAMP_PRECISION_NANO);
+    if (pcap_activate(handle) < 0) {
+        fprintf(stderr, "Couldn't open device %s: %s\n", dev, pcap_geterr(handle));
+        pcap_close(handle);
+        return NULL;
+    }
+    rx_nsec = pcap_get_tstamp_precision(handle) == PCAP_TSTAMP_PRECISION_NANO;
+#else
     /* Open the session in promiscuous mode */
     handle = pcap_open_live(dev, BUFSIZ_PLUS, PROMISC_OFF, TIMEOUT_ms, errbuf);
     if (handle == NULL) {
         fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
         return handle;
     }
+#endif
     /* Compile and apply the filter */
     if (pcap_compile(handle, &fp, filter_exp, 0, net) == -1) {
         fprintf(stderr, "Couldn't parse filter %s: %s\n", filter_exp, pcap_geterr(handle));
@@ -683,16 +1132,31 @@ set_offline_filter(char *file)
 }
 
 /**
- * This is the callback function for pcap_loop
- * This function is called every time we receive a remote packet
+ * Back up a session to the first local packet after the last correctly
+ * ACKed packet, to send it again
+ */
+static void
+session_rewind(struct tcp_session *s)
+{
+    s->index = s->acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
+    while (s->index < pkts_scheduled && !sched[s->index].local) {
+        s->index++;
+    }
+}
+
+/**
+ * This is the callback function for pcap_dispatch
+ * This function is called every time we receive a remote packet, the
+ * destination port tells us which session it belongs to
  */
 void
-got_packet(_U_ u_char *args, _U_ const struct pcap_pkthdr *header, const u_char *packet)
+got_packet(_U_ u_char *args, const struct pcap_pkthdr *header, const u_char *packet)
 {
+    struct tcp_session *s;
     tcp_hdr *tcphdr;
     ipv4_hdr *iphdr;
 
-    unsigned int size_ip, size_tcp, size_payload;
+    unsigned int size_ip, size_tcp, size_payload, port;
     unsigned int flags;
 
     /* Extract and examine received packet headers */
@@ -710,88 +1174,177 @@ got_packet(_U_ u_char *args, _U_ const struct pcap_pkthdr *header, const u_char
     }
     size_payload = ntohs(iphdr->ip_len) - (size_ip + (size_tcp));
 
+    port = ntohs(tcphdr->th_dport);
+    if (port < base_port || port - base_port >= nsessions)
+        return;
+
+    s = &sessions[port - base_port];
+    if (s->state != SESSION_RUNNING)
+        return;
+
     flags = tcphdr->th_flags;
-    /* Check correct SYN-ACK expectation, if so then proceed in fixing entire schedule from relative to absolute
-     * SEQs+ACKs */
-    if ((flags == (TH_SYN | TH_ACK)) && (sched_index == 1) &&
-        (tcphdr->th_ack == htonl(sched[sched_index - 1].curr_lseq + 1))) {
-        unsigned int j;
-        printf("Received Remote Packet...............	[%u]\n", sched_index + 1);
-        printf("Remote Packet Expectation met.\nProceeding in replay....\n");
-        // printf("SYN-ACKed Random SEQ set!\n");
-        initial_rseq = ntohl(tcphdr->th_seq);
-        // printf("initial_rseq: %u\n", initial_rseq);
-        /* After we receiving the first SYN-ACK, then adjust the entire sched to be absolute rather than relative #s*/
-        sched[1].exp_rseq = sched[1].exp_rseq + initial_rseq;
-        for (j = 2; j < pkts_scheduled;
-             j++) { /* Based on correctly receiving the random SEQ from the SYN-ACK packet, do the following:*/
-            if (sched[j].local) { /* Set local ACKs for entire sched to be absolute #s*/
-                sched[j].curr_lack = sched[j].curr_lack + initial_rseq;
-            } else if (sched[j].remote) { /* Set remote SEQs for entire sched to be absolute #s*/
-                sched[j].exp_rseq = sched[j].exp_rseq + initial_rseq;
-            }
-        }
-        sched_index++; /* Proceed in the schedule*/
+    /* Check correct SYN-ACK expectation, if so then the session knows the remote SEQ and proceeds */
+    if ((flags == (TH_SYN | TH_ACK)) && (s->index == 1) && (tcphdr->th_ack == htonl(session_lseq(s, 0) + 1))) {
+        session_printf("Received Remote Packet...............	[%u]\n", s->index + 1);
+        session_printf("Remote Packet Expectation met.\nProceeding in replay....\n");
+        session_measure(s, session_rx_ns(header), 0);
+        s->rseq = ntohl(tcphdr->th_seq);
+        s->index++; /* Proceed in the schedule*/
+        session_step(s);
         return;
     }
 
-    printf(">Received a Remote Packet\n");
-    printf(">>Checking Expectations\n");
+    session_printf(">Received a Remote Packet\n");
+    session_printf(">>Checking Expectations\n");
 
     /* Handle Remote Packet Loss */
-    if (sched[sched_index].exp_rack > ntohl(tcphdr->th_ack)) {
+    if (session_exp_rack(s, s->index) > ntohl(tcphdr->th_ack)) {
         // printf("Remote Packet Loss! Resending Lost packet\n");
-        sched_index = acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
-        // printf("ACKED Index = %d\n", acked_index);
-        while (!sched[sched_index].local) {
-            sched_index++;
-        }
+        session_rewind(s);
+        session_step(s);
         return;
     }
 
     /* Handle Local Packet Loss <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<COME BACK TO
        THIS<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<< */
-    else if ((sched[sched_index].exp_rseq < ntohl(tcphdr->th_seq)) && sched[sched_index].remote) {
+    else if ((session_exp_rseq(s, s->index) < ntohl(tcphdr->th_seq)) && sched[s->index].remote) {
         /* Resend immediate previous LOCAL packet */
-        printf("Local Packet Loss! Resending Lost packet >> DupACK Issued!\n");
-        sched_index = acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
-        /*sched[sched_index].sent_counter=0; Reset the re-transmission counter for this ACKed packet?*/
-        // printf("ACKED Index = %d\n", acked_index);
-        while (!sched[sched_index].local) {
-            sched_index++;
-        }
+        session_printf("Local Packet Loss! Resending Lost packet >> DupACK Issued!\n");
+        session_rewind(s);
+        session_step(s);
         return;
     }
 
     /* No Packet Loss... Proceed Normally (if expectations are met!) */
-    else if ((tcphdr->th_seq == htonl(sched[sched_index].exp_rseq)) &&
-             (tcphdr->th_ack == htonl(sched[sched_index].exp_rack))) {
-        printf("Received Remote Packet...............	[%d]\n", sched_index + 1);
+    else if ((tcphdr->th_seq == htonl(session_exp_rseq(s, s->index))) &&
+             (tcphdr->th_ack == htonl(session_exp_rack(s, s->index)))) {
+        session_printf("Received Remote Packet...............	[%d]\n", s->index + 1);
         /* Handles differing payload size and does not trigger on unnecessary ACK + window update issues*/
-        if ((sched[sched_index].size_payload != size_payload) && (size_payload != 0)) {
-            printf("Payload size of received packet does not meet expectations\n");
+        if ((sched[s->index].size_payload != size_payload) && (size_payload != 0)) {
+            session_printf("Payload size of received packet does not meet expectations\n");
             /* Resent last local packet, maybe remote host behaves this time*/
-            different_payload = true;
-            /* Set global variable of where differing payload size is not meeting expectations*/
-            diff_payload_index = sched_index;
+            s->different_payload = true;
+            /* Keep track of where differing payload size is not meeting expectations*/
+            s->diff_payload_index = s->index;
 
             /*Treat this as packet loss, and attempt resetting index to resend packets where*/
             /* packets were received matching expectation*/
-            sched_index = acked_index; /* Reset the schedule index back to the last correctly ACKed packet */
-            // printf("ACKED Index = %d\n", acked_index);
-            while (!sched[sched_index].local) {
-                sched_index++;
-            }
+            session_rewind(s);
+            session_step(s);
             return;
         }
-        printf("Remote Packet Expectation met.\nProceeding in replay....\n");
-        sched_index++;
-        acked_index = sched_index; /*Keep track correctly ACKed packet index*/
+        session_printf("Remote Packet Expectation met.\nProceeding in replay....\n");
+        session_measure(s, session_rx_ns(header), size_payload);
+        s->index++;
+        s->acked_index = s->index; /*Keep track correctly ACKed packet index*/
+    }
+
+    /* keep tack of last received packet info */
+    s->have_rprev = true;
+    s->rprev_seq = tcphdr->th_seq;
+    s->rprev_ack = tcphdr->th_ack;
+    s->rprev_flags = tcphdr->th_flags;
+    s->size_payload_prev = size_payload;
+
+    session_step(s);
+}
+
+/**
+ * Local packets of a session sent more than once, counting every resend
+ */
+static unsigned int
+session_retransmissions(const struct tcp_session *s)
+{
+    unsigned int j, cnt = 0;
+
+    for (j = 0; j < pkts_scheduled; j++) {
+        if (s->sent_counter[j] > 1)
+            cnt += s->sent_counter[j] - 1;
     }
 
-    /* Global variable to keep tack of last received packet info */
-    tcphdr_rprev = tcphdr;
-    size_payload_prev = size_payload;
+    return cnt;
+}
+
+/**
+ * Add the response times to the summary printed at exit
+ */
+static void
+liveplay_stats_print(void)
+{
+    char buf[256];
+
+    tcpr_hist_summary(&live_stats.rtt, buf, sizeof(buf));
+    printf("- Round Trip Time:     %s\n", buf);
+    tcpr_hist_summary(&live_stats.think, buf, sizeof(buf));
+    printf("- Server Think Time:   %s\n", buf);
+    if (nsessions > 1) {
+        tcpr_hist_summary(&live_stats.complete, buf, sizeof(buf));
+        printf("- Time to Complete:    %s\n", buf);
+    } else if (sessions[0].start_ns != 0) {
+        printf("- Time to Complete:    %.6f sec\n", (double)(sessions[0].end_ns - sessions[0].start_ns) / 1000000000.0);
+    }
+}
+
+static void
+liveplay_stats_hist(FILE *f, const char *name, const tcpr_hist_t *h)
+{
+    fprintf(f,
+            ",\"%s\":{\"count\":" COUNTER_SPEC ",\"sum_ns\":%llu,\"max_ns\":%llu,\"p50_ns\":%llu,"
+            "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}",
+            name,
+            h->count,
+            (unsigned long long)h->sum,
+            (unsigned long long)h->max,
+            (unsigned long long)tcpr_hist_percentile(h, 50.0),
+            (unsigned long long)tcpr_hist_percentile(h, 90.0),
+            (unsigned long long)tcpr_hist_percentile(h, 99.0),
+            (unsigned long long)tcpr_hist_percentile(h, 99.9));
+}
+
+/**
+ * Write the response time histograms and the totals of every session to
+ * path for --stats-file, in the layout of the tcpreplay /json exporter
+ */
+static void
+liveplay_stats_write(const char *path)
+{
+    FILE *f;
+    unsigned int k;
+
+    if ((f = fopen(path, "w")) == NULL) {
+        warnx("Unable to write %s: %s", path, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "{\"sessions\":%u", nsessions);
+    liveplay_stats_hist(f, "rtt", &live_stats.rtt);
+    liveplay_stats_hist(f, "think", &live_stats.think);
+    liveplay_stats_hist(f, "complete", &live_stats.complete);
+
+    fprintf(f, ",\"session_totals\":[");
+    for (k = 0; k < nsessions; k++) {
+        const struct tcp_session *s = &sessions[k];
+
+        fprintf(f,
+                "%s{\"port\":%u,\"state\":\"%s\",\"time_ns\":%llu,\"packets\":%u,\"retransmissions\":%u,"
+                "\"rtt_count\":" COUNTER_SPEC ",\"rtt_sum_ns\":%llu,\"rtt_min_ns\":%llu,"
+                "\"exchanges\":" COUNTER_SPEC ",\"think_sum_ns\":%llu}",
+                k ? "," : "",
+                s->port,
+                session_state_names[s->state],
+                (unsigned long long)(s->start_ns ? s->end_ns - s->start_ns : 0),
+                s->index,
+                session_retransmissions(s),
+                s->rtt_cnt,
+                (unsigned long long)s->rtt_sum,
+                (unsigned long long)s->rtt_min,
+                s->think_cnt,
+                (unsigned long long)s->think_sum);
+    }
+    fprintf(f, "]}\n");
+
+    if (fclose(f) != 0)
+        warnx("Unable to write %s: %s", path, strerror(errno));
 }
 
 /**
@@ -1138,16 +1691,16 @@ do_checksum_liveplay(u_int8_t *data, int proto, int len)
          * length is 2x a single IP
          */
 
-        sum = do_checksum_math_liveplay((u_int16_t *)&ipv4->ip_src, 8);
+        sum = tcpr_csum_partial(&ipv4->ip_src, 8, 0);
 
         sum += ntohs(IPPROTO_TCP + len);
-        sum += do_checksum_math_liveplay((u_int16_t *)tcp, len);
+        sum += tcpr_csum_partial(tcp, len, 0);
         tcp->th_sum = CHECKSUM_CARRY(sum);
         break;
 
     case IPPROTO_IP:
         ipv4->ip_sum = 0;
-        sum = do_checksum_math_liveplay((u_int16_t *)data, ip_hl);
+        sum = tcpr_csum_partial(data, ip_hl, 0);
         ipv4->ip_sum = CHECKSUM_CARRY(sum);
         break;
 
@@ -1158,29 +1711,3 @@ do_checksum_liveplay(u_int8_t *data, int proto, int len)
 
     return TCPEDIT_OK;
 }
-
-/**
- * code to do a ones-compliment checksum
- */
-int
-do_checksum_math_liveplay(u_int16_t *data, int len)
-{
-    int sum = 0;
-    union {
-        u_int16_t s;
-        u_int8_t b[2];
-    } pad;
-
-    while (len > 1) {
-        sum += *data++;
-        len -= 2;
-    }
-
-    if (len == 1) {
-        pad.b[0] = *(u_int8_t *)data;
-        pad.b[1] = 0;
-        sum += pad.s;
-    }
-
-    return (sum);
-}
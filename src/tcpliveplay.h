@@ -12,16 +12,19 @@
 
 #include "defines.h"
 #include "config.h"
+#include "lib/queue.h"
+#include "common/histogram.h"
 
 #define SIZE_ETHERNET 14
 #define LOCAL_IP_MATCH 1
 #define REMOTE_IP_MATCH 2
 #define NO_MATCH 0
 #define PCAP_OPEN_ERROR (-1)
-#define TIMEOUT_ms 10000
+#define TIMEOUT_ms 1 /* libpcap read timeout, don't let packets sit in the RX ring */
 #define PROMISC_OFF 0
 #define BUFSIZ_PLUS BUFSIZ
 #define ALARM_TIMEOUT 10
+#define MAX_SENDS 3 /* attempts at sending a local packet before giving up */
 #define SUCCESS 1
 #define ERROR (-1)
 
@@ -134,7 +137,58 @@ struct tcp_sched {
     unsigned int size_ip;           /* Keep track of each packet's IP Size */
     unsigned int size_tcp;          /* Keep track of each packet's TCP Size */
     unsigned int size_payload;      /* Keep tack of each packet's Payload size, if any */
-    unsigned int sent_counter;      /* Keep track of each packet's sent attempts*/
+    u_int32_t csum_partial;         /* TCP checksum sum without the port, SEQ & ACK sessions set */
     bool remote;                    /* Flag to signify this is a remote packet */
     bool local;                     /* Flag to signify this is a local packet */
 };
+
+/* how a session ended */
+typedef enum {
+    SESSION_RUNNING = 0,
+    SESSION_DONE,       /* whole schedule replayed */
+    SESSION_TIMEOUT,    /* remote host stopped responding */
+    SESSION_RESET,      /* remote host sent a RST */
+    SESSION_RETRANSMIT, /* MAX_SENDS attempts at a local packet */
+} session_state_t;
+
+/*
+ * One replay of the schedule over its own local port.  The schedule holds
+ * SEQ/ACK numbers relative to the ISNs, each session adds its own.
+ */
+struct tcp_session {
+    TAILQ_ENTRY(tcp_session) timer; /* position in the timeout queue */
+    bool timer_set;
+    u_int64_t deadline;             /* give up on the remote host at this time (ns) */
+    session_state_t state;
+    u_int16_t port;                 /* local port */
+    u_int32_t lseq;                 /* random local ISN */
+    u_int32_t rseq;                 /* remote ISN, from the SYN-ACK */
+    unsigned int index;             /* position in the schedule */
+    unsigned int acked_index;       /* last schedule index correctly ACKed */
+    unsigned int diff_payload_index;
+    bool different_payload;
+    bool have_rprev;                /* last remote tcp header, network byte order */
+    u_int32_t rprev_seq;
+    u_int32_t rprev_ack;
+    u_int8_t rprev_flags;
+    unsigned int size_payload_prev;
+    u_char *sent_counter;           /* send attempts of each schedule entry */
+    /* response times (ns, tcpr_clock_ns() clock), see session_measure() */
+    u_int64_t start_ns;             /* SYN went out */
+    u_int64_t end_ns;               /* done or given up */
+    u_int64_t tx_ns;                /* last local packet went out */
+    bool rtt_due;                   /* the next bare remote ACK is an RTT sample */
+    bool think_due;                 /* the next remote data is a response to our data */
+    u_int64_t rtt_min;
+    COUNTER rtt_cnt;
+    u_int64_t rtt_sum;
+    COUNTER think_cnt;              /* exchanges: our data answered by theirs */
+    u_int64_t think_sum;
+};
+
+/* the response time histograms of all sessions */
+typedef struct {
+    tcpr_hist_t rtt;      /* local packet to bare remote ACK */
+    tcpr_hist_t think;    /* local data to remote data, less the RTT */
+    tcpr_hist_t complete; /* SYN to end of schedule, completed sessions only */
+} liveplay_stats_t;
@@ -31,14 +31,17 @@
  *  - Auto learning of CIDR block for servers (clients all other)
  */
 
+#define TCPR_MEM_SUBSYS TCPR_MEM_TCPPREP /* see memstat.h */
+
 #include "defines.h"
 #include "config.h"
 #include "common.h"
 #include "tcpprep_api.h"
+#include "tcpprep_append.h"
+#include "tcpprep_classify.h"
 #include "tcpprep_opts.h"
 #include "tree.h"
 #include <errno.h>
-#include <regex.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -51,18 +54,12 @@
 int debug = 0;
 #endif
 
-tcpprep_t *tcpprep;
 int info = 0;
 char *cidr = NULL;
-tcpr_data_tree_t treeroot;
 
 void print_comment(const char *);
 void print_info(const char *);
 void print_stats(const char *);
-static int check_ipv4_regex(unsigned long ip);
-static int check_ipv6_regex(const struct tcpr_in6_addr *addr);
-static COUNTER process_raw_packets(pcap_t *pcap);
-static int check_dst_port(ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr, int len);
 
 /*
  *  main()
@@ -71,7 +68,7 @@ int
 main(int argc, char *argv[])
 {
     int out_file;
-    COUNTER totpackets;
+    COUNTER totpackets, cached = 0;
     char errbuf[PCAP_ERRBUF_SIZE];
     tcpprep_opt_t *options;
 
@@ -81,17 +78,25 @@ main(int argc, char *argv[])
     optionProcess(&tcpprepOptions, argc, argv);
     tcpprep_post_args(tcpprep, argc, argv);
 
-    /* open the cache file */
+    /* open the cache file, --append keeps what is there */
     if ((out_file = open(OPT_ARG(CACHEFILE),
-                         O_WRONLY | O_CREAT | O_TRUNC,
+                         HAVE_OPT(APPEND) ? O_RDWR | O_CREAT : O_WRONLY | O_CREAT | O_TRUNC,
                          S_IREAD | S_IWRITE | S_IRGRP | S_IWGRP | S_IROTH)) == -1) {
         tcpprep_close(tcpprep);
         errx(-1, "Unable to open cache file %s for writing: %s", OPT_ARG(CACHEFILE), strerror(errno));
     }
 
+    if (HAVE_OPT(APPEND)) {
+        options->append = tcpprep_append_open(options, OPT_ARG(CACHEFILE), out_file, OPT_ARG(PCAP));
+        cached = options->append->packets;
+    }
+
+    /* each of the --threads opens the file again */
+    tcpprep->pcapfile = safe_strdup(OPT_ARG(PCAP));
+
 readpcap:
     /* open the pcap file */
-    if ((options->pcap = pcap_open_offline(OPT_ARG(PCAP), errbuf)) == NULL) {
+    if ((options->pcap = tcpr_pcap_open_offline(OPT_ARG(PCAP), errbuf)) == NULL) {
         close(out_file);
         tcpprep_close(tcpprep);
         errx(-1, "Error opening libpcap: %s", errbuf);
@@ -142,7 +147,29 @@ readpcap:
         pcap_freecode(&options->bpf.program);
     }
 
-    if ((totpackets = process_raw_packets(options->pcap)) == 0) {
+    /* only the packets after those already cached */
+    if (options->append != NULL)
+        tcpprep_append_start(options->append, options->pcap, OPT_ARG(PCAP));
+
+    /* the final pass writes the cache to the file as packets are classified */
+    options->cache_fd = out_file;
+    if (options->mode != AUTO_MODE && options->cache_stream < 0)
+        options->cache_stream = start_cache_stream(out_file, options->comment, options->pairs, options->shards);
+
+    if ((totpackets = tcpprep_process_packets(options->pcap)) == 0) {
+        if (cached > 0) {
+            if (info)
+                notice("No new packets, the cache still holds " COUNTER_SPEC " packets.\n", cached);
+
+            pcap_close(options->pcap);
+            options->pcap = NULL;
+            close(out_file);
+            tcpprep_append_free(options->append);
+            tree_free(&treeroot);
+            tcpprep_close(tcpprep);
+            return 0;
+        }
+
         close(out_file);
         tcpprep_close(tcpprep);
         err(-1, "No packets were processed.  Filter too limiting?");
@@ -157,29 +184,25 @@ readpcap:
 
     /* we need to process the pcap file twice in HASH/AUTO mode */
     if (options->mode == AUTO_MODE) {
-        options->mode = options->automode;
-        if (options->mode == ROUTER_MODE) { /* do we need to convert TREE->CIDR? */
-            if (info)
-                notice("Building network list from pre-cache...\n");
-            if (!process_tree()) {
-                err(-1, "Error: unable to build a valid list of servers. Aborting.");
-            }
-        } else {
-            /*
-             * in bridge mode we need to calculate client/sever
-             * manually since this is done automatically in
-             * process_tree()
-             */
-            tree_calculate(&treeroot);
-        }
+        if (info && options->automode == ROUTER_MODE)
+            notice("Building network list from pre-cache...\n");
+
+        /* the next --append carries on learning from here */
+        if (options->append != NULL)
+            tcpprep_append_hosts(options->append, &treeroot);
+
+        /* in single pass mode this builds the cache too */
+        tcpprep_auto_done();
 
         if (info)
             notice("Building cache file...\n");
+
         /*
          * re-process files, but this time generate
          * cache
          */
-        goto readpcap;
+        if (!options->single_pass)
+            goto readpcap;
     }
 #ifdef DEBUG
     if (debug && (options->cidrdata != NULL))
@@ -187,381 +210,43 @@ readpcap:
 #endif
 
     /* write cache data */
-    totpackets = write_cache(options->cachedata, out_file, totpackets, options->comment);
+    if (options->cache_stream >= 0) {
+        totpackets = finish_cache_stream(out_file,
+                                         options->cache_stream,
+                                         cached + totpackets,
+                                         options->pairdata,
+                                         options->pairs,
+                                         options->sharddata,
+                                         options->shards);
+    } else {
+        totpackets = write_cache(options->cachedata,
+                                 out_file,
+                                 totpackets,
+                                 options->comment,
+                                 options->pairdata,
+                                 options->pairs,
+                                 options->sharddata,
+                                 options->shards);
+    }
     if (info)
         notice("Done.\nCached " COUNTER_SPEC " packets.\n", totpackets);
 
     /* close cache file */
     close(out_file);
 
+    if (options->append != NULL) {
+        tcpprep_append_done(options->append, options, OPT_ARG(PCAP), totpackets);
+        tcpprep_append_free(options->append);
+        options->append = NULL;
+    }
+
+    tree_free(&treeroot);
     tcpprep_close(tcpprep);
 
     restore_stdin();
     return 0;
 }
 
-/**
- * checks the dst port to see if this is destined for a server port.
- * returns 1 for true, 0 for false
- */
-static int
-check_dst_port(ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr, int len)
-{
-    tcp_hdr_t *tcp_hdr = NULL;
-    udp_hdr_t *udp_hdr = NULL;
-    tcpprep_opt_t *options = tcpprep->options;
-    uint8_t proto;
-    u_char *l4;
-
-    if (ip_hdr) {
-        if (len < ((ip_hdr->ip_hl * 4) + 4))
-            return 0; /* not enough data in the packet to know */
-
-        proto = ip_hdr->ip_p;
-        l4 = get_layer4_v4(ip_hdr, (u_char *)ip_hdr + len);
-    } else if (ip6_hdr) {
-        if (len < (TCPR_IPV6_H + 4))
-            return 0; /* not enough data in the packet to know */
-
-        proto = get_ipv6_l4proto(ip6_hdr, (u_char *)ip6_hdr + len);
-        dbgx(3, "Our layer4 proto is 0x%hhu", proto);
-        if ((l4 = get_layer4_v6(ip6_hdr, (u_char *)ip6_hdr + len)) == NULL)
-            return 0;
-
-        dbgx(3,
-             "Found proto %u at offset %p.  base %p (%p)",
-             proto,
-             (void *)l4,
-             (void *)ip6_hdr,
-             (void *)(l4 - (u_char *)ip6_hdr));
-    } else {
-        assert(0);
-    }
-
-    dbg(3, "Checking the destination port...");
-
-    switch (proto) {
-    case IPPROTO_TCP:
-        tcp_hdr = (tcp_hdr_t *)l4;
-
-        /* is a service? */
-        if (options->services.tcp[ntohs(tcp_hdr->th_dport)]) {
-            dbgx(1, "TCP packet is destined for a server port: %d", ntohs(tcp_hdr->th_dport));
-            return 1;
-        }
-
-        /* nope */
-        dbgx(1, "TCP packet is NOT destined for a server port: %d", ntohs(tcp_hdr->th_dport));
-        return 0;
-
-    case IPPROTO_UDP:
-        udp_hdr = (udp_hdr_t *)l4;
-
-        /* is a service? */
-        if (options->services.udp[ntohs(udp_hdr->uh_dport)]) {
-            dbgx(1, "UDP packet is destined for a server port: %d", ntohs(udp_hdr->uh_dport));
-            return 1;
-        }
-
-        /* nope */
-        dbgx(1, "UDP packet is NOT destined for a server port: %d", ntohs(udp_hdr->uh_dport));
-        return 0;
-
-    default:
-        /* not a TCP or UDP packet... return as non_ip */
-        dbg(1, "Packet isn't a UDP or TCP packet... no port to process.");
-        return options->nonip;
-    }
-}
-
-/**
- * checks to see if an ip address matches a regex.  Returns 1 for true
- * 0 for false
- */
-static int
-check_ipv4_regex(const unsigned long ip)
-{
-    int eflags = 0;
-    u_char src_ip[16];
-    size_t nmatch = 0;
-    tcpprep_opt_t *options = tcpprep->options;
-
-    memset(src_ip, '\0', sizeof(src_ip));
-    strlcpy((char *)src_ip, (char *)get_addr2name4(ip, RESOLVE), sizeof(src_ip));
-    if (regexec(&options->preg, (char *)src_ip, nmatch, NULL, eflags) == 0) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
-
-static int
-check_ipv6_regex(const struct tcpr_in6_addr *addr)
-{
-    int eflags = 0;
-    u_char src_ip[INET6_ADDRSTRLEN];
-    size_t nmatch = 0;
-    tcpprep_opt_t *options = tcpprep->options;
-
-    memset(src_ip, '\0', sizeof(src_ip));
-    strlcpy((char *)src_ip, (char *)get_addr2name6(addr, RESOLVE), sizeof(src_ip));
-    if (regexec(&options->preg, (char *)src_ip, nmatch, NULL, eflags) == 0) {
-        return 1;
-    } else {
-        return 0;
-    }
-}
-
-/**
- * uses libpcap library to parse the packets and build
- * the cache file.
- */
-static COUNTER
-process_raw_packets(pcap_t *pcap)
-{
-    struct pcap_pkthdr pkthdr;
-    const u_char *pktdata = NULL;
-    COUNTER packetnum = 0;
-    int l2len;
-    u_char *ipbuff, *buffptr;
-    tcpr_dir_t direction = TCPR_DIR_ERROR;
-    tcpprep_opt_t *options = tcpprep->options;
-
-    assert(pcap);
-
-    ipbuff = safe_malloc(MAXPACKET);
-
-    while ((pktdata = safe_pcap_next(pcap, &pkthdr)) != NULL) {
-        ipv4_hdr_t *ip_hdr = NULL;
-        ipv6_hdr_t *ip6_hdr = NULL;
-        eth_hdr_t *eth_hdr = NULL;
-
-        packetnum++;
-
-        dbgx(1, "Packet " COUNTER_SPEC, packetnum);
-
-        /* look for include or exclude LIST match */
-        if (options->xX.list != NULL) {
-            if (options->xX.mode < xXExclude) {
-                /* include list */
-                if (!check_list(options->xX.list, packetnum)) {
-                    add_cache(&(options->cachedata), DONT_SEND, 0);
-                    continue;
-                }
-            }
-            /* exclude list */
-            else if (check_list(options->xX.list, packetnum)) {
-                add_cache(&(options->cachedata), DONT_SEND, 0);
-                continue;
-            }
-        }
-
-        /*
-         * If the packet doesn't include an IPv4 header we should just treat
-         * it as a non-IP packet, UNLESS we're in MAC mode, in which case
-         * we should let the MAC matcher below handle it
-         */
-        if (options->mode != MAC_MODE) {
-            dbg(3, "Looking for IPv4/v6 header in non-MAC mode");
-
-            /* get the IP header (if any) */
-            buffptr = ipbuff;
-
-            /* first look for IPv4 */
-            if ((ip_hdr = (ipv4_hdr_t *)get_ipv4(pktdata, (int)pkthdr.caplen, pcap_datalink(pcap), &buffptr)) != NULL) {
-                dbg(2, "Packet is IPv4");
-            } else if ((ip6_hdr = (ipv6_hdr_t *)get_ipv6(pktdata, (int)pkthdr.caplen, pcap_datalink(pcap), &buffptr)) !=
-                       NULL) {
-                /* IPv6 */
-                dbg(2, "Packet is IPv6");
-            } else {
-                /* we're something else... */
-                dbg(2, "Packet isn't IPv4/v6");
-
-                /* we don't want to cache these packets twice */
-                if (options->mode != AUTO_MODE) {
-                    dbg(3, "Adding to cache using options for Non-IP packets");
-                    add_cache(&options->cachedata, SEND, options->nonip);
-                }
-
-                /* go to next packet */
-                continue;
-            }
-
-            l2len = get_l2len(pktdata, (int)pkthdr.caplen, pcap_datalink(pcap));
-            if (l2len < 0) {
-                /* go to next packet */
-                continue;
-            }
-
-            /* look for include or exclude CIDR match */
-            if (options->xX.cidr != NULL) {
-                if (ip_hdr) {
-                    if (!process_xX_by_cidr_ipv4(options->xX.mode, options->xX.cidr, ip_hdr)) {
-                        add_cache(&options->cachedata, DONT_SEND, 0);
-                        continue;
-                    }
-                } else if (ip6_hdr) {
-                    if (!process_xX_by_cidr_ipv6(options->xX.mode, options->xX.cidr, ip6_hdr)) {
-                        add_cache(&options->cachedata, DONT_SEND, 0);
-                        continue;
-                    }
-                }
-            }
-        }
-
-        switch (options->mode) {
-        case REGEX_MODE:
-            dbg(2, "processing regex mode...");
-            if (ip_hdr) {
-                direction = check_ipv4_regex(ip_hdr->ip_src.s_addr);
-            } else if (ip6_hdr) {
-                direction = check_ipv6_regex(&ip6_hdr->ip_src);
-            }
-
-            /* reverse direction? */
-            if (HAVE_OPT(REVERSE) && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
-                direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
-
-            add_cache(&options->cachedata, SEND, direction);
-            break;
-
-        case CIDR_MODE:
-            dbg(2, "processing cidr mode...");
-            if (ip_hdr) {
-                direction = check_ip_cidr(options->cidrdata, ip_hdr->ip_src.s_addr) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
-            } else if (ip6_hdr) {
-                direction = check_ip6_cidr(options->cidrdata, &ip6_hdr->ip_src) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
-            }
-
-            /* reverse direction? */
-            if (HAVE_OPT(REVERSE) && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
-                direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
-
-            add_cache(&options->cachedata, SEND, direction);
-            break;
-
-        case MAC_MODE:
-            dbg(2, "processing mac mode...");
-            if (pkthdr.caplen < sizeof(*eth_hdr)) {
-                dbg(2, "capture length too short for mac mode processing");
-                break;
-            }
-
-            eth_hdr = (eth_hdr_t *)pktdata;
-            direction = macinstring(options->maclist, (u_char *)eth_hdr->ether_shost);
-
-            /* reverse direction? */
-            if (HAVE_OPT(REVERSE) && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
-                direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
-
-            add_cache(&options->cachedata, SEND, direction);
-            break;
-
-        case AUTO_MODE:
-            dbg(2, "processing first pass of auto mode...");
-            /* first run through in auto mode: create tree */
-            if (options->automode != FIRST_MODE) {
-                if (ip_hdr) {
-                    add_tree_ipv4(ip_hdr->ip_src.s_addr, pktdata, (int)pkthdr.caplen, pcap_datalink(pcap));
-                } else if (ip6_hdr) {
-                    add_tree_ipv6(&ip6_hdr->ip_src, pktdata, (int)pkthdr.caplen, pcap_datalink(pcap));
-                }
-            } else {
-                if (ip_hdr) {
-                    add_tree_first_ipv4(pktdata, (int)pkthdr.caplen, pcap_datalink(pcap));
-                } else if (ip6_hdr) {
-                    add_tree_first_ipv6(pktdata, (int)pkthdr.caplen, pcap_datalink(pcap));
-                }
-            }
-            break;
-
-        case ROUTER_MODE:
-            /*
-             * second run through in auto mode: create route
-             * based cache
-             */
-            dbg(2, "processing second pass of auto: router mode...");
-            if (ip_hdr) {
-                add_cache(&options->cachedata, SEND, check_ip_tree(options->nonip, ip_hdr->ip_src.s_addr));
-            } else {
-                add_cache(&options->cachedata, SEND, check_ip6_tree(options->nonip, &ip6_hdr->ip_src));
-            }
-            break;
-
-        case BRIDGE_MODE:
-            /*
-             * second run through in auto mode: create bridge
-             * based cache
-             */
-            dbg(2, "processing second pass of auto: bridge mode...");
-            if (ip_hdr) {
-                add_cache(&options->cachedata, SEND, check_ip_tree(DIR_UNKNOWN, ip_hdr->ip_src.s_addr));
-            } else {
-                add_cache(&options->cachedata, SEND, check_ip6_tree(DIR_UNKNOWN, &ip6_hdr->ip_src));
-            }
-            break;
-
-        case SERVER_MODE:
-            /*
-             * second run through in auto mode: create bridge
-             * where unknowns are servers
-             */
-            dbg(2, "processing second pass of auto: server mode...");
-            if (ip_hdr) {
-                add_cache(&options->cachedata, SEND, check_ip_tree(DIR_SERVER, ip_hdr->ip_src.s_addr));
-            } else {
-                add_cache(&options->cachedata, SEND, check_ip6_tree(DIR_SERVER, &ip6_hdr->ip_src));
-            }
-            break;
-
-        case CLIENT_MODE:
-            /*
-             * second run through in auto mode: create bridge
-             * where unknowns are clients
-             */
-            dbg(2, "processing second pass of auto: client mode...");
-            if (ip_hdr) {
-                add_cache(&options->cachedata, SEND, check_ip_tree(DIR_CLIENT, ip_hdr->ip_src.s_addr));
-            } else {
-                add_cache(&options->cachedata, SEND, check_ip6_tree(DIR_CLIENT, &ip6_hdr->ip_src));
-            }
-            break;
-
-        case PORT_MODE:
-            /*
-             * process ports based on their destination port
-             */
-            dbg(2, "processing port mode...");
-            add_cache(&options->cachedata, SEND, check_dst_port(ip_hdr, ip6_hdr, (int)pkthdr.caplen - l2len));
-            break;
-
-        case FIRST_MODE:
-            /*
-             * First packet mode, looks at each host and picks clients
-             * by the ones which send the first packet in a session
-             */
-            dbg(2, "processing second pass of auto: first packet mode...");
-            if (ip_hdr) {
-                add_cache(&options->cachedata, SEND, check_ip_tree(DIR_UNKNOWN, ip_hdr->ip_src.s_addr));
-            } else {
-                add_cache(&options->cachedata, SEND, check_ip6_tree(DIR_UNKNOWN, &ip6_hdr->ip_src));
-            }
-            break;
-
-        default:
-            errx(-1, "Whoops!  What mode are we in anyways? %d", options->mode);
-        }
-#ifdef ENABLE_VERBOSE
-        if (options->verbose)
-            tcpdump_print(&tcpprep->tcpdump, &pkthdr, pktdata);
-#endif
-    }
-
-    safe_free(ipbuff);
-
-    return packetnum;
-}
 
 /**
  * print the tcpprep cache file comment
@@ -18,17 +18,23 @@
  *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define TCPR_MEM_SUBSYS TCPR_MEM_TCPPREP /* see memstat.h */
+
 #include "tcpprep_api.h"
 #include "config.h"
 #include "common.h"
-#include "tcpprep_opts.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef TCPPREP
+/* tcprewrite has the context without the options of tcpprep */
+#include "tcpprep_opts.h"
+
 extern void print_comment(const char *);
 extern void print_info(const char *);
 extern void print_stats(const char *);
+#endif
 
 /**
  * \brief Initialize a new tcpprep context
@@ -46,6 +52,14 @@ tcpprep_init()
     ctx->options = safe_malloc(sizeof(tcpprep_opt_t));
 
     ctx->options->bpf.optimize = BPF_OPTIMIZE;
+    ctx->options->cache_fd = -1;
+    ctx->options->cache_stream = -1;
+    ctx->options->min_mask = DEFAULT_MIN_MASK;
+    ctx->options->max_mask = DEFAULT_MAX_MASK;
+    ctx->options->ratio = DEFAULT_RATIO;
+    ctx->options->pairs = 1;
+    ctx->options->threads = 1;
+    ctx->options->thread_chunk = DEFAULT_THREAD_CHUNK;
 
     for (i = DEFAULT_LOW_SERVER_PORT; i <= DEFAULT_HIGH_SERVER_PORT; i++) {
         ctx->options->services.tcp[i] = 1;
@@ -76,6 +90,12 @@ tcpprep_close(tcpprep_t *ctx)
 #endif
     safe_free(options->comment);
     safe_free(options->maclist);
+    macset_free(options->macset);
+    safe_free(options->pairdata);
+    safe_free(options->sharddata);
+    safe_free(options->deferred);
+    if (options->index != NULL)
+        pcap_index_free(options->index);
 
     cache = options->cachedata;
     while (cache != NULL) {
@@ -98,6 +118,7 @@ tcpprep_close(tcpprep_t *ctx)
     safe_free(ctx);
 }
 
+#ifdef TCPPREP
 /**
  * \brief When using AutoOpts, call to do post argument processing
  * Used to process the autoopts arguments
@@ -196,6 +217,35 @@ tcpprep_post_args(tcpprep_t *ctx, int argc, char *argv[])
              ctx->options->min_mask,
              ctx->options->max_mask);
 
+    ctx->options->pairs = OPT_VALUE_PAIRS;
+
+    if (HAVE_OPT(SHARDS))
+        ctx->options->shards = OPT_VALUE_SHARDS;
+
+    if (HAVE_OPT(SINGLE_PASS))
+        ctx->options->single_pass = true;
+
+    ctx->options->threads = 1;
+#ifdef HAVE_PTHREAD
+    /* chunks are numbered from the start of the file */
+    if (HAVE_OPT(THREADS) && !HAVE_OPT(APPEND))
+        ctx->options->threads = OPT_VALUE_THREADS;
+    ctx->options->thread_chunk = OPT_VALUE_THREAD_CHUNK;
+#endif
+
+    /* the cache is extended in place, and packets are found by their offset in the pcap */
+    if (HAVE_OPT(APPEND)) {
+        if (ctx->options->pairs > 1 || ctx->options->shards > 0)
+            err(-1, "--append doesn't support --pairs or --shards");
+
+        if (ctx->options->bpf.filter != NULL)
+            err(-1, "--append doesn't support BPF filters");
+
+        if (strcmp(OPT_ARG(PCAP), "-") == 0 || remote_is_url(OPT_ARG(PCAP)) ||
+            decompress_detect(OPT_ARG(PCAP)) != DECOMPRESS_NONE)
+            errx(-1, "--append needs an uncompressed pcap file, not %s", OPT_ARG(PCAP));
+    }
+
     ctx->options->ratio = strtod(OPT_ARG(RATIO), &endptr);
     if (endptr == OPT_ARG(RATIO))
         err(-1, "Ratio supplied is not a number.");
@@ -203,5 +253,9 @@ tcpprep_post_args(tcpprep_t *ctx, int argc, char *argv[])
     if (ctx->options->ratio < 0)
         err(-1, "Ratio must be a non-negative number.");
 
+    if (HAVE_OPT(REVERSE))
+        ctx->options->reverse = true;
+
     return 0;
 }
+#endif /* TCPPREP */
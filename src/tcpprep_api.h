@@ -32,6 +32,12 @@ extern "C" {
 /* default ports used for servers */
 #define DEFAULT_LOW_SERVER_PORT 0
 #define DEFAULT_HIGH_SERVER_PORT 1023
+/* --minmask, --maxmask and --ratio unless they are given */
+#define DEFAULT_MIN_MASK 30
+#define DEFAULT_MAX_MASK 8
+#define DEFAULT_RATIO 2.0
+/* --thread-chunk: don't bother splitting files into chunks of fewer packets */
+#define DEFAULT_THREAD_CHUNK 10000
 #define MYARGS_LEN 1024
 
 typedef struct tcpprep_opt_s {
@@ -43,6 +49,7 @@ typedef struct tcpprep_opt_s {
     tcpr_cache_t *cachedata;
     tcpr_cidr_t *cidrdata;
     char *maclist;
+    tcpr_macset_t *macset; /* maclist, parsed */
     tcpr_xX_t xX;
     tcpr_bpf_t bpf;
     tcpr_services_t services;
@@ -54,7 +61,23 @@ typedef struct tcpprep_opt_s {
     int max_mask;
     double ratio;
     regex_t preg;
+    bool reverse;            /* --mac, --regex and --cidr match clients */
     bool nonip;
+    int pairs;               /* interface pairs to spread flows over */
+    u_char *pairdata;        /* interface pair of each packet */
+    int shards;              /* shards to spread flows over, 0 for no shard map */
+    u_char *sharddata;       /* shard of each packet */
+    COUNTER pairdata_len;    /* bytes allocated in pairdata and sharddata */
+    bool single_pass;        /* auto mode without a second read of the pcap */
+    u_int32_t *deferred;     /* single pass: how to cache each packet */
+    COUNTER deferred_cnt;
+    COUNTER deferred_max;
+    int threads;             /* threads used to classify packets */
+    COUNTER thread_chunk;    /* fewest packets each thread gets */
+    pcap_index_t *index;     /* used to split the pcap between threads */
+    int cache_fd;            /* the cache file */
+    off_t cache_stream;      /* offset of the streamed cache data, -1 if not streaming */
+    struct tcpprep_append_s *append; /* --append, see tcpprep_append.h */
 } tcpprep_opt_t;
 
 typedef struct tcpprep_s {
@@ -75,7 +98,9 @@ _U_ char *tcpprep_getwarn(tcpprep_t *);
 tcpprep_t *tcpprep_init();
 void tcpprep_close(tcpprep_t *);
 
+#ifdef TCPPREP
 int tcpprep_post_args(tcpprep_t *, int, char *[]);
+#endif
 
 #ifdef __cplusplus
 }
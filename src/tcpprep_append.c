@@ -0,0 +1,364 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * tcpprep --append, see tcpprep_append.h
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_TCPPREP /* see memstat.h */
+
+#include "tcpprep_append.h"
+#include "config.h"
+#include "common.h"
+#include "tcpprep_classify.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool load_state(tcpprep_append_t *append, tcpprep_opt_t *options, int cache_fd, const char *pcapfile,
+                       char *ebuf);
+static bool read_last(const char *pcapfile, u_int64_t offset, tcpprep_append_file_hdr_t *hdr, u_int64_t *next,
+                      char *ebuf);
+
+/**
+ * \brief works out whether the cache open as cache_fd can be appended to
+ *
+ * A cache with no .resume file, or one which no longer matches the cache
+ * or pcapfile, is truncated and built again.  In auto mode the host table
+ * of the packets already cached is put back in treeroot
+ */
+tcpprep_append_t *
+tcpprep_append_open(tcpprep_opt_t *options, const char *cachefile, int cache_fd, const char *pcapfile)
+{
+    tcpprep_append_t *append;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    struct stat statbuf;
+    size_t len;
+
+    assert(options);
+    assert(cachefile);
+    assert(pcapfile);
+
+    append = (tcpprep_append_t *)safe_malloc(sizeof(tcpprep_append_t));
+    len = strlen(cachefile) + sizeof(TCPPREP_APPEND_SUFFIX);
+    append->path = (char *)safe_malloc(len);
+    snprintf(append->path, len, "%s%s", cachefile, TCPPREP_APPEND_SUFFIX);
+    append->mode = options->mode;
+
+    if (fstat(cache_fd, &statbuf) != 0)
+        errx(-1, "Unable to stat cache file %s: %s", cachefile, strerror(errno));
+
+    if (statbuf.st_size == 0)
+        return append;
+
+    if (!load_state(append, options, cache_fd, pcapfile, ebuf)) {
+        warnx("Building %s again: %s", cachefile, ebuf);
+        if (ftruncate(cache_fd, 0) != 0)
+            errx(-1, "Unable to truncate cache file %s: %s", cachefile, strerror(errno));
+
+        return append;
+    }
+
+    append->resume = true;
+    options->cache_stream = append->cache_offset;
+    dbgx(1, "Appending to " COUNTER_SPEC " packets from offset %" PRIu64, append->packets, append->offset);
+
+    return append;
+}
+
+/**
+ * checks the .resume file of the cache on cache_fd against the cache and
+ * pcapfile and fills in append from it.  Returns false and fills in ebuf if
+ * the cache can't be appended to
+ */
+static bool
+load_state(tcpprep_append_t *append, tcpprep_opt_t *options, int cache_fd, const char *pcapfile, char *ebuf)
+{
+    tcpprep_append_file_hdr_t hdr, last;
+    tcpprep_append_host_t host;
+    tcpr_cache_file_hdr_t cache_hdr;
+    tcpr_data_tree_t hosts;
+    struct stat statbuf;
+    u_int64_t next;
+    u_int32_t i;
+    bool ret = false;
+    int fd;
+
+    if ((fd = open(append->path, O_RDONLY)) < 0) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "unable to open %s: %s", append->path, strerror(errno));
+        return false;
+    }
+
+    memset(&hosts, 0, sizeof(hosts));
+    if (read(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr) ||
+        memcmp(hdr.magic, TCPPREP_APPEND_MAGIC, sizeof(TCPPREP_APPEND_MAGIC)) != 0 ||
+        strtol(hdr.version, NULL, 10) != strtol(TCPPREP_APPEND_VERSION, NULL, 10)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s is not a tcpprep resume file of this version", append->path);
+        goto out;
+    }
+
+    if (ntohl(hdr.mode) != (u_int32_t)options->mode || ntohl(hdr.automode) != (u_int32_t)options->automode) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "the cache was built in another mode");
+        goto out;
+    }
+
+    /* the interface pairs and shards of version 05 and 06 follow the 2 bit data */
+    if (pread(cache_fd, &cache_hdr, sizeof(cache_hdr), 0) != (ssize_t)sizeof(cache_hdr) ||
+        memcmp(cache_hdr.magic, CACHEMAGIC, sizeof(CACHEMAGIC)) != 0 ||
+        strtol(cache_hdr.version, NULL, 10) != strtol(CACHEVERSION, NULL, 10)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "not a version %s cache file", CACHEVERSION);
+        goto out;
+    }
+
+    append->packets = (COUNTER)ntohll(cache_hdr.num_packets);
+    append->cache_offset = (off_t)(sizeof(cache_hdr) + ntohs(cache_hdr.comment_len));
+    if (append->packets == 0 || append->packets != (COUNTER)ntohll(hdr.num_packets)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "the cache doesn't match %s", append->path);
+        goto out;
+    }
+
+    if (fstat(cache_fd, &statbuf) != 0 ||
+        statbuf.st_size < append->cache_offset +
+                                  (off_t)((append->packets + CACHE_PACKETS_PER_BYTE - 1) / CACHE_PACKETS_PER_BYTE)) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "the cache file is truncated");
+        goto out;
+    }
+
+    /* the last packet cached must still be where it was */
+    append->offset = ntohll(hdr.offset);
+    append->prev_offset = ntohll(hdr.last_offset);
+    if (!read_last(pcapfile, append->prev_offset, &last, &next, ebuf))
+        goto out;
+
+    if (last.dlt != hdr.dlt || last.last_sec != hdr.last_sec || last.last_usec != hdr.last_usec ||
+        last.last_caplen != hdr.last_caplen || last.last_len != hdr.last_len || last.last_crc != hdr.last_crc ||
+        next != append->offset) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s has changed, not just grown", pcapfile);
+        goto out;
+    }
+
+    if (ntohl(hdr.num_hosts) > 0) {
+        hosts.count = ntohl(hdr.num_hosts);
+        hosts.hosts = (tcpr_tree_t *)safe_malloc(hosts.count * sizeof(tcpr_tree_t));
+        for (i = 0; i < hosts.count; i++) {
+            tcpr_tree_t *node = &hosts.hosts[i];
+
+            if (read(fd, &host, sizeof(host)) != (ssize_t)sizeof(host)) {
+                snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s is truncated", append->path);
+                goto out;
+            }
+
+            node->family = host.family;
+            node->masklen = host.masklen;
+            node->type = host.type;
+            node->server_cnt = (int)ntohl(host.server_cnt);
+            node->client_cnt = (int)ntohl(host.client_cnt);
+            if (host.family == AF_INET6) {
+                memcpy(&node->u.ip6, host.addr, sizeof(node->u.ip6));
+            } else {
+                u_int32_t ip;
+
+                memcpy(&ip, host.addr, sizeof(ip));
+                node->u.ip = ip;
+            }
+        }
+
+        tree_merge(&treeroot, &hosts, options->automode == FIRST_MODE);
+    }
+
+    ret = true;
+
+out:
+    tree_free(&hosts);
+    close(fd);
+    return ret;
+}
+
+/**
+ * reads the packet at offset in pcapfile into the last_ fields and dlt of
+ * hdr, and where the next packet starts into next
+ */
+static bool
+read_last(const char *pcapfile, u_int64_t offset, tcpprep_append_file_hdr_t *hdr, u_int64_t *next, char *ebuf)
+{
+    struct pcap_pkthdr pkthdr;
+    const u_char *pktdata;
+    pcap_t *pcap;
+
+    if ((pcap = tcpr_pcap_open_offline(pcapfile, ebuf)) == NULL)
+        return false;
+
+    if (fseeko(pcap_file(pcap), (off_t)offset, SEEK_SET) != 0 || (pktdata = pcap_next(pcap, &pkthdr)) == NULL) {
+        snprintf(ebuf, PCAP_ERRBUF_SIZE, "%s is shorter than the cache", pcapfile);
+        pcap_close(pcap);
+        return false;
+    }
+
+    hdr->dlt = htonl((u_int32_t)pcap_datalink(pcap));
+    hdr->last_sec = htonll((u_int64_t)pkthdr.ts.tv_sec);
+    hdr->last_usec = htonl((u_int32_t)pkthdr.ts.tv_usec);
+    hdr->last_caplen = htonl(pkthdr.caplen);
+    hdr->last_len = htonl(pkthdr.len);
+    hdr->last_crc = htonl(tcpr_crc32(pktdata, pkthdr.caplen, 0));
+    *next = (u_int64_t)ftello(pcap_file(pcap));
+
+    pcap_close(pcap);
+    return true;
+}
+
+/**
+ * \brief a pass over the pcap is about to read its packets: when
+ * appending, skip to the first new one
+ */
+void
+tcpprep_append_start(tcpprep_append_t *append, pcap_t *pcap, const char *pcapfile)
+{
+    assert(append);
+    assert(pcap);
+
+    if (pcap_file(pcap) == NULL)
+        errx(-1, "--append needs to seek in %s", pcapfile);
+
+    if (append->resume && fseeko(pcap_file(pcap), (off_t)append->offset, SEEK_SET) != 0)
+        errx(-1, "Unable to seek in %s: %s", pcapfile, strerror(errno));
+
+    append->last_offset = append->prev_offset;
+    append->next_offset = append->resume ? append->offset : (u_int64_t)ftello(pcap_file(pcap));
+}
+
+/**
+ * \brief auto mode: keeps the host table built by the first pass, before
+ * tcpprep_auto_done() works out the role of each host
+ */
+void
+tcpprep_append_hosts(tcpprep_append_t *append, const tcpr_data_tree_t *tree)
+{
+    assert(append);
+    assert(tree);
+
+    tree_free(&append->hosts);
+    if (tree->count == 0)
+        return;
+
+    append->hosts.count = tree->count;
+    append->hosts.hosts = (tcpr_tree_t *)safe_malloc(tree->count * sizeof(tcpr_tree_t));
+    memcpy(append->hosts.hosts, tree->hosts, tree->count * sizeof(tcpr_tree_t));
+}
+
+/**
+ * \brief writes the .resume file once the cache holds packets packets, so
+ * the next tcpprep --append starts after them
+ */
+void
+tcpprep_append_done(tcpprep_append_t *append, tcpprep_opt_t *options, const char *pcapfile, COUNTER packets)
+{
+    tcpprep_append_file_hdr_t hdr;
+    tcpprep_append_host_t host;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    char *tmp;
+    u_int64_t next;
+    u_int32_t i;
+    size_t len;
+    int fd;
+
+    assert(append);
+    assert(options);
+
+    memset(&hdr, 0, sizeof(hdr));
+    if (!read_last(pcapfile, append->last_offset, &hdr, &next, ebuf)) {
+        warnx("Unable to write %s: %s", append->path, ebuf);
+        return;
+    }
+
+    strncpy(hdr.magic, TCPPREP_APPEND_MAGIC, sizeof(hdr.magic));
+    strncpy(hdr.version, TCPPREP_APPEND_VERSION, sizeof(hdr.version));
+    hdr.mode = htonl((u_int32_t)append->mode);
+    hdr.automode = htonl((u_int32_t)options->automode);
+    hdr.num_packets = htonll((u_int64_t)packets);
+    hdr.offset = htonll(append->next_offset);
+    hdr.last_offset = htonll(append->last_offset);
+    hdr.num_hosts = htonl(append->hosts.count);
+
+    /* written whole and renamed over the old one, so it always matches some cache */
+    len = strlen(append->path) + 5;
+    tmp = (char *)safe_malloc(len);
+    snprintf(tmp, len, "%s.tmp", append->path);
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+        warnx("Unable to open %s: %s", tmp, strerror(errno));
+        safe_free(tmp);
+        return;
+    }
+
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr))
+        goto fail;
+
+    for (i = 0; i < append->hosts.count; i++) {
+        const tcpr_tree_t *node = &append->hosts.hosts[i];
+
+        memset(&host, 0, sizeof(host));
+        host.family = (u_int8_t)node->family;
+        host.masklen = (u_int8_t)node->masklen;
+        host.type = (int8_t)node->type;
+        host.server_cnt = htonl((u_int32_t)node->server_cnt);
+        host.client_cnt = htonl((u_int32_t)node->client_cnt);
+        if (node->family == AF_INET6) {
+            memcpy(host.addr, &node->u.ip6, sizeof(node->u.ip6));
+        } else {
+            u_int32_t ip = (u_int32_t)node->u.ip;
+
+            memcpy(host.addr, &ip, sizeof(ip));
+        }
+
+        if (write(fd, &host, sizeof(host)) != (ssize_t)sizeof(host))
+            goto fail;
+    }
+
+    if (close(fd) < 0 || rename(tmp, append->path) < 0) {
+        warnx("Unable to write %s: %s", append->path, strerror(errno));
+        unlink(tmp);
+    }
+
+    safe_free(tmp);
+    return;
+
+fail:
+    warnx("Unable to write %s: %s", tmp, strerror(errno));
+    close(fd);
+    unlink(tmp);
+    safe_free(tmp);
+}
+
+/**
+ * \brief frees append
+ */
+void
+tcpprep_append_free(tcpprep_append_t *append)
+{
+    if (append == NULL)
+        return;
+
+    tree_free(&append->hosts);
+    safe_free(append->path);
+    safe_free(append);
+}
@@ -0,0 +1,117 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "defines.h"
+#include "config.h"
+#include "tcpprep_api.h"
+#include "tree.h"
+#include <stdio.h>
+
+/*
+ * tcpprep --append: extend the cache of a capture which has grown since it
+ * was last classified, rather than build it again.
+ *
+ * Next to the cache, <cachefile>.resume says how far into the pcap the
+ * cache goes: the packets classified, the file offset of the record after
+ * the last one and enough of that last record to know it is still the
+ * same file.  Auto modes also keep the host table of their first pass,
+ * so the new packets add to what was learnt from the old ones.  All
+ * integers are in network byte order.
+ *
+ * Packets already in the cache keep their classification, even if the
+ * new packets change what auto mode thinks of a host.
+ */
+#define TCPPREP_APPEND_MAGIC "tcprapp"
+#define TCPPREP_APPEND_VERSION "01"
+#define TCPPREP_APPEND_SUFFIX ".resume"
+
+/*
+ * TCPPREP_APPEND_VERSION History:
+ * 01 - Initial release
+ */
+
+/*
+ * On-disk file header, followed by num_hosts tcpprep_append_host_t.
+ *
+ * If you need to enhance this struct, do so AFTER the version field and be
+ * sure to increment TCPPREP_APPEND_VERSION
+ */
+typedef struct tcpprep_append_file_hdr_s {
+    char magic[8];
+    char version[4];
+    u_int32_t mode;        /* tcpprep_mode_t from the command line */
+    u_int32_t automode;    /* auto mode only */
+    u_int32_t dlt;
+    u_int64_t num_packets; /* packets in the cache */
+    u_int64_t offset;      /* pcap file offset after the last packet */
+    u_int64_t last_offset; /* pcap file offset of the last packet */
+    u_int64_t last_sec;
+    u_int32_t last_usec;
+    u_int32_t last_caplen;
+    u_int32_t last_len;
+    u_int32_t last_crc;    /* tcpr_crc32() of the last packet's data */
+    u_int32_t num_hosts;   /* auto mode: hosts of the first pass */
+} __attribute__((__packed__)) tcpprep_append_file_hdr_t;
+
+typedef struct tcpprep_append_host_s {
+    u_int8_t family;
+    u_int8_t masklen;
+    int8_t type;
+    u_int8_t pad;
+    u_int32_t server_cnt;
+    u_int32_t client_cnt;
+    u_int8_t addr[16]; /* IPv4 hosts only use the first 4 */
+} __attribute__((__packed__)) tcpprep_append_host_t;
+
+struct tcpprep_append_s {
+    char *path;             /* of the .resume file */
+    tcpprep_mode_t mode;    /* from the command line, tcpprep_auto_done() changes options->mode */
+    bool resume;            /* the cache is being appended to, not rebuilt */
+    COUNTER packets;        /* packets already in the cache */
+    off_t cache_offset;     /* of the cache data */
+    u_int64_t offset;       /* pcap file offset of the first new packet */
+    u_int64_t prev_offset;  /* ... of the last packet already cached */
+    /* where the last pass got to, see tcpprep_append_mark() */
+    u_int64_t last_offset;
+    u_int64_t next_offset;
+    tcpr_data_tree_t hosts; /* auto mode: host table of the first pass */
+};
+
+typedef struct tcpprep_append_s tcpprep_append_t;
+
+tcpprep_append_t *tcpprep_append_open(tcpprep_opt_t *options, const char *cachefile, int cache_fd,
+                                      const char *pcapfile);
+void tcpprep_append_start(tcpprep_append_t *append, pcap_t *pcap, const char *pcapfile);
+void tcpprep_append_hosts(tcpprep_append_t *append, const tcpr_data_tree_t *tree);
+void tcpprep_append_done(tcpprep_append_t *append, tcpprep_opt_t *options, const char *pcapfile, COUNTER packets);
+void tcpprep_append_free(tcpprep_append_t *append);
+
+/*
+ * a packet has just been read from pcap: remember where it ended.  glibc
+ * answers ftello() from the stdio buffer, so with --append this is cheap
+ * enough to do for every packet
+ */
+static inline void
+tcpprep_append_mark(tcpprep_append_t *append, pcap_t *pcap)
+{
+    append->last_offset = append->next_offset;
+    append->next_offset = (u_int64_t)ftello(pcap_file(pcap));
+}
@@ -0,0 +1,1041 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * How tcpprep classifies packets, see tcpprep_classify.h.  A file is
+ * classified in chunks, on several threads when it can be split, and
+ * each chunk either builds a cache or, for tcprewrite, just says what
+ * each packet is.
+ */
+
+#define TCPR_MEM_SUBSYS TCPR_MEM_TCPPREP /* see memstat.h */
+
+#include "tcpprep_classify.h"
+#include "config.h"
+#include "common.h"
+#include "tcpprep_append.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+tcpprep_t *tcpprep;
+tcpr_data_tree_t treeroot;
+
+static int check_ipv4_regex(unsigned long ip);
+static int check_ipv6_regex(const struct tcpr_in6_addr *addr);
+
+/* slots of the per-chunk --regex result cache; must be a power of 2 */
+#define TCPPREP_REGEX_MEMO 65536
+
+/* a host and whether it matched --regex */
+typedef struct tcpprep_regex_memo_s {
+    struct tcpr_in6_addr addr; /* IPv4 hosts only set the first word */
+    u_char family;             /* AF_INET or AF_INET6, 0 if the slot is empty */
+    u_char match;
+} tcpprep_regex_memo_t;
+
+/* a run of packets classified by process_raw_packets(), or by tcpprep_chunk_packet() */
+struct tcpprep_chunk_s {
+    pcap_t *pcap;
+    COUNTER first;           /* packets before the chunk */
+    COUNTER last;            /* last packet of the chunk, 0 for the end of the file */
+    u_int64_t offset;        /* file offset of a packet at or before the chunk */
+    COUNTER skip;            /* packets from there to the chunk */
+    tcpr_data_tree_t *tree;  /* hosts seen by the first pass of auto mode */
+    tcpr_cache_t *cachedata;
+    tcpr_cache_t *lastcache;
+    tcpr_cache_stream_t *stream; /* used instead of cachedata when streaming */
+    COUNTER packets;         /* packets processed */
+    tcpprep_regex_memo_t *regex_memo;
+    u_int32_t list_cursor;   /* see check_list_from() */
+    u_char *ipbuff;          /* for get_ipv4() and get_ipv6() */
+    bool direct;             /* nothing is cached, the packet's direction is left in result */
+    tcpr_dir_t result;
+#ifdef HAVE_PTHREAD
+    pthread_t thread;
+#endif
+};
+
+static COUNTER process_raw_packets(tcpprep_chunk_t *chunk);
+static void process_packet(tcpprep_chunk_t *chunk,
+                           struct pcap_pkthdr *pkthdr,
+                           const u_char *pktdata,
+                           int datalink,
+                           COUNTER packetnum);
+#ifdef HAVE_PTHREAD
+static COUNTER process_threads(pcap_t *pcap);
+#endif
+static int check_dst_port(ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr, int len);
+static int check_regex(tcpprep_chunk_t *chunk, int family, const void *addr);
+static u_int32_t ip_flow_hash(ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr, int len);
+static u_int32_t mac_hash(eth_hdr_t *eth_hdr);
+static void grow_flowdata(tcpprep_opt_t *options, COUNTER packets);
+static void assign_flow(COUNTER packetnum, u_int32_t hash);
+static tcpr_dir_t cache_packet(tcpprep_chunk_t *chunk, const int send, const tcpr_dir_t interface);
+static void cache_dont_send(tcpprep_chunk_t *chunk);
+static void cache_nonip(tcpprep_chunk_t *chunk);
+static void defer_cache(u_int32_t code);
+static void resolve_deferred(void);
+
+/* single pass auto mode: how to cache a packet once the host table is done */
+#define DEFER_DONT_SEND 0
+#define DEFER_NONIP 1
+#define DEFER_HOST 2 /* + host returned by add_tree_*() */
+
+/**
+ * checks the dst port to see if this is destined for a server port.
+ * returns 1 for true, 0 for false
+ */
+static int
+check_dst_port(ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr, int len)
+{
+    tcp_hdr_t *tcp_hdr = NULL;
+    udp_hdr_t *udp_hdr = NULL;
+    tcpprep_opt_t *options = tcpprep->options;
+    uint8_t proto;
+    u_char *l4;
+
+    if (ip_hdr) {
+        if (len < ((ip_hdr->ip_hl * 4) + 4))
+            return 0; /* not enough data in the packet to know */
+
+        proto = ip_hdr->ip_p;
+        l4 = get_layer4_v4(ip_hdr, (u_char *)ip_hdr + len);
+    } else if (ip6_hdr) {
+        if (len < (TCPR_IPV6_H + 4))
+            return 0; /* not enough data in the packet to know */
+
+        l4 = get_layer4_v6_proto(ip6_hdr, (u_char *)ip6_hdr + len, &proto);
+        dbgx(3, "Our layer4 proto is 0x%hhu", proto);
+        if (l4 == NULL)
+            return 0;
+
+        dbgx(3,
+             "Found proto %u at offset %p.  base %p (%p)",
+             proto,
+             (void *)l4,
+             (void *)ip6_hdr,
+             (void *)(l4 - (u_char *)ip6_hdr));
+    } else {
+        assert(0);
+    }
+
+    dbg(3, "Checking the destination port...");
+
+    switch (proto) {
+    case IPPROTO_TCP:
+        tcp_hdr = (tcp_hdr_t *)l4;
+
+        /* is a service? */
+        if (options->services.tcp[ntohs(tcp_hdr->th_dport)]) {
+            dbgx(1, "TCP packet is destined for a server port: %d", ntohs(tcp_hdr->th_dport));
+            return 1;
+        }
+
+        /* nope */
+        dbgx(1, "TCP packet is NOT destined for a server port: %d", ntohs(tcp_hdr->th_dport));
+        return 0;
+
+    case IPPROTO_UDP:
+        udp_hdr = (udp_hdr_t *)l4;
+
+        /* is a service? */
+        if (options->services.udp[ntohs(udp_hdr->uh_dport)]) {
+            dbgx(1, "UDP packet is destined for a server port: %d", ntohs(udp_hdr->uh_dport));
+            return 1;
+        }
+
+        /* nope */
+        dbgx(1, "UDP packet is NOT destined for a server port: %d", ntohs(udp_hdr->uh_dport));
+        return 0;
+
+    default:
+        /* not a TCP or UDP packet... return as non_ip */
+        dbg(1, "Packet isn't a UDP or TCP packet... no port to process.");
+        return options->nonip;
+    }
+}
+
+/**
+ * checks to see if an ip address matches a regex.  Returns 1 for true
+ * 0 for false
+ */
+static int
+check_ipv4_regex(const unsigned long ip)
+{
+    int eflags = 0;
+    u_char src_ip[16];
+#ifdef HAVE_INET_NTOP
+    struct in_addr addr;
+#endif
+    size_t nmatch = 0;
+    tcpprep_opt_t *options = tcpprep->options;
+
+    memset(src_ip, '\0', sizeof(src_ip));
+#ifdef HAVE_INET_NTOP
+    /* not get_addr2name4(), which isn't thread safe */
+    addr.s_addr = ip;
+    inet_ntop(AF_INET, &addr, (char *)src_ip, sizeof(src_ip));
+#else
+    strlcpy((char *)src_ip, (char *)get_addr2name4(ip, RESOLVE), sizeof(src_ip));
+#endif
+    if (regexec(&options->preg, (char *)src_ip, nmatch, NULL, eflags) == 0) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static int
+check_ipv6_regex(const struct tcpr_in6_addr *addr)
+{
+    int eflags = 0;
+    u_char src_ip[INET6_ADDRSTRLEN];
+    size_t nmatch = 0;
+    tcpprep_opt_t *options = tcpprep->options;
+
+    memset(src_ip, '\0', sizeof(src_ip));
+#ifdef HAVE_INET_NTOP
+    inet_ntop(AF_INET6, addr, (char *)src_ip, sizeof(src_ip));
+#else
+    strlcpy((char *)src_ip, (char *)get_addr2name6(addr, RESOLVE), sizeof(src_ip));
+#endif
+    if (regexec(&options->preg, (char *)src_ip, nmatch, NULL, eflags) == 0) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/**
+ * checks the source IP of a packet against the regex, remembering the
+ * result so each host only goes through inet_ntop() and regexec() once
+ * (until another host hashes to its slot)
+ */
+static int
+check_regex(tcpprep_chunk_t *chunk, int family, const void *addr)
+{
+    struct tcpr_in6_addr key;
+    tcpprep_regex_memo_t *memo;
+
+    memset(&key, 0, sizeof(key));
+    memcpy(&key, addr, family == AF_INET ? sizeof(key.tcpr_s6_addr32[0]) : sizeof(key));
+
+    if (chunk->regex_memo == NULL)
+        chunk->regex_memo = (tcpprep_regex_memo_t *)safe_malloc(TCPPREP_REGEX_MEMO * sizeof(tcpprep_regex_memo_t));
+
+    memo = &chunk->regex_memo[flow_hash_words(&key, sizeof(key), 0) & (TCPPREP_REGEX_MEMO - 1)];
+    if (memo->family == family && memcmp(&memo->addr, &key, sizeof(key)) == 0)
+        return memo->match;
+
+    memo->addr = key;
+    memo->family = (u_char)family;
+    memo->match = (u_char)(family == AF_INET ? check_ipv4_regex(key.tcpr_s6_addr32[0]) : check_ipv6_regex(&key));
+
+    return memo->match;
+}
+
+/**
+ * makes room for the interface pair and shard of the first packets packets
+ */
+static void
+grow_flowdata(tcpprep_opt_t *options, COUNTER packets)
+{
+    options->pairdata_len = packets;
+    if (options->pairs > 1)
+        options->pairdata = (u_char *)safe_realloc(options->pairdata, options->pairdata_len);
+    if (options->shards > 0)
+        options->sharddata = (u_char *)safe_realloc(options->sharddata, options->pairdata_len);
+}
+
+/**
+ * mixes the bits of a flow hash and uses it to pick the interface pair and
+ * the shard of a packet.  The shard comes from what is left of the hash
+ * after the pair, so every shard still uses every pair
+ */
+static void
+assign_flow(COUNTER packetnum, u_int32_t hash)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    if (options->pairs > 1)
+        options->pairdata[packetnum - 1] = (u_char)(hash % (u_int32_t)options->pairs);
+
+    if (options->shards > 0)
+        options->sharddata[packetnum - 1] = (u_char)(hash / (u_int32_t)options->pairs % (u_int32_t)options->shards);
+}
+
+/**
+ * hashes the addresses, protocol and TCP/UDP ports of an IPv4/v6 packet.
+ * The hash is the same for both directions of a flow
+ */
+static u_int32_t
+ip_flow_hash(ipv4_hdr_t *ip_hdr, ipv6_hdr_t *ip6_hdr, int len)
+{
+    u_int32_t src = 0, dst = 0;
+    u_int16_t ports[2] = {0, 0};
+    uint8_t proto;
+    u_char *l4 = NULL, *end;
+    int i;
+
+    if (ip_hdr) {
+        end = (u_char *)ip_hdr + len;
+        src = ip_hdr->ip_src.s_addr;
+        dst = ip_hdr->ip_dst.s_addr;
+        proto = ip_hdr->ip_p;
+        if (len >= ((ip_hdr->ip_hl * 4) + 4))
+            l4 = get_layer4_v4(ip_hdr, end);
+    } else if (ip6_hdr) {
+        end = (u_char *)ip6_hdr + len;
+        for (i = 0; i < 4; i++) {
+            src ^= ip6_hdr->ip_src.tcpr_s6_addr32[i];
+            dst ^= ip6_hdr->ip_dst.tcpr_s6_addr32[i];
+        }
+        if (len >= (TCPR_IPV6_H + 4))
+            l4 = get_layer4_v6_proto(ip6_hdr, end, &proto);
+        else
+            proto = get_ipv6_l4proto(ip6_hdr, end);
+    } else {
+        return 0;
+    }
+
+    /* TCP and UDP both start with the source and destination ports */
+    if (l4 != NULL && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) && l4 + sizeof(ports) <= end)
+        memcpy(ports, l4, sizeof(ports));
+
+    /* xor and add are order independent, so both directions match */
+    return (src ^ dst) + (src & dst) + (u_int32_t)(ports[0] ^ ports[1]) * 31 + proto;
+}
+
+/**
+ * hashes the source and destination MAC of an ethernet frame.  The hash is
+ * the same for both directions
+ */
+static u_int32_t
+mac_hash(eth_hdr_t *eth_hdr)
+{
+    u_int32_t hash = 0;
+    int i;
+
+    for (i = 0; i < ETHER_ADDR_LEN; i++)
+        hash = hash * 31 + (eth_hdr->ether_shost[i] ^ eth_hdr->ether_dhost[i]);
+
+    return hash;
+}
+
+/**
+ * caches the next packet of the chunk
+ */
+static tcpr_dir_t
+cache_packet(tcpprep_chunk_t *chunk, const int send, const tcpr_dir_t interface)
+{
+    if (chunk->direct)
+        return chunk->result = send != SEND ? TCPR_DIR_NOSEND : interface == TCPR_DIR_C2S ? TCPR_DIR_C2S : TCPR_DIR_S2C;
+
+    if (chunk->stream != NULL)
+        return add_cache_stream(chunk->stream, send, interface);
+
+    return add_cache_r(&chunk->cachedata, &chunk->lastcache, send, interface);
+}
+
+/**
+ * caches a packet we are not going to send.  In single pass auto mode
+ * the cache is built at the end, so just remember it.  The first of two
+ * auto mode passes doesn't cache anything
+ */
+static void
+cache_dont_send(tcpprep_chunk_t *chunk)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+
+    if (options->mode == AUTO_MODE) {
+        if (options->single_pass)
+            defer_cache(DEFER_DONT_SEND);
+    } else {
+        cache_packet(chunk, DONT_SEND, 0);
+    }
+}
+
+/**
+ * caches a packet we can't find the IP header of
+ */
+static void
+cache_nonip(tcpprep_chunk_t *chunk)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+
+    /* we don't want to cache these packets twice */
+    if (options->mode != AUTO_MODE) {
+        dbg(3, "Adding to cache using options for Non-IP packets");
+        cache_packet(chunk, SEND, options->nonip);
+    } else if (options->single_pass) {
+        defer_cache(DEFER_NONIP);
+    }
+}
+
+static void
+defer_cache(u_int32_t code)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+
+    if (options->deferred_cnt == options->deferred_max) {
+        options->deferred_max = options->deferred_max ? options->deferred_max * 2 : CACHEDATASIZE;
+        options->deferred =
+                (u_int32_t *)safe_realloc(options->deferred, options->deferred_max * sizeof(u_int32_t));
+    }
+
+    options->deferred[options->deferred_cnt++] = code;
+}
+
+/**
+ * single pass auto mode: build the cache from the host table, the same
+ * way the second pass would
+ */
+static void
+resolve_deferred(void)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+    tcpr_cache_t *lastcache = NULL;
+    int unknowns;
+    COUNTER i;
+
+    /* what check_ip_tree() does with unknown hosts in each mode */
+    switch (options->automode) {
+    case ROUTER_MODE:
+        unknowns = options->nonip;
+        break;
+    case SERVER_MODE:
+        unknowns = DIR_SERVER;
+        break;
+    case CLIENT_MODE:
+        unknowns = DIR_CLIENT;
+        break;
+    default:
+        unknowns = DIR_UNKNOWN;
+        break;
+    }
+
+    for (i = 0; i < options->deferred_cnt; i++) {
+        u_int32_t code = options->deferred[i];
+
+        if (code == DEFER_DONT_SEND) {
+            add_cache_r(&options->cachedata, &lastcache, DONT_SEND, 0);
+        } else if (code == DEFER_NONIP) {
+            add_cache_r(&options->cachedata, &lastcache, SEND, options->nonip);
+        } else {
+            add_cache_r(&options->cachedata, &lastcache, SEND, check_host_tree(unknowns, code - DEFER_HOST));
+        }
+    }
+
+    safe_free(options->deferred);
+    options->deferred = NULL;
+    options->deferred_cnt = options->deferred_max = 0;
+}
+
+/**
+ * \brief the auto mode of a --auto name, ERROR_MODE if there is none
+ */
+tcpprep_mode_t
+tcpprep_automode(const char *name)
+{
+    if (strcmp(name, "bridge") == 0)
+        return BRIDGE_MODE;
+    if (strcmp(name, "router") == 0)
+        return ROUTER_MODE;
+    if (strcmp(name, "client") == 0)
+        return CLIENT_MODE;
+    if (strcmp(name, "server") == 0)
+        return SERVER_MODE;
+    if (strcmp(name, "first") == 0)
+        return FIRST_MODE;
+
+    return ERROR_MODE;
+}
+
+/**
+ * \brief after the first pass of auto mode, decide which hosts are clients
+ * and which servers and switch to the mode of the second pass.  In single
+ * pass mode the cache is built here, the packets aren't read again
+ */
+void
+tcpprep_auto_done(void)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+
+    assert(options->mode == AUTO_MODE);
+
+    options->mode = options->automode;
+    if (options->mode == ROUTER_MODE) { /* do we need to convert TREE->CIDR? */
+        if (!process_tree()) {
+            err(-1, "Error: unable to build a valid list of servers. Aborting.");
+        }
+    } else {
+        /*
+         * in bridge mode we need to calculate client/sever
+         * manually since this is done automatically in
+         * process_tree()
+         */
+        tree_calculate(&treeroot);
+    }
+
+    /* every packet has already been seen, no need to read them again */
+    if (options->single_pass)
+        resolve_deferred();
+}
+
+/**
+ * \brief classifies all the packets of pcap into options->cachedata (and
+ * the tree in the first pass of auto mode), on several threads if we can
+ */
+COUNTER
+tcpprep_process_packets(pcap_t *pcap)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+    tcpprep_chunk_t chunk;
+    COUNTER packets;
+
+#ifdef HAVE_PTHREAD
+    if (options->threads > 1 && (packets = process_threads(pcap)) > 0)
+        return packets;
+#endif
+
+    memset(&chunk, 0, sizeof(chunk));
+    chunk.pcap = pcap;
+    chunk.tree = &treeroot;
+    if (options->append != NULL)
+        chunk.first = options->append->packets;
+
+    packets = process_raw_packets(&chunk);
+    options->cachedata = chunk.cachedata;
+
+    return packets;
+}
+
+#ifdef HAVE_PTHREAD
+/**
+ * opens the pcap again and processes the packets of one chunk
+ */
+static void *
+process_chunk(void *arg)
+{
+    tcpprep_chunk_t *chunk = (tcpprep_chunk_t *)arg;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    struct pcap_pkthdr pkthdr;
+    COUNTER i;
+
+    if ((chunk->pcap = pcap_open_offline(tcpprep->pcapfile, ebuf)) == NULL)
+        errx(-1, "Error opening libpcap: %s", ebuf);
+
+    /* libpcap reads records straight from its FILE, so we can seek to one */
+    if (chunk->first > 0 && fseeko(pcap_file(chunk->pcap), (off_t)chunk->offset, SEEK_SET) != 0)
+        errx(-1, "Unable to seek in %s: %s", tcpprep->pcapfile, strerror(errno));
+
+    for (i = 0; i < chunk->skip; i++) {
+        if (pcap_next(chunk->pcap, &pkthdr) == NULL)
+            errx(-1, "%s is shorter than its index", tcpprep->pcapfile);
+    }
+
+    chunk->packets = process_raw_packets(chunk);
+
+    pcap_close(chunk->pcap);
+    chunk->pcap = NULL;
+
+    return NULL;
+}
+
+/**
+ * splits the pcap into options->threads chunks using its index and
+ * processes each on its own thread.  Every chunk but the last is a whole
+ * number of cache bytes, so their cache data is joined by linking the
+ * lists together.  In the first pass of auto mode each thread builds its
+ * own host table, merged in file order afterwards.
+ * Returns 0 if the file can't be split
+ */
+static COUNTER
+process_threads(pcap_t *pcap)
+{
+    tcpprep_opt_t *options = tcpprep->options;
+    tcpprep_chunk_t *chunks;
+    tcpr_cache_t *lastcache = NULL;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    COUNTER packets, total = 0;
+    int threads, i;
+
+    /* we need to know packet numbers and to seek in the file */
+    if (options->bpf.filter != NULL || options->single_pass || strcmp(tcpprep->pcapfile, "-") == 0 ||
+        pcap_file(pcap) == NULL || decompress_detect(tcpprep->pcapfile) != DECOMPRESS_NONE)
+        return 0;
+
+#ifdef ENABLE_VERBOSE
+    /* packets have to be printed in order */
+    if (options->verbose)
+        return 0;
+#endif
+#ifndef HAVE_INET_NTOP
+    if (options->mode == REGEX_MODE)
+        return 0;
+#endif
+
+    /* kept for the second pass of auto mode */
+    if (options->index == NULL) {
+        if ((options->index = pcap_index_load(tcpprep->pcapfile)) == NULL &&
+            (options->index = pcap_index_build(tcpprep->pcapfile, 0, ebuf)) == NULL) {
+            warnx("Unable to split %s between threads: %s", tcpprep->pcapfile, ebuf);
+            options->threads = 1;
+            return 0;
+        }
+    }
+
+    packets = options->index->num_packets;
+    threads = options->threads;
+    if ((COUNTER)threads > packets / options->thread_chunk)
+        threads = (int)(packets / options->thread_chunk);
+
+    if (threads < 2)
+        return 0;
+
+    dbgx(1, "Processing " COUNTER_SPEC " packets on %d threads", packets, threads);
+
+    /* threads store interface pairs and shards in place */
+    if (options->pairdata_len < packets)
+        grow_flowdata(options, packets);
+
+    chunks = (tcpprep_chunk_t *)safe_malloc(threads * sizeof(tcpprep_chunk_t));
+    for (i = 0; i < threads; i++) {
+        tcpprep_chunk_t *chunk = &chunks[i];
+
+        chunk->first = packets * i / threads / CACHE_PACKETS_PER_BYTE * CACHE_PACKETS_PER_BYTE;
+        if (i < threads - 1)
+            chunk->last = packets * (i + 1) / threads / CACHE_PACKETS_PER_BYTE * CACHE_PACKETS_PER_BYTE;
+
+        if (chunk->first > 0) {
+            const pcap_index_entry_t *entry = pcap_index_find_packet(options->index, chunk->first);
+
+            assert(entry);
+            chunk->offset = entry->offset;
+            chunk->skip = chunk->first - entry->packet;
+        }
+
+        if (options->mode == AUTO_MODE) {
+            chunk->tree = (tcpr_data_tree_t *)safe_malloc(sizeof(tcpr_data_tree_t));
+        } else {
+            chunk->tree = &treeroot;
+        }
+
+        if (pthread_create(&chunk->thread, NULL, process_chunk, chunk) != 0)
+            errx(-1, "Unable to create thread: %s", strerror(errno));
+    }
+
+    for (i = 0; i < threads; i++) {
+        tcpprep_chunk_t *chunk = &chunks[i];
+
+        pthread_join(chunk->thread, NULL);
+
+        if (chunk->last != 0 && chunk->packets != chunk->last - chunk->first)
+            errx(-1, "%s changed while it was being read", tcpprep->pcapfile);
+
+        total += chunk->packets;
+
+        if (chunk->cachedata != NULL) {
+            if (lastcache == NULL) {
+                options->cachedata = chunk->cachedata;
+            } else {
+                lastcache->next = chunk->cachedata;
+            }
+            lastcache = chunk->lastcache;
+        }
+
+        if (options->mode == AUTO_MODE) {
+            tree_merge(&treeroot, chunk->tree, options->automode == FIRST_MODE);
+            tree_free(chunk->tree);
+            safe_free(chunk->tree);
+        }
+    }
+
+    safe_free(chunks);
+
+    return total;
+}
+#endif
+
+/**
+ * uses libpcap library to parse the packets and build
+ * the cache file.
+ */
+static COUNTER
+process_raw_packets(tcpprep_chunk_t *chunk)
+{
+    struct pcap_pkthdr pkthdr;
+    const u_char *pktdata = NULL;
+    pcap_t *pcap = chunk->pcap;
+    COUNTER packetnum = chunk->first;
+    tcpprep_opt_t *options = tcpprep->options;
+
+    assert(pcap);
+
+    chunk->ipbuff = safe_malloc(MAXPACKET);
+
+    /* chunks start on a cache byte, so each can write its own part */
+    if (options->cache_stream >= 0 && options->mode != AUTO_MODE) {
+        chunk->stream = (tcpr_cache_stream_t *)safe_malloc(sizeof(tcpr_cache_stream_t));
+        init_cache_stream(chunk->stream,
+                          options->cache_fd,
+                          options->cache_stream + (off_t)(chunk->first / CACHE_PACKETS_PER_BYTE));
+        /* only --append starts part way through a byte */
+        resume_cache_stream(chunk->stream, chunk->first % CACHE_PACKETS_PER_BYTE);
+    }
+
+    while ((chunk->last == 0 || packetnum < chunk->last) && (pktdata = safe_pcap_next(pcap, &pkthdr)) != NULL) {
+        packetnum++;
+        if (options->append != NULL)
+            tcpprep_append_mark(options->append, pcap);
+
+        process_packet(chunk, &pkthdr, pktdata, pcap_datalink(pcap), packetnum);
+    }
+
+    safe_free(chunk->ipbuff);
+    chunk->ipbuff = NULL;
+    safe_free(chunk->regex_memo);
+    chunk->regex_memo = NULL;
+
+    if (chunk->stream != NULL) {
+        flush_cache_stream(chunk->stream);
+        safe_free(chunk->stream);
+        chunk->stream = NULL;
+    }
+
+    return packetnum - chunk->first;
+}
+
+/**
+ * classifies packet number packetnum into the cache, or the tree in the
+ * first pass of auto mode
+ */
+static void
+process_packet(tcpprep_chunk_t *chunk,
+               struct pcap_pkthdr *pkthdr,
+               const u_char *pktdata,
+               int datalink,
+               COUNTER packetnum)
+{
+    ipv4_hdr_t *ip_hdr = NULL;
+    ipv6_hdr_t *ip6_hdr = NULL;
+    eth_hdr_t *eth_hdr = NULL;
+    int l2len = 0;
+    u_char *buffptr;
+    tcpr_dir_t direction = TCPR_DIR_ERROR;
+    tcpprep_opt_t *options = tcpprep->options;
+    u_int32_t host = 0;
+
+    dbgx(1, "Packet " COUNTER_SPEC, packetnum);
+
+    /* packets use the first interface pair and shard unless they are hashed below */
+    if (options->pairs > 1 || options->shards > 0) {
+        if (packetnum > options->pairdata_len)
+            grow_flowdata(options,
+                          options->pairdata_len ? options->pairdata_len * 2 : CACHEDATASIZE * CACHE_PACKETS_PER_BYTE);
+        if (options->pairs > 1)
+            options->pairdata[packetnum - 1] = 0;
+        if (options->shards > 0)
+            options->sharddata[packetnum - 1] = 0;
+    }
+
+    /* look for include or exclude LIST match */
+    if (options->xX.list != NULL) {
+        if (options->xX.mode < xXExclude) {
+            /* include list */
+            if (!check_list_from(options->xX.list, packetnum, &chunk->list_cursor)) {
+                cache_dont_send(chunk);
+                return;
+            }
+        }
+        /* exclude list */
+        else if (check_list_from(options->xX.list, packetnum, &chunk->list_cursor)) {
+            cache_dont_send(chunk);
+            return;
+        }
+    }
+
+    /*
+     * If the packet doesn't include an IPv4 header we should just treat
+     * it as a non-IP packet, UNLESS we're in MAC mode, in which case
+     * we should let the MAC matcher below handle it
+     */
+    if (options->mode != MAC_MODE) {
+        dbg(3, "Looking for IPv4/v6 header in non-MAC mode");
+
+        /* get the IP header (if any) */
+        buffptr = chunk->ipbuff;
+
+        /* first look for IPv4 */
+        if ((ip_hdr = (ipv4_hdr_t *)get_ipv4(pktdata, (int)pkthdr->caplen, datalink, &buffptr)) != NULL) {
+            dbg(2, "Packet is IPv4");
+        } else if ((ip6_hdr = (ipv6_hdr_t *)get_ipv6(pktdata, (int)pkthdr->caplen, datalink, &buffptr)) != NULL) {
+            /* IPv6 */
+            dbg(2, "Packet is IPv6");
+        } else {
+            /* we're something else... */
+            dbg(2, "Packet isn't IPv4/v6");
+
+            cache_nonip(chunk);
+
+            /* go to next packet */
+            return;
+        }
+
+        l2len = get_l2len(pktdata, (int)pkthdr->caplen, datalink);
+        if (l2len < 0) {
+            /* every packet needs an entry, or those after it would move */
+            cache_nonip(chunk);
+            return;
+        }
+
+        if (options->pairs > 1 || options->shards > 0)
+            assign_flow(packetnum, ip_flow_hash(ip_hdr, ip6_hdr, (int)pkthdr->caplen - l2len));
+
+        /* look for include or exclude CIDR match */
+        if (options->xX.cidr != NULL) {
+            if (ip_hdr) {
+                if (!process_xX_by_cidr_ipv4(options->xX.mode, options->xX.cidr, ip_hdr)) {
+                    cache_dont_send(chunk);
+                    return;
+                }
+            } else if (ip6_hdr) {
+                if (!process_xX_by_cidr_ipv6(options->xX.mode, options->xX.cidr, ip6_hdr)) {
+                    cache_dont_send(chunk);
+                    return;
+                }
+            }
+        }
+    }
+
+    switch (options->mode) {
+    case REGEX_MODE:
+        dbg(2, "processing regex mode...");
+        if (ip_hdr) {
+            direction = check_regex(chunk, AF_INET, &ip_hdr->ip_src);
+        } else if (ip6_hdr) {
+            direction = check_regex(chunk, AF_INET6, &ip6_hdr->ip_src);
+        }
+
+        /* reverse direction? */
+        if (options->reverse && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
+            direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
+
+        cache_packet(chunk, SEND, direction);
+        break;
+
+    case CIDR_MODE:
+        dbg(2, "processing cidr mode...");
+        if (ip_hdr) {
+            direction = check_ip_cidr(options->cidrdata, ip_hdr->ip_src.s_addr) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
+        } else if (ip6_hdr) {
+            direction = check_ip6_cidr(options->cidrdata, &ip6_hdr->ip_src) ? TCPR_DIR_C2S : TCPR_DIR_S2C;
+        }
+
+        /* reverse direction? */
+        if (options->reverse && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
+            direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
+
+        cache_packet(chunk, SEND, direction);
+        break;
+
+    case MAC_MODE:
+        dbg(2, "processing mac mode...");
+        if (pkthdr->caplen < sizeof(*eth_hdr)) {
+            dbg(2, "capture length too short for mac mode processing");
+            cache_packet(chunk, SEND, options->nonip);
+            break;
+        }
+
+        eth_hdr = (eth_hdr_t *)pktdata;
+        if (options->pairs > 1 || options->shards > 0)
+            assign_flow(packetnum, mac_hash(eth_hdr));
+
+        direction = macset_lookup(options->macset, (u_char *)eth_hdr->ether_shost);
+
+        /* reverse direction? */
+        if (options->reverse && (direction == TCPR_DIR_C2S || direction == TCPR_DIR_S2C))
+            direction = direction == TCPR_DIR_C2S ? TCPR_DIR_S2C : TCPR_DIR_C2S;
+
+        cache_packet(chunk, SEND, direction);
+        break;
+
+    case AUTO_MODE:
+        dbg(2, "processing first pass of auto mode...");
+        /* first run through in auto mode: create tree */
+        if (options->automode != FIRST_MODE) {
+            if (ip_hdr) {
+                host = add_tree_ipv4(chunk->tree, ip_hdr->ip_src.s_addr, pktdata, (int)pkthdr->caplen, datalink);
+            } else if (ip6_hdr) {
+                host = add_tree_ipv6(chunk->tree, &ip6_hdr->ip_src, pktdata, (int)pkthdr->caplen, datalink);
+            }
+        } else {
+            if (ip_hdr) {
+                host = add_tree_first_ipv4(chunk->tree, pktdata, (int)pkthdr->caplen, datalink);
+            } else if (ip6_hdr) {
+                host = add_tree_first_ipv6(chunk->tree, pktdata, (int)pkthdr->caplen, datalink);
+            }
+        }
+
+        if (options->single_pass)
+            defer_cache(DEFER_HOST + host);
+        break;
+
+    case ROUTER_MODE:
+        /*
+         * second run through in auto mode: create route
+         * based cache
+         */
+        dbg(2, "processing second pass of auto: router mode...");
+        if (ip_hdr) {
+            cache_packet(chunk, SEND, check_ip_tree(options->nonip, ip_hdr->ip_src.s_addr));
+        } else {
+            cache_packet(chunk, SEND, check_ip6_tree(options->nonip, &ip6_hdr->ip_src));
+        }
+        break;
+
+    case BRIDGE_MODE:
+        /*
+         * second run through in auto mode: create bridge
+         * based cache
+         */
+        dbg(2, "processing second pass of auto: bridge mode...");
+        if (ip_hdr) {
+            cache_packet(chunk, SEND, check_ip_tree(DIR_UNKNOWN, ip_hdr->ip_src.s_addr));
+        } else {
+            cache_packet(chunk, SEND, check_ip6_tree(DIR_UNKNOWN, &ip6_hdr->ip_src));
+        }
+        break;
+
+    case SERVER_MODE:
+        /*
+         * second run through in auto mode: create bridge
+         * where unknowns are servers
+         */
+        dbg(2, "processing second pass of auto: server mode...");
+        if (ip_hdr) {
+            cache_packet(chunk, SEND, check_ip_tree(DIR_SERVER, ip_hdr->ip_src.s_addr));
+        } else {
+            cache_packet(chunk, SEND, check_ip6_tree(DIR_SERVER, &ip6_hdr->ip_src));
+        }
+        break;
+
+    case CLIENT_MODE:
+        /*
+         * second run through in auto mode: create bridge
+         * where unknowns are clients
+         */
+        dbg(2, "processing second pass of auto: client mode...");
+        if (ip_hdr) {
+            cache_packet(chunk, SEND, check_ip_tree(DIR_CLIENT, ip_hdr->ip_src.s_addr));
+        } else {
+            cache_packet(chunk, SEND, check_ip6_tree(DIR_CLIENT, &ip6_hdr->ip_src));
+        }
+        break;
+
+    case PORT_MODE:
+        /*
+         * process ports based on their destination port
+         */
+        dbg(2, "processing port mode...");
+        cache_packet(chunk, SEND, check_dst_port(ip_hdr, ip6_hdr, (int)pkthdr->caplen - l2len));
+        break;
+
+    case FIRST_MODE:
+        /*
+         * First packet mode, looks at each host and picks clients
+         * by the ones which send the first packet in a session
+         */
+        dbg(2, "processing second pass of auto: first packet mode...");
+        if (ip_hdr) {
+            cache_packet(chunk, SEND, check_ip_tree(DIR_UNKNOWN, ip_hdr->ip_src.s_addr));
+        } else {
+            cache_packet(chunk, SEND, check_ip6_tree(DIR_UNKNOWN, &ip6_hdr->ip_src));
+        }
+        break;
+
+    default:
+        errx(-1, "Whoops!  What mode are we in anyways? %d", options->mode);
+    }
+#ifdef ENABLE_VERBOSE
+    if (options->verbose)
+        tcpdump_print(&tcpprep->tcpdump, pkthdr, pktdata);
+#endif
+}
+
+/**
+ * \brief a chunk to classify packets one at a time with
+ * tcpprep_chunk_packet(), in the mode the tcpprep global is in
+ *
+ * Auto mode has to have been through its first pass already, see
+ * tcpprep_auto_done().
+ */
+tcpprep_chunk_t *
+tcpprep_chunk_open(void)
+{
+    tcpprep_chunk_t *chunk;
+
+    assert(tcpprep->options->mode != AUTO_MODE);
+
+    chunk = (tcpprep_chunk_t *)safe_malloc(sizeof(tcpprep_chunk_t));
+    chunk->tree = &treeroot;
+    chunk->ipbuff = safe_malloc(MAXPACKET);
+    chunk->direct = true;
+
+    return chunk;
+}
+
+/**
+ * \brief what the next packet is: TCPR_DIR_C2S, TCPR_DIR_S2C or
+ * TCPR_DIR_NOSEND, like check_cache() would say with a cache file
+ */
+tcpr_dir_t
+tcpprep_chunk_packet(tcpprep_chunk_t *chunk, struct pcap_pkthdr *pkthdr, const u_char *pktdata, int datalink)
+{
+    /* the primary interface, in case process_packet() says nothing */
+    chunk->result = TCPR_DIR_C2S;
+    process_packet(chunk, pkthdr, pktdata, datalink, ++chunk->packets);
+
+    return chunk->result;
+}
+
+void
+tcpprep_chunk_close(tcpprep_chunk_t *chunk)
+{
+    if (chunk == NULL)
+        return;
+
+    safe_free(chunk->ipbuff);
+    safe_free(chunk->regex_memo);
+    safe_free(chunk);
+}
@@ -0,0 +1,46 @@
+/* $Id$ */
+
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "tcpprep_api.h"
+#include "tree.h"
+
+/*
+ * The classification behind tcpprep: what a packet is, client, server or
+ * not sent, by the mode of the tcpprep_opt_t of the tcpprep global.
+ * tcpprep runs it over whole files into a cache; tcprewrite asks it about
+ * one packet at a time with a tcpprep_chunk_t, so it can split traffic
+ * without a cache file.
+ */
+
+typedef struct tcpprep_chunk_s tcpprep_chunk_t;
+
+extern tcpprep_t *tcpprep;
+extern tcpr_data_tree_t treeroot;
+
+tcpprep_mode_t tcpprep_automode(const char *name);
+COUNTER tcpprep_process_packets(pcap_t *pcap);
+void tcpprep_auto_done(void);
+
+tcpprep_chunk_t *tcpprep_chunk_open(void);
+tcpr_dir_t tcpprep_chunk_packet(tcpprep_chunk_t *chunk, struct pcap_pkthdr *pkthdr, const u_char *pktdata,
+                                int datalink);
+void tcpprep_chunk_close(tcpprep_chunk_t *chunk);
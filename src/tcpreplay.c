@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #ifdef HAVE_FTS_H
 #include <fts.h>
 #endif
@@ -37,13 +38,22 @@
 #ifdef TCPREPLAY_EDIT
 #include "tcpreplay_edit_opts.h"
 #include "tcpedit/tcpedit.h"
-#include "tcpedit/fuzzing.h"
 tcpedit_t *tcpedit;
+#ifdef ENABLE_FRAGROUTE
+#include "fragroute/fragroute.h"
+fragroute_t *frag_ctx; /* --fragroute, applied at preload, see preload_fragroute() */
+#endif
 #else
 #include "tcpreplay_opts.h"
 #endif
 
 #include "send_packets.h"
+#include "preload_lz4.h"
+#include "probe.h"
+#include "inject.h"
+#include "rss.h"
+#include "fleet.h"
+#include "breakdown.h"
 #include "signal_handler.h"
 
 #ifdef DEBUG
@@ -53,6 +63,19 @@ int debug = 0;
 tcpreplay_t *ctx;
 
 static void flow_stats(const tcpreplay_t *tcpr_ctx);
+static void preload_report(const tcpreplay_t *tcpr_ctx);
+static void timing_stats(const tcpreplay_t *tcpr_ctx, const sendpacket_t *sp);
+static void profile_stats(const tcpreplay_t *tcpr_ctx, const sendpacket_t *sp);
+static void digest_stats(const sendpacket_t *sp);
+static void mem_stats(const char *when);
+#ifdef ENABLE_TXSTAMP
+static void txstamp_stats(const sendpacket_t *sp);
+#endif
+#ifdef ENABLE_RXMATCH
+static void rxmatch_stats(const rxmatch_t *rm);
+#endif
+static void probe_stats(const tcpreplay_t *tcpr_ctx);
+static void breakdown_stats(const tcpreplay_t *tcpr_ctx);
 
 int
 main(int argc, char *argv[])
@@ -96,6 +119,23 @@ main(int argc, char *argv[])
         errx(-1, "Unable to edit packets given options:\n%s",
                tcpedit_geterr(tcpedit));
     }
+
+    /* the interfaces were set up for it by tcpreplay_post_args() */
+    if (ctx->options->csum_offload)
+        tcpedit_set_csum_offload(tcpedit, true);
+
+#ifdef ENABLE_FRAGROUTE
+    if (HAVE_OPT(FRAGROUTE)) {
+        char ebuf[FRAGROUTE_ERRBUF_LEN];
+
+        /* the fragments are made once, so the edits have to come out the same every loop */
+        if (!tcpedit_is_repeatable(tcpedit) || ctx->options->csum_offload)
+            errx(-1, "%s", "--fragroute can't be used with --fuzz-seed or --csum-offload");
+
+        if ((frag_ctx = fragroute_init(65535, tcpedit_get_output_dlt(tcpedit), OPT_ARG(FRAGROUTE), ebuf)) == NULL)
+            errx(-1, "Unable to initialize fragroute: %s", ebuf);
+    }
+#endif
 #endif
 
     if (ctx->options->preload_pcap && ! HAVE_OPT(QUIET)) {
@@ -109,7 +149,7 @@ main(int argc, char *argv[])
 #ifdef HAVE_FTS_H
         struct stat statbuf;
 
-        if (!strcmp(argv[i], "-")) {
+        if (!strcmp(argv[i], "-") || remote_is_url(argv[i]) || shm_pipe_path(argv[i])) {
             tcpreplay_add_pcapfile(ctx, argv[i]);
             continue;
         }
@@ -150,28 +190,149 @@ main(int argc, char *argv[])
 #endif
     }
 
+#ifdef HAVE_PTHREAD
+    if (HAVE_OPT(FOLLOW_DIR)) {
+        if (ctx->options->source_cnt == 0 && !HAVE_OPT(QUIET))
+            notice("Waiting for the first file in %s", OPT_ARG(FOLLOW_DIR));
+
+        if (tcpreplay_follow_dir(ctx, OPT_ARG(FOLLOW_DIR)) < 0)
+            errx(-1, "%s", tcpreplay_geterr(ctx));
+    }
+#endif
+
+#ifndef TCPREPLAY_EDIT
+    /* stdin and shared memory pipes can only be read once, so later loops are sent from memory */
+    if (!ctx->options->preload_pcap && ctx->options->loop != 1) {
+        for (i = 0; i < ctx->options->source_cnt; i++) {
+            const char *path = ctx->options->sources[i].filename;
+
+            if (ctx->options->sources[i].type == source_filename && (strcmp(path, "-") == 0 || shm_pipe_path(path))) {
+                if (!HAVE_OPT(QUIET))
+                    notice("Caching %s for --loop", strcmp(path, "-") == 0 ? "STDIN" : path);
+                ctx->options->preload_pcap = true;
+                break;
+            }
+        }
+    }
+#endif
+
     /*
      * Setup up the file cache, if required
      */
-    if (ctx->options->preload_pcap) {
-        /* Initialize each of the file cache structures */
+    if (ctx->options->preload_pcap && !ctx->options->preload_stream) {
+        preload_report(ctx);
+        preload_pcap_files(ctx);
+    }
+
+    if (ctx->options->unique_pool_size && ctx->unique_hosts.cnt > ctx->options->unique_pool_size - 2)
+        warnx("--unique-ip-pool has fewer addresses than the %u hosts of the pcaps, so loops will reuse some",
+              ctx->unique_hosts.cnt);
+
+    if (ctx->rss != NULL && !HAVE_OPT(QUIET))
+        rss_report(ctx->rss);
+
+#ifdef ENABLE_FLEET
+    if (ctx->fleet != NULL && !HAVE_OPT(QUIET))
+        notice("Fleet of %u streams from %d pcaps on %d threads", ctx->fleet->cnt, ctx->fleet->pcaps,
+               ctx->options->threads > 1 ? ctx->options->threads : 1);
+#endif
+
+    if (ctx->options->preload_dedup && !ctx->options->preload_stream && !HAVE_OPT(QUIET)) {
+        COUNTER bytes = 0, saved = 0;
+
         for (i = 0; i < ctx->options->source_cnt; i++) {
-            ctx->options->file_cache[i].index = i;
-            ctx->options->file_cache[i].cached = FALSE;
-            ctx->options->file_cache[i].packet_cache = NULL;
-            /* preload our pcap file */
-            preload_pcap_file(ctx, i);
+            bytes += ctx->options->file_cache[i].dedup_bytes;
+            saved += ctx->options->file_cache[i].dedup_saved;
         }
+        if (bytes > 0)
+            notice("Preload dedup: " COUNTER_SPEC " of " COUNTER_SPEC " packet bytes stored, %.2fx",
+                   bytes - saved,
+                   bytes,
+                   bytes > saved ? (double)bytes / (double)(bytes - saved) : 1.0);
     }
 
-#ifdef TCPREPLAY_EDIT
-    /* fuzzing init */
-    fuzzing_init(tcpedit->fuzz_seed, tcpedit->fuzz_factor);
+    if ((ctx->options->preload_filter != NULL || ctx->options->preload_sample > 1) && !ctx->options->preload_stream &&
+        !HAVE_OPT(QUIET)) {
+        COUNTER kept = 0, dropped = 0;
+
+        for (i = 0; i < ctx->options->source_cnt; i++) {
+            kept += ctx->options->file_cache[i].filter_kept;
+            dropped += ctx->options->file_cache[i].filter_dropped;
+        }
+        notice("Preload subset: " COUNTER_SPEC " of " COUNTER_SPEC " packets cached", kept, kept + dropped);
+    }
+
+#ifdef ENABLE_PRELOAD_LZ4
+    if (ctx->options->preload_lz4 && !HAVE_OPT(QUIET)) {
+        COUNTER raw = 0, comp = 0;
+
+        for (i = 0; i < ctx->options->source_cnt; i++) {
+            if (ctx->options->file_cache[i].lz4 != NULL) {
+                raw += ctx->options->file_cache[i].lz4->raw_bytes;
+                comp += ctx->options->file_cache[i].lz4->comp_bytes;
+            }
+        }
+        if (comp > 0)
+            notice("Preload LZ4: " COUNTER_SPEC " packet bytes stored in " COUNTER_SPEC ", %.2fx",
+                   raw,
+                   comp,
+                   (double)raw / (double)comp);
+    }
 #endif
 
+    if (ctx->options->gso && !HAVE_OPT(QUIET)) {
+        COUNTER packets = 0, frames = 0;
+
+        for (i = 0; i < ctx->options->source_cnt; i++) {
+            packets += ctx->options->file_cache[i].gso_packets;
+            frames += ctx->options->file_cache[i].gso_frames;
+        }
+        notice("GSO: " COUNTER_SPEC " packets coalesced into " COUNTER_SPEC " super-frames", packets, frames);
+    }
+
+    if (ctx->inject != NULL && !HAVE_OPT(QUIET)) {
+        char buf[1024];
+        size_t n = inject_summary(ctx->inject, buf, sizeof(buf));
+
+        /* notice() ends the line itself */
+        if (n > 0 && buf[n - 1] == '\n')
+            buf[n - 1] = '\0';
+        notice("Inject: %s picked for the %s on %s:\n%s",
+               sendpacket_get_method(ctx->intf1),
+               ctx->inject->by_cpu ? "least CPU a packet" : "most packets a second",
+               ctx->options->intf1_name,
+               buf);
+    }
+
+    if (tcpr_huge_enabled() && !HAVE_OPT(QUIET)) {
+        char buf[256];
+
+        tcpr_huge_report(buf, sizeof(buf));
+        notice("Huge pages: %s", buf);
+    }
+
+    if (HAVE_OPT(WARMUP) || HAVE_OPT(READY_FILE) || HAVE_OPT(WAIT_START)) {
+        if ((rcode = tcpreplay_warmup(ctx)) < 0)
+            errx(-1, "%s", tcpreplay_geterr(ctx));
+        else if (rcode == 1)
+            warnx("%s", tcpreplay_getwarn(ctx));
+
+        if (!HAVE_OPT(QUIET))
+            notice("Warm-up: " COUNTER_SPEC " bytes faulted in, " COUNTER_SPEC " of them locked",
+                   ctx->warmup_touched,
+                   ctx->warmup_locked);
+    }
+
+    if (ctx->options->mem_stats)
+        mem_stats("Memory at start");
+
     /* init the signal handlers */
     init_signal_handlers();
 
+    if ((HAVE_OPT(READY_FILE) || HAVE_OPT(WAIT_START)) &&
+        signal_ready(HAVE_OPT(READY_FILE) ? OPT_ARG(READY_FILE) : NULL, HAVE_OPT(WAIT_START)) < 0)
+        exit(-1);
+
     /* main loop */
     rcode = tcpreplay_replay(ctx);
 
@@ -187,37 +348,123 @@ main(int argc, char *argv[])
 
     if (ctx->stats.bytes_sent > 0) {
         char buf[1024];
+        /* with one interface its flows are the totals already printed */
+        bool split = ctx->intf2 != NULL;
 
         packet_stats(&ctx->stats);
         if (ctx->options->flow_stats)
             flow_stats(ctx);
-        sendpacket_getstat(ctx->intf1, buf, sizeof(buf));
+        sendpacket_getstat(ctx->intf1, buf, sizeof(buf), split);
         printf("%s", buf);
         if (ctx->intf2 != NULL) {
-            sendpacket_getstat(ctx->intf2, buf, sizeof(buf));
+            sendpacket_getstat(ctx->intf2, buf, sizeof(buf), split);
+            printf("%s", buf);
+        }
+        for (i = 0; i < ctx->options->pair_intf_cnt; i++) {
+            sendpacket_getstat(ctx->pair_intf[i], buf, sizeof(buf), split);
             printf("%s", buf);
         }
+        if (ctx->options->timing_stats) {
+            timing_stats(ctx, ctx->intf1);
+            if (ctx->intf2 != NULL)
+                timing_stats(ctx, ctx->intf2);
+            for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+                timing_stats(ctx, ctx->pair_intf[i]);
+        }
+        if (ctx->options->profile) {
+            profile_stats(ctx, ctx->intf1);
+            if (ctx->intf2 != NULL)
+                profile_stats(ctx, ctx->intf2);
+            for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+                profile_stats(ctx, ctx->pair_intf[i]);
+        }
+        if (ctx->options->digest) {
+            digest_stats(ctx->intf1);
+            if (ctx->intf2 != NULL)
+                digest_stats(ctx->intf2);
+            for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+                digest_stats(ctx->pair_intf[i]);
+        }
+#ifdef ENABLE_TXSTAMP
+        if (ctx->options->tx_timestamps) {
+            txstamp_stats(ctx->intf1);
+            if (ctx->intf2 != NULL)
+                txstamp_stats(ctx->intf2);
+            for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+                txstamp_stats(ctx->pair_intf[i]);
+        }
+#endif
+#ifdef ENABLE_RXMATCH
+        if (ctx->rxmatch != NULL)
+            rxmatch_stats(ctx->rxmatch);
+#endif
+        if (ctx->probe != NULL)
+            probe_stats(ctx);
+        if (ctx->breakdown != NULL)
+            breakdown_stats(ctx);
+        if (ctx->options->rate_adapt_ms != 0) {
+            if (ctx->rate_adapt_bps != 0)
+                printf("Rate adapt: %.2f Mbps was the highest rate without drops\n",
+                       (double)ctx->rate_adapt_bps / 1000000.0);
+            else
+                printf("Rate adapt: no rate without drops found\n");
+        }
     }
 
-#ifdef TIMESTAMP_TRACE
-    dump_timestamp_trace_array(&ctx->stats.start_time, &ctx->stats.end_time,
-            ctx->options->speed.speed);
-#endif
+    if (ctx->options->mem_stats)
+        mem_stats("Memory at end");
+
 #ifdef TCPREPLAY_EDIT
     tcpedit_close(&tcpedit);
+#ifdef ENABLE_FRAGROUTE
+    if (frag_ctx != NULL)
+        fragroute_close(frag_ctx);
+#endif
 #endif
     tcpreplay_close(ctx);
     restore_stdin();
     return 0;
 }   /* main() */
 
+/**
+ * Print how much memory preloading is expected to take, always with
+ * --cache-memory and otherwise when it's more than the host has
+ */
+static void
+preload_report(const tcpreplay_t *tcpr_ctx)
+{
+    const tcpreplay_opt_t *options = tcpr_ctx->options;
+    COUNTER bytes, ram = 0;
+    int unindexed;
+
+    if (HAVE_OPT(QUIET) || options->cache_image)
+        return;
+
+    bytes = preload_footprint((tcpreplay_t *)tcpr_ctx, &unindexed);
+#ifdef _SC_PHYS_PAGES
+    if (sysconf(_SC_PHYS_PAGES) > 0 && sysconf(_SC_PAGESIZE) > 0)
+        ram = (COUNTER)sysconf(_SC_PHYS_PAGES) * (COUNTER)sysconf(_SC_PAGESIZE);
+#endif
+
+    if (options->cache_memory != 0) {
+        notice("Preload footprint: %sabout %.1f MB, of which up to %.1f MB in RAM and the rest sent from the file",
+               unindexed ? "at least " : "",
+               (double)bytes / (1024.0 * 1024.0),
+               (double)options->cache_memory / (1024.0 * 1024.0));
+    } else if (ram != 0 && bytes > ram && !options->mmap_pcap) {
+        warnx("Preload footprint: %sabout %.1f MB, more than the %.1f MB of RAM of this host; see --cache-memory",
+              unindexed ? "at least " : "",
+              (double)bytes / (1024.0 * 1024.0),
+              (double)ram / (1024.0 * 1024.0));
+    }
+}
+
 /**
  * Print various flow statistics
  */
 static void flow_stats(const tcpreplay_t *tcpr_ctx)
 {
-    struct timeval diff;
-    COUNTER diff_us;
+    COUNTER diff_us = 0;
     const tcpreplay_stats_t *stats = &tcpr_ctx->stats;
     const tcpreplay_opt_t *options = tcpr_ctx->options;
     COUNTER flows_total = stats->flows;
@@ -228,8 +475,8 @@ static void flow_stats(const tcpreplay_t *tcpr_ctx)
     COUNTER flows_sec = 0;
     u_int32_t flows_sec_100ths = 0;
 
-    timersub(&stats->end_time, &stats->start_time, &diff);
-    diff_us = TIMEVAL_TO_MICROSEC(&diff);
+    if (stats->end_time_ns > stats->start_time_ns)
+        diff_us = (stats->end_time_ns - stats->start_time_ns) / 1000;
 
     if (!flows_total || !tcpr_ctx->iteration)
         return;
@@ -279,4 +526,179 @@ static void flow_stats(const tcpreplay_t *tcpr_ctx)
                 flow_non_flow_packets);
 }
 
+/**
+ * Print the --timing-stats histograms of an interface
+ */
+static void timing_stats(const tcpreplay_t *tcpr_ctx, const sendpacket_t *sp)
+{
+    char buf[256];
+
+    printf("Timing for %s (timer %s):\n", sp->device, tcpreplay_accurate_name(tcpr_ctx->options->accurate));
+    tcpr_hist_summary(&sp->late, buf, sizeof(buf));
+    printf("\tLateness:        %s\n", buf);
+    tcpr_hist_summary(&sp->gap, buf, sizeof(buf));
+    printf("\tGap error:       %s\n", buf);
+    tcpr_hist_summary(&sp->overshoot, buf, sizeof(buf));
+    printf("\tSleep overshoot: %s\n", buf);
+    if (sp->batch.count > 0)
+        printf("\tBatch size:      " COUNTER_SPEC " batches, mean %.1f, p50 %" PRIu64 ", p99 %" PRIu64 ", max %" PRIu64
+               " packets\n",
+               sp->batch.count,
+               (double)sp->batch.sum / (double)sp->batch.count,
+               tcpr_hist_percentile(&sp->batch, 50.0),
+               tcpr_hist_percentile(&sp->batch, 99.0),
+               sp->batch.max);
+}
+
+/**
+ * Print the --profile breakdown of an interface
+ */
+static void profile_stats(const tcpreplay_t *tcpr_ctx, const sendpacket_t *sp)
+{
+    char buf[256];
+    u_int64_t wall_ns = 0;
+
+    if (tcpr_ctx->stats.end_time_ns > tcpr_ctx->stats.start_time_ns)
+        wall_ns = tcpr_ctx->stats.end_time_ns - tcpr_ctx->stats.start_time_ns;
+
+    tcpr_prof_summary(&sp->profile, wall_ns, buf, sizeof(buf));
+    printf("Profile for %s: %s\n", sp->device, buf);
+}
+
+/**
+ * Print the --digest of an interface
+ */
+static void digest_stats(const sendpacket_t *sp)
+{
+    char buf[256];
+
+    if (sp->digest == NULL)
+        return;
+
+    tcpr_digest_summary(sp->digest, buf, sizeof(buf));
+    printf("Digest for %s: %s\n", sp->device, buf);
+}
+
+/**
+ * Print the --mem-stats allocations by subsystem
+ */
+static void mem_stats(const char *when)
+{
+    char buf[1024];
+
+    tcpr_mem_report(buf, sizeof(buf));
+    printf("%s:\n%s", when, buf);
+}
+
+#ifdef ENABLE_TXSTAMP
+/**
+ * Print what the --tx-timestamps of an interface showed
+ */
+static void txstamp_stats(const sendpacket_t *sp)
+{
+    char buf[768];
+
+    if (sp->txstamp == NULL)
+        return;
+
+    txstamp_summary(sp->txstamp, buf, sizeof(buf));
+    printf("TX timestamps for %s:\n%s", sp->device, buf);
+}
+#endif
+
+#ifdef ENABLE_RXMATCH
+/**
+ * Print what came back on the --rx-interface
+ */
+static void rxmatch_stats(const rxmatch_t *rm)
+{
+    char buf[768];
+
+    rxmatch_summary(rm, buf, sizeof(buf));
+    printf("Returned on %s:\n%s", rm->device, buf);
+}
+#endif
+
+/**
+ * Print how many --probe-rate probes went out and, with --rx-interface,
+ * what came of them
+ */
+static void probe_stats(const tcpreplay_t *tcpr_ctx)
+{
+    const tcpr_probe_t *pr = tcpr_ctx->probe;
+#ifdef ENABLE_RXMATCH
+    char buf[768];
+
+    if (tcpr_ctx->rxmatch != NULL) {
+        rxmatch_probe_summary(tcpr_ctx->rxmatch, pr->sent, buf, sizeof(buf));
+        printf("Probes returned on %s:\n%s", tcpr_ctx->rxmatch->device, buf);
+        return;
+    }
+#endif
+    if (pr->ready)
+        printf("Probes: " COUNTER_SPEC " sent\n", pr->sent);
+    else
+        printf("%s", "Probes: none sent, there was no IPv4 packet to model them on\n");
+}
+
+/**
+ * Print the --stats-breakdown of the interfaces, files and loops
+ */
+static void breakdown_stats(const tcpreplay_t *tcpr_ctx)
+{
+    const tcpr_breakdowns_t *bd = tcpr_ctx->breakdown;
+    const tcpreplay_opt_t *options = tcpr_ctx->options;
+    tcpr_breakdown_t b;
+    COUNTER loop, first = 1;
+    char buf[512];
+    int i;
+
+    printf("Breakdown by interface:\n");
+    breakdown_interface(tcpr_ctx, tcpr_ctx->intf1, &b);
+    breakdown_summary(&b, buf, sizeof(buf));
+    printf("\t%s: %s\n", tcpr_ctx->intf1->device, buf);
+    if (tcpr_ctx->intf2 != NULL) {
+        breakdown_interface(tcpr_ctx, tcpr_ctx->intf2, &b);
+        breakdown_summary(&b, buf, sizeof(buf));
+        printf("\t%s: %s\n", tcpr_ctx->intf2->device, buf);
+    }
+    for (i = 0; i < options->pair_intf_cnt; i++) {
+        breakdown_interface(tcpr_ctx, tcpr_ctx->pair_intf[i], &b);
+        breakdown_summary(&b, buf, sizeof(buf));
+        printf("\t%s: %s\n", tcpr_ctx->pair_intf[i]->device, buf);
+    }
+
+    if (options->mix_cnt == 0) {
+        printf("Breakdown by file:\n");
+        for (i = 0; i < options->source_cnt; i++) {
+            if (bd->sources[i].passes == 0)
+                continue;
+
+            breakdown_summary(&bd->sources[i], buf, sizeof(buf));
+            if (options->dualfile)
+                printf("\t%s + %s: " COUNTER_SPEC " passes, %s\n",
+                       options->sources[i].filename,
+                       options->sources[i + 1].filename,
+                       bd->sources[i].passes,
+                       buf);
+            else
+                printf("\t%s: " COUNTER_SPEC " passes, %s\n", options->sources[i].filename, bd->sources[i].passes, buf);
+        }
+    }
+
+    if (bd->loop_cnt == 0)
+        return;
+
+    if (bd->loop_cnt > BREAKDOWN_LOOPS) {
+        first = bd->loop_cnt - BREAKDOWN_LOOPS + 1;
+        printf("Breakdown by loop, the last %d of " COUNTER_SPEC ":\n", BREAKDOWN_LOOPS, bd->loop_cnt);
+    } else {
+        printf("Breakdown by loop:\n");
+    }
+    for (loop = first; loop <= bd->loop_cnt; loop++) {
+        breakdown_summary(&bd->loops[(loop - 1) % BREAKDOWN_LOOPS], buf, sizeof(buf));
+        printf("\t" COUNTER_SPEC ": %s\n", loop, buf);
+    }
+}
+
 /* vim: set tabstop=8 expandtab shiftwidth=4 softtabstop=4: */
@@ -33,8 +33,26 @@
 #include <stdarg.h>
 
 #include "tcpreplay_api.h"
+#include "checkpoint.h"
+#include "send_threads.h"
+#include "stats_export.h"
+#include "rate_adapt.h"
+#include "nic_threads.h"
+#include "warmup.h"
+#include "probe.h"
+#include "inject.h"
+#include "breakdown.h"
+#include "pkt_source.h"
+#include "playlist.h"
+#include "follow.h"
+#include "fleet.h"
+#include "preload_lz4.h"
+#include "rss.h"
 #include "send_packets.h"
+#include "generator.h"
 #include "replay.h"
+#include "sleep.h"
+#include "common/probes.h"
 
 #ifdef TCPREPLAY_EDIT
 #include "tcpreplay_edit_opts.h"
@@ -88,9 +106,13 @@ tcpreplay_init()
     /* replay packets only once */
     ctx->options->loop = 1;
 
+    /* send every shard of a tcpprep cache */
+    ctx->options->shard = -1;
+
     /* Default mode is to replay pcap once in real-time */
     ctx->options->speed.mode = speed_multiplier;
     ctx->options->speed.multiplier = 1.0;
+    ctx->options->speed.late_ns = LATE_THRESHOLD_DEFAULT;
 
     /* Set the default timing method */
     ctx->options->accurate = accurate_gtod;
@@ -107,9 +129,16 @@ tcpreplay_init()
     /* default unique-loops */
     ctx->options->unique_loops = 1.0;
 
+    /* send from the NUMA node of the NIC */
+    ctx->options->numa_node = TCPR_NUMA_AUTO;
+
 #ifdef ENABLE_VERBOSE
     /* clear out tcpdump struct */
     ctx->options->tcpdump = (tcpdump_t *)safe_malloc(sizeof(tcpdump_t));
+#ifdef HAVE_PTHREAD
+    /* don't let the decoder hold up sending */
+    ctx->options->tcpdump->async = true;
+#endif
 #endif
 
     if (fcntl(STDERR_FILENO, F_SETFL, O_NONBLOCK) < 0)
@@ -133,6 +162,181 @@ tcpreplay_init()
     return ctx;
 }
 
+/**
+ * makes sure there is an interface pair for every pair in the tcpprep cache
+ */
+static int
+check_cache_pairs(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int pairs = 1 + options->pair_intf_cnt / 2;
+
+    if (options->cache_pairs > pairs) {
+        tcpreplay_seterr(ctx, "tcpprep cache file uses %d interface pairs, but only %d were given.  See --intf-pair",
+                options->cache_pairs, pairs);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * makes sure the tcpprep cache has the shard given by --shard.  Without
+ * --shard every packet is sent and the shard map is ignored
+ */
+static int
+check_cache_shard(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+
+    if (options->shard < 0) {
+        options->cacheshards = NULL;
+        return 0;
+    }
+
+    if (options->cacheshards == NULL) {
+        tcpreplay_seterr(ctx, "%s", "--shard requires a tcpprep cache file created with --shards");
+        return -1;
+    }
+
+    if (options->shard >= options->cache_shards) {
+        tcpreplay_seterr(ctx, "--shard=%d is not one of the %d shards in the tcpprep cache file",
+                options->shard, options->cache_shards);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief pin this thread to the CPUs to send from and set up --hugepages
+ *
+ * Done before opening the interfaces and preloading, so the AF_XDP UMEM,
+ * the packet cache and the flow tables are allocated (and first touched)
+ * on the right NUMA node.
+ */
+static int
+numa_setup(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    bool automatic = options->numa_node == TCPR_NUMA_AUTO;
+    int cnt = 0;
+
+    if (automatic)
+        options->numa_node = tcpr_numa_node(options->intf1_name);
+
+    if (options->cpu_list != NULL) {
+        if ((cnt = tcpr_cpu_list_parse(options->cpu_list, ctx->cpus, TCPR_CPU_MAX)) <= 0) {
+            tcpreplay_seterr(ctx, "invalid CPU list: %s", options->cpu_list);
+            return -1;
+        }
+    } else if (options->numa_node >= 0) {
+        if ((cnt = tcpr_numa_cpus(options->numa_node, ctx->cpus, TCPR_CPU_MAX)) < 0) {
+            if (!automatic) {
+                tcpreplay_seterr(ctx, "unknown NUMA node: %d", options->numa_node);
+                return -1;
+            }
+            cnt = 0;
+        }
+    }
+    ctx->cpu_cnt = cnt;
+
+    /* the OS may not let us have them, which only matters when asked for */
+    if (cnt > 0 && tcpr_cpus_pin(ctx->cpus, cnt) < 0) {
+        if (!automatic || options->cpu_list != NULL)
+            tcpreplay_setwarn(ctx, "Unable to run on the CPUs of %s", options->cpu_list ? options->cpu_list : "the NUMA node");
+        ctx->cpu_cnt = 0;
+    }
+    dbgx(1, "NUMA node %d, sending from %d CPUs", options->numa_node, ctx->cpu_cnt);
+
+    if (options->hugepages)
+        tcpr_huge_init(options->numa_node);
+
+    return 0;
+}
+
+/**
+ * \brief parse SEC[.FRAC] into nanoseconds
+ *
+ * Done by hand rather than with strtod(), which can't hold today's time
+ * to the nanosecond.
+ */
+static int
+parse_seconds(const char *arg, u_int64_t *ns)
+{
+    u_int64_t sec = 0, frac = 0, scale = 1000000000ULL;
+    const char *p = arg;
+
+    if (!isdigit((unsigned char)*p))
+        return -1;
+
+    for (; isdigit((unsigned char)*p); p++) {
+        if (sec > (UINT64_MAX / 1000000000ULL - 9) / 10)
+            return -1;
+        sec = sec * 10 + (u_int64_t)(*p - '0');
+    }
+
+    if (*p == '.') {
+        for (p++; isdigit((unsigned char)*p); p++) {
+            if (scale > 1) {
+                scale /= 10;
+                frac += (u_int64_t)(*p - '0') * scale;
+            }
+        }
+    }
+
+    if (*p != '\0')
+        return -1;
+
+    *ns = sec * 1000000000ULL + frac;
+    return 0;
+}
+
+/**
+ * \brief parse --start-at SEC[.FRAC] into nanoseconds
+ */
+static int
+parse_start_at(const char *arg, u_int64_t *ns)
+{
+    if (parse_seconds(arg, ns) < 0)
+        return -1;
+
+    return *ns ? 0 : -1;
+}
+
+/**
+ * \brief parse --start-time or --end-time [[HH:]MM:]SS[.FRAC] into nanoseconds
+ */
+static int
+parse_slice_time(const char *arg, u_int64_t *ns)
+{
+    u_int64_t minutes = 0;
+    const char *p = arg;
+    const char *colon;
+    int fields = 0;
+
+    while ((colon = strchr(p, ':')) != NULL) {
+        char *end;
+        unsigned long value;
+
+        if (++fields > 2 || !isdigit((unsigned char)*p))
+            return -1;
+
+        value = strtoul(p, &end, 10);
+        if (end != colon || value >= 1000000)
+            return -1;
+
+        minutes = minutes * 60 + value;
+        p = colon + 1;
+    }
+
+    if (parse_seconds(p, ns) < 0 || *ns >= UINT64_MAX / 2)
+        return -1;
+
+    *ns += minutes * 60 * 1000000000ULL;
+    return 0;
+}
+
 /**
  * \brief Parses the GNU AutoOpts options for tcpreplay
  *
@@ -166,13 +370,65 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
 
     options->loop = OPT_VALUE_LOOP;
     options->loopdelay_ms = OPT_VALUE_LOOPDELAY_MS;
+    if (HAVE_OPT(LOOP_SEAMLESS)) {
+        /* the wrap around needs the whole file in memory */
+        options->loop_seamless = true;
+        options->preload_pcap = true;
+    }
 
     if (HAVE_OPT(LIMIT))
         options->limit_send = OPT_VALUE_LIMIT;
 
+    if (HAVE_OPT(SHARD))
+        options->shard = OPT_VALUE_SHARD;
+
+    if (HAVE_OPT(START_AT) && parse_start_at(OPT_ARG(START_AT), &options->start_at_ns) < 0) {
+        tcpreplay_seterr(ctx, "invalid --start-at time: %s", OPT_ARG(START_AT));
+        ret = -1;
+        goto out;
+    }
+
     if (HAVE_OPT(DURATION))
         options->limit_time = OPT_VALUE_DURATION;
 
+    if (HAVE_OPT(START_TIME) && parse_slice_time(OPT_ARG(START_TIME), &options->slice_start_ns) < 0) {
+        tcpreplay_seterr(ctx, "invalid --start-time: %s", OPT_ARG(START_TIME));
+        ret = -1;
+        goto out;
+    }
+
+    if (HAVE_OPT(END_TIME) &&
+        (parse_slice_time(OPT_ARG(END_TIME), &options->slice_end_ns) < 0 || options->slice_end_ns == 0)) {
+        tcpreplay_seterr(ctx, "invalid --end-time: %s", OPT_ARG(END_TIME));
+        ret = -1;
+        goto out;
+    }
+
+    if (HAVE_OPT(START_PACKET))
+        options->slice_start_pkt = OPT_VALUE_START_PACKET;
+    if (HAVE_OPT(END_PACKET))
+        options->slice_end_pkt = OPT_VALUE_END_PACKET;
+
+    options->slice = HAVE_OPT(START_TIME) || HAVE_OPT(END_TIME) || HAVE_OPT(START_PACKET) || HAVE_OPT(END_PACKET);
+    if (options->slice) {
+        if ((options->slice_end_ns != 0 && options->slice_end_ns <= options->slice_start_ns) ||
+            (options->slice_end_pkt != 0 && options->slice_end_pkt < options->slice_start_pkt)) {
+            tcpreplay_seterr(ctx, "%s", "the end of the slice must come after its start");
+            ret = -1;
+            goto out;
+        }
+
+        /* the cache file and checkpoints count every packet of the file */
+        if (HAVE_OPT(CACHEFILE) || HAVE_OPT(DUALFILE) || HAVE_OPT(CHECKPOINT) || HAVE_OPT(CACHE_IMAGE)) {
+            tcpreplay_seterr(ctx,
+                             "%s",
+                             "--start-time, --end-time, --start-packet and --end-packet can not be used with "
+                             "--cachefile, --dualfile, --checkpoint or --cache-image");
+            ret = -1;
+            goto out;
+        }
+    }
+
     if (HAVE_OPT(TOPSPEED)) {
         options->speed.mode = speed_topspeed;
         options->speed.speed = 0;
@@ -203,22 +459,176 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         options->speed.multiplier = atof(OPT_ARG(MULTIPLIER));
     }
 
+    if (HAVE_OPT(RATE_PROFILE)) {
+        char ebuf[TCPREPLAY_ERRSTR_LEN];
+
+        if ((options->speed.profile = rate_profile_load(OPT_ARG(RATE_PROFILE), ebuf, sizeof(ebuf))) == NULL) {
+            tcpreplay_seterr(ctx, "%s", ebuf);
+            ret = -1;
+            goto out;
+        }
+
+        /* the profile stands in for --mbps or --pps */
+        if (options->speed.profile->units == rate_profile_pps) {
+            options->speed.mode = speed_packetrate;
+            options->speed.speed = (COUNTER)(options->speed.profile->points[0].rate * 60.0 * 60.0);
+            options->speed.pps_multi = OPT_VALUE_PPS_MULTI;
+        } else {
+            options->speed.mode = speed_mbpsrate;
+            options->speed.speed = (COUNTER)(options->speed.profile->points[0].rate * 1000000.0);
+        }
+    }
+
+    if (HAVE_OPT(BURST))
+        options->speed.burst = (COUNTER)OPT_VALUE_BURST;
+
+    if (HAVE_OPT(LATE_POLICY)) {
+        if (strcmp(OPT_ARG(LATE_POLICY), "burst") == 0) {
+            options->speed.late_policy = late_burst;
+        } else if (strcmp(OPT_ARG(LATE_POLICY), "shift") == 0) {
+            options->speed.late_policy = late_shift;
+        } else if (strcmp(OPT_ARG(LATE_POLICY), "drop") == 0) {
+            options->speed.late_policy = late_drop;
+        } else {
+            tcpreplay_seterr(ctx, "Unsupported late policy: %s", OPT_ARG(LATE_POLICY));
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (HAVE_OPT(LATE_THRESHOLD))
+        options->speed.late_ns = (u_int64_t)OPT_VALUE_LATE_THRESHOLD * 1000;
+
+    if (HAVE_OPT(MICROBURST)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--microburst is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        if (options->speed.mode != speed_mbpsrate && options->speed.mode != speed_packetrate) {
+            tcpreplay_seterr(ctx, "%s", "--microburst requires --mbps or --pps");
+            ret = -1;
+            goto out;
+        }
+
+        /* the bursts are laid out in the send schedule */
+        options->speed.microburst = (COUNTER)OPT_VALUE_MICROBURST;
+        options->preload_pcap = true;
+#endif
+    }
+
+    if (HAVE_OPT(WAKEUP_SLACK)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--wakeup-slack is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        /* the windows are taken from the send schedule */
+        options->speed.wakeup_slack_ns = (u_int64_t)OPT_VALUE_WAKEUP_SLACK * 1000;
+        options->preload_pcap = true;
+#endif
+    }
+
+    if (HAVE_OPT(WIRE_RATE)) {
+        options->speed.wire_overhead = SPEED_WIRE_OVERHEAD;
+        ctx->stats.wire_overhead = SPEED_WIRE_OVERHEAD;
+    }
+
     if (HAVE_OPT(MAXSLEEP)) {
         options->maxsleep.tv_sec = OPT_VALUE_MAXSLEEP / 1000;
         options->maxsleep.tv_nsec = (OPT_VALUE_MAXSLEEP % 1000) * 1000 * 1000;
     }
 
+    if (HAVE_OPT(IDLE_GAP))
+        options->idle_gap_ns = (u_int64_t)OPT_VALUE_IDLE_GAP * 1000000;
+
 #ifdef ENABLE_VERBOSE
     if (HAVE_OPT(VERBOSE))
         options->verbose = 1;
 
     if (HAVE_OPT(DECODE))
         options->tcpdump->args = safe_strdup(OPT_ARG(DECODE));
+
+    if (HAVE_OPT(VERBOSE_SAMPLE))
+        options->tcpdump->sample = (uint32_t)OPT_VALUE_VERBOSE_SAMPLE;
 #endif
 
     if (HAVE_OPT(STATS))
         options->stats = OPT_VALUE_STATS;
 
+    if (HAVE_OPT(TIMING_STATS))
+        options->timing_stats = true;
+
+    if (HAVE_OPT(PROFILE))
+        options->profile = true;
+
+    if (HAVE_OPT(MEM_STATS) || HAVE_OPT(MEM_GUARD))
+        options->mem_stats = true;
+
+    if (HAVE_OPT(MEM_GUARD))
+        tcpr_mem_guard_warn(true);
+
+    if (HAVE_OPT(STATS_BREAKDOWN))
+        options->stats_breakdown = true;
+
+    if (HAVE_OPT(TX_TIMESTAMPS)) {
+#ifdef ENABLE_TXSTAMP
+        options->tx_timestamps = true;
+        if (HAVE_OPT(TX_TIMESTAMPS_PCAP))
+            options->tx_timestamps_pcap = safe_strdup(OPT_ARG(TX_TIMESTAMPS_PCAP));
+#else
+        err(-1, "--tx-timestamps requires Linux SO_TIMESTAMPING and POSIX threads");
+#endif
+    }
+
+    if (HAVE_OPT(RX_INTERFACE)) {
+#ifdef ENABLE_RXMATCH
+        options->rx_intf = safe_strdup(OPT_ARG(RX_INTERFACE));
+        options->rx_window = HAVE_OPT(RX_WINDOW) ? (u_int32_t)OPT_VALUE_RX_WINDOW : RXMATCH_WINDOW_DEFAULT;
+        options->rx_wait_ms = HAVE_OPT(RX_WAIT) ? (u_int32_t)OPT_VALUE_RX_WAIT : RXMATCH_WAIT_DEFAULT;
+#else
+        err(-1, "--rx-interface requires POSIX threads");
+#endif
+    }
+
+    if (HAVE_OPT(PROBE_RATE)) {
+        options->probe_rate = (u_int32_t)OPT_VALUE_PROBE_RATE;
+        options->probe_port = HAVE_OPT(PROBE_PORT) ? (u_int16_t)OPT_VALUE_PROBE_PORT : PROBE_PORT_DEFAULT;
+    }
+
+    if (HAVE_OPT(TRACE_RING)) {
+        options->trace_file = safe_strdup(OPT_ARG(TRACE_RING));
+        options->trace_size = HAVE_OPT(TRACE_RING_SIZE) ? OPT_VALUE_TRACE_RING_SIZE : TCPR_TRACE_DEFAULT_SIZE;
+    }
+
+    if (HAVE_OPT(DIGEST) || HAVE_OPT(DIGEST_FLOWS)) {
+        options->digest = true;
+        options->digest_flows = HAVE_OPT(DIGEST_FLOWS);
+    }
+
+    if (HAVE_OPT(CHECKPOINT)) {
+        options->checkpoint_file = safe_strdup(OPT_ARG(CHECKPOINT));
+        options->checkpoint_interval = OPT_VALUE_CHECKPOINT_INTERVAL;
+        options->resume = HAVE_OPT(RESUME);
+    }
+
+    if (HAVE_OPT(STATS_SOCKET)) {
+#ifdef HAVE_PTHREAD
+        options->stats_socket = safe_strdup(OPT_ARG(STATS_SOCKET));
+        options->timing_stats = true;
+#else
+        err(-1, "--stats-socket requires POSIX threads. See INSTALL.");
+#endif
+    }
+
+    if (HAVE_OPT(RATE_ADAPT)) {
+#ifdef HAVE_PTHREAD
+        options->rate_adapt_ms = OPT_VALUE_RATE_ADAPT;
+#else
+        err(-1, "--rate-adapt requires POSIX threads. See INSTALL.");
+#endif
+    }
+
     /*
      * preloading the pcap before the first run
      */
@@ -227,62 +637,477 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         options->preload_pcap = true;
     }
 
+    if (HAVE_OPT(PRELOAD_STREAM)) {
+#ifdef HAVE_PTHREAD
+        options->preload_pcap = true;
+        options->preload_stream = true;
+#else
+        err(-1, "--preload-stream requires POSIX threads. See INSTALL.");
+#endif
+    }
+
+#if defined TCPREPLAY_EDIT && defined ENABLE_FRAGROUTE
+    /* the fragments are made once and sent from the cache */
+    if (HAVE_OPT(FRAGROUTE))
+        options->preload_pcap = true;
+#endif
+
+    if (HAVE_OPT(PRELOAD_SNAPLEN)) {
 #ifdef TCPREPLAY_EDIT
-    if (HAVE_OPT(PRELOAD_PCAP) && OPT_VALUE_LOOP > 1) {
-        tcpreplay_seterr(ctx,
-                         "%s",
-                         "tcpreplay_edit --loop (-l) and --preload_pcap (-K) options are mutually exclusive");
+        /* edits may need the payload, and grow packets into the headroom */
+        tcpreplay_seterr(ctx, "%s", "--preload-snaplen is not supported by tcpreplay-edit");
         ret = -1;
         goto out;
+#else
+        options->preload_pcap = true;
+        options->preload_snaplen = (uint32_t)OPT_VALUE_PRELOAD_SNAPLEN;
+#endif
     }
+
+    if (HAVE_OPT(PRELOAD_DEDUP)) {
+#ifdef TCPREPLAY_EDIT
+        /* cached packets are edited in place */
+        tcpreplay_seterr(ctx, "%s", "--preload-dedup is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        options->preload_pcap = true;
+        options->preload_dedup = true;
 #endif
+    }
 
-    /* Dual file mode */
-    if (HAVE_OPT(DUALFILE)) {
-        options->dualfile = true;
-        if (argc < 2) {
-            tcpreplay_seterr(ctx, "%s", "--dualfile mode requires at least two pcap files");
-            ret = -1;
-            goto out;
-        }
-        if (argc % 2 != 0) {
-            tcpreplay_seterr(ctx, "%s", "--dualfile mode requires an even number of pcap files");
-            ret = -1;
-            goto out;
-        }
+    if (HAVE_OPT(PRELOAD_FILTER) && tcpreplay_set_preload_filter(ctx, OPT_ARG(PRELOAD_FILTER)) < 0) {
+        ret = -1;
+        goto out;
     }
 
-#ifdef HAVE_NETMAP
-    options->netmap_delay = OPT_VALUE_NM_DELAY;
-#endif
+    if (HAVE_OPT(PRELOAD_SAMPLE)) {
+        options->preload_pcap = true;
+        options->preload_sample = (u_int32_t)OPT_VALUE_PRELOAD_SAMPLE;
+    }
 
-    if (HAVE_OPT(NETMAP)) {
-#ifdef HAVE_NETMAP
-        options->netmap = 1;
-        ctx->sp_type = SP_TYPE_NETMAP;
+    if (HAVE_OPT(PRELOAD_LZ4)) {
+#if defined TCPREPLAY_EDIT
+        /* cached packets are edited in place */
+        tcpreplay_seterr(ctx, "%s", "--preload-lz4 is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#elif defined ENABLE_PRELOAD_LZ4
+        options->preload_pcap = true;
+        options->preload_lz4 = true;
 #else
-         err(-1, "--netmap feature was not compiled in. See INSTALL.");
+        err(-1, "--preload-lz4 requires liblz4 and POSIX threads. See INSTALL.");
 #endif
     }
 
-    if (HAVE_OPT(UNIQUE_IP))
-        options->unique_ip = 1;
+    if (HAVE_OPT(CACHE_MEMORY)) {
+#ifdef TCPREPLAY_EDIT
+        /* cached packets are edited in place, which would dirty the mapping */
+        tcpreplay_seterr(ctx, "%s", "--cache-memory is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        options->preload_pcap = true;
+        options->cache_memory = (size_t)OPT_VALUE_CACHE_MEMORY * 1024 * 1024;
+#endif
+    }
 
-    if (HAVE_OPT(UNIQUE_IP_LOOPS)) {
-        options->unique_loops = atof(OPT_ARG(UNIQUE_IP_LOOPS));
-        if (options->unique_loops < 1.0) {
-            tcpreplay_seterr(ctx, "%s", "--unique-ip-loops requires loop count >= 1.0");
+#ifdef HAVE_PACKET_VNET_HDR
+    if (HAVE_OPT(GSO)) {
+#ifdef TCPREPLAY_EDIT
+        /* cached packets are edited one at a time as they're sent */
+        tcpreplay_seterr(ctx, "%s", "--gso is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        /* a super-frame leaves back to back, so only byte rates can be kept */
+        if (options->speed.mode != speed_topspeed && options->speed.mode != speed_mbpsrate) {
+            tcpreplay_seterr(ctx, "%s", "--gso requires --topspeed or --mbps");
             ret = -1;
             goto out;
         }
+        options->preload_pcap = true;
+        options->gso = true;
+#endif
     }
+#endif
 
-    /* flow statistics */
-    if (HAVE_OPT(NO_FLOW_STATS))
-        options->flow_stats = 0;
-
-    if (HAVE_OPT(FLOW_EXPIRY)) {
-        options->flow_expiry = OPT_VALUE_FLOW_EXPIRY;
+    if (HAVE_OPT(MMAP_PCAP)) {
+#ifdef TCPREPLAY_EDIT
+        /* packets may grow when edited, which would clobber the next record */
+        tcpreplay_seterr(ctx, "%s", "tcpreplay_edit does not support --mmap-pcap");
+        ret = -1;
+        goto out;
+#elif defined HAVE_MMAP
+        options->mmap_pcap = true;
+#else
+        err(-1, "--mmap-pcap feature was not compiled in. See INSTALL.");
+#endif
+    }
+
+    if (HAVE_OPT(CACHE_IMAGE)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--cache-image is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#elif defined HAVE_MMAP
+        options->preload_pcap = true;
+        options->cache_image = true;
+#else
+        err(-1, "--cache-image feature was not compiled in. See INSTALL.");
+#endif
+    }
+
+    if (HAVE_OPT(READAHEAD)) {
+#ifdef HAVE_PTHREAD
+        options->readahead = (size_t)OPT_VALUE_READAHEAD * 1024 * 1024;
+#else
+        err(-1, "--readahead requires POSIX threads. See INSTALL.");
+#endif
+    }
+
+#ifdef TCPREPLAY_EDIT
+    if (HAVE_OPT(PRELOAD_PCAP) && OPT_VALUE_LOOP > 1) {
+        tcpreplay_seterr(ctx,
+                         "%s",
+                         "tcpreplay_edit --loop (-l) and --preload_pcap (-K) options are mutually exclusive");
+        ret = -1;
+        goto out;
+    }
+#endif
+
+    /* Dual file mode */
+    if (HAVE_OPT(DUALFILE)) {
+        options->dualfile = true;
+        if (argc < 2) {
+            tcpreplay_seterr(ctx, "%s", "--dualfile mode requires at least two pcap files");
+            ret = -1;
+            goto out;
+        }
+        if (argc % 2 != 0) {
+            tcpreplay_seterr(ctx, "%s", "--dualfile mode requires an even number of pcap files");
+            ret = -1;
+            goto out;
+        }
+    }
+
+#ifdef HAVE_NETMAP
+    options->netmap_delay = OPT_VALUE_NM_DELAY;
+#endif
+
+    if (HAVE_OPT(NETMAP)) {
+#ifdef HAVE_NETMAP
+        options->netmap = 1;
+        ctx->sp_type = SP_TYPE_NETMAP;
+#else
+         err(-1, "--netmap feature was not compiled in. See INSTALL.");
+#endif
+    }
+
+    if (HAVE_OPT(XDP)) {
+#ifdef HAVE_AF_XDP
+        options->xdp = 1;
+        options->xdp_queue = OPT_VALUE_XDP_QUEUE;
+        ctx->sp_type = SP_TYPE_AF_XDP;
+#else
+         err(-1, "--xdp feature was not compiled in. See INSTALL.");
+#endif
+    }
+
+#ifdef HAVE_DPDK
+    if (HAVE_OPT(DPDK_EAL))
+        options->dpdk_eal = safe_strdup(OPT_ARG(DPDK_EAL));
+#endif
+
+    if (HAVE_OPT(IO_URING)) {
+#ifdef HAVE_IO_URING
+        if (ctx->sp_type != SP_TYPE_NONE) {
+            tcpreplay_seterr(ctx, "%s", "--io-uring can't be used with --netmap or --xdp");
+            ret = -1;
+            goto out;
+        }
+        options->io_uring = true;
+        options->io_uring_sqpoll = HAVE_OPT(IO_URING_SQPOLL);
+        ctx->sp_type = SP_TYPE_IO_URING;
+#else
+         err(-1, "--io-uring feature was not compiled in. See INSTALL.");
+#endif
+    }
+
+#if defined TCPREPLAY_EDIT && defined HAVE_PACKET_VNET_HDR
+    if (HAVE_OPT(CSUM_OFFLOAD))
+        options->csum_offload = true;
+#endif
+
+    if (HAVE_OPT(UNIQUE_IP))
+        options->unique_ip = 1;
+
+    if (HAVE_OPT(UNIQUE_IP_LOOPS)) {
+        options->unique_loops = atof(OPT_ARG(UNIQUE_IP_LOOPS));
+        if (options->unique_loops < 1.0) {
+            tcpreplay_seterr(ctx, "%s", "--unique-ip-loops requires loop count >= 1.0");
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (HAVE_OPT(FLOW_COPIES)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--flow-copies is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        options->flow_copies = OPT_VALUE_FLOW_COPIES;
+        options->preload_pcap = true;
+        if (HAVE_OPT(FLOW_COPY_OFFSET))
+            options->flow_copy_offset = OPT_VALUE_FLOW_COPY_OFFSET;
+#endif
+    }
+
+    if (HAVE_OPT(REPEAT)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--repeat is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        options->repeat = OPT_VALUE_REPEAT;
+        options->repeat_unique = HAVE_OPT(REPEAT_UNIQUE);
+        if (HAVE_OPT(REPEAT_FLOWS)) {
+            if (HAVE_OPT(NO_FLOW_STATS)) {
+                tcpreplay_seterr(ctx, "%s", "--repeat-flows needs the flow statistics, not --no-flow-stats");
+                ret = -1;
+                goto out;
+            }
+
+            /* flows are told apart while preloading */
+            options->repeat_flows = OPT_VALUE_REPEAT_FLOWS;
+            options->preload_pcap = true;
+        }
+#endif
+    }
+
+    if (HAVE_OPT(MIX)) {
+        if (tcpreplay_set_mix(ctx, OPT_ARG(MIX)) < 0) {
+            ret = -1;
+            goto out;
+        }
+        options->mix_packets = HAVE_OPT(MIX_PACKETS);
+    }
+
+    if (HAVE_OPT(FLEET)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--fleet is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        if (argc > 0) {
+            tcpreplay_seterr(ctx, "%s", "--fleet takes the pcaps from its file, not the command line");
+            ret = -1;
+            goto out;
+        }
+
+        if (tcpreplay_set_fleet(ctx, OPT_ARG(FLEET)) < 0) {
+            ret = -1;
+            goto out;
+        }
+#endif
+    }
+
+    if (HAVE_OPT(UNIQUE_IP_POOL)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--unique-ip-pool is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        if (tcpreplay_set_unique_ip_pool(ctx, OPT_ARG(UNIQUE_IP_POOL)) < 0) {
+            ret = -1;
+            goto out;
+        }
+#endif
+    }
+
+    if (HAVE_OPT(RSS_QUEUES)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--rss-queues is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        options->rss_queues = (int)OPT_VALUE_RSS_QUEUES;
+        options->rss_reta = HAVE_OPT(RSS_RETA) ? (u_int32_t)OPT_VALUE_RSS_RETA : RSS_RETA_DEFAULT;
+        if ((options->rss_reta & (options->rss_reta - 1)) != 0 || options->rss_reta < (u_int32_t)options->rss_queues) {
+            tcpreplay_seterr(ctx,
+                             "--rss-reta=%u must be a power of two and no less than --rss-queues",
+                             options->rss_reta);
+            ret = -1;
+            goto out;
+        }
+        if (HAVE_OPT(RSS_KEY) && tcpreplay_set_rss_key(ctx, OPT_ARG(RSS_KEY)) < 0) {
+            ret = -1;
+            goto out;
+        }
+        options->rss_balance = HAVE_OPT(RSS_BALANCE);
+        /* the packets are hashed while preloading */
+        options->preload_pcap = true;
+#endif
+    }
+
+    if (HAVE_OPT(GEN_FIELD)) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--gen-field is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        int ct = STACKCT_OPT(GEN_FIELD);
+        char **list = (char **)STACKLST_OPT(GEN_FIELD);
+
+        do {
+            if (tcpreplay_add_gen_field(ctx, *list++) < 0) {
+                ret = -1;
+                goto out;
+            }
+        } while (--ct > 0);
+
+        if (HAVE_OPT(GEN_VLAN_ADD)) {
+            int i;
+
+            for (i = 0; i < options->gen_field_cnt && options->gen_fields[i].name != gen_vlan; i++)
+                ;
+            if (i == options->gen_field_cnt) {
+                tcpreplay_seterr(ctx, "%s", "--gen-vlan-add requires a --gen-field=vlan rule");
+                ret = -1;
+                goto out;
+            }
+            options->gen_vlan_add = true;
+        }
+#endif
+    }
+
+    if (options->mix_cnt > 0 && (options->speed.mode == speed_multiplier || options->speed.mode == speed_oneatatime)) {
+        /* the mix is paced as a whole, the timestamps of the captures don't fit together */
+        tcpreplay_seterr(ctx, "%s", "--mix requires --topspeed, --mbps or --pps");
+        ret = -1;
+        goto out;
+    }
+
+#ifdef ENABLE_SEND_THREADS
+    options->threads = OPT_VALUE_THREADS;
+#else
+    if (OPT_VALUE_THREADS > 1) {
+        tcpreplay_seterr(ctx, "%s", "--threads is not supported by this build");
+        ret = -1;
+        goto out;
+    }
+#endif
+
+    if (options->threads > 1) {
+        if (options->dualfile || HAVE_OPT(CACHEFILE)) {
+            tcpreplay_seterr(ctx, "%s", "--threads can not be used with --dualfile or --cachefile");
+            ret = -1;
+            goto out;
+        }
+
+        if (options->unique_ip) {
+            tcpreplay_seterr(ctx, "%s", "--threads can not be used with --unique-ip");
+            ret = -1;
+            goto out;
+        }
+
+        if (options->flow_copies > 1 || options->mix_cnt > 0) {
+            tcpreplay_seterr(ctx, "%s", "--threads can not be used with --flow-copies or --mix");
+            ret = -1;
+            goto out;
+        }
+
+        /* a fleet paces each stream on its own */
+        if (ctx->fleet == NULL &&
+            (options->speed.mode == speed_multiplier || options->speed.mode == speed_oneatatime)) {
+            tcpreplay_seterr(ctx, "%s", "--threads requires --topspeed, --mbps or --pps");
+            ret = -1;
+            goto out;
+        }
+
+#ifdef HAVE_NETMAP
+        if (options->netmap) {
+            tcpreplay_seterr(ctx, "%s", "--threads can not be used with --netmap");
+            ret = -1;
+            goto out;
+        }
+#endif
+
+#ifdef ENABLE_VERBOSE
+        if (options->verbose) {
+            tcpreplay_seterr(ctx, "%s", "--threads can not be used with --verbose");
+            ret = -1;
+            goto out;
+        }
+#endif
+
+        /* workers send straight out of the packet cache */
+        options->preload_pcap = true;
+    }
+
+    /* --spray sends each interface from its own thread */
+    if (HAVE_OPT(NIC_THREADS) || HAVE_OPT(SPRAY)) {
+#ifdef ENABLE_SEND_THREADS
+        /* the queues point into the packet cache */
+        options->nic_threads = true;
+        options->nic_skew_us = OPT_VALUE_NIC_SKEW;
+        options->preload_pcap = true;
+#ifdef HAVE_NETMAP
+        if (options->netmap) {
+            tcpreplay_seterr(ctx, "%s", "--nic-threads can not be used with --netmap");
+            ret = -1;
+            goto out;
+        }
+#endif
+#else
+        tcpreplay_seterr(ctx, "%s", "--nic-threads and --spray are not supported by this build");
+        ret = -1;
+        goto out;
+#endif
+    }
+
+    if (options->repeat > 1 &&
+        (options->dualfile || options->threads > 1 || options->flow_copies > 1 || options->mix_cnt > 0)) {
+        tcpreplay_seterr(ctx, "%s", "--repeat can not be used with --dualfile, --threads, --flow-copies or --mix");
+        ret = -1;
+        goto out;
+    }
+
+    if (options->repeat_unique && options->nic_threads) {
+        tcpreplay_seterr(ctx, "%s", "--repeat-unique can not be used with --nic-threads");
+        ret = -1;
+        goto out;
+    }
+
+    if (options->speed.microburst != 0 &&
+        (options->dualfile || options->threads > 1 || options->flow_copies > 1 || options->mix_cnt > 0)) {
+        tcpreplay_seterr(ctx, "%s", "--microburst can not be used with --dualfile, --threads, --flow-copies or --mix");
+        ret = -1;
+        goto out;
+    }
+
+    if (options->checkpoint_file != NULL) {
+        if (options->dualfile || options->threads > 1 || options->flow_copies > 1 || options->mix_cnt > 0) {
+            tcpreplay_seterr(ctx, "%s", "--checkpoint can not be used with --dualfile, --threads, --flow-copies or --mix");
+            ret = -1;
+            goto out;
+        }
+
+        /* a streamed file isn't kept, so its --unique-ip changes can't be redone */
+        if (options->resume && options->unique_ip && options->preload_stream) {
+            tcpreplay_seterr(ctx, "%s", "--resume can not be used with --unique-ip and --preload-stream");
+            ret = -1;
+            goto out;
+        }
+    }
+
+    /* flow statistics */
+    if (HAVE_OPT(NO_FLOW_STATS))
+        options->flow_stats = 0;
+
+    if (HAVE_OPT(FLOW_EXPIRY)) {
+        options->flow_expiry = OPT_VALUE_FLOW_EXPIRY;
     }
 
     if (HAVE_OPT(TIMER)) {
@@ -305,6 +1130,33 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
             options->accurate = accurate_gtod;
         } else if (strcmp(OPT_ARG(TIMER), "nano") == 0) {
             options->accurate = accurate_nanosleep;
+        } else if (strcmp(OPT_ARG(TIMER), "hybrid") == 0) {
+            options->accurate = accurate_hybrid;
+            options->hybrid_margin_ns = hybrid_sleep_calibrate();
+        } else if (strcmp(OPT_ARG(TIMER), "kqueue") == 0) {
+#ifdef HAVE_KQUEUE_SLEEP
+            options->accurate = accurate_kqueue;
+#else
+            tcpreplay_seterr(ctx, "%s", "tcpreplay_api not compiled with kqueue timer support");
+            ret = -1;
+            goto out;
+#endif
+        } else if (strcmp(OPT_ARG(TIMER), "timerfd") == 0) {
+#ifdef HAVE_TIMERFD_WAIT
+            options->accurate = accurate_timerfd;
+#else
+            tcpreplay_seterr(ctx, "%s", "tcpreplay_api not compiled with timerfd support");
+            ret = -1;
+            goto out;
+#endif
+        } else if (strcmp(OPT_ARG(TIMER), "txtime") == 0) {
+#ifdef HAVE_SO_TXTIME
+            options->accurate = accurate_txtime;
+#else
+            tcpreplay_seterr(ctx, "%s", "tcpreplay_api not compiled with SO_TXTIME support");
+            ret = -1;
+            goto out;
+#endif
         } else if (strcmp(OPT_ARG(TIMER), "abstime") == 0) {
             tcpreplay_seterr(ctx, "%s", "abstime is deprecated");
             ret = -1;
@@ -316,6 +1168,56 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         }
     }
 
+    if (HAVE_OPT(INTF_PAIR)) {
+        int ct = STACKCT_OPT(INTF_PAIR);
+        char **list = (char **)STACKLST_OPT(INTF_PAIR);
+
+        do {
+            char *primary = safe_strdup(*list++);
+            char *secondary = strchr(primary, ',');
+
+            if (secondary == NULL) {
+                tcpreplay_seterr(ctx, "--intf-pair=%s requires two interfaces separated by a comma", primary);
+                safe_free(primary);
+                ret = -1;
+                goto out;
+            }
+            *secondary++ = '\0';
+
+            if (tcpreplay_add_intf_pair(ctx, primary, secondary) < 0) {
+                safe_free(primary);
+                ret = -1;
+                goto out;
+            }
+            safe_free(primary);
+        } while (--ct > 0);
+    }
+
+#ifdef HAVE_SO_TXTIME
+    if (options->accurate == accurate_txtime) {
+#ifdef TCPREPLAY_EDIT
+        tcpreplay_seterr(ctx, "%s", "--timer=txtime is not supported by tcpreplay-edit");
+        ret = -1;
+        goto out;
+#else
+        if (options->dualfile || options->threads > 1 || options->nic_threads) {
+            tcpreplay_seterr(ctx, "%s", "--timer=txtime can not be used with --dualfile, --threads or --nic-threads");
+            ret = -1;
+            goto out;
+        }
+
+        if (options->speed.mode == speed_topspeed || options->speed.mode == speed_oneatatime) {
+            tcpreplay_seterr(ctx, "%s", "--timer=txtime requires --multiplier, --mbps or --pps");
+            ret = -1;
+            goto out;
+        }
+
+        /* launch times come from the send schedule of the packet cache */
+        options->preload_pcap = true;
+#endif
+    }
+#endif
+
 #ifdef HAVE_RDTSC
     if (HAVE_OPT(RDTSC_CLICKS)) {
         rdtsc_calibrate(OPT_VALUE_RDTSC_CLICKS);
@@ -328,81 +1230,271 @@ tcpreplay_post_args(tcpreplay_t *ctx, int argc)
         tcpreplay_setwarn(ctx, "%s", "--pktlen may cause problems.  Use with caution.");
     }
 
-    if ((intname = get_interface(ctx->intlist, OPT_ARG(INTF1))) == NULL) {
+    if (HAVE_OPT(SIMULATE)) {
+        /* the rest is refused by the option definitions */
+        if (options->accurate == accurate_txtime || ctx->sp_type != SP_TYPE_NONE) {
+            tcpreplay_seterr(ctx, "%s", "--simulate can not be used with --timer=txtime, --netmap, --xdp or --io-uring");
+            ret = -1;
+            goto out;
+        }
+
+        /* the pcap file stands in for --intf1, and the clock for the sleeps */
+        intname = OPT_ARG(SIMULATE);
+        ctx->sp_type = SP_TYPE_SIMULATE;
+        tcpr_clock_simulate();
+    } else if (!HAVE_OPT(INTF1)) {
+        tcpreplay_seterr(ctx, "%s", "--intf1 is required");
+        ret = -1;
+        goto out;
+    } else if ((intname = get_interface(ctx->intlist, OPT_ARG(INTF1))) == NULL) {
         if (!strncmp(OPT_ARG(INTF1), "netmap:", 7) || !strncmp(OPT_ARG(INTF1), "vale", 4))
             tcpreplay_seterr(ctx, "Unable to connect to netmap interface %s. Ensure netmap module is installed (see INSTALL).",
                     OPT_ARG(INTF1));
+        else if (!strncmp(OPT_ARG(INTF1), "dpdk:", 5))
+            tcpreplay_seterr(ctx, "DPDK port %s requires building with --with-dpdk (see INSTALL).", OPT_ARG(INTF1));
         else
             tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", OPT_ARG(INTF1));
 
-        ret = -1;
-        goto out;
+        ret = -1;
+        goto out;
+    }
+
+    if (ctx->sp_type != SP_TYPE_SIMULATE && (!strncmp(intname, "netmap:", 7) || !strncmp(intname, "vale:", 5))) {
+#ifdef HAVE_NETMAP
+        options->netmap = 1;
+        ctx->sp_type = SP_TYPE_NETMAP;
+#else
+        tcpreplay_seterr(ctx, "%s", "tcpreplay_api not compiled with netmap support");
+        ret = -1;
+        goto out;
+#endif
+    }
+
+    options->intf1_name = safe_strdup(intname);
+
+    options->hugepages = HAVE_OPT(HUGEPAGES);
+    if (HAVE_OPT(NUMA))
+        options->numa_node = OPT_VALUE_NUMA;
+    if (HAVE_OPT(CPU))
+        options->cpu_list = safe_strdup(OPT_ARG(CPU));
+
+    if (numa_setup(ctx) < 0) {
+        ret = -1;
+        goto out;
+    }
+
+    if (HAVE_OPT(INJECT)) {
+        if (ctx->sp_type != SP_TYPE_NONE) {
+            tcpreplay_seterr(ctx, "%s", "--inject can't be used with a netmap interface");
+            ret = -1;
+            goto out;
+        }
+        if (inject_select(ctx, OPT_ARG(INJECT)) < 0) {
+            ret = -1;
+            goto out;
+        }
+    }
+
+    /* open interfaces for writing */
+    if ((ctx->intf1 = sendpacket_open(options->intf1_name, ebuf, TCPR_DIR_C2S, ctx->sp_type, ctx)) == NULL) {
+        tcpreplay_seterr(ctx, "Can't open %s: %s", options->intf1_name, ebuf);
+        ret = -1;
+        goto out;
+    }
+
+#if defined HAVE_NETMAP
+    ctx->intf1->netmap_delay = ctx->options->netmap_delay;
+#endif
+
+    ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
+
+    /* --wire-rate --topspeed: the line rate of the link, exactly */
+    if (options->speed.wire_overhead != 0 && options->speed.mode == speed_topspeed) {
+        COUNTER link_mbps = sendpacket_get_link_mbps(ctx->intf1);
+
+        if (link_mbps == 0) {
+            tcpreplay_seterr(ctx, "--wire-rate with --topspeed requires the link speed of %s, which is unknown",
+                             options->intf1_name);
+            ret = -1;
+            goto out;
+        }
+        options->speed.mode = speed_mbpsrate;
+        options->speed.speed = link_mbps * 1000000; /* bps */
+        dbgx(1, "--wire-rate: link speed of %s is " COUNTER_SPEC " Mbps", options->intf1_name, link_mbps);
+    }
+
+    if (HAVE_OPT(INTF2)) {
+        if (!HAVE_OPT(CACHEFILE) && !HAVE_OPT(DUALFILE)) {
+            tcpreplay_seterr(ctx, "--intf2=%s requires either --cachefile or --dualfile", OPT_ARG(INTF2));
+            ret = -1;
+            goto out;
+        }
+        if ((intname = get_interface(ctx->intlist, OPT_ARG(INTF2))) == NULL) {
+            tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", OPT_ARG(INTF2));
+            ret = -1;
+            goto out;
+        }
+
+        options->intf2_name = safe_strdup(intname);
+
+        /* open interface for writing */
+        if ((ctx->intf2 = sendpacket_open(options->intf2_name, ebuf, TCPR_DIR_S2C, ctx->sp_type, ctx)) == NULL) {
+            tcpreplay_seterr(ctx, "Can't open %s: %s", options->intf2_name, ebuf);
+        }
+
+#if defined HAVE_NETMAP
+        ctx->intf2->netmap_delay = ctx->options->netmap_delay;
+#endif
+
+        ctx->intf2dlt = sendpacket_get_dlt(ctx->intf2);
+        if (ctx->intf2dlt != ctx->intf1dlt) {
+            tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
+                options->intf1_name, pcap_datalink_val_to_name(ctx->intf1dlt),
+                options->intf2_name, pcap_datalink_val_to_name(ctx->intf2dlt));
+            ret = -1;
+            goto out;
+        }
+    }
+
+    if (HAVE_OPT(SPRAY)) {
+        char *list = safe_strdup(OPT_ARG(SPRAY));
+        char *name, *save = NULL;
+
+        for (name = strtok_r(list, ",", &save); name != NULL; name = strtok_r(NULL, ",", &save)) {
+            if (tcpreplay_add_spray_intf(ctx, name) < 0) {
+                safe_free(list);
+                ret = -1;
+                goto out;
+            }
+        }
+        safe_free(list);
+
+        if (options->spray_cnt == 0) {
+            tcpreplay_seterr(ctx, "--spray=%s names no interfaces", OPT_ARG(SPRAY));
+            ret = -1;
+            goto out;
+        }
+    }
+
+#ifdef HAVE_SO_TXTIME
+    if (options->accurate == accurate_txtime) {
+        int i;
+
+        if (sendpacket_enable_txtime(ctx->intf1) < 0) {
+            tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->intf1));
+            ret = -1;
+            goto out;
+        }
+
+        if (ctx->intf2 != NULL && sendpacket_enable_txtime(ctx->intf2) < 0) {
+            tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->intf2));
+            ret = -1;
+            goto out;
+        }
+
+        for (i = 0; i < options->pair_intf_cnt; i++) {
+            if (sendpacket_enable_txtime(ctx->pair_intf[i]) < 0) {
+                tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->pair_intf[i]));
+                ret = -1;
+                goto out;
+            }
+        }
     }
-
-    if (!strncmp(intname, "netmap:", 7) || !strncmp(intname, "vale:", 5)) {
-#ifdef HAVE_NETMAP
-        options->netmap = 1;
-        ctx->sp_type = SP_TYPE_NETMAP;
-#else
-        tcpreplay_seterr(ctx, "%s", "tcpreplay_api not compiled with netmap support");
-        ret = -1;
-        goto out;
 #endif
-    }
 
-    options->intf1_name = safe_strdup(intname);
+#ifdef HAVE_PACKET_VNET_HDR
+    if (options->csum_offload || options->gso) {
+        int i;
 
-    /* open interfaces for writing */
-    if ((ctx->intf1 = sendpacket_open(options->intf1_name, ebuf, TCPR_DIR_C2S, ctx->sp_type, ctx)) == NULL) {
-        tcpreplay_seterr(ctx, "Can't open %s: %s", options->intf1_name, ebuf);
-        ret = -1;
-        goto out;
-    }
+        if (sendpacket_enable_vnet_hdr(ctx->intf1) < 0) {
+            tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->intf1));
+            ret = -1;
+            goto out;
+        }
 
-#if defined HAVE_NETMAP
-    ctx->intf1->netmap_delay = ctx->options->netmap_delay;
+        if (ctx->intf2 != NULL && sendpacket_enable_vnet_hdr(ctx->intf2) < 0) {
+            tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->intf2));
+            ret = -1;
+            goto out;
+        }
+
+        for (i = 0; i < options->pair_intf_cnt; i++) {
+            if (sendpacket_enable_vnet_hdr(ctx->pair_intf[i]) < 0) {
+                tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->pair_intf[i]));
+                ret = -1;
+                goto out;
+            }
+        }
+    }
 #endif
 
-    ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
+#ifdef ENABLE_TXSTAMP
+    if (options->tx_timestamps) {
+        int i;
 
-    if (HAVE_OPT(INTF2)) {
-        if (!HAVE_OPT(CACHEFILE) && !HAVE_OPT(DUALFILE)) {
-            tcpreplay_seterr(ctx, "--intf2=%s requires either --cachefile or --dualfile", OPT_ARG(INTF2));
+        if (options->tx_timestamps_pcap != NULL && (ctx->intf2 != NULL || options->pair_intf_cnt > 0)) {
+            tcpreplay_seterr(ctx, "%s", "--tx-timestamps-pcap only works with a single interface");
             ret = -1;
             goto out;
         }
-        if ((intname = get_interface(ctx->intlist, OPT_ARG(INTF2))) == NULL) {
-            tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", OPT_ARG(INTF2));
+
+        if (sendpacket_enable_txstamp(ctx->intf1, options->tx_timestamps_pcap, ctx->intf1dlt) < 0) {
+            tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->intf1));
             ret = -1;
             goto out;
         }
 
-        options->intf2_name = safe_strdup(intname);
-
-        /* open interface for writing */
-        if ((ctx->intf2 = sendpacket_open(options->intf2_name, ebuf, TCPR_DIR_S2C, ctx->sp_type, ctx)) == NULL) {
-            tcpreplay_seterr(ctx, "Can't open %s: %s", options->intf2_name, ebuf);
+        if (ctx->intf2 != NULL && sendpacket_enable_txstamp(ctx->intf2, NULL, ctx->intf2dlt) < 0) {
+            tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->intf2));
+            ret = -1;
+            goto out;
         }
 
-#if defined HAVE_NETMAP
-        ctx->intf2->netmap_delay = ctx->options->netmap_delay;
+        for (i = 0; i < options->pair_intf_cnt; i++) {
+            if (sendpacket_enable_txstamp(ctx->pair_intf[i], NULL, ctx->intf1dlt) < 0) {
+                tcpreplay_seterr(ctx, "%s", sendpacket_geterr(ctx->pair_intf[i]));
+                ret = -1;
+                goto out;
+            }
+        }
+    }
 #endif
 
-        ctx->intf2dlt = sendpacket_get_dlt(ctx->intf2);
-        if (ctx->intf2dlt != ctx->intf1dlt) {
-            tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
-                options->intf1_name, pcap_datalink_val_to_name(ctx->intf1dlt),
-                options->intf2_name, pcap_datalink_val_to_name(ctx->intf2dlt));
+#ifdef ENABLE_RXMATCH
+    if (options->rx_intf != NULL) {
+        char ebuf[PCAP_ERRBUF_SIZE];
+
+        if ((ctx->rxmatch = rxmatch_open(options->rx_intf, options->rx_window, ebuf)) == NULL) {
+            tcpreplay_seterr(ctx, "%s", ebuf);
             ret = -1;
             goto out;
         }
+        /* the reader tells the probes which come back apart from the rest */
+        ctx->rxmatch->probe_port = options->probe_rate != 0 ? options->probe_port : 0;
     }
+#endif
+
+    if (options->probe_rate != 0)
+        ctx->probe = probe_new(options->probe_rate, options->probe_port);
+    if (options->rss_queues != 0)
+        ctx->rss = rss_new(options);
 
     if (HAVE_OPT(CACHEFILE)) {
+        if (!HAVE_OPT(INTF2) && !HAVE_OPT(SHARD)) {
+            tcpreplay_seterr(ctx, "%s", "--cachefile requires --intf2 unless --shard is used");
+            ret = -1;
+            goto out;
+        }
+
         temp = safe_strdup(OPT_ARG(CACHEFILE));
-        options->cache_packets = read_cache(&options->cachedata, temp,
-            &options->comment);
+        options->cache_packets = read_cache_shards(&options->cachedata, &options->cachepairs,
+            &options->cache_pairs, &options->cacheshards, &options->cache_shards, temp, &options->comment);
         safe_free(temp);
+
+        if (check_cache_pairs(ctx) < 0 || check_cache_shard(ctx) < 0) {
+            ret = -1;
+            goto out;
+        }
     }
 
     /* return -2 on warnings */
@@ -423,19 +1515,65 @@ tcpreplay_close(tcpreplay_t *ctx)
 {
     tcpreplay_opt_t *options;
     interface_list_t *intlist, *intlistnext;
-    packet_cache_t *packet_cache, *next;
+    int i;
 
     assert(ctx);
     assert(ctx->options);
     options = ctx->options;
 
+#ifdef HAVE_PTHREAD
+    /* stop reading the counters before their sendpacket_t go away */
+    stats_export_stop(ctx);
+    rate_adapt_stop(ctx);
+    follow_free(ctx);
+    playlist_free(ctx);
+#endif
+    safe_free(options->stats_socket);
+    safe_free(options->trace_file);
+    safe_free(options->checkpoint_file);
+    safe_free(ctx->resume);
+    safe_free(options->tx_timestamps_pcap);
+#ifdef ENABLE_RXMATCH
+    rxmatch_close(ctx->rxmatch);
+    ctx->rxmatch = NULL;
+#endif
+    safe_free(options->rx_intf);
+    probe_free(ctx->probe);
+    ctx->probe = NULL;
+    inject_free(ctx->inject);
+    ctx->inject = NULL;
+    breakdown_free(ctx->breakdown);
+    ctx->breakdown = NULL;
+    safe_free(options->cpu_list);
+    safe_free(ctx->unique_hosts.slot);
+    rss_free(ctx->rss);
+    ctx->rss = NULL;
+    fleet_free(ctx);
+    safe_free(options->rss_key);
+    safe_free(options->preload_filter);
+    safe_free(ctx->edit_buff);
+
+#ifdef ENABLE_SEND_THREADS
+    /* worker rings of a netmap NIC go before the one that opened it */
+    send_threads_close(ctx);
+    nic_threads_stop(ctx);
+#endif
+
     safe_free(options->intf1_name);
     safe_free(options->intf2_name);
     sendpacket_close(ctx->intf1);
     if (ctx->intf2 != NULL)
         sendpacket_close(ctx->intf2);
-    safe_free(options->cachedata);
+    for (i = 0; i < options->pair_intf_cnt; i++) {
+        safe_free(options->pair_intf_name[i]);
+        sendpacket_close(ctx->pair_intf[i]);
+    }
+    free_cache(options->cachedata);
     safe_free(options->comment);
+#ifdef HAVE_DPDK
+    safe_free(options->dpdk_eal);
+#endif
+    rate_profile_free(options->speed.profile);
 
 #ifdef ENABLE_VERBOSE
     safe_free(options->tcpdump_args);
@@ -446,13 +1584,8 @@ tcpreplay_close(tcpreplay_t *ctx)
     flow_hash_table_release(ctx->flow_hash_table);
 
     /* free the file cache */
-    packet_cache = options->file_cache->packet_cache;
-    while (packet_cache != NULL) {
-        next = packet_cache->next;
-        safe_free(packet_cache->pktdata);
-        safe_free(packet_cache);
-        packet_cache = next;
-    }
+    for (i = 0; i < options->source_cnt; i++)
+        file_cache_free(&options->file_cache[i]);
 
     /* free our interface list */
     if (ctx->intlist != NULL) {
@@ -475,7 +1608,6 @@ tcpreplay_close(tcpreplay_t *ctx)
 int
 tcpreplay_set_interface(tcpreplay_t *ctx, tcpreplay_intf intf, char *value)
 {
-    static int int1dlt = -1, int2dlt = -1;
     char *intname;
     char *ebuf;
     int ret = 0;
@@ -505,7 +1637,7 @@ tcpreplay_set_interface(tcpreplay_t *ctx, tcpreplay_intf intf, char *value)
             goto out;
         }
 
-        int1dlt = sendpacket_get_dlt(ctx->intf1);
+        ctx->intf1dlt = sendpacket_get_dlt(ctx->intf1);
     } else if (intf == intf2) {
         if ((intname = get_interface(ctx->intlist, value)) == NULL) {
             tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", ctx->options->intf2_name);
@@ -521,18 +1653,88 @@ tcpreplay_set_interface(tcpreplay_t *ctx, tcpreplay_intf intf, char *value)
             ret = -1;
             goto out;
         }
-        int2dlt = sendpacket_get_dlt(ctx->intf2);
+        ctx->intf2dlt = sendpacket_get_dlt(ctx->intf2);
     }
 
     /*
      * If both interfaces are selected, then make sure both interfaces use
      * the same DLT type
      */
-    if (int1dlt != -1 && int2dlt != -1) {
-        if (int1dlt != int2dlt) {
+    if (ctx->intf1dlt != -1 && ctx->intf2dlt != -1) {
+        if (ctx->intf1dlt != ctx->intf2dlt) {
             tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
-                ctx->options->intf1_name, pcap_datalink_val_to_name(int1dlt), 
-                ctx->options->intf2_name, pcap_datalink_val_to_name(int2dlt));
+                ctx->options->intf1_name, pcap_datalink_val_to_name(ctx->intf1dlt), 
+                ctx->options->intf2_name, pcap_datalink_val_to_name(ctx->intf2dlt));
+            ret = -1;
+            goto out;
+        }
+    }
+
+out:
+    safe_free(ebuf);
+    return ret;
+}
+
+/**
+ * \brief Adds the primary and secondary interface of another interface pair.
+ *
+ * tcpprep cache files created with --pairs send each flow out one of several
+ * interface pairs.  The first pair is set with tcpreplay_set_interface(), call
+ * this once for each pair after that, in order.  All interfaces must use the
+ * same DLT type
+ */
+int
+tcpreplay_add_intf_pair(tcpreplay_t *ctx, char *primary, char *secondary)
+{
+    tcpreplay_opt_t *options;
+    char *names[2];
+    char *intname;
+    char *ebuf;
+    int i, dlt, ret = 0;
+
+    assert(ctx);
+    assert(primary);
+    assert(secondary);
+    options = ctx->options;
+
+    if (options->pair_intf_cnt >= 2 * (CACHE_MAX_PAIRS - 1)) {
+        tcpreplay_seterr(ctx, "Too many interface pairs, the max is %d", CACHE_MAX_PAIRS);
+        return -1;
+    }
+
+    ebuf = safe_malloc(SENDPACKET_ERRBUF_SIZE);
+    names[0] = primary;
+    names[1] = secondary;
+
+    for (i = 0; i < 2; i++) {
+        int idx = options->pair_intf_cnt;
+
+        if ((intname = get_interface(ctx->intlist, names[i])) == NULL) {
+            tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", names[i]);
+            ret = -1;
+            goto out;
+        }
+
+        /* open interface for writing */
+        ctx->pair_intf[idx] = sendpacket_open(intname, ebuf, i == 0 ? TCPR_DIR_C2S : TCPR_DIR_S2C, ctx->sp_type, ctx);
+        if (ctx->pair_intf[idx] == NULL) {
+            tcpreplay_seterr(ctx, "Can't open %s: %s", intname, ebuf);
+            ret = -1;
+            goto out;
+        }
+
+        options->pair_intf_name[idx] = safe_strdup(intname);
+        options->pair_intf_cnt++;
+
+#if defined HAVE_NETMAP
+        ctx->pair_intf[idx]->netmap_delay = options->netmap_delay;
+#endif
+
+        dlt = sendpacket_get_dlt(ctx->pair_intf[idx]);
+        if (ctx->intf1dlt != -1 && dlt != ctx->intf1dlt) {
+            tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
+                options->intf1_name, pcap_datalink_val_to_name(ctx->intf1dlt),
+                intname, pcap_datalink_val_to_name(dlt));
             ret = -1;
             goto out;
         }
@@ -543,6 +1745,87 @@ out:
     return ret;
 }
 
+/**
+ * \brief Adds another interface to spread the flows across, --spray.
+ *
+ * The first interface is set with tcpreplay_set_interface(), then each
+ * flow is sent out one of it and the interfaces added here, picked by a
+ * hash of the flow which is the same in both directions.  The first one
+ * added becomes intf2 and the rest pair interfaces, so there can be up
+ * to 2 * CACHE_MAX_PAIRS in all.  Not with a tcpprep cache or --dualfile.
+ */
+int
+tcpreplay_add_spray_intf(tcpreplay_t *ctx, const char *name)
+{
+    tcpreplay_opt_t *options;
+    sendpacket_t *sp;
+    char *intname;
+    char *ebuf;
+    int dlt, ret = 0;
+
+    assert(ctx);
+    assert(name);
+    options = ctx->options;
+
+    if (ctx->intf1 == NULL) {
+        tcpreplay_seterr(ctx, "%s", "--spray needs --intf1 first");
+        return -1;
+    }
+
+    if (options->spray_cnt == 0 && (ctx->intf2 != NULL || options->pair_intf_cnt > 0 || options->dualfile)) {
+        tcpreplay_seterr(ctx, "%s", "--spray can not be used with --intf2, --intf-pair or --dualfile");
+        return -1;
+    }
+
+    if (options->pair_intf_cnt >= 2 * (CACHE_MAX_PAIRS - 1)) {
+        tcpreplay_seterr(ctx, "Too many --spray interfaces, the max is %d", 2 * CACHE_MAX_PAIRS);
+        return -1;
+    }
+
+    if ((intname = get_interface(ctx->intlist, name)) == NULL) {
+        tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", name);
+        return -1;
+    }
+
+    ebuf = safe_malloc(SENDPACKET_ERRBUF_SIZE);
+
+    /* open interface for writing */
+    if ((sp = sendpacket_open(intname, ebuf, TCPR_DIR_C2S, ctx->sp_type, ctx)) == NULL) {
+        tcpreplay_seterr(ctx, "Can't open %s: %s", intname, ebuf);
+        ret = -1;
+        goto out;
+    }
+
+#if defined HAVE_NETMAP
+    sp->netmap_delay = options->netmap_delay;
+#endif
+
+    if (options->spray_cnt == 0) {
+        ctx->intf2 = sp;
+        ctx->intf2dlt = sendpacket_get_dlt(sp);
+        options->intf2_name = safe_strdup(intname);
+        options->spray_cnt = 2;
+    } else {
+        ctx->pair_intf[options->pair_intf_cnt] = sp;
+        options->pair_intf_name[options->pair_intf_cnt] = safe_strdup(intname);
+        options->pair_intf_cnt++;
+        options->spray_cnt++;
+    }
+
+    dlt = sendpacket_get_dlt(sp);
+    if (ctx->intf1dlt != -1 && dlt != ctx->intf1dlt) {
+        tcpreplay_seterr(ctx, "DLT type mismatch for %s (%s) and %s (%s)",
+            options->intf1_name, pcap_datalink_val_to_name(ctx->intf1dlt),
+            intname, pcap_datalink_val_to_name(dlt));
+        ret = -1;
+        goto out;
+    }
+
+out:
+    safe_free(ebuf);
+    return ret;
+}
+
 /**
  * Set the replay speed mode.
  */
@@ -551,63 +1834,306 @@ tcpreplay_set_speed_mode(tcpreplay_t *ctx, tcpreplay_speed_mode value)
 {
     assert(ctx);
 
-    ctx->options->speed.mode = value;
+    ctx->options->speed.mode = value;
+    return 0;
+}
+
+/**
+ * Set the approprate speed value.  Value is interpreted based on 
+ * how tcpreplay_set_speed_mode() value
+ */
+int
+tcpreplay_set_speed_speed(tcpreplay_t *ctx, COUNTER value)
+{
+    assert(ctx);
+    ctx->options->speed.speed = value;
+    return 0;
+}
+
+
+/**
+ * Sending under packets/sec requires an integer value, not float.
+ * you must first call tcpreplay_set_speed_mode(ctx, speed_packetrate)
+ */
+int
+tcpreplay_set_speed_pps_multi(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+    ctx->options->speed.pps_multi = value;
+    return 0;
+}
+
+/**
+ * Most bytes (mbps) or packets (pps) to send back to back when catching
+ * up after falling behind, 0 for no limit
+ */
+int
+tcpreplay_set_speed_burst(tcpreplay_t *ctx, COUNTER value)
+{
+    assert(ctx);
+    ctx->options->speed.burst = value;
+    return 0;
+}
+
+/**
+ * What to do with packets more than threshold_ns late
+ */
+int
+tcpreplay_set_late_policy(tcpreplay_t *ctx, tcpreplay_late_policy policy, u_int64_t threshold_ns)
+{
+    assert(ctx);
+    ctx->options->speed.late_policy = policy;
+    ctx->options->speed.late_ns = threshold_ns;
+    return 0;
+}
+
+/**
+ * How many times should we loop through all the pcap files?
+ */
+int
+tcpreplay_set_loop(tcpreplay_t *ctx, u_int32_t value)
+{
+    assert(ctx);
+    ctx->options->loop = value;
+    return 0;
+}
+
+/**
+ * Set the unique IP address flag
+ */
+int
+tcpreplay_set_unique_ip(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->unique_ip = value;
+    return 0;
+}
+
+int
+tcpreplay_set_unique_ip_loops(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+    ctx->options->unique_loops = value;
+    return 0;
+}
+
+/**
+ * \brief Give each host a new address of the IPv4 network pool every loop
+ *
+ * Rather than shifting addresses by the loop count, --unique-ip maps the
+ * n-th host of the preloaded files to a distinct address of pool for
+ * every loop, e.g. 10.0.0.0/8.  Implies preloading.  NULL turns it off.
+ */
+int
+tcpreplay_set_unique_ip_pool(tcpreplay_t *ctx, const char *value)
+{
+    tcpreplay_opt_t *options;
+    tcpr_cidr_t *cidr = NULL;
+    char *pool;
+
+    assert(ctx);
+    options = ctx->options;
+
+    if (value == NULL) {
+        options->unique_pool_size = 0;
+        return 0;
+    }
+
+    pool = safe_strdup(value);
+    if (!parse_cidr(&cidr, pool, ",") || cidr->family != AF_INET || cidr->next != NULL || cidr->masklen > 30) {
+        tcpreplay_seterr(ctx, "invalid --unique-ip-pool: %s.  Expected an IPv4 network up to /30, e.g. 10.0.0.0/8", value);
+        destroy_cidr(cidr);
+        safe_free(pool);
+        return -1;
+    }
+
+    options->unique_pool_size = (u_int64_t)1 << (32 - cidr->masklen);
+    options->unique_pool = ntohl(cidr->u.network) & (uint32_t)~(options->unique_pool_size - 1);
+    options->preload_pcap = true;
+    destroy_cidr(cidr);
+    safe_free(pool);
+
     return 0;
 }
 
 /**
- * Set the approprate speed value.  Value is interpreted based on 
- * how tcpreplay_set_speed_mode() value
+ * \brief Only preload the packets matching a BPF expression
+ *
+ * The expression is checked here, and compiled again for the link type
+ * of each file as it is preloaded, see preload_filter_open().  Packets
+ * which don't match never enter the cache, so loops don't look at them
+ * again.  Implies preloading.  NULL caches every packet.
  */
 int
-tcpreplay_set_speed_speed(tcpreplay_t *ctx, COUNTER value)
+tcpreplay_set_preload_filter(tcpreplay_t *ctx, const char *filter)
 {
+    tcpreplay_opt_t *options;
+    struct bpf_program program;
+    pcap_t *dead;
+
     assert(ctx);
-    ctx->options->speed.speed = value;
+    options = ctx->options;
+
+    safe_free(options->preload_filter);
+    options->preload_filter = NULL;
+    if (filter == NULL)
+        return 0;
+
+    if ((dead = pcap_open_dead(DLT_EN10MB, MAX_SNAPLEN)) == NULL) {
+        tcpreplay_seterr(ctx, "%s", "unable to check --preload-filter");
+        return -1;
+    }
+
+    if (pcap_compile(dead, &program, filter, 1, 0) != 0) {
+        tcpreplay_seterr(ctx, "invalid --preload-filter '%s': %s", filter, pcap_geterr(dead));
+        pcap_close(dead);
+        return -1;
+    }
+
+    pcap_freecode(&program);
+    pcap_close(dead);
+    options->preload_filter = safe_strdup(filter);
+    options->preload_pcap = true;
+
     return 0;
 }
 
-
 /**
- * Sending under packets/sec requires an integer value, not float.
- * you must first call tcpreplay_set_speed_mode(ctx, speed_packetrate)
+ * \brief Set the --rss-queues Toeplitz key, e.g. as ethtool -x prints it
+ *
+ * Hex digits, optionally with a colon between bytes.  Of keys longer
+ * than FLOW_RSS_KEY_LEN bytes, which some NICs use, only the first
+ * FLOW_RSS_KEY_LEN bytes matter for the hash.  NULL goes back to the
+ * default key.
  */
 int
-tcpreplay_set_speed_pps_multi(tcpreplay_t *ctx, int value)
+tcpreplay_set_rss_key(tcpreplay_t *ctx, const char *value)
 {
+    tcpreplay_opt_t *options;
+    u_char *key;
+    size_t len = 0;
+    const char *p;
+
     assert(ctx);
-    ctx->options->speed.pps_multi = value;
+    options = ctx->options;
+
+    safe_free(options->rss_key);
+    options->rss_key = NULL;
+    options->rss_key_len = 0;
+    if (value == NULL)
+        return 0;
+
+    key = safe_malloc(strlen(value) / 2 + 1);
+    for (p = value; *p != '\0'; p += 2) {
+        char hex[3];
+
+        if (*p == ':' && len > 0)
+            ++p;
+        if (!isxdigit((u_char)p[0]) || !isxdigit((u_char)p[1]))
+            break;
+        hex[0] = p[0];
+        hex[1] = p[1];
+        hex[2] = '\0';
+        key[len++] = (u_char)strtoul(hex, NULL, 16);
+    }
+
+    if (*p != '\0' || len < FLOW_RSS_KEY_LEN) {
+        tcpreplay_seterr(ctx,
+                         "invalid --rss-key: %s.  Expected at least %d bytes in hex, e.g. 6d:5a:56:da:...",
+                         value,
+                         FLOW_RSS_KEY_LEN);
+        safe_free(key);
+        return -1;
+    }
+
+    options->rss_key = key;
+    options->rss_key_len = len;
     return 0;
 }
 
 /**
- * How many times should we loop through all the pcap files?
+ * \brief Set the --mix weights, one per pcap file in order, e.g. "60,25,15"
+ *
+ * The files are then sent together out the primary interface, each
+ * getting its share of the bytes (or packets) sent.  Implies preloading.
+ * NULL turns it off.
  */
 int
-tcpreplay_set_loop(tcpreplay_t *ctx, u_int32_t value)
+tcpreplay_set_mix(tcpreplay_t *ctx, const char *value)
 {
+    tcpreplay_opt_t *options;
+    char *weights, *token, *end, *save = NULL;
+    int cnt = 0;
+
     assert(ctx);
-    ctx->options->loop = value;
+    options = ctx->options;
+
+    if (value == NULL) {
+        options->mix_cnt = 0;
+        return 0;
+    }
+
+    weights = safe_strdup(value);
+    for (token = strtok_r(weights, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+        unsigned long weight = strtoul(token, &end, 10);
+
+        if (end == token || *end != '\0' || weight < 1 || weight > MIX_WEIGHT_MAX || cnt == MAX_FILES) {
+            tcpreplay_seterr(ctx, "invalid --mix: %s.  Expected a weight of 1-%d for each pcap, e.g. 60,25,15", value, MIX_WEIGHT_MAX);
+            safe_free(weights);
+            return -1;
+        }
+        options->mix_weight[cnt++] = (u_int32_t)weight;
+    }
+    safe_free(weights);
+
+    if (cnt == 0) {
+        tcpreplay_seterr(ctx, "invalid --mix: %s", value);
+        return -1;
+    }
+
+    options->mix_cnt = cnt;
+    options->preload_pcap = true;
+
     return 0;
 }
 
 /**
- * Set the unique IP address flag
+ * \brief Add a --gen-field rule, e.g. "sport:inc:1024-65535"
+ *
+ * Every packet sent from the cache then gets the next value of the field,
+ * see gen_field_parse() for the syntax.  Implies preloading.  Not
+ * available to tcpreplay-edit.
  */
 int
-tcpreplay_set_unique_ip(tcpreplay_t *ctx, bool value)
+tcpreplay_add_gen_field(tcpreplay_t *ctx, const char *value)
 {
-    assert(ctx);
-    ctx->options->unique_ip = value;
-    return 0;
-}
+    tcpreplay_opt_t _U_ *options;
 
-int
-tcpreplay_set_unique_ip_loops(tcpreplay_t *ctx, int value)
-{
     assert(ctx);
-    ctx->options->unique_loops = value;
+    assert(value);
+    options = ctx->options;
+
+#ifdef TCPREPLAY_EDIT
+    tcpreplay_seterr(ctx, "%s", "--gen-field is not supported by tcpreplay-edit");
+    return -1;
+#else
+    if (options->gen_field_cnt == GEN_FIELDS_MAX) {
+        tcpreplay_seterr(ctx, "too many --gen-field rules, at most %d", GEN_FIELDS_MAX);
+        return -1;
+    }
+
+    if (gen_field_parse(&options->gen_fields[options->gen_field_cnt], value) < 0) {
+        tcpreplay_seterr(ctx,
+                         "invalid --gen-field: %s.  Expected FIELD:inc|rand|loop[:LOW-HIGH] where FIELD is ipsrc, "
+                         "ipdst, sport, dport, vlan or @OFFSET/WIDTH",
+                         value);
+        return -1;
+    }
+
+    options->gen_field_cnt++;
+    options->preload_pcap = true;
     return 0;
+#endif
 }
 
 /**
@@ -657,9 +2183,62 @@ tcpreplay_set_accurate(tcpreplay_t *ctx, tcpreplay_accurate value)
 {
     assert(ctx);
     ctx->options->accurate = value;
+    if (value == accurate_hybrid && ctx->options->hybrid_margin_ns == 0)
+        ctx->options->hybrid_margin_ns = hybrid_sleep_calibrate();
     return 0;
 }
 
+/**
+ * \brief a --digest for a sendpacket_t whose packets are of datalink
+ *
+ * With --threads or --fleet the order packets go out in changes from
+ * run to run, so only the digest by flow is kept.
+ */
+tcpr_digest_t *
+tcpreplay_digest_new(tcpreplay_t *ctx, int datalink)
+{
+    bool parallel = ctx->options->threads > 1 || ctx->fleet != NULL;
+    tcpr_digest_t *digest;
+
+    /* what sendpacket_get_dlt() assumes too */
+    if (datalink < 0)
+        datalink = DLT_EN10MB;
+
+    digest = tcpr_digest_new(ctx->options->digest_flows || parallel ? datalink : -1);
+    if (parallel)
+        digest->ordered = false;
+
+    return digest;
+}
+
+/**
+ * Returns the --timer name of an accurate timing mode
+ */
+const char *
+tcpreplay_accurate_name(tcpreplay_accurate value)
+{
+    switch (value) {
+    case accurate_gtod:
+        return "gtod";
+    case accurate_select:
+        return "select";
+    case accurate_nanosleep:
+        return "nano";
+    case accurate_ioport:
+        return "ioport";
+    case accurate_txtime:
+        return "txtime";
+    case accurate_hybrid:
+        return "hybrid";
+    case accurate_kqueue:
+        return "kqueue";
+    case accurate_timerfd:
+        return "timerfd";
+    }
+
+    return "unknown";
+}
+
 /**
  * Sets the number of seconds between printing stats
  */
@@ -701,11 +2280,214 @@ tcpreplay_set_preload_pcap(tcpreplay_t *ctx, bool value)
     return 0;
 }
 
+/**
+ * \brief Enable or disable reading classic pcap files via mmap()
+ *
+ * Packets are handed out as pointers into the file mapping rather than
+ * being copied, so with --preload-pcap the cache costs no RAM beyond the
+ * page cache.  Files libpcap must decode (pcapng, stdin, compressed) still
+ * go through libpcap.
+ */
+int
+tcpreplay_set_mmap_pcap(_U_ tcpreplay_t *ctx, _U_ bool value)
+{
+    assert(ctx);
+#if defined HAVE_MMAP && !defined TCPREPLAY_EDIT
+    ctx->options->mmap_pcap = value;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "mmap pcap reader not supported");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Enable or disable mapping a saved image of the preload cache
+ */
+int
+tcpreplay_set_cache_image(_U_ tcpreplay_t *ctx, _U_ bool value)
+{
+    assert(ctx);
+#if defined HAVE_MMAP && !defined TCPREPLAY_EDIT
+    ctx->options->cache_image = value;
+    if (value)
+        ctx->options->preload_pcap = true;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "cache images not supported");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Enable or disable pipelined preloading of multi-file playlists
+ *
+ * Rather than loading every pcap before the first packet is sent, the
+ * next file (or pair of files with --dualfile) is loaded on a background
+ * thread while the current one is sent, and each file is freed once sent.
+ * Forces preloading.
+ */
+int
+tcpreplay_set_preload_stream(_U_ tcpreplay_t *ctx, _U_ bool value)
+{
+    assert(ctx);
+#ifdef HAVE_PTHREAD
+    ctx->options->preload_stream = value;
+    if (value)
+        ctx->options->preload_pcap = true;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "streaming preload not supported");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Keep the preloaded packets LZ4 compressed, decompressing them on
+ * a helper thread ahead of sending.  Forces preloading.
+ */
+int
+tcpreplay_set_preload_lz4(_U_ tcpreplay_t *ctx, _U_ bool value)
+{
+    assert(ctx);
+#ifdef ENABLE_PRELOAD_LZ4
+    ctx->options->preload_lz4 = value;
+    if (value)
+        ctx->options->preload_pcap = true;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "LZ4 compressed preload not supported");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Copy at most this many bytes of packets into RAM when preloading,
+ * or 0 for no limit
+ *
+ * The packets past the limit are sent straight from a memory mapping of
+ * the file, read ahead of sending.  Files that can't be mapped, such as
+ * compressed ones, must fit.  Forces preloading.
+ */
+int
+tcpreplay_set_cache_memory(tcpreplay_t *ctx, size_t bytes)
+{
+    assert(ctx);
+    ctx->options->cache_memory = bytes;
+    if (bytes != 0)
+        ctx->options->preload_pcap = true;
+    return 0;
+}
+
+/**
+ * \brief Set how many bytes of packets to read ahead of sending
+ *
+ * Only applies to files which are neither preloaded nor memory mapped.
+ * Use 0 to read directly through libpcap.
+ */
+int
+tcpreplay_set_readahead(_U_ tcpreplay_t *ctx, _U_ size_t value)
+{
+    assert(ctx);
+#ifdef HAVE_PTHREAD
+    ctx->options->readahead = value;
+    return 0;
+#else
+    tcpreplay_seterr(ctx, "%s", "read-ahead not supported");
+    return -1;
+#endif
+}
+
+/**
+ * \brief Set the number of threads used to send the preloaded pcaps
+ *
+ * Packets are sharded across threads by flow, so ordering within a
+ * flow is preserved.  Values > 1 force preloading and require top speed,
+ * --mbps or --pps.
+ */
+int
+tcpreplay_set_threads(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+#ifdef ENABLE_SEND_THREADS
+    if (value < 0 || value > MAX_SEND_THREADS) {
+        tcpreplay_seterr(ctx, "invalid thread count: %d", value);
+        return -1;
+    }
+    ctx->options->threads = value;
+    if (value > 1)
+        ctx->options->preload_pcap = true;
+    return 0;
+#else
+    if (value > 1) {
+        tcpreplay_seterr(ctx, "%s", "send threads not supported");
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+/**
+ * \brief NUMA node to send from
+ *
+ * The send thread(s) run on the CPUs of the node, so the memory they
+ * preload is placed there too.  TCPR_NUMA_AUTO (the default) picks the
+ * node of the first interface, -1 leaves placement to the OS.  Takes
+ * effect in tcpreplay_prepare().
+ */
+int
+tcpreplay_set_numa_node(tcpreplay_t *ctx, int value)
+{
+    assert(ctx);
+    if (value < TCPR_NUMA_AUTO) {
+        tcpreplay_seterr(ctx, "invalid NUMA node: %d", value);
+        return -1;
+    }
+    ctx->options->numa_node = value;
+    return 0;
+}
+
+/**
+ * \brief CPUs to send from, such as "2,4-7", instead of all those of the
+ * NUMA node
+ *
+ * With send threads, each thread is pinned to the next CPU of the list.
+ * Takes effect in tcpreplay_prepare().
+ */
+int
+tcpreplay_set_cpu_list(tcpreplay_t *ctx, const char *value)
+{
+    int cpus[TCPR_CPU_MAX];
+
+    assert(ctx);
+    if (value != NULL && tcpr_cpu_list_parse(value, cpus, TCPR_CPU_MAX) <= 0) {
+        tcpreplay_seterr(ctx, "invalid CPU list: %s", value);
+        return -1;
+    }
+    safe_free(ctx->options->cpu_list);
+    ctx->options->cpu_list = value != NULL ? safe_strdup(value) : NULL;
+    return 0;
+}
+
+/**
+ * \brief Allocate the preload cache from huge pages
+ *
+ * Takes effect in tcpreplay_prepare()
+ */
+int
+tcpreplay_set_hugepages(tcpreplay_t *ctx, bool value)
+{
+    assert(ctx);
+    ctx->options->hugepages = value;
+    return 0;
+}
+
 /**
  * \brief Add a pcap file to be sent via tcpreplay
  *
  * One or more pcap files can be added.  Each file will be replayed
- * in order
+ * in order.  Once tcpreplay_prepare() has been called, use
+ * tcpreplay_playlist_add() instead
  */
 int
 tcpreplay_add_pcapfile(tcpreplay_t *ctx, char *pcap_file)
@@ -713,7 +2495,7 @@ tcpreplay_add_pcapfile(tcpreplay_t *ctx, char *pcap_file)
     assert(ctx);
     assert(pcap_file);
 
-    if (ctx->options->source_cnt < MAX_FILES) {
+    if (ctx->options->source_cnt < MEM_SOURCE_IDX) {
         ctx->options->sources[ctx->options->source_cnt].filename = safe_strdup(pcap_file);
         ctx->options->sources[ctx->options->source_cnt].type = source_filename;
 
@@ -730,46 +2512,102 @@ tcpreplay_add_pcapfile(tcpreplay_t *ctx, char *pcap_file)
 
 
     } else {
-        tcpreplay_seterr(ctx, "Unable to add more then %u files", MAX_FILES);
+        tcpreplay_seterr(ctx, "Unable to add more then %u files", MEM_SOURCE_IDX);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Send packets from memory with tcpreplay_send_batch()
+ *
+ * The packets are of link type dlt, or that of the interface if -1.  With
+ * this set tcpreplay_prepare() doesn't need any pcap files
+ */
+int
+tcpreplay_set_mem_source(tcpreplay_t *ctx, int dlt)
+{
+    file_cache_t *file_cache;
+
+    assert(ctx);
+    if (ctx->intf1 != NULL) {
+        tcpreplay_seterr(ctx, "%s", "memory source must be set before tcpreplay_prepare()");
+        return -1;
+    }
+
+    file_cache = &ctx->options->file_cache[MEM_SOURCE_IDX];
+    file_cache->index = MEM_SOURCE_IDX;
+    file_cache->dlt = dlt;
+    ctx->options->mem_source = true;
+    return 0;
+}
+
+/**
+ * Limit the total number of packets to send
+ */
+int
+tcpreplay_set_limit_send(tcpreplay_t *ctx, COUNTER value)
+{
+    assert(ctx);
+    ctx->options->limit_send = value;
+    return 0;
+}
+
+/**
+ * \brief Specify the tcpprep cache file to use for replaying with two NICs
+ *
+ * Note: this only works if you have a single pcap file
+ * returns -1 on error
+ */
+int
+tcpreplay_set_tcpprep_cache(tcpreplay_t *ctx, char *file)
+{
+    assert(ctx);
+    char *tcpprep_file;
+
+    if (ctx->options->source_cnt > 1) {
+        tcpreplay_seterr(ctx, "%s", "Unable to use tcpprep cache file with a single pcap file");
         return -1;
     }
+
+    tcpprep_file = safe_strdup(file);
+    ctx->options->cache_packets = read_cache_shards(&ctx->options->cachedata, &ctx->options->cachepairs,
+        &ctx->options->cache_pairs, &ctx->options->cacheshards, &ctx->options->cache_shards, tcpprep_file,
+        &ctx->options->comment);
+
+    free(tcpprep_file);
+
     return 0;
 }
 
 /**
- * Limit the total number of packets to send
+ * \brief Wait until the given CLOCK_TAI time in nanoseconds before sending
+ * the first packet, or start right away if it's 0
  */
 int
-tcpreplay_set_limit_send(tcpreplay_t *ctx, COUNTER value)
+tcpreplay_set_start_at(tcpreplay_t *ctx, u_int64_t start_at_ns)
 {
     assert(ctx);
-    ctx->options->limit_send = value;
+
+    ctx->options->start_at_ns = start_at_ns;
     return 0;
 }
 
 /**
- * \brief Specify the tcpprep cache file to use for replaying with two NICs
- *
- * Note: this only works if you have a single pcap file
- * returns -1 on error
+ * \brief Only send the packets of this shard of the tcpprep cache, or every
+ * packet if shard is -1
  */
 int
-tcpreplay_set_tcpprep_cache(tcpreplay_t *ctx, char *file)
+tcpreplay_set_shard(tcpreplay_t *ctx, int shard)
 {
     assert(ctx);
-    char *tcpprep_file;
 
-    if (ctx->options->source_cnt > 1) {
-        tcpreplay_seterr(ctx, "%s", "Unable to use tcpprep cache file with a single pcap file");
+    if (shard < -1 || shard >= CACHE_MAX_SHARDS) {
+        tcpreplay_seterr(ctx, "Invalid shard: %d", shard);
         return -1;
     }
 
-    tcpprep_file = safe_strdup(file);
-    ctx->options->cache_packets = read_cache(&ctx->options->cachedata, 
-        tcpprep_file, &ctx->options->comment);
-
-    free(tcpprep_file);
-
+    ctx->options->shard = shard;
     return 0;
 }
 
@@ -901,8 +2739,8 @@ const struct timeval *
 tcpreplay_get_start_time(tcpreplay_t *ctx)
 {
     assert(ctx);
-    TIMEVAL_SET(&ctx->static_stats.start_time, &ctx->stats.start_time);
-    return &ctx->static_stats.start_time;
+    tcpr_clock_to_timeval(ctx->stats.start_time_ns, &ctx->static_start_time);
+    return &ctx->static_start_time;
 }
 
 /**
@@ -912,8 +2750,8 @@ const struct timeval *
 tcpreplay_get_end_time(tcpreplay_t *ctx)
 {
     assert(ctx);
-    TIMEVAL_SET(&ctx->static_stats.end_time, &ctx->stats.end_time);
-    return &ctx->static_stats.end_time;
+    tcpr_clock_to_timeval(ctx->stats.end_time_ns, &ctx->static_end_time);
+    return &ctx->static_end_time;
 }
 
 
@@ -998,7 +2836,7 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         goto out;
     }
 
-    if (ctx->options->source_cnt == 0) {
+    if (ctx->options->source_cnt == 0 && !ctx->options->mem_source) {
         tcpreplay_seterr(ctx, "%s", "You must specify at least one source pcap");
         ret = -1;
         goto out;
@@ -1018,17 +2856,31 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         }
     }
 
+    if (ctx->options->mix_cnt > 0 && ctx->options->mix_cnt != ctx->options->source_cnt) {
+        tcpreplay_seterr(ctx,
+                         "--mix has %d weights for %d pcap files",
+                         ctx->options->mix_cnt,
+                         ctx->options->source_cnt);
+        ret = -1;
+        goto out;
+    }
+
     if (ctx->options->dualfile && ctx->options->cachedata != NULL) {
         tcpreplay_seterr(ctx, "%s", "Can't use dual file mode and tcpprep cache file together");
         ret = -1;
         goto out;
     }
 
-    if ((ctx->options->dualfile || ctx->options->cachedata != NULL) && 
+    if ((ctx->options->dualfile || (ctx->options->cachedata != NULL && ctx->options->shard < 0)) &&
            ctx->options->intf2_name == NULL) {
         tcpreplay_seterr(ctx, "%s", "dual file mode and tcpprep cache files require two interfaces");
     }
 
+    if (ctx->options->cachedata != NULL && (check_cache_pairs(ctx) < 0 || check_cache_shard(ctx) < 0)) {
+        ret = -1;
+        goto out;
+    }
+
 
 #ifndef HAVE_SELECT
     if (ctx->options->accurate == accurate_select) {
@@ -1042,6 +2894,8 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         if (!strncmp(OPT_ARG(INTF1), "netmap:", 7) || !strncmp(OPT_ARG(INTF1), "vale", 4))
             tcpreplay_seterr(ctx, "Unable to connect to netmap interface %s. Ensure netmap module is installed (see INSTALL).",
                     OPT_ARG(INTF1));
+        else if (!strncmp(OPT_ARG(INTF1), "dpdk:", 5))
+            tcpreplay_seterr(ctx, "DPDK port %s requires building with --with-dpdk (see INSTALL).", OPT_ARG(INTF1));
         else
             tcpreplay_seterr(ctx, "Invalid interface name/alias: %s", OPT_ARG(INTF1));
 
@@ -1049,6 +2903,11 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         goto out;
     }
 
+    if (numa_setup(ctx) < 0) {
+        ret = -1;
+        goto out;
+    }
+
     /* open interfaces for writing */
     if ((ctx->intf1 = sendpacket_open(ctx->options->intf1_name, ebuf, TCPR_DIR_C2S, ctx->sp_type, ctx)) == NULL) {
         tcpreplay_seterr(ctx, "Can't open %s: %s", ctx->options->intf1_name, ebuf);
@@ -1082,6 +2941,9 @@ tcpreplay_prepare(tcpreplay_t *ctx)
         }
     }
 
+    if (ctx->options->mem_source && ctx->options->file_cache[MEM_SOURCE_IDX].dlt < 0)
+        ctx->options->file_cache[MEM_SOURCE_IDX].dlt = int1dlt;
+
     /*
      * Setup up the file cache, if required
      */
@@ -1099,6 +2961,277 @@ out:
     return ret;
 }
 
+/**
+ * \brief give every interface a --digest, workers get theirs in send_threads_init()
+ */
+static void
+tcpreplay_digest_alloc(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int i;
+
+    if (ctx->intf1->digest == NULL)
+        ctx->intf1->digest = tcpreplay_digest_new(ctx, ctx->intf1dlt);
+    if (ctx->intf2 != NULL && ctx->intf2->digest == NULL)
+        ctx->intf2->digest = tcpreplay_digest_new(ctx, ctx->intf2dlt);
+    for (i = 0; i < options->pair_intf_cnt; i++) {
+        if (ctx->pair_intf[i]->digest == NULL)
+            ctx->pair_intf[i]->digest = tcpreplay_digest_new(ctx, ctx->intf1dlt);
+    }
+}
+
+/**
+ * \brief give every interface a --trace-ring, workers get theirs in send_threads_init()
+ */
+static void
+tcpreplay_trace_alloc(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int i;
+
+    if (ctx->intf1->trace == NULL)
+        ctx->intf1->trace = tcpr_trace_new(options->trace_size);
+    if (ctx->intf2 != NULL && ctx->intf2->trace == NULL)
+        ctx->intf2->trace = tcpr_trace_new(options->trace_size);
+    for (i = 0; i < options->pair_intf_cnt; i++) {
+        if (ctx->pair_intf[i]->trace == NULL)
+            ctx->pair_intf[i]->trace = tcpr_trace_new(options->trace_size);
+    }
+}
+
+/**
+ * \brief write every --trace-ring to options->trace_file
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int
+tcpreplay_trace_dump(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    sendpacket_t *sources[2 + 2 * (CACHE_MAX_PAIRS - 1) + MAX_SEND_THREADS];
+    int threads[2 + 2 * (CACHE_MAX_PAIRS - 1) + MAX_SEND_THREADS];
+    int i, n = 0, ret = 0;
+    FILE *f;
+
+    sources[n] = ctx->intf1;
+    threads[n++] = 0;
+    if (ctx->intf2 != NULL) {
+        sources[n] = ctx->intf2;
+        threads[n++] = 0;
+    }
+    for (i = 0; i < options->pair_intf_cnt; i++) {
+        sources[n] = ctx->pair_intf[i];
+        threads[n++] = 0;
+    }
+#ifdef ENABLE_SEND_THREADS
+    for (i = 1; ctx->threads != NULL && i < ctx->threads->cnt; i++) {
+        if (ctx->threads->workers[i].sp == NULL)
+            continue;
+        sources[n] = ctx->threads->workers[i].sp;
+        threads[n++] = i;
+    }
+#endif
+
+    if ((f = fopen(options->trace_file, "wb")) == NULL) {
+        tcpreplay_setwarn(ctx, "Unable to open trace file %s: %s", options->trace_file, strerror(errno));
+        return -1;
+    }
+
+    if (tcpr_trace_write_header(f) < 0)
+        ret = -1;
+    for (i = 0; i < n && ret == 0; i++) {
+        if (sources[i]->trace != NULL && tcpr_trace_write(f, sources[i]->trace, sources[i]->device, threads[i]) < 0)
+            ret = -1;
+    }
+    if (fclose(f) != 0)
+        ret = -1;
+
+    if (ret < 0)
+        tcpreplay_setwarn(ctx, "Unable to write trace file %s: %s", options->trace_file, strerror(errno));
+
+    return ret;
+}
+
+#ifdef ENABLE_TXSTAMP
+/**
+ * \brief start the --tx-timestamps reader of every interface
+ *
+ * Returns 0 on success, -1 on error
+ */
+static int
+tcpreplay_txstamp_start(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    double multiplier = options->speed.mode == speed_multiplier ? options->speed.multiplier : 0.0;
+    sendpacket_t *sp;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    int i;
+
+    for (i = -2; i < options->pair_intf_cnt; i++) {
+        sp = i == -2 ? ctx->intf1 : i == -1 ? ctx->intf2 : ctx->pair_intf[i];
+        if (sp == NULL || sp->txstamp == NULL)
+            continue;
+        if (txstamp_start(sp->txstamp, multiplier, ebuf) < 0) {
+            tcpreplay_seterr(ctx, "%s", ebuf);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \brief collect the last timestamps and stop the readers
+ */
+static void
+tcpreplay_txstamp_stop(tcpreplay_t *ctx)
+{
+    sendpacket_t *sp;
+    int i;
+
+    for (i = -2; i < ctx->options->pair_intf_cnt; i++) {
+        sp = i == -2 ? ctx->intf1 : i == -1 ? ctx->intf2 : ctx->pair_intf[i];
+        if (sp != NULL)
+            txstamp_stop(sp->txstamp);
+    }
+}
+#endif
+
+/**
+ * \brief Gets everything ready for the first packet to go out at full speed
+ *
+ * Call after the files are preloaded and before tcpreplay_replay(): locks
+ * the packet cache in memory, faulting it in, faults in the TX rings and
+ * latches the clocks, so none of it slows down the first pass.  Returns
+ * 1 with a warning if the cache couldn't be locked, in which case it is
+ * only faulted in and the OS may still page it out.
+ */
+int
+tcpreplay_warmup(tcpreplay_t *ctx)
+{
+    assert(ctx);
+
+    return warmup_run(ctx);
+}
+
+/*
+ * --start-at is on CLOCK_TAI, which the nodes of a multi-host replay keep
+ * in step with PTP, or the wall clock where there is no CLOCK_TAI
+ */
+#if defined HAVE_CLOCK_GETTIME && defined CLOCK_TAI
+#define START_AT_CLOCK_ID CLOCK_TAI
+#elif defined HAVE_CLOCK_GETTIME
+#define START_AT_CLOCK_ID CLOCK_REALTIME
+#endif
+
+/* sleep until this close to the start time, then busy-wait the rest */
+#define START_AT_SPIN_NS 2000000ULL
+
+static u_int64_t
+start_at_clock_ns(void)
+{
+#ifdef START_AT_CLOCK_ID
+    struct timespec ts;
+
+    clock_gettime(START_AT_CLOCK_ID, &ts);
+    return TIMESPEC_TO_NANOSEC(&ts);
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return TIMEVAL_TO_NANOSEC(&tv);
+#endif
+}
+
+/**
+ * \brief wake every sendpacket_t of ctx out of its sleeps
+ */
+static void
+tcpreplay_wake(tcpreplay_t *ctx)
+{
+    int i;
+
+    if (ctx->intf1 != NULL)
+        sendpacket_wake(ctx->intf1);
+
+    if (ctx->intf2 != NULL)
+        sendpacket_wake(ctx->intf2);
+
+    for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+        sendpacket_wake(ctx->pair_intf[i]);
+
+#ifdef ENABLE_SEND_THREADS
+    send_threads_wake(ctx);
+#endif
+}
+
+/**
+ * \brief sleep for nap_ns between passes, ended early only by an abort
+ */
+static void
+tcpreplay_nap(tcpreplay_t *ctx, u_int64_t nap_ns)
+{
+    u_int64_t until = tcpr_clock_ns() + nap_ns, now;
+
+    if (tcpr_clock_simulated()) {
+        tcpr_clock_sim_advance(until);
+        return;
+    }
+
+    if (ctx->intf1 == NULL) {
+        struct timespec ts;
+
+        NANOSEC_TO_TIMESPEC(nap_ns, &ts);
+        nanosleep(&ts, NULL);
+        return;
+    }
+
+    /* a suspend or pause is left to the send loop */
+    while (!ctx->abort && (now = tcpr_clock_ns()) < until) {
+        if (sendpacket_nap(ctx->intf1, until - now) && !ctx->abort)
+            sendpacket_wake_clear(ctx->intf1);
+    }
+}
+
+/**
+ * \brief wait for --start-at
+ *
+ * Sleeps in short steps, so tcpreplay_abort() isn't held up, then spins
+ * for the last couple of milliseconds to start as close to the time as
+ * the clock allows.  The wait only applies to the first call of
+ * tcpreplay_replay().  Returns -1 if the time has already passed.
+ */
+static int
+tcpreplay_wait_start(tcpreplay_t *ctx)
+{
+    u_int64_t start_at = ctx->options->start_at_ns;
+    u_int64_t now = start_at_clock_ns();
+
+    ctx->options->start_at_ns = 0;
+
+    if (now >= start_at) {
+        tcpreplay_seterr(ctx, "--start-at time is %.6f seconds in the past",
+                (double)(now - start_at) / 1000000000.0);
+        return -1;
+    }
+
+    notice("Waiting %.3f seconds for the start time...", (double)(start_at - now) / 1000000000.0);
+
+    while (!ctx->abort && start_at - now > START_AT_SPIN_NS) {
+        u_int64_t wait = start_at - now - START_AT_SPIN_NS;
+
+        if (wait > 100000000ULL)
+            wait = 100000000ULL;
+        tcpreplay_nap(ctx, wait);
+        now = start_at_clock_ns();
+    }
+
+    while (!ctx->abort && now < start_at)
+        now = start_at_clock_ns();
+
+    return 0;
+}
+
 /**
  * \brief sends the traffic out the interfaces
  *
@@ -1110,6 +3243,7 @@ tcpreplay_replay(tcpreplay_t *ctx)
 {
     int rcode;
     COUNTER loop, total_loops;
+    bool warned = false;
 
     assert(ctx);
 
@@ -1123,16 +3257,63 @@ tcpreplay_replay(tcpreplay_t *ctx)
         return -1;
     }
 
-    init_timestamp(&ctx->stats.start_time);
-    init_timestamp(&ctx->stats.time_delta);
-    init_timestamp(&ctx->stats.end_time);
-    init_timestamp(&ctx->stats.pkt_ts_delta);
-    init_timestamp(&ctx->stats.last_print);
+    tcpr_clock_init();
+    if (ctx->options->profile)
+        tcpr_prof_calibrate();
+    if (ctx->options->trace_file != NULL)
+        tcpreplay_trace_alloc(ctx);
+    if (ctx->options->digest)
+        tcpreplay_digest_alloc(ctx);
+    if (ctx->options->stats_breakdown && ctx->breakdown == NULL)
+        ctx->breakdown = breakdown_new();
+#ifdef ENABLE_TXSTAMP
+    if (ctx->options->tx_timestamps && tcpreplay_txstamp_start(ctx) < 0)
+        return -1;
+#endif
+#ifdef ENABLE_RXMATCH
+    if (ctx->rxmatch != NULL) {
+        char ebuf[PCAP_ERRBUF_SIZE];
+
+        if (rxmatch_start(ctx->rxmatch, ebuf) < 0) {
+            tcpreplay_seterr(ctx, "%s", ebuf);
+            return -1;
+        }
+    }
+#endif
+
+#ifdef HAVE_PTHREAD
+    if (ctx->options->stats_socket != NULL && stats_export_start(ctx, ctx->options->stats_socket) < 0)
+        return -1;
+    if (ctx->options->rate_adapt_ms != 0 && rate_adapt_start(ctx) < 0)
+        return -1;
+#endif
+#ifdef ENABLE_SEND_THREADS
+    if (ctx->options->nic_threads && ctx->intf2 != NULL && nic_threads_start(ctx) < 0)
+        return -1;
+#endif
+
+    if (ctx->options->start_at_ns != 0 && tcpreplay_wait_start(ctx) < 0)
+        return -1;
+
+    ctx->stats.start_time_ns = 0;
+    ctx->stats.time_delta_ns = 0;
+    ctx->stats.end_time_ns = 0;
+    ctx->stats.pkt_ts_delta_ns = 0;
+    ctx->stats.last_print_ns = 0;
+    memset(&ctx->pacer, 0, sizeof(ctx->pacer));
 
     ctx->running = true;
+    ctx->loop_forever = ctx->options->loop == 0;
     total_loops = ctx->options->loop;
     loop = 0;
 
+    /* --resume picks up the loop count where the checkpoint left it */
+    if (ctx->options->checkpoint_file != NULL) {
+        if (checkpoint_start(ctx) < 0)
+            return -1;
+        loop = ctx->iteration;
+    }
+
     /* main loop, when not looping forever (or until abort) */
     if (ctx->options->loop > 0) {
         while (ctx->options->loop-- && !ctx->abort) {  /* limited loop */
@@ -1146,12 +3327,18 @@ tcpreplay_replay(tcpreplay_t *ctx)
                             loop, total_loops,
                             ctx->unique_iteration);
             }
+            TCPR_PROBE1(loop__begin, loop);
+            if (ctx->breakdown != NULL)
+                breakdown_loop_start(ctx);
             if ((rcode = tcpr_replay_index(ctx)) < 0)
                 return rcode;
+            if (ctx->breakdown != NULL)
+                breakdown_loop_end(ctx);
+            TCPR_PROBE1(loop__end, loop);
             if (ctx->options->loop > 0) {
                 if (!ctx->abort && ctx->options->loopdelay_ms > 0) {
-                    usleep(ctx->options->loopdelay_ms * 1000);
-                    gettimeofday(&ctx->stats.end_time, NULL);
+                    tcpreplay_nap(ctx, (u_int64_t)ctx->options->loopdelay_ms * 1000000);
+                    ctx->stats.end_time_ns = tcpr_clock_ns();
                 }
 
                 if (ctx->options->stats == 0)
@@ -1168,12 +3355,18 @@ tcpreplay_replay(tcpreplay_t *ctx)
                     printf("Loop " COUNTER_SPEC " (" COUNTER_SPEC " unique)...\n", loop,
                             ctx->unique_iteration);
             }
+            TCPR_PROBE1(loop__begin, loop);
+            if (ctx->breakdown != NULL)
+                breakdown_loop_start(ctx);
             if ((rcode = tcpr_replay_index(ctx)) < 0)
                 return rcode;
+            if (ctx->breakdown != NULL)
+                breakdown_loop_end(ctx);
+            TCPR_PROBE1(loop__end, loop);
 
             if (!ctx->abort && ctx->options->loopdelay_ms > 0) {
-                usleep(ctx->options->loopdelay_ms * 1000);
-                gettimeofday(&ctx->stats.end_time, NULL);
+                tcpreplay_nap(ctx, (u_int64_t)ctx->options->loopdelay_ms * 1000000);
+                ctx->stats.end_time_ns = tcpr_clock_ns();
             }
 
             if (ctx->options->stats == 0 && !ctx->abort)
@@ -1181,7 +3374,31 @@ tcpreplay_replay(tcpreplay_t *ctx)
         }
     }
 
+#ifdef HAVE_PTHREAD
+    stats_export_stop(ctx);
+    rate_adapt_stop(ctx);
+#endif
+#ifdef ENABLE_SEND_THREADS
+    nic_threads_stop(ctx);
+#endif
+    if (ctx->options->checkpoint_file != NULL)
+        checkpoint_finish(ctx);
+    if (ctx->options->trace_file != NULL && tcpreplay_trace_dump(ctx) < 0)
+        warned = true;
+#ifdef ENABLE_TXSTAMP
+    if (ctx->options->tx_timestamps)
+        tcpreplay_txstamp_stop(ctx);
+#endif
+#ifdef ENABLE_RXMATCH
+    /* whatever hasn't come back when the wait is over was lost */
+    rxmatch_stop(ctx->rxmatch, ctx->abort ? 0 : ctx->options->rx_wait_ms);
+#endif
+#ifdef ENABLE_SEND_THREADS
+    send_threads_fold(ctx);
+#endif
+
     ctx->running = false;
+    packet_stats_timevals(&ctx->stats);
 
     if (ctx->options->stats >= 0) {
         char buf[64];
@@ -1190,19 +3407,76 @@ tcpreplay_replay(tcpreplay_t *ctx)
             printf("Test complete: %s\n", buf);
     }
 
-    return 0;
+    return warned ? 1 : 0;
+}
+
+/**
+ * \brief Send packets from the caller's memory
+ *
+ * The cnt packets go through the same pacing, stats, editing and batched
+ * sending as those of a pcap file, as source MEM_SOURCE_IDX.  They are
+ * sent from where they are: the buffers are lent to tcpreplay until this
+ * returns, and may be edited in place as they go (--unique-ip, and
+ * tcpreplay-edit rewrites which don't grow the packet), so pass copies if
+ * they need to stay as they are.  Consecutive calls carry on the pacing
+ * as if they were one file, so timestamps should keep going up.
+ *
+ * Call tcpreplay_set_mem_source() before tcpreplay_prepare(), and not
+ * while tcpreplay_replay() is running.  Returns the number of packets
+ * taken, fewer than cnt if a limit was reached or the replay was
+ * aborted, or -1 on error
+ */
+int
+tcpreplay_send_batch(tcpreplay_t *ctx, const struct pcap_pkthdr *pkthdrs, u_char *const *data, int cnt)
+{
+    pkt_source_t *src;
+    int taken;
+
+    assert(ctx);
+
+    if (!ctx->options->mem_source || ctx->intf1 == NULL) {
+        tcpreplay_seterr(ctx, "%s", "call tcpreplay_set_mem_source() and tcpreplay_prepare() first");
+        return -1;
+    }
+
+    if (ctx->running) {
+        tcpreplay_seterr(ctx, "%s", "can't send a batch while replaying");
+        return -1;
+    }
+
+    if (cnt <= 0 || ctx->abort)
+        return 0;
+
+    assert(pkthdrs);
+    assert(data);
+
+    if (ctx->stats.start_time_ns == 0) {
+        tcpr_clock_init();
+        if (ctx->options->stats_breakdown && ctx->breakdown == NULL)
+            ctx->breakdown = breakdown_new();
+    }
+
+    src = pkt_source_mem(&ctx->options->file_cache[MEM_SOURCE_IDX], pkthdrs, data, cnt);
+    ctx->running = true;
+    send_packets(ctx, MEM_SOURCE_IDX);
+    ctx->running = false;
+    taken = (int)src->taken;
+    pkt_source_close(src);
+
+    return taken;
 }
 
 /**
  * \brief Abort the tcpreplay_replay execution.
  *
- * This might take a little while since tcpreplay_replay() only checks this
- * once per packet (sleeping between packets can cause delays), however, 
- * this function returns once the signal has been sent and does not block
+ * Sleeps and waits for room to send end at once, see sendpacket_wake().
+ * This function returns once the signal has been sent and does not block
  */
 int
 tcpreplay_abort(tcpreplay_t *ctx)
 {
+    int i;
+
     assert(ctx);
     ctx->abort = true;
 
@@ -1214,15 +3488,22 @@ tcpreplay_abort(tcpreplay_t *ctx)
     if (ctx->intf2 != NULL)
         sendpacket_abort(ctx->intf2);
 
+    for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+        sendpacket_abort(ctx->pair_intf[i]);
+
+#ifdef ENABLE_SEND_THREADS
+    send_threads_abort(ctx);
+#endif
+
     return 0;
 }
 
 /**
  * \brief Temporarily suspend tcpreplay_replay()
  *
- * This might take a little while since tcpreplay_replay() only checks this
- * once per packet (sleeping between packets can cause delays), however, 
- * this function returns once the signal has been sent and does not block 
+ * Sleeps and waits for room to send end at once, so no more packets go
+ * out.  This function returns once the signal has been sent and does not
+ * block
  *
  * Note that suspending a running context can create odd timing 
  */
@@ -1231,6 +3512,7 @@ tcpreplay_suspend(tcpreplay_t *ctx)
 {
     assert(ctx);
     ctx->suspend = true;
+    tcpreplay_wake(ctx);
     return 0;
 }
 
@@ -1244,6 +3526,7 @@ tcpreplay_restart(tcpreplay_t *ctx)
 {
     assert(ctx);
     ctx->suspend = false;
+    tcpreplay_wake(ctx);
     return 0;
 }
 
@@ -1259,6 +3542,177 @@ tcpreplay_is_suspended(tcpreplay_t *ctx)
     return ctx->suspend;
 }
 
+/**
+ * \brief Change the speed of a running replay
+ *
+ * Safe to call from any thread.  value is in the units of the matching
+ * option: Mbps for speed_mbpsrate, packets/sec for speed_packetrate, the
+ * factor for speed_multiplier; it is ignored for speed_topspeed.  The send
+ * loop picks the change up before its next packet or batch, and it
+ * replaces any --rate-profile.
+ */
+int
+tcpreplay_control_speed(tcpreplay_t *ctx, tcpreplay_speed_mode mode, double value)
+{
+    tcpreplay_control_t *control;
+
+    assert(ctx);
+    control = &ctx->control;
+
+    switch (mode) {
+    case speed_mbpsrate:
+    case speed_packetrate:
+    case speed_multiplier:
+        if (value <= 0.0) {
+            tcpreplay_seterr(ctx, "invalid speed %f", value);
+            return -1;
+        }
+        break;
+    case speed_topspeed:
+        break;
+    default:
+        tcpreplay_seterr(ctx, "speed mode %d can not be changed to while replaying", mode);
+        return -1;
+    }
+
+    while (__sync_lock_test_and_set(&control->lock, 1))
+        ;
+    control->mode = mode;
+    control->value = value;
+    __atomic_add_fetch(&control->gen, 1, __ATOMIC_RELEASE);
+    __sync_lock_release(&control->lock);
+
+    return 0;
+}
+
+/**
+ * \brief Stop or resume sending out an interface of a running replay
+ *
+ * Safe to call from any thread.  intf is the name of one of the interfaces,
+ * or NULL for all of them.  Packets for a paused interface are held, not
+ * dropped, so a replay through both interfaces of a cache file stops
+ * when it reaches a packet for the paused one.
+ */
+int
+tcpreplay_control_pause(tcpreplay_t *ctx, const char *intf, bool pause)
+{
+    sendpacket_t *sps[2 + 2 * (CACHE_MAX_PAIRS - 1)];
+    int i, cnt = 0, found = 0;
+
+    assert(ctx);
+
+    sps[cnt++] = ctx->intf1;
+    sps[cnt++] = ctx->intf2;
+    for (i = 0; i < ctx->options->pair_intf_cnt; i++)
+        sps[cnt++] = ctx->pair_intf[i];
+
+    for (i = 0; i < cnt; i++) {
+        if (sps[i] == NULL || (intf != NULL && strcmp(sps[i]->device, intf) != 0))
+            continue;
+
+        sps[i]->paused = pause;
+        sendpacket_wake(sps[i]);
+        found++;
+
+#ifdef ENABLE_SEND_THREADS
+        /* the send workers all share intf1 */
+        if (sps[i] == ctx->intf1 && ctx->threads != NULL) {
+            send_threads_t *st = __atomic_load_n(&ctx->threads, __ATOMIC_ACQUIRE);
+            int w;
+
+            for (w = 1; w < st->cnt; w++) {
+                sendpacket_t *sp = __atomic_load_n(&st->workers[w].sp, __ATOMIC_ACQUIRE);
+
+                if (sp != NULL) {
+                    sp->paused = pause;
+                    sendpacket_wake(sp);
+                }
+            }
+        }
+#endif
+    }
+
+    if (!found) {
+        tcpreplay_seterr(ctx, "no interface %s", intf != NULL ? intf : "");
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief (re)start the --mbps/--pps pacer from now
+ *
+ * pkts and bytes are what has been sent so far
+ */
+void
+tcpreplay_pace_restart(tcpreplay_t *ctx, COUNTER pkts, COUNTER bytes, u_int64_t now_ns)
+{
+    tcpreplay_speed_t *speed = &ctx->options->speed;
+
+    switch (speed->mode) {
+    case speed_mbpsrate:
+        if (speed->speed == 0)
+            break;
+        tcpr_pacer_init(&ctx->pacer, 1000000000.0 / (double)speed->speed, speed->burst * 8, now_ns);
+        ctx->pacer.base_units = tcpreplay_pace_bits(speed, pkts, bytes);
+        return;
+    case speed_packetrate:
+        tcpr_pacer_init(&ctx->pacer, 1000000000.0 * (60 * 60) / (double)speed->speed, speed->burst, now_ns);
+        ctx->pacer.base_units = pkts;
+        return;
+    default:
+        break;
+    }
+
+    memset(&ctx->pacer, 0, sizeof(ctx->pacer));
+}
+
+/**
+ * \brief copy a pending tcpreplay_control_speed() into options->speed
+ *
+ * Only called by the thread(s) sending, with pkts and bytes sent so far.
+ * Returns true if the speed changed.
+ */
+bool
+tcpreplay_control_apply(tcpreplay_t *ctx, COUNTER pkts, COUNTER bytes, u_int64_t now_ns)
+{
+    tcpreplay_control_t *control = &ctx->control;
+    tcpreplay_speed_t *speed = &ctx->options->speed;
+
+    if (__atomic_load_n(&control->gen, __ATOMIC_ACQUIRE) == control->seen)
+        return false;
+
+    while (__sync_lock_test_and_set(&control->lock, 1))
+        ;
+    control->seen = control->gen;
+    speed->mode = control->mode;
+    switch (control->mode) {
+    case speed_mbpsrate:
+        speed->speed = (COUNTER)(control->value * 1000000.0); /* bps */
+        break;
+    case speed_packetrate:
+        speed->speed = (COUNTER)(control->value * 60.0 * 60.0); /* packets per hour */
+        if (speed->pps_multi < 1)
+            speed->pps_multi = 1;
+        break;
+    case speed_multiplier:
+        speed->multiplier = (float)control->value;
+        break;
+    default:
+        speed->speed = 0;
+        break;
+    }
+    __sync_lock_release(&control->lock);
+
+    dbgx(1, "speed changed to mode %d speed " COUNTER_SPEC " multiplier %f", speed->mode, speed->speed, speed->multiplier);
+
+    rate_profile_free(speed->profile);
+    speed->profile = NULL;
+    tcpreplay_pace_restart(ctx, pkts, bytes, now_ns);
+    return true;
+}
+
 /**
  * \brief Tells you if the tcpreplay context is running (not yet finished)
  *
@@ -1287,6 +3741,7 @@ tcpreplay_get_stats(tcpreplay_t *ctx)
 
     /* copy stats over so they don't change while caller is using the buffer */
     memcpy(&ctx->static_stats, &ctx->stats, sizeof(tcpreplay_stats_t));
+    packet_stats_timevals(&ctx->static_stats);
     ptr = &ctx->static_stats;
     return ptr;
 }
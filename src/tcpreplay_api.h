@@ -22,7 +22,15 @@
 
 #include "defines.h"
 #include "config.h"
+#include <common/cache.h>
+#include <common/hugepage.h>
 #include <common/interface.h>
+#include <common/mmap_pcap.h>
+#include <common/numa.h>
+#include <common/pacer.h>
+#include <common/pcap_readahead.h>
+#include <common/rate_profile.h>
+#include <common/rxmatch.h>
 #include <common/sendpacket.h>
 #include <common/tcpdump.h>
 #include <common/utils.h>
@@ -39,22 +47,212 @@ extern "C" {
 #endif
 
 struct tcpreplay_s; /* forward declare */
+struct send_threads_s;
+typedef struct send_threads_s send_threads_t;
+struct pkt_source_s;
+typedef struct pkt_source_s pkt_source_t;
+struct stats_export_s;
+typedef struct stats_export_s stats_export_t;
+struct rate_adapt_s;
+typedef struct rate_adapt_s rate_adapt_t;
+struct nic_threads_s;
+typedef struct nic_threads_s nic_threads_t;
+struct preload_lz4_s;
+typedef struct preload_lz4_s preload_lz4_t;
+struct tcpr_checkpoint_s;
+typedef struct tcpr_checkpoint_s tcpr_checkpoint_t;
+struct tcpr_probe_s;
+typedef struct tcpr_probe_s tcpr_probe_t;
+struct tcpr_inject_s;
+typedef struct tcpr_inject_s tcpr_inject_t;
+struct tcpr_breakdown_s;
+typedef struct tcpr_breakdown_s tcpr_breakdown_t;
+struct tcpr_breakdowns_s;
+typedef struct tcpr_breakdowns_s tcpr_breakdowns_t;
+struct tcpr_playlist_s;
+typedef struct tcpr_playlist_s tcpr_playlist_t;
+struct tcpr_follow_s;
+typedef struct tcpr_follow_s tcpr_follow_t;
+struct tcpr_rss_s;
+typedef struct tcpr_rss_s tcpr_rss_t;
+struct tcpr_fleet_s;
+typedef struct tcpr_fleet_s tcpr_fleet_t;
 
 /* in memory packet cache struct */
 typedef struct packet_cache_s {
     struct pcap_pkthdr pkthdr;
     u_char *pktdata;
-    struct packet_cache_s *next;
+    uint32_t flow_id;    /* from flow_decode() during preload; 0 if none */
+    uint8_t flow_type;   /* flow_entry_type_t, only valid with --flow-stats */
+    bool edited;         /* tcpreplay-edit: packet and header are already edited */
+    uint16_t unique_src; /* --unique-ip: offset of the src IP word, 0 if not IP */
+    uint16_t unique_dst; /* --unique-ip: offset of the dst IP word */
+    bool unique_udp;          /* --unique-ip-pool: unique_l4_sum is UDP's, where 0 means none */
+    uint16_t unique_ip_sum;   /* --unique-ip-pool: offset of the IPv4 header checksum */
+    uint16_t unique_l4_sum;   /* --unique-ip-pool: offset of the TCP/UDP checksum, 0 if none */
+    uint32_t unique_src_host; /* --unique-ip-pool: see unique_hosts_t, 0 if not in the pool */
+    uint32_t unique_dst_host;
+    uint32_t pad_caplen; /* --preload-snaplen: caplen to pad back to when sent, 0 if whole */
+    uint16_t csum_start;  /* tcpreplay-edit --csum-offload or --gso, see sendpacket_pkt_t */
+    uint16_t csum_offset; /* 0 if the packet is fully checksummed */
+    uint16_t gso_size;    /* --gso: segment payload size of a super-frame, 0 if a plain packet */
+    uint16_t gso_hdr_len; /* --gso: header bytes each segment starts with */
+    bool gso_v6;          /* --gso: the segments are TCP over IPv6 */
+    uint16_t gen_ip_sum;      /* --gen-field: offset of the IPv4 header checksum, 0 if not IPv4 */
+    uint16_t gen_l4;          /* --gen-field: offset of the TCP/UDP header, 0 if none */
+    uint16_t gen_payload;     /* --gen-field: offset of the TCP/UDP payload */
+    uint16_t gen_payload_len; /* --gen-field: bytes of it stored, within the IP packet */
+    uint16_t gen_vlan;        /* --gen-field: offset of the first VLAN TCI, 0 if none */
+    bool gen_udp;             /* --gen-field: gen_l4 is UDP, where a checksum of 0 means none */
+    bool gen_tag;             /* --gen-vlan-add: untagged Ethernet, sent with a tag inserted */
+    uint32_t rx_sig;          /* --rx-interface: rxmatch_sig() of the packet, 0 if worked out when sent */
 } packet_cache_t;
 
+/*
+ * --unique-ip-pool numbers every IPv4 address of the preloaded files.
+ * Loop n sends host h as address (n - 1) * hosts + h of the pool.
+ */
+typedef struct unique_host_s {
+    uint32_t addr; /* network byte order */
+    uint32_t id;   /* from 1, 0 for a free slot */
+} unique_host_t;
+
+typedef struct unique_hosts_s {
+    unique_host_t *slot;
+    uint32_t size; /* power of two */
+    uint32_t cnt;
+} unique_hosts_t;
+
+/*
+ * Packet data is stored back to back in large arenas rather than
+ * in a separate allocation for each packet
+ */
+#define PACKET_ARENA_SIZE (16 * 1024 * 1024)
+/* with --hugepages arenas double in size up to this, to get 1 GB pages */
+#define PACKET_ARENA_HUGE_MAX (1024 * 1024 * 1024)
+#define PACKET_CACHE_INITIAL_CNT 4096
+/*
+ * The cached send paths prefetch the packet data this many packets
+ * ahead, and the packet_cache_t twice as far
+ */
+#define PACKET_PREFETCH_AHEAD 8
+/*
+ * --preload-snaplen packets are padded back out in a ring of buffers,
+ * enough for a full batch plus a packet pending in each direction
+ */
+#define PACKET_PAD_SLOTS (SENDPACKET_BATCH_MAX + 2)
+
+/*
+ * --preload-dedup: packet data already in a file's arenas, by the hash
+ * of its bytes.  Only needed while the file is loaded.
+ */
+#define PRELOAD_DEDUP_INITIAL 4096
+
+typedef struct preload_dedup_slot_s {
+    uint64_t hash;
+    const u_char *data; /* NULL for a free slot */
+    uint32_t len;
+} preload_dedup_slot_t;
+
+typedef struct preload_dedup_s {
+    preload_dedup_slot_t *slot;
+    size_t size; /* power of two */
+    size_t cnt;
+} preload_dedup_t;
+
+typedef struct packet_arena_s {
+    u_char *data;
+    size_t size;
+    size_t used;
+    struct packet_arena_s *next;
+} packet_arena_t;
+
+/*
+ * tcpreplay_send_batch(): packets handed over by the caller, which are
+ * sent from where they are.  They go out as source MEM_SOURCE_IDX, past
+ * any file
+ */
+#define MEM_SOURCE_IDX (MAX_FILES - 1)
+
 /* packet cache header */
 typedef struct file_cache_s {
     int index;
     int cached;
     int dlt;
-    packet_cache_t *packet_cache;
+    bool nsec;                    /* tv_usec of packet timestamps holds nanoseconds */
+    packet_cache_t *packet_cache; /* array of cached packet headers */
+    COUNTER packet_cnt;           /* number of entries in use in packet_cache */
+    COUNTER packet_max;           /* number of entries allocated in packet_cache */
+    packet_arena_t *arena;        /* list of arenas, most recently allocated first */
+    mmap_pcap_t *mmap;            /* if set, cached packets point into this mapping */
+    pkt_source_t *source;         /* if set, what the file is being read from, see pkt_source.h */
+    bool streamed;                /* loaded by --preload-stream for a single pass */
+    uint64_t *schedule;           /* per packet send time in ns from the start of a pass */
+    uint64_t schedule_period;     /* ns from the start of one pass to the next */
+    uint64_t schedule_burst_ns;   /* --burst as time, how far behind the schedule may get */
+    uint32_t snaplen;             /* --preload-snaplen, bytes of each packet kept */
+    uint32_t pad_max;             /* largest pad_caplen in the cache */
+    u_char *pad_ring;             /* PACKET_PAD_SLOTS buffers of pad_max bytes, tails all zero */
+    int pad_next;
+    preload_dedup_t *dedup;       /* --preload-dedup, while loading */
+    COUNTER dedup_bytes;          /* packet bytes, whether stored or shared */
+    COUNTER dedup_saved;          /* of those, bytes shared with an earlier packet */
+    struct bpf_program *filter;   /* --preload-filter for the link type of the file, while loading */
+    COUNTER filter_kept;          /* --preload-filter and --preload-sample: packets read and cached */
+    COUNTER filter_dropped;       /* and those left out */
+    COUNTER gso_packets;          /* --gso: packets coalesced into super-frames */
+    COUNTER gso_frames;           /* --gso: super-frames they became */
+    u_char *image;                /* --cache-image: if set, the cache was loaded from this mapping */
+    size_t image_size;
+    bool image_flows;             /* the flow stats of the file were counted from the image */
+    bool image_locked;            /* image_lock holds the lock on building the image */
+    int image_lock;
+    bool spilled;                 /* --cache-memory ran out, the rest is in the mapping */
+    COUNTER spill_first;          /* first packet left in the mapping */
+    const u_char *spill_from;     /* start of the mapping last read ahead */
+    const u_char *spill_next;     /* read ahead again once sending gets here */
+    preload_lz4_t *lz4;           /* --preload-lz4: the packet data, compressed, NULL if not */
+    COUNTER slice_read;           /* --start-time and co: packets of the file read or seeked past */
+    u_int64_t slice_first_ns;     /* timestamp of the first packet of the file */
+    bool slice_done;              /* read past the end of the slice */
 } file_cache_t;
 
+/*
+ * --gen-field: a header field of the preloaded packets that takes a new
+ * value for every packet sent, so the packets serve as templates
+ */
+#define GEN_FIELDS_MAX 16
+/* --gen-vlan-add: bytes of the 802.1Q tag given to untagged templates */
+#define GEN_VLAN_TAG_LEN (TCPR_802_1Q_H - TCPR_ETH_H)
+
+/* largest --mix weight, so bytes sent times weight can't overflow in a pass */
+#define MIX_WEIGHT_MAX 1000000
+
+typedef enum {
+    gen_ip_src = 1,
+    gen_ip_dst,
+    gen_sport,
+    gen_dport,
+    gen_vlan,
+    gen_payload,
+} gen_field_name_t;
+
+typedef enum {
+    gen_inc = 1,
+    gen_rand,
+    gen_loop,
+} gen_field_mode_t;
+
+typedef struct gen_field_s {
+    gen_field_name_t name;
+    gen_field_mode_t mode;
+    uint32_t offset; /* gen_payload: bytes into the TCP/UDP payload */
+    int width;       /* bytes, 1, 2 or 4 */
+    bool range;      /* low and high given, else the whole width */
+    uint32_t low;    /* host byte order */
+    uint32_t high;
+} gen_field_t;
+
 /* speed mode selector */
 typedef enum {
     speed_multiplier = 1,
@@ -64,6 +262,19 @@ typedef enum {
     speed_oneatatime
 } tcpreplay_speed_mode;
 
+/* --late-policy: what to do with a packet which is already late */
+typedef enum {
+    late_burst = 0, /* send it and catch up back to back */
+    late_shift,     /* move the rest of the timeline back by how late it is */
+    late_drop       /* don't send it */
+} tcpreplay_late_policy;
+
+/* --late-threshold default, in ns */
+#define LATE_THRESHOLD_DEFAULT 1000000
+
+/* --wire-rate: preamble and SFD, FCS and inter-frame gap of an Ethernet frame */
+#define SPEED_WIRE_OVERHEAD (8 + 4 + 12)
+
 /* speed mode configuration */
 typedef struct {
     /* speed modifiers */
@@ -71,6 +282,13 @@ typedef struct {
     COUNTER speed;
     float multiplier;
     int pps_multi;
+    COUNTER burst; /* --burst: most bytes (mbps) or packets (pps) to catch up with, 0 unlimited */
+    COUNTER microburst; /* --microburst: packets sent back to back at a time, 0 if off */
+    tcpreplay_late_policy late_policy;
+    u_int64_t late_ns; /* --late-threshold: how late a packet may be before late_policy applies */
+    u_int64_t wakeup_slack_ns; /* --wakeup-slack: packets due this close to the first go with it, 0 if off */
+    rate_profile_t *profile; /* --rate-profile, the rate changes over time */
+    u_int32_t wire_overhead; /* --wire-rate: bytes a frame takes on the wire beyond its length */
     u_int32_t (*manual_callback)(struct tcpreplay_s *, char *, COUNTER);
 } tcpreplay_speed_t;
 
@@ -80,8 +298,24 @@ typedef enum {
     accurate_select,
     accurate_nanosleep,
     accurate_ioport,
+    accurate_txtime,
+    accurate_hybrid,
+    accurate_kqueue,
+    accurate_timerfd,
 } tcpreplay_accurate;
 
+/*
+ * speed changes made by other threads while replaying, picked up by the
+ * send loop before its next packet or batch
+ */
+typedef struct {
+    volatile int lock;
+    volatile u_int32_t gen; /* bumped by every change */
+    u_int32_t seen;         /* last gen applied to options->speed */
+    tcpreplay_speed_mode mode;
+    double value; /* Mbps, packets/sec or multiplier, as for the options */
+} tcpreplay_control_t;
+
 typedef enum { source_filename = 1, source_fd = 2, source_cache = 3 } tcpreplay_source_type;
 
 typedef struct {
@@ -90,22 +324,57 @@ typedef struct {
     char *filename;
 } tcpreplay_source_t;
 
+/* tcpreplay_opt_t.numa_node: use the node of the first interface */
+#define TCPR_NUMA_AUTO (-2)
+
 /* run-time options */
 typedef struct tcpreplay_opt_s {
     /* input/output */
     char *intf1_name;
     char *intf2_name;
+    /* primary & secondary interfaces of the tcpprep cache pairs after the first */
+    char *pair_intf_name[2 * (CACHE_MAX_PAIRS - 1)];
+    int pair_intf_cnt;
+    /* --spray: intf1, intf2 then the pair interfaces, which flows are spread over.  0 if not spraying */
+    int spray_cnt;
 
     tcpreplay_speed_t speed;
     COUNTER loop;
     u_int32_t loopdelay_ms;
+    bool loop_seamless; /* wrap around the cache instead of starting a new pass */
 
     int stats;
+    char *stats_socket; /* serve live stats on this Unix socket */
+    u_int32_t rate_adapt_ms; /* --rate-adapt: ms between samples of the drop counters, 0 if off */
+    bool timing_stats;  /* keep the sendpacket_t timing histograms */
+    bool profile;       /* keep the sendpacket_t per-stage time, see profile.h */
+    bool mem_stats;     /* report allocations by subsystem, see memstat.h */
+    bool stats_breakdown; /* report per file, loop and interface, see breakdown.h */
+    char *trace_file;     /* --trace-ring: write the trace rings here at the end */
+    u_int32_t trace_size; /* records per ring */
+    bool digest;          /* --digest: hash what each interface sends, see digest.h */
+    bool digest_flows;    /* and the order-independent digest by flow */
+    char *checkpoint_file;       /* --checkpoint: save where we are here */
+    COUNTER checkpoint_interval; /* seconds between checkpoints */
+    bool resume;                 /* and start from it */
+    bool tx_timestamps;       /* collect SO_TIMESTAMPING TX timestamps, see txstamp.h */
+    char *tx_timestamps_pcap; /* and write the packets they're for here */
+    char *rx_intf;            /* --rx-interface: match what comes back here, see rxmatch.h */
+    u_int32_t rx_window;      /* sends kept track of */
+    u_int32_t rx_wait_ms;     /* for the last of them after sending */
+    u_int32_t probe_rate;     /* --probe-rate: probes a second, 0 if off, see probe.h */
+    u_int16_t probe_port;
     bool use_pkthdr_len;
 
     /* tcpprep cache data */
     COUNTER cache_packets;
     char *cachedata;
+    u_char *cachepairs; /* interface pair of each packet, NULL if only one */
+    int cache_pairs;
+    u_char *cacheshards; /* shard of each packet, NULL without a shard map */
+    int cache_shards;
+    int shard;           /* --shard: the shard to send, -1 for all */
+    u_int64_t start_at_ns; /* --start-at: TAI ns to wait for before sending, 0 to start now */
     char *comment; /* tcpprep comment */
 
     /* deal with MTU/packet len issues */
@@ -113,21 +382,48 @@ typedef struct tcpreplay_opt_s {
 
     /* accurate mode to use */
     tcpreplay_accurate accurate;
+    u_int64_t hybrid_margin_ns; /* calibrated nanosleep() overshoot for accurate_hybrid and batch windows */
 
     /* limit # of packets to send */
     COUNTER limit_send;
     COUNTER limit_time;
 
+    /* --start-time, --end-time, --start-packet, --end-packet: the part of each file sent */
+    bool slice;
+    u_int64_t slice_start_ns; /* from the first packet of the file */
+    u_int64_t slice_end_ns;   /* 0 for the end of the file */
+    COUNTER slice_start_pkt;  /* first packet, starting at 1 */
+    COUNTER slice_end_pkt;    /* last packet, 0 for the end of the file */
+
     /* maximum sleep time between packets */
     struct timespec maxsleep;
 
+    /* --idle-gap: longest quiet spell of the capture kept, in ns of capture time, 0 to keep all */
+    u_int64_t idle_gap_ns;
+
     /* pcap file caching */
     file_cache_t file_cache[MAX_FILES];
     bool preload_pcap;
+    bool mmap_pcap;
+    bool cache_image; /* load and save the preloaded cache as <file>.img */
+    bool preload_stream; /* preload the next file(s) while sending, not all up front */
+    bool preload_lz4;    /* keep the preloaded packets LZ4 compressed, see preload_lz4.h */
+    size_t cache_memory; /* --cache-memory: most bytes of packets copied into RAM, 0 for no limit */
+    uint32_t preload_snaplen; /* only cache this many bytes of a packet, 0 for all */
+    bool preload_dedup;       /* store identical packets of a file once */
+    char *preload_filter;     /* --preload-filter: BPF expression packets are cached by, NULL for all */
+    u_int32_t preload_sample; /* --preload-sample: cache 1 in this many flows, 0 or 1 for all */
+    size_t readahead; /* bytes to read ahead when not preloading, 0 = off */
+    bool hugepages;   /* allocate the cache from huge pages */
+
+    /* NUMA placement of the send thread(s) and the memory they send from */
+    int numa_node;  /* TCPR_NUMA_AUTO for that of intf1, -1 for none */
+    char *cpu_list; /* CPUs to send from, instead of those of numa_node */
 
     /* pcap files/sources to replay */
     int source_cnt;
     tcpreplay_source_t sources[MAX_FILES];
+    bool mem_source; /* packets may be given to tcpreplay_send_batch(), see tcpreplay_set_mem_source() */
 
 #ifdef ENABLE_VERBOSE
     /* tcpdump verbose printing */
@@ -144,12 +440,67 @@ typedef struct tcpreplay_opt_s {
     int netmap_delay;
 #endif
 
+#ifdef HAVE_AF_XDP
+    int xdp;
+    int xdp_queue;
+#endif
+
+#ifdef HAVE_DPDK
+    char *dpdk_eal; /* --dpdk-eal: arguments for rte_eal_init() */
+#endif
+
+#ifdef HAVE_IO_URING
+    bool io_uring;
+    bool io_uring_sqpoll;
+#endif
+
     /* print flow statistic */
     bool flow_stats;
     int flow_expiry;
 
+    /* tcpreplay-edit: have the NIC finish TCP/UDP checksums, see --csum-offload */
+    bool csum_offload;
+
+    /* coalesce runs of TCP segments for the NIC to split up, see --gso */
+    bool gso;
+
     int unique_ip;
     float unique_loops;
+    uint32_t unique_pool;       /* --unique-ip-pool network, host byte order */
+    u_int64_t unique_pool_size; /* addresses in it, 0 without --unique-ip-pool */
+
+    /* --rss-queues: receive queues to predict the spread of the capture over, 0 if off */
+    int rss_queues;
+    u_int32_t rss_reta;   /* --rss-reta: indirection table entries, a power of two */
+    u_char *rss_key;      /* --rss-key, NULL for flow_rss_default_key */
+    size_t rss_key_len;
+    bool rss_balance;     /* --rss-balance: pick the --unique-ip-pool addresses to even out the queues */
+
+    /* --gen-field rules, applied in order to every cached packet sent */
+    gen_field_t gen_fields[GEN_FIELDS_MAX];
+    int gen_field_cnt;
+    bool gen_vlan_add; /* --gen-vlan-add, tag untagged Ethernet templates for a vlan rule */
+
+    /* number of send threads, 0 or 1 is single threaded */
+    int threads;
+
+    /* --nic-threads: a transmit thread per interface of the cache file */
+    bool nic_threads;
+    COUNTER nic_skew_us; /* --nic-skew, 0 for no limit */
+
+    /* --flow-copies: copies of each pcap sent at once, 0 or 1 for just the one */
+    int flow_copies;
+    COUNTER flow_copy_offset; /* usec between the copies, 0 to spread them over the pcap */
+
+    /* --repeat: times each packet is sent in a row, 0 or 1 for once */
+    u_int32_t repeat;
+    u_int32_t repeat_flows; /* --repeat-flows: only repeat every so many flows, 0 for all */
+    bool repeat_unique;     /* --repeat-unique: shift the addresses of copy n by n */
+
+    /* --mix: share of each source, which are then sent together out intf1 */
+    u_int32_t mix_weight[MAX_FILES];
+    int mix_cnt;      /* 0 without --mix */
+    bool mix_packets; /* weights count packets rather than bytes */
 } tcpreplay_opt_t;
 
 /* interface */
@@ -162,29 +513,82 @@ typedef struct tcpreplay_s {
     interface_list_t *intlist;
     sendpacket_t *intf1;
     sendpacket_t *intf2;
+    sendpacket_t *pair_intf[2 * (CACHE_MAX_PAIRS - 1)];
     int intf1dlt;
     int intf2dlt;
     COUNTER iteration;
     COUNTER unique_iteration;
     COUNTER last_unique_iteration;
+    unique_hosts_t unique_hosts;
+    COUNTER gen_seq; /* --gen-field: packets stamped so far */
+#ifdef ENABLE_RXMATCH
+    rxmatch_t *rxmatch; /* --rx-interface, NULL if off */
+#endif
+    tcpr_probe_t *probe; /* --probe-rate, NULL if off */
+    bool loop_forever; /* --loop=0, options->loop no longer counts down */
+    int cpus[TCPR_CPU_MAX]; /* where to send from, see numa_node and cpu_list */
+    int cpu_cnt;
     sendpacket_type_t sp_type;
+    tcpr_inject_t *inject; /* --inject=auto, what each method did, NULL if not */
+    tcpr_breakdowns_t *breakdown; /* --stats-breakdown, NULL if off */
+    tcpr_playlist_t *playlist;    /* sources added and removed while replaying, NULL if none yet */
+    tcpr_follow_t *follow;        /* --follow-dir, NULL if not following a directory */
+    tcpr_rss_t *rss;              /* --rss-queues, NULL if off */
+    tcpr_fleet_t *fleet;          /* --fleet, the streams replayed instead of the sources, NULL if off */
     char errstr[TCPREPLAY_ERRSTR_LEN];
     char warnstr[TCPREPLAY_ERRSTR_LEN];
     /* status trackers */
     int current_source; /* current source input being replayed */
 
+    /* tcpreplay-edit: private copy of the packet being edited, see get_edit_buffer() */
+    u_char *edit_buff;
+
     /* sleep helpers */
     struct timespec nap;
     uint32_t skip_packets;
     bool first_time;
+    uint64_t schedule_next_ns; /* when the next pass over a scheduled file starts */
+    uint64_t sleep_paused_ns;  /* how much of the last tcpr_sleep() was paused */
+    tcpr_pacer_t pacer;        /* --mbps and --pps */
+
+    /* --checkpoint: when the next is due, the --loop of the run, and where --resume starts */
+    uint64_t checkpoint_next_ns;
+    COUNTER checkpoint_loops;
+    tcpr_checkpoint_t *resume;
 
     /* counter stats */
     tcpreplay_stats_t stats;
     tcpreplay_stats_t static_stats; /* stats returned by tcpreplay_get_stats() */
+    struct timeval static_start_time; /* returned by tcpreplay_get_start_time() */
+    struct timeval static_end_time;   /* returned by tcpreplay_get_end_time() */
 
     /* flow statistics */
     flow_hash_table_t *flow_hash_table;
 
+    /* multi-threaded replay state */
+    send_threads_t *threads;
+
+    /* --nic-threads transmit threads, while replaying */
+    nic_threads_t *nic_threads;
+
+    /* --stats-socket exporter thread */
+    stats_export_t *exporter;
+
+    /* --rate-adapt thread and the highest rate it found without drops, bps */
+    rate_adapt_t *adapter;
+    COUNTER rate_adapt_bps;
+
+    /* --cache-memory bytes taken so far, by all the preload threads */
+    size_t cache_memory_used;
+
+    /* bytes tcpreplay_warmup() locked in memory and faulted in, and why locking failed */
+    COUNTER warmup_locked;
+    COUNTER warmup_touched;
+    int warmup_errno;
+
+    /* runtime speed changes */
+    tcpreplay_control_t control;
+
     /* abort, suspend & running flags */
     volatile bool abort;
     volatile bool suspend;
@@ -215,21 +619,46 @@ int tcpreplay_post_args(tcpreplay_t *, int argc);
 
 /* all these configuration functions return 0 on success and < 0 on error. */
 int tcpreplay_set_interface(tcpreplay_t *, tcpreplay_intf, char *);
+int tcpreplay_add_intf_pair(tcpreplay_t *, char *, char *);
+int tcpreplay_add_spray_intf(tcpreplay_t *, const char *);
 int tcpreplay_set_speed_mode(tcpreplay_t *, tcpreplay_speed_mode);
 int tcpreplay_set_speed_speed(tcpreplay_t *, COUNTER);
 int tcpreplay_set_speed_pps_multi(tcpreplay_t *, int);
+int tcpreplay_set_speed_burst(tcpreplay_t *, COUNTER);
+int tcpreplay_set_late_policy(tcpreplay_t *, tcpreplay_late_policy, u_int64_t);
 int tcpreplay_set_loop(tcpreplay_t *, u_int32_t);
 int tcpreplay_set_unique_ip(tcpreplay_t *, bool);
 int tcpreplay_set_unique_ip_loops(tcpreplay_t *, int);
+int tcpreplay_set_unique_ip_pool(tcpreplay_t *, const char *);
+int tcpreplay_add_gen_field(tcpreplay_t *, const char *);
+int tcpreplay_set_rss_key(tcpreplay_t *, const char *);
+int tcpreplay_set_preload_filter(tcpreplay_t *, const char *);
+int tcpreplay_set_mix(tcpreplay_t *, const char *);
+int tcpreplay_set_fleet(tcpreplay_t *, const char *);
 int tcpreplay_set_netmap(tcpreplay_t *, bool);
 int tcpreplay_set_use_pkthdr_len(tcpreplay_t *, bool);
 int tcpreplay_set_mtu(tcpreplay_t *, int);
 int tcpreplay_set_accurate(tcpreplay_t *, tcpreplay_accurate);
+const char *tcpreplay_accurate_name(tcpreplay_accurate);
+tcpr_digest_t *tcpreplay_digest_new(tcpreplay_t *, int);
 int tcpreplay_set_limit_send(tcpreplay_t *, COUNTER);
 int tcpreplay_set_dualfile(tcpreplay_t *, bool);
 int tcpreplay_set_tcpprep_cache(tcpreplay_t *, char *);
+int tcpreplay_set_shard(tcpreplay_t *, int);
+int tcpreplay_set_start_at(tcpreplay_t *, u_int64_t);
 int tcpreplay_add_pcapfile(tcpreplay_t *, char *);
+int tcpreplay_set_mem_source(tcpreplay_t *, int);
 int tcpreplay_set_preload_pcap(tcpreplay_t *, bool);
+int tcpreplay_set_mmap_pcap(tcpreplay_t *, bool);
+int tcpreplay_set_cache_image(tcpreplay_t *, bool);
+int tcpreplay_set_preload_stream(tcpreplay_t *, bool);
+int tcpreplay_set_preload_lz4(tcpreplay_t *, bool);
+int tcpreplay_set_cache_memory(tcpreplay_t *, size_t);
+int tcpreplay_set_readahead(tcpreplay_t *, size_t);
+int tcpreplay_set_threads(tcpreplay_t *, int);
+int tcpreplay_set_numa_node(tcpreplay_t *, int);
+int tcpreplay_set_cpu_list(tcpreplay_t *, const char *);
+int tcpreplay_set_hugepages(tcpreplay_t *, bool);
 
 /* information */
 int tcpreplay_get_source_count(tcpreplay_t *);
@@ -241,7 +670,9 @@ int tcpreplay_get_flow_expiry(tcpreplay_t *);
 
 /* functions controlling execution */
 int tcpreplay_prepare(tcpreplay_t *);
+int tcpreplay_warmup(tcpreplay_t *);
 int tcpreplay_replay(tcpreplay_t *);
+int tcpreplay_send_batch(tcpreplay_t *, const struct pcap_pkthdr *, u_char *const *, int);
 const tcpreplay_stats_t *tcpreplay_get_stats(tcpreplay_t *);
 int tcpreplay_abort(tcpreplay_t *);
 int tcpreplay_suspend(tcpreplay_t *);
@@ -249,6 +680,30 @@ int tcpreplay_restart(tcpreplay_t *);
 bool tcpreplay_is_suspended(tcpreplay_t *);
 bool tcpreplay_is_running(tcpreplay_t *);
 
+/* thread safe changes while replaying */
+int tcpreplay_control_speed(tcpreplay_t *, tcpreplay_speed_mode, double);
+int tcpreplay_control_pause(tcpreplay_t *, const char *, bool);
+int tcpreplay_playlist_add(tcpreplay_t *, const char *);
+int tcpreplay_playlist_replace(tcpreplay_t *, char *const *, int);
+int tcpreplay_playlist_remove(tcpreplay_t *, const char *);
+int tcpreplay_follow_dir(tcpreplay_t *, const char *);
+bool tcpreplay_control_apply(tcpreplay_t *, COUNTER, COUNTER, u_int64_t);
+void tcpreplay_pace_restart(tcpreplay_t *, COUNTER, COUNTER, u_int64_t);
+
+/* anything for the send loop to do before its next batch? */
+static inline bool
+tcpreplay_control_pending(tcpreplay_t *ctx, sendpacket_t *sp)
+{
+    return __atomic_load_n(&ctx->control.gen, __ATOMIC_RELAXED) != ctx->control.seen || ctx->suspend || sp->paused;
+}
+
+/* bits --mbps counts for pkts packets of bytes bytes, on the wire with --wire-rate */
+static inline COUNTER
+tcpreplay_pace_bits(const tcpreplay_speed_t *speed, COUNTER pkts, COUNTER bytes)
+{
+    return (bytes + pkts * speed->wire_overhead) * 8;
+}
+
 /* set callback for manual stepping */
 int tcpreplay_set_manual_callback(tcpreplay_t *ctx, tcpreplay_manual_callback);
 
@@ -27,7 +27,10 @@
 #include "tcprewrite.h"
 #include "config.h"
 #include "common.h"
-#include "tcpedit/fuzzing.h"
+#include "rewrite_batch.h"
+#include "rewrite_inplace.h"
+#include "rewrite_sort.h"
+#include "rewrite_threads.h"
 #include "tcpedit/tcpedit.h"
 #include "tcprewrite_opts.h"
 #include <errno.h>
@@ -54,6 +57,13 @@ tcpedit_t *tcpedit;
 void tcprewrite_init(void);
 void post_args(int argc, char *argv[]);
 int rewrite_packets(tcpedit_t *tcpedit_ctx, pcap_t *pin, pcap_dumper_t *pout);
+static int open_output(tcprewrite_output_t *output);
+static void close_output(tcprewrite_output_t *output);
+static int split_open(void);
+static void split_close(void);
+static void prep_post_args(void);
+static void prep_open(void);
+static void prep_close(void);
 
 int
 main(int argc, char *argv[])
@@ -73,6 +83,15 @@ main(int argc, char *argv[])
     /* parse the tcprewrite args */
     post_args(argc, argv);
 
+#ifdef ENABLE_REWRITE_THREADS
+    /* every input gets its own tcpedit_t on the thread which rewrites it */
+    if (options.batch) {
+        rcode = rewrite_batch_files(options.infile, OPT_ARG(OUTFILE), options.threads, options.batch_chunk);
+        restore_stdin();
+        return rcode < 0 ? -1 : 0;
+    }
+#endif
+
     /* init tcpedit context */
     if (tcpedit_init(&tcpedit, pcap_datalink(options.pin)) < 0) {
         err_no_exitx("Error initializing tcpedit: %s", tcpedit_geterr(tcpedit));
@@ -96,11 +115,41 @@ main(int argc, char *argv[])
         exit(-1);
     }
 
-    /* fuzzing init */
-    fuzzing_init(tcpedit->fuzz_seed, tcpedit->fuzz_factor);
+    if (tcpprep != NULL)
+        prep_open();
+
+    if (options.in_place) {
+        size_t len = strlen(options.infile) + 32;
+
+        /* edit the input where it lies if every edit keeps packets the same length */
+        if (tcpedit_is_size_preserving(tcpedit) && !HAVE_OPT(SKIP_SOFT_ERRORS) && !options.sort && !HAVE_OPT(DIGEST)
+#ifdef ENABLE_FRAGROUTE
+            && options.fragroute_args == NULL
+#endif
+        ) {
+#ifdef ENABLE_VERBOSE
+            if (options.verbose)
+                tcpdump_open(&tcpdump, options.pin);
+#endif
+            rcode = rewrite_inplace_packets(tcpedit, options.infile);
+            if (rcode == TCPEDIT_ERROR) {
+                err_no_exitx("Error rewriting packets: %s", tcpedit_geterr(tcpedit));
+                tcpedit_close(&tcpedit);
+                exit(-1);
+            } else if (rcode != REWRITE_INPLACE_UNSUPPORTED) {
+                goto done;
+            }
+        }
+
+        /* otherwise write a new file and put it in place of the input */
+        options.outfile = (char *)safe_malloc(len);
+        snprintf(options.outfile, len, "%s.tmp.%d", options.infile, (int)getpid());
+        notice("Unable to edit %s in place, rewriting it through %s", options.infile, options.outfile);
+    } else {
+        options.outfile = safe_strdup(OPT_ARG(OUTFILE));
+    }
 
     /* open up the output file */
-    options.outfile = safe_strdup(OPT_ARG(OUTFILE));
     dbgx(1, "Rewriting DLT to %s", pcap_datalink_val_to_name(tcpedit_get_output_dlt(tcpedit)));
     if ((dlt_pcap = pcap_open_dead(tcpedit_get_output_dlt(tcpedit), 65535)) == NULL) {
         tcpedit_close(&tcpedit);
@@ -120,13 +169,26 @@ main(int argc, char *argv[])
 #endif
 
 #ifdef ENABLE_VERBOSE
-    if (options.verbose) {
+    if (options.verbose && tcpdump.pid == 0) {
         tcpdump_open(&tcpdump, dlt_pcap);
     }
 #endif
 
-    if ((options.pout = pcap_dump_open(dlt_pcap, options.outfile)) == NULL) {
-        err_no_exitx("Unable to open output pcap file: %s", pcap_geterr(dlt_pcap));
+    options.output_dlt = pcap_datalink(dlt_pcap);
+    if (HAVE_OPT(DIGEST))
+        options.digest = tcpr_digest_new(options.output_dlt);
+    if (options.split == TCPREWRITE_SPLIT_NONE) {
+        tcprewrite_output_t output;
+
+        memset(&output, 0, sizeof(output));
+        output.filename = options.outfile;
+        if (open_output(&output) < 0) {
+            tcpedit_close(&tcpedit);
+            exit(-1);
+        }
+        options.pout = output.pout;
+        options.pwriter = output.pwriter;
+    } else if (split_open() < 0) {
         tcpedit_close(&tcpedit);
         exit(-1);
     }
@@ -134,16 +196,52 @@ main(int argc, char *argv[])
     pcap_close(dlt_pcap);
 
     /* rewrite packets */
-    if (rewrite_packets(tcpedit, options.pin, options.pout) == TCPEDIT_ERROR) {
+#ifdef ENABLE_REWRITE_SORT
+    if (options.sort)
+        rcode = rewrite_sort_packets(tcpedit, options.threads, options.pin, options.pout);
+    else
+#endif
+#ifdef ENABLE_REWRITE_THREADS
+    if (options.threads > 1)
+        rcode = rewrite_threads_packets(tcpedit, options.threads, options.pin, options.pout);
+    else
+#endif
+        rcode = rewrite_packets(tcpedit, options.pin, options.pout);
+
+    if (rcode == TCPEDIT_ERROR) {
         err_no_exitx("Error rewriting packets: %s", tcpedit_geterr(tcpedit));
         tcpedit_close(&tcpedit);
         exit(-1);
     }
 
     /* clean up after ourselves */
-    pcap_dump_close(options.pout);
+    if (options.split == TCPREWRITE_SPLIT_NONE) {
+        tcprewrite_output_t output;
+
+        memset(&output, 0, sizeof(output));
+        output.pout = options.pout;
+        output.pwriter = options.pwriter;
+        close_output(&output);
+    } else {
+        split_close();
+    }
+
+    if (options.digest != NULL) {
+        char buf[256];
+
+        /* stderr, the output may be going to stdout */
+        tcpr_digest_summary(options.digest, buf, sizeof(buf));
+        notice("Digest: %s", buf);
+        tcpr_digest_free(options.digest);
+    }
+
+done:
     pcap_close(options.pin);
     tcpedit_close(&tcpedit);
+    prep_close();
+
+    if (options.in_place && options.outfile != NULL && rename(options.outfile, options.infile) < 0)
+        errx(-1, "Unable to replace %s with %s: %s", options.infile, options.outfile, strerror(errno));
 
 #ifdef ENABLE_VERBOSE
     tcpdump_close(&tcpdump);
@@ -219,9 +317,113 @@ post_args(_U_ int argc, _U_ char *argv[])
     }
 #endif
 
+#ifdef ENABLE_REWRITE_THREADS
+    options.threads = OPT_VALUE_THREADS;
+    options.thread_batch = OPT_VALUE_THREAD_BATCH;
+#endif
+
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    options.write_buffer = (size_t)OPT_VALUE_WRITE_BUFFER * 1024;
+
+    if (HAVE_OPT(SORT)) {
+        options.sort = true;
+        options.sort_memory = (size_t)OPT_VALUE_SORT_MEMORY * 1024 * 1024;
+        if (HAVE_OPT(SORT_TMPDIR))
+            options.sort_tmpdir = safe_strdup(OPT_ARG(SORT_TMPDIR));
+        else if (getenv("TMPDIR") != NULL)
+            options.sort_tmpdir = safe_strdup(getenv("TMPDIR"));
+        else
+            options.sort_tmpdir = safe_strdup("/tmp");
+
+        if (HAVE_OPT(SORT_DEDUP)) {
+            options.sort_dedup = true;
+            options.sort_dedup_us = (u_int32_t)OPT_VALUE_SORT_DEDUP;
+        }
+        options.sort_fix = HAVE_OPT(SORT_FIX);
+    }
+#endif
+
+    if (HAVE_OPT(AUTO) || HAVE_OPT(CIDR) || HAVE_OPT(REGEX) || HAVE_OPT(PORT) || HAVE_OPT(MAC))
+        prep_post_args();
+    else if (HAVE_OPT(REVERSE) || HAVE_OPT(NONIP))
+        errx(-1, "%s", "--reverse and --nonip need one of --auto, --cidr, --regex, --port or --mac");
+
+    if (HAVE_OPT(SPLIT)) {
+        const char *split = OPT_ARG(SPLIT);
+        char *end = NULL;
+        long arg = 0;
+
+        if (strcmp(split, "dir") == 0) {
+            if (!HAVE_OPT(CACHEFILE) && tcpprep == NULL)
+                errx(-1, "%s", "--split=dir requires --cachefile or one of the tcpprep modes");
+            options.split = TCPREWRITE_SPLIT_DIR;
+        } else if (strncmp(split, "flow:", 5) == 0) {
+            arg = strtol(split + 5, &end, 10);
+            if (end == split + 5 || *end != '\0' || arg < 1 || arg > TCPREWRITE_SPLIT_MAX)
+                errx(-1, "Invalid --split flow count, must be 1 to %d: %s", TCPREWRITE_SPLIT_MAX, split);
+            options.split = TCPREWRITE_SPLIT_FLOW;
+        } else if (strncmp(split, "time:", 5) == 0) {
+            arg = strtol(split + 5, &end, 10);
+            if (end == split + 5 || *end != '\0' || arg < 1)
+                errx(-1, "Invalid --split seconds: %s", split);
+            options.split = TCPREWRITE_SPLIT_TIME;
+        } else {
+            errx(-1, "Unknown --split value: %s", split);
+        }
+        options.split_arg = (u_int32_t)arg;
+    }
+
+    options.in_place = HAVE_OPT(IN_PLACE);
+    if (!options.in_place && !HAVE_OPT(OUTFILE))
+        errx(-1, "%s", "One of --outfile or --in-place is required");
+    if (options.in_place && remote_is_url(OPT_ARG(INFILE)))
+        errx(-1, "%s", "--in-place can't be used with a URL");
+    if (HAVE_OPT(OUTFILE) && shm_pipe_path(OPT_ARG(OUTFILE))) {
+#ifndef HAVE_PCAP_DUMP_FOPEN
+        errx(-1, "%s", "Writing to a shared memory pipe needs pcap_dump_fopen() in libpcap");
+#endif
+        if (options.split != TCPREWRITE_SPLIT_NONE)
+            errx(-1, "%s", "--split can't write to a shared memory pipe");
+    }
+
+    /* the tcpprep modes classify the packets in order, as rewrite_packets() reads them */
+    if (tcpprep != NULL && (options.in_place || options.sort || options.threads > 1))
+        errx(-1, "%s", "The tcpprep modes can't be used with --in-place, --sort or --threads");
+
+#ifdef ENABLE_REWRITE_THREADS
+    if (HAVE_OPT(BATCH)) {
+        if (options.sort)
+            errx(-1, "%s", "--batch can't be used with --sort");
+#ifdef ENABLE_FRAGROUTE
+        if (options.fragroute_args != NULL)
+            errx(-1, "%s", "--batch can't be used with --fragroute");
+#endif
+#ifdef ENABLE_VERBOSE
+        if (options.verbose)
+            errx(-1, "%s", "--batch can't be used with --verbose");
+#endif
+        if (shm_pipe_path(OPT_ARG(OUTFILE)))
+            errx(-1, "%s", "--batch can't write to a shared memory pipe");
+        if (HAVE_OPT(DIGEST))
+            errx(-1, "%s", "--batch can't be used with --digest");
+
+        options.batch = true;
+        options.batch_chunk = (size_t)OPT_VALUE_BATCH_CHUNK * 1024 * 1024;
+        if (!HAVE_OPT(THREADS)) {
+            long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+            options.threads = ncpus < 1 ? 1 : ncpus > MAX_REWRITE_THREADS ? MAX_REWRITE_THREADS : (int)ncpus;
+        }
+
+        /* the inputs are opened by the threads */
+        options.infile = safe_strdup(OPT_ARG(INFILE));
+        return;
+    }
+#endif
+
     /* open up the input file */
     options.infile = safe_strdup(OPT_ARG(INFILE));
-    if ((options.pin = pcap_open_offline(options.infile, ebuf)) == NULL)
+    if ((options.pin = tcpr_pcap_open_offline(options.infile, ebuf)) == NULL)
         errx(-1, "Unable to open input pcap file: %s", ebuf);
 
 #ifdef HAVE_PCAP_SNAPSHOT
@@ -232,6 +434,483 @@ post_args(_U_ int argc, _U_ char *argv[])
 #endif
 }
 
+/**
+ * open output->filename for writing, buffered if --write-buffer is set.
+ * A shm:NAME pipe to tcpreplay always goes through the pcap_writer_t
+ */
+static int
+open_output(tcprewrite_output_t *output)
+{
+    pcap_t *dlt_pcap;
+
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    if (options.write_buffer > 0 || shm_pipe_path(output->filename)) {
+        char pw_ebuf[PCAP_ERRBUF_SIZE];
+
+        output->pwriter = pcap_writer_open(output->filename, options.output_dlt, 65535, options.write_buffer, pw_ebuf);
+        if (output->pwriter == NULL) {
+            err_no_exitx("Unable to open output pcap file: %s", pw_ebuf);
+            return -1;
+        }
+
+        return 0;
+    }
+#endif
+
+    if ((dlt_pcap = pcap_open_dead(options.output_dlt, 65535)) == NULL) {
+        err_no_exitx("%s", "Unable to open dead pcap handle.");
+        return -1;
+    }
+
+    if ((output->pout = pcap_dump_open(dlt_pcap, output->filename)) == NULL) {
+        err_no_exitx("Unable to open output pcap file: %s", pcap_geterr(dlt_pcap));
+        pcap_close(dlt_pcap);
+        return -1;
+    }
+
+    pcap_close(dlt_pcap);
+    return 0;
+}
+
+/**
+ * flush and close an output file
+ */
+static void
+close_output(tcprewrite_output_t *output)
+{
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    if (output->pwriter != NULL) {
+        if (pcap_writer_flush(output->pwriter) < 0)
+            errx(-1, "%s", pcap_writer_geterr(output->pwriter));
+        pcap_writer_close(output->pwriter);
+        output->pwriter = NULL;
+    }
+#endif
+
+    if (output->pout != NULL) {
+        pcap_dump_close(output->pout);
+        output->pout = NULL;
+    }
+}
+
+/**
+ * name a --split file by putting tag before the extension of outfile:
+ * out.pcap becomes out.<tag>.pcap
+ */
+static char *
+split_filename(const char *outfile, const char *tag)
+{
+    const char *slash = strrchr(outfile, '/');
+    const char *dot = strrchr(outfile, '.');
+    size_t len = strlen(outfile) + strlen(tag) + 2;
+    char *filename = (char *)safe_malloc(len);
+
+    if (dot == NULL || dot == outfile || (slash != NULL && dot < slash + 2)) {
+        snprintf(filename, len, "%s.%s", outfile, tag);
+    } else {
+        snprintf(filename, len, "%.*s.%s%s", (int)(dot - outfile), outfile, tag, dot);
+    }
+
+    return filename;
+}
+
+/**
+ * open the --split files known up front: both directions, or every flow
+ * shard.  Time windows are opened as packets reach them
+ */
+static int
+split_open(void)
+{
+    char tag[16];
+    int i;
+
+    switch (options.split) {
+    case TCPREWRITE_SPLIT_DIR:
+        options.num_outputs = 2;
+        break;
+    case TCPREWRITE_SPLIT_FLOW:
+        options.num_outputs = (int)options.split_arg;
+        break;
+    case TCPREWRITE_SPLIT_TIME:
+        options.num_outputs = 1;
+        options.split_window = -1;
+        break;
+    default:
+        assert(0);
+    }
+
+    options.outputs = (tcprewrite_output_t *)safe_malloc(options.num_outputs * sizeof(tcprewrite_output_t));
+    if (options.split == TCPREWRITE_SPLIT_TIME)
+        return 0;
+
+    for (i = 0; i < options.num_outputs; i++) {
+        if (options.split == TCPREWRITE_SPLIT_DIR) {
+            strlcpy(tag, i == 0 ? "primary" : "secondary", sizeof(tag));
+        } else {
+            snprintf(tag, sizeof(tag), "%d", i);
+        }
+
+        options.outputs[i].filename = split_filename(options.outfile, tag);
+        if (open_output(&options.outputs[i]) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void
+split_close(void)
+{
+    int i;
+
+    for (i = 0; i < options.num_outputs; i++) {
+        close_output(&options.outputs[i]);
+        safe_free(options.outputs[i].filename);
+    }
+
+    safe_free(options.outputs);
+    options.outputs = NULL;
+    options.num_outputs = 0;
+}
+
+/**
+ * --auto, --cidr, --regex, --port and --mac: set up a tcpprep context to
+ * classify the packets the way tcpprep would, instead of a cache file
+ */
+static void
+prep_post_args(void)
+{
+    tcpprep_opt_t *prep;
+
+    tcpprep = tcpprep_init();
+    prep = tcpprep->options;
+
+    if (HAVE_OPT(AUTO)) {
+        if (strcmp(OPT_ARG(INFILE), "-") == 0)
+            errx(-1, "%s", "--auto reads the input twice, it can't be standard input");
+
+        prep->mode = AUTO_MODE;
+        if ((prep->automode = tcpprep_automode(OPT_ARG(AUTO))) == ERROR_MODE)
+            errx(-1, "Invalid auto mode type: %s", OPT_ARG(AUTO));
+    } else if (HAVE_OPT(CIDR)) {
+        char *cidr = safe_strdup(OPT_ARG(CIDR));
+
+        prep->mode = CIDR_MODE;
+        if (!parse_cidr(&prep->cidrdata, cidr, ","))
+            errx(-1, "Unable to parse CIDR map: %s", OPT_ARG(CIDR));
+        compile_cidr(prep->cidrdata);
+        safe_free(cidr);
+    } else if (HAVE_OPT(REGEX)) {
+        char ebuf[EBUF_SIZE];
+        int regex_error;
+
+        prep->mode = REGEX_MODE;
+        if ((regex_error = regcomp(&prep->preg, OPT_ARG(REGEX), REG_EXTENDED | REG_NOSUB))) {
+            regerror(regex_error, &prep->preg, ebuf, EBUF_SIZE);
+            errx(-1, "Unable to compile regex: %s", ebuf);
+        }
+    } else if (HAVE_OPT(PORT)) {
+        prep->mode = PORT_MODE;
+    } else {
+        prep->mode = MAC_MODE;
+        prep->maclist = safe_strdup(OPT_ARG(MAC));
+        prep->macset = macset_new(prep->maclist);
+    }
+
+    prep->reverse = HAVE_OPT(REVERSE);
+    if (HAVE_OPT(NONIP))
+        prep->nonip = DIR_SERVER;
+}
+
+/**
+ * ready the tcpprep context for rewrite_packets(), after reading the whole
+ * input once to learn its hosts in auto mode
+ */
+static void
+prep_open(void)
+{
+    tcpprep_opt_t *prep = tcpprep->options;
+    char ebuf[PCAP_ERRBUF_SIZE];
+    pcap_t *pcap;
+
+    if (prep->mode == MAC_MODE && pcap_datalink(options.pin) != DLT_EN10MB)
+        errx(-1, "%s", "--mac is only supported by DLT_EN10MB packet captures");
+
+    if (prep->mode == AUTO_MODE) {
+        if ((pcap = tcpr_pcap_open_offline(options.infile, ebuf)) == NULL)
+            errx(-1, "Unable to open input pcap file: %s", ebuf);
+
+        if (tcpprep_process_packets(pcap) == 0)
+            errx(-1, "No packets in %s to learn the hosts from", options.infile);
+        pcap_close(pcap);
+
+        tcpprep_auto_done();
+    }
+
+    options.prep = tcpprep_chunk_open();
+}
+
+static void
+prep_close(void)
+{
+    if (tcpprep == NULL)
+        return;
+
+    tcpprep_chunk_close(options.prep);
+    options.prep = NULL;
+    tree_free(&treeroot);
+    tcpprep_close(tcpprep);
+    tcpprep = NULL;
+}
+
+/**
+ * hash of an edited packet's addresses, protocol and TCP/UDP ports that is
+ * the same for both directions of a flow
+ */
+static u_int32_t
+split_flow_hash(tcpedit_t *tcpedit_ctx, const struct pcap_pkthdr *pkthdr, u_char *pktdata)
+{
+    const u_char *l3, *end = pktdata + pkthdr->caplen;
+    u_int32_t src = 0, dst = 0, hash;
+    u_int16_t ports[2] = {0, 0};
+    u_char *l4 = NULL;
+    uint8_t proto;
+    int i;
+
+    l3 = tcpedit_l3data(tcpedit_ctx, AFTER_PROCESS, pktdata, (int)pkthdr->caplen);
+    if (l3 == NULL)
+        return 0;
+
+    switch (tcpedit_l3proto(tcpedit_ctx, AFTER_PROCESS, pktdata, (int)pkthdr->caplen)) {
+    case ETHERTYPE_IP: {
+        const ipv4_hdr_t *ip_hdr = (const ipv4_hdr_t *)l3;
+
+        if (l3 + TCPR_IPV4_H > end)
+            return 0;
+
+        src = ip_hdr->ip_src.s_addr;
+        dst = ip_hdr->ip_dst.s_addr;
+        proto = ip_hdr->ip_p;
+        l4 = get_layer4_v4(ip_hdr, end);
+        break;
+    }
+    case ETHERTYPE_IP6: {
+        const ipv6_hdr_t *ip6_hdr = (const ipv6_hdr_t *)l3;
+
+        if (l3 + TCPR_IPV6_H > end)
+            return 0;
+
+        for (i = 0; i < 4; i++) {
+            src ^= ip6_hdr->ip_src.tcpr_s6_addr32[i];
+            dst ^= ip6_hdr->ip_dst.tcpr_s6_addr32[i];
+        }
+        l4 = get_layer4_v6_proto(ip6_hdr, end, &proto);
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    /* TCP and UDP both start with the source and destination ports */
+    if (l4 != NULL && (proto == IPPROTO_TCP || proto == IPPROTO_UDP) && l4 + sizeof(ports) <= end)
+        memcpy(ports, l4, sizeof(ports));
+
+    /* xor and add are order independent, so both directions match */
+    hash = (src ^ dst) + (src & dst) + (u_int32_t)(ports[0] ^ ports[1]) * 31 + proto;
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+/**
+ * the --split file a packet goes to.  Packets the cache doesn't send go to
+ * the primary file
+ */
+static tcprewrite_output_t *
+split_output(tcpedit_t *tcpedit_ctx, const struct pcap_pkthdr *pkthdr, u_char *pktdata, tcpr_dir_t cache_result)
+{
+    tcprewrite_output_t *output = &options.outputs[0];
+    int window;
+
+    switch (options.split) {
+    case TCPREWRITE_SPLIT_DIR:
+        if (cache_result == TCPR_DIR_S2C)
+            output = &options.outputs[1];
+        break;
+
+    case TCPREWRITE_SPLIT_FLOW:
+        output = &options.outputs[split_flow_hash(tcpedit_ctx, pkthdr, pktdata) % options.split_arg];
+        break;
+
+    case TCPREWRITE_SPLIT_TIME:
+        if (options.split_window < 0)
+            options.split_start = pkthdr->ts.tv_sec;
+
+        /* packets out of order stay in the current file */
+        window = (int)((pkthdr->ts.tv_sec - options.split_start) / (time_t)options.split_arg);
+        if (window > options.split_window) {
+            char tag[16];
+
+            close_output(output);
+            safe_free(output->filename);
+            snprintf(tag, sizeof(tag), "%d", window);
+            output->filename = split_filename(options.outfile, tag);
+            if (open_output(output) < 0)
+                exit(-1);
+            options.split_window = window;
+        }
+        break;
+
+    default:
+        assert(0);
+    }
+
+    return output;
+}
+
+/**
+ * append a single record to the output file
+ */
+static void
+dump_packet(pcap_dumper_t *pout, _U_ pcap_writer_t *pwriter, struct pcap_pkthdr *pkthdr, const u_char *pktdata)
+{
+    if (options.digest != NULL)
+        tcpr_digest_add(options.digest, pktdata, pkthdr->caplen);
+
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    if (pwriter != NULL) {
+        if (pcap_writer_write(pwriter, pkthdr, pktdata) < 0)
+            errx(-1, "%s", pcap_writer_geterr(pwriter));
+        return;
+    }
+#endif
+
+    pcap_dump((u_char *)pout, pkthdr, pktdata);
+}
+
+#ifdef ENABLE_FRAGROUTE
+/**
+ * append a record made of several segments.  They are gathered straight
+ * into the write buffer when there is one, otherwise assembled in buf for
+ * pcap_dump()
+ */
+static void
+dump_packet_iov(pcap_dumper_t *pout,
+                _U_ pcap_writer_t *pwriter,
+                struct pcap_pkthdr *pkthdr,
+                const struct iovec *iov,
+                int iovcnt,
+                u_char *buf)
+{
+    size_t len = 0;
+    int i;
+
+    if (options.digest != NULL) {
+        /* gathered for the digest anyway, so write it in one piece */
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+            len += iov[i].iov_len;
+        }
+        dump_packet(pout, pwriter, pkthdr, buf);
+        return;
+    }
+
+#ifdef HAVE_PCAP_DUMP_FOPEN
+    if (pwriter != NULL) {
+        if (pcap_writer_writev(pwriter, pkthdr, iov, iovcnt) < 0)
+            errx(-1, "%s", pcap_writer_geterr(pwriter));
+        return;
+    }
+#endif
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+
+    pcap_dump((u_char *)pout, pkthdr, buf);
+}
+#endif
+
+/**
+ * write an edited packet to the output file, running it through fragroute
+ * first if required.  Also prints it when in verbose mode.
+ */
+void
+tcprewrite_write_packet(_U_ tcpedit_t *tcpedit_ctx,
+                        pcap_dumper_t *pout,
+                        struct pcap_pkthdr *pkthdr_ptr,
+                        u_char *pktdata,
+                        _U_ tcpr_dir_t cache_result,
+                        _U_ COUNTER packetnum)
+{
+    pcap_writer_t *pwriter = options.pwriter;
+#ifdef ENABLE_FRAGROUTE
+    static u_char *frag = NULL;
+    struct iovec frag_iov[FRAGROUTE_IOV_MAX];
+    int frag_len, proto;
+
+    if (frag == NULL)
+        frag = (u_char *)safe_malloc(MAXPACKET);
+#endif
+
+    if (options.split != TCPREWRITE_SPLIT_NONE) {
+        tcprewrite_output_t *output = split_output(tcpedit_ctx, pkthdr_ptr, pktdata, cache_result);
+
+        pout = output->pout;
+        pwriter = output->pwriter;
+    }
+
+#ifdef ENABLE_VERBOSE
+    if (options.verbose && cache_result != TCPR_DIR_NOSEND)
+        tcpdump_print(&tcpdump, pkthdr_ptr, pktdata);
+#endif
+
+#ifdef ENABLE_FRAGROUTE
+    if (options.frag_ctx == NULL) {
+        /* write the packet when there's no fragrouting to be done */
+        if (pkthdr_ptr->caplen)
+            dump_packet(pout, pwriter, pkthdr_ptr, pktdata);
+    } else {
+        /* get the L3 protocol of the packet */
+        proto = tcpedit_l3proto(tcpedit_ctx, AFTER_PROCESS, pktdata, pkthdr_ptr->caplen);
+
+        /* packet is IPv4/IPv6 AND needs to be fragmented */
+        if ((proto == ETHERTYPE_IP || proto == ETHERTYPE_IP6) &&
+            ((options.fragroute_dir == FRAGROUTE_DIR_BOTH) ||
+             (cache_result == TCPR_DIR_C2S && options.fragroute_dir == FRAGROUTE_DIR_C2S) ||
+             (cache_result == TCPR_DIR_S2C && options.fragroute_dir == FRAGROUTE_DIR_S2C))) {
+#ifdef DEBUG
+            int i = 0;
+#endif
+            if (fragroute_process(options.frag_ctx, pktdata, pkthdr_ptr->caplen) < 0)
+                errx(-1, "Error processing packet via fragroute: %s", options.frag_ctx->errbuf);
+
+            while ((frag_len = fragroute_getfragment_iov(options.frag_ctx, frag_iov)) > 0) {
+                /* frags get the same timestamp as the original packet */
+                dbgx(1, "processing packet " COUNTER_SPEC " frag: %u (%d)", packetnum, i++, frag_len);
+                pkthdr_ptr->caplen = frag_len;
+                pkthdr_ptr->len = frag_len;
+                if (pkthdr_ptr->caplen)
+                    dump_packet_iov(pout, pwriter, pkthdr_ptr, frag_iov, FRAGROUTE_IOV_MAX, frag);
+            }
+        } else {
+            /* write the packet without fragroute */
+            if (pkthdr_ptr->caplen)
+                dump_packet(pout, pwriter, pkthdr_ptr, pktdata);
+        }
+    }
+#else
+    /* write the packet when there's no fragrouting to be done */
+    if (pkthdr_ptr->caplen)
+        dump_packet(pout, pwriter, pkthdr_ptr, pktdata);
+#endif
+}
+
 /**
  * Main loop to rewrite packets
  */
@@ -243,12 +922,8 @@ rewrite_packets(tcpedit_t *tcpedit_ctx, pcap_t *pin, pcap_dumper_t *pout)
     const u_char *pktconst = NULL;          /* packet from libpcap */
     u_char **pktdata = NULL;
     static u_char *pktdata_buff;
-    static char *frag = NULL;
     COUNTER packetnum = 0;
     int rcode;
-#ifdef ENABLE_FRAGROUTE
-    int frag_len, proto;
-#endif
 
     pkthdr_ptr = &pkthdr;
 
@@ -257,9 +932,6 @@ rewrite_packets(tcpedit_t *tcpedit_ctx, pcap_t *pin, pcap_dumper_t *pout)
 
     pktdata = &pktdata_buff;
 
-    if (frag == NULL)
-        frag = (char *)safe_malloc(MAXPACKET);
-
     /* MAIN LOOP
      * Keep sending while we have packets or until
      * we've sent enough packets
@@ -270,15 +942,14 @@ rewrite_packets(tcpedit_t *tcpedit_ctx, pcap_t *pin, pcap_dumper_t *pout)
 
         if (pkthdr.caplen > MAX_SNAPLEN)
             errx(-1, "Frame too big, caplen %d exceeds %d", pkthdr.caplen, MAX_SNAPLEN);
-        /*
-         * copy over the packet so we can pad it out if necessary and
-         * because pcap_next() returns a const ptr
-         */
+        /* libpcap's buffer is read only, so edit a copy */
         memcpy(*pktdata, pktconst, pkthdr.caplen);
 
         /* Dual nic processing? */
         if (options.cachedata != NULL) {
             cache_result = check_cache(options.cachedata, packetnum);
+        } else if (options.prep != NULL) {
+            cache_result = tcpprep_chunk_packet(options.prep, &pkthdr, pktconst, pcap_datalink(pin));
         }
 
         /* sometimes we should not send the packet, in such cases
@@ -290,6 +961,8 @@ rewrite_packets(tcpedit_t *tcpedit_ctx, pcap_t *pin, pcap_dumper_t *pout)
         if (cache_result == TCPR_DIR_NOSEND)
             goto WRITE_PACKET; /* still need to write it so cache stays in sync */
 
+        /* number packets as in the input, as the editor threads do */
+        tcpedit_ctx->runtime.packetnum = packetnum - 1;
         if ((rcode = tcpedit_packet(tcpedit_ctx, &pkthdr_ptr, pktdata, cache_result)) == TCPEDIT_ERROR) {
             return rcode;
         } else if ((rcode == TCPEDIT_SOFT_ERROR) && HAVE_OPT(SKIP_SOFT_ERRORS)) {
@@ -298,52 +971,8 @@ rewrite_packets(tcpedit_t *tcpedit_ctx, pcap_t *pin, pcap_dumper_t *pout)
             continue;
         }
 
-#ifdef ENABLE_VERBOSE
-        if (options.verbose)
-            tcpdump_print(&tcpdump, pkthdr_ptr, *pktdata);
-#endif
-
 WRITE_PACKET:
-#ifdef ENABLE_FRAGROUTE
-        if (options.frag_ctx == NULL) {
-            /* write the packet when there's no fragrouting to be done */
-            if (pkthdr_ptr->caplen)
-                pcap_dump((u_char *)pout, pkthdr_ptr, *pktdata);
-        } else {
-            /* get the L3 protocol of the packet */
-            proto = tcpedit_l3proto(tcpedit_ctx, AFTER_PROCESS, *pktdata, pkthdr_ptr->caplen);
-
-            /* packet is IPv4/IPv6 AND needs to be fragmented */
-            if ((proto == ETHERTYPE_IP || proto == ETHERTYPE_IP6) &&
-                ((options.fragroute_dir == FRAGROUTE_DIR_BOTH) ||
-                 (cache_result == TCPR_DIR_C2S && options.fragroute_dir == FRAGROUTE_DIR_C2S) ||
-                 (cache_result == TCPR_DIR_S2C && options.fragroute_dir == FRAGROUTE_DIR_S2C))) {
-#ifdef DEBUG
-                int i = 0;
-#endif
-                if (fragroute_process(options.frag_ctx, *pktdata, pkthdr_ptr->caplen) < 0)
-                    errx(-1, "Error processing packet via fragroute: %s", options.frag_ctx->errbuf);
-
-                while ((frag_len = fragroute_getfragment(options.frag_ctx, &frag)) > 0) {
-                    /* frags get the same timestamp as the original packet */
-                    dbgx(1, "processing packet " COUNTER_SPEC " frag: %u (%d)", packetnum, i++, frag_len);
-                    pkthdr_ptr->caplen = frag_len;
-                    pkthdr_ptr->len = frag_len;
-                    if (pkthdr_ptr->caplen)
-                        pcap_dump((u_char *)pout, pkthdr_ptr, (u_char *)frag);
-                }
-            } else {
-                /* write the packet without fragroute */
-                if (pkthdr_ptr->caplen)
-                    pcap_dump((u_char *)pout, pkthdr_ptr, *pktdata);
-            }
-        }
-#else
-        /* write the packet when there's no fragrouting to be done */
-        if (pkthdr_ptr->caplen)
-            pcap_dump((u_char *)pout, pkthdr_ptr, *pktdata);
-
-#endif
+        tcprewrite_write_packet(tcpedit_ctx, pout, pkthdr_ptr, *pktdata, cache_result, packetnum);
     } /* while() */
     return 0;
 }
@@ -22,7 +22,9 @@
 
 #include "defines.h"
 #include "config.h"
+#include "common/digest.h"
 #include "tcpedit/tcpedit.h"
+#include "tcpprep_classify.h"
 
 #ifdef ENABLE_DMALLOC
 #include <dmalloc.h>
@@ -32,6 +34,24 @@
 #include "fragroute/fragroute.h"
 #endif
 
+/* most files --split can write at once */
+#define TCPREWRITE_SPLIT_MAX 256
+
+/* how --split picks the output file of each packet */
+typedef enum {
+    TCPREWRITE_SPLIT_NONE = 0,
+    TCPREWRITE_SPLIT_DIR,  /* primary/secondary from the tcpprep cache */
+    TCPREWRITE_SPLIT_FLOW, /* hash of the addresses and ports */
+    TCPREWRITE_SPLIT_TIME, /* a new file every so many seconds */
+} tcprewrite_split_t;
+
+/* one of the files written by --split */
+typedef struct tcprewrite_output_s {
+    char *filename;
+    pcap_dumper_t *pout;
+    pcap_writer_t *pwriter; /* used instead of pout when buffering */
+} tcprewrite_output_t;
+
 /* runtime options */
 struct tcprewrite_opt_s {
     /* input and output pcap filenames & handles */
@@ -39,11 +59,26 @@ struct tcprewrite_opt_s {
     char *outfile;
     pcap_t *pin;
     pcap_dumper_t *pout;
+    pcap_writer_t *pwriter; /* used instead of pout when buffering */
+    size_t write_buffer;
+    bool in_place;          /* --in-place: outfile, if any, replaces infile */
+
+    /* --split */
+    tcprewrite_split_t split;
+    u_int32_t split_arg;    /* flow: number of files, time: seconds per file */
+    tcprewrite_output_t *outputs;
+    int num_outputs;
+    int output_dlt;
+    time_t split_start;     /* time: first second of the first file */
+    int split_window;       /* time: window of the open file, -1 before the first */
 
     /* tcpprep cache data */
     COUNTER cache_packets;
     char *cachedata;
 
+    /* --auto, --cidr and the other tcpprep modes: used instead of cachedata */
+    tcpprep_chunk_t *prep;
+
     /* tcpprep cache file comment */
     char *comment;
 
@@ -62,6 +97,32 @@ struct tcprewrite_opt_s {
     int fragroute_dir;
 #endif
     tcpedit_t *tcpedit;
+
+    /* number of editor threads, and packets they are given at a time */
+    int threads;
+    int thread_batch;
+
+    /* --batch: infile is a directory or list, outfile a template */
+    bool batch;
+    size_t batch_chunk;
+
+    /* --sort */
+    bool sort;
+    size_t sort_memory;
+    char *sort_tmpdir;
+    bool sort_dedup;
+    u_int32_t sort_dedup_us;
+    bool sort_fix;
+
+    /* --digest of every packet written, NULL if off */
+    tcpr_digest_t *digest;
 };
 
 typedef struct tcprewrite_opt_s tcprewrite_opt_t;
+
+void tcprewrite_write_packet(tcpedit_t *tcpedit_ctx,
+                             pcap_dumper_t *pout,
+                             struct pcap_pkthdr *pkthdr_ptr,
+                             u_char *pktdata,
+                             tcpr_dir_t cache_result,
+                             COUNTER packetnum);
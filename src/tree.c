@@ -18,11 +18,12 @@
  *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define TCPR_MEM_SUBSYS TCPR_MEM_TCPPREP /* see memstat.h */
+
 #include "tree.h"
 #include "config.h"
 #include "common.h"
 #include "tcpprep_api.h"
-#include "tcpprep_opts.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,166 +34,255 @@ extern tcpprep_t *tcpprep;
 /* static buffer used by tree_print*() functions */
 char tree_print_buff[TREEPRINTBUFFLEN];
 
-static tcpr_tree_t *new_tree();
-static tcpr_tree_t *packet2tree(const u_char *, int, int);
+/* initial size of the host table, must be a power of 2 */
+#define TREE_MIN_SLOTS 1024
+
+static tcpr_tree_t *tree_find(const tcpr_data_tree_t *, const tcpr_tree_t *);
+static tcpr_tree_t *tree_insert(tcpr_data_tree_t *, const tcpr_tree_t *, int *);
+static void packet2tree(const u_char *, int, int, tcpr_tree_t *);
 #ifdef DEBUG /* prevent compile warnings */
 static char *tree_print(tcpr_data_tree_t *);
 static char *tree_printnode(const char *, const tcpr_tree_t *);
 #endif /* DEBUG */
 static void tree_buildcidr(tcpr_data_tree_t *, tcpr_buildcidr_t *);
-static int tree_checkincidr(tcpr_data_tree_t *, tcpr_buildcidr_t *);
 
-static int ipv6_cmp(const struct tcpr_in6_addr *a, const struct tcpr_in6_addr *b);
-
-RB_PROTOTYPE(tcpr_data_tree_s, tcpr_tree_s, node, tree_comp)
-RB_GENERATE(tcpr_data_tree_s, tcpr_tree_s, node, tree_comp)
+/* a host address as bytes in network order, so they sort by prefix */
+typedef struct tree_key_s {
+    int family;
+    u_char addr[16];
+} tree_key_t;
 
 /**
- * used with rbwalk to walk a tree and generate cidr_t * cidrdata.
- * is smart enough to prevent dupes.  void * arg is cast to bulidcidr_t
+ * fills key with the address of node, true if it is an IPv4 or IPv6 host
  */
-void
-tree_buildcidr(tcpr_data_tree_t *tree_root, tcpr_buildcidr_t *bcdata)
+static bool
+tree_key(const tcpr_tree_t *node, tree_key_t *key)
 {
-    tcpr_tree_t *node = NULL;
-    tcpr_cidr_t *newcidr = NULL;
-    unsigned long network;
-    struct tcpr_in6_addr network6;
-    unsigned long mask = ~0; /* turn on all bits */
-    tcpprep_opt_t *options = tcpprep->options;
-    uint32_t i, j, k;
+    memset(key, 0, sizeof(*key));
+    key->family = node->family;
 
-    dbg(1, "Running: tree_buildcidr()");
+    if (node->family == AF_INET) {
+        u_int32_t ip = (u_int32_t)node->u.ip;
 
-    RB_FOREACH(node, tcpr_data_tree_s, tree_root)
-    {
-        /* we only check types that are valid */
-        if (bcdata->type != DIR_ANY)        /* don't check if we're adding ANY */
-            if (bcdata->type != node->type) /* no match, exit early */
-                return;
-        /*
-         * in cases of leaves and last visit add to cidrdata if
-         * necessary.  First check IPv4
-         */
-        dbgx(4, "Checking if %s exists in cidrdata...", get_addr2name4(node->u.ip, RESOLVE));
-        if (node->family == AF_INET) {
-            if (!check_ip_cidr(options->cidrdata, node->u.ip)) { /* if we exist, abort */
-                dbgx(3, "Node %s doesn't exist... creating.", get_addr2name4(node->u.ip, RESOLVE));
-                newcidr = new_cidr();
-                newcidr->masklen = bcdata->masklen;
-                network = node->u.ip & (mask << (32 - bcdata->masklen));
-                dbgx(3, "Using network: %s", get_addr2name4(network, RESOLVE));
-                newcidr->u.network = network;
-                add_cidr(&options->cidrdata, &newcidr);
-            }
-        }
-        /* Check IPv6 Address */
-        else if (node->family == AF_INET6) {
-            if (!check_ip6_cidr(options->cidrdata, &node->u.ip6)) { /* if we exist, abort */
-                dbgx(3, "Node %s doesn't exist... creating.", get_addr2name6(&node->u.ip6, RESOLVE));
+        memcpy(key->addr, &ip, sizeof(ip));
+        return true;
+    }
 
-                newcidr = new_cidr();
-                newcidr->masklen = bcdata->masklen;
+    if (node->family == AF_INET6) {
+        memcpy(key->addr, node->u.ip6.tcpr_s6_addr, sizeof(key->addr));
+        return true;
+    }
 
-                /* init each 4 quads to zero */
-                for (i = 0; i < 4; i++)
-                    network6.tcpr_s6_addr32[i] = 0;
+    return false;
+}
 
-                /* Build our mask */
-                j = bcdata->masklen / 8;
+static int
+tree_key_cmp(const void *a, const void *b)
+{
+    const tree_key_t *x = a, *y = b;
 
-                for (i = 0; i < j; i++)
-                    network6.tcpr_s6_addr[i] = node->u.ip6.tcpr_s6_addr[i];
+    if (x->family != y->family)
+        return x->family < y->family ? -1 : 1;
 
-                if ((k = bcdata->masklen % 8) != 0) {
-                    k = (uint32_t)~0 << (8 - k);
-                    network6.tcpr_s6_addr[j] = node->u.ip6.tcpr_s6_addr[i] & k;
-                }
+    return memcmp(x->addr, y->addr, sizeof(x->addr));
+}
 
-                dbgx(3, "Using network: %s", get_addr2name6(&network6, RESOLVE));
-                newcidr->u.network6 = network6;
-                add_cidr(&options->cidrdata, &newcidr);
+/**
+ * number of leading bits two addresses of the same family have in common
+ */
+static int
+tree_key_prefix(const tree_key_t *a, const tree_key_t *b)
+{
+    int i, bits = 0;
+    u_char diff;
+
+    for (i = 0; i < (int)sizeof(a->addr); i++) {
+        if ((diff = a->addr[i] ^ b->addr[i]) != 0) {
+            while (!(diff & 0x80)) {
+                diff <<= 1;
+                bits++;
             }
+            return bits;
         }
+        bits += 8;
     }
+
+    return bits;
 }
 
 /**
- * uses rbwalk to check to see if a given ip address of a given type in the
- * tree is inside any of the cidrdata
+ * zeroes the host bits of key beyond masklen
  */
-static int
-tree_checkincidr(tcpr_data_tree_t *tree_root, tcpr_buildcidr_t *bcdata)
+static void
+tree_key_mask(tree_key_t *key, int masklen)
+{
+    int i;
+
+    for (i = 0; i < (int)sizeof(key->addr); i++, masklen -= 8) {
+        if (masklen <= 0)
+            key->addr[i] = 0;
+        else if (masklen < 8)
+            key->addr[i] &= (u_char)(0xff << (8 - masklen));
+    }
+}
+
+/**
+ * returns the keys of the hosts of the given type (or DIR_ANY), sorted,
+ * with their count in cnt
+ */
+static tree_key_t *
+tree_sorted_keys(const tcpr_data_tree_t *tree_root, int type, u_int32_t *cnt)
+{
+    tree_key_t *keys;
+    u_int32_t n;
+
+    keys = (tree_key_t *)safe_malloc((tree_root->count + 1) * sizeof(tree_key_t));
+    *cnt = 0;
+
+    for (n = 0; n < tree_root->count; n++) {
+        const tcpr_tree_t *node = &tree_root->hosts[n];
+
+        if ((type == DIR_ANY || node->type == type) && tree_key(node, &keys[*cnt]))
+            ++*cnt;
+    }
+
+    qsort(keys, *cnt, sizeof(tree_key_t), tree_key_cmp);
+    return keys;
+}
+
+/**
+ * builds cidrdata from the hosts of bcdata->type, one network of
+ * bcdata->masklen for each prefix they have.  The hosts are sorted so
+ * hosts in the same network are next to each other, and each network is
+ * only added once
+ */
+void
+tree_buildcidr(tcpr_data_tree_t *tree_root, tcpr_buildcidr_t *bcdata)
 {
-    tcpr_tree_t *node = NULL;
     tcpprep_opt_t *options = tcpprep->options;
+    tcpr_cidr_t *head = NULL, **tail = &head, *newcidr;
+    tree_key_t *keys, prev;
+    u_int32_t n, cnt;
 
-    RB_FOREACH(node, tcpr_data_tree_s, tree_root)
-    {
-        /* we only check types that are valid */
-        if (bcdata->type != DIR_ANY)        /* don't check if we're adding ANY */
-            if (bcdata->type != node->type) /* no match, exit early */
-                return 0;
+    dbg(1, "Running: tree_buildcidr()");
 
-        /*
-         * in cases of leaves and last visit add to cidrdata if
-         * necessary
-         */
-        if (node->family == AF_INET && check_ip_cidr(options->cidrdata, node->u.ip)) /* if we exist, abort */
-            return 1;
-        if (node->family == AF_INET6 && check_ip6_cidr(options->cidrdata, &node->u.ip6))
-            return 1;
+    keys = tree_sorted_keys(tree_root, bcdata->type, &cnt);
+
+    for (n = 0; n < cnt; n++) {
+        tree_key_mask(&keys[n], bcdata->masklen);
+        if (n > 0 && tree_key_cmp(&keys[n], &prev) == 0)
+            continue;
+        prev = keys[n];
+
+        newcidr = new_cidr();
+        newcidr->family = keys[n].family;
+        newcidr->masklen = bcdata->masklen;
+        if (keys[n].family == AF_INET) {
+            memcpy(&newcidr->u.network, keys[n].addr, sizeof(newcidr->u.network));
+            dbgx(3, "Using network: %s", get_addr2name4(newcidr->u.network, RESOLVE));
+        } else {
+            memcpy(newcidr->u.network6.tcpr_s6_addr, keys[n].addr, sizeof(keys[n].addr));
+            dbgx(3, "Using network: %s", get_addr2name6(&newcidr->u.network6, RESOLVE));
+        }
+
+        *tail = newcidr;
+        tail = &newcidr->next;
     }
-    return 0;
+
+    safe_free(keys);
+
+    /* add the whole list at once, add_cidr() walks to the end of it */
+    if (head != NULL)
+        add_cidr(&options->cidrdata, &head);
 }
 
 /**
- * processes the tree using rbwalk / tree2cidr to generate a CIDR
+ * returns the longest prefix any client shares with a server, -1 if
+ * there are no servers or no clients to compare.
+ *
+ * Of the servers, the nearest to a client in sorted order share the
+ * longest prefix with it, so after sorting the servers each client only
+ * needs a binary search and a look at its two neighbours, rather than
+ * a walk of every host for every mask
+ */
+static int
+tree_client_prefix(const tcpr_data_tree_t *tree_root)
+{
+    tree_key_t *servers, client;
+    u_int32_t n, cnt, lo, hi, mid;
+    int longest = -1, bits;
+
+    servers = tree_sorted_keys(tree_root, DIR_SERVER, &cnt);
+
+    for (n = 0; n < tree_root->count && cnt > 0; n++) {
+        if (tree_root->hosts[n].type != DIR_CLIENT || !tree_key(&tree_root->hosts[n], &client))
+            continue;
+
+        /* first server after the client */
+        lo = 0;
+        hi = cnt;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (tree_key_cmp(&servers[mid], &client) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        if (lo < cnt && servers[lo].family == client.family &&
+            (bits = tree_key_prefix(&servers[lo], &client)) > longest)
+            longest = bits;
+        if (lo > 0 && servers[lo - 1].family == client.family &&
+            (bits = tree_key_prefix(&servers[lo - 1], &client)) > longest)
+            longest = bits;
+    }
+
+    safe_free(servers);
+    return longest;
+}
+
+/**
+ * processes the host table to generate a CIDR
  * used for 2nd pass, router mode
  *
+ * The networks of the servers may not hold any clients, so the shortest
+ * mask which works is one bit longer than the longest prefix a client
+ * shares with a server.
+ *
  * returns > 0 for success (the mask len), 0 for fail
  */
 int
 process_tree(void)
 {
     int mymask;
-    tcpr_buildcidr_t *bcdata;
+    tcpr_buildcidr_t bcdata;
     tcpprep_opt_t *options = tcpprep->options;
 
     dbg(1, "Running: process_tree()");
 
-    bcdata = (tcpr_buildcidr_t *)safe_malloc(sizeof(tcpr_buildcidr_t));
-
-    for (mymask = options->max_mask; mymask <= options->min_mask; mymask++) {
-        dbgx(1, "Current mask: %u", mymask);
-
-        /* set starting vals */
-        bcdata->type = DIR_SERVER;
-        bcdata->masklen = mymask;
+    /* calculate types of all IP's */
+    tree_calculate(&treeroot);
 
-        /* build cidrdata with servers */
-        tree_buildcidr(&treeroot, bcdata);
+    mymask = tree_client_prefix(&treeroot) + 1;
+    if (mymask < options->max_mask)
+        mymask = options->max_mask;
 
-        /* calculate types of all IP's */
-        tree_calculate(&treeroot);
+    if (mymask > options->min_mask) {
+        /* we failed to find a valid cidr list */
+        notice("Unable to determine any IP addresses as a clients.");
+        notice("Perhaps you should change the --ratio, --minmask/maxmask settings, or try another mode?");
+        return (0);
+    }
 
-        /* try to find clients in cidrdata */
-        bcdata->type = DIR_CLIENT;
+    dbgx(1, "Current mask: %u", mymask);
 
-        if (!tree_checkincidr(&treeroot, bcdata)) { /* didn't find any clients in cidrdata */
-            safe_free(bcdata);
-            return (mymask); /* success! */
-        } else {
-            destroy_cidr(options->cidrdata); /* clean up after our mess */
-            options->cidrdata = NULL;
-        }
-    }
+    /* build cidrdata with servers */
+    bcdata.type = DIR_SERVER;
+    bcdata.masklen = mymask;
+    tree_buildcidr(&treeroot, &bcdata);
+    compile_cidr(options->cidrdata);
 
-    safe_free(bcdata);
-    /* we failed to find a valid cidr list */
-    notice("Unable to determine any IP addresses as a clients.");
-    notice("Perhaps you should change the --ratio, --minmask/maxmask settings, or try another mode?");
-    return (0);
+    return (mymask);
 }
 
 /*
@@ -209,57 +299,51 @@ tcpr_tree_to_cidr(int masklen, int type)
  */
 
 /**
- * Checks to see if an IP is client or server by finding it in the tree
- * returns TCPR_DIR_C2S or TCPR_DIR_S2C or -1 on error
- * if mode = UNKNOWN, then abort on unknowns
- * if mode = CLIENT, then unknowns become clients
- * if mode = SERVER, then unknowns become servers
+ * returns the printable address of a node
  */
-tcpr_dir_t
-check_ip_tree(int mode, unsigned long ip)
+static const char *
+tree_addr2name(const tcpr_tree_t *node)
 {
-    tcpr_tree_t *node, *finder;
-
-    finder = new_tree();
-    finder->family = AF_INET;
-    finder->u.ip = ip;
+    if (node->family == AF_INET6)
+        return get_addr2name6(&node->u.ip6, RESOLVE);
 
-    node = RB_FIND(tcpr_data_tree_s, &treeroot, finder);
+    return get_addr2name4(node->u.ip, RESOLVE);
+}
 
-    if (node == NULL && mode == DIR_UNKNOWN) {
-        safe_free(finder);
+/**
+ * returns the direction of the host key, whose entry in the table is node
+ * (or NULL if it isn't in the table), given the mode used for unknowns
+ */
+static tcpr_dir_t
+tree_dir(const tcpr_tree_t *key, const tcpr_tree_t *node, int mode)
+{
+    if (node == NULL && mode == DIR_UNKNOWN)
         errx(-1,
-             "%s (%lu) is an unknown system... aborting.!\n"
+             "%s is an unknown system... aborting.!\n"
              "Try a different auto mode (-n router|client|server)",
-             get_addr2name4(ip, RESOLVE),
-             ip);
-    }
+             tree_addr2name(key));
 
     /* return node type if we found the node, else return the default (mode) */
     if (node != NULL) {
         switch (node->type) {
         case DIR_SERVER:
-            dbgx(1, "DIR_SERVER: %s", get_addr2name4(ip, RESOLVE));
-            safe_free(finder);
+            dbgx(1, "DIR_SERVER: %s", tree_addr2name(key));
             return TCPR_DIR_S2C;
         case DIR_CLIENT:
-            dbgx(1, "DIR_CLIENT: %s", get_addr2name4(ip, RESOLVE));
-            safe_free(finder);
+            dbgx(1, "DIR_CLIENT: %s", tree_addr2name(key));
             return TCPR_DIR_C2S;
         case DIR_UNKNOWN:
-            dbgx(1, "DIR_UNKNOWN: %s", get_addr2name4(ip, RESOLVE));
+            dbgx(1, "DIR_UNKNOWN: %s", tree_addr2name(key));
             /* use our current mode to determine return code */
-            goto return_unknown;
+            break;
         case DIR_ANY:
-            dbgx(1, "DIR_ANY: %s", get_addr2name4(ip, RESOLVE));
-            goto return_unknown;
+            dbgx(1, "DIR_ANY: %s", tree_addr2name(key));
+            break;
         default:
-            errx(-1, "Node for %s has invalid type: %d", get_addr2name4(ip, RESOLVE), node->type);
+            errx(-1, "Node for %s has invalid type: %d", tree_addr2name(key), node->type);
         }
     }
 
-return_unknown:
-    safe_free(finder);
     switch (mode) {
     case DIR_SERVER:
         return TCPR_DIR_S2C;
@@ -270,76 +354,70 @@ return_unknown:
     }
 }
 
+/**
+ * Checks to see if an IP is client or server by finding it in the tree
+ * returns TCPR_DIR_C2S or TCPR_DIR_S2C or -1 on error
+ * if mode = UNKNOWN, then abort on unknowns
+ * if mode = CLIENT, then unknowns become clients
+ * if mode = SERVER, then unknowns become servers
+ */
+tcpr_dir_t
+check_ip_tree(int mode, unsigned long ip)
+{
+    tcpr_tree_t finder;
+
+    memset(&finder, 0, sizeof(finder));
+    finder.family = AF_INET;
+    finder.u.ip = ip;
+
+    return tree_dir(&finder, tree_find(&treeroot, &finder), mode);
+}
+
 tcpr_dir_t
 check_ip6_tree(int mode, const struct tcpr_in6_addr *addr)
 {
-    tcpr_tree_t *node, *finder;
+    tcpr_tree_t finder;
 
-    finder = new_tree();
-    finder->family = AF_INET6;
-    finder->u.ip6 = *addr;
+    memset(&finder, 0, sizeof(finder));
+    finder.family = AF_INET6;
+    finder.u.ip6 = *addr;
 
-    node = RB_FIND(tcpr_data_tree_s, &treeroot, finder);
+    return tree_dir(&finder, tree_find(&treeroot, &finder), mode);
+}
 
-    if (node == NULL && mode == DIR_UNKNOWN) {
-        safe_free(finder);
-        errx(-1,
-             "%s is an unknown system... aborting.!\n"
-             "Try a different auto mode (-n router|client|server)",
-             get_addr2name6(addr, RESOLVE));
-    }
+/**
+ * same as check_ip_tree(), for the host returned by one of the
+ * add_tree_*() functions
+ */
+tcpr_dir_t
+check_host_tree(int mode, u_int32_t host)
+{
+    const tcpr_tree_t *node;
 
-    /* return node type if we found the node, else return the default (mode) */
-    if (node != NULL) {
-        switch (node->type) {
-        case DIR_SERVER:
-            dbgx(1, "DIR_SERVER: %s", get_addr2name6(addr, RESOLVE));
-            safe_free(finder);
-            return TCPR_DIR_S2C;
-        case DIR_CLIENT:
-            dbgx(1, "DIR_CLIENT: %s", get_addr2name6(addr, RESOLVE));
-            safe_free(finder);
-            return TCPR_DIR_C2S;
-        case DIR_UNKNOWN:
-            dbgx(1, "DIR_UNKNOWN: %s", get_addr2name6(addr, RESOLVE));
-            /* use our current mode to determine return code */
-            goto return_unknown;
-        case DIR_ANY:
-            dbgx(1, "DIR_ANY: %s", get_addr2name6(addr, RESOLVE));
-            goto return_unknown;
-        default:
-            errx(-1, "Node for %s has invalid type: %d", get_addr2name6(addr, RESOLVE), node->type);
-        }
-    }
+    assert(host < treeroot.count);
+    node = &treeroot.hosts[host];
 
-return_unknown:
-    safe_free(finder);
-    switch (mode) {
-    case DIR_SERVER:
-        return TCPR_DIR_S2C;
-    case DIR_CLIENT:
-        return TCPR_DIR_C2S;
-    default:
-        return -1;
-    }
+    return tree_dir(node, node, mode);
 }
 
 /**
  * Parses the IP header of the given packet (data) to get the SRC/DST IP
  * addresses.  If the SRC IP doesn't exist in the TREE, we add it as a
- * client, if the DST IP doesn't exist in the TREE, we add it as a server
+ * client, if the DST IP doesn't exist in the TREE, we add it as a server.
+ * Returns the host of the SRC IP
  */
-void
-add_tree_first_ipv4(const u_char *data, int len, int datalink)
+u_int32_t
+add_tree_first_ipv4(tcpr_data_tree_t *tree_root, const u_char *data, int len, int datalink)
 {
-    tcpr_tree_t *newnode, *findnode;
+    tcpr_tree_t key, *node;
     uint32_t _U_ vlan_offset;
     uint32_t pkt_len = len;
     uint16_t ether_type;
     uint32_t l2offset;
     ipv4_hdr_t ip_hdr;
     uint32_t l2len;
-    int res;
+    u_int32_t src;
+    int res, created;
 
     assert(data);
 
@@ -349,58 +427,48 @@ add_tree_first_ipv4(const u_char *data, int len, int datalink)
         errx(-1, "Capture length %d too small for IPv4 parsing", len);
     }
 
-    /*
-     * first add/find the source IP/client
-     */
-    newnode = new_tree();
-
     /* prevent issues with byte alignment, must memcpy */
     memcpy(&ip_hdr, data + l2len, TCPR_IPV4_H);
 
-    /* copy over the source ip, and values to guarantee this a client */
-    newnode->family = AF_INET;
-    newnode->u.ip = ip_hdr.ip_src.s_addr;
-    newnode->type = DIR_CLIENT;
-    newnode->client_cnt = 1000;
-    findnode = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
-
-    /* if we didn't find it, add it to the tree, else free it */
-    if (findnode == NULL) {
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
-    } else {
-        safe_free(newnode);
+    /*
+     * first add/find the source IP/client, and set values to guarantee
+     * this a client
+     */
+    memset(&key, 0, sizeof(key));
+    key.family = AF_INET;
+    key.u.ip = ip_hdr.ip_src.s_addr;
+    node = tree_insert(tree_root, &key, &created);
+    if (created) {
+        node->type = DIR_CLIENT;
+        node->client_cnt = 1000;
     }
+    src = (u_int32_t)(node - tree_root->hosts);
 
     /*
      * now add/find the destination IP/server
      */
-    newnode = new_tree();
-    memcpy(&ip_hdr, data + l2len, TCPR_IPV4_H);
-
-    newnode->family = AF_INET;
-    newnode->u.ip = ip_hdr.ip_dst.s_addr;
-    newnode->type = DIR_SERVER;
-    newnode->server_cnt = 1000;
-    findnode = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
-
-    if (findnode == NULL) {
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
-    } else {
-        safe_free(newnode);
+    key.u.ip = ip_hdr.ip_dst.s_addr;
+    node = tree_insert(tree_root, &key, &created);
+    if (created) {
+        node->type = DIR_SERVER;
+        node->server_cnt = 1000;
     }
+
+    return src;
 }
 
-void
-add_tree_first_ipv6(const u_char *data, int len, int datalink)
+u_int32_t
+add_tree_first_ipv6(tcpr_data_tree_t *tree_root, const u_char *data, int len, int datalink)
 {
-    tcpr_tree_t *newnode, *findnode;
+    tcpr_tree_t key, *node;
     uint32_t _U_ vlan_offset;
     uint32_t pkt_len = len;
     uint16_t ether_type;
     ipv6_hdr_t ip6_hdr;
     uint32_t l2offset;
     uint32_t l2len;
-    int res;
+    u_int32_t src;
+    int res, created;
 
     assert(data);
 
@@ -409,86 +477,60 @@ add_tree_first_ipv6(const u_char *data, int len, int datalink)
     if (res == -1 || len < (int)(l2len + TCPR_IPV6_H))
         errx(-1, "Capture length %d too small for IPv6 parsing", len);
 
-    /*
-     * first add/find the source IP/client
-     */
-    newnode = new_tree();
-
     /* prevent issues with byte alignment, must memcpy */
     memcpy(&ip6_hdr, data + l2len, TCPR_IPV6_H);
 
-    /* copy over the source ip, and values to guarantee this a client */
-    newnode->family = AF_INET6;
-    newnode->u.ip6 = ip6_hdr.ip_src;
-    newnode->type = DIR_CLIENT;
-    newnode->client_cnt = 1000;
-    findnode = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
-
-    /* if we didn't find it, add it to the tree, else free it */
-    if (findnode == NULL) {
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
-    } else {
-        safe_free(newnode);
+    /*
+     * first add/find the source IP/client, and set values to guarantee
+     * this a client
+     */
+    memset(&key, 0, sizeof(key));
+    key.family = AF_INET6;
+    key.u.ip6 = ip6_hdr.ip_src;
+    node = tree_insert(tree_root, &key, &created);
+    if (created) {
+        node->type = DIR_CLIENT;
+        node->client_cnt = 1000;
     }
+    src = (u_int32_t)(node - tree_root->hosts);
 
     /*
      * now add/find the destination IP/server
      */
-    newnode = new_tree();
-    memcpy(&ip6_hdr, data + l2len, TCPR_IPV6_H);
-
-    newnode->family = AF_INET6;
-    newnode->u.ip6 = ip6_hdr.ip_dst;
-    newnode->type = DIR_SERVER;
-    newnode->server_cnt = 1000;
-    findnode = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
-
-    if (findnode == NULL) {
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
-    } else {
-        safe_free(newnode);
+    key.u.ip6 = ip6_hdr.ip_dst;
+    node = tree_insert(tree_root, &key, &created);
+    if (created) {
+        node->type = DIR_SERVER;
+        node->server_cnt = 1000;
     }
+
+    return src;
 }
 
-static void
-add_tree_node(tcpr_tree_t *newnode)
+static u_int32_t
+add_tree_node(tcpr_data_tree_t *tree_root, const tcpr_tree_t *newnode)
 {
     tcpr_tree_t *node;
+    int created;
 
-    /* try to find a simular entry in the tree */
-    node = RB_FIND(tcpr_data_tree_s, &treeroot, newnode);
-
-    dbgx(3, "%s", tree_printnode("add_tree", node));
+    /* find or add the entry, new entries keep the type of this packet */
+    node = tree_insert(tree_root, newnode, &created);
+    if (created)
+        node->type = newnode->type;
 
-    /* new entry required */
-    if (node == NULL) {
-        /* increment counters */
-        if (newnode->type == DIR_SERVER) {
-            newnode->server_cnt++;
-        } else if (newnode->type == DIR_CLIENT) {
-            newnode->client_cnt++;
-        }
-        /* insert it in */
-        RB_INSERT(tcpr_data_tree_s, &treeroot, newnode);
+    dbgx(3, "%s", tree_printnode(created ? "add_tree" : "update node", node));
 
-    } else {
-        /* we found something, so update it */
-        dbgx(2, "   node: %p\nnewnode: %p", node, newnode);
-        dbgx(3, "%s", tree_printnode("update node", node));
-        /* increment counter */
-        if (newnode->type == DIR_SERVER) {
-            node->server_cnt++;
-        } else if (newnode->type == DIR_CLIENT) {
-            /* temp debug code */
-            node->client_cnt++;
-        }
-
-        /* didn't insert it, so free it */
-        safe_free(newnode);
+    /* increment counter */
+    if (newnode->type == DIR_SERVER) {
+        node->server_cnt++;
+    } else if (newnode->type == DIR_CLIENT) {
+        node->client_cnt++;
     }
 
     dbg(2, "------- START NEXT -------");
-    dbgx(3, "%s", tree_print(&treeroot));
+    dbgx(3, "%s", tree_print(tree_root));
+
+    return (u_int32_t)(node - tree_root->hosts);
 }
 
 /**
@@ -496,41 +538,40 @@ add_tree_node(tcpr_tree_t *newnode)
  * to the tree if it doesn't yet exist.  We go through and track:
  * - number of times each host acts as a client or server
  * - the way the host acted the first time we saw it (client or server)
+ * Returns the host of the packet
  */
-void
-add_tree_ipv4(unsigned long ip, const u_char *data, int len, int datalink)
+u_int32_t
+add_tree_ipv4(tcpr_data_tree_t *tree_root, unsigned long ip, const u_char *data, int len, int datalink)
 {
-    tcpr_tree_t *newnode;
+    tcpr_tree_t newnode;
     assert(data);
 
-    newnode = packet2tree(data, len, datalink);
-    assert(newnode);
-    assert(ip == newnode->u.ip);
-    if (newnode->type == DIR_UNKNOWN) {
+    packet2tree(data, len, datalink, &newnode);
+    assert(ip == newnode.u.ip);
+    if (newnode.type == DIR_UNKNOWN) {
         /* couldn't figure out if packet was client or server */
 
-        dbgx(2, "%s (%lu) unknown client/server", get_addr2name4(newnode->u.ip, RESOLVE), newnode->u.ip);
+        dbgx(2, "%s (%lu) unknown client/server", get_addr2name4(newnode.u.ip, RESOLVE), newnode.u.ip);
     }
 
-    add_tree_node(newnode);
+    return add_tree_node(tree_root, &newnode);
 }
 
-void
-add_tree_ipv6(const struct tcpr_in6_addr *addr, const u_char *data, int len, int datalink)
+u_int32_t
+add_tree_ipv6(tcpr_data_tree_t *tree_root, const struct tcpr_in6_addr *addr, const u_char *data, int len, int datalink)
 {
-    tcpr_tree_t *newnode;
+    tcpr_tree_t newnode;
     assert(data);
 
-    newnode = packet2tree(data, len, datalink);
-    assert(newnode);
-    assert(ipv6_cmp(addr, &newnode->u.ip6) == 0);
-    if (newnode->type == DIR_UNKNOWN) {
+    packet2tree(data, len, datalink, &newnode);
+    assert(memcmp(addr, &newnode.u.ip6, sizeof(*addr)) == 0);
+    if (newnode.type == DIR_UNKNOWN) {
         /* couldn't figure out if packet was client or server */
 
-        dbgx(2, "%s unknown client/server", get_addr2name6(&newnode->u.ip6, RESOLVE));
+        dbgx(2, "%s unknown client/server", get_addr2name6(&newnode.u.ip6, RESOLVE));
     }
 
-    add_tree_node(newnode);
+    return add_tree_node(tree_root, &newnode);
 }
 
 /**
@@ -541,11 +582,13 @@ tree_calculate(tcpr_data_tree_t *tree_root)
 {
     tcpr_tree_t *node;
     tcpprep_opt_t *options = tcpprep->options;
+    u_int32_t n;
 
     dbg(1, "Running tree_calculate()");
 
-    RB_FOREACH(node, tcpr_data_tree_s, tree_root)
-    {
+    for (n = 0; n < tree_root->count; n++) {
+        node = &tree_root->hosts[n];
+
         dbgx(4, "Processing %s", get_addr2name4(node->u.ip, RESOLVE));
         if ((node->server_cnt > 0) || (node->client_cnt > 0)) {
             /* type based on: server >= (client*ratio) */
@@ -563,98 +606,166 @@ tree_calculate(tcpr_data_tree_t *tree_root)
     }
 }
 
-static int
-ipv6_cmp(const struct tcpr_in6_addr *a, const struct tcpr_in6_addr *b)
+/**
+ * adds the hosts of src, a table built from packets following those of
+ * tree_root, to tree_root.  In first packet mode (first) only the role of
+ * hosts new to tree_root is kept, otherwise their counters are added up
+ */
+void
+tree_merge(tcpr_data_tree_t *tree_root, const tcpr_data_tree_t *src, int first)
 {
-    int i;
-
-    for (i = 0; i < 4; i++) {
-        int k;
-        if ((k = ((int)a->tcpr_s6_addr32[i] - (int)b->tcpr_s6_addr32[i]))) {
-            return (k > 0) ? 1 : -1;
+    tcpr_tree_t *node;
+    u_int32_t n;
+    int created;
+
+    for (n = 0; n < src->count; n++) {
+        const tcpr_tree_t *host = &src->hosts[n];
+
+        node = tree_insert(tree_root, host, &created);
+        if (created) {
+            node->type = host->type;
+            node->server_cnt = host->server_cnt;
+            node->client_cnt = host->client_cnt;
+        } else if (!first) {
+            node->server_cnt += host->server_cnt;
+            node->client_cnt += host->client_cnt;
         }
     }
-
-    return 0;
 }
 
 /**
- * tree_comp(), called by rbsearch compares two treees and returns:
- * 1  = first > second
- * -1 = first < second
- * 0  = first = second
- * based upon the ip address stored
- *
+ * frees the host table
  */
-int
-tree_comp(tcpr_tree_t *t1, tcpr_tree_t *t2)
+void
+tree_free(tcpr_data_tree_t *tree_root)
 {
-    if (t1->family > t2->family) {
-        dbgx(2, "family %d > %d", t1->family, t2->family);
-        return 1;
-    }
+    safe_free(tree_root->hosts);
+    safe_free(tree_root->slots);
+    memset(tree_root, 0, sizeof(*tree_root));
+}
 
-    if (t1->family < t2->family) {
-        dbgx(2, "family %d < %d", t1->family, t2->family);
-        return -1;
+static u_int32_t
+tree_hash(const tcpr_tree_t *key)
+{
+    u_int32_t hash;
+    int i;
+
+    if (key->family == AF_INET6) {
+        hash = 0;
+        for (i = 0; i < 4; i++)
+            hash = (hash ^ key->u.ip6.tcpr_s6_addr32[i]) * 0x9e3779b1;
+    } else {
+        hash = (u_int32_t)key->u.ip * 0x9e3779b1;
     }
 
-    if (t1->family == AF_INET) {
-        if (t1->u.ip > t2->u.ip) {
-            dbgx(2, "%s > %s", get_addr2name4(t1->u.ip, RESOLVE), get_addr2name4(t2->u.ip, RESOLVE));
-            return 1;
-        }
+    return hash ^ (hash >> 16);
+}
 
-        if (t1->u.ip < t2->u.ip) {
-            dbgx(2, "%s < %s", get_addr2name4(t1->u.ip, RESOLVE), get_addr2name4(t2->u.ip, RESOLVE));
-            return -1;
-        }
+static int
+tree_equal(const tcpr_tree_t *a, const tcpr_tree_t *b)
+{
+    if (a->family != b->family)
+        return 0;
 
-        dbgx(2, "%s = %s", get_addr2name4(t1->u.ip, RESOLVE), get_addr2name4(t2->u.ip, RESOLVE));
+    if (a->family == AF_INET6)
+        return memcmp(&a->u.ip6, &b->u.ip6, sizeof(a->u.ip6)) == 0;
 
-        return 0;
-    }
+    return a->u.ip == b->u.ip;
+}
+
+/**
+ * returns the entry for the host in key, or NULL if there is none
+ */
+static tcpr_tree_t *
+tree_find(const tcpr_data_tree_t *tree_root, const tcpr_tree_t *key)
+{
+    u_int32_t i;
+
+    if (tree_root->slots == NULL)
+        return NULL;
 
-    if (t1->family == AF_INET6) {
-        int ret = ipv6_cmp(&t1->u.ip6, &t1->u.ip6);
-        dbgx(2, "cmp(%s, %s) = %d", get_addr2name6(&t1->u.ip6, RESOLVE), get_addr2name6(&t2->u.ip6, RESOLVE), ret);
-        return ret;
+    for (i = tree_hash(key) & tree_root->mask; tree_root->slots[i] != 0; i = (i + 1) & tree_root->mask) {
+        tcpr_tree_t *node = &tree_root->hosts[tree_root->slots[i] - 1];
+
+        if (tree_equal(node, key))
+            return node;
     }
 
-    return 0;
+    return NULL;
+}
+
+/**
+ * doubles the number of hash slots and re-adds every host
+ */
+static void
+tree_grow(tcpr_data_tree_t *tree_root)
+{
+    u_int32_t size = tree_root->slots ? (tree_root->mask + 1) * 2 : TREE_MIN_SLOTS;
+    u_int32_t n, i;
+
+    safe_free(tree_root->slots);
+    tree_root->slots = (u_int32_t *)safe_malloc(size * sizeof(u_int32_t));
+    tree_root->mask = size - 1;
+
+    for (n = 0; n < tree_root->count; n++) {
+        for (i = tree_hash(&tree_root->hosts[n]) & tree_root->mask; tree_root->slots[i] != 0;
+             i = (i + 1) & tree_root->mask)
+            ;
+        tree_root->slots[i] = n + 1;
+    }
 }
 
 /**
- * creates a new TREE * with reasonable defaults
+ * returns the entry for the host in key, adding it with reasonable
+ * defaults if it doesn't exist.  created is set if it was added.  Any
+ * pointer to an entry is invalid after the next call
  */
 static tcpr_tree_t *
-new_tree()
+tree_insert(tcpr_data_tree_t *tree_root, const tcpr_tree_t *key, int *created)
 {
     tcpr_tree_t *node;
+    u_int32_t i;
+
+    if ((node = tree_find(tree_root, key)) != NULL) {
+        *created = 0;
+        return node;
+    }
 
-    node = (tcpr_tree_t *)safe_malloc(sizeof(tcpr_tree_t));
+    /* keep the table at most half full */
+    if (tree_root->slots == NULL || (tree_root->count + 1) * 2 > tree_root->mask + 1)
+        tree_grow(tree_root);
 
+    if (tree_root->count == tree_root->max) {
+        tree_root->max = tree_root->max ? tree_root->max * 2 : TREE_MIN_SLOTS / 2;
+        tree_root->hosts = (tcpr_tree_t *)safe_realloc(tree_root->hosts, tree_root->max * sizeof(tcpr_tree_t));
+    }
+
+    node = &tree_root->hosts[tree_root->count];
     memset(node, '\0', sizeof(tcpr_tree_t));
-    node->server_cnt = 0;
-    node->client_cnt = 0;
+    node->family = key->family;
+    node->u = key->u;
     node->type = DIR_UNKNOWN;
     node->masklen = -1;
-    node->u.ip = 0;
-    return (node);
+
+    for (i = tree_hash(key) & tree_root->mask; tree_root->slots[i] != 0; i = (i + 1) & tree_root->mask)
+        ;
+    tree_root->slots[i] = ++tree_root->count;
+
+    *created = 1;
+    return node;
 }
 
 /**
- * returns a struct of TREE * from a packet header
+ * fills in node from a packet header
  * and sets the type to be SERVER or CLIENT or UNKNOWN
  * if it's an undefined packet, we return -1 for the type
  * the u_char * data should be the data that is passed by pcap_dispatch()
  */
-static tcpr_tree_t *
-packet2tree(const u_char *data, int len, int datalink)
+static void
+packet2tree(const u_char *data, int len, int datalink, tcpr_tree_t *node)
 {
     uint32_t _U_ vlan_offset;
     ssize_t pkt_len = len;
-    tcpr_tree_t *node = NULL;
     ipv4_hdr_t ip_hdr;
     ipv6_hdr_t ip6_hdr;
     tcp_hdr_t tcp_hdr;
@@ -677,7 +788,9 @@ packet2tree(const u_char *data, int len, int datalink)
     if (res == -1)
         goto len_error;
 
-    node = new_tree();
+    memset(node, '\0', sizeof(tcpr_tree_t));
+    node->type = DIR_UNKNOWN;
+    node->masklen = -1;
 
     if (ether_type == ETHERTYPE_IP) {
         if (pkt_len < (ssize_t)l2len + TCPR_IPV4_H + hl)
@@ -728,7 +841,7 @@ packet2tree(const u_char *data, int len, int datalink)
 
         /* ftp-data is going to skew our results so we ignore it */
         if (tcp_hdr.th_sport == 20)
-            return (node);
+            return;
 
         /* set TREE->type based on TCP flags */
         if (tcp_hdr.th_flags == TH_SYN) {
@@ -774,7 +887,7 @@ packet2tree(const u_char *data, int len, int datalink)
 
                 dbg(3, "is a dns client");
             }
-            return (node);
+            return;
         default:
             break;
         }
@@ -796,7 +909,7 @@ packet2tree(const u_char *data, int len, int datalink)
                 node->type = DIR_CLIENT;
                 dbg(3, "is a dns client");
             }
-            return (node);
+            return;
         default:
 
             dbgx(3, "unknown UDP protocol: %hu->%hu", udp_hdr.uh_sport, udp_hdr.uh_dport);
@@ -826,10 +939,9 @@ packet2tree(const u_char *data, int len, int datalink)
         }
     }
 
-    return (node);
+    return;
 
 len_error:
-    safe_free(node);
     errx(-1, "packet capture length %d too small to process", len);
 }
 
@@ -870,12 +982,11 @@ tree_printnode(const char *name, const tcpr_tree_t *node)
 static char *
 tree_print(tcpr_data_tree_t *tree_root)
 {
-    tcpr_tree_t *node = NULL;
+    u_int32_t n;
+
     memset(&tree_print_buff, '\0', TREEPRINTBUFFLEN);
-    RB_FOREACH(node, tcpr_data_tree_s, tree_root)
-    {
-        tree_printnode("my node", node);
-    }
+    for (n = 0; n < tree_root->count; n++)
+        tree_printnode("my node", &tree_root->hosts[n]);
     return (tree_print_buff);
 }
 #endif /* DEBUG */
@@ -22,12 +22,10 @@
 
 #include "defines.h"
 #include "tcpr.h"
-#include <lib/tree.h>
 
 #define TREEPRINTBUFFLEN 2048
 
 typedef struct tcpr_tree_s {
-    RB_ENTRY(tcpr_tree_s) node;
     int family;
     union {
         unsigned long ip; /* ip/network address in network byte order */
@@ -40,10 +38,16 @@ typedef struct tcpr_tree_s {
 } tcpr_tree_t;
 
 /*
- * replacement for RB_HEAD() which doesn't actually declare the root
+ * Table of every host seen by auto mode.  Hosts are stored in the order
+ * they were first seen, so their index never changes, and found through
+ * an open addressing hash of those indexes.
  */
 typedef struct tcpr_data_tree_s {
-    tcpr_tree_t *rbh_root;
+    tcpr_tree_t *hosts;
+    u_int32_t count;  /* hosts in use */
+    u_int32_t max;    /* hosts allocated */
+    u_int32_t *slots; /* host index + 1 or 0 for an empty slot */
+    u_int32_t mask;   /* number of slots - 1 */
 } tcpr_data_tree_t;
 
 typedef struct tcpr_buildcidr_s {
@@ -53,12 +57,14 @@ typedef struct tcpr_buildcidr_s {
 
 #define DNS_QUERY_FLAG 0x8000
 
-void add_tree_ipv4(unsigned long, const u_char *, int, int);
-void add_tree_ipv6(const struct tcpr_in6_addr *, const u_char *, int, int);
-void add_tree_first_ipv4(const u_char *, int, int);
-void add_tree_first_ipv6(const u_char *, int, int);
+u_int32_t add_tree_ipv4(tcpr_data_tree_t *, unsigned long, const u_char *, int, int);
+u_int32_t add_tree_ipv6(tcpr_data_tree_t *, const struct tcpr_in6_addr *, const u_char *, int, int);
+u_int32_t add_tree_first_ipv4(tcpr_data_tree_t *, const u_char *, int, int);
+u_int32_t add_tree_first_ipv6(tcpr_data_tree_t *, const u_char *, int, int);
 tcpr_dir_t check_ip_tree(int, unsigned long);
 tcpr_dir_t check_ip6_tree(int, const struct tcpr_in6_addr *);
+tcpr_dir_t check_host_tree(int, u_int32_t);
 int process_tree();
 void tree_calculate(tcpr_data_tree_t *);
-int tree_comp(tcpr_tree_t *, tcpr_tree_t *);
+void tree_merge(tcpr_data_tree_t *, const tcpr_data_tree_t *, int);
+void tree_free(tcpr_data_tree_t *);
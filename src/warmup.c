@@ -0,0 +1,173 @@
+/*
+ *   Copyright (c) 2001-2010 Aaron Turner <aturner at synfin dot net>
+ *   Copyright (c) 2013-2022 Fred Klassen <tcpreplay at appneta dot com> - AppNeta
+ *
+ *   The Tcpreplay Suite of tools is free software: you can redistribute it
+ *   and/or modify it under the terms of the GNU General Public License as
+ *   published by the Free Software Foundation, either version 3 of the
+ *   License, or with the authors permission any later version.
+ *
+ *   The Tcpreplay Suite is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with the Tcpreplay Suite.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/*
+ * Warm-up before the first pass: everything the first loop of a cached
+ * run would otherwise pay for as it goes, page faults in the packet cache
+ * and the TX rings above all, is done up front so a measured run starts
+ * at full speed.
+ */
+
+#include "warmup.h"
+#include "config.h"
+#include "defines.h"
+#include "common.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_NETMAP
+#include <sys/ioctl.h>
+#endif
+
+#include "common/profile.h"
+
+/**
+ * \brief fault in every page of a region, reading so pages shared with the
+ * kernel or a file aren't dirtied
+ */
+static void
+warm_touch(tcpreplay_t *ctx, const void *addr, size_t len)
+{
+    static size_t page;
+    const volatile u_char *p = addr;
+    size_t off;
+
+    if (addr == NULL || len == 0)
+        return;
+
+    if (page == 0) {
+        long ps = sysconf(_SC_PAGESIZE);
+
+        page = ps > 0 ? (size_t)ps : 4096;
+    }
+
+    for (off = 0; off < len; off += page)
+        (void)p[off];
+    (void)p[len - 1];
+
+    ctx->warmup_touched += len;
+}
+
+/**
+ * \brief lock a region of our own memory in RAM, which also faults it in,
+ * or just fault it in if we're not allowed to lock it
+ */
+static void
+warm_lock(tcpreplay_t *ctx, const void *addr, size_t len)
+{
+    if (addr == NULL || len == 0)
+        return;
+
+#ifdef HAVE_MLOCK
+    if (mlock(addr, len) == 0) {
+        ctx->warmup_locked += len;
+        ctx->warmup_touched += len;
+        return;
+    }
+
+    if (ctx->warmup_errno == 0)
+        ctx->warmup_errno = errno;
+#endif
+
+    warm_touch(ctx, addr, len);
+}
+
+static void
+warm_file_cache(tcpreplay_t *ctx, file_cache_t *file_cache)
+{
+    packet_arena_t *arena;
+
+    warm_lock(ctx, file_cache->packet_cache, file_cache->packet_cnt * sizeof(packet_cache_t));
+    for (arena = file_cache->arena; arena != NULL; arena = arena->next)
+        warm_lock(ctx, arena->data, arena->used);
+    if (file_cache->mmap != NULL)
+        warm_lock(ctx, file_cache->mmap->base, file_cache->mmap->size);
+    warm_lock(ctx, file_cache->image, file_cache->image_size);
+    warm_lock(ctx, file_cache->schedule, file_cache->packet_cnt * sizeof(uint64_t));
+    warm_lock(ctx, file_cache->pad_ring, (size_t)file_cache->pad_max * PACKET_PAD_SLOTS);
+}
+
+static void
+warm_interface(tcpreplay_t *ctx, sendpacket_t *sp)
+{
+    if (sp == NULL)
+        return;
+
+#if defined HAVE_PF_PACKET && defined HAVE_TX_RING
+    if (sp->tx_ring != NULL)
+        warm_touch(ctx, sp->tx_ring->tx_head, sp->tx_ring->tx_size);
+#endif
+#ifdef HAVE_AF_XDP
+    if (sp->xdp != NULL)
+        warm_lock(ctx, sp->xdp->umem, sp->xdp->umem_size);
+#endif
+#ifdef HAVE_NETMAP
+    if (sp->handle_type == SP_TYPE_NETMAP) {
+        warm_touch(ctx, sp->mmap_addr, (size_t)sp->mmap_size);
+        /* the wake-up the first packet would otherwise trigger */
+        ioctl(sp->handle.fd, NIOCTXSYNC, NULL);
+        sp->first_packet = false;
+    }
+#endif
+}
+
+/**
+ * \brief do the warm-up, see tcpreplay_warmup()
+ *
+ * Returns 1 with a warning set if the memory could not be locked.
+ */
+int
+warmup_run(tcpreplay_t *ctx)
+{
+    tcpreplay_opt_t *options = ctx->options;
+    int i;
+
+    ctx->warmup_locked = 0;
+    ctx->warmup_touched = 0;
+    ctx->warmup_errno = 0;
+
+    if (options->preload_pcap && !options->preload_stream) {
+        for (i = 0; i < options->source_cnt; i++) {
+            if (options->file_cache[i].cached)
+                warm_file_cache(ctx, &options->file_cache[i]);
+        }
+    }
+
+    warm_interface(ctx, ctx->intf1);
+    warm_interface(ctx, ctx->intf2);
+    for (i = 0; i < options->pair_intf_cnt; i++)
+        warm_interface(ctx, ctx->pair_intf[i]);
+
+    tcpr_clock_init();
+    if (options->profile)
+        tcpr_prof_calibrate();
+
+    if (ctx->warmup_errno != 0) {
+        tcpreplay_setwarn(ctx, "Unable to lock the packet cache in memory: %s%s",
+                strerror(ctx->warmup_errno),
+                ctx->warmup_errno == ENOMEM || ctx->warmup_errno == EPERM ? " (see ulimit -l)" : "");
+        return 1;
+    }
+
+    return 0;
+}